@@ -0,0 +1,11 @@
+#version 140
+
+flat in vec4 vs_color;
+in float vs_distance;
+flat in float vs_half_width;
+
+void main() {
+    // Fade out over the outermost pixel
+    float coverage = clamp(vs_half_width - abs(vs_distance), 0.0f, 1.0f);
+    gl_FragColor = vec4(vs_color.rgb, vs_color.a * coverage);
+}
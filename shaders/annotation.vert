@@ -0,0 +1,57 @@
+#version 140
+
+// Annotation outlines, drawn as screen-space quads (6 vertices per segment, no vertex attributes).
+// The geometry is stored once in world coordinates (micrometers), in texture buffers:
+// segments = (x0, y0, x1, y1); segment_annotations = the annotation each segment belongs to;
+// annotation_attributes = (r, g, b, selected) per annotation.
+
+flat out vec4 vs_color;
+out float vs_distance; // across the line, in pixels from the center
+flat out float vs_half_width;
+
+uniform samplerBuffer segments;
+uniform isamplerBuffer segment_annotations;
+uniform samplerBuffer annotation_attributes;
+uniform vec2 camera_min;
+uniform float um_per_pixel;
+uniform vec2 viewport_offset;
+uniform vec2 screen_size;
+uniform float thickness;
+
+void main() {
+    int segment_index = gl_VertexID / 6;
+    int corner = gl_VertexID % 6;
+    vec4 segment = texelFetch(segments, segment_index);
+    int annotation_index = texelFetch(segment_annotations, segment_index).r;
+    vec4 attributes = texelFetch(annotation_attributes, annotation_index);
+
+    vec3 color = attributes.rgb;
+    float width = thickness;
+    if (attributes.a > 0.5f) {
+        // selected: lighter and thicker
+        color = mix(color, vec3(1.0f), 0.2f);
+        width *= 2.0f;
+    }
+    float half_width = 0.5f * width + 0.5f; // half a pixel extra for the antialiased edges
+
+    vec2 p0 = (segment.xy - camera_min) / um_per_pixel + viewport_offset;
+    vec2 p1 = (segment.zw - camera_min) / um_per_pixel + viewport_offset;
+    vec2 delta = p1 - p0;
+    float len = length(delta);
+    vec2 dir = (len > 0.0001f) ? delta / len : vec2(1.0f, 0.0f);
+    vec2 normal = vec2(-dir.y, dir.x);
+
+    // Two triangles: (start, -), (end, -), (start, +) and (start, +), (end, -), (end, +).
+    // The ends are extended by half the width, so that the segments of an outline join without gaps,
+    // and so that a segment of zero length still shows up as a dot.
+    bool is_end = (corner == 1 || corner == 4 || corner == 5);
+    float side = (corner == 2 || corner == 3 || corner == 5) ? 1.0f : -1.0f;
+    vec2 pos = is_end ? p1 + dir * half_width : p0 - dir * half_width;
+    pos += normal * side * half_width;
+
+    vec2 ndc = vec2(pos.x / screen_size.x * 2.0f - 1.0f, 1.0f - pos.y / screen_size.y * 2.0f);
+    gl_Position = vec4(ndc, 0.0f, 1.0f);
+    vs_color = vec4(color, 1.0f);
+    vs_distance = side * half_width;
+    vs_half_width = half_width;
+}
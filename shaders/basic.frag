@@ -5,16 +5,31 @@ in vec2 vs_tex_coord;
 
 
 uniform vec3 bg_color;
-uniform sampler2D the_texture;
-uniform float black_level;
-uniform float white_level;
+uniform sampler2DArray the_texture;
+uniform float layer;
+uniform sampler3D color_lut; // the image adjustments and display color correction, see update_color_lut()
+uniform bool apply_color_lut;
+uniform bool show_single_stain; // see get_stain_unmixing()
+uniform vec3 stain_unmixing;
+uniform vec3 stain_vector;
 
 void main() {
-    vec4 the_texture_rgba = texture(the_texture, vs_tex_coord);
+    vec4 the_texture_rgba = texture(the_texture, vec3(vs_tex_coord, layer));
 
     float opacity = the_texture_rgba.a;
     vec3 color = the_texture_rgba.rgb;
-    color = (color - black_level) * (1.0f / (white_level - black_level));
+    if (show_single_stain) {
+        // Color deconvolution: the optical density is unmixed into the amount of the shown stain, which is then
+        // rebuilt without the other stains
+        vec3 optical_density = -log(max(color, vec3(1.0f / 255.0f)));
+        float stain_amount = max(0.0f, dot(stain_unmixing, optical_density));
+        color = exp(-stain_amount * stain_vector);
+    }
+    if (apply_color_lut) {
+        // (the outermost grid points of the lookup table are at the texel centers)
+        vec3 lut_size = vec3(textureSize(color_lut, 0));
+        color = texture(color_lut, color * ((lut_size - 1.0f) / lut_size) + 0.5f / lut_size).rgb;
+    }
 
     gl_FragColor = vec4(opacity * color + (1.0f-opacity) * bg_color, opacity);
 }
@@ -0,0 +1,104 @@
+#version 140
+
+
+in vec2 vs_tex_coord;
+flat in float vs_layer;
+flat in float vs_is_flat;
+flat in vec4 vs_flat_color;
+flat in float vs_alpha; // less than 1 while a level is blended in or out (blending is enabled for those tiles only)
+flat in vec2 vs_valid_max; // beyond this, the tile is outside of the image (see push_tile_instance())
+
+
+uniform vec3 bg_color;
+uniform sampler2DArray the_texture;
+uniform sampler3D color_lut; // the image adjustments and display color correction, see update_color_lut()
+uniform bool show_single_stain; // see get_stain_unmixing()
+uniform vec3 stain_unmixing;
+uniform vec3 stain_vector;
+uniform bool is_planar; // the texture holds YCbCr 4:2:0 planes (see TILE_TEXTURE_FORMAT_YCBCR420)
+uniform bool is_channel; // a channel of a fluorescence image, added to the other channels (see channel_view_t)
+uniform vec3 channel_color;
+uniform float channel_gain;
+uniform float channel_offset;
+uniform bool is_overlay; // an overlay, e.g. a heatmap: the values are colored and blended over the image
+uniform int overlay_colormap; // see overlay_colormap_enum
+uniform float overlay_opacity;
+
+// The layout of a planar tile is a single channel image of dim x (1.5 * dim): the Y plane on top, with the Cb and
+// Cr planes side by side below it. The chroma is upsampled by repeating each sample (the texture is sampled NEAREST).
+vec4 sample_planar_tile(vec2 uv, float layer) {
+    float dim = float(textureSize(the_texture, 0).x);
+    uv = clamp(uv, vec2(0.5f / dim), vec2(1.0f - 0.5f / dim)); // don't let Y run into the chroma planes
+    float y = texture(the_texture, vec3(uv.x, uv.y * (2.0f / 3.0f), layer)).r;
+    float chroma_v = (2.0f + uv.y) / 3.0f;
+    float cb = texture(the_texture, vec3(uv.x * 0.5f, chroma_v, layer)).r - 128.0f / 255.0f;
+    float cr = texture(the_texture, vec3(0.5f + uv.x * 0.5f, chroma_v, layer)).r - 128.0f / 255.0f;
+    // Full range YCbCr (JFIF), like libjpeg converts it
+    vec3 rgb = vec3(y + 1.402f * cr, y - 0.344136f * cb - 0.714136f * cr, y + 1.772f * cb);
+    return vec4(clamp(rgb, 0.0f, 1.0f), 1.0f);
+}
+
+// Returns the color of the value, with the opacity: zero (no data) is transparent.
+vec4 apply_overlay_colormap(float value) {
+    vec3 color;
+    float opacity = (value > 0.5f / 255.0f) ? overlay_opacity : 0.0f;
+    if (overlay_colormap == 0) {
+        // Jet
+        color = clamp(vec3(1.5f) - abs(vec3(4.0f * value) - vec3(3.0f, 2.0f, 1.0f)), 0.0f, 1.0f);
+    } else if (overlay_colormap == 1) {
+        // Viridis, as a polynomial fit
+        const vec3 c0 = vec3(0.2777273272234177f, 0.005407344544966578f, 0.3340998053353061f);
+        const vec3 c1 = vec3(0.1050930431085774f, 1.404613529898575f, 1.384590162594685f);
+        const vec3 c2 = vec3(-0.3308618287255563f, 0.214847559468213f, 0.09509516302823659f);
+        const vec3 c3 = vec3(-4.634230498983486f, -5.799100973351585f, -19.33244095627987f);
+        const vec3 c4 = vec3(6.228269936347081f, 14.17993336680509f, 56.69055260068105f);
+        const vec3 c5 = vec3(4.776384997670288f, -13.74514537774601f, -65.35303263337234f);
+        const vec3 c6 = vec3(-5.435455855934631f, 4.645852612178535f, 26.3124352495832f);
+        color = clamp(c0 + value * (c1 + value * (c2 + value * (c3 + value * (c4 + value * (c5 + value * c6))))), 0.0f, 1.0f);
+    } else {
+        // Red, more opaque for higher values
+        color = vec3(1.0f, 0.0f, 0.0f);
+        opacity = overlay_opacity * value;
+    }
+    return vec4(color, opacity);
+}
+
+// The part of the pixel that lies within the image: the tiles at the edges of the image are clipped here, with the edge
+// anti-aliased over one pixel.
+float get_coverage() {
+    vec2 pixels_inside = (vs_valid_max - vs_tex_coord) / max(fwidth(vs_tex_coord), vec2(1e-6f));
+    return clamp(min(pixels_inside.x, pixels_inside.y) + 0.5f, 0.0f, 1.0f);
+}
+
+void main() {
+    float coverage = get_coverage(); // (the derivatives need uniform control flow, as does the texture lookup)
+    // (the texture is also sampled for flat tiles, so that the texture lookup stays in uniform control flow)
+    vec4 texel = is_planar ? sample_planar_tile(vs_tex_coord, vs_layer) : texture(the_texture, vec3(vs_tex_coord, vs_layer));
+    vec4 the_texture_rgba = mix(texel, vs_flat_color, vs_is_flat);
+    if (is_channel) {
+        // (the texture is single channel, and flat tiles of a channel are gray)
+        float intensity = clamp(the_texture_rgba.r * channel_gain + channel_offset, 0.0f, 1.0f);
+        gl_FragColor = vec4(coverage * intensity * channel_color, 1.0f);
+        return;
+    } else if (is_overlay) {
+        vec4 overlay = apply_overlay_colormap(the_texture_rgba.r);
+        gl_FragColor = vec4(overlay.rgb, overlay.a * coverage);
+        return;
+    }
+
+    // (outside of the image, the background shows through, as for transparent pixels)
+    float opacity = the_texture_rgba.a * coverage;
+    vec3 color = the_texture_rgba.rgb;
+    if (show_single_stain) {
+        // Color deconvolution: the optical density is unmixed into the amount of the shown stain, which is then
+        // rebuilt without the other stains
+        vec3 optical_density = -log(max(color, vec3(1.0f / 255.0f)));
+        float stain_amount = max(0.0f, dot(stain_unmixing, optical_density));
+        color = exp(-stain_amount * stain_vector);
+    }
+    // (the outermost grid points of the lookup table are at the texel centers)
+    vec3 lut_size = vec3(textureSize(color_lut, 0));
+    color = texture(color_lut, color * ((lut_size - 1.0f) / lut_size) + 0.5f / lut_size).rgb;
+
+    gl_FragColor = vec4(opacity * color + (1.0f-opacity) * bg_color, opacity * vs_alpha);
+}
@@ -0,0 +1,44 @@
+#version 140
+
+in vec3 pos;
+in vec2 tex_coord;
+
+out vec2 vs_tex_coord;
+flat out float vs_layer;
+flat out float vs_is_flat;
+flat out vec4 vs_flat_color;
+flat out float vs_alpha;
+flat out vec2 vs_valid_max;
+
+uniform mat4 projection_view_matrix;
+
+// Per-instance data for a batch of tiles, indexed by gl_InstanceID.
+// rect = (x, y, width, height) in screen coordinates; params = (texture layer, depth, is flat, alpha)
+// tex_rect = the part of the tile that is drawn (x, y, width, height), less than the whole tile at the viewport edges;
+// for flat tiles (which are drawn in a single color instead of from a texture) the color (r, g, b, a)
+// valid_max = (x, y) where the part of the tile within the image ends, in the texture coordinates of tile.frag
+layout(std140) uniform tile_instances {
+    vec4 instance_rects[256];
+    vec4 instance_params[256];
+    vec4 instance_tex_rects[256];
+    vec4 instance_valid_maxes[256];
+};
+
+void main() {
+    vec4 rect = instance_rects[gl_InstanceID];
+    vec4 params = instance_params[gl_InstanceID];
+    vec3 world_pos = vec3(rect.xy + pos.xy * rect.zw, params.y);
+    gl_Position = projection_view_matrix * vec4(world_pos, 1.0f);
+    vec4 tex_rect = instance_tex_rects[gl_InstanceID];
+    vs_is_flat = params.z;
+    if (params.z > 0.5f) {
+        vs_tex_coord = tex_coord;
+        vs_flat_color = tex_rect;
+    } else {
+        vs_tex_coord = tex_rect.xy + tex_coord * tex_rect.zw;
+        vs_flat_color = vec4(0.0f);
+    }
+    vs_layer = params.x;
+    vs_alpha = params.w;
+    vs_valid_max = instance_valid_maxes[gl_InstanceID].xy;
+}
@@ -22,6 +22,10 @@
 #include "platform.h"
 #include "gui.h"
 #include "yxml.h"
+#include "intrinsics.h"
+#include "win32_main.h"
+#include "annotation_sidecar.h"
+#include "stringutils.h"
 
 #include <math.h>
 
@@ -33,22 +37,283 @@
 // https://dev.yorhel.nl/yxml/man
 #define YXML_STACK_BUFFER_SIZE KILOBYTES(32)
 
+#define ASAP_XML_MAX_TRACKED_DEPTH 64
+
+// The groups are usually defined at the end of the file, after the annotations that refer to them. While parsing,
+// annotation_t.group_id is an index into group_refs; the real groups are assigned once the whole file is read.
 typedef struct asap_xml_parse_state_t {
 	annotation_group_t current_group;
 	asap_xml_element_enum element_type;
+	asap_xml_element_enum element_stack[ASAP_XML_MAX_TRACKED_DEPTH];
+	i32 depth;
+	annotation_group_t* defined_groups; // sb, in the order of the <Group> elements
+	annotation_group_t* group_refs; // sb, in the order in which the groups are first referred to
+	i32 last_group_ref;
 } asap_xml_parse_state_t;
 
-asap_xml_parse_state_t global_parse_state;
+#define ANNOTATION_INDEX_LEAF_SIZE 8
 
-void draw_annotations(annotation_set_t* annotation_set, v2f camera_min, float screen_um_per_pixel) {
-	if (!annotation_set->enabled) return;
+static void destroy_annotation_index(annotation_index_t* index) {
+	if (index->segments) sb_free(index->segments);
+	if (index->nodes) sb_free(index->nodes);
+	memset(index, 0, sizeof(*index));
+}
+
+// Sets the bounds of the node, and splits it in two at the middle of its longest side (by segment center), until the
+// leaves are small enough. Note: the nodes are referred to by index, because pushing new nodes may move them.
+static void build_annotation_index_node(annotation_index_t* index, i32 node_index, i32 first, i32 count) {
+	annotation_segment_t* segments = index->segments;
+	v2f min = segments[first].p0;
+	v2f max = min;
+	for (i32 i = first; i < first + count; ++i) {
+		annotation_segment_t* segment = segments + i;
+		min.x = ATMOST(min.x, ATMOST(segment->p0.x, segment->p1.x));
+		min.y = ATMOST(min.y, ATMOST(segment->p0.y, segment->p1.y));
+		max.x = ATLEAST(max.x, ATLEAST(segment->p0.x, segment->p1.x));
+		max.y = ATLEAST(max.y, ATLEAST(segment->p0.y, segment->p1.y));
+	}
+	index->nodes[node_index].min = min;
+	index->nodes[node_index].max = max;
+	if (count <= ANNOTATION_INDEX_LEAF_SIZE) {
+		index->nodes[node_index].first = first;
+		index->nodes[node_index].count = count;
+		return;
+	}
+
+	bool32 split_x = (max.x - min.x) >= (max.y - min.y);
+	float split = split_x ? (min.x + max.x) * 0.5f : (min.y + max.y) * 0.5f;
+	i32 i = first;
+	i32 j = first + count - 1;
+	while (i <= j) {
+		annotation_segment_t* segment = segments + i;
+		float center = split_x ? (segment->p0.x + segment->p1.x) * 0.5f : (segment->p0.y + segment->p1.y) * 0.5f;
+		if (center < split) {
+			++i;
+		} else {
+			annotation_segment_t temp = segments[i];
+			segments[i] = segments[j];
+			segments[j] = temp;
+			--j;
+		}
+	}
+	i32 left_count = i - first;
+	if (left_count == 0 || left_count == count) {
+		left_count = count / 2; // all segment centers are in the same place
+	}
+
+	i32 child_index = sb_count(index->nodes);
+	annotation_index_node_t empty_node = {};
+	sb_push(index->nodes, empty_node);
+	sb_push(index->nodes, empty_node);
+	index->nodes[node_index].first = child_index;
+	index->nodes[node_index].count = 0;
+	build_annotation_index_node(index, child_index, first, left_count);
+	build_annotation_index_node(index, child_index + 1, first + left_count, count - left_count);
+}
+
+// Needs to be called once all annotations are loaded. Deleting annotations keeps the index up to date by itself
+// (see delete_selected_annotations() and compact_annotations()).
+void build_annotation_index(annotation_set_t* annotation_set) {
+	annotation_index_t* index = &annotation_set->index;
+	destroy_annotation_index(index);
+	for (i32 annotation_index = 0; annotation_index < annotation_set->annotation_count; ++annotation_index) {
+		annotation_t* annotation = annotation_set->annotations + annotation_index;
+		if (!annotation->has_coordinates || annotation->deleted) continue;
+		i32 count = annotation->coordinate_count;
+		float* x = annotation_set->coordinate_x + annotation->first_coordinate;
+		float* y = annotation_set->coordinate_y + annotation->first_coordinate;
+		// A single coordinate becomes a segment of zero length; two coordinates are a single line, not a polygon.
+		i32 segment_count = (count <= 2) ? 1 : count;
+		for (i32 i = 0; i < segment_count; ++i) {
+			i32 next = (i + 1) % count;
+			annotation_segment_t segment = {};
+			segment.p0.x = x[i];
+			segment.p0.y = y[i];
+			segment.p1.x = x[next];
+			segment.p1.y = y[next];
+			segment.annotation_index = annotation_index;
+			sb_push(index->segments, segment);
+		}
+	}
+	i32 segment_count = sb_count(index->segments);
+	if (segment_count > 0) {
+		annotation_index_node_t root = {};
+		sb_push(index->nodes, root);
+		build_annotation_index_node(index, 0, 0, segment_count);
+	}
+}
+
+static float sq_distance_to_box(v2f p, v2f min, v2f max) {
+	float dx = ATLEAST(0.0f, ATLEAST(min.x - p.x, p.x - max.x));
+	float dy = ATLEAST(0.0f, ATLEAST(min.y - p.y, p.y - max.y));
+	return SQUARE(dx) + SQUARE(dy);
+}
+
+static float sq_distance_to_segment(v2f p, v2f a, v2f b) {
+	float ab_x = b.x - a.x;
+	float ab_y = b.y - a.y;
+	float sq_length = SQUARE(ab_x) + SQUARE(ab_y);
+	float t = 0.0f;
+	if (sq_length > 0.0f) {
+		t = ((p.x - a.x) * ab_x + (p.y - a.y) * ab_y) / sq_length;
+		t = CLAMP(t, 0.0f, 1.0f);
+	}
+	float dx = p.x - (a.x + t * ab_x);
+	float dy = p.y - (a.y + t * ab_y);
+	return SQUARE(dx) + SQUARE(dy);
+}
+
+// Returns the annotation with the outline closest to the point (or -1 if there are no annotations).
+// Only the nodes of the index that might contain a closer segment than the closest one found so far are visited.
+i32 find_nearest_annotation(annotation_set_t* annotation_set, float x, float y, float* distance_ptr) {
+	annotation_index_t* index = &annotation_set->index;
+	if (!index->nodes) {
+		return -1;
+	}
+	v2f p = {x, y};
+	i32 result = -1;
+	float shortest_sq_distance = 1e30f;
+	i32* stack = NULL; // sb
+	sb_push(stack, 0);
+	while (sb_count(stack) > 0) {
+		annotation_index_node_t* node = index->nodes + sb_last(stack);
+		--sb_raw_count(stack);
+		if (sq_distance_to_box(p, node->min, node->max) >= shortest_sq_distance) {
+			continue;
+		}
+		if (node->count > 0) {
+			for (i32 i = node->first; i < node->first + node->count; ++i) {
+				annotation_segment_t* segment = index->segments + i;
+				if (segment->annotation_index < 0) continue; // deleted
+				if (annotation_set->annotations[segment->annotation_index].deleted) continue;
+				float sq_distance = sq_distance_to_segment(p, segment->p0, segment->p1);
+				if (sq_distance < shortest_sq_distance) {
+					shortest_sq_distance = sq_distance;
+					result = segment->annotation_index;
+				}
+			}
+		} else {
+			// Visit the nearest child first (it is pushed last), so that the other one can more often be skipped.
+			annotation_index_node_t* left = index->nodes + node->first;
+			annotation_index_node_t* right = left + 1;
+			if (sq_distance_to_box(p, left->min, left->max) < sq_distance_to_box(p, right->min, right->max)) {
+				sb_push(stack, node->first + 1);
+				sb_push(stack, node->first);
+			} else {
+				sb_push(stack, node->first);
+				sb_push(stack, node->first + 1);
+			}
+		}
+	}
+	sb_free(stack);
+	if (result >= 0 && distance_ptr) {
+		*distance_ptr = sqrtf(shortest_sq_distance);
+	}
+	return result;
+}
+
+static v2f* annotation_screen_points; // sb, reused every frame
+static i32* annotation_draw_firsts; // sb, reused every frame
+static i32* annotation_draw_counts; // sb, reused every frame
+
+#define ANNOTATION_LINE_THICKNESS 2.0f
+
+// Returns the coarsest simplified outline that differs less than a pixel from the real one (-1 = full detail).
+static i32 choose_annotation_lod(float screen_um_per_pixel) {
+	i32 lod = -1;
+	while (lod + 1 < ANNOTATION_LOD_COUNT && ANNOTATION_LOD_BASE_TOLERANCE * (float)(1 << (lod + 1)) <= screen_um_per_pixel) {
+		++lod;
+	}
+	return lod;
+}
+
+static bool32 is_annotation_in_view(annotation_t* annotation, v2f camera_min, v2f camera_max, float screen_um_per_pixel) {
+	// Leave some margin for the line thickness
+	float margin = 4.0f * screen_um_per_pixel;
+	return !(annotation->bounds_max.x < camera_min.x - margin || annotation->bounds_min.x > camera_max.x + margin ||
+	         annotation->bounds_max.y < camera_min.y - margin || annotation->bounds_min.y > camera_max.y + margin);
+}
+
+static bool32 is_annotation_smaller_than_a_pixel(annotation_t* annotation, float screen_um_per_pixel) {
+	float width_in_pixels = (annotation->bounds_max.x - annotation->bounds_min.x) / screen_um_per_pixel;
+	float height_in_pixels = (annotation->bounds_max.y - annotation->bounds_min.y) / screen_um_per_pixel;
+	return (width_in_pixels < 1.0f && height_in_pixels < 1.0f);
+}
+
+// The segments on the GPU are laid out like the points they start at: first one for each coordinate (full detail),
+// followed by one for each point in annotation_set_t.lod_points. Each outline is closed, so the last segment of an
+// annotation goes back to its first point.
+static void upload_annotation_geometry(annotation_set_t* annotation_set) {
+	i32 segment_count = annotation_set->coordinate_count + sb_count(annotation_set->lod_points);
+	v4f* segments = (v4f*) calloc(ATLEAST(1, segment_count), sizeof(v4f));
+	i32* annotation_indices = (i32*) calloc(ATLEAST(1, segment_count), sizeof(i32));
 	for (i32 annotation_index = 0; annotation_index < annotation_set->annotation_count; ++annotation_index) {
 		annotation_t* annotation = annotation_set->annotations + annotation_index;
+		if (!annotation->has_coordinates) continue;
+		i32 count = annotation->coordinate_count;
+		float* x = annotation_set->coordinate_x + annotation->first_coordinate;
+		float* y = annotation_set->coordinate_y + annotation->first_coordinate;
+		for (i32 i = 0; i < count; ++i) {
+			i32 next = (i + 1) % count;
+			v4f* segment = segments + annotation->first_coordinate + i;
+			segment->x = x[i];
+			segment->y = y[i];
+			segment->z = x[next];
+			segment->w = y[next];
+			annotation_indices[annotation->first_coordinate + i] = annotation_index;
+		}
+		for (i32 lod = 0; lod < ANNOTATION_LOD_COUNT; ++lod) {
+			i32 point_count = annotation->lod_point_count[lod];
+			v2f* points = annotation_set->lod_points + annotation->lod_first_point[lod];
+			i32 first_segment = annotation_set->coordinate_count + annotation->lod_first_point[lod];
+			for (i32 i = 0; i < point_count; ++i) {
+				v2f p0 = points[i];
+				v2f p1 = points[(i + 1) % point_count];
+				v4f* segment = segments + first_segment + i;
+				segment->x = p0.x;
+				segment->y = p0.y;
+				segment->z = p1.x;
+				segment->w = p1.y;
+				annotation_indices[first_segment + i] = annotation_index;
+			}
+		}
+	}
+	annotation_set->is_geometry_on_gpu = upload_annotation_segments(segments, annotation_indices, segment_count);
+	free(segments);
+	free(annotation_indices);
+}
+
+static void upload_annotation_set_attributes(annotation_set_t* annotation_set) {
+	rgba_t* attributes = (rgba_t*) calloc(ATLEAST(1, annotation_set->annotation_count), sizeof(rgba_t));
+	for (i32 annotation_index = 0; annotation_index < annotation_set->annotation_count; ++annotation_index) {
+		annotation_t* annotation = annotation_set->annotations + annotation_index;
+		rgba_t rgba = annotation_set->groups[annotation->group_id].color;
+		rgba.a = annotation->selected ? 255 : 0;
+		attributes[annotation_index] = rgba;
+	}
+	upload_annotation_attributes(attributes, annotation_set->annotation_count);
+	free(attributes);
+}
+
+// Fallback for when the segments don't fit on the GPU: the outlines are transformed on the CPU, and drawn by ImGui.
+static void draw_annotations_with_imgui(annotation_set_t* annotation_set, v2f camera_min, float screen_um_per_pixel, rect2i viewport) {
+	// Draw the annotations in the background list (behind UI elements), cut off at the edges of the scene
+	ImDrawList* draw_list = ImGui::GetBackgroundDrawList();
+	draw_list->PushClipRect(ImVec2((float)viewport.x, (float)viewport.y),
+	                        ImVec2((float)(viewport.x + viewport.w), (float)(viewport.y + viewport.h)), true);
+
+	v2f camera_max = { camera_min.x + viewport.w * screen_um_per_pixel, camera_min.y + viewport.h * screen_um_per_pixel };
+	i32 lod = choose_annotation_lod(screen_um_per_pixel);
+
+	for (i32 annotation_index = 0; annotation_index < annotation_set->annotation_count; ++annotation_index) {
+		annotation_t* annotation = annotation_set->annotations + annotation_index;
+		if (!annotation->has_coordinates || annotation->deleted) continue;
+		if (!is_annotation_in_view(annotation, camera_min, camera_max, screen_um_per_pixel)) continue;
 		annotation_group_t* group = annotation_set->groups + annotation->group_id;
 //		rgba_t rgba = {50, 50, 0, 255 };
 		rgba_t rgba = group->color;
 		rgba.a = 255;
-		float thickness = 2.0f;
+		float thickness = ANNOTATION_LINE_THICKNESS;
 		if (annotation->selected) {
 			rgba.r = LERP(0.2f, rgba.r, 255);
 			rgba.g = LERP(0.2f, rgba.g, 255);
@@ -56,80 +321,347 @@ void draw_annotations(annotation_set_t* annotation_set, v2f camera_min, float sc
 			thickness *= 2.0f;
 		}
 		u32 color = *(u32*)(&rgba);
-		if (annotation->has_coordinates) {
-			// TODO: don't abuse the stack here
-			v2f* points = (v2f*) alloca(sizeof(v2f) * annotation->coordinate_count);
+
+		if (is_annotation_smaller_than_a_pixel(annotation, screen_um_per_pixel)) {
+			v2f world_center = { (annotation->bounds_min.x + annotation->bounds_max.x) * 0.5f,
+			                     (annotation->bounds_min.y + annotation->bounds_max.y) * 0.5f };
+			v2f center = world_pos_to_screen_pos(world_center, camera_min, screen_um_per_pixel);
+			center.x += viewport.x;
+			center.y += viewport.y;
+			float half_size = thickness * 0.5f;
+			draw_list->AddRectFilled(ImVec2(center.x - half_size, center.y - half_size),
+			                         ImVec2(center.x + half_size, center.y + half_size), color);
+			continue;
+		}
+
+		if (annotation_screen_points) {
+			sb_raw_count(annotation_screen_points) = 0;
+		}
+		if (lod < 0) {
 			for (i32 i = 0; i < annotation->coordinate_count; ++i) {
-				coordinate_t* coordinate = annotation_set->coordinates + annotation->first_coordinate + i;
-				v2f world_pos = {(float)coordinate->x, (float)coordinate->y};
+				i32 coordinate_index = annotation->first_coordinate + i;
+				v2f world_pos = {annotation_set->coordinate_x[coordinate_index], annotation_set->coordinate_y[coordinate_index]};
 				v2f transformed_pos = world_pos_to_screen_pos(world_pos, camera_min, screen_um_per_pixel);
-				points[i] = transformed_pos;
+				transformed_pos.x += viewport.x;
+				transformed_pos.y += viewport.y;
+				sb_push(annotation_screen_points, transformed_pos);
+			}
+		} else {
+			v2f* lod_points = annotation_set->lod_points + annotation->lod_first_point[lod];
+			for (i32 i = 0; i < annotation->lod_point_count[lod]; ++i) {
+				v2f transformed_pos = world_pos_to_screen_pos(lod_points[i], camera_min, screen_um_per_pixel);
+				transformed_pos.x += viewport.x;
+				transformed_pos.y += viewport.y;
+				sb_push(annotation_screen_points, transformed_pos);
 			}
-			// Draw the annotation in the background list (behind UI elements), as a thick colored line
-			ImDrawList* draw_list = ImGui::GetBackgroundDrawList();
-			draw_list->AddPolyline((ImVec2*)points, annotation->coordinate_count, color, true, thickness);
 		}
+		// Draw the annotation as a thick colored line
+		draw_list->AddPolyline((ImVec2*)annotation_screen_points, sb_count(annotation_screen_points), color, true, thickness);
 	}
+	draw_list->PopClipRect();
 }
 
-i32 find_nearest_annotation(annotation_set_t* annotation_set, float x, float y, float* distance_ptr) {
-	i32 result = -1;
-	float shortest_sq_distance = 1e50;
-	// TODO: use bounding boxes and subdivide line segments with far apart coordinates
+// Only the annotations that are (partly) in view are drawn. When zoomed out, the outlines are replaced by simplified
+// versions that differ less than a pixel, and annotations smaller than a pixel are drawn as a dot.
+// The geometry lives on the GPU; per frame, only the ranges of segments to draw are determined here.
+// Note: draws directly with OpenGL, so needs to be called after the tiles have been drawn.
+void draw_annotations(annotation_set_t* annotation_set, v2f camera_min, float screen_um_per_pixel, rect2i viewport,
+                      rect2i client_viewport) {
+	if (!annotation_set->enabled) return;
+	if (annotation_set->needs_geometry_upload) {
+		upload_annotation_geometry(annotation_set);
+		annotation_set->needs_geometry_upload = false;
+		annotation_set->needs_attribute_upload = true;
+	}
+	if (!annotation_set->is_geometry_on_gpu) {
+		draw_annotations_with_imgui(annotation_set, camera_min, screen_um_per_pixel, viewport);
+		return;
+	}
+	if (annotation_set->needs_attribute_upload) {
+		upload_annotation_set_attributes(annotation_set);
+		annotation_set->needs_attribute_upload = false;
+	}
+
+	v2f camera_max = { camera_min.x + viewport.w * screen_um_per_pixel, camera_min.y + viewport.h * screen_um_per_pixel };
+	i32 lod = choose_annotation_lod(screen_um_per_pixel);
+
+	if (annotation_draw_firsts) sb_raw_count(annotation_draw_firsts) = 0;
+	if (annotation_draw_counts) sb_raw_count(annotation_draw_counts) = 0;
 	for (i32 annotation_index = 0; annotation_index < annotation_set->annotation_count; ++annotation_index) {
 		annotation_t* annotation = annotation_set->annotations + annotation_index;
-		if (annotation->has_coordinates) {
-			for (i32 i = 0; i < annotation->coordinate_count; ++i) {
-				coordinate_t* coordinate = annotation_set->coordinates + annotation->first_coordinate + i;
-				float delta_x = x - (float)coordinate->x;
-				float delta_y = y - (float)coordinate->y;
-				float sq_distance = SQUARE(delta_x) + SQUARE(delta_y);
-				if (sq_distance < shortest_sq_distance) {
-					shortest_sq_distance = sq_distance;
-					if (distance_ptr) {
-						*distance_ptr = sqrtf(shortest_sq_distance);
-					}
-					result = annotation_index;
+		if (!annotation->has_coordinates || annotation->deleted) continue;
+		if (!is_annotation_in_view(annotation, camera_min, camera_max, screen_um_per_pixel)) continue;
+		i32 first_segment, segment_count;
+		if (lod < 0) {
+			first_segment = annotation->first_coordinate;
+			segment_count = annotation->coordinate_count;
+		} else {
+			first_segment = annotation_set->coordinate_count + annotation->lod_first_point[lod];
+			segment_count = annotation->lod_point_count[lod];
+		}
+		if (is_annotation_smaller_than_a_pixel(annotation, screen_um_per_pixel)) {
+			segment_count = 1; // a segment is drawn with square ends, so this is enough for a dot
+		}
+		sb_push(annotation_draw_firsts, first_segment);
+		sb_push(annotation_draw_counts, segment_count);
+	}
+	draw_annotation_segments(annotation_draw_firsts, annotation_draw_counts, sb_count(annotation_draw_firsts), camera_min,
+	                         screen_um_per_pixel, ANNOTATION_LINE_THICKNESS, viewport, client_viewport);
+}
+
+// Douglas-Peucker simplification, done once for all tolerances: each coordinate gets the largest tolerance for which
+// it would still be kept. Capping this at the value of the coordinate that split the range gives exactly the result
+// of running the algorithm separately for each tolerance.
+static void compute_douglas_peucker_importance(v2f* points, i32 point_count, float* importance) {
+	typedef struct { i32 begin; i32 end; float cap; } dp_range_t;
+	dp_range_t* stack = NULL; // sb
+	for (i32 i = 0; i < point_count; ++i) {
+		importance[i] = 0.0f;
+	}
+	// Closed outline: start with the first coordinate and the coordinate farthest away from it.
+	// The outline is handled as points[0..point_count], where the last point wraps around to points[0].
+	i32 farthest = 0;
+	float farthest_sq_distance = -1.0f;
+	for (i32 i = 1; i < point_count; ++i) {
+		float sq_distance = SQUARE(points[i].x - points[0].x) + SQUARE(points[i].y - points[0].y);
+		if (sq_distance > farthest_sq_distance) {
+			farthest_sq_distance = sq_distance;
+			farthest = i;
+		}
+	}
+	importance[0] = 1e30f;
+	importance[farthest] = 1e30f;
+	dp_range_t first_half = { 0, farthest, 1e30f };
+	dp_range_t second_half = { farthest, point_count, 1e30f };
+	sb_push(stack, first_half);
+	sb_push(stack, second_half);
+	while (sb_count(stack) > 0) {
+		dp_range_t range = sb_last(stack);
+		--sb_raw_count(stack);
+		v2f a = points[range.begin];
+		v2f b = points[range.end % point_count];
+		i32 split = -1;
+		float max_sq_distance = -1.0f;
+		for (i32 i = range.begin + 1; i < range.end; ++i) {
+			float sq_distance = sq_distance_to_segment(points[i], a, b);
+			if (sq_distance > max_sq_distance) {
+				max_sq_distance = sq_distance;
+				split = i;
+			}
+		}
+		if (split < 0) continue;
+		float value = ATMOST(sqrtf(max_sq_distance), range.cap);
+		importance[split] = value;
+		dp_range_t left = { range.begin, split, value };
+		dp_range_t right = { split, range.end, value };
+		sb_push(stack, left);
+		sb_push(stack, right);
+	}
+	sb_free(stack);
+}
+
+// Computes the bounding boxes and the simplified outlines of the annotations in [first_annotation, end_annotation).
+// The simplified outlines are appended to lod_points, so the annotations before first_annotation need to have theirs.
+static void build_annotation_lods_for_range(annotation_set_t* annotation_set, i32 first_annotation, i32 end_annotation) {
+	v2f* points = NULL; // sb
+	float* importance = NULL; // sb
+	for (i32 annotation_index = first_annotation; annotation_index < end_annotation; ++annotation_index) {
+		annotation_t* annotation = annotation_set->annotations + annotation_index;
+		memset(annotation->lod_first_point, 0, sizeof(annotation->lod_first_point));
+		memset(annotation->lod_point_count, 0, sizeof(annotation->lod_point_count));
+		if (!annotation->has_coordinates) continue;
+
+		i32 count = annotation->coordinate_count;
+		if (points) sb_raw_count(points) = 0;
+		if (importance) sb_raw_count(importance) = 0;
+		for (i32 i = 0; i < count; ++i) {
+			i32 coordinate_index = annotation->first_coordinate + i;
+			v2f point = {annotation_set->coordinate_x[coordinate_index], annotation_set->coordinate_y[coordinate_index]};
+			sb_push(points, point);
+			sb_push(importance, 1e30f);
+			if (i == 0) {
+				annotation->bounds_min = point;
+				annotation->bounds_max = point;
+			} else {
+				annotation->bounds_min.x = ATMOST(annotation->bounds_min.x, point.x);
+				annotation->bounds_min.y = ATMOST(annotation->bounds_min.y, point.y);
+				annotation->bounds_max.x = ATLEAST(annotation->bounds_max.x, point.x);
+				annotation->bounds_max.y = ATLEAST(annotation->bounds_max.y, point.y);
+			}
+		}
+		if (count > 3) {
+			compute_douglas_peucker_importance(points, count, importance);
+		}
+
+		for (i32 lod = 0; lod < ANNOTATION_LOD_COUNT; ++lod) {
+			float tolerance = ANNOTATION_LOD_BASE_TOLERANCE * (float)(1 << lod);
+			annotation->lod_first_point[lod] = sb_count(annotation_set->lod_points);
+			for (i32 i = 0; i < count; ++i) {
+				if (importance[i] > tolerance) {
+					sb_push(annotation_set->lod_points, points[i]);
 				}
 			}
+			annotation->lod_point_count[lod] = sb_count(annotation_set->lod_points) - annotation->lod_first_point[lod];
 		}
+	}
+	sb_free(points);
+	sb_free(importance);
+}
 
+// Needs to be called once all annotations are loaded: computes the bounding boxes, and the simplified outlines.
+void build_annotation_lods(annotation_set_t* annotation_set) {
+	if (annotation_set->lod_points) {
+		sb_free(annotation_set->lod_points);
+		annotation_set->lod_points = NULL;
 	}
-	return result;
+	build_annotation_lods_for_range(annotation_set, 0, annotation_set->annotation_count);
 }
 
 void annotations_modified(annotation_set_t* annotation_set) {
+	annotation_set->are_group_statistics_dirty = true; // e.g. deleted, or assigned to another group
 	annotation_set->modified = true; // need to (auto-)save the changes
 	annotation_set->last_modification_time = get_clock();
 }
 
+static void wait_for_annotation_saves(annotation_set_t* annotation_set) {
+	while (annotation_set->saves_in_flight > 0) {
+		do_worker_work(&work_queue, 0);
+	}
+}
+
+// Removes the selected annotations, without recording the edit (see delete_selected_annotations()).
+// The annotations are only marked as deleted, so that nothing else needs to be renumbered or uploaded again.
+void remove_selected_annotations(annotation_set_t* annotation_set) {
+	for (i32 i = 0; i < annotation_set->annotation_count; ++i) {
+		annotation_t* annotation = annotation_set->annotations + i;
+		if (annotation->selected && !annotation->deleted) {
+			annotation->deleted = true;
+			annotation->selected = false;
+			++annotation_set->deleted_annotation_count;
+			if (annotation->has_coordinates) {
+				annotation_set->deleted_coordinate_count += annotation->coordinate_count;
+			}
+		}
+	}
+}
+
+// Removes the deleted annotations for good, along with their coordinates and simplified outlines, without recording
+// the edit. The annotations after a deleted one move down, so the segments in the index are renumbered, and the
+// geometry on the GPU needs to be uploaded again.
+void compact_annotations(annotation_set_t* annotation_set) {
+	if (annotation_set->deleted_annotation_count == 0) return;
+	wait_for_annotation_saves(annotation_set); // the save tasks may still be reading the coordinates
+	wait_for_annotation_statistics(annotation_set);
+
+	i32* new_annotation_indices = (i32*) malloc(ATLEAST(1, annotation_set->annotation_count) * sizeof(i32));
+	float* coordinate_x = NULL; // sb
+	float* coordinate_y = NULL; // sb
+	v2f* lod_points = NULL; // sb
+	i32 live_coordinate_count = annotation_set->coordinate_count - annotation_set->deleted_coordinate_count;
+	if (live_coordinate_count > 0) {
+		sb_add(coordinate_x, live_coordinate_count);
+		sb_add(coordinate_y, live_coordinate_count);
+		sb_raw_count(coordinate_x) = 0;
+		sb_raw_count(coordinate_y) = 0;
+	}
+	i32 annotation_count = 0;
+	i32 measured_annotation_count = 0;
+	for (i32 i = 0; i < annotation_set->annotation_count; ++i) {
+		annotation_t annotation = annotation_set->annotations[i];
+		if (annotation.deleted) {
+			new_annotation_indices[i] = -1;
+			continue;
+		}
+		if (i < annotation_set->measured_annotation_count) {
+			++measured_annotation_count;
+		}
+		new_annotation_indices[i] = annotation_count;
+		if (annotation.has_coordinates) {
+			i32 first_coordinate = sb_count(coordinate_x);
+			size_t copy_size = annotation.coordinate_count * sizeof(float);
+			memcpy(sb_add(coordinate_x, annotation.coordinate_count), annotation_set->coordinate_x + annotation.first_coordinate, copy_size);
+			memcpy(sb_add(coordinate_y, annotation.coordinate_count), annotation_set->coordinate_y + annotation.first_coordinate, copy_size);
+			annotation.first_coordinate = first_coordinate;
+		}
+		if (annotation_set->lod_points) {
+			for (i32 lod = 0; lod < ANNOTATION_LOD_COUNT; ++lod) {
+				i32 point_count = annotation.lod_point_count[lod];
+				v2f* dest = sb_add(lod_points, point_count);
+				memcpy(dest, annotation_set->lod_points + annotation.lod_first_point[lod], point_count * sizeof(v2f));
+				annotation.lod_first_point[lod] = (i32)(dest - lod_points);
+			}
+		}
+		annotation_set->annotations[annotation_count++] = annotation;
+	}
+	sb_raw_count(annotation_set->annotations) = annotation_count;
+	annotation_set->annotation_count = annotation_count;
+	annotation_set->deleted_annotation_count = 0;
+	annotation_set->measured_annotation_count = measured_annotation_count;
+
+	if (annotation_set->coordinate_x) sb_free(annotation_set->coordinate_x);
+	if (annotation_set->coordinate_y) sb_free(annotation_set->coordinate_y);
+	annotation_set->coordinate_x = coordinate_x;
+	annotation_set->coordinate_y = coordinate_y;
+	annotation_set->coordinate_count = sb_count(coordinate_x);
+	annotation_set->deleted_coordinate_count = 0;
+	if (annotation_set->lod_points) sb_free(annotation_set->lod_points);
+	annotation_set->lod_points = lod_points;
+
+	annotation_index_t* index = &annotation_set->index;
+	for (i32 i = 0; i < sb_count(index->segments); ++i) {
+		annotation_segment_t* segment = index->segments + i;
+		if (segment->annotation_index >= 0) {
+			segment->annotation_index = new_annotation_indices[segment->annotation_index];
+		}
+	}
+	free(new_annotation_indices);
+	annotation_set->needs_geometry_upload = true;
+}
+
+// Compacts once at least half of the annotations or coordinates are deleted, so that the memory stays bounded while
+// the cost of compacting is spread out over many deletions.
+static void maybe_compact_annotations(annotation_set_t* annotation_set) {
+	if (annotation_set->deleted_annotation_count == 0) return;
+	if (2 * annotation_set->deleted_annotation_count >= annotation_set->annotation_count ||
+	    2 * annotation_set->deleted_coordinate_count >= annotation_set->coordinate_count) {
+		record_annotations_compacted(annotation_set);
+		compact_annotations(annotation_set);
+	}
+}
+
 void delete_selected_annotations(annotation_set_t* annotation_set) {
 	if (!annotation_set->annotations) return;
-	bool has_selected = false;
+	i32* deleted_indices = NULL; // sb
 	for (i32 i = 0; i < annotation_set->annotation_count; ++i) {
 		annotation_t* annotation = annotation_set->annotations + i;
-		if (annotation->selected) {
-			has_selected = true;
-			break;
+		if (annotation->selected && !annotation->deleted) {
+			sb_push(deleted_indices, i);
 		}
 	}
-	if (has_selected) {
-		// rebuild the annotations, leaving out the deleted ones
-		size_t copy_size = annotation_set->annotation_count * sizeof(annotation_t);
-		annotation_t* temp_copy = (annotation_t*) malloc(copy_size);
-		memcpy(temp_copy, annotation_set->annotations, copy_size);
+	if (deleted_indices) {
+		record_annotations_deleted(annotation_set, deleted_indices, sb_count(deleted_indices));
+		remove_selected_annotations(annotation_set);
+		maybe_compact_annotations(annotation_set);
+		annotations_modified(annotation_set);
+		sb_free(deleted_indices);
+	}
+}
 
-		sb_raw_count(annotation_set->annotations) = 0;
-		for (i32 i = 0; i < annotation_set->annotation_count; ++i) {
-			annotation_t* annotation = temp_copy + i;
-			if (annotation->selected) continue; // skip (delete)
-					sb_push(annotation_set->annotations, *annotation);
+static void assign_selected_annotations_to_group(annotation_set_t* annotation_set, i32 group_index) {
+	i32* assigned_indices = NULL; // sb
+	for (i32 i = 0; i < annotation_set->annotation_count; ++i) {
+		annotation_t* annotation = annotation_set->annotations + i;
+		if (annotation->selected) {
+			annotation->group_id = group_index;
+			sb_push(assigned_indices, i);
 		}
-		annotation_set->annotation_count = sb_count(annotation_set->annotations);
+	}
+	if (assigned_indices) {
+		record_annotations_assigned(annotation_set, group_index, assigned_indices, sb_count(assigned_indices));
+		annotation_set->needs_attribute_upload = true;
 		annotations_modified(annotation_set);
+		sb_free(assigned_indices);
 	}
-
-
 }
 
 i32 select_annotation(scene_t* scene, bool32 additive) {
@@ -147,6 +679,7 @@ i32 select_annotation(scene_t* scene, bool32 additive) {
 			annotation->selected = !annotation->selected;
 		}
 	}
+	annotation_set->needs_attribute_upload = true; // the selection is drawn differently
 
 	// unselect all annotations (except if Ctrl held down)
 	if (!additive) {
@@ -160,9 +693,98 @@ i32 select_annotation(scene_t* scene, bool32 additive) {
 	return nearest_annotation_index;
 }
 
+// The list of annotations in the Annotations window only emits the rows that are scrolled into view (through
+// ImGuiListClipper), so that its cost doesn't grow with the size of the annotation set. The labels are built once, and
+// only built again when the annotations change.
+typedef struct annotation_list_cache_t {
+	annotation_set_t* annotation_set;
+	i32 annotation_count;
+	i32 deleted_annotation_count;
+	i32 group_count;
+	i64 last_modification_time;
+	i32* annotation_indices; // sb, one per row: the annotations that are not deleted
+	i32* label_offsets; // sb, one per row, into label_text
+	char* label_text; // sb, the labels one after the other (zero-terminated)
+} annotation_list_cache_t;
+
+static annotation_list_cache_t annotation_list_cache;
+
+static void update_annotation_list_cache(annotation_set_t* annotation_set) {
+	annotation_list_cache_t* cache = &annotation_list_cache;
+	if (cache->annotation_set == annotation_set && cache->annotation_count == annotation_set->annotation_count &&
+	    cache->deleted_annotation_count == annotation_set->deleted_annotation_count &&
+	    cache->group_count == annotation_set->group_count &&
+	    cache->last_modification_time == annotation_set->last_modification_time) {
+		return;
+	}
+	cache->annotation_set = annotation_set;
+	cache->annotation_count = annotation_set->annotation_count;
+	cache->deleted_annotation_count = annotation_set->deleted_annotation_count;
+	cache->group_count = annotation_set->group_count;
+	cache->last_modification_time = annotation_set->last_modification_time;
+	if (cache->annotation_indices) sb_raw_count(cache->annotation_indices) = 0;
+	if (cache->label_offsets) sb_raw_count(cache->label_offsets) = 0;
+	if (cache->label_text) sb_raw_count(cache->label_text) = 0;
+
+	for (i32 i = 0; i < annotation_set->annotation_count; ++i) {
+		annotation_t* annotation = annotation_set->annotations + i;
+		if (annotation->deleted) continue;
+		char label[160];
+		const char* group_name = (annotation->group_id >= 0 && annotation->group_id < annotation_set->group_count) ?
+		                         annotation_set->groups[annotation->group_id].name : "";
+		i32 length;
+		if (annotation->name[0]) {
+			length = snprintf(label, sizeof(label), "%s (%s)", annotation->name, group_name);
+		} else {
+			length = snprintf(label, sizeof(label), "Annotation %d (%s)", i + 1, group_name);
+		}
+		length = CLAMP(length, 0, (i32)sizeof(label) - 1);
+		sb_push(cache->annotation_indices, i);
+		sb_push(cache->label_offsets, sb_count(cache->label_text));
+		memcpy(sb_add(cache->label_text, length + 1), label, length + 1);
+	}
+}
+
+// Clicking a row selects the annotation (with Ctrl held down: adds it to the selection, or removes it); double-clicking
+// also moves the camera to it.
+static void draw_annotation_list(scene_t* scene, annotation_set_t* annotation_set, bool32 additive) {
+	annotation_list_cache_t* cache = &annotation_list_cache;
+	update_annotation_list_cache(annotation_set);
+	i32 row_count = sb_count(cache->annotation_indices);
+
+	ImGui::BeginChild("Annotation list", ImVec2(0, 0), true);
+	ImGuiListClipper clipper(row_count, ImGui::GetTextLineHeightWithSpacing());
+	while (clipper.Step()) {
+		for (i32 row = clipper.DisplayStart; row < clipper.DisplayEnd; ++row) {
+			i32 annotation_index = cache->annotation_indices[row];
+			annotation_t* annotation = annotation_set->annotations + annotation_index;
+			ImGui::PushID(row);
+			if (ImGui::Selectable(cache->label_text + cache->label_offsets[row], annotation->selected,
+			                      ImGuiSelectableFlags_AllowDoubleClick)) {
+				if (additive) {
+					annotation->selected = !annotation->selected;
+				} else {
+					for (i32 i = 0; i < annotation_set->annotation_count; ++i) {
+						annotation_set->annotations[i].selected = false;
+					}
+					annotation->selected = true;
+				}
+				annotation_set->needs_attribute_upload = true; // the selection is drawn differently
+				if (ImGui::IsMouseDoubleClicked(0) && annotation->has_coordinates) {
+					v2f center = { (annotation->bounds_min.x + annotation->bounds_max.x) * 0.5f,
+					               (annotation->bounds_min.y + annotation->bounds_max.y) * 0.5f };
+					jump_scene_camera(scene, center);
+				}
+			}
+			ImGui::PopID();
+		}
+	}
+	ImGui::EndChild();
+}
+
 void draw_annotations_window(app_state_t* app_state, input_t* input) {
 
-	annotation_set_t* annotation_set = &app_state->scene.annotation_set;
+	annotation_set_t* annotation_set = &app_state->scenes[0].annotation_set;
 
 	const char** item_previews = (const char**) alloca(annotation_set->group_count * sizeof(char*));
 	for (i32 i = 0; i < annotation_set->group_count; ++i) {
@@ -204,6 +826,9 @@ void draw_annotations_window(app_state_t* app_state, input_t* input) {
 		hotkey_pressed[9] = true;
 	}
 
+	// Both windows (and the hotkeys) can ask for a group assignment; it is applied once, after drawing them.
+	i32 assign_to_group_index = -1;
+
 	const char* preview = "";
 	if (annotation_group_index >= 0 && annotation_group_index < annotation_set->group_count) {
 		preview = item_previews[annotation_group_index];
@@ -223,7 +848,7 @@ void draw_annotations_window(app_state_t* app_state, input_t* input) {
 
 		ImGui::Text("(work in progress...)");
 
-		ImGui::Text("Number of annotations loaded: %d\n", annotation_set->annotation_count);
+		ImGui::Text("Number of annotations loaded: %d\n", annotation_set->annotation_count - annotation_set->deleted_annotation_count);
 		ImGui::Checkbox("Show annotations", &annotation_set->enabled);
 
 
@@ -238,14 +863,7 @@ void draw_annotations_window(app_state_t* app_state, input_t* input) {
 
 				if (ImGui::Selectable(item_previews[group_index], (annotation_group_index == group_index), selectable_flags, (ImVec2){})
 				      || ((!nothing_selected) && hotkey_pressed[group_index])) {
-					// set group
-					for (i32 i = 0; i < annotation_set->annotation_count; ++i) {
-						annotation_t* annotation = annotation_set->annotations + i;
-						if (annotation->selected) {
-							annotation->group_id = group_index;
-							annotations_modified(annotation_set);
-						}
-					}
+					assign_to_group_index = group_index;
 				}
 			}
 			ImGui::EndCombo();
@@ -270,6 +888,8 @@ void draw_annotations_window(app_state_t* app_state, input_t* input) {
 				rgba.g = FLOAT_TO_BYTE(color[1]);
 				rgba.b = FLOAT_TO_BYTE(color[2]);
 				group->color = rgba;
+				record_annotation_group_changed(annotation_set, annotation_group_index);
+				annotation_set->needs_attribute_upload = true;
 				annotations_modified(annotation_set);
 			}
 		} else {
@@ -282,6 +902,8 @@ void draw_annotations_window(app_state_t* app_state, input_t* input) {
 			ImGui::PopStyleVar();
 		}
 
+		draw_annotation_list(app_state->scenes + 0, annotation_set, is_key_down(input, KEYCODE_CONTROL));
+
 		ImGui::End();
 	}
 
@@ -317,14 +939,7 @@ void draw_annotations_window(app_state_t* app_state, input_t* input) {
 //		ImGui::PushStyleColor(ImGuiCol_FrameBgActive, color);
 			if (ImGui::Selectable("", (annotation_group_index == group_index), selectable_flags, ImVec2(0,ImGui::GetFrameHeight()))
 			    || ((!nothing_selected) && hotkey_pressed[group_index])) {
-				// set group
-				for (i32 i = 0; i < annotation_set->annotation_count; ++i) {
-					annotation_t* annotation = annotation_set->annotations + i;
-					if (annotation->selected) {
-						annotation->group_id = group_index;
-						annotations_modified(annotation_set);
-					}
-				}
+				assign_to_group_index = group_index;
 			}
 
 			ImGui::SameLine(0); ImGui::RadioButton(item_previews[group_index], &annotation_group_index, group_index);
@@ -350,7 +965,9 @@ void draw_annotations_window(app_state_t* app_state, input_t* input) {
 		ImGui::End();
 	}
 
-
+	if (assign_to_group_index >= 0) {
+		assign_selected_annotations_to_group(annotation_set, assign_to_group_index);
+	}
 
 }
 
@@ -391,56 +1008,179 @@ rgba_t asap_xml_parse_color(const char* value) {
 	return rgba;
 }
 
-void annotation_set_attribute(annotation_set_t* annotation_set, annotation_t* annotation, const char* attr,
-                              const char* value) {
-	if (strcmp(attr, "Color") == 0) {
-		annotation->color = asap_xml_parse_color(value);
-	} else if (strcmp(attr, "Name") == 0) {
-		strncpy(annotation->name, value, sizeof(annotation->name));
-	} else if (strcmp(attr, "PartOfGroup") == 0) {
-		i32 group_index = find_annotation_group(annotation_set, value);
-		if (group_index < 0) {
-			group_index = add_annotation_group(annotation_set, value); // Group not found --> create it
-		}
-		annotation->group_id = group_index;
-	} else if (strcmp(attr, "Type") == 0) {
-		if (strcmp(value, "Rectangle") == 0) {
-			annotation->type = ANNOTATION_RECTANGLE;
-		} else if (strcmp(value, "Polygon") == 0) {
-			annotation->type = ANNOTATION_POLYGON;
+// Element and attribute names are looked up once per token; the handlers below only compare enums.
+static asap_xml_element_enum asap_xml_lookup_element(const char* name) {
+	switch (name[0]) {
+		case 'A': if (strcmp(name, "Annotation") == 0) return ASAP_XML_ELEMENT_ANNOTATION; break;
+		case 'C': if (strcmp(name, "Coordinate") == 0) return ASAP_XML_ELEMENT_COORDINATE; break;
+		case 'G': if (strcmp(name, "Group") == 0) return ASAP_XML_ELEMENT_GROUP; break;
+		default: break;
+	}
+	return ASAP_XML_ELEMENT_NONE;
+}
+
+static asap_xml_attribute_enum asap_xml_lookup_attribute(const char* name) {
+	switch (name[0]) {
+		case 'C': if (strcmp(name, "Color") == 0) return ASAP_XML_ATTRIBUTE_COLOR; break;
+		case 'N': if (strcmp(name, "Name") == 0) return ASAP_XML_ATTRIBUTE_NAME; break;
+		case 'O': if (strcmp(name, "Order") == 0) return ASAP_XML_ATTRIBUTE_ORDER; break;
+		case 'P': if (strcmp(name, "PartOfGroup") == 0) return ASAP_XML_ATTRIBUTE_PARTOFGROUP; break;
+		case 'T': if (strcmp(name, "Type") == 0) return ASAP_XML_ATTRIBUTE_TYPE; break;
+		case 'X': if (name[1] == '\0') return ASAP_XML_ATTRIBUTE_X; break;
+		case 'Y': if (name[1] == '\0') return ASAP_XML_ATTRIBUTE_Y; break;
+		default: break;
+	}
+	return ASAP_XML_ATTRIBUTE_NONE;
+}
+
+// Fast path for plain decimal numbers such as "12345.678": if the digits fit in a double exactly and the power of
+// ten is small, a single multiplication or division gives the correctly rounded result. Anything else goes to atof().
+static double asap_xml_parse_double(const char* value) {
+	static const double powers_of_ten[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+	};
+	const char* p = value;
+	bool negative = false;
+	if (*p == '-') {
+		negative = true;
+		++p;
+	} else if (*p == '+') {
+		++p;
+	}
+	u64 mantissa = 0;
+	i32 significant_digits = 0;
+	i32 exponent = 0;
+	bool has_digits = false;
+	for (; *p >= '0' && *p <= '9'; ++p) {
+		has_digits = true;
+		if (significant_digits < 19) {
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa) ++significant_digits;
 		} else {
-			printf("Warning: annotation '%s' with unrecognized type '%s', defaulting to 'Polygon'.\n", annotation->name, value);
-			annotation->type = ANNOTATION_POLYGON;
+			++exponent;
+		}
+	}
+	if (*p == '.') {
+		++p;
+		for (; *p >= '0' && *p <= '9'; ++p) {
+			has_digits = true;
+			if (significant_digits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa) ++significant_digits;
+				--exponent;
+			}
+		}
+	}
+	if (has_digits && (*p == 'e' || *p == 'E')) {
+		++p;
+		bool negative_exponent = false;
+		if (*p == '-') {
+			negative_exponent = true;
+			++p;
+		} else if (*p == '+') {
+			++p;
+		}
+		if (!(*p >= '0' && *p <= '9')) {
+			return atof(value);
+		}
+		i32 explicit_exponent = 0;
+		for (; *p >= '0' && *p <= '9'; ++p) {
+			if (explicit_exponent < 10000) explicit_exponent = explicit_exponent * 10 + (*p - '0');
 		}
+		exponent += negative_exponent ? -explicit_exponent : explicit_exponent;
 	}
+	if (!has_digits || *p != '\0' || significant_digits > 15 || exponent < -22 || exponent > 22) {
+		return atof(value);
+	}
+	double result = (double)mantissa;
+	if (exponent < 0) {
+		result /= powers_of_ten[-exponent];
+	} else {
+		result *= powers_of_ten[exponent];
+	}
+	return negative ? -result : result;
+}
+
+// Returns the index into parse_state->group_refs. Consecutive annotations usually belong to the same group.
+static i32 asap_xml_find_group_ref(asap_xml_parse_state_t* parse_state, const char* group_name) {
+	if (strcmp(parse_state->group_refs[parse_state->last_group_ref].name, group_name) == 0) {
+		return parse_state->last_group_ref;
+	}
+	i32 group_ref = -1;
+	for (i32 i = 0; i < sb_count(parse_state->group_refs); ++i) {
+		if (strcmp(parse_state->group_refs[i].name, group_name) == 0) {
+			group_ref = i;
+			break;
+		}
+	}
+	if (group_ref < 0) {
+		annotation_group_t new_ref = {};
+		strncpy(new_ref.name, group_name, sizeof(new_ref.name) - 1);
+		group_ref = sb_count(parse_state->group_refs);
+		sb_push(parse_state->group_refs, new_ref);
+	}
+	parse_state->last_group_ref = group_ref;
+	return group_ref;
 }
 
-void coordinate_set_attribute(coordinate_t* coordinate, const char* attr, const char* value) {
-	if (strcmp(attr, "Order") == 0) {
-		coordinate->order = atoi(value);
-	} else if (strcmp(attr, "X") == 0) {
-		coordinate->x = atof(value) * 0.25; // TODO: address assumption
-	} else if (strcmp(attr, "Y") == 0) {
-		coordinate->y = atof(value) * 0.25; // TODO: address assumption
+void annotation_set_attribute(asap_xml_parse_state_t* parse_state, annotation_t* annotation,
+                              asap_xml_attribute_enum attr, const char* value) {
+	switch (attr) {
+		case ASAP_XML_ATTRIBUTE_COLOR: {
+			annotation->color = asap_xml_parse_color(value);
+		} break;
+		case ASAP_XML_ATTRIBUTE_NAME: {
+			strncpy(annotation->name, value, sizeof(annotation->name));
+		} break;
+		case ASAP_XML_ATTRIBUTE_PARTOFGROUP: {
+			annotation->group_id = asap_xml_find_group_ref(parse_state, value);
+		} break;
+		case ASAP_XML_ATTRIBUTE_TYPE: {
+			if (strcmp(value, "Rectangle") == 0) {
+				annotation->type = ANNOTATION_RECTANGLE;
+			} else if (strcmp(value, "Polygon") == 0) {
+				annotation->type = ANNOTATION_POLYGON;
+			} else {
+				printf("Warning: annotation '%s' with unrecognized type '%s', defaulting to 'Polygon'.\n", annotation->name, value);
+				annotation->type = ANNOTATION_POLYGON;
+			}
+		} break;
+		default: break;
 	}
 }
 
-void group_set_attribute(annotation_group_t* group, const char* attr, const char* value) {
-	if (strcmp(attr, "Color") == 0) {
-		group->color = asap_xml_parse_color(value);
-	} else if (strcmp(attr, "Name") == 0) {
-		strncpy(group->name, value, sizeof(group->name));
-	} else if (strcmp(attr, "PartOfGroup") == 0) {
-		// TODO: allow nested groups?
+// Note: the coordinates are kept in the order they appear in the file (the Order attribute is not used).
+// ASAP stores pixels of the full resolution level; they are converted to micrometers with the mpp of the image.
+void coordinate_set_attribute(annotation_set_t* annotation_set, i32 coordinate_index, asap_xml_attribute_enum attr, const char* value) {
+	v2f mpp = get_annotation_set_mpp(annotation_set);
+	switch (attr) {
+		case ASAP_XML_ATTRIBUTE_X: annotation_set->coordinate_x[coordinate_index] = (float)(asap_xml_parse_double(value) * mpp.x); break;
+		case ASAP_XML_ATTRIBUTE_Y: annotation_set->coordinate_y[coordinate_index] = (float)(asap_xml_parse_double(value) * mpp.y); break;
+		default: break;
 	}
 }
 
-void unload_and_reinit_annotations(annotation_set_t* annotation_set) {
+void group_set_attribute(annotation_group_t* group, asap_xml_attribute_enum attr, const char* value) {
+	switch (attr) {
+		case ASAP_XML_ATTRIBUTE_COLOR: group->color = asap_xml_parse_color(value); break;
+		case ASAP_XML_ATTRIBUTE_NAME: strncpy(group->name, value, sizeof(group->name)); break;
+		case ASAP_XML_ATTRIBUTE_PARTOFGROUP: break; // TODO: allow nested groups?
+		default: break;
+	}
+}
+
+void destroy_annotation_set(annotation_set_t* annotation_set) {
+	wait_for_annotation_saves(annotation_set); // the save tasks may still be reading the coordinates
+	wait_for_annotation_statistics(annotation_set);
 	if (annotation_set->annotations) {
 		sb_free(annotation_set->annotations);
 	}
-	if (annotation_set->coordinates) {
-		sb_free(annotation_set->coordinates);
+	if (annotation_set->coordinate_x) {
+		sb_free(annotation_set->coordinate_x);
+	}
+	if (annotation_set->coordinate_y) {
+		sb_free(annotation_set->coordinate_y);
 	}
 	if (annotation_set->groups) {
 		sb_free(annotation_set->groups);
@@ -448,185 +1188,997 @@ void unload_and_reinit_annotations(annotation_set_t* annotation_set) {
 	if (annotation_set->filename) {
 		free(annotation_set->filename);
 	}
+	destroy_annotation_index(&annotation_set->index);
+	if (annotation_set->lod_points) {
+		sb_free(annotation_set->lod_points);
+	}
+	if (annotation_set->pending_edits) {
+		sb_free(annotation_set->pending_edits);
+	}
+	if (annotation_set->group_statistics) {
+		sb_free(annotation_set->group_statistics);
+	}
 	memset(annotation_set, 0, sizeof(*annotation_set));
+}
+
+// The memory held by the annotation set, for the memory statistics (see memory_stats.h).
+i64 get_annotation_set_memory_usage(annotation_set_t* annotation_set) {
+	i64 size = sb_allocated_size(annotation_set->annotations) + sb_allocated_size(annotation_set->coordinate_x) +
+	           sb_allocated_size(annotation_set->coordinate_y) + sb_allocated_size(annotation_set->groups) +
+	           sb_allocated_size(annotation_set->index.segments) + sb_allocated_size(annotation_set->index.nodes) +
+	           sb_allocated_size(annotation_set->lod_points) + sb_allocated_size(annotation_set->pending_edits);
+	return size;
+}
 
+// (The annotations still belong to the same image, so the mpp is kept.)
+void unload_and_reinit_annotations(annotation_set_t* annotation_set) {
+	v2f mpp = annotation_set->mpp;
+	destroy_annotation_set(annotation_set);
+	annotation_set->mpp = mpp;
 	// reserve annotation group 0 for the "None" category
 	add_annotation_group(annotation_set, "None");
 }
 
-enum {
-	ASAP_XML_PARSE_GROUPS = 0,
-	ASAP_XML_PARSE_ANNOTATIONS = 1,
-};
+// A part of the annotations that is handed over to the main thread while the rest of the file is still being read.
+// The coordinates and the simplified outlines are copies of consecutive ranges of those in the loading set.
+typedef struct annotation_load_batch_t {
+	annotation_t* annotations;
+	i32 annotation_count;
+	float* coordinate_x;
+	float* coordinate_y;
+	i32 first_coordinate; // in the loading set
+	i32 coordinate_count;
+	v2f* lod_points;
+	i32 first_lod_point;
+	i32 lod_point_count;
+	annotation_group_t* groups; // all groups so far
+	i32 group_count;
+} annotation_load_batch_t;
+
+#define ANNOTATION_LOAD_MAX_BATCHES 32
+#define ANNOTATION_LOAD_MIN_BATCH_COORDINATES 65536
+
+// Annotations can be loaded on a worker thread. The result is kept in the task until the main thread picks it up
+// (see update_background_annotation_loads()), so that the annotations on screen are never half-loaded.
+// The exception are the GeoJSON files, which are often huge (e.g. cell detections): those are shown as they are read,
+// in batches that each hold at least as many coordinates as all batches before them, so that uploading the growing
+// set to the GPU over and over costs at most about twice as much as uploading it once. The complete result (with the
+// spatial index for selecting) then replaces the batches.
+typedef struct annotation_load_task_t {
+	char* filename;
+	v2f mpp; // of the image that the annotations are loaded for
+	annotation_set_t result;
+	bool32 success;
+	volatile i64 bytes_parsed;
+	volatile i64 total_bytes;
+	volatile i32 is_cancelled;
+	volatile i32 is_done;
+	bool32 is_incremental; // hand over batches while loading
+	annotation_load_batch_t* batches[ANNOTATION_LOAD_MAX_BATCHES];
+	volatile i32 batch_count; // written by the worker
+	i32 batches_applied; // only accessed by the main thread
+	i32 published_annotation_count; // only accessed by the worker
+	i32 published_coordinate_count;
+	i32 published_lod_point_count;
+} annotation_load_task_t;
+
+static annotation_load_task_t** annotation_load_tasks; // sb, only accessed by the main thread
+
+#define ANNOTATION_LOAD_PROGRESS_INTERVAL KILOBYTES(64)
+
+// Called by the worker after each complete annotation (or group of annotations); annotations from
+// finished_annotation_count onwards may still be incomplete.
+static void maybe_publish_annotation_load_batch(annotation_load_task_t* task, annotation_set_t* annotation_set,
+                                                i32 finished_annotation_count) {
+	if (!task->is_incremental || task->batch_count >= ANNOTATION_LOAD_MAX_BATCHES) return; // the rest comes at the end
+	i32 end_coordinate = (finished_annotation_count < annotation_set->annotation_count) ?
+	                     annotation_set->annotations[finished_annotation_count].first_coordinate :
+	                     annotation_set->coordinate_count;
+	i32 coordinate_count = end_coordinate - task->published_coordinate_count;
+	if (coordinate_count < ATLEAST(ANNOTATION_LOAD_MIN_BATCH_COORDINATES, task->published_coordinate_count)) return;
+
+	i32 first_annotation = task->published_annotation_count;
+	build_annotation_lods_for_range(annotation_set, first_annotation, finished_annotation_count);
+
+	annotation_load_batch_t* batch = (annotation_load_batch_t*) calloc(1, sizeof(annotation_load_batch_t));
+	batch->annotation_count = finished_annotation_count - first_annotation;
+	batch->annotations = (annotation_t*) malloc(batch->annotation_count * sizeof(annotation_t));
+	memcpy(batch->annotations, annotation_set->annotations + first_annotation, batch->annotation_count * sizeof(annotation_t));
+	batch->first_coordinate = task->published_coordinate_count;
+	batch->coordinate_count = coordinate_count;
+	batch->coordinate_x = (float*) malloc(coordinate_count * sizeof(float));
+	batch->coordinate_y = (float*) malloc(coordinate_count * sizeof(float));
+	memcpy(batch->coordinate_x, annotation_set->coordinate_x + batch->first_coordinate, coordinate_count * sizeof(float));
+	memcpy(batch->coordinate_y, annotation_set->coordinate_y + batch->first_coordinate, coordinate_count * sizeof(float));
+	batch->first_lod_point = task->published_lod_point_count;
+	batch->lod_point_count = sb_count(annotation_set->lod_points) - batch->first_lod_point;
+	batch->lod_points = (v2f*) malloc(ATLEAST(1, batch->lod_point_count) * sizeof(v2f));
+	memcpy(batch->lod_points, annotation_set->lod_points + batch->first_lod_point, batch->lod_point_count * sizeof(v2f));
+	batch->group_count = annotation_set->group_count;
+	batch->groups = (annotation_group_t*) malloc(batch->group_count * sizeof(annotation_group_t));
+	memcpy(batch->groups, annotation_set->groups, batch->group_count * sizeof(annotation_group_t));
+
+	task->published_annotation_count = finished_annotation_count;
+	task->published_coordinate_count = end_coordinate;
+	task->published_lod_point_count = sb_count(annotation_set->lod_points);
+	task->batches[task->batch_count] = batch;
+	write_barrier;
+	++task->batch_count;
+}
 
-bool32 load_asap_xml_annotations(app_state_t* app_state, const char* filename) {
-	annotation_set_t* annotation_set = &app_state->scene.annotation_set;
-	unload_and_reinit_annotations(annotation_set);
+static void destroy_annotation_load_batch(annotation_load_batch_t* batch) {
+	free(batch->annotations);
+	free(batch->coordinate_x);
+	free(batch->coordinate_y);
+	free(batch->lod_points);
+	free(batch->groups);
+	free(batch);
+}
 
-	asap_xml_parse_state_t* parse_state = &global_parse_state;
-	memset(parse_state, 0, sizeof(*parse_state));
+// Appends the batch to the displayed annotations.
+static void apply_annotation_load_batch(annotation_set_t* annotation_set, annotation_load_batch_t* batch) {
+	wait_for_annotation_statistics(annotation_set); // the coordinates may move
+	i32 coordinate_offset = annotation_set->coordinate_count - batch->first_coordinate;
+	i32 lod_point_offset = sb_count(annotation_set->lod_points) - batch->first_lod_point;
+	for (i32 i = 0; i < batch->annotation_count; ++i) {
+		annotation_t annotation = batch->annotations[i];
+		annotation.first_coordinate += coordinate_offset;
+		for (i32 lod = 0; lod < ANNOTATION_LOD_COUNT; ++lod) {
+			annotation.lod_first_point[lod] += lod_point_offset;
+		}
+		sb_push(annotation_set->annotations, annotation);
+	}
+	annotation_set->annotation_count += batch->annotation_count;
+	memcpy(sb_add(annotation_set->coordinate_x, batch->coordinate_count), batch->coordinate_x,
+	       batch->coordinate_count * sizeof(float));
+	memcpy(sb_add(annotation_set->coordinate_y, batch->coordinate_count), batch->coordinate_y,
+	       batch->coordinate_count * sizeof(float));
+	annotation_set->coordinate_count += batch->coordinate_count;
+	if (batch->lod_point_count > 0) {
+		memcpy(sb_add(annotation_set->lod_points, batch->lod_point_count), batch->lod_points,
+		       batch->lod_point_count * sizeof(v2f));
+	}
+	for (i32 i = annotation_set->group_count; i < batch->group_count; ++i) {
+		sb_push(annotation_set->groups, batch->groups[i]);
+	}
+	annotation_set->group_count = ATLEAST(annotation_set->group_count, batch->group_count);
+	annotation_set->needs_geometry_upload = true;
+}
 
-	mem_t* file = platform_read_entire_file(filename);
-	yxml_t* x = NULL;
+// Single pass over the document: the groups referred to by the annotations are resolved at the end.
+static bool32 parse_asap_xml_annotations(annotation_set_t* annotation_set, char* doc, i64 doc_size,
+                                         annotation_load_task_t* task) {
+	asap_xml_parse_state_t parse_state_storage = {};
+	asap_xml_parse_state_t* parse_state = &parse_state_storage;
+	annotation_group_t none_ref = {};
+	strncpy(none_ref.name, "None", sizeof(none_ref.name)); // annotations without a PartOfGroup attribute
+	sb_push(parse_state->group_refs, none_ref);
+
+	// hack: merge memory for yxml_t struct and stack buffer
+	yxml_t* x = (yxml_t*) malloc(sizeof(yxml_t) + YXML_STACK_BUFFER_SIZE);
+	yxml_init(x, x + 1, YXML_STACK_BUFFER_SIZE);
 	bool32 success = false;
-	i64 start = get_clock();
 
-	if (0) { failed: cleanup:
-		if (x) free(x);
-		if (file) free(file);
-		return success;
-	}
-
-	if (file) {
-		// hack: merge memory for yxml_t struct and stack buffer
-		x = (yxml_t*) malloc(sizeof(yxml_t) + YXML_STACK_BUFFER_SIZE);
-
-		// ASAP puts all of the group definitions at the end of the file, instead of the beginning.
-		// To preserve the order of the groups, we need to load the XML in two passes:
-		// pass 0: read annotation groups only
-		// pass 1: read annotations and coordinates
-		for (i32 pass = 0; pass < 2; ++pass) {
-			yxml_init(x, x + 1, YXML_STACK_BUFFER_SIZE);
-
-			// parse XML byte for byte
-			char attrbuf[128];
-			char* attrbuf_end = attrbuf + sizeof(attrbuf);
-			char* attrcur = NULL;
-			char contentbuf[128];
-			char* contentbuf_end = contentbuf + sizeof(contentbuf);
-			char* contentcur = NULL;
-
-			char* doc = (char*) file->data;
-			for (; *doc; doc++) {
-				yxml_ret_t r = yxml_parse(x, *doc);
-				if (r == YXML_OK) {
-					continue; // nothing worthy of note has happened -> continue
-				} else if (r < 0) {
-					goto failed;
-				} else if (r > 0) {
-					// token
-					switch(r) {
-						case YXML_ELEMSTART: {
-							// start of an element: '<Tag ..'
-//						    printf("element start: %s\n", x->elem);
-							contentcur = contentbuf;
-							*contentcur = '\0';
-
-							parse_state->element_type = ASAP_XML_ELEMENT_NONE;
-							if (pass == ASAP_XML_PARSE_ANNOTATIONS && strcmp(x->elem, "Annotation") == 0) {
-								annotation_t new_annotation = (annotation_t){};
-								sb_push(annotation_set->annotations, new_annotation);
-								++annotation_set->annotation_count;
-								parse_state->element_type = ASAP_XML_ELEMENT_ANNOTATION;
-							} else if (pass == ASAP_XML_PARSE_ANNOTATIONS && strcmp(x->elem, "Coordinate") == 0) {
-								coordinate_t new_coordinate = (coordinate_t){};
-								sb_push(annotation_set->coordinates, new_coordinate);
-								parse_state->element_type = ASAP_XML_ELEMENT_COORDINATE;
-
-								annotation_t* current_annotation = &sb_last(annotation_set->annotations);
-								if (!current_annotation->has_coordinates) {
-									current_annotation->first_coordinate = annotation_set->coordinate_count;
-									current_annotation->has_coordinates = true;
-								}
-								current_annotation->coordinate_count++;
-								++annotation_set->coordinate_count;
-							} else if (pass == ASAP_XML_PARSE_GROUPS && strcmp(x->elem, "Group") == 0) {
-								parse_state->element_type = ASAP_XML_ELEMENT_GROUP;
-								// reset the state (start parsing a new group)
-								parse_state->current_group = (annotation_group_t){};
-								parse_state->current_group.is_explicitly_defined = true; // (because this group has an XML tag)
-							}
-						} break;
-						case YXML_CONTENT: {
-							// element content
-//						    printf("   element content: %s\n", x->elem);
-							if (!contentcur) break;
-							char* tmp = x->data;
-							while (*tmp && contentbuf < contentbuf_end) {
-								*(contentcur++) = *(tmp++);
-							}
-							if (contentcur == contentbuf_end) {
-								// too long content
-								printf("load_asap_xml_annotations(): encountered a too long XML element content\n");
-								goto failed;
-							}
-							*contentcur = '\0';
-						} break;
-						case YXML_ELEMEND: {
-							// end of an element: '.. />' or '</Tag>'
-//						    printf("element end: %s\n", x->elem);
-							if (contentcur) {
-								// NOTE: usually only whitespace (newlines and such)
-//							    printf("elem content: %s\n", contentbuf);
-							}
-							if (pass == ASAP_XML_PARSE_GROUPS && strcmp(x->elem, "Group") == 0) {
-								annotation_group_t* parsed_group = &parse_state->current_group;
-								// Check if a group already exists with this name, if not create it
-								i32 group_index = find_annotation_group(annotation_set, parsed_group->name);
-								if (group_index < 0) {
-									group_index = add_annotation_group(annotation_set, parsed_group->name);
-								}
-								annotation_group_t* destination_group = annotation_set->groups + group_index;
-								// 'Commit' the group with all its attributes
-								memcpy(destination_group, parsed_group, sizeof(*destination_group));
-							}
-						} break;
-						case YXML_ATTRSTART: {
-							// attribute: 'Name=..'
-//						    printf("attr start: %s\n", x->attr);
-							attrcur = attrbuf;
-							*attrcur = '\0';
-						} break;
-						case YXML_ATTRVAL: {
-							// attribute value
-//						    printf("   attr val: %s\n", x->attr);
-							if (!attrcur) break;
-							char* tmp = x->data;
-							while (*tmp && attrbuf < attrbuf_end) {
-								*(attrcur++) = *(tmp++);
-							}
-							if (attrcur == attrbuf_end) {
-								// too long attribute
-								printf("load_asap_xml_annotations(): encountered a too long XML attribute\n");
-								goto failed;
-							}
-							*attrcur = '\0';
-						} break;
-						case YXML_ATTREND: {
-							// end of attribute '.."'
-							if (attrcur) {
-//							    printf("attr %s = %s\n", x->attr, attrbuf);
-								if (pass == ASAP_XML_PARSE_ANNOTATIONS && parse_state->element_type == ASAP_XML_ELEMENT_ANNOTATION) {
-									annotation_set_attribute(annotation_set, &sb_last(annotation_set->annotations), x->attr, attrbuf);
-								} else if (pass == ASAP_XML_PARSE_ANNOTATIONS && parse_state->element_type == ASAP_XML_ELEMENT_COORDINATE) {
-									coordinate_set_attribute(&sb_last(annotation_set->coordinates), x->attr, attrbuf);
-								} else if (pass == ASAP_XML_PARSE_GROUPS && parse_state->element_type == ASAP_XML_ELEMENT_GROUP) {
-									group_set_attribute(&parse_state->current_group, x->attr, attrbuf);
-								}
-							}
-						} break;
-						case YXML_PISTART:
-						case YXML_PICONTENT:
-						case YXML_PIEND:
-							break; // processing instructions (uninteresting, skip)
-						default: {
-							printf("yxml_parse(): unrecognized token (%d)\n", r);
-							goto failed;
+	char attrbuf[128];
+	char* attrbuf_end = attrbuf + sizeof(attrbuf);
+	char* attrcur = NULL;
+	asap_xml_attribute_enum attr = ASAP_XML_ATTRIBUTE_NONE;
+	char contentbuf[128];
+	char* contentbuf_end = contentbuf + sizeof(contentbuf);
+	char* contentcur = NULL;
+
+	for (i64 pos = 0; pos < doc_size && doc[pos]; ++pos) {
+		if (task && (pos % ANNOTATION_LOAD_PROGRESS_INTERVAL) == 0) {
+			task->bytes_parsed = pos;
+			if (task->is_cancelled) goto failed;
+		}
+		yxml_ret_t r = yxml_parse(x, doc[pos]);
+		if (r == YXML_OK) {
+			continue; // nothing worthy of note has happened -> continue
+		} else if (r < 0) {
+			goto failed;
+		} else if (r > 0) {
+			// token
+			switch(r) {
+				case YXML_ELEMSTART: {
+					// start of an element: '<Tag ..'
+					contentcur = contentbuf;
+					*contentcur = '\0';
+
+					asap_xml_element_enum element_type = asap_xml_lookup_element(x->elem);
+					if (element_type == ASAP_XML_ELEMENT_ANNOTATION) {
+						annotation_t new_annotation = {};
+						sb_push(annotation_set->annotations, new_annotation);
+						++annotation_set->annotation_count;
+					} else if (element_type == ASAP_XML_ELEMENT_COORDINATE && annotation_set->annotation_count > 0) {
+						sb_push(annotation_set->coordinate_x, 0.0f);
+						sb_push(annotation_set->coordinate_y, 0.0f);
+
+						annotation_t* current_annotation = &sb_last(annotation_set->annotations);
+						if (!current_annotation->has_coordinates) {
+							current_annotation->first_coordinate = annotation_set->coordinate_count;
+							current_annotation->has_coordinates = true;
 						}
+						current_annotation->coordinate_count++;
+						++annotation_set->coordinate_count;
+					} else if (element_type == ASAP_XML_ELEMENT_GROUP) {
+						// reset the state (start parsing a new group)
+						memset(&parse_state->current_group, 0, sizeof(parse_state->current_group));
+						parse_state->current_group.is_explicitly_defined = true; // (because this group has an XML tag)
+					} else {
+						element_type = ASAP_XML_ELEMENT_NONE;
+					}
+					parse_state->element_type = element_type;
+					if (parse_state->depth < ASAP_XML_MAX_TRACKED_DEPTH) {
+						parse_state->element_stack[parse_state->depth] = element_type;
+					}
+					++parse_state->depth;
+				} break;
+				case YXML_CONTENT: {
+					// element content
+					if (!contentcur) break;
+					char* tmp = x->data;
+					while (*tmp && contentcur < contentbuf_end) {
+						*(contentcur++) = *(tmp++);
+					}
+					if (contentcur == contentbuf_end) {
+						// too long content
+						printf("load_asap_xml_annotations(): encountered a too long XML element content\n");
+						goto failed;
 					}
+					*contentcur = '\0';
+				} break;
+				case YXML_ELEMEND: {
+					// end of an element: '.. />' or '</Tag>'
+					// Note: x->elem already refers to the parent element here, so we keep track of the element ourselves.
+					--parse_state->depth;
+					asap_xml_element_enum element_type = ASAP_XML_ELEMENT_NONE;
+					if (parse_state->depth >= 0 && parse_state->depth < ASAP_XML_MAX_TRACKED_DEPTH) {
+						element_type = parse_state->element_stack[parse_state->depth];
+					}
+					if (element_type == ASAP_XML_ELEMENT_GROUP) {
+						sb_push(parse_state->defined_groups, parse_state->current_group);
+					}
+					parse_state->element_type = ASAP_XML_ELEMENT_NONE;
+				} break;
+				case YXML_ATTRSTART: {
+					// attribute: 'Name=..'
+					attr = asap_xml_lookup_attribute(x->attr);
+					attrcur = attrbuf;
+					*attrcur = '\0';
+				} break;
+				case YXML_ATTRVAL: {
+					// attribute value
+					if (!attrcur) break;
+					char* tmp = x->data;
+					while (*tmp && attrcur < attrbuf_end) {
+						*(attrcur++) = *(tmp++);
+					}
+					if (attrcur == attrbuf_end) {
+						// too long attribute
+						printf("load_asap_xml_annotations(): encountered a too long XML attribute\n");
+						goto failed;
+					}
+					*attrcur = '\0';
+				} break;
+				case YXML_ATTREND: {
+					// end of attribute '.."'
+					if (attrcur && attr != ASAP_XML_ATTRIBUTE_NONE) {
+						if (parse_state->element_type == ASAP_XML_ELEMENT_ANNOTATION) {
+							annotation_set_attribute(parse_state, &sb_last(annotation_set->annotations), attr, attrbuf);
+						} else if (parse_state->element_type == ASAP_XML_ELEMENT_COORDINATE && annotation_set->annotation_count > 0) {
+							coordinate_set_attribute(annotation_set, annotation_set->coordinate_count - 1, attr, attrbuf);
+						} else if (parse_state->element_type == ASAP_XML_ELEMENT_GROUP) {
+							group_set_attribute(&parse_state->current_group, attr, attrbuf);
+						}
+					}
+				} break;
+				case YXML_PISTART:
+				case YXML_PICONTENT:
+				case YXML_PIEND:
+					break; // processing instructions (uninteresting, skip)
+				default: {
+					printf("yxml_parse(): unrecognized token (%d)\n", r);
+					goto failed;
 				}
 			}
 		}
 	}
 
-	annotation_set->filename = strdup(filename);
+	// The order of the groups is: 'None', the groups as defined in the file, and then the groups that are only
+	// referred to (in the order in which they are first referred to).
+	for (i32 i = 0; i < sb_count(parse_state->defined_groups); ++i) {
+		annotation_group_t* parsed_group = parse_state->defined_groups + i;
+		// Check if a group already exists with this name, if not create it
+		i32 group_index = find_annotation_group(annotation_set, parsed_group->name);
+		if (group_index < 0) {
+			group_index = add_annotation_group(annotation_set, parsed_group->name);
+		}
+		// 'Commit' the group with all its attributes
+		memcpy(annotation_set->groups + group_index, parsed_group, sizeof(*parsed_group));
+	}
+	{
+		i32 group_ref_count = sb_count(parse_state->group_refs);
+		i32* group_indices = (i32*) malloc(group_ref_count * sizeof(i32));
+		for (i32 i = 0; i < group_ref_count; ++i) {
+			const char* group_name = parse_state->group_refs[i].name;
+			i32 group_index = find_annotation_group(annotation_set, group_name);
+			if (group_index < 0) {
+				group_index = add_annotation_group(annotation_set, group_name); // Group not found --> create it
+			}
+			group_indices[i] = group_index;
+		}
+		for (i32 i = 0; i < annotation_set->annotation_count; ++i) {
+			annotation_t* annotation = annotation_set->annotations + i;
+			annotation->group_id = group_indices[annotation->group_id];
+		}
+		free(group_indices);
+	}
 	success = true;
-	annotation_set->enabled = true;
-	float seconds_elapsed = get_seconds_elapsed(start, get_clock());
-	printf("Loaded annotations in %g seconds.\n", seconds_elapsed);
 
-	goto cleanup;
-	// return success;
+	failed:
+	free(x);
+	sb_free(parse_state->defined_groups);
+	sb_free(parse_state->group_refs);
+	return success;
+}
+
+// GeoJSON files (e.g. exported from QuPath) are read in chunks and tokenized as they go, without building a document
+// tree: the coordinates of the polygons are written straight into the coordinate storage of the annotation set.
+// A Polygon becomes an annotation (its outer ring; holes are left out), as does each polygon of a MultiPolygon; other
+// geometries (points and lines) are skipped. The classification of a feature becomes its group.
+// Like in the ASAP XML files, the coordinates are in pixels.
+
+#define GEOJSON_READ_BUFFER_SIZE MEGABYTES(1)
+#define GEOJSON_MAX_DEPTH 32
+
+typedef struct geojson_reader_t {
+	FILE* fp;
+	u8* buffer;
+	i64 pos;
+	i64 len;
+	i64 buffer_offset; // in the file
+	bool32 is_at_end; // end of the file, or cancelled
+	bool32 has_error;
+	annotation_load_task_t* task;
+} geojson_reader_t;
+
+typedef struct geojson_parse_state_t {
+	annotation_set_t* annotation_set;
+	i32 finished_annotation_count;
+	i32 skipped_geometry_count;
+} geojson_parse_state_t;
+
+// The properties of a feature, applied to its annotations once the whole feature is read (the properties may come
+// before or after the geometry).
+typedef struct geojson_feature_properties_t {
+	char name[64];
+	char class_name[64];
+	rgba_t class_color;
+	bool32 has_class_color;
+} geojson_feature_properties_t;
+
+static bool32 geojson_refill(geojson_reader_t* r) {
+	if (r->is_at_end) return false;
+	r->buffer_offset += r->len;
+	r->pos = 0;
+	r->len = (i64)fread(r->buffer, 1, GEOJSON_READ_BUFFER_SIZE, r->fp);
+	annotation_load_task_t* task = r->task;
+	if (task) {
+		task->bytes_parsed = r->buffer_offset;
+		if (task->is_cancelled) r->len = 0;
+	}
+	if (r->len == 0) {
+		r->is_at_end = true;
+		return false;
+	}
+	return true;
+}
+
+// Returns -1 at the end of the file.
+static inline i32 geojson_peek_byte(geojson_reader_t* r) {
+	if (r->pos == r->len && !geojson_refill(r)) return -1;
+	return r->buffer[r->pos];
+}
+
+// Skips whitespace, and returns the first byte of the next token (without consuming it).
+static i32 geojson_peek_token(geojson_reader_t* r) {
+	for (;;) {
+		i32 c = geojson_peek_byte(r);
+		if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+			++r->pos;
+		} else {
+			return c;
+		}
+	}
+}
+
+static bool32 geojson_expect(geojson_reader_t* r, char c) {
+	if (geojson_peek_token(r) == c) {
+		++r->pos;
+		return true;
+	}
+	return false;
+}
+
+// Expects to be at the opening quote. The string is decoded into dest (to UTF-8), cut off if it doesn't fit; if dest
+// is NULL, the string is skipped.
+static bool32 geojson_read_string(geojson_reader_t* r, char* dest, i32 dest_size) {
+	if (!geojson_expect(r, '"')) return false;
+	i32 length = 0;
+	for (;;) {
+		i32 c = geojson_peek_byte(r);
+		if (c < 0) return false;
+		++r->pos;
+		if (c == '"') break;
+		if (c == '\\') {
+			c = geojson_peek_byte(r);
+			if (c < 0) return false;
+			++r->pos;
+			switch (c) {
+				case 'b': c = '\b'; break;
+				case 'f': c = '\f'; break;
+				case 'n': c = '\n'; break;
+				case 'r': c = '\r'; break;
+				case 't': c = '\t'; break;
+				case 'u': {
+					u32 code_point = 0;
+					for (i32 i = 0; i < 4; ++i) {
+						i32 h = geojson_peek_byte(r);
+						if (h < 0) return false;
+						++r->pos;
+						u32 digit = (h >= '0' && h <= '9') ? (u32)(h - '0') : (h >= 'a' && h <= 'f') ? (u32)(h - 'a' + 10) :
+						            (h >= 'A' && h <= 'F') ? (u32)(h - 'A' + 10) : 0;
+						code_point = (code_point << 4) | digit;
+					}
+					if (!dest) continue;
+					// Characters outside the Basic Multilingual Plane (surrogate pairs) are not expected in names.
+					if (code_point >= 0xD800 && code_point <= 0xDFFF) code_point = '?';
+					u8 utf8[3];
+					i32 utf8_length;
+					if (code_point < 0x80) {
+						utf8[0] = (u8)code_point;
+						utf8_length = 1;
+					} else if (code_point < 0x800) {
+						utf8[0] = (u8)(0xC0 | (code_point >> 6));
+						utf8[1] = (u8)(0x80 | (code_point & 0x3F));
+						utf8_length = 2;
+					} else {
+						utf8[0] = (u8)(0xE0 | (code_point >> 12));
+						utf8[1] = (u8)(0x80 | ((code_point >> 6) & 0x3F));
+						utf8[2] = (u8)(0x80 | (code_point & 0x3F));
+						utf8_length = 3;
+					}
+					if (length + utf8_length < dest_size) {
+						memcpy(dest + length, utf8, utf8_length);
+						length += utf8_length;
+					}
+					continue;
+				}
+				default: break; // '"', '\\' and '/' stand for themselves
+			}
+		}
+		if (dest && length + 1 < dest_size) {
+			dest[length++] = (char)c;
+		}
+	}
+	if (dest) dest[length] = '\0';
+	return true;
+}
+
+static bool32 geojson_read_number(geojson_reader_t* r, double* value) {
+	char buf[64];
+	i32 length = 0;
+	for (i32 c = geojson_peek_token(r); (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+	     c = geojson_peek_byte(r)) {
+		if (length + 1 >= (i32)sizeof(buf)) return false;
+		buf[length++] = (char)c;
+		++r->pos;
+	}
+	if (length == 0) return false;
+	buf[length] = '\0';
+	*value = asap_xml_parse_double(buf);
+	return true;
+}
+
+static bool32 geojson_skip_value(geojson_reader_t* r) {
+	i32 c = geojson_peek_token(r);
+	if (c == '"') {
+		return geojson_read_string(r, NULL, 0);
+	} else if (c == '{' || c == '[') {
+		i32 depth = 0;
+		for (;;) {
+			c = geojson_peek_byte(r);
+			if (c < 0) return false;
+			if (c == '"') {
+				if (!geojson_read_string(r, NULL, 0)) return false;
+				continue;
+			}
+			++r->pos;
+			if (c == '{' || c == '[') {
+				++depth;
+			} else if (c == '}' || c == ']') {
+				if (--depth == 0) return true;
+			}
+		}
+	} else {
+		// number, true, false or null
+		i32 length = 0;
+		for (; c >= 0 && c != ',' && c != '}' && c != ']' && c != ' ' && c != '\t' && c != '\n' && c != '\r';
+		     c = geojson_peek_byte(r)) {
+			++r->pos;
+			++length;
+		}
+		return length > 0;
+	}
+}
+
+// Reads the key of the next member of an object (after the opening brace), leaving the value to the caller.
+// Returns false at the closing brace, or if the object is malformed (then has_error is set).
+static bool32 geojson_next_member(geojson_reader_t* r, bool32* is_first, char* key, i32 key_size) {
+	if (geojson_expect(r, '}')) return false;
+	if ((!*is_first && !geojson_expect(r, ',')) || !geojson_read_string(r, key, key_size) || !geojson_expect(r, ':')) {
+		r->has_error = true;
+		return false;
+	}
+	*is_first = false;
+	return true;
+}
+
+static rgba_t geojson_parse_packed_color(double value) {
+	u32 packed = (u32)(i32)value; // QuPath stores the color as a signed ARGB integer
+	rgba_t rgba = {(u8)(packed >> 16), (u8)(packed >> 8), (u8)packed, 255};
+	return rgba;
+}
+
+static bool32 geojson_parse_color_array(geojson_reader_t* r, rgba_t* color) {
+	double components[3] = {};
+	i32 count = 0;
+	if (!geojson_expect(r, '[')) return false;
+	while (!geojson_expect(r, ']')) {
+		if (count > 0 && !geojson_expect(r, ',')) return false;
+		double value;
+		if (!geojson_read_number(r, &value)) return false;
+		if (count < 3) components[count] = ATMOST(255.0, ATLEAST(0.0, value));
+		++count;
+	}
+	rgba_t rgba = {(u8)components[0], (u8)components[1], (u8)components[2], 255};
+	*color = rgba;
+	return true;
+}
+
+// QuPath: "classification": {"name": "Tumor", "color": [200, 0, 0]} (older versions: "colorRGB": -3670016)
+static bool32 geojson_parse_classification(geojson_reader_t* r, geojson_feature_properties_t* properties) {
+	if (geojson_peek_token(r) == '"') {
+		return geojson_read_string(r, properties->class_name, sizeof(properties->class_name));
+	} else if (geojson_peek_token(r) != '{') {
+		return geojson_skip_value(r);
+	}
+	++r->pos;
+	bool32 is_first = true;
+	char key[32];
+	while (geojson_next_member(r, &is_first, key, sizeof(key))) {
+		bool32 ok;
+		if (strcmp(key, "name") == 0 && geojson_peek_token(r) == '"') {
+			ok = geojson_read_string(r, properties->class_name, sizeof(properties->class_name));
+		} else if (strcmp(key, "color") == 0 && geojson_peek_token(r) == '[') {
+			ok = geojson_parse_color_array(r, &properties->class_color);
+			properties->has_class_color = true;
+		} else if (strcmp(key, "colorRGB") == 0 && geojson_peek_token(r) != 'n') {
+			double value = 0.0;
+			ok = geojson_read_number(r, &value);
+			properties->class_color = geojson_parse_packed_color(value);
+			properties->has_class_color = true;
+		} else {
+			ok = geojson_skip_value(r);
+		}
+		if (!ok) return false;
+	}
+	return !r->has_error;
+}
+
+static bool32 geojson_parse_properties(geojson_reader_t* r, geojson_feature_properties_t* properties) {
+	if (geojson_peek_token(r) != '{') return geojson_skip_value(r);
+	++r->pos;
+	bool32 is_first = true;
+	char key[32];
+	while (geojson_next_member(r, &is_first, key, sizeof(key))) {
+		bool32 ok;
+		if (strcmp(key, "name") == 0 && geojson_peek_token(r) == '"') {
+			ok = geojson_read_string(r, properties->name, sizeof(properties->name));
+		} else if (strcmp(key, "classification") == 0) {
+			ok = geojson_parse_classification(r, properties);
+		} else {
+			ok = geojson_skip_value(r);
+		}
+		if (!ok) return false;
+	}
+	return !r->has_error;
+}
+
+// Closes the outline: the last position of a GeoJSON ring repeats the first one.
+static void geojson_finish_ring(annotation_set_t* annotation_set) {
+	annotation_t* annotation = &sb_last(annotation_set->annotations);
+	i32 first = annotation->first_coordinate;
+	i32 last = first + annotation->coordinate_count - 1;
+	if (annotation->coordinate_count > 1 && annotation_set->coordinate_x[first] == annotation_set->coordinate_x[last] &&
+	    annotation_set->coordinate_y[first] == annotation_set->coordinate_y[last]) {
+		--sb_raw_count(annotation_set->coordinate_x);
+		--sb_raw_count(annotation_set->coordinate_y);
+		--annotation_set->coordinate_count;
+		--annotation->coordinate_count;
+	}
+}
+
+// The nesting depth of the numbers tells what the geometry is, so it doesn't matter if "type" comes after
+// "coordinates": 3 for a Polygon ([ring][position][x, y]), 4 for a MultiPolygon. The outer ring of a polygon is the
+// first one.
+static bool32 geojson_parse_coordinates(geojson_reader_t* r, geojson_parse_state_t* state, bool32 may_be_polygon) {
+	annotation_set_t* annotation_set = state->annotation_set;
+	i32 element_index[GEOJSON_MAX_DEPTH];
+	i32 depth = 0;
+	i32 number_depth = 0; // not known until the first number
+	bool32 is_polygon = false;
+	bool32 is_in_outer_ring = false;
+	float x = 0.0f;
+	v2f mpp = get_annotation_set_mpp(annotation_set);
+	do {
+		i32 c = geojson_peek_token(r);
+		if (c == '[') {
+			++r->pos;
+			if (depth == GEOJSON_MAX_DEPTH) return false;
+			element_index[depth++] = 0;
+		} else if (c == ']') {
+			++r->pos;
+			if (depth == 0) return false;
+			--depth;
+			if (is_in_outer_ring && depth == number_depth - 2) {
+				geojson_finish_ring(annotation_set);
+				is_in_outer_ring = false;
+			}
+		} else if (c == ',') {
+			++r->pos;
+			if (depth == 0) return false;
+			++element_index[depth - 1];
+		} else {
+			double value;
+			if (depth == 0 || !geojson_read_number(r, &value)) return false;
+			if (number_depth == 0) {
+				number_depth = depth;
+				is_polygon = may_be_polygon && (number_depth == 3 || number_depth == 4);
+				if (!is_polygon) ++state->skipped_geometry_count;
+			}
+			if (depth != number_depth) return false;
+			if (!is_polygon) continue;
+			i32 component = element_index[depth - 1];
+			i32 position_index = element_index[depth - 2];
+			i32 ring_index = element_index[depth - 3];
+			// QuPath stores pixels of the full resolution level (like ASAP, see coordinate_set_attribute())
+			if (component == 0) {
+				x = (float)(value * mpp.x);
+			} else if (component == 1 && ring_index == 0) {
+				if (position_index == 0) {
+					annotation_t new_annotation = {};
+					new_annotation.type = ANNOTATION_POLYGON;
+					new_annotation.first_coordinate = annotation_set->coordinate_count;
+					new_annotation.has_coordinates = true;
+					sb_push(annotation_set->annotations, new_annotation);
+					++annotation_set->annotation_count;
+					is_in_outer_ring = true;
+				}
+				sb_push(annotation_set->coordinate_x, x);
+				sb_push(annotation_set->coordinate_y, (float)(value * mpp.y));
+				++annotation_set->coordinate_count;
+				++sb_last(annotation_set->annotations).coordinate_count;
+			}
+		}
+	} while (depth > 0);
+	return true;
+}
+
+static bool32 geojson_parse_object(geojson_reader_t* r, geojson_parse_state_t* state, i32 depth);
+
+// The elements of "features" and "geometries".
+static bool32 geojson_parse_object_array(geojson_reader_t* r, geojson_parse_state_t* state, i32 depth,
+                                         bool32 is_feature_array) {
+	if (!geojson_expect(r, '[')) return false;
+	bool32 is_first = true;
+	while (!geojson_expect(r, ']')) {
+		if (!is_first && !geojson_expect(r, ',')) return false;
+		is_first = false;
+		if (!geojson_parse_object(r, state, depth + 1)) return false;
+		if (is_feature_array) {
+			state->finished_annotation_count = state->annotation_set->annotation_count;
+			if (r->task) {
+				maybe_publish_annotation_load_batch(r->task, state->annotation_set, state->finished_annotation_count);
+			}
+		}
+	}
+	return true;
+}
+
+// Handles a FeatureCollection, a Feature and a geometry alike: each of them is an object with some of the members
+// below.
+static bool32 geojson_parse_object(geojson_reader_t* r, geojson_parse_state_t* state, i32 depth) {
+	if (depth >= GEOJSON_MAX_DEPTH) return false;
+	if (geojson_peek_token(r) != '{') return geojson_skip_value(r); // e.g. "geometry": null
+	++r->pos;
+	annotation_set_t* annotation_set = state->annotation_set;
+	i32 first_annotation = annotation_set->annotation_count;
+	geojson_feature_properties_t properties = {};
+	bool32 has_properties = false;
+	char type[32] = "";
+	bool32 is_first = true;
+	char key[32];
+	while (geojson_next_member(r, &is_first, key, sizeof(key))) {
+		bool32 ok;
+		if (strcmp(key, "type") == 0 && geojson_peek_token(r) == '"') {
+			ok = geojson_read_string(r, type, sizeof(type));
+		} else if (strcmp(key, "features") == 0) {
+			ok = geojson_parse_object_array(r, state, depth, true);
+		} else if (strcmp(key, "geometries") == 0) {
+			ok = geojson_parse_object_array(r, state, depth, false);
+		} else if (strcmp(key, "geometry") == 0) {
+			ok = geojson_parse_object(r, state, depth + 1);
+		} else if (strcmp(key, "coordinates") == 0) {
+			bool32 may_be_polygon = (type[0] == '\0' || strcmp(type, "Polygon") == 0 || strcmp(type, "MultiPolygon") == 0);
+			ok = geojson_parse_coordinates(r, state, may_be_polygon);
+		} else if (strcmp(key, "properties") == 0) {
+			ok = geojson_parse_properties(r, &properties);
+			has_properties = true;
+		} else {
+			ok = geojson_skip_value(r);
+		}
+		if (!ok) return false;
+	}
+	if (r->has_error) return false;
+	if (has_properties && annotation_set->annotation_count > first_annotation) {
+		i32 group_id = 0; // "None"
+		if (properties.class_name[0] != '\0') {
+			group_id = find_annotation_group(annotation_set, properties.class_name);
+			if (group_id < 0) {
+				group_id = add_annotation_group(annotation_set, properties.class_name);
+				annotation_group_t* group = annotation_set->groups + group_id;
+				if (properties.has_class_color) group->color = properties.class_color;
+				group->is_explicitly_defined = true;
+			}
+		}
+		for (i32 i = first_annotation; i < annotation_set->annotation_count; ++i) {
+			annotation_t* annotation = annotation_set->annotations + i;
+			annotation->group_id = group_id;
+			strncpy(annotation->name, properties.name, sizeof(annotation->name));
+		}
+	}
+	return true;
+}
+
+// The top level is a FeatureCollection, a single Feature, or (e.g. in QuPath's 'export as array') an array of Features.
+static bool32 parse_geojson_annotations(annotation_set_t* annotation_set, const char* filename,
+                                        annotation_load_task_t* task) {
+	FILE* fp = fopen64(filename, "rb");
+	if (!fp) return false;
+	if (task) {
+		fseeko64(fp, 0, SEEK_END);
+		task->total_bytes = ftello64(fp);
+		fseeko64(fp, 0, SEEK_SET);
+	}
+	geojson_reader_t reader = {};
+	geojson_reader_t* r = &reader;
+	r->fp = fp;
+	r->buffer = (u8*) malloc(GEOJSON_READ_BUFFER_SIZE);
+	r->task = task;
+	geojson_parse_state_t state = {};
+	state.annotation_set = annotation_set;
+
+	bool32 success;
+	if (geojson_peek_token(r) == '[') {
+		success = geojson_parse_object_array(r, &state, 0, true);
+	} else {
+		success = geojson_parse_object(r, &state, 0);
+	}
+	if (success && geojson_peek_token(r) >= 0) {
+		success = false; // something after the end of the document
+	}
+	if (task && task->is_cancelled) {
+		success = false;
+	} else if (!success) {
+		printf("parse_geojson_annotations(): error at byte %lld\n", (long long)(r->buffer_offset + r->pos));
+	} else if (state.skipped_geometry_count > 0) {
+		printf("parse_geojson_annotations(): skipped %d geometries that are not polygons\n", state.skipped_geometry_count);
+	}
+	free(r->buffer);
+	fclose(fp);
+	return success;
+}
+
+static bool32 is_geojson_filename(const char* filename) {
+	return strcasecmp(get_file_extension(filename), "geojson") == 0;
+}
+
+// Reads and parses the file, and prepares everything else that can be done off the main thread.
+// If the binary sidecar is up to date, that is loaded instead of the XML or GeoJSON file; otherwise the sidecar is
+// (re)created.
+static void run_annotation_load_task(annotation_load_task_t* task) {
+	i64 start = get_clock();
+	annotation_set_t* annotation_set = &task->result;
+	annotation_set->mpp = task->mpp;
+	unload_and_reinit_annotations(annotation_set);
+	task->success = false;
+
+	bool32 parsed = false;
+	if (load_annotation_sidecar(annotation_set, task->filename)) {
+		parsed = true;
+	} else {
+		unload_and_reinit_annotations(annotation_set);
+		if (is_geojson_filename(task->filename)) {
+			parsed = parse_geojson_annotations(annotation_set, task->filename, task);
+		} else {
+			mem_t* file = platform_read_entire_file(task->filename);
+			if (file) {
+				task->total_bytes = file->len;
+				parsed = parse_asap_xml_annotations(annotation_set, (char*) file->data, file->len, task);
+				free(file);
+			}
+		}
+		if (parsed) {
+			write_annotation_sidecar(annotation_set, task->filename);
+		}
+	}
+	if (parsed) {
+		annotation_set->filename = strdup(task->filename);
+		maybe_compact_annotations(annotation_set); // deletions played back from the sidecar
+		build_annotation_index(annotation_set);
+		if (task->published_annotation_count > 0) {
+			// (the batches that were handed over already have theirs)
+			build_annotation_lods_for_range(annotation_set, task->published_annotation_count,
+			                                annotation_set->annotation_count);
+		} else {
+			build_annotation_lods(annotation_set);
+		}
+		annotation_set->needs_geometry_upload = true;
+		annotation_set->enabled = true;
+		task->success = true;
+		float seconds_elapsed = get_seconds_elapsed(start, get_clock());
+		printf("Loaded annotations in %g seconds.\n", seconds_elapsed);
+	} else {
+		destroy_annotation_set(annotation_set);
+	}
+	task->bytes_parsed = task->total_bytes;
+}
+
+static void annotation_load_task_func(i32 logical_thread_index, void* userdata) {
+	annotation_load_task_t* task = (annotation_load_task_t*) userdata;
+	run_annotation_load_task(task);
+	write_barrier;
+	task->is_done = true;
+}
+
+static void destroy_annotation_load_task(annotation_load_task_t* task) {
+	for (i32 i = task->batches_applied; i < task->batch_count; ++i) {
+		destroy_annotation_load_batch(task->batches[i]);
+	}
+	destroy_annotation_set(&task->result);
+	free(task->filename);
+	free(task);
+}
+
+// Replaces the annotations of the displayed image (scene 0) with the loaded ones.
+static void apply_loaded_annotations(app_state_t* app_state, annotation_load_task_t* task) {
+	annotation_set_t* annotation_set = &app_state->scenes[0].annotation_set;
+	destroy_annotation_set(annotation_set);
+	*annotation_set = task->result;
+	memset(&task->result, 0, sizeof(task->result)); // ownership moved
+}
+
+// The annotations are placed on the image that is displayed in scene 0.
+static v2f get_displayed_image_mpp(app_state_t* app_state) {
+	v2f mpp = {ANNOTATION_DEFAULT_MPP, ANNOTATION_DEFAULT_MPP};
+	if (app_state->displayed_image >= 0 && app_state->displayed_image < sb_count(app_state->loaded_images)) {
+		image_t* image = app_state->loaded_images[app_state->displayed_image];
+		if (image->mpp_x > 0.0f && image->mpp_y > 0.0f) {
+			mpp.x = image->mpp_x;
+			mpp.y = image->mpp_y;
+		}
+	}
+	return mpp;
+}
+
+// Loads the annotations into the given annotation set (with its mpp), which is left alone if loading fails.
+bool32 load_asap_xml_annotation_set(annotation_set_t* annotation_set, const char* filename) {
+	annotation_load_task_t* task = (annotation_load_task_t*) calloc(1, sizeof(annotation_load_task_t));
+	task->filename = strdup(filename);
+	task->mpp = get_annotation_set_mpp(annotation_set);
+	run_annotation_load_task(task);
+	bool32 success = task->success;
+	if (success) {
+		destroy_annotation_set(annotation_set);
+		*annotation_set = task->result;
+		memset(&task->result, 0, sizeof(task->result)); // ownership moved
+	}
+	destroy_annotation_load_task(task);
+	return success;
+}
+
+bool32 load_asap_xml_annotations(app_state_t* app_state, const char* filename) {
+	cancel_background_annotation_loads();
+	annotation_set_t* annotation_set = &app_state->scenes[0].annotation_set;
+	annotation_set->mpp = get_displayed_image_mpp(app_state);
+	bool32 success = load_asap_xml_annotation_set(annotation_set, filename);
+	if (!success) {
+		unload_and_reinit_annotations(annotation_set);
+	}
+	return success;
+}
+
+// The annotations are replaced once loading has finished (the old ones stay visible until then), or for GeoJSON files
+// once the first batch comes in.
+void load_annotations_in_background(app_state_t* app_state, const char* filename) {
+	cancel_background_annotation_loads(); // only the most recently requested file is shown
+	annotation_load_task_t* task = (annotation_load_task_t*) calloc(1, sizeof(annotation_load_task_t));
+	task->filename = strdup(filename);
+	task->mpp = get_displayed_image_mpp(app_state);
+	task->is_incremental = is_geojson_filename(filename);
+	if (!add_work_queue_entry(&work_queue, annotation_load_task_func, task)) {
+		annotation_load_task_func(0, task); // queue is full, do it now
+	}
+	sb_push(annotation_load_tasks, task);
+}
+
+void cancel_background_annotation_loads() {
+	for (i32 i = 0; i < sb_count(annotation_load_tasks); ++i) {
+		annotation_load_tasks[i]->is_cancelled = true;
+	}
+}
+
+// Needs to be called every frame, on the main thread: hands over batches and finished loads, and cleans up cancelled
+// ones.
+void update_background_annotation_loads(app_state_t* app_state) {
+	i32 i = 0;
+	while (i < sb_count(annotation_load_tasks)) {
+		annotation_load_task_t* task = annotation_load_tasks[i];
+		i32 batch_count = task->batch_count;
+		if (!task->is_cancelled && task->batches_applied < batch_count) {
+			read_barrier;
+			annotation_set_t* annotation_set = &app_state->scenes[0].annotation_set;
+			if (task->batches_applied == 0) {
+				unload_and_reinit_annotations(annotation_set);
+				annotation_set->mpp = task->mpp;
+				annotation_set->enabled = true;
+			}
+			for (; task->batches_applied < batch_count; ++task->batches_applied) {
+				annotation_load_batch_t* batch = task->batches[task->batches_applied];
+				apply_annotation_load_batch(annotation_set, batch);
+				destroy_annotation_load_batch(batch);
+			}
+		}
+		if (!task->is_done) {
+			++i;
+			continue;
+		}
+		read_barrier;
+		if (!task->is_cancelled) {
+			if (task->success) {
+				apply_loaded_annotations(app_state, task);
+			} else {
+				printf("Could not load annotations from '%s'\n", task->filename);
+			}
+		}
+		destroy_annotation_load_task(task);
+		annotation_load_tasks[i] = sb_last(annotation_load_tasks);
+		--sb_raw_count(annotation_load_tasks);
+	}
+}
+
+// Returns false if no annotations are being loaded.
+bool32 get_background_annotation_load_progress(float* progress) {
+	for (i32 i = 0; i < sb_count(annotation_load_tasks); ++i) {
+		annotation_load_task_t* task = annotation_load_tasks[i];
+		if (task->is_cancelled || task->is_done) continue;
+		i64 total_bytes = task->total_bytes;
+		*progress = (total_bytes > 0) ? (float)((double)task->bytes_parsed / (double)total_bytes) : 0.0f;
+		return true;
+	}
+	return false;
 }
 
 const char* get_annotation_type_name(annotation_type_enum type) {
@@ -646,6 +2198,7 @@ void asap_xml_print_color(char* buf, size_t bufsize, rgba_t rgba) {
 
 void save_asap_xml_annotations(annotation_set_t* annotation_set, const char* filename_out) {
 	ASSERT(annotation_set);
+	v2f mpp = get_annotation_set_mpp(annotation_set); // micrometers back to pixels
 	FILE* fp = fopen(filename_out, "wb");
 	if (fp) {
 //		const char* base_tag = "<ASAP_Annotations><Annotations>";
@@ -673,6 +2226,7 @@ void save_asap_xml_annotations(annotation_set_t* annotation_set, const char* fil
 
 		for (i32 annotation_index = 0; annotation_index < annotation_set->annotation_count; ++annotation_index) {
 			annotation_t* annotation = annotation_set->annotations + annotation_index;
+			if (annotation->deleted) continue;
 			char color_buf[32];
 			asap_xml_print_color(color_buf, sizeof(color_buf), annotation->color);
 
@@ -685,8 +2239,9 @@ void save_asap_xml_annotations(annotation_set_t* annotation_set, const char* fil
 			if (annotation->has_coordinates) {
 				fprintf(fp, "<Coordinates>");
 				for (i32 coordinate_index = 0; coordinate_index < annotation->coordinate_count; ++coordinate_index) {
-					coordinate_t* coordinate = annotation_set->coordinates + annotation->first_coordinate + coordinate_index;
-					fprintf(fp, "<Coordinate Order=\"%d\" X=\"%g\" Y=\"%g\" />", coordinate_index, coordinate->x / 0.25, coordinate->y / 0.25);
+					float x = annotation_set->coordinate_x[annotation->first_coordinate + coordinate_index];
+					float y = annotation_set->coordinate_y[annotation->first_coordinate + coordinate_index];
+					fprintf(fp, "<Coordinate Order=\"%d\" X=\"%g\" Y=\"%g\" />", coordinate_index, x / mpp.x, y / mpp.y);
 				}
 				fprintf(fp, "</Coordinates>");
 			}
@@ -703,9 +2258,88 @@ void save_asap_xml_annotations(annotation_set_t* annotation_set, const char* fil
 	}
 }
 
+// Autosaving happens on a worker thread, so that writing the sidecar never holds up a frame. The task gets its own
+// copy of what needs to be written: either the pending edit records, or (for a new snapshot) the annotations and
+// groups. The coordinates are shared with the task instead of copied, because they never change after loading; the
+// annotation set waits for the task before freeing them (see destroy_annotation_set()).
+typedef struct annotation_save_task_t {
+	annotation_set_t* annotation_set; // only used to report back (saves_in_flight, sidecar_save_failed)
+	char* filename;
+	annotation_set_t snapshot; // shallow copy, only valid if is_snapshot
+	bool32 is_snapshot;
+	u8* records; // sb
+	i64 offset;
+} annotation_save_task_t;
+
+static void annotation_save_task_func(i32 logical_thread_index, void* userdata) {
+	annotation_save_task_t* task = (annotation_save_task_t*) userdata;
+	bool32 ok;
+	if (task->is_snapshot) {
+		ok = write_annotation_sidecar(&task->snapshot, task->filename);
+		free(task->snapshot.annotations);
+		free(task->snapshot.groups);
+	} else {
+		ok = append_annotation_sidecar_records(task->filename, task->offset, task->records, sb_count(task->records));
+		sb_free(task->records);
+	}
+	if (!ok) {
+		task->annotation_set->sidecar_save_failed = true;
+	}
+	free(task->filename);
+	annotation_set_t* annotation_set = task->annotation_set;
+	free(task);
+	write_barrier;
+	interlocked_decrement(&annotation_set->saves_in_flight);
+}
+
+static void save_annotations_in_background(annotation_set_t* annotation_set) {
+	annotation_save_task_t* task = (annotation_save_task_t*) calloc(1, sizeof(annotation_save_task_t));
+	task->annotation_set = annotation_set;
+	task->filename = strdup(annotation_set->filename);
+
+	i64 pending_size = annotation_set->pending_edits ? sb_count(annotation_set->pending_edits) : 0;
+	i64 snapshot_size = get_annotation_sidecar_snapshot_size(annotation_set);
+	// Once the edit log outgrows the annotations themselves, a new snapshot is smaller and faster to load.
+	// After a failed write the state of the file on disk is unknown, so also start over with a snapshot.
+	task->is_snapshot = annotation_set->sidecar_file_size == 0 || annotation_set->sidecar_save_failed ||
+	                    annotation_set->sidecar_edit_size + pending_size > snapshot_size;
+	annotation_set->sidecar_save_failed = false;
+	if (task->is_snapshot) {
+		compact_annotations(annotation_set); // the snapshot only has room for the annotations that are left
+		snapshot_size = get_annotation_sidecar_snapshot_size(annotation_set);
+		task->snapshot = *annotation_set;
+		size_t annotations_size = annotation_set->annotation_count * sizeof(annotation_t);
+		size_t groups_size = annotation_set->group_count * sizeof(annotation_group_t);
+		task->snapshot.annotations = (annotation_t*) malloc(annotations_size);
+		task->snapshot.groups = (annotation_group_t*) malloc(groups_size);
+		memcpy(task->snapshot.annotations, annotation_set->annotations, annotations_size);
+		memcpy(task->snapshot.groups, annotation_set->groups, groups_size);
+		annotation_set->sidecar_snapshot_size = snapshot_size;
+		annotation_set->sidecar_edit_size = 0;
+		annotation_set->sidecar_file_size = snapshot_size;
+	} else {
+		task->offset = annotation_set->sidecar_file_size;
+		task->records = annotation_set->pending_edits; // ownership moved to the task
+		annotation_set->pending_edits = NULL;
+		annotation_set->sidecar_edit_size += pending_size;
+		annotation_set->sidecar_file_size += pending_size;
+	}
+	if (annotation_set->pending_edits) {
+		sb_raw_count(annotation_set->pending_edits) = 0;
+	}
+
+	interlocked_increment(&annotation_set->saves_in_flight);
+	if (!add_work_queue_entry(&work_queue, annotation_save_task_func, task)) {
+		annotation_save_task_func(0, task);
+	}
+}
+
 void autosave_annotations(app_state_t* app_state, annotation_set_t* annotation_set, bool force_ignore_delay) {
-	if (!annotation_set->modified) return; // no changes, nothing to do
+	if (!annotation_set->modified && !annotation_set->sidecar_save_failed) return; // no changes, nothing to do
 	if (!annotation_set->filename) return; // don't know where to save to / file doesn't already exist (?)
+	// The sidecar is written by a single task at a time; the records of later edits have to come after it.
+	if (annotation_set->saves_in_flight > 0 && !force_ignore_delay) return;
+	wait_for_annotation_saves(annotation_set);
 
 	bool proceed = force_ignore_delay;
 	if (!force_ignore_delay) {
@@ -716,13 +2350,41 @@ void autosave_annotations(app_state_t* app_state, annotation_set_t* annotation_s
 		}
 	}
 	if (proceed) {
-		char backup_filename[4096];
-		snprintf(backup_filename, sizeof(backup_filename), "%s.orig", annotation_set->filename);
-		if (!file_exists(backup_filename)) {
-			rename(annotation_set->filename, backup_filename);
+		// Only the edits are saved (to the sidecar); the XML file is left alone until it is exported.
+		save_annotations_in_background(annotation_set);
+		annotation_set->modified = false;
+		if (force_ignore_delay) {
+			wait_for_annotation_saves(annotation_set); // e.g. when quitting
 		}
-		save_asap_xml_annotations(annotation_set, annotation_set->filename);
+	}
+}
+
+// Writes the annotations back to the XML file they were loaded from (keeping the original as a backup).
+// Annotations loaded from a GeoJSON file are written to an XML file next to it; the GeoJSON file is left alone.
+bool32 export_asap_xml_annotations(annotation_set_t* annotation_set) {
+	if (!annotation_set->filename) return false;
+	wait_for_annotation_saves(annotation_set);
+	if (is_geojson_filename(annotation_set->filename)) {
+		char xml_filename[4096];
+		strncpy(xml_filename, annotation_set->filename, sizeof(xml_filename) - 1);
+		xml_filename[sizeof(xml_filename) - 1] = '\0';
+		replace_file_extension(xml_filename, sizeof(xml_filename), "xml");
+		save_asap_xml_annotations(annotation_set, xml_filename);
+		return true;
+	}
+	char backup_filename[4096];
+	snprintf(backup_filename, sizeof(backup_filename), "%s.orig", annotation_set->filename);
+	if (!file_exists(backup_filename)) {
+		rename(annotation_set->filename, backup_filename);
+	}
+	save_asap_xml_annotations(annotation_set, annotation_set->filename);
+	compact_annotations(annotation_set);
+	// The XML file has changed, so the sidecar needs a new snapshot to still be valid.
+	bool32 success = write_annotation_sidecar(annotation_set, annotation_set->filename);
+	if (success) {
 		annotation_set->modified = false;
+		annotation_set->sidecar_save_failed = false;
 	}
+	return success;
 }
 
@@ -49,8 +49,14 @@ typedef enum asap_xml_attribute_enum {
 	ASAP_XML_ATTRIBUTE_TYPE = 4,
 	ASAP_XML_ATTRIBUTE_X = 5,
 	ASAP_XML_ATTRIBUTE_Y = 6,
+	ASAP_XML_ATTRIBUTE_ORDER = 7,
 } asap_xml_attribute_enum;
 
+// Simplified outlines for drawing when zoomed out: level k is accurate to within ANNOTATION_LOD_BASE_TOLERANCE * 2^k
+// micrometers (see build_annotation_lods()).
+#define ANNOTATION_LOD_COUNT 12
+#define ANNOTATION_LOD_BASE_TOLERANCE 0.25f
+
 typedef struct annotation_t {
 	annotation_type_enum type;
 	char name[64];
@@ -60,15 +66,15 @@ typedef struct annotation_t {
 	i32 coordinate_count;
 	bool8 has_coordinates;
 	bool8 selected;
+	bool8 deleted; // kept in place until the annotations are compacted (see compact_annotations())
+	v2f bounds_min; // bounding box of the coordinates, for culling
+	v2f bounds_max;
+	i32 lod_first_point[ANNOTATION_LOD_COUNT]; // index into annotation_set_t.lod_points
+	i32 lod_point_count[ANNOTATION_LOD_COUNT];
+	float area; // in square micrometers, once measured (see annotation_statistics.cpp)
+	float perimeter; // in micrometers
 } annotation_t;
 
-typedef struct coordinate_t {
-	i32 order;
-	double x;
-	double y;
-	bool8 selected;
-} coordinate_t;
-
 typedef struct annotation_group_t {
 	char name[64];
 	rgba_t color;
@@ -76,28 +82,119 @@ typedef struct annotation_group_t {
 	bool8 selected;
 } annotation_group_t;
 
+// A line segment of an annotation outline (polygons and rectangles are closed, so the last segment goes back to the
+// first coordinate).
+typedef struct annotation_segment_t {
+	v2f p0;
+	v2f p1;
+	i32 annotation_index; // -1 if the annotation has been deleted
+} annotation_segment_t;
+
+// Node of the bounding volume hierarchy. A leaf refers to a range of segments; an inner node has two children,
+// stored next to each other.
+typedef struct annotation_index_node_t {
+	v2f min;
+	v2f max;
+	i32 first; // leaf: the first segment; inner node: the first child node
+	i32 count; // leaf: the number of segments; 0 for inner nodes
+} annotation_index_node_t;
+
+// Spatial index over the segments of all annotations, for hit-testing (see find_nearest_annotation()).
+typedef struct annotation_index_t {
+	annotation_segment_t* segments; // sb
+	annotation_index_node_t* nodes; // sb, nodes[0] is the root
+} annotation_index_t;
+
+typedef struct annotation_group_statistics_t {
+	i32 annotation_count;
+	double area; // in square micrometers
+	double perimeter; // in micrometers
+} annotation_group_statistics_t;
+
+#define ANNOTATION_DEFAULT_MPP 0.25f // if the image that the annotations belong to is not known
+
 typedef struct annotation_set_t {
 	annotation_t* annotations; // sb
-	i32 annotation_count;
-	coordinate_t* coordinates; // sb
+	i32 annotation_count; // including the deleted annotations
+	i32 deleted_annotation_count;
+	// The coordinates of all annotations (in micrometers), as separate x and y arrays. An annotation refers to its
+	// coordinates by first_coordinate and coordinate_count.
+	float* coordinate_x; // sb
+	float* coordinate_y; // sb
 	i32 coordinate_count;
+	i32 deleted_coordinate_count; // coordinates of deleted annotations, left over until compaction
 	annotation_group_t* groups; // sb
 	i32 group_count;
 	bool enabled;
 	char* filename;
 	bool modified;
 	i64 last_modification_time;
+	annotation_index_t index;
+	v2f* lod_points; // sb
+	bool32 needs_geometry_upload; // the outlines changed (see draw_annotations())
+	bool32 needs_attribute_upload; // the colors or the selection changed
+	bool32 is_geometry_on_gpu;
+	u8* pending_edits; // sb, edit records not yet saved to the sidecar (see annotation_sidecar.h)
+	i64 sidecar_snapshot_size;
+	i64 sidecar_edit_size;
+	i64 sidecar_file_size; // 0 if there is no sidecar yet
+	volatile i32 saves_in_flight; // autosaves still being written on a worker thread
+	volatile i32 sidecar_save_failed; // set by the worker; the next autosave then writes a new snapshot
+	i32 measured_annotation_count; // the annotations before this one have their area and perimeter
+	struct annotation_statistics_job_t* statistics_job; // measuring the rest on worker threads
+	annotation_group_statistics_t* group_statistics; // sb, one for each group
+	bool32 are_group_statistics_dirty;
+	// Micrometers per pixel of the image that the annotations belong to. The files (and the sidecar) store the
+	// coordinates in pixels of the full resolution level; they are converted with this when loaded and saved.
+	v2f mpp;
 } annotation_set_t;
 
-void draw_annotations(annotation_set_t* annotation_set, v2f camera_min, float screen_um_per_pixel);
+static inline v2f get_annotation_set_mpp(annotation_set_t* annotation_set) {
+	v2f mpp = annotation_set->mpp;
+	if (!(mpp.x > 0.0f && mpp.y > 0.0f)) {
+		mpp.x = ANNOTATION_DEFAULT_MPP;
+		mpp.y = ANNOTATION_DEFAULT_MPP;
+	}
+	return mpp;
+}
+
+// Parameters of the annotation stress test (see annotation_stress.cpp), run with --annotation-stress N M K or from
+// View > Debug. The test runs in the frame after is_pending is set.
+typedef struct annotation_stress_params_t {
+	i32 annotation_count;
+	i32 vertex_count; // per annotation
+	i32 group_count;
+	bool32 is_pending;
+	bool32 quit_when_done; // e.g. when started from the command line
+} annotation_stress_params_t;
+
+void draw_annotations(annotation_set_t* annotation_set, v2f camera_min, float screen_um_per_pixel, rect2i viewport,
+                      rect2i client_viewport);
+void build_annotation_index(annotation_set_t* annotation_set);
+void build_annotation_lods(annotation_set_t* annotation_set);
 i32 find_nearest_annotation(annotation_set_t* annotation_set, float x, float y, float* distance_ptr);
+void remove_selected_annotations(annotation_set_t* annotation_set);
+void compact_annotations(annotation_set_t* annotation_set);
 void delete_selected_annotations(annotation_set_t* annotation_set);
 i32 select_annotation(scene_t* scene, bool32 additive);
 void draw_annotations_window(app_state_t* app_state, input_t* input);
+void destroy_annotation_set(annotation_set_t* annotation_set);
 void unload_and_reinit_annotations(annotation_set_t* annotation_set);
+u32 add_annotation_group(annotation_set_t* annotation_set, const char* name);
+i64 get_annotation_set_memory_usage(annotation_set_t* annotation_set);
+bool32 load_asap_xml_annotation_set(annotation_set_t* annotation_set, const char* filename);
 bool32 load_asap_xml_annotations(app_state_t* app_state, const char* filename);
+void load_annotations_in_background(app_state_t* app_state, const char* filename); // ASAP XML or GeoJSON
+void cancel_background_annotation_loads();
+void update_background_annotation_loads(app_state_t* app_state);
+bool32 get_background_annotation_load_progress(float* progress);
 void save_asap_xml_annotations(annotation_set_t* annotation_set, const char* filename_out);
+bool32 export_asap_xml_annotations(annotation_set_t* annotation_set);
 void autosave_annotations(app_state_t* app_state, annotation_set_t* annotation_set, bool force_ignore_delay);
+void run_annotation_stress_test(app_state_t* app_state, annotation_stress_params_t* params);
+void wait_for_annotation_statistics(annotation_set_t* annotation_set);
+void update_annotation_statistics(annotation_set_t* annotation_set);
+void draw_annotation_statistics_window(app_state_t* app_state);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,384 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include "platform.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "stretchy_buffer.h"
+#include "annotation_sidecar.h"
+
+static bool32 get_source_file_identity(const char* filename, i64* filesize, i64* modification_time) {
+	struct stat st;
+	if (stat(filename, &st) != 0) {
+		return false;
+	}
+	*filesize = (i64)st.st_size;
+	*modification_time = (i64)st.st_mtime;
+	return true;
+}
+
+void get_annotation_sidecar_filename(const char* annotation_filename, char* buf, size_t buf_size) {
+	snprintf(buf, buf_size, "%s" ANNOTATION_SIDECAR_EXTENSION, annotation_filename);
+}
+
+static void push_bytes(u8** buffer, const void* data, size_t size) {
+	u8* dest = sb_add(*buffer, (i32)size);
+	memcpy(dest, data, size);
+}
+
+static void push_u32(u8** buffer, u32 value) {
+	push_bytes(buffer, &value, sizeof(value));
+}
+
+// Edits are collected in annotation_set->pending_edits, until the next (auto)save appends them to the sidecar.
+static void push_record_header(u8** buffer, u32 tag, u32 size) {
+	annotation_sidecar_record_t record = { .tag = tag, .size = size };
+	push_bytes(buffer, &record, sizeof(record));
+}
+
+static annotation_sidecar_group_t make_sidecar_group(annotation_group_t* group) {
+	annotation_sidecar_group_t result = {0};
+	memcpy(result.name, group->name, sizeof(result.name));
+	result.color = group->color;
+	result.is_explicitly_defined = group->is_explicitly_defined;
+	return result;
+}
+
+void record_annotation_group_changed(annotation_set_t* annotation_set, i32 group_index) {
+	annotation_sidecar_group_t group = make_sidecar_group(annotation_set->groups + group_index);
+	push_record_header(&annotation_set->pending_edits, ANNOTATION_SIDECAR_TAG_GROUP, sizeof(u32) + sizeof(group));
+	push_u32(&annotation_set->pending_edits, group_index);
+	push_bytes(&annotation_set->pending_edits, &group, sizeof(group));
+}
+
+void record_annotations_assigned(annotation_set_t* annotation_set, i32 group_index, i32* annotation_indices, i32 count) {
+	if (count == 0) return;
+	push_record_header(&annotation_set->pending_edits, ANNOTATION_SIDECAR_TAG_ASSIGN, (2 + count) * sizeof(u32));
+	push_u32(&annotation_set->pending_edits, group_index);
+	push_u32(&annotation_set->pending_edits, count);
+	push_bytes(&annotation_set->pending_edits, annotation_indices, count * sizeof(u32));
+}
+
+void record_annotations_deleted(annotation_set_t* annotation_set, i32* annotation_indices, i32 count) {
+	if (count == 0) return;
+	push_record_header(&annotation_set->pending_edits, ANNOTATION_SIDECAR_TAG_DELETE, (1 + count) * sizeof(u32));
+	push_u32(&annotation_set->pending_edits, count);
+	push_bytes(&annotation_set->pending_edits, annotation_indices, count * sizeof(u32));
+}
+
+void record_annotations_compacted(annotation_set_t* annotation_set) {
+	push_record_header(&annotation_set->pending_edits, ANNOTATION_SIDECAR_TAG_COMPACT, 0);
+}
+
+static bool32 read_snapshot(annotation_set_t* annotation_set, u8* payload, u32 size) {
+	annotation_sidecar_snapshot_t snapshot = {0};
+	if (size < sizeof(snapshot)) return false;
+	memcpy(&snapshot, payload, sizeof(snapshot));
+	u64 expected_size = sizeof(snapshot) + (u64)snapshot.group_count * sizeof(annotation_sidecar_group_t) +
+	                    (u64)snapshot.annotation_count * sizeof(annotation_sidecar_annotation_t) +
+	                    (u64)snapshot.coordinate_count * sizeof(v2f);
+	if (expected_size != size || snapshot.group_count == 0) return false;
+
+	annotation_sidecar_group_t* groups = (annotation_sidecar_group_t*)(payload + sizeof(snapshot));
+	annotation_sidecar_annotation_t* annotations = (annotation_sidecar_annotation_t*)(groups + snapshot.group_count);
+	v2f* coordinates = (v2f*)(annotations + snapshot.annotation_count);
+
+	for (u32 i = 0; i < snapshot.annotation_count; ++i) {
+		annotation_sidecar_annotation_t* annotation = annotations + i;
+		if (annotation->group_index >= snapshot.group_count ||
+		    (u64)annotation->first_coordinate + annotation->coordinate_count > snapshot.coordinate_count) {
+			return false;
+		}
+	}
+
+	// Group 0 ('None') already exists in a freshly initialized annotation set
+	sb_raw_count(annotation_set->groups) = 0;
+	for (u32 i = 0; i < snapshot.group_count; ++i) {
+		annotation_group_t group = {0};
+		memcpy(group.name, groups[i].name, sizeof(group.name));
+		group.name[sizeof(group.name) - 1] = '\0';
+		group.color = groups[i].color;
+		group.is_explicitly_defined = groups[i].is_explicitly_defined;
+		sb_push(annotation_set->groups, group);
+	}
+	annotation_set->group_count = snapshot.group_count;
+
+	for (u32 i = 0; i < snapshot.annotation_count; ++i) {
+		annotation_sidecar_annotation_t* source = annotations + i;
+		annotation_t annotation = {0};
+		memcpy(annotation.name, source->name, sizeof(annotation.name));
+		annotation.name[sizeof(annotation.name) - 1] = '\0';
+		annotation.color = source->color;
+		annotation.group_id = source->group_index;
+		annotation.type = (annotation_type_enum)source->type;
+		annotation.first_coordinate = source->first_coordinate;
+		annotation.coordinate_count = source->coordinate_count;
+		annotation.has_coordinates = (source->coordinate_count > 0);
+		sb_push(annotation_set->annotations, annotation);
+	}
+	annotation_set->annotation_count = snapshot.annotation_count;
+
+	v2f mpp = get_annotation_set_mpp(annotation_set);
+	float* x = sb_add(annotation_set->coordinate_x, (i32)snapshot.coordinate_count);
+	float* y = sb_add(annotation_set->coordinate_y, (i32)snapshot.coordinate_count);
+	for (u32 i = 0; i < snapshot.coordinate_count; ++i) {
+		v2f point;
+		memcpy(&point, coordinates + i, sizeof(point));
+		x[i] = point.x * mpp.x;
+		y[i] = point.y * mpp.y;
+	}
+	annotation_set->coordinate_count = snapshot.coordinate_count;
+	return true;
+}
+
+// Plays back an edit record. Returns false if the record does not make sense for the current annotations.
+static bool32 apply_edit_record(annotation_set_t* annotation_set, u32 tag, u8* payload, u32 size) {
+	u32* values = (u32*)payload;
+	u32 value_count = size / sizeof(u32);
+	switch (tag) {
+		case ANNOTATION_SIDECAR_TAG_GROUP: {
+			if (size != sizeof(u32) + sizeof(annotation_sidecar_group_t) || values[0] > (u32)annotation_set->group_count) {
+				return false;
+			}
+			annotation_sidecar_group_t* source = (annotation_sidecar_group_t*)(payload + sizeof(u32));
+			annotation_group_t group = {0};
+			memcpy(group.name, source->name, sizeof(group.name));
+			group.name[sizeof(group.name) - 1] = '\0';
+			group.color = source->color;
+			group.is_explicitly_defined = source->is_explicitly_defined;
+			if (values[0] == (u32)annotation_set->group_count) {
+				sb_push(annotation_set->groups, group); // a new group
+				++annotation_set->group_count;
+			} else {
+				annotation_set->groups[values[0]] = group;
+			}
+		} break;
+		case ANNOTATION_SIDECAR_TAG_ASSIGN: {
+			if (value_count < 2 || value_count != 2 + values[1] || values[0] >= (u32)annotation_set->group_count) {
+				return false;
+			}
+			for (u32 i = 0; i < values[1]; ++i) {
+				u32 annotation_index = values[2 + i];
+				if (annotation_index >= (u32)annotation_set->annotation_count) return false;
+				annotation_set->annotations[annotation_index].group_id = values[0];
+			}
+		} break;
+		case ANNOTATION_SIDECAR_TAG_DELETE: {
+			if (value_count < 1 || value_count != 1 + values[0]) {
+				return false;
+			}
+			for (i32 i = 0; i < annotation_set->annotation_count; ++i) {
+				annotation_set->annotations[i].selected = false;
+			}
+			for (u32 i = 0; i < values[0]; ++i) {
+				u32 annotation_index = values[1 + i];
+				if (annotation_index >= (u32)annotation_set->annotation_count) return false;
+				if (annotation_set->annotations[annotation_index].deleted) return false;
+				annotation_set->annotations[annotation_index].selected = true;
+			}
+			remove_selected_annotations(annotation_set);
+		} break;
+		case ANNOTATION_SIDECAR_TAG_COMPACT: {
+			if (size != 0) {
+				return false;
+			}
+			compact_annotations(annotation_set);
+		} break;
+		default: return false;
+	}
+	return true;
+}
+
+// Loads the snapshot and plays back the edits after it. The file is read in one go, and the records are decoded in
+// place. Returns false if there is no usable sidecar (the annotations then need to be loaded from the XML file).
+bool32 load_annotation_sidecar(annotation_set_t* annotation_set, const char* annotation_filename) {
+	char sidecar_filename[4096];
+	get_annotation_sidecar_filename(annotation_filename, sidecar_filename, sizeof(sidecar_filename));
+	i64 source_filesize = 0;
+	i64 source_modification_time = 0;
+	if (!get_source_file_identity(annotation_filename, &source_filesize, &source_modification_time)) {
+		return false;
+	}
+	mem_t* file = platform_read_entire_file(sidecar_filename);
+	if (!file) {
+		return false;
+	}
+	bool32 success = false;
+	annotation_sidecar_header_t header = {0};
+	if (file->len >= sizeof(header)) {
+		memcpy(&header, file->data, sizeof(header));
+	}
+	if (header.magic == ANNOTATION_SIDECAR_MAGIC && header.version == ANNOTATION_SIDECAR_VERSION &&
+	    header.source_filesize == source_filesize && header.source_modification_time == source_modification_time) {
+		i64 offset = sizeof(header);
+		i64 edit_size = 0;
+		annotation_sidecar_record_t record = {0};
+		while (offset + (i64)sizeof(record) <= (i64)file->len) {
+			memcpy(&record, file->data + offset, sizeof(record));
+			i64 payload_offset = offset + sizeof(record);
+			if (payload_offset + record.size > (i64)file->len) {
+				break; // truncated (e.g., shut down while writing)
+			}
+			u8* payload = file->data + payload_offset;
+			if (!success) {
+				// The first record needs to be the snapshot
+				if (record.tag != ANNOTATION_SIDECAR_TAG_SNAPSHOT || !read_snapshot(annotation_set, payload, record.size)) {
+					break;
+				}
+				success = true;
+				annotation_set->sidecar_snapshot_size = payload_offset + record.size;
+			} else {
+				if (!apply_edit_record(annotation_set, record.tag, payload, record.size)) {
+					printf("Annotations: ignoring the edits in %s from offset %lld onwards\n", sidecar_filename, offset);
+					break;
+				}
+				edit_size += sizeof(record) + record.size;
+			}
+			offset = payload_offset + record.size;
+		}
+		annotation_set->sidecar_edit_size = edit_size;
+		annotation_set->sidecar_file_size = offset; // new edits will be appended from here
+	}
+	free(file);
+	if (success) {
+		for (i32 i = 0; i < annotation_set->annotation_count; ++i) {
+			annotation_set->annotations[i].selected = false;
+		}
+		printf("Annotations: loaded %s\n", sidecar_filename);
+	}
+	return success;
+}
+
+static annotation_sidecar_snapshot_t describe_snapshot(annotation_set_t* annotation_set, u64* payload_size) {
+	u32 coordinate_count = 0;
+	for (i32 i = 0; i < annotation_set->annotation_count; ++i) {
+		annotation_t* annotation = annotation_set->annotations + i;
+		if (annotation->has_coordinates) coordinate_count += annotation->coordinate_count;
+	}
+	annotation_sidecar_snapshot_t snapshot = { .group_count = annotation_set->group_count,
+	                                           .annotation_count = annotation_set->annotation_count,
+	                                           .coordinate_count = coordinate_count };
+	*payload_size = sizeof(snapshot) + (u64)snapshot.group_count * sizeof(annotation_sidecar_group_t) +
+	                (u64)snapshot.annotation_count * sizeof(annotation_sidecar_annotation_t) +
+	                (u64)snapshot.coordinate_count * sizeof(v2f);
+	return snapshot;
+}
+
+// The size of the file that write_annotation_sidecar() would write.
+i64 get_annotation_sidecar_snapshot_size(annotation_set_t* annotation_set) {
+	u64 payload_size = 0;
+	describe_snapshot(annotation_set, &payload_size);
+	return sizeof(annotation_sidecar_header_t) + sizeof(annotation_sidecar_record_t) + payload_size;
+}
+
+// Writes a new snapshot of all annotations, replacing the old sidecar. The annotations need to be compacted first.
+// The file is written under a temporary name first, so that the old sidecar stays intact if writing fails.
+bool32 write_annotation_sidecar(annotation_set_t* annotation_set, const char* annotation_filename) {
+	ASSERT(annotation_set->deleted_annotation_count == 0);
+	annotation_sidecar_header_t header = { .magic = ANNOTATION_SIDECAR_MAGIC, .version = ANNOTATION_SIDECAR_VERSION };
+	if (!get_source_file_identity(annotation_filename, &header.source_filesize, &header.source_modification_time)) {
+		return false;
+	}
+	u64 payload_size = 0;
+	annotation_sidecar_snapshot_t snapshot = describe_snapshot(annotation_set, &payload_size);
+	if (payload_size > UINT32_MAX) {
+		return false;
+	}
+
+	u8* buffer = NULL; // sb
+	push_bytes(&buffer, &header, sizeof(header));
+	push_record_header(&buffer, ANNOTATION_SIDECAR_TAG_SNAPSHOT, (u32)payload_size);
+	push_bytes(&buffer, &snapshot, sizeof(snapshot));
+	for (i32 i = 0; i < annotation_set->group_count; ++i) {
+		annotation_sidecar_group_t group = make_sidecar_group(annotation_set->groups + i);
+		push_bytes(&buffer, &group, sizeof(group));
+	}
+	u32 first_coordinate = 0;
+	for (i32 i = 0; i < annotation_set->annotation_count; ++i) {
+		annotation_t* annotation = annotation_set->annotations + i;
+		annotation_sidecar_annotation_t record = {0};
+		memcpy(record.name, annotation->name, sizeof(record.name));
+		record.color = annotation->color;
+		record.group_index = annotation->group_id;
+		record.type = annotation->type;
+		record.first_coordinate = first_coordinate;
+		record.coordinate_count = annotation->has_coordinates ? annotation->coordinate_count : 0;
+		first_coordinate += record.coordinate_count;
+		push_bytes(&buffer, &record, sizeof(record));
+	}
+	v2f mpp = get_annotation_set_mpp(annotation_set);
+	for (i32 i = 0; i < annotation_set->annotation_count; ++i) {
+		annotation_t* annotation = annotation_set->annotations + i;
+		if (!annotation->has_coordinates) continue;
+		v2f* dest = (v2f*) sb_add(buffer, annotation->coordinate_count * (i32)sizeof(v2f));
+		for (i32 j = 0; j < annotation->coordinate_count; ++j) {
+			i32 coordinate_index = annotation->first_coordinate + j;
+			v2f point = { annotation_set->coordinate_x[coordinate_index] / mpp.x,
+			              annotation_set->coordinate_y[coordinate_index] / mpp.y };
+			memcpy(dest + j, &point, sizeof(point));
+		}
+	}
+
+	char sidecar_filename[4096];
+	char temp_filename[4096 + 8];
+	get_annotation_sidecar_filename(annotation_filename, sidecar_filename, sizeof(sidecar_filename));
+	snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", sidecar_filename);
+	bool32 ok = false;
+	FILE* fp = fopen64(temp_filename, "wb");
+	if (fp) {
+		ok = (fwrite(buffer, sb_count(buffer), 1, fp) == 1);
+		ok = (fclose(fp) == 0) && ok;
+	}
+	if (ok) {
+		remove(sidecar_filename); // rename() does not replace an existing file on Windows
+		ok = (rename(temp_filename, sidecar_filename) == 0);
+	}
+	if (ok) {
+		annotation_set->sidecar_snapshot_size = sb_count(buffer);
+		annotation_set->sidecar_edit_size = 0;
+		annotation_set->sidecar_file_size = sb_count(buffer);
+		if (annotation_set->pending_edits) {
+			sb_raw_count(annotation_set->pending_edits) = 0; // included in the snapshot
+		}
+	} else {
+		printf("Annotations: could not write %s\n", sidecar_filename);
+		remove(temp_filename);
+	}
+	sb_free(buffer);
+	return ok;
+}
+
+// Appends edit records at the given offset (the end of the last complete record). Appending is not atomic, but a
+// record cut off halfway is ignored when loading (along with anything after it).
+bool32 append_annotation_sidecar_records(const char* annotation_filename, i64 offset, u8* records, i64 size) {
+	char sidecar_filename[4096];
+	get_annotation_sidecar_filename(annotation_filename, sidecar_filename, sizeof(sidecar_filename));
+	bool32 ok = false;
+	FILE* fp = fopen64(sidecar_filename, "r+b");
+	if (fp) {
+		ok = (fseeko64(fp, offset, SEEK_SET) == 0) && (fwrite(records, size, 1, fp) == 1);
+		ok = (fclose(fp) == 0) && ok;
+	}
+	if (!ok) {
+		printf("Annotations: could not append to %s\n", sidecar_filename);
+	}
+	return ok;
+}
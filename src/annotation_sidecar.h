@@ -0,0 +1,106 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+#include "viewer.h"
+
+// Annotations are kept in a compact binary sidecar file next to the XML file they were loaded from
+// (<annotations>.svann). The sidecar starts with a snapshot of all annotations, followed by a log of the edits made
+// since then, so that saving only needs to append the latest edits. The XML file itself is only rewritten when
+// explicitly exported (see export_asap_xml_annotations()).
+// The sidecar is only used as long as the XML file is unchanged since the snapshot was written.
+//
+// File layout:
+//   annotation_sidecar_header_t
+//   records: annotation_sidecar_record_t, followed by record.size bytes of payload
+//     SNAP: annotation_sidecar_snapshot_t, groups, annotations, coordinates (v2f, in pixels of the full resolution
+//           level, like in the source file; see annotation_set_t::mpp)
+//     GRUP: u32 group_index, annotation_sidecar_group_t (the group was changed)
+//     ASGN: u32 group_index, u32 count, u32 annotation_indices[count] (the annotations were assigned to the group)
+//     ADEL: u32 count, u32 annotation_indices[count] (the annotations were deleted, indices in ascending order)
+//     PACK: no payload (the deleted annotations were compacted away, so the annotations after them moved down)
+//
+// The indices in the edit records refer to the annotations as they were at the time of the edit. Deleted
+// annotations keep their place until they are compacted, so the PACK records are needed to keep the numbering in
+// step. A snapshot is always written right after compacting.
+
+#define ANNOTATION_SIDECAR_EXTENSION ".svann"
+#define ANNOTATION_SIDECAR_MAGIC 0x4E4E4153 // "SANN"
+#define ANNOTATION_SIDECAR_VERSION 3 // 3: coordinates in pixels instead of micrometers
+#define ANNOTATION_SIDECAR_TAG_SNAPSHOT 0x50414E53 // "SNAP"
+#define ANNOTATION_SIDECAR_TAG_GROUP 0x50555247 // "GRUP"
+#define ANNOTATION_SIDECAR_TAG_ASSIGN 0x4E475341 // "ASGN"
+#define ANNOTATION_SIDECAR_TAG_DELETE 0x4C454441 // "ADEL"
+#define ANNOTATION_SIDECAR_TAG_COMPACT 0x4B434150 // "PACK"
+
+#pragma pack(push, 1)
+typedef struct annotation_sidecar_header_t {
+	u32 magic;
+	u32 version;
+	i64 source_filesize; // the sidecar is only valid for the XML file as it was when the snapshot was written
+	i64 source_modification_time;
+} annotation_sidecar_header_t;
+
+typedef struct annotation_sidecar_record_t {
+	u32 tag;
+	u32 size;
+} annotation_sidecar_record_t;
+
+typedef struct annotation_sidecar_snapshot_t {
+	u32 group_count;
+	u32 annotation_count;
+	u32 coordinate_count;
+	u32 reserved;
+} annotation_sidecar_snapshot_t;
+
+typedef struct annotation_sidecar_group_t {
+	char name[64];
+	rgba_t color;
+	u8 is_explicitly_defined;
+	u8 reserved[3];
+} annotation_sidecar_group_t;
+
+typedef struct annotation_sidecar_annotation_t {
+	char name[64];
+	rgba_t color;
+	u32 group_index;
+	u32 type;
+	u32 first_coordinate;
+	u32 coordinate_count;
+} annotation_sidecar_annotation_t;
+#pragma pack(pop)
+
+void get_annotation_sidecar_filename(const char* annotation_filename, char* buf, size_t buf_size);
+bool32 load_annotation_sidecar(annotation_set_t* annotation_set, const char* annotation_filename);
+i64 get_annotation_sidecar_snapshot_size(annotation_set_t* annotation_set);
+bool32 write_annotation_sidecar(annotation_set_t* annotation_set, const char* annotation_filename);
+bool32 append_annotation_sidecar_records(const char* annotation_filename, i64 offset, u8* records, i64 size);
+void record_annotation_group_changed(annotation_set_t* annotation_set, i32 group_index);
+void record_annotations_assigned(annotation_set_t* annotation_set, i32 group_index, i32* annotation_indices, i32 count);
+void record_annotations_deleted(annotation_set_t* annotation_set, i32* annotation_indices, i32 count);
+void record_annotations_compacted(annotation_set_t* annotation_set);
+
+#ifdef __cplusplus
+}
+#endif
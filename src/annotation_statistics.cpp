@@ -0,0 +1,273 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include "viewer.h"
+#include "annotation.h"
+#include "platform.h"
+#include "gui.h"
+#include "intrinsics.h"
+#include "win32_main.h"
+
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "imgui.h"
+
+// Area and perimeter of the annotations, totalled per group (e.g. for reporting the tumor area).
+// The coordinates are in micrometers: the pixels in the annotation files are converted with the mpp of the slide when
+// they are loaded (see annotation_set_t::mpp).
+// The area and perimeter of an annotation only depend on its coordinates, which don't change once loaded, so they are
+// measured once and kept in annotation_t; deleting annotations or assigning them to another group only needs the
+// (cheap) totals to be added up again. New annotations (a file that was loaded, or GeoJSON batches coming in) are
+// measured on worker threads, in chunks that the tasks take turns picking up.
+// The job reads the coordinates of the annotation set without copying them, so anything that moves the coordinates
+// has to wait for it first (see wait_for_annotation_statistics()).
+
+#define ANNOTATION_STATISTICS_CHUNK_SIZE 4096 // annotations
+
+typedef struct annotation_statistics_job_t {
+	float* coordinate_x; // shared with the annotation set
+	float* coordinate_y;
+	i32 first_annotation;
+	i32 annotation_count;
+	i32* first_coordinates; // copies, because the annotations may be appended to (and move) in the meantime
+	i32* coordinate_counts;
+	float* areas;
+	float* perimeters;
+	i32 chunk_count;
+	volatile i32 next_chunk;
+	volatile i32 tasks_left;
+	volatile i32 is_done;
+} annotation_statistics_job_t;
+
+// Shoelace formula for the area, and the sum of the edge lengths. The outline is closed, so the last edge goes back to
+// the first coordinate. The coordinates are taken relative to the first one, which keeps the products small enough
+// for single precision; the sums are kept in double precision.
+static void measure_annotation_outline(float* x, float* y, i32 count, float* area_out, float* perimeter_out) {
+	if (count < 2) {
+		*area_out = 0.0f;
+		*perimeter_out = 0.0f;
+		return;
+	}
+	float x0 = x[0];
+	float y0 = y[0];
+	double twice_area = 0.0;
+	double perimeter = 0.0;
+	i32 i = 0;
+#if defined(__SSE2__)
+	__m128 origin_x = _mm_set1_ps(x0);
+	__m128 origin_y = _mm_set1_ps(y0);
+	__m128d area_sum = _mm_setzero_pd();
+	__m128d perimeter_sum = _mm_setzero_pd();
+	for (; i + 4 < count; i += 4) {
+		__m128 xa = _mm_sub_ps(_mm_loadu_ps(x + i), origin_x);
+		__m128 ya = _mm_sub_ps(_mm_loadu_ps(y + i), origin_y);
+		__m128 xb = _mm_sub_ps(_mm_loadu_ps(x + i + 1), origin_x);
+		__m128 yb = _mm_sub_ps(_mm_loadu_ps(y + i + 1), origin_y);
+		__m128 cross = _mm_sub_ps(_mm_mul_ps(xa, yb), _mm_mul_ps(xb, ya));
+		__m128 dx = _mm_sub_ps(xb, xa);
+		__m128 dy = _mm_sub_ps(yb, ya);
+		__m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)));
+		area_sum = _mm_add_pd(area_sum, _mm_add_pd(_mm_cvtps_pd(cross), _mm_cvtps_pd(_mm_movehl_ps(cross, cross))));
+		perimeter_sum = _mm_add_pd(perimeter_sum, _mm_add_pd(_mm_cvtps_pd(length), _mm_cvtps_pd(_mm_movehl_ps(length, length))));
+	}
+	double lanes[2];
+	_mm_storeu_pd(lanes, area_sum);
+	twice_area = lanes[0] + lanes[1];
+	_mm_storeu_pd(lanes, perimeter_sum);
+	perimeter = lanes[0] + lanes[1];
+#endif
+	for (; i < count; ++i) {
+		i32 next = (i + 1 == count) ? 0 : i + 1;
+		float xa = x[i] - x0;
+		float ya = y[i] - y0;
+		float xb = x[next] - x0;
+		float yb = y[next] - y0;
+		twice_area += (double)(xa * yb - xb * ya);
+		perimeter += (double)sqrtf(SQUARE(xb - xa) + SQUARE(yb - ya));
+	}
+	if (count == 2) {
+		perimeter *= 0.5; // a single line, not a closed outline
+	}
+	*area_out = (float)(fabs(twice_area) * 0.5);
+	*perimeter_out = (float)perimeter;
+}
+
+static void annotation_statistics_task_func(i32 logical_thread_index, void* userdata) {
+	annotation_statistics_job_t* job = (annotation_statistics_job_t*) userdata;
+	for (;;) {
+		i32 chunk = interlocked_increment(&job->next_chunk) - 1;
+		if (chunk >= job->chunk_count) break;
+		i32 begin = chunk * ANNOTATION_STATISTICS_CHUNK_SIZE;
+		i32 end = ATMOST(begin + ANNOTATION_STATISTICS_CHUNK_SIZE, job->annotation_count);
+		for (i32 i = begin; i < end; ++i) {
+			i32 first = job->first_coordinates[i];
+			measure_annotation_outline(job->coordinate_x + first, job->coordinate_y + first, job->coordinate_counts[i],
+			                           job->areas + i, job->perimeters + i);
+		}
+	}
+	if (interlocked_decrement(&job->tasks_left) == 0) {
+		write_barrier;
+		job->is_done = true;
+	}
+}
+
+static void start_annotation_statistics_job(annotation_set_t* annotation_set) {
+	annotation_statistics_job_t* job = (annotation_statistics_job_t*) calloc(1, sizeof(annotation_statistics_job_t));
+	job->coordinate_x = annotation_set->coordinate_x;
+	job->coordinate_y = annotation_set->coordinate_y;
+	job->first_annotation = annotation_set->measured_annotation_count;
+	job->annotation_count = annotation_set->annotation_count - job->first_annotation;
+	job->first_coordinates = (i32*) malloc(job->annotation_count * sizeof(i32));
+	job->coordinate_counts = (i32*) malloc(job->annotation_count * sizeof(i32));
+	job->areas = (float*) malloc(job->annotation_count * sizeof(float));
+	job->perimeters = (float*) malloc(job->annotation_count * sizeof(float));
+	for (i32 i = 0; i < job->annotation_count; ++i) {
+		annotation_t* annotation = annotation_set->annotations + job->first_annotation + i;
+		job->first_coordinates[i] = annotation->first_coordinate;
+		job->coordinate_counts[i] = annotation->has_coordinates ? annotation->coordinate_count : 0;
+	}
+	job->chunk_count = (job->annotation_count + ANNOTATION_STATISTICS_CHUNK_SIZE - 1) / ANNOTATION_STATISTICS_CHUNK_SIZE;
+	// Half of the workers at most, so that the tiles in view still get loaded in the meantime.
+	i32 task_count = CLAMP((total_thread_count - 1) / 2, 1, job->chunk_count);
+	job->tasks_left = task_count;
+	annotation_set->statistics_job = job;
+	for (i32 i = 0; i < task_count; ++i) {
+		if (!add_work_queue_entry(&work_queue, annotation_statistics_task_func, job)) {
+			annotation_statistics_task_func(0, job); // queue is full, do it now
+		}
+	}
+}
+
+// Copies the measurements into the annotations, which are still numbered the same as when the job started (because
+// compacting the annotations waits for the job).
+static void finish_annotation_statistics_job(annotation_set_t* annotation_set) {
+	annotation_statistics_job_t* job = annotation_set->statistics_job;
+	read_barrier;
+	for (i32 i = 0; i < job->annotation_count; ++i) {
+		annotation_t* annotation = annotation_set->annotations + job->first_annotation + i;
+		annotation->area = job->areas[i];
+		annotation->perimeter = job->perimeters[i];
+	}
+	annotation_set->measured_annotation_count = job->first_annotation + job->annotation_count;
+	annotation_set->are_group_statistics_dirty = true;
+	free(job->first_coordinates);
+	free(job->coordinate_counts);
+	free(job->areas);
+	free(job->perimeters);
+	free(job);
+	annotation_set->statistics_job = NULL;
+}
+
+void wait_for_annotation_statistics(annotation_set_t* annotation_set) {
+	if (!annotation_set->statistics_job) return;
+	while (!annotation_set->statistics_job->is_done) {
+		do_worker_work(&work_queue, 0);
+	}
+	finish_annotation_statistics_job(annotation_set);
+}
+
+static void sum_annotation_group_statistics(annotation_set_t* annotation_set) {
+	if (annotation_set->group_statistics) {
+		sb_raw_count(annotation_set->group_statistics) = 0;
+	}
+	annotation_group_statistics_t empty = {};
+	for (i32 i = 0; i < annotation_set->group_count; ++i) {
+		sb_push(annotation_set->group_statistics, empty);
+	}
+	i32 measured_count = ATMOST(annotation_set->measured_annotation_count, annotation_set->annotation_count);
+	for (i32 i = 0; i < annotation_set->annotation_count; ++i) {
+		annotation_t* annotation = annotation_set->annotations + i;
+		if (annotation->deleted || annotation->group_id < 0 || annotation->group_id >= annotation_set->group_count) continue;
+		annotation_group_statistics_t* stats = annotation_set->group_statistics + annotation->group_id;
+		++stats->annotation_count;
+		if (i < measured_count) {
+			stats->area += annotation->area;
+			stats->perimeter += annotation->perimeter;
+		}
+	}
+	annotation_set->are_group_statistics_dirty = false;
+}
+
+// Needs to be called every frame while the statistics are shown, on the main thread.
+void update_annotation_statistics(annotation_set_t* annotation_set) {
+	if (annotation_set->statistics_job && annotation_set->statistics_job->is_done) {
+		finish_annotation_statistics_job(annotation_set);
+	}
+	if (!annotation_set->statistics_job && annotation_set->measured_annotation_count < annotation_set->annotation_count) {
+		start_annotation_statistics_job(annotation_set);
+	}
+	if (annotation_set->are_group_statistics_dirty || sb_count(annotation_set->group_statistics) != annotation_set->group_count) {
+		sum_annotation_group_statistics(annotation_set);
+	}
+}
+
+// The coordinates are in micrometers (they are converted when the annotations are loaded), so the areas are shown in
+// square millimeters and the perimeters in millimeters.
+void draw_annotation_statistics_window(app_state_t* app_state) {
+	annotation_set_t* annotation_set = &app_state->scenes[0].annotation_set;
+	update_annotation_statistics(annotation_set);
+
+	ImGui::SetNextWindowPos(ImVec2(440, 600), ImGuiCond_FirstUseEver);
+	ImGui::SetNextWindowSize(ImVec2(440, 250), ImGuiCond_FirstUseEver);
+	if (!ImGui::Begin("Annotation statistics", &show_annotation_statistics_window)) {
+		ImGui::End();
+		return;
+	}
+	if (annotation_set->statistics_job) {
+		ImGui::Text("Measuring %d annotations...", annotation_set->statistics_job->annotation_count);
+	} else {
+		ImGui::Text("Annotations: %d", annotation_set->annotation_count - annotation_set->deleted_annotation_count);
+	}
+	ImGui::Separator();
+	ImGui::Columns(5, "##group_statistics");
+	ImGui::TextUnformatted("Group"); ImGui::NextColumn();
+	ImGui::TextUnformatted("Count"); ImGui::NextColumn();
+	ImGui::TextUnformatted("Area (mm2)"); ImGui::NextColumn();
+	ImGui::TextUnformatted("Perimeter (mm)"); ImGui::NextColumn();
+	ImGui::TextUnformatted("Mean area (um2)"); ImGui::NextColumn();
+	ImGui::Separator();
+	annotation_group_statistics_t total = {};
+	for (i32 i = 0; i <= sb_count(annotation_set->group_statistics); ++i) {
+		annotation_group_statistics_t* stats;
+		const char* name;
+		if (i < sb_count(annotation_set->group_statistics)) {
+			stats = annotation_set->group_statistics + i;
+			name = annotation_set->groups[i].name;
+			total.annotation_count += stats->annotation_count;
+			total.area += stats->area;
+			total.perimeter += stats->perimeter;
+		} else {
+			stats = &total; // the last row
+			name = "(all)";
+			ImGui::Separator();
+		}
+		if (stats->annotation_count == 0) continue;
+		ImGui::TextUnformatted(name); ImGui::NextColumn();
+		ImGui::Text("%d", stats->annotation_count); ImGui::NextColumn();
+		ImGui::Text("%.4f", stats->area * 1e-6); ImGui::NextColumn();
+		ImGui::Text("%.3f", stats->perimeter * 1e-3); ImGui::NextColumn();
+		ImGui::Text("%.1f", stats->area / stats->annotation_count); ImGui::NextColumn();
+	}
+	ImGui::Columns(1);
+	ImGui::End();
+}
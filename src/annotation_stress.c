@@ -0,0 +1,255 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include "platform.h"
+
+#include <stdio.h>
+#include <math.h>
+
+#include <glad/glad.h>
+
+#include "stretchy_buffer.h"
+#include "viewer.h"
+#include "annotation.h"
+#include "annotation_sidecar.h"
+
+// The annotation stress test: generates N polygons with M vertices each in K groups, spread over the displayed slide
+// (or over a slide-sized area if none is displayed), and times what a large annotation set costs: writing the XML
+// file and the sidecar, loading both back, drawing at several zoom levels, selecting, deleting and autosaving.
+// The annotations are kept apart from the ones of the displayed image, and the random seed is fixed, so that runs can
+// be compared. The files are left in the working directory (ANNOTATION_STRESS_FILENAME), for inspection.
+
+#define ANNOTATION_STRESS_FILENAME "annotation_stress.xml"
+#define ANNOTATION_STRESS_SEED 0x5EED1234u
+#define ANNOTATION_STRESS_DRAW_ITERATIONS 20
+#define ANNOTATION_STRESS_SELECT_ITERATIONS 1000
+#define ANNOTATION_STRESS_DEFAULT_SLIDE_WIDTH_IN_UM 20000.0f
+#define ANNOTATION_STRESS_DEFAULT_SLIDE_HEIGHT_IN_UM 15000.0f
+
+static u32 stress_rng_state;
+
+// xorshift32: good enough for spreading out shapes, and the same on every platform
+static u32 stress_random() {
+	u32 x = stress_rng_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	stress_rng_state = x;
+	return x;
+}
+
+static float stress_randomf() {
+	return (float)(stress_random() & 0xFFFFFF) / (float)(1 << 24);
+}
+
+// Irregular blobs (a circle with a wobbling radius), so that the simplified outlines are not trivial.
+static void generate_stress_annotations(annotation_set_t* annotation_set, annotation_stress_params_t* params,
+                                        v2f slide_size) {
+	unload_and_reinit_annotations(annotation_set);
+	for (i32 i = 0; i < params->group_count; ++i) {
+		char name[64];
+		snprintf(name, sizeof(name), "Stress group %d", i + 1);
+		u32 group_index = add_annotation_group(annotation_set, name);
+		annotation_group_t* group = annotation_set->groups + group_index;
+		group->color = (rgba_t){ (u8)(64 + stress_random() % 192), (u8)(64 + stress_random() % 192),
+		                         (u8)(64 + stress_random() % 192), 255 };
+		group->is_explicitly_defined = true;
+	}
+	i32 coordinate_count = params->annotation_count * params->vertex_count;
+	sb_add(annotation_set->coordinate_x, coordinate_count);
+	sb_add(annotation_set->coordinate_y, coordinate_count);
+	sb_add(annotation_set->annotations, params->annotation_count);
+	memset(annotation_set->annotations, 0, params->annotation_count * sizeof(annotation_t));
+	for (i32 i = 0; i < params->annotation_count; ++i) {
+		annotation_t* annotation = annotation_set->annotations + i;
+		annotation->type = ANNOTATION_POLYGON;
+		snprintf(annotation->name, sizeof(annotation->name), "Stress %d", i + 1);
+		annotation->group_id = 1 + (i32)(stress_random() % (u32)params->group_count);
+		annotation->color = annotation_set->groups[annotation->group_id].color;
+		annotation->first_coordinate = i * params->vertex_count;
+		annotation->coordinate_count = params->vertex_count;
+		annotation->has_coordinates = true;
+		float radius = 20.0f + 180.0f * stress_randomf();
+		v2f center = { radius + (slide_size.x - 2.0f * radius) * stress_randomf(),
+		               radius + (slide_size.y - 2.0f * radius) * stress_randomf() };
+		float phase = 6.2831853f * stress_randomf();
+		for (i32 j = 0; j < params->vertex_count; ++j) {
+			float angle = 6.2831853f * (float)j / (float)params->vertex_count;
+			float r = radius * (0.8f + 0.15f * sinf(5.0f * angle + phase) + 0.05f * stress_randomf());
+			annotation_set->coordinate_x[annotation->first_coordinate + j] = center.x + r * cosf(angle);
+			annotation_set->coordinate_y[annotation->first_coordinate + j] = center.y + r * sinf(angle);
+		}
+	}
+	annotation_set->annotation_count = params->annotation_count;
+	annotation_set->coordinate_count = coordinate_count;
+	build_annotation_index(annotation_set);
+	build_annotation_lods(annotation_set);
+	annotation_set->needs_geometry_upload = true;
+	annotation_set->enabled = true;
+}
+
+static i64 get_stress_file_size(const char* filename) {
+	FILE* fp = fopen(filename, "rb");
+	if (!fp) return 0;
+	fseek(fp, 0, SEEK_END);
+	i64 size = (i64)ftell(fp);
+	fclose(fp);
+	return size;
+}
+
+// Draws the whole annotation set, with the camera at the center of the slide, and waits for the GPU to finish.
+static float time_annotation_draw(annotation_set_t* annotation_set, v2f slide_size, float um_per_pixel, rect2i viewport,
+                                  rect2i client_viewport) {
+	v2f camera_min = { slide_size.x * 0.5f - viewport.w * 0.5f * um_per_pixel,
+	                   slide_size.y * 0.5f - viewport.h * 0.5f * um_per_pixel };
+	i64 start = get_clock();
+	draw_annotations(annotation_set, camera_min, um_per_pixel, viewport, client_viewport);
+	glFinish();
+	return get_seconds_elapsed(start, get_clock());
+}
+
+// Needs to be called from the main thread, during a frame (the draws end up in the frame, underneath the GUI).
+void run_annotation_stress_test(app_state_t* app_state, annotation_stress_params_t* params) {
+	params->is_pending = false;
+	params->annotation_count = ATLEAST(1, params->annotation_count);
+	params->vertex_count = ATLEAST(3, params->vertex_count);
+	params->group_count = ATLEAST(1, params->group_count);
+	stress_rng_state = ANNOTATION_STRESS_SEED;
+
+	v2f slide_size = { ANNOTATION_STRESS_DEFAULT_SLIDE_WIDTH_IN_UM, ANNOTATION_STRESS_DEFAULT_SLIDE_HEIGHT_IN_UM };
+	v2f mpp = {}; // (the default, see get_annotation_set_mpp())
+	if (app_state->displayed_image >= 0 && app_state->displayed_image < sb_count(app_state->loaded_images)) {
+		image_t* image = app_state->loaded_images[app_state->displayed_image];
+		if (image->width_in_um > 0 && image->height_in_um > 0) {
+			slide_size = (v2f){ (float)image->width_in_um, (float)image->height_in_um };
+			mpp = (v2f){ image->mpp_x, image->mpp_y };
+		}
+	}
+	printf("Annotation stress test: %d annotations with %d vertices each, in %d groups, over %.0f x %.0f um\n",
+	       params->annotation_count, params->vertex_count, params->group_count, slide_size.x, slide_size.y);
+
+	annotation_set_t* annotation_set = (annotation_set_t*) calloc(1, sizeof(annotation_set_t));
+	annotation_set->mpp = mpp; // for saving and loading (the file has pixels)
+	i64 start = get_clock();
+	generate_stress_annotations(annotation_set, params, slide_size);
+	printf("  generate (incl. index and simplified outlines): %.1f ms\n", get_seconds_elapsed(start, get_clock()) * 1000.0f);
+
+	// Writing
+	char sidecar_filename[512];
+	get_annotation_sidecar_filename(ANNOTATION_STRESS_FILENAME, sidecar_filename, sizeof(sidecar_filename));
+	remove(sidecar_filename);
+	start = get_clock();
+	save_asap_xml_annotations(annotation_set, ANNOTATION_STRESS_FILENAME);
+	printf("  save_asap_xml_annotations: %.1f ms (%.1f MB)\n", get_seconds_elapsed(start, get_clock()) * 1000.0f,
+	       (float)get_stress_file_size(ANNOTATION_STRESS_FILENAME) / (float)MEGABYTES(1));
+	start = get_clock();
+	bool32 sidecar_written = write_annotation_sidecar(annotation_set, ANNOTATION_STRESS_FILENAME);
+	printf("  write_annotation_sidecar: %.1f ms (%.1f MB)%s\n", get_seconds_elapsed(start, get_clock()) * 1000.0f,
+	       (float)get_stress_file_size(sidecar_filename) / (float)MEGABYTES(1), sidecar_written ? "" : " FAILED");
+
+	// Loading: first from the sidecar, then from the XML file (which writes the sidecar again)
+	start = get_clock();
+	bool32 loaded = load_asap_xml_annotation_set(annotation_set, ANNOTATION_STRESS_FILENAME);
+	printf("  load from sidecar: %.1f ms%s\n", get_seconds_elapsed(start, get_clock()) * 1000.0f, loaded ? "" : " FAILED");
+	remove(sidecar_filename);
+	start = get_clock();
+	loaded = load_asap_xml_annotation_set(annotation_set, ANNOTATION_STRESS_FILENAME) && loaded;
+	printf("  load from XML (incl. writing the sidecar): %.1f ms%s\n", get_seconds_elapsed(start, get_clock()) * 1000.0f,
+	       loaded ? "" : " FAILED");
+	if (!loaded) {
+		destroy_annotation_set(annotation_set);
+		free(annotation_set);
+		if (params->quit_when_done) is_program_running = false;
+		return;
+	}
+
+	// Drawing, from the whole slide in view down to full resolution
+	rect2i viewport = app_state->scenes[0].viewport;
+	if (viewport.w <= 0 || viewport.h <= 0) viewport = app_state->client_viewport;
+	float fit_um_per_pixel = ATLEAST(slide_size.x / (float)ATLEAST(1, viewport.w), slide_size.y / (float)ATLEAST(1, viewport.h));
+	glFinish();
+	float first_draw_time = time_annotation_draw(annotation_set, slide_size, fit_um_per_pixel, viewport, app_state->client_viewport);
+	printf("  first draw (incl. geometry upload): %.2f ms\n", first_draw_time * 1000.0f);
+	float zoom_factors[] = { 1.0f, 1.0f / 4.0f, 1.0f / 16.0f, 1.0f / 64.0f, 0.0f /* full resolution */ };
+	for (i32 i = 0; i < COUNT(zoom_factors); ++i) {
+		float um_per_pixel = zoom_factors[i] > 0.0f ? fit_um_per_pixel * zoom_factors[i] : 0.25f;
+		float total_time = 0.0f;
+		float max_time = 0.0f;
+		for (i32 iteration = 0; iteration < ANNOTATION_STRESS_DRAW_ITERATIONS; ++iteration) {
+			float time = time_annotation_draw(annotation_set, slide_size, um_per_pixel, viewport, app_state->client_viewport);
+			total_time += time;
+			max_time = ATLEAST(max_time, time);
+		}
+		printf("  draw_annotations at %.3f um/pixel: mean %.2f ms, max %.2f ms\n", um_per_pixel,
+		       total_time * 1000.0f / ANNOTATION_STRESS_DRAW_ITERATIONS, max_time * 1000.0f);
+	}
+
+	// Selecting: clicks near the outlines of random annotations (as when clicking on them) and at random places
+	scene_t* scene = (scene_t*) calloc(1, sizeof(scene_t));
+	scene->annotation_set = *annotation_set;
+	free(annotation_set);
+	annotation_set = &scene->annotation_set;
+	scene->pixel_width = fit_um_per_pixel / 16.0f;
+	scene->pixel_height = scene->pixel_width;
+	float total_time = 0.0f;
+	float max_time = 0.0f;
+	for (i32 i = 0; i < ANNOTATION_STRESS_SELECT_ITERATIONS; ++i) {
+		if (i % 2 == 0) {
+			annotation_t* annotation = annotation_set->annotations + (stress_random() % (u32)annotation_set->annotation_count);
+			i32 coordinate_index = annotation->first_coordinate + (i32)(stress_random() % (u32)annotation->coordinate_count);
+			scene->mouse = (v2f){ annotation_set->coordinate_x[coordinate_index] + 2.0f,
+			                      annotation_set->coordinate_y[coordinate_index] - 2.0f };
+		} else {
+			scene->mouse = (v2f){ slide_size.x * stress_randomf(), slide_size.y * stress_randomf() };
+		}
+		start = get_clock();
+		select_annotation(scene, false);
+		float time = get_seconds_elapsed(start, get_clock());
+		total_time += time;
+		max_time = ATLEAST(max_time, time);
+	}
+	printf("  select_annotation: mean %.3f ms, max %.3f ms\n", total_time * 1000.0f / ANNOTATION_STRESS_SELECT_ITERATIONS,
+	       max_time * 1000.0f);
+
+	// Deleting every tenth annotation, and autosaving that edit
+	i32 deleted_count = 0;
+	for (i32 i = 0; i < annotation_set->annotation_count; ++i) {
+		annotation_set->annotations[i].selected = (i % 10 == 0);
+		if (i % 10 == 0) ++deleted_count;
+	}
+	start = get_clock();
+	delete_selected_annotations(annotation_set);
+	printf("  delete_selected_annotations (%d annotations): %.2f ms\n", deleted_count,
+	       get_seconds_elapsed(start, get_clock()) * 1000.0f);
+	start = get_clock();
+	autosave_annotations(app_state, annotation_set, true);
+	printf("  autosave_annotations: %.2f ms\n", get_seconds_elapsed(start, get_clock()) * 1000.0f);
+
+	destroy_annotation_set(annotation_set);
+	free(scene);
+	// The annotation geometry on the GPU is shared, so the annotations of the displayed image need to go up again.
+	annotation_set_t* displayed_annotation_set = &app_state->scenes[0].annotation_set;
+	if (displayed_annotation_set->enabled) {
+		displayed_annotation_set->needs_geometry_upload = true;
+	}
+	printf("Annotation stress test done (files left in %s)\n", ANNOTATION_STRESS_FILENAME);
+	if (params->quit_when_done) {
+		is_program_running = false;
+	}
+}
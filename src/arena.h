@@ -32,6 +32,21 @@ static void* push_size_(arena_t* arena, size_t size) {
 	return result;
 }
 
+// Like push_size(), but returns NULL if the arena is full, so that the caller can fall back to the heap.
+#define try_push_array(arena, count, type) (type*) try_push_size((arena), (count)* sizeof(type))
+static void* try_push_size(arena_t* arena, size_t size) {
+	if (size > arena->size - arena->used) return NULL;
+	void* result = arena->base + arena->used;
+	arena->used += size;
+	return result;
+}
+
+// Throws away everything on the arena (e.g. at the start of a frame, or after a task is finished).
+static void reset_arena(arena_t* arena) {
+	ASSERT(arena->temp_count == 0);
+	arena->used = 0;
+}
+
 static temp_memory_t begin_temp_memory(arena_t* arena) {
 	temp_memory_t result = {
 			.arena = arena,
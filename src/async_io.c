@@ -0,0 +1,341 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "common.h"
+
+#include <stdio.h>
+
+#if WINDOWS
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define IO_URING_SUPPORTED 1
+#else
+#define IO_URING_SUPPORTED 0
+#endif
+#endif
+
+#include "async_io.h"
+
+i32 io_coalesce_ranges(u64* offsets, u64* sizes, i32 count, u64 max_gap, u64 max_range_size,
+                       io_range_t* ranges, u64* positions, i32* range_indices) {
+	ASSERT(count <= IO_READ_BATCH_MAX);
+	i32 order[IO_READ_BATCH_MAX];
+	for (i32 i = 0; i < count; ++i) {
+		// insertion sort by offset (the batches are small)
+		i32 j = i;
+		while (j > 0 && offsets[order[j-1]] > offsets[i]) {
+			order[j] = order[j-1];
+			--j;
+		}
+		order[j] = i;
+	}
+
+	i32 range_count = 0;
+	u64 range_position = 0; // where the current range starts in the buffer
+	for (i32 k = 0; k < count; ++k) {
+		i32 i = order[k];
+		u64 offset = offsets[i];
+		u64 end = offset + sizes[i];
+		if (range_count > 0) {
+			io_range_t* range = ranges + range_count - 1;
+			u64 range_end = range->offset + range->size;
+			if (offset <= range_end + max_gap && MAX(end, range_end) - range->offset <= max_range_size) {
+				range->size = MAX(end, range_end) - range->offset;
+				positions[i] = range_position + (offset - range->offset);
+				range_indices[i] = range_count - 1;
+				continue;
+			}
+			range_position += range->size;
+		}
+		ranges[range_count] = (io_range_t){ .offset = offset, .size = sizes[i] };
+		positions[i] = range_position;
+		range_indices[i] = range_count;
+		++range_count;
+	}
+	return range_count;
+}
+
+#if WINDOWS
+
+static THREAD_LOCAL HANDLE io_events[IO_READ_BATCH_MAX];
+
+bool32 io_read_batch(io_read_request_t* requests, i32 count) {
+	bool32 result = true;
+	for (i32 batch_start = 0; batch_start < count; batch_start += IO_READ_BATCH_MAX) {
+		i32 batch_count = MIN(count - batch_start, IO_READ_BATCH_MAX);
+		OVERLAPPED overlapped[IO_READ_BATCH_MAX];
+		bool32 is_submitted[IO_READ_BATCH_MAX];
+
+		// First submit everything...
+		for (i32 i = 0; i < batch_count; ++i) {
+			io_read_request_t* request = requests + batch_start + i;
+			request->bytes_read = 0;
+			if (!io_events[i]) {
+				io_events[i] = CreateEventA(NULL, TRUE, FALSE, NULL);
+			}
+			ResetEvent(io_events[i]);
+			overlapped[i] = (OVERLAPPED){};
+			overlapped[i].Offset = (DWORD)(request->offset & 0xFFFFFFFF);
+			overlapped[i].OffsetHigh = (DWORD)(request->offset >> 32);
+			overlapped[i].hEvent = io_events[i];
+			is_submitted[i] = true;
+			if (!ReadFile(request->file, request->dest, request->size, NULL, overlapped + i)) {
+				DWORD error = GetLastError();
+				if (error != ERROR_IO_PENDING) {
+					printf("ReadFile failed (error code 0x%x)\n", (u32)error);
+					is_submitted[i] = false;
+				}
+			}
+		}
+
+		// ...then wait for all of it to come in.
+		for (i32 i = 0; i < batch_count; ++i) {
+			io_read_request_t* request = requests + batch_start + i;
+			if (is_submitted[i]) {
+				DWORD bytes_read = 0;
+				if (GetOverlappedResult(request->file, overlapped + i, &bytes_read, TRUE)) {
+					request->bytes_read = bytes_read;
+				} else {
+					printf("GetOverlappedResult failed (error code 0x%x)\n", (u32)GetLastError());
+				}
+			}
+			if (request->bytes_read != request->size) {
+				result = false;
+			}
+		}
+	}
+	return result;
+}
+
+// (looked up at run time, because PrefetchVirtualMemory() doesn't exist before Windows 8)
+typedef BOOL (WINAPI *prefetch_virtual_memory_func_t)(HANDLE process, ULONG_PTR entry_count, void* entries, ULONG flags);
+typedef struct prefetch_range_entry_t {
+	void* address;
+	SIZE_T size;
+} prefetch_range_entry_t; // WIN32_MEMORY_RANGE_ENTRY
+
+void io_readahead(io_file_t file, u8* mapped_data, io_range_t* ranges, i32 count) {
+	static prefetch_virtual_memory_func_t prefetch_virtual_memory;
+	static bool32 is_looked_up;
+	if (!is_looked_up) {
+		prefetch_virtual_memory = (prefetch_virtual_memory_func_t)
+				GetProcAddress(GetModuleHandleA("kernel32.dll"), "PrefetchVirtualMemory");
+		is_looked_up = true;
+	}
+	if (!prefetch_virtual_memory || count <= 0) return;
+
+	// The pages of a file mapping are the same pages that the file cache uses for ReadFile(), so prefetching them
+	// through a temporary view also warms up the reads. The reads go on after the view is unmapped.
+	HANDLE mapping = NULL;
+	u8* view = mapped_data;
+	if (!view) {
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (!mapping) return;
+		view = (u8*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!view) {
+			CloseHandle(mapping);
+			return;
+		}
+	}
+	prefetch_range_entry_t entries[IO_READ_BATCH_MAX];
+	i32 entry_count = MIN(count, IO_READ_BATCH_MAX);
+	for (i32 i = 0; i < entry_count; ++i) {
+		entries[i].address = view + ranges[i].offset;
+		entries[i].size = (SIZE_T)ranges[i].size;
+	}
+	prefetch_virtual_memory(GetCurrentProcess(), entry_count, entries, 0);
+	if (mapping) {
+		UnmapViewOfFile(view);
+		CloseHandle(mapping);
+	}
+}
+
+#else
+
+// Reads the rest of a request synchronously (also used to finish short reads).
+static void pread_request(io_read_request_t* request) {
+	while (request->bytes_read < request->size) {
+		ssize_t ret = pread(request->file, (u8*)request->dest + request->bytes_read, request->size - request->bytes_read,
+		                    (off_t)(request->offset + request->bytes_read));
+		if (ret < 0 && errno == EINTR) continue;
+		if (ret <= 0) break; // error or end of file
+		request->bytes_read += (u32)ret;
+	}
+}
+
+#if IO_URING_SUPPORTED
+
+// Minimal io_uring setup using the raw system calls (no dependency on liburing), one ring per thread.
+typedef struct io_uring_t {
+	bool32 is_initialized;
+	bool32 is_available;
+	i32 ring_fd;
+	u32* sq_tail;
+	u32* sq_mask;
+	u32* sq_array;
+	struct io_uring_sqe* sqes;
+	u32* cq_head;
+	u32* cq_tail;
+	u32* cq_mask;
+	struct io_uring_cqe* cqes;
+} io_uring_t;
+
+static THREAD_LOCAL io_uring_t io_uring;
+
+static void io_uring_init(io_uring_t* ring) {
+	ring->is_initialized = true;
+	struct io_uring_params params = {0};
+	i32 fd = (i32)syscall(__NR_io_uring_setup, IO_READ_BATCH_MAX, &params);
+	if (fd < 0) {
+		return; // not supported by the kernel, or not allowed (e.g. in a container)
+	}
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		sq_size = cq_size = MAX(sq_size, cq_size);
+	}
+	u8* sq = (u8*) mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	u8* cq = sq;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) && sq != MAP_FAILED) {
+		cq = (u8*) mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	}
+	struct io_uring_sqe* sqes = (struct io_uring_sqe*) mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+	                                                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+		close(fd); // Note: the mappings that did succeed are leaked, but this only happens once per thread
+		return;
+	}
+	ring->ring_fd = fd;
+	ring->sq_tail = (u32*)(sq + params.sq_off.tail);
+	ring->sq_mask = (u32*)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (u32*)(sq + params.sq_off.array);
+	ring->sqes = sqes;
+	ring->cq_head = (u32*)(cq + params.cq_off.head);
+	ring->cq_tail = (u32*)(cq + params.cq_off.tail);
+	ring->cq_mask = (u32*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	ring->is_available = true;
+}
+
+// Returns false if the batch could not be submitted at all (the caller should fall back to pread()).
+static bool32 io_uring_read_batch(io_uring_t* ring, io_read_request_t* requests, i32 count) {
+	u32 tail = *ring->sq_tail;
+	u32 mask = *ring->sq_mask;
+	for (i32 i = 0; i < count; ++i) {
+		io_read_request_t* request = requests + i;
+		u32 index = (tail + i) & mask;
+		struct io_uring_sqe* sqe = ring->sqes + index;
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = request->file;
+		sqe->off = request->offset;
+		sqe->addr = (u64)(uintptr_t)request->dest;
+		sqe->len = request->size;
+		sqe->user_data = (u64)i;
+		ring->sq_array[index] = index;
+	}
+	__atomic_store_n(ring->sq_tail, tail + count, __ATOMIC_RELEASE);
+
+	i32 submitted = 0;
+	i32 completed = 0;
+	while (completed < count) {
+		i32 to_submit = count - submitted;
+		i32 ret = (i32)syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			if (submitted == 0) {
+				// Nothing was submitted: take the entries back out of the queue.
+				__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+				return false;
+			}
+			break;
+		}
+		submitted += ret;
+
+		u32 head = *ring->cq_head;
+		u32 cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != cq_tail) {
+			struct io_uring_cqe* cqe = ring->cqes + (head & *ring->cq_mask);
+			io_read_request_t* request = requests + cqe->user_data;
+			if (cqe->res >= 0) {
+				request->bytes_read = (u32)cqe->res;
+			}
+			++completed;
+			++head;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return true;
+}
+
+#endif //IO_URING_SUPPORTED
+
+bool32 io_read_batch(io_read_request_t* requests, i32 count) {
+	for (i32 i = 0; i < count; ++i) {
+		requests[i].bytes_read = 0;
+	}
+#if IO_URING_SUPPORTED
+	if (!io_uring.is_initialized) {
+		io_uring_init(&io_uring);
+	}
+	if (io_uring.is_available) {
+		for (i32 batch_start = 0; batch_start < count; batch_start += IO_READ_BATCH_MAX) {
+			i32 batch_count = MIN(count - batch_start, IO_READ_BATCH_MAX);
+			if (!io_uring_read_batch(&io_uring, requests + batch_start, batch_count)) {
+				io_uring.is_available = false; // e.g. IORING_OP_READ not supported by this kernel
+				break;
+			}
+		}
+	}
+#endif
+	// pread() fallback; this also finishes any reads that io_uring could only partly complete.
+	bool32 result = true;
+	for (i32 i = 0; i < count; ++i) {
+		io_read_request_t* request = requests + i;
+		if (request->bytes_read < request->size) {
+			pread_request(request);
+		}
+		if (request->bytes_read != request->size) {
+			result = false;
+		}
+	}
+	return result;
+}
+
+void io_readahead(io_file_t file, u8* mapped_data, io_range_t* ranges, i32 count) {
+	for (i32 i = 0; i < count; ++i) {
+		if (mapped_data) {
+			// (madvise() wants a page-aligned address)
+			u64 page_size = (u64)sysconf(_SC_PAGESIZE);
+			u64 offset = ROUND_DOWN_POW2(ranges[i].offset, page_size);
+			madvise(mapped_data + offset, ranges[i].size + (ranges[i].offset - offset), MADV_WILLNEED);
+		} else {
+			posix_fadvise(file, (off_t)ranges[i].offset, (off_t)ranges[i].size, POSIX_FADV_WILLNEED);
+		}
+	}
+}
+
+#endif
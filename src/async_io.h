@@ -0,0 +1,78 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+// Batched file reads: all the requests in a batch are in flight at the same time, so a single thread can keep many
+// reads outstanding (network storage only reaches full bandwidth at a high queue depth).
+// Windows: overlapped ReadFile() (the file must be opened with FILE_FLAG_OVERLAPPED).
+// Linux: io_uring, falling back to pread() if io_uring is not available.
+
+#define IO_READ_BATCH_MAX 64 // larger batches are split up
+
+#if WINDOWS
+typedef void* io_file_t; // HANDLE
+#else
+typedef int io_file_t; // file descriptor
+#endif
+
+typedef struct io_read_request_t {
+	io_file_t file;
+	u64 offset;
+	u32 size;
+	void* dest;
+	u32 bytes_read; // set when the read has completed
+} io_read_request_t;
+
+// Blocks until every request has completed. Returns true if all requests were read in full.
+bool32 io_read_batch(io_read_request_t* requests, i32 count);
+
+// Read coalescing: tiles are often stored back to back in the file, so instead of one small read per tile it is
+// much cheaper (on spinning disks, network shares and the tile server) to do one larger sequential read.
+#define IO_COALESCE_MAX_GAP KILOBYTES(64) // bytes in between two requests that we are willing to read and throw away
+#define IO_COALESCE_MAX_SIZE MEGABYTES(4)
+
+typedef struct io_range_t {
+	u64 offset;
+	u64 size;
+} io_range_t;
+
+// Sorts the requested byte ranges by offset and merges the ones that overlap or are at most max_gap bytes apart.
+// Returns the number of merged ranges. When the merged ranges are read one after another into a single buffer,
+// request i ends up at positions[i] in that buffer, as part of ranges[range_indices[i]].
+// At most IO_READ_BATCH_MAX requests.
+i32 io_coalesce_ranges(u64* offsets, u64* sizes, i32 count, u64 max_gap, u64 max_range_size,
+                       io_range_t* ranges, u64* positions, i32* range_indices);
+
+// Readahead hints: asks the OS to start reading the ranges into its page cache in the background, without waiting for
+// it and without a buffer to read into, so that reading them later is cheap. If mapped_data is set (a memory-mapped
+// file), the ranges are prefetched through the mapping. Not useful for files opened for unbuffered (direct) I/O.
+// Windows: PrefetchVirtualMemory() through a file mapping (Windows 8 and later; otherwise this does nothing).
+// Linux: posix_fadvise(POSIX_FADV_WILLNEED), or madvise(MADV_WILLNEED) for mapped files.
+void io_readahead(io_file_t file, u8* mapped_data, io_range_t* ranges, i32 count);
+
+#ifdef __cplusplus
+}
+#endif
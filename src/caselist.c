@@ -20,8 +20,10 @@
 
 #include <stdio.h>
 
+#include "win32_main.h"
 #include "platform.h"
-#include "parson.h"
+#include "intrinsics.h"
+#include "stretchy_buffer.h"
 #include "stringutils.h"
 
 #define CASELIST_IMPL
@@ -30,6 +32,109 @@
 #include "gui.h"
 #include "tlsclient.h"
 
+// Prefetching happens on a few background threads with idle priority, so that it doesn't compete with the slide
+// that is being viewed. For remote case lists, the headers of the next slides are downloaded (they include the tiles
+// of the coarsest level, see tiff_serialize()); for local ones, the same parts of the files are read, so that they
+// are in the OS file cache.
+typedef struct {
+	char path[2048]; // the filename on the server, or the path of the local file
+	bool32 is_remote;
+	char hostname[256];
+	i32 portno;
+} caselist_prefetch_item_t;
+
+static caselist_prefetch_item_t prefetch_items[CASELIST_PREFETCH_COUNT];
+static i32 prefetch_item_count;
+static i32 prefetch_next_item; // the first one that hasn't been picked up yet
+static volatile i32 prefetch_lock;
+static HANDLE prefetch_semaphore;
+static bool32 is_prefetch_started;
+
+static bool32 is_current_slide_loading() {
+	return is_queue_work_in_progress(&work_queue) || !are_remote_downloads_idle();
+}
+
+static void prefetch_local_slide(const char* path) {
+	tiff_t tiff = {0};
+	if (open_tiff_file(&tiff, path)) {
+		tiff_ifd_t* coarsest_level = tiff_get_coarsest_level(&tiff);
+		if (coarsest_level && tiff_load_tile_tables(&tiff, coarsest_level)) {
+			u64 size = 0;
+			u8* tile_data = tiff_read_all_tiles(&tiff, coarsest_level, TIFF_SERIAL_TILE_DATA_MAX_SIZE, &size);
+			if (tile_data) free(tile_data);
+		}
+	}
+	tiff_destroy(&tiff);
+}
+
+// Woken up once for every item in the list.
+static DWORD WINAPI caselist_prefetch_thread_proc(LPVOID parameter) {
+	for (;;) {
+		WaitForSingleObject(prefetch_semaphore, INFINITE);
+		i32 idle_ms = 0;
+		while (idle_ms < CASELIST_PREFETCH_IDLE_MS) {
+			platform_sleep(50);
+			idle_ms = is_current_slide_loading() ? 0 : idle_ms + 50;
+		}
+		caselist_prefetch_item_t item;
+		spin_lock(&prefetch_lock);
+		bool32 has_item = (prefetch_next_item < prefetch_item_count);
+		if (has_item) item = prefetch_items[prefetch_next_item++];
+		spin_unlock(&prefetch_lock);
+		if (!has_item) continue; // the list was replaced meanwhile
+
+		if (item.is_remote) {
+			prefetch_remote_slide_header(item.hostname, item.portno, item.path);
+		} else {
+			prefetch_local_slide(item.path);
+		}
+	}
+	return 0;
+}
+
+// Replaces the list of slides to prefetch with those of the cases after case_index (-1 for the start of the list).
+void caselist_prefetch_after(caselist_t* caselist, i32 case_index) {
+	if (!is_prefetch_started) {
+		prefetch_semaphore = CreateSemaphoreA(NULL, 0, INT32_MAX, NULL);
+		for (i32 i = 0; i < CASELIST_PREFETCH_THREAD_COUNT; ++i) {
+			HANDLE thread_handle = CreateThread(NULL, 0, caselist_prefetch_thread_proc, NULL, 0, NULL);
+			SetThreadPriority(thread_handle, THREAD_PRIORITY_IDLE);
+			CloseHandle(thread_handle);
+		}
+		is_prefetch_started = true;
+	}
+
+	spin_lock(&prefetch_lock);
+	prefetch_item_count = 0;
+	prefetch_next_item = 0;
+	for (i32 i = case_index + 1; i < (i32)caselist->num_cases_with_filenames; ++i) {
+		if (prefetch_item_count == CASELIST_PREFETCH_COUNT) break;
+		case_t* the_case = caselist->cases + i;
+		caselist_prefetch_item_t* item = prefetch_items + prefetch_item_count++;
+		memset(item, 0, sizeof(*item));
+		item->is_remote = caselist->is_remote;
+		if (caselist->is_remote) {
+			strncpy(item->path, the_case->filename, sizeof(item->path) - 1);
+			strncpy(item->hostname, caselist->hostname, sizeof(item->hostname) - 1);
+			item->portno = caselist->portno;
+		} else {
+			snprintf(item->path, sizeof(item->path), "%s%s", caselist->folder_prefix, the_case->filename);
+		}
+	}
+	i32 item_count = prefetch_item_count;
+	spin_unlock(&prefetch_lock);
+	if (item_count > 0) {
+		ReleaseSemaphore(prefetch_semaphore, item_count, NULL);
+	}
+}
+
+static void caselist_cancel_prefetch() {
+	spin_lock(&prefetch_lock);
+	prefetch_item_count = 0;
+	prefetch_next_item = 0;
+	spin_unlock(&prefetch_lock);
+}
+
 
 void reset_global_caselist(app_state_t* app_state) {
 	app_state->selected_case = NULL;
@@ -45,56 +150,377 @@ void reload_global_caselist(app_state_t *app_state, const char *filename) {
 	load_caselist_from_file(&app_state->caselist, filename);
 }
 
-bool32 load_caselist(caselist_t* caselist, mem_t* file_mem, const char* caselist_name) {
+// A minimal JSON scanner, for going through the case list once without building a DOM: values that are not needed are
+// skipped over, strings are only located (and decoded later, if needed).
+typedef struct {
+	const char* begin;
+	const char* p;
+	const char* end;
+} json_scanner_t;
 
-	bool32 success = false;
+static void json_skip_whitespace(json_scanner_t* s) {
+	while (s->p < s->end && (*s->p == ' ' || *s->p == '\t' || *s->p == '\n' || *s->p == '\r')) {
+		++s->p;
+	}
+}
+
+static bool32 json_expect(json_scanner_t* s, char c) {
+	json_skip_whitespace(s);
+	if (s->p < s->end && *s->p == c) {
+		++s->p;
+		return true;
+	}
+	return false;
+}
 
-	if (file_mem) {
-		JSON_Value* root_value = json_parse_string((const char*)file_mem->data);
-		if (json_value_get_type(root_value) != JSONArray) {
-			// failed
+static bool32 json_peek(json_scanner_t* s, char c) {
+	json_skip_whitespace(s);
+	return (s->p < s->end && *s->p == c);
+}
 
-		} else {
-			caselist->json_root_value = root_value;
-
-			// The base element of the cases file is an unnamed array; each element is a case
-			JSON_Array* json_cases = json_value_get_array(root_value);
-			caselist->case_count = (u32) json_array_get_count(json_cases);
-
-			if (caselist->case_count > 0) {
-				caselist->cases = (case_t*) calloc(1, caselist->case_count * sizeof(case_t));
-				caselist->names = (const char**) calloc(1, caselist->case_count * sizeof(void*));
-
-
-				i32 num_cases_with_filenames = 0;
-				for (i32 i = 0; i < caselist->case_count; ++i) {
-					i32 curr_index = num_cases_with_filenames;
-					case_t* the_case = caselist->cases + curr_index;
-					JSON_Object* json_case_obj = json_array_get_object(json_cases, (size_t) i);
-					the_case->name = json_object_get_string(json_case_obj, "name");
-					if (!the_case->name) {
-						printf("%s: case %d has no name element, defaulting to '(unnamed)'\n", caselist_name, i);
-						the_case->name = "(unnamed)";
-					}
-					the_case->clinical_context = json_object_get_string(json_case_obj, "clinical_context");
-					the_case->diagnosis = json_object_get_string(json_case_obj, "diagnosis");
-					the_case->notes = json_object_get_string(json_case_obj, "notes");
-					const char* image_filename = json_object_get_string(json_case_obj, "filename");
-					if (image_filename) {
-						++num_cases_with_filenames;
-						strncpy(the_case->filename, image_filename, sizeof(the_case->filename));
-						caselist->names[curr_index] = the_case->name; // for ImGui
+// Expects to be at the opening quote; returns the string as it is in the document (without the quotes).
+static bool32 json_scan_string(json_scanner_t* s, const char** string, u32* length) {
+	if (!json_expect(s, '"')) return false;
+	const char* start = s->p;
+	while (s->p < s->end && *s->p != '"') {
+		s->p += (*s->p == '\\') ? 2 : 1;
+	}
+	if (s->p >= s->end) return false;
+	*string = start;
+	*length = (u32)(s->p - start);
+	++s->p; // closing quote
+	return true;
+}
+
+static bool32 json_skip_value(json_scanner_t* s) {
+	json_skip_whitespace(s);
+	if (s->p >= s->end) return false;
+	const char* string;
+	u32 length;
+	if (*s->p == '"') {
+		return json_scan_string(s, &string, &length);
+	} else if (*s->p == '{' || *s->p == '[') {
+		i32 depth = 0;
+		while (s->p < s->end) {
+			char c = *s->p;
+			if (c == '"') {
+				if (!json_scan_string(s, &string, &length)) return false;
+				continue;
+			}
+			++s->p;
+			if (c == '{' || c == '[') {
+				++depth;
+			} else if (c == '}' || c == ']') {
+				if (--depth == 0) return true;
+			}
+		}
+		return false;
+	} else {
+		// number, true, false or null
+		const char* start = s->p;
+		while (s->p < s->end && *s->p != ',' && *s->p != '}' && *s->p != ']' && *s->p != ' ' && *s->p != '\t' &&
+		       *s->p != '\n' && *s->p != '\r') {
+			++s->p;
+		}
+		return s->p > start;
+	}
+}
+
+static u32 json_hex4(const char* p) {
+	u32 value = 0;
+	for (i32 i = 0; i < 4; ++i) {
+		char c = p[i];
+		u32 digit = (c >= '0' && c <= '9') ? (u32)(c - '0') : (c >= 'a' && c <= 'f') ? (u32)(c - 'a' + 10) :
+		            (c >= 'A' && c <= 'F') ? (u32)(c - 'A' + 10) : 0;
+		value = (value << 4) | digit;
+	}
+	return value;
+}
+
+// Unescapes a JSON string (as returned by json_scan_string()) into UTF-8. The result is never longer than the escaped
+// string, so dest needs length + 1 bytes. Returns the decoded length.
+static u32 json_decode_string(const char* src, u32 length, char* dest) {
+	const char* end = src + length;
+	char* out = dest;
+	while (src < end) {
+		char c = *src++;
+		if (c != '\\' || src >= end) {
+			*out++ = c;
+			continue;
+		}
+		c = *src++;
+		switch (c) {
+			case 'b': *out++ = '\b'; break;
+			case 'f': *out++ = '\f'; break;
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case 'u': {
+				if (end - src < 4) {
+					src = end;
+					break;
+				}
+				u32 code_point = json_hex4(src);
+				src += 4;
+				if (code_point >= 0xD800 && code_point < 0xDC00 && end - src >= 6 && src[0] == '\\' && src[1] == 'u') {
+					u32 low = json_hex4(src + 2);
+					if (low >= 0xDC00 && low < 0xE000) {
+						code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+						src += 6;
 					}
+				}
+				if (code_point < 0x80) {
+					*out++ = (char)code_point;
+				} else if (code_point < 0x800) {
+					*out++ = (char)(0xC0 | (code_point >> 6));
+					*out++ = (char)(0x80 | (code_point & 0x3F));
+				} else if (code_point < 0x10000) {
+					*out++ = (char)(0xE0 | (code_point >> 12));
+					*out++ = (char)(0x80 | ((code_point >> 6) & 0x3F));
+					*out++ = (char)(0x80 | (code_point & 0x3F));
+				} else {
+					*out++ = (char)(0xF0 | (code_point >> 18));
+					*out++ = (char)(0x80 | ((code_point >> 12) & 0x3F));
+					*out++ = (char)(0x80 | ((code_point >> 6) & 0x3F));
+					*out++ = (char)(0x80 | (code_point & 0x3F));
+				}
+			} break;
+			default: *out++ = c; break; // '"', '\\' and '/'
+		}
+	}
+	*out = '\0';
+	return (u32)(out - dest);
+}
+
+// Decodes the string onto the end of the string pool; returns its offset in the pool.
+static u32 push_decoded_string(char** string_pool, const char* string, u32 length) {
+	u32 offset = sb_count(*string_pool);
+	char* dest = sb_add(*string_pool, length + 1);
+	u32 decoded_length = json_decode_string(string, length, dest);
+	sb_raw_count(*string_pool) = offset + decoded_length + 1;
+	return offset;
+}
+
+typedef struct {
+	u32 name_offset;
+	u32 filename_offset;
+} case_strings_t;
 
+// Scans the JSON document (which needs to stay valid until the details have been located): builds the index of the
+// cases with a filename, and the search text. If keep_document is set, the case list takes over file_mem (needed for
+// remote case lists, whose details can't be read back from a file later).
+bool32 load_caselist(caselist_t* caselist, mem_t* file_mem, const char* caselist_name, bool32 keep_document) {
+	if (!file_mem) {
+		return false;
+	}
+	json_scanner_t scanner = { (const char*)file_mem->data, (const char*)file_mem->data,
+	                           (const char*)file_mem->data + file_mem->len };
+	json_scanner_t* s = &scanner;
+	case_strings_t* case_strings = NULL; // sb, until the string pool has its final address
+	bool32 success = json_expect(s, '[');
+	u32 case_count = 0;
+	u32 unnamed_offset = 0;
+	bool32 has_unnamed = false;
+	while (success && !json_expect(s, ']')) {
+		if (case_count > 0 && !json_expect(s, ',')) {
+			success = false;
+			break;
+		}
+		i32 case_index = case_count++;
+		if (!json_peek(s, '{')) {
+			success = json_skip_value(s); // not an object: no name or filename either
+			continue;
+		}
+		++s->p;
+		case_t the_case = {0};
+		case_strings_t strings = {0};
+		bool32 has_name = false;
+		bool32 has_filename = false;
+		bool32 is_first_member = true;
+		while (!json_expect(s, '}')) {
+			const char* key;
+			u32 key_length;
+			if ((!is_first_member && !json_expect(s, ',')) || !json_scan_string(s, &key, &key_length) ||
+			    !json_expect(s, ':')) {
+				success = false;
+				break;
+			}
+			is_first_member = false;
+			if (!json_peek(s, '"')) {
+				if (!json_skip_value(s)) {
+					success = false;
+					break;
 				}
-				caselist->num_cases_with_filenames = num_cases_with_filenames;
+				continue; // (only strings are used)
+			}
+			const char* value;
+			u32 value_length;
+			if (!json_scan_string(s, &value, &value_length)) {
+				success = false;
+				break;
+			}
+			#define KEY_IS(k) (key_length == sizeof(k) - 1 && memcmp(key, k, sizeof(k) - 1) == 0)
+			i32 detail = -1;
+			if (KEY_IS("name")) {
+				strings.name_offset = push_decoded_string(&caselist->string_pool, value, value_length);
+				has_name = true;
+			} else if (KEY_IS("filename")) {
+				strings.filename_offset = push_decoded_string(&caselist->string_pool, value, value_length);
+				has_filename = true;
+			} else if (KEY_IS("clinical_context")) {
+				detail = CASE_DETAIL_CLINICAL_CONTEXT;
+			} else if (KEY_IS("diagnosis")) {
+				detail = CASE_DETAIL_DIAGNOSIS;
+			} else if (KEY_IS("notes")) {
+				detail = CASE_DETAIL_NOTES;
+			}
+			#undef KEY_IS
+			if (detail >= 0) {
+				the_case.details[detail] = (case_detail_ref_t){ .offset = (u64)(value - s->begin), .length = value_length };
+			}
+		}
+		if (!success) break;
+		if (!has_name) {
+			printf("%s: case %d has no name element, defaulting to '(unnamed)'\n", caselist_name, case_index);
+			if (!has_unnamed) {
+				unnamed_offset = push_decoded_string(&caselist->string_pool, "(unnamed)", 9);
+				has_unnamed = true;
+			}
+			strings.name_offset = unnamed_offset;
+		}
+		if (has_filename) {
+			sb_push(caselist->cases, the_case);
+			sb_push(case_strings, strings);
+		}
+	}
+
+	if (!success || case_count == 0) {
+		if (!success) printf("%s: could not parse the case list\n", caselist_name);
+		sb_free(case_strings);
+		sb_free(caselist->cases);
+		sb_free(caselist->string_pool);
+		caselist->cases = NULL;
+		caselist->string_pool = NULL;
+		return false;
+	}
+
+	caselist->case_count = case_count;
+	caselist->num_cases_with_filenames = sb_count(caselist->cases);
+	u32 search_text_size = 0;
+	for (u32 i = 0; i < caselist->num_cases_with_filenames; ++i) {
+		case_t* the_case = caselist->cases + i;
+		the_case->name = caselist->string_pool + case_strings[i].name_offset;
+		the_case->filename = caselist->string_pool + case_strings[i].filename_offset;
+		search_text_size += (u32)strlen(the_case->name) + 1;
+	}
+	sb_free(case_strings);
+
+	// The search text: the names in lowercase, separated by zero bytes (so that a match can't span two names)
+	caselist->search_text = (char*) malloc(search_text_size + 1);
+	caselist->search_offsets = (u32*) malloc((caselist->num_cases_with_filenames + 1) * sizeof(u32));
+	u32 pos = 0;
+	for (u32 i = 0; i < caselist->num_cases_with_filenames; ++i) {
+		caselist->search_offsets[i] = pos;
+		for (const char* c = caselist->cases[i].name; *c; ++c) {
+			caselist->search_text[pos++] = (char)((*c >= 'A' && *c <= 'Z') ? *c - 'A' + 'a' : *c);
+		}
+		caselist->search_text[pos++] = '\0';
+	}
+	caselist->search_offsets[caselist->num_cases_with_filenames] = pos;
+	caselist->search_text[pos] = '\0';
 
+	if (keep_document) {
+		caselist->document = file_mem;
+	}
+	return true;
+}
 
-				success = true;
+static char* load_case_detail(caselist_t* caselist, case_detail_ref_t ref) {
+	if (ref.offset == 0) {
+		return NULL; // the case doesn't have it
+	}
+	char* raw = NULL;
+	char* buffer = NULL;
+	if (caselist->document) {
+		if (ref.offset + ref.length > caselist->document->len) return NULL;
+		raw = (char*)caselist->document->data + ref.offset;
+	} else {
+		FILE* fp = fopen(caselist->json_filename, "rb");
+		if (!fp) return NULL;
+		buffer = (char*) malloc(ref.length + 1);
+		bool32 ok = (fseeko64(fp, ref.offset, SEEK_SET) == 0) && (fread(buffer, 1, ref.length, fp) == ref.length);
+		fclose(fp);
+		if (!ok) {
+			free(buffer);
+			return NULL;
+		}
+		raw = buffer;
+	}
+	char* detail = (char*) malloc(ref.length + 1);
+	json_decode_string(raw, ref.length, detail);
+	free(buffer);
+	return detail;
+}
+
+// Returns the detail of the case (NULL if it doesn't have it), loading the details of the case if they are not loaded
+// yet. Only the details of one case are kept at a time: the result is valid until the details of another case are
+// asked for.
+const char* caselist_get_case_detail(caselist_t* caselist, case_t* the_case, case_detail_enum detail) {
+	if (caselist->detail_case != the_case) {
+		for (i32 i = 0; i < CASE_DETAIL_COUNT; ++i) {
+			free(caselist->details[i]);
+			caselist->details[i] = the_case ? load_case_detail(caselist, the_case->details[i]) : NULL;
+		}
+		caselist->detail_case = the_case;
+	}
+	return caselist->details[detail];
+}
+
+// Finds the cases whose names contain the query (ignoring case), in the order of the list. The results stay valid until
+// the next search with another query; searching again for the same query is free.
+i32 caselist_search(caselist_t* caselist, const char* query, i32** results) {
+	char lowercase_query[sizeof(caselist->search_query)];
+	u32 query_length = 0;
+	for (; query[query_length] && query_length < sizeof(lowercase_query) - 1; ++query_length) {
+		char c = query[query_length];
+		lowercase_query[query_length] = (char)((c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c);
+	}
+	lowercase_query[query_length] = '\0';
+	if (!caselist->has_search_results || strcmp(lowercase_query, caselist->search_query) != 0) {
+		if (caselist->search_results) sb_raw_count(caselist->search_results) = 0;
+		i32 count = caselist->num_cases_with_filenames;
+		if (query_length == 0) {
+			for (i32 i = 0; i < count; ++i) {
+				sb_push(caselist->search_results, i);
+			}
+		} else if (count > 0) {
+			// One pass over the search text; after a match, continue with the next name.
+			i32 case_index = 0;
+			const char* text = caselist->search_text;
+			const char* text_end = text + caselist->search_offsets[count];
+			const char* p = text;
+			while (p < text_end) {
+				const char* match = strstr(p, lowercase_query);
+				if (!match) {
+					// (strstr stops at the zero byte after each name, so go on with the next one)
+					while (case_index < count && caselist->search_offsets[case_index] <= (u32)(p - text)) ++case_index;
+					if (case_index >= count) break;
+					p = text + caselist->search_offsets[case_index];
+					continue;
+				}
+				u32 match_pos = (u32)(match - text);
+				while (case_index + 1 < count && caselist->search_offsets[case_index + 1] <= match_pos) ++case_index;
+				sb_push(caselist->search_results, case_index);
+				++case_index;
+				if (case_index >= count) break;
+				p = text + caselist->search_offsets[case_index];
 			}
 		}
+		strcpy(caselist->search_query, lowercase_query);
+		caselist->has_search_results = true;
 	}
-	return success;
+	*results = caselist->search_results;
+	return sb_count(caselist->search_results);
 }
 
 bool32 load_caselist_from_file(caselist_t* caselist, const char* json_filename) {
@@ -110,8 +536,10 @@ bool32 load_caselist_from_file(caselist_t* caselist, const char* json_filename)
 		caselist->prefix_len = strlen(caselist->folder_prefix);
 
 		caselist->is_remote = false;
-		success = load_caselist(caselist, caselist_file, json_filename);
+		strncpy(caselist->json_filename, json_filename, sizeof(caselist->json_filename) - 1);
+		success = load_caselist(caselist, caselist_file, json_filename, false); // (the details are read back later)
 		free(caselist_file);
+		if (success) caselist_prefetch_after(caselist, -1);
 	}
 	return success;
 }
@@ -121,22 +549,39 @@ bool32 load_caselist_from_remote(caselist_t* caselist, const char* hostname, i32
 
 	mem_t* json_file = download_remote_caselist(hostname, portno, name); // load from remote
 	caselist->is_remote = true;
-	success = load_caselist(caselist, json_file, name);
+	strncpy(caselist->hostname, hostname, sizeof(caselist->hostname) - 1);
+	caselist->portno = portno;
+	success = load_caselist(caselist, json_file, name, true);
+	if (!success && json_file) free(json_file);
+	if (success) caselist_prefetch_after(caselist, -1);
 
 	return success;
 }
 
 
 void caselist_destroy(caselist_t* caselist) {
+	caselist_cancel_prefetch();
 	if (caselist) {
-		if (caselist->json_root_value) {
-			json_value_free(caselist->json_root_value);
-			caselist->json_root_value = NULL;
+		sb_free(caselist->cases);
+		caselist->cases = NULL;
+		sb_free(caselist->string_pool);
+		caselist->string_pool = NULL;
+		free(caselist->search_text);
+		caselist->search_text = NULL;
+		free(caselist->search_offsets);
+		caselist->search_offsets = NULL;
+		sb_free(caselist->search_results);
+		caselist->search_results = NULL;
+		caselist->has_search_results = false;
+		if (caselist->document) {
+			free(caselist->document);
+			caselist->document = NULL;
 		}
-		if (caselist->cases) {
-			free(caselist->cases);
-			caselist->cases = NULL;
+		for (i32 i = 0; i < CASE_DETAIL_COUNT; ++i) {
+			free(caselist->details[i]);
+			caselist->details[i] = NULL;
 		}
+		caselist->detail_case = NULL;
 	}
 
 }
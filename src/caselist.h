@@ -18,18 +18,35 @@
 
 #pragma once
 #include "common.h"
-#include "parson.h"
 
 #define SLIDE_MAX_PATH 512
 #define SLIDE_MAX_META_STR 128
 
 
+// A case list is a JSON array of cases, each an object with a name, the filename of the slide, and some details
+// (clinical context, diagnosis, notes). Case lists can run into tens of MB, so the document is not kept as a DOM:
+// it is scanned once, and only an index is kept, of the names and filenames (decoded, in a string pool) and of where
+// the details of each case are in the document. The details are decoded when a case is selected (see
+// caselist_get_case_detail()): for a local case list, they are read back from the file; for a remote one, the
+// downloaded document is kept for this.
+
+typedef enum case_detail_enum {
+	CASE_DETAIL_CLINICAL_CONTEXT,
+	CASE_DETAIL_DIAGNOSIS,
+	CASE_DETAIL_NOTES,
+	CASE_DETAIL_COUNT
+} case_detail_enum;
+
+// A JSON string in the document, still escaped; offset 0 if the case doesn't have it
 typedef struct {
-	const char *name;
-	char filename[SLIDE_MAX_PATH];
-	const char *clinical_context;
-	const char *diagnosis;
-	const char *notes;
+	u64 offset; // of the first character after the opening quote
+	u32 length;
+} case_detail_ref_t;
+
+typedef struct {
+	const char* name; // in the string pool of the case list
+	const char* filename;
+	case_detail_ref_t details[CASE_DETAIL_COUNT];
 } case_t;
 
 typedef struct {
@@ -40,20 +57,38 @@ typedef struct {
 typedef struct {
 	u32 case_count;
 	u32 num_cases_with_filenames;
-	case_t *cases;
-	const char** names;
-	JSON_Value* json_root_value;
+	case_t *cases; // only the cases with a filename
+	char* string_pool;
+	char* search_text; // the names in lowercase, one after the other (see caselist_search())
+	u32* search_offsets; // where the name of each case starts in search_text
+	i32* search_results; // sb, for search_query
+	char search_query[128];
+	bool32 has_search_results;
+	mem_t* document; // remote case lists only
+	char json_filename[SLIDE_MAX_PATH]; // local case lists only
+	case_t* detail_case; // the case whose details are loaded (see caselist_get_case_detail())
+	char* details[CASE_DETAIL_COUNT];
 	bool32 is_remote;
+	char hostname[256]; // for remote case lists
+	i32 portno;
 	char folder_prefix[SLIDE_MAX_PATH]; // working directory
 	u32 prefix_len;
 } caselist_t;
 
+// The slides of the cases that come after the selected one are opened ahead of time (see caselist_prefetch_after()).
+#define CASELIST_PREFETCH_COUNT 3
+#define CASELIST_PREFETCH_THREAD_COUNT 3
+#define CASELIST_PREFETCH_IDLE_MS 250 // how long the current slide needs to have been done loading before we start
+
 typedef struct app_state_t app_state_t;
 void reset_global_caselist(app_state_t* app_state);
 void reload_global_caselist(app_state_t *app_state, const char *filename);
-bool32 load_caselist(caselist_t* caselist, mem_t* file_mem, const char* caselist_name);
+bool32 load_caselist(caselist_t* caselist, mem_t* file_mem, const char* caselist_name, bool32 keep_document);
 bool32 load_caselist_from_file(caselist_t* caselist, const char* json_filename);
 bool32 load_caselist_from_remote(caselist_t* caselist, const char* hostname, i32 portno, const char* name);
+const char* caselist_get_case_detail(caselist_t* caselist, case_t* the_case, case_detail_enum detail);
+i32 caselist_search(caselist_t* caselist, const char* query, i32** results);
+void caselist_prefetch_after(caselist_t* caselist, i32 case_index);
 void caselist_destroy(caselist_t* caselist);
 
 // globals
@@ -0,0 +1,367 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include "platform.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "color_pipeline.h"
+
+void init_color_adjustments(color_adjustments_t* adjustments) {
+	color_curve_t identity = { .black_level = 0.0f, .white_level = 1.0f, .gamma = 1.0f };
+	adjustments->master = identity;
+	for (i32 i = 0; i < COUNT(adjustments->channels); ++i) {
+		adjustments->channels[i] = identity;
+	}
+}
+
+// Auto-levels: sets the black and white level of the curve to the values at the low and high percentile (fractions,
+// e.g. 0.005 and 0.995) of the histogram, which has bin_count bins evenly spread over 0..1. Returns false if the
+// histogram is empty.
+bool32 set_levels_from_histogram(color_curve_t* curve, u32* bins, i32 bin_count, float low_percentile,
+                                 float high_percentile) {
+	u64 total = 0;
+	for (i32 i = 0; i < bin_count; ++i) {
+		total += bins[i];
+	}
+	if (total == 0 || bin_count < 2) {
+		return false;
+	}
+	u64 low_count = (u64)(low_percentile * (float)total);
+	u64 high_count = (u64)(high_percentile * (float)total);
+	i32 low_bin = 0;
+	i32 high_bin = bin_count - 1;
+	u64 count = 0;
+	for (i32 i = 0; i < bin_count; ++i) {
+		count += bins[i];
+		if (count > low_count) {
+			low_bin = i;
+			break;
+		}
+	}
+	count = 0;
+	for (i32 i = 0; i < bin_count; ++i) {
+		count += bins[i];
+		if (count >= high_count) {
+			high_bin = i;
+			break;
+		}
+	}
+	if (high_bin <= low_bin) {
+		return false; // (nearly) a single value, nothing to stretch
+	}
+	curve->black_level = (float)low_bin / (float)(bin_count - 1);
+	curve->white_level = (float)high_bin / (float)(bin_count - 1);
+	return true;
+}
+
+static float apply_color_curve(color_curve_t* curve, float value) {
+	float range = curve->white_level - curve->black_level;
+	if (fabsf(range) < 1e-4f) {
+		range = (range < 0.0f) ? -1e-4f : 1e-4f;
+	}
+	value = CLAMP((value - curve->black_level) / range, 0.0f, 1.0f);
+	if (curve->gamma > 0.0f && curve->gamma != 1.0f) {
+		value = powf(value, 1.0f / curve->gamma);
+	}
+	return value;
+}
+
+void init_stain_matrix(stain_matrix_t* matrix, stain_preset_enum preset) {
+	// The optical density vectors measured by Ruifrok & Johnston (2001)
+	static const float presets[STAIN_PRESET_COUNT][3][3] = {
+		[STAIN_PRESET_H_DAB] = {{0.650f, 0.704f, 0.286f}, {0.268f, 0.570f, 0.776f}, {0.0f, 0.0f, 0.0f}},
+		[STAIN_PRESET_H_E] = {{0.644f, 0.717f, 0.267f}, {0.093f, 0.954f, 0.283f}, {0.0f, 0.0f, 0.0f}},
+	};
+	memcpy(matrix->stains, presets[CLAMP((i32)preset, 0, STAIN_PRESET_COUNT - 1)], sizeof(matrix->stains));
+}
+
+static bool32 invert_matrix3x3(float m[3][3], float inverse[3][3]);
+
+static bool32 normalize3(float v[3]) {
+	float length = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+	if (length < 1e-6f) return false;
+	for (i32 i = 0; i < 3; ++i) {
+		v[i] /= length;
+	}
+	return true;
+}
+
+// Gets what the shader needs to show only one of the stains (0-2): the row of the inverse stain matrix that gives
+// the amount of that stain from the optical density, and the (normalized) optical density vector of the stain.
+// Returns false if the stains are not independent.
+bool32 get_stain_unmixing(stain_matrix_t* matrix, i32 stain_index, float unmixing[3], float stain_vector[3]) {
+	if (stain_index < 0 || stain_index > 2) return false;
+	float stains[3][3];
+	memcpy(stains, matrix->stains, sizeof(stains));
+	if (!normalize3(stains[0]) || !normalize3(stains[1])) return false;
+	if (!normalize3(stains[2])) {
+		// The residual is perpendicular to the other two stains.
+		stains[2][0] = stains[0][1] * stains[1][2] - stains[0][2] * stains[1][1];
+		stains[2][1] = stains[0][2] * stains[1][0] - stains[0][0] * stains[1][2];
+		stains[2][2] = stains[0][0] * stains[1][1] - stains[0][1] * stains[1][0];
+		if (!normalize3(stains[2])) return false;
+	}
+	// The columns of the stain matrix are the stains: optical density = stain matrix * amounts
+	float stain_matrix[3][3];
+	for (i32 i = 0; i < 3; ++i) {
+		for (i32 j = 0; j < 3; ++j) {
+			stain_matrix[i][j] = stains[j][i];
+		}
+	}
+	float inverse[3][3];
+	if (!invert_matrix3x3(stain_matrix, inverse)) return false;
+	for (i32 i = 0; i < 3; ++i) {
+		unmixing[i] = inverse[stain_index][i];
+		stain_vector[i] = stains[stain_index][i];
+	}
+	return true;
+}
+
+// ICC profiles are big-endian.
+static u32 icc_read_u32(u8* p) {
+	return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | (u32)p[3];
+}
+
+static u16 icc_read_u16(u8* p) {
+	return (u16)(((u32)p[0] << 8) | (u32)p[1]);
+}
+
+static float icc_read_s15fixed16(u8* p) {
+	return (float)(i32)icc_read_u32(p) / 65536.0f;
+}
+
+#define ICC_SIGNATURE(a, b, c, d) (((u32)(a) << 24) | ((u32)(b) << 16) | ((u32)(c) << 8) | (u32)(d))
+
+static u8* icc_find_tag(u8* data, u64 size, u32 signature, u32* tag_size) {
+	if (size < 132) return NULL;
+	u32 tag_count = icc_read_u32(data + 128);
+	if (tag_count > (size - 132) / 12) return NULL;
+	for (u32 i = 0; i < tag_count; ++i) {
+		u8* entry = data + 132 + i * 12;
+		if (icc_read_u32(entry) == signature) {
+			u32 offset = icc_read_u32(entry + 4);
+			u32 length = icc_read_u32(entry + 8);
+			if (offset > size || length > size - offset || length < 8) return NULL;
+			*tag_size = length;
+			return data + offset;
+		}
+	}
+	return NULL;
+}
+
+static bool32 icc_read_xyz_tag(u8* data, u64 size, u32 signature, float* xyz) {
+	u32 tag_size = 0;
+	u8* tag = icc_find_tag(data, size, signature, &tag_size);
+	if (!tag || tag_size < 20 || icc_read_u32(tag) != ICC_SIGNATURE('X','Y','Z',' ')) return false;
+	for (i32 i = 0; i < 3; ++i) {
+		xyz[i] = icc_read_s15fixed16(tag + 8 + i * 4);
+	}
+	return true;
+}
+
+// Tabulates a tone reproduction curve ('curv' or 'para' type), from display values to linear light.
+static bool32 icc_read_trc_tag(u8* data, u64 size, u32 signature, float* table) {
+	u32 tag_size = 0;
+	u8* tag = icc_find_tag(data, size, signature, &tag_size);
+	if (!tag) return false;
+	u32 type = icc_read_u32(tag);
+	if (type == ICC_SIGNATURE('c','u','r','v')) {
+		if (tag_size < 12) return false;
+		u32 entry_count = icc_read_u32(tag + 8);
+		if (entry_count > (tag_size - 12) / 2) return false;
+		float gamma = (entry_count == 1) ? (float)icc_read_u16(tag + 12) / 256.0f : 1.0f;
+		for (i32 i = 0; i < DISPLAY_PROFILE_TRC_SIZE; ++i) {
+			float x = (float)i / (float)(DISPLAY_PROFILE_TRC_SIZE - 1);
+			if (entry_count <= 1) {
+				table[i] = powf(x, gamma);
+			} else {
+				float position = x * (float)(entry_count - 1);
+				u32 index = ATMOST((u32)position, entry_count - 2);
+				float t = position - (float)index;
+				float a = (float)icc_read_u16(tag + 12 + index * 2) / 65535.0f;
+				float b = (float)icc_read_u16(tag + 12 + (index + 1) * 2) / 65535.0f;
+				table[i] = a + (b - a) * t;
+			}
+		}
+		return true;
+	} else if (type == ICC_SIGNATURE('p','a','r','a')) {
+		static const i32 parameter_counts[] = {1, 3, 4, 5, 7};
+		if (tag_size < 12) return false;
+		u16 function_type = icc_read_u16(tag + 8);
+		if (function_type >= COUNT(parameter_counts)) return false;
+		i32 parameter_count = parameter_counts[function_type];
+		if (tag_size < 12 + (u32)parameter_count * 4) return false;
+		// Y = (aX+b)^g + e for X >= d, and Y = cX + f below that; the simpler function types leave out some terms.
+		float p[7] = {1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f}; // g a b c d e f
+		for (i32 i = 0; i < parameter_count; ++i) {
+			p[i] = icc_read_s15fixed16(tag + 12 + i * 4);
+		}
+		float g = p[0], a = p[1], b = p[2], c = 0.0f, d = 0.0f, e = 0.0f, f = 0.0f;
+		if (function_type == 1 || function_type == 2) {
+			d = (a != 0.0f) ? -b / a : 0.0f;
+			if (function_type == 2) e = f = p[3];
+		} else if (function_type >= 3) {
+			c = p[3];
+			d = p[4];
+			if (function_type == 4) {
+				e = p[5];
+				f = p[6];
+			}
+		}
+		for (i32 i = 0; i < DISPLAY_PROFILE_TRC_SIZE; ++i) {
+			float x = (float)i / (float)(DISPLAY_PROFILE_TRC_SIZE - 1);
+			table[i] = (x >= d) ? powf(ATLEAST(0.0f, a * x + b), g) + e : c * x + f;
+		}
+		return true;
+	}
+	return false;
+}
+
+static bool32 invert_matrix3x3(float m[3][3], float inverse[3][3]) {
+	float det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+	            m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+	            m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	if (fabsf(det) < 1e-8f) return false;
+	float r = 1.0f / det;
+	inverse[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * r;
+	inverse[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * r;
+	inverse[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * r;
+	inverse[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * r;
+	inverse[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * r;
+	inverse[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * r;
+	inverse[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * r;
+	inverse[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * r;
+	inverse[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * r;
+	return true;
+}
+
+bool32 load_display_profile(display_profile_t* profile, const char* filename) {
+	profile->is_valid = false;
+	++profile->generation;
+	mem_t* file = platform_read_entire_file(filename);
+	if (!file) {
+		printf("Error: could not read the display profile %s\n", filename);
+		return false;
+	}
+	u8* data = file->data;
+	u64 size = file->len;
+	bool32 success = false;
+	float primaries[3][3]; // rows: red, green, blue; columns: X, Y, Z
+	if (size < 132 || icc_read_u32(data + 36) != ICC_SIGNATURE('a','c','s','p')) {
+		printf("Error: %s is not an ICC profile\n", filename);
+	} else if (icc_read_u32(data + 16) != ICC_SIGNATURE('R','G','B',' ') ||
+	           icc_read_u32(data + 20) != ICC_SIGNATURE('X','Y','Z',' ')) {
+		printf("Error: the display profile %s is not an RGB profile with an XYZ connection space\n", filename);
+	} else if (!icc_read_xyz_tag(data, size, ICC_SIGNATURE('r','X','Y','Z'), primaries[0]) ||
+	           !icc_read_xyz_tag(data, size, ICC_SIGNATURE('g','X','Y','Z'), primaries[1]) ||
+	           !icc_read_xyz_tag(data, size, ICC_SIGNATURE('b','X','Y','Z'), primaries[2]) ||
+	           !icc_read_trc_tag(data, size, ICC_SIGNATURE('r','T','R','C'), profile->trc[0]) ||
+	           !icc_read_trc_tag(data, size, ICC_SIGNATURE('g','T','R','C'), profile->trc[1]) ||
+	           !icc_read_trc_tag(data, size, ICC_SIGNATURE('b','T','R','C'), profile->trc[2])) {
+		printf("Error: the display profile %s has no matrix/TRC conversion\n", filename);
+	} else {
+		float rgb_to_xyz[3][3];
+		for (i32 i = 0; i < 3; ++i) {
+			for (i32 j = 0; j < 3; ++j) {
+				rgb_to_xyz[i][j] = primaries[j][i];
+			}
+		}
+		if (invert_matrix3x3(rgb_to_xyz, profile->xyz_to_rgb)) {
+			success = true;
+		} else {
+			printf("Error: the display profile %s has degenerate primaries\n", filename);
+		}
+	}
+	free(file);
+	if (success) {
+		strncpy(profile->filename, filename, sizeof(profile->filename) - 1);
+		profile->filename[sizeof(profile->filename) - 1] = '\0';
+		profile->is_valid = true;
+	}
+	return success;
+}
+
+static float srgb_to_linear(float value) {
+	return (value <= 0.04045f) ? value / 12.92f : powf((value + 0.055f) / 1.055f, 2.4f);
+}
+
+// Inverts a (non-decreasing) tabulated tone reproduction curve: from linear light back to display values.
+static float invert_trc(float* table, float linear) {
+	if (linear <= table[0]) return 0.0f;
+	if (linear >= table[DISPLAY_PROFILE_TRC_SIZE - 1]) return 1.0f;
+	i32 low = 0;
+	i32 high = DISPLAY_PROFILE_TRC_SIZE - 1;
+	while (high - low > 1) {
+		i32 middle = (low + high) / 2;
+		if (table[middle] <= linear) {
+			low = middle;
+		} else {
+			high = middle;
+		}
+	}
+	float span = table[high] - table[low];
+	float t = (span > 0.0f) ? (linear - table[low]) / span : 0.0f;
+	return ((float)low + t) / (float)(DISPLAY_PROFILE_TRC_SIZE - 1);
+}
+
+// Fills a lut_dim^3 RGBA lookup table (red varying fastest), mapping the colors of the tiles to display values.
+// The tiles are assumed to be sRGB; if there is a valid display profile, the colors are converted for the display.
+void build_color_lut(u16* lut, i32 lut_dim, color_adjustments_t* adjustments, display_profile_t* display_profile) {
+	// sRGB to XYZ, adapted to the D50 white point of the profile connection space
+	static const float srgb_to_xyz[3][3] = {
+		{0.4360747f, 0.3850649f, 0.1430804f},
+		{0.2225045f, 0.7168786f, 0.0606169f},
+		{0.0139322f, 0.0971045f, 0.7141733f},
+	};
+	bool32 use_display_profile = display_profile && display_profile->is_valid;
+	u16* out = lut;
+	for (i32 b = 0; b < lut_dim; ++b) {
+		for (i32 g = 0; g < lut_dim; ++g) {
+			for (i32 r = 0; r < lut_dim; ++r) {
+				float rgb[3] = {(float)r, (float)g, (float)b};
+				for (i32 c = 0; c < 3; ++c) {
+					float value = rgb[c] / (float)(lut_dim - 1);
+					value = apply_color_curve(&adjustments->master, value);
+					rgb[c] = apply_color_curve(&adjustments->channels[c], value);
+				}
+				if (use_display_profile) {
+					float linear[3], xyz[3];
+					for (i32 c = 0; c < 3; ++c) {
+						linear[c] = srgb_to_linear(rgb[c]);
+					}
+					for (i32 i = 0; i < 3; ++i) {
+						xyz[i] = srgb_to_xyz[i][0] * linear[0] + srgb_to_xyz[i][1] * linear[1] + srgb_to_xyz[i][2] * linear[2];
+					}
+					for (i32 c = 0; c < 3; ++c) {
+						float* m = display_profile->xyz_to_rgb[c];
+						float display_linear = CLAMP(m[0] * xyz[0] + m[1] * xyz[1] + m[2] * xyz[2], 0.0f, 1.0f);
+						rgb[c] = invert_trc(display_profile->trc[c], display_linear);
+					}
+				}
+				for (i32 c = 0; c < 3; ++c) {
+					*out++ = (u16)(CLAMP(rgb[c], 0.0f, 1.0f) * 65535.0f + 0.5f);
+				}
+				*out++ = 65535;
+			}
+		}
+	}
+}
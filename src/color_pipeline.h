@@ -0,0 +1,78 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+// The color pipeline for displaying the tiles: image adjustments (levels, gamma, per-channel curves) followed by
+// color correction for the display, through its ICC profile. The whole pipeline is baked into a 3D lookup table,
+// which the tile shader samples once per pixel (see update_color_lut() in render_group.c); the table only needs to
+// be rebuilt if the settings change.
+
+#define COLOR_LUT_DIM 33 // grid points per axis, trilinearly interpolated in between
+#define DISPLAY_PROFILE_TRC_SIZE 1024
+
+typedef struct color_curve_t {
+	float black_level; // the input value that becomes 0
+	float white_level; // the input value that becomes 1
+	float gamma; // applied after the levels, as value^(1/gamma)
+} color_curve_t;
+
+typedef struct color_adjustments_t {
+	color_curve_t master;
+	color_curve_t channels[3]; // red, green, blue; applied after the master curve
+} color_adjustments_t;
+
+// Only matrix/TRC profiles are supported (as used for most displays), not profiles based on lookup tables.
+typedef struct display_profile_t {
+	bool32 is_valid;
+	i32 generation; // incremented on every load, so that the color lookup table knows when to be rebuilt
+	char filename[512];
+	float xyz_to_rgb[3][3]; // from the profile connection space (XYZ, D50) to linear display RGB
+	float trc[3][DISPLAY_PROFILE_TRC_SIZE]; // per channel, from display values (evenly spaced) to linear light
+} display_profile_t;
+
+// Color deconvolution (Ruifrok & Johnston), to show the stains of a slide separately, e.g. hematoxylin versus DAB:
+// each stain absorbs light according to its optical density vector, and the optical densities of the stains add up.
+// Unmixing with the inverse of the stain matrix gives the amount of each stain in a pixel.
+typedef enum stain_preset_enum {
+	STAIN_PRESET_H_DAB,
+	STAIN_PRESET_H_E,
+	STAIN_PRESET_COUNT
+} stain_preset_enum;
+
+typedef struct stain_matrix_t {
+	float stains[3][3]; // optical density (red, green, blue) per stain; a third stain of zero is taken as the residual
+} stain_matrix_t;
+
+void init_color_adjustments(color_adjustments_t* adjustments);
+bool32 set_levels_from_histogram(color_curve_t* curve, u32* bins, i32 bin_count, float low_percentile,
+                                 float high_percentile);
+void init_stain_matrix(stain_matrix_t* matrix, stain_preset_enum preset);
+bool32 get_stain_unmixing(stain_matrix_t* matrix, i32 stain_index, float unmixing[3], float stain_vector[3]);
+bool32 load_display_profile(display_profile_t* profile, const char* filename);
+void build_color_lut(u16* lut, i32 lut_dim, color_adjustments_t* adjustments, display_profile_t* display_profile);
+
+#ifdef __cplusplus
+}
+#endif
@@ -51,6 +51,12 @@
 #define COMPILER_GCC 0
 #endif
 
+#if COMPILER_MSVC
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 // IDE detection (for dealing with pesky preprocessor highlighting issues)
 #if defined(__JETBRAINS_IDE__)
 #define CODE_EDITOR 1
@@ -72,6 +78,7 @@
 #include <stretchy_buffer.h> // https://github.com/nothings/stb/blob/master/stretchy_buffer.h
 #define sb_raw_count(a)    stb__sbn(a)
 #define sb_raw_capacity(a) stb__sbm(a)
+#define sb_allocated_size(a) ((a) ? (i64)sb_raw_capacity(a) * (i64)sizeof(*(a)) : 0) // in bytes, excluding the header
 #define sb_maybegrow       stb__sbmaybegrow
 
 // Typedef choices for numerical types
@@ -107,6 +114,10 @@ typedef int8_t bool8;
 
 #define SQUARE(x) ((x)*(x))
 
+// Round to a multiple of a power of two
+#define ROUND_DOWN_POW2(x, a) ((x) & ~((a) - 1))
+#define ROUND_UP_POW2(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
 #define memset_zero(x) memset((x), 0, sizeof(*x))
 
 #define KILOBYTES(n) (1024LL*(n))
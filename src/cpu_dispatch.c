@@ -0,0 +1,172 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#ifndef TARGET_EMSCRIPTEN
+#include "intrinsics.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu_dispatch.h"
+
+static const char* cpu_level_names[CPU_LEVEL_COUNT] = { "scalar", "sse2", "avx2" };
+static const char* cpu_kernel_names[CPU_KERNEL_COUNT] = {
+	"jpeg_idct", "jpeg_color_convert", "rgb_swizzle", "mip_downsample", "byte_swap", "tissue_threshold", "aes_gcm",
+	"chacha20",
+};
+
+static volatile i32 cpu_detected_level = -1; // set once by cpu_dispatch_init()
+static volatile i32 cpu_kernel_levels[CPU_KERNEL_COUNT];
+static volatile i32 cpu_kernel_max_levels[CPU_KERNEL_COUNT];
+
+static i32 detect_cpu_level() {
+#if defined(__SSE2__) && !defined(TARGET_EMSCRIPTEN)
+	u32 regs[4];
+	get_cpuid(0, 0, regs);
+	u32 max_leaf = regs[0];
+	get_cpuid(1, 0, regs);
+	bool32 has_osxsave = (regs[2] >> 27) & 1;
+	bool32 has_avx = (regs[2] >> 28) & 1;
+	// The OS needs to save the YMM registers as well, otherwise AVX instructions fault.
+	if (max_leaf >= 7 && has_osxsave && has_avx && (get_xcr0() & 6) == 6) {
+		get_cpuid(7, 0, regs);
+		bool32 has_avx2 = (regs[1] >> 5) & 1;
+#if CPU_AVX2_SUPPORTED
+		if (has_avx2) return CPU_LEVEL_AVX2;
+#endif
+	}
+	return CPU_LEVEL_SSE2;
+#elif defined(__SSE2__)
+	// Web build with -msimd128 -msse2: the SSE2 kernels run as WebAssembly SIMD. There is nothing to detect, a
+	// browser without SIMD support refuses to load the module.
+	return CPU_LEVEL_SSE2;
+#else
+	return CPU_LEVEL_SCALAR;
+#endif
+}
+
+// AES-NI, PCLMULQDQ and SSSE3 (for the byte shuffles around them), for the hardware AES-GCM in tlse.c.
+static bool32 detect_aes_ni() {
+#if CPU_AVX2_SUPPORTED && !defined(TARGET_EMSCRIPTEN)
+	u32 regs[4];
+	get_cpuid(1, 0, regs);
+	bool32 has_pclmulqdq = (regs[2] >> 1) & 1;
+	bool32 has_ssse3 = (regs[2] >> 9) & 1;
+	bool32 has_aes = (regs[2] >> 25) & 1;
+	return has_pclmulqdq && has_ssse3 && has_aes;
+#else
+	return false;
+#endif
+}
+
+// Detects what the CPU supports, and applies the overrides in the CPU_KERNELS environment variable (see
+// cpu_parse_kernel_overrides()). Should be called at startup, before the worker threads are started; the kernels
+// call it themselves if it wasn't.
+void cpu_dispatch_init() {
+	if (cpu_detected_level >= 0) return;
+	i32 level = detect_cpu_level();
+	for (i32 kernel = 0; kernel < CPU_KERNEL_COUNT; ++kernel) {
+		cpu_kernel_max_levels[kernel] = level;
+	}
+	// (there is only one hardware AES-GCM implementation)
+	cpu_kernel_max_levels[CPU_KERNEL_AES_GCM] = detect_aes_ni() ? ATMOST(level, CPU_LEVEL_SSE2) : CPU_LEVEL_SCALAR;
+	for (i32 kernel = 0; kernel < CPU_KERNEL_COUNT; ++kernel) {
+		cpu_kernel_levels[kernel] = cpu_kernel_max_levels[kernel];
+	}
+	cpu_detected_level = level;
+	const char* overrides = getenv("CPU_KERNELS");
+	if (overrides && !cpu_parse_kernel_overrides(overrides)) {
+		fprintf(stderr, "CPU_KERNELS: could not parse '%s'\n", overrides);
+	}
+}
+
+// The best instruction set that the CPU supports.
+i32 cpu_get_detected_level() {
+	if (cpu_detected_level < 0) cpu_dispatch_init();
+	return cpu_detected_level;
+}
+
+// The implementation to use for a kernel (index into its table of implementations).
+i32 cpu_get_kernel_level(i32 kernel) {
+	if (cpu_detected_level < 0) cpu_dispatch_init();
+	return cpu_kernel_levels[kernel];
+}
+
+// The best implementation of a kernel that the CPU can run (usually the detected level).
+i32 cpu_get_kernel_max_level(i32 kernel) {
+	if (cpu_detected_level < 0) cpu_dispatch_init();
+	return cpu_kernel_max_levels[kernel];
+}
+
+// E.g. to compare the implementations of a kernel (kernelbench). The level is capped at what the CPU supports; the
+// level that is actually used is returned. Affects all threads, from the next call of the kernel on.
+i32 cpu_set_kernel_level(i32 kernel, i32 level) {
+	level = CLAMP(level, CPU_LEVEL_SCALAR, cpu_get_kernel_max_level(kernel));
+	cpu_kernel_levels[kernel] = level;
+	return level;
+}
+
+static i32 find_name(const char** names, i32 name_count, const char* name, size_t length) {
+	for (i32 i = 0; i < name_count; ++i) {
+		if (strlen(names[i]) == length && strncmp(names[i], name, length) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Parses a comma-separated list of levels for all kernels ("sse2") or for one kernel ("mip_downsample=scalar"),
+// applied from left to right. E.g. "scalar,jpeg_idct=avx2" only uses SIMD for the IDCT.
+bool32 cpu_parse_kernel_overrides(const char* overrides) {
+	bool32 success = true;
+	const char* pos = overrides;
+	while (*pos) {
+		const char* end = strchr(pos, ',');
+		if (!end) end = pos + strlen(pos);
+		const char* equals = memchr(pos, '=', end - pos);
+		const char* level_name = equals ? equals + 1 : pos;
+		i32 level = find_name(cpu_level_names, CPU_LEVEL_COUNT, level_name, end - level_name);
+		if (level < 0) {
+			success = false;
+		} else if (equals) {
+			i32 kernel = find_name(cpu_kernel_names, CPU_KERNEL_COUNT, pos, equals - pos);
+			if (kernel < 0) {
+				success = false;
+			} else {
+				cpu_set_kernel_level(kernel, level);
+			}
+		} else {
+			for (i32 kernel = 0; kernel < CPU_KERNEL_COUNT; ++kernel) {
+				cpu_set_kernel_level(kernel, level);
+			}
+		}
+		pos = (*end == ',') ? end + 1 : end;
+	}
+	return success;
+}
+
+const char* cpu_get_level_name(i32 level) {
+	return (level >= 0 && level < CPU_LEVEL_COUNT) ? cpu_level_names[level] : "";
+}
+
+const char* cpu_get_kernel_name(i32 kernel) {
+	return (kernel >= 0 && kernel < CPU_KERNEL_COUNT) ? cpu_kernel_names[kernel] : "";
+}
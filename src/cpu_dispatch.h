@@ -0,0 +1,80 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+// Runtime selection between the plain C, SSE2 and AVX2 versions of the hot kernels. The build targets SSE2, so the
+// AVX2 versions are compiled per function (CPU_TARGET_AVX2) and are only called if the CPU (and the OS) support it.
+// Each kernel keeps a table of implementations indexed by level (see e.g. rgb_to_bgra_row() in jpeg_decoder.c).
+// Some kernels need more than the level: the sse2 level of aes_gcm is the AES-NI/PCLMULQDQ implementation (see
+// tlse.c), so on CPUs without those instructions it stays at scalar (see cpu_get_kernel_max_level()).
+
+enum cpu_level_enum {
+	CPU_LEVEL_SCALAR,
+	CPU_LEVEL_SSE2,
+	CPU_LEVEL_AVX2,
+	CPU_LEVEL_COUNT,
+};
+
+enum cpu_kernel_enum {
+	CPU_KERNEL_JPEG_IDCT,
+	CPU_KERNEL_JPEG_COLOR_CONVERT,
+	CPU_KERNEL_RGB_SWIZZLE,
+	CPU_KERNEL_MIP_DOWNSAMPLE,
+	CPU_KERNEL_BYTE_SWAP,
+	CPU_KERNEL_TISSUE_THRESHOLD,
+	CPU_KERNEL_AES_GCM,
+	CPU_KERNEL_CHACHA20,
+	CPU_KERNEL_COUNT,
+};
+
+// (the web build translates the SSE2 intrinsics to WebAssembly SIMD, but there is nothing to translate AVX2 to)
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__)) && !defined(TARGET_EMSCRIPTEN)
+#define CPU_AVX2_SUPPORTED 1
+#define CPU_TARGET_AVX2 __attribute__((target("avx2")))
+#define CPU_TARGET_AES_NI __attribute__((target("aes,pclmul,ssse3")))
+#endif
+
+// For the bodies of kernels that are instantiated for fixed sizes (e.g. the color conversions in jpeg_simd.c): the
+// constants only become trip counts if the body is inlined into each variant.
+#if defined(__GNUC__) || defined(__clang__)
+#define CPU_FORCE_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define CPU_FORCE_INLINE __forceinline
+#else
+#define CPU_FORCE_INLINE inline
+#endif
+
+void cpu_dispatch_init();
+i32 cpu_get_detected_level();
+i32 cpu_get_kernel_level(i32 kernel);
+i32 cpu_get_kernel_max_level(i32 kernel);
+i32 cpu_set_kernel_level(i32 kernel, i32 level);
+bool32 cpu_parse_kernel_overrides(const char* overrides);
+const char* cpu_get_level_name(i32 level);
+const char* cpu_get_kernel_name(i32 kernel);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,459 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "common.h"
+#include "intrinsics.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#if WINDOWS
+#include <windows.h>
+#include <io.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+#include "disk_cache.h"
+
+#define DISK_CACHE_BUCKET_COUNT 65536
+
+static disk_cache_t** open_caches; // sb
+static volatile i32 open_caches_lock;
+
+static disk_cache_t* find_open_cache(const char* path) {
+	for (i32 i = 0; i < sb_count(open_caches); ++i) {
+		if (strcmp(open_caches[i]->path, path) == 0) {
+			return open_caches[i];
+		}
+	}
+	return NULL;
+}
+
+u64 disk_cache_key(i32 level, i32 tile_index) {
+	u64 key = ((u64)(level & 0xFF) << 40) | ((u64)tile_index & 0xFFFFFFFFFF);
+	return key;
+}
+
+static inline i32 disk_cache_bucket(disk_cache_t* cache, u64 key) {
+	u64 hash = key * 11400714819323198485llu;
+	i32 result = (i32)(hash >> 32) & (cache->bucket_count - 1);
+	return result;
+}
+
+static void disk_cache_add_entry(disk_cache_t* cache, u64 key, i64 offset, u32 size) {
+	i32 bucket = disk_cache_bucket(cache, key);
+	disk_cache_entry_t entry = {.key = key, .offset = offset, .size = size, .hash_next = cache->buckets[bucket]};
+	cache->buckets[bucket] = sb_count(cache->entries);
+	sb_push(cache->entries, entry);
+}
+
+static disk_cache_entry_t* disk_cache_find(disk_cache_t* cache, u64 key) {
+	i32 index = cache->buckets[disk_cache_bucket(cache, key)];
+	while (index >= 0) {
+		disk_cache_entry_t* entry = cache->entries + index;
+		if (entry->key == key) {
+			return entry;
+		}
+		index = entry->hash_next;
+	}
+	return NULL;
+}
+
+static void disk_cache_clear_index(disk_cache_t* cache) {
+	sb_free(cache->entries);
+	cache->entries = NULL;
+	for (i32 i = 0; i < cache->bucket_count; ++i) {
+		cache->buckets[i] = -1;
+	}
+}
+
+// Positional reads and writes on the cache file, so that the tiles can be read and written outside the lock, by
+// several threads at once (the file position of the FILE* is not touched).
+static bool32 disk_cache_read_at(FILE* fp, void* dest, u32 size, i64 offset) {
+#if WINDOWS
+	HANDLE handle = (HANDLE)_get_osfhandle(_fileno(fp));
+	OVERLAPPED overlapped = {0};
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+	DWORD bytes_read = 0;
+	return ReadFile(handle, dest, size, &bytes_read, &overlapped) && bytes_read == size;
+#else
+	u32 total = 0;
+	while (total < size) {
+		ssize_t ret = pread(fileno(fp), (u8*)dest + total, size - total, offset + total);
+		if (ret <= 0) return false;
+		total += (u32)ret;
+	}
+	return true;
+#endif
+}
+
+static bool32 disk_cache_write_at(FILE* fp, const void* data, u32 size, i64 offset) {
+#if WINDOWS
+	HANDLE handle = (HANDLE)_get_osfhandle(_fileno(fp));
+	OVERLAPPED overlapped = {0};
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+	DWORD bytes_written = 0;
+	return WriteFile(handle, data, size, &bytes_written, &overlapped) && bytes_written == size;
+#else
+	u32 total = 0;
+	while (total < size) {
+		ssize_t ret = pwrite(fileno(fp), (const u8*)data + total, size - total, offset + total);
+		if (ret <= 0) return false;
+		total += (u32)ret;
+	}
+	return true;
+#endif
+}
+
+static void make_cache_directory() {
+#if WINDOWS
+	CreateDirectoryA(DISK_CACHE_DIRECTORY, NULL);
+#else
+	mkdir(DISK_CACHE_DIRECTORY, 0755);
+#endif
+}
+
+// Delete the least recently written cache files until the total size of the cache directory is within bounds.
+static void disk_cache_enforce_total_size(const char* keep_path) {
+	typedef struct { char path[1024]; i64 size; i64 mtime; } cache_file_t;
+	cache_file_t* files = NULL; // sb
+	i64 total_size = 0;
+#if WINDOWS
+	WIN32_FIND_DATAA find_data = {0};
+	HANDLE find_handle = FindFirstFileA(DISK_CACHE_DIRECTORY "\\*.svcache", &find_data);
+	if (find_handle != INVALID_HANDLE_VALUE) {
+		do {
+			cache_file_t file = {0};
+			snprintf(file.path, sizeof(file.path), DISK_CACHE_DIRECTORY "/%s", find_data.cFileName);
+			file.size = ((i64)find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow;
+			file.mtime = ((i64)find_data.ftLastWriteTime.dwHighDateTime << 32) | find_data.ftLastWriteTime.dwLowDateTime;
+			sb_push(files, file);
+		} while (FindNextFileA(find_handle, &find_data));
+		FindClose(find_handle);
+	}
+#else
+	DIR* dir = opendir(DISK_CACHE_DIRECTORY);
+	if (dir) {
+		struct dirent* dir_entry;
+		while ((dir_entry = readdir(dir)) != NULL) {
+			if (!strstr(dir_entry->d_name, ".svcache")) continue;
+			cache_file_t file = {0};
+			snprintf(file.path, sizeof(file.path), DISK_CACHE_DIRECTORY "/%s", dir_entry->d_name);
+			struct stat st;
+			if (stat(file.path, &st) == 0) {
+				file.size = st.st_size;
+				file.mtime = st.st_mtime;
+				sb_push(files, file);
+			}
+		}
+		closedir(dir);
+	}
+#endif
+	i32 file_count = sb_count(files);
+	for (i32 i = 0; i < file_count; ++i) {
+		total_size += files[i].size;
+	}
+	while (total_size > DISK_CACHE_MAX_TOTAL_SIZE) {
+		i32 oldest = -1;
+		for (i32 i = 0; i < file_count; ++i) {
+			if (files[i].size > 0 && strcmp(files[i].path, keep_path) != 0) {
+				if (oldest < 0 || files[i].mtime < files[oldest].mtime) {
+					oldest = i;
+				}
+			}
+		}
+		if (oldest < 0) break;
+		printf("Disk cache: removing %s\n", files[oldest].path);
+		remove(files[oldest].path);
+		total_size -= files[oldest].size;
+		files[oldest].size = 0;
+	}
+	sb_free(files);
+}
+
+// Rebuild the tile index by walking the records in the cache file. A truncated record at the end (e.g. because
+// the program was shut down while writing) is cut off.
+static void disk_cache_scan_records(disk_cache_t* cache, i64 first_record_offset) {
+	i64 offset = first_record_offset;
+	fseeko64(cache->fp, offset, SEEK_SET);
+	disk_cache_record_t record = {0};
+	while (offset + (i64)sizeof(record) <= cache->file_size && fread(&record, sizeof(record), 1, cache->fp) == 1) {
+		i64 data_offset = offset + sizeof(record);
+		if (record.tag != DISK_CACHE_RECORD_TAG || data_offset + record.size > cache->file_size) {
+			break;
+		}
+		disk_cache_add_entry(cache, record.key, data_offset, record.size);
+		offset = data_offset + record.size;
+		fseeko64(cache->fp, offset, SEEK_SET);
+	}
+	cache->file_size = offset; // new records will be appended from here
+}
+
+static void get_cache_file_path(char* path, size_t path_size, const char* hostname, i32 portno, const char* filename,
+                                const char* extension) {
+	i32 len = snprintf(path, path_size, DISK_CACHE_DIRECTORY "/%s_%d_%s", hostname, portno, filename);
+	// sanitize the part after the directory name
+	for (i32 i = sizeof(DISK_CACHE_DIRECTORY); i < len && path[i] != '\0'; ++i) {
+		char c = path[i];
+		bool32 ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.' || c == '-';
+		if (!ok) path[i] = '_';
+	}
+	strncat(path, extension, path_size - strlen(path) - 1);
+}
+
+disk_cache_t* disk_cache_open(const char* hostname, i32 portno, const char* filename) {
+	make_cache_directory();
+
+	disk_cache_t* cache = (disk_cache_t*) calloc(1, sizeof(disk_cache_t));
+	get_cache_file_path(cache->path, sizeof(cache->path), hostname, portno, filename, ".svcache");
+	spin_lock(&open_caches_lock);
+	disk_cache_t* open_cache = find_open_cache(cache->path);
+	if (open_cache) ++open_cache->refcount;
+	spin_unlock(&open_caches_lock);
+	if (open_cache) {
+		free(cache);
+		return open_cache;
+	}
+
+	disk_cache_enforce_total_size(cache->path);
+
+	cache->bucket_count = DISK_CACHE_BUCKET_COUNT;
+	cache->buckets = (i32*) malloc(cache->bucket_count * sizeof(i32));
+	disk_cache_clear_index(cache);
+
+	cache->fp = fopen64(cache->path, "r+b");
+	if (cache->fp) {
+		fseeko64(cache->fp, 0, SEEK_END);
+		cache->file_size = ftello64(cache->fp);
+		fseeko64(cache->fp, 0, SEEK_SET);
+		disk_cache_file_header_t file_header = {0};
+		if (fread(&file_header, sizeof(file_header), 1, cache->fp) == 1 && file_header.magic == DISK_CACHE_MAGIC &&
+		    file_header.version == DISK_CACHE_VERSION && file_header.header_size < (u64)cache->file_size) {
+			cache->header = (u8*) malloc(file_header.header_size);
+			if (fread(cache->header, file_header.header_size, 1, cache->fp) == 1) {
+				cache->header_size = file_header.header_size;
+				cache->slide_filesize = file_header.slide_filesize;
+				disk_cache_scan_records(cache, sizeof(file_header) + file_header.header_size);
+				printf("Disk cache: opened %s (%d tiles)\n", cache->path, sb_count(cache->entries));
+			} else {
+				free(cache->header);
+				cache->header = NULL;
+			}
+		}
+	} else {
+		cache->fp = fopen64(cache->path, "w+b");
+		if (!cache->fp) {
+			printf("Disk cache: could not create %s\n", cache->path);
+			disk_cache_close(cache);
+			return NULL;
+		}
+	}
+
+	// Someone else may have opened the same file meanwhile; then theirs is used (nothing has been written to ours).
+	spin_lock(&open_caches_lock);
+	open_cache = find_open_cache(cache->path);
+	if (open_cache) {
+		++open_cache->refcount;
+	} else {
+		cache->refcount = 1;
+		sb_push(open_caches, cache);
+	}
+	spin_unlock(&open_caches_lock);
+	if (open_cache) {
+		disk_cache_close(cache);
+		return open_cache;
+	}
+	return cache;
+}
+
+void disk_cache_close(disk_cache_t* cache) {
+	if (cache) {
+		spin_lock(&open_caches_lock);
+		bool32 is_still_used = false;
+		for (i32 i = 0; i < sb_count(open_caches); ++i) {
+			if (open_caches[i] == cache) {
+				if (--cache->refcount > 0) {
+					is_still_used = true;
+				} else {
+					open_caches[i] = sb_last(open_caches);
+					--stb__sbn(open_caches);
+				}
+				break;
+			}
+		}
+		spin_unlock(&open_caches_lock);
+		if (is_still_used) return;
+		if (cache->fp) fclose(cache->fp);
+		if (cache->header) free(cache->header);
+		if (cache->buckets) free(cache->buckets);
+		sb_free(cache->entries);
+		free(cache);
+	}
+}
+
+// Compare the header sent by the server with the cached header. If they differ, the slide has changed (or was
+// never cached), and the cache file is started over.
+bool32 disk_cache_validate_header(disk_cache_t* cache, u8* header, u64 header_size, i64 slide_filesize) {
+	bool32 is_valid = false;
+	spin_lock(&cache->lock);
+	if (cache->header && cache->header_size == header_size && cache->slide_filesize == slide_filesize &&
+	    memcmp(cache->header, header, header_size) == 0) {
+		is_valid = true;
+	} else {
+		if (cache->header) {
+			printf("Disk cache: %s is out of date, discarding\n", cache->path);
+			free(cache->header);
+		}
+		disk_cache_clear_index(cache);
+		while (cache->io_in_flight > 0) {
+			_mm_pause(); // reads and writes that are still using the old file (they don't need the lock to finish)
+		}
+		fclose(cache->fp);
+		cache->fp = fopen64(cache->path, "w+b");
+		cache->header = (u8*) malloc(header_size);
+		memcpy(cache->header, header, header_size);
+		cache->header_size = header_size;
+		cache->slide_filesize = slide_filesize;
+		cache->file_size = 0;
+		if (cache->fp) {
+			disk_cache_file_header_t file_header = {.magic = DISK_CACHE_MAGIC, .version = DISK_CACHE_VERSION,
+			                                        .slide_filesize = slide_filesize, .header_size = header_size};
+			fwrite(&file_header, sizeof(file_header), 1, cache->fp);
+			fwrite(header, header_size, 1, cache->fp);
+			fflush(cache->fp);
+			cache->file_size = sizeof(file_header) + header_size;
+		}
+	}
+	spin_unlock(&cache->lock);
+	return is_valid;
+}
+
+bool32 disk_cache_has_tile(disk_cache_t* cache, u64 key) {
+	if (!cache || !cache->fp) return false;
+	spin_lock(&cache->lock);
+	bool32 result = (disk_cache_find(cache, key) != NULL);
+	spin_unlock(&cache->lock);
+	return result;
+}
+
+// The lock is only held to look up the entry; the read itself happens outside it.
+bool32 disk_cache_read_tile(disk_cache_t* cache, u64 key, u8* dest, u64 dest_capacity, u32* size) {
+	if (!cache || !cache->fp) return false;
+	spin_lock(&cache->lock);
+	disk_cache_entry_t* entry = disk_cache_find(cache, key);
+	FILE* fp = cache->fp;
+	i64 offset = 0;
+	u32 entry_size = 0;
+	bool32 is_found = (fp && entry && entry->size <= dest_capacity);
+	if (is_found) {
+		offset = entry->offset;
+		entry_size = entry->size;
+		interlocked_increment(&cache->io_in_flight);
+	}
+	spin_unlock(&cache->lock);
+	if (!is_found) return false;
+
+	bool32 result = disk_cache_read_at(fp, dest, entry_size, offset);
+	interlocked_decrement(&cache->io_in_flight);
+	if (result) {
+		*size = entry_size;
+		interlocked_add_i64(&cache->hit_count, 1);
+	}
+	return result;
+}
+
+// The room for the record is reserved under the lock, and written outside it. The entry is only added once the data
+// is on disk, so that readers never see a tile that is still being written. (If the write fails, the room stays
+// unused; disk_cache_scan_records() cuts the file off there the next time it is opened.)
+void disk_cache_write_tile(disk_cache_t* cache, u64 key, u8* data, u32 size) {
+	if (!cache || !cache->fp || !cache->header) return;
+	spin_lock(&cache->lock);
+	FILE* fp = cache->fp;
+	i64 record_offset = -1;
+	if (fp && !disk_cache_find(cache, key) &&
+	    cache->file_size + (i64)sizeof(disk_cache_record_t) + size <= DISK_CACHE_MAX_FILE_SIZE) {
+		record_offset = cache->file_size;
+		cache->file_size += sizeof(disk_cache_record_t) + size;
+		interlocked_increment(&cache->io_in_flight);
+	}
+	spin_unlock(&cache->lock);
+	if (record_offset < 0) return;
+
+	disk_cache_record_t record = {.tag = DISK_CACHE_RECORD_TAG, .size = size, .key = key};
+	bool32 ok = disk_cache_write_at(fp, data, size, record_offset + sizeof(record)) &&
+	            disk_cache_write_at(fp, &record, sizeof(record), record_offset); // tag last: the record is complete
+	spin_lock(&cache->lock);
+	// (if the file was started over meanwhile, see disk_cache_validate_header(), the offset is no longer valid)
+	if (ok && cache->fp == fp && !disk_cache_find(cache, key)) {
+		disk_cache_add_entry(cache, key, record_offset + sizeof(record), size);
+		++cache->write_count;
+	}
+	spin_unlock(&cache->lock);
+	interlocked_decrement(&cache->io_in_flight);
+}
+
+// Returns the cached copy of a remote case list (and its ETag), or NULL if there is none.
+mem_t* disk_cache_read_caselist(const char* hostname, i32 portno, const char* filename, char* etag, size_t etag_size) {
+	char path[1024];
+	get_cache_file_path(path, sizeof(path), hostname, portno, filename, ".svcaselist");
+	FILE* fp = fopen64(path, "rb");
+	if (!fp) return NULL;
+	mem_t* result = NULL;
+	disk_cache_caselist_header_t header = {0};
+	if (fread(&header, sizeof(header), 1, fp) == 1 && header.magic == DISK_CACHE_CASELIST_MAGIC &&
+	    header.version == DISK_CACHE_CASELIST_VERSION && header.content_size < DISK_CACHE_MAX_FILE_SIZE) {
+		result = platform_allocate_mem_buffer(header.content_size);
+		if (fread(result->data, 1, header.content_size, fp) == header.content_size) {
+			result->data[header.content_size] = '\0';
+			result->len = header.content_size;
+			header.etag[sizeof(header.etag) - 1] = '\0';
+			strncpy(etag, header.etag, etag_size - 1);
+			etag[etag_size - 1] = '\0';
+		} else {
+			free(result);
+			result = NULL;
+		}
+	}
+	fclose(fp);
+	return result;
+}
+
+void disk_cache_write_caselist(const char* hostname, i32 portno, const char* filename, const char* etag, u8* data,
+                               u64 size) {
+	make_cache_directory();
+	char path[1024];
+	get_cache_file_path(path, sizeof(path), hostname, portno, filename, ".svcaselist");
+	FILE* fp = fopen64(path, "wb");
+	if (!fp) {
+		printf("Disk cache: could not create %s\n", path);
+		return;
+	}
+	disk_cache_caselist_header_t header = {0};
+	header.magic = DISK_CACHE_CASELIST_MAGIC;
+	header.version = DISK_CACHE_CASELIST_VERSION;
+	strncpy(header.etag, etag, sizeof(header.etag) - 1);
+	header.content_size = size;
+	bool32 ok = fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(data, 1, size, fp) == size;
+	fclose(fp);
+	if (!ok) remove(path); // (a partial copy would not be used anyway, but it shouldn't take up room)
+}
@@ -0,0 +1,105 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+#include "platform.h"
+#include <stdio.h>
+
+// Persistent on-disk cache for remote slides: one cache file per slide, containing the serialized TIFF header
+// (as sent by the server) followed by the compressed tile chunks that have been downloaded so far.
+// The cache is invalidated if the header sent by the server no longer matches the cached one.
+// A cache file is opened only once at a time: if the same slide is opened again (e.g. by the viewer while the slide
+// is being downloaded for offline use, see offline_download.c), the open cache is shared, and closed with the last user.
+
+#define DISK_CACHE_DIRECTORY "slideviewer_cache"
+#define DISK_CACHE_MAGIC 0x43445653 // "SVDC"
+#define DISK_CACHE_VERSION 1
+#define DISK_CACHE_RECORD_TAG 0x454C4954 // "TILE"
+#define DISK_CACHE_MAX_FILE_SIZE GIGABYTES(2)
+#define DISK_CACHE_MAX_TOTAL_SIZE GIGABYTES(8)
+// Remote case lists are kept here as well (in their own files), together with their ETag, for revalidation.
+#define DISK_CACHE_CASELIST_MAGIC 0x4C435653 // "SVCL"
+#define DISK_CACHE_CASELIST_VERSION 1
+
+#pragma pack(push, 1)
+typedef struct disk_cache_file_header_t {
+	u32 magic;
+	u32 version;
+	i64 slide_filesize;
+	u64 header_size; // size of the serialized TIFF header, which follows directly after this struct
+} disk_cache_file_header_t;
+
+typedef struct disk_cache_record_t {
+	u32 tag;
+	u32 size;
+	u64 key;
+} disk_cache_record_t;
+
+typedef struct disk_cache_caselist_header_t {
+	u32 magic;
+	u32 version;
+	char etag[256];
+	u64 content_size; // the JSON follows directly after this struct
+} disk_cache_caselist_header_t;
+#pragma pack(pop)
+
+typedef struct disk_cache_entry_t {
+	u64 key;
+	i64 offset; // file offset of the tile data
+	u32 size;
+	i32 hash_next;
+} disk_cache_entry_t;
+
+typedef struct disk_cache_t {
+	volatile i32 lock; // guards the index and file_size; the tile data is read and written outside it
+	volatile i32 io_in_flight; // reads and writes going on outside the lock
+	i32 refcount; // guarded by the list of open caches (see disk_cache_open())
+	FILE* fp;
+	char path[1024];
+	i64 file_size;
+	u8* header; // serialized TIFF header
+	u64 header_size;
+	i64 slide_filesize;
+	disk_cache_entry_t* entries; // sb
+	i32* buckets;
+	i32 bucket_count; // power of 2
+	volatile i64 hit_count;
+	i64 write_count;
+} disk_cache_t;
+
+u64 disk_cache_key(i32 level, i32 tile_index);
+disk_cache_t* disk_cache_open(const char* hostname, i32 portno, const char* filename);
+void disk_cache_close(disk_cache_t* cache);
+bool32 disk_cache_validate_header(disk_cache_t* cache, u8* header, u64 header_size, i64 slide_filesize);
+bool32 disk_cache_has_tile(disk_cache_t* cache, u64 key);
+bool32 disk_cache_read_tile(disk_cache_t* cache, u64 key, u8* dest, u64 dest_capacity, u32* size);
+void disk_cache_write_tile(disk_cache_t* cache, u64 key, u8* data, u32 size);
+mem_t* disk_cache_read_caselist(const char* hostname, i32 portno, const char* filename, char* etag, size_t etag_size);
+void disk_cache_write_caselist(const char* hostname, i32 portno, const char* filename, const char* etag, u8* data,
+                               u64 size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,110 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#include "win32_main.h"
+#include "platform.h"
+
+#include "viewer.h"
+#include "profiler.h"
+#include "frame_jobs.h"
+
+typedef struct frame_job_t {
+	const char* name; // also the name of the profiler section
+	frame_job_func_t* func;
+	bool32 is_sliceable; // keeps to the time budget it is given; otherwise the job needs its expected cost
+	i32 max_frames_deferred;
+	float expected_cost; // in seconds, for jobs that are not sliceable; follows the peaks
+	i32 frames_deferred; // in a row
+} frame_job_t;
+
+static bool32 tile_upload_job(app_state_t* app_state, float time_budget) {
+	// (the configured upload budget is the most that uploads may take, even if there is more time left)
+	float budget = ATMOST(time_budget, app_state->tile_upload_budget_in_ms / 1000.0f);
+	app_state->tiles_waiting_for_upload = upload_decoded_tiles(app_state, budget);
+	return app_state->tiles_waiting_for_upload > 0;
+}
+
+static bool32 tile_eviction_job(app_state_t* app_state, float time_budget) {
+	evict_least_recently_drawn_tiles(app_state);
+	return false;
+}
+
+static bool32 autosave_job(app_state_t* app_state, float time_budget) {
+	autosave(app_state, false);
+	return false;
+}
+
+// In the order in which they run.
+static frame_job_t frame_jobs[FRAME_JOB_COUNT] = {
+	[FRAME_JOB_TILE_UPLOADS] = { .name = "tile uploads", .func = tile_upload_job, .is_sliceable = true, .max_frames_deferred = 2 },
+	[FRAME_JOB_TILE_EVICTION] = { .name = "tile eviction", .func = tile_eviction_job, .max_frames_deferred = 8 },
+	[FRAME_JOB_AUTOSAVE] = { .name = "autosave", .func = autosave_job, .max_frames_deferred = 60 },
+};
+
+static i64 frame_start_clock;
+static float frame_budget;
+
+// Called once the input for the frame has been sampled. The budget is the time from then until the frame should be
+// handed to the display (leaving some room for the GPU to finish).
+void begin_frame_jobs(i64 start_clock, float frame_budget_in_seconds) {
+	frame_start_clock = start_clock;
+	frame_budget = frame_budget_in_seconds;
+}
+
+float get_frame_time_remaining() {
+	return frame_budget - get_seconds_elapsed(frame_start_clock, get_clock());
+}
+
+// Needs to be called every frame, on the main thread, after everything else for the frame has been drawn.
+void run_frame_jobs(app_state_t* app_state) {
+	i32 deferred_count = 0;
+	float deferred_seconds = 0.0f;
+	for (i32 i = 0; i < FRAME_JOB_COUNT; ++i) {
+		frame_job_t* job = frame_jobs + i;
+		float remaining = get_frame_time_remaining();
+		// Jobs that are expected to take next to nothing are never worth deferring.
+		bool32 fits = job->is_sliceable ? (remaining >= FRAME_JOB_MIN_SLICE_SECONDS)
+		                                : (job->expected_cost <= ATLEAST(remaining, FRAME_JOB_MIN_SLICE_SECONDS));
+		if (!fits && job->frames_deferred < job->max_frames_deferred) {
+			++job->frames_deferred;
+			++deferred_count;
+			deferred_seconds += job->is_sliceable ? FRAME_JOB_MIN_SLICE_SECONDS : job->expected_cost;
+			continue;
+		}
+		i64 start = get_clock();
+		profiler_begin(job->name);
+		bool32 has_work_left = job->func(app_state, ATLEAST(remaining, FRAME_JOB_MIN_SLICE_SECONDS));
+		profiler_end();
+		float cost = get_seconds_elapsed(start, get_clock());
+		if (cost > job->expected_cost) {
+			job->expected_cost = cost; // react to expensive runs immediately, and forget them slowly
+		} else {
+			job->expected_cost += (cost - job->expected_cost) * 0.05f;
+		}
+		job->frames_deferred = 0;
+		if (has_work_left) {
+			app_state->allow_idling_next_frame = false;
+		}
+	}
+	if (deferred_count > 0) {
+		app_state->allow_idling_next_frame = false; // (the deferred jobs need the next frame)
+	}
+	profiler_set_frame_deferred_jobs(deferred_count, deferred_seconds);
+}
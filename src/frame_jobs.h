@@ -0,0 +1,52 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+#include "viewer.h"
+
+// Main-thread work that does not have to happen in a particular frame (uploading decoded tiles, evicting tiles from
+// the texture cache, autosaving annotations) runs at the end of the frame, in the time that is left of the frame
+// budget, so that a burst of such work doesn't make the frame miss the refresh. A job that doesn't fit is deferred to
+// the next frame; after max_frames_deferred frames in a row, it runs anyway (so that nothing starves).
+// The profiler window shows how many jobs were deferred, and the time they were expected to take.
+
+#define FRAME_JOB_MIN_SLICE_SECONDS 0.0005f // less time than this left is not worth starting a sliceable job for
+
+typedef enum frame_job_enum {
+	FRAME_JOB_TILE_UPLOADS,
+	FRAME_JOB_TILE_EVICTION,
+	FRAME_JOB_AUTOSAVE,
+	FRAME_JOB_COUNT
+} frame_job_enum;
+
+// Does the work, taking roughly at most time_budget seconds if the job is sliceable. Returns true if work is left.
+typedef bool32 frame_job_func_t(app_state_t* app_state, float time_budget);
+
+void begin_frame_jobs(i64 frame_start_clock, float frame_budget_in_seconds);
+float get_frame_time_remaining();
+void run_frame_jobs(app_state_t* app_state);
+
+#ifdef __cplusplus
+}
+#endif
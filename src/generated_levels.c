@@ -0,0 +1,314 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#include "win32_main.h"
+#include "platform.h"
+#include "intrinsics.h"
+#include "viewer.h"
+#include "tiff.h"
+#include "memory_stats.h"
+#include "stb_image.h"
+
+// Images that don't come with a (complete) pyramid of their own get the missing levels generated in memory, by
+// workers in the background. Each generated level is kept as one BGRA raster, out of which the tiles are cut when
+// they are requested (see copy_generated_tile()); until a level is ready, its tiles are not requested, and the
+// coarser levels are drawn in their place.
+// - Large PNG/JPEG images (IMAGE_TYPE_RASTER): all levels are generated; level 0 is the decoded image itself.
+// - TIFFs without coarse levels: the levels more than 3 levels away from the coarsest level in the file can't be
+//   synthesized tile by tile (see synthesize_tile()). The finest of these is built from all the tiles of the coarsest
+//   synthesized level, the coarser ones from that. Levels that would take more than GENERATED_LEVEL_MAX_SIZE are
+//   left out (they are not drawn).
+
+typedef struct generated_levels_job_t {
+	image_t* image;
+	i32 focal_plane;
+	level_image_t* levels; // of the focal plane (see get_focal_plane_levels())
+	i32 first_level; // the finest generated level; the coarser ones are downsampled from it
+	u8* pixels; // raster of first_level, while it is being built
+	// TIFF: each task takes a row of tiles of source_level at a time, and downsamples them into the raster
+	i32 source_level;
+	i32 row_count;
+	volatile i32 next_row;
+	volatile i32 tasks_left;
+} generated_levels_job_t;
+
+bool32 is_level_ready(level_image_t* level_image) {
+	if (!level_image->is_generated) return true;
+	bool32 result = (level_image->generated_pixels != NULL);
+	read_barrier;
+	return result;
+}
+
+// The level size in pixels, as it comes out of halving the size of the finer level (rounding up) level_shift times.
+static u32 get_downsampled_size(u32 size, i32 level_shift) {
+	for (i32 i = 0; i < level_shift; ++i) {
+		size = (size + 1) / 2;
+	}
+	return size;
+}
+
+// Call after the size of the generated level is set. The tiles of generated levels are always TILE_DIM pixels.
+void init_generated_level(level_image_t* level_image, float um_per_pixel_x, float um_per_pixel_y) {
+	level_image->is_generated = true;
+	level_image->tiff_level = -1;
+	level_image->tile_width = TILE_DIM;
+	level_image->tile_height = TILE_DIM;
+	level_image->width_in_tiles = (level_image->generated_width + TILE_DIM - 1) / TILE_DIM;
+	level_image->height_in_tiles = (level_image->generated_height + TILE_DIM - 1) / TILE_DIM;
+	level_image->tile_count = (u64)level_image->width_in_tiles * level_image->height_in_tiles;
+	level_image->um_per_pixel_x = um_per_pixel_x;
+	level_image->um_per_pixel_y = um_per_pixel_y;
+	level_image->x_tile_side_in_um = um_per_pixel_x * (float)TILE_DIM;
+	level_image->y_tile_side_in_um = um_per_pixel_y * (float)TILE_DIM;
+	init_tile_table(level_image);
+}
+
+// Fills a tile buffer (TILE_DIM x TILE_DIM, pitch TILE_PITCH); the part outside of the level is made transparent.
+// Returns false if the level is not ready yet.
+bool32 copy_generated_tile(level_image_t* level_image, i32 tile_x, i32 tile_y, u8* dest) {
+	if (!is_level_ready(level_image)) return false;
+	u8* pixels = level_image->generated_pixels;
+	u64 pitch = (u64)level_image->generated_width * BYTES_PER_PIXEL;
+	u32 x0 = (u32)tile_x * TILE_DIM;
+	u32 y0 = (u32)tile_y * TILE_DIM;
+	u32 width = ATMOST(TILE_DIM, level_image->generated_width - x0);
+	u32 height = ATMOST(TILE_DIM, level_image->generated_height - y0);
+	for (u32 y = 0; y < height; ++y) {
+		memcpy(dest + y * TILE_PITCH, pixels + (y0 + y) * pitch + (u64)x0 * BYTES_PER_PIXEL, width * BYTES_PER_PIXEL);
+	}
+	if (width < TILE_DIM || height < TILE_DIM) {
+		tiff_clear_pixels_outside_image(dest, TILE_PITCH, TILE_DIM, TILE_DIM, width, height);
+	}
+	return true;
+}
+
+// 2x2 box filter; at the right and bottom edges of an odd-sized source, the last column or row is repeated.
+static void downsample_raster(u8* src, u32 src_width, u32 src_height, u8* dest, u32 dest_width, u32 dest_height) {
+	u64 src_pitch = (u64)src_width * BYTES_PER_PIXEL;
+	for (u32 y = 0; y < dest_height; ++y) {
+		u8* row0 = src + (u64)(2 * y) * src_pitch;
+		u8* row1 = src + (u64)ATMOST(2 * y + 1, src_height - 1) * src_pitch;
+		u8* out = dest + (u64)y * dest_width * BYTES_PER_PIXEL;
+		for (u32 x = 0; x < dest_width; ++x) {
+			u32 x0 = 2 * x * BYTES_PER_PIXEL;
+			u32 x1 = ATMOST(2 * x + 1, src_width - 1) * BYTES_PER_PIXEL;
+			for (i32 c = 0; c < BYTES_PER_PIXEL; ++c) {
+				out[x * BYTES_PER_PIXEL + c] = (u8)((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2);
+			}
+		}
+	}
+}
+
+static void publish_generated_level(level_image_t* level_image, u8* pixels) {
+	memory_stats_add(MEMORY_DOMAIN_GENERATED_LEVELS,
+	                 (i64)level_image->generated_width * level_image->generated_height * BYTES_PER_PIXEL);
+	write_barrier;
+	level_image->generated_pixels = pixels;
+	platform_wake_main_thread(); // the level can be requested and drawn now
+}
+
+// Publishes the first generated level, then makes each coarser generated level out of the one before it.
+static void finish_generated_levels(generated_levels_job_t* job) {
+	image_t* image = job->image;
+	level_image_t* finer = job->levels + job->first_level;
+	publish_generated_level(finer, job->pixels);
+	for (i32 level = job->first_level + 1; level < image->level_count && !image->is_level_generation_cancelled; ++level) {
+		level_image_t* level_image = job->levels + level;
+		if (!level_image->is_generated) break;
+		u8* pixels = (u8*) malloc((u64)level_image->generated_width * level_image->generated_height * BYTES_PER_PIXEL);
+		if (!pixels) break;
+		downsample_raster(finer->generated_pixels, finer->generated_width, finer->generated_height,
+		                  pixels, level_image->generated_width, level_image->generated_height);
+		publish_generated_level(level_image, pixels);
+		finer = level_image;
+	}
+}
+
+// Work queue entry for IMAGE_TYPE_RASTER: decodes the whole image, as level 0.
+static void generate_raster_levels_func(i32 logical_thread_index, void* userdata) {
+	generated_levels_job_t* job = (generated_levels_job_t*) userdata;
+	image_t* image = job->image;
+	platform_set_thread_background_mode(true);
+	i32 width = 0, height = 0, channels_in_file = 0;
+	u8* pixels = stbi_load(image->identity, &width, &height, &channels_in_file, 4);
+	level_image_t* level_image = job->levels + 0;
+	if (pixels && (u32)width == level_image->generated_width && (u32)height == level_image->generated_height) {
+		// RGBA -> BGRA
+		u64 pixel_count = (u64)width * height;
+		for (u64 i = 0; i < pixel_count; ++i) {
+			u8 r = pixels[i * 4 + 0];
+			pixels[i * 4 + 0] = pixels[i * 4 + 2];
+			pixels[i * 4 + 2] = r;
+		}
+		job->pixels = pixels;
+		finish_generated_levels(job);
+	} else {
+		printf("Could not decode %s\n", image->identity);
+		if (pixels) stbi_image_free(pixels);
+	}
+	platform_set_thread_background_mode(false);
+	interlocked_decrement(&image->level_generations_in_flight);
+	free(job);
+}
+
+// Work queue entry for TIFFs: downsamples the tiles of the source level (synthesized from the file, see
+// synthesize_tile()) into the raster of the first generated level. Whoever finishes last builds the coarser levels.
+static void generate_tiff_levels_func(i32 logical_thread_index, void* userdata) {
+	generated_levels_job_t* job = (generated_levels_job_t*) userdata;
+	image_t* image = job->image;
+	level_image_t* source = job->levels + job->source_level;
+	level_image_t* target = job->levels + job->first_level;
+	i32 shift = job->first_level - job->source_level;
+	u32 factor = 1u << shift;
+	u64 target_pitch = (u64)target->generated_width * BYTES_PER_PIXEL;
+	thread_memory_t* thread_memory = (thread_memory_t*) thread_local_storage[logical_thread_index];
+	u8* tile_pixels = (u8*) malloc(WSI_BLOCK_SIZE);
+	tiff_t* tiff = &image->tiff.tiff;
+	bool32 has_tile_tables = tiff_load_tile_tables(tiff, tiff->level_images + job->levels[source->source_level].tiff_level);
+	platform_set_thread_background_mode(true);
+	while (has_tile_tables) {
+		i32 tile_y = interlocked_increment(&job->next_row) - 1;
+		if (tile_y >= job->row_count || image->is_level_generation_cancelled) break;
+		for (i32 tile_x = 0; tile_x < (i32)source->width_in_tiles; ++tile_x) {
+			load_tile_task_t task = { .image = image, .focal_plane = job->focal_plane, .level = job->source_level,
+			                          .tile_x = tile_x, .tile_y = tile_y };
+			synthesize_tile(logical_thread_index, image, &task, tile_pixels, (u8*)thread_memory->aligned_rest_of_thread_memory,
+			                thread_memory->thread_memory_usable_size);
+			// The target pixels whose blocks start in this tile (blocks that cross into the next tile are cut short)
+			u32 source_x0 = tile_x * source->tile_width;
+			u32 source_y0 = tile_y * source->tile_height;
+			u32 x1 = (source_x0 + factor - 1) >> shift;
+			u32 y1 = (source_y0 + factor - 1) >> shift;
+			u32 x2 = ATMOST(target->generated_width, (source_x0 + source->tile_width + factor - 1) >> shift);
+			u32 y2 = ATMOST(target->generated_height, (source_y0 + source->tile_height + factor - 1) >> shift);
+			for (u32 y = y1; y < y2; ++y) {
+				u32 sy1 = (y << shift) - source_y0;
+				u32 sy2 = ATMOST(sy1 + factor, source->tile_height);
+				for (u32 x = x1; x < x2; ++x) {
+					u32 sx1 = (x << shift) - source_x0;
+					u32 sx2 = ATMOST(sx1 + factor, source->tile_width);
+					u32 sum[BYTES_PER_PIXEL] = {0};
+					for (u32 sy = sy1; sy < sy2; ++sy) {
+						u8* p = tile_pixels + sy * TILE_PITCH + sx1 * BYTES_PER_PIXEL;
+						for (u32 sx = sx1; sx < sx2; ++sx, p += BYTES_PER_PIXEL) {
+							for (i32 c = 0; c < BYTES_PER_PIXEL; ++c) sum[c] += p[c];
+						}
+					}
+					u32 count = (sy2 - sy1) * (sx2 - sx1);
+					u8* out = job->pixels + y * target_pitch + (u64)x * BYTES_PER_PIXEL;
+					for (i32 c = 0; c < BYTES_PER_PIXEL; ++c) out[c] = (u8)((sum[c] + count / 2) / count);
+				}
+			}
+		}
+	}
+	platform_set_thread_background_mode(false);
+	free(tile_pixels);
+	if (interlocked_decrement(&job->tasks_left) == 0) {
+		if (!image->is_level_generation_cancelled) {
+			finish_generated_levels(job);
+		} else {
+			free(job->pixels);
+		}
+		free(job);
+		interlocked_decrement(&image->level_generations_in_flight);
+	}
+}
+
+// For a level of a TIFF that is more than 3 levels away from the nearest finer level in the file (source_level), so
+// that it can't be synthesized. It can be generated instead, as long as it is no larger than GENERATED_LEVEL_MAX_SIZE;
+// returns false if not.
+bool32 init_generated_tiff_level(image_t* image, i32 focal_plane, i32 level) {
+	level_image_t* levels = get_focal_plane_levels(image, focal_plane);
+	level_image_t* level_image = levels + level;
+	level_image_t* file_level = levels + level_image->source_level;
+	tiff_ifd_t* ifd = image->tiff.tiff.level_images + file_level->tiff_level;
+	i32 shift = level - level_image->source_level;
+	ASSERT(shift > 3);
+	u32 width = get_downsampled_size(ifd->image_width, shift);
+	u32 height = get_downsampled_size(ifd->image_height, shift);
+	if ((u64)width * height * BYTES_PER_PIXEL > GENERATED_LEVEL_MAX_SIZE) {
+		return false;
+	}
+	level_image->generated_width = width;
+	level_image->generated_height = height;
+	level_image->source_scale_shift = shift;
+	init_generated_level(level_image, file_level->um_per_pixel_x * (float)(1 << shift),
+	                     file_level->um_per_pixel_y * (float)(1 << shift));
+	return true;
+}
+
+static void start_generated_levels_job(image_t* image, i32 focal_plane, i32 first_level) {
+	generated_levels_job_t* job = (generated_levels_job_t*) calloc(1, sizeof(generated_levels_job_t));
+	job->image = image;
+	job->focal_plane = focal_plane;
+	job->levels = get_focal_plane_levels(image, focal_plane);
+	job->first_level = first_level;
+	if (image->type == IMAGE_TYPE_RASTER) {
+		interlocked_increment(&image->level_generations_in_flight);
+		if (!add_work_queue_entry(&work_queue, generate_raster_levels_func, job)) {
+			generate_raster_levels_func(0, job); // queue is full, do it now
+		}
+	} else {
+		level_image_t* target = job->levels + first_level;
+		job->pixels = (u8*) calloc(1, (u64)target->generated_width * target->generated_height * BYTES_PER_PIXEL);
+		if (!job->pixels) {
+			free(job);
+			return;
+		}
+		job->source_level = target->source_level + 3; // the coarsest level that can be synthesized
+		job->row_count = (i32)job->levels[job->source_level].height_in_tiles;
+		// Half of the workers at most, so that the tiles in view still get loaded in the meantime.
+		i32 task_count = CLAMP((total_thread_count - 1) / 2, 1, job->row_count);
+		job->tasks_left = task_count;
+		interlocked_increment(&image->level_generations_in_flight);
+		for (i32 i = 0; i < task_count; ++i) {
+			if (!add_work_queue_entry(&work_queue, generate_tiff_levels_func, job)) {
+				generate_tiff_levels_func(0, job); // queue is full, do it now
+			}
+		}
+	}
+}
+
+// Call once the image is in the list of loaded images (its address doesn't change anymore). Each run of consecutive
+// generated levels (of each focal plane) is built by one job.
+void start_level_generation(image_t* image) {
+	for (i32 focal_plane = 0; focal_plane < image->focal_plane_count; ++focal_plane) {
+		level_image_t* levels = get_focal_plane_levels(image, focal_plane);
+		for (i32 level = 0; level < image->level_count; ++level) {
+			bool32 is_first_of_run = (level == 0 || !levels[level - 1].is_generated);
+			if (levels[level].is_generated && is_first_of_run) {
+				start_generated_levels_job(image, focal_plane, level);
+			}
+		}
+	}
+}
+
+// Needs the level generation to be over (see image_t::level_generations_in_flight).
+void free_generated_levels(image_t* image) {
+	for (i32 i = 0; i < image->focal_plane_count * image->level_count; ++i) {
+		level_image_t* level_image = image->focal_plane_level_images + i;
+		if (level_image->generated_pixels) {
+			memory_stats_add(MEMORY_DOMAIN_GENERATED_LEVELS,
+			                 -(i64)level_image->generated_width * level_image->generated_height * BYTES_PER_PIXEL);
+			free(level_image->generated_pixels);
+			level_image->generated_pixels = NULL;
+		}
+	}
+}
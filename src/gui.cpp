@@ -19,6 +19,7 @@
 #include "common.h"
 
 #include "stdio.h"
+#include <math.h>
 
 #include <windows.h>
 #include "platform.h"
@@ -38,7 +39,18 @@
 #define GUI_IMPL
 #include "gui.h"
 #include "annotation.h"
+#include "tile_cache.h"
+#include "shared_tile_cache.h"
 #include "stringutils.h"
+#include "profiler.h"
+#include "tile_metrics.h"
+#include "memory_stats.h"
+#include "region_export.h"
+#include "view_capture.h"
+#include "registration.h"
+#include "offline_download.h"
+#include "slide_catalog.h"
+#include "slide_open.h"
 
 void gui_new_frame() {
 	ImGui_ImplOpenGL3_NewFrame();
@@ -49,7 +61,613 @@ void gui_new_frame() {
 void menu_close_file(app_state_t* app_state) {
 	unload_all_images(app_state);
 	reset_global_caselist(app_state);
-	unload_and_reinit_annotations(&app_state->scene.annotation_set);
+	cancel_background_annotation_loads();
+	unload_and_reinit_annotations(&app_state->scenes[0].annotation_set);
+}
+
+// Timeline of the last frame(s), with a track for each thread and a row for each level of nesting.
+static void draw_profiler_window() {
+	static bool is_paused;
+	static i32 frames_shown = 1;
+	static i64 shown_begin;
+	static i64 shown_end;
+	static profiler_span_t* spans; // sb, reused
+	static bool32 export_failed;
+	static float shown_input_latency; // averaged over the frames shown
+	static float shown_max_input_latency;
+	static float shown_frame_cost;
+	static i32 shown_deferred_job_count; // summed over the frames shown
+	static float shown_deferred_seconds;
+
+	ImGui::SetNextWindowSize(ImVec2(900, 300), ImGuiCond_FirstUseEver);
+	ImGui::Begin("Profiler", &show_profiler_window);
+	ImGui::Checkbox("Pause", &is_paused);
+	ImGui::SameLine();
+	ImGui::SetNextItemWidth(200.0f);
+	ImGui::SliderInt("Frames", &frames_shown, 1, 16);
+	ImGui::SameLine();
+	if (ImGui::Button("Export trace")) {
+		// Can be opened in chrome://tracing or https://ui.perfetto.dev
+		export_failed = !profiler_export_chrome_trace("profile.json");
+	}
+	if (export_failed) {
+		ImGui::SameLine();
+		ImGui::TextUnformatted("(could not write profile.json)");
+	}
+
+	i64 begin, end, unused;
+	if (!is_paused && profiler_get_frame(frames_shown - 1, &begin, &unused) && profiler_get_frame(0, &unused, &end)) {
+		shown_begin = begin;
+		shown_end = end;
+		float latency_sum = 0.0f, cost_sum = 0.0f, max_latency = 0.0f;
+		i32 latency_count = 0;
+		for (i32 i = 0; i < frames_shown; ++i) {
+			float input_latency, frame_cost;
+			if (profiler_get_frame_latency(i, &input_latency, &frame_cost) && input_latency > 0.0f) {
+				latency_sum += input_latency;
+				cost_sum += frame_cost;
+				max_latency = ATLEAST(max_latency, input_latency);
+				++latency_count;
+			}
+		}
+		if (latency_count > 0) {
+			shown_input_latency = latency_sum / (float)latency_count;
+			shown_max_input_latency = max_latency;
+			shown_frame_cost = cost_sum / (float)latency_count;
+		}
+		shown_deferred_job_count = 0;
+		shown_deferred_seconds = 0.0f;
+		for (i32 i = 0; i < frames_shown; ++i) {
+			i32 deferred_job_count;
+			float deferred_seconds;
+			if (profiler_get_frame_deferred_jobs(i, &deferred_job_count, &deferred_seconds)) {
+				shown_deferred_job_count += deferred_job_count;
+				shown_deferred_seconds += deferred_seconds;
+			}
+		}
+	}
+	if (shown_end <= shown_begin) {
+		ImGui::End();
+		return;
+	}
+	ImGui::Text("%.2f ms", get_seconds_elapsed(shown_begin, shown_end) * 1000.0f);
+	ImGui::SameLine();
+	// Input latency: from sampling the input until SwapBuffers() returns; frame cost: the part that isn't waiting.
+	ImGui::Text("   input latency %.2f ms (max %.2f ms), frame cost %.2f ms",
+	            shown_input_latency * 1000.0f, shown_max_input_latency * 1000.0f, shown_frame_cost * 1000.0f);
+	ImGui::SameLine();
+	// Main-thread jobs that did not fit in the frame budget (see run_frame_jobs())
+	ImGui::Text("   deferred %d jobs (%.2f ms)", shown_deferred_job_count, shown_deferred_seconds * 1000.0f);
+	if (are_gpu_timers_available()) {
+		// (smoothed; the GPU track in the timeline lags a few frames behind, see begin_gpu_timer_frame())
+		ImGui::TextUnformatted("GPU:");
+		for (i32 pass = 0; pass < GPU_PASS_COUNT; ++pass) {
+			ImGui::SameLine();
+			ImGui::Text("  %s %.2f ms", get_gpu_pass_name((gpu_pass_enum)pass), get_gpu_pass_seconds((gpu_pass_enum)pass) * 1000.0f);
+		}
+	}
+
+	ImDrawList* draw_list = ImGui::GetWindowDrawList();
+	const float label_width = 80.0f;
+	const float row_height = ImGui::GetTextLineHeight() + 2.0f;
+	const i32 max_rows = 8;
+	float timeline_width = ATLEAST(1.0f, ImGui::GetContentRegionAvail().x - label_width);
+	float pixels_per_tick = timeline_width / (float)(shown_end - shown_begin);
+	ImVec2 mouse_pos = ImGui::GetIO().MousePos;
+
+	i32 thread_count = profiler_get_thread_count();
+	for (i32 thread_index = 0; thread_index < thread_count; ++thread_index) {
+		if (spans) sb_raw_count(spans) = 0;
+		profiler_copy_spans(thread_index, shown_begin, shown_end, &spans);
+		i32 row_count = 1;
+		for (i32 i = 0; i < sb_count(spans); ++i) {
+			row_count = ATLEAST(row_count, ATMOST(spans[i].depth + 1, max_rows));
+		}
+
+		ImVec2 origin = ImGui::GetCursorScreenPos();
+		ImGui::TextUnformatted(profiler_get_thread_name(thread_index));
+		ImGui::SetCursorScreenPos(origin);
+		ImGui::Dummy(ImVec2(label_width + timeline_width, row_count * row_height + 2.0f));
+		float timeline_x = origin.x + label_width;
+		draw_list->AddRectFilled(ImVec2(timeline_x, origin.y), ImVec2(timeline_x + timeline_width, origin.y + row_count * row_height),
+		                         IM_COL32(40, 40, 40, 255));
+
+		for (i32 i = 0; i < sb_count(spans); ++i) {
+			profiler_span_t* span = spans + i;
+			if (span->depth >= max_rows) continue;
+			float x0 = timeline_x + (float)(ATLEAST(span->begin, shown_begin) - shown_begin) * pixels_per_tick;
+			float x1 = timeline_x + (float)(ATMOST(span->end, shown_end) - shown_begin) * pixels_per_tick;
+			x1 = ATLEAST(x1, x0 + 1.0f);
+			float y0 = origin.y + span->depth * row_height;
+			float y1 = y0 + row_height - 1.0f;
+			// The names are string literals, so the address is good enough to tell the sections apart by color.
+			u32 hash = (u32)(((uintptr_t)span->name >> 3) * 2654435761u);
+			ImU32 color = ImColor::HSV((float)(hash >> 8) / (float)(1 << 24), 0.5f, 0.7f);
+			draw_list->AddRectFilled(ImVec2(x0, y0), ImVec2(x1, y1), color);
+			if (ImGui::CalcTextSize(span->name).x < x1 - x0 - 4.0f) {
+				draw_list->AddText(ImVec2(x0 + 2.0f, y0 + 1.0f), IM_COL32(255, 255, 255, 255), span->name);
+			}
+			if (ImGui::IsWindowHovered() && mouse_pos.x >= x0 && mouse_pos.x < x1 && mouse_pos.y >= y0 && mouse_pos.y < y1) {
+				ImGui::SetTooltip("%s: %.3f ms", span->name, get_seconds_elapsed(span->begin, span->end) * 1000.0f);
+			}
+		}
+	}
+	ImGui::End();
+}
+
+static void draw_tile_metrics_window() {
+	ImGui::SetNextWindowSize(ImVec2(560, 260), ImGuiCond_FirstUseEver);
+	ImGui::Begin("Tile pipeline metrics", &show_tile_metrics_window);
+	if (ImGui::Button("Reset")) {
+		tile_metrics_reset();
+	}
+	ImGui::Columns(5, "tile_stages");
+	ImGui::TextUnformatted("Stage"); ImGui::NextColumn();
+	ImGui::TextUnformatted("Tiles"); ImGui::NextColumn();
+	ImGui::TextUnformatted("p50 (ms)"); ImGui::NextColumn();
+	ImGui::TextUnformatted("p95 (ms)"); ImGui::NextColumn();
+	ImGui::TextUnformatted("p99 (ms)"); ImGui::NextColumn();
+	ImGui::Separator();
+	for (i32 i = 0; i < TILE_STAGE_COUNT; ++i) {
+		tile_stage_enum stage = (tile_stage_enum)i;
+		ImGui::TextUnformatted(tile_metrics_get_stage_name(stage)); ImGui::NextColumn();
+		ImGui::Text("%d", global_tile_metrics.stages[stage].count); ImGui::NextColumn();
+		ImGui::Text("%.2f", tile_metrics_get_percentile(stage, 0.50f) * 1000.0f); ImGui::NextColumn();
+		ImGui::Text("%.2f", tile_metrics_get_percentile(stage, 0.95f) * 1000.0f); ImGui::NextColumn();
+		ImGui::Text("%.2f", tile_metrics_get_percentile(stage, 0.99f) * 1000.0f); ImGui::NextColumn();
+	}
+	ImGui::Columns(1);
+	ImGui::Separator();
+	for (i32 i = 0; i < TILE_COUNTER_COUNT; ++i) {
+		tile_counter_enum counter = (tile_counter_enum)i;
+		ImGui::Text("%s: %d", tile_metrics_get_counter_name(counter), global_tile_metrics.counters[counter]);
+	}
+	ImGui::End();
+}
+
+static void draw_memory_window() {
+	ImGui::SetNextWindowSize(ImVec2(420, 230), ImGuiCond_FirstUseEver);
+	ImGui::Begin("Memory usage", &show_memory_window);
+	ImGui::Columns(3, "memory_domains");
+	ImGui::TextUnformatted("Domain"); ImGui::NextColumn();
+	ImGui::TextUnformatted("Current (MB)"); ImGui::NextColumn();
+	ImGui::TextUnformatted("Peak (MB)"); ImGui::NextColumn();
+	ImGui::Separator();
+	for (i32 i = 0; i < MEMORY_DOMAIN_COUNT; ++i) {
+		memory_domain_enum domain = (memory_domain_enum)i;
+		ImGui::TextUnformatted(memory_stats_get_domain_name(domain)); ImGui::NextColumn();
+		ImGui::Text("%.1f", (float)memory_stats_get(domain) / (float)MEGABYTES(1)); ImGui::NextColumn();
+		ImGui::Text("%.1f", (float)memory_stats_get_peak(domain) / (float)MEGABYTES(1)); ImGui::NextColumn();
+	}
+	ImGui::Separator();
+	ImGui::TextUnformatted("Total"); ImGui::NextColumn();
+	ImGui::Text("%.1f", (float)memory_stats_get_total() / (float)MEGABYTES(1)); ImGui::NextColumn();
+	ImGui::NextColumn();
+	ImGui::Columns(1);
+	ImGui::End();
+}
+
+// The part of the level (in its pixels) that is in view in the main scene.
+static void get_view_region_in_level(app_state_t* app_state, image_t* image, i32 level, i64 level_width,
+                                     i64 level_height, i64* x, i64* y, i64* width, i64* height) {
+	v2f camera_min, camera_max;
+	get_scene_camera_bounds(app_state->scenes + 0, &camera_min, &camera_max);
+	level_image_t* level_image = image->level_images + level;
+	i64 x2 = CLAMP((i64)(camera_max.x / level_image->um_per_pixel_x), 0, level_width);
+	i64 y2 = CLAMP((i64)(camera_max.y / level_image->um_per_pixel_y), 0, level_height);
+	*x = CLAMP((i64)(camera_min.x / level_image->um_per_pixel_x), 0, level_width);
+	*y = CLAMP((i64)(camera_min.y / level_image->um_per_pixel_y), 0, level_height);
+	*width = x2 - *x;
+	*height = y2 - *y;
+}
+
+// Captures the view as it is on screen (see view_capture.h), or at the native resolution of the slide: then the
+// region in view is exported from the finest level in the file instead (without the annotations).
+static void draw_capture_view_window(app_state_t* app_state) {
+	static bool at_native_resolution;
+	static char filename[512] = "capture.jpg";
+
+	ImGui::SetNextWindowSize(ImVec2(380, 150), ImGuiCond_FirstUseEver);
+	ImGui::Begin("Capture view", &show_capture_view_window);
+	image_t* image = NULL;
+	if (app_state->displayed_image >= 0 && app_state->displayed_image < sb_count(app_state->loaded_images)) {
+		image = app_state->loaded_images[app_state->displayed_image];
+	}
+	i64 level_width = 0, level_height = 0;
+	bool32 can_capture_native = image && image->type != IMAGE_TYPE_SIMPLE &&
+	                            get_exportable_level_size(image, 0, &level_width, &level_height);
+	if (!can_capture_native) at_native_resolution = false;
+	ImGui::Checkbox("At native resolution", &at_native_resolution);
+	i64 x = 0, y = 0, width = 0, height = 0;
+	if (at_native_resolution) {
+		get_view_region_in_level(app_state, image, 0, level_width, level_height, &x, &y, &width, &height);
+		ImGui::Text("%lld x %lld pixels (without annotations)", width, height);
+	} else {
+		ImGui::Text("%d x %d pixels, as on screen", app_state->client_viewport.w, app_state->client_viewport.h);
+	}
+	ImGui::InputText("Filename", filename, sizeof(filename));
+
+	float progress = 0.0f;
+	if (at_native_resolution && get_region_export_progress(&progress)) {
+		ImGui::ProgressBar(progress);
+		if (ImGui::Button("Cancel")) {
+			cancel_region_exports();
+		}
+	} else if (ImGui::Button("Capture")) {
+		if (at_native_resolution) {
+			if (width > 0 && height > 0) {
+				start_region_export(image, 0, x, y, width, height, EXPORT_FORMAT_JPEG, filename);
+			}
+		} else {
+			request_view_capture(filename);
+		}
+	}
+	if (!at_native_resolution && is_view_capture_in_progress()) {
+		ImGui::SameLine();
+		ImGui::TextUnformatted("Capturing...");
+	}
+	ImGui::End();
+}
+
+// Exports the current view (or the whole level) of the displayed image at the resolution of a level of the file.
+static void draw_export_region_window(app_state_t* app_state) {
+	static i32 export_level;
+	static i32 region_choice; // 0 = current view, 1 = whole level
+	static i32 format_choice = EXPORT_FORMAT_TIFF;
+	static char filename[512] = "export.tif";
+
+	ImGui::SetNextWindowSize(ImVec2(420, 220), ImGuiCond_FirstUseEver);
+	ImGui::Begin("Export region", &show_export_region_window);
+	image_t* image = NULL;
+	if (app_state->displayed_image >= 0 && app_state->displayed_image < sb_count(app_state->loaded_images)) {
+		image = app_state->loaded_images[app_state->displayed_image];
+	}
+	if (!image || image->type == IMAGE_TYPE_SIMPLE) {
+		ImGui::TextUnformatted("No slide is displayed.");
+		ImGui::End();
+		return;
+	}
+
+	export_level = CLAMP(export_level, 0, image->level_count - 1);
+	i64 level_width = 0, level_height = 0;
+	char level_label[64];
+	snprintf(level_label, sizeof(level_label), "Level %d", export_level);
+	if (ImGui::BeginCombo("Level", level_label)) {
+		for (i32 level = 0; level < image->level_count; ++level) {
+			i64 width, height;
+			if (!get_exportable_level_size(image, level, &width, &height)) continue; // not in the file
+			char label[64];
+			snprintf(label, sizeof(label), "Level %d (%.3f um/pixel)", level, image->level_images[level].um_per_pixel_x);
+			if (ImGui::Selectable(label, level == export_level)) {
+				export_level = level;
+			}
+		}
+		ImGui::EndCombo();
+	}
+	bool32 is_level_exportable = get_exportable_level_size(image, export_level, &level_width, &level_height);
+
+	ImGui::RadioButton("Current view", &region_choice, 0); ImGui::SameLine();
+	ImGui::RadioButton("Whole level", &region_choice, 1);
+	i64 x = 0, y = 0, width = level_width, height = level_height;
+	if (region_choice == 0) {
+		get_view_region_in_level(app_state, image, export_level, level_width, level_height, &x, &y, &width, &height);
+	}
+	ImGui::Text("%lld x %lld pixels (%.0f MB uncompressed)", width, height,
+	            (double)width * (double)height * 3.0 / (double)MEGABYTES(1));
+
+	ImGui::RadioButton("Tiled TIFF", &format_choice, EXPORT_FORMAT_TIFF); ImGui::SameLine();
+	ImGui::RadioButton("JPEG", &format_choice, EXPORT_FORMAT_JPEG);
+	ImGui::InputText("Filename", filename, sizeof(filename));
+
+	float progress = 0.0f;
+	if (get_region_export_progress(&progress)) {
+		ImGui::ProgressBar(progress);
+		if (ImGui::Button("Cancel")) {
+			cancel_region_exports();
+		}
+	} else if (ImGui::Button("Export") && is_level_exportable && width > 0 && height > 0) {
+		start_region_export(image, export_level, x, y, width, height, (export_format_enum)format_choice, filename);
+	}
+	ImGui::End();
+}
+
+static slide_catalog_t slide_catalog;
+
+// Shortens the text (with "...") until it fits in the width.
+static void text_fitted_to_width(const char* text, float width) {
+	if (ImGui::CalcTextSize(text).x <= width) {
+		ImGui::TextUnformatted(text);
+		return;
+	}
+	char buffer[256];
+	i32 length = (i32)ATMOST(strlen(text), sizeof(buffer) - 4);
+	for (; length > 0; --length) {
+		snprintf(buffer, sizeof(buffer), "%.*s...", length, text);
+		if (ImGui::CalcTextSize(buffer).x <= width) break;
+	}
+	ImGui::TextUnformatted(buffer);
+}
+
+// The slides on the server, as a grid of thumbnails (see slide_catalog.h). Only the visible rows are laid out, and their
+// thumbnails are uploaded when they first come into view. Clicking a slide opens it.
+static void draw_slide_catalog_window(app_state_t* app_state) {
+	ImGui::SetNextWindowPos(ImVec2(220, 50), ImGuiCond_FirstUseEver);
+	ImGui::SetNextWindowSize(ImVec2(720, 540), ImGuiCond_FirstUseEver);
+	if (!ImGui::Begin("Slide catalog", &show_slide_catalog_window)) {
+		ImGui::End();
+		return;
+	}
+	i32 slide_count = sb_count(slide_catalog.slides);
+	ImGui::Text("%d slides on %s:%d", slide_count, slide_catalog.hostname, slide_catalog.portno);
+	ImGui::SameLine();
+	if (ImGui::SmallButton("Refresh")) {
+		char hostname[256];
+		strncpy(hostname, slide_catalog.hostname, sizeof(hostname));
+		load_remote_slide_catalog(&slide_catalog, hostname, slide_catalog.portno);
+		slide_count = sb_count(slide_catalog.slides);
+	}
+
+	ImGui::BeginChild("##thumbnails");
+	float cell_size = (float)SLIDE_CATALOG_THUMBNAIL_SIZE;
+	ImGuiStyle& style = ImGui::GetStyle();
+	i32 column_count = ATLEAST(1, (i32)((ImGui::GetContentRegionAvail().x + style.ItemSpacing.x) /
+	                                    (cell_size + style.ItemSpacing.x)));
+	i32 row_count = (slide_count + column_count - 1) / column_count;
+	float row_height = cell_size + ImGui::GetTextLineHeight() + style.ItemSpacing.y * 2.0f;
+	ImGuiListClipper clipper(row_count, row_height);
+	while (clipper.Step()) {
+		for (i32 row = clipper.DisplayStart; row < clipper.DisplayEnd; ++row) {
+			for (i32 column = 0; column < column_count; ++column) {
+				i32 slide_index = row * column_count + column;
+				if (slide_index >= slide_count) break;
+				catalog_slide_t* slide = slide_catalog.slides + slide_index;
+				upload_catalog_thumbnails(slide);
+				if (column > 0) ImGui::SameLine();
+				ImGui::BeginGroup();
+				ImGui::PushID(slide_index);
+				ImVec2 pos = ImGui::GetCursorScreenPos();
+				bool clicked = ImGui::InvisibleButton("##thumbnail", ImVec2(cell_size, cell_size));
+				bool hovered = ImGui::IsItemHovered();
+				ImDrawList* draw_list = ImGui::GetWindowDrawList();
+				draw_list->AddRectFilled(pos, ImVec2(pos.x + cell_size, pos.y + cell_size),
+				                         ImGui::GetColorU32(hovered ? ImGuiCol_ButtonHovered : ImGuiCol_FrameBg));
+				if (slide->macro_texture && slide->thumbnail_width > 0 && slide->thumbnail_height > 0) {
+					// Fit the thumbnail in the cell, keeping its aspect ratio.
+					float scale = cell_size / (float)MAX(slide->thumbnail_width, slide->thumbnail_height);
+					float width = slide->thumbnail_width * scale;
+					float height = slide->thumbnail_height * scale;
+					ImVec2 min = ImVec2(pos.x + (cell_size - width) * 0.5f, pos.y + (cell_size - height) * 0.5f);
+					draw_list->AddImage((ImTextureID)(intptr_t)slide->macro_texture, min,
+					                    ImVec2(min.x + width, min.y + height));
+				}
+				if (hovered) {
+					ImGui::BeginTooltip();
+					if (slide->label_texture) {
+						ImGui::Image((ImTextureID)(intptr_t)slide->label_texture, ImVec2(cell_size, cell_size));
+					}
+					slide_catalog_entry_t* info = &slide->info;
+					ImGui::TextUnformatted(slide->name);
+					ImGui::Text("%u x %u pixels, %u levels", info->width, info->height, info->level_count);
+					if (info->mpp_x > 0.0f) {
+						ImGui::Text("%.4f x %.4f um/pixel", info->mpp_x, info->mpp_y);
+					}
+					ImGui::Text("%.1f MB", (double)info->filesize / (double)MEGABYTES(1));
+					ImGui::EndTooltip();
+				}
+				text_fitted_to_width(slide->name, cell_size);
+				ImGui::PopID();
+				ImGui::EndGroup();
+				if (clicked) {
+					start_remote_slide_open(app_state, slide_catalog.hostname, slide_catalog.portno, slide->name);
+				}
+			}
+		}
+	}
+	ImGui::EndChild();
+	ImGui::End();
+}
+
+// The overview of the displayed slide: the slide itself is drawn underneath by the viewer, into the rect reserved here
+// (see draw_minimap() in viewer.c), so the window has no background. On top of it go the outline of the view, and the
+// loaded tiles of the current level (or of the finest level that still fits), as a debugging aid. Clicking jumps the
+// camera there.
+static void draw_minimap_window(app_state_t* app_state) {
+	app_state->minimap_rect = rect2i{};
+	image_t* image = NULL;
+	if (app_state->displayed_image >= 0 && app_state->displayed_image < sb_count(app_state->loaded_images)) {
+		image = app_state->loaded_images[app_state->displayed_image];
+	}
+	ImGui::SetNextWindowPos(ImVec2(25, 300), ImGuiCond_FirstUseEver);
+	ImGui::SetNextWindowSize(ImVec2(280, 240), ImGuiCond_FirstUseEver);
+	if (!ImGui::Begin("Overview", &show_minimap_window, ImGuiWindowFlags_NoBackground | ImGuiWindowFlags_NoScrollbar)) {
+		ImGui::End();
+		return;
+	}
+	if (!image || image->type == IMAGE_TYPE_SIMPLE || image->width_in_um <= 0 || image->height_in_um <= 0) {
+		ImGui::TextUnformatted("No slide is displayed.");
+		ImGui::End();
+		return;
+	}
+
+	ImVec2 avail = ImGui::GetContentRegionAvail();
+	avail.y -= ImGui::GetTextLineHeightWithSpacing(); // (for the coverage label below)
+	float aspect = (float)image->width_in_um / (float)image->height_in_um;
+	float width = ATLEAST(1.0f, avail.x);
+	float height = width / aspect;
+	if (height > avail.y) {
+		height = ATLEAST(1.0f, avail.y);
+		width = height * aspect;
+	}
+	ImVec2 origin = ImGui::GetCursorScreenPos();
+	origin.x = floorf(origin.x);
+	origin.y = floorf(origin.y);
+	ImGui::SetCursorScreenPos(origin);
+	ImGui::InvisibleButton("minimap", ImVec2(floorf(width), floorf(height)));
+	app_state->minimap_rect = rect2i{ (i32)origin.x, (i32)origin.y, (i32)width, (i32)height };
+	float scale_x = floorf(width) / (float)image->width_in_um;
+	float scale_y = floorf(height) / (float)image->height_in_um;
+	scene_t* scene = app_state->scenes + 0;
+
+	if (ImGui::IsItemClicked(0)) {
+		ImVec2 mouse_pos = ImGui::GetIO().MousePos;
+		v2f target = { (mouse_pos.x - origin.x) / scale_x, (mouse_pos.y - origin.y) / scale_y };
+		jump_scene_camera(scene, target);
+	}
+
+	// Loaded tiles: at least 2 pixels per tile on the overview, otherwise a coarser level is shown
+	ImDrawList* draw_list = ImGui::GetWindowDrawList();
+	i32 coverage_level = CLAMP(scene->current_level, 0, image->level_count - 1);
+	while (coverage_level < image->level_count - 1 &&
+	       image->level_images[coverage_level].x_tile_side_in_um * scale_x < 2.0f) {
+		++coverage_level;
+	}
+	level_image_t* level_image = image->level_images + coverage_level;
+	float tile_w = level_image->x_tile_side_in_um * scale_x;
+	float tile_h = level_image->y_tile_side_in_um * scale_y;
+	tile_range_t range = { 0, 0, (i32)level_image->width_in_tiles, (i32)level_image->height_in_tiles };
+	ImU32 coverage_color = IM_COL32(0, 200, 0, 90);
+	i32 run_y = -1, run_x1 = 0, run_x2 = 0; // consecutive loaded tiles in a row are drawn as one rect
+	tile_iterator_t it = begin_tile_iteration(level_image, range, false);
+	for (;;) {
+		bool32 has_next = next_tile(&it);
+		bool32 is_loaded = has_next && it.tile && (it.tile->texture_slot != 0 || it.tile->is_uniform);
+		if (run_y >= 0 && (!has_next || !is_loaded || it.tile_y != run_y || it.tile_x != run_x2)) {
+			ImVec2 p0 = ImVec2(origin.x + run_x1 * tile_w, origin.y + run_y * tile_h);
+			ImVec2 p1 = ImVec2(ATMOST(origin.x + run_x2 * tile_w, origin.x + width), ATMOST(p0.y + tile_h, origin.y + height));
+			draw_list->AddRectFilled(p0, p1, coverage_color);
+			run_y = -1;
+		}
+		if (!has_next) break;
+		if (is_loaded) {
+			if (run_y < 0) {
+				run_y = it.tile_y;
+				run_x1 = it.tile_x;
+			}
+			run_x2 = it.tile_x + 1;
+		}
+	}
+
+	// The view
+	v2f camera_min, camera_max;
+	get_scene_camera_bounds(scene, &camera_min, &camera_max);
+	ImVec2 view_min = ImVec2(origin.x + camera_min.x * scale_x, origin.y + camera_min.y * scale_y);
+	ImVec2 view_max = ImVec2(origin.x + camera_max.x * scale_x, origin.y + camera_max.y * scale_y);
+	draw_list->PushClipRect(origin, ImVec2(origin.x + width, origin.y + height), true);
+	draw_list->AddRect(view_min, view_max, IM_COL32(255, 255, 0, 255), 0.0f, 0, 2.0f);
+	draw_list->PopClipRect();
+	draw_list->AddRect(origin, ImVec2(origin.x + width, origin.y + height), IM_COL32(128, 128, 128, 255));
+
+	ImGui::Text("Slide: level %d, tiles loaded: level %d", get_minimap_level(image), coverage_level);
+	ImGui::End();
+}
+
+static const char* tile_overlay_state_names[TILE_OVERLAY_STATE_COUNT] = {
+	"Not requested", "Queued", "I/O", "Decoding", "Uploading", "Resident", "Empty", "Failed", "Evicted",
+};
+
+static const ImU32 tile_overlay_state_colors[TILE_OVERLAY_STATE_COUNT] = {
+	IM_COL32(128, 128, 128, 60),  // not requested
+	IM_COL32(80, 140, 255, 110),  // queued
+	IM_COL32(170, 80, 255, 110),  // I/O
+	IM_COL32(255, 150, 0, 110),   // decoding
+	IM_COL32(255, 230, 0, 110),   // uploading
+	IM_COL32(0, 200, 0, 60),      // resident
+	IM_COL32(0, 0, 0, 0),         // empty (not drawn)
+	IM_COL32(255, 0, 0, 140),     // failed
+	IM_COL32(255, 0, 200, 90),    // evicted
+};
+
+static i32 tile_overlay_coarser_level_count = 1;
+static bool tile_overlay_color_by_latency = false;
+static float tile_overlay_max_latency_in_ms = 1000.0f;
+
+static ImU32 get_tile_overlay_latency_color(float latency, u8 alpha) {
+	float t = CLAMP(latency * 1000.0f / ATLEAST(1.0f, tile_overlay_max_latency_in_ms), 0.0f, 1.0f);
+	return IM_COL32((u8)(255.0f * t), (u8)(255.0f * (1.0f - t)), 0, alpha);
+}
+
+// Colors the tiles in view of a scene by state. The finest level (the one being zoomed to) is filled; the coarser
+// levels underneath it, which are what shows through while the finer tiles are not in yet, are drawn as outlines with
+// a small inset each, so that a tile that stays blurry can be traced down to the level it is actually drawn from.
+static void draw_tile_state_overlay_for_scene(scene_t* scene, image_t* image) {
+	rect2i viewport = scene->viewport;
+	if (viewport.w <= 0 || viewport.h <= 0 || scene->pixel_width <= 0.0f) return;
+	v2f camera_min, camera_max;
+	get_scene_camera_bounds(scene, &camera_min, &camera_max);
+	float screen_um_per_pixel = scene->pixel_width;
+	ImDrawList* draw_list = ImGui::GetBackgroundDrawList();
+	draw_list->PushClipRect(ImVec2((float)viewport.x, (float)viewport.y),
+	                        ImVec2((float)(viewport.x + viewport.w), (float)(viewport.y + viewport.h)), true);
+
+	i32 finest_level = CLAMP(scene->current_level, 0, image->level_count - 1);
+	i32 coarsest_level = ATMOST(finest_level + tile_overlay_coarser_level_count, image->level_count - 1);
+	for (i32 level = coarsest_level; level >= finest_level; --level) {
+		level_image_t* level_image = image->level_images + level;
+		if (level_image->x_tile_side_in_um <= 0.0f || level_image->y_tile_side_in_um <= 0.0f) continue;
+		tile_range_t range = get_tile_range_in_region(level_image, camera_min, camera_max);
+		bool is_filled = (level == finest_level);
+		float inset = (float)(level - finest_level) * 2.0f;
+		for (i32 tile_y = range.y1; tile_y < range.y2; ++tile_y) {
+			for (i32 tile_x = range.x1; tile_x < range.x2; ++tile_x) {
+				float latency = 0.0f;
+				tile_overlay_state_enum state = get_tile_overlay_state(level_image, tile_x, tile_y, &latency);
+				if (state == TILE_OVERLAY_EMPTY) continue;
+				ImU32 color = tile_overlay_state_colors[state];
+				if (tile_overlay_color_by_latency && state == TILE_OVERLAY_RESIDENT && latency > 0.0f) {
+					color = get_tile_overlay_latency_color(latency, 110);
+				}
+				v2f world_min = { tile_x * level_image->x_tile_side_in_um, tile_y * level_image->y_tile_side_in_um };
+				v2f world_max = { world_min.x + level_image->x_tile_side_in_um, world_min.y + level_image->y_tile_side_in_um };
+				v2f p0 = world_pos_to_screen_pos(world_min, camera_min, screen_um_per_pixel);
+				v2f p1 = world_pos_to_screen_pos(world_max, camera_min, screen_um_per_pixel);
+				ImVec2 min = ImVec2(viewport.x + p0.x + inset, viewport.y + p0.y + inset);
+				ImVec2 max = ImVec2(viewport.x + p1.x - inset, viewport.y + p1.y - inset);
+				if (is_filled) {
+					draw_list->AddRectFilled(min, max, color);
+					draw_list->AddRect(min, max, IM_COL32(0, 0, 0, 60));
+				} else {
+					draw_list->AddRect(min, max, color | IM_COL32(0, 0, 0, 255), 0.0f, 0, 2.0f);
+				}
+			}
+		}
+	}
+	draw_list->PopClipRect();
+}
+
+// View > Debug > Tile state overlay: shows how far each tile in view has got in the tile pipeline (see
+// get_tile_overlay_state()). Nothing of this runs while the overlay is off; the pipeline only writes a byte per tile.
+static void draw_tile_state_overlay(app_state_t* app_state) {
+	ImGui::SetNextWindowSize(ImVec2(260, 330), ImGuiCond_FirstUseEver);
+	if (ImGui::Begin("Tile state overlay", &show_tile_state_overlay)) {
+		ImGui::SliderInt("Coarser levels", &tile_overlay_coarser_level_count, 0, 4);
+		ImGui::Checkbox("Color by load latency", &tile_overlay_color_by_latency);
+		if (tile_overlay_color_by_latency) {
+			ImGui::SliderFloat("Max latency (ms)", &tile_overlay_max_latency_in_ms, 50.0f, 5000.0f, "%.0f");
+		}
+		ImGui::Separator();
+		for (i32 i = 0; i < TILE_OVERLAY_STATE_COUNT; ++i) {
+			if (i == TILE_OVERLAY_EMPTY) continue;
+			ImU32 color = tile_overlay_state_colors[i] | IM_COL32(0, 0, 0, 255);
+			if (tile_overlay_color_by_latency && i == TILE_OVERLAY_RESIDENT) {
+				ImGui::ColorButton("##fast", ImColor(get_tile_overlay_latency_color(0.0f, 255)), ImGuiColorEditFlags_NoTooltip);
+				ImGui::SameLine(0.0f, 0.0f);
+				ImGui::ColorButton("##slow", ImColor(get_tile_overlay_latency_color(1000.0f, 255)), ImGuiColorEditFlags_NoTooltip);
+			} else {
+				ImGui::ColorButton(tile_overlay_state_names[i], ImColor(color), ImGuiColorEditFlags_NoTooltip);
+			}
+			ImGui::SameLine();
+			ImGui::TextUnformatted(tile_overlay_state_names[i]);
+		}
+		ImGui::TextDisabled("Coarser levels are drawn as outlines.");
+	}
+	ImGui::End();
+
+	for (i32 scene_index = 0; scene_index < app_state->scene_count; ++scene_index) {
+		scene_t* scene = app_state->scenes + scene_index;
+		image_t* image = find_loaded_image(app_state, scene->image_id);
+		if (!image || image->type == IMAGE_TYPE_SIMPLE || image->level_count <= 0) continue;
+		draw_tile_state_overlay_for_scene(scene, image);
+	}
 }
 
 void gui_draw(app_state_t* app_state, input_t* input, i32 client_width, i32 client_height) {
@@ -71,6 +689,7 @@ void gui_draw(app_state_t* app_state, input_t* input, i32 client_width, i32 clie
 	if (ret) {
 		static struct {
 			bool open_file;
+			bool open_overlay;
 			bool close;
 			bool open_remote;
 			bool exit_program;
@@ -83,31 +702,65 @@ void gui_draw(app_state_t* app_state, input_t* input, i32 client_width, i32 clie
 
 		if (ImGui::BeginMenu("File")) {
 			if (ImGui::MenuItem("Open...", "Ctrl+O", &menu_items_clicked.open_file)) {}
+			if (ImGui::MenuItem("Open overlay...", NULL, &menu_items_clicked.open_overlay)) {}
 			if (ImGui::MenuItem("Close", "Ctrl+W", &menu_items_clicked.close)) {}
+			if (ImGui::MenuItem("Export region...", NULL, &show_export_region_window)) {}
+			if (ImGui::MenuItem("Capture view...", NULL, &show_capture_view_window)) {}
 			ImGui::Separator();
 			if (ImGui::MenuItem("Exit", "Alt+F4", &menu_items_clicked.exit_program)) {}
 			ImGui::EndMenu();
 		}
 		if (ImGui::BeginMenu("Annotation")) {
 			if (ImGui::MenuItem("Load...", NULL, &menu_items_clicked.open_file)) {} // TODO: only accept annotation files here?
+			if (ImGui::MenuItem("Export to XML", NULL, &menu_items_clicked.save_annotations, app_state->scenes[0].annotation_set.filename != NULL)) {}
 			ImGui::Separator();
 			if (ImGui::MenuItem("Annotations...", NULL, &show_annotations_window)) {}
 			if (ImGui::MenuItem("Assign group...", NULL, &show_annotation_group_assignment_window)) {}
+			if (ImGui::MenuItem("Statistics...", NULL, &show_annotation_statistics_window)) {}
 			ImGui::EndMenu();
 		}
 		if (ImGui::BeginMenu("View")) {
 			prev_fullscreen = is_fullscreen = win32_is_fullscreen(main_window); // double-check just in case...
 			if (ImGui::MenuItem("Fullscreen", "F11", &is_fullscreen)) {}
 			if (ImGui::MenuItem("Image adjustments...", NULL, &show_image_adjustments_window)) {}
+			if (ImGui::MenuItem("Overview", NULL, &show_minimap_window)) {}
+			if (ImGui::BeginMenu("Split screen")) {
+				if (ImGui::MenuItem("Single view", NULL, app_state->scene_count == 1)) app_state->scene_count = 1;
+				if (ImGui::MenuItem("Two views side by side", NULL, app_state->scene_count == 2)) app_state->scene_count = 2;
+				if (ImGui::MenuItem("Three views side by side", NULL, app_state->scene_count == 3)) app_state->scene_count = 3;
+				if (ImGui::MenuItem("Four views", NULL, app_state->scene_count == 4)) app_state->scene_count = 4;
+				ImGui::Separator();
+				if (ImGui::MenuItem("Link cameras", NULL, &app_state->link_scene_cameras)) {}
+				if (ImGui::MenuItem("Align slides", NULL, false, app_state->scene_count > 1 && !is_registration_in_progress())) {
+					start_scene_registrations(app_state);
+				}
+				ImGui::EndMenu();
+			}
 
 			ImGui::Separator();
 
 			if (ImGui::MenuItem("Options...", NULL, &show_display_options_window)) {}
 			if (ImGui::BeginMenu("Debug")) {
 				if (ImGui::MenuItem("Demo window", "F1", &show_demo_window)) {}
+				if (ImGui::MenuItem("Profiler...", NULL, &show_profiler_window)) {}
+				if (ImGui::MenuItem("Tile pipeline metrics...", NULL, &show_tile_metrics_window)) {}
+				if (ImGui::MenuItem("Memory usage...", NULL, &show_memory_window)) {}
+				if (ImGui::MenuItem("Tile state overlay...", NULL, &show_tile_state_overlay)) {}
+				bool is_replaying = app_state->camera_path_replay.is_active;
+				if (ImGui::MenuItem("Record camera path", NULL, &app_state->record_camera_path, !is_replaying)) {}
+				if (ImGui::MenuItem("Replay camera path", NULL, is_replaying, !is_replaying && !app_state->record_camera_path)) {
+					start_camera_path_replay(app_state, "camera_path.txt", false);
+				}
+				if (ImGui::MenuItem("Annotation stress test", NULL, false, !app_state->annotation_stress.is_pending)) {
+					// (the results are printed to the console)
+					annotation_stress_params_t* stress = &app_state->annotation_stress;
+					stress->annotation_count = 10000;
+					stress->vertex_count = 64;
+					stress->group_count = 8;
+					stress->is_pending = true;
+				}
 				if (ImGui::MenuItem("Open remote", NULL, &menu_items_clicked.open_remote)) {}
 				if (ImGui::MenuItem("Show case list", NULL, &menu_items_clicked.show_case_list)) {}
-//				if (ImGui::MenuItem("Save XML annotations", NULL, &menu_items_clicked.save_annotations)) {}
 				ImGui::EndMenu();
 			}
 			ImGui::EndMenu();
@@ -117,12 +770,34 @@ void gui_draw(app_state_t* app_state, input_t* input, i32 client_width, i32 clie
 			ImGui::EndMenu();
 		}
 
+		const char* opening_slide_name = NULL;
+		float slide_open_progress = 0.0f;
+		if (get_slide_open_progress(&opening_slide_name, &slide_open_progress)) {
+			ImGui::Separator();
+			if (slide_open_progress > 0.0f) {
+				ImGui::Text("Opening %s... %d%%", opening_slide_name, (i32)(slide_open_progress * 100.0f));
+			} else {
+				ImGui::Text("Opening %s...", opening_slide_name);
+			}
+			if (ImGui::SmallButton("Cancel")) {
+				cancel_slide_open();
+			}
+		}
+
+		float annotation_load_progress = 0.0f;
+		if (get_background_annotation_load_progress(&annotation_load_progress)) {
+			ImGui::Separator();
+			ImGui::Text("Loading annotations... %d%%", (i32)(annotation_load_progress * 100.0f));
+		}
+
 		ImGui::EndMainMenuBar();
 
 		if (menu_items_clicked.exit_program) {
 			is_program_running = false;
 		} else if (menu_items_clicked.open_file) {
 			win32_open_file_dialog(main_window);
+		} else if (menu_items_clicked.open_overlay) {
+			win32_open_overlay_file_dialog(main_window);
 		} else if (menu_items_clicked.close) {
 			menu_close_file(app_state);
 		} else if (menu_items_clicked.open_remote) {
@@ -136,13 +811,13 @@ void gui_draw(app_state_t* app_state, input_t* input, i32 client_width, i32 clie
 				win32_toggle_fullscreen(main_window);
 			}
 		} else if(menu_items_clicked.save_annotations) {
-			save_asap_xml_annotations(&app_state->scene.annotation_set, "test_out.xml");
+			export_asap_xml_annotations(&app_state->scenes[0].annotation_set);
 		}
 	}
 
 	if (show_open_remote_window) {
 		ImGui::SetNextWindowPos(ImVec2(120, 100), ImGuiCond_FirstUseEver);
-		ImGui::SetNextWindowSize(ImVec2(256, 156), ImGuiCond_FirstUseEver);
+		ImGui::SetNextWindowSize(ImVec2(256, 180), ImGuiCond_FirstUseEver);
 
 		ImGui::Begin("Open remote", &show_open_remote_window);
 
@@ -151,7 +826,12 @@ void gui_draw(app_state_t* app_state, input_t* input, i32 client_width, i32 clie
 		entered = entered || ImGui::InputText("Hostname", remote_hostname, sizeof(remote_hostname), input_flags);
 		entered = entered || ImGui::InputText("Port", remote_port, sizeof(remote_port), input_flags);
 		entered = entered || ImGui::InputText("Filename", remote_filename, sizeof(remote_filename), input_flags);
+		entered = entered || ImGui::InputText("Mirrors", remote_mirrors, sizeof(remote_mirrors), input_flags);
+		if (ImGui::IsItemHovered()) {
+			ImGui::SetTooltip("Other servers with the same slides (host:port, comma-separated)");
+		}
 		if (entered || ImGui::Button("Connect")) {
+			set_remote_mirrors(remote_hostname, atoi(remote_port), remote_mirrors);
 			const char* ext = get_file_extension(remote_filename);
 			if (strcasecmp(ext, "json") == 0) {
 				// Open as 'caselist'
@@ -163,16 +843,29 @@ void gui_draw(app_state_t* app_state, input_t* input, i32 client_width, i32 clie
 				}
 			} else {
 				// Open as 'slide'
-				if (open_remote_slide(app_state, remote_hostname, atoi(remote_port), remote_filename)) {
-					show_open_remote_window = false; // success!
+				if (start_remote_slide_open(app_state, remote_hostname, atoi(remote_port), remote_filename)) {
+					show_open_remote_window = false; // (the slide opens in the background)
 				}
 			}
 
 
+		}
+		ImGui::SameLine();
+		if (ImGui::Button("Browse slides")) {
+			// (the catalog is one download, with the thumbnails; the slides themselves are not opened)
+			set_remote_mirrors(remote_hostname, atoi(remote_port), remote_mirrors);
+			if (load_remote_slide_catalog(&slide_catalog, remote_hostname, atoi(remote_port))) {
+				show_slide_catalog_window = true;
+				show_open_remote_window = false;
+			}
 		}
 		ImGui::End();
 	}
 
+	if (show_slide_catalog_window) {
+		draw_slide_catalog_window(app_state);
+	}
+
 
 	// 1. Show the big demo window (Most of the sample code is in ImGui::ShowDemoWindow()! You can browse its code to learn more about Dear ImGui!).
 	if (show_demo_window)
@@ -191,10 +884,112 @@ void gui_draw(app_state_t* app_state, input_t* input, i32 client_width, i32 clie
 //		ImGui::Text("This is some useful text.");               // Display some text (you can use a format strings too)
 		ImGui::Checkbox("Use image adjustments", &app_state->use_image_adjustments);
 
-		ImGui::SliderFloat("black level", &app_state->black_level, 0.0f,
+		color_adjustments_t* adjustments = &app_state->image_adjustments;
+		ImGui::SliderFloat("black level", &adjustments->master.black_level, 0.0f,
 		                   1.0f);            // Edit 1 float using a slider from 0.0f to 1.0f
-		ImGui::SliderFloat("white level", &app_state->white_level, 0.0f,
+		ImGui::SliderFloat("white level", &adjustments->master.white_level, 0.0f,
 		                   1.0f);            // Edit 1 float using a slider from 0.0f to 1.0f
+		ImGui::SliderFloat("gamma", &adjustments->master.gamma, 0.2f, 5.0f, "%.2f", 2.0f);
+		if (is_visible_tile_histogram_available()) {
+			// (the levels follow the visible tiles, see update_auto_levels())
+			ImGui::Checkbox("Auto levels", &app_state->use_auto_levels);
+		}
+		if (ImGui::TreeNode("Per-channel curves")) {
+			const char* channel_names[] = {"Red", "Green", "Blue"};
+			for (i32 i = 0; i < 3; ++i) {
+				color_curve_t* curve = adjustments->channels + i;
+				ImGui::PushID(i);
+				ImGui::TextUnformatted(channel_names[i]);
+				ImGui::SliderFloat("black level", &curve->black_level, 0.0f, 1.0f);
+				ImGui::SliderFloat("white level", &curve->white_level, 0.0f, 1.0f);
+				ImGui::SliderFloat("gamma", &curve->gamma, 0.2f, 5.0f, "%.2f", 2.0f);
+				ImGui::PopID();
+			}
+			ImGui::TreePop();
+		}
+		if (ImGui::Button("Reset")) {
+			init_color_adjustments(adjustments);
+		}
+
+		// Color deconvolution, for the displayed image (see get_stain_unmixing())
+		if (app_state->displayed_image >= 0 && app_state->displayed_image < sb_count(app_state->loaded_images)) {
+			image_t* image = app_state->loaded_images[app_state->displayed_image];
+			ImGui::Separator();
+			if (image->channel_count > 0) {
+				// Fluorescence channels: only the enabled ones are loaded, and retinting them is free
+				for (i32 i = 0; i < image->channel_count; ++i) {
+					image_channel_t* channel = image->channels + i;
+					char label[32];
+					snprintf(label, sizeof(label), "Channel %d", i + 1);
+					ImGui::PushID(i);
+					ImGui::Checkbox(label, &channel->is_enabled);
+					ImGui::SameLine();
+					ImGui::ColorEdit3("color", (float*) &channel->color, ImGuiColorEditFlags_NoInputs);
+					ImGui::SliderFloat("gain", &channel->gain, 0.0f, 10.0f, "%.2f", 2.0f);
+					ImGui::SliderFloat("offset", &channel->offset, -1.0f, 1.0f);
+					ImGui::PopID();
+				}
+			} else if (image->focal_plane_count > 1) {
+				// (also Ctrl + mouse wheel, or Page Up / Page Down)
+				i32 focal_plane = image->focal_plane;
+				if (ImGui::SliderInt("Focal plane", &focal_plane, 0, image->focal_plane_count - 1)) {
+					set_focal_plane(image, focal_plane);
+				}
+			}
+			const char* shown_stain_names[] = {"All stains", "Stain 1 (hematoxylin)", "Stain 2", "Stain 3 (residual)"};
+			ImGui::Combo("Show", &image->shown_stain, shown_stain_names, COUNT(shown_stain_names));
+			if (ImGui::TreeNode("Stain vectors")) {
+				if (ImGui::Button("H-DAB")) {
+					init_stain_matrix(&image->stain_matrix, STAIN_PRESET_H_DAB);
+				}
+				ImGui::SameLine();
+				if (ImGui::Button("H&E")) {
+					init_stain_matrix(&image->stain_matrix, STAIN_PRESET_H_E);
+				}
+				// (the vectors are normalized, and a third stain of zero is taken as the residual)
+				ImGui::DragFloat3("Stain 1", image->stain_matrix.stains[0], 0.005f, 0.0f, 1.0f);
+				ImGui::DragFloat3("Stain 2", image->stain_matrix.stains[1], 0.005f, 0.0f, 1.0f);
+				ImGui::DragFloat3("Stain 3", image->stain_matrix.stains[2], 0.005f, 0.0f, 1.0f);
+				ImGui::TreePop();
+			}
+			image_t* overlay = find_overlay_for_image(app_state, image);
+			if (overlay) {
+				// (File > Open overlay...)
+				ImGui::Separator();
+				const char* colormap_names[] = {"Jet", "Viridis", "Red"};
+				ImGui::Combo("Overlay colormap", &overlay->overlay_colormap, colormap_names, COUNT(colormap_names));
+				ImGui::SliderFloat("Overlay opacity", &overlay->overlay_opacity, 0.0f, 1.0f);
+				if (ImGui::Button("Remove overlay")) {
+					close_overlay_for_image(app_state, image);
+				}
+			}
+		}
+
+		ImGui::Separator();
+		static char display_profile_filename[512];
+		static bool32 display_profile_failed;
+		ImGui::Checkbox("Correct colors for the display (ICC profile)", &app_state->use_display_profile);
+		if (ImGui::Button("Use the profile of this display")) {
+			if (platform_get_display_profile_filename(display_profile_filename, sizeof(display_profile_filename))) {
+				display_profile_failed = !load_display_profile(&app_state->display_profile, display_profile_filename);
+			} else {
+				display_profile_failed = true;
+			}
+			app_state->use_display_profile = !display_profile_failed;
+		}
+		ImGui::InputText("##display_profile", display_profile_filename, sizeof(display_profile_filename));
+		ImGui::SameLine();
+		if (ImGui::Button("Load")) {
+			display_profile_failed = !load_display_profile(&app_state->display_profile, display_profile_filename);
+			app_state->use_display_profile = !display_profile_failed;
+		}
+		if (display_profile_failed) {
+			ImGui::TextUnformatted("Could not load the profile (only matrix/TRC profiles are supported)");
+		} else if (app_state->display_profile.is_valid) {
+			ImGui::Text("Profile: %s", app_state->display_profile.filename);
+		} else {
+			ImGui::TextUnformatted("No profile loaded");
+		}
 
 
 
@@ -267,6 +1062,69 @@ void gui_draw(app_state_t* app_state, input_t* input, i32 client_width, i32 clie
 			ImGui::EndCombo();
 		}
 
+		ImGui::Text("\nTile cache");
+		ImGui::SliderInt("Budget (MB)", &app_state->tile_cache_budget_in_mb, 128, 8192);
+		ImGui::Text("Resident tiles: %d (%.1f MB)", app_state->cached_tile_count,
+		            (float)app_state->cached_tile_memory / (float)MEGABYTES(1));
+		ImGui::Text("Evicted tiles: %lld", app_state->evicted_tile_count);
+		ImGui::Text("Queued tile requests: %d, cancelled: %lld", tile_request_queue.request_count,
+		            app_state->cancelled_tile_request_count);
+		if (is_tile_texture_compression_available()) {
+			ImGui::Checkbox("Compress tile textures (BC1, for tiles loaded from now on)", &compress_tile_textures);
+		}
+		ImGui::Checkbox("Keep JPEG tiles as YCbCr planes (converted by the GPU, for tiles loaded from now on)",
+		                &planar_tile_textures);
+		if (is_gpu_tile_decoding_available()) {
+			ImGui::Checkbox("Decode JPEG tiles on the GPU (experimental, for tiles loaded from now on)", &gpu_tile_decoding);
+		}
+		ImGui::Checkbox("Prefetch tiles ahead of panning and zooming", &app_state->enable_prefetch);
+		ImGui::Checkbox("Read ahead around the view in local slides (OS file cache)", &app_state->enable_readahead);
+		ImGui::Checkbox("Blend between levels while zooming", &app_state->blend_zoom_levels);
+		if (!app_state->blend_zoom_levels) {
+			ImGui::Checkbox("Decode minified tiles at reduced size while zooming in",
+			                &app_state->decode_minified_tiles_at_reduced_size);
+		}
+		ImGui::Checkbox("Low-latency frame pacing while panning and zooming", &app_state->enable_low_latency_frame_pacing);
+		ImGui::Text("Prefetched tiles: %d", app_state->prefetched_tile_count);
+		ImGui::Text("Tile loads: %.1f/s, %.1f ms per tile (I/O %.1f ms), in flight: %d", app_state->tile_load_rate,
+		            app_state->tile_load_time * 1000.0f, app_state->tile_io_latency * 1000.0f,
+		            app_state->target_tile_loads_in_flight);
+		ImGui::Text("Remote: RTT %.1f ms, %.2f MB/s per connection, %.1f KB per tile", app_state->remote_rtt * 1000.0f,
+		            app_state->remote_bandwidth / (float)MEGABYTES(1), app_state->remote_bytes_per_tile / (float)KILOBYTES(1));
+		ImGui::Text("Remote batches: %d tiles each, %d in flight", app_state->remote_tile_batch_size,
+		            app_state->remote_tile_batches_in_flight);
+		ImGui::Checkbox("Ask for remote tiles at lower quality first on slow links", &app_state->adapt_remote_tile_quality);
+		if (app_state->remote_tile_quality > 0) {
+			ImGui::SameLine();
+			ImGui::Text("(now: JPEG quality %d)", app_state->remote_tile_quality);
+		}
+		ImGui::Checkbox("Download remote tiles over UDP, if the server offers it (experimental)", &use_datagram_tile_transport);
+		if (remote_datagram_stats.tiles_received > 0 || remote_datagram_stats.fallback_count > 0) {
+			ImGui::Text("Tiles over UDP: %lld, fragments asked for again: %lld, fallbacks to TCP: %lld",
+			            remote_datagram_stats.tiles_received, remote_datagram_stats.fragments_requested_again,
+			            remote_datagram_stats.fallback_count);
+		}
+		ImGui::SliderFloat("Upload budget (ms/frame)", &app_state->tile_upload_budget_in_ms, 0.5f, 16.0f, "%.1f");
+		ImGui::Text("Tiles waiting for upload: %d", app_state->tiles_waiting_for_upload);
+		bool enable_mmap = tiff_enable_mmap;
+		if (ImGui::Checkbox("Memory-map local slides (on next open)", &enable_mmap)) {
+			tiff_enable_mmap = enable_mmap;
+		}
+		bool enable_direct_io = tiff_enable_direct_io;
+		if (ImGui::Checkbox("Unbuffered reads, bypassing the OS file cache (on next open)", &enable_direct_io)) {
+			tiff_enable_direct_io = enable_direct_io;
+		}
+		if (ImGui::SliderInt("Compressed cache (MB)", &app_state->compressed_tile_cache_budget_in_mb, 0, 8192)) {
+			tile_cache_set_budget(&global_tile_cache, (i64)app_state->compressed_tile_cache_budget_in_mb * MEGABYTES(1));
+		}
+		ImGui::Text("Compressed tiles: %d (%.1f MB), hits: %lld, misses: %lld", global_tile_cache.entry_count,
+		            (float)global_tile_cache.memory_used / (float)MEGABYTES(1), global_tile_cache.hit_count, global_tile_cache.miss_count);
+		if (global_shared_tile_cache.is_open) {
+			ImGui::Checkbox("Share downloaded tiles with other instances", &global_shared_tile_cache.enabled);
+			ImGui::Text("Shared cache hits: %lld, misses: %lld, tiles shared: %lld", global_shared_tile_cache.hit_count,
+			            global_shared_tile_cache.miss_count, global_shared_tile_cache.insert_count);
+		}
+
 //		ImGui::Text("\nGlobal Alpha");
 //		ImGui::SliderFloat("##Global Alpha", &ImGui::GetStyle().Alpha, 0.20f, 1.0f, "%.2f"); // Not exposing zero here so user doesn't "lose" the UI (zero alpha clips all widgets). But application code could have a toggle to switch between zero and non-zero.
 
@@ -282,31 +1140,41 @@ void gui_draw(app_state_t* app_state, input_t* input, i32 client_width, i32 clie
 
 		ImGui::Begin("Select case", &show_slide_list_window);
 
-		// List box
-		const char* listbox_items_dummy[] = {"",};
-		const char** listbox_items = listbox_items_dummy;
-		i32 items_count = 0;
-
 		caselist_t* caselist = &app_state->caselist;
-		if (caselist->names) {
-			listbox_items = caselist->names;
-			items_count = caselist->num_cases_with_filenames;
-		}
-
+		static char search_query[128];
+		ImGui::SetNextItemWidth(-1);
+		ImGui::InputTextWithHint("##search", "Search", search_query, sizeof(search_query));
+		i32* results = NULL;
+		i32 result_count = caselist->cases ? caselist_search(caselist, search_query, &results) : 0;
+
+		// List box (only the visible part of the list is laid out, the list may hold many thousands of cases)
+		// Remote case lists can be downloaded for offline use; the controls for that go underneath.
+		float footer_height = caselist->is_remote ? ImGui::GetFrameHeightWithSpacing() * 2.0f : 1.0f;
 		static int listbox_item_current = -1;
-		float line_height = ImGui::GetTextLineHeightWithSpacing();
-		float list_height_in_items = ImGui::GetWindowHeight() / line_height;
-		if (ImGui::ListBox("##listbox\n(single select)", &listbox_item_current, listbox_items, items_count,
-		                   (int) (list_height_in_items - 2.5f))) {
-			// value changed
-			if (caselist->cases) {
+		if (ImGui::ListBoxHeader("##cases", ImVec2(-1, -footer_height))) {
+			i32 clicked_case = -1;
+			ImGuiListClipper clipper(result_count);
+			while (clipper.Step()) {
+				for (i32 i = clipper.DisplayStart; i < clipper.DisplayEnd; ++i) {
+					i32 case_index = results[i];
+					ImGui::PushID(case_index);
+					if (ImGui::Selectable(caselist->cases[case_index].name, case_index == listbox_item_current)) {
+						clicked_case = case_index;
+					}
+					ImGui::PopID();
+				}
+			}
+			ImGui::ListBoxFooter();
+
+			if (clicked_case >= 0) {
+				// value changed
+				listbox_item_current = clicked_case;
 				app_state->selected_case = caselist->cases + listbox_item_current;
 				show_case_info_window = true;
-				unload_all_images(app_state);
 				if (app_state->selected_case->filename) {
 
 					if (caselist->is_remote) {
-						open_remote_slide(app_state, remote_hostname, atoi(remote_port), app_state->selected_case->filename);
+						start_remote_slide_open(app_state, remote_hostname, atoi(remote_port), app_state->selected_case->filename);
 					} else {
 						// If the SLIDES_DIR environment variable is set, load slides from there
 						char path_buffer[2048] = {};
@@ -315,14 +1183,45 @@ void gui_draw(app_state_t* app_state, input_t* input, i32 client_width, i32 clie
 
 						load_image_from_file(app_state, path_buffer);
 					}
+					// The cases after this one are likely to be next.
+					caselist_prefetch_after(caselist, listbox_item_current);
 
 
 				}
 			}
 		}
 
-		// stub
-
+		if (caselist->is_remote) {
+			static offline_download_options_t offline_options = {};
+			float progress = 0.0f;
+			i32 slides_done = 0;
+			i32 slide_count = 0;
+			if (get_caselist_offline_download_progress(&progress, &slides_done, &slide_count)) {
+				char overlay[64];
+				snprintf(overlay, sizeof(overlay), "%d/%d slides", slides_done, slide_count);
+				ImGui::ProgressBar(progress, ImVec2(-1, 0), overlay);
+				if (ImGui::Button("Cancel")) {
+					cancel_caselist_offline_download();
+				}
+			} else if (ImGui::Button("Make available offline...")) {
+				ImGui::OpenPopup("Offline download");
+			}
+			if (ImGui::BeginPopup("Offline download")) {
+				ImGui::Text("Download all %d slides into the disk cache", caselist->num_cases_with_filenames);
+				ImGui::SliderInt("Skip finest levels", &offline_options.skipped_finest_levels, 0, 8);
+				bool tissue_only = offline_options.tissue_only;
+				if (ImGui::Checkbox("Only tiles with tissue", &tissue_only)) {
+					offline_options.tissue_only = tissue_only;
+				}
+				ImGui::SliderFloat("Bandwidth limit (MB/s)", &offline_options.max_megabytes_per_second, 0.0f, 100.0f,
+				                   offline_options.max_megabytes_per_second > 0.0f ? "%.1f" : "no limit");
+				if (ImGui::Button("Start")) {
+					start_caselist_offline_download(caselist, &offline_options);
+					ImGui::CloseCurrentPopup();
+				}
+				ImGui::EndPopup();
+			}
+		}
 
 		ImGui::End();
 
@@ -337,11 +1236,16 @@ void gui_draw(app_state_t* app_state, input_t* input, i32 client_width, i32 clie
 
 		case_t* global_selected_case = app_state->selected_case;
 		if (global_selected_case != NULL) {
+			// (the details are loaded from the case list when the case is first shown)
+			caselist_t* caselist = &app_state->caselist;
+			const char* clinical_context = caselist_get_case_detail(caselist, global_selected_case, CASE_DETAIL_CLINICAL_CONTEXT);
+			const char* diagnosis = caselist_get_case_detail(caselist, global_selected_case, CASE_DETAIL_DIAGNOSIS);
+			const char* notes = caselist_get_case_detail(caselist, global_selected_case, CASE_DETAIL_NOTES);
 			ImGui::TextWrapped("%s\n", global_selected_case->name);
-			ImGui::TextWrapped("%s\n", global_selected_case->clinical_context);
+			if (clinical_context) ImGui::TextWrapped("%s\n", clinical_context);
 			if (ImGui::TreeNode("Diagnosis and comment")) {
-				ImGui::TextWrapped("%s\n", global_selected_case->diagnosis);
-				ImGui::TextWrapped("%s\n", global_selected_case->notes);
+				if (diagnosis) ImGui::TextWrapped("%s\n", diagnosis);
+				if (notes) ImGui::TextWrapped("%s\n", notes);
 				ImGui::TreePop();
 			}
 
@@ -356,6 +1260,40 @@ void gui_draw(app_state_t* app_state, input_t* input, i32 client_width, i32 clie
 		draw_annotations_window(app_state, input);
 	}
 
+	if (show_annotation_statistics_window) {
+		draw_annotation_statistics_window(app_state);
+	}
+
+	if (show_profiler_window) {
+		draw_profiler_window();
+	}
+
+	if (show_tile_metrics_window) {
+		draw_tile_metrics_window();
+	}
+
+	if (show_memory_window) {
+		draw_memory_window();
+	}
+
+	if (show_export_region_window) {
+		draw_export_region_window(app_state);
+	}
+
+	if (show_capture_view_window) {
+		draw_capture_view_window(app_state);
+	}
+
+	if (show_tile_state_overlay) {
+		draw_tile_state_overlay(app_state);
+	}
+
+	if (show_minimap_window) {
+		draw_minimap_window(app_state);
+	} else {
+		app_state->minimap_rect = rect2i{};
+	}
+
 	if (show_about_window) {
 		ImGui::Begin("About Slideviewer", &show_about_window, ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoCollapse);
 
@@ -389,7 +1327,9 @@ void gui_draw(app_state_t* app_state, input_t* input, i32 client_width, i32 clie
 	glViewport(0, 0, client_width, client_height);
 //	glClearColor(clear_color.x, clear_color.y, clear_color.z, clear_color.w);
 //	glClear(GL_COLOR_BUFFER_BIT);
+	begin_gpu_pass(GPU_PASS_GUI);
 	ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+	end_gpu_pass(GPU_PASS_GUI);
 
 
 
@@ -433,7 +1373,8 @@ void win32_init_gui(HWND hwnd) {
 //	font_config.OversampleH = 3;
 //	font_config.OversampleV = 2;
 //	font_config.RasterizerMultiply = 1.2f;
-	ImFont* font = io.Fonts->AddFontFromFileTTF("c:\\Windows\\Fonts\\segoeui.ttf", 17.0f, &font_config, io.Fonts->GetGlyphRangesJapanese());
+	// (the glyphs are rasterized on the first frame: the default ranges take a fraction of the time the CJK ranges do)
+	ImFont* font = io.Fonts->AddFontFromFileTTF("c:\\Windows\\Fonts\\segoeui.ttf", 17.0f, &font_config, io.Fonts->GetGlyphRangesDefault());
 	if (!font) {
 		// could not load font
 	}
@@ -50,16 +50,26 @@ extern bool show_demo_window;
 extern bool show_image_adjustments_window INIT(= false);
 extern bool show_open_remote_window;
 extern bool show_slide_list_window;
+extern bool show_slide_catalog_window;
 extern bool show_case_info_window;
 extern bool show_annotations_window;
 extern bool show_annotation_group_assignment_window;
+extern bool show_annotation_statistics_window;
 extern bool show_display_options_window;
 extern bool show_about_window;
+extern bool show_profiler_window;
+extern bool show_tile_metrics_window;
+extern bool show_memory_window;
+extern bool show_export_region_window;
+extern bool show_capture_view_window;
+extern bool show_minimap_window;
+extern bool show_tile_state_overlay;
 extern bool gui_want_capture_mouse;
 extern bool gui_want_capture_keyboard;
 extern char remote_hostname[64] INIT(= "localhost");
 extern char remote_port[64] INIT(= "2000");
 extern char remote_filename[128] INIT(= "sample.tiff");
+extern char remote_mirrors[256] INIT(= ""); // other servers with the same slides, as host:port,host:port
 
 
 #undef INIT
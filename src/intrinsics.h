@@ -20,23 +20,75 @@
 
 #include "common.h"
 
+#if WINDOWS
+#include <windows.h>
 #include "intrin.h"
+#else
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
 
 #if WINDOWS
 #define write_barrier do { _WriteBarrier(); _mm_sfence(); } while (0)
 #define read_barrier _ReadBarrier()
 
 #define interlocked_increment(x) InterlockedIncrement((volatile long*)(x))
+#define interlocked_decrement(x) InterlockedDecrement((volatile long*)(x))
 #define interlocked_compare_exchange(destination, exchange, comparand) \
   InterlockedCompareExchange((volatile long*)(destination), (exchange), (comparand))
+#define interlocked_add_i64(x, amount) (InterlockedExchangeAdd64((volatile LONGLONG*)(x), (amount)) + (amount))
+#define interlocked_compare_exchange_i64(destination, exchange, comparand) \
+  InterlockedCompareExchange64((volatile LONGLONG*)(destination), (exchange), (comparand))
+#define interlocked_compare_exchange_pointer(destination, exchange, comparand) \
+  InterlockedCompareExchangePointer((void* volatile*)(destination), (exchange), (comparand))
+#define interlocked_exchange_pointer(destination, exchange) \
+  InterlockedExchangePointer((void* volatile*)(destination), (exchange))
 
 #else
-//TODO: implement
-#define write_barrier
-#define read_barrier
-#define interlocked_increment(x)
-#define interlocked_compare_exchange(x)
+#define write_barrier do { __asm__ volatile("" ::: "memory"); _mm_sfence(); } while (0)
+#define read_barrier __asm__ volatile("" ::: "memory")
+
+#define interlocked_increment(x) __sync_add_and_fetch((volatile i32*)(x), 1)
+#define interlocked_decrement(x) __sync_sub_and_fetch((volatile i32*)(x), 1)
+#define interlocked_compare_exchange(destination, exchange, comparand) \
+  __sync_val_compare_and_swap((volatile i32*)(destination), (comparand), (exchange))
+#define interlocked_add_i64(x, amount) __sync_add_and_fetch((volatile i64*)(x), (amount))
+#define interlocked_compare_exchange_i64(destination, exchange, comparand) \
+  __sync_val_compare_and_swap((volatile i64*)(destination), (comparand), (exchange))
+#define interlocked_compare_exchange_pointer(destination, exchange, comparand) \
+  __sync_val_compare_and_swap((void* volatile*)(destination), (void*)(comparand), (void*)(exchange))
+#define interlocked_exchange_pointer(destination, exchange) \
+  __atomic_exchange_n((void* volatile*)(destination), (void*)(exchange), __ATOMIC_SEQ_CST)
 #endif
 
+// Simple spin lock, for protecting short critical sections shared between the worker threads.
+static inline void spin_lock(volatile i32* lock) {
+	while (interlocked_compare_exchange(lock, 1, 0) != 0) {
+		_mm_pause();
+	}
+}
+
+static inline void spin_unlock(volatile i32* lock) {
+	write_barrier;
+	*lock = 0;
+}
 
+// CPUID, for picking kernels at runtime (see cpu_dispatch.c). regs receives eax, ebx, ecx, edx.
+static inline void get_cpuid(u32 leaf, u32 subleaf, u32 regs[4]) {
+#if WINDOWS
+	__cpuidex((int*)regs, (int)leaf, (int)subleaf);
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
 
+// XCR0: which register states the OS saves on context switches (only valid if CPUID reports OSXSAVE).
+static inline u64 get_xcr0() {
+#if WINDOWS
+	return _xgetbv(0);
+#else
+	u32 eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((u64)edx << 32) | eax;
+#endif
+}
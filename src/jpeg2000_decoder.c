@@ -0,0 +1,337 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include "platform.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#define OPJ_CALLCONV __stdcall
+#else
+#include <dlfcn.h>
+#define OPJ_CALLCONV
+#endif
+
+#include "jpeg2000_decoder.h"
+
+// The parts of the OpenJPEG 2.x API (openjpeg.h) that are needed here.
+typedef int32_t OPJ_BOOL;
+typedef int64_t OPJ_OFF_T;
+typedef size_t OPJ_SIZE_T;
+
+enum {
+	OPJ_CODEC_J2K = 0, // raw codestream, as in Aperio slides
+	OPJ_CODEC_JP2 = 2, // codestream wrapped in JP2 boxes
+};
+
+enum {
+	OPJ_CLRSPC_SYCC = 3,
+};
+
+typedef struct opj_image_comp_t {
+	uint32_t dx, dy;
+	uint32_t w, h;
+	uint32_t x0, y0;
+	uint32_t prec;
+	uint32_t bpp; // obsolete
+	uint32_t sgnd;
+	uint32_t resno_decoded;
+	uint32_t factor;
+	int32_t* data;
+	uint16_t alpha;
+} opj_image_comp_t;
+
+typedef struct opj_image_t {
+	uint32_t x0, y0, x1, y1;
+	uint32_t numcomps;
+	int32_t color_space;
+	opj_image_comp_t* comps;
+	uint8_t* icc_profile_buf;
+	uint32_t icc_profile_len;
+} opj_image_t;
+
+typedef struct opj_dparameters_t {
+	uint32_t cp_reduce;
+	uint32_t cp_layer;
+	char infile[4096];
+	char outfile[4096];
+	int32_t decod_format;
+	int32_t cod_format;
+	uint32_t DA_x0, DA_x1, DA_y0, DA_y1;
+	OPJ_BOOL m_verbose;
+	uint32_t tile_index;
+	uint32_t nb_tile_to_decode;
+	OPJ_BOOL jpwl_correct;
+	int32_t jpwl_exp_comps;
+	int32_t jpwl_max_tiles;
+	uint32_t flags;
+	u8 reserved[256]; // headroom, in case a newer version has more fields
+} opj_dparameters_t;
+
+typedef void* opj_codec_t;
+typedef void* opj_stream_t;
+typedef OPJ_SIZE_T (*opj_stream_read_fn)(void* buffer, OPJ_SIZE_T byte_count, void* user_data);
+typedef OPJ_OFF_T (*opj_stream_skip_fn)(OPJ_OFF_T byte_count, void* user_data);
+typedef OPJ_BOOL (*opj_stream_seek_fn)(OPJ_OFF_T position, void* user_data);
+typedef void (*opj_stream_free_user_data_fn)(void* user_data);
+
+typedef struct openjpeg_api {
+	opj_codec_t* (OPJ_CALLCONV *opj_create_decompress)(int32_t format);
+	void         (OPJ_CALLCONV *opj_destroy_codec)(opj_codec_t* codec);
+	void         (OPJ_CALLCONV *opj_set_default_decoder_parameters)(opj_dparameters_t* parameters);
+	OPJ_BOOL     (OPJ_CALLCONV *opj_setup_decoder)(opj_codec_t* codec, opj_dparameters_t* parameters);
+	OPJ_BOOL     (OPJ_CALLCONV *opj_codec_set_threads)(opj_codec_t* codec, int thread_count); // since 2.2, may be NULL
+	OPJ_BOOL     (OPJ_CALLCONV *opj_read_header)(opj_stream_t* stream, opj_codec_t* codec, opj_image_t** image);
+	OPJ_BOOL     (OPJ_CALLCONV *opj_decode)(opj_codec_t* codec, opj_stream_t* stream, opj_image_t* image);
+	OPJ_BOOL     (OPJ_CALLCONV *opj_end_decompress)(opj_codec_t* codec, opj_stream_t* stream);
+	void         (OPJ_CALLCONV *opj_image_destroy)(opj_image_t* image);
+	opj_stream_t* (OPJ_CALLCONV *opj_stream_create)(OPJ_SIZE_T buffer_size, OPJ_BOOL is_input);
+	void         (OPJ_CALLCONV *opj_stream_destroy)(opj_stream_t* stream);
+	void         (OPJ_CALLCONV *opj_stream_set_read_function)(opj_stream_t* stream, opj_stream_read_fn function);
+	void         (OPJ_CALLCONV *opj_stream_set_skip_function)(opj_stream_t* stream, opj_stream_skip_fn function);
+	void         (OPJ_CALLCONV *opj_stream_set_seek_function)(opj_stream_t* stream, opj_stream_seek_fn function);
+	void         (OPJ_CALLCONV *opj_stream_set_user_data)(opj_stream_t* stream, void* data, opj_stream_free_user_data_fn function);
+	void         (OPJ_CALLCONV *opj_stream_set_user_data_length)(opj_stream_t* stream, uint64_t data_length);
+	const char*  (OPJ_CALLCONV *opj_version)(void);
+} openjpeg_api;
+
+static openjpeg_api openjpeg;
+static bool32 is_jpeg2000_init_done;
+static bool32 is_jpeg2000_available;
+
+// Loads OpenJPEG, the first time it is needed. Must be called before decoding (from the main thread).
+bool32 init_jpeg2000_decoder() {
+	if (is_jpeg2000_init_done) return is_jpeg2000_available;
+	is_jpeg2000_init_done = true;
+	i64 debug_start = get_clock();
+#ifdef _WIN32
+	const char* library_names[] = { "libopenjp2-7.dll", "libopenjp2.dll", "openjp2.dll" };
+	HINSTANCE library = NULL;
+	for (i32 i = 0; i < COUNT(library_names) && !library; ++i) {
+		library = LoadLibraryA(library_names[i]);
+		if (!library) {
+			SetDllDirectoryA("openslide");
+			library = LoadLibraryA(library_names[i]);
+			SetDllDirectoryA(NULL);
+		}
+	}
+#define GET_SYMBOL(library, name) GetProcAddress(library, name)
+#else
+	const char* library_names[] = { "libopenjp2.so.7", "libopenjp2.so" };
+	void* library = NULL;
+	for (i32 i = 0; i < COUNT(library_names) && !library; ++i) {
+		library = dlopen(library_names[i], RTLD_NOW);
+	}
+#define GET_SYMBOL(library, name) dlsym(library, name)
+#endif
+	if (!library) {
+		printf("JPEG 2000 decoding not available: could not load OpenJPEG\n");
+		return false;
+	}
+
+#define GET_PROC(proc) if (!(openjpeg.proc = (void*) GET_SYMBOL(library, #proc))) goto failed;
+	GET_PROC(opj_create_decompress);
+	GET_PROC(opj_destroy_codec);
+	GET_PROC(opj_set_default_decoder_parameters);
+	GET_PROC(opj_setup_decoder);
+	GET_PROC(opj_read_header);
+	GET_PROC(opj_decode);
+	GET_PROC(opj_end_decompress);
+	GET_PROC(opj_image_destroy);
+	GET_PROC(opj_stream_create);
+	GET_PROC(opj_stream_destroy);
+	GET_PROC(opj_stream_set_read_function);
+	GET_PROC(opj_stream_set_skip_function);
+	GET_PROC(opj_stream_set_seek_function);
+	GET_PROC(opj_stream_set_user_data);
+	GET_PROC(opj_stream_set_user_data_length);
+	GET_PROC(opj_version);
+#undef GET_PROC
+	openjpeg.opj_codec_set_threads = (void*) GET_SYMBOL(library, "opj_codec_set_threads");
+#undef GET_SYMBOL
+
+	printf("Initialized OpenJPEG %s in %g seconds.\n", openjpeg.opj_version(), get_seconds_elapsed(debug_start, get_clock()));
+	is_jpeg2000_available = true;
+	return true;
+
+	failed:
+	printf("JPEG 2000 decoding not available: OpenJPEG is missing functions\n");
+	return false;
+}
+
+// The compressed tile, read by OpenJPEG through the stream callbacks below.
+typedef struct {
+	u8* data;
+	u64 size;
+	u64 pos;
+} memory_stream_t;
+
+static OPJ_SIZE_T memory_stream_read(void* buffer, OPJ_SIZE_T byte_count, void* user_data) {
+	memory_stream_t* stream = (memory_stream_t*) user_data;
+	if (stream->pos >= stream->size) return (OPJ_SIZE_T)-1; // end of stream
+	u64 count = ATMOST((u64)byte_count, stream->size - stream->pos);
+	memcpy(buffer, stream->data + stream->pos, count);
+	stream->pos += count;
+	return (OPJ_SIZE_T)count;
+}
+
+static OPJ_OFF_T memory_stream_skip(OPJ_OFF_T byte_count, void* user_data) {
+	memory_stream_t* stream = (memory_stream_t*) user_data;
+	i64 new_pos = (i64)stream->pos + byte_count;
+	if (new_pos < 0) return -1;
+	if ((u64)new_pos > stream->size) new_pos = stream->size;
+	OPJ_OFF_T skipped = new_pos - (i64)stream->pos;
+	stream->pos = new_pos;
+	return skipped;
+}
+
+static OPJ_BOOL memory_stream_seek(OPJ_OFF_T position, void* user_data) {
+	memory_stream_t* stream = (memory_stream_t*) user_data;
+	if (position < 0 || (u64)position > stream->size) return 0;
+	stream->pos = position;
+	return 1;
+}
+
+static inline u8 clamp_to_u8(i32 value) {
+	return (u8)(value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+// Sample of a component at a pixel position of the first component (chroma components may be subsampled)
+static inline i32 get_component_sample(opj_image_comp_t* comp, u32 x, u32 y, u32 scale_x, u32 scale_y) {
+	u32 comp_x = ATMOST(x / scale_x, comp->w - 1);
+	u32 comp_y = ATMOST(y / scale_y, comp->h - 1);
+	i32 value = comp->data[comp_y * comp->w + comp_x];
+	if (comp->sgnd) value += 1 << (comp->prec - 1);
+	if (comp->prec > 8) value >>= (comp->prec - 8);
+	else if (comp->prec < 8) value <<= (8 - comp->prec);
+	return value;
+}
+
+// Converts the decoded components to BGRA pixels. Each output pixel is the average of a block of decoded pixels, if
+// the resolution could not be reduced by OpenJPEG itself (see below).
+static bool32 convert_decoded_image(opj_image_t* image, u8* dest, u32 dest_pitch, u32 max_width, u32 max_height,
+                                    bool32 is_YCbCr, i32 box_shift) {
+	if (image->numcomps == 0 || !image->comps[0].data) return false;
+	opj_image_comp_t* comps = image->comps;
+	u32 comp_count = (image->numcomps >= 3) ? 3 : 1;
+	u32 scale_x[3] = {1, 1, 1};
+	u32 scale_y[3] = {1, 1, 1};
+	for (u32 c = 1; c < comp_count; ++c) {
+		if (!comps[c].data || comps[c].w == 0 || comps[c].h == 0) return false;
+		scale_x[c] = ATLEAST(1, comps[c].dx / ATLEAST(1, comps[0].dx));
+		scale_y[c] = ATLEAST(1, comps[c].dy / ATLEAST(1, comps[0].dy));
+	}
+	u32 box = 1 << box_shift;
+	u32 width = ATMOST(comps[0].w >> box_shift, max_width);
+	u32 height = ATMOST(comps[0].h >> box_shift, max_height);
+	for (u32 y = 0; y < height; ++y) {
+		u32* row = (u32*)(dest + y * dest_pitch);
+		for (u32 x = 0; x < width; ++x) {
+			i32 sum[3] = {0, 0, 0};
+			for (u32 box_y = 0; box_y < box; ++box_y) {
+				for (u32 box_x = 0; box_x < box; ++box_x) {
+					u32 source_x = (x << box_shift) + box_x;
+					u32 source_y = (y << box_shift) + box_y;
+					for (u32 c = 0; c < comp_count; ++c) {
+						sum[c] += get_component_sample(comps + c, source_x, source_y, scale_x[c], scale_y[c]);
+					}
+				}
+			}
+			i32 v0 = sum[0] >> (2 * box_shift);
+			i32 v1 = sum[1] >> (2 * box_shift);
+			i32 v2 = sum[2] >> (2 * box_shift);
+			u8 r, g, b;
+			if (comp_count == 1) {
+				r = g = b = clamp_to_u8(v0);
+			} else if (is_YCbCr) {
+				// ITU-R BT.601 (full range, as in JFIF), fixed point with 16 fractional bits
+				i32 cb = v1 - 128;
+				i32 cr = v2 - 128;
+				r = clamp_to_u8(v0 + ((91881 * cr) >> 16));
+				g = clamp_to_u8(v0 - ((22554 * cb + 46802 * cr) >> 16));
+				b = clamp_to_u8(v0 + ((116130 * cb) >> 16));
+			} else {
+				r = clamp_to_u8(v0);
+				g = clamp_to_u8(v1);
+				b = clamp_to_u8(v2);
+			}
+			row[x] = 0xFF000000 | ((u32)r << 16) | ((u32)g << 8) | b;
+		}
+	}
+	return true;
+}
+
+static opj_image_t* decode_image(u8* data, u64 size, i32 resolution_reduction, i32 thread_count) {
+	// Aperio slides store raw codestreams; TIFF compression 34712 may also wrap them in JP2 boxes.
+	static const u8 jp2_signature[] = {0x00, 0x00, 0x00, 0x0C, 0x6A, 0x50, 0x20, 0x20};
+	bool32 is_jp2 = (size >= sizeof(jp2_signature) && memcmp(data, jp2_signature, sizeof(jp2_signature)) == 0);
+	opj_codec_t* codec = openjpeg.opj_create_decompress(is_jp2 ? OPJ_CODEC_JP2 : OPJ_CODEC_J2K);
+	if (!codec) return NULL;
+	opj_image_t* image = NULL;
+	opj_dparameters_t parameters;
+	openjpeg.opj_set_default_decoder_parameters(&parameters);
+	parameters.cp_reduce = resolution_reduction;
+	memory_stream_t memory_stream = { .data = data, .size = size };
+	opj_stream_t* stream = openjpeg.opj_stream_create(ATMOST(size, 1 << 20), 1);
+	bool32 success = false;
+	if (stream && openjpeg.opj_setup_decoder(codec, &parameters)) {
+		if (thread_count > 1 && openjpeg.opj_codec_set_threads) {
+			openjpeg.opj_codec_set_threads(codec, thread_count);
+		}
+		openjpeg.opj_stream_set_user_data(stream, &memory_stream, NULL);
+		openjpeg.opj_stream_set_user_data_length(stream, size);
+		openjpeg.opj_stream_set_read_function(stream, memory_stream_read);
+		openjpeg.opj_stream_set_skip_function(stream, memory_stream_skip);
+		openjpeg.opj_stream_set_seek_function(stream, memory_stream_seek);
+		success = openjpeg.opj_read_header(stream, codec, &image) &&
+		          openjpeg.opj_decode(codec, stream, image) &&
+		          openjpeg.opj_end_decompress(codec, stream);
+	}
+	if (stream) openjpeg.opj_stream_destroy(stream);
+	openjpeg.opj_destroy_codec(codec);
+	if (!success && image) {
+		openjpeg.opj_image_destroy(image);
+		image = NULL;
+	}
+	return image;
+}
+
+// Decodes a JPEG 2000 tile into BGRA pixels (at most max_width x max_height of them), 1 / 2^resolution_reduction
+// of the full size. Reduced resolutions are decoded from the lower resolution levels of the codestream only, which
+// is much less work than decoding the whole tile. OpenJPEG can decode the code-blocks of a tile in parallel
+// (thread_count > 1); that only pays off for large tiles when not all the workers are busy with tiles of their own.
+bool32 jpeg2000_decode_tile(u8* data, u64 size, u8* dest, u32 dest_pitch, u32 max_width, u32 max_height,
+                            bool32 is_YCbCr, i32 resolution_reduction, i32 thread_count) {
+	if (!is_jpeg2000_available) return false;
+	i32 box_shift = 0;
+	opj_image_t* image = decode_image(data, size, resolution_reduction, thread_count);
+	if (!image && resolution_reduction > 0) {
+		// The codestream has fewer resolution levels than that: decode at full size and downsample instead.
+		image = decode_image(data, size, 0, thread_count);
+		box_shift = resolution_reduction;
+	}
+	if (!image) return false;
+	bool32 success = convert_decoded_image(image, dest, dest_pitch, max_width, max_height,
+	                                       is_YCbCr || image->color_space == OPJ_CLRSPC_SYCC, box_shift);
+	openjpeg.opj_image_destroy(image);
+	return success;
+}
@@ -0,0 +1,37 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+// Decoding of JPEG 2000 compressed TIFF tiles (Aperio J2K slides, and TIFF compression 34712), using OpenJPEG.
+// OpenJPEG is loaded at runtime, like OpenSlide (the OpenSlide distribution comes with it); if it is missing, these
+// slides are left to OpenSlide.
+
+bool32 init_jpeg2000_decoder();
+bool32 jpeg2000_decode_tile(u8* data, u64 size, u8* dest, u32 dest_pitch, u32 max_width, u32 max_height,
+                            bool32 is_YCbCr, i32 resolution_reduction, i32 thread_count);
+
+#ifdef __cplusplus
+}
+#endif
@@ -8,6 +8,15 @@
 #define EMSCRIPTEN_KEEPALIVE
 #endif
 #include "jpeglib.h"
+#include "jpeg_simd.h"
+#include "cpu_dispatch.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#if CPU_AVX2_SUPPORTED
+#include <immintrin.h>
+#endif
+#endif
 
 static void on_error(j_common_ptr cinfo) {
 	(*cinfo->err->output_message)(cinfo);
@@ -62,6 +71,134 @@ void setup_jpeg_source(j_decompress_ptr cinfo, uint8_t *input_ptr, uint32_t inpu
 	src->next_input_byte = input_ptr;
 }
 
+static void rgb_to_bgra_row_scalar(uint8_t* dest, const uint8_t* src, int pixel_count) {
+	for (int i = 0; i < pixel_count; ++i) {
+		dest[i * 4 + 0] = src[i * 3 + 2];
+		dest[i * 4 + 1] = src[i * 3 + 1];
+		dest[i * 4 + 2] = src[i * 3 + 0];
+		dest[i * 4 + 3] = 255;
+	}
+}
+
+#if defined(__SSE2__)
+static void rgb_to_bgra_row_sse2(uint8_t* dest, const uint8_t* src, int pixel_count) {
+	int i = 0;
+	const __m128i mask_g = _mm_set1_epi32(0x0000FF00);
+	const __m128i mask_low_byte = _mm_set1_epi32(0x000000FF);
+	const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+	for (; i + 4 <= pixel_count; i += 4) {
+		const uint8_t* p = src + i * 3;
+		uint32_t p0, p1, p2, p3;
+		memcpy(&p0, p, 4);
+		memcpy(&p1, p + 3, 4);
+		memcpy(&p2, p + 6, 4);
+		memcpy(&p3, p + 9, 4);
+		// each 32-bit lane now contains R | G << 8 | B << 16 | (garbage) << 24
+		__m128i v = _mm_set_epi32(p3, p2, p1, p0);
+		__m128i r = _mm_slli_epi32(_mm_and_si128(v, mask_low_byte), 16);
+		__m128i g = _mm_and_si128(v, mask_g);
+		__m128i b = _mm_and_si128(_mm_srli_epi32(v, 16), mask_low_byte);
+		__m128i bgra = _mm_or_si128(_mm_or_si128(b, g), _mm_or_si128(r, alpha));
+		_mm_storeu_si128((__m128i*)(dest + i * 4), bgra);
+	}
+	rgb_to_bgra_row_scalar(dest + i * 4, src + i * 3, pixel_count - i);
+}
+#endif
+
+#if CPU_AVX2_SUPPORTED
+// 8 pixels at a time: 4 pixels (12 bytes) in each 128-bit lane are spread out and swizzled with a single shuffle.
+CPU_TARGET_AVX2 static void rgb_to_bgra_row_avx2(uint8_t* dest, const uint8_t* src, int pixel_count) {
+	int i = 0;
+	const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+	                                         2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+	const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+	// The second load reads 16 bytes from pixel 4 on, so the loop stops early enough to stay within the padding.
+	for (; i + 9 <= pixel_count; i += 8) {
+		const uint8_t* p = src + i * 3;
+		__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) p)),
+		                                    _mm_loadu_si128((const __m128i*) (p + 12)), 1);
+		__m256i bgra = _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), alpha);
+		_mm256_storeu_si256((__m256i*)(dest + i * 4), bgra);
+	}
+	rgb_to_bgra_row_sse2(dest + i * 4, src + i * 3, pixel_count - i);
+}
+#endif
+
+typedef void rgb_to_bgra_row_func_t(uint8_t* dest, const uint8_t* src, int pixel_count);
+
+// Indexed by level, see cpu_dispatch.h
+static rgb_to_bgra_row_func_t* rgb_to_bgra_row_impls[CPU_LEVEL_COUNT] = {
+	rgb_to_bgra_row_scalar,
+#if defined(__SSE2__)
+	rgb_to_bgra_row_sse2,
+#if CPU_AVX2_SUPPORTED
+	rgb_to_bgra_row_avx2,
+#else
+	rgb_to_bgra_row_sse2,
+#endif
+#endif
+};
+
+// Expand RGB to BGRA (with alpha = 255).
+// Note: the source row needs to have at least one byte of padding at the end (SSE2 path reads 4 bytes per pixel).
+void rgb_to_bgra_row(uint8_t* dest, const uint8_t* src, int pixel_count) {
+	rgb_to_bgra_row_impls[cpu_get_kernel_level(CPU_KERNEL_RGB_SWIZZLE)](dest, src, pixel_count);
+}
+
+#define DECODE_MAX_SCANLINES_PER_CALL 16
+
+// Decompress the image after the header of the tile has been read, and write the pixels as BGRA.
+// If scale_denom > 1, libjpeg decodes at reduced resolution (1/2, 1/4 or 1/8), which is much cheaper.
+// tile_dim (0 if unknown) selects the color conversion for tiles of that size (see jpeg_simd_install()).
+static void decode_tile_pixels(j_decompress_ptr cinfo, uint8_t *output_ptr, uint32_t output_pitch, bool32 is_YCbCr,
+                               int scale_denom, int tile_dim) {
+	// If the TIFF says RGB, we go by what libjpeg made of the markers in the stream: e.g. Aperio SVS files are marked
+	// as RGB, but the JPEG streams may still be YCbCr.
+	if (is_YCbCr) {
+		cinfo->jpeg_color_space = JCS_YCbCr;
+	}
+	cinfo->out_color_space = JCS_RGB;
+	if (scale_denom > 1) {
+		cinfo->scale_num = 1;
+		cinfo->scale_denom = scale_denom;
+	}
+
+	jpeg_start_decompress(cinfo);
+	bool32 is_bgra_output = jpeg_simd_install(cinfo, true, tile_dim);
+
+	int row_width = cinfo->output_width;
+	int target_row_stride = output_pitch ? output_pitch : row_width * 4;
+	// Read several scanlines at once, to cut down on the per-call overhead (libjpeg may return fewer lines).
+	int max_lines = ATLEAST(cinfo->rec_outbuf_height, DECODE_MAX_SCANLINES_PER_CALL);
+	if (is_bgra_output) {
+		// The color conversion already writes BGRA: the scanlines can go straight into place.
+		JSAMPROW rows[DECODE_MAX_SCANLINES_PER_CALL];
+		max_lines = ATMOST(max_lines, DECODE_MAX_SCANLINES_PER_CALL);
+		while (cinfo->output_scanline < cinfo->output_height) {
+			for (int line = 0; line < max_lines; ++line) {
+				rows[line] = output_ptr + line * target_row_stride;
+			}
+			int lines_read = (int) jpeg_read_scanlines(cinfo, rows, max_lines);
+			output_ptr += lines_read * target_row_stride;
+		}
+	} else {
+		int source_row_stride = row_width * cinfo->output_components;
+		JSAMPARRAY buffer = (*cinfo->mem->alloc_sarray)
+				((j_common_ptr) cinfo, JPOOL_IMAGE, source_row_stride + 4 /* padding for rgb_to_bgra_row() */, max_lines);
+
+		while (cinfo->output_scanline < cinfo->output_height) {
+			int lines_read = (int) jpeg_read_scanlines(cinfo, buffer, max_lines);
+			for (int line = 0; line < lines_read; ++line) {
+				// TODO: what to do here, BGRA or RGBA?
+				rgb_to_bgra_row(output_ptr, buffer[line], row_width);
+				output_ptr += target_row_stride;
+			}
+		}
+	}
+
+	(void) jpeg_finish_decompress(cinfo);
+}
+
 EMSCRIPTEN_KEEPALIVE
 boolean decode_tile(uint8_t *table_ptr, uint32_t table_length, uint8_t *input_ptr, uint32_t input_length, uint8_t *output_ptr, bool32 is_YCbCr) {
 	struct jpeg_decompress_struct cinfo;
@@ -89,41 +226,284 @@ boolean decode_tile(uint8_t *table_ptr, uint32_t table_length, uint8_t *input_pt
 		return FALSE;
 	}
 
-	cinfo.jpeg_color_space = is_YCbCr ? JCS_YCbCr : JCS_RGB;
-	cinfo.out_color_space = JCS_RGB;
+	decode_tile_pixels(&cinfo, output_ptr, 0, is_YCbCr, 1, 0);
+
+	jpeg_destroy_decompress(&cinfo);
 
-	jpeg_start_decompress(&cinfo);
+	return TRUE;
+}
 
-	int row_width = cinfo.output_width;
-	int target_row_stride = row_width * 4;
-	int source_row_stride = row_width * cinfo.output_components;
-	JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray)
-			((j_common_ptr) &cinfo, JPOOL_IMAGE, source_row_stride, 1);
+// Long-lived decoder, to be used by a single thread.
+// Setting up a decompressor and parsing the JPEGTables stream of the TIFF for every tile is relatively expensive,
+// so instead we keep the decompressor around and cache the parsed tables (the tables of an IFD never change).
 
-	int source_offset;
-	int target_offset;
-	while (cinfo.output_scanline < cinfo.output_height) {
-		(void) jpeg_read_scanlines(&cinfo, buffer, 1);
+#define JPEG_TABLES_CACHE_SIZE 8
 
-		for (int i = 0; i < row_width; i++) {
-			source_offset = i * 3;
-			target_offset = i * 4;
+typedef struct jpeg_tables_cache_entry_t {
+	uint8_t* raw_tables; // copy of the JPEGTables stream, used as the key
+	uint32_t raw_tables_length;
+	JQUANT_TBL quant_tbls[NUM_QUANT_TBLS];
+	JHUFF_TBL dc_huff_tbls[NUM_HUFF_TBLS];
+	JHUFF_TBL ac_huff_tbls[NUM_HUFF_TBLS];
+	bool8 has_quant_tbl[NUM_QUANT_TBLS];
+	bool8 has_dc_huff_tbl[NUM_HUFF_TBLS];
+	bool8 has_ac_huff_tbl[NUM_HUFF_TBLS];
+	uint32_t last_used;
+} jpeg_tables_cache_entry_t;
 
-			// TODO: what to do here, BGRA or RGBA?
-			output_ptr[target_offset + 0] = buffer[0][source_offset + 2];
-			output_ptr[target_offset + 1] = buffer[0][source_offset + 1];
-			output_ptr[target_offset + 2] = buffer[0][source_offset + 0];
-			output_ptr[target_offset + 3] = 255;
+typedef struct jpeg_decoder_state_t {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	jpeg_tables_cache_entry_t tables_cache[JPEG_TABLES_CACHE_SIZE];
+	uint32_t use_counter;
+} jpeg_decoder_state_t;
+
+jpeg_decoder_state_t* jpeg_decoder_create_state() {
+	jpeg_decoder_state_t* state = (jpeg_decoder_state_t*) calloc(1, sizeof(jpeg_decoder_state_t));
+	state->cinfo.err = jpeg_std_error(&state->jerr);
+	state->jerr.error_exit = on_error;
+	jpeg_create_decompress(&state->cinfo);
+	return state;
+}
+
+void jpeg_decoder_destroy_state(jpeg_decoder_state_t* state) {
+	if (state) {
+		jpeg_destroy_decompress(&state->cinfo);
+		for (int i = 0; i < JPEG_TABLES_CACHE_SIZE; ++i) {
+			free(state->tables_cache[i].raw_tables);
 		}
+		free(state);
+	}
+}
 
-		output_ptr += target_row_stride;
+static jpeg_tables_cache_entry_t* find_cached_jpeg_tables(jpeg_decoder_state_t* state, uint8_t *table_ptr, uint32_t table_length) {
+	for (int i = 0; i < JPEG_TABLES_CACHE_SIZE; ++i) {
+		jpeg_tables_cache_entry_t* entry = state->tables_cache + i;
+		if (entry->raw_tables && entry->raw_tables_length == table_length
+		    && memcmp(entry->raw_tables, table_ptr, table_length) == 0) {
+			return entry;
+		}
 	}
+	return NULL;
+}
 
-	(void) jpeg_finish_decompress(&cinfo);
+// Parses the JPEGTables stream, and stores the resulting tables in the cache (replacing the least recently used).
+static jpeg_tables_cache_entry_t* parse_and_cache_jpeg_tables(jpeg_decoder_state_t* state, uint8_t *table_ptr, uint32_t table_length) {
+	j_decompress_ptr cinfo = &state->cinfo;
+	setup_jpeg_source(cinfo, table_ptr, table_length);
+	if (jpeg_read_header(cinfo, FALSE) != JPEG_HEADER_TABLES_ONLY) {
+		printf("Failed to load table\n");
+		jpeg_abort_decompress(cinfo);
+		return NULL;
+	}
 
-	jpeg_destroy_decompress(&cinfo);
+	jpeg_tables_cache_entry_t* entry = state->tables_cache;
+	for (int i = 1; i < JPEG_TABLES_CACHE_SIZE; ++i) {
+		if (state->tables_cache[i].last_used < entry->last_used) {
+			entry = state->tables_cache + i;
+		}
+	}
+	free(entry->raw_tables);
+	memset(entry, 0, sizeof(*entry));
+	entry->raw_tables = (uint8_t*) malloc(table_length);
+	memcpy(entry->raw_tables, table_ptr, table_length);
+	entry->raw_tables_length = table_length;
+	for (int i = 0; i < NUM_QUANT_TBLS; ++i) {
+		if (cinfo->quant_tbl_ptrs[i]) {
+			entry->quant_tbls[i] = *cinfo->quant_tbl_ptrs[i];
+			entry->has_quant_tbl[i] = true;
+		}
+	}
+	for (int i = 0; i < NUM_HUFF_TBLS; ++i) {
+		if (cinfo->dc_huff_tbl_ptrs[i]) {
+			entry->dc_huff_tbls[i] = *cinfo->dc_huff_tbl_ptrs[i];
+			entry->has_dc_huff_tbl[i] = true;
+		}
+		if (cinfo->ac_huff_tbl_ptrs[i]) {
+			entry->ac_huff_tbls[i] = *cinfo->ac_huff_tbl_ptrs[i];
+			entry->has_ac_huff_tbl[i] = true;
+		}
+	}
+	return entry;
+}
 
-	return TRUE;
+// Copy the cached tables back into the decompressor (a previous tile may have defined tables of its own).
+static void restore_cached_jpeg_tables(jpeg_decoder_state_t* state, jpeg_tables_cache_entry_t* entry) {
+	j_decompress_ptr cinfo = &state->cinfo;
+	for (int i = 0; i < NUM_QUANT_TBLS; ++i) {
+		if (entry->has_quant_tbl[i]) {
+			if (!cinfo->quant_tbl_ptrs[i]) {
+				cinfo->quant_tbl_ptrs[i] = jpeg_alloc_quant_table((j_common_ptr) cinfo);
+			}
+			*cinfo->quant_tbl_ptrs[i] = entry->quant_tbls[i];
+		}
+	}
+	for (int i = 0; i < NUM_HUFF_TBLS; ++i) {
+		if (entry->has_dc_huff_tbl[i]) {
+			if (!cinfo->dc_huff_tbl_ptrs[i]) {
+				cinfo->dc_huff_tbl_ptrs[i] = jpeg_alloc_huff_table((j_common_ptr) cinfo);
+			}
+			*cinfo->dc_huff_tbl_ptrs[i] = entry->dc_huff_tbls[i];
+		}
+		if (entry->has_ac_huff_tbl[i]) {
+			if (!cinfo->ac_huff_tbl_ptrs[i]) {
+				cinfo->ac_huff_tbl_ptrs[i] = jpeg_alloc_huff_table((j_common_ptr) cinfo);
+			}
+			*cinfo->ac_huff_tbl_ptrs[i] = entry->ac_huff_tbls[i];
+		}
+	}
+}
+
+// Sets up the tables (if the TIFF has them) and reads the header of the tile.
+static bool32 read_tile_header_with_state(jpeg_decoder_state_t* state, uint8_t *table_ptr, uint32_t table_length,
+                                          uint8_t *input_ptr, uint32_t input_length) {
+	j_decompress_ptr cinfo = &state->cinfo;
+
+	if (table_ptr && table_length > 0) {
+		jpeg_tables_cache_entry_t* entry = find_cached_jpeg_tables(state, table_ptr, table_length);
+		if (entry) {
+			restore_cached_jpeg_tables(state, entry);
+		} else {
+			entry = parse_and_cache_jpeg_tables(state, table_ptr, table_length);
+			if (!entry) {
+				return false;
+			}
+		}
+		entry->last_used = ++state->use_counter;
+	}
+
+	// Read tile data
+	setup_jpeg_source(cinfo, input_ptr, input_length);
+	if (jpeg_read_header(cinfo, TRUE) != JPEG_HEADER_OK) {
+		printf("Failed to read header\n");
+		jpeg_abort_decompress(cinfo);
+		return false;
+	}
+	return true;
+}
+
+// Note: output_pitch may be 0 (rows are tightly packed); scale_denom can be 1, 2, 4 or 8.
+bool32 decode_tile_with_state(jpeg_decoder_state_t* state, uint8_t *table_ptr, uint32_t table_length, uint8_t *input_ptr,
+                              uint32_t input_length, uint8_t *output_ptr, uint32_t output_pitch, bool32 is_YCbCr, int scale_denom) {
+	if (!read_tile_header_with_state(state, table_ptr, table_length, input_ptr, input_length)) {
+		return false;
+	}
+	decode_tile_pixels(&state->cinfo, output_ptr, output_pitch, is_YCbCr, scale_denom, 0);
+	return true;
+}
+
+// The same as decode_tile_with_state(), for tiles of which the size is known to be tile_dim x tile_dim (from the tile
+// path of the IFD, see tiff_select_tile_path()): at full size, the color conversion for that width is used.
+bool32 decode_fixed_size_tile_with_state(jpeg_decoder_state_t* state, uint8_t *table_ptr, uint32_t table_length,
+                                         uint8_t *input_ptr, uint32_t input_length, uint8_t *output_ptr,
+                                         uint32_t output_pitch, bool32 is_YCbCr, int tile_dim, int scale_denom) {
+	if (!read_tile_header_with_state(state, table_ptr, table_length, input_ptr, input_length)) {
+		return false;
+	}
+	decode_tile_pixels(&state->cinfo, output_ptr, output_pitch, is_YCbCr, scale_denom, tile_dim);
+	return true;
+}
+
+// Is the stream YCbCr with 2x2 chroma subsampling (4:2:0), and is it dim x dim pixels?
+static bool32 is_planar_decodable(j_decompress_ptr cinfo, int dim) {
+	return cinfo->jpeg_color_space == JCS_YCbCr && cinfo->num_components == 3 &&
+	       cinfo->image_width == (JDIMENSION)dim && cinfo->image_height == (JDIMENSION)dim && dim % 16 == 0 &&
+	       cinfo->comp_info[0].h_samp_factor == 2 && cinfo->comp_info[0].v_samp_factor == 2 &&
+	       cinfo->comp_info[1].h_samp_factor == 1 && cinfo->comp_info[1].v_samp_factor == 1 &&
+	       cinfo->comp_info[2].h_samp_factor == 1 && cinfo->comp_info[2].v_samp_factor == 1;
+}
+
+// Decodes a YCbCr 4:2:0 tile of dim x dim pixels into its planes as they are stored in the stream, without upsampling
+// the chroma or converting to RGB. The output is tightly packed: the Y plane (dim x dim), followed by dim / 2 rows
+// that each hold a row of the Cb plane and then a row of the Cr plane (dim / 2 samples each).
+// Other streams are decoded as BGRA instead, like decode_tile_with_state(); *is_planar tells which it was.
+bool32 decode_tile_planar_with_state(jpeg_decoder_state_t* state, uint8_t *table_ptr, uint32_t table_length,
+                                     uint8_t *input_ptr, uint32_t input_length, uint8_t *output_ptr,
+                                     uint32_t output_pitch, bool32 is_YCbCr, int dim, bool32* is_planar) {
+	*is_planar = false;
+	if (!read_tile_header_with_state(state, table_ptr, table_length, input_ptr, input_length)) {
+		return false;
+	}
+	j_decompress_ptr cinfo = &state->cinfo;
+	if (is_YCbCr) {
+		cinfo->jpeg_color_space = JCS_YCbCr;
+	}
+	if (!is_planar_decodable(cinfo, dim)) {
+		decode_tile_pixels(cinfo, output_ptr, output_pitch, is_YCbCr, 1, dim);
+		return true;
+	}
+
+	cinfo->raw_data_out = TRUE;
+	cinfo->out_color_space = JCS_YCbCr;
+	jpeg_start_decompress(cinfo);
+	jpeg_simd_install(cinfo, false, 0);
+	// Each call reads one row of MCUs: 16 rows of Y, 8 rows of Cb and Cr. The rows go straight into place.
+	uint8_t* y_plane = output_ptr;
+	uint8_t* chroma_planes = output_ptr + dim * dim;
+	int chroma_dim = dim / 2;
+	JSAMPROW y_rows[16], cb_rows[8], cr_rows[8];
+	JSAMPARRAY planes[3] = { y_rows, cb_rows, cr_rows };
+	while (cinfo->output_scanline < cinfo->output_height) {
+		int y = (int) cinfo->output_scanline;
+		for (int i = 0; i < 16; ++i) {
+			y_rows[i] = y_plane + (y + i) * dim;
+		}
+		for (int i = 0; i < 8; ++i) {
+			uint8_t* chroma_row = chroma_planes + (y / 2 + i) * dim;
+			cb_rows[i] = chroma_row;
+			cr_rows[i] = chroma_row + chroma_dim;
+		}
+		if (jpeg_read_raw_data(cinfo, planes, 16) == 0) {
+			break;
+		}
+	}
+	(void) jpeg_finish_decompress(cinfo);
+	cinfo->raw_data_out = FALSE; // the decompressor is reused for other tiles
+	*is_planar = true;
+	return true;
+}
+
+// Only the entropy decoding, for tiles of which the rest of the decoding is done on the GPU: the quantized DCT
+// coefficients and the quantization tables are written to output_ptr as described in jpeg_decoder.h.
+// Only the tiles that decode_tile_planar_with_state() can keep as planes qualify; other tiles are decoded into BGRA
+// pixels instead (*is_coefficients tells which it was).
+bool32 decode_tile_coefficients_with_state(jpeg_decoder_state_t* state, uint8_t *table_ptr, uint32_t table_length,
+                                           uint8_t *input_ptr, uint32_t input_length, uint8_t *output_ptr,
+                                           uint32_t output_pitch, bool32 is_YCbCr, int dim, bool32* is_coefficients) {
+	*is_coefficients = false;
+	if (!read_tile_header_with_state(state, table_ptr, table_length, input_ptr, input_length)) {
+		return false;
+	}
+	j_decompress_ptr cinfo = &state->cinfo;
+	if (is_YCbCr) {
+		cinfo->jpeg_color_space = JCS_YCbCr;
+	}
+	if (!is_planar_decodable(cinfo, dim) || sizeof(JCOEF) != sizeof(int16_t)) {
+		decode_tile_pixels(cinfo, output_ptr, output_pitch, is_YCbCr, 1, dim);
+		return true;
+	}
+
+	jvirt_barray_ptr* coefficient_arrays = jpeg_read_coefficients(cinfo);
+	uint16_t* quant_tables = (uint16_t*) output_ptr;
+	int16_t* coefficients = (int16_t*) (quant_tables + 3 * DCTSIZE2); // (JPEG_COEFFICIENT_TILE_HEADER_SIZE)
+	for (int component = 0; component < 3; ++component) {
+		jpeg_component_info* compptr = cinfo->comp_info + component;
+		if (!compptr->quant_table) {
+			jpeg_abort_decompress(cinfo);
+			return false;
+		}
+		memcpy(quant_tables + component * DCTSIZE2, compptr->quant_table->quantval, DCTSIZE2 * sizeof(uint16_t));
+		// (the coefficient arrays are padded to whole MCUs, so only the blocks inside the image are copied)
+		for (JDIMENSION block_row = 0; block_row < compptr->height_in_blocks; ++block_row) {
+			JBLOCKARRAY blocks = (*cinfo->mem->access_virt_barray)((j_common_ptr) cinfo, coefficient_arrays[component],
+			                                                       block_row, 1, FALSE);
+			memcpy(coefficients, blocks[0], compptr->width_in_blocks * sizeof(JBLOCK));
+			coefficients += compptr->width_in_blocks * DCTSIZE2;
+		}
+	}
+	(void) jpeg_finish_decompress(cinfo);
+	*is_coefficients = true;
+	return true;
 }
 
 EMSCRIPTEN_KEEPALIVE
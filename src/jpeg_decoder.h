@@ -1,3 +1,5 @@
+#pragma once
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -11,6 +13,29 @@ extern "C" {
 #endif
 
 EMSCRIPTEN_KEEPALIVE bool8 decode_tile(uint8_t *table_ptr, uint32_t table_length, uint8_t *input_ptr, uint32_t input_length, uint8_t *output_ptr, bool32 is_YCbCr);
+
+// Layout of a tile decoded by decode_tile_coefficients_with_state() (a YCbCr 4:2:0 tile of dim x dim pixels): the
+// quantization tables of Y, Cb and Cr (64 x u16 each), followed by the quantized DCT coefficients of all blocks of Y,
+// then Cb, then Cr (64 x i16 per block, blocks in raster order). Tables and blocks are in natural (not zigzag) order.
+#define JPEG_COEFFICIENT_TILE_HEADER_SIZE (3 * 64 * 2)
+#define JPEG_COEFFICIENT_TILE_SIZE(dim) (JPEG_COEFFICIENT_TILE_HEADER_SIZE + (dim) * (dim) * 3) // 1.5 coefficients per pixel
+
+typedef struct jpeg_decoder_state_t jpeg_decoder_state_t;
+jpeg_decoder_state_t* jpeg_decoder_create_state();
+void jpeg_decoder_destroy_state(jpeg_decoder_state_t* state);
+bool32 decode_tile_with_state(jpeg_decoder_state_t* state, uint8_t *table_ptr, uint32_t table_length, uint8_t *input_ptr,
+                              uint32_t input_length, uint8_t *output_ptr, uint32_t output_pitch, bool32 is_YCbCr, int scale_denom);
+bool32 decode_fixed_size_tile_with_state(jpeg_decoder_state_t* state, uint8_t *table_ptr, uint32_t table_length,
+                                         uint8_t *input_ptr, uint32_t input_length, uint8_t *output_ptr,
+                                         uint32_t output_pitch, bool32 is_YCbCr, int tile_dim, int scale_denom);
+bool32 decode_tile_planar_with_state(jpeg_decoder_state_t* state, uint8_t *table_ptr, uint32_t table_length,
+                                     uint8_t *input_ptr, uint32_t input_length, uint8_t *output_ptr,
+                                     uint32_t output_pitch, bool32 is_YCbCr, int dim, bool32* is_planar);
+bool32 decode_tile_coefficients_with_state(jpeg_decoder_state_t* state, uint8_t *table_ptr, uint32_t table_length,
+                                           uint8_t *input_ptr, uint32_t input_length, uint8_t *output_ptr,
+                                           uint32_t output_pitch, bool32 is_YCbCr, int dim, bool32* is_coefficients);
+void rgb_to_bgra_row(uint8_t* dest, const uint8_t* src, int pixel_count);
+
 EMSCRIPTEN_KEEPALIVE uint8_t *create_buffer(int size);
 EMSCRIPTEN_KEEPALIVE void destroy_buffer(uint8_t *p);
 
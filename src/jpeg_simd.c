@@ -0,0 +1,570 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// SIMD versions of the parts of the bundled libjpeg (deps/jpeg) that take most of the time when decoding tiles:
+// - the 8x8 'islow' IDCT;
+// - the 16x16 IDCT: libjpeg 9 does the fancy upsampling of chroma subsampled 2x2 (as nearly all slides are) by
+//   scaling up the IDCT of the chroma instead of upsampling afterwards, so this is the upsampling step;
+// - YCbCr to RGB color conversion, writing BGRA straight away (which also saves the rgb_to_bgra_row() pass).
+// The library itself is left as it is: after jpeg_start_decompress() has chosen its methods, jpeg_simd_install()
+// swaps in these versions through the method pointers. The results are exactly the same as those of the C code.
+// Everything comes in SSE2 and AVX2 versions, chosen at runtime (see cpu_dispatch.c).
+
+#include "common.h"
+
+#include <stdio.h>
+
+#define JPEG_INTERNALS
+#include "jpeglib.h"
+#include "jdct.h"
+#include "jpeg_simd.h"
+#include "cpu_dispatch.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#if CPU_AVX2_SUPPORTED
+#include <immintrin.h>
+#endif
+#endif
+
+// From jidctint.c (for 8-bit samples)
+#define CONST_BITS  13
+#define PASS1_BITS  2
+
+#define FIX_0_298631336  ((INT32)  2446)
+#define FIX_0_390180644  ((INT32)  3196)
+#define FIX_0_541196100  ((INT32)  4433)
+#define FIX_0_765366865  ((INT32)  6270)
+#define FIX_0_899976223  ((INT32)  7373)
+#define FIX_1_175875602  ((INT32)  9633)
+#define FIX_1_501321110  ((INT32)  12299)
+#define FIX_1_847759065  ((INT32)  15137)
+#define FIX_1_961570560  ((INT32)  16069)
+#define FIX_2_053119869  ((INT32)  16819)
+#define FIX_2_562915447  ((INT32)  20995)
+#define FIX_3_072711026  ((INT32)  25172)
+
+// From jdcolor.c
+#define YCC_SCALEBITS 16
+#define YCC_ONE_HALF ((INT32) 1 << (YCC_SCALEBITS-1))
+#define YCC_FIX(x) ((INT32) ((x) * (1L<<YCC_SCALEBITS) + 0.5))
+
+#if defined(__SSE2__)
+
+// SSE2: the 8 lanes are in two registers.
+
+typedef struct v8i_sse2_t {
+	__m128i lo, hi;
+} v8i_sse2_t;
+
+static inline v8i_sse2_t v8_set1_sse2(i32 x) {
+	v8i_sse2_t result = { _mm_set1_epi32(x), _mm_set1_epi32(x) };
+	return result;
+}
+
+static inline v8i_sse2_t v8_add_sse2(v8i_sse2_t a, v8i_sse2_t b) {
+	v8i_sse2_t result = { _mm_add_epi32(a.lo, b.lo), _mm_add_epi32(a.hi, b.hi) };
+	return result;
+}
+
+static inline v8i_sse2_t v8_sub_sse2(v8i_sse2_t a, v8i_sse2_t b) {
+	v8i_sse2_t result = { _mm_sub_epi32(a.lo, b.lo), _mm_sub_epi32(a.hi, b.hi) };
+	return result;
+}
+
+static inline v8i_sse2_t v8_and_sse2(v8i_sse2_t a, v8i_sse2_t b) {
+	v8i_sse2_t result = { _mm_and_si128(a.lo, b.lo), _mm_and_si128(a.hi, b.hi) };
+	return result;
+}
+
+// SSE2 has no 32-bit multiply that keeps the low half: multiply the even and odd lanes separately.
+// (the low 32 bits of the product are the same for signed and unsigned numbers)
+static inline __m128i mullo_epi32_sse2(__m128i a, __m128i b) {
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+	                          _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline v8i_sse2_t v8_mul_sse2(v8i_sse2_t a, v8i_sse2_t b) {
+	v8i_sse2_t result = { mullo_epi32_sse2(a.lo, b.lo), mullo_epi32_sse2(a.hi, b.hi) };
+	return result;
+}
+
+static inline v8i_sse2_t v8_slli_sse2(v8i_sse2_t a, i32 bits) {
+	v8i_sse2_t result = { _mm_slli_epi32(a.lo, bits), _mm_slli_epi32(a.hi, bits) };
+	return result;
+}
+
+static inline v8i_sse2_t v8_srai_sse2(v8i_sse2_t a, i32 bits) {
+	v8i_sse2_t result = { _mm_srai_epi32(a.lo, bits), _mm_srai_epi32(a.hi, bits) };
+	return result;
+}
+
+static inline v8i_sse2_t v8_load_coefs_sse2(const JCOEF* coefs) {
+	__m128i x = _mm_loadu_si128((const __m128i*) coefs);
+	v8i_sse2_t result = { _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16), _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16) };
+	return result;
+}
+
+static inline v8i_sse2_t v8_load_sse2(const ISLOW_MULT_TYPE* values) {
+	v8i_sse2_t result = { _mm_loadu_si128((const __m128i*) values), _mm_loadu_si128((const __m128i*) (values + 4)) };
+	return result;
+}
+
+static inline void transpose_4x4_sse2(__m128i* r0, __m128i* r1, __m128i* r2, __m128i* r3) {
+	__m128i t0 = _mm_unpacklo_epi32(*r0, *r1);
+	__m128i t1 = _mm_unpackhi_epi32(*r0, *r1);
+	__m128i t2 = _mm_unpacklo_epi32(*r2, *r3);
+	__m128i t3 = _mm_unpackhi_epi32(*r2, *r3);
+	*r0 = _mm_unpacklo_epi64(t0, t2);
+	*r1 = _mm_unpackhi_epi64(t0, t2);
+	*r2 = _mm_unpacklo_epi64(t1, t3);
+	*r3 = _mm_unpackhi_epi64(t1, t3);
+}
+
+// Transposes 8 rows of 8 lanes, as four 4x4 blocks (the top-right and bottom-left blocks trade places).
+static inline void v8_transpose_sse2(v8i_sse2_t* v) {
+	transpose_4x4_sse2(&v[0].lo, &v[1].lo, &v[2].lo, &v[3].lo);
+	transpose_4x4_sse2(&v[0].hi, &v[1].hi, &v[2].hi, &v[3].hi);
+	transpose_4x4_sse2(&v[4].lo, &v[5].lo, &v[6].lo, &v[7].lo);
+	transpose_4x4_sse2(&v[4].hi, &v[5].hi, &v[6].hi, &v[7].hi);
+	for (i32 i = 0; i < 4; ++i) {
+		__m128i temp = v[i].hi;
+		v[i].hi = v[4 + i].lo;
+		v[4 + i].lo = temp;
+	}
+}
+
+// Packs 8 lanes into 8 samples, clamped to 0..255.
+static inline void v8_store_samples_sse2(JSAMPLE* dest, v8i_sse2_t x) {
+	__m128i words = _mm_packs_epi32(x.lo, x.hi);
+	_mm_storel_epi64((__m128i*) dest, _mm_packus_epi16(words, words));
+}
+
+#define V v8i_sse2_t
+#define V_SET1 v8_set1_sse2
+#define V_ADD v8_add_sse2
+#define V_SUB v8_sub_sse2
+#define V_AND v8_and_sse2
+#define V_MUL v8_mul_sse2
+#define V_SLLI v8_slli_sse2
+#define V_SRAI v8_srai_sse2
+#define V_LOAD_COEFS v8_load_coefs_sse2
+#define V_LOAD v8_load_sse2
+#define V_TRANSPOSE v8_transpose_sse2
+#define V_STORE_SAMPLES v8_store_samples_sse2
+#define FN(name) name##_sse2
+#define FN_TARGET
+#include "jpeg_simd_idct.h"
+#undef V
+#undef V_SET1
+#undef V_ADD
+#undef V_SUB
+#undef V_AND
+#undef V_MUL
+#undef V_SLLI
+#undef V_SRAI
+#undef V_LOAD_COEFS
+#undef V_LOAD
+#undef V_TRANSPOSE
+#undef V_STORE_SAMPLES
+#undef FN
+#undef FN_TARGET
+
+#if CPU_AVX2_SUPPORTED
+
+// AVX2: the 8 lanes are a single register. Compiled for AVX2 per function, only called if the CPU supports it.
+
+#define AVX2_TARGET CPU_TARGET_AVX2
+
+AVX2_TARGET static inline __m256i v8_load_coefs_avx2(const JCOEF* coefs) {
+	return _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*) coefs));
+}
+
+AVX2_TARGET static inline __m256i v8_load_avx2(const ISLOW_MULT_TYPE* values) {
+	return _mm256_loadu_si256((const __m256i*) values);
+}
+
+AVX2_TARGET static inline void v8_transpose_avx2(__m256i* v) {
+	__m256i t0 = _mm256_unpacklo_epi32(v[0], v[1]);
+	__m256i t1 = _mm256_unpackhi_epi32(v[0], v[1]);
+	__m256i t2 = _mm256_unpacklo_epi32(v[2], v[3]);
+	__m256i t3 = _mm256_unpackhi_epi32(v[2], v[3]);
+	__m256i t4 = _mm256_unpacklo_epi32(v[4], v[5]);
+	__m256i t5 = _mm256_unpackhi_epi32(v[4], v[5]);
+	__m256i t6 = _mm256_unpacklo_epi32(v[6], v[7]);
+	__m256i t7 = _mm256_unpackhi_epi32(v[6], v[7]);
+	__m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+	__m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+	__m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+	__m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+	__m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+	__m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+	__m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+	__m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+	v[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+	v[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+	v[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+	v[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+	v[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+	v[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+	v[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+	v[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+AVX2_TARGET static inline void v8_store_samples_avx2(JSAMPLE* dest, __m256i x) {
+	__m128i words = _mm_packs_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+	_mm_storel_epi64((__m128i*) dest, _mm_packus_epi16(words, words));
+}
+
+#define V __m256i
+#define V_SET1 _mm256_set1_epi32
+#define V_ADD _mm256_add_epi32
+#define V_SUB _mm256_sub_epi32
+#define V_AND _mm256_and_si256
+#define V_MUL _mm256_mullo_epi32
+#define V_SLLI _mm256_slli_epi32
+#define V_SRAI _mm256_srai_epi32
+#define V_LOAD_COEFS v8_load_coefs_avx2
+#define V_LOAD v8_load_avx2
+#define V_TRANSPOSE v8_transpose_avx2
+#define V_STORE_SAMPLES v8_store_samples_avx2
+#define FN(name) name##_avx2
+#define FN_TARGET AVX2_TARGET
+#include "jpeg_simd_idct.h"
+#undef V
+#undef V_SET1
+#undef V_ADD
+#undef V_SUB
+#undef V_AND
+#undef V_MUL
+#undef V_SLLI
+#undef V_SRAI
+#undef V_LOAD_COEFS
+#undef V_LOAD
+#undef V_TRANSPOSE
+#undef V_STORE_SAMPLES
+#undef FN
+#undef FN_TARGET
+
+#endif //CPU_AVX2_SUPPORTED
+
+// YCbCr -> BGRA, like ycc_rgb_convert() in jdcolor.c. The products with the constants (scaled by 2^16) are formed
+// exactly with _mm_madd_epi16(), as pairs (x, 4 * x) times (c & 3, c >> 2), because the constants don't fit in 16 bits.
+
+static inline __m128i ycc_multiply_sse2(__m128i pairs, INT32 constant) {
+	return _mm_madd_epi16(pairs, _mm_set1_epi32((i32)((u32)(constant >> 2) << 16 | (u32)(constant & 3))));
+}
+
+// (x * constant + ONE_HALF) >> SCALEBITS, for 8 values of x at once (rounded separately for each term; callers that
+// sum several terms before rounding use ycc_multiply_sse2() themselves)
+static inline __m128i ycc_scale_sse2(__m128i x, __m128i x4, INT32 constant) {
+	__m128i one_half = _mm_set1_epi32(YCC_ONE_HALF);
+	__m128i lo = ycc_multiply_sse2(_mm_unpacklo_epi16(x, x4), constant);
+	__m128i hi = ycc_multiply_sse2(_mm_unpackhi_epi16(x, x4), constant);
+	lo = _mm_srai_epi32(_mm_add_epi32(lo, one_half), YCC_SCALEBITS);
+	hi = _mm_srai_epi32(_mm_add_epi32(hi, one_half), YCC_SCALEBITS);
+	return _mm_packs_epi32(lo, hi);
+}
+
+// Interleaves 8 samples of each channel into 8 BGRA pixels.
+static inline void store_bgra_sse2(JSAMPLE* dest, __m128i b, __m128i g, __m128i r) {
+	__m128i bg = _mm_unpacklo_epi8(b, g);
+	__m128i ra = _mm_unpacklo_epi8(r, _mm_set1_epi8((char)0xFF));
+	_mm_storeu_si128((__m128i*) dest, _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128((__m128i*) (dest + 16), _mm_unpackhi_epi16(bg, ra));
+}
+
+static inline JSAMPLE clamp_sample(i32 x) {
+	return (JSAMPLE) CLAMP(x, 0, MAXJSAMPLE);
+}
+
+// The pixels left over at the end of a row, one at a time.
+static inline void ycc_bgra_convert_tail(JSAMPROW y_row, JSAMPROW cb_row, JSAMPROW cr_row, JSAMPROW dest, i32 x,
+                                         i32 width) {
+	const INT32 cr_r = YCC_FIX(1.402);
+	const INT32 cb_b = YCC_FIX(1.772);
+	const INT32 cr_g = YCC_FIX(0.714136286);
+	const INT32 cb_g = YCC_FIX(0.344136286);
+	for (; x < width; ++x) {
+		i32 y = y_row[x];
+		i32 cb = cb_row[x] - CENTERJSAMPLE;
+		i32 cr = cr_row[x] - CENTERJSAMPLE;
+		dest[x * 4 + 0] = clamp_sample(y + (i32) RIGHT_SHIFT(cb_b * cb + YCC_ONE_HALF, YCC_SCALEBITS));
+		dest[x * 4 + 1] = clamp_sample(y + (i32) RIGHT_SHIFT(-cb_g * cb - cr_g * cr + YCC_ONE_HALF, YCC_SCALEBITS));
+		dest[x * 4 + 2] = clamp_sample(y + (i32) RIGHT_SHIFT(cr_r * cr + YCC_ONE_HALF, YCC_SCALEBITS));
+		dest[x * 4 + 3] = 255;
+	}
+}
+
+// The color conversions are instantiated for the common tile widths (see tiff_tile_path_enum): the generic version
+// takes the width of the image, the others have it built in, so that the loops have a fixed trip count and the
+// per-pixel tail drops out.
+#define DEFINE_COLOR_CONVERT_VARIANTS(name, level, target) \
+	target static void name##_##level(j_decompress_ptr cinfo, JSAMPIMAGE input_buf, JDIMENSION input_row, \
+	                                  JSAMPARRAY output_buf, int num_rows) { \
+		name##_rows_##level(input_buf, input_row, output_buf, num_rows, (i32) cinfo->output_width); \
+	} \
+	target static void name##_256_##level(j_decompress_ptr cinfo, JSAMPIMAGE input_buf, JDIMENSION input_row, \
+	                                      JSAMPARRAY output_buf, int num_rows) { \
+		name##_rows_##level(input_buf, input_row, output_buf, num_rows, 256); \
+	} \
+	target static void name##_512_##level(j_decompress_ptr cinfo, JSAMPIMAGE input_buf, JDIMENSION input_row, \
+	                                      JSAMPARRAY output_buf, int num_rows) { \
+		name##_rows_##level(input_buf, input_row, output_buf, num_rows, 512); \
+	}
+
+static CPU_FORCE_INLINE void ycc_bgra_convert_rows_sse2(JSAMPIMAGE input_buf, JDIMENSION input_row,
+                                                        JSAMPARRAY output_buf, int num_rows, i32 width) {
+	const INT32 cr_r = YCC_FIX(1.402);
+	const INT32 cb_b = YCC_FIX(1.772);
+	const INT32 cr_g = YCC_FIX(0.714136286);
+	const INT32 cb_g = YCC_FIX(0.344136286);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i center = _mm_set1_epi16(CENTERJSAMPLE);
+	const __m128i one_half = _mm_set1_epi32(YCC_ONE_HALF);
+	for (i32 row = 0; row < num_rows; ++row) {
+		JSAMPROW y_row = input_buf[0][input_row + row];
+		JSAMPROW cb_row = input_buf[1][input_row + row];
+		JSAMPROW cr_row = input_buf[2][input_row + row];
+		JSAMPROW dest = output_buf[row];
+		i32 x = 0;
+		for (; x + 8 <= width; x += 8) {
+			__m128i y = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (y_row + x)), zero);
+			__m128i cb = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (cb_row + x)), zero), center);
+			__m128i cr = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (cr_row + x)), zero), center);
+			__m128i cb4 = _mm_slli_epi16(cb, 2);
+			__m128i cr4 = _mm_slli_epi16(cr, 2);
+
+			__m128i r = _mm_add_epi16(y, ycc_scale_sse2(cr, cr4, cr_r));
+			__m128i b = _mm_add_epi16(y, ycc_scale_sse2(cb, cb4, cb_b));
+			// For green, the two terms are added up before rounding.
+			__m128i g_lo = _mm_add_epi32(ycc_multiply_sse2(_mm_unpacklo_epi16(cb, cb4), -cb_g),
+			                             ycc_multiply_sse2(_mm_unpacklo_epi16(cr, cr4), -cr_g));
+			__m128i g_hi = _mm_add_epi32(ycc_multiply_sse2(_mm_unpackhi_epi16(cb, cb4), -cb_g),
+			                             ycc_multiply_sse2(_mm_unpackhi_epi16(cr, cr4), -cr_g));
+			g_lo = _mm_srai_epi32(_mm_add_epi32(g_lo, one_half), YCC_SCALEBITS);
+			g_hi = _mm_srai_epi32(_mm_add_epi32(g_hi, one_half), YCC_SCALEBITS);
+			__m128i g = _mm_add_epi16(y, _mm_packs_epi32(g_lo, g_hi));
+
+			store_bgra_sse2(dest + x * 4, _mm_packus_epi16(b, b), _mm_packus_epi16(g, g), _mm_packus_epi16(r, r));
+		}
+		ycc_bgra_convert_tail(y_row, cb_row, cr_row, dest, x, width);
+	}
+}
+DEFINE_COLOR_CONVERT_VARIANTS(ycc_bgra_convert, sse2, )
+
+// RGB -> BGRA, for streams that are stored as RGB (like rgb_convert() in jdcolor.c, which only interleaves).
+static CPU_FORCE_INLINE void rgb_bgra_convert_rows_sse2(JSAMPIMAGE input_buf, JDIMENSION input_row,
+                                                        JSAMPARRAY output_buf, int num_rows, i32 width) {
+	for (i32 row = 0; row < num_rows; ++row) {
+		JSAMPROW r_row = input_buf[0][input_row + row];
+		JSAMPROW g_row = input_buf[1][input_row + row];
+		JSAMPROW b_row = input_buf[2][input_row + row];
+		JSAMPROW dest = output_buf[row];
+		i32 x = 0;
+		for (; x + 8 <= width; x += 8) {
+			store_bgra_sse2(dest + x * 4, _mm_loadl_epi64((const __m128i*) (b_row + x)),
+			                _mm_loadl_epi64((const __m128i*) (g_row + x)), _mm_loadl_epi64((const __m128i*) (r_row + x)));
+		}
+		for (; x < width; ++x) {
+			dest[x * 4 + 0] = b_row[x];
+			dest[x * 4 + 1] = g_row[x];
+			dest[x * 4 + 2] = r_row[x];
+			dest[x * 4 + 3] = 255;
+		}
+	}
+}
+DEFINE_COLOR_CONVERT_VARIANTS(rgb_bgra_convert, sse2, )
+
+#if CPU_AVX2_SUPPORTED
+
+// The same as ycc_bgra_convert_sse2(), 16 pixels at a time.
+
+AVX2_TARGET static inline __m256i ycc_multiply_avx2(__m256i pairs, INT32 constant) {
+	return _mm256_madd_epi16(pairs, _mm256_set1_epi32((i32)((u32)(constant >> 2) << 16 | (u32)(constant & 3))));
+}
+
+AVX2_TARGET static inline __m256i ycc_scale_avx2(__m256i x, __m256i x4, INT32 constant) {
+	__m256i one_half = _mm256_set1_epi32(YCC_ONE_HALF);
+	__m256i lo = ycc_multiply_avx2(_mm256_unpacklo_epi16(x, x4), constant);
+	__m256i hi = ycc_multiply_avx2(_mm256_unpackhi_epi16(x, x4), constant);
+	lo = _mm256_srai_epi32(_mm256_add_epi32(lo, one_half), YCC_SCALEBITS);
+	hi = _mm256_srai_epi32(_mm256_add_epi32(hi, one_half), YCC_SCALEBITS);
+	return _mm256_packs_epi32(lo, hi); // the unpacks and packs work within 128-bit lanes, so the order is kept
+}
+
+// 16 values (16-bit) -> 16 samples, saturated.
+AVX2_TARGET static inline __m128i pack_samples_avx2(__m256i x) {
+	__m256i packed = _mm256_packus_epi16(x, x);
+	return _mm256_castsi256_si128(_mm256_permute4x64_epi64(packed, 0x08));
+}
+
+AVX2_TARGET static inline __m256i load_samples_avx2(JSAMPROW row) {
+	return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) row));
+}
+
+AVX2_TARGET static CPU_FORCE_INLINE void ycc_bgra_convert_rows_avx2(JSAMPIMAGE input_buf, JDIMENSION input_row,
+                                                                    JSAMPARRAY output_buf, int num_rows, i32 width) {
+	const INT32 cr_r = YCC_FIX(1.402);
+	const INT32 cb_b = YCC_FIX(1.772);
+	const INT32 cr_g = YCC_FIX(0.714136286);
+	const INT32 cb_g = YCC_FIX(0.344136286);
+	const __m256i center = _mm256_set1_epi16(CENTERJSAMPLE);
+	const __m256i one_half = _mm256_set1_epi32(YCC_ONE_HALF);
+	const __m128i alpha = _mm_set1_epi8((char)0xFF);
+	for (i32 row = 0; row < num_rows; ++row) {
+		JSAMPROW y_row = input_buf[0][input_row + row];
+		JSAMPROW cb_row = input_buf[1][input_row + row];
+		JSAMPROW cr_row = input_buf[2][input_row + row];
+		JSAMPROW dest = output_buf[row];
+		i32 x = 0;
+		for (; x + 16 <= width; x += 16) {
+			__m256i y = load_samples_avx2(y_row + x);
+			__m256i cb = _mm256_sub_epi16(load_samples_avx2(cb_row + x), center);
+			__m256i cr = _mm256_sub_epi16(load_samples_avx2(cr_row + x), center);
+			__m256i cb4 = _mm256_slli_epi16(cb, 2);
+			__m256i cr4 = _mm256_slli_epi16(cr, 2);
+
+			__m256i r = _mm256_add_epi16(y, ycc_scale_avx2(cr, cr4, cr_r));
+			__m256i b = _mm256_add_epi16(y, ycc_scale_avx2(cb, cb4, cb_b));
+			__m256i g_lo = _mm256_add_epi32(ycc_multiply_avx2(_mm256_unpacklo_epi16(cb, cb4), -cb_g),
+			                                ycc_multiply_avx2(_mm256_unpacklo_epi16(cr, cr4), -cr_g));
+			__m256i g_hi = _mm256_add_epi32(ycc_multiply_avx2(_mm256_unpackhi_epi16(cb, cb4), -cb_g),
+			                                ycc_multiply_avx2(_mm256_unpackhi_epi16(cr, cr4), -cr_g));
+			g_lo = _mm256_srai_epi32(_mm256_add_epi32(g_lo, one_half), YCC_SCALEBITS);
+			g_hi = _mm256_srai_epi32(_mm256_add_epi32(g_hi, one_half), YCC_SCALEBITS);
+			__m256i g = _mm256_add_epi16(y, _mm256_packs_epi32(g_lo, g_hi));
+
+			__m128i b8 = pack_samples_avx2(b);
+			__m128i g8 = pack_samples_avx2(g);
+			__m128i r8 = pack_samples_avx2(r);
+			__m128i bg_lo = _mm_unpacklo_epi8(b8, g8);
+			__m128i bg_hi = _mm_unpackhi_epi8(b8, g8);
+			__m128i ra_lo = _mm_unpacklo_epi8(r8, alpha);
+			__m128i ra_hi = _mm_unpackhi_epi8(r8, alpha);
+			JSAMPLE* out = dest + x * 4;
+			_mm_storeu_si128((__m128i*) out, _mm_unpacklo_epi16(bg_lo, ra_lo));
+			_mm_storeu_si128((__m128i*) (out + 16), _mm_unpackhi_epi16(bg_lo, ra_lo));
+			_mm_storeu_si128((__m128i*) (out + 32), _mm_unpacklo_epi16(bg_hi, ra_hi));
+			_mm_storeu_si128((__m128i*) (out + 48), _mm_unpackhi_epi16(bg_hi, ra_hi));
+		}
+		ycc_bgra_convert_tail(y_row, cb_row, cr_row, dest, x, width);
+	}
+}
+DEFINE_COLOR_CONVERT_VARIANTS(ycc_bgra_convert, avx2, AVX2_TARGET)
+
+#endif //CPU_AVX2_SUPPORTED
+
+// Mirrors use_merged_upsample() in jdmaster.c: in that case upsampling and color conversion are done together by
+// jdmerge.c, and cinfo->cconvert is not used (and may even be left over from an earlier image).
+static bool32 is_using_merged_upsampler(j_decompress_ptr cinfo) {
+	if (cinfo->CCIR601_sampling) return false;
+	if ((cinfo->jpeg_color_space != JCS_YCbCr && cinfo->jpeg_color_space != JCS_BG_YCC) ||
+	    cinfo->num_components != 3 || cinfo->out_color_space != JCS_RGB ||
+	    cinfo->out_color_components != RGB_PIXELSIZE || cinfo->color_transform) {
+		return false;
+	}
+	jpeg_component_info* comp = cinfo->comp_info;
+	if (comp[0].h_samp_factor != 2 || comp[1].h_samp_factor != 1 || comp[2].h_samp_factor != 1 ||
+	    comp[0].v_samp_factor > 2 || comp[1].v_samp_factor != 1 || comp[2].v_samp_factor != 1) {
+		return false;
+	}
+	for (i32 ci = 0; ci < 3; ++ci) {
+		if (comp[ci].DCT_h_scaled_size != cinfo->min_DCT_h_scaled_size ||
+		    comp[ci].DCT_v_scaled_size != cinfo->min_DCT_v_scaled_size) {
+			return false;
+		}
+	}
+	return true;
+}
+
+#endif //__SSE2__
+
+#if defined(__SSE2__)
+
+// The implementations for each level (see cpu_dispatch.h); NULL leaves the method that libjpeg picked.
+#if CPU_AVX2_SUPPORTED
+#define AVX2_OR_SSE2(name) name##_avx2
+#else
+#define AVX2_OR_SSE2(name) name##_sse2
+#endif
+typedef void color_convert_func_t(j_decompress_ptr, JSAMPIMAGE, JDIMENSION, JSAMPARRAY, int);
+static inverse_DCT_method_ptr idct_islow_impls[CPU_LEVEL_COUNT] = {
+	NULL, jpeg_idct_islow_sse2, AVX2_OR_SSE2(jpeg_idct_islow),
+};
+static inverse_DCT_method_ptr idct_16x16_impls[CPU_LEVEL_COUNT] = {
+	NULL, jpeg_idct_16x16_sse2, AVX2_OR_SSE2(jpeg_idct_16x16),
+};
+// Also indexed by the width variant: any width, 256, 512 (see DEFINE_COLOR_CONVERT_VARIANTS)
+static color_convert_func_t* ycc_bgra_convert_impls[3][CPU_LEVEL_COUNT] = {
+	{ NULL, ycc_bgra_convert_sse2, AVX2_OR_SSE2(ycc_bgra_convert) },
+	{ NULL, ycc_bgra_convert_256_sse2, AVX2_OR_SSE2(ycc_bgra_convert_256) },
+	{ NULL, ycc_bgra_convert_512_sse2, AVX2_OR_SSE2(ycc_bgra_convert_512) },
+};
+static color_convert_func_t* rgb_bgra_convert_impls[3][CPU_LEVEL_COUNT] = { // only interleaves, AVX2 doesn't help
+	{ NULL, rgb_bgra_convert_sse2, rgb_bgra_convert_sse2 },
+	{ NULL, rgb_bgra_convert_256_sse2, rgb_bgra_convert_256_sse2 },
+	{ NULL, rgb_bgra_convert_512_sse2, rgb_bgra_convert_512_sse2 },
+};
+#undef AVX2_OR_SSE2
+
+#endif //__SSE2__
+
+// Should be called right after jpeg_start_decompress(), not in buffered image mode. If want_bgra is set, the color
+// conversion may be replaced by one that writes BGRA (4 bytes per pixel, so the scanline buffers passed to
+// jpeg_read_scanlines() need to be that large); returns whether it was. If tile_dim (256 or 512, from the tile path
+// of the IFD, see tiff_select_tile_path()) matches the width of the output, the version for that width is used.
+bool32 jpeg_simd_install(j_decompress_ptr cinfo, bool32 want_bgra, i32 tile_dim) {
+#if defined(__SSE2__)
+	// Only the methods that libjpeg picked are replaced, so that e.g. the reduced-size IDCTs are left alone.
+	i32 idct_level = cpu_get_kernel_level(CPU_KERNEL_JPEG_IDCT);
+	for (i32 ci = 0; ci < cinfo->num_components; ++ci) {
+		inverse_DCT_method_ptr* method = cinfo->idct->inverse_DCT + ci;
+		inverse_DCT_method_ptr replacement = NULL;
+		if (*method == jpeg_idct_islow) {
+			replacement = idct_islow_impls[idct_level];
+		} else if (*method == jpeg_idct_16x16) {
+			replacement = idct_16x16_impls[idct_level];
+		}
+		if (replacement) *method = replacement;
+	}
+
+	if (want_bgra && !cinfo->raw_data_out && !cinfo->quantize_colors && cinfo->num_components == 3 &&
+	    cinfo->out_color_space == JCS_RGB && cinfo->out_color_components == RGB_PIXELSIZE &&
+	    !is_using_merged_upsampler(cinfo)) {
+		i32 color_level = cpu_get_kernel_level(CPU_KERNEL_JPEG_COLOR_CONVERT);
+		i32 width_variant = 0;
+		if (tile_dim > 0 && cinfo->output_width == (JDIMENSION)tile_dim) {
+			width_variant = (tile_dim == 256) ? 1 : (tile_dim == 512) ? 2 : 0;
+		}
+		color_convert_func_t* color_convert = NULL;
+		if (cinfo->jpeg_color_space == JCS_YCbCr) {
+			color_convert = ycc_bgra_convert_impls[width_variant][color_level];
+		} else if (cinfo->jpeg_color_space == JCS_RGB && cinfo->color_transform == JCT_NONE) {
+			color_convert = rgb_bgra_convert_impls[width_variant][color_level];
+		}
+		if (color_convert) {
+			cinfo->cconvert->color_convert = color_convert;
+			return true;
+		}
+	}
+#endif
+	return false;
+}
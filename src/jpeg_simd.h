@@ -0,0 +1,34 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+// SIMD versions of the hot parts of the bundled libjpeg decoder (see jpeg_simd.c). Include after jpeglib.h.
+// Which versions are used is up to cpu_dispatch.c (the jpeg_idct and jpeg_color_convert kernels).
+
+bool32 jpeg_simd_install(j_decompress_ptr cinfo, bool32 want_bgra, i32 tile_dim);
+
+#ifdef __cplusplus
+}
+#endif
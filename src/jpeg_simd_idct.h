@@ -0,0 +1,231 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// The IDCTs of jpeg_simd.c, written once for vectors of 8 x i32. This file is included once per instruction set,
+// with the vector type V and its operations defined, and FN(name) giving the functions their suffix.
+// The arithmetic is that of jpeg_idct_islow() and jpeg_idct_16x16() in deps/jpeg/jidctint.c, step by step, so that
+// the results are exactly the same: each lane does what the C code does for one column (pass 1) or one row (pass 2).
+// The shortcuts of the C code for columns and rows without AC terms give the same results as the full calculation.
+
+FN_TARGET static inline void FN(dequantize)(JCOEFPTR coef_block, ISLOW_MULT_TYPE* quant, V in[8]) {
+	for (i32 i = 0; i < 8; ++i) {
+		in[i] = V_MUL(V_LOAD_COEFS(coef_block + i * DCTSIZE), V_LOAD(quant + i * DCTSIZE));
+	}
+}
+
+// Range limiting of the outputs, like range_limit[RIGHT_SHIFT(x, CONST_BITS+PASS1_BITS+3) & RANGE_MASK]: the table
+// maps the masked index i to CLAMP(i - RANGE_SUBSET, 0, MAXJSAMPLE); the clamping is done when packing to samples.
+FN_TARGET static inline V FN(descale_to_sample)(V x) {
+	return V_SUB(V_AND(V_SRAI(x, CONST_BITS + PASS1_BITS + 3), V_SET1(RANGE_MASK)), V_SET1(RANGE_SUBSET));
+}
+
+// The 8-point IDCT, on 8 columns (or rows) at once. dc is in[0] as prepared by the pass: scaled up by CONST_BITS, and
+// with the rounding fudge added. The outputs still need to be descaled.
+FN_TARGET static inline void FN(idct_islow_8)(V dc, V in[8], V out[8]) {
+	// Even part
+	V z3 = V_SLLI(in[4], CONST_BITS);
+	V tmp0 = V_ADD(dc, z3);
+	V tmp1 = V_SUB(dc, z3);
+
+	V z2 = in[2];
+	z3 = in[6];
+	V z1 = V_MUL(V_ADD(z2, z3), V_SET1(FIX_0_541196100));
+	V tmp2 = V_ADD(z1, V_MUL(z2, V_SET1(FIX_0_765366865)));
+	V tmp3 = V_SUB(z1, V_MUL(z3, V_SET1(FIX_1_847759065)));
+
+	V tmp10 = V_ADD(tmp0, tmp2);
+	V tmp13 = V_SUB(tmp0, tmp2);
+	V tmp11 = V_ADD(tmp1, tmp3);
+	V tmp12 = V_SUB(tmp1, tmp3);
+
+	// Odd part
+	tmp0 = in[7];
+	tmp1 = in[5];
+	tmp2 = in[3];
+	tmp3 = in[1];
+
+	z2 = V_ADD(tmp0, tmp2);
+	z3 = V_ADD(tmp1, tmp3);
+
+	z1 = V_MUL(V_ADD(z2, z3), V_SET1(FIX_1_175875602));
+	z2 = V_ADD(V_MUL(z2, V_SET1(-FIX_1_961570560)), z1);
+	z3 = V_ADD(V_MUL(z3, V_SET1(-FIX_0_390180644)), z1);
+
+	z1 = V_MUL(V_ADD(tmp0, tmp3), V_SET1(-FIX_0_899976223));
+	tmp0 = V_ADD(V_MUL(tmp0, V_SET1(FIX_0_298631336)), V_ADD(z1, z2));
+	tmp3 = V_ADD(V_MUL(tmp3, V_SET1(FIX_1_501321110)), V_ADD(z1, z3));
+
+	z1 = V_MUL(V_ADD(tmp1, tmp2), V_SET1(-FIX_2_562915447));
+	tmp1 = V_ADD(V_MUL(tmp1, V_SET1(FIX_2_053119869)), V_ADD(z1, z3));
+	tmp2 = V_ADD(V_MUL(tmp2, V_SET1(FIX_3_072711026)), V_ADD(z1, z2));
+
+	out[0] = V_ADD(tmp10, tmp3);
+	out[7] = V_SUB(tmp10, tmp3);
+	out[1] = V_ADD(tmp11, tmp2);
+	out[6] = V_SUB(tmp11, tmp2);
+	out[2] = V_ADD(tmp12, tmp1);
+	out[5] = V_SUB(tmp12, tmp1);
+	out[3] = V_ADD(tmp13, tmp0);
+	out[4] = V_SUB(tmp13, tmp0);
+}
+
+// The 16-point IDCT from 8 inputs, like idct_islow_8().
+FN_TARGET static inline void FN(idct_16_from_8)(V dc, V in[8], V out[16]) {
+	// Even part
+	V tmp0 = dc;
+	V z1 = in[4];
+	V tmp1 = V_MUL(z1, V_SET1(FIX(1.306562965)));
+	V tmp2 = V_MUL(z1, V_SET1(FIX_0_541196100));
+
+	V tmp10 = V_ADD(tmp0, tmp1);
+	V tmp11 = V_SUB(tmp0, tmp1);
+	V tmp12 = V_ADD(tmp0, tmp2);
+	V tmp13 = V_SUB(tmp0, tmp2);
+
+	z1 = in[2];
+	V z2 = in[6];
+	V z3 = V_SUB(z1, z2);
+	V z4 = V_MUL(z3, V_SET1(FIX(0.275899379)));
+	z3 = V_MUL(z3, V_SET1(FIX(1.387039845)));
+
+	tmp0 = V_ADD(z3, V_MUL(z2, V_SET1(FIX_2_562915447)));
+	tmp1 = V_ADD(z4, V_MUL(z1, V_SET1(FIX_0_899976223)));
+	tmp2 = V_SUB(z3, V_MUL(z1, V_SET1(FIX(0.601344887))));
+	V tmp3 = V_SUB(z4, V_MUL(z2, V_SET1(FIX(0.509795579))));
+
+	V tmp20 = V_ADD(tmp10, tmp0);
+	V tmp27 = V_SUB(tmp10, tmp0);
+	V tmp21 = V_ADD(tmp12, tmp1);
+	V tmp26 = V_SUB(tmp12, tmp1);
+	V tmp22 = V_ADD(tmp13, tmp2);
+	V tmp25 = V_SUB(tmp13, tmp2);
+	V tmp23 = V_ADD(tmp11, tmp3);
+	V tmp24 = V_SUB(tmp11, tmp3);
+
+	// Odd part
+	z1 = in[1];
+	z2 = in[3];
+	z3 = in[5];
+	z4 = in[7];
+
+	tmp11 = V_ADD(z1, z3);
+
+	tmp1  = V_MUL(V_ADD(z1, z2), V_SET1(FIX(1.353318001)));
+	tmp2  = V_MUL(tmp11, V_SET1(FIX(1.247225013)));
+	tmp3  = V_MUL(V_ADD(z1, z4), V_SET1(FIX(1.093201867)));
+	tmp10 = V_MUL(V_SUB(z1, z4), V_SET1(FIX(0.897167586)));
+	tmp11 = V_MUL(tmp11, V_SET1(FIX(0.666655658)));
+	tmp12 = V_MUL(V_SUB(z1, z2), V_SET1(FIX(0.410524528)));
+	tmp0  = V_SUB(V_ADD(V_ADD(tmp1, tmp2), tmp3), V_MUL(z1, V_SET1(FIX(2.286341144))));
+	tmp13 = V_SUB(V_ADD(V_ADD(tmp10, tmp11), tmp12), V_MUL(z1, V_SET1(FIX(1.835730603))));
+	z1    = V_MUL(V_ADD(z2, z3), V_SET1(FIX(0.138617169)));
+	tmp1  = V_ADD(tmp1, V_ADD(z1, V_MUL(z2, V_SET1(FIX(0.071888074)))));
+	tmp2  = V_ADD(tmp2, V_SUB(z1, V_MUL(z3, V_SET1(FIX(1.125726048)))));
+	z1    = V_MUL(V_SUB(z3, z2), V_SET1(FIX(1.407403738)));
+	tmp11 = V_ADD(tmp11, V_SUB(z1, V_MUL(z3, V_SET1(FIX(0.766367282)))));
+	tmp12 = V_ADD(tmp12, V_ADD(z1, V_MUL(z2, V_SET1(FIX(1.971951411)))));
+	z2    = V_ADD(z2, z4);
+	z1    = V_MUL(z2, V_SET1(-FIX(0.666655658)));
+	tmp1  = V_ADD(tmp1, z1);
+	tmp3  = V_ADD(tmp3, V_ADD(z1, V_MUL(z4, V_SET1(FIX(1.065388962)))));
+	z2    = V_MUL(z2, V_SET1(-FIX(1.247225013)));
+	tmp10 = V_ADD(tmp10, V_ADD(z2, V_MUL(z4, V_SET1(FIX(3.141271809)))));
+	tmp12 = V_ADD(tmp12, z2);
+	z2    = V_MUL(V_ADD(z3, z4), V_SET1(-FIX(1.353318001)));
+	tmp2  = V_ADD(tmp2, z2);
+	tmp3  = V_ADD(tmp3, z2);
+	z2    = V_MUL(V_SUB(z4, z3), V_SET1(FIX(0.410524528)));
+	tmp10 = V_ADD(tmp10, z2);
+	tmp11 = V_ADD(tmp11, z2);
+
+	out[0]  = V_ADD(tmp20, tmp0);
+	out[15] = V_SUB(tmp20, tmp0);
+	out[1]  = V_ADD(tmp21, tmp1);
+	out[14] = V_SUB(tmp21, tmp1);
+	out[2]  = V_ADD(tmp22, tmp2);
+	out[13] = V_SUB(tmp22, tmp2);
+	out[3]  = V_ADD(tmp23, tmp3);
+	out[12] = V_SUB(tmp23, tmp3);
+	out[4]  = V_ADD(tmp24, tmp10);
+	out[11] = V_SUB(tmp24, tmp10);
+	out[5]  = V_ADD(tmp25, tmp11);
+	out[10] = V_SUB(tmp25, tmp11);
+	out[6]  = V_ADD(tmp26, tmp12);
+	out[9]  = V_SUB(tmp26, tmp12);
+	out[7]  = V_ADD(tmp27, tmp13);
+	out[8]  = V_SUB(tmp27, tmp13);
+}
+
+// The dc of pass 1 (columns of coefficients)
+FN_TARGET static inline V FN(pass1_dc)(V in0) {
+	return V_ADD(V_SLLI(in0, CONST_BITS), V_SET1(ONE << (CONST_BITS - PASS1_BITS - 1)));
+}
+
+// The dc of pass 2 (rows of the workspace), with the range center added
+FN_TARGET static inline V FN(pass2_dc)(V in0) {
+	V bias = V_SET1((((INT32) RANGE_CENTER) << (PASS1_BITS + 3)) + (ONE << (PASS1_BITS + 2)));
+	return V_SLLI(V_ADD(in0, bias), CONST_BITS);
+}
+
+FN_TARGET static void FN(jpeg_idct_islow)(j_decompress_ptr cinfo, jpeg_component_info* compptr, JCOEFPTR coef_block,
+                                          JSAMPARRAY output_buf, JDIMENSION output_col) {
+	// Pass 1: the lanes are the columns; the results are the rows of the workspace.
+	V in[8], workspace[8], out[8];
+	FN(dequantize)(coef_block, (ISLOW_MULT_TYPE*) compptr->dct_table, in);
+	FN(idct_islow_8)(FN(pass1_dc)(in[0]), in, workspace);
+	for (i32 i = 0; i < 8; ++i) {
+		workspace[i] = V_SRAI(workspace[i], CONST_BITS - PASS1_BITS);
+	}
+	// Pass 2: the lanes are the rows; the results are the columns of the output, which are turned back into rows.
+	V_TRANSPOSE(workspace);
+	FN(idct_islow_8)(FN(pass2_dc)(workspace[0]), workspace, out);
+	for (i32 i = 0; i < 8; ++i) {
+		out[i] = FN(descale_to_sample)(out[i]);
+	}
+	V_TRANSPOSE(out);
+	for (i32 row = 0; row < 8; ++row) {
+		V_STORE_SAMPLES(output_buf[row] + output_col, out[row]);
+	}
+}
+
+FN_TARGET static void FN(jpeg_idct_16x16)(j_decompress_ptr cinfo, jpeg_component_info* compptr, JCOEFPTR coef_block,
+                                          JSAMPARRAY output_buf, JDIMENSION output_col) {
+	// Pass 1: 8 columns of coefficients into 16 rows of the workspace.
+	V in[8], workspace[16], out[16];
+	FN(dequantize)(coef_block, (ISLOW_MULT_TYPE*) compptr->dct_table, in);
+	FN(idct_16_from_8)(FN(pass1_dc)(in[0]), in, workspace);
+	for (i32 i = 0; i < 16; ++i) {
+		workspace[i] = V_SRAI(workspace[i], CONST_BITS - PASS1_BITS);
+	}
+	// Pass 2: 16 rows of 16 samples, 8 rows at a time.
+	for (i32 half = 0; half < 2; ++half) {
+		V* rows = workspace + half * 8;
+		V_TRANSPOSE(rows);
+		FN(idct_16_from_8)(FN(pass2_dc)(rows[0]), rows, out);
+		for (i32 i = 0; i < 16; ++i) {
+			out[i] = FN(descale_to_sample)(out[i]);
+		}
+		V_TRANSPOSE(out);
+		V_TRANSPOSE(out + 8);
+		for (i32 row = 0; row < 8; ++row) {
+			JSAMPROW outptr = output_buf[half * 8 + row] + output_col;
+			V_STORE_SAMPLES(outptr, out[row]);
+			V_STORE_SAMPLES(outptr + 8, out[8 + row]);
+		}
+	}
+}
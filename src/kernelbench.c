@@ -0,0 +1,566 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Micro-benchmarks of the hot kernels of the tile pipeline and the file formats, to compare optimizations with.
+// Each kernel is run KERNELBENCH_RUNS times, for at least KERNELBENCH_RUN_SECONDS per run; the best and the median
+// run are reported, in nanoseconds per operation and in bytes processed per second.
+//
+// Without arguments, the kernels run on synthetic data (a generated JPEG tile, an annotation file with many
+// coordinates). Slides passed on the command line (e.g. a Philips and an Aperio TIFF) add their own tiles to the
+// decode benchmarks, and are used for tiff_serialize() / tiff_deserialize().
+//
+// Kernels with SIMD versions (see cpu_dispatch.h) are run with each implementation that the CPU supports, labeled
+// [scalar], [sse2] or [avx2]. (The mipmap downsampling is part of render_group.c, which needs OpenGL and isn't built
+// here; in the viewer, CPU_KERNELS=mip_downsample=scalar can be compared with the profiler.)
+//
+// The TLS record benchmarks seal (encrypt, as the server does with the tiles) and open (decrypt, as the client does)
+// 16 KB records with each cipher suite of TLS 1.3, on one core; the sse2 level of aes_gcm is AES-NI/PCLMULQDQ.
+//
+// The results are written to stderr, so that the messages printed by the kernels themselves (tiff_deserialize() logs
+// what it parses) can be discarded.
+//
+// Usage: kernelbench [slide.tiff ...] > /dev/null
+
+#ifndef IS_SERVER
+#define IS_SERVER 1 // should be defined by the command-line because we also need to compile e.g. tiff.c which is shared
+#endif
+
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#undef MIN
+#undef MAX // redefined by tlse.c
+#define LTM_DESC
+#define TLS_AMALGAMATION
+#define LTC_NO_ASM
+#define TLS_CPU_DISPATCH
+#include "tlse.c"
+
+#include "stretchy_buffer.h"
+#include "tiff.h"
+#include "jpeg_decoder.h"
+#include "cpu_dispatch.h"
+#include "pyramid.h"
+#include "yxml.h"
+
+#define KERNELBENCH_RUNS 7
+#define KERNELBENCH_RUN_SECONDS 0.1
+#define KERNELBENCH_TILE_DIM 512
+#define KERNELBENCH_SLIDE_TILES 16 // tiles taken from the middle of the base level of each slide
+#define KERNELBENCH_XML_ANNOTATIONS 1000
+#define KERNELBENCH_XML_COORDINATES_PER_ANNOTATION 100
+#define KERNELBENCH_TLS_RECORD_SIZE TLS_MAXTLS_APP_SIZE
+
+typedef void kernel_func_t(void* userdata);
+
+double get_seconds() {
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+int compare_doubles(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+// Results are written here, so that the compiler can't leave out the work.
+static volatile u64 kernelbench_sink;
+
+static void run_kernel(const char* name, kernel_func_t* func, void* userdata, u64 bytes_per_op) {
+	// Find out how many operations fit in a run (this also warms up the caches).
+	i64 ops_per_run = 1;
+	for (;;) {
+		double start = get_seconds();
+		for (i64 i = 0; i < ops_per_run; ++i) func(userdata);
+		double elapsed = get_seconds() - start;
+		if (elapsed >= KERNELBENCH_RUN_SECONDS * 0.5 || ops_per_run >= (1LL << 40)) break;
+		ops_per_run *= 2;
+	}
+	double ns_per_op[KERNELBENCH_RUNS];
+	for (i32 run = 0; run < KERNELBENCH_RUNS; ++run) {
+		double start = get_seconds();
+		for (i64 i = 0; i < ops_per_run; ++i) func(userdata);
+		ns_per_op[run] = (get_seconds() - start) * 1e9 / (double)ops_per_run;
+	}
+	qsort(ns_per_op, KERNELBENCH_RUNS, sizeof(double), compare_doubles);
+	double best = ns_per_op[0];
+	double median = ns_per_op[KERNELBENCH_RUNS / 2];
+	fprintf(stderr, "%-48s %12.1f ns/op (median %12.1f)", name, best, median);
+	if (bytes_per_op > 0) {
+		fprintf(stderr, " %10.1f MB/s", (double)bytes_per_op / (best * 1e-9) / (1024.0 * 1024.0));
+	}
+	fprintf(stderr, "\n");
+}
+
+// Runs a kernel once for each implementation that the CPU supports (see cpu_dispatch.h), from plain C upwards.
+static void run_kernel_at_each_level(const char* name, i32 cpu_kernel, kernel_func_t* func, void* userdata,
+                                     u64 bytes_per_op) {
+	char label[256];
+	i32 old_level = cpu_get_kernel_level(cpu_kernel);
+	for (i32 level = CPU_LEVEL_SCALAR; level <= cpu_get_kernel_max_level(cpu_kernel); ++level) {
+		cpu_set_kernel_level(cpu_kernel, level);
+		snprintf(label, sizeof(label), "%s [%s]", name, cpu_get_level_name(level));
+		run_kernel(label, func, userdata, bytes_per_op);
+	}
+	cpu_set_kernel_level(cpu_kernel, old_level);
+}
+
+// decode_tile_with_state()
+
+typedef struct {
+	jpeg_decoder_state_t* decoder;
+	u8* jpeg_tables;
+	u32 jpeg_tables_length;
+	u8** tiles; // the compressed tiles, decoded in turn
+	u32* tile_sizes;
+	i32 tile_count;
+	i32 next_tile;
+	bool32 is_YCbCr;
+	i32 scale_denom;
+	u8* pixels;
+	u32 pitch;
+} decode_bench_t;
+
+static void decode_kernel(void* userdata) {
+	decode_bench_t* bench = (decode_bench_t*) userdata;
+	i32 index = bench->next_tile;
+	bench->next_tile = (index + 1) % bench->tile_count;
+	decode_tile_with_state(bench->decoder, bench->jpeg_tables, bench->jpeg_tables_length, bench->tiles[index],
+	                       bench->tile_sizes[index], bench->pixels, bench->pitch, bench->is_YCbCr, bench->scale_denom);
+	kernelbench_sink += bench->pixels[0];
+}
+
+static void run_decode_kernels(const char* name, decode_bench_t* bench) {
+	u64 compressed_size = 0;
+	for (i32 i = 0; i < bench->tile_count; ++i) {
+		compressed_size += bench->tile_sizes[i];
+	}
+	u64 bytes_per_op = compressed_size / ATLEAST(1, bench->tile_count);
+	char label[256];
+	// Each decode runs once with the plain libjpeg code, and once for each SIMD level the CPU supports.
+	i32 old_idct_level = cpu_get_kernel_level(CPU_KERNEL_JPEG_IDCT);
+	i32 old_color_convert_level = cpu_get_kernel_level(CPU_KERNEL_JPEG_COLOR_CONVERT);
+	for (i32 scale_denom = 1; scale_denom <= 2; scale_denom *= 2) {
+		for (i32 level = CPU_LEVEL_SCALAR; level <= cpu_get_detected_level(); ++level) {
+			cpu_set_kernel_level(CPU_KERNEL_JPEG_IDCT, level);
+			cpu_set_kernel_level(CPU_KERNEL_JPEG_COLOR_CONVERT, level);
+			bench->scale_denom = scale_denom;
+			bench->next_tile = 0;
+			snprintf(label, sizeof(label), "decode_tile %s%s [%s]", name, (scale_denom == 2) ? " (1/2 scale)" : "",
+			         cpu_get_level_name(level));
+			run_kernel(label, decode_kernel, bench, bytes_per_op);
+		}
+	}
+	cpu_set_kernel_level(CPU_KERNEL_JPEG_IDCT, old_idct_level);
+	cpu_set_kernel_level(CPU_KERNEL_JPEG_COLOR_CONVERT, old_color_convert_level);
+}
+
+// A tile with some structure (so that it compresses like tissue does, more or less), encoded like pyramid.c does.
+static u8* create_synthetic_jpeg_tile(u64* size) {
+	u8* pixels = (u8*) malloc(KERNELBENCH_TILE_DIM * KERNELBENCH_TILE_DIM * 4);
+	u32 random_state = 12345;
+	for (i32 y = 0; y < KERNELBENCH_TILE_DIM; ++y) {
+		for (i32 x = 0; x < KERNELBENCH_TILE_DIM; ++x) {
+			random_state = random_state * 1664525u + 1013904223u;
+			u8 noise = (u8)(random_state >> 27);
+			u8* p = pixels + (y * KERNELBENCH_TILE_DIM + x) * 4;
+			bool32 is_nucleus = (((x / 24) + (y / 24)) % 3 == 0);
+			p[0] = (u8)(is_nucleus ? 140 : 210) + noise;
+			p[1] = (u8)(is_nucleus ? 60 : 150 + (x + y) % 32) + noise;
+			p[2] = (u8)(is_nucleus ? 110 : 200) + noise;
+			p[3] = 255;
+		}
+	}
+	u8* jpeg = encode_tile(pixels, KERNELBENCH_TILE_DIM, KERNELBENCH_TILE_DIM, size);
+	free(pixels);
+	return jpeg;
+}
+
+// rgb_to_bgra_row()
+
+typedef struct {
+	u8* src;
+	u8* dest;
+} swizzle_bench_t;
+
+static void swizzle_kernel(void* userdata) {
+	swizzle_bench_t* bench = (swizzle_bench_t*) userdata;
+	rgb_to_bgra_row(bench->dest, bench->src, KERNELBENCH_TILE_DIM);
+	kernelbench_sink += bench->dest[0];
+}
+
+// tiff_swap_integers_to_u64(), e.g. the tile offsets of a big-endian TIFF
+
+#define KERNELBENCH_SWAP_COUNT 65536
+
+typedef struct {
+	u32* source;
+	u64* dest;
+} swap_bench_t;
+
+static void swap_kernel(void* userdata) {
+	swap_bench_t* bench = (swap_bench_t*) userdata;
+	tiff_swap_integers_to_u64(bench->dest, bench->source, KERNELBENCH_SWAP_COUNT, sizeof(u32));
+	kernelbench_sink += bench->dest[0];
+}
+
+// tiff_clear_pixels_outside_image(), for a tile at the bottom right corner of the image
+
+typedef struct {
+	u8* pixels;
+} trim_bench_t;
+
+static void trim_kernel(void* userdata) {
+	trim_bench_t* bench = (trim_bench_t*) userdata;
+	tiff_clear_pixels_outside_image(bench->pixels, KERNELBENCH_TILE_DIM * 4, KERNELBENCH_TILE_DIM, KERNELBENCH_TILE_DIM,
+	                                KERNELBENCH_TILE_DIM * 2 / 3, KERNELBENCH_TILE_DIM * 2 / 3);
+	kernelbench_sink += bench->pixels[0];
+}
+
+// tiff_serialize() / tiff_deserialize()
+
+typedef struct {
+	tiff_t* tiff;
+	push_buffer_t serialized;
+} serialize_bench_t;
+
+static void serialize_kernel(void* userdata) {
+	serialize_bench_t* bench = (serialize_bench_t*) userdata;
+	push_buffer_t buffer = {0};
+	tiff_serialize(bench->tiff, &buffer);
+	kernelbench_sink += buffer.used_size;
+	free(buffer.raw_memory);
+}
+
+static void deserialize_kernel(void* userdata) {
+	serialize_bench_t* bench = (serialize_bench_t*) userdata;
+	tiff_t tiff = {0};
+	if (tiff_deserialize(&tiff, bench->serialized.data, bench->serialized.used_size)) {
+		kernelbench_sink += tiff.level_count;
+		tiff.is_remote = true; // so that tiff_destroy() knows how the IFDs were allocated
+		tiff_destroy(&tiff);
+	}
+}
+
+// find_end_of_http_headers()
+
+typedef struct {
+	u8* data;
+	u64 size;
+} headers_bench_t;
+
+static void headers_kernel(void* userdata) {
+	headers_bench_t* bench = (headers_bench_t*) userdata;
+	kernelbench_sink += (u64)find_end_of_http_headers(bench->data, bench->size);
+}
+
+// yxml: tokenizing an ASAP annotation file, and converting the coordinates (like parse_asap_xml_annotations())
+
+typedef struct {
+	char* doc;
+	u64 size;
+	yxml_t* x;
+} xml_bench_t;
+
+#define KERNELBENCH_YXML_STACK_SIZE KILOBYTES(32)
+
+static void xml_kernel(void* userdata) {
+	xml_bench_t* bench = (xml_bench_t*) userdata;
+	yxml_t* x = bench->x;
+	yxml_init(x, x + 1, KERNELBENCH_YXML_STACK_SIZE);
+	char attrbuf[128];
+	char* attrcur = attrbuf;
+	double sum = 0.0;
+	for (u64 pos = 0; pos < bench->size; ++pos) {
+		yxml_ret_t r = yxml_parse(x, bench->doc[pos]);
+		if (r == YXML_OK) continue;
+		if (r < 0) break;
+		if (r == YXML_ATTRSTART) {
+			attrcur = attrbuf;
+		} else if (r == YXML_ATTRVAL) {
+			for (char* tmp = x->data; *tmp && attrcur < attrbuf + sizeof(attrbuf) - 1; ++tmp) {
+				*attrcur++ = *tmp;
+			}
+		} else if (r == YXML_ATTREND) {
+			*attrcur = '\0';
+			if (x->attr[0] == 'X' || x->attr[0] == 'Y') {
+				sum += atof(attrbuf);
+			}
+		}
+	}
+	kernelbench_sink += (u64)sum;
+}
+
+// TLS records
+
+typedef struct {
+	struct TLSContext* sender; // the server
+	struct TLSContext* receiver; // the client
+	u8* plaintext;
+	u8* record; // sealed by the sender, with sequence number 0
+	u32 record_size;
+	u8* received;
+} tls_record_bench_t;
+
+// One end of a TLS 1.3 connection, with fixed keys instead of a handshake (both directions use the same keys, so
+// that the receiver can open what the sender seals).
+static struct TLSContext* create_tls_record_context(u16 cipher, bool32 is_server) {
+	static const u8 key[32] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+	                            17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32 };
+	static const u8 iv[12] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12 };
+	struct TLSContext* context = tls_create_context(is_server, TLS_V13);
+	context->cipher = cipher;
+	context->connection_status = 0xFF;
+	context->cipher_spec_set = 1;
+	memcpy(context->crypto.ctx_local_mac.local_iv, iv, sizeof(iv));
+	memcpy(context->crypto.ctx_remote_mac.remote_iv, iv, sizeof(iv));
+	_private_tls_crypto_create(context, _private_tls_key_length(context), (u8*)key, (u8*)iv, (u8*)key, (u8*)iv);
+	return context;
+}
+
+static void tls_seal_kernel(void* userdata) {
+	tls_record_bench_t* bench = (tls_record_bench_t*) userdata;
+	bench->sender->local_sequence_number = 0;
+	tls_write(bench->sender, bench->plaintext, KERNELBENCH_TLS_RECORD_SIZE);
+	unsigned int size = 0;
+	const u8* record = tls_get_write_buffer(bench->sender, &size);
+	kernelbench_sink += record[size - 1];
+	tls_buffer_clear(bench->sender);
+}
+
+static void tls_open_kernel(void* userdata) {
+	tls_record_bench_t* bench = (tls_record_bench_t*) userdata;
+	bench->receiver->remote_sequence_number = 0;
+	tls_consume_stream(bench->receiver, bench->record, bench->record_size, NULL);
+	kernelbench_sink += tls_read(bench->receiver, bench->received, KERNELBENCH_TLS_RECORD_SIZE);
+}
+
+// The AES-GCM implementation is chosen when the keys are set, so the contexts are created again for each level.
+static void run_tls_record_kernels(const char* cipher_name, u16 cipher, i32 cpu_kernel) {
+	tls_record_bench_t bench = { .plaintext = (u8*) malloc(KERNELBENCH_TLS_RECORD_SIZE),
+	                             .received = (u8*) malloc(KERNELBENCH_TLS_RECORD_SIZE) };
+	for (i32 i = 0; i < KERNELBENCH_TLS_RECORD_SIZE; ++i) {
+		bench.plaintext[i] = (u8)(i * 7);
+	}
+	char label[128];
+	i32 old_level = cpu_get_kernel_level(cpu_kernel);
+	for (i32 level = CPU_LEVEL_SCALAR; level <= cpu_get_kernel_max_level(cpu_kernel); ++level) {
+		cpu_set_kernel_level(cpu_kernel, level);
+		bench.sender = create_tls_record_context(cipher, true);
+		bench.receiver = create_tls_record_context(cipher, false);
+		tls_write(bench.sender, bench.plaintext, KERNELBENCH_TLS_RECORD_SIZE);
+		const u8* record = tls_get_write_buffer(bench.sender, &bench.record_size);
+		bench.record = (u8*) malloc(bench.record_size);
+		memcpy(bench.record, record, bench.record_size);
+		tls_buffer_clear(bench.sender);
+
+		snprintf(label, sizeof(label), "TLS seal %s (16 KB record) [%s]", cipher_name, cpu_get_level_name(level));
+		run_kernel(label, tls_seal_kernel, &bench, KERNELBENCH_TLS_RECORD_SIZE);
+		snprintf(label, sizeof(label), "TLS open %s (16 KB record) [%s]", cipher_name, cpu_get_level_name(level));
+		run_kernel(label, tls_open_kernel, &bench, KERNELBENCH_TLS_RECORD_SIZE);
+		bench.receiver->remote_sequence_number = 0;
+		tls_consume_stream(bench.receiver, bench.record, bench.record_size, NULL);
+		if (tls_read(bench.receiver, bench.received, KERNELBENCH_TLS_RECORD_SIZE) != KERNELBENCH_TLS_RECORD_SIZE ||
+		    memcmp(bench.received, bench.plaintext, KERNELBENCH_TLS_RECORD_SIZE) != 0) {
+			fprintf(stderr, "%s [%s]: the record did not open to the plaintext\n", cipher_name,
+			        cpu_get_level_name(level));
+		}
+
+		free(bench.record);
+		tls_destroy_context(bench.sender);
+		tls_destroy_context(bench.receiver);
+	}
+	cpu_set_kernel_level(cpu_kernel, old_level);
+	free(bench.plaintext);
+	free(bench.received);
+}
+
+static char* create_synthetic_annotation_xml(u64* size) {
+	char* doc = NULL; // sb
+	char line[256];
+	i32 length = snprintf(line, sizeof(line), "<?xml version=\"1.0\"?>\n<ASAP_Annotations>\n<Annotations>\n");
+	memcpy(sb_add(doc, length), line, length);
+	for (i32 i = 0; i < KERNELBENCH_XML_ANNOTATIONS; ++i) {
+		length = snprintf(line, sizeof(line), "<Annotation Name=\"Annotation %d\" Type=\"Polygon\" PartOfGroup=\"Tumor\" "
+		                                      "Color=\"#F4FA58\">\n<Coordinates>\n", i);
+		memcpy(sb_add(doc, length), line, length);
+		for (i32 j = 0; j < KERNELBENCH_XML_COORDINATES_PER_ANNOTATION; ++j) {
+			length = snprintf(line, sizeof(line), "<Coordinate Order=\"%d\" X=\"%.4f\" Y=\"%.4f\" />\n", j,
+			                  10000.0 + i * 13.7 + j * 0.731, 20000.0 + i * 9.1 - j * 0.517);
+			memcpy(sb_add(doc, length), line, length);
+		}
+		length = snprintf(line, sizeof(line), "</Coordinates>\n</Annotation>\n");
+		memcpy(sb_add(doc, length), line, length);
+	}
+	length = snprintf(line, sizeof(line), "</Annotations>\n<AnnotationGroups>\n<Group Name=\"Tumor\" PartOfGroup=\"None\" "
+	                                      "Color=\"#F4FA58\">\n<Attributes />\n</Group>\n</AnnotationGroups>\n"
+	                                      "</ASAP_Annotations>\n");
+	memcpy(sb_add(doc, length), line, length);
+	*size = sb_count(doc);
+	return doc;
+}
+
+// Takes some tiles from the middle of the base level, to avoid the (often blank) border of the slide.
+static bool32 load_slide_tiles(tiff_t* tiff, decode_bench_t* bench) {
+	tiff_ifd_t* ifd = tiff->main_image ? tiff->main_image : tiff->level_images;
+	if (!ifd || ifd->compression != 7 || !tiff_load_tile_tables(tiff, ifd) || ifd->tile_count == 0) {
+		return false;
+	}
+	bench->jpeg_tables = ifd->jpeg_tables;
+	bench->jpeg_tables_length = (u32)ifd->jpeg_tables_length;
+	bench->is_YCbCr = (ifd->color_space == TIFF_PHOTOMETRIC_YCBCR);
+	bench->pitch = ifd->tile_width * 4;
+	bench->pixels = (u8*) malloc((u64)bench->pitch * ifd->tile_height);
+	bench->tiles = (u8**) calloc(KERNELBENCH_SLIDE_TILES, sizeof(u8*));
+	bench->tile_sizes = (u32*) calloc(KERNELBENCH_SLIDE_TILES, sizeof(u32));
+	u64 middle = (ifd->height_in_tiles / 2) * ifd->width_in_tiles + ifd->width_in_tiles / 2;
+	for (u64 i = middle; i < ifd->tile_count && bench->tile_count < KERNELBENCH_SLIDE_TILES; ++i) {
+		u64 size = ifd->tile_byte_counts[i];
+		if (ifd->tile_offsets[i] == 0 || size == 0) continue;
+		u8* data = (u8*) malloc(size);
+		if (tiff_read_at_offset(tiff, data, ifd->tile_offsets[i], size) != 1) {
+			free(data);
+			continue;
+		}
+		bench->tiles[bench->tile_count] = data;
+		bench->tile_sizes[bench->tile_count] = (u32)size;
+		++bench->tile_count;
+	}
+	return bench->tile_count > 0;
+}
+
+int main(int argc, char* argv[]) {
+	cpu_dispatch_init();
+	jpeg_decoder_state_t* decoder = jpeg_decoder_create_state();
+
+	// Decoding
+	u64 synthetic_size = 0;
+	u8* synthetic_tile = create_synthetic_jpeg_tile(&synthetic_size);
+	u32 synthetic_tile_size = (u32)synthetic_size;
+	decode_bench_t synthetic = { .decoder = decoder, .tiles = &synthetic_tile, .tile_sizes = &synthetic_tile_size,
+	                             .tile_count = 1, .is_YCbCr = true, .pitch = KERNELBENCH_TILE_DIM * 4 };
+	synthetic.pixels = (u8*) malloc(KERNELBENCH_TILE_DIM * KERNELBENCH_TILE_DIM * 4);
+	run_decode_kernels("(synthetic 512x512)", &synthetic);
+
+	tiff_t* slides = (tiff_t*) calloc(ATLEAST(1, argc - 1), sizeof(tiff_t));
+	bool32* is_slide_open = (bool32*) calloc(ATLEAST(1, argc - 1), sizeof(bool32));
+	for (i32 i = 1; i < argc; ++i) {
+		tiff_t* tiff = slides + (i - 1);
+		if (!open_tiff_file(tiff, argv[i])) {
+			fprintf(stderr, "Could not open %s\n", argv[i]);
+			continue;
+		}
+		is_slide_open[i - 1] = true;
+		decode_bench_t bench = { .decoder = decoder };
+		if (load_slide_tiles(tiff, &bench)) {
+			const char* basename = strrchr(argv[i], '/');
+			char label[128];
+			snprintf(label, sizeof(label), "(%s)", basename ? basename + 1 : argv[i]);
+			run_decode_kernels(label, &bench);
+		} else {
+			fprintf(stderr, "%s: no JPEG tiles found in the base level\n", argv[i]);
+		}
+		for (i32 j = 0; j < bench.tile_count; ++j) {
+			free(bench.tiles[j]);
+		}
+		free(bench.tiles);
+		free(bench.tile_sizes);
+		free(bench.pixels);
+	}
+
+	// Pixel conversions
+	swizzle_bench_t swizzle = { .src = (u8*) calloc(1, KERNELBENCH_TILE_DIM * 3 + 4),
+	                            .dest = (u8*) malloc(KERNELBENCH_TILE_DIM * 4) };
+	run_kernel_at_each_level("rgb_to_bgra_row (512 pixels)", CPU_KERNEL_RGB_SWIZZLE, swizzle_kernel, &swizzle,
+	                         KERNELBENCH_TILE_DIM * 3);
+	trim_bench_t trim = { .pixels = (u8*) malloc(KERNELBENCH_TILE_DIM * KERNELBENCH_TILE_DIM * 4) };
+	run_kernel("tiff_clear_pixels_outside_image (corner tile)", trim_kernel, &trim,
+	           KERNELBENCH_TILE_DIM * KERNELBENCH_TILE_DIM * 4);
+	swap_bench_t swap = { .source = (u32*) calloc(KERNELBENCH_SWAP_COUNT, sizeof(u32)),
+	                      .dest = (u64*) malloc(KERNELBENCH_SWAP_COUNT * sizeof(u64)) };
+	run_kernel_at_each_level("tiff_swap_integers_to_u64 (64K x 32-bit)", CPU_KERNEL_BYTE_SWAP, swap_kernel, &swap,
+	                         KERNELBENCH_SWAP_COUNT * sizeof(u32));
+
+	// Slide headers
+	for (i32 i = 1; i < argc; ++i) {
+		if (!is_slide_open[i - 1]) continue;
+		serialize_bench_t bench = { .tiff = slides + (i - 1) };
+		tiff_serialize(bench.tiff, &bench.serialized);
+		const char* basename = strrchr(argv[i], '/');
+		char label[128];
+		snprintf(label, sizeof(label), "tiff_serialize (%s)", basename ? basename + 1 : argv[i]);
+		run_kernel(label, serialize_kernel, &bench, bench.serialized.used_size);
+		snprintf(label, sizeof(label), "tiff_deserialize (%s)", basename ? basename + 1 : argv[i]);
+		run_kernel(label, deserialize_kernel, &bench, bench.serialized.used_size);
+		free(bench.serialized.raw_memory);
+	}
+
+	// HTTP
+	static const char request_headers[] = "POST /tiles HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n"
+	                                      "Content-type: application/octet-stream\r\nContent-length: 48\r\n\r\n";
+	headers_bench_t headers = { .data = (u8*) request_headers, .size = sizeof(request_headers) - 1 };
+	run_kernel("find_end_of_http_headers (request)", headers_kernel, &headers, headers.size);
+	headers_bench_t incomplete = { .data = (u8*) malloc(4096), .size = 4096 };
+	memset(incomplete.data, 'a', incomplete.size);
+	run_kernel("find_end_of_http_headers (4 KB, incomplete)", headers_kernel, &incomplete, incomplete.size);
+
+	// TLS
+	tls_init();
+	run_tls_record_kernels("AES-128-GCM", TLS_AES_128_GCM_SHA256, CPU_KERNEL_AES_GCM);
+	run_tls_record_kernels("AES-256-GCM", TLS_AES_256_GCM_SHA384, CPU_KERNEL_AES_GCM);
+	run_tls_record_kernels("ChaCha20-Poly1305", TLS_CHACHA20_POLY1305_SHA256, CPU_KERNEL_CHACHA20);
+
+	// Annotations
+	xml_bench_t xml = { .x = (yxml_t*) malloc(sizeof(yxml_t) + KERNELBENCH_YXML_STACK_SIZE) };
+	xml.doc = create_synthetic_annotation_xml(&xml.size);
+	char label[128];
+	snprintf(label, sizeof(label), "yxml parse (%d coordinates)",
+	         KERNELBENCH_XML_ANNOTATIONS * KERNELBENCH_XML_COORDINATES_PER_ANNOTATION);
+	run_kernel(label, xml_kernel, &xml, xml.size);
+
+	sb_free(xml.doc);
+	free(xml.x);
+	free(incomplete.data);
+	free(trim.pixels);
+	free(swap.source);
+	free(swap.dest);
+	free(swizzle.src);
+	free(swizzle.dest);
+	for (i32 i = 1; i < argc; ++i) {
+		if (is_slide_open[i - 1]) tiff_destroy(slides + (i - 1));
+	}
+	free(slides);
+	free(is_slide_open);
+	free(synthetic.pixels);
+	free(synthetic_tile);
+	jpeg_decoder_destroy_state(decoder);
+	return 0;
+}
@@ -33362,12 +33362,21 @@ int gcm_init(gcm_state *gcm, int cipher,
 #ifdef LTC_GCM_TABLES
    /* setup tables */
 
-   /* generate the first table as it has no shifting (from which we make the other tables) */
+   /* generate the first table as it has no shifting (from which we make the other tables); the product is linear in
+      B, so only the single bits need a full multiplication, the other entries are sums of those */
    zeromem(B, 16);
-   for (y = 0; y < 256; y++) {
+   zeromem(&gcm->PC[0][0][0], 16);
+   for (y = 1; y < 256; y <<= 1) {
         B[0] = y;
         gcm_gf_mult(gcm->H, B, &gcm->PC[0][y][0]);
    }
+   for (y = 3; y < 256; y++) {
+        if ((y & (y - 1)) == 0) continue;
+        t = y & -y;
+        for (z = 0; z < 16; z++) {
+            gcm->PC[0][y][z] = gcm->PC[0][y ^ t][z] ^ gcm->PC[0][t][z];
+        }
+   }
 
    /* now generate the rest of the tables based the previous table */
    for (x = 1; x < 16; x++) {
@@ -0,0 +1,620 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Load test for tlsserver: simulates many viewers browsing a set of slides at once.
+// Each simulated viewer opens a keep-alive connection, requests the header of a slide, and then keeps requesting
+// batches of tiles as fast as the server answers, before moving on to the next slide of the set. The tiles are either
+// requested through the slide handle (POST /tiles), or by byte range (GET /slide/<slide>/<offset>/<size>/..., like
+// the viewer does for servers that don't hand out slide handles). With the 'pan' pattern the batches are neighbouring
+// blocks of tiles, like a viewer panning across a level and now and then zooming; with 'random' they are random
+// tiles from a random level.
+// Reports requests/s, MB/s, the latency percentiles per kind of request, and the cost of the TLS handshakes (use
+// --requests-per-connection to make the viewers reconnect regularly).
+//
+// Usage: tlsloadtest <host> <port> <slide>[,<slide>...] [client_count] [seconds] [--pattern pan|random]
+//                    [--api tiles|ranges] [--requests-per-connection N] [--requests-per-slide N]
+
+#ifndef IS_SERVER
+#define IS_SERVER 1 // should be defined by the command-line because we also need to compile e.g. tiff.c which is shared
+#endif
+
+#include "common.h"
+#undef MIN
+#undef MAX // redefined by tlse.c
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#endif
+
+#define LTM_DESC
+#define TLS_AMALGAMATION
+#define LTC_NO_ASM
+#define TLS_CPU_DISPATCH
+#include "tlse.c"
+
+#include "tiff.h"
+
+#define LOADTEST_DEFAULT_CLIENT_COUNT 40
+#define LOADTEST_DEFAULT_SECONDS 10
+#define LOADTEST_DEFAULT_REQUESTS_PER_SLIDE 200
+#define LOADTEST_MAX_SLIDES 64
+#define LOADTEST_BATCH_WIDTH 4 // the 'pan' pattern requests blocks of LOADTEST_BATCH_WIDTH x LOADTEST_BATCH_HEIGHT tiles
+#define LOADTEST_BATCH_HEIGHT 2
+#define LOADTEST_TILES_PER_REQUEST (LOADTEST_BATCH_WIDTH * LOADTEST_BATCH_HEIGHT)
+
+typedef enum { LOADTEST_PATTERN_PAN, LOADTEST_PATTERN_RANDOM } loadtest_pattern_enum;
+typedef enum { LOADTEST_API_TILES, LOADTEST_API_RANGES } loadtest_api_enum;
+
+typedef struct {
+	const char* hostname;
+	const char* portno;
+	const char* slides[LOADTEST_MAX_SLIDES];
+	i32 slide_count;
+	loadtest_pattern_enum pattern;
+	loadtest_api_enum api;
+	i32 requests_per_connection; // 0 = keep the connection open
+	i32 requests_per_slide;
+	bool32 resume_sessions; // reconnect with the session ticket of the previous connection
+} loadtest_config_t;
+
+typedef struct {
+	i32 index;
+	loadtest_config_t* config;
+	double end_time;
+	double* header_latencies; // stretchy buffer, in seconds
+	double* tile_latencies; // stretchy buffer, in seconds
+	double* handshake_times; // stretchy buffer, in seconds
+	double* resumed_handshake_times; // stretchy buffer, in seconds (also in handshake_times)
+	u8 session_ticket[TLS_SESSION_TICKET_MAX_SIZE];
+	i32 session_ticket_size;
+	i64 bytes_received;
+	i64 tiles_received;
+	i32 error_count;
+} loadtest_client_t;
+
+typedef struct {
+	int socket;
+	struct TLSContext* context;
+	u8* buffer; // stretchy buffer with the received plaintext
+} loadtest_connection_t;
+
+double get_seconds() {
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+bool32 send_pending_tls(loadtest_connection_t* connection) {
+	unsigned int out_buffer_len = 0;
+	const unsigned char* out_buffer = tls_get_write_buffer(connection->context, &out_buffer_len);
+	bool32 ok = true;
+	while (out_buffer && out_buffer_len > 0) {
+		int res = send(connection->socket, (char*)out_buffer, out_buffer_len, 0);
+		if (res <= 0) {
+			ok = false;
+			break;
+		}
+		out_buffer += res;
+		out_buffer_len -= res;
+	}
+	tls_buffer_clear(connection->context);
+	return ok;
+}
+
+// Receives more data from the server, and appends whatever plaintext comes out of it to the buffer.
+bool32 receive_tls(loadtest_connection_t* connection) {
+	u8 message[0xFFFF];
+	int read_size = recv(connection->socket, (char*)message, sizeof(message), 0);
+	if (read_size <= 0 || tls_consume_stream(connection->context, message, read_size, NULL) < 0) {
+		return false;
+	}
+	send_pending_tls(connection);
+	if (tls_established(connection->context) == 1) {
+		u8 plaintext[0xFFFF];
+		int size;
+		while ((size = tls_read(connection->context, plaintext, sizeof(plaintext))) > 0) {
+			memcpy(sb_add(connection->buffer, size), plaintext, size);
+		}
+	}
+	return true;
+}
+
+bool32 open_loadtest_connection(loadtest_connection_t* connection, const char* hostname, const char* portno,
+                                u8* session_ticket, i32 session_ticket_size) {
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	struct addrinfo* addresses = NULL;
+	if (getaddrinfo(hostname, portno, &hints, &addresses) != 0) {
+		return false;
+	}
+	for (struct addrinfo* address = addresses; address; address = address->ai_next) {
+		int sock = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+		if (sock < 0) continue;
+		if (connect(sock, address->ai_addr, address->ai_addrlen) == 0) {
+			connection->socket = sock;
+			break;
+		}
+#ifdef _WIN32
+		closesocket(sock);
+#else
+		close(sock);
+#endif
+	}
+	freeaddrinfo(addresses);
+	if (connection->socket < 0) {
+		return false;
+	}
+	int no_delay = 1;
+	setsockopt(connection->socket, IPPROTO_TCP, TCP_NODELAY, (char*)&no_delay, sizeof(no_delay));
+
+	connection->context = tls_create_context(0, TLS_V13);
+	tls_sni_set(connection->context, hostname);
+	if (session_ticket_size > 0) {
+		tls_set_session_ticket(connection->context, session_ticket, session_ticket_size);
+	}
+	tls_client_connect(connection->context);
+	send_pending_tls(connection);
+	while (tls_established(connection->context) != 1) {
+		if (!receive_tls(connection)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void close_loadtest_connection(loadtest_connection_t* connection) {
+	if (connection->context) {
+		tls_destroy_context(connection->context);
+	}
+	if (connection->socket >= 0) {
+#ifdef _WIN32
+		closesocket(connection->socket);
+#else
+		close(connection->socket);
+#endif
+	}
+	sb_free(connection->buffer);
+	*connection = (loadtest_connection_t){ .socket = -1 };
+}
+
+// Sends a request and waits for the complete response. Returns the HTTP status code, or 0 if the connection failed.
+// The response content is left at the start of the buffer.
+i32 do_loadtest_request(loadtest_connection_t* connection, u8* request, i32 request_size,
+                        i64* content_length, u32* slide_handle) {
+	if (connection->buffer) {
+		sb_raw_count(connection->buffer) = 0;
+	}
+	if (tls_write(connection->context, request, request_size) != request_size || !send_pending_tls(connection)) {
+		return 0;
+	}
+	i64 header_size;
+	while ((header_size = find_end_of_http_headers(connection->buffer, sb_count(connection->buffer))) <= 0) {
+		if (!receive_tls(connection)) return 0;
+	}
+	char* headers = alloca(header_size + 1);
+	memcpy(headers, connection->buffer, header_size);
+	headers[header_size] = '\0';
+	i32 status = 0;
+	sscanf(headers, "HTTP/1.1 %d", &status);
+	*content_length = 0;
+	char* field = strstr(headers, "Content-length:");
+	if (field) {
+		*content_length = atoll(field + strlen("Content-length:"));
+	}
+	field = strstr(headers, "Slide-handle:");
+	if (field && slide_handle) {
+		*slide_handle = (u32)atol(field + strlen("Slide-handle:"));
+	}
+	while (sb_count(connection->buffer) < header_size + *content_length) {
+		if (!receive_tls(connection)) return 0;
+	}
+	memmove(connection->buffer, connection->buffer + header_size, *content_length);
+	return status;
+}
+
+// Where a simulated viewer is looking, for the 'pan' pattern.
+typedef struct {
+	i32 level;
+	i32 tile_x;
+	i32 tile_y;
+	i32 direction_x;
+	i32 direction_y;
+} loadtest_view_t;
+
+u32 next_random(u32* random_state) {
+	*random_state = *random_state * 1664525u + 1013904223u;
+	return *random_state >> 8;
+}
+
+void start_loadtest_view(tiff_t* tiff, loadtest_view_t* view, u32* random_state) {
+	// Start somewhere in the middle of the pyramid, like a viewer that has just zoomed in once or twice.
+	view->level = tiff->level_count / 2;
+	while (view->level > 0 && tiff->level_images[view->level].tile_count == 0) --view->level;
+	tiff_ifd_t* ifd = tiff->level_images + view->level;
+	view->tile_x = (i32)(next_random(random_state) % ATLEAST(1, ifd->width_in_tiles));
+	view->tile_y = (i32)(next_random(random_state) % ATLEAST(1, ifd->height_in_tiles));
+	view->direction_x = 1;
+	view->direction_y = 0;
+}
+
+// Picks the tiles for the next batch. Returns how many tiles were chosen, from which level.
+u32 choose_loadtest_tiles(loadtest_pattern_enum pattern, tiff_t* tiff, loadtest_view_t* view, u32* random_state,
+                          u32* tile_indices) {
+	if (pattern == LOADTEST_PATTERN_RANDOM) {
+		// A batch of random tiles from a random level.
+		do {
+			view->level = (i32)(next_random(random_state) % tiff->level_count);
+		} while (tiff->level_images[view->level].tile_count == 0);
+		tiff_ifd_t* ifd = tiff->level_images + view->level;
+		u32 tile_count = (ifd->tile_count < LOADTEST_TILES_PER_REQUEST) ? (u32)ifd->tile_count : LOADTEST_TILES_PER_REQUEST;
+		for (u32 i = 0; i < tile_count; ++i) {
+			tile_indices[i] = next_random(random_state) % ifd->tile_count;
+		}
+		return tile_count;
+	}
+
+	// Panning: the block next to the previous one. Now and then turn, or zoom in or out around the same spot.
+	u32 r = next_random(random_state);
+	if (r % 16 == 0) {
+		i32 new_level = view->level + ((next_random(random_state) & 1) ? 1 : -1);
+		if (new_level >= 0 && new_level < (i32)tiff->level_count && tiff->level_images[new_level].tile_count > 0) {
+			if (new_level > view->level) {
+				view->tile_x /= 2;
+				view->tile_y /= 2;
+			} else {
+				view->tile_x *= 2;
+				view->tile_y *= 2;
+			}
+			view->level = new_level;
+		}
+	} else if (r % 16 == 1) {
+		do {
+			view->direction_x = (i32)(next_random(random_state) % 3) - 1;
+			view->direction_y = (i32)(next_random(random_state) % 3) - 1;
+		} while (view->direction_x == 0 && view->direction_y == 0);
+	} else {
+		view->tile_x += view->direction_x * LOADTEST_BATCH_WIDTH;
+		view->tile_y += view->direction_y * LOADTEST_BATCH_HEIGHT;
+	}
+	tiff_ifd_t* ifd = tiff->level_images + view->level;
+	i32 max_tile_x = ATLEAST(0, (i32)ifd->width_in_tiles - LOADTEST_BATCH_WIDTH);
+	i32 max_tile_y = ATLEAST(0, (i32)ifd->height_in_tiles - LOADTEST_BATCH_HEIGHT);
+	if (view->tile_x < 0 || view->tile_x > max_tile_x) view->direction_x = -view->direction_x; // bounce off the edges
+	if (view->tile_y < 0 || view->tile_y > max_tile_y) view->direction_y = -view->direction_y;
+	view->tile_x = CLAMP(view->tile_x, 0, max_tile_x);
+	view->tile_y = CLAMP(view->tile_y, 0, max_tile_y);
+	u32 tile_count = 0;
+	for (i32 y = view->tile_y; y < view->tile_y + LOADTEST_BATCH_HEIGHT && y < (i32)ifd->height_in_tiles; ++y) {
+		for (i32 x = view->tile_x; x < view->tile_x + LOADTEST_BATCH_WIDTH && x < (i32)ifd->width_in_tiles; ++x) {
+			tile_indices[tile_count++] = (u32)(y * ifd->width_in_tiles + x);
+		}
+	}
+	return tile_count;
+}
+
+void* loadtest_client_proc(void* parameter) {
+	loadtest_client_t* client = (loadtest_client_t*) parameter;
+	loadtest_config_t* config = client->config;
+	loadtest_connection_t connection = { .socket = -1 };
+	tiff_t tiff = {0};
+	u32 slide_handle = 0;
+	bool32 has_header = false;
+	i32 slide_index = client->index % config->slide_count;
+	i32 requests_on_connection = 0;
+	i32 requests_on_slide = 0;
+	loadtest_view_t view = {0};
+	u32 random_state = 0x9E3779B9u * (u32)(client->index + 1);
+
+	while (get_seconds() < client->end_time) {
+		if (connection.context && config->requests_per_connection > 0 &&
+		    requests_on_connection >= config->requests_per_connection) {
+			if (config->resume_sessions) {
+				i32 ticket_size = tls_get_session_ticket(connection.context, client->session_ticket,
+				                                         sizeof(client->session_ticket));
+				if (ticket_size > 0) client->session_ticket_size = ticket_size;
+			}
+			close_loadtest_connection(&connection);
+		}
+		if (!connection.context) {
+			double handshake_start = get_seconds();
+			if (!open_loadtest_connection(&connection, config->hostname, config->portno, client->session_ticket,
+			                              client->session_ticket_size)) {
+				++client->error_count;
+				client->session_ticket_size = 0; // (perhaps the ticket is the problem)
+				close_loadtest_connection(&connection);
+				continue;
+			}
+			double handshake_time = get_seconds() - handshake_start;
+			sb_push(client->handshake_times, handshake_time);
+			if (tls_is_resumed(connection.context)) {
+				sb_push(client->resumed_handshake_times, handshake_time);
+			}
+			requests_on_connection = 0;
+		}
+		if (has_header && requests_on_slide >= config->requests_per_slide) {
+			// Move on to the next slide of the set.
+			tiff_destroy(&tiff);
+			memset(&tiff, 0, sizeof(tiff));
+			has_header = false;
+			slide_handle = 0;
+			slide_index = (slide_index + 1) % config->slide_count;
+		}
+		const char* filename = config->slides[slide_index];
+
+		u8 request[4096];
+		i32 request_size = 0;
+		bool32 is_header_request = !has_header;
+		u32 batch_tile_count = 0;
+		if (is_header_request) {
+			request_size = snprintf((char*)request, sizeof(request),
+			                        "GET /slide/%s/header HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n",
+			                        filename, config->hostname);
+		} else {
+			u32 tile_indices[LOADTEST_TILES_PER_REQUEST];
+			u32 tile_count = choose_loadtest_tiles(config->pattern, &tiff, &view, &random_state, tile_indices);
+			tiff_ifd_t* ifd = tiff.level_images + view.level;
+			if (config->api == LOADTEST_API_TILES && slide_handle != 0) {
+				tile_request_t tile_request = { .magic = TILE_REQUEST_MAGIC, .slide_handle = slide_handle,
+				                                .level = (u32)view.level, .tile_count = tile_count };
+				u32 body_size = sizeof(tile_request) + tile_count * sizeof(u32);
+				request_size = snprintf((char*)request, sizeof(request),
+				                        "POST /tiles HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n"
+				                        "Content-type: application/octet-stream\r\nContent-length: %u\r\n\r\n",
+				                        config->hostname, body_size);
+				memcpy(request + request_size, &tile_request, sizeof(tile_request));
+				memcpy(request + request_size + sizeof(tile_request), tile_indices, tile_count * sizeof(u32));
+				request_size += body_size;
+			} else {
+				// Byte range batch, in the format of build_batch_uri() (tlsclient.c). Empty tiles aren't requested.
+				request_size = snprintf((char*)request, sizeof(request), "GET /slide/%s", filename);
+				u32 range_count = 0;
+				for (u32 i = 0; i < tile_count; ++i) {
+					u64 size = ifd->tile_byte_counts[tile_indices[i]];
+					if (ifd->tile_offsets[tile_indices[i]] == 0 || size == 0) continue;
+					request_size += snprintf((char*)request + request_size, sizeof(request) - request_size, "/%llu/%llu",
+					                         (unsigned long long)ifd->tile_offsets[tile_indices[i]],
+					                         (unsigned long long)size);
+					++range_count;
+				}
+				if (range_count == 0) {
+					++requests_on_slide; // nothing to see here, keep moving
+					continue;
+				}
+				request_size += snprintf((char*)request + request_size, sizeof(request) - request_size,
+				                         " HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n", config->hostname);
+			}
+			batch_tile_count = tile_count;
+		}
+
+		double start_time = get_seconds();
+		i64 content_length = 0;
+		i32 status = do_loadtest_request(&connection, request, request_size, &content_length, &slide_handle);
+		double latency = get_seconds() - start_time;
+		++requests_on_connection;
+		if (status == 0) {
+			++client->error_count;
+			close_loadtest_connection(&connection);
+			continue;
+		}
+		if (is_header_request) {
+			sb_push(client->header_latencies, latency);
+		} else {
+			sb_push(client->tile_latencies, latency);
+		}
+		client->bytes_received += content_length;
+		if (status != 200) {
+			++client->error_count;
+			if (is_header_request) break; // the slide doesn't exist
+		} else if (is_header_request) {
+			if (!tiff_deserialize(&tiff, connection.buffer, content_length) || tiff.level_count == 0) {
+				fprintf(stderr, "Could not read the slide header of %s\n", filename);
+				break;
+			}
+			tiff.is_remote = true; // so that tiff_destroy() knows how the IFDs were allocated
+			has_header = true;
+			requests_on_slide = 0;
+			start_loadtest_view(&tiff, &view, &random_state);
+		} else {
+			client->tiles_received += batch_tile_count;
+			++requests_on_slide;
+		}
+	}
+	close_loadtest_connection(&connection);
+	if (has_header) {
+		tiff_destroy(&tiff);
+	}
+	return 0;
+}
+
+int compare_doubles(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+void print_latencies(const char* label, double* latencies) {
+	i32 count = sb_count(latencies);
+	if (count == 0) return;
+	qsort(latencies, count, sizeof(double), compare_doubles);
+	printf("%-11s %6d, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", label, count,
+	       latencies[count / 2] * 1000.0,
+	       latencies[(i32)(count * 0.90)] * 1000.0,
+	       latencies[(i32)(count * 0.99)] * 1000.0,
+	       latencies[count - 1] * 1000.0);
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 4) {
+		fprintf(stderr, "Usage: %s <host> <port> <slide>[,<slide>...] [client_count] [seconds] [--pattern pan|random]\n"
+		                "       [--api tiles|ranges] [--requests-per-connection N] [--requests-per-slide N]\n"
+		                "       [--no-resumption]\n", argv[0]);
+		return 1;
+	}
+	loadtest_config_t config = { .hostname = argv[1], .portno = argv[2], .pattern = LOADTEST_PATTERN_PAN,
+	                             .api = LOADTEST_API_TILES, .requests_per_slide = LOADTEST_DEFAULT_REQUESTS_PER_SLIDE,
+	                             .resume_sessions = true };
+	char* slide_list = strdup(argv[3]);
+	for (char* slide = strtok(slide_list, ","); slide && config.slide_count < LOADTEST_MAX_SLIDES; slide = strtok(NULL, ",")) {
+		config.slides[config.slide_count++] = slide;
+	}
+	if (config.slide_count == 0) {
+		fprintf(stderr, "No slides given\n");
+		return 1;
+	}
+	i32 client_count = LOADTEST_DEFAULT_CLIENT_COUNT;
+	i32 seconds = LOADTEST_DEFAULT_SECONDS;
+	i32 positional_index = 0;
+	for (i32 i = 4; i < argc; ++i) {
+		if (strcmp(argv[i], "--pattern") == 0 && i + 1 < argc) {
+			++i;
+			if (strcmp(argv[i], "random") == 0) {
+				config.pattern = LOADTEST_PATTERN_RANDOM;
+			} else if (strcmp(argv[i], "pan") == 0) {
+				config.pattern = LOADTEST_PATTERN_PAN;
+			} else {
+				fprintf(stderr, "Unknown pattern '%s'\n", argv[i]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--api") == 0 && i + 1 < argc) {
+			++i;
+			if (strcmp(argv[i], "ranges") == 0) {
+				config.api = LOADTEST_API_RANGES;
+			} else if (strcmp(argv[i], "tiles") == 0) {
+				config.api = LOADTEST_API_TILES;
+			} else {
+				fprintf(stderr, "Unknown API '%s'\n", argv[i]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--requests-per-connection") == 0 && i + 1 < argc) {
+			config.requests_per_connection = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--requests-per-slide") == 0 && i + 1 < argc) {
+			config.requests_per_slide = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--no-resumption") == 0) {
+			config.resume_sessions = false;
+		} else if (positional_index == 0) {
+			client_count = atoi(argv[i]);
+			++positional_index;
+		} else if (positional_index == 1) {
+			seconds = atoi(argv[i]);
+			++positional_index;
+		} else {
+			fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+			return 1;
+		}
+	}
+	if (client_count <= 0) client_count = LOADTEST_DEFAULT_CLIENT_COUNT;
+	if (seconds <= 0) seconds = LOADTEST_DEFAULT_SECONDS;
+	if (config.requests_per_connection < 0) config.requests_per_connection = 0;
+	if (config.requests_per_slide <= 0) config.requests_per_slide = LOADTEST_DEFAULT_REQUESTS_PER_SLIDE;
+
+#ifdef _WIN32
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+#else
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	tls_init();
+
+	fprintf(stderr, "Running %d clients against %s:%s for %d seconds (%d slides, '%s' pattern, %s)...\n",
+	        client_count, argv[1], argv[2], seconds, config.slide_count,
+	        config.pattern == LOADTEST_PATTERN_PAN ? "pan" : "random",
+	        config.api == LOADTEST_API_TILES ? "POST /tiles" : "byte range batches");
+	loadtest_client_t* clients = calloc(client_count, sizeof(loadtest_client_t));
+	pthread_t* threads = calloc(client_count, sizeof(pthread_t));
+	double start_time = get_seconds();
+	for (i32 i = 0; i < client_count; ++i) {
+		clients[i] = (loadtest_client_t){ .index = i, .config = &config, .end_time = start_time + seconds };
+		if (pthread_create(threads + i, NULL, &loadtest_client_proc, clients + i) != 0) {
+			fprintf(stderr, "Error creating thread\n");
+			return 1;
+		}
+	}
+
+	double* header_latencies = NULL;
+	double* tile_latencies = NULL;
+	double* handshake_times = NULL;
+	double* resumed_handshake_times = NULL;
+	i64 bytes_received = 0;
+	i64 tiles_received = 0;
+	i32 error_count = 0;
+	for (i32 i = 0; i < client_count; ++i) {
+		pthread_join(threads[i], NULL);
+		for (i32 j = 0; j < sb_count(clients[i].header_latencies); ++j) {
+			sb_push(header_latencies, clients[i].header_latencies[j]);
+		}
+		for (i32 j = 0; j < sb_count(clients[i].tile_latencies); ++j) {
+			sb_push(tile_latencies, clients[i].tile_latencies[j]);
+		}
+		for (i32 j = 0; j < sb_count(clients[i].handshake_times); ++j) {
+			sb_push(handshake_times, clients[i].handshake_times[j]);
+		}
+		for (i32 j = 0; j < sb_count(clients[i].resumed_handshake_times); ++j) {
+			sb_push(resumed_handshake_times, clients[i].resumed_handshake_times[j]);
+		}
+		bytes_received += clients[i].bytes_received;
+		tiles_received += clients[i].tiles_received;
+		error_count += clients[i].error_count;
+		sb_free(clients[i].header_latencies);
+		sb_free(clients[i].tile_latencies);
+		sb_free(clients[i].handshake_times);
+		sb_free(clients[i].resumed_handshake_times);
+	}
+	double elapsed = get_seconds() - start_time;
+
+	i32 request_count = sb_count(header_latencies) + sb_count(tile_latencies);
+	printf("requests:   %d (%d errors)\n", request_count, error_count);
+	printf("throughput: %.1f requests/s, %.1f tiles/s, %.2f MB/s\n", request_count / elapsed, tiles_received / elapsed,
+	       bytes_received / (elapsed * 1024.0 * 1024.0));
+	print_latencies("headers:", header_latencies);
+	print_latencies("tiles:", tile_latencies);
+	i32 handshake_count = sb_count(handshake_times);
+	if (handshake_count > 0) {
+		double total_handshake_time = 0.0;
+		for (i32 i = 0; i < handshake_count; ++i) {
+			total_handshake_time += handshake_times[i];
+		}
+		print_latencies("handshakes:", handshake_times);
+		print_latencies("  resumed:", resumed_handshake_times);
+		printf("            %.1f%% of the clients' time spent connecting\n",
+		       total_handshake_time * 100.0 / (elapsed * client_count));
+	}
+	sb_free(header_latencies);
+	sb_free(tile_latencies);
+	sb_free(handshake_times);
+	sb_free(resumed_handshake_times);
+	free(slide_list);
+	return (request_count > 0) ? 0 : 1;
+}
@@ -0,0 +1,193 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include "intrinsics.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+#if WINDOWS
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "log.h"
+
+typedef struct log_record_t {
+	u8 level;
+	char text[LOG_MESSAGE_MAX_LENGTH];
+} log_record_t;
+
+// Each ring buffer has a single writer (its thread) and a single reader (whoever holds log_flush_lock), so neither
+// side needs a lock: the writer only advances write_count, and the reader only advances read_count.
+typedef struct log_thread_t {
+	log_record_t records[LOG_MESSAGES_PER_THREAD];
+	volatile i64 write_count;
+	volatile i64 read_count;
+	volatile i32 dropped_count; // because the ring buffer was full, or because of the rate limit
+	i32 reported_dropped_count; // only touched by the reader
+	// Only touched by the owning thread:
+	i64 rate_limit_second;
+	i32 rate_limit_count;
+} log_thread_t;
+
+volatile i32 log_level = LOG_LEVEL_INFO;
+
+static FILE* log_stream;
+static bool32 is_log_thread_running;
+static log_thread_t* volatile log_threads[LOG_MAX_THREADS];
+static volatile i32 log_thread_count;
+static THREAD_LOCAL log_thread_t* current_log_thread;
+static THREAD_LOCAL bool32 has_no_log_thread; // too many threads: this one writes directly
+static volatile i32 log_flush_lock;
+
+static log_thread_t* get_current_log_thread() {
+	if (current_log_thread || has_no_log_thread) return current_log_thread;
+	log_thread_t* thread = (log_thread_t*) calloc(1, sizeof(log_thread_t));
+	i32 thread_index = interlocked_increment(&log_thread_count) - 1;
+	if (thread_index >= LOG_MAX_THREADS) {
+		interlocked_decrement(&log_thread_count);
+		free(thread);
+		has_no_log_thread = true;
+		return NULL;
+	}
+	write_barrier;
+	log_threads[thread_index] = thread;
+	current_log_thread = thread;
+	return thread;
+}
+
+static void write_dropped_message_count(log_thread_t* thread) {
+	i32 dropped_count = thread->dropped_count;
+	if (dropped_count != thread->reported_dropped_count) {
+		fprintf(log_stream, "(%d log messages dropped)\n", dropped_count - thread->reported_dropped_count);
+		thread->reported_dropped_count = dropped_count;
+	}
+}
+
+// Writes out what the threads have logged so far. Called by the log thread, but can also be called directly (e.g.
+// before exiting).
+void log_flush() {
+	if (!log_stream) return;
+	spin_lock(&log_flush_lock);
+	bool32 has_written = false;
+	i32 thread_count = ATMOST(log_thread_count, LOG_MAX_THREADS);
+	for (i32 i = 0; i < thread_count; ++i) {
+		log_thread_t* thread = log_threads[i];
+		if (!thread) continue; // (still being registered)
+		i64 write_count = thread->write_count;
+		read_barrier;
+		for (i64 read_count = thread->read_count; read_count < write_count; ++read_count) {
+			log_record_t* record = thread->records + (read_count & (LOG_MESSAGES_PER_THREAD - 1));
+			fputs(record->text, log_stream);
+			has_written = true;
+		}
+		write_barrier; // (done reading the records, before the writer may reuse them)
+		thread->read_count = write_count;
+		if (thread->dropped_count != thread->reported_dropped_count) {
+			write_dropped_message_count(thread);
+			has_written = true;
+		}
+	}
+	if (has_written) {
+		fflush(log_stream);
+	}
+	spin_unlock(&log_flush_lock);
+}
+
+#if WINDOWS
+static DWORD WINAPI log_thread_proc(void* parameter) {
+	for (;;) {
+		log_flush();
+		Sleep(LOG_FLUSH_INTERVAL_MS);
+	}
+	return 0;
+}
+#else
+static void* log_thread_proc(void* parameter) {
+	struct timespec interval = { 0, LOG_FLUSH_INTERVAL_MS * 1000000L };
+	for (;;) {
+		log_flush();
+		nanosleep(&interval, NULL);
+	}
+	return NULL;
+}
+#endif
+
+// Starts the log thread. Until then (or if it can't be started), messages are written out directly.
+void log_init(FILE* stream, log_level_enum default_level) {
+	log_stream = stream;
+	log_level = default_level;
+	const char* level_env = getenv("LOG_LEVEL");
+	if (level_env && level_env[0] >= '0' && level_env[0] <= '3') {
+		log_level = level_env[0] - '0';
+	}
+	if (is_log_thread_running) return;
+#if WINDOWS
+	HANDLE thread = CreateThread(NULL, 0, log_thread_proc, NULL, 0, NULL);
+	if (thread) {
+		CloseHandle(thread);
+		is_log_thread_running = true;
+	}
+#else
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, log_thread_proc, NULL) == 0) {
+		pthread_detach(thread);
+		is_log_thread_running = true;
+	}
+#endif
+}
+
+void log_message(log_level_enum level, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	log_thread_t* thread = is_log_thread_running ? get_current_log_thread() : NULL;
+	if (!thread) {
+		vfprintf(log_stream ? log_stream : stdout, format, args);
+		va_end(args);
+		return;
+	}
+
+	i64 second = (i64)time(NULL);
+	if (second != thread->rate_limit_second) {
+		thread->rate_limit_second = second;
+		thread->rate_limit_count = 0;
+	}
+	i64 write_count = thread->write_count;
+	if (thread->rate_limit_count >= LOG_MAX_MESSAGES_PER_SECOND ||
+	    write_count - thread->read_count >= LOG_MESSAGES_PER_THREAD) {
+		interlocked_increment(&thread->dropped_count);
+		va_end(args);
+		return;
+	}
+	++thread->rate_limit_count;
+	read_barrier; // (the reader is done with the record, see log_flush())
+
+	log_record_t* record = thread->records + (write_count & (LOG_MESSAGES_PER_THREAD - 1));
+	record->level = (u8)level;
+	i32 length = vsnprintf(record->text, sizeof(record->text), format, args);
+	if (length >= (i32)sizeof(record->text)) {
+		record->text[sizeof(record->text) - 2] = '\n'; // truncated, but keep the line ending
+	}
+	va_end(args);
+	write_barrier;
+	thread->write_count = write_count + 1;
+}
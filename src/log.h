@@ -0,0 +1,71 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+#include <stdio.h>
+
+// Logging from hot paths (worker threads, server connections) without holding them up: each thread formats its
+// messages into a ring buffer of its own, and a background thread writes them out (see log.c). Console output is
+// slow (especially on Windows) and serializes the threads that write to it, so printf() is best kept for the things
+// that happen once, like opening a file.
+// Messages below LOG_COMPILED_LEVEL are compiled out entirely; the ones below log_level are skipped at run time
+// (which can be set with the LOG_LEVEL environment variable, as 0-3). A thread that logs more than
+// LOG_MAX_MESSAGES_PER_SECOND messages a second drops the rest; the number of dropped messages is reported.
+// The messages of one thread come out in order, but those of different threads may be interleaved differently.
+
+typedef enum log_level_enum {
+	LOG_LEVEL_DEBUG = 0,
+	LOG_LEVEL_INFO = 1,
+	LOG_LEVEL_WARNING = 2,
+	LOG_LEVEL_ERROR = 3,
+} log_level_enum;
+
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_MAX_THREADS 128
+#define LOG_MESSAGES_PER_THREAD 256 // needs to be a power of 2
+#define LOG_MESSAGE_MAX_LENGTH 240
+#define LOG_MAX_MESSAGES_PER_SECOND 200 // per thread
+#define LOG_FLUSH_INTERVAL_MS 20
+
+extern volatile i32 log_level;
+
+void log_init(FILE* stream, log_level_enum default_level);
+void log_flush();
+void log_message(log_level_enum level, const char* format, ...);
+
+#define LOG_AT_LEVEL(level, ...) \
+	do { if ((level) >= LOG_COMPILED_LEVEL && (level) >= log_level) log_message((level), __VA_ARGS__); } while (0)
+
+#define log_debug(...) LOG_AT_LEVEL(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) LOG_AT_LEVEL(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warning(...) LOG_AT_LEVEL(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define log_error(...) LOG_AT_LEVEL(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,72 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include "intrinsics.h"
+
+#include "memory_stats.h"
+
+memory_stats_t global_memory_stats;
+
+static const char* memory_domain_names[MEMORY_DOMAIN_COUNT] = {
+	"Tile textures (VRAM)", "Decoded tiles", "Compressed tile cache", "Thread memory", "TIFF metadata",
+	"Annotations", "Network buffers", "Tile states", "Generated levels",
+};
+
+static void update_peak(memory_domain_stats_t* stats, i64 bytes) {
+	i64 peak = stats->peak_bytes;
+	while (bytes > peak) {
+		i64 previous = interlocked_compare_exchange_i64(&stats->peak_bytes, bytes, peak);
+		if (previous == peak) break;
+		peak = previous;
+	}
+}
+
+// Can be called from any thread. Negative for memory that is freed.
+void memory_stats_add(memory_domain_enum domain, i64 bytes) {
+	memory_domain_stats_t* stats = global_memory_stats.domains + domain;
+	i64 new_bytes = interlocked_add_i64(&stats->bytes, bytes);
+	update_peak(stats, new_bytes);
+}
+
+// For domains that are measured instead of tracked (only one thread should set them).
+void memory_stats_set(memory_domain_enum domain, i64 bytes) {
+	memory_domain_stats_t* stats = global_memory_stats.domains + domain;
+	stats->bytes = bytes;
+	update_peak(stats, bytes);
+}
+
+i64 memory_stats_get(memory_domain_enum domain) {
+	return global_memory_stats.domains[domain].bytes;
+}
+
+i64 memory_stats_get_peak(memory_domain_enum domain) {
+	return global_memory_stats.domains[domain].peak_bytes;
+}
+
+i64 memory_stats_get_total() {
+	i64 total = 0;
+	for (i32 domain = 0; domain < MEMORY_DOMAIN_COUNT; ++domain) {
+		total += global_memory_stats.domains[domain].bytes;
+	}
+	return total;
+}
+
+const char* memory_stats_get_domain_name(memory_domain_enum domain) {
+	return memory_domain_names[domain];
+}
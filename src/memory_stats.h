@@ -0,0 +1,64 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+// How much memory each subsystem is using, for the memory window in gui.cpp. The subsystems keep their numbers up
+// to date where they allocate and free (memory_stats_add()), or, for memory that is easier to measure than to track,
+// set them in one go (memory_stats_set()). The caches base their budgets on the same numbers.
+
+typedef enum memory_domain_enum {
+	MEMORY_DOMAIN_TILE_TEXTURES,   // the tile texture slots in use, estimated as VRAM including the mipmaps
+	MEMORY_DOMAIN_DECODED_TILES,   // the pool of buffers that decoded tiles (with mipmaps) wait in for uploading
+	MEMORY_DOMAIN_TILE_CACHE,      // the cache of compressed tiles in system memory, including its tables
+	MEMORY_DOMAIN_THREAD_MEMORY,   // scratch memory of the worker threads, and the temporary arena of the main thread
+	MEMORY_DOMAIN_TIFF_METADATA,   // tile offset and byte count tables
+	MEMORY_DOMAIN_ANNOTATIONS,
+	MEMORY_DOMAIN_NETWORK_BUFFERS, // download buffers, and the blocks cached for byte range requests
+	MEMORY_DOMAIN_TILE_STATES,     // the tile state pages and empty tile bitmaps of the levels (see tile_table.c)
+	MEMORY_DOMAIN_GENERATED_LEVELS, // the level rasters of images without a complete pyramid (see generated_levels.c)
+	MEMORY_DOMAIN_COUNT
+} memory_domain_enum;
+
+typedef struct memory_domain_stats_t {
+	volatile i64 bytes;
+	volatile i64 peak_bytes;
+} memory_domain_stats_t;
+
+typedef struct memory_stats_t {
+	memory_domain_stats_t domains[MEMORY_DOMAIN_COUNT];
+} memory_stats_t;
+
+extern memory_stats_t global_memory_stats;
+
+void memory_stats_add(memory_domain_enum domain, i64 bytes);
+void memory_stats_set(memory_domain_enum domain, i64 bytes);
+i64 memory_stats_get(memory_domain_enum domain);
+i64 memory_stats_get_peak(memory_domain_enum domain);
+i64 memory_stats_get_total();
+const char* memory_stats_get_domain_name(memory_domain_enum domain);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,357 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#include "win32_main.h"
+#include "platform.h"
+#include "intrinsics.h"
+
+#include <stdio.h>
+
+#include "stretchy_buffer.h"
+#include "viewer.h"
+#include "tiff.h"
+#include "async_io.h"
+#include "disk_cache.h"
+#include "tlsclient.h"
+#include "offline_download.h"
+
+typedef struct offline_tile_t {
+	i32 level;
+	i32 tile_index;
+	u64 offset;
+	u64 size;
+} offline_tile_t;
+
+// The tiles of a batch are downloaded in as few ranges as possible. The ranges are copied as they come in (on the
+// network thread), and written to the disk cache by the download thread once the batch is done.
+typedef struct offline_batch_t {
+	i32 tile_count;
+	offline_tile_t tiles[OFFLINE_DOWNLOAD_BATCH_TILES];
+	u64 positions[OFFLINE_DOWNLOAD_BATCH_TILES]; // see io_coalesce_ranges()
+	i32 range_indices[OFFLINE_DOWNLOAD_BATCH_TILES];
+	u64 range_positions[OFFLINE_DOWNLOAD_BATCH_TILES];
+	u8* range_data[OFFLINE_DOWNLOAD_BATCH_TILES];
+	volatile i32 is_done;
+} offline_batch_t;
+
+typedef struct offline_download_t {
+	char hostname[256];
+	i32 portno;
+	char** filenames; // sb
+	i32 slide_count;
+	offline_download_options_t options;
+	volatile i32 is_running;
+	volatile i32 is_cancelled;
+	// For the progress:
+	volatile i32 slides_done;
+	volatile i32 slide_tile_count; // of the slide that is being downloaded
+	volatile i32 slide_tiles_done;
+	// Only touched by the download thread:
+	offline_batch_t* batches[OFFLINE_DOWNLOAD_BATCHES_IN_FLIGHT];
+	i32 batch_count;
+	float byte_allowance; // for the bandwidth cap
+	i64 allowance_clock;
+	i64 tiles_downloaded;
+	i64 tiles_failed;
+	i64 bytes_downloaded;
+} offline_download_t;
+
+static offline_download_t offline_download; // one at a time
+
+static int compare_tile_sizes(const void* a, const void* b) {
+	u64 size_a = *(u64*)a;
+	u64 size_b = *(u64*)b;
+	return (size_a > size_b) - (size_a < size_b);
+}
+
+// Glass compresses far better than tissue. Most of a slide is glass, so the larger tiles of the level (the 90th
+// percentile) are taken as what tissue looks like.
+static u64 get_glass_tile_size_threshold(tiff_ifd_t* ifd) {
+	u64* sizes = NULL; // sb
+	for (u64 i = 0; i < ifd->tile_count; ++i) {
+		if (ifd->tile_offsets[i] != 0 && ifd->tile_byte_counts[i] > 2) {
+			sb_push(sizes, ifd->tile_byte_counts[i]);
+		}
+	}
+	u64 threshold = 0;
+	i32 count = sb_count(sizes);
+	if (count > 0) {
+		qsort(sizes, count, sizeof(u64), compare_tile_sizes);
+		threshold = (u64)((float)sizes[count * 9 / 10] * OFFLINE_DOWNLOAD_GLASS_TILE_SIZE_RATIO);
+	}
+	sb_free(sizes);
+	return threshold;
+}
+
+// The coarsest levels come first, so that an interrupted download is already useful for an overview.
+static offline_tile_t* get_tiles_to_download(offline_download_t* job, tiff_t* tiff, disk_cache_t* disk_cache) {
+	offline_tile_t* tiles = NULL; // sb
+	i32 finest_level = ATMOST(job->options.skipped_finest_levels, (i32)tiff->level_count - 1);
+	for (i32 level = (i32)tiff->level_count - 1; level >= finest_level && !job->is_cancelled; --level) {
+		tiff_ifd_t* ifd = tiff->level_images + level;
+		if (ifd->tile_data) {
+			continue; // the tiles came with the header
+		}
+		if (!tiff_load_tile_tables(tiff, ifd)) {
+			continue;
+		}
+		u64 min_size = job->options.tissue_only ? get_glass_tile_size_threshold(ifd) : 0;
+		for (u64 i = 0; i < ifd->tile_count; ++i) {
+			u64 offset = ifd->tile_offsets[i];
+			u64 size = ifd->tile_byte_counts[i];
+			if (offset == 0 || size <= 2 || size < min_size || size > UINT32_MAX) {
+				continue;
+			}
+			if (disk_cache_has_tile(disk_cache, disk_cache_key(level, (i32)i))) {
+				continue; // downloaded before
+			}
+			offline_tile_t tile = { .level = level, .tile_index = (i32)i, .offset = offset, .size = size };
+			sb_push(tiles, tile);
+		}
+	}
+	return tiles;
+}
+
+// Called by the network thread for each downloaded range.
+static void receive_offline_range(void* userdata, i32 range_index, u8* data, i64 size) {
+	offline_batch_t* batch = (offline_batch_t*) userdata;
+	if (range_index < 0 || range_index >= batch->tile_count || batch->range_data[range_index]) {
+		return;
+	}
+	u8* copy = (u8*) malloc(size);
+	memcpy(copy, data, size);
+	batch->range_data[range_index] = copy;
+}
+
+// Called by the network thread when the download of a batch is over.
+static void finish_offline_batch(void* userdata, i32 chunks_delivered) {
+	offline_batch_t* batch = (offline_batch_t*) userdata;
+	write_barrier;
+	batch->is_done = true;
+}
+
+// Writes out the tiles of the batches that are done. Tiles that didn't arrive are left for a next attempt.
+static void store_finished_offline_batches(offline_download_t* job, disk_cache_t* disk_cache) {
+	for (i32 b = 0; b < job->batch_count; ) {
+		offline_batch_t* batch = job->batches[b];
+		if (!batch->is_done) {
+			++b;
+			continue;
+		}
+		read_barrier;
+		for (i32 i = 0; i < batch->tile_count; ++i) {
+			offline_tile_t* tile = batch->tiles + i;
+			i32 range_index = batch->range_indices[i];
+			u8* range_data = batch->range_data[range_index];
+			if (range_data) {
+				u8* data = range_data + (batch->positions[i] - batch->range_positions[range_index]);
+				disk_cache_write_tile(disk_cache, disk_cache_key(tile->level, tile->tile_index), data, (u32)tile->size);
+				++job->tiles_downloaded;
+				job->bytes_downloaded += tile->size;
+			} else {
+				++job->tiles_failed;
+			}
+		}
+		for (i32 i = 0; i < batch->tile_count; ++i) {
+			if (batch->range_data[i]) free(batch->range_data[i]);
+		}
+		job->slide_tiles_done += batch->tile_count;
+		free(batch);
+		job->batches[b] = job->batches[--job->batch_count];
+	}
+}
+
+// A token bucket, holding at most a second's worth of bytes. The allowance may go below zero by one batch.
+static bool32 take_offline_bandwidth(offline_download_t* job, u64 bytes) {
+	float max_megabytes_per_second = job->options.max_megabytes_per_second;
+	if (max_megabytes_per_second <= 0.0f) {
+		return true;
+	}
+	float bytes_per_second = max_megabytes_per_second * (float)MEGABYTES(1);
+	i64 clock = get_clock();
+	job->byte_allowance = ATMOST(bytes_per_second, job->byte_allowance +
+	                             get_seconds_elapsed(job->allowance_clock, clock) * bytes_per_second);
+	job->allowance_clock = clock;
+	if (job->byte_allowance < 0.0f) {
+		return false;
+	}
+	job->byte_allowance -= (float)bytes;
+	return true;
+}
+
+// The slide that is being viewed comes first; our own downloads don't count.
+static bool32 is_interactive_loading(offline_download_t* job) {
+	return is_queue_work_in_progress(&work_queue) || !are_remote_downloads_idle_except(job);
+}
+
+static void submit_offline_batch(offline_download_t* job, tiff_t* tiff, offline_tile_t* tiles, i32 tile_count) {
+	offline_batch_t* batch = (offline_batch_t*) calloc(1, sizeof(offline_batch_t));
+	batch->tile_count = tile_count;
+	memcpy(batch->tiles, tiles, tile_count * sizeof(offline_tile_t));
+	u64 offsets[OFFLINE_DOWNLOAD_BATCH_TILES];
+	u64 sizes[OFFLINE_DOWNLOAD_BATCH_TILES];
+	for (i32 i = 0; i < tile_count; ++i) {
+		offsets[i] = tiles[i].offset;
+		sizes[i] = tiles[i].size;
+	}
+	io_range_t ranges[OFFLINE_DOWNLOAD_BATCH_TILES];
+	i32 range_count = io_coalesce_ranges(offsets, sizes, tile_count, IO_COALESCE_MAX_GAP, IO_COALESCE_MAX_SIZE,
+	                                     ranges, batch->positions, batch->range_indices);
+	i64 range_offsets[OFFLINE_DOWNLOAD_BATCH_TILES];
+	i64 range_sizes[OFFLINE_DOWNLOAD_BATCH_TILES];
+	u64 total_size = 0;
+	for (i32 i = 0; i < range_count; ++i) {
+		range_offsets[i] = (i64)ranges[i].offset;
+		range_sizes[i] = (i64)ranges[i].size;
+		batch->range_positions[i] = total_size;
+		total_size += ranges[i].size;
+	}
+	job->batches[job->batch_count++] = batch;
+	submit_remote_batch_download(&tiff->location, range_offsets, range_sizes, range_count,
+	                             OFFLINE_DOWNLOAD_RANGES_PER_REQUEST, receive_offline_range, finish_offline_batch, batch,
+	                             job);
+}
+
+static void download_slide_for_offline_use(offline_download_t* job, const char* filename) {
+	tiff_t tiff = {0};
+	disk_cache_t* disk_cache = NULL;
+	if (!open_remote_tiff(job->hostname, job->portno, filename, &tiff, &disk_cache, NULL, &job->is_cancelled)) {
+		printf("Offline download: could not open %s\n", filename);
+		return;
+	}
+	if (!disk_cache) {
+		tiff_destroy(&tiff);
+		return; // nowhere to keep the tiles
+	}
+	offline_tile_t* tiles = get_tiles_to_download(job, &tiff, disk_cache);
+	i32 tile_count = sb_count(tiles);
+	job->slide_tiles_done = 0;
+	job->slide_tile_count = tile_count;
+
+	for (i32 first = 0; first < tile_count && !job->is_cancelled; ) {
+		i32 batch_tile_count = ATMOST(OFFLINE_DOWNLOAD_BATCH_TILES, tile_count - first);
+		u64 batch_size = 0;
+		for (i32 i = 0; i < batch_tile_count; ++i) {
+			batch_size += tiles[first + i].size;
+		}
+		store_finished_offline_batches(job, disk_cache);
+		if (job->batch_count == OFFLINE_DOWNLOAD_BATCHES_IN_FLIGHT || is_interactive_loading(job) ||
+		    !take_offline_bandwidth(job, batch_size)) {
+			platform_sleep(20);
+			continue;
+		}
+		submit_offline_batch(job, &tiff, tiles + first, batch_tile_count);
+		first += batch_tile_count;
+	}
+	if (job->is_cancelled) {
+		cancel_remote_downloads(job);
+	}
+	while (job->batch_count > 0) {
+		store_finished_offline_batches(job, disk_cache);
+		if (job->batch_count > 0) platform_sleep(20);
+	}
+
+	sb_free(tiles);
+	tiff_destroy(&tiff);
+	disk_cache_close(disk_cache);
+}
+
+static DWORD WINAPI offline_download_thread_proc(LPVOID parameter) {
+	offline_download_t* job = (offline_download_t*) parameter;
+	i64 start = get_clock();
+	i32 slide_count = job->slide_count;
+	for (i32 i = 0; i < slide_count && !job->is_cancelled; ++i) {
+		download_slide_for_offline_use(job, job->filenames[i]);
+		job->slide_tile_count = 0;
+		write_barrier;
+		job->slides_done = i + 1;
+	}
+	printf("Offline download %s: %d of %d slides, %lld tiles (%.1f MB) downloaded, %lld failed, in %g seconds\n",
+	       job->is_cancelled ? "cancelled" : "done", job->slides_done, slide_count, job->tiles_downloaded,
+	       (double)job->bytes_downloaded / (double)MEGABYTES(1), job->tiles_failed,
+	       get_seconds_elapsed(start, get_clock()));
+
+	for (i32 i = 0; i < slide_count; ++i) {
+		free(job->filenames[i]);
+	}
+	sb_free(job->filenames);
+	job->filenames = NULL;
+	write_barrier;
+	job->is_running = false;
+	return 0;
+}
+
+// Only for remote case lists. Returns false if a download is already underway.
+bool32 start_caselist_offline_download(caselist_t* caselist, offline_download_options_t* options) {
+	offline_download_t* job = &offline_download;
+	if (job->is_running || !caselist->is_remote || caselist->num_cases_with_filenames == 0) {
+		return false;
+	}
+	memset(job, 0, sizeof(*job));
+	strncpy(job->hostname, caselist->hostname, sizeof(job->hostname) - 1);
+	job->portno = caselist->portno;
+	job->options = *options;
+	job->allowance_clock = get_clock();
+	for (u32 i = 0; i < caselist->num_cases_with_filenames; ++i) {
+		sb_push(job->filenames, strdup(caselist->cases[i].filename));
+	}
+	job->slide_count = sb_count(job->filenames);
+	job->is_running = true;
+	write_barrier;
+	HANDLE thread_handle = CreateThread(NULL, 0, offline_download_thread_proc, job, 0, NULL);
+	if (!thread_handle) {
+		for (i32 i = 0; i < sb_count(job->filenames); ++i) {
+			free(job->filenames[i]);
+		}
+		sb_free(job->filenames);
+		job->filenames = NULL;
+		job->is_running = false;
+		return false;
+	}
+	// The network is the bottleneck, not the CPU; this only keeps the disk writes out of the way.
+	SetThreadPriority(thread_handle, THREAD_PRIORITY_BELOW_NORMAL);
+	CloseHandle(thread_handle);
+	return true;
+}
+
+// Returns false if there is no download underway.
+bool32 get_caselist_offline_download_progress(float* progress, i32* slides_done, i32* slide_count) {
+	offline_download_t* job = &offline_download;
+	if (!job->is_running) {
+		return false;
+	}
+	i32 count = job->slide_count;
+	i32 done = job->slides_done;
+	i32 tile_count = job->slide_tile_count;
+	float slide_progress = tile_count > 0 ? (float)job->slide_tiles_done / (float)tile_count : 0.0f;
+	*progress = count > 0 ? ((float)done + slide_progress) / (float)count : 1.0f;
+	*slides_done = done;
+	*slide_count = count;
+	return true;
+}
+
+// The tiles that have been downloaded so far stay in the disk cache; starting over skips them.
+void cancel_caselist_offline_download() {
+	offline_download_t* job = &offline_download;
+	if (job->is_running) {
+		job->is_cancelled = true;
+		cancel_remote_downloads(job);
+	}
+}
@@ -0,0 +1,55 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+#include "caselist.h"
+
+// Makes the slides of a remote case list available offline: the header and the tiles of every slide are downloaded
+// into the disk cache (see disk_cache.h), from where the viewer takes them when the server can't be reached.
+// The tiles are downloaded as byte ranges, with tiles that are (nearly) next to each other in the file coalesced into
+// one range, and several batches in flight at once. Tiles that are already in the disk cache are skipped, so starting
+// over after an interruption picks up where the last download stopped.
+// The download gets out of the way of the slide being viewed: it waits while that is loading, and can be capped to a
+// number of bytes per second.
+
+#define OFFLINE_DOWNLOAD_BATCHES_IN_FLIGHT 8
+#define OFFLINE_DOWNLOAD_BATCH_TILES 64 // at most IO_READ_BATCH_MAX
+#define OFFLINE_DOWNLOAD_RANGES_PER_REQUEST 8
+// With the tissue_only option, tiles that compress to less than this fraction of the larger tiles of their level are
+// taken to be glass: glass is flat and bright, and compresses much better than tissue.
+#define OFFLINE_DOWNLOAD_GLASS_TILE_SIZE_RATIO 0.25f
+
+typedef struct offline_download_options_t {
+	i32 skipped_finest_levels; // 0 = down to the full resolution
+	bool32 tissue_only;
+	float max_megabytes_per_second; // 0 = no limit
+} offline_download_options_t;
+
+bool32 start_caselist_offline_download(caselist_t* caselist, offline_download_options_t* options);
+bool32 get_caselist_offline_download_progress(float* progress, i32* slides_done, i32* slide_count);
+void cancel_caselist_offline_download();
+
+#ifdef __cplusplus
+}
+#endif
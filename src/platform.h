@@ -20,6 +20,7 @@
 
 #include "common.h"
 #include "mathutils.h"
+#include "async_io.h"
 
 #ifdef TARGET_EMSCRIPTEN
 #include <emscripten/emscripten.h>
@@ -97,6 +98,11 @@ typedef struct input_t {
 	v2i drag_start_xy;
 	v2i drag_vector;
 	v2i mouse_xy;
+	// The mouse events that were coalesced into drag_vector and mouse_z this frame, and when the first and the last of
+	// them came in (get_clock(); 0 if there were none). Over a drag, drag_vector / (last - first) is the pointer speed.
+	i32 mouse_event_count;
+	i64 first_mouse_event_clock;
+	i64 last_mouse_event_clock;
 	float delta_t;
 	union {
 		controller_input_t abstract_controllers[5];
@@ -282,16 +288,18 @@ typedef struct input_t {
 i64 get_clock();
 float get_seconds_elapsed(i64 start, i64 end);
 void platform_sleep(u32 ms);
-i64 profiler_end_section(i64 start, const char* name, float report_threshold_ms);
 
 u8* platform_alloc(size_t size); // required to be zeroed by the platform
 mem_t* platform_allocate_mem_buffer(size_t capacity);
 mem_t* platform_read_entire_file(const char* filename);
+bool32 platform_get_display_profile_filename(char* filename, i32 size);
 
 void mouse_show();
 void mouse_hide();
 
 void message_box(const char* message);
+void platform_wake_main_thread(); // can be called from any thread, when there is something new to draw
+void platform_set_thread_background_mode(bool32 background); // lower CPU and I/O priority, e.g. while prefetching
 
 bool32 add_work_queue_entry(work_queue_t* queue, work_queue_callback_t callback, void* userdata);
 bool32 is_queue_work_in_progress(work_queue_t* queue);
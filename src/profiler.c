@@ -0,0 +1,271 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include "platform.h"
+#include "intrinsics.h"
+
+#include <stdio.h>
+
+#include "stretchy_buffer.h"
+#include "profiler.h"
+
+typedef struct profiler_thread_t {
+	char name[32];
+	profiler_span_t spans[PROFILER_SPANS_PER_THREAD]; // ring buffer
+	volatile i64 span_count; // the number of spans ever written; only the last PROFILER_SPANS_PER_THREAD are kept
+	// Only touched by the owning thread:
+	i64 open_begin[PROFILER_MAX_DEPTH];
+	const char* open_name[PROFILER_MAX_DEPTH];
+	i32 depth;
+} profiler_thread_t;
+
+static profiler_thread_t* volatile profiler_threads[PROFILER_MAX_THREADS];
+static volatile i32 profiler_thread_count;
+static THREAD_LOCAL profiler_thread_t* current_profiler_thread;
+
+static i64 profiler_frame_begins[PROFILER_FRAME_HISTORY]; // ring buffer, only written by the main thread
+static volatile i64 profiler_frame_count;
+// Per frame: the time from sampling the input to the end of SwapBuffers(), and the part of that spent working
+// (i.e. not waiting for the display), in seconds. Also only written by the main thread.
+static float profiler_frame_input_latencies[PROFILER_FRAME_HISTORY];
+static float profiler_frame_costs[PROFILER_FRAME_HISTORY];
+// Per frame: the main-thread jobs that were put off to a later frame, and the time they were expected to take (see
+// run_frame_jobs()).
+static i32 profiler_frame_deferred_job_counts[PROFILER_FRAME_HISTORY];
+static float profiler_frame_deferred_seconds[PROFILER_FRAME_HISTORY];
+
+static profiler_thread_t* gpu_profiler_thread; // the track for the GPU work, see profiler_add_gpu_span()
+
+// Returns NULL if there are too many threads.
+static profiler_thread_t* add_profiler_thread(const char* name) {
+	profiler_thread_t* thread = (profiler_thread_t*) calloc(1, sizeof(profiler_thread_t));
+	strncpy(thread->name, name, sizeof(thread->name) - 1);
+	i32 thread_index = interlocked_increment(&profiler_thread_count) - 1;
+	if (thread_index >= PROFILER_MAX_THREADS) {
+		interlocked_decrement(&profiler_thread_count);
+		free(thread);
+		return NULL;
+	}
+	write_barrier;
+	profiler_threads[thread_index] = thread;
+	return thread;
+}
+
+// Should be called once at the start of each thread. Threads that aren't registered are registered by their first
+// call to profiler_begin(), under a generic name.
+void profiler_register_thread(const char* name) {
+	if (current_profiler_thread) return;
+	current_profiler_thread = add_profiler_thread(name);
+}
+
+void profiler_begin(const char* name) {
+	if (!current_profiler_thread) {
+		profiler_register_thread("thread");
+		if (!current_profiler_thread) return;
+	}
+	profiler_thread_t* thread = current_profiler_thread;
+	if (thread->depth < PROFILER_MAX_DEPTH) {
+		thread->open_name[thread->depth] = name;
+		thread->open_begin[thread->depth] = get_clock();
+	}
+	++thread->depth; // sections nested too deeply are not recorded, but still need to be balanced
+}
+
+void profiler_end() {
+	profiler_thread_t* thread = current_profiler_thread;
+	if (!thread || thread->depth == 0) return;
+	--thread->depth;
+	if (thread->depth >= PROFILER_MAX_DEPTH) return;
+	i64 count = thread->span_count;
+	profiler_span_t* span = thread->spans + (count & (PROFILER_SPANS_PER_THREAD - 1));
+	span->name = thread->open_name[thread->depth];
+	span->begin = thread->open_begin[thread->depth];
+	span->end = get_clock();
+	span->depth = thread->depth;
+	write_barrier;
+	thread->span_count = count + 1;
+}
+
+// The GPU gets a track of its own, as if it were a thread: the passes measured with timer queries are added once their
+// results are in, a few frames late (see gpu_timers in render_group.c). The times need to be converted to get_clock()
+// already. Only to be called by the thread that owns the OpenGL context.
+void profiler_add_gpu_span(const char* name, i64 begin, i64 end) {
+	if (!gpu_profiler_thread) {
+		gpu_profiler_thread = add_profiler_thread("GPU");
+		if (!gpu_profiler_thread) return;
+	}
+	profiler_thread_t* thread = gpu_profiler_thread;
+	i64 count = thread->span_count;
+	profiler_span_t* span = thread->spans + (count & (PROFILER_SPANS_PER_THREAD - 1));
+	span->name = name;
+	span->begin = begin;
+	span->end = end;
+	span->depth = 0;
+	write_barrier;
+	thread->span_count = count + 1;
+}
+
+// Marks the start of a new frame (on the main thread), so that the timeline can show whole frames.
+void profiler_new_frame() {
+	i64 count = profiler_frame_count;
+	profiler_frame_begins[count % PROFILER_FRAME_HISTORY] = get_clock();
+	profiler_frame_input_latencies[count % PROFILER_FRAME_HISTORY] = 0.0f;
+	profiler_frame_costs[count % PROFILER_FRAME_HISTORY] = 0.0f;
+	profiler_frame_deferred_job_counts[count % PROFILER_FRAME_HISTORY] = 0;
+	profiler_frame_deferred_seconds[count % PROFILER_FRAME_HISTORY] = 0.0f;
+	write_barrier;
+	profiler_frame_count = count + 1;
+}
+
+// Gets the time range of a finished frame (0 = the last one). Returns false if it is not (or no longer) known.
+bool32 profiler_get_frame(i32 frames_ago, i64* begin, i64* end) {
+	i64 count = profiler_frame_count;
+	read_barrier;
+	i64 frame_index = count - 2 - frames_ago; // the last frame that has already ended
+	if (frame_index < 0 || frames_ago + 2 > PROFILER_FRAME_HISTORY) return false;
+	*begin = profiler_frame_begins[frame_index % PROFILER_FRAME_HISTORY];
+	*end = profiler_frame_begins[(frame_index + 1) % PROFILER_FRAME_HISTORY];
+	return true;
+}
+
+// Records the latency of the frame that is currently underway (on the main thread, see win32_main.c).
+void profiler_set_frame_latency(float input_latency, float frame_cost) {
+	i64 count = profiler_frame_count;
+	if (count == 0) return;
+	profiler_frame_input_latencies[(count - 1) % PROFILER_FRAME_HISTORY] = input_latency;
+	profiler_frame_costs[(count - 1) % PROFILER_FRAME_HISTORY] = frame_cost;
+}
+
+// Gets the latency of a finished frame (0 = the last one), like profiler_get_frame().
+bool32 profiler_get_frame_latency(i32 frames_ago, float* input_latency, float* frame_cost) {
+	i64 count = profiler_frame_count;
+	read_barrier;
+	i64 frame_index = count - 2 - frames_ago;
+	if (frame_index < 0 || frames_ago + 2 > PROFILER_FRAME_HISTORY) return false;
+	*input_latency = profiler_frame_input_latencies[frame_index % PROFILER_FRAME_HISTORY];
+	*frame_cost = profiler_frame_costs[frame_index % PROFILER_FRAME_HISTORY];
+	return true;
+}
+
+// Records the deferred jobs of the frame that is currently underway (on the main thread).
+void profiler_set_frame_deferred_jobs(i32 deferred_job_count, float deferred_seconds) {
+	i64 count = profiler_frame_count;
+	if (count == 0) return;
+	profiler_frame_deferred_job_counts[(count - 1) % PROFILER_FRAME_HISTORY] = deferred_job_count;
+	profiler_frame_deferred_seconds[(count - 1) % PROFILER_FRAME_HISTORY] = deferred_seconds;
+}
+
+// Gets the deferred jobs of a finished frame (0 = the last one), like profiler_get_frame().
+bool32 profiler_get_frame_deferred_jobs(i32 frames_ago, i32* deferred_job_count, float* deferred_seconds) {
+	i64 count = profiler_frame_count;
+	read_barrier;
+	i64 frame_index = count - 2 - frames_ago;
+	if (frame_index < 0 || frames_ago + 2 > PROFILER_FRAME_HISTORY) return false;
+	*deferred_job_count = profiler_frame_deferred_job_counts[frame_index % PROFILER_FRAME_HISTORY];
+	*deferred_seconds = profiler_frame_deferred_seconds[frame_index % PROFILER_FRAME_HISTORY];
+	return true;
+}
+
+i32 profiler_get_thread_count() {
+	return ATMOST(profiler_thread_count, PROFILER_MAX_THREADS);
+}
+
+const char* profiler_get_thread_name(i32 thread_index) {
+	profiler_thread_t* thread = profiler_threads[thread_index];
+	return thread ? thread->name : "";
+}
+
+// Appends the spans of a thread that overlap the time range to the stretchy buffer *spans, and returns how many.
+// The ring buffer may be written to meanwhile, so the spans that might have been overwritten while copying are
+// left out afterwards.
+i32 profiler_copy_spans(i32 thread_index, i64 from_clock, i64 to_clock, profiler_span_t** spans) {
+	profiler_thread_t* thread = profiler_threads[thread_index];
+	if (!thread) return 0;
+	read_barrier;
+	i64 count = thread->span_count;
+	read_barrier;
+	i64 first = ATLEAST(0, count - PROFILER_SPANS_PER_THREAD);
+	i32 old_span_count = sb_count(*spans);
+	i64* span_indices = NULL; // sb, to find out afterwards which of the copied spans are still valid
+	for (i64 i = first; i < count; ++i) {
+		profiler_span_t span = thread->spans[i & (PROFILER_SPANS_PER_THREAD - 1)];
+		if (span.end < from_clock || span.begin > to_clock) continue;
+		sb_push(*spans, span);
+		sb_push(span_indices, i);
+	}
+	read_barrier;
+	// A span is overwritten by the span PROFILER_SPANS_PER_THREAD later, which may already be underway once the
+	// count has reached that span's index.
+	i64 overwritten_before = thread->span_count - PROFILER_SPANS_PER_THREAD + 1;
+	i32 kept = 0;
+	for (i32 i = 0; i < sb_count(span_indices); ++i) {
+		if (span_indices[i] >= overwritten_before) {
+			(*spans)[old_span_count + kept++] = (*spans)[old_span_count + i];
+		}
+	}
+	if (*spans) {
+		sb_raw_count(*spans) = old_span_count + kept;
+	}
+	sb_free(span_indices);
+	return kept;
+}
+
+// Writes everything that is still in the ring buffers as 'complete' events, one track per thread.
+bool32 profiler_export_chrome_trace(const char* filename) {
+	FILE* fp = fopen(filename, "wb");
+	if (!fp) {
+		printf("Profiler: could not open %s for writing\n", filename);
+		return false;
+	}
+	i32 thread_count = profiler_get_thread_count();
+	profiler_span_t* spans = NULL; // sb
+	i64 base_clock = INT64_MAX;
+	for (i32 thread_index = 0; thread_index < thread_count; ++thread_index) {
+		if (spans) sb_raw_count(spans) = 0;
+		profiler_copy_spans(thread_index, INT64_MIN, INT64_MAX, &spans);
+		for (i32 i = 0; i < sb_count(spans); ++i) {
+			base_clock = ATMOST(base_clock, spans[i].begin);
+		}
+	}
+	// get_seconds_elapsed() only has float precision, so it is only used to find out the clock frequency.
+	double microseconds_per_tick = get_seconds_elapsed(0, 1LL << 30) * 1e6 / (double)(1LL << 30);
+	fprintf(fp, "{\"traceEvents\":[\n");
+	bool32 is_first_event = true;
+	for (i32 thread_index = 0; thread_index < thread_count; ++thread_index) {
+		fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+		        is_first_event ? "" : ",\n", thread_index, profiler_get_thread_name(thread_index));
+		is_first_event = false;
+		if (spans) sb_raw_count(spans) = 0;
+		profiler_copy_spans(thread_index, INT64_MIN, INT64_MAX, &spans);
+		for (i32 i = 0; i < sb_count(spans); ++i) {
+			profiler_span_t* span = spans + i;
+			double ts = (double)(span->begin - base_clock) * microseconds_per_tick;
+			double dur = (double)(span->end - span->begin) * microseconds_per_tick;
+			fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+			        span->name, thread_index, ts, dur);
+		}
+	}
+	fprintf(fp, "\n]}\n");
+	sb_free(spans);
+	bool32 success = (fclose(fp) == 0);
+	if (success) {
+		printf("Profiler: exported trace to %s\n", filename);
+	}
+	return success;
+}
@@ -0,0 +1,61 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+// Instrumentation of what the threads (main, workers, network) are doing, for the timeline in the profiler window
+// (see gui.cpp) and for exporting to the Chrome trace format (chrome://tracing, or https://ui.perfetto.dev).
+// Sections are marked with profiler_begin() / profiler_end() pairs, and may be nested. Each thread writes the
+// finished sections to its own ring buffer, so recording takes no locks; the oldest sections get overwritten.
+
+#define PROFILER_MAX_THREADS 128
+#define PROFILER_MAX_DEPTH 32
+#define PROFILER_SPANS_PER_THREAD 16384 // needs to be a power of 2
+#define PROFILER_FRAME_HISTORY 64
+
+typedef struct profiler_span_t {
+	const char* name; // needs to stay valid (e.g. a string literal)
+	i64 begin;
+	i64 end;
+	i32 depth;
+} profiler_span_t;
+
+void profiler_register_thread(const char* name);
+void profiler_begin(const char* name);
+void profiler_end();
+void profiler_add_gpu_span(const char* name, i64 begin, i64 end);
+void profiler_new_frame();
+i32 profiler_get_thread_count();
+const char* profiler_get_thread_name(i32 thread_index);
+i32 profiler_copy_spans(i32 thread_index, i64 from_clock, i64 to_clock, profiler_span_t** spans);
+bool32 profiler_get_frame(i32 frames_ago, i64* begin, i64* end);
+void profiler_set_frame_latency(float input_latency, float frame_cost);
+bool32 profiler_get_frame_latency(i32 frames_ago, float* input_latency, float* frame_cost);
+void profiler_set_frame_deferred_jobs(i32 deferred_job_count, float deferred_seconds);
+bool32 profiler_get_frame_deferred_jobs(i32 frames_ago, i32* deferred_job_count, float* deferred_seconds);
+bool32 profiler_export_chrome_trace(const char* filename);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,414 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#include <stdio.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#include "intrinsics.h"
+#include "tiff.h"
+#include "jpeg_decoder.h"
+#include "jpeglib.h"
+#include "pyramid.h"
+#include "memory_stats.h"
+
+static i32 get_downsample_level(tiff_t* tiff, tiff_ifd_t* ifd) {
+	return (i32)roundf(log2f(ifd->um_per_pixel_x / tiff->mpp_x));
+}
+
+static bool32 get_source_file_identity(const char* filename, i64* filesize, i64* modification_time) {
+	struct stat st;
+	if (stat(filename, &st) != 0) {
+		return false;
+	}
+	*filesize = (i64)st.st_size;
+	*modification_time = (i64)st.st_mtime;
+	return true;
+}
+
+// Encodes a BGRA tile as a baseline JPEG stream (YCbCr, 2x2 chroma subsampling). The result is allocated with malloc().
+u8* encode_tile(u8* pixels, u32 width, u32 height, u64* size) {
+	return encode_tile_with_quality(pixels, width, height, PYRAMID_JPEG_QUALITY, size);
+}
+
+u8* encode_tile_with_quality(u8* pixels, u32 width, u32 height, i32 quality, u64* size) {
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+
+	unsigned char* output = NULL;
+	unsigned long output_size = 0;
+	jpeg_mem_dest(&cinfo, &output, &output_size);
+
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+
+	u8* row = (u8*) malloc(width * 3);
+	while (cinfo.next_scanline < cinfo.image_height) {
+		u8* src = pixels + (u64)cinfo.next_scanline * width * 4;
+		for (u32 x = 0; x < width; ++x) {
+			row[x * 3 + 0] = src[x * 4 + 2];
+			row[x * 3 + 1] = src[x * 4 + 1];
+			row[x * 3 + 2] = src[x * 4 + 0];
+		}
+		JSAMPROW rows[1] = { row };
+		jpeg_write_scanlines(&cinfo, rows, 1);
+	}
+	free(row);
+
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	*size = output_size;
+	return output;
+}
+
+// The slide levels have their tables in the slide file; the levels generated so far have them in memory, and their
+// tiles in the sidecar file that is being written.
+typedef struct {
+	tiff_ifd_t* ifd;
+	bool32 is_generated;
+	pyramid_level_header_t header;
+	u64* tile_offsets;
+	u64* tile_byte_counts;
+} pyramid_build_level_t;
+
+static bool32 read_source_tile(tiff_t* tiff, FILE* sidecar_fp, pyramid_build_level_t* level, u32 tile_index,
+                               u8** buffer, u64* buffer_capacity, u64* size) {
+	u64* tile_offsets = level->is_generated ? level->tile_offsets : level->ifd->tile_offsets;
+	u64* tile_byte_counts = level->is_generated ? level->tile_byte_counts : level->ifd->tile_byte_counts;
+	u64 offset = tile_offsets[tile_index];
+	u64 tile_size = tile_byte_counts[tile_index];
+	*size = 0;
+	if (offset == 0 || tile_size == 0) {
+		return true; // empty tile
+	}
+	if (tile_size > *buffer_capacity) {
+		*buffer = (u8*) realloc(*buffer, tile_size);
+		*buffer_capacity = tile_size;
+	}
+	bool32 ok;
+	if (level->is_generated) {
+		ok = (file_read_at_offset(*buffer, sidecar_fp, offset, tile_size) == 1);
+	} else {
+		ok = (tiff_read_at_offset(tiff, *buffer, offset, tile_size) == 1);
+	}
+	if (ok) *size = tile_size;
+	return ok;
+}
+
+bool32 build_pyramid_sidecar(tiff_t* tiff, const char* slide_filename) {
+	pyramid_build_level_t levels[PYRAMID_MAX_LEVELS] = {0};
+	i32 max_level = -1;
+	for (i32 i = 0; i < tiff->level_count; ++i) {
+		tiff_ifd_t* ifd = tiff->level_images + i;
+		i32 level = get_downsample_level(tiff, ifd);
+		if (level >= 0 && level < PYRAMID_MAX_LEVELS && !levels[level].ifd) {
+			levels[level].ifd = ifd;
+			max_level = ATLEAST(max_level, level);
+		}
+	}
+	if (max_level < 0 || !levels[0].ifd) {
+		printf("Pyramid: %s has no usable levels\n", slide_filename);
+		return false;
+	}
+	i32 missing_level_count = 0;
+	for (i32 level = 1; level < max_level; ++level) {
+		if (!levels[level].ifd) ++missing_level_count;
+	}
+	if (missing_level_count == 0) {
+		printf("Pyramid: %s has no missing levels\n", slide_filename);
+		return true;
+	}
+
+	pyramid_file_header_t file_header = { .magic = PYRAMID_FILE_MAGIC, .version = PYRAMID_FILE_VERSION,
+	                                      .level_count = (u32)missing_level_count };
+	if (!get_source_file_identity(slide_filename, &file_header.source_filesize, &file_header.source_modification_time)) {
+		return false;
+	}
+
+	char sidecar_filename[2048];
+	char temp_filename[2048];
+	snprintf(sidecar_filename, sizeof(sidecar_filename), "%s.pyramid", slide_filename);
+	snprintf(temp_filename, sizeof(temp_filename), "%s.pyramid.tmp", slide_filename);
+	FILE* fp = fopen64(temp_filename, "w+b");
+	if (!fp) {
+		printf("Pyramid: could not create %s\n", temp_filename);
+		return false;
+	}
+
+	// The headers are written again at the end, when the table offsets are known.
+	pyramid_level_header_t level_headers[PYRAMID_MAX_LEVELS] = {0};
+	bool32 ok = (fwrite(&file_header, sizeof(file_header), 1, fp) == 1) &&
+	            (fwrite(level_headers, sizeof(pyramid_level_header_t) * missing_level_count, 1, fp) == 1);
+
+	jpeg_decoder_state_t* decoder = jpeg_decoder_create_state();
+	u8* source_buffer = NULL;
+	u64 source_buffer_capacity = 0;
+	u8* pixels = NULL;
+
+	// Each missing level is made from the level just finer than it, which may itself be generated: every output
+	// tile covers 2x2 tiles of the source level, each decoded at half resolution into one quadrant.
+	for (i32 level = 1; level < max_level && ok; ++level) {
+		if (levels[level].ifd) continue;
+		pyramid_build_level_t* source = levels + level - 1;
+		if (!source->is_generated && !tiff_load_tile_tables(tiff, source->ifd)) {
+			ok = false;
+			break;
+		}
+		pyramid_level_header_t* source_header = &source->header;
+		if (!source->is_generated) {
+			tiff_ifd_t* ifd = source->ifd;
+			*source_header = (pyramid_level_header_t){ .image_width = ifd->image_width, .image_height = ifd->image_height,
+			                                           .tile_width = ifd->tile_width, .tile_height = ifd->tile_height,
+			                                           .width_in_tiles = ifd->width_in_tiles,
+			                                           .height_in_tiles = ifd->height_in_tiles };
+		}
+		bool32 is_YCbCr = !source->is_generated ? (source->ifd->color_space == TIFF_PHOTOMETRIC_YCBCR) : true;
+		u8* jpeg_tables = !source->is_generated ? source->ifd->jpeg_tables : NULL;
+		u32 jpeg_tables_length = !source->is_generated ? (u32)source->ifd->jpeg_tables_length : 0;
+
+		pyramid_build_level_t* target = levels + level;
+		pyramid_level_header_t* header = &target->header;
+		header->downsample_level = (u32)level;
+		header->image_width = (source_header->image_width + 1) / 2;
+		header->image_height = (source_header->image_height + 1) / 2;
+		header->tile_width = source_header->tile_width;
+		header->tile_height = source_header->tile_height;
+		header->width_in_tiles = (header->image_width + header->tile_width - 1) / header->tile_width;
+		header->height_in_tiles = (header->image_height + header->tile_height - 1) / header->tile_height;
+		header->tile_count = (u64)header->width_in_tiles * header->height_in_tiles;
+		target->tile_offsets = (u64*) calloc(1, header->tile_count * sizeof(u64));
+		target->tile_byte_counts = (u64*) calloc(1, header->tile_count * sizeof(u64));
+		target->is_generated = true;
+
+		u32 tile_width = header->tile_width;
+		u32 tile_height = header->tile_height;
+		u32 pitch = tile_width * 4;
+		pixels = (u8*) realloc(pixels, (u64)pitch * tile_height);
+
+		printf("Pyramid: generating level %d (%u x %u tiles)\n", level, header->width_in_tiles, header->height_in_tiles);
+		for (u32 tile_y = 0; tile_y < header->height_in_tiles && ok; ++tile_y) {
+			for (u32 tile_x = 0; tile_x < header->width_in_tiles && ok; ++tile_x) {
+				memset(pixels, 0xFF, (u64)pitch * tile_height); // the parts not covered by a source tile stay white
+				bool32 has_content = false;
+				for (u32 quadrant = 0; quadrant < 4 && ok; ++quadrant) {
+					u32 source_x = tile_x * 2 + (quadrant & 1);
+					u32 source_y = tile_y * 2 + (quadrant >> 1);
+					if (source_x >= source_header->width_in_tiles || source_y >= source_header->height_in_tiles) continue;
+					u32 source_tile_index = source_y * source_header->width_in_tiles + source_x;
+					u64 source_size = 0;
+					ok = read_source_tile(tiff, fp, source, source_tile_index, &source_buffer, &source_buffer_capacity,
+					                      &source_size);
+					if (!ok || source_size == 0) continue;
+					u8* dest = pixels + (u64)((quadrant >> 1) * (tile_height / 2)) * pitch + (quadrant & 1) * (tile_width / 2) * 4;
+					if (decode_tile_with_state(decoder, jpeg_tables, jpeg_tables_length, source_buffer, (u32)source_size,
+					                           dest, pitch, is_YCbCr, 2)) {
+						has_content = true;
+					}
+				}
+				if (!ok || !has_content) continue;
+
+				u64 encoded_size = 0;
+				u8* encoded = encode_tile(pixels, tile_width, tile_height, &encoded_size);
+				fseeko64(fp, 0, SEEK_END);
+				u64 offset = (u64)ftello64(fp);
+				ok = (fwrite(encoded, encoded_size, 1, fp) == 1);
+				free(encoded);
+				u32 tile_index = tile_y * header->width_in_tiles + tile_x;
+				target->tile_offsets[tile_index] = offset;
+				target->tile_byte_counts[tile_index] = encoded_size;
+			}
+		}
+	}
+
+	// Now that all tile data is written, append the tables and fill in the headers.
+	i32 header_index = 0;
+	for (i32 level = 1; level < max_level && ok; ++level) {
+		pyramid_build_level_t* build_level = levels + level;
+		if (!build_level->is_generated) continue;
+		fseeko64(fp, 0, SEEK_END);
+		build_level->header.tile_tables_offset = (u64)ftello64(fp);
+		u64 table_size = build_level->header.tile_count * sizeof(u64);
+		ok = (fwrite(build_level->tile_offsets, table_size, 1, fp) == 1) &&
+		     (fwrite(build_level->tile_byte_counts, table_size, 1, fp) == 1);
+		level_headers[header_index++] = build_level->header;
+	}
+	if (ok) {
+		fseeko64(fp, 0, SEEK_SET);
+		ok = (fwrite(&file_header, sizeof(file_header), 1, fp) == 1) &&
+		     (fwrite(level_headers, sizeof(pyramid_level_header_t) * missing_level_count, 1, fp) == 1);
+	}
+	ok = (fclose(fp) == 0) && ok;
+
+	for (i32 level = 0; level < PYRAMID_MAX_LEVELS; ++level) {
+		if (levels[level].tile_offsets) free(levels[level].tile_offsets);
+		if (levels[level].tile_byte_counts) free(levels[level].tile_byte_counts);
+	}
+	if (source_buffer) free(source_buffer);
+	if (pixels) free(pixels);
+	jpeg_decoder_destroy_state(decoder);
+
+	if (ok) {
+		remove(sidecar_filename); // rename() does not replace an existing file on Windows
+		ok = (rename(temp_filename, sidecar_filename) == 0);
+	}
+	if (ok) {
+		printf("Pyramid: wrote %d generated level(s) to %s\n", missing_level_count, sidecar_filename);
+	} else {
+		printf("Pyramid: could not write %s\n", sidecar_filename);
+		remove(temp_filename);
+	}
+	return ok;
+}
+
+// The generated levels are added after the levels of the slide itself, so that the level indices of the slide don't
+// change (the client can tell the levels apart by their resolution). The tile offsets are shifted past the end of the
+// slide file, so that the generated tiles can be told apart (see pyramid_resolve_offset()).
+bool32 load_pyramid_sidecar(tiff_t* tiff, const char* slide_filename, pyramid_t* pyramid) {
+	memset(pyramid, 0, sizeof(*pyramid));
+	char sidecar_filename[2048];
+	snprintf(sidecar_filename, sizeof(sidecar_filename), "%s.pyramid", slide_filename);
+	FILE* fp = fopen64(sidecar_filename, "rb");
+	if (!fp) {
+		return false;
+	}
+
+	pyramid_file_header_t file_header = {0};
+	pyramid_level_header_t level_headers[PYRAMID_MAX_LEVELS];
+	i64 filesize = 0;
+	i64 modification_time = 0;
+	bool32 ok = (fread(&file_header, sizeof(file_header), 1, fp) == 1) &&
+	            file_header.magic == PYRAMID_FILE_MAGIC && file_header.version == PYRAMID_FILE_VERSION &&
+	            file_header.level_count > 0 && file_header.level_count <= PYRAMID_MAX_LEVELS &&
+	            get_source_file_identity(slide_filename, &filesize, &modification_time) &&
+	            file_header.source_filesize == filesize && file_header.source_modification_time == modification_time &&
+	            fread(level_headers, sizeof(pyramid_level_header_t) * file_header.level_count, 1, fp) == 1;
+	if (!ok) {
+		printf("Pyramid: ignoring %s (invalid, or out of date)\n", sidecar_filename);
+		fclose(fp);
+		return false;
+	}
+
+	u32 level_count = file_header.level_count;
+	tiff_ifd_t* new_ifds = (tiff_ifd_t*) calloc(1, level_count * sizeof(tiff_ifd_t));
+	for (u32 i = 0; i < level_count && ok; ++i) {
+		pyramid_level_header_t* header = level_headers + i;
+		tiff_ifd_t* ifd = new_ifds + i;
+		u64 table_size = header->tile_count * sizeof(u64);
+		ifd->tile_offsets = (u64*) malloc(table_size);
+		ifd->tile_byte_counts = (u64*) malloc(table_size);
+		ok = header->tile_count == (u64)header->width_in_tiles * header->height_in_tiles &&
+		     header->downsample_level < PYRAMID_MAX_LEVELS &&
+		     file_read_at_offset(ifd->tile_offsets, fp, header->tile_tables_offset, table_size) == 1 &&
+		     file_read_at_offset(ifd->tile_byte_counts, fp, header->tile_tables_offset + table_size, table_size) == 1;
+		if (!ok) break;
+		for (u64 tile_index = 0; tile_index < header->tile_count; ++tile_index) {
+			if (ifd->tile_offsets[tile_index] != 0) {
+				ifd->tile_offsets[tile_index] += (u64)tiff->filesize;
+			}
+		}
+		float downsample_factor = (float)(1 << header->downsample_level);
+		ifd->image_width = header->image_width;
+		ifd->image_height = header->image_height;
+		ifd->tile_width = header->tile_width;
+		ifd->tile_height = header->tile_height;
+		ifd->tile_count = header->tile_count;
+		ifd->width_in_tiles = header->width_in_tiles;
+		ifd->height_in_tiles = header->height_in_tiles;
+		ifd->are_tile_tables_loaded = true;
+		ifd->compression = TIFF_COMPRESSION_JPEG;
+		ifd->color_space = TIFF_PHOTOMETRIC_YCBCR;
+		ifd->subimage_type = TIFF_LEVEL_SUBIMAGE;
+		ifd->chroma_subsampling_horizontal = 2;
+		ifd->chroma_subsampling_vertical = 2;
+		ifd->um_per_pixel_x = tiff->mpp_x * downsample_factor;
+		ifd->um_per_pixel_y = tiff->mpp_y * downsample_factor;
+		ifd->x_tile_side_in_um = ifd->um_per_pixel_x * (float)ifd->tile_width;
+		ifd->y_tile_side_in_um = ifd->um_per_pixel_y * (float)ifd->tile_height;
+		tiff_select_tile_path(ifd);
+	}
+	if (!ok) {
+		printf("Pyramid: could not read %s\n", sidecar_filename);
+		for (u32 i = 0; i < level_count; ++i) {
+			if (new_ifds[i].tile_offsets) free(new_ifds[i].tile_offsets);
+			if (new_ifds[i].tile_byte_counts) free(new_ifds[i].tile_byte_counts);
+		}
+		free(new_ifds);
+		fclose(fp);
+		return false;
+	}
+
+	// Insert the new IFDs after the last level (the IFDs after it, e.g. the macro and label images, move up).
+	u64 insert_index = tiff->level_image_index + tiff->level_count;
+	bool32 has_macro_image = (tiff->macro_image != NULL);
+	bool32 has_label_image = (tiff->label_image != NULL);
+	for (u32 i = 0; i < level_count; ++i) {
+		tiff_ifd_t dummy = {0};
+		sb_push(tiff->ifds, dummy);
+	}
+	memmove(tiff->ifds + insert_index + level_count, tiff->ifds + insert_index,
+	        (tiff->ifd_count - insert_index) * sizeof(tiff_ifd_t));
+	memcpy(tiff->ifds + insert_index, new_ifds, level_count * sizeof(tiff_ifd_t));
+	for (u32 i = 0; i < level_count; ++i) {
+		memory_stats_add(MEMORY_DOMAIN_TIFF_METADATA, 2 * new_ifds[i].tile_count * sizeof(u64)); // freed by tiff_destroy()
+	}
+	free(new_ifds);
+	tiff->ifd_count += level_count;
+	for (u64 i = 0; i < tiff->ifd_count; ++i) {
+		tiff->ifds[i].ifd_index = i;
+	}
+	if (tiff->macro_image_index >= insert_index) tiff->macro_image_index += level_count;
+	if (tiff->label_image_index >= insert_index) tiff->label_image_index += level_count;
+	tiff->main_image = tiff->ifds + tiff->main_image_index;
+	tiff->macro_image = has_macro_image ? tiff->ifds + tiff->macro_image_index : NULL;
+	tiff->label_image = has_label_image ? tiff->ifds + tiff->label_image_index : NULL;
+	tiff->level_images = tiff->ifds + tiff->level_image_index;
+
+	pyramid->fp = fp;
+	pyramid->first_level = tiff->level_count;
+	pyramid->level_count = level_count;
+	pyramid->base_offset = (u64)tiff->filesize;
+	tiff->level_count += level_count;
+	printf("Pyramid: loaded %u generated level(s) from %s\n", level_count, sidecar_filename);
+	return true;
+}
+
+FILE* pyramid_resolve_offset(tiff_t* tiff, pyramid_t* pyramid, u64* offset, volatile i32** fp_lock) {
+	if (pyramid->fp && *offset >= pyramid->base_offset) {
+		*offset -= pyramid->base_offset;
+		*fp_lock = &pyramid->fp_lock;
+		return pyramid->fp;
+	}
+	*fp_lock = &tiff->fp_lock;
+	return tiff->fp;
+}
+
+void pyramid_destroy(pyramid_t* pyramid) {
+	if (pyramid->fp) {
+		fclose(pyramid->fp);
+	}
+	memset(pyramid, 0, sizeof(*pyramid));
+}
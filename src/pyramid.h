@@ -0,0 +1,84 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+#include "tiff.h"
+
+// Some scanners only store every 2nd or 4th level of the pyramid. The missing levels can be generated once, and
+// stored in a sidecar file next to the slide (<slide>.pyramid). The server then advertises them as extra levels,
+// so that remote clients don't have to download many more tiles of the nearest finer level when zoomed out.
+//
+// Sidecar file layout:
+//   pyramid_file_header_t
+//   pyramid_level_header_t[level_count]
+//   tile data (each tile a complete JPEG stream; tiles are empty if all of their source tiles are empty)
+//   per level: u64 tile_offsets[tile_count], u64 tile_byte_counts[tile_count]
+
+#define PYRAMID_FILE_MAGIC 0x4D525950 // "PYRM"
+#define PYRAMID_FILE_VERSION 1
+#define PYRAMID_MAX_LEVELS 32
+#define PYRAMID_JPEG_QUALITY 90
+
+#pragma pack(push, 1)
+typedef struct {
+	u32 magic;
+	u32 version;
+	i64 source_filesize; // the sidecar is only valid for the slide as it was when the levels were generated
+	i64 source_modification_time;
+	u32 level_count;
+	u32 reserved;
+} pyramid_file_header_t;
+
+typedef struct {
+	u32 downsample_level; // the level is downsampled (1 << downsample_level) times compared to the main image
+	u32 image_width;
+	u32 image_height;
+	u32 tile_width;
+	u32 tile_height;
+	u32 width_in_tiles;
+	u32 height_in_tiles;
+	u32 reserved;
+	u64 tile_count;
+	u64 tile_tables_offset;
+} pyramid_level_header_t;
+#pragma pack(pop)
+
+typedef struct {
+	FILE* fp;
+	volatile i32 fp_lock;
+	u64 first_level; // the generated levels are tiff->level_images[first_level] and onwards
+	u64 level_count;
+	u64 base_offset; // the tile offsets of the generated levels are shifted by this (the size of the slide file)
+} pyramid_t;
+
+u8* encode_tile(u8* pixels, u32 width, u32 height, u64* size);
+u8* encode_tile_with_quality(u8* pixels, u32 width, u32 height, i32 quality, u64* size);
+bool32 build_pyramid_sidecar(tiff_t* tiff, const char* slide_filename);
+bool32 load_pyramid_sidecar(tiff_t* tiff, const char* slide_filename, pyramid_t* pyramid);
+FILE* pyramid_resolve_offset(tiff_t* tiff, pyramid_t* pyramid, u64* offset, volatile i32** fp_lock);
+void pyramid_destroy(pyramid_t* pyramid);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,593 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#include "win32_main.h"
+#include "platform.h"
+#include "intrinsics.h"
+
+#include <stdio.h>
+#include <math.h>
+
+#include "stretchy_buffer.h"
+#include "viewer.h"
+#include "jpeglib.h"
+#include "region_export.h"
+
+typedef struct region_export_t region_export_t;
+typedef struct export_strip_t export_strip_t;
+
+// A row of output tiles within a strip, read (and for TIFF also encoded) by one worker.
+typedef struct export_block_t {
+	region_export_t* job;
+	export_strip_t* strip;
+	i32 first_tile_x;
+	i32 tile_count;
+} export_block_t;
+
+struct export_strip_t {
+	i32 strip_index;
+	u8* pixels; // JPEG: the whole strip, the width of the region and EXPORT_TILE_DIM rows high (BGRA)
+	u8** encoded_tiles; // TIFF: a JPEG stream for each output tile of the strip (allocated with malloc())
+	u64* encoded_tile_sizes;
+	export_block_t* blocks;
+	volatile i32 blocks_remaining;
+};
+
+struct region_export_t {
+	image_t* image;
+	i32 level;
+	i64 x, y, width, height; // in pixels of the level
+	export_format_enum format;
+	char* filename;
+	i32 tiles_across;
+	i32 tiles_down; // = the number of strips
+	i32 blocks_per_strip;
+	export_strip_t strips[2]; // one is written out while the workers fill the other
+	i64 start_clock;
+	volatile i32 blocks_done;
+	volatile i32 is_cancelled;
+	volatile i32 is_done;
+	bool32 success;
+};
+
+static region_export_t** region_exports; // sb, only accessed by the main thread
+
+// Returns false if there are no tiles for the level in the file (synthesized levels are not exported).
+bool32 get_exportable_level_size(image_t* image, i32 level, i64* width, i64* height) {
+	if (level < 0 || level >= image->level_count) {
+		return false;
+	}
+	if (image->type == IMAGE_TYPE_TIFF) {
+		i32 tiff_level = image->level_images[level].tiff_level;
+		if (tiff_level < 0) return false;
+		tiff_ifd_t* ifd = image->tiff.tiff.level_images + tiff_level;
+		*width = ifd->image_width;
+		*height = ifd->image_height;
+		return true;
+	} else if (image->type == IMAGE_TYPE_WSI) {
+		if (level >= image->wsi.wsi.level_count) return false;
+		*width = image->wsi.wsi.levels[level].width;
+		*height = image->wsi.wsi.levels[level].height;
+		return true;
+	}
+	return false;
+}
+
+static void fill_white(u8* dest, u32 dest_pitch, i32 width, i32 height) {
+	for (i32 y = 0; y < height; ++y) {
+		memset(dest + (u64)y * dest_pitch, 0xFF, (u64)width * BYTES_PER_PIXEL);
+	}
+}
+
+// Decodes the tiles of the slide that overlap the area, and copies the overlapping parts into dest. Areas without
+// image data stay white.
+static void read_tiff_region(i32 logical_thread_index, image_t* image, i32 level, i64 x, i64 y, i32 width, i32 height,
+                             u8* dest, u32 dest_pitch) {
+	tiff_t* tiff = &image->tiff.tiff;
+	i32 tiff_level = image->level_images[level].tiff_level;
+	tiff_ifd_t* ifd = tiff->level_images + tiff_level;
+	if (!tiff_load_tile_tables(tiff, ifd)) {
+		return;
+	}
+	thread_memory_t* thread_memory = (thread_memory_t*) thread_local_storage[logical_thread_index];
+	u8* compressed_buffer = (u8*) thread_memory->aligned_rest_of_thread_memory;
+	u64 compressed_buffer_capacity = thread_memory->thread_memory_usable_size;
+	u32 tile_pitch = ifd->tile_width * BYTES_PER_PIXEL;
+	u8* tile_pixels = (u8*) malloc((u64)tile_pitch * ifd->tile_height);
+
+	i64 tile_x1 = x / ifd->tile_width;
+	i64 tile_y1 = y / ifd->tile_height;
+	i64 tile_x2 = ATMOST((x + width - 1) / ifd->tile_width + 1, (i64)ifd->width_in_tiles);
+	i64 tile_y2 = ATMOST((y + height - 1) / ifd->tile_height + 1, (i64)ifd->height_in_tiles);
+	for (i64 tile_y = tile_y1; tile_y < tile_y2; ++tile_y) {
+		for (i64 tile_x = tile_x1; tile_x < tile_x2; ++tile_x) {
+			i32 tile_index = (i32)(tile_y * ifd->width_in_tiles + tile_x);
+			if (ifd->tile_offsets[tile_index] == 0 || ifd->tile_byte_counts[tile_index] <= 2) {
+				continue; // empty tile
+			}
+			if (!is_tissue_in_tile(image, image->level_images + level, (i32)tile_x, (i32)tile_y)) {
+				continue; // only glass (see tissue_mask.c): exported as white, without reading it
+			}
+			u8* compressed_data = get_compressed_tile_data(logical_thread_index, image, tiff_level, tile_index,
+			                                               compressed_buffer, compressed_buffer_capacity);
+			if (!compressed_data) continue;
+			memset(tile_pixels, 0xFF, (u64)tile_pitch * ifd->tile_height); // (stays white if the JPEG stream is empty)
+			if (!decode_compressed_tile_scaled(logical_thread_index, ifd, compressed_data,
+			                                   ifd->tile_byte_counts[tile_index], tile_pixels, tile_pitch, 1)) {
+				continue;
+			}
+			i64 tile_pixel_x = tile_x * ifd->tile_width;
+			i64 tile_pixel_y = tile_y * ifd->tile_height;
+			i64 x1 = ATLEAST(x, tile_pixel_x);
+			i64 y1 = ATLEAST(y, tile_pixel_y);
+			i64 x2 = ATMOST(x + width, tile_pixel_x + ifd->tile_width);
+			i64 y2 = ATMOST(y + height, tile_pixel_y + ifd->tile_height);
+			for (i64 row = y1; row < y2; ++row) {
+				memcpy(dest + (row - y) * dest_pitch + (x1 - x) * BYTES_PER_PIXEL,
+				       tile_pixels + (row - tile_pixel_y) * tile_pitch + (x1 - tile_pixel_x) * BYTES_PER_PIXEL,
+				       (x2 - x1) * BYTES_PER_PIXEL);
+			}
+		}
+	}
+	free(tile_pixels);
+}
+
+static void read_wsi_region(i32 logical_thread_index, image_t* image, i32 level, i64 x, i64 y, i32 width, i32 height,
+                            u8* dest, u32 dest_pitch) {
+	u32* pixels = (u32*) malloc((u64)width * height * BYTES_PER_PIXEL);
+	openslide_t* osr = get_wsi_handle_for_thread(&image->wsi.wsi, logical_thread_index);
+	openslide.openslide_read_region(osr, pixels, x << level, y << level, level, width, height);
+	for (i32 row = 0; row < height; ++row) {
+		u32* src = pixels + (u64)row * width;
+		for (i32 i = 0; i < width; ++i) {
+			if ((src[i] >> 24) == 0) src[i] = 0xFFFFFFFF; // transparent (outside of the scanned area): white
+		}
+		memcpy(dest + (u64)row * dest_pitch, src, (u64)width * BYTES_PER_PIXEL);
+	}
+	free(pixels);
+}
+
+// Reads an area of a level that is in the file (see get_exportable_level_size()) into dest, as BGRA pixels. The tiles
+// are decoded on the calling thread. Areas without image data are left as they are.
+void read_slide_region(i32 logical_thread_index, image_t* image, i32 level, i64 x, i64 y, i32 width, i32 height,
+                       u8* dest, u32 dest_pitch) {
+	if (image->type == IMAGE_TYPE_TIFF) {
+		read_tiff_region(logical_thread_index, image, level, x, y, width, height, dest, dest_pitch);
+	} else if (image->type == IMAGE_TYPE_WSI) {
+		read_wsi_region(logical_thread_index, image, level, x, y, width, height, dest, dest_pitch);
+	}
+}
+
+static void bgra_row_to_rgb(u8* dest, const u8* src, u32 pixel_count) {
+	for (u32 i = 0; i < pixel_count; ++i) {
+		dest[i * 3 + 0] = src[i * 4 + 2];
+		dest[i * 3 + 1] = src[i * 4 + 1];
+		dest[i * 3 + 2] = src[i * 4 + 0];
+	}
+}
+
+// Like encode_tile() in pyramid.c, but from a part of a larger buffer. The result is allocated with malloc().
+static u8* encode_export_tile(u8* pixels, u32 pitch, u32 width, u32 height, u64* size) {
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+
+	unsigned char* output = NULL;
+	unsigned long output_size = 0;
+	jpeg_mem_dest(&cinfo, &output, &output_size);
+
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, EXPORT_JPEG_QUALITY, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+
+	u8* row = (u8*) malloc(width * 3);
+	while (cinfo.next_scanline < cinfo.image_height) {
+		bgra_row_to_rgb(row, pixels + (u64)cinfo.next_scanline * pitch, width);
+		JSAMPROW rows[1] = { row };
+		jpeg_write_scanlines(&cinfo, rows, 1);
+	}
+	free(row);
+
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	*size = output_size;
+	return output;
+}
+
+static void export_block_func(i32 logical_thread_index, void* userdata) {
+	export_block_t* block = (export_block_t*) userdata;
+	region_export_t* job = block->job;
+	export_strip_t* strip = block->strip;
+	if (!job->is_cancelled) {
+		i64 block_x = (i64)block->first_tile_x * EXPORT_TILE_DIM;
+		i64 strip_y = (i64)strip->strip_index * EXPORT_TILE_DIM;
+		i32 width = (i32)ATMOST((i64)block->tile_count * EXPORT_TILE_DIM, job->width - block_x);
+		i32 height = (i32)ATMOST(EXPORT_TILE_DIM, job->height - strip_y);
+		// For TIFF, the block gets a buffer of its own: the tiles at the edges are always whole (and white outside
+		// of the region).
+		u32 pitch = (job->format == EXPORT_FORMAT_JPEG) ? (u32)job->width * BYTES_PER_PIXEL
+		                                                : (u32)block->tile_count * EXPORT_TILE_DIM * BYTES_PER_PIXEL;
+		u8* pixels = NULL;
+		if (job->format == EXPORT_FORMAT_JPEG) {
+			pixels = strip->pixels + block_x * BYTES_PER_PIXEL;
+			fill_white(pixels, pitch, width, height);
+		} else {
+			pixels = (u8*) malloc((u64)pitch * EXPORT_TILE_DIM);
+			memset(pixels, 0xFF, (u64)pitch * EXPORT_TILE_DIM);
+		}
+		read_slide_region(logical_thread_index, job->image, job->level, job->x + block_x, job->y + strip_y,
+		                  width, height, pixels, pitch);
+		if (job->format == EXPORT_FORMAT_TIFF) {
+			for (i32 i = 0; i < block->tile_count; ++i) {
+				i32 tile_x = block->first_tile_x + i;
+				strip->encoded_tiles[tile_x] = encode_export_tile(pixels + i * EXPORT_TILE_DIM * BYTES_PER_PIXEL, pitch,
+				                                                  EXPORT_TILE_DIM, EXPORT_TILE_DIM,
+				                                                  &strip->encoded_tile_sizes[tile_x]);
+			}
+			free(pixels);
+		}
+	}
+	interlocked_increment(&job->blocks_done);
+	write_barrier;
+	interlocked_decrement(&strip->blocks_remaining);
+}
+
+static void submit_export_strip(i32 logical_thread_index, region_export_t* job, export_strip_t* strip, i32 strip_index) {
+	strip->strip_index = strip_index;
+	strip->blocks_remaining = job->blocks_per_strip;
+	write_barrier;
+	for (i32 i = 0; i < job->blocks_per_strip; ++i) {
+		export_block_t* block = strip->blocks + i;
+		block->job = job;
+		block->strip = strip;
+		block->first_tile_x = i * EXPORT_BLOCK_TILES;
+		block->tile_count = ATMOST(EXPORT_BLOCK_TILES, job->tiles_across - block->first_tile_x);
+		if (!add_work_queue_entry(&work_queue, export_block_func, block)) {
+			export_block_func(logical_thread_index, block); // queue is full, do it now
+		}
+	}
+}
+
+// Helps out with the work queue while waiting (the region is read by the same workers).
+static void wait_for_export_strip(i32 logical_thread_index, export_strip_t* strip) {
+	while (strip->blocks_remaining > 0) {
+		if (!do_worker_work(&work_queue, logical_thread_index)) {
+			platform_sleep(1);
+		}
+	}
+	read_barrier;
+}
+
+#pragma pack(push, 1)
+typedef struct bigtiff_tag_t {
+	u16 code;
+	u16 type;
+	u64 count;
+	u64 value; // or the offset of the values, if they don't fit
+} bigtiff_tag_t;
+#pragma pack(pop)
+
+static bigtiff_tag_t make_bigtiff_tag(u16 code, u16 type, u64 count, const void* values, u32 value_size) {
+	bigtiff_tag_t tag = { .code = code, .type = type, .count = count };
+	ASSERT(value_size <= sizeof(tag.value));
+	memcpy(&tag.value, values, value_size);
+	return tag;
+}
+
+// Writes the tile tables and the image file directory after the tiles, and points the header to it.
+static bool32 finish_bigtiff(FILE* fp, u64 file_position, region_export_t* job, u64* tile_offsets,
+                             u64* tile_byte_counts) {
+	u64 tile_count = (u64)job->tiles_across * job->tiles_down;
+	u64 tile_offsets_offset = file_position;
+	u64 tile_byte_counts_offset = tile_offsets_offset + tile_count * sizeof(u64);
+	u64 ifd_offset = tile_byte_counts_offset + tile_count * sizeof(u64);
+	if (fwrite(tile_offsets, sizeof(u64), tile_count, fp) != tile_count ||
+	    fwrite(tile_byte_counts, sizeof(u64), tile_count, fp) != tile_count) {
+		return false;
+	}
+
+	u32 width = (u32)job->width;
+	u32 height = (u32)job->height;
+	u16 bits_per_sample[3] = { 8, 8, 8 };
+	u16 compression = TIFF_COMPRESSION_JPEG;
+	u16 photometric = TIFF_PHOTOMETRIC_YCBCR; // the JPEG streams are YCbCr, with 2x2 chroma subsampling
+	u16 samples_per_pixel = 3;
+	u16 planar_configuration = 1;
+	u16 resolution_unit = 3; // centimeter
+	u32 tile_dim = EXPORT_TILE_DIM;
+	u16 ycbcr_subsampling[2] = { 2, 2 };
+	level_image_t* level_image = job->image->level_images + job->level;
+	u32 x_resolution[2] = { (u32)(10000.0f / level_image->um_per_pixel_x * 100.0f), 100 }; // pixels per cm
+	u32 y_resolution[2] = { (u32)(10000.0f / level_image->um_per_pixel_y * 100.0f), 100 };
+	bigtiff_tag_t tags[] = {
+		make_bigtiff_tag(256, 4, 1, &width, sizeof(width)), // ImageWidth
+		make_bigtiff_tag(257, 4, 1, &height, sizeof(height)), // ImageLength
+		make_bigtiff_tag(258, 3, 3, bits_per_sample, sizeof(bits_per_sample)), // BitsPerSample
+		make_bigtiff_tag(259, 3, 1, &compression, sizeof(compression)), // Compression
+		make_bigtiff_tag(262, 3, 1, &photometric, sizeof(photometric)), // PhotometricInterpretation
+		make_bigtiff_tag(277, 3, 1, &samples_per_pixel, sizeof(samples_per_pixel)), // SamplesPerPixel
+		make_bigtiff_tag(282, 5, 1, x_resolution, sizeof(x_resolution)), // XResolution
+		make_bigtiff_tag(283, 5, 1, y_resolution, sizeof(y_resolution)), // YResolution
+		make_bigtiff_tag(284, 3, 1, &planar_configuration, sizeof(planar_configuration)), // PlanarConfiguration
+		make_bigtiff_tag(296, 3, 1, &resolution_unit, sizeof(resolution_unit)), // ResolutionUnit
+		make_bigtiff_tag(322, 4, 1, &tile_dim, sizeof(tile_dim)), // TileWidth
+		make_bigtiff_tag(323, 4, 1, &tile_dim, sizeof(tile_dim)), // TileLength
+		make_bigtiff_tag(324, 16, tile_count, &tile_offsets_offset, sizeof(u64)), // TileOffsets
+		make_bigtiff_tag(325, 16, tile_count, &tile_byte_counts_offset, sizeof(u64)), // TileByteCounts
+		make_bigtiff_tag(530, 3, 2, ycbcr_subsampling, sizeof(ycbcr_subsampling)), // YCbCrSubSampling
+	};
+	u64 tag_count = COUNT(tags);
+	u64 next_ifd_offset = 0;
+	if (fwrite(&tag_count, sizeof(tag_count), 1, fp) != 1 || fwrite(tags, sizeof(tags), 1, fp) != 1 ||
+	    fwrite(&next_ifd_offset, sizeof(next_ifd_offset), 1, fp) != 1) {
+		return false;
+	}
+	// The header is followed by the offset of the first image file directory.
+	return (fseek(fp, 8, SEEK_SET) == 0 && fwrite(&ifd_offset, sizeof(ifd_offset), 1, fp) == 1);
+}
+
+static bool32 run_region_export(i32 logical_thread_index, region_export_t* job) {
+	FILE* fp = fopen(job->filename, "wb");
+	if (!fp) {
+		printf("Export: could not open %s for writing\n", job->filename);
+		return false;
+	}
+	bool32 success = true;
+	u64 tile_count = (u64)job->tiles_across * job->tiles_down;
+	u64* tile_offsets = NULL;
+	u64* tile_byte_counts = NULL;
+	u64 file_position = 0;
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	u8* rgb_row = NULL;
+
+	if (job->format == EXPORT_FORMAT_TIFF) {
+		tile_offsets = (u64*) calloc(tile_count, sizeof(u64));
+		tile_byte_counts = (u64*) calloc(tile_count, sizeof(u64));
+		// BigTIFF header: little-endian, version 43, 8-byte offsets; the offset of the directory is filled in at the end.
+		u8 header[16] = { 'I', 'I', 43, 0, 8, 0, 0, 0 };
+		success = (fwrite(header, sizeof(header), 1, fp) == 1);
+		file_position = sizeof(header);
+	} else {
+		cinfo.err = jpeg_std_error(&jerr);
+		jpeg_create_compress(&cinfo);
+		jpeg_stdio_dest(&cinfo, fp);
+		cinfo.image_width = (JDIMENSION)job->width;
+		cinfo.image_height = (JDIMENSION)job->height;
+		cinfo.input_components = 3;
+		cinfo.in_color_space = JCS_RGB;
+		jpeg_set_defaults(&cinfo);
+		jpeg_set_quality(&cinfo, EXPORT_JPEG_QUALITY, TRUE);
+		jpeg_start_compress(&cinfo, TRUE);
+		rgb_row = (u8*) malloc(job->width * 3);
+	}
+
+	i32 strip_count = job->tiles_down;
+	for (i32 i = 0; i < 2 && i < strip_count; ++i) {
+		submit_export_strip(logical_thread_index, job, job->strips + i, i);
+	}
+	for (i32 strip_index = 0; strip_index < strip_count && success; ++strip_index) {
+		export_strip_t* strip = job->strips + (strip_index & 1);
+		wait_for_export_strip(logical_thread_index, strip);
+		if (job->is_cancelled) {
+			success = false;
+			break;
+		}
+		if (job->format == EXPORT_FORMAT_TIFF) {
+			for (i32 tile_x = 0; tile_x < job->tiles_across; ++tile_x) {
+				u8* data = strip->encoded_tiles[tile_x];
+				u64 size = strip->encoded_tile_sizes[tile_x];
+				if (!data || fwrite(data, size, 1, fp) != 1) {
+					success = false;
+				}
+				u64 tile_index = (u64)strip_index * job->tiles_across + tile_x;
+				tile_offsets[tile_index] = file_position;
+				tile_byte_counts[tile_index] = size;
+				file_position += size;
+				free(data);
+				strip->encoded_tiles[tile_x] = NULL;
+			}
+		} else {
+			i32 strip_height = (i32)ATMOST(EXPORT_TILE_DIM, job->height - (i64)strip_index * EXPORT_TILE_DIM);
+			for (i32 row = 0; row < strip_height; ++row) {
+				bgra_row_to_rgb(rgb_row, strip->pixels + (u64)row * job->width * BYTES_PER_PIXEL, (u32)job->width);
+				JSAMPROW rows[1] = { rgb_row };
+				jpeg_write_scanlines(&cinfo, rows, 1);
+			}
+		}
+		if (strip_index + 2 < strip_count && success) {
+			submit_export_strip(logical_thread_index, job, strip, strip_index + 2);
+		}
+	}
+
+	// After cancelling (or failing), the other strip may still be underway.
+	for (i32 i = 0; i < 2; ++i) {
+		export_strip_t* strip = job->strips + i;
+		wait_for_export_strip(logical_thread_index, strip);
+		if (strip->encoded_tiles) {
+			for (i32 tile_x = 0; tile_x < job->tiles_across; ++tile_x) {
+				free(strip->encoded_tiles[tile_x]);
+				strip->encoded_tiles[tile_x] = NULL;
+			}
+		}
+	}
+
+	if (job->format == EXPORT_FORMAT_TIFF) {
+		if (success) {
+			success = finish_bigtiff(fp, file_position, job, tile_offsets, tile_byte_counts);
+		}
+		free(tile_offsets);
+		free(tile_byte_counts);
+	} else {
+		if (success) {
+			jpeg_finish_compress(&cinfo);
+		} else {
+			jpeg_abort_compress(&cinfo);
+		}
+		jpeg_destroy_compress(&cinfo);
+		free(rgb_row);
+	}
+	if (fclose(fp) != 0) {
+		success = false;
+	}
+	return success;
+}
+
+static void region_export_func(i32 logical_thread_index, void* userdata) {
+	region_export_t* job = (region_export_t*) userdata;
+	job->success = run_region_export(logical_thread_index, job);
+	if (!job->success) {
+		remove(job->filename); // no incomplete files
+	}
+	interlocked_decrement(&job->image->region_exports_in_flight); // the image may be unloaded from here on
+	write_barrier;
+	job->is_done = true;
+}
+
+static void destroy_region_export(region_export_t* job) {
+	for (i32 i = 0; i < 2; ++i) {
+		export_strip_t* strip = job->strips + i;
+		free(strip->pixels);
+		free(strip->encoded_tiles);
+		free(strip->encoded_tile_sizes);
+		free(strip->blocks);
+	}
+	free(job->filename);
+	free(job);
+}
+
+// Starts exporting the region (in pixels of the level) in the background. Only one export can be underway at a time.
+bool32 start_region_export(image_t* image, i32 level, i64 x, i64 y, i64 width, i64 height,
+                           export_format_enum format, const char* filename) {
+	float progress;
+	if (get_region_export_progress(&progress)) {
+		printf("Export: another export is still underway\n");
+		return false;
+	}
+	i64 level_width, level_height;
+	if (!get_exportable_level_size(image, level, &level_width, &level_height)) {
+		printf("Export: level %d cannot be exported\n", level);
+		return false;
+	}
+	i64 x2 = CLAMP(x + width, 0, level_width);
+	i64 y2 = CLAMP(y + height, 0, level_height);
+	x = CLAMP(x, 0, level_width);
+	y = CLAMP(y, 0, level_height);
+	width = x2 - x;
+	height = y2 - y;
+	if (width <= 0 || height <= 0) {
+		printf("Export: the region is outside of the image\n");
+		return false;
+	}
+	if (format == EXPORT_FORMAT_JPEG && (width > EXPORT_JPEG_MAX_DIMENSION || height > EXPORT_JPEG_MAX_DIMENSION)) {
+		printf("Export: the region is too large for JPEG (%lld x %lld pixels), export as TIFF instead\n", width, height);
+		return false;
+	}
+
+	region_export_t* job = (region_export_t*) calloc(1, sizeof(region_export_t));
+	job->image = image;
+	job->level = level;
+	job->x = x;
+	job->y = y;
+	job->width = width;
+	job->height = height;
+	job->format = format;
+	job->filename = strdup(filename);
+	job->tiles_across = (i32)((width + EXPORT_TILE_DIM - 1) / EXPORT_TILE_DIM);
+	job->tiles_down = (i32)((height + EXPORT_TILE_DIM - 1) / EXPORT_TILE_DIM);
+	job->blocks_per_strip = (job->tiles_across + EXPORT_BLOCK_TILES - 1) / EXPORT_BLOCK_TILES;
+	job->start_clock = get_clock();
+	for (i32 i = 0; i < 2; ++i) {
+		export_strip_t* strip = job->strips + i;
+		strip->blocks = (export_block_t*) calloc(job->blocks_per_strip, sizeof(export_block_t));
+		if (format == EXPORT_FORMAT_JPEG) {
+			strip->pixels = (u8*) malloc((u64)width * EXPORT_TILE_DIM * BYTES_PER_PIXEL);
+		} else {
+			strip->encoded_tiles = (u8**) calloc(job->tiles_across, sizeof(u8*));
+			strip->encoded_tile_sizes = (u64*) calloc(job->tiles_across, sizeof(u64));
+		}
+	}
+
+	interlocked_increment(&image->region_exports_in_flight);
+	if (!add_work_queue_entry(&work_queue, region_export_func, job)) {
+		interlocked_decrement(&image->region_exports_in_flight);
+		destroy_region_export(job);
+		printf("Export: the work queue is full, try again later\n");
+		return false;
+	}
+	sb_push(region_exports, job);
+	printf("Export: exporting %lld x %lld pixels of level %d to %s\n", width, height, level, filename);
+	return true;
+}
+
+// Returns false if no export is underway.
+bool32 get_region_export_progress(float* progress) {
+	for (i32 i = 0; i < sb_count(region_exports); ++i) {
+		region_export_t* job = region_exports[i];
+		if (job->is_cancelled || job->is_done) continue;
+		i32 block_count = job->tiles_down * job->blocks_per_strip;
+		*progress = (float)job->blocks_done / (float)ATLEAST(1, block_count);
+		return true;
+	}
+	return false;
+}
+
+void cancel_region_exports() {
+	for (i32 i = 0; i < sb_count(region_exports); ++i) {
+		region_exports[i]->is_cancelled = true;
+	}
+}
+
+// Needs to be followed by waiting for image->region_exports_in_flight to drop to zero (see update_image_unloads()).
+void cancel_region_exports_for_image(image_t* image) {
+	for (i32 i = 0; i < sb_count(region_exports); ++i) {
+		if (region_exports[i]->image == image) {
+			region_exports[i]->is_cancelled = true;
+		}
+	}
+}
+
+// Needs to be called every frame, on the main thread: cleans up finished exports.
+void update_region_exports() {
+	i32 i = 0;
+	while (i < sb_count(region_exports)) {
+		region_export_t* job = region_exports[i];
+		if (!job->is_done) {
+			++i;
+			continue;
+		}
+		read_barrier;
+		if (job->success) {
+			printf("Export: wrote %s in %.1f seconds\n", job->filename, get_seconds_elapsed(job->start_clock, get_clock()));
+		} else if (job->is_cancelled) {
+			printf("Export: cancelled\n");
+		} else {
+			printf("Export: failed to write %s\n", job->filename);
+		}
+		destroy_region_export(job);
+		region_exports[i] = sb_last(region_exports);
+		--sb_raw_count(region_exports);
+	}
+}
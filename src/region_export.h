@@ -0,0 +1,55 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+#include "viewer.h"
+
+// Exports a region of a slide level at its full resolution, to a tiled TIFF (BigTIFF, JPEG-compressed tiles) or to
+// a single JPEG file. The region is processed in strips of EXPORT_TILE_DIM rows: the tiles of the slide are read and
+// decoded on the worker threads, a block of output tiles at a time, and written out in order by the export task.
+// At most two strips are in memory at any time, however large the region is.
+
+#define EXPORT_TILE_DIM 256 // the tile size of the exported TIFF, and the height of a strip
+#define EXPORT_BLOCK_TILES 8 // a block (the unit of work for the workers) is a row of this many output tiles
+#define EXPORT_JPEG_QUALITY 90
+#define EXPORT_JPEG_MAX_DIMENSION 65500 // the limit of the JPEG format
+
+typedef enum export_format_enum {
+	EXPORT_FORMAT_TIFF,
+	EXPORT_FORMAT_JPEG,
+} export_format_enum;
+
+bool32 get_exportable_level_size(image_t* image, i32 level, i64* width, i64* height);
+void read_slide_region(i32 logical_thread_index, image_t* image, i32 level, i64 x, i64 y, i32 width, i32 height,
+                       u8* dest, u32 dest_pitch);
+bool32 start_region_export(image_t* image, i32 level, i64 x, i64 y, i64 width, i64 height,
+                           export_format_enum format, const char* filename);
+bool32 get_region_export_progress(float* progress);
+void cancel_region_exports();
+void cancel_region_exports_for_image(image_t* image);
+void update_region_exports();
+
+#ifdef __cplusplus
+}
+#endif
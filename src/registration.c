@@ -0,0 +1,396 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#include "win32_main.h"
+#include "platform.h"
+#include "intrinsics.h"
+
+#include <stdio.h>
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "stretchy_buffer.h"
+#include "viewer.h"
+#include "region_export.h"
+#include "registration.h"
+
+typedef struct registration_t {
+	image_t* reference; // shown in scene 0
+	image_t* image;
+	u32 reference_id;
+	u32 image_id;
+	i32 scene_index;
+	i64 start_clock;
+	volatile i32 is_cancelled;
+	volatile i32 is_done;
+	bool32 success;
+	v2f offset; // in micrometers
+	float peak_score;
+} registration_t;
+
+static registration_t** registrations; // sb, only accessed by the main thread
+
+// The coarsest level that is in the file and has at least one pixel per grid cell. If every level is coarser than
+// that, the finest one in the file.
+static i32 choose_registration_level(image_t* image, float um_per_cell) {
+	i32 finest_level = -1;
+	for (i32 level = image->level_count - 1; level >= 0; --level) {
+		i64 width, height;
+		if (!get_exportable_level_size(image, level, &width, &height)) continue;
+		finest_level = level;
+		level_image_t* level_image = image->level_images + level;
+		if (level_image->um_per_pixel_x <= um_per_cell && level_image->um_per_pixel_y <= um_per_cell) {
+			return level;
+		}
+	}
+	return finest_level;
+}
+
+// Reduces the slide to the grid (complex numbers, as pairs of floats, with the imaginary parts zero): each cell holds
+// the average darkness of the pixels in it, so that glass and the area outside the slide are (close to) zero.
+// Returns NULL if the slide can't be read.
+static float* load_registration_grid(i32 logical_thread_index, registration_t* job, image_t* image, float um_per_cell) {
+	i32 level = choose_registration_level(image, um_per_cell);
+	i64 level_width, level_height;
+	if (level < 0 || !get_exportable_level_size(image, level, &level_width, &level_height)) {
+		return NULL;
+	}
+	level_image_t* level_image = image->level_images + level;
+	i32 n = REGISTRATION_GRID_DIM;
+	// (large levels are only read here if the slide has no coarse levels in the file)
+	i32 width = (i32)ATMOST(level_width, (i64)(n * um_per_cell / level_image->um_per_pixel_x) + 1);
+	i32 height = (i32)ATMOST(level_height, (i64)(n * um_per_cell / level_image->um_per_pixel_y) + 1);
+
+	float* grid = (float*) calloc((u64)n * n, 2 * sizeof(float));
+	float* counts = (float*) calloc((u64)n * n, sizeof(float));
+	i32* column_cells = (i32*) malloc((u64)width * sizeof(i32));
+	for (i32 x = 0; x < width; ++x) {
+		column_cells[x] = ATMOST(n - 1, (i32)(((float)x + 0.5f) * level_image->um_per_pixel_x / um_per_cell));
+	}
+	u32 pitch = (u32)width * BYTES_PER_PIXEL;
+	u8* pixels = (u8*) malloc((u64)pitch * REGISTRATION_STRIP_HEIGHT);
+	for (i32 strip_y = 0; strip_y < height && !job->is_cancelled; strip_y += REGISTRATION_STRIP_HEIGHT) {
+		i32 strip_height = ATMOST(REGISTRATION_STRIP_HEIGHT, height - strip_y);
+		memset(pixels, 0xFF, (u64)pitch * strip_height);
+		read_slide_region(logical_thread_index, image, level, 0, strip_y, width, strip_height, pixels, pitch);
+		for (i32 row = 0; row < strip_height; ++row) {
+			i32 cell_y = ATMOST(n - 1, (i32)(((float)(strip_y + row) + 0.5f) * level_image->um_per_pixel_y / um_per_cell));
+			float* grid_row = grid + (u64)cell_y * n * 2;
+			float* counts_row = counts + (u64)cell_y * n;
+			u8* src = pixels + (u64)row * pitch;
+			for (i32 x = 0; x < width; ++x) {
+				u8* bgra = src + x * BYTES_PER_PIXEL;
+				i32 darkness = 255 - ((bgra[0] + 2 * bgra[1] + bgra[2]) >> 2);
+				grid_row[column_cells[x] * 2] += (float)darkness;
+				counts_row[column_cells[x]] += 1.0f;
+			}
+		}
+	}
+	for (i32 i = 0; i < n * n; ++i) {
+		if (counts[i] > 0.0f) grid[i * 2] /= counts[i];
+	}
+	free(pixels);
+	free(column_cells);
+	free(counts);
+	if (job->is_cancelled) {
+		free(grid);
+		return NULL;
+	}
+	return grid;
+}
+
+// In-place radix-2 FFT of n complex numbers (pairs of floats). The twiddle factors are exp(-2 pi i k / n) for the
+// forward transform, k < n/2; the inverse transform is not scaled.
+static void fft_1d(float* data, i32 n, float* twiddles, bool32 inverse) {
+	for (i32 i = 1, j = 0; i < n; ++i) {
+		i32 bit = n >> 1;
+		for (; j & bit; bit >>= 1) {
+			j ^= bit;
+		}
+		j ^= bit;
+		if (i < j) {
+			float re = data[i * 2], im = data[i * 2 + 1];
+			data[i * 2] = data[j * 2];
+			data[i * 2 + 1] = data[j * 2 + 1];
+			data[j * 2] = re;
+			data[j * 2 + 1] = im;
+		}
+	}
+	float sign = inverse ? -1.0f : 1.0f;
+	for (i32 len = 2; len <= n; len <<= 1) {
+		i32 half = len >> 1;
+		i32 twiddle_step = n / len;
+		for (i32 i = 0; i < n; i += len) {
+			for (i32 k = 0; k < half; ++k) {
+				float w_re = twiddles[k * twiddle_step * 2];
+				float w_im = twiddles[k * twiddle_step * 2 + 1] * sign;
+				float* u = data + (i + k) * 2;
+				float* v = data + (i + k + half) * 2;
+				float t_re = v[0] * w_re - v[1] * w_im;
+				float t_im = v[0] * w_im + v[1] * w_re;
+				v[0] = u[0] - t_re;
+				v[1] = u[1] - t_im;
+				u[0] += t_re;
+				u[1] += t_im;
+			}
+		}
+	}
+}
+
+// The rows, then the columns (copied out to a contiguous buffer).
+static void fft_2d(float* grid, i32 n, float* twiddles, bool32 inverse) {
+	for (i32 y = 0; y < n; ++y) {
+		fft_1d(grid + (u64)y * n * 2, n, twiddles, inverse);
+	}
+	float* column = (float*) malloc((u64)n * 2 * sizeof(float));
+	for (i32 x = 0; x < n; ++x) {
+		for (i32 y = 0; y < n; ++y) {
+			column[y * 2] = grid[((u64)y * n + x) * 2];
+			column[y * 2 + 1] = grid[((u64)y * n + x) * 2 + 1];
+		}
+		fft_1d(column, n, twiddles, inverse);
+		for (i32 y = 0; y < n; ++y) {
+			grid[((u64)y * n + x) * 2] = column[y * 2];
+			grid[((u64)y * n + x) * 2 + 1] = column[y * 2 + 1];
+		}
+	}
+	free(column);
+}
+
+// b = b * conj(a) / |b * conj(a)|: only the phase of the cross-power spectrum is kept.
+static void normalized_cross_power_spectrum(float* b, float* a, i32 count) {
+	i32 i = 0;
+#if defined(__SSE2__)
+	// Two complex numbers at a time
+	const __m128 signs = _mm_set_ps(-1.0f, 1.0f, -1.0f, 1.0f);
+	const __m128 epsilon = _mm_set1_ps(1e-12f);
+	for (; i + 2 <= count; i += 2) {
+		__m128 va = _mm_loadu_ps(a + i * 2);
+		__m128 vb = _mm_loadu_ps(b + i * 2);
+		__m128 a_re = _mm_shuffle_ps(va, va, _MM_SHUFFLE(2, 2, 0, 0));
+		__m128 a_im = _mm_shuffle_ps(va, va, _MM_SHUFFLE(3, 3, 1, 1));
+		__m128 vb_swapped = _mm_shuffle_ps(vb, vb, _MM_SHUFFLE(2, 3, 0, 1));
+		// re = b_re * a_re + b_im * a_im, im = b_im * a_re - b_re * a_im
+		__m128 product = _mm_add_ps(_mm_mul_ps(vb, a_re), _mm_mul_ps(_mm_mul_ps(vb_swapped, a_im), signs));
+		__m128 squares = _mm_mul_ps(product, product);
+		__m128 magnitude2 = _mm_add_ps(squares, _mm_shuffle_ps(squares, squares, _MM_SHUFFLE(2, 3, 0, 1)));
+		_mm_storeu_ps(b + i * 2, _mm_mul_ps(product, _mm_rsqrt_ps(_mm_add_ps(magnitude2, epsilon))));
+	}
+#endif
+	for (; i < count; ++i) {
+		float a_re = a[i * 2], a_im = a[i * 2 + 1];
+		float b_re = b[i * 2], b_im = b[i * 2 + 1];
+		float re = b_re * a_re + b_im * a_im;
+		float im = b_im * a_re - b_re * a_im;
+		float scale = 1.0f / sqrtf(re * re + im * im + 1e-12f);
+		b[i * 2] = re * scale;
+		b[i * 2 + 1] = im * scale;
+	}
+}
+
+// The position of the peak between its neighbours, from a parabola through the three values.
+static float refine_peak(float left, float center, float right) {
+	float denominator = left - 2.0f * center + right;
+	if (denominator >= 0.0f) return 0.0f;
+	return CLAMP(0.5f * (left - right) / denominator, -0.5f, 0.5f);
+}
+
+// Returns true if a shift was found that stands out clearly enough.
+static bool32 run_registration(i32 logical_thread_index, registration_t* job) {
+	i32 n = REGISTRATION_GRID_DIM;
+	float extent = (float)MAX(MAX(job->reference->width_in_um, job->reference->height_in_um),
+	                          MAX(job->image->width_in_um, job->image->height_in_um));
+	float um_per_cell = extent / (float)n;
+	if (um_per_cell <= 0.0f) return false;
+
+	float* reference_grid = load_registration_grid(logical_thread_index, job, job->reference, um_per_cell);
+	float* grid = reference_grid ? load_registration_grid(logical_thread_index, job, job->image, um_per_cell) : NULL;
+	if (!grid) {
+		free(reference_grid);
+		return false;
+	}
+
+	float* twiddles = (float*) malloc((u64)(n / 2) * 2 * sizeof(float));
+	for (i32 k = 0; k < n / 2; ++k) {
+		double angle = -2.0 * 3.14159265358979323846 * (double)k / (double)n;
+		twiddles[k * 2] = (float)cos(angle);
+		twiddles[k * 2 + 1] = (float)sin(angle);
+	}
+	fft_2d(reference_grid, n, twiddles, false);
+	fft_2d(grid, n, twiddles, false);
+	normalized_cross_power_spectrum(grid, reference_grid, n * n);
+	fft_2d(grid, n, twiddles, true);
+	free(twiddles);
+	free(reference_grid);
+
+	// If the image is the reference shifted by d, the correlation surface peaks at d (wrapped around).
+	i32 peak_index = 0;
+	double sum = 0.0, sum_of_squares = 0.0;
+	for (i32 i = 0; i < n * n; ++i) {
+		float value = grid[i * 2];
+		sum += value;
+		sum_of_squares += (double)value * value;
+		if (value > grid[peak_index * 2]) peak_index = i;
+	}
+	double mean = sum / ((double)n * n);
+	double stddev = sqrt(ATLEAST(1e-12, sum_of_squares / ((double)n * n) - mean * mean));
+	job->peak_score = (float)((grid[peak_index * 2] - mean) / stddev);
+
+	i32 peak_x = peak_index % n;
+	i32 peak_y = peak_index / n;
+	#define GRID_VALUE(x, y) grid[((u64)(((y) + n) % n) * n + (((x) + n) % n)) * 2]
+	float dx = (float)(peak_x < n / 2 ? peak_x : peak_x - n) +
+	           refine_peak(GRID_VALUE(peak_x - 1, peak_y), GRID_VALUE(peak_x, peak_y), GRID_VALUE(peak_x + 1, peak_y));
+	float dy = (float)(peak_y < n / 2 ? peak_y : peak_y - n) +
+	           refine_peak(GRID_VALUE(peak_x, peak_y - 1), GRID_VALUE(peak_x, peak_y), GRID_VALUE(peak_x, peak_y + 1));
+	#undef GRID_VALUE
+	free(grid);
+
+	job->offset = (v2f){ dx * um_per_cell, dy * um_per_cell };
+	return job->peak_score >= REGISTRATION_MIN_PEAK_SCORE;
+}
+
+static void registration_func(i32 logical_thread_index, void* userdata) {
+	registration_t* job = (registration_t*) userdata;
+	job->success = run_registration(logical_thread_index, job);
+	// The images may be unloaded from here on
+	interlocked_decrement(&job->reference->registrations_in_flight);
+	interlocked_decrement(&job->image->registrations_in_flight);
+	write_barrier;
+	job->is_done = true;
+}
+
+static bool32 can_register_image(image_t* image) {
+	return image && (image->type == IMAGE_TYPE_TIFF || image->type == IMAGE_TYPE_WSI) && image->width_in_um > 0 &&
+	       image->height_in_um > 0;
+}
+
+// Registers the slides in the other scenes with the slide in scene 0, in the background.
+bool32 start_scene_registrations(app_state_t* app_state) {
+	image_t* reference = find_loaded_image(app_state, app_state->scenes[0].image_id);
+	if (!can_register_image(reference)) {
+		printf("Registration: the slide in the first view can't be registered\n");
+		return false;
+	}
+	bool32 started = false;
+	for (i32 scene_index = 1; scene_index < app_state->scene_count; ++scene_index) {
+		scene_t* scene = app_state->scenes + scene_index;
+		image_t* image = find_loaded_image(app_state, scene->image_id);
+		if (!can_register_image(image) || image == reference) continue;
+		bool32 is_underway = false;
+		for (i32 i = 0; i < sb_count(registrations); ++i) {
+			registration_t* other = registrations[i];
+			if (other->scene_index == scene_index && other->image_id == image->image_id && !other->is_done) {
+				is_underway = true;
+			}
+		}
+		if (is_underway) continue;
+
+		registration_t* job = (registration_t*) calloc(1, sizeof(registration_t));
+		job->reference = reference;
+		job->image = image;
+		job->reference_id = reference->image_id;
+		job->image_id = image->image_id;
+		job->scene_index = scene_index;
+		job->start_clock = get_clock();
+		interlocked_increment(&reference->registrations_in_flight);
+		interlocked_increment(&image->registrations_in_flight);
+		if (!add_work_queue_entry(&work_queue, registration_func, job)) {
+			interlocked_decrement(&reference->registrations_in_flight);
+			interlocked_decrement(&image->registrations_in_flight);
+			free(job);
+			printf("Registration: the work queue is full, try again later\n");
+			break;
+		}
+		sb_push(registrations, job);
+		started = true;
+	}
+	return started;
+}
+
+bool32 is_registration_in_progress() {
+	for (i32 i = 0; i < sb_count(registrations); ++i) {
+		if (!registrations[i]->is_done) return true;
+	}
+	return false;
+}
+
+// The offset only applies to the pair of slides it was computed for. Scene 0 is the reference.
+bool32 get_scene_registration_offset(app_state_t* app_state, i32 scene_index, v2f* offset) {
+	scene_t* scene = app_state->scenes + scene_index;
+	if (scene_index == 0) {
+		*offset = (v2f){0};
+		return true;
+	}
+	if (scene->registered_image_id != 0 && scene->registered_image_id == scene->image_id &&
+	    scene->registered_reference_id == app_state->scenes[0].image_id) {
+		*offset = scene->registration_offset;
+		return true;
+	}
+	return false;
+}
+
+// Needs to be followed by waiting for image->registrations_in_flight to drop to zero (see update_image_unloads()).
+void cancel_registrations_for_image(image_t* image) {
+	for (i32 i = 0; i < sb_count(registrations); ++i) {
+		if (registrations[i]->reference == image || registrations[i]->image == image) {
+			registrations[i]->is_cancelled = true;
+		}
+	}
+}
+
+// Needs to be called every frame, on the main thread: hands the finished registrations to their scenes. With linked
+// cameras, the scene moves to the matching tissue right away.
+void update_registrations(app_state_t* app_state) {
+	i32 i = 0;
+	while (i < sb_count(registrations)) {
+		registration_t* job = registrations[i];
+		if (!job->is_done) {
+			++i;
+			continue;
+		}
+		read_barrier;
+		float ms = get_seconds_elapsed(job->start_clock, get_clock()) * 1000.0f;
+		scene_t* scene = app_state->scenes + job->scene_index;
+		if (job->is_cancelled) {
+			// (the slide was closed)
+		} else if (!job->success) {
+			printf("Registration: no clear match for view %d (score %.1f, %.0f ms)\n", job->scene_index + 1,
+			       job->peak_score, ms);
+		} else if (scene->image_id == job->image_id && app_state->scenes[0].image_id == job->reference_id) {
+			printf("Registration: view %d is offset by (%.0f, %.0f) um (score %.1f, %.0f ms)\n", job->scene_index + 1,
+			       job->offset.x, job->offset.y, job->peak_score, ms);
+			scene->registration_offset = job->offset;
+			scene->registered_image_id = job->image_id;
+			scene->registered_reference_id = job->reference_id;
+			if (app_state->link_scene_cameras) {
+				scene->camera.x = app_state->scenes[0].camera.x + job->offset.x;
+				scene->camera.y = app_state->scenes[0].camera.y + job->offset.y;
+				scene->is_jumping = false;
+			}
+		}
+		free(job);
+		registrations[i] = sb_last(registrations);
+		--sb_raw_count(registrations);
+	}
+}
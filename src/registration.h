@@ -0,0 +1,49 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+#include "viewer.h"
+
+// Coarse registration of serial sections, so that linked scenes show the same tissue. The slides are compared at a low
+// resolution: the coarsest level in the file that is fine enough is read and reduced to a grid of REGISTRATION_GRID_DIM
+// cells square (covering the larger of the two slides), and the shift between the grids is found with phase
+// correlation (FFT-based cross-correlation, normalized so that the sharp edges of the tissue count rather than the
+// overall shape of the stain). Each pair of slides is one task for the worker threads.
+// Only a translation is found; rotated sections are aligned as well as a shift allows.
+// The result is kept in the scene (see scene_t::registration_offset), and applied when moving linked cameras.
+
+#define REGISTRATION_GRID_DIM 512 // a power of two (for the FFT)
+#define REGISTRATION_STRIP_HEIGHT 256 // the level is read this many rows at a time
+// How far the correlation peak must stand out (in standard deviations of the correlation surface) to be trusted.
+#define REGISTRATION_MIN_PEAK_SCORE 8.0f
+
+bool32 start_scene_registrations(app_state_t* app_state);
+bool32 is_registration_in_progress();
+bool32 get_scene_registration_offset(app_state_t* app_state, i32 scene_index, v2f* offset);
+void cancel_registrations_for_image(image_t* image);
+void update_registrations(app_state_t* app_state);
+
+#ifdef __cplusplus
+}
+#endif
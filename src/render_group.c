@@ -22,6 +22,18 @@
 
 #include "shader.h"
 #include "stretchy_buffer.h"
+#include "memory_stats.h"
+#include "color_pipeline.h"
+#include "cpu_dispatch.h"
+#include "jpeg_decoder.h"
+#include "profiler.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#if CPU_AVX2_SUPPORTED
+#include <immintrin.h>
+#endif
+#endif
 
 
 static u32 vbo_rect;
@@ -33,12 +45,35 @@ u32 basic_shader;
 i32 basic_shader_u_projection_view_matrix;
 i32 basic_shader_u_model_matrix;
 i32 basic_shader_u_tex;
-i32 basic_shader_u_black_level;
-i32 basic_shader_u_white_level;
+i32 basic_shader_u_color_lut;
+i32 basic_shader_u_apply_color_lut;
+i32 basic_shader_u_show_single_stain;
+i32 basic_shader_u_stain_unmixing;
+i32 basic_shader_u_stain_vector;
 i32 basic_shader_u_background_color;
+i32 basic_shader_u_layer;
 i32 basic_shader_attrib_location_pos;
 i32 basic_shader_attrib_location_tex_coord;
 
+u32 tile_shader;
+i32 tile_shader_u_projection_view_matrix;
+i32 tile_shader_u_tex;
+i32 tile_shader_u_color_lut;
+i32 tile_shader_u_show_single_stain;
+i32 tile_shader_u_stain_unmixing;
+i32 tile_shader_u_stain_vector;
+i32 tile_shader_u_background_color;
+i32 tile_shader_u_is_planar;
+i32 tile_shader_u_is_channel;
+i32 tile_shader_u_channel_color;
+i32 tile_shader_u_channel_gain;
+i32 tile_shader_u_channel_offset;
+i32 tile_shader_u_is_overlay;
+i32 tile_shader_u_overlay_colormap;
+i32 tile_shader_u_overlay_opacity;
+i32 tile_shader_attrib_location_pos;
+i32 tile_shader_attrib_location_tex_coord;
+
 
 void init_draw_rect() {
 	ASSERT(!rect_initialized);
@@ -79,33 +114,2278 @@ void init_draw_rect() {
 
 }
 
+// Note: the texture is expected to be a GL_TEXTURE_2D_ARRAY (with a single layer)
 void draw_rect(u32 texture) {
 	glBindVertexArray(vao_rect);
 //	glEnable(GL_TEXTURE_2D);
 //	glActiveTexture(GL_TEXTURE0 + 0);
 //	glUniform1i(basic_shader_u_tex, 0);
-	glBindTexture(GL_TEXTURE_2D, texture);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+	glUniform1f(basic_shader_u_layer, 0.0f);
 	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
 }
 
+// Tile textures are stored as layers in a small number of preallocated texture arrays, instead of as separate
+// textures. A tile refers to its layer by a 1-based slot index (0 = no texture).
+// Each texture array has one format: uncompressed BGRA, or block-compressed BC1 (see compress_tile_mip_chain_bc1()),
+// which takes 1/8 of the memory, or the planes of a YCbCr 4:2:0 JPEG tile as they come out of the decoder (see
+// decode_tile_planar_with_state()), which take 3/8 of the memory and are converted to RGB in tile.frag.
+// Tiles of all formats can be resident at the same time.
+// Small tiles (at most TILE_DIM / 2, like the 240 or 256 pixel tiles of many scanners) don't need a whole layer: four
+// of them share one, each in its own quadrant, so that they take 1/4 of the memory and are still drawn together with the
+// other tiles of the array. The slot of such a tile is the slot of the layer, plus the quadrant (1-4) in the top bits.
+// Quadrants that are given back are only reused for other small tiles.
+// The arrays are created as they are needed, up to the GPU memory that was available at startup (see
+// init_tile_texture_pool()). Arrays that have become empty (because tiles were evicted, or a slide was closed) are
+// given back by trim_tile_texture_pool().
+
+#define TILE_TEXTURE_ARRAY_LAYERS 256
+#define TILE_TEXTURE_ARRAY_MAX_COUNT 128 // the actual limit is set by max_texture_array_memory
+#define TILE_TEXTURE_DEFAULT_MAX_MEMORY GIGABYTES(4) // if the driver doesn't tell how much GPU memory there is
+#define TILE_TEXTURE_SPARE_ARRAY_COUNT 1 // empty arrays that are kept around after eviction, to avoid churn
+
+// From GL_NVX_gpu_memory_info and GL_ATI_meminfo (in kilobytes)
+#ifndef GL_GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX
+#define GL_GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX 0x9048
+#endif
+#ifndef GL_TEXTURE_FREE_MEMORY_ATI
+#define GL_TEXTURE_FREE_MEMORY_ATI 0x87FC
+#endif
+// The pyramid levels of the slide take the place of most of the mipmaps: once the tiles of a level would be drawn
+// more than 2x smaller, the tiles of the next level are drawn instead. So one mip level below the tile itself is
+// enough, instead of a full chain down to 1x1.
+#define TILE_TEXTURE_MIP_LEVELS 2 // 512x512 and 256x256
+#define TILE_TEXTURE_QUADRANT_SHIFT 24
+#define TILE_TEXTURE_LAYER_SLOT_MASK ((1u << TILE_TEXTURE_QUADRANT_SHIFT) - 1)
+
+// From GL_EXT_texture_compression_s3tc (not part of the OpenGL core profile, but supported by all desktop GPUs)
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT1_EXT 0x83F1
+#endif
+
+typedef enum tile_texture_format_enum {
+	TILE_TEXTURE_FORMAT_BGRA,
+	TILE_TEXTURE_FORMAT_BC1, // 4x4 pixel blocks of 8 bytes, with 1-bit alpha
+	TILE_TEXTURE_FORMAT_YCBCR420, // single channel: the Y plane, with the Cb and Cr planes side by side below it
+	TILE_TEXTURE_FORMAT_R8, // single channel, for the channels of fluorescence images (see build_single_channel_tile_mip_chain())
+	TILE_TEXTURE_FORMAT_COUNT
+} tile_texture_format_enum;
+
+typedef struct tile_texture_pool_t {
+	volatile i32 lock;
+	u32 texture_arrays[TILE_TEXTURE_ARRAY_MAX_COUNT];
+	u8 texture_array_formats[TILE_TEXTURE_ARRAY_MAX_COUNT];
+	u16 texture_array_quarters_in_use[TILE_TEXTURE_ARRAY_MAX_COUNT]; // a layer counts as 4, a quadrant as 1
+	i32 texture_array_count; // including arrays that were given back (texture 0), whose index can be reused
+	i32 texture_array_generation; // changes whenever an array is created
+	i64 texture_array_memory; // of the arrays that exist
+	i64 max_texture_array_memory;
+	u32* free_slots[TILE_TEXTURE_FORMAT_COUNT]; // sb
+	u32* free_quadrant_slots[TILE_TEXTURE_FORMAT_COUNT]; // sb
+	i32 slots_in_use; // including quadrant slots
+	bool32 is_bc1_available;
+	i64 upload_count; // changes whenever texture contents change (see draw_tile_layer())
+} tile_texture_pool_t;
+
+tile_texture_pool_t tile_texture_pool;
+
+// Size in bytes of one mip level of a tile texture
+static u32 get_tile_mip_level_size(i32 format, i32 dim) {
+	if (format == TILE_TEXTURE_FORMAT_BC1) {
+		i32 blocks = ATLEAST(1, dim / 4);
+		return blocks * blocks * 8;
+	} else if (format == TILE_TEXTURE_FORMAT_YCBCR420) {
+		return dim * dim * 3 / 2;
+	} else if (format == TILE_TEXTURE_FORMAT_R8) {
+		return dim * dim;
+	} else {
+		return dim * dim * BYTES_PER_PIXEL;
+	}
+}
+
+// Size in bytes of a whole mip chain (see build_tile_mip_chain()); dim is TILE_DIM, or TILE_DIM / 2 for small tiles
+u32 get_tile_mip_chain_size(i32 format, i32 dim) {
+	u32 size = 0;
+	for (i32 mip_level = 0; mip_level < TILE_TEXTURE_MIP_LEVELS; ++mip_level) {
+		size += get_tile_mip_level_size(format, dim >> mip_level);
+	}
+	return size;
+}
+
+u32 get_tile_texture_memory(i32 format) {
+	return get_tile_mip_chain_size(format, TILE_DIM); // per slot, including the mipmaps
+}
+
+static inline u32 get_tile_texture_layer_slot(u32 slot) {
+	return slot & TILE_TEXTURE_LAYER_SLOT_MASK;
+}
+
+// Returns -1 if the slot is a whole layer
+static inline i32 get_tile_texture_quadrant(u32 slot) {
+	return (i32)(slot >> TILE_TEXTURE_QUADRANT_SHIFT) - 1;
+}
+
+static i32 get_tile_texture_slot_format(u32 slot) {
+	return tile_texture_pool.texture_array_formats[(get_tile_texture_layer_slot(slot) - 1) / TILE_TEXTURE_ARRAY_LAYERS];
+}
+
+u32 get_tile_texture_slot_memory(u32 slot) {
+	u32 memory = get_tile_texture_memory(get_tile_texture_slot_format(slot));
+	return (get_tile_texture_quadrant(slot) >= 0) ? memory / 4 : memory;
+}
+
+// Should be called once the OpenGL context exists.
+static void init_tile_texture_pool() {
+	bool32 has_nvx_memory_info = false;
+	bool32 has_ati_memory_info = false;
+	i32 extension_count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &extension_count);
+	for (i32 i = 0; i < extension_count; ++i) {
+		const char* extension = (const char*) glGetStringi(GL_EXTENSIONS, i);
+		if (extension && strcmp(extension, "GL_EXT_texture_compression_s3tc") == 0) {
+			tile_texture_pool.is_bc1_available = true;
+		} else if (extension && strcmp(extension, "GL_NVX_gpu_memory_info") == 0) {
+			has_nvx_memory_info = true;
+		} else if (extension && strcmp(extension, "GL_ATI_meminfo") == 0) {
+			has_ati_memory_info = true;
+		}
+	}
+	// Leave a quarter of the GPU memory for everything else.
+	i64 available_memory = 0;
+	if (has_nvx_memory_info) {
+		i32 kilobytes = 0;
+		glGetIntegerv(GL_GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX, &kilobytes);
+		available_memory = (i64)kilobytes * KILOBYTES(1);
+	} else if (has_ati_memory_info) {
+		i32 kilobytes[4] = {0};
+		glGetIntegerv(GL_TEXTURE_FREE_MEMORY_ATI, kilobytes);
+		available_memory = (i64)kilobytes[0] * KILOBYTES(1);
+	}
+	tile_texture_pool.max_texture_array_memory = (available_memory > 0) ? available_memory / 4 * 3
+	                                                                    : TILE_TEXTURE_DEFAULT_MAX_MEMORY;
+	printf("Tile textures: up to %lld MB of texture arrays\n", tile_texture_pool.max_texture_array_memory / MEGABYTES(1));
+}
+
+bool32 is_tile_texture_compression_available() {
+	return tile_texture_pool.is_bc1_available;
+}
+
+// The format for the tiles that are decoded now
+i32 get_tile_texture_format_for_new_tiles() {
+	return (compress_tile_textures && tile_texture_pool.is_bc1_available) ? TILE_TEXTURE_FORMAT_BC1 : TILE_TEXTURE_FORMAT_BGRA;
+}
+
+// Whether JPEG tiles decoded now should be kept as YCbCr planes. BC1 compression goes first, because it needs RGB.
+bool32 use_planar_tile_textures() {
+	return planar_tile_textures && get_tile_texture_format_for_new_tiles() != TILE_TEXTURE_FORMAT_BC1;
+}
+
+static u32 create_tile_texture_array(i32 format) {
+	u32 texture = 0;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, TILE_TEXTURE_MIP_LEVELS - 1);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	for (i32 mip_level = 0; mip_level < TILE_TEXTURE_MIP_LEVELS; ++mip_level) {
+		i32 dim = TILE_DIM >> mip_level;
+		if (format == TILE_TEXTURE_FORMAT_YCBCR420) {
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, mip_level, GL_R8, dim, dim * 3 / 2, TILE_TEXTURE_ARRAY_LAYERS, 0,
+			             GL_RED, GL_UNSIGNED_BYTE, NULL);
+		} else if (format == TILE_TEXTURE_FORMAT_R8) {
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, mip_level, GL_R8, dim, dim, TILE_TEXTURE_ARRAY_LAYERS, 0,
+			             GL_RED, GL_UNSIGNED_BYTE, NULL);
+		} else {
+			i32 internal_format = (format == TILE_TEXTURE_FORMAT_BC1) ? GL_COMPRESSED_RGBA_S3TC_DXT1_EXT : GL_RGBA8;
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, mip_level, internal_format, dim, dim, TILE_TEXTURE_ARRAY_LAYERS, 0,
+			             GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+		}
+	}
+	return texture;
+}
+
+static inline u32 get_tile_texture_slot_array_index(u32 slot) {
+	return (get_tile_texture_layer_slot(slot) - 1) / TILE_TEXTURE_ARRAY_LAYERS;
+}
+
+static inline i32 get_tile_texture_slot_quarters(u32 slot) {
+	return (get_tile_texture_quadrant(slot) >= 0) ? 1 : 4;
+}
+
+static i64 get_tile_texture_array_memory(i32 format) {
+	return (i64)get_tile_texture_memory(format) * TILE_TEXTURE_ARRAY_LAYERS;
+}
+
+// Expects the pool to be locked. Returns 0 if the pool is exhausted.
+static u32 allocate_tile_texture_layer(tile_texture_pool_t* pool, i32 format) {
+	u32 slot = 0;
+	if (sb_count(pool->free_slots[format]) > 0) {
+		slot = sb_last(pool->free_slots[format]);
+		--sb_raw_count(pool->free_slots[format]);
+	} else if (pool->texture_array_memory + get_tile_texture_array_memory(format) <= pool->max_texture_array_memory) {
+		// Reuse the index of an array that was given back, if there is one.
+		i32 array_index = 0;
+		while (array_index < pool->texture_array_count && pool->texture_arrays[array_index] != 0) {
+			++array_index;
+		}
+		if (array_index < TILE_TEXTURE_ARRAY_MAX_COUNT) {
+			pool->texture_arrays[array_index] = create_tile_texture_array(format);
+			pool->texture_array_formats[array_index] = (u8)format;
+			pool->texture_array_quarters_in_use[array_index] = 0;
+			pool->texture_array_count = MAX(pool->texture_array_count, array_index + 1);
+			++pool->texture_array_generation;
+			pool->texture_array_memory += get_tile_texture_array_memory(format);
+			u32 first_slot = array_index * TILE_TEXTURE_ARRAY_LAYERS + 1;
+			for (i32 i = TILE_TEXTURE_ARRAY_LAYERS - 1; i >= 1; --i) {
+				sb_push(pool->free_slots[format], first_slot + i); // hand out the slots in ascending order
+			}
+			slot = first_slot;
+		}
+	}
+	return slot;
+}
+
+// Small tiles get a quadrant of a layer (see is_small_tile). Returns 0 if the pool is exhausted.
+u32 allocate_tile_texture_slot(i32 format, bool32 is_small_tile) {
+	tile_texture_pool_t* pool = &tile_texture_pool;
+	u32 slot = 0;
+	spin_lock(&pool->lock);
+	if (!is_small_tile) {
+		slot = allocate_tile_texture_layer(pool, format);
+	} else if (sb_count(pool->free_quadrant_slots[format]) > 0) {
+		slot = sb_last(pool->free_quadrant_slots[format]);
+		--sb_raw_count(pool->free_quadrant_slots[format]);
+	} else {
+		u32 layer_slot = allocate_tile_texture_layer(pool, format);
+		if (layer_slot != 0) {
+			for (u32 quadrant = 3; quadrant >= 1; --quadrant) {
+				sb_push(pool->free_quadrant_slots[format], layer_slot | ((quadrant + 1) << TILE_TEXTURE_QUADRANT_SHIFT));
+			}
+			slot = layer_slot | (1 << TILE_TEXTURE_QUADRANT_SHIFT);
+		}
+	}
+	if (slot != 0) {
+		++pool->slots_in_use;
+		pool->texture_array_quarters_in_use[get_tile_texture_slot_array_index(slot)] += get_tile_texture_slot_quarters(slot);
+		memory_stats_add(MEMORY_DOMAIN_TILE_TEXTURES, get_tile_texture_slot_memory(slot));
+	}
+	spin_unlock(&pool->lock);
+	return slot;
+}
+
+// Can be called from any thread. (Taking many slots back at once only needs the lock once.)
+void release_tile_texture_slots(u32* slots, i32 count) {
+	tile_texture_pool_t* pool = &tile_texture_pool;
+	i64 freed_memory = 0;
+	spin_lock(&pool->lock);
+	for (i32 i = 0; i < count; ++i) {
+		u32 slot = slots[i];
+		ASSERT(slot != 0);
+		i32 format = get_tile_texture_slot_format(slot);
+		if (get_tile_texture_quadrant(slot) >= 0) {
+			sb_push(pool->free_quadrant_slots[format], slot);
+		} else {
+			sb_push(pool->free_slots[format], slot);
+		}
+		freed_memory += get_tile_texture_slot_memory(slot);
+		pool->texture_array_quarters_in_use[get_tile_texture_slot_array_index(slot)] -= get_tile_texture_slot_quarters(slot);
+	}
+	pool->slots_in_use -= count;
+	memory_stats_add(MEMORY_DOMAIN_TILE_TEXTURES, -freed_memory);
+	spin_unlock(&pool->lock);
+}
+
+void release_tile_texture_slot(u32 slot) {
+	release_tile_texture_slots(&slot, 1);
+}
+
+static void remove_free_slots_of_texture_array(u32* free_slots, u32 array_index) {
+	i32 kept_count = 0;
+	for (i32 i = 0; i < sb_count(free_slots); ++i) {
+		if (get_tile_texture_slot_array_index(free_slots[i]) != array_index) {
+			free_slots[kept_count++] = free_slots[i];
+		}
+	}
+	if (free_slots) {
+		sb_raw_count(free_slots) = kept_count;
+	}
+}
+
+// Main thread. Gives the texture arrays that no longer hold any tiles back to the driver, except for spare_count of
+// them (so that tiles that are loaded right after an eviction don't need a new array straight away).
+void trim_tile_texture_pool(i32 spare_count) {
+	tile_texture_pool_t* pool = &tile_texture_pool;
+	spin_lock(&pool->lock);
+	i32 empty_count = 0;
+	for (i32 array_index = 0; array_index < pool->texture_array_count; ++array_index) {
+		if (pool->texture_arrays[array_index] == 0 || pool->texture_array_quarters_in_use[array_index] != 0) {
+			continue;
+		}
+		if (empty_count++ < spare_count) {
+			continue;
+		}
+		i32 format = pool->texture_array_formats[array_index];
+		remove_free_slots_of_texture_array(pool->free_slots[format], array_index);
+		remove_free_slots_of_texture_array(pool->free_quadrant_slots[format], array_index);
+		glDeleteTextures(1, pool->texture_arrays + array_index);
+		pool->texture_arrays[array_index] = 0;
+		pool->texture_array_memory -= get_tile_texture_array_memory(format);
+	}
+	while (pool->texture_array_count > 0 && pool->texture_arrays[pool->texture_array_count - 1] == 0) {
+		--pool->texture_array_count;
+	}
+	spin_unlock(&pool->lock);
+}
+
+// Release the GPU memory of the texture arrays (only safe if no tiles are being loaded).
+void destroy_tile_texture_pool() {
+	tile_texture_pool_t* pool = &tile_texture_pool;
+	spin_lock(&pool->lock);
+	ASSERT(pool->slots_in_use == 0);
+	for (i32 array_index = 0; array_index < pool->texture_array_count; ++array_index) {
+		if (pool->texture_arrays[array_index] != 0) {
+			glDeleteTextures(1, pool->texture_arrays + array_index);
+		}
+	}
+	memset(pool->texture_arrays, 0, sizeof(pool->texture_arrays));
+	memset(pool->texture_array_quarters_in_use, 0, sizeof(pool->texture_array_quarters_in_use));
+	pool->texture_array_count = 0;
+	pool->texture_array_memory = 0;
+	for (i32 format = 0; format < TILE_TEXTURE_FORMAT_COUNT; ++format) {
+		sb_free(pool->free_slots[format]);
+		pool->free_slots[format] = NULL;
+		sb_free(pool->free_quadrant_slots[format]);
+		pool->free_quadrant_slots[format] = NULL;
+	}
+	spin_unlock(&pool->lock);
+}
+
+#define TILE_MIP_CHAIN_SIZE (WSI_BLOCK_SIZE + WSI_BLOCK_SIZE / 2) // more than enough for the tile plus its mipmaps
+
+// Box filter, for the mipmaps. The row kernels average 2x2 blocks of two source rows into one destination row, either
+// of BGRA pixels or of single samples (the planes of YCbCr tiles); the SIMD versions give exactly the same results.
+
+static void downsample_2x_bgra_row_scalar(u8* row0, u8* row1, u8* dest_row, i32 new_width) {
+	for (i32 x = 0; x < new_width; ++x) {
+		for (i32 c = 0; c < BYTES_PER_PIXEL; ++c) {
+			u32 sum = row0[(2*x) * 4 + c] + row0[(2*x+1) * 4 + c] + row1[(2*x) * 4 + c] + row1[(2*x+1) * 4 + c];
+			dest_row[x * 4 + c] = (u8)((sum + 2) / 4);
+		}
+	}
+}
+
+static void downsample_2x_plane_row_scalar(u8* row0, u8* row1, u8* dest_row, i32 new_width) {
+	for (i32 x = 0; x < new_width; ++x) {
+		dest_row[x] = (u8)((row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) / 4);
+	}
+}
+
+#if defined(__SSE2__)
+
+// 4 source pixels of both rows -> 2 averaged pixels, as 16-bit channels
+static inline __m128i downsample_2x_bgra_sse2(__m128i v0, __m128i v1) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(v0, zero), _mm_unpacklo_epi8(v1, zero)); // pixels 0 and 1
+	__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(v0, zero), _mm_unpackhi_epi8(v1, zero)); // pixels 2 and 3
+	__m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+	return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+static void downsample_2x_bgra_row_sse2(u8* row0, u8* row1, u8* dest_row, i32 new_width) {
+	i32 x = 0;
+	for (; x + 4 <= new_width; x += 4) {
+		i32 offset = 2 * x * 4;
+		__m128i a = downsample_2x_bgra_sse2(_mm_loadu_si128((__m128i*)(row0 + offset)),
+		                                    _mm_loadu_si128((__m128i*)(row1 + offset)));
+		__m128i b = downsample_2x_bgra_sse2(_mm_loadu_si128((__m128i*)(row0 + offset + 16)),
+		                                    _mm_loadu_si128((__m128i*)(row1 + offset + 16)));
+		_mm_storeu_si128((__m128i*)(dest_row + x * 4), _mm_packus_epi16(a, b));
+	}
+	downsample_2x_bgra_row_scalar(row0 + 2 * x * 4, row1 + 2 * x * 4, dest_row + x * 4, new_width - x);
+}
+
+// 16 samples of both rows -> 8 averaged samples, 16-bit
+static inline __m128i downsample_2x_plane_sse2(__m128i v0, __m128i v1) {
+	const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+	__m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(v0, low_bytes), _mm_srli_epi16(v0, 8)),
+	                            _mm_add_epi16(_mm_and_si128(v1, low_bytes), _mm_srli_epi16(v1, 8)));
+	return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+static void downsample_2x_plane_row_sse2(u8* row0, u8* row1, u8* dest_row, i32 new_width) {
+	i32 x = 0;
+	for (; x + 16 <= new_width; x += 16) {
+		__m128i a = downsample_2x_plane_sse2(_mm_loadu_si128((__m128i*)(row0 + 2 * x)),
+		                                     _mm_loadu_si128((__m128i*)(row1 + 2 * x)));
+		__m128i b = downsample_2x_plane_sse2(_mm_loadu_si128((__m128i*)(row0 + 2 * x + 16)),
+		                                     _mm_loadu_si128((__m128i*)(row1 + 2 * x + 16)));
+		_mm_storeu_si128((__m128i*)(dest_row + x), _mm_packus_epi16(a, b));
+	}
+	downsample_2x_plane_row_scalar(row0 + 2 * x, row1 + 2 * x, dest_row + x, new_width - x);
+}
+
+#endif //__SSE2__
+
+#if CPU_AVX2_SUPPORTED
+
+// The same as the SSE2 versions, per 128-bit lane; the packs interleave the lanes, which the permutes undo.
+
+CPU_TARGET_AVX2 static inline __m256i downsample_2x_bgra_avx2(__m256i v0, __m256i v1) {
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(v0, zero), _mm256_unpacklo_epi8(v1, zero));
+	__m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(v0, zero), _mm256_unpackhi_epi8(v1, zero));
+	__m256i sum = _mm256_add_epi16(_mm256_unpacklo_epi64(lo, hi), _mm256_unpackhi_epi64(lo, hi));
+	return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(2)), 2);
+}
+
+CPU_TARGET_AVX2 static void downsample_2x_bgra_row_avx2(u8* row0, u8* row1, u8* dest_row, i32 new_width) {
+	i32 x = 0;
+	for (; x + 8 <= new_width; x += 8) {
+		i32 offset = 2 * x * 4;
+		__m256i a = downsample_2x_bgra_avx2(_mm256_loadu_si256((__m256i*)(row0 + offset)),
+		                                    _mm256_loadu_si256((__m256i*)(row1 + offset)));
+		__m256i b = downsample_2x_bgra_avx2(_mm256_loadu_si256((__m256i*)(row0 + offset + 32)),
+		                                    _mm256_loadu_si256((__m256i*)(row1 + offset + 32)));
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+		_mm256_storeu_si256((__m256i*)(dest_row + x * 4), packed);
+	}
+	downsample_2x_bgra_row_sse2(row0 + 2 * x * 4, row1 + 2 * x * 4, dest_row + x * 4, new_width - x);
+}
+
+CPU_TARGET_AVX2 static inline __m256i downsample_2x_plane_avx2(__m256i v0, __m256i v1) {
+	const __m256i low_bytes = _mm256_set1_epi16(0x00FF);
+	__m256i sum = _mm256_add_epi16(_mm256_add_epi16(_mm256_and_si256(v0, low_bytes), _mm256_srli_epi16(v0, 8)),
+	                               _mm256_add_epi16(_mm256_and_si256(v1, low_bytes), _mm256_srli_epi16(v1, 8)));
+	return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(2)), 2);
+}
+
+CPU_TARGET_AVX2 static void downsample_2x_plane_row_avx2(u8* row0, u8* row1, u8* dest_row, i32 new_width) {
+	i32 x = 0;
+	for (; x + 32 <= new_width; x += 32) {
+		__m256i a = downsample_2x_plane_avx2(_mm256_loadu_si256((__m256i*)(row0 + 2 * x)),
+		                                     _mm256_loadu_si256((__m256i*)(row1 + 2 * x)));
+		__m256i b = downsample_2x_plane_avx2(_mm256_loadu_si256((__m256i*)(row0 + 2 * x + 32)),
+		                                     _mm256_loadu_si256((__m256i*)(row1 + 2 * x + 32)));
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+		_mm256_storeu_si256((__m256i*)(dest_row + x), packed);
+	}
+	downsample_2x_plane_row_sse2(row0 + 2 * x, row1 + 2 * x, dest_row + x, new_width - x);
+}
+
+#endif //CPU_AVX2_SUPPORTED
+
+typedef void downsample_2x_row_func_t(u8* row0, u8* row1, u8* dest_row, i32 new_width);
+
+// Indexed by level, see cpu_dispatch.h
+static downsample_2x_row_func_t* downsample_2x_bgra_row_impls[CPU_LEVEL_COUNT] = {
+	downsample_2x_bgra_row_scalar,
+#if defined(__SSE2__)
+	downsample_2x_bgra_row_sse2,
+#if CPU_AVX2_SUPPORTED
+	downsample_2x_bgra_row_avx2,
+#else
+	downsample_2x_bgra_row_sse2,
+#endif
+#endif
+};
+
+static downsample_2x_row_func_t* downsample_2x_plane_row_impls[CPU_LEVEL_COUNT] = {
+	downsample_2x_plane_row_scalar,
+#if defined(__SSE2__)
+	downsample_2x_plane_row_sse2,
+#if CPU_AVX2_SUPPORTED
+	downsample_2x_plane_row_avx2,
+#else
+	downsample_2x_plane_row_sse2,
+#endif
+#endif
+};
+
+static void downsample_2x(u8* pixels, i32 dim, u8* dest) {
+	i32 cpu_level = cpu_get_kernel_level(CPU_KERNEL_MIP_DOWNSAMPLE);
+	downsample_2x_row_func_t* downsample_row = downsample_2x_bgra_row_impls[cpu_level];
+	i32 new_dim = dim / 2;
+	i32 pitch = dim * BYTES_PER_PIXEL;
+	for (i32 y = 0; y < new_dim; ++y) {
+		u8* row0 = pixels + (2 * y) * pitch;
+		downsample_row(row0, row0 + pitch, dest + y * new_dim * BYTES_PER_PIXEL, new_dim);
+	}
+}
+
+#define TILE_UNIFORM_MAX_RANGE 4 // how much the values of a channel may differ within a tile that counts as uniform
+
+// Checks whether a decoded TILE_DIM x TILE_DIM BGRA tile is (nearly) a single color, like the empty glass around the
+// tissue. If so, *color is set to the middle of the range of each channel (BGRA). Gives up as soon as possible, so
+// that checking a tile with tissue in it costs next to nothing.
+bool32 is_tile_uniform(u8* pixels, u32* color) {
+	u8 min[4] = { pixels[0], pixels[1], pixels[2], pixels[3] };
+	u8 max[4] = { pixels[0], pixels[1], pixels[2], pixels[3] };
+#if defined(__SSE2__)
+	u32 first_pixel;
+	memcpy(&first_pixel, pixels, 4);
+	__m128i v_min = _mm_set1_epi32((int)first_pixel);
+	__m128i v_max = v_min;
+	const __m128i max_range = _mm_set1_epi8(TILE_UNIFORM_MAX_RANGE);
+	const __m128i zero = _mm_setzero_si128();
+	for (i32 y = 0; y < TILE_DIM; ++y) {
+		u8* row = pixels + y * TILE_PITCH;
+		for (i32 x = 0; x < TILE_PITCH; x += 16) {
+			__m128i v = _mm_loadu_si128((__m128i*)(row + x));
+			v_min = _mm_min_epu8(v_min, v);
+			v_max = _mm_max_epu8(v_max, v);
+		}
+		// Each byte lane only ever sees the same channel, so the lanes can be checked on their own.
+		__m128i excess = _mm_subs_epu8(_mm_subs_epu8(v_max, v_min), max_range);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(excess, zero)) != 0xFFFF) {
+			return false;
+		}
+	}
+	u8 lane_min[16], lane_max[16];
+	_mm_storeu_si128((__m128i*)lane_min, v_min);
+	_mm_storeu_si128((__m128i*)lane_max, v_max);
+	for (i32 i = 0; i < 16; ++i) {
+		min[i % 4] = ATMOST(min[i % 4], lane_min[i]);
+		max[i % 4] = ATLEAST(max[i % 4], lane_max[i]);
+	}
+#else
+	for (i32 y = 0; y < TILE_DIM; ++y) {
+		u8* row = pixels + y * TILE_PITCH;
+		for (i32 x = 0; x < TILE_PITCH; x += 4) {
+			for (i32 c = 0; c < 4; ++c) {
+				min[c] = ATMOST(min[c], row[x + c]);
+				max[c] = ATLEAST(max[c], row[x + c]);
+			}
+		}
+		for (i32 c = 0; c < 4; ++c) {
+			if (max[c] - min[c] > TILE_UNIFORM_MAX_RANGE) return false;
+		}
+	}
+#endif
+	for (i32 c = 0; c < 4; ++c) {
+		if (max[c] - min[c] > TILE_UNIFORM_MAX_RANGE) return false;
+	}
+	*color = 0;
+	for (i32 c = 0; c < 4; ++c) {
+		*color |= (u32)((min[c] + max[c] + 1) / 2) << (c * 8);
+	}
+	return true;
+}
+
+// Small tiles are decoded into the top-left corner of a tile buffer; this moves their rows together (in place), so that
+// the tile becomes a (TILE_DIM / 2) x (TILE_DIM / 2) image for build_tile_mip_chain().
+void pack_small_tile(u8* pixels) {
+	i32 dim = TILE_DIM / 2;
+	for (i32 y = 1; y < dim; ++y) {
+		memmove(pixels + y * dim * BYTES_PER_PIXEL, pixels + y * TILE_PITCH, dim * BYTES_PER_PIXEL);
+	}
+}
+
+// Lays out a dim x dim BGRA image followed by its mipmaps (each level directly after the previous one), ready for
+// uploading with upload_tile_mip_chain(). dim is TILE_DIM, or TILE_DIM / 2 for small tiles (see pack_small_tile()).
+// Only touches CPU memory, so it can run on any thread.
+// If the tile was decoded into the start of the mip chain buffer itself, nothing needs to be copied.
+void build_tile_mip_chain(u8* pixels, u8* mip_chain, i32 dim) {
+	if (pixels != mip_chain) {
+		memcpy(mip_chain, pixels, dim * dim * BYTES_PER_PIXEL);
+	}
+	u8* level = mip_chain;
+	for (i32 mip_level = 1; mip_level < TILE_TEXTURE_MIP_LEVELS; ++mip_level) {
+		u8* next_level = level + dim * dim * BYTES_PER_PIXEL;
+		downsample_2x(level, dim, next_level);
+		level = next_level;
+		dim /= 2;
+	}
+	ASSERT(level + dim * dim * BYTES_PER_PIXEL <= mip_chain + TILE_MIP_CHAIN_SIZE);
+}
+
+// The same as build_tile_mip_chain(), for a tile decoded as YCbCr planes (see decode_tile_planar_with_state()).
+// Each plane is downsampled on its own, so that each mip level has the same layout as the tile itself.
+void build_planar_tile_mip_chain(u8* planes, u8* mip_chain, i32 dim) {
+	if (planes != mip_chain) {
+		memcpy(mip_chain, planes, dim * dim * 3 / 2);
+	}
+	i32 cpu_level = cpu_get_kernel_level(CPU_KERNEL_MIP_DOWNSAMPLE);
+	downsample_2x_row_func_t* downsample_row = downsample_2x_plane_row_impls[cpu_level];
+	u8* level = mip_chain;
+	for (i32 mip_level = 1; mip_level < TILE_TEXTURE_MIP_LEVELS; ++mip_level) {
+		u8* next_level = level + dim * dim * 3 / 2;
+		i32 next_dim = dim / 2;
+		// The Y plane, and then the Cb and Cr planes together: dim / 2 rows of dim samples, with the boundary between
+		// the planes falling between two pairs of samples, so that the planes don't bleed into each other.
+		for (i32 y = 0; y < next_dim * 3 / 2; ++y) {
+			u8* row0 = level + (2 * y) * dim;
+			downsample_row(row0, row0 + dim, next_level + y * next_dim, next_dim);
+		}
+		level = next_level;
+		dim = next_dim;
+	}
+	ASSERT(level + dim * dim * 3 / 2 <= mip_chain + TILE_MIP_CHAIN_SIZE);
+}
+
+// The same as build_tile_mip_chain(), for the tiles of a channel of a fluorescence image: these are grayscale, so only
+// one byte per pixel is kept. The pixels are packed in place (each one moves forward), then downsampled as a plane.
+void build_single_channel_tile_mip_chain(u8* mip_chain, i32 dim) {
+	for (i32 i = 0; i < dim * dim; ++i) {
+		mip_chain[i] = mip_chain[i * BYTES_PER_PIXEL + 1];
+	}
+	i32 cpu_level = cpu_get_kernel_level(CPU_KERNEL_MIP_DOWNSAMPLE);
+	downsample_2x_row_func_t* downsample_row = downsample_2x_plane_row_impls[cpu_level];
+	u8* level = mip_chain;
+	for (i32 mip_level = 1; mip_level < TILE_TEXTURE_MIP_LEVELS; ++mip_level) {
+		u8* next_level = level + dim * dim;
+		i32 next_dim = dim / 2;
+		for (i32 y = 0; y < next_dim; ++y) {
+			u8* row0 = level + (2 * y) * dim;
+			downsample_row(row0, row0 + dim, next_level + y * next_dim, next_dim);
+		}
+		level = next_level;
+		dim = next_dim;
+	}
+	ASSERT(level + dim * dim <= mip_chain + TILE_MIP_CHAIN_SIZE);
+}
+
+// Like is_tile_uniform(), for a tile decoded as YCbCr planes: the color is converted to BGRA, the way tile.frag does it.
+bool32 is_planar_tile_uniform(u8* planes, i32 dim, u32* color) {
+	i32 min[3] = {255, 255, 255}, max[3] = {0, 0, 0};
+	i32 chroma_dim = dim / 2;
+	for (i32 i = 0; i < dim * dim; ++i) {
+		min[0] = ATMOST(min[0], planes[i]);
+		max[0] = ATLEAST(max[0], planes[i]);
+	}
+	u8* chroma = planes + dim * dim;
+	for (i32 y = 0; y < chroma_dim; ++y) {
+		for (i32 x = 0; x < chroma_dim; ++x) {
+			for (i32 c = 1; c < 3; ++c) {
+				i32 value = chroma[y * dim + (c - 1) * chroma_dim + x];
+				min[c] = ATMOST(min[c], value);
+				max[c] = ATLEAST(max[c], value);
+			}
+		}
+	}
+	for (i32 c = 0; c < 3; ++c) {
+		if (max[c] - min[c] > TILE_UNIFORM_MAX_RANGE) return false;
+	}
+	float luma = (float)(min[0] + max[0]) * 0.5f;
+	float cb = (float)(min[1] + max[1]) * 0.5f - 128.0f;
+	float cr = (float)(min[2] + max[2]) * 0.5f - 128.0f;
+	float rgb[3] = { luma + 1.402f * cr, luma - 0.344136f * cb - 0.714136f * cr, luma + 1.772f * cb };
+	*color = 0xFF000000;
+	for (i32 c = 0; c < 3; ++c) {
+		u32 value = (u32)CLAMP(rgb[c] + 0.5f, 0.0f, 255.0f);
+		*color |= value << ((2 - c) * 8); // BGRA order: blue in the lowest byte
+	}
+	return true;
+}
+
+// BC1 (DXT1) compression: each 4x4 block of pixels is stored as two RGB565 endpoint colors and 2 bits per pixel
+// choosing between the endpoints and two colors in between. If the first endpoint is not the larger one, there is
+// only one color in between, and the fourth choice is transparent (used for the padding of generated tiles).
+// The endpoints are the corners of the bounding box of the colors in the block (inset a little, because the extremes
+// are usually outliers); this is fast, and good enough for the smooth colors of stained tissue.
+
+static inline u16 bgra_to_rgb565(const u8* bgra) {
+	return (u16)(((bgra[2] * 31 + 127) / 255) << 11 | ((bgra[1] * 63 + 127) / 255) << 5 | ((bgra[0] * 31 + 127) / 255));
+}
+
+static inline void rgb565_to_rgb(u16 c, i32* rgb) {
+	i32 r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+	rgb[0] = (r << 3) | (r >> 2);
+	rgb[1] = (g << 2) | (g >> 4);
+	rgb[2] = (b << 3) | (b >> 2);
+}
+
+static void compress_block_bc1(u8 block[16][4], u8* dest) {
+	u8 min[3] = {255, 255, 255}, max[3] = {0, 0, 0};
+	bool32 has_transparency = false;
+	i32 opaque_count = 0;
+	for (i32 i = 0; i < 16; ++i) {
+		if (block[i][3] < 128) {
+			has_transparency = true;
+			continue;
+		}
+		++opaque_count;
+		for (i32 c = 0; c < 3; ++c) {
+			min[c] = ATMOST(min[c], block[i][c]);
+			max[c] = ATLEAST(max[c], block[i][c]);
+		}
+	}
+	u16 c0 = 0, c1 = 0;
+	if (opaque_count > 0) {
+		u8 inset_max[4], inset_min[4];
+		for (i32 c = 0; c < 3; ++c) {
+			i32 inset = (max[c] - min[c]) / 16;
+			inset_max[c] = (u8)(max[c] - inset);
+			inset_min[c] = (u8)(min[c] + inset);
+		}
+		c0 = bgra_to_rgb565(inset_max);
+		c1 = bgra_to_rgb565(inset_min);
+	}
+	// Four colors needs c0 > c1, three colors plus transparency needs c0 <= c1.
+	if ((has_transparency && c0 > c1) || (!has_transparency && c0 < c1)) {
+		u16 temp = c0; c0 = c1; c1 = temp;
+	}
+	i32 palette[4][3];
+	rgb565_to_rgb(c0, palette[0]);
+	rgb565_to_rgb(c1, palette[1]);
+	i32 palette_count = 4;
+	for (i32 c = 0; c < 3; ++c) {
+		if (c0 > c1) {
+			palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+		} else {
+			palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+			palette_count = 3; // index 3 = transparent
+		}
+	}
+	u32 indices = 0;
+	for (i32 i = 0; i < 16; ++i) {
+		u32 best_index = 3;
+		if (block[i][3] >= 128) {
+			i32 best_distance = INT32_MAX;
+			for (i32 j = 0; j < palette_count; ++j) {
+				i32 dr = block[i][2] - palette[j][0];
+				i32 dg = block[i][1] - palette[j][1];
+				i32 db = block[i][0] - palette[j][2];
+				i32 distance = dr * dr + dg * dg + db * db;
+				if (distance < best_distance) {
+					best_distance = distance;
+					best_index = j;
+				}
+			}
+		}
+		indices |= best_index << (2 * i);
+	}
+	memcpy(dest, &c0, 2);
+	memcpy(dest + 2, &c1, 2);
+	memcpy(dest + 4, &indices, 4);
+}
+
+// Compresses a mip chain built by build_tile_mip_chain() to BC1, in place: the compressed levels are laid out one
+// after the other from the start of the buffer, like the uncompressed ones. This works because the compressed data
+// is much smaller, so that it is always written behind the pixels that still need to be read.
+void compress_tile_mip_chain_bc1(u8* mip_chain, i32 tile_dim) {
+	u8* source = mip_chain;
+	u8* dest = mip_chain;
+	for (i32 mip_level = 0; mip_level < TILE_TEXTURE_MIP_LEVELS; ++mip_level) {
+		i32 dim = tile_dim >> mip_level;
+		i32 pitch = dim * BYTES_PER_PIXEL;
+		for (i32 block_y = 0; block_y < dim; block_y += 4) {
+			for (i32 block_x = 0; block_x < dim; block_x += 4) {
+				u8 block[16][4];
+				for (i32 i = 0; i < 16; ++i) {
+					// The smallest levels are less than a block in size: repeat their pixels.
+					i32 x = ATMOST(block_x + (i % 4), dim - 1);
+					i32 y = ATMOST(block_y + (i / 4), dim - 1);
+					memcpy(block[i], source + y * pitch + x * BYTES_PER_PIXEL, 4);
+				}
+				compress_block_bc1(block, dest);
+				dest += 8;
+			}
+		}
+		source += dim * pitch;
+	}
+	ASSERT(dest == mip_chain + get_tile_mip_chain_size(TILE_TEXTURE_FORMAT_BC1, tile_dim));
+}
+
+// Decoded tiles travel through the pipeline in tile buffers of TILE_MIP_CHAIN_SIZE bytes: a worker decodes into the
+// start of the buffer, builds the mipmaps after it in place, and hands the buffer over to the main thread, which
+// uploads it and gives it back. The buffers are page-aligned (taken from the OS in chunks), and recycled instead of
+// being freed, so that decoding a tile does not need to go through the heap.
+// Note: large pages (MEM_LARGE_PAGES) would need the SeLockMemoryPrivilege, which normal users don't have.
+
+#define TILE_BUFFER_POOL_CHUNK_COUNT 8 // buffers allocated at once
+
+typedef struct tile_buffer_pool_t {
+	volatile i32 lock;
+	u8** free_buffers; // sb
+	i32 buffers_in_use;
+	i32 buffer_count;
+} tile_buffer_pool_t;
+
+tile_buffer_pool_t tile_buffer_pool;
+
+u8* acquire_tile_buffer() {
+	tile_buffer_pool_t* pool = &tile_buffer_pool;
+	spin_lock(&pool->lock);
+	if (sb_count(pool->free_buffers) == 0) {
+		u8* chunk = platform_alloc(TILE_BUFFER_POOL_CHUNK_COUNT * TILE_MIP_CHAIN_SIZE);
+		for (i32 i = TILE_BUFFER_POOL_CHUNK_COUNT - 1; i >= 0; --i) {
+			sb_push(pool->free_buffers, chunk + i * TILE_MIP_CHAIN_SIZE);
+		}
+		pool->buffer_count += TILE_BUFFER_POOL_CHUNK_COUNT;
+		memory_stats_add(MEMORY_DOMAIN_DECODED_TILES, TILE_BUFFER_POOL_CHUNK_COUNT * TILE_MIP_CHAIN_SIZE);
+	}
+	u8* buffer = sb_last(pool->free_buffers);
+	--sb_raw_count(pool->free_buffers);
+	++pool->buffers_in_use;
+	spin_unlock(&pool->lock);
+	return buffer;
+}
+
+void release_tile_buffer(u8* buffer) {
+	tile_buffer_pool_t* pool = &tile_buffer_pool;
+	ASSERT(buffer);
+	spin_lock(&pool->lock);
+	sb_push(pool->free_buffers, buffer);
+	--pool->buffers_in_use;
+	spin_unlock(&pool->lock);
+}
+
+// The size of the mip chain (and of the region it goes into) for a slot
+static i32 get_tile_texture_slot_dim(u32 slot) {
+	return (get_tile_texture_quadrant(slot) >= 0) ? TILE_DIM / 2 : TILE_DIM;
+}
+
+static void tex_sub_image_tile_mip_chain(u32 slot, u8* mip_chain) {
+	u32 layer_slot = get_tile_texture_layer_slot(slot);
+	u32 array_index = (layer_slot - 1) / TILE_TEXTURE_ARRAY_LAYERS;
+	i32 layer = (layer_slot - 1) % TILE_TEXTURE_ARRAY_LAYERS;
+	i32 quadrant = ATLEAST(0, get_tile_texture_quadrant(slot));
+	i32 format = get_tile_texture_slot_format(slot);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, tile_texture_pool.texture_arrays[array_index]);
+	i32 dim = get_tile_texture_slot_dim(slot);
+	for (i32 mip_level = 0; mip_level < TILE_TEXTURE_MIP_LEVELS; ++mip_level) {
+		u32 level_size = get_tile_mip_level_size(format, dim);
+		i32 x = (quadrant & 1) * dim;
+		i32 y = (quadrant >> 1) * dim;
+		if (format == TILE_TEXTURE_FORMAT_BC1) {
+			glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, mip_level, x, y, layer, dim, dim, 1,
+			                          GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, level_size, mip_chain);
+		} else if (format == TILE_TEXTURE_FORMAT_YCBCR420) {
+			// (the rows of the planes are dim / 2 or dim bytes long, a multiple of the default unpack alignment)
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, mip_level, 0, 0, layer, dim, dim * 3 / 2, 1, GL_RED, GL_UNSIGNED_BYTE,
+			                mip_chain);
+		} else if (format == TILE_TEXTURE_FORMAT_R8) {
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, mip_level, x, y, layer, dim, dim, 1, GL_RED, GL_UNSIGNED_BYTE, mip_chain);
+		} else {
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, mip_level, x, y, layer, dim, dim, 1, GL_BGRA, GL_UNSIGNED_BYTE, mip_chain);
+		}
+		mip_chain += level_size;
+		dim = ATLEAST(1, dim / 2);
+	}
+}
+
+// Streaming tile uploads: instead of letting the driver copy the pixels during glTexSubImage3D(), the mip chain is
+// copied into a persistently mapped pixel buffer object, from which the GPU pulls the data asynchronously.
+// This needs OpenGL 4.4 (glBufferStorage); otherwise we fall back to the synchronous path.
+
+#if defined(GL_VERSION_4_4)
+#define TILE_STREAMING_UPLOAD_SUPPORTED 1
+#else
+#define TILE_STREAMING_UPLOAD_SUPPORTED 0
+#endif
+
+#if TILE_STREAMING_UPLOAD_SUPPORTED
+
+#define TILE_UPLOAD_RING_SIZE 16 // number of uploads that can be in flight at the same time
+
+typedef struct tile_upload_ring_t {
+	bool32 is_initialized;
+	u32 pbo;
+	u8* mapped_memory;
+	GLsync fences[TILE_UPLOAD_RING_SIZE]; // signaled when the GPU is done reading from that part of the buffer
+	i32 next_index;
+} tile_upload_ring_t;
+
+static tile_upload_ring_t tile_upload_ring;
+
+bool32 is_tile_streaming_upload_available() {
+	return GLAD_GL_VERSION_4_4;
+}
+
+static void init_tile_upload_ring(tile_upload_ring_t* ring) {
+	u32 flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	u64 buffer_size = TILE_UPLOAD_RING_SIZE * TILE_MIP_CHAIN_SIZE;
+	glGenBuffers(1, &ring->pbo);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring->pbo);
+	glBufferStorage(GL_PIXEL_UNPACK_BUFFER, buffer_size, NULL, flags);
+	ring->mapped_memory = (u8*) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, buffer_size, flags);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	ring->is_initialized = true;
+}
+
+static void upload_tile_mip_chain_streaming(tile_upload_ring_t* ring, u32 slot, u8* mip_chain) {
+	if (!ring->is_initialized) {
+		init_tile_upload_ring(ring);
+	}
+	i32 ring_index = ring->next_index;
+	ring->next_index = (ring->next_index + 1) % TILE_UPLOAD_RING_SIZE;
+	if (ring->fences[ring_index]) {
+		// Before overwriting this part of the buffer, the GPU must be done copying the previous tile out of it.
+		// Usually this has long happened already, so we don't expect to actually wait here.
+		glClientWaitSync(ring->fences[ring_index], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+		glDeleteSync(ring->fences[ring_index]);
+		ring->fences[ring_index] = NULL;
+	}
+
+	// The mapped memory is write-combined: write it exactly once, in one go.
+	u64 ring_offset = ring_index * TILE_MIP_CHAIN_SIZE;
+	memcpy(ring->mapped_memory + ring_offset, mip_chain,
+	       get_tile_mip_chain_size(get_tile_texture_slot_format(slot), get_tile_texture_slot_dim(slot)));
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring->pbo);
+	tex_sub_image_tile_mip_chain(slot, (u8*)ring_offset); // offset into the bound PBO
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	ring->fences[ring_index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Transfer queue: a dedicated thread with an OpenGL context of its own (sharing its objects with the main context,
+// see win32_start_transfer_thread()) does the tile uploads, like the copy queue of the newer graphics APIs. The main
+// thread hands over the texture slot and the mip chain; the transfer thread copies the mip chain through a PBO ring
+// of its own into the texture array, and puts a fence after it. Once that fence is signaled (polled, never waited
+// for), the main thread gives the tile its texture (see take_finished_tile_transfer()). So the main thread spends no
+// time on uploads at all, and the uploads overlap with drawing.
+// Single producer (the main thread), single consumer (the transfer thread); the entries are handed back in order.
+
+#define TILE_TRANSFER_QUEUE_SIZE 64
+
+typedef struct tile_transfer_t {
+	u32 slot;
+	u8* mip_chain;
+	void* userdata;
+	GLsync fence; // set by the transfer thread
+} tile_transfer_t;
+
+typedef struct tile_transfer_queue_t {
+	volatile i32 is_running; // set by the transfer thread once its context is current
+	tile_transfer_t entries[TILE_TRANSFER_QUEUE_SIZE];
+	volatile i32 submitted_count; // only written by the main thread
+	volatile i32 uploaded_count; // only written by the transfer thread
+	i32 finished_count; // main thread only
+	i32 shared_texture_array_generation; // main thread only: the texture arrays that the transfer thread can see
+	tile_upload_ring_t upload_ring; // transfer thread only
+} tile_transfer_queue_t;
+
+static tile_transfer_queue_t tile_transfer_queue;
+
+// Called by the transfer thread, with its context current.
+void start_tile_transfers() {
+	if (is_tile_streaming_upload_available()) {
+		tile_transfer_queue.is_running = true;
+	}
+}
+
+bool32 is_tile_transfer_queue_running() {
+	return tile_transfer_queue.is_running;
+}
+
+bool32 is_tile_transfer_queue_full() {
+	tile_transfer_queue_t* queue = &tile_transfer_queue;
+	return queue->submitted_count - queue->finished_count >= TILE_TRANSFER_QUEUE_SIZE;
+}
+
+// Main thread. The mip chain needs to stay valid until the transfer is handed back. Returns false if the queue is full.
+bool32 submit_tile_transfer(u32 slot, u8* mip_chain, void* userdata) {
+	tile_transfer_queue_t* queue = &tile_transfer_queue;
+	ASSERT(slot != 0);
+	if (is_tile_transfer_queue_full()) {
+		return false;
+	}
+	if (queue->shared_texture_array_generation != tile_texture_pool.texture_array_generation) {
+		// A texture array was just created in the main context; it only exists for the other context once the
+		// commands that created it have been flushed.
+		glFlush();
+		queue->shared_texture_array_generation = tile_texture_pool.texture_array_generation;
+	}
+	tile_transfer_t* transfer = queue->entries + (queue->submitted_count % TILE_TRANSFER_QUEUE_SIZE);
+	transfer->slot = slot;
+	transfer->mip_chain = mip_chain;
+	transfer->userdata = userdata;
+	transfer->fence = NULL;
+	write_barrier;
+	++queue->submitted_count;
+	++tile_texture_pool.upload_count;
+	win32_wake_transfer_thread();
+	return true;
+}
+
+// Transfer thread: uploads everything that has been submitted.
+void run_tile_transfers() {
+	tile_transfer_queue_t* queue = &tile_transfer_queue;
+	while (queue->uploaded_count < queue->submitted_count) {
+		read_barrier;
+		tile_transfer_t* transfer = queue->entries + (queue->uploaded_count % TILE_TRANSFER_QUEUE_SIZE);
+		upload_tile_mip_chain_streaming(&queue->upload_ring, transfer->slot, transfer->mip_chain);
+		transfer->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		glFlush(); // (otherwise the fence might never be signaled, as seen from the main context)
+		write_barrier;
+		++queue->uploaded_count;
+	}
+}
+
+// Main thread: hands back the oldest transfer, if its upload is done.
+bool32 take_finished_tile_transfer(u32* slot, void** userdata) {
+	tile_transfer_queue_t* queue = &tile_transfer_queue;
+	if (queue->finished_count == queue->uploaded_count) {
+		return false;
+	}
+	read_barrier;
+	tile_transfer_t* transfer = queue->entries + (queue->finished_count % TILE_TRANSFER_QUEUE_SIZE);
+	GLenum status = glClientWaitSync(transfer->fence, 0, 0);
+	if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+		return false;
+	}
+	glDeleteSync(transfer->fence);
+	transfer->fence = NULL;
+	*slot = transfer->slot;
+	*userdata = transfer->userdata;
+	++queue->finished_count;
+	return true;
+}
+
+#else
+
+typedef struct tile_upload_ring_t {
+	bool32 is_initialized;
+} tile_upload_ring_t;
+
+static tile_upload_ring_t tile_upload_ring;
+
+bool32 is_tile_streaming_upload_available() {
+	return false;
+}
+
+static void upload_tile_mip_chain_streaming(tile_upload_ring_t* ring, u32 slot, u8* mip_chain) {}
+
+void start_tile_transfers() {}
+bool32 is_tile_transfer_queue_running() { return false; }
+bool32 is_tile_transfer_queue_full() { return true; }
+bool32 submit_tile_transfer(u32 slot, u8* mip_chain, void* userdata) { return false; }
+void run_tile_transfers() {}
+bool32 take_finished_tile_transfer(u32* slot, void** userdata) { return false; }
+
+#endif //TILE_STREAMING_UPLOAD_SUPPORTED
+
+// Uploads a mip chain built by build_tile_mip_chain() into the texture slot. Must be called from the main thread,
+// which owns the only OpenGL context: the texture can be drawn right away, no synchronization needed.
+void upload_tile_mip_chain(u32 slot, u8* mip_chain) {
+	ASSERT(slot != 0);
+	++tile_texture_pool.upload_count;
+	if (is_tile_streaming_upload_available()) {
+		upload_tile_mip_chain_streaming(&tile_upload_ring, slot, mip_chain);
+	} else {
+		tex_sub_image_tile_mip_chain(slot, mip_chain);
+	}
+}
+
+// GPU tile decoding (experimental): of JPEG tiles that qualify, the workers only do the entropy decoding (see
+// decode_tile_coefficients_with_state()). The dequantization, IDCT, chroma upsampling and color conversion are done by
+// a compute shader (shaders/jpeg_decode.comp), which writes the pixels and the mip level straight into a layer of a
+// BGRA texture array. This moves most of the decoding cost off the CPU, at the price of decoding within a few levels
+// of what libjpeg makes of the tile (the IDCT is done in floating point).
+// This needs OpenGL 4.3 (compute shaders, shader storage buffers and image load/store); without it the tiles are
+// decoded on the CPU as usual. Tiles decoded this way are not checked for being uniform (see is_tile_uniform()).
+
+#if defined(GL_VERSION_4_3)
+#define GPU_TILE_DECODING_SUPPORTED 1
+#else
+#define GPU_TILE_DECODING_SUPPORTED 0
+#endif
+
+#if GPU_TILE_DECODING_SUPPORTED
+
+typedef struct gpu_tile_decoder_t {
+	u32 program; // 0 if not available
+	i32 u_stage;
+	i32 u_dim;
+	i32 u_layer;
+	u32 coefficient_buffer;
+} gpu_tile_decoder_t;
+
+static gpu_tile_decoder_t gpu_tile_decoder;
+
+// Should be called once the OpenGL context exists.
+static void init_gpu_tile_decoder() {
+	gpu_tile_decoder_t* decoder = &gpu_tile_decoder;
+	if (!GLAD_GL_VERSION_4_3) {
+		return;
+	}
+	u32 program = load_compute_shader_program("shaders/jpeg_decode.comp");
+	if (program) {
+		decoder->u_stage = get_uniform(program, "stage");
+		decoder->u_dim = get_uniform(program, "dim");
+		decoder->u_layer = get_uniform(program, "layer");
+		glGenBuffers(1, &decoder->coefficient_buffer);
+		decoder->program = program; // (checked by the worker threads, see use_gpu_tile_decoding())
+	}
+}
+
+bool32 is_gpu_tile_decoding_available() {
+	return gpu_tile_decoder.program != 0;
+}
+
+static void dispatch_gpu_tile_decode(u32 slot, u8* coefficients) {
+	gpu_tile_decoder_t* decoder = &gpu_tile_decoder;
+	u32 layer_slot = get_tile_texture_layer_slot(slot);
+	u32 array_index = (layer_slot - 1) / TILE_TEXTURE_ARRAY_LAYERS;
+	i32 layer = (layer_slot - 1) % TILE_TEXTURE_ARRAY_LAYERS;
+	u32 texture = tile_texture_pool.texture_arrays[array_index];
+
+	// Respecifying the buffer for every tile (orphaning) means that the driver doesn't have to wait for the dispatches
+	// of the previous tile to be done with it.
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, decoder->coefficient_buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, JPEG_COEFFICIENT_TILE_SIZE(TILE_DIM), coefficients, GL_STREAM_DRAW);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, decoder->coefficient_buffer);
+	glBindImageTexture(0, texture, 0, GL_TRUE, 0, GL_READ_WRITE, GL_RGBA8);
+	glBindImageTexture(1, texture, 1, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA8);
+
+	glUseProgram(decoder->program);
+	glUniform1i(decoder->u_dim, TILE_DIM);
+	glUniform1i(decoder->u_layer, layer);
+	glUniform1i(decoder->u_stage, 0);
+	glDispatchCompute(TILE_DIM / 16, TILE_DIM / 16, 1); // one work group per MCU
+	glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT); // the mip level is built from the pixels written above
+	glUniform1i(decoder->u_stage, 1);
+	glDispatchCompute(TILE_DIM / 32, TILE_DIM / 32, 1);
+	// Before the tile is drawn, and before other tiles are written into the same texture array
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+	glUseProgram(0);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+#else
+
+static void init_gpu_tile_decoder() {}
+
+bool32 is_gpu_tile_decoding_available() {
+	return false;
+}
+
+static void dispatch_gpu_tile_decode(u32 slot, u8* coefficients) {}
+
+#endif //GPU_TILE_DECODING_SUPPORTED
+
+// Whether JPEG tiles decoded now should be left for the GPU to finish. They end up as uncompressed BGRA textures, so
+// BC1 compression goes first.
+bool32 use_gpu_tile_decoding() {
+	return gpu_tile_decoding && is_gpu_tile_decoding_available() &&
+	       get_tile_texture_format_for_new_tiles() == TILE_TEXTURE_FORMAT_BGRA;
+}
+
+// Finishes decoding a tile of which the workers only did the entropy decoding (see use_gpu_tile_decoding()), into
+// the texture slot, which must be a whole BGRA layer. Must be called from the main thread, like upload_tile_mip_chain().
+void decode_tile_coefficients_into_texture(u32 slot, u8* coefficients) {
+	ASSERT(slot != 0 && get_tile_texture_quadrant(slot) < 0);
+	ASSERT(get_tile_texture_slot_format(slot) == TILE_TEXTURE_FORMAT_BGRA);
+	++tile_texture_pool.upload_count;
+	dispatch_gpu_tile_decode(slot, coefficients);
+}
+
+// Instanced tile rendering: the visible tiles are collected into a per-frame instance list, and then drawn using
+// one glDrawElementsInstanced() call per level and texture array (per batch of MAX_TILE_INSTANCES_PER_DRAW tiles).
+// The instance data is passed through a uniform buffer (instead of instanced vertex attributes), because
+// glVertexAttribDivisor() is not available in OpenGL 3.1.
+
+#define MAX_TILE_INSTANCES_PER_DRAW 256 // needs to match the array sizes in tile.vert
+
+typedef struct tile_instance_t {
+	u32 texture_slot; // 0 for a flat tile, which is drawn in a single color
+	u32 color; // BGRA, for flat tiles
+	float x, y;
+	float width, height;
+	float depth;
+	float alpha; // less than 1 for the tiles of a level that is being blended in or out (see push_visible_tiles())
+	i32 stain_view; // 1-based index into stain_views, or 0 to show the original colors
+	i32 channel_view; // 1-based index into channel_views, or 0 if the tile is not of a channel of a fluorescence image
+	i32 overlay_view; // 1-based index into overlay_views, or 0 if the tile is not of an overlay
+	v4f tex_rect;
+	v2f valid_max; // where the part of the tile within the image ends, in the texture coordinates of tile.frag
+} tile_instance_t;
+
+// Showing a single stain of the image (see get_stain_unmixing()) is done in tile.frag, on the same tile textures:
+// tiles pushed after set_tile_stain_view() are drawn in batches with that stain view, until clear_tile_stain_view().
+typedef struct stain_view_t {
+	v3f unmixing; // the row of the inverse stain matrix for the shown stain
+	v3f stain_vector; // the optical density of the shown stain
+} stain_view_t;
+
+// Fluorescence images are composited from their channels in tile.frag: tiles pushed after set_tile_channel_view() are
+// tinted with the color of that channel, and added to what the channels pushed before them have drawn. Changing the
+// settings of a channel only changes these uniforms; the tile textures stay as they are.
+typedef struct channel_view_t {
+	v3f color;
+	float gain;
+	float offset;
+} channel_view_t;
+
+// Overlays (e.g. heatmaps, see load_overlay_from_file()) are drawn over all other tiles in the same pass: tiles pushed
+// after set_tile_overlay_view() are colored through the colormap, and blended over the image with the opacity.
+typedef struct overlay_view_t {
+	i32 colormap; // overlay_colormap_enum
+	float opacity;
+} overlay_view_t;
+
+// Memory layout of the uniform block in tile.vert (std140)
+typedef struct tile_instance_block_t {
+	v4f rects[MAX_TILE_INSTANCES_PER_DRAW];
+	v4f params[MAX_TILE_INSTANCES_PER_DRAW];
+	v4f tex_rects[MAX_TILE_INSTANCES_PER_DRAW];
+	v4f valid_maxes[MAX_TILE_INSTANCES_PER_DRAW]; // (only xy is used; four arrays of 256 is exactly the minimum block size)
+} tile_instance_block_t;
+
+static u32 vao_tile_instances;
+static u32 ubo_tile_instances;
+static tile_instance_t* tile_instances; // sb
+static tile_instance_block_t tile_instance_block;
+static stain_view_t* stain_views; // sb, rebuilt every frame along with the tile instances
+static i32 current_stain_view;
+static channel_view_t* channel_views; // sb, like stain_views
+static i32 current_channel_view;
+static overlay_view_t* overlay_views; // sb, like stain_views
+static i32 current_overlay_view;
+
+void init_tile_instances() {
+	// Reuse the geometry of the rect, but the attribute locations of the tile shader may be different.
+	glGenVertexArrays(1, &vao_tile_instances);
+	glBindVertexArray(vao_tile_instances);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo_rect);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo_rect);
+	u32 vertex_stride = 5 * sizeof(float);
+	glEnableVertexAttribArray(tile_shader_attrib_location_pos);
+	glEnableVertexAttribArray(tile_shader_attrib_location_tex_coord);
+	glVertexAttribPointer(tile_shader_attrib_location_pos, 3, GL_FLOAT, GL_FALSE, vertex_stride, (void*)0);
+	glVertexAttribPointer(tile_shader_attrib_location_tex_coord, 2, GL_FLOAT, GL_FALSE, vertex_stride, (void*)(3 * sizeof(float)));
+	glBindVertexArray(0);
+
+	glGenBuffers(1, &ubo_tile_instances);
+	glBindBuffer(GL_UNIFORM_BUFFER, ubo_tile_instances);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(tile_instance_block_t), NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	u32 block_index = glGetUniformBlockIndex(tile_shader, "tile_instances");
+	glUniformBlockBinding(tile_shader, block_index, 0);
+}
+
+void begin_tile_instances() {
+	if (tile_instances) {
+		sb_raw_count(tile_instances) = 0;
+	}
+	if (stain_views) {
+		sb_raw_count(stain_views) = 0;
+	}
+	current_stain_view = 0;
+	if (channel_views) {
+		sb_raw_count(channel_views) = 0;
+	}
+	current_channel_view = 0;
+	if (overlay_views) {
+		sb_raw_count(overlay_views) = 0;
+	}
+	current_overlay_view = 0;
+}
+
+void set_tile_stain_view(float unmixing[3], float stain_vector[3]) {
+	stain_view_t view = { .unmixing = { unmixing[0], unmixing[1], unmixing[2] },
+	                      .stain_vector = { stain_vector[0], stain_vector[1], stain_vector[2] } };
+	sb_push(stain_views, view);
+	current_stain_view = sb_count(stain_views);
+}
+
+void clear_tile_stain_view() {
+	current_stain_view = 0;
+}
+
+void set_tile_channel_view(float color[3], float gain, float offset) {
+	channel_view_t view = { .color = { color[0], color[1], color[2] }, .gain = gain, .offset = offset };
+	sb_push(channel_views, view);
+	current_channel_view = sb_count(channel_views);
+}
+
+void clear_tile_channel_view() {
+	current_channel_view = 0;
+}
+
+void set_tile_overlay_view(i32 colormap, float opacity) {
+	overlay_view_t view = { .colormap = colormap, .opacity = opacity };
+	sb_push(overlay_views, view);
+	current_overlay_view = sb_count(overlay_views);
+}
+
+void clear_tile_overlay_view() {
+	current_overlay_view = 0;
+}
+
+// Tiles with a lower depth are drawn on top. The position is in screen coordinates; the tile is cut off at the
+// edges of the clip rect (the viewport of its scene), so that the tiles of all scenes can be drawn together.
+// Tiles smaller than TILE_DIM only fill the top-left part of their texture: texture_fill_x/y is the filled fraction.
+// The tiles at the right and bottom edges of a level can extend beyond the image: valid_fill_x/y is the fraction of the
+// tile that lies within it. The rest is clipped in tile.frag (anti-aliased), so the pixels outside of the image don't
+// need to be cleared.
+// Translucent tiles (alpha < 1) are blended over the tiles behind them, except for the tiles of channels (which are
+// added together instead) and overlays (which are blended over the image): the levels of these are drawn opaque.
+void push_tile_instance(u32 texture_slot, float x, float y, float width, float height, float depth, float alpha,
+                        rect2i clip, float texture_fill_x, float texture_fill_y, float valid_fill_x, float valid_fill_y) {
+	ASSERT(texture_slot != 0);
+	float x1 = ATLEAST(x, (float)clip.x);
+	float y1 = ATLEAST(y, (float)clip.y);
+	float x2 = ATMOST(x + width, (float)(clip.x + clip.w));
+	float y2 = ATMOST(y + height, (float)(clip.y + clip.h));
+	if (x1 >= x2 || y1 >= y2 || width <= 0.0f || height <= 0.0f) {
+		return; // outside the viewport
+	}
+	if (x1 >= x + width * valid_fill_x || y1 >= y + height * valid_fill_y) {
+		return; // only the part outside of the image is in view
+	}
+	tile_instance_t instance = { .texture_slot = texture_slot, .x = x1, .y = y1, .width = x2 - x1, .height = y2 - y1,
+	                             .depth = depth, .alpha = (current_channel_view != 0 || current_overlay_view != 0) ? 1.0f : alpha,
+	                             .stain_view = current_stain_view, .channel_view = current_channel_view,
+	                             .overlay_view = current_overlay_view };
+	i32 quadrant = get_tile_texture_quadrant(texture_slot);
+	float offset_x = (quadrant >= 0) ? (float)(quadrant & 1) * 0.5f : 0.0f;
+	float offset_y = (quadrant >= 0) ? (float)(quadrant >> 1) * 0.5f : 0.0f;
+	instance.tex_rect = (v4f){ offset_x + (x1 - x) / width * texture_fill_x, offset_y + (y1 - y) / height * texture_fill_y,
+	                           (x2 - x1) / width * texture_fill_x, (y2 - y1) / height * texture_fill_y };
+	instance.valid_max = (v2f){ offset_x + valid_fill_x * texture_fill_x, offset_y + valid_fill_y * texture_fill_y };
+	sb_push(tile_instances, instance);
+}
+
+// Uniform tiles (see is_tile_uniform()) don't have a texture: they are drawn as a quad of a single color (BGRA).
+// These are clipped to the image in the same way (valid_fill_x/y, see push_tile_instance()).
+void push_flat_tile_instance(u32 color, float x, float y, float width, float height, float depth, float alpha,
+                             rect2i clip, float valid_fill_x, float valid_fill_y) {
+	float x1 = ATLEAST(x, (float)clip.x);
+	float y1 = ATLEAST(y, (float)clip.y);
+	float x2 = ATMOST(x + width, (float)(clip.x + clip.w));
+	float y2 = ATMOST(y + height, (float)(clip.y + clip.h));
+	if (x1 >= x2 || y1 >= y2 || width <= 0.0f || height <= 0.0f) {
+		return; // outside the viewport
+	}
+	float valid_x2 = x + width * valid_fill_x;
+	float valid_y2 = y + height * valid_fill_y;
+	if (x1 >= valid_x2 || y1 >= valid_y2) {
+		return; // only the part outside of the image is in view
+	}
+	tile_instance_t instance = { .texture_slot = 0, .color = color, .x = x1, .y = y1, .width = x2 - x1,
+	                             .height = y2 - y1, .depth = depth, .alpha = (current_channel_view != 0 || current_overlay_view != 0) ? 1.0f : alpha,
+	                             .stain_view = current_stain_view, .channel_view = current_channel_view,
+	                             .overlay_view = current_overlay_view };
+	// (flat tiles have the texture coordinates of the drawn quad, 0 to 1, see tile.vert)
+	instance.valid_max = (v2f){ (valid_x2 - x1) / (x2 - x1), (valid_y2 - y1) / (y2 - y1) };
+	sb_push(tile_instances, instance);
+}
+
+// Flat tiles don't sample from a texture, so they can go along with the tiles of any texture array; they are sorted
+// in front of the tiles of the first one.
+static inline u32 get_tile_instance_array_index(tile_instance_t* instance) {
+	return (instance->texture_slot == 0) ? 0 : (get_tile_texture_layer_slot(instance->texture_slot) - 1) / TILE_TEXTURE_ARRAY_LAYERS;
+}
+
+// Sort front to back (so that the depth test can reject hidden fragments early), then by stain view and texture array.
+// Translucent tiles go last: they need to be blended over whatever is behind them. The channels of fluorescence images
+// come after all other tiles, one channel after the other (see draw_tile_instances()), and the overlays after that.
+int tile_instance_cmp_func(const void* a, const void* b) {
+	tile_instance_t* instance_a = (tile_instance_t*)a;
+	tile_instance_t* instance_b = (tile_instance_t*)b;
+	if (instance_a->overlay_view != instance_b->overlay_view) {
+		return (instance_a->overlay_view > instance_b->overlay_view) ? 1 : -1;
+	}
+	if (instance_a->channel_view != instance_b->channel_view) {
+		return (instance_a->channel_view > instance_b->channel_view) ? 1 : -1;
+	}
+	bool32 is_translucent_a = (instance_a->alpha < 1.0f);
+	bool32 is_translucent_b = (instance_b->alpha < 1.0f);
+	if (is_translucent_a != is_translucent_b) {
+		return is_translucent_a ? 1 : -1;
+	}
+	if (instance_a->depth != instance_b->depth) {
+		return (instance_a->depth > instance_b->depth) ? 1 : -1;
+	}
+	if (instance_a->stain_view != instance_b->stain_view) {
+		return (instance_a->stain_view > instance_b->stain_view) ? 1 : -1;
+	}
+	u32 slot_a = get_tile_texture_layer_slot(instance_a->texture_slot);
+	u32 slot_b = get_tile_texture_layer_slot(instance_b->texture_slot);
+	return (slot_a > slot_b) - (slot_a < slot_b);
+}
+
+// Note: expects the tile shader to be in use. Returns the number of draw calls issued.
+i32 draw_tile_instances() {
+	i32 instance_count = sb_count(tile_instances);
+	if (instance_count == 0) {
+		return 0;
+	}
+	qsort(tile_instances, instance_count, sizeof(tile_instance_t), tile_instance_cmp_func);
+
+	glBindVertexArray(vao_tile_instances);
+	glBindBufferBase(GL_UNIFORM_BUFFER, 0, ubo_tile_instances);
+
+	i32 draw_call_count = 0;
+	bool32 is_blending = false;
+	i32 drawn_channel_view = 0;
+	i32 drawn_overlay_view = 0;
+	i32 i = 0;
+	while (i < instance_count) {
+		u32 array_index = get_tile_instance_array_index(tile_instances + i);
+		float depth = tile_instances[i].depth;
+		float alpha = tile_instances[i].alpha;
+		i32 stain_view = tile_instances[i].stain_view;
+		i32 channel_view = tile_instances[i].channel_view;
+		i32 overlay_view = tile_instances[i].overlay_view;
+		if (alpha < 1.0f && !is_blending) {
+			glEnable(GL_BLEND);
+			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			is_blending = true;
+		}
+		if (overlay_view != drawn_overlay_view) {
+			// The same goes for each overlay, which is blended over what has been drawn so far (the overlays come last,
+			// so their tiles are never of a channel).
+			glClear(GL_DEPTH_BUFFER_BIT);
+			if (!is_blending) {
+				glEnable(GL_BLEND);
+				is_blending = true;
+			}
+			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			drawn_overlay_view = overlay_view;
+			drawn_channel_view = channel_view;
+		} else if (channel_view != drawn_channel_view) {
+			// Each channel is a pass of its own: within the channel, the finer levels hide the coarser ones through
+			// the depth test as usual, but the channel is added to the channels drawn before it.
+			glClear(GL_DEPTH_BUFFER_BIT);
+			if (!is_blending) {
+				glEnable(GL_BLEND);
+				is_blending = true;
+			}
+			glBlendFunc(GL_ONE, GL_ONE);
+			drawn_channel_view = channel_view;
+		}
+		i32 batch_count = 0;
+		while (i < instance_count && batch_count < MAX_TILE_INSTANCES_PER_DRAW) {
+			tile_instance_t* instance = tile_instances + i;
+			if (get_tile_instance_array_index(instance) != array_index || instance->depth != depth ||
+			    instance->alpha != alpha || instance->stain_view != stain_view || instance->channel_view != channel_view ||
+			    instance->overlay_view != overlay_view) {
+				break;
+			}
+			tile_instance_block.rects[batch_count] = (v4f){ instance->x, instance->y, instance->width, instance->height };
+			if (instance->texture_slot == 0) {
+				// For flat tiles, the color is passed instead of the texture rect.
+				u32 c = instance->color;
+				tile_instance_block.params[batch_count] = (v4f){ 0.0f, instance->depth, 1.0f, instance->alpha };
+				tile_instance_block.tex_rects[batch_count] = (v4f){ ((c >> 16) & 0xFF) / 255.0f, ((c >> 8) & 0xFF) / 255.0f,
+				                                                    (c & 0xFF) / 255.0f, ((c >> 24) & 0xFF) / 255.0f };
+			} else {
+				i32 layer = (get_tile_texture_layer_slot(instance->texture_slot) - 1) % TILE_TEXTURE_ARRAY_LAYERS;
+				tile_instance_block.params[batch_count] = (v4f){ (float)layer, instance->depth, 0.0f, instance->alpha };
+				tile_instance_block.tex_rects[batch_count] = instance->tex_rect;
+			}
+			tile_instance_block.valid_maxes[batch_count] = (v4f){ instance->valid_max.x, instance->valid_max.y, 0.0f, 0.0f };
+			++batch_count;
+			++i;
+		}
+		glUniform1i(tile_shader_u_show_single_stain, stain_view != 0);
+		if (stain_view != 0) {
+			stain_view_t* view = stain_views + (stain_view - 1);
+			glUniform3fv(tile_shader_u_stain_unmixing, 1, (GLfloat*) &view->unmixing);
+			glUniform3fv(tile_shader_u_stain_vector, 1, (GLfloat*) &view->stain_vector);
+		}
+		glUniform1i(tile_shader_u_is_channel, channel_view != 0);
+		if (channel_view != 0) {
+			channel_view_t* view = channel_views + (channel_view - 1);
+			glUniform3fv(tile_shader_u_channel_color, 1, (GLfloat*) &view->color);
+			glUniform1f(tile_shader_u_channel_gain, view->gain);
+			glUniform1f(tile_shader_u_channel_offset, view->offset);
+		}
+		glUniform1i(tile_shader_u_is_overlay, overlay_view != 0);
+		if (overlay_view != 0) {
+			overlay_view_t* view = overlay_views + (overlay_view - 1);
+			glUniform1i(tile_shader_u_overlay_colormap, view->colormap);
+			glUniform1f(tile_shader_u_overlay_opacity, view->opacity);
+		}
+		glUniform1i(tile_shader_u_is_planar, tile_texture_pool.texture_array_formats[array_index] == TILE_TEXTURE_FORMAT_YCBCR420);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, tile_texture_pool.texture_arrays[array_index]);
+		glBindBuffer(GL_UNIFORM_BUFFER, ubo_tile_instances);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(tile_instance_block_t), NULL, GL_STREAM_DRAW); // orphan the old storage
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(tile_instance_block.rects[0]) * batch_count, tile_instance_block.rects);
+		glBufferSubData(GL_UNIFORM_BUFFER, sizeof(tile_instance_block.rects),
+		                sizeof(tile_instance_block.params[0]) * batch_count, tile_instance_block.params);
+		glBufferSubData(GL_UNIFORM_BUFFER, sizeof(tile_instance_block.rects) + sizeof(tile_instance_block.params),
+		                sizeof(tile_instance_block.tex_rects[0]) * batch_count, tile_instance_block.tex_rects);
+		glBufferSubData(GL_UNIFORM_BUFFER, sizeof(tile_instance_block.rects) + sizeof(tile_instance_block.params) +
+		                sizeof(tile_instance_block.tex_rects),
+		                sizeof(tile_instance_block.valid_maxes[0]) * batch_count, tile_instance_block.valid_maxes);
+		glDrawElementsInstanced(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0, batch_count);
+		++draw_call_count;
+	}
+	if (is_blending) {
+		glDisable(GL_BLEND);
+	}
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	return draw_call_count;
+}
+
+// Auto-levels (see update_auto_levels() in viewer.c) get a luminance histogram of the visible tiles, which is counted
+// on the GPU from the tile textures that are already there: only the histogram itself is read back, once the GPU is
+// done with it (through a fence, so that the main thread never waits). The histogram is updated incrementally: as long
+// as tiles are only added to the view (e.g. while they are still arriving), only the new tiles are counted; once a
+// tile goes out of view (or the visible part of it changes), the histogram is counted again from the start.
+#if defined(GL_VERSION_4_3)
+#define TILE_HISTOGRAM_SUPPORTED 1
+#else
+#define TILE_HISTOGRAM_SUPPORTED 0
+#endif
+
+#if TILE_HISTOGRAM_SUPPORTED
+
+// A tile as counted in the histogram
+typedef struct histogram_key_t {
+	u32 texture_slot;
+	v4f tex_rect;
+} histogram_key_t;
+
+// Memory layout of the tiles in tile_histogram.comp (std430)
+typedef struct histogram_tile_t {
+	v4f tex_rect;
+	v4f layer;
+} histogram_tile_t;
+
+typedef struct tile_histogram_t {
+	u32 program;
+	i32 u_texture;
+	i32 u_is_planar;
+	i32 u_first_tile;
+	u32 tile_buffer;
+	u32 histogram_buffer;
+	histogram_key_t* counted_keys; // sb, sorted (see histogram_key_cmp_func())
+	histogram_key_t* visible_keys; // sb, rebuilt on every update
+	histogram_tile_t* tiles; // sb, the tiles to be counted in the next dispatch
+	bool32 needs_clear;
+	GLsync fence; // set after a dispatch, until the histogram is read back
+} tile_histogram_t;
+
+static tile_histogram_t tile_histogram;
+
+// Should be called once the OpenGL context exists.
+static void init_tile_histogram() {
+	tile_histogram_t* histogram = &tile_histogram;
+	if (!GLAD_GL_VERSION_4_3) {
+		return;
+	}
+	u32 program = load_compute_shader_program("shaders/tile_histogram.comp");
+	if (program) {
+		histogram->u_texture = get_uniform(program, "the_texture");
+		histogram->u_is_planar = get_uniform(program, "is_planar");
+		histogram->u_first_tile = get_uniform(program, "first_tile");
+		glGenBuffers(1, &histogram->tile_buffer);
+		glGenBuffers(1, &histogram->histogram_buffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, histogram->histogram_buffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, TILE_HISTOGRAM_BINS * sizeof(u32), NULL, GL_DYNAMIC_READ);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		histogram->needs_clear = true;
+		histogram->program = program;
+	}
+}
+
+bool32 is_visible_tile_histogram_available() {
+	return tile_histogram.program != 0;
+}
+
+// Sorted by texture array first, so that the tiles of each texture array can be counted in one dispatch.
+static int histogram_key_cmp_func(const void* a, const void* b) {
+	histogram_key_t* key_a = (histogram_key_t*)a;
+	histogram_key_t* key_b = (histogram_key_t*)b;
+	u32 layer_slot_a = get_tile_texture_layer_slot(key_a->texture_slot);
+	u32 layer_slot_b = get_tile_texture_layer_slot(key_b->texture_slot);
+	if (layer_slot_a != layer_slot_b) {
+		return (layer_slot_a > layer_slot_b) ? 1 : -1;
+	}
+	if (key_a->texture_slot != key_b->texture_slot) {
+		return (key_a->texture_slot > key_b->texture_slot) ? 1 : -1;
+	}
+	return memcmp(&key_a->tex_rect, &key_b->tex_rect, sizeof(v4f));
+}
+
+// The next update counts all visible tiles again. Should be called whenever the histogram is not kept up to date,
+// because texture slots may be reused for other tiles in the meantime.
+void reset_visible_tile_histogram() {
+	tile_histogram_t* histogram = &tile_histogram;
+	if (histogram->counted_keys) {
+		sb_raw_count(histogram->counted_keys) = 0;
+	}
+	histogram->needs_clear = true;
+}
+
+// Counts the visible tiles that are not yet in the histogram, from the tile instances of this frame (so it needs to be
+// called after they are pushed). Tiles of channels and overlays, and flat tiles, are not counted.
+void update_visible_tile_histogram() {
+	tile_histogram_t* histogram = &tile_histogram;
+	if (!histogram->program || histogram->fence) {
+		return; // (the histogram is only updated again once the last update has been read back)
+	}
+	if (histogram->visible_keys) {
+		sb_raw_count(histogram->visible_keys) = 0;
+	}
+	for (i32 i = 0; i < sb_count(tile_instances); ++i) {
+		tile_instance_t* instance = tile_instances + i;
+		if (instance->texture_slot == 0 || instance->channel_view != 0 || instance->overlay_view != 0 ||
+		    get_tile_texture_slot_format(instance->texture_slot) == TILE_TEXTURE_FORMAT_R8) {
+			continue;
+		}
+		// (only count the part within the image: the rest of an edge tile is not drawn)
+		v4f tex_rect = instance->tex_rect;
+		tex_rect.z = ATMOST(tex_rect.z, instance->valid_max.x - tex_rect.x);
+		tex_rect.w = ATMOST(tex_rect.w, instance->valid_max.y - tex_rect.y);
+		histogram_key_t key = { .texture_slot = instance->texture_slot, .tex_rect = tex_rect };
+		sb_push(histogram->visible_keys, key);
+	}
+	i32 visible_count = sb_count(histogram->visible_keys);
+	if (visible_count > 0) {
+		qsort(histogram->visible_keys, visible_count, sizeof(histogram_key_t), histogram_key_cmp_func);
+	}
+
+	// Still counted from the start if any of the tiles in the histogram is no longer visible
+	i32 counted_count = sb_count(histogram->counted_keys);
+	i32 visible_index = 0;
+	for (i32 i = 0; i < counted_count && !histogram->needs_clear; ++i) {
+		int cmp = 1;
+		while (visible_index < visible_count &&
+		       (cmp = histogram_key_cmp_func(histogram->visible_keys + visible_index, histogram->counted_keys + i)) < 0) {
+			++visible_index;
+		}
+		if (visible_index >= visible_count || cmp != 0) {
+			histogram->needs_clear = true;
+		}
+	}
+	if (histogram->needs_clear) {
+		if (histogram->counted_keys) {
+			sb_raw_count(histogram->counted_keys) = 0;
+		}
+		counted_count = 0;
+	}
+
+	// The visible tiles that are not counted yet
+	if (histogram->tiles) {
+		sb_raw_count(histogram->tiles) = 0;
+	}
+	i32 counted_index = 0;
+	for (i32 i = 0; i < visible_count; ++i) {
+		histogram_key_t* key = histogram->visible_keys + i;
+		if (i > 0 && histogram_key_cmp_func(key, key - 1) == 0) {
+			continue; // (the same tile drawn twice)
+		}
+		int cmp = 1;
+		while (counted_index < counted_count &&
+		       (cmp = histogram_key_cmp_func(histogram->counted_keys + counted_index, key)) < 0) {
+			++counted_index;
+		}
+		if (counted_index < counted_count && cmp == 0) {
+			continue;
+		}
+		u32 layer_slot = get_tile_texture_layer_slot(key->texture_slot);
+		i32 layer = (layer_slot - 1) % TILE_TEXTURE_ARRAY_LAYERS;
+		u32 array_index = (layer_slot - 1) / TILE_TEXTURE_ARRAY_LAYERS;
+		// (the texture array goes along in y, for the dispatches below; the shader doesn't use it)
+		histogram_tile_t tile = { .tex_rect = key->tex_rect, .layer = { (float)layer, (float)array_index } };
+		sb_push(histogram->tiles, tile);
+		sb_push(histogram->counted_keys, *key);
+	}
+	i32 tile_count = sb_count(histogram->tiles);
+	if (tile_count == 0 && !histogram->needs_clear) {
+		return;
+	}
+	if (tile_count > 0 && counted_count > 0) {
+		qsort(histogram->counted_keys, sb_count(histogram->counted_keys), sizeof(histogram_key_t), histogram_key_cmp_func);
+	}
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, histogram->histogram_buffer);
+	if (histogram->needs_clear) {
+		glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+		histogram->needs_clear = false;
+	}
+	if (tile_count > 0) {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, histogram->tile_buffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, tile_count * sizeof(histogram_tile_t), histogram->tiles, GL_STREAM_DRAW);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, histogram->tile_buffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, histogram->histogram_buffer);
+		glUseProgram(histogram->program);
+		glActiveTexture(GL_TEXTURE0);
+		glUniform1i(histogram->u_texture, 0);
+		// One dispatch per texture array (the new tiles are in the order of the sorted keys)
+		i32 first_tile = 0;
+		while (first_tile < tile_count) {
+			u32 array_index = (u32)histogram->tiles[first_tile].layer.y;
+			i32 end_tile = first_tile + 1;
+			while (end_tile < tile_count && (u32)histogram->tiles[end_tile].layer.y == array_index) {
+				++end_tile;
+			}
+			glUniform1i(histogram->u_is_planar, tile_texture_pool.texture_array_formats[array_index] == TILE_TEXTURE_FORMAT_YCBCR420);
+			glUniform1i(histogram->u_first_tile, first_tile);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, tile_texture_pool.texture_arrays[array_index]);
+			glDispatchCompute(end_tile - first_tile, 1, 1);
+			first_tile = end_tile;
+		}
+		glUseProgram(0);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT); // (before the histogram is read back)
+	histogram->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Copies the histogram into bins (TILE_HISTOGRAM_BINS of them) once the GPU is done with the last update; returns false
+// (without waiting) if there is no new histogram yet.
+bool32 read_visible_tile_histogram(u32* bins) {
+	tile_histogram_t* histogram = &tile_histogram;
+	if (!histogram->fence) {
+		return false;
+	}
+	GLenum status = glClientWaitSync(histogram->fence, 0, 0);
+	if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+		return false;
+	}
+	glDeleteSync(histogram->fence);
+	histogram->fence = 0;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, histogram->histogram_buffer);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, TILE_HISTOGRAM_BINS * sizeof(u32), bins);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	return true;
+}
+
+#else
+
+static void init_tile_histogram() {}
+
+bool32 is_visible_tile_histogram_available() {
+	return false;
+}
+
+void reset_visible_tile_histogram() {}
+
+void update_visible_tile_histogram() {}
+
+bool32 read_visible_tile_histogram(u32* bins) {
+	return false;
+}
+
+#endif //TILE_HISTOGRAM_SUPPORTED
+
+// The color pipeline (see color_pipeline.h), baked into a 3D texture that the shaders sample on texture unit 1.
+// It is only rebuilt when the adjustments or the display profile change; the version tells the tile layer when its
+// contents need to be redrawn.
+typedef struct color_lut_t {
+	u32 texture;
+	u16* pixels; // COLOR_LUT_DIM^3 RGBA
+	bool32 is_built;
+	color_adjustments_t adjustments;
+	display_profile_t* display_profile;
+	i32 display_profile_generation;
+	i64 version;
+} color_lut_t;
+
+static color_lut_t color_lut;
+
+// Passing NULL for the display profile means no color correction for the display.
+void update_color_lut(color_adjustments_t* adjustments, display_profile_t* display_profile) {
+	color_lut_t* lut = &color_lut;
+	if (display_profile && !display_profile->is_valid) {
+		display_profile = NULL;
+	}
+	i32 display_profile_generation = display_profile ? display_profile->generation : 0;
+	if (lut->is_built && memcmp(&lut->adjustments, adjustments, sizeof(color_adjustments_t)) == 0 &&
+	    lut->display_profile == display_profile && lut->display_profile_generation == display_profile_generation) {
+		return;
+	}
+	if (!lut->texture) {
+		glGenTextures(1, &lut->texture);
+		lut->pixels = (u16*) malloc(COLOR_LUT_DIM * COLOR_LUT_DIM * COLOR_LUT_DIM * 4 * sizeof(u16));
+	}
+	build_color_lut(lut->pixels, COLOR_LUT_DIM, adjustments, display_profile);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_3D, lut->texture);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA16, COLOR_LUT_DIM, COLOR_LUT_DIM, COLOR_LUT_DIM, 0, GL_RGBA,
+	             GL_UNSIGNED_SHORT, lut->pixels);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAX_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glActiveTexture(GL_TEXTURE0);
+	lut->adjustments = *adjustments;
+	lut->display_profile = display_profile;
+	lut->display_profile_generation = display_profile_generation;
+	lut->is_built = true;
+	++lut->version;
+}
+
+// Binds the color lookup table for the shader that is in use (which samples it through the given uniform).
+void bind_color_lut(i32 color_lut_uniform) {
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_3D, color_lut.texture);
+	glActiveTexture(GL_TEXTURE0);
+	glUniform1i(color_lut_uniform, 1);
+}
+
+
+// The tiles are drawn into an offscreen framebuffer (the tile layer), which is then copied to the screen. If a frame
+// pushes exactly the same tile instances as the frame before, with the same shader parameters, and no tile textures
+// have been uploaded in between (e.g. the camera is standing still while only the GUI repaints), the tile layer is
+// still up to date: only the copy is left to do.
+typedef struct tile_layer_t {
+	u32 fbo;
+	u32 color_texture; // GL_TEXTURE_2D_ARRAY with a single layer, so that it can be drawn with draw_rect()
+	u32 depth_renderbuffer;
+	i32 width;
+	i32 height;
+	bool32 is_complete; // the framebuffer can be used
+	bool32 is_valid; // the contents match the fields below
+	tile_instance_t* instances; // sb
+	stain_view_t* stain_views; // sb
+	channel_view_t* channel_views; // sb
+	overlay_view_t* overlay_views; // sb
+	v3f background_color;
+	i64 color_lut_version;
+	i64 upload_count;
+} tile_layer_t;
+
+static tile_layer_t tile_layer;
+
+static void resize_tile_layer(i32 width, i32 height) {
+	tile_layer_t* layer = &tile_layer;
+	if (!layer->fbo) {
+		glGenFramebuffers(1, &layer->fbo);
+		glGenTextures(1, &layer->color_texture);
+		glGenRenderbuffers(1, &layer->depth_renderbuffer);
+	}
+	glBindTexture(GL_TEXTURE_2D_ARRAY, layer->color_texture);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, width, height, 1, 0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindRenderbuffer(GL_RENDERBUFFER, layer->depth_renderbuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, layer->fbo);
+	glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, layer->color_texture, 0, 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, layer->depth_renderbuffer);
+	layer->is_complete = (glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+	if (!layer->is_complete) {
+		printf("Warning: the tile layer framebuffer is incomplete, tiles are drawn directly\n");
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	layer->width = width;
+	layer->height = height;
+	layer->is_valid = false;
+}
+
+static void copy_tile_layer_to_screen() {
+	tile_layer_t* layer = &tile_layer;
+	mat4x4 projection = {};
+	mat4x4_ortho(projection, 0.0f, (float)layer->width, (float)layer->height, 0.0f, 100.0f, -100.0f);
+	// The first row of the framebuffer is at the bottom, so the rect is flipped vertically.
+	mat4x4 model_matrix;
+	mat4x4_identity(model_matrix);
+	mat4x4_translate(model_matrix, 0.0f, (float)layer->height, 0.0f);
+	mat4x4_scale_aniso(model_matrix, model_matrix, (float)layer->width, -(float)layer->height, 1.0f);
+	glUseProgram(basic_shader);
+	glUniformMatrix4fv(basic_shader_u_projection_view_matrix, 1, GL_FALSE, &projection[0][0]);
+	glUniformMatrix4fv(basic_shader_u_model_matrix, 1, GL_FALSE, &model_matrix[0][0]);
+	glUniform1i(basic_shader_u_tex, 0);
+	glUniform1i(basic_shader_u_apply_color_lut, 0); // already applied while drawing the tiles
+	glUniform1i(basic_shader_u_show_single_stain, 0);
+	glUniform3fv(basic_shader_u_background_color, 1, (GLfloat*) &layer->background_color);
+	glDisable(GL_DEPTH_TEST);
+	draw_rect(layer->color_texture);
+	glEnable(GL_DEPTH_TEST);
+}
+
+// Draws the pushed tile instances (see draw_tile_instances()) through the tile layer. Expects the tile shader to be in
+// use, with the projection set up for the whole client area, and the color lookup table to be up to date (see
+// update_color_lut()); sets the other uniforms of the tile shader itself.
+// Returns the number of draw calls issued for the tiles (0 if the tile layer could be reused).
+i32 draw_tile_layer(i32 width, i32 height, v3f background_color) {
+	tile_layer_t* layer = &tile_layer;
+	glUniform3fv(tile_shader_u_background_color, 1, (GLfloat*) &background_color);
+	bind_color_lut(tile_shader_u_color_lut);
+	if (width <= 0 || height <= 0) {
+		return 0;
+	}
+	if (width != layer->width || height != layer->height) {
+		resize_tile_layer(width, height);
+	}
+	if (!layer->is_complete) {
+		return draw_tile_instances();
+	}
+
+	i32 instance_count = sb_count(tile_instances);
+	bool32 is_unchanged = layer->is_valid && layer->upload_count == tile_texture_pool.upload_count &&
+	                      layer->color_lut_version == color_lut.version &&
+	                      memcmp(&layer->background_color, &background_color, sizeof(v3f)) == 0 &&
+	                      sb_count(layer->instances) == instance_count &&
+	                      (instance_count == 0 ||
+	                       memcmp(layer->instances, tile_instances, instance_count * sizeof(tile_instance_t)) == 0) &&
+	                      sb_count(layer->stain_views) == sb_count(stain_views) &&
+	                      (sb_count(stain_views) == 0 ||
+	                       memcmp(layer->stain_views, stain_views, sb_count(stain_views) * sizeof(stain_view_t)) == 0) &&
+	                      sb_count(layer->channel_views) == sb_count(channel_views) &&
+	                      (sb_count(channel_views) == 0 ||
+	                       memcmp(layer->channel_views, channel_views, sb_count(channel_views) * sizeof(channel_view_t)) == 0) &&
+	                      sb_count(layer->overlay_views) == sb_count(overlay_views) &&
+	                      (sb_count(overlay_views) == 0 ||
+	                       memcmp(layer->overlay_views, overlay_views, sb_count(overlay_views) * sizeof(overlay_view_t)) == 0);
+	i32 draw_call_count = 0;
+	if (!is_unchanged) {
+		// (the instances are compared in the order in which they were pushed, before draw_tile_instances() sorts them)
+		if (layer->instances) {
+			sb_raw_count(layer->instances) = 0;
+		}
+		if (instance_count > 0) {
+			memcpy(sb_add(layer->instances, instance_count), tile_instances, instance_count * sizeof(tile_instance_t));
+		}
+		if (layer->stain_views) {
+			sb_raw_count(layer->stain_views) = 0;
+		}
+		if (sb_count(stain_views) > 0) {
+			memcpy(sb_add(layer->stain_views, sb_count(stain_views)), stain_views, sb_count(stain_views) * sizeof(stain_view_t));
+		}
+		if (layer->channel_views) {
+			sb_raw_count(layer->channel_views) = 0;
+		}
+		if (sb_count(channel_views) > 0) {
+			memcpy(sb_add(layer->channel_views, sb_count(channel_views)), channel_views,
+			       sb_count(channel_views) * sizeof(channel_view_t));
+		}
+		if (layer->overlay_views) {
+			sb_raw_count(layer->overlay_views) = 0;
+		}
+		if (sb_count(overlay_views) > 0) {
+			memcpy(sb_add(layer->overlay_views, sb_count(overlay_views)), overlay_views,
+			       sb_count(overlay_views) * sizeof(overlay_view_t));
+		}
+		layer->upload_count = tile_texture_pool.upload_count;
+		layer->background_color = background_color;
+		layer->color_lut_version = color_lut.version;
+		layer->is_valid = true;
+
+		glBindFramebuffer(GL_FRAMEBUFFER, layer->fbo);
+		glClearColor(background_color.r, background_color.g, background_color.b, 1.0f);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		draw_call_count = draw_tile_instances();
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+	copy_tile_layer_to_screen();
+	return draw_call_count;
+}
+
+// Annotation outlines are drawn from geometry that stays on the GPU: the segments of all annotations (in world
+// coordinates) are uploaded once, and only need to be uploaded again if the annotations are edited. The camera
+// transform and the line thickness are applied in annotation.vert.
+// The segments are stored in texture buffers and indexed by gl_VertexID (6 vertices per segment), because instanced
+// vertex attributes are not available in OpenGL 3.1.
+
+#define VERTICES_PER_ANNOTATION_SEGMENT 6
+
+typedef struct annotation_geometry_t {
+	u32 vao; // empty, but a vertex array needs to be bound for drawing
+	u32 segment_buffer;
+	u32 segment_texture;
+	u32 segment_annotation_buffer;
+	u32 segment_annotation_texture;
+	u32 attribute_buffer;
+	u32 attribute_texture;
+	i32 segment_count;
+	i32 max_texture_buffer_size;
+	GLint* draw_firsts; // sb
+	GLsizei* draw_counts; // sb
+} annotation_geometry_t;
+
+static annotation_geometry_t annotation_geometry;
+
+u32 annotation_shader;
+i32 annotation_shader_u_segments;
+i32 annotation_shader_u_segment_annotations;
+i32 annotation_shader_u_annotation_attributes;
+i32 annotation_shader_u_camera_min;
+i32 annotation_shader_u_um_per_pixel;
+i32 annotation_shader_u_viewport_offset;
+i32 annotation_shader_u_screen_size;
+i32 annotation_shader_u_thickness;
+
+static void create_texture_buffer(u32* buffer, u32* texture, u32 internal_format) {
+	glGenBuffers(1, buffer);
+	glGenTextures(1, texture);
+	glBindBuffer(GL_TEXTURE_BUFFER, *buffer);
+	glBindTexture(GL_TEXTURE_BUFFER, *texture);
+	glTexBuffer(GL_TEXTURE_BUFFER, internal_format, *buffer);
+}
+
+void init_annotation_geometry() {
+	annotation_geometry_t* geometry = &annotation_geometry;
+	glGenVertexArrays(1, &geometry->vao);
+	create_texture_buffer(&geometry->segment_buffer, &geometry->segment_texture, GL_RGBA32F);
+	create_texture_buffer(&geometry->segment_annotation_buffer, &geometry->segment_annotation_texture, GL_R32I);
+	create_texture_buffer(&geometry->attribute_buffer, &geometry->attribute_texture, GL_RGBA8);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &geometry->max_texture_buffer_size);
+}
+
+// Segments are (x0, y0, x1, y1) in world coordinates; annotation_indices refer to the attributes of the segments.
+// Returns false if there are more segments than fit in a texture buffer (the caller then needs to draw some other way).
+bool32 upload_annotation_segments(v4f* segments, i32* annotation_indices, i32 segment_count) {
+	annotation_geometry_t* geometry = &annotation_geometry;
+	if (segment_count > geometry->max_texture_buffer_size) {
+		geometry->segment_count = 0;
+		return false;
+	}
+	glBindBuffer(GL_TEXTURE_BUFFER, geometry->segment_buffer);
+	glBufferData(GL_TEXTURE_BUFFER, segment_count * sizeof(v4f), segments, GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, geometry->segment_annotation_buffer);
+	glBufferData(GL_TEXTURE_BUFFER, segment_count * sizeof(i32), annotation_indices, GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	geometry->segment_count = segment_count;
+	return true;
+}
+
+// The attributes of an annotation are its color (RGB) and whether it is selected (alpha = 255).
+void upload_annotation_attributes(rgba_t* attributes, i32 annotation_count) {
+	annotation_geometry_t* geometry = &annotation_geometry;
+	glBindBuffer(GL_TEXTURE_BUFFER, geometry->attribute_buffer);
+	glBufferData(GL_TEXTURE_BUFFER, annotation_count * sizeof(rgba_t), attributes, GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+// Draws ranges of the uploaded segments (usually those of the annotations in view), in a single draw call.
+// The outlines are cut off at the edges of the viewport (both in screen coordinates, the y-axis pointing down).
+void draw_annotation_segments(i32* first_segments, i32* segment_counts, i32 range_count, v2f camera_min,
+                              float um_per_pixel, float thickness, rect2i viewport, rect2i client_viewport) {
+	annotation_geometry_t* geometry = &annotation_geometry;
+	if (range_count == 0 || geometry->segment_count == 0) {
+		return;
+	}
+	if (geometry->draw_firsts) sb_raw_count(geometry->draw_firsts) = 0;
+	if (geometry->draw_counts) sb_raw_count(geometry->draw_counts) = 0;
+	for (i32 i = 0; i < range_count; ++i) {
+		ASSERT(first_segments[i] + segment_counts[i] <= geometry->segment_count);
+		sb_push(geometry->draw_firsts, first_segments[i] * VERTICES_PER_ANNOTATION_SEGMENT);
+		sb_push(geometry->draw_counts, segment_counts[i] * VERTICES_PER_ANNOTATION_SEGMENT);
+	}
+
+	glUseProgram(annotation_shader);
+	glUniform2f(annotation_shader_u_camera_min, camera_min.x, camera_min.y);
+	glUniform1f(annotation_shader_u_um_per_pixel, um_per_pixel);
+	glUniform2f(annotation_shader_u_viewport_offset, (float)viewport.x, (float)viewport.y);
+	glUniform2f(annotation_shader_u_screen_size, (float)client_viewport.w, (float)client_viewport.h);
+	glUniform1f(annotation_shader_u_thickness, thickness);
+
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_BUFFER, geometry->segment_texture);
+	glUniform1i(annotation_shader_u_segments, 1);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_BUFFER, geometry->segment_annotation_texture);
+	glUniform1i(annotation_shader_u_segment_annotations, 2);
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_BUFFER, geometry->attribute_texture);
+	glUniform1i(annotation_shader_u_annotation_attributes, 3);
+	glActiveTexture(GL_TEXTURE0);
+
+	// The outlines go on top of the tiles, with antialiased edges
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(viewport.x, client_viewport.h - (viewport.y + viewport.h), viewport.w, viewport.h);
+
+	glBindVertexArray(geometry->vao);
+	glMultiDrawArrays(GL_TRIANGLES, geometry->draw_firsts, geometry->draw_counts, range_count);
+	glBindVertexArray(0);
+
+	glDisable(GL_SCISSOR_TEST);
+	glDisable(GL_BLEND);
+	glEnable(GL_DEPTH_TEST);
+}
+
+// GPU timers: the time the GPU spends on each render pass is measured with a pair of timestamp queries around it. The
+// results are read back GPU_TIMER_FRAMES_IN_FLIGHT frames later (and skipped if they still aren't in), so that the
+// main thread never waits for the GPU. The passes go on a track of their own in the profiler timeline (see
+// profiler_add_gpu_span()), and the profiler window shows the time per pass, to tell CPU submission, tile fill rate
+// and the GUI apart.
+#if defined(GL_VERSION_3_3)
+#define GPU_TIMERS_SUPPORTED 1
+#else
+#define GPU_TIMERS_SUPPORTED 0
+#endif
+
+#define GPU_TIMER_FRAMES_IN_FLIGHT 3
+
+static const char* gpu_pass_names[GPU_PASS_COUNT] = {
+	[GPU_PASS_TILES] = "tiles",
+	[GPU_PASS_ANNOTATIONS] = "annotations",
+	[GPU_PASS_GUI] = "GUI",
+};
+
+#if GPU_TIMERS_SUPPORTED
+
+typedef struct gpu_timer_frame_t {
+	u32 queries[GPU_PASS_COUNT][2]; // timestamps at the begin and end of each pass
+	bool32 is_pass_measured[GPU_PASS_COUNT];
+	// The GPU clock at (about) the same moment as the CPU clock, to place the timestamps on the profiler timeline
+	i64 gpu_sync_time; // in nanoseconds
+	i64 cpu_sync_clock;
+} gpu_timer_frame_t;
+
+typedef struct gpu_timers_t {
+	bool32 is_available;
+	gpu_timer_frame_t frames[GPU_TIMER_FRAMES_IN_FLIGHT];
+	i64 frame_index;
+	double clocks_per_nanosecond;
+	float pass_seconds[GPU_PASS_COUNT]; // smoothed
+} gpu_timers_t;
+
+static gpu_timers_t gpu_timers;
+
+static void init_gpu_timers() {
+	if (!GLAD_GL_VERSION_3_3) {
+		return;
+	}
+	for (i32 i = 0; i < GPU_TIMER_FRAMES_IN_FLIGHT; ++i) {
+		glGenQueries(GPU_PASS_COUNT * 2, &gpu_timers.frames[i].queries[0][0]);
+	}
+	// (get_seconds_elapsed() only has float precision, but that is plenty for the ratio)
+	gpu_timers.clocks_per_nanosecond = (double)(1LL << 30) / ((double)get_seconds_elapsed(0, 1LL << 30) * 1e9);
+	gpu_timers.is_available = true;
+}
+
+bool32 are_gpu_timers_available() {
+	return gpu_timers.is_available;
+}
+
+// Needs to be called at the start of every frame, before anything is drawn: collects the results of the oldest frame
+// in flight, and reuses its queries for this frame.
+void begin_gpu_timer_frame() {
+	if (!gpu_timers.is_available) return;
+	++gpu_timers.frame_index;
+	gpu_timer_frame_t* frame = gpu_timers.frames + (gpu_timers.frame_index % GPU_TIMER_FRAMES_IN_FLIGHT);
+	for (i32 pass = 0; pass < GPU_PASS_COUNT; ++pass) {
+		if (!frame->is_pass_measured[pass]) continue;
+		frame->is_pass_measured[pass] = false;
+		i32 is_available = 0;
+		glGetQueryObjectiv(frame->queries[pass][1], GL_QUERY_RESULT_AVAILABLE, &is_available);
+		if (!is_available) continue; // lost (the GPU is far behind); not worth waiting for
+		u64 begin = 0, end = 0;
+		glGetQueryObjectui64v(frame->queries[pass][0], GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(frame->queries[pass][1], GL_QUERY_RESULT, &end);
+		float seconds = (float)(end - begin) * 1e-9f;
+		gpu_timers.pass_seconds[pass] += (seconds - gpu_timers.pass_seconds[pass]) * 0.1f;
+		i64 begin_clock = frame->cpu_sync_clock +
+		                  (i64)((double)((i64)begin - frame->gpu_sync_time) * gpu_timers.clocks_per_nanosecond);
+		i64 end_clock = frame->cpu_sync_clock +
+		                (i64)((double)((i64)end - frame->gpu_sync_time) * gpu_timers.clocks_per_nanosecond);
+		profiler_add_gpu_span(gpu_pass_names[pass], begin_clock, end_clock);
+	}
+	glGetInteger64v(GL_TIMESTAMP, &frame->gpu_sync_time);
+	frame->cpu_sync_clock = get_clock();
+}
+
+// The passes can't overlap; each pass can be measured once per frame.
+void begin_gpu_pass(gpu_pass_enum pass) {
+	if (!gpu_timers.is_available) return;
+	gpu_timer_frame_t* frame = gpu_timers.frames + (gpu_timers.frame_index % GPU_TIMER_FRAMES_IN_FLIGHT);
+	glQueryCounter(frame->queries[pass][0], GL_TIMESTAMP);
+}
+
+void end_gpu_pass(gpu_pass_enum pass) {
+	if (!gpu_timers.is_available) return;
+	gpu_timer_frame_t* frame = gpu_timers.frames + (gpu_timers.frame_index % GPU_TIMER_FRAMES_IN_FLIGHT);
+	glQueryCounter(frame->queries[pass][1], GL_TIMESTAMP);
+	frame->is_pass_measured[pass] = true;
+}
+
+float get_gpu_pass_seconds(gpu_pass_enum pass) {
+	return gpu_timers.pass_seconds[pass];
+}
+
+#else
+
+static void init_gpu_timers() {}
+
+bool32 are_gpu_timers_available() {
+	return false;
+}
+
+void begin_gpu_timer_frame() {}
+void begin_gpu_pass(gpu_pass_enum pass) {}
+void end_gpu_pass(gpu_pass_enum pass) {}
+
+float get_gpu_pass_seconds(gpu_pass_enum pass) {
+	return 0.0f;
+}
+
+#endif //GPU_TIMERS_SUPPORTED
+
+const char* get_gpu_pass_name(gpu_pass_enum pass) {
+	return gpu_pass_names[pass];
+}
+
 void init_opengl_stuff() {
 
 	basic_shader = load_basic_shader_program("shaders/basic.vert", "shaders/basic.frag");
 	basic_shader_u_projection_view_matrix = get_uniform(basic_shader, "projection_view_matrix");
 	basic_shader_u_model_matrix = get_uniform(basic_shader, "model_matrix");
 	basic_shader_u_tex = get_uniform(basic_shader, "the_texture");
-	basic_shader_u_black_level = get_uniform(basic_shader, "black_level");
-	basic_shader_u_white_level = get_uniform(basic_shader, "white_level");
+	basic_shader_u_color_lut = get_uniform(basic_shader, "color_lut");
+	basic_shader_u_apply_color_lut = get_uniform(basic_shader, "apply_color_lut");
+	basic_shader_u_show_single_stain = get_uniform(basic_shader, "show_single_stain");
+	basic_shader_u_stain_unmixing = get_uniform(basic_shader, "stain_unmixing");
+	basic_shader_u_stain_vector = get_uniform(basic_shader, "stain_vector");
 	basic_shader_u_background_color = get_uniform(basic_shader, "bg_color");
+	basic_shader_u_layer = get_uniform(basic_shader, "layer");
 	basic_shader_attrib_location_pos = get_attrib(basic_shader, "pos");
 	basic_shader_attrib_location_tex_coord = get_attrib(basic_shader, "tex_coord");
 
+	tile_shader = load_basic_shader_program("shaders/tile.vert", "shaders/tile.frag");
+	tile_shader_u_projection_view_matrix = get_uniform(tile_shader, "projection_view_matrix");
+	tile_shader_u_tex = get_uniform(tile_shader, "the_texture");
+	tile_shader_u_color_lut = get_uniform(tile_shader, "color_lut");
+	tile_shader_u_show_single_stain = get_uniform(tile_shader, "show_single_stain");
+	tile_shader_u_stain_unmixing = get_uniform(tile_shader, "stain_unmixing");
+	tile_shader_u_stain_vector = get_uniform(tile_shader, "stain_vector");
+	tile_shader_u_background_color = get_uniform(tile_shader, "bg_color");
+	tile_shader_u_is_planar = get_uniform(tile_shader, "is_planar");
+	tile_shader_u_is_channel = get_uniform(tile_shader, "is_channel");
+	tile_shader_u_channel_color = get_uniform(tile_shader, "channel_color");
+	tile_shader_u_channel_gain = get_uniform(tile_shader, "channel_gain");
+	tile_shader_u_channel_offset = get_uniform(tile_shader, "channel_offset");
+	tile_shader_u_is_overlay = get_uniform(tile_shader, "is_overlay");
+	tile_shader_u_overlay_colormap = get_uniform(tile_shader, "overlay_colormap");
+	tile_shader_u_overlay_opacity = get_uniform(tile_shader, "overlay_opacity");
+	tile_shader_attrib_location_pos = get_attrib(tile_shader, "pos");
+	tile_shader_attrib_location_tex_coord = get_attrib(tile_shader, "tex_coord");
+
+	annotation_shader = load_basic_shader_program("shaders/annotation.vert", "shaders/annotation.frag");
+	annotation_shader_u_segments = get_uniform(annotation_shader, "segments");
+	annotation_shader_u_segment_annotations = get_uniform(annotation_shader, "segment_annotations");
+	annotation_shader_u_annotation_attributes = get_uniform(annotation_shader, "annotation_attributes");
+	annotation_shader_u_camera_min = get_uniform(annotation_shader, "camera_min");
+	annotation_shader_u_um_per_pixel = get_uniform(annotation_shader, "um_per_pixel");
+	annotation_shader_u_viewport_offset = get_uniform(annotation_shader, "viewport_offset");
+	annotation_shader_u_screen_size = get_uniform(annotation_shader, "screen_size");
+	annotation_shader_u_thickness = get_uniform(annotation_shader, "thickness");
+
 #ifdef STRINGIFY_SHADERS
 	write_stringified_shaders();
 #endif
 	glEnable(GL_TEXTURE_2D);
 
 	init_draw_rect();
+	init_tile_texture_pool();
+	init_gpu_tile_decoder();
+	init_tile_histogram();
+	init_tile_instances();
+	init_annotation_geometry();
+	init_gpu_timers();
+
+	// The color lookup table is sampled on texture unit 1 (samplers of different types may not share a unit).
+	color_adjustments_t identity;
+	init_color_adjustments(&identity);
+	update_color_lut(&identity, NULL);
+	glUseProgram(basic_shader);
+	glUniform1i(basic_shader_u_color_lut, 1);
+	glUseProgram(tile_shader);
+	glUniform1i(tile_shader_u_color_lut, 1);
+	glUseProgram(0);
 
 }
 
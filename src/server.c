@@ -26,35 +26,235 @@
 
 #include <stdio.h>
 #include <string.h>    //strlen
+#include <math.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <pthread.h>
 
 #include <time.h>
 #include <errno.h>
+#include <stdarg.h>
 
 #ifdef _WIN32
 #include <winsock2.h>
 #define socklen_t int
+#define poll WSAPoll
 #else
 #include <sys/socket.h>
     #include <arpa/inet.h>
+    #include <netinet/tcp.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
 #define LTM_DESC
 #define TLS_AMALGAMATION
 #define LTC_NO_ASM
+#define TLS_CPU_DISPATCH
 #include "tlse.c"
 
 #include "tiff.h"
+#include "lz4.h"
+#include "async_io.h"
+#include "intrinsics.h"
+#include "tile_cache.h"
+#include "pyramid.h"
+#include "jpeg_decoder.h"
+#include "cpu_dispatch.h"
+#include "log.h"
+#include "shard_ring.h"
+#include "slide_catalog.h"
+#include "tile_datagram.h"
+#include "parson.h"
 
-#define THREAD_COUNT 16
-#define SERVER_VERBOSE 1
+#if defined(__linux__)
+// With kernel TLS, the kernel does the record encryption on send(), and sendfile() can send tile data straight
+// from the page cache. The handshake (and everything the server receives) is still handled by TLSe.
+#include <sys/sendfile.h>
+#include <linux/tls.h>
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#define SERVER_KTLS 1
+#else
+#define SERVER_KTLS 0
+#endif
+
+#define WORKER_THREADS_PER_CORE 2 // workers also wait for disk reads and for clients to accept the responses
+#define MAX_WORKER_THREAD_COUNT 64
+#define MAX_CONNECTION_COUNT 1024
+#define CONNECTION_IDLE_TIMEOUT_SECONDS 15 // close connections on which the client has gone quiet
+#define CONNECTION_SEND_TIMEOUT_SECONDS 10 // give up on clients that stop accepting data
+#define SERVER_VERBOSE 1 // log every connection and request (at LOG_LEVEL_DEBUG, see log.h)
+
+// Tile data that had to be read from the file is kept in memory, shared by all clients. The cache is split into
+// shards with their own lock, so that the workers don't all wait on the same lock.
+#define TILE_CACHE_SHARD_COUNT 16
+#define TILE_CACHE_DEFAULT_MEGABYTES 512 // can be changed with the TILE_CACHE_MB environment variable
+#define TILE_CACHE_ENTRIES_PER_SHARD 16384
+// Decoded tiles are cached as well, for rendering regions (see execute_region_api_call()): clients that pan around
+// request overlapping regions, which would otherwise decode the same tiles over and over.
+#define DECODED_TILE_CACHE_DEFAULT_MEGABYTES 256 // can be changed with the DECODED_TILE_CACHE_MB environment variable
+#define DECODED_TILE_CACHE_ENTRIES_PER_SHARD 1024
+#define REGION_MAX_DIMENSION 4096 // in pixels, for both the width and the height
+// Deep Zoom tiles that don't match a tile in the file are generated, and kept (see execute_dzi_api_call()).
+#define DZI_TILE_CACHE_DEFAULT_MEGABYTES 128 // can be changed with the DZI_TILE_CACHE_MB environment variable
+#define DZI_TILE_CACHE_ENTRIES_PER_SHARD 4096
+#define DZI_DEFAULT_TILE_SIZE 256 // if the tiles in the file are not square
+// Tiles re-encoded at a lower JPEG quality, for clients on slow links that ask for them (see send_reduced_quality_tiles()).
+#define REDUCED_TILE_CACHE_DEFAULT_MEGABYTES 64 // can be changed with the REDUCED_TILE_CACHE_MB environment variable
+#define REDUCED_TILE_CACHE_ENTRIES_PER_SHARD 4096
+// The slide catalog (see slide_catalog.h) is kept up to date by looking through SLIDES_DIR every so often.
+#define SLIDE_CATALOG_DEFAULT_RESCAN_SECONDS 10 // can be changed with the SLIDE_CATALOG_RESCAN_SECONDS environment variable
+#define SLIDE_CATALOG_MAX_DECODED_PIXELS (4096 * 4096) // label and macro images are decoded at 1/8 size at most
+// When a slide set is asked for, the hottest tiles of its slides are read into the tile cache (see warm_slide_set()).
+#define TILE_WARMING_DEFAULT_MAX_TILES 256 // per slide; can be changed with TILE_WARMING_MAX_TILES (0 = no warming)
+#define TILE_WARMING_MIN_INTERVAL_SECONDS 600 // the same slide set is warmed at most once in this time
+
+typedef struct connection_t {
+	int socket;
+	struct TLSContext* context;
+	bool32 is_ktls; // the kernel encrypts outgoing data, so tls_write() must not be used anymore
+	bool32 tried_ktls;
+	bool32 is_handshake_done;
+	i64 handshake_microseconds; // spent in TLSe on the handshake messages so far
+	time_t last_activity_time;
+	i32 request_buffer_size;
+	u8 request_buffer[0xFFFF];
+	char stream_header_field[32]; // "Stream-id: <id>\r\n" while answering a stream request, otherwise empty
+	// Scheduling (see pop_ready_connection()):
+	struct server_client_t* client;
+	bool32 is_bulk; // the last request was a prefetch or a bulk download
+	bool32 has_deferred_requests; // stopped serving to let other connections go first; there is more in request_buffer
+	i64 bytes_sent;
+	i64 accounted_bytes_sent; // the part of bytes_sent that was charged to the client already
+	i64 ready_microseconds; // when it was put in the ready queue
+	i64 not_before_microseconds; // held back by the bandwidth cap of the client until then
+	struct connection_t* next;
+} connection_t;
+
+volatile i32 open_connection_count;
+
+// Handshake counters, for the stats API call. The time is what the workers spend in TLSe on the handshake messages,
+// i.e. the CPU cost of the handshakes (without the round trips). Resumed handshakes (with a session ticket, see
+// tls_enable_session_tickets()) skip the key exchange and the certificate signature.
+typedef struct {
+	volatile i64 full_count;
+	volatile i64 resumed_count;
+	volatile i64 failed_count; // connections closed before the handshake was done
+	volatile i64 full_microseconds;
+	volatile i64 resumed_microseconds;
+} handshake_stats_t;
+
+static handshake_stats_t handshake_stats;
+
+// Counters for the stats API call (see execute_metrics_api_call()). Each thread counts in a block of its own, so that
+// serving a request only ever writes to memory that no other thread writes to: no locks, and no cache lines bouncing
+// between the workers. The blocks are only read (and summed) when the stats are asked for.
+typedef enum {
+	REQUEST_TYPE_HEADER,
+	REQUEST_TYPE_CHUNKS, // byte ranges (GET /slide/<file>/<offset>/<size>/...)
+	REQUEST_TYPE_TILES,
+	REQUEST_TYPE_REGION,
+	REQUEST_TYPE_DZI,
+	REQUEST_TYPE_SLIDE_SET,
+	REQUEST_TYPE_STATS,
+	REQUEST_TYPE_NODES,
+	REQUEST_TYPE_CATALOG,
+	REQUEST_TYPE_OTHER,
+	REQUEST_TYPE_COUNT
+} request_type_enum;
+
+static const char* request_type_names[REQUEST_TYPE_COUNT] = {
+	"header", "chunks", "tiles", "region", "dzi", "slide_set", "stats", "nodes", "catalog", "other",
+};
+
+// Upper bounds (in seconds) of the buckets of the file read latency histogram, one observation per batch of reads.
+static const double file_read_latency_bounds[] = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+                                                   0.1, 0.25, 1.0 };
+#define FILE_READ_LATENCY_BUCKET_COUNT COUNT(file_read_latency_bounds)
+#define METRICS_MAX_THREADS 256
+
+typedef struct {
+	volatile i64 request_counts[REQUEST_TYPE_COUNT];
+	volatile i64 failed_request_counts[REQUEST_TYPE_COUNT];
+	volatile i64 bytes_sent;
+	volatile i64 header_cache_hit_count; // the serialized header of an open slide was ready
+	volatile i64 header_cache_miss_count;
+	volatile i64 file_read_count;
+	volatile i64 file_read_microseconds;
+	volatile i64 file_read_buckets[FILE_READ_LATENCY_BUCKET_COUNT + 1]; // (per bucket, not cumulative; the last is +Inf)
+	volatile i64 datagram_tile_count; // tiles sent over UDP (see tile_datagram.h), counting every time they are asked for
+	volatile i64 datagram_fragment_count;
+	volatile i64 warmed_tile_count; // read into the tile cache ahead of the clients (see warm_slide_set())
+} thread_metrics_t;
+
+static thread_metrics_t* volatile thread_metrics[METRICS_MAX_THREADS];
+static volatile i32 thread_metrics_count;
+static THREAD_LOCAL thread_metrics_t* current_thread_metrics;
+static thread_metrics_t shared_thread_metrics; // for threads beyond METRICS_MAX_THREADS (their counts may be off)
+
+static thread_metrics_t* get_thread_metrics() {
+	if (current_thread_metrics) return current_thread_metrics;
+	i32 thread_index = interlocked_increment(&thread_metrics_count) - 1;
+	if (thread_index >= METRICS_MAX_THREADS) {
+		interlocked_decrement(&thread_metrics_count);
+		current_thread_metrics = &shared_thread_metrics;
+	} else {
+		thread_metrics_t* metrics = calloc(1, sizeof(thread_metrics_t));
+		write_barrier;
+		thread_metrics[thread_index] = metrics;
+		current_thread_metrics = metrics;
+	}
+	return current_thread_metrics;
+}
+
+static void record_file_read(i64 microseconds) {
+	thread_metrics_t* metrics = get_thread_metrics();
+	++metrics->file_read_count;
+	metrics->file_read_microseconds += microseconds;
+	i32 bucket = 0;
+	while (bucket < FILE_READ_LATENCY_BUCKET_COUNT && (double)microseconds > file_read_latency_bounds[bucket] * 1e6) {
+		++bucket;
+	}
+	++metrics->file_read_buckets[bucket];
+}
 
 static char identity_str[0xFF] = {0};
 
-pthread_cond_t semaphore_work_available;
-pthread_mutex_t work_mutex;
-volatile int work_available = -1;
+// The sockets are non-blocking, so that a worker never waits for a client that has nothing to send.
+void set_socket_blocking(int sock, bool32 blocking) {
+#ifdef _WIN32
+	u_long mode = blocking ? 0 : 1;
+	ioctlsocket(sock, FIONBIO, &mode);
+#else
+	int flags = fcntl(sock, F_GETFL, 0);
+	fcntl(sock, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
+#endif
+}
+
+void close_socket(int sock) {
+#ifdef _WIN32
+	closesocket(sock);
+#else
+	close(sock);
+#endif
+}
+
+bool32 socket_would_block() {
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+// Sending a response waits for the client to make room, but not forever.
+bool32 wait_until_writable(int sock) {
+	struct pollfd poll_fd = { .fd = sock, .events = POLLOUT };
+	return poll(&poll_fd, 1, CONNECTION_SEND_TIMEOUT_SECONDS * 1000) > 0 && !(poll_fd.revents & (POLLERR | POLLHUP));
+}
 
 typedef struct mem_t {
 	size_t len;
@@ -87,6 +287,22 @@ mem_t* read_entire_file(const char* filename) {
 }
 
 
+static i64 get_microseconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (i64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#if !WINDOWS
+// (The file reads of the request path go through here, for the latency histogram.)
+static bool32 timed_io_read_batch(io_read_request_t* requests, i32 count) {
+	i64 start = get_microseconds();
+	bool32 ok = io_read_batch(requests, count);
+	record_file_read(get_microseconds() - start);
+	return ok;
+}
+#endif
+
 //https://stackoverflow.com/questions/1157209/is-there-an-alternative-sleep-function-in-c-to-milliseconds
 int msleep(long msec) {
 	struct timespec ts;
@@ -145,6 +361,12 @@ bool32 load_keys(struct TLSContext *context, char *fname, char *priv_fname) {
 	if (!private_key_loaded) {
 		fprintf(stderr, "Could not load private key: %s\n", priv_fname);
 	}
+#ifdef TLS_ECDSA_SUPPORTED
+	// An ECDSA key makes the signature in each full handshake much cheaper than an RSA key does.
+	if (certificate_loaded && private_key_loaded) {
+		fprintf(stderr, "Loaded %s certificate %s\n", context->ec_private_key ? "ECDSA" : "RSA", fname);
+	}
+#endif
 
 	return (certificate_loaded && private_key_loaded);
 }
@@ -175,8 +397,11 @@ int send_pending(int client_sock, struct TLSContext *context) {
 	int send_res = 0;
 	while ((out_buffer) && (out_buffer_len > 0)) {
 		int res = send(client_sock, (char *)&out_buffer[out_buffer_index], out_buffer_len, 0);
+		if (res < 0 && socket_would_block() && wait_until_writable(client_sock)) {
+			continue;
+		}
 		if (res <= 0) {
-			send_res = res;
+			send_res = -1;
 			break;
 		}
 		out_buffer_len -= res;
@@ -256,6 +481,14 @@ typedef struct http_request_t {
 	char* method_name;
 	char* uri;
 	char* protocol;
+	bool32 keep_alive;
+	i64 content_length; // size of the request body (following the headers)
+	u32 stream_id; // 0 if the request is not part of a stream (see serve_buffered_requests())
+	i32 stream_priority;
+	bool32 is_bulk; // Request-class: bulk (e.g. an export), or a stream with a negative priority (prefetched tiles)
+	char* if_none_match; // the ETag the client has a copy for (points into the headers), or NULL
+	bool32 accepts_lz4; // see SLIDE_SET_LZ4_ENCODING
+	i32 tile_quality; // Tile-quality: the JPEG quality the client settles for (see send_reduced_quality_tiles()), or 0
 } http_request_t;
 
 http_request_t* parse_http_headers(const char* http_headers, u64 size) {
@@ -290,9 +523,40 @@ http_request_t* parse_http_headers(const char* http_headers, u64 size) {
 	result->uri = uri;
 	result->protocol = protocol;
 
+	// HTTP/1.1 connections are persistent unless the client asks otherwise
+	result->keep_alive = (strcmp(protocol, "HTTP/1.1") == 0);
+	for (i64 i = 1; i < num_lines; ++i) {
+		char* line = lines[i];
+		if (strncasecmp(line, "Connection:", 11) == 0) {
+			char* value = line + 11;
+			while (*value == ' ') ++value;
+			result->keep_alive = (strncasecmp(value, "close", 5) != 0);
+		} else if (strncasecmp(line, "Content-length:", 15) == 0) {
+			result->content_length = atoll(line + 15);
+		} else if (strncasecmp(line, "Stream-id:", 10) == 0) {
+			result->stream_id = (u32)atoll(line + 10);
+		} else if (strncasecmp(line, "Stream-priority:", 16) == 0) {
+			result->stream_priority = atoi(line + 16);
+			if (result->stream_priority < 0) result->is_bulk = true;
+		} else if (strncasecmp(line, "Request-class:", 14) == 0) {
+			char* value = line + 14;
+			while (*value == ' ') ++value;
+			if (strncasecmp(value, "bulk", 4) == 0) result->is_bulk = true;
+		} else if (strncasecmp(line, "If-none-match:", 14) == 0) {
+			char* value = line + 14;
+			while (*value == ' ') ++value;
+			result->if_none_match = value;
+		} else if (strncasecmp(line, "Accept-encoding:", 16) == 0) {
+			result->accepts_lz4 = (strstr(line + 16, SLIDE_SET_LZ4_ENCODING) != NULL);
+		} else if (strncasecmp(line, "Tile-quality:", 13) == 0) {
+			result->tile_quality = atoi(line + 13);
+		}
+	}
+	if (result->content_length < 0) goto fail;
+
 	goto cleanup;
 	fail:
-	printf("Error: malformed HTTP headers\n");
+	log_warning("Error: malformed HTTP headers\n");
 	free(result);
 	return NULL;
 
@@ -315,14 +579,19 @@ typedef struct slide_api_call_t {
 			char *parameter2;
 		};
 	};
-
+	u8* body;
+	i64 body_size;
+	const char* uri; // (from the http_request_t)
+	const char* if_none_match; // (from the http_request_t)
+	bool32 accepts_lz4;
+	i32 tile_quality;
 } slide_api_call_t;
 
 slide_api_call_t* interpret_api_request(http_request_t* request) {
 	if (!request) return NULL;
 	switch(request->method) {
 		default: {
-			printf("unknown API call: %s %s %s\n", request->method_name, request->uri, request->protocol);
+			log_warning("unknown API call: %s %s %s\n", request->method_name, request->uri, request->protocol);
 		} break;
 		case HTTP_GET:
 		case HTTP_POST: {
@@ -367,7 +636,127 @@ const char* prepend_env_dir(const char* base_filename, const char* env, char* pa
 	return base_filename;
 }
 
-bool32 send_buffer_to_client(struct TLSContext* context, int client_sock, u8* send_buffer, u64 send_size) {
+#if SERVER_KTLS
+// Sends plaintext on a socket on which the kernel does the encryption. Pass MSG_MORE if more data follows, so that
+// the kernel can fill up the TLS records.
+bool32 send_plaintext_to_client(connection_t* connection, u8* send_buffer, u64 send_size, int flags) {
+	while (send_size > 0) {
+		ssize_t bytes_sent = send(connection->socket, send_buffer, send_size, flags);
+		if (bytes_sent < 0) {
+			if (errno == EINTR || (socket_would_block() && wait_until_writable(connection->socket))) continue;
+			return false;
+		}
+		send_buffer += bytes_sent;
+		send_size -= bytes_sent;
+		connection->bytes_sent += bytes_sent;
+		get_thread_metrics()->bytes_sent += bytes_sent;
+	}
+	return true;
+}
+
+// Switches the sending side of an established connection over to kernel TLS. Only AES-128-GCM is supported
+// (for both TLS 1.2 and TLS 1.3), which is what the key material kept by tls_make_exportable() allows for.
+// If this fails, nothing has changed and TLSe keeps doing the encryption.
+bool32 enable_ktls_send(connection_t* connection) {
+	struct TLSContext* context = connection->context;
+	if (context->connection_status != 0xFF || !context->crypto.created || !context->exportable_keys ||
+	    context->exportable_size < TLS_CIPHER_AES_GCM_128_KEY_SIZE * 2) {
+		return false;
+	}
+	struct tls12_crypto_info_aes_gcm_128 crypto_info = {0};
+	crypto_info.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+	u64 sequence_number = htonll(context->local_sequence_number);
+	if (context->version == TLS_V13 && context->cipher == TLS_AES_128_GCM_SHA256) {
+		crypto_info.info.version = TLS_1_3_VERSION;
+		// The 12-byte TLS 1.3 IV is split into the 'salt' and the 'iv' the kernel expects.
+		memcpy(crypto_info.salt, context->crypto.ctx_local_mac.local_iv, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+		memcpy(crypto_info.iv, context->crypto.ctx_local_mac.local_iv + TLS_CIPHER_AES_GCM_128_SALT_SIZE,
+		       TLS_CIPHER_AES_GCM_128_IV_SIZE);
+	} else if (context->version == TLS_V12 && (context->cipher == TLS_RSA_WITH_AES_128_GCM_SHA256 ||
+	                                           context->cipher == TLS_DHE_RSA_WITH_AES_128_GCM_SHA256 ||
+	                                           context->cipher == TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256 ||
+	                                           context->cipher == TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256)) {
+		crypto_info.info.version = TLS_1_2_VERSION;
+		memcpy(crypto_info.salt, context->crypto.ctx_local_mac.local_aead_iv, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+		memcpy(crypto_info.iv, &sequence_number, TLS_CIPHER_AES_GCM_128_IV_SIZE); // TLSe uses the sequence number as explicit nonce
+	} else {
+		return false;
+	}
+	memcpy(crypto_info.key, context->exportable_keys, TLS_CIPHER_AES_GCM_128_KEY_SIZE); // our own key comes first
+	memcpy(crypto_info.rec_seq, &sequence_number, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+
+	// Anything TLSe still has queued up must go out before the kernel takes over.
+	send_pending(connection->socket, context);
+	if (setsockopt(connection->socket, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0) {
+		return false; // the tls kernel module is not available
+	}
+	if (setsockopt(connection->socket, SOL_TLS, TLS_TX, &crypto_info, sizeof(crypto_info)) != 0) {
+		return false; // without TLS_TX, the socket still behaves like a plain TCP socket
+	}
+	connection->is_ktls = true;
+	return true;
+}
+
+// Sends a response of which the body consists of ranges from a file, without copying the data into user space.
+// After a failure halfway the response can't be completed, so the connection is shut down.
+bool32 send_file_ranges_to_client(connection_t* connection, u8* prefix, u64 prefix_size, int fd,
+                                  i64* offsets, i64* sizes, i32 range_count) {
+	ASSERT(connection->is_ktls);
+	bool32 ok = send_plaintext_to_client(connection, prefix, prefix_size, range_count > 0 ? MSG_MORE : 0);
+	for (i32 i = 0; i < range_count && ok; ++i) {
+		off_t offset = (off_t)offsets[i];
+		i64 size_remaining = sizes[i];
+		while (size_remaining > 0) {
+			ssize_t bytes_sent = sendfile(connection->socket, fd, &offset, size_remaining);
+			if (bytes_sent < 0 && (errno == EINTR || (socket_would_block() && wait_until_writable(connection->socket)))) {
+				continue;
+			}
+			if (bytes_sent <= 0) {
+				ok = false; // error, or the range extends past the end of the file
+				break;
+			}
+			size_remaining -= bytes_sent;
+			connection->bytes_sent += bytes_sent;
+			get_thread_metrics()->bytes_sent += bytes_sent;
+		}
+	}
+	if (!ok) {
+		log_warning("[socket %d] Error sending file data\n", connection->socket);
+		shutdown(connection->socket, SHUT_RDWR);
+	}
+	return ok;
+}
+#endif
+
+void send_close_notify(connection_t* connection) {
+#if SERVER_KTLS
+	if (connection->is_ktls) {
+		// The alert record has to go through the kernel as well, sent with its own record type.
+		u8 alert[2] = {0x01, 0x00}; // warning, close_notify
+		char control[CMSG_SPACE(sizeof(u8))] = {0};
+		struct iovec iov = { .iov_base = alert, .iov_len = sizeof(alert) };
+		struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+		cmsg->cmsg_level = SOL_TLS;
+		cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(u8));
+		*CMSG_DATA(cmsg) = 21; // alert
+		sendmsg(connection->socket, &message, 0);
+		return;
+	}
+#endif
+	tls_close_notify(connection->context);
+	send_pending(connection->socket, connection->context);
+}
+
+bool32 send_buffer_to_client(connection_t* connection, u8* send_buffer, u64 send_size) {
+#if SERVER_KTLS
+	if (connection->is_ktls) {
+		return send_plaintext_to_client(connection, send_buffer, send_size, 0);
+	}
+#endif
+	struct TLSContext* context = connection->context;
+	int client_sock = connection->socket;
 	u8* send_buffer_pos = send_buffer;
 	u32 send_size_remaining = (u32)send_size;
 
@@ -376,333 +765,3349 @@ bool32 send_buffer_to_client(struct TLSContext* context, int client_sock, u8* se
 	i32 total_bytes_written = 0;
 	while (!sent) {
 		bytes_written = tls_write(context, send_buffer_pos, send_size_remaining);
+		if (bytes_written <= 0) {
+			break;
+		}
 		total_bytes_written += bytes_written;
+		connection->bytes_sent += bytes_written;
+		get_thread_metrics()->bytes_sent += bytes_written;
 		send_buffer_pos += bytes_written;
 		send_size_remaining -= bytes_written;
 		if (total_bytes_written >= send_size) {
 			sent = true;
-		} else {
-			send_pending(client_sock, context);
+		} else if (send_pending(client_sock, context) < 0) {
+			break; // the client is gone, or has stopped reading
 		}
 	}
 	return sent;
 }
 
-bool32 execute_slide_set_api_call(struct TLSContext *context, int client_sock, slide_api_call_t *call) {
-	bool32 success = false;
+// Responses without a body still need a Content-length, otherwise the client can't tell where they end.
+bool32 send_http_status_to_client(connection_t* connection, const char* status) {
+	char http_headers[256];
+	snprintf(http_headers, sizeof(http_headers),
+	         "HTTP/1.1 %s\r\nConnection: keep-alive\r\n%sContent-length: 0\r\n\r\n", status,
+	         connection->stream_header_field);
+	return send_buffer_to_client(connection, (u8*)http_headers, strlen(http_headers));
+}
 
-	const char* full_filename = prepend_env_dir(call->filename, "SLIDES_DIR", alloca(2048), 2048);
-	mem_t* file_mem = read_entire_file(full_filename);
-	if (file_mem) {
-		success = send_buffer_to_client(context, client_sock, file_mem->data, file_mem->len);
+// The serialized headers of the slides (see tiff_serialize()) are kept on disk, in the directory given by the
+// SLIDE_INDEX_DIR environment variable, so that after a restart the first request for a slide doesn't have to parse
+// the TIFF file again (for a large BigTIFF on a network share, that takes seconds). Each slide has its own index file,
+// named after a hash of its path:
+//   slide_index_header_t, the path, then the serialized header (with the HTTP headers, as tiff_serialize() makes it)
+// An index file is only used while the slide still has the size and modification time it had when it was indexed.
+// The index is filled in when a slide is opened, kept up to date by the catalog thread when slides are added, changed
+// or removed (see scan_slide_catalog()), and can be built ahead of time with: tlsserver --build-index [slide...]
+#define SLIDE_INDEX_MAGIC 0x58444953 // "SIDX"
+#define SLIDE_INDEX_VERSION 1
+#define SLIDE_INDEX_MAX_SERIALIZED_SIZE GIGABYTES(1)
+
+#pragma pack(push, 1)
+typedef struct slide_index_header_t {
+	u32 magic;
+	u32 version;
+	i64 filesize;
+	i64 modification_time;
+	u32 path_length;
+	u32 reserved;
+	u64 serialized_size;
+} slide_index_header_t;
+#pragma pack(pop)
+
+// (The tile access statistics go next to the index, with another extension; see save_tile_access_stats().)
+static bool32 get_slide_index_filename(const char* slide_filename, const char* extension, char* buffer,
+                                       size_t buffer_size) {
+	const char* index_dir = getenv("SLIDE_INDEX_DIR");
+	if (!index_dir || !index_dir[0]) {
+		return false; // no index
+	}
+	u64 hash = 0xcbf29ce484222325ull; // FNV-1a
+	for (const char* c = slide_filename; *c; ++c) {
+		hash = (hash ^ (u8)*c) * 0x100000001b3ull;
 	}
+	snprintf(buffer, buffer_size, "%s/%016llx%s", index_dir, (unsigned long long)hash, extension);
+	return true;
+}
 
-	return success;
+// Reads the index file up to the serialized header, and checks that it belongs to the slide as it is now.
+static FILE* open_slide_index(const char* slide_filename, i64 filesize, time_t modification_time,
+                              slide_index_header_t* header) {
+	char index_filename[2048];
+	if (!get_slide_index_filename(slide_filename, ".slideindex", index_filename, sizeof(index_filename))) {
+		return NULL;
+	}
+	FILE* fp = fopen64(index_filename, "rb");
+	if (!fp) {
+		return NULL;
+	}
+	char path[2048];
+	if (fread(header, sizeof(*header), 1, fp) == 1 && header->magic == SLIDE_INDEX_MAGIC &&
+	    header->version == SLIDE_INDEX_VERSION && header->filesize == filesize &&
+	    header->modification_time == (i64)modification_time && header->path_length < sizeof(path) &&
+	    header->serialized_size > 0 && header->serialized_size <= SLIDE_INDEX_MAX_SERIALIZED_SIZE &&
+	    fread(path, header->path_length, 1, fp) == 1) {
+		path[header->path_length] = '\0';
+		if (strcmp(path, slide_filename) == 0) {
+			return fp; // (a hash collision would have a different path)
+		}
+	}
+	fclose(fp);
+	return NULL;
 }
 
-bool32 execute_slide_api_call(struct TLSContext *context, int client_sock, slide_api_call_t *call) {
-	if (!call || !call->command) return false;
-	bool32 success = false;
+static bool32 is_slide_index_current(const char* slide_filename, i64 filesize, time_t modification_time) {
+	slide_index_header_t header;
+	FILE* fp = open_slide_index(slide_filename, filesize, modification_time, &header);
+	if (fp) fclose(fp);
+	return (fp != NULL);
+}
 
-	if (strcmp(call->command, "slide_set") == 0) {
-		success = execute_slide_set_api_call(context, client_sock, call);
+// Returns the serialized header (to be freed by the caller), or NULL if the slide isn't indexed or has changed since.
+static u8* read_slide_index(const char* slide_filename, i64 filesize, time_t modification_time, u64* serialized_size) {
+	slide_index_header_t header;
+	FILE* fp = open_slide_index(slide_filename, filesize, modification_time, &header);
+	if (!fp) {
+		return NULL;
 	}
+	u8* serialized = malloc(header.serialized_size);
+	if (fread(serialized, header.serialized_size, 1, fp) == 1) {
+		*serialized_size = header.serialized_size;
+	} else {
+		free(serialized);
+		serialized = NULL;
+	}
+	fclose(fp);
+	return serialized;
+}
 
-	else if (strcmp(call->command, "slide") == 0) {
-		// If the SLIDES_DIR environment variable is set, load slides from there
-		const char* filename_full_path = prepend_env_dir(call->filename, "SLIDES_DIR", alloca(2048), 2048);
-
+// The index file is written under a temporary name first, so that no one reads half of it.
+static void write_slide_index(const char* slide_filename, i64 filesize, time_t modification_time,
+                              push_buffer_t* serialized_header) {
+	char index_filename[2048];
+	if (!get_slide_index_filename(slide_filename, ".slideindex", index_filename, sizeof(index_filename))) {
+		return;
+	}
+	char temp_filename[2100];
+	snprintf(temp_filename, sizeof(temp_filename), "%s.%llx.tmp", index_filename,
+	         (unsigned long long)get_microseconds() ^ (unsigned long long)(uintptr_t)serialized_header);
+	FILE* fp = fopen64(temp_filename, "wb");
+	if (!fp) {
+		log_warning("Slide index: could not create %s\n", temp_filename);
+		return;
+	}
+	u8* serialized = serialized_header->raw_memory; // (the HTTP headers come before serialized_header->data)
+	slide_index_header_t header = {
+		.magic = SLIDE_INDEX_MAGIC,
+		.version = SLIDE_INDEX_VERSION,
+		.filesize = filesize,
+		.modification_time = (i64)modification_time,
+		.path_length = (u32)strlen(slide_filename),
+		.serialized_size = (u64)(serialized_header->data - serialized) + serialized_header->used_size,
+	};
+	bool32 ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+	            fwrite(slide_filename, header.path_length, 1, fp) == 1 &&
+	            fwrite(serialized, header.serialized_size, 1, fp) == 1;
+	ok = (fclose(fp) == 0) && ok;
+	if (ok) {
+		remove(index_filename); // rename() does not replace an existing file on Windows
+		ok = (rename(temp_filename, index_filename) == 0);
+	}
+	if (!ok) {
+		log_warning("Slide index: could not write %s\n", index_filename);
+		remove(temp_filename);
+	}
+}
 
-		char* parameter1 = call->parameter1;
-		char* parameter2 = call->parameter2;
-		// is the client requesting TIFF header and metadata?
-		if (parameter1 && strcmp(parameter1, "header") == 0) {
-			if (filename_full_path) {
-				tiff_t tiff = {0};
-				if (open_tiff_file(&tiff, filename_full_path)) {
-					push_buffer_t buffer = {0};
-					tiff_serialize(&tiff, &buffer);
-					u64 send_size = ((u64)buffer.data - (u64)buffer.raw_memory) + buffer.used_size;
-					u8* send_buffer = buffer.raw_memory;
-					success = send_buffer_to_client(context, client_sock, send_buffer, send_size);
+static void remove_slide_index(const char* slide_filename) {
+	char index_filename[2048];
+	if (get_slide_index_filename(slide_filename, ".slideindex", index_filename, sizeof(index_filename))) {
+		remove(index_filename);
+	}
+	if (get_slide_index_filename(slide_filename, ".tileaccess", index_filename, sizeof(index_filename))) {
+		remove(index_filename);
+	}
+}
 
-//				    tls_close_notify(context);
-//				    send_pending(client_sock, context);
-					tiff_destroy(&tiff);
-					free(buffer.raw_memory);
-				} else {
-					fprintf(stderr, "Couldn't open TIFF file %s\n", filename_full_path);
-					success = false;
-				}
+// Indexes the slide, if it isn't already. Returns false if the file can't be opened.
+static bool32 update_slide_index(const char* slide_filename, bool32* was_current) {
+	struct stat st;
+	if (stat(slide_filename, &st) != 0) {
+		return false;
+	}
+	*was_current = is_slide_index_current(slide_filename, (i64)st.st_size, st.st_mtime);
+	if (*was_current) {
+		return true;
+	}
+	tiff_t tiff = {0};
+	if (!open_tiff_file(&tiff, slide_filename)) {
+		return false;
+	}
+	push_buffer_t serialized_header = {0};
+	tiff_serialize(&tiff, &serialized_header);
+	write_slide_index(slide_filename, (i64)st.st_size, st.st_mtime, &serialized_header);
+	free(serialized_header.raw_memory);
+	tiff_destroy(&tiff);
+	return true;
+}
 
+static void init_slide_index() {
+	const char* index_dir = getenv("SLIDE_INDEX_DIR");
+	if (index_dir && index_dir[0]) {
+#ifdef _WIN32
+		mkdir(index_dir);
+#else
+		mkdir(index_dir, 0755);
+#endif
+		log_info("Slide index: %s\n", index_dir);
+	}
+}
 
-			}
-		}
-		else if (parameter1 && parameter2){
+// How often each tile of a slide is asked for, over all clients. Teaching sets are looked at in much the same way by
+// everyone, so when a slide set is asked for, the tiles that were the most popular before are read into the tile
+// cache ahead of the clients (see warm_slide_set()). The counts are kept in a small hash table per open slide; when it
+// fills up, only the hottest half is kept, with the counts halved, so that what is popular now weighs the most. The
+// hottest TILE_ACCESS_MAX_SAVED tiles are saved next to the slide index (<hash>.tileaccess, 12 bytes per tile), so
+// that they survive a restart.
+#define TILE_ACCESS_MAGIC 0x43434154 // "TACC"
+#define TILE_ACCESS_VERSION 1
+#define TILE_ACCESS_TABLE_SIZE 4096 // (a power of two)
+#define TILE_ACCESS_MAX_SAVED 1024
+#define TILE_ACCESS_SAVE_INTERVAL_SECONDS 60
 
-			// try to interpret as batch
-			i32 batch_size = (call->par_count - 2) / 2; // minus two, because 'command' and 'filename' are also counted
-			ASSERT(batch_size >= 1);
-			i64* chunk_offsets = alloca(batch_size * sizeof(i64));
-			i64* chunk_sizes = alloca(batch_size * sizeof(i64));
-			i64 total_size = 0;
-			for (i32 i = 0; i < batch_size; ++i) {
-				// try to interpret the parameters as numbers
-				chunk_offsets[i] = atoll(call->pars[2+2*i]);
-				chunk_sizes[i] = atoll(call->pars[3+2*i]);
-				total_size += chunk_sizes[i];
-			}
+#pragma pack(push, 1)
+typedef struct tile_access_file_header_t {
+	u32 magic;
+	u32 version;
+	i64 filesize;
+	i64 modification_time;
+	u32 path_length;
+	u32 entry_count; // the entries follow the path, the hottest first
+} tile_access_file_header_t;
 
+typedef struct tile_access_entry_t {
+	u32 level;
+	u32 tile_index;
+	u32 count; // 0 = empty slot
+} tile_access_entry_t;
+#pragma pack(pop)
 
-			if (total_size > 0) {
+typedef struct tile_access_stats_t {
+	tile_access_entry_t slots[TILE_ACCESS_TABLE_SIZE];
+	i32 used_count;
+	i32 unsaved_count; // accesses since the last time the statistics were saved
+	volatile i32 lock;
+} tile_access_stats_t;
 
-				FILE* fp = fopen64(filename_full_path, "rb");
-				if (fp) {
-					struct stat st;
-					if (fstat(fileno(fp), &st) == 0) {
-						i64 filesize = st.st_size;
-
-						char http_headers[4096];
-						snprintf(http_headers, sizeof(http_headers),
-						         "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-type: application/octet-stream\r\nContent-length: %llu\r\n\r\n",
-						         total_size);
-						u64 http_headers_size = strlen(http_headers);
-
-						u64 send_size = http_headers_size + total_size;
-						u8* send_buffer = malloc(send_size);
-						memcpy(send_buffer, http_headers, http_headers_size);
-						u8* data_buffer = send_buffer + http_headers_size;
-						u8* data_buffer_pos = data_buffer;
-
-						bool32 ok = true;
-
-						for (i32 i = 0; i < batch_size; ++i) {
-							// try to interpret the parameters as numbers
-							i64 requested_offset = chunk_offsets[i];
-							i64 requested_size = chunk_sizes[i];
-							fseeko64(fp, requested_offset, SEEK_SET);
-							ok = ok && (fread(data_buffer_pos, requested_size, 1, fp) == 1);
-							if (!ok) {
-								printf("Error reading from %s\n", call->filename);
-							}
-							data_buffer_pos += requested_size;
-						}
+static inline u32 get_tile_access_slot(u32 level, u32 tile_index) {
+	u64 hash = (((u64)level << 32) | tile_index) * 0x9E3779B97F4A7C15ull;
+	return (u32)(hash >> 32) & (TILE_ACCESS_TABLE_SIZE - 1);
+}
 
-						if (ok) {
-
-							u8* send_buffer_pos = send_buffer;
-							u64 send_size_remaining = send_size;
-
-							bool32 sent = false;
-							i32 bytes_written = 0;
-							i32 total_bytes_written = 0;
-							while (!sent) {
-								bytes_written = tls_write(context, send_buffer_pos, send_size_remaining);
-								total_bytes_written += bytes_written;
-								send_buffer_pos += bytes_written;
-								send_size_remaining -= bytes_written;
-								if (total_bytes_written >= send_size) {
-									sent = true;
-									success = true;
-								} else {
-									send_pending(client_sock, context);
-								}
-							}
-//									tls_close_notify(context);
-//									send_pending(client_sock, context);
+// (needs the lock, or the table to be private)
+static tile_access_entry_t* find_tile_access_entry(tile_access_stats_t* stats, u32 level, u32 tile_index) {
+	for (u32 slot = get_tile_access_slot(level, tile_index); ; slot = (slot + 1) & (TILE_ACCESS_TABLE_SIZE - 1)) {
+		tile_access_entry_t* entry = stats->slots + slot;
+		if (entry->count == 0 || (entry->level == level && entry->tile_index == tile_index)) {
+			return entry; // (the table is never full, see count_tile_access())
+		}
+	}
+}
 
-						}
-						free(send_buffer);
-					}
-					fclose(fp);
-				}
+static int compare_tile_access_entries(const void* a, const void* b) {
+	u32 count_a = ((tile_access_entry_t*)a)->count;
+	u32 count_b = ((tile_access_entry_t*)b)->count;
+	return (count_a < count_b) - (count_a > count_b); // the hottest first
+}
 
-			}
-		}
-	} else {
-		printf("Slide API: unknown command %s\n", call->command);
-	};
-	return success;
+// Copies the used entries to dest (which must have room for TILE_ACCESS_TABLE_SIZE entries), the hottest first.
+// (needs the lock)
+static i32 sort_tile_access_entries(tile_access_stats_t* stats, tile_access_entry_t* dest) {
+	i32 count = 0;
+	for (i32 i = 0; i < TILE_ACCESS_TABLE_SIZE; ++i) {
+		if (stats->slots[i].count > 0) dest[count++] = stats->slots[i];
+	}
+	qsort(dest, count, sizeof(tile_access_entry_t), compare_tile_access_entries);
+	return count;
 }
 
-struct TLSContext *server_context;
+static void add_tile_access(tile_access_stats_t* stats, u32 level, u32 tile_index, u32 count) {
+	tile_access_entry_t* entry = find_tile_access_entry(stats, level, tile_index);
+	if (entry->count == 0) {
+		*entry = (tile_access_entry_t){ .level = level, .tile_index = tile_index };
+		++stats->used_count;
+	}
+	entry->count = (entry->count > UINT32_MAX - count) ? UINT32_MAX : entry->count + count;
+}
 
+// Keeps the hottest half of the table, with the counts halved. (needs the lock)
+static void age_tile_access_stats(tile_access_stats_t* stats) {
+	tile_access_entry_t* entries = malloc(TILE_ACCESS_TABLE_SIZE * sizeof(tile_access_entry_t));
+	i32 count = MIN(sort_tile_access_entries(stats, entries), TILE_ACCESS_TABLE_SIZE / 2);
+	memset(stats->slots, 0, sizeof(stats->slots));
+	stats->used_count = 0;
+	for (i32 i = 0; i < count; ++i) {
+		add_tile_access(stats, entries[i].level, entries[i].tile_index, MAX(1, entries[i].count / 2));
+	}
+	free(entries);
+}
 
-void *connection_handler(void *socket_desc) {
-	//Get the socket descriptor
-	int client_sock = *(int*)socket_desc;
-	int ret;
+static void count_tile_access(tile_access_stats_t* stats, u32 level, u32 tile_index) {
+	spin_lock(&stats->lock);
+	if (stats->used_count >= TILE_ACCESS_TABLE_SIZE * 3 / 4) {
+		age_tile_access_stats(stats);
+	}
+	add_tile_access(stats, level, tile_index, 1);
+	++stats->unsaved_count;
+	spin_unlock(&stats->lock);
+}
 
-	char client_message[0xFFFF];
+// Copies (at most) the max_count hottest tiles to dest, the hottest first.
+static i32 get_hottest_tiles(tile_access_stats_t* stats, tile_access_entry_t* dest, i32 max_count) {
+	tile_access_entry_t* entries = malloc(TILE_ACCESS_TABLE_SIZE * sizeof(tile_access_entry_t));
+	spin_lock(&stats->lock);
+	i32 count = MIN(sort_tile_access_entries(stats, entries), max_count);
+	spin_unlock(&stats->lock);
+	memcpy(dest, entries, count * sizeof(tile_access_entry_t));
+	free(entries);
+	return count;
+}
 
+// Fills in the saved statistics (when the slide is opened), if they belong to the slide as it is now.
+static void load_tile_access_stats(tile_access_stats_t* stats, const char* slide_filename, i64 filesize,
+                                   time_t modification_time) {
+	char stats_filename[2048];
+	if (!get_slide_index_filename(slide_filename, ".tileaccess", stats_filename, sizeof(stats_filename))) {
+		return;
+	}
+	FILE* fp = fopen64(stats_filename, "rb");
+	if (!fp) {
+		return;
+	}
+	tile_access_file_header_t header;
+	char path[2048];
+	if (fread(&header, sizeof(header), 1, fp) == 1 && header.magic == TILE_ACCESS_MAGIC &&
+	    header.version == TILE_ACCESS_VERSION && header.filesize == filesize &&
+	    header.modification_time == (i64)modification_time && header.path_length < sizeof(path) &&
+	    header.entry_count <= TILE_ACCESS_MAX_SAVED && fread(path, header.path_length, 1, fp) == 1) {
+		path[header.path_length] = '\0';
+		tile_access_entry_t* entries = malloc(TILE_ACCESS_MAX_SAVED * sizeof(tile_access_entry_t));
+		if (strcmp(path, slide_filename) == 0 &&
+		    fread(entries, sizeof(tile_access_entry_t), header.entry_count, fp) == header.entry_count) {
+			spin_lock(&stats->lock);
+			for (u32 i = 0; i < header.entry_count; ++i) {
+				if (entries[i].count > 0) add_tile_access(stats, entries[i].level, entries[i].tile_index, entries[i].count);
+			}
+			spin_unlock(&stats->lock);
+		}
+		free(entries);
+	}
+	fclose(fp);
+}
 
-	struct TLSContext *context = tls_accept(server_context);
-	if (!context) {
-		fprintf(stderr, "[socket %d] tls_accept() failed\n", client_sock);
-		goto cleanup;
+// Written under a temporary name first, as the slide index is (see write_slide_index()).
+static void save_tile_access_stats(tile_access_stats_t* stats, const char* slide_filename, i64 filesize,
+                                   time_t modification_time) {
+	char stats_filename[2048];
+	if (!get_slide_index_filename(slide_filename, ".tileaccess", stats_filename, sizeof(stats_filename))) {
+		return;
+	}
+	tile_access_entry_t* entries = malloc(TILE_ACCESS_MAX_SAVED * sizeof(tile_access_entry_t));
+	i32 entry_count = get_hottest_tiles(stats, entries, TILE_ACCESS_MAX_SAVED);
+	char temp_filename[2100];
+	snprintf(temp_filename, sizeof(temp_filename), "%s.%llx.tmp", stats_filename,
+	         (unsigned long long)get_microseconds() ^ (unsigned long long)(uintptr_t)stats);
+	FILE* fp = fopen64(temp_filename, "wb");
+	if (!fp) {
+		log_warning("Tile access statistics: could not create %s\n", temp_filename);
+		free(entries);
+		return;
+	}
+	tile_access_file_header_t header = {
+		.magic = TILE_ACCESS_MAGIC,
+		.version = TILE_ACCESS_VERSION,
+		.filesize = filesize,
+		.modification_time = (i64)modification_time,
+		.path_length = (u32)strlen(slide_filename),
+		.entry_count = (u32)entry_count,
+	};
+	bool32 ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+	            fwrite(slide_filename, header.path_length, 1, fp) == 1 &&
+	            fwrite(entries, sizeof(tile_access_entry_t), entry_count, fp) == (size_t)entry_count;
+	ok = (fclose(fp) == 0) && ok;
+	if (ok) {
+		remove(stats_filename); // rename() does not replace an existing file on Windows
+		ok = (rename(temp_filename, stats_filename) == 0);
+	}
+	if (!ok) {
+		log_warning("Tile access statistics: could not write %s\n", stats_filename);
+		remove(temp_filename);
 	}
+	free(entries);
+}
 
-	// uncomment next line to request client certificate
-//        tls_request_client_certificate(context);
+// Slides stay open after a client asked for their header, so that tile requests can refer to them by handle
+// (see tile_request_t), and the server can look up the tile offsets itself. Byte range requests use the open file
+// as well, and the serialized header is kept, so that it is only built once no matter how many clients ask for it.
+#define OPEN_SLIDES_MAX 256
 
-	// make the TLS context serializable (this must be called before negotiation)
-//		tls_make_exportable(context, 1);
+typedef struct {
+	char filename[2048];
+	time_t modification_time;
+	i64 filesize;
+	tiff_t tiff;
+	pyramid_t pyramid; // generated levels, if there is a sidecar file (see build_pyramid_sidecar())
+	pthread_mutex_t serialize_mutex;
+	push_buffer_t serialized_header; // LZ4-compressed (see tiff_serialize()), prepared on the first request
+	bool32 is_serialized;
+	tile_access_stats_t tile_access;
+} open_slide_t;
 
-#if SERVER_VERBOSE
-	fprintf(stderr, "[socket %d] Client connected\n", client_sock);
-#endif
+open_slide_t* open_slides[OPEN_SLIDES_MAX];
+i32 open_slide_count;
+pthread_mutex_t open_slides_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-	int read_size;
-	for (;;) {
-		read_size = recv(client_sock, client_message, sizeof(client_message), 0);
-		if (read_size < 0) {
-			fprintf(stderr, "[socket %d] recv(1) returned %d\n", client_sock, read_size);
-			perror("recv failed");
-			goto cleanup;
-		} else if (read_size == 0) {
-#if SERVER_VERBOSE
-			fprintf(stderr, "[socket %d] Gracefully closed\n", client_sock);
-#endif
+// Returns the open slide, opening it if needed. Returns NULL if the file can't be opened or the table is full.
+open_slide_t* get_open_slide_by_filename(const char* filename, u32* slide_handle) {
+	struct stat st;
+	if (stat(filename, &st) != 0) {
+		return NULL;
+	}
+	open_slide_t* result = NULL;
+	pthread_mutex_lock(&open_slides_mutex);
+	for (i32 i = open_slide_count - 1; i >= 0; --i) {
+		open_slide_t* slide = open_slides[i];
+		// If the file was changed, open it again. (The old entry must stay, other clients may still be using it.)
+		if (strcmp(slide->filename, filename) == 0 && slide->modification_time == st.st_mtime &&
+		    slide->filesize == (i64)st.st_size) {
+			result = slide;
+			*slide_handle = (u32)(i + 1);
 			break;
-		} else {
-			ret = tls_consume_stream(context, (u8*) client_message, read_size, verify_signature);
-			if (ret < 0) {
-				fprintf(stderr, "[socket %d] Error in stream consume\n", client_sock);
-				goto cleanup;
-			} else if (ret == 0) {
-				fprintf(stderr, "[socket %d] stream consume returned 0\n", client_sock);
-				continue;
-			} else {
-				break; // done
+		}
+	}
+	if (!result && open_slide_count < OPEN_SLIDES_MAX) {
+		open_slide_t* slide = calloc(1, sizeof(open_slide_t));
+		strncpy(slide->filename, filename, sizeof(slide->filename) - 1);
+		slide->modification_time = st.st_mtime;
+		slide->filesize = (i64)st.st_size;
+		pthread_mutex_init(&slide->serialize_mutex, NULL);
+		u64 serialized_size = 0;
+		u8* serialized = read_slide_index(filename, slide->filesize, slide->modification_time, &serialized_size);
+		bool32 is_indexed = serialized && open_tiff_file_with_header(&slide->tiff, filename, serialized, serialized_size);
+		if (is_indexed || open_tiff_file(&slide->tiff, filename)) {
+			load_pyramid_sidecar(&slide->tiff, filename, &slide->pyramid);
+			load_tile_access_stats(&slide->tile_access, filename, slide->filesize, slide->modification_time);
+			// The indexed header can be sent as it is, unless there are generated levels (those are not indexed).
+			if (is_indexed && slide->pyramid.level_count == 0) {
+				u64 http_headers_size = (u64)find_end_of_http_headers(serialized, serialized_size);
+				slide->serialized_header = (push_buffer_t){
+					.raw_memory = serialized,
+					.data = serialized + http_headers_size,
+					.used_size = serialized_size - http_headers_size,
+					.capacity = serialized_size - http_headers_size,
+				};
+				slide->is_serialized = true;
+				serialized = NULL;
 			}
+			open_slides[open_slide_count++] = slide;
+			result = slide;
+			*slide_handle = (u32)open_slide_count;
+		} else {
+			pthread_mutex_destroy(&slide->serialize_mutex);
+			free(slide);
 		}
+		free(serialized);
+	}
+	pthread_mutex_unlock(&open_slides_mutex);
 
+	return result;
+}
+
+// Clients that ask for the header at the same time wait for the first one to finish serializing.
+push_buffer_t* get_serialized_slide_header(open_slide_t* slide) {
+	pthread_mutex_lock(&slide->serialize_mutex);
+	thread_metrics_t* metrics = get_thread_metrics();
+	if (slide->is_serialized) {
+		++metrics->header_cache_hit_count;
+	} else {
+		++metrics->header_cache_miss_count;
+		tiff_serialize(&slide->tiff, &slide->serialized_header);
+		slide->is_serialized = true;
+		if (slide->pyramid.level_count == 0) {
+			write_slide_index(slide->filename, slide->filesize, slide->modification_time, &slide->serialized_header);
+		}
 	}
+	pthread_mutex_unlock(&slide->serialize_mutex);
+	return &slide->serialized_header;
+}
 
+open_slide_t* get_open_slide_by_handle(u32 slide_handle) {
+	open_slide_t* result = NULL;
+	pthread_mutex_lock(&open_slides_mutex);
+	if (slide_handle >= 1 && slide_handle <= (u32)open_slide_count) {
+		result = open_slides[slide_handle - 1];
+	}
+	pthread_mutex_unlock(&open_slides_mutex);
+	return result;
+}
 
-	send_pending(client_sock, context);
+// Files that are read by byte range without being open as a slide (e.g. because the slide table is full, or the file
+// isn't a TIFF) also stay open, so that a batch of chunks doesn't cost an open() and a close() every time. A file that
+// has changed is opened again; the old entry is closed once the requests that are still reading from it are done.
+#define CACHED_FILES_MAX 64
 
-	if (read_size > 0) {
-#if SERVER_VERBOSE
-		fprintf(stderr, "USED CIPHER: %s\n", tls_cipher_name(context));
-#endif
-		int ref_packet_count = 0;
-		int res;
-		for (;;) {
-			read_size = recv(client_sock, client_message, sizeof(client_message) , 0);
-			if (read_size < 0) {
-				fprintf(stderr, "[socket %d] recv (2) returned %d\n", client_sock, read_size);
-				perror("recv failed");
-				goto cleanup;
-			} else if (read_size == 0) {
-				fprintf(stderr, "[socket %d] Gracefully closed\n", client_sock);
-				break;
-			}
-			if (tls_consume_stream(context, (u8*) client_message, read_size, verify_signature) < 0) {
-				fprintf(stderr, "[socket %d] Error in stream consume\n", client_sock);
-				goto cleanup;
-			}
-			send_pending(client_sock, context);
-			if (tls_established(context) == 1) {
-				unsigned char read_buffer[0xFFFF];
-				int read_size = tls_read(context, read_buffer, sizeof(read_buffer) - 1);
-				if (read_size > 0) {
-					read_buffer[read_size] = 0;
-					unsigned char export_buffer[0xFFF];
-					// simulate serialization / deserialization to another process
-					char sni[0xFF];
-					sni[0] = 0;
-					if (context->sni)
-						snprintf(sni, 0xFF, "%s", context->sni);
-
-					// note: the export context stuff does not seem to work on the server??
-#if 0
-					/* COOL STUFF => */ int size = tls_export_context(context, export_buffer, sizeof(export_buffer), 1);
-                        if (size > 0) {
-    /* COOLER STUFF => */   struct TLSContext *imported_context = tls_import_context(export_buffer, size);
-    // This is cool because a context can be sent to an existing process.
-    // It will work both with fork and with already existing worker process.
-                            fprintf(stderr, "Imported context (size: %i): %x\n", size, imported_context);
-                            if (imported_context) {
-                                // destroy old context
-                                tls_destroy_context(context);
-                                // simulate serialization/deserialization of context
-                                context = imported_context;
-                            }
-                        }
-#endif
-					// interpret the request
-					http_request_t* request = parse_http_headers((char *) read_buffer, read_size);
-					if (!request) {
-						fprintf(stderr, "[socket %d] Warning: bad request\n", client_sock);
-					} else {
-						fprintf(stderr, "[socket %d] Received request: %s\n", client_sock, request->uri);
-						slide_api_call_t* call = interpret_api_request(request);
-						if (call) {
-							if (execute_slide_api_call(context, client_sock, call)) {
-								// success!
-							}
-						}
-					}
+typedef struct {
+	char filename[2048];
+	time_t modification_time;
+	i64 filesize;
+	FILE* fp;
+	volatile i32 fp_lock; // the file position is shared (only used for fseeko64() and fread())
+	i32 user_count;
+	i64 last_used;
+	bool32 is_stale;
+} cached_file_t;
 
-					tls_close_notify(context);
-					send_pending(client_sock, context);
+cached_file_t cached_files[CACHED_FILES_MAX];
+i64 cached_file_use_counter;
+pthread_mutex_t cached_files_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-					break;
-				}
+// Returns NULL if the file can't be opened. If all entries are in use, the file is opened without caching it
+// (*cached_file is then NULL). Every successful call needs a matching release_cached_file().
+FILE* acquire_cached_file(const char* filename, cached_file_t** cached_file) {
+	*cached_file = NULL;
+	struct stat st;
+	if (stat(filename, &st) != 0) {
+		return NULL;
+	}
+	FILE* fp = NULL;
+	pthread_mutex_lock(&cached_files_mutex);
+	cached_file_t* free_entry = NULL;
+	for (i32 i = 0; i < CACHED_FILES_MAX; ++i) {
+		cached_file_t* entry = cached_files + i;
+		if (!entry->fp) {
+			if (!free_entry) free_entry = entry;
+			continue;
+		}
+		if (entry->is_stale || strcmp(entry->filename, filename) != 0) {
+			if (entry->user_count == 0 && (!free_entry || (free_entry->fp && entry->last_used < free_entry->last_used))) {
+				free_entry = entry; // least recently used, if there is no empty entry
 			}
+			continue;
+		}
+		if (entry->modification_time == st.st_mtime && entry->filesize == (i64)st.st_size) {
+			*cached_file = entry;
+			break;
+		}
+		entry->is_stale = true;
+		if (entry->user_count == 0) {
+			fclose(entry->fp);
+			entry->fp = NULL;
+			if (!free_entry || free_entry->fp) free_entry = entry;
 		}
 	}
+	if (!*cached_file && free_entry) {
+		FILE* new_fp = fopen64(filename, "rb");
+		if (new_fp) {
+			if (free_entry->fp) fclose(free_entry->fp);
+			memset(free_entry, 0, sizeof(*free_entry));
+			strncpy(free_entry->filename, filename, sizeof(free_entry->filename) - 1);
+			free_entry->modification_time = st.st_mtime;
+			free_entry->filesize = (i64)st.st_size;
+			free_entry->fp = new_fp;
+			*cached_file = free_entry;
+		}
+	}
+	if (*cached_file) {
+		++(*cached_file)->user_count;
+		(*cached_file)->last_used = ++cached_file_use_counter;
+		fp = (*cached_file)->fp;
+	}
+	pthread_mutex_unlock(&cached_files_mutex);
+	if (!fp && !free_entry) {
+		fp = fopen64(filename, "rb"); // every entry is being read from
+	}
+	return fp;
+}
 
-	cleanup:
-#ifdef __WIN32
-	shutdown(client_sock, SD_BOTH);
-	closesocket(client_sock);
-#else
-	shutdown(client_sock, SHUT_RDWR);
-        close(client_sock);
-#endif
-	tls_destroy_context(context);
-
-	return 0;
+void release_cached_file(FILE* fp, cached_file_t* cached_file) {
+	if (!cached_file) {
+		fclose(fp);
+		return;
+	}
+	pthread_mutex_lock(&cached_files_mutex);
+	--cached_file->user_count;
+	if (cached_file->is_stale && cached_file->user_count == 0) {
+		fclose(cached_file->fp);
+		cached_file->fp = NULL;
+	}
+	pthread_mutex_unlock(&cached_files_mutex);
 }
 
+tile_cache_t tile_cache_shards[TILE_CACHE_SHARD_COUNT];
+tile_cache_t decoded_tile_cache_shards[TILE_CACHE_SHARD_COUNT];
+tile_cache_t dzi_tile_cache_shards[TILE_CACHE_SHARD_COUNT];
+tile_cache_t reduced_tile_cache_shards[TILE_CACHE_SHARD_COUNT];
 
-void* worker(void* arg_ptr) {
+static i64 get_cache_budget_from_env(const char* env, i64 default_megabytes) {
+	const char* budget_env = getenv(env);
+	return (budget_env ? (i64)atoll(budget_env) : default_megabytes) * MEGABYTES(1);
+}
 
-	for (;;) {
-		/* thread code blocks here until work is available */
-		pthread_mutex_lock(&work_mutex);
-		while (work_available <= 0) {
-			pthread_cond_wait(&semaphore_work_available, &work_mutex);
+static void init_tile_cache_shards(tile_cache_t* shards, i64 budget, i32 entries_per_shard) {
+	if (budget > 0) {
+		for (i32 i = 0; i < TILE_CACHE_SHARD_COUNT; ++i) {
+			tile_cache_init(shards + i, budget / TILE_CACHE_SHARD_COUNT, entries_per_shard);
 		}
-		pthread_mutex_unlock(&work_mutex);
-		/* proceed with thread execution */
+	}
+}
 
-		int client_socket = work_available;
-		work_available = 0;
+static i64 server_tile_cache_budget;
 
-		connection_handler(&client_socket);
+void init_server_tile_cache() {
+	i64 budget = get_cache_budget_from_env("TILE_CACHE_MB", TILE_CACHE_DEFAULT_MEGABYTES);
+	server_tile_cache_budget = budget;
+	init_tile_cache_shards(tile_cache_shards, budget, TILE_CACHE_ENTRIES_PER_SHARD);
+	i64 decoded_budget = get_cache_budget_from_env("DECODED_TILE_CACHE_MB", DECODED_TILE_CACHE_DEFAULT_MEGABYTES);
+	init_tile_cache_shards(decoded_tile_cache_shards, decoded_budget, DECODED_TILE_CACHE_ENTRIES_PER_SHARD);
+	i64 dzi_budget = get_cache_budget_from_env("DZI_TILE_CACHE_MB", DZI_TILE_CACHE_DEFAULT_MEGABYTES);
+	init_tile_cache_shards(dzi_tile_cache_shards, dzi_budget, DZI_TILE_CACHE_ENTRIES_PER_SHARD);
+	i64 reduced_budget = get_cache_budget_from_env("REDUCED_TILE_CACHE_MB", REDUCED_TILE_CACHE_DEFAULT_MEGABYTES);
+	init_tile_cache_shards(reduced_tile_cache_shards, reduced_budget, REDUCED_TILE_CACHE_ENTRIES_PER_SHARD);
+	fprintf(stderr, "Tile cache: %lld MB (decoded tiles: %lld MB, Deep Zoom tiles: %lld MB, reduced quality tiles: %lld MB)\n",
+	        budget / MEGABYTES(1), decoded_budget / MEGABYTES(1), dzi_budget / MEGABYTES(1), reduced_budget / MEGABYTES(1));
+}
 
+// Key layout: 16 bits slide handle | 48 bits file offset (the same as tile_cache_key(), with the slide handle in the
+// place of the image id)
+static inline u64 server_tile_cache_key(u32 slide_handle, u64 offset) {
+	return ((u64)(slide_handle & 0xFFFF) << 48) | (offset & 0xFFFFFFFFFFFF);
+}
 
-//	pthread_cond_signal(&semaphore_work_grabbed);
-	}
+static inline tile_cache_t* get_tile_cache_shard(tile_cache_t* shards, u64 key) {
+	u64 hash = key * 11400714819323198485llu;
+	return shards + (hash >> 60) % TILE_CACHE_SHARD_COUNT;
+}
+
+bool32 server_tile_cache_lookup(u32 slide_handle, u64 offset, u8* dest, u32 size) {
+	u64 key = server_tile_cache_key(slide_handle, offset);
+	u32 cached_size = 0;
+	return tile_cache_lookup(get_tile_cache_shard(tile_cache_shards, key), key, dest, size, &cached_size) &&
+	       cached_size == size;
+}
+
+void server_tile_cache_insert(u32 slide_handle, u64 offset, u8* data, u32 size) {
+	u64 key = server_tile_cache_key(slide_handle, offset);
+	tile_cache_insert(get_tile_cache_shard(tile_cache_shards, key), key, data, size);
+}
+
+// Decoded tiles are keyed the same way, by the offset of the compressed tile.
+bool32 decoded_tile_cache_lookup(u32 slide_handle, u64 offset, u8* dest, u32 size) {
+	u64 key = server_tile_cache_key(slide_handle, offset);
+	u32 cached_size = 0;
+	return tile_cache_lookup(get_tile_cache_shard(decoded_tile_cache_shards, key), key, dest, size, &cached_size) &&
+	       cached_size == size;
+}
+
+void decoded_tile_cache_insert(u32 slide_handle, u64 offset, u8* pixels, u32 size) {
+	u64 key = server_tile_cache_key(slide_handle, offset);
+	tile_cache_insert(get_tile_cache_shard(decoded_tile_cache_shards, key), key, pixels, size);
+}
+
+// Singleflight: when many clients ask for the same chunks at the same time (e.g. a class following the slide on the
+// projector), only the first request reads a chunk from the file. The others wait for that read to finish, and then
+// take the chunk from the tile cache (or read it themselves after all, if it didn't make it into the cache).
+// A request first finishes all the reads it claimed, before waiting for the reads of others, so requests that
+// wait for each other can't deadlock.
+#define INFLIGHT_CHUNK_SLOTS 1024 // needs to be a power of 2
+
+typedef struct {
+	u64 key; // see server_tile_cache_key(); 0 = free
+	i32 waiter_count;
+	bool32 is_done;
+} inflight_chunk_t;
+
+static inflight_chunk_t inflight_chunks[INFLIGHT_CHUNK_SLOTS];
+static pthread_mutex_t inflight_chunks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inflight_chunks_cond = PTHREAD_COND_INITIALIZER;
+volatile i64 shared_chunk_read_count; // reads that were saved this way
+
+// Returns the slot of the chunk, for finish_inflight_chunk() if the caller is the one to read it, or else for
+// wait_for_inflight_chunk() (*is_reader is then false). Returns -1 if the slot is taken by a different chunk; the
+// caller then just reads the chunk without sharing it.
+static i32 claim_inflight_chunk(u64 key, bool32* is_reader) {
+	i32 slot = (i32)((key * 11400714819323198485llu) >> 32) & (INFLIGHT_CHUNK_SLOTS - 1);
+	inflight_chunk_t* chunk = inflight_chunks + slot;
+	*is_reader = true;
+	pthread_mutex_lock(&inflight_chunks_mutex);
+	if (chunk->key == 0) {
+		chunk->key = key;
+		chunk->waiter_count = 0;
+		chunk->is_done = false;
+	} else if (chunk->key == key && !chunk->is_done) {
+		++chunk->waiter_count;
+		*is_reader = false;
+	} else {
+		slot = -1;
+	}
+	pthread_mutex_unlock(&inflight_chunks_mutex);
+	return slot;
+}
+
+// Call after the chunk was put in the tile cache (or the read failed).
+static void finish_inflight_chunk(i32 slot) {
+	if (slot < 0) return;
+	inflight_chunk_t* chunk = inflight_chunks + slot;
+	pthread_mutex_lock(&inflight_chunks_mutex);
+	chunk->is_done = true;
+	if (chunk->waiter_count == 0) {
+		chunk->key = 0;
+	} else {
+		pthread_cond_broadcast(&inflight_chunks_cond);
+	}
+	pthread_mutex_unlock(&inflight_chunks_mutex);
+}
+
+static void wait_for_inflight_chunk(i32 slot) {
+	inflight_chunk_t* chunk = inflight_chunks + slot;
+	pthread_mutex_lock(&inflight_chunks_mutex);
+	while (!chunk->is_done) {
+		pthread_cond_wait(&inflight_chunks_cond, &inflight_chunks_mutex);
+	}
+	if (--chunk->waiter_count == 0) {
+		chunk->key = 0;
+	}
+	pthread_mutex_unlock(&inflight_chunks_mutex);
+}
+
+// Sums up the counters of the shards, as a JSON object.
+static void format_tile_cache_stats(tile_cache_t* shards, char* dest, size_t dest_size) {
+	i64 hit_count = 0, miss_count = 0, eviction_count = 0, entry_count = 0, memory_used = 0, budget = 0;
+	for (i32 i = 0; i < TILE_CACHE_SHARD_COUNT; ++i) {
+		tile_cache_t* shard = shards + i;
+		spin_lock(&shard->lock);
+		hit_count += shard->hit_count;
+		miss_count += shard->miss_count;
+		eviction_count += shard->eviction_count;
+		entry_count += shard->entry_count;
+		memory_used += shard->memory_used;
+		budget += shard->budget;
+		spin_unlock(&shard->lock);
+	}
+	snprintf(dest, dest_size,
+	         "{\"hits\": %lld, \"misses\": %lld, \"evictions\": %lld, \"entries\": %lld, "
+	         "\"memory_used\": %lld, \"budget\": %lld}",
+	         hit_count, miss_count, eviction_count, entry_count, memory_used, budget);
+}
+
+bool32 execute_stats_api_call(connection_t* connection) {
+	char tile_cache_stats[512];
+	char decoded_tile_cache_stats[512];
+	char dzi_tile_cache_stats[512];
+	format_tile_cache_stats(tile_cache_shards, tile_cache_stats, sizeof(tile_cache_stats));
+	format_tile_cache_stats(decoded_tile_cache_shards, decoded_tile_cache_stats, sizeof(decoded_tile_cache_stats));
+	format_tile_cache_stats(dzi_tile_cache_shards, dzi_tile_cache_stats, sizeof(dzi_tile_cache_stats));
+	i64 full_count = handshake_stats.full_count;
+	i64 resumed_count = handshake_stats.resumed_count;
+	char handshake_stats_json[512];
+	snprintf(handshake_stats_json, sizeof(handshake_stats_json),
+	         "{\"full\": %lld, \"resumed\": %lld, \"failed\": %lld, \"full_average_ms\": %.3f, "
+	         "\"resumed_average_ms\": %.3f}", full_count, resumed_count, (i64)handshake_stats.failed_count,
+	         full_count ? (double)handshake_stats.full_microseconds / (1000.0 * full_count) : 0.0,
+	         resumed_count ? (double)handshake_stats.resumed_microseconds / (1000.0 * resumed_count) : 0.0);
+	char body[2048];
+	snprintf(body, sizeof(body),
+	         "{\"tile_cache\": %s, \"decoded_tile_cache\": %s, \"dzi_tile_cache\": %s, \"handshakes\": %s, "
+	         "\"shared_chunk_reads\": %lld, \"open_connections\": %d, \"open_slides\": %d}\n", tile_cache_stats,
+	         decoded_tile_cache_stats, dzi_tile_cache_stats, handshake_stats_json, (i64)shared_chunk_read_count,
+	         open_connection_count, open_slide_count);
+	char http_headers[256];
+	snprintf(http_headers, sizeof(http_headers),
+	         "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-type: application/json\r\nContent-length: %llu\r\n\r\n",
+	         (u64)strlen(body));
+	return send_buffer_to_client(connection, (u8*)http_headers, strlen(http_headers)) &&
+	       send_buffer_to_client(connection, (u8*)body, strlen(body));
+}
+
+bool32 send_reduced_quality_tiles(connection_t* connection, u32 slide_handle, tiff_ifd_t* ifd, u32* tile_indices,
+                                  u32 tile_count, u32* tile_sizes, u8* tile_data, i32 quality);
+
+bool32 execute_tiles_api_call(connection_t* connection, slide_api_call_t *call) {
+	tile_request_t request = {0};
+	if (!call->body || call->body_size < (i64)sizeof(request)) {
+		return false;
+	}
+	memcpy(&request, call->body, sizeof(request)); // the body may not be aligned
+	if (request.magic != TILE_REQUEST_MAGIC || request.tile_count == 0 || request.tile_count > TILE_REQUEST_MAX_TILES ||
+	    call->body_size != (i64)(sizeof(request) + request.tile_count * sizeof(u32))) {
+		log_warning("Tile request: malformed request\n");
+		return false;
+	}
+	open_slide_t* slide = NULL;
+	if (request.slide_handle == 0 && call->filename) {
+		// A client that got the header from another server with the same slides asks by filename instead (POST
+		// /tiles/<filename>), since it doesn't know the handle on this server.
+		const char* filename_full_path = prepend_env_dir(call->filename, "SLIDES_DIR", alloca(2048), 2048);
+		slide = get_open_slide_by_filename(filename_full_path, &request.slide_handle);
+	} else {
+		slide = get_open_slide_by_handle(request.slide_handle);
+	}
+	tiff_t* tiff = slide ? &slide->tiff : NULL;
+	if (!tiff || request.level >= tiff->level_count) {
+		log_warning("Tile request: unknown slide handle %u or level %u\n", request.slide_handle, request.level);
+		return false;
+	}
+	tiff_ifd_t* ifd = tiff->level_images + request.level;
+	if (!tiff_load_tile_tables(tiff, ifd)) {
+		return false;
+	}
+	// Only tiles that the client can decode the same way after re-encoding (YCbCr JPEG) are reduced.
+	bool32 reduce_quality = (call->tile_quality > 0 && call->tile_quality < PYRAMID_JPEG_QUALITY &&
+	                         ifd->compression == TIFF_COMPRESSION_JPEG && ifd->color_space == TIFF_PHOTOMETRIC_YCBCR &&
+	                         ifd->tile_width > 0 && ifd->tile_height > 0);
+
+	u32 tile_count = request.tile_count;
+	u32* tile_indices = alloca(tile_count * sizeof(u32));
+	memcpy(tile_indices, call->body + sizeof(request), tile_count * sizeof(u32));
+	u32* tile_sizes = alloca(tile_count * sizeof(u32));
+	u64 total_size = tile_count * sizeof(u32);
+	for (u32 i = 0; i < tile_count; ++i) {
+		u32 tile_index = tile_indices[i];
+		if (tile_index >= ifd->tile_count) {
+			log_warning("Tile request: tile %u out of range\n", tile_index);
+			return false;
+		}
+		// Empty tiles (that have no data in the file) are sent with size 0.
+		tile_sizes[i] = (ifd->tile_offsets[tile_index] != 0) ? (u32)ifd->tile_byte_counts[tile_index] : 0;
+		total_size += tile_sizes[i];
+	}
+	for (u32 i = 0; i < tile_count; ++i) {
+		count_tile_access(&slide->tile_access, request.level, tile_indices[i]);
+	}
+
+	char http_headers[4096];
+	snprintf(http_headers, sizeof(http_headers),
+	         "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-type: application/octet-stream\r\n%s"
+	         "Content-length: %llu\r\n\r\n", connection->stream_header_field, total_size);
+	u64 http_headers_size = strlen(http_headers);
+
+	// The tiles of generated levels are in the sidecar file (see load_pyramid_sidecar()).
+	bool32 is_generated_level = (slide->pyramid.fp && request.level >= slide->pyramid.first_level);
+	FILE* fp = is_generated_level ? slide->pyramid.fp : tiff->fp;
+	volatile i32* fp_lock = is_generated_level ? &slide->pyramid.fp_lock : &tiff->fp_lock;
+	u64 base_offset = is_generated_level ? slide->pyramid.base_offset : 0;
+
+#if SERVER_KTLS
+	if (connection->is_ktls && !reduce_quality) {
+		// Send the tile data directly from the file (the table with the tile sizes is sent ahead of it).
+		u64 prefix_size = http_headers_size + tile_count * sizeof(u32);
+		u8* prefix = alloca(prefix_size);
+		memcpy(prefix, http_headers, http_headers_size);
+		memcpy(prefix + http_headers_size, tile_sizes, tile_count * sizeof(u32));
+		i64* range_offsets = alloca(tile_count * sizeof(i64));
+		i64* range_sizes = alloca(tile_count * sizeof(i64));
+		i32 range_count = 0;
+		for (u32 i = 0; i < tile_count; ++i) {
+			if (tile_sizes[i] == 0) continue;
+			range_offsets[range_count] = (i64)(ifd->tile_offsets[tile_indices[i]] - base_offset);
+			range_sizes[range_count] = tile_sizes[i];
+			++range_count;
+		}
+		return send_file_ranges_to_client(connection, prefix, prefix_size, fileno(fp),
+		                                  range_offsets, range_sizes, range_count);
+	}
+#endif
+
+	u64 send_size = http_headers_size + total_size;
+	u8* send_buffer = malloc(send_size);
+	memcpy(send_buffer, http_headers, http_headers_size);
+	memcpy(send_buffer + http_headers_size, tile_sizes, tile_count * sizeof(u32));
+	u8* data_buffer_pos = send_buffer + http_headers_size + tile_count * sizeof(u32);
+
+	bool32 ok = true;
+#if !WINDOWS
+	io_read_request_t* io_requests = alloca(tile_count * sizeof(io_read_request_t));
+	i32 io_request_count = 0;
+#endif
+	// Tiles that had to be read from the file go into the cache afterwards. Tiles that another request is already
+	// reading are taken from the cache once that read is done (see claim_inflight_chunk()).
+	u8** read_tiles = alloca(tile_count * sizeof(u8*));
+	u8** shared_tiles = alloca(tile_count * sizeof(u8*));
+	i32* inflight_slots = alloca(tile_count * sizeof(i32));
+	memset(read_tiles, 0, tile_count * sizeof(u8*));
+	memset(shared_tiles, 0, tile_count * sizeof(u8*));
+	memset(inflight_slots, -1, tile_count * sizeof(i32));
+	for (u32 i = 0; i < tile_count && ok; ++i) {
+		if (tile_sizes[i] == 0) continue;
+		u64 offset = ifd->tile_offsets[tile_indices[i]];
+		u8* mapped = tiff_get_mapped_range(tiff, offset, tile_sizes[i]);
+		if (mapped) {
+			memcpy(data_buffer_pos, mapped, tile_sizes[i]); // already in memory
+		} else if (server_tile_cache_lookup(request.slide_handle, offset, data_buffer_pos, tile_sizes[i])) {
+			// served from the cache
+		} else {
+			bool32 is_reader = true;
+			inflight_slots[i] = claim_inflight_chunk(server_tile_cache_key(request.slide_handle, offset), &is_reader);
+			if (!is_reader) {
+				shared_tiles[i] = data_buffer_pos;
+			} else {
+				read_tiles[i] = data_buffer_pos;
+#if WINDOWS
+				i64 read_start = get_microseconds();
+				spin_lock(fp_lock);
+				ok = (file_read_at_offset(data_buffer_pos, fp, offset - base_offset, tile_sizes[i]) == 1);
+				spin_unlock(fp_lock);
+				record_file_read(get_microseconds() - read_start);
+#else
+				io_requests[io_request_count++] = (io_read_request_t){ .file = fileno(fp), .offset = offset - base_offset,
+				                                                       .size = tile_sizes[i], .dest = data_buffer_pos };
+#endif
+			}
+		}
+		data_buffer_pos += tile_sizes[i];
+	}
+#if !WINDOWS
+	if (ok && io_request_count > 0) {
+		ok = timed_io_read_batch(io_requests, io_request_count);
+	}
+#endif
+	for (u32 i = 0; i < tile_count; ++i) {
+		if (read_tiles[i]) {
+			if (ok) {
+				server_tile_cache_insert(request.slide_handle, ifd->tile_offsets[tile_indices[i]], read_tiles[i], tile_sizes[i]);
+			}
+			finish_inflight_chunk(inflight_slots[i]);
+		}
+	}
+	for (u32 i = 0; i < tile_count; ++i) {
+		if (!shared_tiles[i]) continue;
+		wait_for_inflight_chunk(inflight_slots[i]);
+		u64 offset = ifd->tile_offsets[tile_indices[i]];
+		if (!ok) {
+			continue;
+		} else if (server_tile_cache_lookup(request.slide_handle, offset, shared_tiles[i], tile_sizes[i])) {
+			interlocked_add_i64(&shared_chunk_read_count, 1);
+		} else {
+			// The other read failed, or the tile didn't stay in the cache: read it after all.
+#if WINDOWS
+			i64 read_start = get_microseconds();
+			spin_lock(fp_lock);
+			ok = (file_read_at_offset(shared_tiles[i], fp, offset - base_offset, tile_sizes[i]) == 1);
+			spin_unlock(fp_lock);
+			record_file_read(get_microseconds() - read_start);
+#else
+			io_read_request_t io_request = { .file = fileno(fp), .offset = offset - base_offset, .size = tile_sizes[i],
+			                                 .dest = shared_tiles[i] };
+			ok = timed_io_read_batch(&io_request, 1);
+#endif
+		}
+	}
+
+	bool32 success = false;
+	if (!ok) {
+		log_warning("Tile request: error reading tiles\n");
+	} else if (reduce_quality) {
+		success = send_reduced_quality_tiles(connection, request.slide_handle, ifd, tile_indices, tile_count, tile_sizes,
+		                                     send_buffer + http_headers_size + tile_count * sizeof(u32), call->tile_quality);
+	} else {
+		success = send_buffer_to_client(connection, send_buffer, send_size);
+	}
+	free(send_buffer);
+	return success;
+}
+
+// Slide sets are kept in memory (as they are, and LZ4-compressed), so that clients that reload a case list don't make
+// the server read and compress the file every time. The file is checked for changes on every request, as for slides.
+#define SLIDE_SETS_MAX 32
+#define SLIDE_SET_MIN_COMPRESSED_SIZE KILOBYTES(4) // smaller ones are sent as they are
+
+typedef struct slide_set_t {
+	char filename[2048];
+	time_t modification_time;
+	i64 filesize;
+	mem_t* json;
+	u8* lz4_data; // NULL if not worth it
+	i32 lz4_size;
+	char etag[24]; // a hash of the contents, so that it stays the same if the server restarts
+	i32 ref_count; // the table holds one reference, each response that is being sent holds another
+	i64 last_used; // for choosing which one to evict
+	i64 warmed_at; // in seconds since the epoch; 0 if the tiles of its slides haven't been warmed yet
+} slide_set_t;
+
+slide_set_t* slide_sets[SLIDE_SETS_MAX];
+i32 slide_set_count;
+i64 slide_set_use_counter;
+pthread_mutex_t slide_sets_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void release_slide_set(slide_set_t* slide_set) {
+	pthread_mutex_lock(&slide_sets_mutex);
+	bool32 is_unused = (--slide_set->ref_count == 0);
+	pthread_mutex_unlock(&slide_sets_mutex);
+	if (is_unused) {
+		free(slide_set->json);
+		free(slide_set->lz4_data);
+		free(slide_set);
+	}
+}
+
+// (needs slide_sets_mutex to be locked)
+static void remove_slide_set(i32 index) {
+	slide_set_t* slide_set = slide_sets[index];
+	slide_sets[index] = slide_sets[--slide_set_count];
+	if (--slide_set->ref_count == 0) {
+		free(slide_set->json);
+		free(slide_set->lz4_data);
+		free(slide_set);
+	}
+}
+
+static slide_set_t* load_slide_set(const char* filename, struct stat* st) {
+	mem_t* json = read_entire_file(filename);
+	if (!json) return NULL;
+	slide_set_t* slide_set = calloc(1, sizeof(slide_set_t));
+	strncpy(slide_set->filename, filename, sizeof(slide_set->filename) - 1);
+	slide_set->modification_time = st->st_mtime;
+	slide_set->filesize = (i64)st->st_size;
+	slide_set->json = json;
+	u64 hash = 0xcbf29ce484222325ull; // FNV-1a
+	for (size_t i = 0; i < json->len; ++i) {
+		hash = (hash ^ json->data[i]) * 0x100000001b3ull;
+	}
+	snprintf(slide_set->etag, sizeof(slide_set->etag), "\"%016llx\"", (unsigned long long)hash);
+	if (json->len >= SLIDE_SET_MIN_COMPRESSED_SIZE && json->len < LZ4_MAX_INPUT_SIZE) {
+		i32 bound = LZ4_compressBound((i32)json->len);
+		slide_set->lz4_data = malloc(bound);
+		slide_set->lz4_size = LZ4_compress_default((const char*)json->data, (char*)slide_set->lz4_data, (i32)json->len, bound);
+		if (slide_set->lz4_size <= 0 || (u64)slide_set->lz4_size >= json->len) {
+			free(slide_set->lz4_data);
+			slide_set->lz4_data = NULL;
+			slide_set->lz4_size = 0;
+		}
+	}
+	slide_set->ref_count = 1;
+	return slide_set;
+}
+
+// Returns the slide set with a reference added (see release_slide_set()), loading it if needed.
+static slide_set_t* get_slide_set(const char* filename) {
+	struct stat st;
+	if (stat(filename, &st) != 0) {
+		return NULL;
+	}
+	slide_set_t* result = NULL;
+	pthread_mutex_lock(&slide_sets_mutex);
+	for (i32 i = 0; i < slide_set_count; ++i) {
+		slide_set_t* slide_set = slide_sets[i];
+		if (strcmp(slide_set->filename, filename) == 0) {
+			if (slide_set->modification_time == st.st_mtime && slide_set->filesize == (i64)st.st_size) {
+				result = slide_set;
+				++result->ref_count;
+				result->last_used = ++slide_set_use_counter;
+			} else {
+				remove_slide_set(i); // the file was changed (responses still being sent keep the old one alive)
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&slide_sets_mutex);
+	if (result) return result;
+
+	// Read the file outside of the lock; if another client loads the same slide set meanwhile, there will briefly be two.
+	result = load_slide_set(filename, &st);
+	if (!result) return NULL;
+	pthread_mutex_lock(&slide_sets_mutex);
+	if (slide_set_count == SLIDE_SETS_MAX) {
+		i32 oldest = 0;
+		for (i32 i = 1; i < slide_set_count; ++i) {
+			if (slide_sets[i]->last_used < slide_sets[oldest]->last_used) oldest = i;
+		}
+		remove_slide_set(oldest);
+	}
+	result->last_used = ++slide_set_use_counter;
+	++result->ref_count; // (one for the table, one for the caller)
+	slide_sets[slide_set_count++] = result;
+	pthread_mutex_unlock(&slide_sets_mutex);
+	return result;
+}
+
+void queue_slide_set_warming(slide_set_t* slide_set);
+
+bool32 execute_slide_set_api_call(connection_t* connection, slide_api_call_t *call) {
+	bool32 success = false;
+
+	const char* full_filename = prepend_env_dir(call->filename, "SLIDES_DIR", alloca(2048), 2048);
+	slide_set_t* slide_set = get_slide_set(full_filename);
+	if (slide_set) {
+		char http_headers[4096];
+		if (call->if_none_match && strncmp(call->if_none_match, slide_set->etag, strlen(slide_set->etag)) == 0) {
+			// The client's copy is still current.
+			snprintf(http_headers, sizeof(http_headers),
+			         "HTTP/1.1 304 Not Modified\r\nConnection: keep-alive\r\nETag: %s\r\nContent-length: 0\r\n\r\n",
+			         slide_set->etag);
+			success = send_buffer_to_client(connection, (u8*)http_headers, strlen(http_headers));
+		} else if (call->accepts_lz4 && slide_set->lz4_data) {
+			snprintf(http_headers, sizeof(http_headers),
+			         "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-type: application/json\r\nETag: %s\r\n"
+			         "Content-encoding: " SLIDE_SET_LZ4_ENCODING "\r\nUncompressed-length: %llu\r\nContent-length: %d\r\n\r\n",
+			         slide_set->etag, (u64)slide_set->json->len, slide_set->lz4_size);
+			success = send_buffer_to_client(connection, (u8*)http_headers, strlen(http_headers)) &&
+			          send_buffer_to_client(connection, slide_set->lz4_data, slide_set->lz4_size);
+		} else {
+			snprintf(http_headers, sizeof(http_headers),
+			         "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-type: application/json\r\nETag: %s\r\n"
+			         "Content-length: %llu\r\n\r\n", slide_set->etag, (u64)slide_set->json->len);
+			success = send_buffer_to_client(connection, (u8*)http_headers, strlen(http_headers)) &&
+			          send_buffer_to_client(connection, slide_set->json->data, slide_set->json->len);
+		}
+		if (success) {
+			queue_slide_set_warming(slide_set);
+		}
+		release_slide_set(slide_set);
+	}
+
+	return success;
+}
+
+// If this server is one of several nodes (see shard_ring.h), it only serves its own share of the slides, so that its
+// caches only hold those. Requests for other slides are sent on to the node they belong to; clients that know the node
+// list (from /nodes) go there directly.
+shard_ring_t shard_ring;
+i32 shard_ring_self_index = -1;
+
+static void init_shard_ring(i32 port) {
+	const char* nodes_env = getenv("SERVER_NODES");
+	const char* self_env = getenv("SERVER_NODE");
+	if (!nodes_env || !nodes_env[0]) return;
+	if (!shard_ring_parse(&shard_ring, nodes_env, port)) {
+		fprintf(stderr, "SERVER_NODES has no usable nodes; serving all slides\n");
+		return;
+	}
+	shard_ring_t self = {0};
+	if (self_env && shard_ring_parse(&self, self_env, port)) {
+		shard_ring_self_index = shard_ring_find_node(&shard_ring, self.nodes[0].hostname, self.nodes[0].portno);
+		shard_ring_destroy(&self);
+	}
+	if (shard_ring_self_index < 0) {
+		fprintf(stderr, "SERVER_NODE (this node, as host:port) is not in SERVER_NODES; serving all slides\n");
+		shard_ring_destroy(&shard_ring);
+		return;
+	}
+	fprintf(stderr, "Node %d of %d: serving a share of the slides\n", shard_ring_self_index + 1, shard_ring.node_count);
+}
+
+// Returns the node that the slide belongs to, or NULL if that is this server.
+static shard_node_t* get_other_slide_node(const char* slide_name) {
+	if (shard_ring_self_index < 0) return NULL;
+	i32 node_index = shard_ring_lookup(&shard_ring, slide_name);
+	if (node_index < 0 || node_index == shard_ring_self_index) return NULL;
+	return shard_ring.nodes + node_index;
+}
+
+static bool32 send_redirect_to_node(connection_t* connection, slide_api_call_t* call, shard_node_t* node) {
+	char http_headers[4096];
+	snprintf(http_headers, sizeof(http_headers),
+	         "HTTP/1.1 307 Temporary Redirect\r\nConnection: keep-alive\r\n%sLocation: https://%s:%d%s\r\n"
+	         "Slide-node: %s:%d\r\nContent-length: 0\r\n\r\n", connection->stream_header_field, node->hostname,
+	         node->portno, call->uri ? call->uri : "/", node->hostname, node->portno);
+	return send_buffer_to_client(connection, (u8*)http_headers, strlen(http_headers));
+}
+
+// The node list (empty if this server serves all slides by itself).
+bool32 execute_nodes_api_call(connection_t* connection) {
+	char body[SHARD_RING_MAX_NODES * 300];
+	shard_ring_format(&shard_ring, body, sizeof(body) - 1);
+	if (shard_ring.node_count > 0) strcat(body, "\n");
+	char http_headers[256];
+	snprintf(http_headers, sizeof(http_headers),
+	         "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-type: text/plain\r\nContent-length: %llu\r\n\r\n",
+	         (u64)strlen(body));
+	return send_buffer_to_client(connection, (u8*)http_headers, strlen(http_headers)) &&
+	       (body[0] == '\0' || send_buffer_to_client(connection, (u8*)body, strlen(body)));
+}
+
+// The stats in the Prometheus text format (GET /stats), for scraping. Only reads the counters: the per-thread blocks
+// and the tile cache counters are read without taking any locks, so scraping never holds up a request. (Each value is
+// read whole, but they may be from slightly different moments.)
+typedef struct {
+	char* data;
+	i64 size;
+	i64 capacity;
+} metrics_text_t;
+
+static void append_metrics(metrics_text_t* text, const char* format, ...) {
+	for (;;) {
+		va_list args;
+		va_start(args, format);
+		i32 length = vsnprintf(text->data + text->size, text->capacity - text->size, format, args);
+		va_end(args);
+		if (length < 0) return;
+		if (text->size + length < text->capacity) {
+			text->size += length;
+			return;
+		}
+		text->capacity = MAX(2 * text->capacity, text->size + length + 1);
+		text->data = realloc(text->data, text->capacity);
+	}
+}
+
+static void append_tile_cache_metrics(metrics_text_t* text, tile_cache_t* shards, const char* cache_name) {
+	i64 hit_count = 0, miss_count = 0, eviction_count = 0, entry_count = 0, memory_used = 0, budget = 0;
+	for (i32 i = 0; i < TILE_CACHE_SHARD_COUNT; ++i) {
+		volatile tile_cache_t* shard = shards + i;
+		hit_count += shard->hit_count;
+		miss_count += shard->miss_count;
+		eviction_count += shard->eviction_count;
+		entry_count += shard->entry_count;
+		memory_used += shard->memory_used;
+		budget += shard->budget;
+	}
+	append_metrics(text, "tlsserver_tile_cache_hits_total{cache=\"%s\"} %lld\n", cache_name, hit_count);
+	append_metrics(text, "tlsserver_tile_cache_misses_total{cache=\"%s\"} %lld\n", cache_name, miss_count);
+	append_metrics(text, "tlsserver_tile_cache_evictions_total{cache=\"%s\"} %lld\n", cache_name, eviction_count);
+	append_metrics(text, "tlsserver_tile_cache_entries{cache=\"%s\"} %lld\n", cache_name, entry_count);
+	append_metrics(text, "tlsserver_tile_cache_memory_bytes{cache=\"%s\"} %lld\n", cache_name, memory_used);
+	append_metrics(text, "tlsserver_tile_cache_budget_bytes{cache=\"%s\"} %lld\n", cache_name, budget);
+}
+
+i32 get_ready_connection_count();
+
+bool32 execute_metrics_api_call(connection_t* connection) {
+	// Sum up the blocks of the threads.
+	thread_metrics_t total = {0};
+	i32 thread_count = ATMOST(thread_metrics_count, METRICS_MAX_THREADS);
+	for (i32 t = 0; t <= thread_count; ++t) {
+		thread_metrics_t* metrics = (t < thread_count) ? thread_metrics[t] : &shared_thread_metrics;
+		if (!metrics) continue; // (still being registered)
+		for (i32 i = 0; i < REQUEST_TYPE_COUNT; ++i) {
+			total.request_counts[i] += metrics->request_counts[i];
+			total.failed_request_counts[i] += metrics->failed_request_counts[i];
+		}
+		total.bytes_sent += metrics->bytes_sent;
+		total.header_cache_hit_count += metrics->header_cache_hit_count;
+		total.header_cache_miss_count += metrics->header_cache_miss_count;
+		total.file_read_count += metrics->file_read_count;
+		total.file_read_microseconds += metrics->file_read_microseconds;
+		for (i32 i = 0; i < FILE_READ_LATENCY_BUCKET_COUNT + 1; ++i) {
+			total.file_read_buckets[i] += metrics->file_read_buckets[i];
+		}
+		total.datagram_tile_count += metrics->datagram_tile_count;
+		total.datagram_fragment_count += metrics->datagram_fragment_count;
+		total.warmed_tile_count += metrics->warmed_tile_count;
+	}
+
+	metrics_text_t text = { .data = malloc(KILOBYTES(8)), .capacity = KILOBYTES(8) };
+	append_metrics(&text, "# TYPE tlsserver_requests_total counter\n");
+	for (i32 i = 0; i < REQUEST_TYPE_COUNT; ++i) {
+		append_metrics(&text, "tlsserver_requests_total{type=\"%s\"} %lld\n", request_type_names[i], total.request_counts[i]);
+	}
+	append_metrics(&text, "# TYPE tlsserver_failed_requests_total counter\n");
+	for (i32 i = 0; i < REQUEST_TYPE_COUNT; ++i) {
+		append_metrics(&text, "tlsserver_failed_requests_total{type=\"%s\"} %lld\n", request_type_names[i],
+		               total.failed_request_counts[i]);
+	}
+	append_metrics(&text, "# TYPE tlsserver_sent_bytes_total counter\ntlsserver_sent_bytes_total %lld\n", total.bytes_sent);
+	append_metrics(&text, "# TYPE tlsserver_open_connections gauge\ntlsserver_open_connections %d\n", open_connection_count);
+	append_metrics(&text, "# HELP tlsserver_ready_connections Connections waiting for a worker.\n"
+	                      "# TYPE tlsserver_ready_connections gauge\ntlsserver_ready_connections %d\n", get_ready_connection_count());
+	append_metrics(&text, "# TYPE tlsserver_open_slides gauge\ntlsserver_open_slides %d\n", open_slide_count);
+
+	append_metrics(&text, "# TYPE tlsserver_tls_handshakes_total counter\n");
+	append_metrics(&text, "tlsserver_tls_handshakes_total{kind=\"full\"} %lld\n", (i64)handshake_stats.full_count);
+	append_metrics(&text, "tlsserver_tls_handshakes_total{kind=\"resumed\"} %lld\n", (i64)handshake_stats.resumed_count);
+	append_metrics(&text, "tlsserver_tls_handshakes_total{kind=\"failed\"} %lld\n", (i64)handshake_stats.failed_count);
+	append_metrics(&text, "# HELP tlsserver_tls_handshake_seconds_total CPU time spent on the handshake messages.\n"
+	                      "# TYPE tlsserver_tls_handshake_seconds_total counter\n");
+	append_metrics(&text, "tlsserver_tls_handshake_seconds_total{kind=\"full\"} %.6f\n",
+	               (double)handshake_stats.full_microseconds * 1e-6);
+	append_metrics(&text, "tlsserver_tls_handshake_seconds_total{kind=\"resumed\"} %.6f\n",
+	               (double)handshake_stats.resumed_microseconds * 1e-6);
+
+	append_metrics(&text, "# TYPE tlsserver_header_cache_hits_total counter\ntlsserver_header_cache_hits_total %lld\n",
+	               total.header_cache_hit_count);
+	append_metrics(&text, "# TYPE tlsserver_header_cache_misses_total counter\ntlsserver_header_cache_misses_total %lld\n",
+	               total.header_cache_miss_count);
+	append_tile_cache_metrics(&text, tile_cache_shards, "tile");
+	append_tile_cache_metrics(&text, decoded_tile_cache_shards, "decoded");
+	append_tile_cache_metrics(&text, dzi_tile_cache_shards, "dzi");
+	append_tile_cache_metrics(&text, reduced_tile_cache_shards, "reduced");
+	append_metrics(&text, "# HELP tlsserver_shared_chunk_reads_total Chunks that were read once for concurrent requests.\n"
+	                      "# TYPE tlsserver_shared_chunk_reads_total counter\ntlsserver_shared_chunk_reads_total %lld\n",
+	               (i64)shared_chunk_read_count);
+
+	append_metrics(&text, "# HELP tlsserver_file_read_seconds Latency of the file reads, per batch of reads.\n"
+	                      "# TYPE tlsserver_file_read_seconds histogram\n");
+	i64 cumulative_count = 0;
+	for (i32 i = 0; i < FILE_READ_LATENCY_BUCKET_COUNT; ++i) {
+		cumulative_count += total.file_read_buckets[i];
+		append_metrics(&text, "tlsserver_file_read_seconds_bucket{le=\"%g\"} %lld\n", file_read_latency_bounds[i],
+		               cumulative_count);
+	}
+	cumulative_count += total.file_read_buckets[FILE_READ_LATENCY_BUCKET_COUNT];
+	append_metrics(&text, "tlsserver_file_read_seconds_bucket{le=\"+Inf\"} %lld\n", cumulative_count);
+	append_metrics(&text, "tlsserver_file_read_seconds_sum %.6f\n", (double)total.file_read_microseconds * 1e-6);
+	append_metrics(&text, "tlsserver_file_read_seconds_count %lld\n", cumulative_count);
+
+	append_metrics(&text, "# TYPE tlsserver_datagram_tiles_total counter\ntlsserver_datagram_tiles_total %lld\n",
+	               total.datagram_tile_count);
+	append_metrics(&text, "# TYPE tlsserver_datagram_fragments_total counter\ntlsserver_datagram_fragments_total %lld\n",
+	               total.datagram_fragment_count);
+	append_metrics(&text, "# TYPE tlsserver_warmed_tiles_total counter\ntlsserver_warmed_tiles_total %lld\n",
+	               total.warmed_tile_count);
+
+	char http_headers[256];
+	snprintf(http_headers, sizeof(http_headers),
+	         "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-type: text/plain; version=0.0.4\r\n"
+	         "Content-length: %llu\r\n\r\n", (u64)text.size);
+	bool32 success = send_buffer_to_client(connection, (u8*)http_headers, strlen(http_headers)) &&
+	                 send_buffer_to_client(connection, (u8*)text.data, text.size);
+	free(text.data);
+	return success;
+}
+
+static request_type_enum get_request_type(slide_api_call_t* call) {
+	if (!call || !call->command) return REQUEST_TYPE_OTHER;
+	if (strcmp(call->command, "slide") == 0) {
+		if (call->parameter1 && strcmp(call->parameter1, "region") == 0) return REQUEST_TYPE_REGION;
+		if (call->parameter1 && strcmp(call->parameter1, "header") == 0) return REQUEST_TYPE_HEADER;
+		if (call->parameter1 && call->parameter2) return REQUEST_TYPE_CHUNKS;
+	}
+	if (strcmp(call->command, "tiles") == 0) return REQUEST_TYPE_TILES;
+	if (strcmp(call->command, "dzi") == 0) return REQUEST_TYPE_DZI;
+	if (strcmp(call->command, "slide_set") == 0) return REQUEST_TYPE_SLIDE_SET;
+	if (strcmp(call->command, "stats") == 0) return REQUEST_TYPE_STATS;
+	if (strcmp(call->command, "nodes") == 0) return REQUEST_TYPE_NODES;
+	if (strcmp(call->command, "catalog") == 0) return REQUEST_TYPE_CATALOG;
+	return REQUEST_TYPE_OTHER;
+}
+
+static void count_request(slide_api_call_t* call, bool32 success) {
+	thread_metrics_t* metrics = get_thread_metrics();
+	request_type_enum type = get_request_type(call);
+	++metrics->request_counts[type];
+	if (!success) ++metrics->failed_request_counts[type];
+}
+
+bool32 execute_region_api_call(connection_t* connection, slide_api_call_t* call, const char* filename);
+bool32 execute_dzi_api_call(connection_t* connection, slide_api_call_t* call);
+bool32 execute_catalog_api_call(connection_t* connection, slide_api_call_t* call);
+bool32 execute_datagram_api_call(connection_t* connection);
+
+bool32 execute_slide_api_call(connection_t* connection, slide_api_call_t *call) {
+	if (!call || !call->command) return false;
+	bool32 success = false;
+
+	if (strcmp(call->command, "slide_set") == 0) {
+		success = execute_slide_set_api_call(connection, call);
+	}
+
+	else if (strcmp(call->command, "tiles") == 0) {
+		success = execute_tiles_api_call(connection, call);
+	}
+
+	else if (strcmp(call->command, "stats") == 0) {
+		// (GET /stats/json has the older summary, as JSON)
+		if (call->filename && strcmp(call->filename, "json") == 0) {
+			success = execute_stats_api_call(connection);
+		} else {
+			success = execute_metrics_api_call(connection);
+		}
+	}
+
+	else if (strcmp(call->command, "nodes") == 0) {
+		success = execute_nodes_api_call(connection);
+	}
+
+	else if (strcmp(call->command, "dzi") == 0) {
+		success = execute_dzi_api_call(connection, call);
+	}
+
+	else if (strcmp(call->command, "catalog") == 0) {
+		success = execute_catalog_api_call(connection, call);
+	}
+
+	else if (strcmp(call->command, "datagram") == 0) {
+		success = execute_datagram_api_call(connection);
+	}
+
+	else if (strcmp(call->command, "slide") == 0) {
+		shard_node_t* node = call->filename ? get_other_slide_node(call->filename) : NULL;
+		if (node) return send_redirect_to_node(connection, call, node);
+
+		// If the SLIDES_DIR environment variable is set, load slides from there
+		const char* filename_full_path = prepend_env_dir(call->filename, "SLIDES_DIR", alloca(2048), 2048);
+
+
+		char* parameter1 = call->parameter1;
+		char* parameter2 = call->parameter2;
+		if (filename_full_path && parameter1 && strcmp(parameter1, "region") == 0) {
+			success = execute_region_api_call(connection, call, filename_full_path);
+		}
+		// is the client requesting TIFF header and metadata?
+		else if (parameter1 && strcmp(parameter1, "header") == 0) {
+			if (filename_full_path) {
+				u32 slide_handle = 0;
+				tiff_t temp_tiff = {0};
+				push_buffer_t temp_buffer = {0};
+				push_buffer_t* buffer = NULL;
+				open_slide_t* slide = get_open_slide_by_filename(filename_full_path, &slide_handle);
+				if (slide) {
+					buffer = get_serialized_slide_header(slide);
+				} else if (open_tiff_file(&temp_tiff, filename_full_path)) {
+					// no room to keep it open; tiles will have to be requested by byte range
+					++get_thread_metrics()->header_cache_miss_count;
+					buffer = tiff_serialize(&temp_tiff, &temp_buffer);
+				}
+				if (buffer) {
+					// Replace the HTTP headers prepared by tiff_serialize(), to also pass on the handle for tile requests.
+					char http_headers[4096];
+					snprintf(http_headers, sizeof(http_headers),
+					         "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-type: application/octet-stream\r\n"
+					         "Slide-handle: %u\r\nContent-length: %llu\r\n\r\n", slide_handle, buffer->used_size);
+					success = send_buffer_to_client(connection, (u8*)http_headers, strlen(http_headers)) &&
+					          send_buffer_to_client(connection, buffer->data, buffer->used_size);
+
+//				    tls_close_notify(context);
+//				    send_pending(client_sock, context);
+					if (buffer == &temp_buffer) {
+						free(temp_buffer.raw_memory);
+						tiff_destroy(&temp_tiff);
+					}
+				} else {
+					log_warning("Couldn't open TIFF file %s\n", filename_full_path);
+					success = false;
+				}
+
+
+			}
+		}
+		else if (parameter1 && parameter2){
+
+			// try to interpret as batch
+			i32 batch_size = (call->par_count - 2) / 2; // minus two, because 'command' and 'filename' are also counted
+			ASSERT(batch_size >= 1);
+			i64* chunk_offsets = alloca(batch_size * sizeof(i64));
+			i64* chunk_sizes = alloca(batch_size * sizeof(i64));
+			i64 total_size = 0;
+			for (i32 i = 0; i < batch_size; ++i) {
+				// try to interpret the parameters as numbers
+				chunk_offsets[i] = atoll(call->pars[2+2*i]);
+				chunk_sizes[i] = atoll(call->pars[3+2*i]);
+				total_size += chunk_sizes[i];
+			}
+
+
+			if (total_size > 0) {
+
+				// Use the open slide's file if there is one, instead of opening the file again.
+				u32 slide_handle = 0;
+				open_slide_t* slide = get_open_slide_by_filename(filename_full_path, &slide_handle);
+				cached_file_t* cached_file = NULL;
+				FILE* fp = slide ? slide->tiff.fp : acquire_cached_file(filename_full_path, &cached_file);
+				if (fp) {
+					char http_headers[4096];
+					snprintf(http_headers, sizeof(http_headers),
+					         "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-type: application/octet-stream\r\nContent-length: %llu\r\n\r\n",
+					         total_size);
+					u64 http_headers_size = strlen(http_headers);
+
+					// Chunks past the end of the slide file belong to generated levels (see load_pyramid_sidecar()).
+					bool32 has_generated_chunks = false;
+					for (i32 i = 0; i < batch_size && slide && slide->pyramid.fp; ++i) {
+						if ((u64)chunk_offsets[i] >= slide->pyramid.base_offset) has_generated_chunks = true;
+					}
+
+#if SERVER_KTLS
+					if (connection->is_ktls && !has_generated_chunks) {
+						success = send_file_ranges_to_client(connection, (u8*)http_headers, http_headers_size,
+						                                     fileno(fp), chunk_offsets, chunk_sizes, batch_size);
+						if (!slide) release_cached_file(fp, cached_file);
+						return success;
+					}
+#endif
+
+					u64 send_size = http_headers_size + total_size;
+					u8* send_buffer = malloc(send_size);
+					memcpy(send_buffer, http_headers, http_headers_size);
+					u8* data_buffer = send_buffer + http_headers_size;
+					u8* data_buffer_pos = data_buffer;
+
+					bool32 ok = true;
+
+#if WINDOWS
+					for (i32 i = 0; i < batch_size; ++i) {
+						// try to interpret the parameters as numbers
+						i64 requested_offset = chunk_offsets[i];
+						i64 requested_size = chunk_sizes[i];
+						if (!slide || !server_tile_cache_lookup(slide_handle, requested_offset, data_buffer_pos, (u32)requested_size)) {
+							u64 file_offset = (u64)requested_offset;
+							volatile i32* fp_lock = NULL;
+							FILE* chunk_fp = slide ? pyramid_resolve_offset(&slide->tiff, &slide->pyramid, &file_offset, &fp_lock) : fp;
+							if (cached_file) fp_lock = &cached_file->fp_lock;
+							i64 read_start = get_microseconds();
+							if (fp_lock) spin_lock(fp_lock); // the file position is shared
+							fseeko64(chunk_fp, file_offset, SEEK_SET);
+							ok = ok && (fread(data_buffer_pos, requested_size, 1, chunk_fp) == 1);
+							if (fp_lock) spin_unlock(fp_lock);
+							record_file_read(get_microseconds() - read_start);
+							if (!ok) {
+								log_warning("Error reading from %s\n", call->filename);
+							} else if (slide) {
+								server_tile_cache_insert(slide_handle, requested_offset, data_buffer_pos, (u32)requested_size);
+							}
+						}
+						data_buffer_pos += requested_size;
+					}
+#else
+					// Read all the chunks at once, so that the reads are in flight together.
+					// Chunks of open slides may already be in the cache, or being read by another request.
+					io_read_request_t* requests = alloca(batch_size * sizeof(io_read_request_t));
+					i32* requested_chunk_indices = alloca(batch_size * sizeof(i32));
+					i32* inflight_slots = alloca(batch_size * sizeof(i32));
+					io_read_request_t* shared_requests = alloca(batch_size * sizeof(io_read_request_t));
+					i32* shared_chunk_indices = alloca(batch_size * sizeof(i32));
+					i32* shared_inflight_slots = alloca(batch_size * sizeof(i32));
+					i32 request_count = 0;
+					i32 shared_count = 0;
+					for (i32 i = 0; i < batch_size; ++i) {
+						if (!slide || !server_tile_cache_lookup(slide_handle, (u64)chunk_offsets[i], data_buffer_pos,
+						                                        (u32)chunk_sizes[i])) {
+							u64 file_offset = (u64)chunk_offsets[i];
+							volatile i32* fp_lock = NULL;
+							FILE* chunk_fp = slide ? pyramid_resolve_offset(&slide->tiff, &slide->pyramid, &file_offset, &fp_lock) : fp;
+							io_read_request_t chunk_request = { .file = fileno(chunk_fp), .offset = file_offset,
+							                                    .size = (u32)chunk_sizes[i], .dest = data_buffer_pos };
+							bool32 is_reader = true;
+							i32 slot = slide ? claim_inflight_chunk(server_tile_cache_key(slide_handle, (u64)chunk_offsets[i]),
+							                                        &is_reader) : -1;
+							if (is_reader) {
+								requested_chunk_indices[request_count] = i;
+								inflight_slots[request_count] = slot;
+								requests[request_count++] = chunk_request;
+							} else {
+								shared_chunk_indices[shared_count] = i;
+								shared_inflight_slots[shared_count] = slot;
+								shared_requests[shared_count++] = chunk_request;
+							}
+						}
+						data_buffer_pos += chunk_sizes[i];
+					}
+					ok = (request_count == 0) || timed_io_read_batch(requests, request_count);
+					for (i32 i = 0; i < request_count; ++i) {
+						if (ok && slide) {
+							// (the cache is keyed by the offset as requested, which may differ from the offset in the file)
+							server_tile_cache_insert(slide_handle, (u64)chunk_offsets[requested_chunk_indices[i]],
+							                         requests[i].dest, requests[i].size);
+						}
+						finish_inflight_chunk(inflight_slots[i]);
+					}
+					// The chunks that another request was reading: take them from the cache, or else read them after all.
+					i32 remaining_count = 0;
+					for (i32 i = 0; i < shared_count; ++i) {
+						wait_for_inflight_chunk(shared_inflight_slots[i]);
+						io_read_request_t* shared_request = shared_requests + i;
+						if (server_tile_cache_lookup(slide_handle, (u64)chunk_offsets[shared_chunk_indices[i]],
+						                             shared_request->dest, shared_request->size)) {
+							interlocked_add_i64(&shared_chunk_read_count, 1);
+						} else {
+							shared_requests[remaining_count++] = *shared_request;
+						}
+					}
+					if (ok && remaining_count > 0) {
+						ok = timed_io_read_batch(shared_requests, remaining_count);
+					}
+					if (!ok) {
+						log_warning("Error reading from %s\n", call->filename);
+					}
+#endif
+
+					if (ok) {
+						success = send_buffer_to_client(connection, send_buffer, send_size);
+					}
+					free(send_buffer);
+					if (!slide) release_cached_file(fp, cached_file);
+				}
+
+			}
+		}
+	} else {
+		log_warning("Slide API: unknown command %s\n", call->command);
+	};
+	return success;
+}
+
+struct TLSContext *server_context;
+
+// The server is event-driven: the main thread waits (with poll()) for data on all open connections, and hands a
+// connection that has become readable to one of the worker threads. The worker reads whatever has arrived without
+// blocking, advances the TLS handshake, and serves the requests that are complete; then the connection goes back to
+// the main thread. So a connection only ties up a thread while there is something to do for it.
+
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	connection_t* first;
+	connection_t* last;
+	volatile i32 count; // (the stats API call reads it without the mutex)
+} connection_queue_t;
+
+connection_queue_t ready_connections = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER }; // for the workers
+
+// (for the stats; read without taking the mutex)
+i32 get_ready_connection_count() {
+	return ((volatile connection_queue_t*)&ready_connections)->count;
+}
+connection_t* finished_connections; // handed back to the main thread
+i32 finished_connections_lock;
+int wake_socket = -1;
+
+// Fair scheduling between clients (told apart by their address, so that opening more connections doesn't help):
+// - Each client has a virtual time, the number of bytes it has been sent so far, where bytes sent for bulk requests
+//   (prefetched tiles, exports) count BULK_TRAFFIC_WEIGHT times. Of the connections that are ready, the one of the
+//   client with the lowest virtual time goes first, so a client that keeps the server busy yields to the others.
+// - Connections whose last request was interactive go before bulk ones, unless a bulk connection has been waiting
+//   for longer than BULK_MAX_WAIT_MICROSECONDS (so that it is never starved).
+// - A connection that is busy with bulk requests stops after each pass (see serve_buffered_requests()) if others are
+//   waiting, and goes back into the ready queue behind them.
+// - Optionally, the bulk traffic of each client is capped (SERVER_CLIENT_BULK_MBPS, in megabytes per second).
+#define SERVER_CLIENTS_MAX MAX_CONNECTION_COUNT
+#define BULK_TRAFFIC_WEIGHT 4
+#define BULK_MAX_WAIT_MICROSECONDS 250000
+
+typedef struct server_client_t {
+	u32 address; // IPv4, in network byte order
+	i32 connection_count; // the entry is free when this is 0
+	i64 virtual_time;
+	double bulk_bandwidth_tokens; // bytes of bulk traffic that may still be sent, if there is a cap
+	i64 last_refill_microseconds;
+} server_client_t;
+
+// Guarded by ready_connections.mutex:
+server_client_t server_clients[SERVER_CLIENTS_MAX];
+i64 server_virtual_time; // the virtual time of the client that was served last
+double client_bulk_bytes_per_second; // 0 = no cap
+
+server_client_t* acquire_server_client(u32 address) {
+	pthread_mutex_lock(&ready_connections.mutex);
+	server_client_t* result = NULL;
+	server_client_t* free_entry = NULL;
+	for (i32 i = 0; i < SERVER_CLIENTS_MAX; ++i) {
+		server_client_t* client = server_clients + i;
+		if (client->connection_count > 0 && client->address == address) {
+			result = client;
+			break;
+		} else if (client->connection_count == 0 && !free_entry) {
+			free_entry = client;
+		}
+	}
+	if (!result && free_entry) {
+		result = free_entry;
+		*result = (server_client_t){ .address = address, .virtual_time = server_virtual_time,
+		                             .bulk_bandwidth_tokens = client_bulk_bytes_per_second,
+		                             .last_refill_microseconds = get_microseconds() };
+	}
+	if (result) ++result->connection_count;
+	pthread_mutex_unlock(&ready_connections.mutex);
+	return result;
+}
+
+void release_server_client(server_client_t* client) {
+	if (!client) return;
+	pthread_mutex_lock(&ready_connections.mutex);
+	--client->connection_count;
+	pthread_mutex_unlock(&ready_connections.mutex);
+}
+
+// Charges what was sent since last time to the client. Needs ready_connections.mutex.
+static void account_connection_traffic(connection_t* connection, i64 now) {
+	server_client_t* client = connection->client;
+	i64 bytes = connection->bytes_sent - connection->accounted_bytes_sent;
+	connection->accounted_bytes_sent = connection->bytes_sent;
+	connection->not_before_microseconds = 0;
+	if (!client) return;
+	client->virtual_time += connection->is_bulk ? bytes * BULK_TRAFFIC_WEIGHT : bytes;
+	if (connection->is_bulk && client_bulk_bytes_per_second > 0.0) {
+		double refill = (double)(now - client->last_refill_microseconds) * 1e-6 * client_bulk_bytes_per_second;
+		client->bulk_bandwidth_tokens = MIN(client->bulk_bandwidth_tokens + refill, client_bulk_bytes_per_second);
+		client->last_refill_microseconds = now;
+		client->bulk_bandwidth_tokens -= (double)bytes;
+		if (client->bulk_bandwidth_tokens < 0.0) {
+			// Over the cap: hold the connection back until the deficit has been made up.
+			connection->not_before_microseconds = now +
+					(i64)(-client->bulk_bandwidth_tokens / client_bulk_bytes_per_second * 1e6);
+		}
+	}
+}
+
+// For connections that go back to the main thread (see return_connection()).
+void charge_connection_traffic(connection_t* connection) {
+	i64 now = get_microseconds();
+	pthread_mutex_lock(&ready_connections.mutex);
+	account_connection_traffic(connection, now);
+	pthread_mutex_unlock(&ready_connections.mutex);
+}
+
+void push_ready_connection(connection_t* connection) {
+	connection->next = NULL;
+	i64 now = get_microseconds();
+	pthread_mutex_lock(&ready_connections.mutex);
+	account_connection_traffic(connection, now);
+	connection->ready_microseconds = now;
+	server_client_t* client = connection->client;
+	if (client && client->virtual_time < server_virtual_time) {
+		client->virtual_time = server_virtual_time; // a client that was idle doesn't get to catch up
+	}
+	if (ready_connections.last) {
+		ready_connections.last->next = connection;
+	} else {
+		ready_connections.first = connection;
+	}
+	ready_connections.last = connection;
+	++ready_connections.count;
+	pthread_cond_signal(&ready_connections.cond);
+	pthread_mutex_unlock(&ready_connections.mutex);
+}
+
+// Rendering a region (see execute_region_api_call()) is split up into a task per tile, which the workers pick up
+// while waiting for connections. The worker that serves the request works on the tiles as well, so the region gets
+// rendered even if all the other workers are busy.
+typedef struct region_render_t {
+	open_slide_t* slide;
+	u32 slide_handle;
+	tiff_ifd_t* ifd;
+	i32 x, y, width, height; // the region, in pixels of the level
+	u8* pixels; // BGRA, width * height
+	i32 first_tile_x, first_tile_y, width_in_tiles;
+	i32 tile_count;
+	i32 next_tile; // the next tile to hand out; guarded by ready_connections.mutex
+	i32 tiles_remaining; // guarded by done_mutex
+	bool32 failed;
+	pthread_mutex_t done_mutex;
+	pthread_cond_t done_cond;
+	struct region_render_t* next;
+} region_render_t;
+
+region_render_t* active_region_renders; // the regions that still have tiles to hand out; guarded by ready_connections.mutex
+
+void render_region_tile(region_render_t* region, i32 tile);
+
+// Needs ready_connections.mutex. Regions of which all tiles have been handed out are taken off the list.
+region_render_t* claim_region_tile(i32* tile) {
+	while (active_region_renders) {
+		region_render_t* region = active_region_renders;
+		if (region->next_tile < region->tile_count) {
+			*tile = region->next_tile++;
+			return region;
+		}
+		active_region_renders = region->next;
+	}
+	return NULL;
+}
+
+static bool32 goes_before(connection_t* a, connection_t* b, i64 now) {
+	bool32 a_is_interactive = !a->is_bulk || now - a->ready_microseconds > BULK_MAX_WAIT_MICROSECONDS;
+	bool32 b_is_interactive = !b->is_bulk || now - b->ready_microseconds > BULK_MAX_WAIT_MICROSECONDS;
+	if (a_is_interactive != b_is_interactive) return a_is_interactive;
+	i64 a_time = a->client ? a->client->virtual_time : server_virtual_time;
+	i64 b_time = b->client ? b->client->virtual_time : server_virtual_time;
+	return a_time < b_time;
+}
+
+// Takes the connection that should be served next out of the ready queue (see above), or returns NULL if all of them
+// are held back by the bandwidth cap; *wait_until is then set to when the first one may go. Needs
+// ready_connections.mutex.
+static connection_t* take_next_ready_connection_or_wait(i64* wait_until) {
+	i64 now = get_microseconds();
+	connection_t* best = NULL;
+	connection_t* best_previous = NULL;
+	connection_t* previous = NULL;
+	*wait_until = 0;
+	for (connection_t* connection = ready_connections.first; connection; previous = connection, connection = connection->next) {
+		if (connection->not_before_microseconds > now) {
+			if (*wait_until == 0 || connection->not_before_microseconds < *wait_until) {
+				*wait_until = connection->not_before_microseconds;
+			}
+			continue;
+		}
+		if (!best || goes_before(connection, best, now)) {
+			best = connection;
+			best_previous = previous;
+		}
+	}
+	if (!best) return NULL;
+	if (best_previous) {
+		best_previous->next = best->next;
+	} else {
+		ready_connections.first = best->next;
+	}
+	if (ready_connections.last == best) {
+		ready_connections.last = best_previous;
+	}
+	--ready_connections.count;
+	best->next = NULL;
+	if (best->client && best->client->virtual_time > server_virtual_time) {
+		server_virtual_time = best->client->virtual_time;
+	}
+	return best;
+}
+
+// Are other connections waiting for a worker? (A bulk connection then lets them go first.)
+bool32 are_other_connections_ready() {
+	pthread_mutex_lock(&ready_connections.mutex);
+	bool32 result = (ready_connections.first != NULL);
+	pthread_mutex_unlock(&ready_connections.mutex);
+	return result;
+}
+
+// Waits for a connection that has become readable. Returns NULL instead if the worker rendered a tile of a region
+// in the meantime; the tiles come first, because a client is already waiting for them.
+connection_t* pop_ready_connection() {
+	pthread_mutex_lock(&ready_connections.mutex);
+	connection_t* connection = NULL;
+	for (;;) {
+		while (!ready_connections.first && !active_region_renders) {
+			pthread_cond_wait(&ready_connections.cond, &ready_connections.mutex);
+		}
+		i32 tile = 0;
+		region_render_t* region = claim_region_tile(&tile);
+		if (region) {
+			pthread_mutex_unlock(&ready_connections.mutex);
+			render_region_tile(region, tile);
+			return NULL;
+		}
+		i64 wait_until = 0;
+		connection = take_next_ready_connection_or_wait(&wait_until);
+		if (connection) break;
+		if (wait_until) {
+			// Everything that is ready is held back by the bandwidth cap. (The deadline is in CLOCK_REALTIME.)
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			i64 nanoseconds = deadline.tv_nsec + MAX(0, wait_until - get_microseconds()) * 1000;
+			deadline.tv_sec += (time_t)(nanoseconds / 1000000000);
+			deadline.tv_nsec = (long)(nanoseconds % 1000000000);
+			pthread_cond_timedwait(&ready_connections.cond, &ready_connections.mutex, &deadline);
+		}
+	}
+	pthread_mutex_unlock(&ready_connections.mutex);
+	return connection;
+}
+
+// Hands the connection back to the main thread, so that it will be watched again.
+void return_connection(connection_t* connection) {
+	spin_lock(&finished_connections_lock);
+	connection->next = finished_connections;
+	finished_connections = connection;
+	spin_unlock(&finished_connections_lock);
+	u8 dummy = 0;
+	send(wake_socket, (char*)&dummy, 1, 0);
+}
+
+static THREAD_LOCAL jpeg_decoder_state_t* region_decoder_state;
+static THREAD_LOCAL u8* region_compressed_buffer;
+static THREAD_LOCAL u64 region_compressed_buffer_capacity;
+static THREAD_LOCAL u8* region_decoded_buffer;
+static THREAD_LOCAL u64 region_decoded_buffer_capacity;
+
+static u8* get_thread_buffer(u8** buffer, u64* capacity, u64 size) {
+	if (size > *capacity) {
+		free(*buffer);
+		*buffer = malloc(size);
+		*capacity = size;
+	}
+	return *buffer;
+}
+
+// Gets the compressed data of a tile: from the file mapping, from the tile cache, or else from the file (or the
+// sidecar file, for generated levels). Returns NULL if it can't be read.
+static u8* read_slide_tile(open_slide_t* slide, u32 slide_handle, u64 offset, u32 size) {
+	u8* mapped = tiff_get_mapped_range(&slide->tiff, offset, size);
+	if (mapped) return mapped;
+	u8* buffer = get_thread_buffer(&region_compressed_buffer, &region_compressed_buffer_capacity, size);
+	if (server_tile_cache_lookup(slide_handle, offset, buffer, size)) return buffer;
+	u64 file_offset = offset;
+	volatile i32* fp_lock = NULL;
+	FILE* fp = pyramid_resolve_offset(&slide->tiff, &slide->pyramid, &file_offset, &fp_lock);
+	spin_lock(fp_lock); // the file position is shared
+	bool32 ok = (file_read_at_offset(buffer, fp, file_offset, size) == 1);
+	spin_unlock(fp_lock);
+	if (!ok) return NULL;
+	server_tile_cache_insert(slide_handle, offset, buffer, size);
+	return buffer;
+}
+
+// Decodes a tile of the region (or gets it from the decoded tile cache), and copies the part that overlaps the
+// region into place. The tiles don't overlap each other, so the workers can do this at the same time.
+void render_region_tile(region_render_t* region, i32 tile) {
+	tiff_ifd_t* ifd = region->ifd;
+	i32 tile_x = region->first_tile_x + tile % region->width_in_tiles;
+	i32 tile_y = region->first_tile_y + tile / region->width_in_tiles;
+	u32 tile_index = (u32)tile_y * ifd->width_in_tiles + (u32)tile_x;
+	u64 offset = ifd->tile_offsets[tile_index];
+	u32 compressed_size = (u32)ifd->tile_byte_counts[tile_index];
+	// A tile of 2 bytes can only be an empty JPEG stream (0xFFD9). Empty tiles stay white.
+	if (offset != 0 && compressed_size > 2) {
+		u32 tile_pitch = ifd->tile_width * 4;
+		u32 decoded_size = tile_pitch * ifd->tile_height;
+		u8* decoded = get_thread_buffer(&region_decoded_buffer, &region_decoded_buffer_capacity, decoded_size);
+		bool32 ok = decoded_tile_cache_lookup(region->slide_handle, offset, decoded, decoded_size);
+		if (!ok) {
+			u8* compressed = read_slide_tile(region->slide, region->slide_handle, offset, compressed_size);
+			if (compressed) {
+				if (!region_decoder_state) {
+					region_decoder_state = jpeg_decoder_create_state();
+				}
+				ok = decode_fixed_size_tile_with_state(region_decoder_state, ifd->jpeg_tables,
+				                                       (u32)ifd->jpeg_tables_length, compressed, compressed_size,
+				                                       decoded, tile_pitch, (ifd->color_space == TIFF_PHOTOMETRIC_YCBCR),
+				                                       tiff_get_tile_path_dim(ifd->tile_path), 1);
+			}
+			if (ok) {
+				decoded_tile_cache_insert(region->slide_handle, offset, decoded, decoded_size);
+			}
+		}
+		if (ok) {
+			i32 tile_min_x = tile_x * (i32)ifd->tile_width;
+			i32 tile_min_y = tile_y * (i32)ifd->tile_height;
+			i32 min_x = MAX(region->x, tile_min_x);
+			i32 min_y = MAX(region->y, tile_min_y);
+			i32 max_x = MIN(region->x + region->width, tile_min_x + (i32)ifd->tile_width);
+			i32 max_y = MIN(region->y + region->height, tile_min_y + (i32)ifd->tile_height);
+			for (i32 y = min_y; y < max_y; ++y) {
+				u8* src = decoded + (u64)(y - tile_min_y) * tile_pitch + (u64)(min_x - tile_min_x) * 4;
+				u8* dest = region->pixels + ((u64)(y - region->y) * region->width + (min_x - region->x)) * 4;
+				memcpy(dest, src, (u64)(max_x - min_x) * 4);
+			}
+		} else {
+			log_warning("Region: failed to read or decode tile %u of %s\n", tile_index, region->slide->filename);
+			region->failed = true;
+		}
+	}
+	pthread_mutex_lock(&region->done_mutex);
+	if (--region->tiles_remaining == 0) {
+		pthread_cond_broadcast(&region->done_cond);
+	}
+	pthread_mutex_unlock(&region->done_mutex);
+}
+
+// Renders a rectangle of a level (in pixels of that level, and within the level) from the tiles that cover it.
+// Returns the BGRA pixels (allocated with malloc()), or NULL if a tile can't be read or decoded.
+u8* render_region(open_slide_t* slide, u32 slide_handle, tiff_ifd_t* ifd, i32 x, i32 y, i32 width, i32 height) {
+	region_render_t region = { .slide = slide, .slide_handle = slide_handle, .ifd = ifd,
+	                           .x = x, .y = y, .width = width, .height = height };
+	region.first_tile_x = x / (i32)ifd->tile_width;
+	region.first_tile_y = y / (i32)ifd->tile_height;
+	region.width_in_tiles = (x + width - 1) / (i32)ifd->tile_width - region.first_tile_x + 1;
+	i32 height_in_tiles = (y + height - 1) / (i32)ifd->tile_height - region.first_tile_y + 1;
+	region.tile_count = region.width_in_tiles * height_in_tiles;
+	region.tiles_remaining = region.tile_count;
+	u64 pixels_size = (u64)width * height * 4;
+	region.pixels = malloc(pixels_size);
+	memset(region.pixels, 0xFF, pixels_size); // empty tiles are white
+	pthread_mutex_init(&region.done_mutex, NULL);
+	pthread_cond_init(&region.done_cond, NULL);
+
+	// Hand out the tiles to the idle workers, and work on them here as well.
+	pthread_mutex_lock(&ready_connections.mutex);
+	region_render_t** link = &active_region_renders;
+	while (*link) link = &(*link)->next;
+	*link = &region;
+	if (region.tile_count > 1) {
+		pthread_cond_broadcast(&ready_connections.cond);
+	}
+	while (region.next_tile < region.tile_count) {
+		i32 tile = region.next_tile++;
+		pthread_mutex_unlock(&ready_connections.mutex);
+		render_region_tile(&region, tile);
+		pthread_mutex_lock(&ready_connections.mutex);
+	}
+	// All tiles are handed out; make sure no other worker can find the region anymore.
+	for (link = &active_region_renders; *link; link = &(*link)->next) {
+		if (*link == &region) {
+			*link = region.next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ready_connections.mutex);
+	pthread_mutex_lock(&region.done_mutex);
+	while (region.tiles_remaining > 0) {
+		pthread_cond_wait(&region.done_cond, &region.done_mutex);
+	}
+	pthread_mutex_unlock(&region.done_mutex);
+	pthread_mutex_destroy(&region.done_mutex);
+	pthread_cond_destroy(&region.done_cond);
+
+	if (region.failed) {
+		free(region.pixels);
+		return NULL;
+	}
+	return region.pixels;
+}
+
+// Only JPEG tiles can be decoded on the server.
+static bool32 can_render_level(tiff_t* tiff, tiff_ifd_t* ifd) {
+	return ifd->compression == TIFF_COMPRESSION_JPEG && ifd->tile_width > 0 && ifd->tile_height > 0 &&
+	       tiff_load_tile_tables(tiff, ifd);
+}
+
+// Key layout: 16 bits slide handle | 7 bits JPEG quality | 41 bits file offset
+static inline u64 reduced_tile_cache_key(u32 slide_handle, u64 offset, i32 quality) {
+	return ((u64)(slide_handle & 0xFFFF) << 48) | ((u64)(quality & 0x7F) << 41) | (offset & 0x1FFFFFFFFFF);
+}
+
+// POST /tiles with Tile-quality: <quality>
+// For clients on a slow link: the tiles are decoded (or taken from the decoded tile cache) and re-encoded at the JPEG
+// quality asked for, and kept in the reduced tile cache. The response has the same layout as for the tiles as they
+// are, with Tile-quality in the header. Tiles that don't get any smaller are sent as they are, so the client can tell
+// which tiles were reduced from their size (and load those again later).
+bool32 send_reduced_quality_tiles(connection_t* connection, u32 slide_handle, tiff_ifd_t* ifd, u32* tile_indices,
+                                  u32 tile_count, u32* tile_sizes, u8* tile_data, i32 quality) {
+	u8** tiles = alloca(tile_count * sizeof(u8*));
+	u32* sizes = alloca(tile_count * sizeof(u32));
+	u8** reduced_tiles = alloca(tile_count * sizeof(u8*));
+	memset(reduced_tiles, 0, tile_count * sizeof(u8*));
+	u32 tile_pitch = ifd->tile_width * 4;
+	u32 decoded_size = tile_pitch * ifd->tile_height;
+	u64 total_size = tile_count * sizeof(u32);
+	for (u32 i = 0; i < tile_count; ++i) {
+		tiles[i] = tile_data;
+		sizes[i] = tile_sizes[i];
+		tile_data += tile_sizes[i];
+		if (sizes[i] > 2) {
+			u64 offset = ifd->tile_offsets[tile_indices[i]];
+			u64 key = reduced_tile_cache_key(slide_handle, offset, quality);
+			tile_cache_t* shard = get_tile_cache_shard(reduced_tile_cache_shards, key);
+			u8* reduced = malloc(sizes[i]);
+			u32 reduced_size = 0;
+			if (!tile_cache_lookup(shard, key, reduced, sizes[i], &reduced_size)) {
+				u8* decoded = get_thread_buffer(&region_decoded_buffer, &region_decoded_buffer_capacity, decoded_size);
+				bool32 ok = decoded_tile_cache_lookup(slide_handle, offset, decoded, decoded_size);
+				if (!ok) {
+					if (!region_decoder_state) {
+						region_decoder_state = jpeg_decoder_create_state();
+					}
+					ok = decode_fixed_size_tile_with_state(region_decoder_state, ifd->jpeg_tables,
+					                                       (u32)ifd->jpeg_tables_length, tiles[i], sizes[i], decoded,
+					                                       tile_pitch, true, tiff_get_tile_path_dim(ifd->tile_path), 1);
+					if (ok) {
+						decoded_tile_cache_insert(slide_handle, offset, decoded, decoded_size);
+					}
+				}
+				reduced_size = 1; // (a single byte: the tile doesn't get smaller, or can't be decoded)
+				reduced[0] = 0;
+				if (ok) {
+					u64 jpeg_size = 0;
+					u8* jpeg = encode_tile_with_quality(decoded, ifd->tile_width, ifd->tile_height, quality, &jpeg_size);
+					if (jpeg_size < sizes[i]) {
+						memcpy(reduced, jpeg, jpeg_size);
+						reduced_size = (u32)jpeg_size;
+					}
+					free(jpeg);
+				}
+				tile_cache_insert(shard, key, reduced, reduced_size);
+			}
+			if (reduced_size > 1) {
+				reduced_tiles[i] = reduced;
+				tiles[i] = reduced;
+				sizes[i] = reduced_size;
+			} else {
+				free(reduced);
+			}
+		}
+		total_size += sizes[i];
+	}
+
+	char http_headers[4096];
+	snprintf(http_headers, sizeof(http_headers),
+	         "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-type: application/octet-stream\r\n%s"
+	         "Tile-quality: %d\r\nContent-length: %llu\r\n\r\n", connection->stream_header_field, quality, total_size);
+	u64 http_headers_size = strlen(http_headers);
+	u64 send_size = http_headers_size + total_size;
+	u8* send_buffer = malloc(send_size);
+	memcpy(send_buffer, http_headers, http_headers_size);
+	memcpy(send_buffer + http_headers_size, sizes, tile_count * sizeof(u32));
+	u8* pos = send_buffer + http_headers_size + tile_count * sizeof(u32);
+	for (u32 i = 0; i < tile_count; ++i) {
+		memcpy(pos, tiles[i], sizes[i]);
+		pos += sizes[i];
+		free(reduced_tiles[i]);
+	}
+	bool32 success = send_buffer_to_client(connection, send_buffer, send_size);
+	free(send_buffer);
+	return success;
+}
+
+bool32 send_jpeg_to_client(connection_t* connection, u8* jpeg, u64 jpeg_size, const char* extra_header_fields) {
+	char http_headers[512];
+	snprintf(http_headers, sizeof(http_headers),
+	         "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-type: image/jpeg\r\n%sContent-length: %llu\r\n\r\n",
+	         extra_header_fields, jpeg_size);
+	return send_buffer_to_client(connection, (u8*)http_headers, strlen(http_headers)) &&
+	       send_buffer_to_client(connection, jpeg, jpeg_size);
+}
+
+// GET /slide/<file>/region/<level>/<x>/<y>/<width>/<height>
+// Renders a rectangle of a level (in pixels of that level) from the tiles that cover it, and sends it back as a
+// single JPEG image; for clients that would rather not download and decode the tiles themselves. The parts outside
+// the level are cut off.
+bool32 execute_region_api_call(connection_t* connection, slide_api_call_t* call, const char* filename) {
+	for (i32 i = 3; i <= 7; ++i) {
+		if (i >= call->par_count || !call->pars[i]) return false;
+	}
+	u32 slide_handle = 0;
+	open_slide_t* slide = get_open_slide_by_filename(filename, &slide_handle);
+	if (!slide) {
+		log_warning("Region: couldn't open TIFF file %s\n", filename);
+		return false;
+	}
+	tiff_t* tiff = &slide->tiff;
+	i32 level = atoi(call->pars[3]);
+	if (level < 0 || (u64)level >= tiff->level_count) {
+		log_warning("Region: level %d out of range\n", level);
+		return false;
+	}
+	tiff_ifd_t* ifd = tiff->level_images + level;
+	if (!can_render_level(tiff, ifd)) {
+		log_warning("Region: level %d can't be decoded\n", level);
+		return false;
+	}
+	i64 x = atoll(call->pars[4]);
+	i64 y = atoll(call->pars[5]);
+	i64 width = atoll(call->pars[6]);
+	i64 height = atoll(call->pars[7]);
+	if (x < 0 || y < 0 || width <= 0 || height <= 0 || width > REGION_MAX_DIMENSION || height > REGION_MAX_DIMENSION ||
+	    x >= (i64)ifd->image_width || y >= (i64)ifd->image_height) {
+		log_warning("Region: invalid region\n");
+		return false;
+	}
+	width = MIN(width, (i64)ifd->image_width - x);
+	height = MIN(height, (i64)ifd->image_height - y);
+
+	u8* pixels = render_region(slide, slide_handle, ifd, (i32)x, (i32)y, (i32)width, (i32)height);
+	if (!pixels) return false;
+	u64 jpeg_size = 0;
+	u8* jpeg = encode_tile(pixels, (u32)width, (u32)height, &jpeg_size);
+	free(pixels);
+	bool32 success = send_jpeg_to_client(connection, jpeg, jpeg_size, "");
+	free(jpeg);
+	return success;
+}
+
+// Deep Zoom (DZI) access, for browser viewers such as OpenSeadragon. Deep Zoom has a pyramid level for every
+// factor of 2, down to a single pixel; level max_level is the full resolution image. The tiles don't overlap.
+typedef struct {
+	u32 image_width;
+	u32 image_height;
+	u32 tile_size;
+	i32 max_level;
+} dzi_geometry_t;
+
+static dzi_geometry_t get_dzi_geometry(tiff_t* tiff) {
+	tiff_ifd_t* base_ifd = tiff->level_images;
+	dzi_geometry_t geometry = { .image_width = base_ifd->image_width, .image_height = base_ifd->image_height };
+	// Use the tile size of the file, so that its tiles can be passed on as they are.
+	geometry.tile_size = (base_ifd->tile_width == base_ifd->tile_height && base_ifd->tile_width > 0) ?
+	                     base_ifd->tile_width : DZI_DEFAULT_TILE_SIZE;
+	u32 max_dimension = MAX(geometry.image_width, geometry.image_height);
+	while (((u64)1 << geometry.max_level) < max_dimension) {
+		++geometry.max_level;
+	}
+	return geometry;
+}
+
+// Key layout: 16 bits slide handle | 6 bits Deep Zoom level | 21 bits tile x | 21 bits tile y
+static inline u64 dzi_tile_cache_key(u32 slide_handle, i32 dzi_level, u32 tile_x, u32 tile_y) {
+	return ((u64)(slide_handle & 0xFFFF) << 48) | ((u64)(dzi_level & 0x3F) << 42) |
+	       ((u64)(tile_x & 0x1FFFFF) << 21) | (u64)(tile_y & 0x1FFFFF);
+}
+
+// Averages a block of source pixels into one destination pixel (the part of the block that is within the source).
+static inline void downsample_block(u8* src, i32 src_width, i32 src_height, i32 factor, i32 dest_x, i32 dest_y,
+                                    u8* dest_pixel) {
+	i32 min_y = dest_y * factor;
+	i32 max_y = MIN(min_y + factor, src_height);
+	i32 min_x = dest_x * factor;
+	i32 max_x = MIN(min_x + factor, src_width);
+	u32 sums[4] = {0};
+	u32 count = 0;
+	for (i32 y = min_y; y < max_y; ++y) {
+		u8* src_pixel = src + ((u64)y * src_width + min_x) * 4;
+		for (i32 x = min_x; x < max_x; ++x, src_pixel += 4) {
+			sums[0] += src_pixel[0];
+			sums[1] += src_pixel[1];
+			sums[2] += src_pixel[2];
+			sums[3] += src_pixel[3];
+			++count;
+		}
+	}
+	for (i32 i = 0; i < 4; ++i) {
+		dest_pixel[i] = count ? (u8)((sums[i] + count / 2) / count) : 0xFF;
+	}
+}
+
+// The rows of whole blocks, for the factors of the Deep Zoom levels right below a level in the file: with the factor
+// built in, the loops over the block have fixed trip counts, and the division is a shift. (Same results as
+// downsample_block().)
+#define DEFINE_DOWNSAMPLE_ROW(FACTOR, SHIFT) \
+	static void downsample_row_##FACTOR(u8* src, i32 src_width, i32 dest_y, u8* dest_row, i32 width) { \
+		u8* block_row = src + (u64)dest_y * FACTOR * src_width * 4; \
+		for (i32 dest_x = 0; dest_x < width; ++dest_x) { \
+			u32 sums[4] = {0}; \
+			for (i32 y = 0; y < FACTOR; ++y) { \
+				u8* src_pixel = block_row + ((u64)y * src_width + dest_x * FACTOR) * 4; \
+				for (i32 x = 0; x < FACTOR; ++x, src_pixel += 4) { \
+					sums[0] += src_pixel[0]; \
+					sums[1] += src_pixel[1]; \
+					sums[2] += src_pixel[2]; \
+					sums[3] += src_pixel[3]; \
+				} \
+			} \
+			for (i32 i = 0; i < 4; ++i) { \
+				dest_row[dest_x * 4 + i] = (u8)((sums[i] + (1 << (SHIFT - 1))) >> SHIFT); \
+			} \
+		} \
+	}
+DEFINE_DOWNSAMPLE_ROW(2, 2)
+DEFINE_DOWNSAMPLE_ROW(4, 4)
+
+// Averages blocks of factor x factor pixels (at the edge of the source, the part of the block that is there).
+static void downsample_pixels(u8* src, i32 src_width, i32 src_height, i32 factor, u8* dest, i32 dest_width,
+                              i32 dest_height) {
+	// Interior blocks lie wholly within the source; only the last column and row can be partial.
+	i32 interior_width = MIN(dest_width, src_width / factor);
+	i32 interior_height = MIN(dest_height, src_height / factor);
+	void (*downsample_row)(u8*, i32, i32, u8*, i32) = (factor == 2) ? downsample_row_2 :
+	                                                  (factor == 4) ? downsample_row_4 : NULL;
+	for (i32 dest_y = 0; dest_y < dest_height; ++dest_y) {
+		u8* dest_row = dest + (u64)dest_y * dest_width * 4;
+		i32 dest_x = 0;
+		if (downsample_row && dest_y < interior_height) {
+			downsample_row(src, src_width, dest_y, dest_row, interior_width);
+			dest_x = interior_width;
+		}
+		for (; dest_x < dest_width; ++dest_x) {
+			downsample_block(src, src_width, src_height, factor, dest_x, dest_y, dest_row + dest_x * 4);
+		}
+	}
+}
+
+static THREAD_LOCAL u8* dzi_tile_buffer;
+static THREAD_LOCAL u64 dzi_tile_buffer_capacity;
+
+#define DZI_HEADER_FIELDS "Access-Control-Allow-Origin: *\r\n" // the web viewer may be served from elsewhere
+
+// Sends a Deep Zoom tile. If the level matches a level in the file, the tiles inside the image are passed on as they
+// are (with the JPEG tables put back in). Otherwise the tile is rendered from the nearest finer level, downsampled,
+// encoded, and kept in the Deep Zoom tile cache.
+bool32 send_dzi_tile(connection_t* connection, open_slide_t* slide, u32 slide_handle, i32 dzi_level, u32 tile_x,
+                     u32 tile_y) {
+	tiff_t* tiff = &slide->tiff;
+	dzi_geometry_t geometry = get_dzi_geometry(tiff);
+	if (dzi_level < 0 || dzi_level > geometry.max_level) return false;
+	i32 shift = geometry.max_level - dzi_level;
+	u32 downsample_factor = 1u << shift;
+	u32 level_width = (u32)(((u64)geometry.image_width + downsample_factor - 1) >> shift);
+	u32 level_height = (u32)(((u64)geometry.image_height + downsample_factor - 1) >> shift);
+	u64 tile_size = geometry.tile_size;
+	if ((u64)tile_x * tile_size >= level_width || (u64)tile_y * tile_size >= level_height) return false;
+	i32 x = (i32)(tile_x * tile_size);
+	i32 y = (i32)(tile_y * tile_size);
+	i32 width = (i32)MIN(tile_size, level_width - (u64)x);
+	i32 height = (i32)MIN(tile_size, level_height - (u64)y);
+
+	// The source is the coarsest level in the file that is at least as detailed.
+	tiff_ifd_t* source_ifd = NULL;
+	float source_downsample_factor = 1.0f;
+	for (u64 i = 0; i < tiff->level_count; ++i) {
+		tiff_ifd_t* ifd = tiff->level_images + i;
+		if (ifd->image_width == 0 || !can_render_level(tiff, ifd)) continue;
+		float level_downsample_factor = (float)geometry.image_width / (float)ifd->image_width;
+		if (level_downsample_factor > (float)downsample_factor * 1.01f) continue;
+		if (!source_ifd || level_downsample_factor > source_downsample_factor) {
+			source_ifd = ifd;
+			source_downsample_factor = level_downsample_factor;
+		}
+	}
+	if (!source_ifd) return false;
+	i32 factor = ATLEAST(1, (i32)roundf((float)downsample_factor / source_downsample_factor));
+
+	if (factor == 1 && source_ifd->image_width == level_width && source_ifd->image_height == level_height &&
+	    source_ifd->tile_width == tile_size && source_ifd->tile_height == tile_size &&
+	    width == (i32)tile_size && height == (i32)tile_size && source_ifd->color_space == TIFF_PHOTOMETRIC_YCBCR) {
+		u32 tile_index = tile_y * source_ifd->width_in_tiles + tile_x;
+		u64 offset = source_ifd->tile_offsets[tile_index];
+		u32 size = (u32)source_ifd->tile_byte_counts[tile_index];
+		if (offset != 0 && size > 2) {
+			u8* data = read_slide_tile(slide, slide_handle, offset, size);
+			if (!data) return false;
+			// Abbreviated streams get the tables inserted after SOI (the tables end with EOI, which is left out).
+			u64 tables_size = source_ifd->jpeg_tables_length;
+			if (source_ifd->jpeg_tables && tables_size > 4) {
+				u64 jpeg_size = (tables_size - 2) + (size - 2);
+				u8* jpeg = malloc(jpeg_size);
+				memcpy(jpeg, source_ifd->jpeg_tables, tables_size - 2);
+				memcpy(jpeg + tables_size - 2, data + 2, size - 2);
+				bool32 success = send_jpeg_to_client(connection, jpeg, jpeg_size, DZI_HEADER_FIELDS);
+				free(jpeg);
+				return success;
+			}
+			return send_jpeg_to_client(connection, data, size, DZI_HEADER_FIELDS);
+		}
+	}
+
+	u64 key = dzi_tile_cache_key(slide_handle, dzi_level, tile_x, tile_y);
+	tile_cache_t* shard = get_tile_cache_shard(dzi_tile_cache_shards, key);
+	u32 capacity = (u32)(tile_size * tile_size * 4);
+	u8* buffer = get_thread_buffer(&dzi_tile_buffer, &dzi_tile_buffer_capacity, capacity);
+	u32 cached_size = 0;
+	if (tile_cache_lookup(shard, key, buffer, capacity, &cached_size)) {
+		return send_jpeg_to_client(connection, buffer, cached_size, DZI_HEADER_FIELDS);
+	}
+
+	i32 source_x = x * factor;
+	i32 source_y = y * factor;
+	if (source_x >= (i32)source_ifd->image_width || source_y >= (i32)source_ifd->image_height) return false;
+	i32 source_width = MIN(width * factor, (i32)source_ifd->image_width - source_x);
+	i32 source_height = MIN(height * factor, (i32)source_ifd->image_height - source_y);
+	if (source_width > REGION_MAX_DIMENSION || source_height > REGION_MAX_DIMENSION) {
+		log_warning("Deep Zoom: level %d of %s has no source level that is small enough\n", dzi_level, slide->filename);
+		return false;
+	}
+	u8* source_pixels = render_region(slide, slide_handle, source_ifd, source_x, source_y, source_width, source_height);
+	if (!source_pixels) return false;
+	u8* pixels = source_pixels;
+	if (factor > 1) {
+		pixels = malloc((u64)width * height * 4);
+		downsample_pixels(source_pixels, source_width, source_height, factor, pixels, width, height);
+		free(source_pixels);
+	}
+	u64 jpeg_size = 0;
+	u8* jpeg = encode_tile(pixels, (u32)width, (u32)height, &jpeg_size);
+	free(pixels);
+	tile_cache_insert(shard, key, jpeg, (u32)jpeg_size);
+	bool32 success = send_jpeg_to_client(connection, jpeg, jpeg_size, DZI_HEADER_FIELDS);
+	free(jpeg);
+	return success;
+}
+
+// GET /dzi/<file>.dzi                        the Deep Zoom descriptor
+// GET /dzi/<file>_files/<level>/<x>_<y>.jpeg  a tile (the URL layout that Deep Zoom viewers expect)
+bool32 execute_dzi_api_call(connection_t* connection, slide_api_call_t* call) {
+	if (!call->filename) return false;
+	char slide_name[2048];
+	strncpy(slide_name, call->filename, sizeof(slide_name) - 1);
+	slide_name[sizeof(slide_name) - 1] = '\0';
+	size_t name_length = strlen(slide_name);
+	bool32 is_descriptor = false;
+	if (name_length > 4 && strcmp(slide_name + name_length - 4, ".dzi") == 0) {
+		slide_name[name_length - 4] = '\0';
+		is_descriptor = true;
+	} else if (name_length > 6 && strcmp(slide_name + name_length - 6, "_files") == 0) {
+		slide_name[name_length - 6] = '\0';
+	} else {
+		return false;
+	}
+	shard_node_t* node = get_other_slide_node(slide_name);
+	if (node) return send_redirect_to_node(connection, call, node);
+	const char* filename = prepend_env_dir(slide_name, "SLIDES_DIR", alloca(2048), 2048);
+	u32 slide_handle = 0;
+	open_slide_t* slide = get_open_slide_by_filename(filename, &slide_handle);
+	if (!slide || slide->tiff.level_count == 0) {
+		log_warning("Deep Zoom: couldn't open TIFF file %s\n", filename);
+		return false;
+	}
+
+	if (is_descriptor) {
+		dzi_geometry_t geometry = get_dzi_geometry(&slide->tiff);
+		char body[512];
+		snprintf(body, sizeof(body),
+		         "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		         "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"jpeg\" Overlap=\"0\" TileSize=\"%u\">"
+		         "<Size Width=\"%u\" Height=\"%u\"/></Image>\n",
+		         geometry.tile_size, geometry.image_width, geometry.image_height);
+		char http_headers[512];
+		snprintf(http_headers, sizeof(http_headers),
+		         "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-type: application/xml\r\n" DZI_HEADER_FIELDS
+		         "Content-length: %llu\r\n\r\n", (u64)strlen(body));
+		return send_buffer_to_client(connection, (u8*)http_headers, strlen(http_headers)) &&
+		       send_buffer_to_client(connection, (u8*)body, strlen(body));
+	}
+
+	i32 dzi_level = 0;
+	u32 tile_x = 0, tile_y = 0;
+	if (!call->parameter1 || !call->parameter2 || sscanf(call->parameter1, "%d", &dzi_level) != 1 ||
+	    sscanf(call->parameter2, "%u_%u", &tile_x, &tile_y) != 2) {
+		return false;
+	}
+	return send_dzi_tile(connection, slide, slide_handle, dzi_level, tile_x, tile_y);
+}
+
+// Tiles over UDP (experimental, see tile_datagram.h), enabled with the TILE_DATAGRAM_PORT environment variable.
+// Sessions are handed out over TLS by the workers (GET /datagram), and then only used by the datagram thread, which
+// answers each request by reading the tile the way a tile request does (see read_slide_tile()), and sending the
+// fragments that were asked for. The responses always go to the address that the session was last seen from with a
+// new sequence number, so that a replayed request can't be used to send tiles somewhere else.
+#define TILE_DATAGRAM_MAX_SESSIONS 64
+#define TILE_DATAGRAM_SESSION_IDLE_SECONDS 600
+#define TILE_DATAGRAM_SEND_BUFFER_SIZE MEGABYTES(4)
+
+typedef struct tile_datagram_server_session_t {
+	struct tile_datagram_server_session_t* next; // in new_datagram_sessions
+	u32 session_id;
+	gcm_state gcm;
+	u64 next_sequence; // for the datagrams going out
+	u64 highest_sequence_seen; // (0 = none yet)
+	struct sockaddr_in client_address;
+	time_t last_activity_time;
+} tile_datagram_server_session_t;
+
+static i32 tile_datagram_port; // 0 = disabled
+static tile_datagram_server_session_t* new_datagram_sessions; // handed over by the workers
+static volatile i32 new_datagram_sessions_lock;
+
+// GET /datagram
+bool32 execute_datagram_api_call(connection_t* connection) {
+	if (tile_datagram_port == 0) {
+		return send_http_status_to_client(connection, "404 Not Found");
+	}
+	tile_datagram_session_t response = { .magic = TILE_DATAGRAM_SESSION_MAGIC, .port = (u32)tile_datagram_port };
+	tile_datagram_server_session_t* session = calloc(1, sizeof(tile_datagram_server_session_t));
+	if (!tls_random((u8*)&response.session_id, sizeof(response.session_id)) ||
+	    !tls_random(response.key, sizeof(response.key)) ||
+	    gcm_init(&session->gcm, find_cipher("aes"), response.key, sizeof(response.key)) != CRYPT_OK) {
+		free(session);
+		return false;
+	}
+	session->session_id = response.session_id;
+	session->next_sequence = 1;
+	session->last_activity_time = time(NULL);
+	spin_lock(&new_datagram_sessions_lock);
+	session->next = new_datagram_sessions;
+	new_datagram_sessions = session;
+	spin_unlock(&new_datagram_sessions_lock);
+
+	char http_headers[256];
+	snprintf(http_headers, sizeof(http_headers),
+	         "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-type: application/octet-stream\r\n%s"
+	         "Content-length: %llu\r\n\r\n", connection->stream_header_field, (u64)sizeof(response));
+	bool32 success = send_buffer_to_client(connection, (u8*)http_headers, strlen(http_headers)) &&
+	                 send_buffer_to_client(connection, (u8*)&response, sizeof(response));
+	memset(&response, 0, sizeof(response));
+	return success;
+}
+
+static void send_tile_datagram(int sock, tile_datagram_server_session_t* session, tile_datagram_fragment_t* fragment,
+                               u8* data, u32 data_size) {
+	u8 datagram[TILE_DATAGRAM_MAX_SIZE];
+	tile_datagram_header_t header = { TILE_DATAGRAM_MAGIC, session->session_id, session->next_sequence++ };
+	memcpy(datagram, &header, sizeof(header));
+	memcpy(datagram + sizeof(header), fragment, sizeof(*fragment));
+	if (data_size > 0) {
+		memcpy(datagram + sizeof(header) + sizeof(*fragment), data, data_size);
+	}
+	i32 datagram_size = seal_tile_datagram(&session->gcm, TILE_DATAGRAM_FROM_SERVER, datagram,
+	                                       (i32)(sizeof(*fragment) + data_size));
+	if (datagram_size > 0) {
+		// If the send buffer is full, wait for room rather than drop the datagram (a lost one would be asked for again,
+		// but only after a timeout).
+		for (;;) {
+			int res = (int)sendto(sock, (char*)datagram, datagram_size, 0, (struct sockaddr*)&session->client_address,
+			                      sizeof(session->client_address));
+			if (res >= 0 || !socket_would_block() || !wait_until_writable(sock)) break;
+		}
+		++get_thread_metrics()->datagram_fragment_count;
+		get_thread_metrics()->bytes_sent += datagram_size;
+	}
+}
+
+static void serve_tile_datagram_request(int sock, tile_datagram_server_session_t* session, tile_datagram_request_t* request) {
+	tile_datagram_fragment_t fragment = { .request_id = request->request_id, .fragment_count = 1 };
+	open_slide_t* slide = get_open_slide_by_handle(request->slide_handle);
+	tiff_t* tiff = slide ? &slide->tiff : NULL;
+	tiff_ifd_t* ifd = (tiff && request->level < tiff->level_count) ? tiff->level_images + request->level : NULL;
+	if (!ifd || !tiff_load_tile_tables(tiff, ifd) || request->tile_index >= ifd->tile_count) {
+		fragment.status = TILE_DATAGRAM_STATUS_NOT_FOUND;
+		send_tile_datagram(sock, session, &fragment, NULL, 0);
+		return;
+	}
+	u64 offset = ifd->tile_offsets[request->tile_index];
+	u32 tile_size = (offset != 0) ? (u32)ifd->tile_byte_counts[request->tile_index] : 0;
+	u32 fragment_count = get_tile_datagram_fragment_count(tile_size);
+	u8* data = NULL;
+	if (fragment_count > TILE_DATAGRAM_MAX_FRAGMENTS) {
+		fragment.status = TILE_DATAGRAM_STATUS_TOO_LARGE;
+	} else if (tile_size > 0 && !(data = read_slide_tile(slide, request->slide_handle, offset, tile_size))) {
+		fragment.status = TILE_DATAGRAM_STATUS_READ_ERROR;
+	}
+	if (fragment.status != TILE_DATAGRAM_STATUS_OK) {
+		send_tile_datagram(sock, session, &fragment, NULL, 0);
+		return;
+	}
+	++get_thread_metrics()->datagram_tile_count;
+	if (request->range_count == 0) {
+		count_tile_access(&slide->tile_access, request->level, request->tile_index); // (not the resends)
+	}
+	fragment.tile_size = tile_size;
+	fragment.fragment_count = (u16)fragment_count;
+	tile_datagram_range_t all_fragments = { 0, (u16)fragment_count };
+	tile_datagram_range_t* ranges = request->range_count ? request->ranges : &all_fragments;
+	u32 range_count = request->range_count ? request->range_count : 1;
+	for (u32 r = 0; r < range_count; ++r) {
+		u32 end = MIN((u32)ranges[r].first_fragment + ranges[r].fragment_count, fragment_count);
+		for (u32 i = ranges[r].first_fragment; i < end; ++i) {
+			u32 fragment_offset = i * TILE_DATAGRAM_PAYLOAD_SIZE;
+			fragment.fragment_index = (u16)i;
+			send_tile_datagram(sock, session, &fragment, data ? data + fragment_offset : NULL,
+			                   MIN(TILE_DATAGRAM_PAYLOAD_SIZE, tile_size - fragment_offset));
+		}
+	}
+}
+
+static void* tile_datagram_thread_proc(void* parameter) {
+	int sock = (int)(i64)parameter;
+	tile_datagram_server_session_t* sessions[TILE_DATAGRAM_MAX_SESSIONS];
+	i32 session_count = 0;
+	time_t last_expiry_check = time(NULL);
+	u8 datagram[TILE_DATAGRAM_MAX_SIZE + 1];
+	for (;;) {
+		struct pollfd poll_fd = { .fd = sock, .events = POLLIN };
+		poll(&poll_fd, 1, 1000);
 
-	return 0;
+		// Take in the new sessions (the oldest ones make room, if needed), and forget the ones that are no longer used.
+		spin_lock(&new_datagram_sessions_lock);
+		tile_datagram_server_session_t* new_session = new_datagram_sessions;
+		new_datagram_sessions = NULL;
+		spin_unlock(&new_datagram_sessions_lock);
+		while (new_session) {
+			tile_datagram_server_session_t* next = new_session->next;
+			if (session_count == TILE_DATAGRAM_MAX_SESSIONS) {
+				i32 oldest = 0;
+				for (i32 i = 1; i < session_count; ++i) {
+					if (sessions[i]->last_activity_time < sessions[oldest]->last_activity_time) oldest = i;
+				}
+				free(sessions[oldest]);
+				sessions[oldest] = sessions[--session_count];
+			}
+			sessions[session_count++] = new_session;
+			new_session = next;
+		}
+		time_t now = time(NULL);
+		if (now - last_expiry_check > 10) {
+			for (i32 i = 0; i < session_count; ) {
+				if (now - sessions[i]->last_activity_time > TILE_DATAGRAM_SESSION_IDLE_SECONDS) {
+					free(sessions[i]);
+					sessions[i] = sessions[--session_count];
+				} else {
+					++i;
+				}
+			}
+			last_expiry_check = now;
+		}
+
+		for (;;) {
+			struct sockaddr_in address;
+			socklen_t address_size = sizeof(address);
+			i32 datagram_size = (i32)recvfrom(sock, (char*)datagram, sizeof(datagram), 0, (struct sockaddr*)&address,
+			                                  &address_size);
+			if (datagram_size < 0) break; // nothing more for now
+			if (datagram_size < (i32)sizeof(tile_datagram_header_t) || datagram_size > (i32)TILE_DATAGRAM_MAX_SIZE) {
+				continue;
+			}
+			tile_datagram_header_t header;
+			memcpy(&header, datagram, sizeof(header));
+			if (header.magic != TILE_DATAGRAM_MAGIC) continue;
+			tile_datagram_server_session_t* session = NULL;
+			for (i32 i = 0; i < session_count && !session; ++i) {
+				if (sessions[i]->session_id == header.session_id) session = sessions[i];
+			}
+			if (!session) continue; // (the client will find out when the request times out)
+			i32 message_size = open_tile_datagram(&session->gcm, TILE_DATAGRAM_FROM_CLIENT, datagram, datagram_size);
+			tile_datagram_request_t request = {0};
+			if (message_size < (i32)offsetof(tile_datagram_request_t, ranges) || message_size > (i32)sizeof(request)) {
+				continue;
+			}
+			memcpy(&request, datagram + sizeof(header), message_size);
+			if (request.range_count > TILE_DATAGRAM_MAX_RANGES ||
+			    message_size != (i32)(offsetof(tile_datagram_request_t, ranges) +
+			                          request.range_count * sizeof(tile_datagram_range_t))) {
+				continue;
+			}
+			if (header.sequence > session->highest_sequence_seen) {
+				session->highest_sequence_seen = header.sequence;
+				session->client_address = address; // (the client may have moved, e.g. to another network)
+			}
+			session->last_activity_time = now;
+			serve_tile_datagram_request(sock, session, &request);
+		}
+	}
+	return NULL;
+}
+
+static void start_tile_datagram_server() {
+	const char* port_env = getenv("TILE_DATAGRAM_PORT");
+	i32 port = port_env ? atoi(port_env) : 0;
+	if (port <= 0) return;
+	int sock = (int)socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(port) };
+	address.sin_addr.s_addr = INADDR_ANY;
+	if (sock < 0 || bind(sock, (struct sockaddr*)&address, sizeof(address)) != 0) {
+		fprintf(stderr, "Could not open UDP port %d for tile datagrams\n", port);
+		if (sock >= 0) close_socket(sock);
+		return;
+	}
+	int send_buffer_size = TILE_DATAGRAM_SEND_BUFFER_SIZE;
+	setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char*)&send_buffer_size, sizeof(send_buffer_size));
+	set_socket_blocking(sock, false);
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, tile_datagram_thread_proc, (void*)(i64)sock) == 0) {
+		pthread_detach(thread);
+		tile_datagram_port = port;
+		fprintf(stderr, "Serving tiles over UDP on port %d (experimental)\n", port);
+	} else {
+		fprintf(stderr, "Could not start the tile datagram thread\n");
+		close_socket(sock);
+	}
+}
+
+// Warming: when a slide set is asked for, a background thread opens its slides (so that their headers are ready) and
+// reads their historically hottest tiles into the tile cache (see tile_access_stats_t), before the clients ask for
+// them. A slide set is warmed at most once every TILE_WARMING_MIN_INTERVAL_SECONDS, and no more than a quarter of the
+// tile cache is used for one set. The same thread saves the tile access statistics every so often.
+static slide_set_t** tile_warming_queue; // sb, each holds a reference
+static pthread_mutex_t tile_warming_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tile_warming_cond = PTHREAD_COND_INITIALIZER;
+static i32 tile_warming_max_tiles; // per slide, 0 = disabled
+
+void queue_slide_set_warming(slide_set_t* slide_set) {
+	if (tile_warming_max_tiles <= 0) return;
+	i64 now = (i64)time(NULL);
+	pthread_mutex_lock(&tile_warming_mutex);
+	if (slide_set->warmed_at == 0 || now - slide_set->warmed_at >= TILE_WARMING_MIN_INTERVAL_SECONDS) {
+		slide_set->warmed_at = now;
+		pthread_mutex_lock(&slide_sets_mutex);
+		++slide_set->ref_count;
+		pthread_mutex_unlock(&slide_sets_mutex);
+		sb_push(tile_warming_queue, slide_set);
+		pthread_cond_signal(&tile_warming_cond);
+	}
+	pthread_mutex_unlock(&tile_warming_mutex);
+}
+
+// Returns the number of tiles that are now in the tile cache (or that didn't need to be, being mapped in memory).
+static i32 warm_hottest_tiles(open_slide_t* slide, u32 slide_handle, tile_access_entry_t* hottest, i64* budget) {
+	i32 hottest_count = get_hottest_tiles(&slide->tile_access, hottest, tile_warming_max_tiles);
+	tiff_t* tiff = &slide->tiff;
+	i32 warmed_count = 0;
+	for (i32 i = 0; i < hottest_count; ++i) {
+		if (hottest[i].level >= tiff->level_count) continue;
+		tiff_ifd_t* ifd = tiff->level_images + hottest[i].level;
+		if (!tiff_load_tile_tables(tiff, ifd) || hottest[i].tile_index >= ifd->tile_count) continue;
+		u64 offset = ifd->tile_offsets[hottest[i].tile_index];
+		u32 size = (u32)ifd->tile_byte_counts[hottest[i].tile_index];
+		if (offset == 0 || size == 0) continue; // empty tile
+		if (size > *budget) break;
+		if (read_slide_tile(slide, slide_handle, offset, size)) {
+			*budget -= size;
+			++warmed_count;
+		}
+	}
+	return warmed_count;
+}
+
+static void warm_slide_set(slide_set_t* slide_set) {
+	i64 start = get_microseconds();
+	JSON_Value* root = json_parse_string((const char*)slide_set->json->data);
+	JSON_Array* cases = json_value_get_array(root);
+	if (!cases) {
+		json_value_free(root);
+		return;
+	}
+	tile_access_entry_t* hottest = malloc(tile_warming_max_tiles * sizeof(tile_access_entry_t));
+	i64 budget = server_tile_cache_budget / 4;
+	i32 slide_count = 0;
+	i32 tile_count = 0;
+	for (size_t i = 0; i < json_array_get_count(cases); ++i) {
+		const char* filename = json_object_get_string(json_array_get_object(cases, i), "filename");
+		if (!filename) continue;
+		// Leave room in the slide table for the slides that clients open themselves.
+		if (open_slide_count >= OPEN_SLIDES_MAX * 3 / 4) break;
+		char full_filename[2048];
+		prepend_env_dir(filename, "SLIDES_DIR", full_filename, sizeof(full_filename));
+		u32 slide_handle = 0;
+		open_slide_t* slide = get_open_slide_by_filename(full_filename, &slide_handle);
+		if (!slide) continue;
+		get_serialized_slide_header(slide);
+		++slide_count;
+		if (budget > 0) {
+			tile_count += warm_hottest_tiles(slide, slide_handle, hottest, &budget);
+		}
+	}
+	get_thread_metrics()->warmed_tile_count += tile_count;
+	free(hottest);
+	json_value_free(root);
+	log_info("Warming: %d slides and %d tiles of %s (in %.2f seconds)\n", slide_count, tile_count, slide_set->filename,
+	         (double)(get_microseconds() - start) * 1e-6);
+}
+
+static void save_all_tile_access_stats() {
+	pthread_mutex_lock(&open_slides_mutex);
+	i32 slide_count = open_slide_count;
+	pthread_mutex_unlock(&open_slides_mutex);
+	for (i32 i = 0; i < slide_count; ++i) {
+		open_slide_t* slide = open_slides[i]; // (entries are never removed)
+		spin_lock(&slide->tile_access.lock);
+		bool32 is_changed = (slide->tile_access.unsaved_count > 0);
+		slide->tile_access.unsaved_count = 0;
+		spin_unlock(&slide->tile_access.lock);
+		// Slides that were changed on disk have been opened again, in another entry; that one has the statistics.
+		struct stat st;
+		if (is_changed && stat(slide->filename, &st) == 0 && st.st_mtime == slide->modification_time &&
+		    (i64)st.st_size == slide->filesize) {
+			save_tile_access_stats(&slide->tile_access, slide->filename, slide->filesize, slide->modification_time);
+		}
+	}
+}
+
+static void* tile_warming_thread_proc(void* parameter) {
+	const char* index_dir = getenv("SLIDE_INDEX_DIR");
+	bool32 is_saving = (index_dir && index_dir[0]);
+	i64 last_save_time = (i64)time(NULL);
+	for (;;) {
+		pthread_mutex_lock(&tile_warming_mutex);
+		if (sb_count(tile_warming_queue) == 0) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += TILE_ACCESS_SAVE_INTERVAL_SECONDS;
+			pthread_cond_timedwait(&tile_warming_cond, &tile_warming_mutex, &deadline);
+		}
+		slide_set_t* slide_set = NULL;
+		if (sb_count(tile_warming_queue) > 0) {
+			slide_set = tile_warming_queue[--sb_raw_count(tile_warming_queue)]; // the most recent first
+		}
+		pthread_mutex_unlock(&tile_warming_mutex);
+
+		if (slide_set) {
+			warm_slide_set(slide_set);
+			release_slide_set(slide_set);
+		}
+		i64 now = (i64)time(NULL);
+		if (is_saving && now - last_save_time >= TILE_ACCESS_SAVE_INTERVAL_SECONDS) {
+			save_all_tile_access_stats();
+			last_save_time = now;
+		}
+	}
+	return NULL;
+}
+
+static void start_tile_warming() {
+	const char* max_tiles_env = getenv("TILE_WARMING_MAX_TILES");
+	tile_warming_max_tiles = max_tiles_env ? atoi(max_tiles_env) : TILE_WARMING_DEFAULT_MAX_TILES;
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, tile_warming_thread_proc, NULL) == 0) {
+		pthread_detach(thread);
+	} else {
+		tile_warming_max_tiles = 0;
+		fprintf(stderr, "Could not start the tile warming thread\n");
+	}
+}
+
+// Slide catalog (GET /catalog, see slide_catalog.h). A background thread looks through SLIDES_DIR every few seconds;
+// only the slides that are new or have changed (by modification time and size) are opened, to read their metadata
+// and make their thumbnails. If anything changed, the response is built anew and swapped in; responses that are still
+// being sent keep the old one alive.
+typedef struct catalog_item_t {
+	char name[256];
+	time_t modification_time;
+	i64 filesize;
+	bool32 is_slide; // false if the file can't be opened (it is tried again when it changes)
+	bool32 is_seen; // in the current scan
+	slide_catalog_entry_t entry;
+	u8* label_jpeg;
+	u8* macro_jpeg;
+} catalog_item_t;
+
+typedef struct catalog_response_t {
+	u8* data;
+	u64 size;
+	char etag[24];
+	i32 ref_count; // one for catalog_response, one for each response that is being sent
+} catalog_response_t;
+
+static catalog_item_t* catalog_items; // sb, only touched by the catalog thread
+static catalog_response_t* catalog_response; // NULL until the first scan is done
+static pthread_mutex_t catalog_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void release_catalog_response(catalog_response_t* response) {
+	pthread_mutex_lock(&catalog_mutex);
+	bool32 is_unused = (--response->ref_count == 0);
+	pthread_mutex_unlock(&catalog_mutex);
+	if (is_unused) {
+		free(response->data);
+		free(response);
+	}
+}
+
+// Decodes the image (at a reduced size, if it is large), and scales it down to SLIDE_CATALOG_THUMBNAIL_SIZE.
+// Only tiled JPEG images can be decoded; for other images there is no thumbnail.
+static u8* make_catalog_thumbnail(tiff_t* tiff, tiff_ifd_t* ifd, jpeg_decoder_state_t* decoder_state, u32* jpeg_size) {
+	if (!ifd || !can_render_level(tiff, ifd)) {
+		return NULL;
+	}
+	i32 scale = 1;
+	while (scale < 8 && MAX(ifd->image_width, ifd->image_height) / (u32)(scale * 2) >= SLIDE_CATALOG_THUMBNAIL_SIZE) {
+		scale *= 2;
+	}
+	i32 tile_width = (i32)ifd->tile_width / scale;
+	i32 tile_height = (i32)ifd->tile_height / scale;
+	i32 width = (i32)((ifd->image_width + scale - 1) / scale);
+	i32 height = (i32)((ifd->image_height + scale - 1) / scale);
+	if (tile_width <= 0 || tile_height <= 0 || (i64)width * height > SLIDE_CATALOG_MAX_DECODED_PIXELS) {
+		return NULL;
+	}
+	u8* pixels = malloc((u64)width * height * 4);
+	memset(pixels, 0xFF, (u64)width * height * 4); // empty tiles are white
+	u32 tile_pitch = tile_width * 4;
+	u8* tile_pixels = malloc((u64)tile_pitch * tile_height);
+	u8* compressed = NULL;
+	u64 compressed_capacity = 0;
+	bool32 ok = true;
+	for (i32 tile_y = 0; tile_y < (i32)ifd->height_in_tiles && ok; ++tile_y) {
+		for (i32 tile_x = 0; tile_x < (i32)ifd->width_in_tiles; ++tile_x) {
+			u32 tile_index = (u32)tile_y * ifd->width_in_tiles + (u32)tile_x;
+			u64 offset = ifd->tile_offsets[tile_index];
+			u32 size = (u32)ifd->tile_byte_counts[tile_index];
+			if (offset == 0 || size <= 2) continue;
+			compressed = get_thread_buffer(&compressed, &compressed_capacity, size);
+			ok = file_read_at_offset(compressed, tiff->fp, offset, size) == 1 &&
+			     decode_tile_with_state(decoder_state, ifd->jpeg_tables, (u32)ifd->jpeg_tables_length, compressed, size,
+			                            tile_pixels, tile_pitch, (ifd->color_space == TIFF_PHOTOMETRIC_YCBCR), scale);
+			if (!ok) break;
+			i32 x1 = tile_x * tile_width;
+			i32 y1 = tile_y * tile_height;
+			i32 part_width = MIN(tile_width, width - x1);
+			i32 part_height = MIN(tile_height, height - y1);
+			for (i32 row = 0; row < part_height; ++row) {
+				memcpy(pixels + ((u64)(y1 + row) * width + x1) * 4, tile_pixels + (u64)row * tile_pitch,
+				       (u64)part_width * 4);
+			}
+		}
+	}
+	free(compressed);
+	free(tile_pixels);
+	u8* jpeg = NULL;
+	if (ok) {
+		i32 factor = MAX(1, (MAX(width, height) + SLIDE_CATALOG_THUMBNAIL_SIZE - 1) / SLIDE_CATALOG_THUMBNAIL_SIZE);
+		i32 thumbnail_width = (width + factor - 1) / factor;
+		i32 thumbnail_height = (height + factor - 1) / factor;
+		u8* thumbnail = malloc((u64)thumbnail_width * thumbnail_height * 4);
+		downsample_pixels(pixels, width, height, factor, thumbnail, thumbnail_width, thumbnail_height);
+		u64 size = 0;
+		jpeg = encode_tile_with_quality(thumbnail, thumbnail_width, thumbnail_height, SLIDE_CATALOG_THUMBNAIL_QUALITY, &size);
+		*jpeg_size = (u32)size;
+		free(thumbnail);
+	}
+	free(pixels);
+	return jpeg;
+}
+
+static void free_catalog_item(catalog_item_t* item) {
+	free(item->label_jpeg);
+	free(item->macro_jpeg);
+	item->label_jpeg = NULL;
+	item->macro_jpeg = NULL;
+}
+
+static void update_catalog_item(catalog_item_t* item, const char* path, jpeg_decoder_state_t* decoder_state) {
+	free_catalog_item(item);
+	memset(&item->entry, 0, sizeof(item->entry));
+	item->is_slide = false;
+	tiff_t tiff = {0};
+	if (open_tiff_file(&tiff, path) && tiff.level_count > 0) {
+		item->is_slide = true;
+		slide_catalog_entry_t* entry = &item->entry;
+		entry->name_length = (u32)strlen(item->name);
+		entry->width = tiff.level_images[0].image_width;
+		entry->height = tiff.level_images[0].image_height;
+		entry->level_count = (u32)tiff.level_count;
+		entry->mpp_x = tiff.mpp_x;
+		entry->mpp_y = tiff.mpp_y;
+		entry->filesize = item->filesize;
+		entry->modification_time = (i64)item->modification_time;
+		item->label_jpeg = make_catalog_thumbnail(&tiff, tiff.label_image, decoder_state, &entry->label_size);
+		tiff_ifd_t* overview = tiff.macro_image ? tiff.macro_image : tiff_get_coarsest_level(&tiff);
+		item->macro_jpeg = make_catalog_thumbnail(&tiff, overview, decoder_state, &entry->macro_size);
+		if (!item->label_jpeg) entry->label_size = 0;
+		if (!item->macro_jpeg) entry->macro_size = 0;
+		// Keep the slide index up to date as well (under the path that requests for the slide use).
+		char index_path[2048];
+		const char* slide_path = prepend_env_dir(item->name, "SLIDES_DIR", index_path, sizeof(index_path));
+		if (!is_slide_index_current(slide_path, item->filesize, item->modification_time)) {
+			push_buffer_t serialized_header = {0};
+			tiff_serialize(&tiff, &serialized_header);
+			write_slide_index(slide_path, item->filesize, item->modification_time, &serialized_header);
+			free(serialized_header.raw_memory);
+		}
+	}
+	tiff_destroy(&tiff);
+}
+
+static bool32 is_slide_filename(const char* name) {
+	const char* dot = strrchr(name, '.');
+	if (!dot) return false;
+	return strcasecmp(dot, ".tiff") == 0 || strcasecmp(dot, ".tif") == 0 || strcasecmp(dot, ".ptif") == 0 ||
+	       strcasecmp(dot, ".svs") == 0;
+}
+
+// Returns true if anything changed.
+static bool32 scan_slide_catalog(const char* directory, jpeg_decoder_state_t* decoder_state) {
+	DIR* dir = opendir(directory);
+	if (!dir) return false;
+	bool32 has_changed = false;
+	for (i32 i = 0; i < sb_count(catalog_items); ++i) {
+		catalog_items[i].is_seen = false;
+	}
+	struct dirent* dir_entry;
+	while ((dir_entry = readdir(dir)) != NULL) {
+		// (the API has no room for subdirectories: the filename is a single part of the path)
+		if (!is_slide_filename(dir_entry->d_name) || strlen(dir_entry->d_name) >= sizeof(catalog_items->name)) {
+			continue;
+		}
+		char path[2048];
+		snprintf(path, sizeof(path), "%s/%s", directory, dir_entry->d_name);
+		struct stat st;
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+		catalog_item_t* item = NULL;
+		for (i32 i = 0; i < sb_count(catalog_items); ++i) {
+			if (strcmp(catalog_items[i].name, dir_entry->d_name) == 0) {
+				item = catalog_items + i;
+				break;
+			}
+		}
+		if (!item) {
+			catalog_item_t new_item = {0};
+			snprintf(new_item.name, sizeof(new_item.name), "%s", dir_entry->d_name); // (names that don't fit were skipped above)
+			sb_push(catalog_items, new_item);
+			item = &sb_last(catalog_items);
+		} else if (item->modification_time == st.st_mtime && item->filesize == (i64)st.st_size) {
+			item->is_seen = true;
+			continue;
+		}
+		item->is_seen = true;
+		item->modification_time = st.st_mtime;
+		item->filesize = (i64)st.st_size;
+		update_catalog_item(item, path, decoder_state);
+		has_changed = true;
+	}
+	closedir(dir);
+	for (i32 i = 0; i < sb_count(catalog_items); ) {
+		if (!catalog_items[i].is_seen) {
+			char index_path[2048];
+			remove_slide_index(prepend_env_dir(catalog_items[i].name, "SLIDES_DIR", index_path, sizeof(index_path)));
+			free_catalog_item(catalog_items + i);
+			catalog_items[i] = sb_last(catalog_items);
+			--stb__sbn(catalog_items);
+			has_changed = true;
+		} else {
+			++i;
+		}
+	}
+	return has_changed;
+}
+
+static int compare_catalog_items(const void* a, const void* b) {
+	return strcmp(((catalog_item_t*)a)->name, ((catalog_item_t*)b)->name);
+}
+
+static catalog_response_t* build_catalog_response() {
+	i32 item_count = sb_count(catalog_items);
+	if (item_count > 1) {
+		qsort(catalog_items, item_count, sizeof(catalog_item_t), compare_catalog_items);
+	}
+	u64 size = sizeof(slide_catalog_header_t);
+	u32 slide_count = 0;
+	for (i32 i = 0; i < item_count; ++i) {
+		catalog_item_t* item = catalog_items + i;
+		if (!item->is_slide) continue;
+		size += sizeof(slide_catalog_entry_t) + item->entry.name_length + item->entry.label_size + item->entry.macro_size;
+		++slide_count;
+	}
+	catalog_response_t* response = calloc(1, sizeof(catalog_response_t));
+	response->data = malloc(size);
+	response->size = size;
+	slide_catalog_header_t header = { .magic = SLIDE_CATALOG_MAGIC, .version = SLIDE_CATALOG_VERSION,
+	                                  .slide_count = slide_count };
+	u8* pos = response->data;
+	memcpy(pos, &header, sizeof(header));
+	pos += sizeof(header);
+	for (i32 i = 0; i < item_count; ++i) {
+		catalog_item_t* item = catalog_items + i;
+		if (!item->is_slide) continue;
+		memcpy(pos, &item->entry, sizeof(item->entry));
+		pos += sizeof(item->entry);
+		memcpy(pos, item->name, item->entry.name_length);
+		pos += item->entry.name_length;
+		if (item->entry.label_size) memcpy(pos, item->label_jpeg, item->entry.label_size);
+		pos += item->entry.label_size;
+		if (item->entry.macro_size) memcpy(pos, item->macro_jpeg, item->entry.macro_size);
+		pos += item->entry.macro_size;
+	}
+	u64 hash = 0xcbf29ce484222325ull; // FNV-1a
+	for (u64 i = 0; i < size; ++i) {
+		hash = (hash ^ response->data[i]) * 0x100000001b3ull;
+	}
+	snprintf(response->etag, sizeof(response->etag), "\"%016llx\"", (unsigned long long)hash);
+	response->ref_count = 1;
+	return response;
+}
+
+static void* slide_catalog_thread_proc(void* parameter) {
+	const char* slides_dir = getenv("SLIDES_DIR");
+	const char* directory = (slides_dir && slides_dir[0]) ? slides_dir : ".";
+	const char* rescan_env = getenv("SLIDE_CATALOG_RESCAN_SECONDS");
+	i32 rescan_seconds = (rescan_env && atoi(rescan_env) > 0) ? atoi(rescan_env) : SLIDE_CATALOG_DEFAULT_RESCAN_SECONDS;
+	jpeg_decoder_state_t* decoder_state = jpeg_decoder_create_state();
+	for (bool32 is_first_scan = true; ; is_first_scan = false) {
+		i64 start = get_microseconds();
+		if (scan_slide_catalog(directory, decoder_state) || is_first_scan) {
+			catalog_response_t* response = build_catalog_response();
+			pthread_mutex_lock(&catalog_mutex);
+			catalog_response_t* old_response = catalog_response;
+			catalog_response = response;
+			pthread_mutex_unlock(&catalog_mutex);
+			if (old_response) release_catalog_response(old_response);
+			log_info("Slide catalog: %d files in %s, %llu bytes (updated in %.2f seconds)\n", sb_count(catalog_items),
+			         directory, response->size, (double)(get_microseconds() - start) * 1e-6);
+		}
+		msleep(rescan_seconds * 1000);
+	}
+	return NULL;
+}
+
+static void start_slide_catalog() {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, slide_catalog_thread_proc, NULL) == 0) {
+		pthread_detach(thread);
+	} else {
+		fprintf(stderr, "Could not start the slide catalog thread\n");
+	}
+}
+
+// GET /catalog
+bool32 execute_catalog_api_call(connection_t* connection, slide_api_call_t* call) {
+	pthread_mutex_lock(&catalog_mutex);
+	catalog_response_t* response = catalog_response;
+	if (response) ++response->ref_count;
+	pthread_mutex_unlock(&catalog_mutex);
+	if (!response) {
+		return send_http_status_to_client(connection, "503 Service Unavailable"); // the first scan is still underway
+	}
+	bool32 success = false;
+	char http_headers[512];
+	if (call->if_none_match && strncmp(call->if_none_match, response->etag, strlen(response->etag)) == 0) {
+		snprintf(http_headers, sizeof(http_headers),
+		         "HTTP/1.1 304 Not Modified\r\nConnection: keep-alive\r\nETag: %s\r\nContent-length: 0\r\n\r\n",
+		         response->etag);
+		success = send_buffer_to_client(connection, (u8*)http_headers, strlen(http_headers));
+	} else {
+		snprintf(http_headers, sizeof(http_headers),
+		         "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-type: application/octet-stream\r\nETag: %s\r\n"
+		         "Content-length: %llu\r\n\r\n", response->etag, response->size);
+		success = send_buffer_to_client(connection, (u8*)http_headers, strlen(http_headers)) &&
+		          send_buffer_to_client(connection, response->data, response->size);
+	}
+	release_catalog_response(response);
+	return success;
+}
+
+connection_t* open_connection(int client_sock) {
+	set_socket_blocking(client_sock, false);
+	int no_delay = 1; // send the end of each response right away, the client is waiting for it
+	setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, (char*)&no_delay, sizeof(no_delay));
+
+	struct TLSContext* context = tls_accept(server_context);
+	if (!context) {
+		log_warning("[socket %d] tls_accept() failed\n", client_sock);
+		close_socket(client_sock);
+		return NULL;
+	}
+	// uncomment next line to request client certificate
+//        tls_request_client_certificate(context);
+
+	// make the TLS context serializable (this must be called before negotiation)
+	// Note: the exported keys are also needed to hand the connection over to kernel TLS (see enable_ktls_send()).
+#if SERVER_KTLS
+	tls_make_exportable(context, 1);
+#endif
+
+	connection_t* connection = calloc(1, sizeof(connection_t));
+	connection->socket = client_sock;
+	connection->context = context;
+	connection->last_activity_time = time(NULL);
+	interlocked_increment(&open_connection_count);
+	log_debug("[socket %d] Client connected\n", client_sock);
+	return connection;
+}
+
+void close_connection(connection_t* connection) {
+#ifdef _WIN32
+	shutdown(connection->socket, SD_BOTH);
+#else
+	shutdown(connection->socket, SHUT_RDWR);
+#endif
+	close_socket(connection->socket);
+	if (!connection->is_handshake_done) {
+		interlocked_add_i64(&handshake_stats.failed_count, 1);
+	}
+	tls_destroy_context(connection->context);
+	release_server_client(connection->client);
+	free(connection);
+	interlocked_decrement(&open_connection_count);
 }
 
-// https://stackoverflow.com/questions/21405204/multithread-server-client-implementation-in-c
+// Serves the complete requests in the request buffer. Returns false if the connection should be closed.
+// Tile requests can be sent as streams: each gets a Stream-id, which is echoed in the response, so that the responses
+// don't have to come back in the order of the requests. Stream requests that are buffered together are answered by
+// Stream-priority (highest first), so that e.g. the tiles in view overtake the prefetched ones, instead of waiting
+// behind them. Other requests are answered one at a time, in order, as HTTP/1.1 pipelining requires.
+#define MAX_STREAMS_PER_PASS 64
 
 typedef struct {
-	i32 client_socket;
-	pthread_cond_t cond;
-} thread_data_t;
+	http_request_t* request;
+	i64 offset; // within the request buffer
+	i64 header_size;
+} buffered_request_t;
 
-int main(int argc , char *argv[]) {
-	int socket_desc , client_sock , read_size;
-	socklen_t c;
-	struct sockaddr_in server , client;
+bool32 serve_buffered_requests(connection_t* connection) {
+	int client_sock = connection->socket;
+	// The client may pipeline its requests (send several before waiting for the responses),
+	// so there can be more than one request in the buffer. Handle the complete ones.
+	for (;;) {
+		buffered_request_t requests[MAX_STREAMS_PER_PASS];
+		i32 request_count = 0;
+		i64 consumed_size = 0;
+		bool32 is_bad_request = false;
+		while (request_count < MAX_STREAMS_PER_PASS) {
+			u8* request_start = connection->request_buffer + consumed_size;
+			i64 bytes_available = connection->request_buffer_size - consumed_size;
+			i64 header_size = find_end_of_http_headers(request_start, bytes_available);
+			if (header_size <= 0) break;
+			// interpret the request
+			http_request_t* request = parse_http_headers((char *) request_start, header_size);
+			i64 request_size = request ? header_size + request->content_length : 0;
+			if (!request || request_size > (i64)sizeof(connection->request_buffer) - 1) {
+				free(request);
+				is_bad_request = true;
+				break;
+			}
+			if (bytes_available < request_size) {
+				free(request);
+				break; // wait for the rest of the request body
+			}
+			if (request->stream_id != 0 && strcmp(request->uri, "/tiles") != 0) {
+				request->stream_id = 0; // only tile requests can be part of a stream
+			}
+			if (request_count > 0 && request->stream_id == 0) {
+				free(request);
+				break; // answer it after the streams that came before it
+			}
+			requests[request_count++] = (buffered_request_t){ request, consumed_size, header_size };
+			consumed_size += request_size;
+			if (request->stream_id == 0) break;
+		}
+
+		if (request_count == 0) {
+			if (is_bad_request) {
+				log_warning("[socket %d] Warning: bad request\n", client_sock);
+				send_http_status_to_client(connection, "400 Bad Request");
+				send_close_notify(connection);
+				return false;
+			}
+			break;
+		}
+
+		// Highest priority first (insertion sort, so that equal priorities stay in the order they came in).
+		for (i32 i = 1; i < request_count; ++i) {
+			buffered_request_t item = requests[i];
+			i32 j = i - 1;
+			while (j >= 0 && requests[j].request->stream_priority < item.request->stream_priority) {
+				requests[j + 1] = requests[j];
+				--j;
+			}
+			requests[j + 1] = item;
+		}
+
+		bool32 keep_alive = true;
+		for (i32 i = 0; i < request_count; ++i) {
+			http_request_t* request = requests[i].request;
+			log_debug("[socket %d] Received request: %s\n", client_sock, request->uri);
+			connection->is_bulk = request->is_bulk;
+			if (request->stream_id != 0) {
+				snprintf(connection->stream_header_field, sizeof(connection->stream_header_field),
+				         "Stream-id: %u\r\n", request->stream_id);
+			}
+			slide_api_call_t* call = interpret_api_request(request);
+			if (call) {
+				call->body = connection->request_buffer + requests[i].offset + requests[i].header_size;
+				call->body_size = request->content_length;
+				call->uri = request->uri;
+				call->if_none_match = request->if_none_match;
+				call->accepts_lz4 = request->accepts_lz4;
+				call->tile_quality = request->tile_quality;
+			}
+			bool32 success = execute_slide_api_call(connection, call);
+			count_request(call, success);
+			if (!success) {
+				send_http_status_to_client(connection, "404 Not Found");
+			}
+			send_pending(client_sock, connection->context);
+			connection->stream_header_field[0] = '\0';
+			keep_alive = keep_alive && request->keep_alive;
+			free(call);
+			free(request);
+		}
+		connection->request_buffer_size -= (i32)consumed_size;
+		memmove(connection->request_buffer, connection->request_buffer + consumed_size, connection->request_buffer_size);
+
+		if (!keep_alive) {
+			send_close_notify(connection);
+			return false;
+		}
+		// Bulk work yields to the other connections (and to the bandwidth cap) after every pass.
+		if (connection->is_bulk && connection->request_buffer_size > 0 &&
+		    (client_bulk_bytes_per_second > 0.0 || are_other_connections_ready())) {
+			connection->has_deferred_requests = true;
+			return true;
+		}
+	}
+
+	if (connection->request_buffer_size == sizeof(connection->request_buffer) - 1) {
+		log_warning("[socket %d] Warning: request too long\n", client_sock);
+		send_http_status_to_client(connection, "400 Bad Request");
+		send_close_notify(connection);
+		return false;
+	}
+	return true;
+}
+
+// Called on a worker thread when data has arrived. Reads everything that is available without blocking.
+// Returns false if the connection should be closed.
+bool32 handle_connection_input(connection_t* connection) {
+	int client_sock = connection->socket;
+	struct TLSContext* context = connection->context;
 	char client_message[0xFFFF];
+	if (connection->has_deferred_requests) {
+		connection->has_deferred_requests = false;
+		if (!serve_buffered_requests(connection)) {
+			return false;
+		}
+		if (connection->has_deferred_requests) return true;
+	}
+	for (;;) {
+		int read_size = recv(client_sock, client_message, sizeof(client_message), 0);
+		if (read_size < 0) {
+			if (socket_would_block()) {
+				return true; // nothing more for now
+			}
+			log_warning("[socket %d] recv failed: %s\n", client_sock, strerror(errno));
+			return false;
+		} else if (read_size == 0) {
+			log_debug("[socket %d] Gracefully closed\n", client_sock);
+			return false;
+		}
+		i64 start_microseconds = connection->is_handshake_done ? 0 : get_microseconds();
+		if (tls_consume_stream(context, (u8*) client_message, read_size, verify_signature) < 0) {
+			log_warning("[socket %d] Error in stream consume\n", client_sock);
+			return false;
+		}
+		send_pending(client_sock, context);
+		if (!connection->is_handshake_done) {
+			connection->handshake_microseconds += get_microseconds() - start_microseconds;
+			if (tls_established(context) == 1) {
+				connection->is_handshake_done = true;
+				if (tls_is_resumed(context)) {
+					interlocked_add_i64(&handshake_stats.resumed_count, 1);
+					interlocked_add_i64(&handshake_stats.resumed_microseconds, connection->handshake_microseconds);
+				} else {
+					interlocked_add_i64(&handshake_stats.full_count, 1);
+					interlocked_add_i64(&handshake_stats.full_microseconds, connection->handshake_microseconds);
+				}
+			}
+		}
+		if (tls_established(context) == 1) {
+			if (!connection->tried_ktls) {
+				connection->tried_ktls = true;
+				log_debug("USED CIPHER: %s\n", tls_cipher_name(context));
+#if SERVER_KTLS
+				if (enable_ktls_send(connection)) {
+					log_debug("[socket %d] Using kernel TLS for sending\n", client_sock);
+				}
+#endif
+			}
+			int size;
+			while ((size = tls_read(context, connection->request_buffer + connection->request_buffer_size,
+			                        sizeof(connection->request_buffer) - 1 - connection->request_buffer_size)) > 0) {
+				connection->request_buffer_size += size;
+			}
+			if (!serve_buffered_requests(connection)) {
+				return false;
+			}
+			if (connection->has_deferred_requests) {
+				return true; // the rest comes after the other connections had their turn
+			}
+		}
+	}
+}
+
+void* worker(void* arg_ptr) {
+	for (;;) {
+		connection_t* connection = pop_ready_connection();
+		if (!connection) continue;
+		if (handle_connection_input(connection)) {
+			connection->last_activity_time = time(NULL);
+			if (connection->has_deferred_requests) {
+				push_ready_connection(connection); // (no need to wait for the socket, there is work left)
+			} else {
+				charge_connection_traffic(connection);
+				return_connection(connection);
+			}
+		} else {
+			close_connection(connection);
+		}
+	}
+	return 0;
+}
+
+bool32 create_wake_socket() {
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0) return false;
+	struct sockaddr_in address = { .sin_family = AF_INET };
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t address_size = sizeof(address);
+	if (bind(sock, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+	    getsockname(sock, (struct sockaddr*)&address, &address_size) != 0 ||
+	    connect(sock, (struct sockaddr*)&address, sizeof(address)) != 0) {
+		close_socket(sock);
+		return false;
+	}
+	set_socket_blocking(sock, false);
+	wake_socket = sock;
+	return true;
+}
+
+i32 get_worker_thread_count() {
+#ifdef _WIN32
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	i32 core_count = (i32)system_info.dwNumberOfProcessors;
+#else
+	i32 core_count = (i32)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	i32 thread_count = core_count * WORKER_THREADS_PER_CORE;
+	return CLAMP(thread_count, 2, MAX_WORKER_THREAD_COUNT);
+}
+
+int main(int argc , char *argv[]) {
+	int socket_desc;
+	struct sockaddr_in server;
 
 #ifdef _WIN32
 	WSADATA wsaData;
@@ -710,23 +4115,70 @@ int main(int argc , char *argv[]) {
 #else
 	signal(SIGPIPE, SIG_IGN);
 #endif
+	cpu_dispatch_init(); // picks the SIMD kernels (may be overridden with the CPU_KERNELS environment variable)
+	log_init(stderr, SERVER_VERBOSE ? LOG_LEVEL_DEBUG : LOG_LEVEL_INFO);
 
-	tls_init();
-
-	pthread_t threads[THREAD_COUNT] = {0};
-
-	pthread_cond_init(&semaphore_work_available, NULL);
-	pthread_mutex_init(&work_mutex, NULL);
-
-	pthread_mutex_lock(&work_mutex);
+	// Offline mode: generate the missing pyramid levels of the given slides (see build_pyramid_sidecar()), then exit.
+	if (argc > 2 && strcmp(argv[1], "--build-pyramid") == 0) {
+		int exit_code = 0;
+		for (i32 i = 2; i < argc; ++i) {
+			char path_buffer[2048];
+			const char* filename = prepend_env_dir(argv[i], "SLIDES_DIR", path_buffer, sizeof(path_buffer));
+			tiff_t tiff = {0};
+			if (open_tiff_file(&tiff, filename)) {
+				if (!build_pyramid_sidecar(&tiff, filename)) exit_code = 1;
+				tiff_destroy(&tiff);
+			} else {
+				fprintf(stderr, "Couldn't open TIFF file %s\n", filename);
+				exit_code = 1;
+			}
+		}
+		return exit_code;
+	}
 
-	for (i64 i = 1; i < COUNT(threads); ++i) {
-		if (pthread_create(threads + i, NULL, &worker, (void*)i) != 0) {
-			fprintf(stderr, "Error creating thread\n");
+	// Offline mode: index the given slides, or all slides in SLIDES_DIR (see write_slide_index()), then exit.
+	if (argc > 1 && strcmp(argv[1], "--build-index") == 0) {
+		if (!getenv("SLIDE_INDEX_DIR")) {
+			fprintf(stderr, "Set SLIDE_INDEX_DIR to the directory for the index\n");
 			return 1;
 		}
+		init_slide_index();
+		char** filenames = NULL; // sb
+		for (i32 i = 2; i < argc; ++i) {
+			sb_push(filenames, strdup(argv[i]));
+		}
+		if (argc == 2) {
+			const char* slides_dir = getenv("SLIDES_DIR");
+			DIR* dir = opendir((slides_dir && slides_dir[0]) ? slides_dir : ".");
+			struct dirent* dir_entry;
+			while (dir && (dir_entry = readdir(dir)) != NULL) {
+				if (is_slide_filename(dir_entry->d_name)) sb_push(filenames, strdup(dir_entry->d_name));
+			}
+			if (dir) closedir(dir);
+		}
+		int exit_code = 0;
+		i32 indexed_count = 0;
+		for (i32 i = 0; i < sb_count(filenames); ++i) {
+			char path_buffer[2048];
+			const char* filename = prepend_env_dir(filenames[i], "SLIDES_DIR", path_buffer, sizeof(path_buffer));
+			bool32 was_current = false;
+			if (!update_slide_index(filename, &was_current)) {
+				fprintf(stderr, "Couldn't open TIFF file %s\n", filename);
+				exit_code = 1;
+			} else if (!was_current) {
+				++indexed_count;
+			}
+			free(filenames[i]);
+		}
+		fprintf(stderr, "Slide index: %d of %d slides (re)indexed\n", indexed_count, sb_count(filenames));
+		sb_free(filenames);
+		return exit_code;
 	}
 
+	tls_init();
+	init_server_tile_cache();
+	init_slide_index();
+
 	socket_desc = socket(AF_INET , SOCK_STREAM , 0);
 	if (socket_desc == -1) {
 		printf("Could not create socket");
@@ -744,19 +4196,15 @@ int main(int argc , char *argv[]) {
 	server.sin_port = htons(port);
 
 	int enable = 1;
-	int timeout = 5000;
 	setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, (char*)&enable, sizeof(int));
-	setsockopt(socket_desc, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(int));
-	setsockopt(socket_desc, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(int));
 
 	if( bind(socket_desc,(struct sockaddr *)&server , sizeof(server)) < 0) {
 		perror("bind failed. Error");
 		return 1;
 	}
 
-	listen(socket_desc , 3);
-
-	c = sizeof(struct sockaddr_in);
+	listen(socket_desc, SOMAXCONN);
+	set_socket_blocking(socket_desc, false);
 
 	/*struct TLSContext **/server_context = tls_create_context(1, TLS_V13);
 
@@ -765,27 +4213,123 @@ int main(int argc , char *argv[]) {
 	if (!load_keys(server_context, "testcert/fullchain.pem", "testcert/privkey.pem")) {
 		exit(1);
 	}
+	// Clients that reconnect (after being idle, or after an error) can then skip most of the handshake.
+	if (tls_enable_session_tickets(server_context) != 0) {
+		fprintf(stderr, "Could not enable TLS session tickets\n");
+	}
+
+	if (!create_wake_socket()) {
+		fprintf(stderr, "Could not create the wake-up socket\n");
+		return 1;
+	}
+
+	const char* bulk_cap_env = getenv("SERVER_CLIENT_BULK_MBPS");
+	if (bulk_cap_env && atof(bulk_cap_env) > 0.0) {
+		client_bulk_bytes_per_second = atof(bulk_cap_env) * MEGABYTES(1);
+		fprintf(stderr, "Bulk traffic capped at %.1f MB/s per client\n", atof(bulk_cap_env));
+	}
+
+	init_shard_ring(port);
+	start_slide_catalog();
+	start_tile_datagram_server();
+	start_tile_warming();
+
+	i32 worker_thread_count = get_worker_thread_count();
+	for (i64 i = 0; i < worker_thread_count; ++i) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, &worker, (void*)i) != 0) {
+			fprintf(stderr, "Error creating thread\n");
+			return 1;
+		}
+	}
+
+	fprintf(stderr, "Listening on port %d (%d worker threads)\n", port, worker_thread_count);
 
-	fprintf(stderr, "Listening on port %d\n", port);
+	// The connections that are not being served by a worker right now, waiting for the client to send something.
+	connection_t** idle_connections = malloc(MAX_CONNECTION_COUNT * sizeof(connection_t*));
+	i32 idle_connection_count = 0;
+	struct pollfd* poll_fds = malloc((MAX_CONNECTION_COUNT + 2) * sizeof(struct pollfd));
+
+	for (;;) {
+		// Take back the connections the workers are done with.
+		spin_lock(&finished_connections_lock);
+		connection_t* finished = finished_connections;
+		finished_connections = NULL;
+		spin_unlock(&finished_connections_lock);
+		while (finished) {
+			connection_t* next = finished->next;
+			idle_connections[idle_connection_count++] = finished;
+			finished = next;
+		}
 
-	while (1) {
-		identity_str[0] = 0;
+		// Give up on connections on which the client has gone quiet.
+		time_t now = time(NULL);
+		for (i32 i = 0; i < idle_connection_count; ) {
+			connection_t* connection = idle_connections[i];
+			if (now - connection->last_activity_time > CONNECTION_IDLE_TIMEOUT_SECONDS) {
+				log_debug("[socket %d] Closing idle connection\n", connection->socket);
+				send_close_notify(connection);
+				close_connection(connection);
+				idle_connections[i] = idle_connections[--idle_connection_count];
+			} else {
+				++i;
+			}
+		}
 
-		client_sock = accept(socket_desc, (struct sockaddr *)&client, &c);
-		if (client_sock < 0) {
-			perror("accept failed");
+		poll_fds[0] = (struct pollfd){ .fd = socket_desc, .events = POLLIN };
+		poll_fds[1] = (struct pollfd){ .fd = wake_socket, .events = POLLIN };
+		for (i32 i = 0; i < idle_connection_count; ++i) {
+			poll_fds[2 + i] = (struct pollfd){ .fd = idle_connections[i]->socket, .events = POLLIN };
+		}
+		// Wake up once a second to check the idle timeouts.
+		if (poll(poll_fds, 2 + idle_connection_count, 1000) < 0) {
+			if (errno == EINTR) continue;
+			perror("poll failed");
 			return 1;
 		}
 
-		work_available = client_sock;
-		while (work_available) {
-			pthread_mutex_unlock(&work_mutex);
-			pthread_cond_signal(&semaphore_work_available);
-			msleep(1);
-//			pthread_mutex_lock(&work_mutex);
-//			printf("waiting for someone to grab the work\n");
+		if (poll_fds[1].revents) {
+			u8 dummy[64];
+			while (recv(wake_socket, (char*)dummy, sizeof(dummy), 0) > 0) {}
+		}
+
+		// Hand the connections that have something to read over to the workers.
+		// Note: a connection that was closed by the client or has an error also needs to be read from, to find out.
+		i32 still_idle_count = 0;
+		for (i32 i = 0; i < idle_connection_count; ++i) {
+			connection_t* connection = idle_connections[i];
+			if (poll_fds[2 + i].revents) {
+				push_ready_connection(connection);
+			} else {
+				idle_connections[still_idle_count++] = connection;
+			}
 		}
+		idle_connection_count = still_idle_count;
 
+		if (poll_fds[0].revents & POLLIN) {
+			for (;;) {
+				struct sockaddr_in client;
+				socklen_t c = sizeof(struct sockaddr_in);
+				int client_sock = accept(socket_desc, (struct sockaddr *)&client, &c);
+				if (client_sock < 0) {
+					if (!socket_would_block() && errno != EINTR) {
+						perror("accept failed");
+					}
+					break;
+				}
+				if (open_connection_count >= MAX_CONNECTION_COUNT) {
+					log_warning("[socket %d] Too many connections, refusing\n", client_sock);
+					close_socket(client_sock);
+					continue;
+				}
+				connection_t* connection = open_connection(client_sock);
+				if (connection) {
+					connection->client = acquire_server_client(client.sin_addr.s_addr);
+					// The client speaks first (ClientHello), so wait for it to arrive.
+					idle_connections[idle_connection_count++] = connection;
+				}
+			}
+		}
 	}
 	tls_destroy_context(server_context);
 	return 0;
@@ -103,34 +103,46 @@ void write_stringified_shaders() {
 
 #endif
 
+static const char* find_stringified_shader_source(const char* source_filename) {
+	const char* stripped_filename = one_past_last_slash(source_filename, MAX_SHADER_FILENAME);
+	char source_name_temp[MAX_SHADER_FILENAME] = {};
+	strncpy(source_name_temp, stripped_filename, MAX_SHADER_FILENAME - 1);
+	dots_to_underscores(source_name_temp, MAX_SHADER_FILENAME);
+	for (i32 i = 0; i < COUNT(stringified_shader_source_names); ++i) {
+		if (strncmp(source_name_temp, stringified_shader_source_names[i], MAX_SHADER_FILENAME) == 0) {
+			return stringified_shader_sources[i];
+		}
+	}
+	return NULL;
+}
+
+// Debug builds load the shader sources from file (so that they can be edited, and stringified again). Release builds
+// use the embedded sources, and only read the file if a shader is missing from stringified_shaders.c; this saves the
+// file I/O at startup.
 void load_shader(u32 shader, const char* source_filename) {
-	mem_t* shader_source_file = platform_read_entire_file(source_filename);
 	const char* shader_source = NULL;
+	mem_t* shader_source_file = NULL;
 	bool32 source_from_file = false;
-
-	if (shader_source_file) {
-		source_from_file = true;
-		shader_source = (char*) shader_source_file->data;
+#ifndef STRINGIFY_SHADERS
+	shader_source = find_stringified_shader_source(source_filename);
+#endif
+	if (!shader_source) {
+		shader_source_file = platform_read_entire_file(source_filename);
+		if (shader_source_file) {
+			source_from_file = true;
+			shader_source = (char*) shader_source_file->data;
 
 #ifdef STRINGIFY_SHADERS
-		const char* stripped_filename = one_past_last_slash(source_filename, MAX_SHADER_FILENAME);
+			const char* stripped_filename = one_past_last_slash(source_filename, MAX_SHADER_FILENAME);
 
-		ASSERT(shader_count < COUNT(shader_filenames));
-		shader_sources[shader_count] = strdup(shader_source);
-		strncpy(shader_filenames[shader_count], stripped_filename, MAX_SHADER_FILENAME);
+			ASSERT(shader_count < COUNT(shader_filenames));
+			shader_sources[shader_count] = strdup(shader_source);
+			strncpy(shader_filenames[shader_count], stripped_filename, MAX_SHADER_FILENAME);
 #endif
-		++shader_count;
-	} else {
-		are_any_shader_sources_missing = true;
-		const char* stripped_filename = one_past_last_slash(source_filename, MAX_SHADER_FILENAME);
-		char source_name_temp[MAX_SHADER_FILENAME] = {};
-		strncpy(source_name_temp, stripped_filename, MAX_SHADER_FILENAME);
-		dots_to_underscores(source_name_temp, MAX_SHADER_FILENAME);
-		for (i32 i = 0; i < COUNT(stringified_shader_source_names); ++i) {
-			const char* name = stringified_shader_source_names[i];
-			if (strncmp(source_name_temp, name, MAX_SHADER_FILENAME) == 0) {
-				shader_source = stringified_shader_sources[i];
-			}
+			++shader_count;
+		} else {
+			are_any_shader_sources_missing = true;
+			shader_source = find_stringified_shader_source(source_filename);
 		}
 	}
 
@@ -187,6 +199,30 @@ u32 load_basic_shader_program(const char* vert_filename, const char* frag_filena
 	return shader_program;
 }
 
+#if defined(GL_VERSION_4_3)
+// Returns 0 if the shader does not compile or link (compute shaders are only used for optional features).
+u32 load_compute_shader_program(const char* comp_filename) {
+	u32 compute_shader = glCreateShader(GL_COMPUTE_SHADER);
+	load_shader(compute_shader, comp_filename);
+
+	u32 shader_program = glCreateProgram();
+	glAttachShader(shader_program, compute_shader);
+	glLinkProgram(shader_program);
+	glDeleteShader(compute_shader);
+
+	i32 success;
+	glGetProgramiv(shader_program, GL_LINK_STATUS, &success);
+	if (!success) {
+		char info_log[2048];
+		glGetProgramInfoLog(shader_program, sizeof(info_log), NULL, info_log);
+		printf("Error: shader linking failed: %s", info_log);
+		glDeleteProgram(shader_program);
+		return 0;
+	}
+	return shader_program;
+}
+#endif
+
 i32 get_attrib(i32 program, const char *name) {
 	i32 attribute = glGetAttribLocation(program, name);
 	if(attribute == -1)
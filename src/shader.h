@@ -36,6 +36,7 @@ void write_stringified_shaders();
 
 void load_shader(u32 shader, const char* source_filename);
 u32 load_basic_shader_program(const char* vert_filename, const char* frag_filename);
+u32 load_compute_shader_program(const char* comp_filename); // needs OpenGL 4.3
 i32 get_attrib(i32 program, const char *name);
 i32 get_uniform(i32 program, const char *name);
 
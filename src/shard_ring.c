@@ -0,0 +1,144 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shard_ring.h"
+
+static u64 shard_ring_hash(const char* s, size_t length) {
+	u64 hash = 0xcbf29ce484222325ull; // FNV-1a
+	for (size_t i = 0; i < length; ++i) {
+		hash = (hash ^ (u8)s[i]) * 0x100000001b3ull;
+	}
+	// FNV-1a of similar strings (like "host:2000#1" and "host:2000#2") ends up in similar places; mix the bits up.
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdull;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ull;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+static int compare_shard_ring_points(const void* a, const void* b) {
+	const shard_ring_point_t* point_a = (const shard_ring_point_t*) a;
+	const shard_ring_point_t* point_b = (const shard_ring_point_t*) b;
+	if (point_a->hash != point_b->hash) return (point_a->hash < point_b->hash) ? -1 : 1;
+	return point_a->node_index - point_b->node_index;
+}
+
+// Reads a node list into nodes; nodes without a port get default_portno. Returns the number of nodes.
+i32 shard_ring_parse_nodes(const char* node_list, i32 default_portno, shard_node_t* nodes, i32 max_node_count) {
+	i32 node_count = 0;
+	const char* pos = node_list;
+	while (pos && *pos) {
+		size_t length = strcspn(pos, ",\r\n");
+		const char* start = pos;
+		pos += length;
+		if (*pos) ++pos;
+		while (length > 0 && (*start == ' ' || *start == '\t')) { ++start; --length; }
+		while (length > 0 && (start[length-1] == ' ' || start[length-1] == '\t')) --length;
+		if (length == 0) continue;
+		if (node_count == max_node_count) {
+			printf("Node list: too many nodes (the maximum is %d)\n", max_node_count);
+			break;
+		}
+		shard_node_t* node = nodes + node_count;
+		const char* colon = memchr(start, ':', length);
+		size_t hostname_length = colon ? (size_t)(colon - start) : length;
+		if (hostname_length == 0 || hostname_length >= sizeof(node->hostname)) continue;
+		memcpy(node->hostname, start, hostname_length);
+		node->hostname[hostname_length] = '\0';
+		node->portno = colon ? atoi(colon + 1) : default_portno;
+		if (node->portno <= 0) continue;
+		bool32 is_duplicate = false;
+		for (i32 i = 0; i < node_count; ++i) {
+			if (nodes[i].portno == node->portno && strcmp(nodes[i].hostname, node->hostname) == 0) is_duplicate = true;
+		}
+		if (!is_duplicate) ++node_count;
+	}
+	return node_count;
+}
+
+// Builds the ring from a node list; nodes without a port get default_portno. Returns false if there are no nodes.
+bool32 shard_ring_parse(shard_ring_t* ring, const char* node_list, i32 default_portno) {
+	memset(ring, 0, sizeof(*ring));
+	ring->node_count = shard_ring_parse_nodes(node_list, default_portno, ring->nodes, SHARD_RING_MAX_NODES);
+	if (ring->node_count == 0) return false;
+
+	ring->point_count = ring->node_count * SHARD_RING_POINTS_PER_NODE;
+	ring->points = (shard_ring_point_t*) malloc(ring->point_count * sizeof(shard_ring_point_t));
+	for (i32 node_index = 0; node_index < ring->node_count; ++node_index) {
+		shard_node_t* node = ring->nodes + node_index;
+		for (i32 i = 0; i < SHARD_RING_POINTS_PER_NODE; ++i) {
+			char point_name[300];
+			i32 point_name_length = snprintf(point_name, sizeof(point_name), "%s:%d#%d", node->hostname, node->portno, i);
+			shard_ring_point_t* point = ring->points + node_index * SHARD_RING_POINTS_PER_NODE + i;
+			point->hash = shard_ring_hash(point_name, (size_t)point_name_length);
+			point->node_index = node_index;
+		}
+	}
+	qsort(ring->points, ring->point_count, sizeof(shard_ring_point_t), compare_shard_ring_points);
+	return true;
+}
+
+void shard_ring_destroy(shard_ring_t* ring) {
+	free(ring->points);
+	memset(ring, 0, sizeof(*ring));
+}
+
+// Returns the index of the node that the slide belongs to, or -1 if the ring is empty.
+i32 shard_ring_lookup(shard_ring_t* ring, const char* slide_name) {
+	if (ring->point_count == 0) return -1;
+	u64 hash = shard_ring_hash(slide_name, strlen(slide_name));
+	// Binary search for the first point at or after the hash (wrapping around past the last one).
+	i32 low = 0;
+	i32 high = ring->point_count;
+	while (low < high) {
+		i32 mid = low + (high - low) / 2;
+		if (ring->points[mid].hash < hash) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	if (low == ring->point_count) low = 0;
+	return ring->points[low].node_index;
+}
+
+i32 shard_ring_find_node(shard_ring_t* ring, const char* hostname, i32 portno) {
+	for (i32 i = 0; i < ring->node_count; ++i) {
+		if (ring->nodes[i].portno == portno && strcmp(ring->nodes[i].hostname, hostname) == 0) return i;
+	}
+	return -1;
+}
+
+// Writes out the node list, in the form that shard_ring_parse() reads.
+void shard_ring_format(shard_ring_t* ring, char* dest, size_t dest_size) {
+	size_t used = 0;
+	if (dest_size > 0) dest[0] = '\0';
+	for (i32 i = 0; i < ring->node_count && used < dest_size; ++i) {
+		i32 written = snprintf(dest + used, dest_size - used, "%s%s:%d", i > 0 ? "," : "", ring->nodes[i].hostname,
+		                       ring->nodes[i].portno);
+		if (written < 0) break;
+		used += (size_t)written;
+	}
+}
@@ -0,0 +1,65 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+// Slides can be spread over several servers ("nodes"), so that each node only needs to keep its own share of the
+// slides in its caches. Which node a slide belongs to is decided by consistent hashing of the slide's filename: every
+// node gets many points on a ring of hash values, and a slide belongs to the node that owns the first point at or after
+// the slide's hash. Only the names of the nodes go into the ring, so the server and the clients all come to the same
+// answer without talking to each other; and when a node is added, only the slides that the new node takes over move
+// (about 1/N of them), so the other nodes keep their caches warm.
+// A node list is written as "host:port,host:port,..." (as in the SERVER_NODES environment variable of the server, and
+// in the response to /nodes).
+
+#define SHARD_RING_MAX_NODES 64
+#define SHARD_RING_POINTS_PER_NODE 128 // more points spread the slides more evenly over the nodes
+
+typedef struct shard_node_t {
+	char hostname[256];
+	i32 portno;
+} shard_node_t;
+
+typedef struct shard_ring_point_t {
+	u64 hash;
+	i32 node_index;
+} shard_ring_point_t;
+
+typedef struct shard_ring_t {
+	shard_node_t nodes[SHARD_RING_MAX_NODES];
+	i32 node_count;
+	shard_ring_point_t* points; // sorted by hash
+	i32 point_count;
+} shard_ring_t;
+
+i32 shard_ring_parse_nodes(const char* node_list, i32 default_portno, shard_node_t* nodes, i32 max_node_count);
+bool32 shard_ring_parse(shard_ring_t* ring, const char* node_list, i32 default_portno);
+void shard_ring_destroy(shard_ring_t* ring);
+i32 shard_ring_lookup(shard_ring_t* ring, const char* slide_name);
+i32 shard_ring_find_node(shard_ring_t* ring, const char* hostname, i32 portno);
+void shard_ring_format(shard_ring_t* ring, char* dest, size_t dest_size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,225 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include "intrinsics.h"
+
+#include <stdio.h>
+
+#if WINDOWS
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define SHARED_TILE_CACHE_IMPL
+#include "shared_tile_cache.h"
+
+static i64 get_shared_tile_cache_mapping_size() {
+	return sizeof(shared_tile_cache_header_t) +
+	       (i64)SHARED_TILE_CACHE_BUCKET_COUNT * SHARED_TILE_CACHE_SLOTS_PER_BUCKET * sizeof(shared_tile_cache_slot_t) +
+	       SHARED_TILE_CACHE_DATA_SIZE;
+}
+
+// FNV-1a over the identity, mixed with the file size (so that a slide that was replaced isn't mixed up with the old one)
+u64 shared_tile_cache_slide_id(const char* identity, i64 filesize) {
+	u64 hash = 0xcbf29ce484222325ull;
+	for (const char* c = identity; *c; ++c) {
+		hash = (hash ^ (u8)*c) * 0x100000001b3ull;
+	}
+	hash = (hash ^ (u64)filesize) * 11400714819323198485llu;
+	return hash;
+}
+
+u64 shared_tile_cache_key(u64 slide_id, i32 level, i32 tile_index) {
+	u64 key = slide_id ^ ((((u64)(level & 0xFF) << 40) | ((u64)tile_index & 0xFFFFFFFFFF)) * 0x9E3779B97F4A7C15ull);
+	return key | 1; // (0 marks an empty slot)
+}
+
+// Opens the shared memory, or creates it if this is the first instance. The memory starts out zeroed, which is an empty
+// cache, so the creator only needs to fill in the header. Returns false if the shared memory can't be used (e.g. because
+// an instance of another version created it).
+bool32 shared_tile_cache_open(shared_tile_cache_t* cache) {
+	memset(cache, 0, sizeof(*cache));
+	i64 mapping_size = get_shared_tile_cache_mapping_size();
+	bool32 is_creator = false;
+#if WINDOWS
+	HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)(mapping_size >> 32),
+	                                    (DWORD)(mapping_size & 0xFFFFFFFF), "Local\\" SHARED_TILE_CACHE_NAME);
+	if (!mapping) {
+		printf("Shared tile cache: could not create the file mapping (error code 0x%x)\n", (u32)GetLastError());
+		return false;
+	}
+	is_creator = (GetLastError() != ERROR_ALREADY_EXISTS);
+	u8* base = (u8*) MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, (size_t)mapping_size);
+	if (!base) {
+		printf("Shared tile cache: could not map the shared memory (error code 0x%x)\n", (u32)GetLastError());
+		CloseHandle(mapping);
+		return false;
+	}
+	cache->mapping = mapping;
+#else
+	int fd = shm_open("/" SHARED_TILE_CACHE_NAME, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd >= 0) {
+		is_creator = true;
+		if (ftruncate(fd, mapping_size) != 0) {
+			close(fd);
+			shm_unlink("/" SHARED_TILE_CACHE_NAME);
+			return false;
+		}
+	} else {
+		fd = shm_open("/" SHARED_TILE_CACHE_NAME, O_RDWR, 0600);
+		if (fd < 0) return false;
+	}
+	u8* base = (u8*) mmap(NULL, (size_t)mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) return false;
+	cache->mapping = (void*)(intptr_t)mapping_size;
+#endif
+	cache->base = base;
+	cache->header = (shared_tile_cache_header_t*) base;
+	cache->slots = (shared_tile_cache_slot_t*) (base + sizeof(shared_tile_cache_header_t));
+	cache->data = (u8*)(cache->slots + (i64)SHARED_TILE_CACHE_BUCKET_COUNT * SHARED_TILE_CACHE_SLOTS_PER_BUCKET);
+
+	shared_tile_cache_header_t* header = cache->header;
+	if (is_creator) {
+		header->version = SHARED_TILE_CACHE_VERSION;
+		header->data_size = SHARED_TILE_CACHE_DATA_SIZE;
+		header->bucket_count = SHARED_TILE_CACHE_BUCKET_COUNT;
+		header->slots_per_bucket = SHARED_TILE_CACHE_SLOTS_PER_BUCKET;
+		write_barrier;
+		header->magic = SHARED_TILE_CACHE_MAGIC;
+	} else {
+		// The creator may still be filling in the header.
+		for (i32 i = 0; i < 100 && header->magic == 0; ++i) {
+#if WINDOWS
+			Sleep(1);
+#else
+			usleep(1000);
+#endif
+		}
+		read_barrier;
+	}
+	if (header->magic != SHARED_TILE_CACHE_MAGIC || header->version != SHARED_TILE_CACHE_VERSION ||
+	    header->data_size != SHARED_TILE_CACHE_DATA_SIZE || header->bucket_count != SHARED_TILE_CACHE_BUCKET_COUNT ||
+	    header->slots_per_bucket != SHARED_TILE_CACHE_SLOTS_PER_BUCKET) {
+		printf("Shared tile cache: the shared memory has an unexpected layout, not using it\n");
+		shared_tile_cache_close(cache);
+		return false;
+	}
+	cache->is_open = true;
+	cache->enabled = true;
+	return true;
+}
+
+void shared_tile_cache_close(shared_tile_cache_t* cache) {
+	if (cache->base) {
+#if WINDOWS
+		UnmapViewOfFile(cache->base);
+		CloseHandle((HANDLE)cache->mapping);
+#else
+		munmap(cache->base, (size_t)(intptr_t)cache->mapping);
+#endif
+	}
+	memset(cache, 0, sizeof(*cache));
+}
+
+static shared_tile_cache_slot_t* get_shared_tile_cache_bucket(shared_tile_cache_t* cache, u64 key) {
+	u64 hash = key * 11400714819323198485llu; // Fibonacci hashing
+	i32 bucket_index = (i32)(hash >> 32) & (SHARED_TILE_CACHE_BUCKET_COUNT - 1);
+	return cache->slots + (i64)bucket_index * SHARED_TILE_CACHE_SLOTS_PER_BUCKET;
+}
+
+// The data of a tile may wrap around the end of the ring.
+static void copy_from_ring(shared_tile_cache_t* cache, i64 position, u8* dest, u32 size) {
+	i64 offset = position % SHARED_TILE_CACHE_DATA_SIZE;
+	i64 first_part = ATMOST((i64)size, SHARED_TILE_CACHE_DATA_SIZE - offset);
+	memcpy(dest, cache->data + offset, first_part);
+	memcpy(dest + first_part, cache->data, size - first_part);
+}
+
+static void copy_to_ring(shared_tile_cache_t* cache, i64 position, u8* src, u32 size) {
+	i64 offset = position % SHARED_TILE_CACHE_DATA_SIZE;
+	i64 first_part = ATMOST((i64)size, SHARED_TILE_CACHE_DATA_SIZE - offset);
+	memcpy(cache->data + offset, src, first_part);
+	memcpy(cache->data, src + first_part, size - first_part);
+}
+
+static bool32 is_still_in_ring(shared_tile_cache_t* cache, i64 position) {
+	return cache->header->write_position <= position + SHARED_TILE_CACHE_DATA_SIZE;
+}
+
+bool32 shared_tile_cache_lookup(shared_tile_cache_t* cache, u64 key, u8* dest, u32 dest_capacity, u32* size) {
+	if (!cache->is_open || !cache->enabled) return false;
+	shared_tile_cache_slot_t* bucket = get_shared_tile_cache_bucket(cache, key);
+	for (i32 i = 0; i < SHARED_TILE_CACHE_SLOTS_PER_BUCKET; ++i) {
+		shared_tile_cache_slot_t* slot = bucket + i;
+		i32 sequence = slot->sequence;
+		if (sequence & 1) continue; // being written
+		read_barrier;
+		if (slot->key != key) continue;
+		u32 slot_size = slot->size;
+		i64 position = slot->position;
+		read_barrier;
+		if (slot->sequence != sequence) break; // changed while reading, so the tile was replaced
+		if (slot_size > dest_capacity || !is_still_in_ring(cache, position)) break;
+		copy_from_ring(cache, position, dest, slot_size);
+		read_barrier;
+		if (!is_still_in_ring(cache, position)) break; // overwritten while copying
+		*size = slot_size;
+		++cache->hit_count;
+		return true;
+	}
+	++cache->miss_count;
+	return false;
+}
+
+// Takes the slot with the same key, or an empty one, or else the one with the oldest data.
+void shared_tile_cache_insert(shared_tile_cache_t* cache, u64 key, u8* data, u32 size) {
+	if (!cache->is_open || !cache->enabled) return;
+	if (size == 0 || size > SHARED_TILE_CACHE_MAX_TILE_SIZE) return;
+	shared_tile_cache_slot_t* bucket = get_shared_tile_cache_bucket(cache, key);
+	shared_tile_cache_slot_t* victim = bucket;
+	for (i32 i = 0; i < SHARED_TILE_CACHE_SLOTS_PER_BUCKET; ++i) {
+		shared_tile_cache_slot_t* slot = bucket + i;
+		if (slot->key == key) {
+			if (is_still_in_ring(cache, slot->position)) return; // another instance was first
+			victim = slot;
+			break;
+		}
+		if (slot->key == 0 || slot->position < victim->position) {
+			victim = slot;
+			if (slot->key == 0) break;
+		}
+	}
+	i32 sequence = victim->sequence;
+	if (sequence & 1) return;
+	if (interlocked_compare_exchange(&victim->sequence, sequence + 1, sequence) != sequence) return; // lost the race
+
+	i64 position = interlocked_add_i64(&cache->header->write_position, (i64)size) - size;
+	copy_to_ring(cache, position, data, size);
+	victim->key = key;
+	victim->size = size;
+	victim->position = position;
+	write_barrier;
+	victim->sequence = sequence + 2;
+	++cache->insert_count;
+}
@@ -0,0 +1,100 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+// Compressed tile data of remote slides, shared between the slideviewer instances running on the same machine (in
+// named shared memory), so that a tile downloaded by one instance doesn't need to be downloaded again by another.
+// It sits between the per-process tile cache (see tile_cache.h) and the disk cache (see disk_cache.h).
+//
+// The processes can't share a lock, so nothing here takes one:
+// - The tile data goes into a ring: a writer reserves room by advancing write_position, and the oldest data gets
+//   overwritten. A reader copies the data out first, and then checks that the ring hasn't come round in the meantime.
+// - The index is a hash table with a few slots per bucket. Each slot has a sequence number that is odd while the slot
+//   is being written; a writer that can't claim a slot simply doesn't cache the tile, and a reader that sees the
+//   sequence number change treats it as a miss.
+// Slides are told apart by their identity (file or remote location) and size, since image ids are per process.
+
+#define SHARED_TILE_CACHE_NAME "slideviewer_shared_tile_cache_v1"
+#define SHARED_TILE_CACHE_MAGIC 0x43545353 // "SSTC"
+#define SHARED_TILE_CACHE_VERSION 1
+#define SHARED_TILE_CACHE_DATA_SIZE MEGABYTES(256)
+#define SHARED_TILE_CACHE_BUCKET_COUNT 65536 // needs to be a power of 2
+#define SHARED_TILE_CACHE_SLOTS_PER_BUCKET 4
+#define SHARED_TILE_CACHE_MAX_TILE_SIZE MEGABYTES(4)
+
+typedef struct shared_tile_cache_slot_t {
+	volatile i32 sequence; // odd while the slot is being written
+	u32 size;
+	u64 key; // 0 = empty
+	i64 position; // of the data in the ring, counted from the start (not wrapped around)
+} shared_tile_cache_slot_t;
+
+typedef struct shared_tile_cache_header_t {
+	volatile i32 magic; // set last by the process that created the shared memory
+	u32 version;
+	i64 data_size;
+	u32 bucket_count;
+	u32 slots_per_bucket;
+	volatile i64 write_position; // the number of bytes ever written to the ring
+} shared_tile_cache_header_t;
+
+typedef struct shared_tile_cache_t {
+	void* mapping; // the handle of the file mapping (Windows) or the size of the mapping (elsewhere)
+	u8* base;
+	shared_tile_cache_header_t* header;
+	shared_tile_cache_slot_t* slots;
+	u8* data;
+	bool32 is_open;
+	bool enabled; // can be switched off in the options
+	// Per process:
+	i64 hit_count;
+	i64 miss_count;
+	i64 insert_count;
+} shared_tile_cache_t;
+
+u64 shared_tile_cache_slide_id(const char* identity, i64 filesize);
+u64 shared_tile_cache_key(u64 slide_id, i32 level, i32 tile_index);
+bool32 shared_tile_cache_open(shared_tile_cache_t* cache);
+void shared_tile_cache_close(shared_tile_cache_t* cache);
+bool32 shared_tile_cache_lookup(shared_tile_cache_t* cache, u64 key, u8* dest, u32 dest_capacity, u32* size);
+void shared_tile_cache_insert(shared_tile_cache_t* cache, u64 key, u8* data, u32 size);
+
+// globals
+#if defined(SHARED_TILE_CACHE_IMPL)
+#define INIT(...) __VA_ARGS__
+#define extern
+#else
+#define INIT(...)
+#undef extern
+#endif
+
+extern shared_tile_cache_t global_shared_tile_cache;
+
+#undef INIT
+#undef extern
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,116 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#include "win32_main.h"
+#include "platform.h"
+#include <glad/glad.h>
+#include "viewer.h"
+#include "tlsclient.h"
+#include "stb_image.h"
+#include "slide_catalog.h"
+
+#include <stdio.h>
+
+// The catalog points into the downloaded data; nothing is copied except the names.
+bool32 parse_slide_catalog(slide_catalog_t* catalog, mem_t* data) {
+	if (data->len < sizeof(slide_catalog_header_t)) return false;
+	slide_catalog_header_t* header = (slide_catalog_header_t*) data->data;
+	if (header->magic != SLIDE_CATALOG_MAGIC || header->version != SLIDE_CATALOG_VERSION) {
+		printf("Slide catalog: unknown format\n");
+		return false;
+	}
+	u8* pos = data->data + sizeof(slide_catalog_header_t);
+	u8* end = data->data + data->len;
+	for (u32 i = 0; i < header->slide_count; ++i) {
+		if (pos + sizeof(slide_catalog_entry_t) > end) break;
+		catalog_slide_t slide = {0};
+		memcpy(&slide.info, pos, sizeof(slide_catalog_entry_t));
+		pos += sizeof(slide_catalog_entry_t);
+		slide_catalog_entry_t* info = &slide.info;
+		if ((u64)info->name_length + info->label_size + info->macro_size > (u64)(end - pos) ||
+		    info->name_length >= sizeof(slide.name)) {
+			break; // truncated
+		}
+		memcpy(slide.name, pos, info->name_length);
+		pos += info->name_length;
+		slide.label_jpeg = info->label_size ? pos : NULL;
+		pos += info->label_size;
+		slide.macro_jpeg = info->macro_size ? pos : NULL;
+		pos += info->macro_size;
+		sb_push(catalog->slides, slide);
+	}
+	catalog->data = data;
+	return true;
+}
+
+bool32 load_remote_slide_catalog(slide_catalog_t* catalog, const char* hostname, i32 portno) {
+	destroy_slide_catalog(catalog);
+	mem_t* data = download_remote_slide_catalog(hostname, portno);
+	if (!data) return false;
+	strncpy(catalog->hostname, hostname, sizeof(catalog->hostname) - 1);
+	catalog->portno = portno;
+	if (!parse_slide_catalog(catalog, data)) {
+		free(data);
+		return false;
+	}
+	return true;
+}
+
+static u32 upload_thumbnail_texture(u8* jpeg, u32 jpeg_size, i32* width_out, i32* height_out) {
+	if (!jpeg) return 0;
+	i32 width = 0;
+	i32 height = 0;
+	i32 channels_in_file = 0;
+	u8* pixels = stbi_load_from_memory(jpeg, (i32)jpeg_size, &width, &height, &channels_in_file, 4);
+	if (!pixels) return 0;
+	u32 texture = 0;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	stbi_image_free(pixels);
+	if (width_out) *width_out = width;
+	if (height_out) *height_out = height;
+	return texture;
+}
+
+// Thumbnails are decoded and uploaded when they are first shown (on the main thread), so that a catalog of thousands
+// of slides doesn't hold up the first frame.
+void upload_catalog_thumbnails(catalog_slide_t* slide) {
+	if (slide->has_textures) return;
+	slide->macro_texture = upload_thumbnail_texture(slide->macro_jpeg, slide->info.macro_size, &slide->thumbnail_width,
+	                                                &slide->thumbnail_height);
+	slide->label_texture = upload_thumbnail_texture(slide->label_jpeg, slide->info.label_size, NULL, NULL);
+	slide->has_textures = true;
+}
+
+void destroy_slide_catalog(slide_catalog_t* catalog) {
+	for (i32 i = 0; i < sb_count(catalog->slides); ++i) {
+		catalog_slide_t* slide = catalog->slides + i;
+		if (slide->macro_texture) glDeleteTextures(1, &slide->macro_texture);
+		if (slide->label_texture) glDeleteTextures(1, &slide->label_texture);
+	}
+	sb_free(catalog->slides);
+	if (catalog->data) free(catalog->data);
+	memset(catalog, 0, sizeof(*catalog));
+}
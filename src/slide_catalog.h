@@ -0,0 +1,93 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+// The slide catalog is the list of the slides in SLIDES_DIR on the server, with their metadata and small thumbnails of
+// the label and the macro image. The server keeps it up to date in the background (see server.c), and sends it as one
+// response to GET /catalog, so that a client can show what is there without opening the slides:
+//   slide_catalog_header_t, then for each slide a slide_catalog_entry_t, followed by its name, its label thumbnail
+//   and its macro thumbnail (JPEG; either may be missing, with size 0).
+// Slides without a macro image get a thumbnail of their coarsest level instead.
+
+#define SLIDE_CATALOG_MAGIC 0x54414353 // "SCAT"
+#define SLIDE_CATALOG_VERSION 1
+#define SLIDE_CATALOG_THUMBNAIL_SIZE 160 // in pixels, the longest side
+#define SLIDE_CATALOG_THUMBNAIL_QUALITY 80
+#define SLIDE_CATALOG_CACHE_NAME "slide_catalog" // the client keeps the last catalog in the disk cache
+
+#pragma pack(push, 1)
+typedef struct slide_catalog_header_t {
+	u32 magic;
+	u32 version;
+	u32 slide_count;
+	u32 reserved;
+} slide_catalog_header_t;
+
+typedef struct slide_catalog_entry_t {
+	u32 name_length;
+	u32 label_size;
+	u32 macro_size;
+	u32 width; // of the full resolution level
+	u32 height;
+	u32 level_count;
+	float mpp_x;
+	float mpp_y;
+	i64 filesize;
+	i64 modification_time; // seconds since the epoch
+} slide_catalog_entry_t;
+#pragma pack(pop)
+
+#if !IS_SERVER
+#include "platform.h"
+
+// Client side (see slide_catalog.c)
+typedef struct catalog_slide_t {
+	char name[256];
+	slide_catalog_entry_t info;
+	u8* label_jpeg; // in the downloaded catalog
+	u8* macro_jpeg;
+	u32 label_texture; // uploaded when first shown (0 if there is no thumbnail)
+	u32 macro_texture;
+	i32 thumbnail_width; // of the macro thumbnail
+	i32 thumbnail_height;
+	bool32 has_textures;
+} catalog_slide_t;
+
+typedef struct slide_catalog_t {
+	mem_t* data;
+	catalog_slide_t* slides; // sb
+	char hostname[256];
+	i32 portno;
+} slide_catalog_t;
+
+bool32 parse_slide_catalog(slide_catalog_t* catalog, mem_t* data);
+bool32 load_remote_slide_catalog(slide_catalog_t* catalog, const char* hostname, i32 portno);
+void upload_catalog_thumbnails(catalog_slide_t* slide);
+void destroy_slide_catalog(slide_catalog_t* catalog);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,181 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#include "win32_main.h"
+#include "platform.h"
+#include "intrinsics.h"
+
+#include <stdio.h>
+
+#include "stretchy_buffer.h"
+#include "viewer.h"
+#include "disk_cache.h"
+#include "tlsclient.h"
+#include "stringutils.h"
+#include "slide_open.h"
+
+typedef struct slide_open_t {
+	char filename[512];
+	char hostname[256]; // only for remote slides
+	i32 portno;
+	bool32 is_remote;
+	char identity[512]; // see switch_to_loaded_image()
+	const char* name; // for the progress indicator
+	bool32 load_xml_annotations;
+	tiff_t tiff;
+	disk_cache_t* disk_cache;
+	bool32 success;
+	volatile float progress; // stays 0 for local files (the IFDs are parsed in one go)
+	volatile i32 is_cancelled;
+	volatile i32 is_done;
+} slide_open_t;
+
+// The last one is the current open (unless it is cancelled); the others are cancelled, but still running on a worker.
+static slide_open_t** slide_opens; // sb, only accessed by the main thread
+
+static void slide_open_func(i32 logical_thread_index, void* userdata) {
+	slide_open_t* open = (slide_open_t*) userdata;
+	if (!open->is_cancelled) {
+		if (open->is_remote) {
+			open->success = open_remote_tiff(open->hostname, open->portno, open->filename, &open->tiff,
+			                                 &open->disk_cache, &open->progress, &open->is_cancelled);
+		} else {
+			open->success = open_tiff_file(&open->tiff, open->filename);
+			if (!open->success) {
+				tiff_destroy(&open->tiff);
+			}
+#ifdef BENCHMARK_TILE_READS
+			if (open->success) benchmark_tile_reads(&open->tiff, open->filename);
+#endif
+		}
+	}
+	write_barrier;
+	open->is_done = true;
+	platform_wake_main_thread(); // (so that the slide gets added)
+}
+
+void cancel_slide_open() {
+	for (i32 i = 0; i < sb_count(slide_opens); ++i) {
+		slide_opens[i]->is_cancelled = true;
+	}
+}
+
+static bool32 start_slide_open(slide_open_t* open) {
+	open->name = one_past_last_slash(open->filename, sizeof(open->filename));
+	if (!add_work_queue_entry(&work_queue, slide_open_func, open)) {
+		printf("Opening %s: the work queue is full, try again later\n", open->filename);
+		free(open);
+		return false;
+	}
+	sb_push(slide_opens, open);
+	return true;
+}
+
+// Starts opening a slide with the built-in TIFF backend. If the file turns out to be something that it can't handle,
+// OpenSlide gets to try once the open is done.
+bool32 start_local_slide_open(app_state_t* app_state, const char* filename, bool32 load_xml_annotations) {
+	cancel_slide_open(); // a newer selection wins
+	slide_open_t* open = (slide_open_t*) calloc(1, sizeof(slide_open_t));
+	strncpy(open->filename, filename, sizeof(open->filename) - 1);
+	strncpy(open->identity, filename, sizeof(open->identity) - 1);
+	open->load_xml_annotations = load_xml_annotations;
+	return start_slide_open(open);
+}
+
+bool32 start_remote_slide_open(app_state_t* app_state, const char* hostname, i32 portno, const char* filename) {
+	cancel_slide_open(); // a newer selection wins
+	char identity[512];
+	snprintf(identity, sizeof(identity), "%s:%d/%s", hostname, portno, filename);
+	if (switch_to_loaded_image(app_state, identity)) {
+		return true;
+	}
+	// Get the connections for the tile requests ready, while we are downloading the header.
+	keep_remote_connections_ready(hostname, portno);
+
+	slide_open_t* open = (slide_open_t*) calloc(1, sizeof(slide_open_t));
+	strncpy(open->filename, filename, sizeof(open->filename) - 1);
+	strncpy(open->hostname, hostname, sizeof(open->hostname) - 1);
+	open->portno = portno;
+	open->is_remote = true;
+	memcpy(open->identity, identity, sizeof(identity));
+	return start_slide_open(open);
+}
+
+// Returns false if no slide is being opened. The progress is that of the header download (zero for local files).
+bool32 get_slide_open_progress(const char** name, float* progress) {
+	i32 count = sb_count(slide_opens);
+	if (count == 0 || slide_opens[count - 1]->is_cancelled) {
+		return false;
+	}
+	slide_open_t* open = slide_opens[count - 1];
+	*name = open->name;
+	*progress = open->progress;
+	return true;
+}
+
+// Adds the slide (or else tries OpenSlide for local files). This needs to happen on the main thread: loading the
+// image uploads textures, and the image may replace one that is displayed.
+static void finish_slide_open(app_state_t* app_state, slide_open_t* open) {
+	// Note: checking for JPEG 2000 support loads OpenJPEG the first time, which is not thread-safe.
+	bool32 success = open->success && can_load_tiff_tiles(&open->tiff);
+	if (success) {
+		add_image_from_tiff(app_state, open->tiff, open->identity);
+		sb_last(app_state->loaded_images)->disk_cache = open->disk_cache;
+	} else if (open->success) {
+		tiff_destroy(&open->tiff);
+		disk_cache_close(open->disk_cache);
+	}
+	if (!success && !open->is_remote) {
+		printf("Opening %s with the built-in TIFF backend failed, trying OpenSlide instead\n", open->filename);
+		success = load_image_using_openslide(app_state, open->filename);
+	}
+	if (success) {
+		if (open->load_xml_annotations) {
+			load_associated_xml_annotations(app_state, open->filename);
+		}
+	} else {
+		printf("Could not load '%s'\n", open->filename);
+	}
+}
+
+// Needs to be called every frame, on the main thread: adds the slide once it is open, and cleans up.
+void update_slide_opens(app_state_t* app_state) {
+	i32 i = 0;
+	while (i < sb_count(slide_opens)) {
+		slide_open_t* open = slide_opens[i];
+		if (!open->is_done) {
+			++i;
+			continue;
+		}
+		read_barrier;
+		if (open->is_cancelled) {
+			if (open->success) {
+				tiff_destroy(&open->tiff);
+				disk_cache_close(open->disk_cache);
+			}
+		} else {
+			finish_slide_open(app_state, open);
+		}
+		free(open);
+		// (keep the order: the current open stays last)
+		memmove(slide_opens + i, slide_opens + i + 1, (sb_count(slide_opens) - i - 1) * sizeof(slide_open_t*));
+		--sb_raw_count(slide_opens);
+	}
+}
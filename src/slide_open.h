@@ -0,0 +1,43 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+#include "viewer.h"
+
+// Opens slides in the background: parsing the IFDs of a local TIFF file, or downloading (and deserializing) the header
+// of a remote slide, is done on a worker thread, so that the slide that is already loaded stays interactive in the
+// meantime. The new slide is added once it is ready (see update_slide_opens(), on the main thread).
+// Only the most recent open counts: starting another one cancels the one that is underway (a header download is cut
+// off; a local file that is already being parsed is thrown away when done). Files that the built-in TIFF backend
+// can't handle fall back to OpenSlide, on the main thread.
+
+bool32 start_local_slide_open(app_state_t* app_state, const char* filename, bool32 load_xml_annotations);
+bool32 start_remote_slide_open(app_state_t* app_state, const char* hostname, i32 portno, const char* filename);
+bool32 get_slide_open_progress(const char** name, float* progress);
+void cancel_slide_open();
+void update_slide_opens(app_state_t* app_state);
+
+#ifdef __cplusplus
+}
+#endif
@@ -27,10 +27,25 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <stdlib.h>
+#include <math.h>
+
+#if WINDOWS
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
+#endif
 
 #include "lz4.h"
+#include "intrinsics.h"
+#include "cpu_dispatch.h"
 
 #include "tiff.h"
+#include "memory_stats.h"
 
 u32 get_tiff_field_size(u16 data_type) {
 	u32 size = 0;
@@ -81,7 +96,10 @@ const char* get_tiff_tag_name(u32 tag) {
 		case TIFF_TAG_SAMPLES_PER_PIXEL: result = "SamplesPerPixel"; break;
 		case TIFF_TAG_ROWS_PER_STRIP: result = "RowsPerStrip"; break;
 		case TIFF_TAG_STRIP_BYTE_COUNTS: result = "StripByteCounts"; break;
+		case TIFF_TAG_X_RESOLUTION: result = "XResolution"; break;
+		case TIFF_TAG_Y_RESOLUTION: result = "YResolution"; break;
 		case TIFF_TAG_PLANAR_CONFIGURATION: result = "PlanarConfiguration"; break;
+		case TIFF_TAG_RESOLUTION_UNIT: result = "ResolutionUnit"; break;
 		case TIFF_TAG_SOFTWARE: result = "Software"; break;
 		case TIFF_TAG_TILE_WIDTH: result = "TileWidth"; break;
 		case TIFF_TAG_TILE_LENGTH: result = "TileLength"; break;
@@ -109,11 +127,122 @@ u64 file_read_at_offset(void* dest, FILE* fp, u64 offset, u64 num_bytes) {
 	return result;
 }
 
+// Memory-mapped access for local files: tile data (and the IFDs) can then be read in place, without a read call or a
+// copy, and the OS page cache is shared between all threads. Only used for files on local storage: on a network share
+// every page fault is a blocking round trip, so there batched reads (see async_io.h) are faster.
+bool32 tiff_enable_mmap = true;
+
+// Unbuffered reads (FILE_FLAG_NO_BUFFERING) for local files: large slides that are only viewed once would otherwise
+// push more useful data out of the OS page cache. The application's tile cache is then the only cache.
+// Takes precedence over memory-mapping.
+bool32 tiff_enable_direct_io = false;
+
+static bool32 tiff_should_map_file(const char* filename, i64 filesize) {
+	if (!tiff_enable_mmap || tiff_enable_direct_io || sizeof(void*) < 8 || filesize <= 0 || filesize > TIFF_MMAP_MAX_FILESIZE) {
+		return false;
+	}
+#if WINDOWS
+	char root_path[MAX_PATH];
+	if (GetFullPathNameA(filename, sizeof(root_path), root_path, NULL) == 0 || root_path[1] != ':') {
+		return false; // UNC path (network share) or something we do not recognize
+	}
+	root_path[3] = '\0'; // e.g. "C:\"
+	UINT drive_type = GetDriveTypeA(root_path);
+	return drive_type == DRIVE_FIXED;
+#elif defined(__linux__)
+	struct statfs fs;
+	if (statfs(filename, &fs) != 0) {
+		return false;
+	}
+	switch ((u32)fs.f_type) {
+		case 0x6969: /*NFS*/ case 0x517B: /*SMB*/ case 0xFF534D42: /*CIFS*/ case 0xFE534D42: /*SMB2*/
+		case 0x65735546: /*FUSE*/
+			return false;
+		default: return true;
+	}
+#else
+	return true;
+#endif
+}
+
+static bool32 tiff_map_file(tiff_t* tiff, const char* filename, i64 filesize) {
+#if WINDOWS
+	// Note: the view stays valid after the file and mapping handles are closed
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	void* view = NULL;
+	if (mapping) {
+		view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+	}
+	CloseHandle(file);
+	if (!view) {
+		printf("Warning: could not memory-map %s (error code 0x%x)\n", filename, (u32)GetLastError());
+		return false;
+	}
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	void* view = mmap(NULL, (size_t)filesize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (view == MAP_FAILED) {
+		printf("Warning: could not memory-map %s\n", filename);
+		return false;
+	}
+	madvise(view, (size_t)filesize, MADV_RANDOM); // tiles are read in whatever order they come into view
+#endif
+	tiff->mapped_data = (u8*) view;
+	tiff->mapped_size = (u64) filesize;
+	return true;
+}
+
+static void tiff_unmap_file(tiff_t* tiff) {
+	if (tiff->mapped_data) {
+#if WINDOWS
+		UnmapViewOfFile(tiff->mapped_data);
+#else
+		munmap(tiff->mapped_data, tiff->mapped_size);
+#endif
+		tiff->mapped_data = NULL;
+		tiff->mapped_size = 0;
+	}
+}
+
+// Returns a pointer to the data in the file mapping, or NULL if the file is not mapped (or the range is out of bounds).
+u8* tiff_get_mapped_range(tiff_t* tiff, u64 offset, u64 size) {
+	if (tiff->mapped_data && offset <= tiff->mapped_size && size <= tiff->mapped_size - offset) {
+		return tiff->mapped_data + offset;
+	}
+	return NULL;
+}
+
+// Read through the range reader or from the file mapping if there is one, otherwise from the file. Returns 1 on success (like fread).
+u64 tiff_read_at_offset(tiff_t* tiff, void* dest, u64 offset, u64 num_bytes) {
+	if (tiff->range_reader) {
+		return tiff->range_reader->read(tiff->range_reader, dest, offset, num_bytes);
+	}
+	if (tiff->mapped_data) {
+		u8* src = tiff_get_mapped_range(tiff, offset, num_bytes);
+		if (!src) return 0;
+		memcpy(dest, src, num_bytes);
+		return 1;
+	}
+	spin_lock(&tiff->fp_lock); // the file may be shared between threads loading tile tables
+	u64 result = file_read_at_offset(dest, tiff->fp, offset, num_bytes);
+	spin_unlock(&tiff->fp_lock);
+	return result;
+}
+
 char* tiff_read_field_ascii(tiff_t* tiff, tiff_tag_t* tag) {
 	size_t description_length = tag->data_count;
 	char* result = (char*) calloc(ATLEAST(8, description_length + 1), 1);
 	if (tag->data_is_offset) {
-		file_read_at_offset(result, tiff->fp, tag->offset, tag->data_count);
+		tiff_read_at_offset(tiff, result, tag->offset, tag->data_count);
 	} else {
 		memcpy(result, tag->data, description_length);
 	}
@@ -124,6 +253,136 @@ static inline void* tiff_read_field_undefined(tiff_t* tiff, tiff_tag_t* tag) {
 	return (void*) tiff_read_field_ascii(tiff, tag);
 }
 
+// Byte swapping of big-endian integer arrays (e.g. the tile offsets), widened to u64. These get a kernel of their own
+// (see cpu_dispatch.h) because the byte swap needs shuffles for which SSE2 has no single instruction.
+
+static void swap_u64_to_u64_scalar(u64* dest, void* source, u64 count) {
+	u64* src = (u64*) source;
+	for (u64 i = 0; i < count; ++i) dest[i] = bswap_64(src[i]);
+}
+
+static void swap_u32_to_u64_scalar(u64* dest, void* source, u64 count) {
+	u32* src = (u32*) source;
+	for (u64 i = 0; i < count; ++i) dest[i] = bswap_32(src[i]);
+}
+
+static void swap_u16_to_u64_scalar(u64* dest, void* source, u64 count) {
+	u16* src = (u16*) source;
+	for (u64 i = 0; i < count; ++i) dest[i] = bswap_16(src[i]);
+}
+
+#if defined(__SSE2__)
+
+static inline __m128i swap_bytes_in_u16_sse2(__m128i v) {
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static void swap_u64_to_u64_sse2(u64* dest, void* source, u64 count) {
+	u64* src = (u64*) source;
+	u64 i = 0;
+	for (; i + 2 <= count; i += 2) {
+		__m128i v = swap_bytes_in_u16_sse2(_mm_loadu_si128((__m128i*)(src + i)));
+		v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0x1B), 0x1B); // reverse the 16-bit words of each u64
+		_mm_storeu_si128((__m128i*)(dest + i), v);
+	}
+	swap_u64_to_u64_scalar(dest + i, src + i, count - i);
+}
+
+static void swap_u32_to_u64_sse2(u64* dest, void* source, u64 count) {
+	u32* src = (u32*) source;
+	const __m128i zero = _mm_setzero_si128();
+	u64 i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i v = swap_bytes_in_u16_sse2(_mm_loadu_si128((__m128i*)(src + i)));
+		v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1); // swap the 16-bit halves of each u32
+		_mm_storeu_si128((__m128i*)(dest + i), _mm_unpacklo_epi32(v, zero));
+		_mm_storeu_si128((__m128i*)(dest + i + 2), _mm_unpackhi_epi32(v, zero));
+	}
+	swap_u32_to_u64_scalar(dest + i, src + i, count - i);
+}
+
+static void swap_u16_to_u64_sse2(u64* dest, void* source, u64 count) {
+	u16* src = (u16*) source;
+	const __m128i zero = _mm_setzero_si128();
+	u64 i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i v = swap_bytes_in_u16_sse2(_mm_loadu_si128((__m128i*)(src + i)));
+		__m128i lo = _mm_unpacklo_epi16(v, zero);
+		__m128i hi = _mm_unpackhi_epi16(v, zero);
+		_mm_storeu_si128((__m128i*)(dest + i), _mm_unpacklo_epi32(lo, zero));
+		_mm_storeu_si128((__m128i*)(dest + i + 2), _mm_unpackhi_epi32(lo, zero));
+		_mm_storeu_si128((__m128i*)(dest + i + 4), _mm_unpacklo_epi32(hi, zero));
+		_mm_storeu_si128((__m128i*)(dest + i + 6), _mm_unpackhi_epi32(hi, zero));
+	}
+	swap_u16_to_u64_scalar(dest + i, src + i, count - i);
+}
+
+#endif //__SSE2__
+
+#if CPU_AVX2_SUPPORTED
+
+// With AVX2, a byte shuffle does the swap in one go.
+
+CPU_TARGET_AVX2 static void swap_u64_to_u64_avx2(u64* dest, void* source, u64 count) {
+	u64* src = (u64*) source;
+	const __m256i shuffle = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+	                                         7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+	u64 i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m256i v = _mm256_loadu_si256((__m256i*)(src + i));
+		_mm256_storeu_si256((__m256i*)(dest + i), _mm256_shuffle_epi8(v, shuffle));
+	}
+	swap_u64_to_u64_scalar(dest + i, src + i, count - i);
+}
+
+CPU_TARGET_AVX2 static void swap_u32_to_u64_avx2(u64* dest, void* source, u64 count) {
+	u32* src = (u32*) source;
+	const __m128i shuffle = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	u64 i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i v = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)(src + i)), shuffle);
+		_mm256_storeu_si256((__m256i*)(dest + i), _mm256_cvtepu32_epi64(v));
+	}
+	swap_u32_to_u64_scalar(dest + i, src + i, count - i);
+}
+
+CPU_TARGET_AVX2 static void swap_u16_to_u64_avx2(u64* dest, void* source, u64 count) {
+	u16* src = (u16*) source;
+	const __m128i shuffle = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	u64 i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i v = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)(src + i)), shuffle);
+		_mm256_storeu_si256((__m256i*)(dest + i), _mm256_cvtepu16_epi64(v));
+		_mm256_storeu_si256((__m256i*)(dest + i + 4), _mm256_cvtepu16_epi64(_mm_srli_si128(v, 8)));
+	}
+	swap_u16_to_u64_scalar(dest + i, src + i, count - i);
+}
+
+#endif //CPU_AVX2_SUPPORTED
+
+typedef void swap_to_u64_func_t(u64* dest, void* source, u64 count);
+
+// Indexed by level (see cpu_dispatch.h), for 8, 4 and 2 byte integers
+#if CPU_AVX2_SUPPORTED
+#define SWAP_TO_U64_IMPLS(bits) { swap_u##bits##_to_u64_scalar, swap_u##bits##_to_u64_sse2, swap_u##bits##_to_u64_avx2 }
+#elif defined(__SSE2__)
+#define SWAP_TO_U64_IMPLS(bits) { swap_u##bits##_to_u64_scalar, swap_u##bits##_to_u64_sse2, swap_u##bits##_to_u64_sse2 }
+#else
+#define SWAP_TO_U64_IMPLS(bits) { swap_u##bits##_to_u64_scalar }
+#endif
+static swap_to_u64_func_t* swap_to_u64_impls[3][CPU_LEVEL_COUNT] = {
+	SWAP_TO_U64_IMPLS(64), SWAP_TO_U64_IMPLS(32), SWAP_TO_U64_IMPLS(16),
+};
+#undef SWAP_TO_U64_IMPLS
+
+// Converts big-endian integers of 8, 4 or 2 bytes to little-endian u64. For 8 byte integers, dest may be the same as
+// source (swapping in place).
+void tiff_swap_integers_to_u64(u64* dest, void* source, u64 count, u32 bytesize) {
+	i32 width_index = (bytesize == 8) ? 0 : (bytesize == 4) ? 1 : 2;
+	ASSERT(bytesize == 8 || bytesize == 4 || bytesize == 2);
+	swap_to_u64_impls[width_index][cpu_get_kernel_level(CPU_KERNEL_BYTE_SWAP)](dest, source, count);
+}
+
 // Read integer values in a TIFF tag (either 8, 16, 32, or 64 bits wide) + convert them to little-endian u64 if needed
 u64* tiff_read_field_integers(tiff_t* tiff, tiff_tag_t* tag) {
 	u64* integers = NULL;
@@ -131,35 +390,46 @@ u64* tiff_read_field_integers(tiff_t* tiff, tiff_tag_t* tag) {
 	if (tag->data_is_offset) {
 		u64 bytesize = get_tiff_field_size(tag->data_type);
 		void* temp_integers = calloc(bytesize, tag->data_count);
-		if (file_read_at_offset(temp_integers, tiff->fp, tag->offset, tag->data_count * bytesize) != 1) {
+		if (tiff_read_at_offset(tiff, temp_integers, tag->offset, tag->data_count * bytesize) != 1) {
 			free(temp_integers);
 			return NULL; // failed
 		}
 
+		// Note: the loops are kept simple (and the byte order check out of them), so that they get vectorized.
+		u64 count = tag->data_count;
+		bool32 is_big_endian = tiff->is_big_endian;
 		if (bytesize == 8) {
 			// the numbers are already 64-bit, no need to widen
 			integers = (u64*) temp_integers;
-			if (tiff->is_big_endian) {
-				for (i32 i = 0; i < tag->data_count; ++i) {
-					integers[i] = bswap_64(integers[i]);
-				}
+			if (is_big_endian) {
+				tiff_swap_integers_to_u64(integers, temp_integers, count, bytesize);
 			}
 		} else {
 			// offsets are 32-bit or less -> widen to 64-bit offsets
-			integers = (u64*) malloc(tag->data_count * sizeof(u64));
+			integers = (u64*) malloc(count * sizeof(u64));
 			switch(bytesize) {
 				case 4: {
-					for (i32 i = 0; i < tag->data_count; ++i) {
-						integers[i] = maybe_swap_32(((u32*) temp_integers)[i], tiff->is_big_endian);
+					u32* source = (u32*) temp_integers;
+					if (is_big_endian) {
+						tiff_swap_integers_to_u64(integers, temp_integers, count, bytesize);
+					} else {
+						for (u64 i = 0; i < count; ++i) {
+							integers[i] = source[i];
+						}
 					}
 				} break;
 				case 2: {
-					for (i32 i = 0; i < tag->data_count; ++i) {
-						integers[i] = maybe_swap_16(((u16*) temp_integers)[i], tiff->is_big_endian);
+					u16* source = (u16*) temp_integers;
+					if (is_big_endian) {
+						tiff_swap_integers_to_u64(integers, temp_integers, count, bytesize);
+					} else {
+						for (u64 i = 0; i < count; ++i) {
+							integers[i] = source[i];
+						}
 					}
 				} break;
 				case 1: {
-					for (i32 i = 0; i < tag->data_count; ++i) {
+					for (u64 i = 0; i < count; ++i) {
 						integers[i] = ((u8*) temp_integers)[i];
 					}
 				} break;
@@ -187,11 +457,10 @@ tiff_rational_t* tiff_read_field_rationals(tiff_t* tiff, tiff_tag_t* tag) {
 	tiff_rational_t* rationals = (tiff_rational_t*) calloc(ATLEAST(8, tag->data_count * sizeof(tiff_rational_t)), 1);
 
 	if (tag->data_is_offset) {
-		file_read_at_offset(rationals, tiff->fp, tag->offset, tag->data_count * sizeof(tiff_rational_t));
+		tiff_read_at_offset(tiff, rationals, tag->offset, tag->data_count * sizeof(tiff_rational_t));
 	} else {
-		// data is inlined
-		rationals = (tiff_rational_t*) malloc(sizeof(u64));
-		rationals[0] = *(tiff_rational_t*) tag->data_u64;
+		// data is inlined (in BigTIFF files, a single rational fits in the tag)
+		memcpy(rationals, &tag->data_u64, sizeof(tiff_rational_t));
 	}
 
 	if (tiff->is_big_endian) {
@@ -213,14 +482,14 @@ bool32 tiff_read_ifd(tiff_t* tiff, tiff_ifd_t* ifd, u64* next_ifd_offset) {
 	// (although TIFF files are always required to specify this in the PhotometricInterpretation tag)
 	ifd->color_space = TIFF_PHOTOMETRIC_RGB;
 
-	// Set the file position to the start of the IFD
-	if (!(next_ifd_offset != NULL && fseeko64(tiff->fp, *next_ifd_offset, SEEK_SET) == 0)) {
+	if (next_ifd_offset == NULL) {
 		return false; // failed
 	}
+	u64 ifd_offset = *next_ifd_offset;
 
 	u64 tag_count = 0;
 	u64 tag_count_num_bytes = is_bigtiff ? 8 : 2;
-	if (fread(&tag_count, tag_count_num_bytes, 1, tiff->fp) != 1) return false;
+	if (tiff_read_at_offset(tiff, &tag_count, ifd_offset, tag_count_num_bytes) != 1) return false;
 	if (is_big_endian) {
 		tag_count = is_bigtiff ? bswap_64(tag_count) : bswap_16(tag_count);
 	}
@@ -228,14 +497,22 @@ bool32 tiff_read_ifd(tiff_t* tiff, tiff_ifd_t* ifd, u64* next_ifd_offset) {
 	// Read the tags
 	u64 tag_size = is_bigtiff ? 20 : 12;
 	u64 bytes_to_read = tag_count * tag_size;
-	u8* raw_tags = (u8*) malloc(bytes_to_read);
-	if (fread(raw_tags, bytes_to_read, 1, tiff->fp) != 1) {
-		free(raw_tags);
+	// The tags are only needed while parsing the IFD, so they share one scratch block on the stack (unless there are
+	// so many that they don't fit), instead of two heap allocations per IFD.
+	u64 tags_size = sizeof(tiff_tag_t) * tag_count;
+	u64 scratch_size = tags_size + bytes_to_read;
+	u64 scratch_storage[KILOBYTES(4) / sizeof(u64)]; // u64, for the alignment of the tiff_tag_t's
+	u8* heap_scratch = (scratch_size > sizeof(scratch_storage)) ? (u8*) malloc(scratch_size) : NULL;
+	u8* scratch = heap_scratch ? heap_scratch : (u8*) scratch_storage;
+	tiff_tag_t* tags = (tiff_tag_t*) scratch;
+	u8* raw_tags = scratch + tags_size;
+	if (tiff_read_at_offset(tiff, raw_tags, ifd_offset + tag_count_num_bytes, bytes_to_read) != 1) {
+		free(heap_scratch);
 		return false; // failed
 	}
 
 	// Restructure the fields so we don't have to worry about the memory layout, endianness, etc
-	tiff_tag_t* tags = (tiff_tag_t*) calloc(sizeof(tiff_tag_t) * tag_count, 1);
+	memset(tags, 0, sizeof(tiff_tag_t) * tag_count);
 	for (i32 i = 0; i < tag_count; ++i) {
 		tiff_tag_t* tag = tags + i;
 		if (is_bigtiff) {
@@ -277,7 +554,6 @@ bool32 tiff_read_ifd(tiff_t* tiff, tiff_ifd_t* ifd, u64* next_ifd_offset) {
 			}
 		}
 	}
-	free(raw_tags);
 
 	// Read and interpret the entries in the IFD
 	for (i32 tag_index = 0; tag_index < tag_count; ++tag_index) {
@@ -323,6 +599,22 @@ bool32 tiff_read_ifd(tiff_t* tiff, tiff_ifd_t* ifd, u64* next_ifd_offset) {
 				printf("%.500s\n", ifd->image_description);
 #endif
 			} break;
+			case TIFF_TAG_X_RESOLUTION:
+			case TIFF_TAG_Y_RESOLUTION: {
+				tiff_rational_t* resolution = tiff_read_field_rationals(tiff, tag);
+				if (resolution && resolution->b != 0) {
+					float value = (float)(u32)resolution->a / (float)(u32)resolution->b;
+					if (tag->code == TIFF_TAG_X_RESOLUTION) {
+						ifd->x_resolution = value;
+					} else {
+						ifd->y_resolution = value;
+					}
+				}
+				free(resolution);
+			} break;
+			case TIFF_TAG_RESOLUTION_UNIT: {
+				ifd->resolution_unit = tag->data_u16;
+			} break;
 			case TIFF_TAG_TILE_WIDTH: {
 				ifd->tile_width = tag->data_u32;
 			} break;
@@ -331,26 +623,19 @@ bool32 tiff_read_ifd(tiff_t* tiff, tiff_ifd_t* ifd, u64* next_ifd_offset) {
 			} break;
 			case TIFF_TAG_TILE_OFFSETS: {
 				// TODO: to be sure, need check PlanarConfiguration==1 to check how to interpret the data count?
+				// Note: the table itself is only read when needed, see tiff_load_tile_tables()
 				ifd->tile_count = tag->data_count;
-				ifd->tile_offsets = tiff_read_field_integers(tiff, tag);
-				if (ifd->tile_offsets == NULL) {
-					free(tags);
-					return false; // failed
-				}
+				ifd->tile_offsets_tag = *tag;
 			} break;
 			case TIFF_TAG_TILE_BYTE_COUNTS: {
 				// Note: is it OK to assume that the TileByteCounts will always come after the TileOffsets?
 				if (tag->data_count != ifd->tile_count) {
 					ASSERT(tag->data_count != 0);
 					printf("Error: mismatch in the TIFF tile count reported by TileByteCounts and TileOffsets tags\n");
-					free(tags);
+					free(heap_scratch);
 					return false; // failed;
 				}
-				ifd->tile_byte_counts = tiff_read_field_integers(tiff, tag);
-				if (ifd->tile_byte_counts == NULL) {
-					free(tags);
-					return false; // failed
-				}
+				ifd->tile_byte_counts_tag = *tag;
 			} break;
 			case TIFF_TAG_JPEG_TABLES: {
 				ifd->jpeg_tables = (u8*) tiff_read_field_undefined(tiff, tag);
@@ -369,7 +654,7 @@ bool32 tiff_read_ifd(tiff_t* tiff, tiff_ifd_t* ifd, u64* next_ifd_offset) {
 				ifd->reference_black_white_rational_count = tag->data_count;
 				ifd->reference_black_white = tiff_read_field_rationals(tiff, tag); //TODO: free, add to serialized format
 				if (ifd->reference_black_white == NULL) {
-					free(tags);
+					free(heap_scratch);
 					return false; // failed
 				}
 #if TIFF_VERBOSE
@@ -386,7 +671,7 @@ bool32 tiff_read_ifd(tiff_t* tiff, tiff_ifd_t* ifd, u64* next_ifd_offset) {
 
 	}
 
-	free(tags);
+	free(heap_scratch);
 
 	if (ifd->tile_width > 0) {
 		ifd->width_in_tiles = (ifd->image_width + ifd->tile_width - 1) / ifd->tile_width;
@@ -394,6 +679,7 @@ bool32 tiff_read_ifd(tiff_t* tiff, tiff_ifd_t* ifd, u64* next_ifd_offset) {
 	if (ifd->tile_height > 0) {
 		ifd->height_in_tiles = (ifd->image_height + ifd->tile_height - 1) / ifd->tile_height;
 	}
+	tiff_select_tile_path(ifd);
 
 	// Try to deduce what type of image this is (level, macro, or label).
 	// Unfortunately this does not seem to be very consistently specified in the TIFF files, so in part we have to guess.
@@ -406,27 +692,254 @@ bool32 tiff_read_ifd(tiff_t* tiff, tiff_ifd_t* ifd, u64* next_ifd_offset) {
 			ifd->subimage_type = TIFF_LABEL_SUBIMAGE;
 			tiff->label_image = ifd;
 			tiff->label_image_index = ifd->ifd_index;
+		} else if (strstr(ifd->image_description, "\nmacro ")) {
+			// Aperio SVS: e.g. "Aperio Image Library v11.2.1\r\nmacro 1280x431"
+			ifd->subimage_type = TIFF_MACRO_SUBIMAGE;
+			tiff->macro_image = ifd;
+			tiff->macro_image_index = ifd->ifd_index;
+		} else if (strstr(ifd->image_description, "\nlabel ")) {
+			ifd->subimage_type = TIFF_LABEL_SUBIMAGE;
+			tiff->label_image = ifd;
+			tiff->label_image_index = ifd->ifd_index;
 		} else if (strncmp(ifd->image_description, "level", 5) == 0) {
 			ifd->subimage_type = TIFF_LEVEL_SUBIMAGE;
 		}
 	}
-	// Guess that it must be a level image if it's not explicitly said to be something else
-	if (ifd->subimage_type == TIFF_UNKNOWN_SUBIMAGE /*0*/ && ifd->tile_width > 0) {
-		if (ifd->ifd_index == 0 /* main image */ || ifd->tiff_subfiletype & TIFF_FILETYPE_REDUCEDIMAGE) {
-			ifd->subimage_type = TIFF_LEVEL_SUBIMAGE;
-		}
-	}
+	// Which of the remaining tiled images are levels is decided once all the IFDs are known (see tiff_find_levels())
 
 
 
 	// Read the next IFD
-	if (fread(next_ifd_offset, tiff->bytesize_of_offsets, 1, tiff->fp) != 1) return false;
+	*next_ifd_offset = 0;
+	if (tiff_read_at_offset(tiff, next_ifd_offset, ifd_offset + tag_count_num_bytes + bytes_to_read,
+	                        tiff->bytesize_of_offsets) != 1) return false;
 #if TIFF_VERBOSE
 	printf("next ifd offset = %lld\n", *next_ifd_offset);
 #endif
 	return true; // success
 }
 
+// The tile offset and byte count tables can be very large (millions of tiles for the base level of a big BigTIFF), so
+// they are not read while opening the file; tiff_load_tile_tables() needs to be called before using them.
+// Can be called from any thread; returns false if the tables could not be read.
+bool32 tiff_load_tile_tables(tiff_t* tiff, tiff_ifd_t* ifd) {
+	if (ifd->are_tile_tables_loaded) {
+		read_barrier;
+		return (ifd->tile_offsets != NULL && ifd->tile_byte_counts != NULL);
+	}
+	spin_lock(&ifd->tile_tables_lock);
+	if (!ifd->are_tile_tables_loaded) {
+		if (ifd->tile_count > 0) {
+			ifd->tile_offsets = tiff_read_field_integers(tiff, &ifd->tile_offsets_tag);
+			ifd->tile_byte_counts = tiff_read_field_integers(tiff, &ifd->tile_byte_counts_tag);
+			if (!ifd->tile_offsets || !ifd->tile_byte_counts) {
+				printf("Error: could not read the tile offsets or byte counts of TIFF IFD %llu\n", ifd->ifd_index);
+			}
+			if (ifd->tile_offsets) memory_stats_add(MEMORY_DOMAIN_TIFF_METADATA, ifd->tile_count * sizeof(u64));
+			if (ifd->tile_byte_counts) memory_stats_add(MEMORY_DOMAIN_TIFF_METADATA, ifd->tile_count * sizeof(u64));
+		}
+		write_barrier;
+		ifd->are_tile_tables_loaded = true;
+	}
+	spin_unlock(&ifd->tile_tables_lock);
+	return (ifd->tile_offsets != NULL && ifd->tile_byte_counts != NULL);
+}
+
+// Is the image a downsampled version of the main image? Allows the sizes to be rounded either way.
+static bool32 tiff_is_downsampled_from(tiff_ifd_t* ifd, tiff_ifd_t* main_image) {
+	if (ifd->image_width == 0 || ifd->image_height == 0 || ifd->image_width > main_image->image_width) return false;
+	float expected_height = (float)main_image->image_height * (float)ifd->image_width / (float)main_image->image_width;
+	float tolerance = 2.0f + 0.01f * expected_height;
+	return fabsf((float)ifd->image_height - expected_height) <= tolerance;
+}
+
+// Decides which IFDs are the levels of the pyramid, and moves them to the front of the IFD array, finest level first.
+// Philips TIFF files have the levels first already, but e.g. Aperio SVS files have a (stripped) thumbnail in between,
+// and don't mark the levels as reduced images. So any tiled image that is not a macro or label image, and has the
+// same aspect ratio as the largest one, is taken to be a level.
+static void tiff_find_levels(tiff_t* tiff) {
+	tiff_ifd_t* largest = NULL;
+	for (i32 i = 0; i < tiff->ifd_count; ++i) {
+		tiff_ifd_t* ifd = tiff->ifds + i;
+		bool32 is_candidate = (ifd->tile_width > 0 && ifd->tile_height > 0 && ifd->subimage_type != TIFF_MACRO_SUBIMAGE
+		                       && ifd->subimage_type != TIFF_LABEL_SUBIMAGE);
+		if (!is_candidate && ifd->subimage_type == TIFF_LEVEL_SUBIMAGE) {
+			ifd->subimage_type = TIFF_UNKNOWN_SUBIMAGE; // not tiled, cannot be used as a level
+		}
+		if (is_candidate && (!largest || ifd->image_width > largest->image_width)) {
+			largest = ifd;
+		}
+	}
+	u64 level_count = 0;
+	for (i32 i = 0; i < tiff->ifd_count; ++i) {
+		tiff_ifd_t* ifd = tiff->ifds + i;
+		if (ifd->subimage_type == TIFF_MACRO_SUBIMAGE || ifd->subimage_type == TIFF_LABEL_SUBIMAGE) continue;
+		if (largest && ifd->tile_width > 0 && ifd->tile_height > 0 && tiff_is_downsampled_from(ifd, largest)) {
+			ifd->subimage_type = TIFF_LEVEL_SUBIMAGE;
+			++level_count;
+		} else {
+			ifd->subimage_type = TIFF_UNKNOWN_SUBIMAGE;
+		}
+	}
+
+	// Reorder: the levels from large to small, followed by the other images in file order
+	tiff_ifd_t* sorted_ifds = (tiff_ifd_t*) malloc(ATLEAST(1, tiff->ifd_count) * sizeof(tiff_ifd_t));
+	u64 sorted_count = 0;
+	for (i32 i = 0; i < tiff->ifd_count; ++i) {
+		if (tiff->ifds[i].subimage_type != TIFF_LEVEL_SUBIMAGE) continue;
+		u64 insert_index = sorted_count;
+		while (insert_index > 0 && sorted_ifds[insert_index - 1].image_width < tiff->ifds[i].image_width) {
+			sorted_ifds[insert_index] = sorted_ifds[insert_index - 1];
+			--insert_index;
+		}
+		sorted_ifds[insert_index] = tiff->ifds[i];
+		++sorted_count;
+	}
+	for (i32 i = 0; i < tiff->ifd_count; ++i) {
+		if (tiff->ifds[i].subimage_type != TIFF_LEVEL_SUBIMAGE) {
+			sorted_ifds[sorted_count++] = tiff->ifds[i];
+		}
+	}
+	memcpy(tiff->ifds, sorted_ifds, tiff->ifd_count * sizeof(tiff_ifd_t));
+	free(sorted_ifds);
+
+	tiff->macro_image = NULL;
+	tiff->label_image = NULL;
+	for (u64 i = 0; i < tiff->ifd_count; ++i) {
+		tiff_ifd_t* ifd = tiff->ifds + i;
+		ifd->ifd_index = i;
+		if (ifd->subimage_type == TIFF_MACRO_SUBIMAGE) {
+			tiff->macro_image = ifd;
+			tiff->macro_image_index = i;
+		} else if (ifd->subimage_type == TIFF_LABEL_SUBIMAGE) {
+			tiff->label_image = ifd;
+			tiff->label_image_index = i;
+		}
+	}
+	tiff->main_image = tiff->ifds;
+	tiff->main_image_index = 0;
+	tiff->level_images = tiff->ifds;
+	tiff->level_image_index = 0;
+	tiff->level_count = level_count;
+}
+
+// Finds the size of the pixels of the main image in the ImageDescription (Aperio SVS: "|MPP = 0.2520|", Philips TIFF:
+// the DICOM_PIXEL_SPACING attribute, in mm), or else in the XResolution and YResolution tags.
+// Falls back to 0.25 (40x magnification) if nothing is known.
+static void tiff_find_mpp(tiff_t* tiff) {
+	tiff->mpp_x = tiff->mpp_y = 0.25f;
+	if (tiff->ifd_count == 0) return;
+	tiff_ifd_t* main_image = tiff->ifds;
+	const char* description = main_image->image_description;
+	if (description) {
+		const char* aperio_mpp = strstr(description, "|MPP = ");
+		if (aperio_mpp) {
+			float mpp = (float)atof(aperio_mpp + 7);
+			if (mpp > 0.0f) {
+				tiff->mpp_x = tiff->mpp_y = mpp;
+				return;
+			}
+		}
+		// e.g. <Attribute Name="DICOM_PIXEL_SPACING" ...>&quot;0.000243902&quot; &quot;0.000243902&quot;</Attribute>
+		// The first one belongs to the base level.
+		const char* philips_spacing = strstr(description, "DICOM_PIXEL_SPACING");
+		if (philips_spacing && (philips_spacing = strchr(philips_spacing, '>')) != NULL) {
+			const char* first = strstr(philips_spacing, "&quot;");
+			const char* second = first ? strstr(first + 6, "&quot;") : NULL;
+			second = second ? strstr(second + 6, "&quot;") : NULL;
+			if (first && second) {
+				float spacing_y = (float)atof(first + 6) * 1000.0f; // (rows first, as in DICOM)
+				float spacing_x = (float)atof(second + 6) * 1000.0f;
+				if (spacing_x > 0.0f && spacing_y > 0.0f) {
+					tiff->mpp_x = spacing_x;
+					tiff->mpp_y = spacing_y;
+					return;
+				}
+			}
+		}
+	}
+	if (main_image->x_resolution > 0.0f && main_image->y_resolution > 0.0f) {
+		float um_per_unit = 0.0f;
+		if (main_image->resolution_unit == TIFF_RESOLUTION_UNIT_CENTIMETER) {
+			um_per_unit = 10000.0f;
+		} else if (main_image->resolution_unit == TIFF_RESOLUTION_UNIT_INCH || main_image->resolution_unit == 0) {
+			um_per_unit = 25400.0f;
+		}
+		float mpp_x = um_per_unit / main_image->x_resolution;
+		float mpp_y = um_per_unit / main_image->y_resolution;
+		// Ignore the resolution if it can't be from a microscope (e.g. the default 72 dpi)
+		if (mpp_x > 0.01f && mpp_x < 100.0f && mpp_y > 0.01f && mpp_y < 100.0f) {
+			tiff->mpp_x = mpp_x;
+			tiff->mpp_y = mpp_y;
+		}
+	}
+}
+
+// Parses the TIFF header and all the IFDs (except for the tile tables, which are loaded on demand).
+static bool32 tiff_read_header_and_ifds(tiff_t* tiff) {
+	// read the 8-byte TIFF header / 16-byte BigTIFF header
+	tiff_header_t tiff_header = {};
+	if (tiff_read_at_offset(tiff, &tiff_header, 0, sizeof(tiff_header_t) /*16*/) != 1) return false;
+	bool32 is_big_endian;
+	switch(tiff_header.byte_order_indication) {
+		case TIFF_BIG_ENDIAN: is_big_endian = true; break;
+		case TIFF_LITTLE_ENDIAN: is_big_endian = false; break;
+		default: return false;
+	}
+	tiff->is_big_endian = is_big_endian;
+	u16 filetype = maybe_swap_16(tiff_header.filetype, is_big_endian);
+	bool32 is_bigtiff;
+	switch(filetype) {
+		case 0x2A: is_bigtiff = false; break;
+		case 0x2B: is_bigtiff = true; break;
+		default: return false;
+	}
+	tiff->is_bigtiff = is_bigtiff;
+	u32 bytesize_of_offsets;
+	u64 next_ifd_offset = 0;
+	if (is_bigtiff) {
+		bytesize_of_offsets = maybe_swap_16(tiff_header.bigtiff.offset_size, is_big_endian);
+		if (bytesize_of_offsets != 8) return false;
+		if (tiff_header.bigtiff.always_zero != 0) return false;
+		next_ifd_offset = maybe_swap_64(tiff_header.bigtiff.first_ifd_offset, is_big_endian);
+	} else {
+		bytesize_of_offsets = 4;
+		next_ifd_offset = maybe_swap_32(tiff_header.tiff.first_ifd_offset, is_big_endian);
+	}
+	ASSERT((bytesize_of_offsets == 4 && !is_bigtiff) || (bytesize_of_offsets == 8 && is_bigtiff));
+	tiff->bytesize_of_offsets = bytesize_of_offsets;
+
+	// Read and process the IFDs
+	while (next_ifd_offset != 0) {
+#if TIFF_VERBOSE
+		printf("Reading IFD #%llu\n", tiff->ifd_count);
+#endif
+		tiff_ifd_t ifd = { .ifd_index = tiff->ifd_count };
+		if (!tiff_read_ifd(tiff, &ifd, &next_ifd_offset)) return false;
+		sb_push(tiff->ifds, ifd);
+		tiff->ifd_count += 1;
+	}
+
+	tiff_find_levels(tiff);
+	tiff_find_mpp(tiff);
+
+	for (i32 i = 0; i < tiff->level_count; ++i) {
+		tiff_ifd_t* ifd = tiff->level_images + i;
+		// Derive the downsampling factor from the actual image size, because not every pyramid has
+		// a level for every power of two (some only have e.g. every 4x).
+		i32 downsample_level = 0;
+		while (downsample_level < 30 && ((u64)ifd->image_width << (downsample_level + 1)) <= (u64)tiff->main_image->image_width + ifd->image_width / 2) {
+			++downsample_level;
+		}
+		ifd->um_per_pixel_x = tiff->mpp_x * (float)(1 << downsample_level);
+		ifd->um_per_pixel_y = tiff->mpp_y * (float)(1 << downsample_level);
+		ifd->x_tile_side_in_um = ifd->um_per_pixel_x * (float)ifd->tile_width;
+		ifd->y_tile_side_in_um = ifd->um_per_pixel_y * (float)ifd->tile_height;
+	}
+
+	return true;
+}
+
 bool32 open_tiff_file(tiff_t* tiff, const char* filename) {
 #if TIFF_VERBOSE
 	printf("Opening TIFF file %s\n", filename);
@@ -439,101 +952,29 @@ bool32 open_tiff_file(tiff_t* tiff, const char* filename) {
 		struct stat st;
 		if (fstat(fileno(fp), &st) == 0) {
 			i64 filesize = st.st_size;
-			if (filesize > 8) {
-				// read the 8-byte TIFF header / 16-byte BigTIFF header
-				tiff_header_t tiff_header = {};
-				if (fread(&tiff_header, sizeof(tiff_header_t) /*16*/, 1, fp) != 1) goto fail;
-				bool32 is_big_endian;
-				switch(tiff_header.byte_order_indication) {
-					case TIFF_BIG_ENDIAN: is_big_endian = true; break;
-					case TIFF_LITTLE_ENDIAN: is_big_endian = false; break;
-					default: goto fail;
-				}
-				tiff->is_big_endian = is_big_endian;
-				u16 filetype = maybe_swap_16(tiff_header.filetype, is_big_endian);
-				bool32 is_bigtiff;
-				switch(filetype) {
-					case 0x2A: is_bigtiff = false; break;
-					case 0x2B: is_bigtiff = true; break;
-					default: goto fail;
-				}
-				tiff->is_bigtiff = is_bigtiff;
-				u32 bytesize_of_offsets;
-				u64 next_ifd_offset = 0;
-				if (is_bigtiff) {
-					bytesize_of_offsets = maybe_swap_16(tiff_header.bigtiff.offset_size, is_big_endian);
-					if (bytesize_of_offsets != 8) goto fail;
-					if (tiff_header.bigtiff.always_zero != 0) goto fail;
-					next_ifd_offset = maybe_swap_64(tiff_header.bigtiff.first_ifd_offset, is_big_endian);
-				} else {
-					bytesize_of_offsets = 4;
-					next_ifd_offset = maybe_swap_32(tiff_header.tiff.first_ifd_offset, is_big_endian);
-				}
-				ASSERT((bytesize_of_offsets == 4 && !is_bigtiff) || (bytesize_of_offsets == 8 && is_bigtiff));
-				tiff->bytesize_of_offsets = bytesize_of_offsets;
-
-				// Read and process the IFDs
-				while (next_ifd_offset != 0) {
-#if TIFF_VERBOSE
-					printf("Reading IFD #%llu\n", tiff->ifd_count);
-#endif
-					tiff_ifd_t ifd = { .ifd_index = tiff->ifd_count };
-					if (!tiff_read_ifd(tiff, &ifd, &next_ifd_offset)) goto fail;
-					sb_push(tiff->ifds, ifd);
-					tiff->ifd_count += 1;
-				}
-
-				// TODO: make more robust
-				// Assume the first IFD is the main image, and also level 0
-				tiff->main_image = tiff->ifds;
-				tiff->main_image_index = 0;
-				tiff->level_images = tiff->main_image;
-				tiff->level_image_index = 0;
-
-				// TODO: make more robust
-				u64 level_counter = 0;
-				for (i32 i = 0; i < tiff->ifd_count; ++i) {
-					tiff_ifd_t* ifd = tiff->ifds + i;
-					if (ifd->subimage_type == TIFF_LEVEL_SUBIMAGE) ++level_counter;
-				}
-				tiff->level_count = level_counter;
-
-				// TODO: make more robust
-				tiff->mpp_x = tiff->mpp_y = 0.25f;
-				float um_per_pixel = 0.25f;
-				for (i32 i = 0; i < tiff->level_count; ++i) {
-					tiff_ifd_t* ifd = tiff->level_images + i;
-					// TODO: allow other tile sizes?
-					ASSERT(ifd->tile_width == 512);
-					ASSERT(ifd->tile_height == 512);
-					ifd->um_per_pixel_x = um_per_pixel;
-					ifd->um_per_pixel_y = um_per_pixel;
-					ifd->x_tile_side_in_um = ifd->um_per_pixel_x * (float)ifd->tile_width;
-					ifd->y_tile_side_in_um = ifd->um_per_pixel_y * (float)ifd->tile_height;
-
-					um_per_pixel *= 2.0f; // downsample, so at higher levels there are more pixels per micrometer
-				}
-
-
+			tiff->filesize = filesize;
+			if (tiff_should_map_file(filename, filesize)) {
+				tiff_map_file(tiff, filename, filesize);
+			}
+			if (filesize > 8 && tiff_read_header_and_ifds(tiff)) {
 				success = true;
-
 			}
-
 		}
-		// TODO: better error handling than this crap
-		fail:;
-		// Note: we need async i/o in the worker threads...
-		// so for now we close and reopen the file using platform-native APIs to make that possible.
-		fclose(fp);
-		tiff->fp = NULL;
+		// Note: the tile data is read in the worker threads using a separate handle, for async I/O (see below).
+		// The FILE* stays open for loading the tile tables on demand.
+		if (!success) {
+			fclose(fp);
+			tiff->fp = NULL;
+		}
 
 #if !IS_SERVER
-		// TODO: make async I/O platform agnostic
-		// TODO: set FILE_FLAG_NO_BUFFERING for maximum performance (but: need to align read requests to page size...)
+		// Note: the handle is used for batched reads with io_read_batch() (see async_io.h)
+		// With FILE_FLAG_NO_BUFFERING, the reads need to be aligned (see read_local_tiles() in viewer.c)
 		// http://vec3.ca/using-win32-asynchronous-io/
+		tiff->is_direct_io = tiff_enable_direct_io;
 		tiff->win32_file_handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
 		                                                 FILE_ATTRIBUTE_NORMAL | /*FILE_FLAG_SEQUENTIAL_SCAN |*/
-		                                                 /*FILE_FLAG_NO_BUFFERING |*/ FILE_FLAG_OVERLAPPED,
+		                                                 (tiff->is_direct_io ? FILE_FLAG_NO_BUFFERING : 0) | FILE_FLAG_OVERLAPPED,
 		                                                 NULL);
 #endif
 
@@ -545,12 +986,63 @@ bool32 open_tiff_file(tiff_t* tiff, const char* filename) {
 	return success;
 }
 
+// Opens a local TIFF file, taking the IFDs and tile tables from its serialized header (see tiff_serialize()) instead of
+// reading them from the file, e.g. because the header was kept from an earlier run. The caller is responsible for
+// checking that the header was made from the file as it is now.
+bool32 open_tiff_file_with_header(tiff_t* tiff, const char* filename, u8* serialized, u64 serialized_size) {
+	if (!tiff_deserialize(tiff, serialized, serialized_size)) {
+		return false;
+	}
+	// tiff_deserialize() allocates the IFDs the way it is done for remote slides; for local files they are a stretchy
+	// buffer (e.g. load_pyramid_sidecar() adds to them).
+	tiff_ifd_t* ifds = tiff->ifds;
+	tiff->ifds = NULL;
+	for (u64 i = 0; i < tiff->ifd_count; ++i) {
+		sb_push(tiff->ifds, ifds[i]);
+	}
+	free(ifds);
+	tiff->main_image = tiff->ifds + tiff->main_image_index;
+	tiff->level_images = tiff->ifds + tiff->level_image_index;
+	tiff->macro_image = NULL;
+	tiff->label_image = NULL;
+	for (u64 i = 0; i < tiff->ifd_count; ++i) {
+		tiff_ifd_t* ifd = tiff->ifds + i;
+		if (ifd->subimage_type == TIFF_MACRO_SUBIMAGE) {
+			tiff->macro_image = ifd;
+		} else if (ifd->subimage_type == TIFF_LABEL_SUBIMAGE) {
+			tiff->label_image = ifd;
+		}
+	}
 
+	FILE* fp = fopen64(filename, "rb");
+	if (!fp) {
+		tiff_destroy(tiff);
+		return false;
+	}
+	tiff->fp = fp;
+	if (tiff_should_map_file(filename, tiff->filesize)) {
+		tiff_map_file(tiff, filename, tiff->filesize);
+	}
+#if !IS_SERVER
+	tiff->is_direct_io = tiff_enable_direct_io;
+	tiff->win32_file_handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+	                                      FILE_ATTRIBUTE_NORMAL | (tiff->is_direct_io ? FILE_FLAG_NO_BUFFERING : 0) |
+	                                      FILE_FLAG_OVERLAPPED, NULL);
+#endif
+	return true;
+}
 
+// Opens a TIFF file that is read through range_reader, e.g. from a regular web server. The tiff takes ownership of
+// the reader (also if this fails).
+bool32 open_tiff_with_range_reader(tiff_t* tiff, i64 filesize, tiff_range_reader_t* range_reader) {
+	tiff->range_reader = range_reader;
+	tiff->filesize = filesize;
+	return (filesize > 8 && tiff_read_header_and_ifds(tiff));
+}
 
-void push_size(push_buffer_t* buffer, u8* data, u64 size) {
+void push_to_buffer(push_buffer_t* buffer, u8* data, u64 size) {
 	if (buffer->used_size + size > buffer->capacity) {
-		printf("push_size(): buffer overflow\n");
+		printf("push_to_buffer(): buffer overflow\n");
 		exit(1);
 	}
 	memcpy(buffer->data + buffer->used_size, data, size);
@@ -559,15 +1051,189 @@ void push_size(push_buffer_t* buffer, u8* data, u64 size) {
 
 void push_block(push_buffer_t* buffer, u32 block_type, u32 index, u64 block_length) {
 	serial_block_t block = { .block_type = block_type, .index = index, .length = block_length };
-	push_size(buffer, (u8*)&block, sizeof(block));
+	push_to_buffer(buffer, (u8*)&block, sizeof(block));
 }
 
 #define INCLUDE_IMAGE_DESCRIPTION 1
 
+// Note: not necessarily the last level, generated levels may come after it (see load_pyramid_sidecar())
+tiff_ifd_t* tiff_get_coarsest_level(tiff_t* tiff) {
+	if (tiff->level_count == 0) return NULL;
+	tiff_ifd_t* coarsest_level = tiff->level_images;
+	for (i32 i = 1; i < tiff->level_count; ++i) {
+		if (tiff->level_images[i].image_width < coarsest_level->image_width) {
+			coarsest_level = tiff->level_images + i;
+		}
+	}
+	return coarsest_level;
+}
+
+// Reads all tiles of the IFD, back to back. Returns NULL if they don't fit within max_size, or cannot be read.
+// The tile tables need to be loaded already (see tiff_load_tile_tables()).
+u8* tiff_read_all_tiles(tiff_t* tiff, tiff_ifd_t* ifd, u64 max_size, u64* size) {
+	u64 total_size = 0;
+	for (u64 i = 0; i < ifd->tile_count; ++i) {
+		total_size += ifd->tile_byte_counts[i];
+	}
+	if (total_size == 0 || total_size > max_size) return NULL;
+	u8* data = (u8*) malloc(total_size);
+	u8* pos = data;
+	bool32 ok = true;
+	for (u64 i = 0; i < ifd->tile_count && ok; ++i) {
+		u64 offset = ifd->tile_offsets[i];
+		u64 tile_size = ifd->tile_byte_counts[i];
+		if (tile_size == 0) continue;
+		u8* mapped = tiff_get_mapped_range(tiff, offset, tile_size);
+		if (mapped) {
+			memcpy(pos, mapped, tile_size);
+		} else {
+			spin_lock(&tiff->fp_lock);
+			ok = (file_read_at_offset(pos, tiff->fp, offset, tile_size) == 1);
+			spin_unlock(&tiff->fp_lock);
+		}
+		pos += tile_size;
+	}
+	if (!ok) {
+		free(data);
+		return NULL;
+	}
+	*size = total_size;
+	return data;
+}
+
+// Tiles at the right and bottom edges may extend beyond the image: the decoded pixels outside of it are made
+// transparent (BGRA, 4 bytes per pixel).
+void tiff_clear_pixels_outside_image(u8* pixels, u32 pitch, u32 tile_width, u32 tile_height, u32 valid_width,
+                                     u32 valid_height) {
+	valid_width = ATMOST(valid_width, tile_width);
+	valid_height = ATMOST(valid_height, tile_height);
+	if (valid_height < tile_height) {
+		memset(pixels + valid_height * pitch, 0, (tile_height - valid_height) * pitch);
+	}
+	if (valid_width < tile_width) {
+		u32 excess_bytes = (tile_width - valid_width) * 4;
+		for (u32 row = 0; row < valid_height; ++row) {
+			memset(pixels + row * pitch + valid_width * 4, 0, excess_bytes);
+		}
+	}
+}
+
+// Chooses the variant of the tile kernels for the tiles of the IFD (see tiff_tile_path_enum).
+void tiff_select_tile_path(tiff_ifd_t* ifd) {
+	ifd->tile_path = TIFF_TILE_PATH_GENERIC;
+	bool32 is_square = (ifd->tile_width == ifd->tile_height);
+	if (ifd->compression != TIFF_COMPRESSION_JPEG || !is_square || (ifd->tile_width != 256 && ifd->tile_width != 512)) {
+		return;
+	}
+	bool32 is_256 = (ifd->tile_width == 256);
+	if (ifd->color_space == TIFF_PHOTOMETRIC_YCBCR) {
+		// (without the YCbCrSubSampling tag, the default is 2x2)
+		u16 horizontal = ifd->chroma_subsampling_horizontal ? ifd->chroma_subsampling_horizontal : 2;
+		u16 vertical = ifd->chroma_subsampling_vertical ? ifd->chroma_subsampling_vertical : 2;
+		if (horizontal == 2 && vertical == 2) {
+			ifd->tile_path = is_256 ? TIFF_TILE_PATH_JPEG_YCBCR420_256 : TIFF_TILE_PATH_JPEG_YCBCR420_512;
+		}
+	} else if (ifd->color_space == TIFF_PHOTOMETRIC_RGB) {
+		ifd->tile_path = is_256 ? TIFF_TILE_PATH_JPEG_RGB_256 : TIFF_TILE_PATH_JPEG_RGB_512;
+	}
+}
+
+// The tile tables are by far the largest part of the serialized header (16 bytes per tile), but most of it is
+// predictable: tiles tend to be stored one after the other, so that a tile usually starts where the previous one ended.
+// So per tile we store the byte count, and the difference between the offset and where we expected it to be, both as
+// variable-length integers (7 bits per byte). Empty tiles (byte count 0) store their offset as is.
+#define TIFF_PACKED_TILE_TABLE_MAX_BYTES_PER_TILE 20
+
+static inline u8* put_varint(u8* pos, u64 value) {
+	while (value >= 0x80) {
+		*pos++ = (u8)(value | 0x80);
+		value >>= 7;
+	}
+	*pos++ = (u8)value;
+	return pos;
+}
+
+static inline u8* get_varint(u8* pos, u8* end, u64* value) {
+	u64 result = 0;
+	for (i32 shift = 0; pos < end && shift < 64; shift += 7) {
+		u8 byte = *pos++;
+		result |= (u64)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			*value = result;
+			return pos;
+		}
+	}
+	return NULL; // truncated or malformed
+}
+
+static u8* tiff_pack_tile_tables(tiff_ifd_t* ifd, u64* packed_size) {
+	u8* packed = (u8*) malloc(ifd->tile_count * TIFF_PACKED_TILE_TABLE_MAX_BYTES_PER_TILE + 1);
+	u8* pos = packed;
+	u64 expected_offset = 0;
+	for (u64 i = 0; i < ifd->tile_count; ++i) {
+		u64 offset = ifd->tile_offsets[i];
+		u64 byte_count = ifd->tile_byte_counts[i];
+		pos = put_varint(pos, byte_count);
+		if (byte_count == 0) {
+			pos = put_varint(pos, offset);
+		} else {
+			// zigzag encoding, so that small negative differences stay small
+			i64 delta = (i64)(offset - expected_offset);
+			pos = put_varint(pos, ((u64)delta << 1) ^ (u64)(delta >> 63));
+			expected_offset = offset + byte_count;
+		}
+	}
+	*packed_size = pos - packed;
+	return packed;
+}
+
+static bool32 tiff_unpack_tile_tables(tiff_ifd_t* ifd, u8* packed, u64 packed_size) {
+	u8* pos = packed;
+	u8* end = packed + packed_size;
+	ifd->tile_offsets = (u64*) malloc(ifd->tile_count * sizeof(u64));
+	ifd->tile_byte_counts = (u64*) malloc(ifd->tile_count * sizeof(u64));
+	memory_stats_add(MEMORY_DOMAIN_TIFF_METADATA, 2 * ifd->tile_count * sizeof(u64));
+	u64 expected_offset = 0;
+	for (u64 i = 0; i < ifd->tile_count; ++i) {
+		u64 byte_count = 0;
+		u64 value = 0;
+		if (!(pos = get_varint(pos, end, &byte_count)) || !(pos = get_varint(pos, end, &value))) {
+			return false;
+		}
+		ifd->tile_byte_counts[i] = byte_count;
+		if (byte_count == 0) {
+			ifd->tile_offsets[i] = value;
+		} else {
+			i64 delta = (i64)(value >> 1) ^ -(i64)(value & 1);
+			u64 offset = expected_offset + (u64)delta;
+			ifd->tile_offsets[i] = offset;
+			expected_offset = offset + byte_count;
+		}
+	}
+	return (pos == end);
+}
+
 push_buffer_t* tiff_serialize(tiff_t* tiff, push_buffer_t* buffer) {
+	for (i32 i = 0; i < tiff->ifd_count; ++i) {
+		tiff_ifd_t* ifd = tiff->ifds + i;
+		if (!tiff_load_tile_tables(tiff, ifd)) {
+			ifd->tile_count = 0; // could not read the tables, send the IFD without tiles
+		}
+	}
 
 	u64 total_size = 0;
 
+	// The tiles of the coarsest level go along, so that the client can show the whole slide right away,
+	// without waiting for another round trip.
+	u8* tile_data = NULL;
+	u64 tile_data_size = 0;
+	u32 tile_data_ifd_index = 0;
+	tiff_ifd_t* coarsest_level = tiff_get_coarsest_level(tiff);
+	if (coarsest_level) {
+		tile_data = tiff_read_all_tiles(tiff, coarsest_level, TIFF_SERIAL_TILE_DATA_MAX_SIZE, &tile_data_size);
+		tile_data_ifd_index = (u32)coarsest_level->ifd_index;
+	}
+
 	// block: general TIFF header / meta
 	total_size += sizeof(serial_block_t);
 	tiff_serial_header_t serial_header = (tiff_serial_header_t){
@@ -590,6 +1256,8 @@ push_buffer_t* tiff_serialize(tiff_t* tiff, push_buffer_t* buffer) {
 	total_size += sizeof(serial_block_t);
 	u64 serial_ifds_block_size = tiff->ifd_count * sizeof(tiff_serial_ifd_t);
 	tiff_serial_ifd_t* serial_ifds = (tiff_serial_ifd_t*) alloca(serial_ifds_block_size);
+	u8** packed_tile_tables = (u8**) alloca(tiff->ifd_count * sizeof(u8*));
+	u64* packed_tile_tables_sizes = (u64*) alloca(tiff->ifd_count * sizeof(u64));
 	for (i32 i = 0; i < tiff->ifd_count; ++i) {
 		tiff_ifd_t* ifd = tiff->ifds + i;
 		tiff_serial_ifd_t* serial_ifd = serial_ifds + i;
@@ -618,18 +1286,22 @@ push_buffer_t* tiff_serialize(tiff_t* tiff, push_buffer_t* buffer) {
 		total_size += ifd->image_description_length;
 #endif
 		total_size += ifd->jpeg_tables_length;
-		total_size += ifd->tile_count * sizeof(ifd->tile_offsets[0]);
-		total_size += ifd->tile_count * sizeof(ifd->tile_byte_counts[0]);
+		packed_tile_tables[i] = tiff_pack_tile_tables(ifd, &packed_tile_tables_sizes[i]);
+		total_size += packed_tile_tables_sizes[i];
 	}
 	total_size += tiff->ifd_count * sizeof(tiff_serial_ifd_t);
 
-	// blocks: need separate blocks for each IFD's image descriptions, tile offsets, tile byte counts, jpeg tables
+	// blocks: need separate blocks for each IFD's image descriptions, tile tables, jpeg tables
 #if INCLUDE_IMAGE_DESCRIPTION
 	total_size += tiff->ifd_count * sizeof(serial_block_t);
 #endif
 	total_size += tiff->ifd_count * sizeof(serial_block_t);
 	total_size += tiff->ifd_count * sizeof(serial_block_t);
-	total_size += tiff->ifd_count * sizeof(serial_block_t);
+
+	// block: tile data of the coarsest level
+	if (tile_data) {
+		total_size += sizeof(serial_block_t) + tile_data_size;
+	}
 
 	// block: terminator (end of stream marker)
 	total_size += sizeof(serial_block_t);
@@ -637,7 +1309,7 @@ push_buffer_t* tiff_serialize(tiff_t* tiff, push_buffer_t* buffer) {
 	// Now we know the total size of our uncompressed payload (although if compressed we'll need to rewrite the headers)
 	char http_headers[4096];
 	snprintf(http_headers, sizeof(http_headers),
-	         "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-type: application/octet-stream\r\nContent-length: %-16llu\r\n\r\n",
+	         "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-type: application/octet-stream\r\nContent-length: %-16llu\r\n\r\n",
 	         total_size);
 	u64 http_headers_size = strlen(http_headers);
 
@@ -652,28 +1324,30 @@ push_buffer_t* tiff_serialize(tiff_t* tiff, push_buffer_t* buffer) {
 	buffer->capacity = total_size;
 
 	push_block(buffer, SERIAL_BLOCK_TIFF_HEADER_AND_META, 0,  sizeof(serial_block_t));
-	push_size(buffer, (u8*)&serial_header, sizeof(serial_header));
+	push_to_buffer(buffer, (u8*)&serial_header, sizeof(serial_header));
 
 	push_block(buffer, SERIAL_BLOCK_TIFF_IFDS, 0, serial_ifds_block_size);
-	push_size(buffer, (u8*)serial_ifds, serial_ifds_block_size);
+	push_to_buffer(buffer, (u8*)serial_ifds, serial_ifds_block_size);
 
 	for (i32 i = 0; i < tiff->ifd_count; ++i) {
 		tiff_ifd_t* ifd = tiff->ifds + i;
 #if INCLUDE_IMAGE_DESCRIPTION
 		push_block(buffer, SERIAL_BLOCK_TIFF_IMAGE_DESCRIPTION, i, ifd->image_description_length);
-		push_size(buffer, (u8*)ifd->image_description, ifd->image_description_length);
+		push_to_buffer(buffer, (u8*)ifd->image_description, ifd->image_description_length);
 #endif
-		u64 tile_offsets_size = ifd->tile_count * sizeof(ifd->tile_offsets[0]);
-		push_block(buffer, SERIAL_BLOCK_TIFF_TILE_OFFSETS, i, tile_offsets_size);
-		push_size(buffer, (u8*)ifd->tile_offsets, tile_offsets_size);
-
-		u64 tile_byte_counts_size = ifd->tile_count * sizeof(ifd->tile_byte_counts[0]);
-		push_block(buffer, SERIAL_BLOCK_TIFF_TILE_BYTE_COUNTS, i, tile_byte_counts_size);
-		push_size(buffer, (u8*)ifd->tile_byte_counts, tile_byte_counts_size);
+		push_block(buffer, SERIAL_BLOCK_TIFF_TILE_TABLES_PACKED, i, packed_tile_tables_sizes[i]);
+		push_to_buffer(buffer, packed_tile_tables[i], packed_tile_tables_sizes[i]);
+		free(packed_tile_tables[i]);
 
 		push_block(buffer, SERIAL_BLOCK_TIFF_JPEG_TABLES, i, ifd->jpeg_tables_length);
-		push_size(buffer, ifd->jpeg_tables, ifd->jpeg_tables_length);
+		push_to_buffer(buffer, ifd->jpeg_tables, ifd->jpeg_tables_length);
+
+	}
 
+	if (tile_data) {
+		push_block(buffer, SERIAL_BLOCK_TIFF_TILE_DATA, tile_data_ifd_index, tile_data_size);
+		push_to_buffer(buffer, tile_data, tile_data_size);
+		free(tile_data);
 	}
 
 	push_block(buffer, SERIAL_BLOCK_TERMINATOR, 0, 0);
@@ -682,49 +1356,52 @@ push_buffer_t* tiff_serialize(tiff_t* tiff, push_buffer_t* buffer) {
 
 	// Additional compression step
 #if 1
-	i32 compression_size_bound = LZ4_COMPRESSBOUND(total_size);
+	u64 chunk_count = (total_size + TIFF_SERIAL_LZ4_CHUNK_SIZE - 1) / TIFF_SERIAL_LZ4_CHUNK_SIZE;
+	u64 compression_size_bound = chunk_count * (sizeof(tiff_serial_lz4_chunk_t) + LZ4_COMPRESSBOUND(TIFF_SERIAL_LZ4_CHUNK_SIZE));
 	u8* compression_buffer = (u8*) malloc(compression_size_bound);
 	ASSERT(buffer->used_size == total_size);
-	i32 compressed_size = LZ4_compress_default((char*)buffer->data, (char*)compression_buffer, buffer->used_size, compression_size_bound);
-	if (compressed_size > 0) {
+	// Compressed in chunks, so that the client can start decompressing before all of it has come in.
+	LZ4_stream_t lz4_stream;
+	LZ4_initStream(&lz4_stream, sizeof(lz4_stream));
+	i64 compressed_size = 0;
+	for (u64 chunk_offset = 0; chunk_offset < total_size; chunk_offset += TIFF_SERIAL_LZ4_CHUNK_SIZE) {
+		i32 chunk_size = (i32)MIN(TIFF_SERIAL_LZ4_CHUNK_SIZE, total_size - chunk_offset);
+		tiff_serial_lz4_chunk_t* chunk = (tiff_serial_lz4_chunk_t*)(compression_buffer + compressed_size);
+		i32 chunk_compressed_size = LZ4_compress_fast_continue(&lz4_stream, (char*)buffer->data + chunk_offset,
+		                                                       (char*)(chunk + 1), chunk_size,
+		                                                       LZ4_COMPRESSBOUND(chunk_size), 1);
+		if (chunk_compressed_size <= 0) {
+			compressed_size = 0;
+			break;
+		}
+		*chunk = (tiff_serial_lz4_chunk_t){ .compressed_size = chunk_compressed_size, .decompressed_size = chunk_size };
+		compressed_size += sizeof(tiff_serial_lz4_chunk_t) + chunk_compressed_size;
+	}
+	if (compressed_size > 0 && compressed_size + sizeof(serial_block_t) <= total_size) {
 		// success! We can replace the buffer contents with the compressed data
 		buffer->used_size = 0;
-		push_block(buffer, SERIAL_BLOCK_LZ4_COMPRESSED_DATA, total_size, compressed_size);
-		push_size(buffer, compression_buffer, compressed_size);
+		push_block(buffer, SERIAL_BLOCK_LZ4_COMPRESSED_CHUNKS, 0, compressed_size);
+		push_to_buffer(buffer, compression_buffer, compressed_size);
 
 		// rewrite the HTTP headers at the start, the Content-Length now isn't correct
 		snprintf(http_headers, sizeof(http_headers),
-		         "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-type: application/octet-stream\r\nContent-length: %-16llu\r\n\r\n",
-		         total_size);
+		         "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-type: application/octet-stream\r\nContent-length: %-16llu\r\n\r\n",
+		         buffer->used_size);
 		ASSERT(strlen(http_headers) == http_headers_size); // We should be able to assume this because of the padding spaces for the Content-length header field.
 		memcpy(buffer->raw_memory, http_headers, http_headers_size);
 	}
+	free(compression_buffer);
 #endif
 
 	return buffer;
 
 }
 
-u8* pop_from_buffer(u8** pos, i64 size, i64* bytes_left) {
-	if (size > *bytes_left) {
-		printf("pop_from_buffer(): buffer empty\n");
-		return NULL;
-	}
-	u8* old_pos = *pos;
-	*pos += size;
-	*bytes_left -= size;
-	return old_pos;
-}
-
-serial_block_t* pop_block_from_buffer(u8** pos, i64* bytes_left) {
-	return (serial_block_t*) pop_from_buffer(pos, sizeof(serial_block_t), bytes_left);
-}
-
 i64 find_end_of_http_headers(u8* str, u64 len) {
 	static const char crlfcrlf[] = "\r\n\r\n";
 	u32 search_key = *(u32*)crlfcrlf;
 	i64 result = 0;
-	for (i64 offset = 0; offset < len - 4; ++offset) {
+	for (i64 offset = 0; (u64)offset + 4 <= len; ++offset) {
 		u8* pos = str + offset;
 		u32 check = *(u32*)pos;
 		if (check == search_key) {
@@ -737,216 +1414,324 @@ i64 find_end_of_http_headers(u8* str, u64 len) {
 
 
 
-bool32 tiff_deserialize(tiff_t* tiff, u8* buffer, u64 buffer_size) {
-	i64 bytes_left = (i64)buffer_size;
-	u8* pos = buffer;
-	u8* data = NULL;
-	serial_block_t* block = NULL;
-	bool32 success = false;
-	u8* decompressed_buffer = NULL;
-
-	if (0) {
-		failed:
-		if (decompressed_buffer) free(decompressed_buffer);
-		return false;
-	}
+enum tiff_deserializer_mode_enum {
+	TIFF_DESERIALIZER_START = 0,
+	TIFF_DESERIALIZER_UNCOMPRESSED,
+	TIFF_DESERIALIZER_LZ4_CHUNKS,
+	TIFF_DESERIALIZER_LZ4_SINGLE_BLOCK,
+};
 
+// Copies as much as is still needed (and available) to dest + *received. Returns the number of bytes used up.
+static u64 take_bytes(u8* dest, u64 needed, u64* received, u8* src, u64 src_size) {
+	u64 count = MIN(needed - *received, src_size);
+	if (dest) memcpy(dest + *received, src, count);
+	*received += count;
+	return count;
+}
 
-#define POP_DATA(size) do {if (!(data = pop_from_buffer(&pos, (size), &bytes_left))) goto failed; } while(0)
-#define POP_BLOCK() do{if (!(block = pop_block_from_buffer(&pos, &bytes_left))) goto failed; } while(0)
+static bool32 tiff_deserializer_begin_block(tiff_deserializer_t* d) {
+	serial_block_t* block = &d->block;
+	tiff_t* tiff = d->tiff;
+	d->block_dest = NULL;
+	d->block_content_size = block->length;
+	d->block_content_received = 0;
+
+	if (!d->has_serial_header) {
+		if (block->block_type != SERIAL_BLOCK_TIFF_HEADER_AND_META) return false;
+		// Note: the length of this block has never been filled in correctly, the size is fixed anyway.
+		d->block_dest = (u8*)&d->serial_header;
+		d->block_content_size = sizeof(tiff_serial_header_t);
+		return true;
+	}
+	if (!tiff->ifds) {
+		if (block->block_type != SERIAL_BLOCK_TIFF_IFDS) return false;
+		if (block->length != d->serial_header.ifd_count * sizeof(tiff_serial_ifd_t)) return false;
+		d->block_dest = d->block_temp = (u8*) malloc(block->length);
+		return true;
+	}
+	if (block->block_type == SERIAL_BLOCK_TERMINATOR) {
+		return true;
+	}
 
+	// TODO: Need to think about this: are block index's (if present) always referring an IFD index, though? Or are there other use cases?
+	if (block->index >= tiff->ifd_count) {
+		printf("tiff_deserialize(): found block referencing a non-existent IFD\n");
+		return false;
+	}
+	tiff_ifd_t* ifd = tiff->ifds + block->index;
+	switch (block->block_type) {
+		case SERIAL_BLOCK_TIFF_IMAGE_DESCRIPTION: {
+			if (ifd->image_description) {
+				printf("tiff_deserialize(): IFD %u already has an image description\n", block->index);
+				return false;
+			}
+			ifd->image_description = (char*) calloc(1, block->length + 1);
+			ifd->image_description_length = block->length;
+			d->block_dest = (u8*)ifd->image_description;
+		} break;
+		case SERIAL_BLOCK_TIFF_TILE_OFFSETS: {
+			if (ifd->tile_offsets || block->length != ifd->tile_count * sizeof(u64)) {
+				printf("tiff_deserialize(): IFD %u has unexpected tile offsets\n", block->index);
+				return false;
+			}
+			ifd->tile_offsets = (u64*) malloc(block->length);
+			memory_stats_add(MEMORY_DOMAIN_TIFF_METADATA, block->length);
+			d->block_dest = (u8*)ifd->tile_offsets;
+		} break;
+		case SERIAL_BLOCK_TIFF_TILE_BYTE_COUNTS: {
+			if (ifd->tile_byte_counts || block->length != ifd->tile_count * sizeof(u64)) {
+				printf("tiff_deserialize(): IFD %u has unexpected tile byte counts\n", block->index);
+				return false;
+			}
+			ifd->tile_byte_counts = (u64*) malloc(block->length);
+			memory_stats_add(MEMORY_DOMAIN_TIFF_METADATA, block->length);
+			d->block_dest = (u8*)ifd->tile_byte_counts;
+		} break;
+		case SERIAL_BLOCK_TIFF_TILE_TABLES_PACKED: {
+			if (ifd->tile_offsets || ifd->tile_byte_counts) {
+				printf("tiff_deserialize(): IFD %u already has tile tables\n", block->index);
+				return false;
+			}
+			d->block_dest = d->block_temp = (u8*) malloc(block->length);
+		} break;
+		case SERIAL_BLOCK_TIFF_JPEG_TABLES: {
+			if (ifd->jpeg_tables) {
+				printf("tiff_deserialize(): IFD %u already has JPEG tables\n", block->index);
+				return false;
+			}
+			ifd->jpeg_tables = (u8*) calloc(1, block->length + 1);
+			ifd->jpeg_tables_length = block->length;
+			d->block_dest = ifd->jpeg_tables;
+		} break;
+		case SERIAL_BLOCK_TIFF_TILE_DATA: {
+			if (ifd->tile_data) {
+				printf("tiff_deserialize(): IFD %u already has tile data\n", block->index);
+				return false;
+			}
+			ifd->tile_data = (u8*) malloc(block->length);
+			ifd->tile_data_size = block->length;
+			d->block_dest = ifd->tile_data;
+		} break;
+		default: break; // unknown blocks are skipped
+	}
+	return true;
+}
 
-	i64 content_offset = find_end_of_http_headers(buffer, buffer_size);
-	i64 content_length = buffer_size - content_offset;
-	POP_DATA(content_offset);
+static bool32 tiff_deserializer_end_block(tiff_deserializer_t* d) {
+	serial_block_t* block = &d->block;
+	tiff_t* tiff = d->tiff;
+	bool32 success = true;
+	if (!d->has_serial_header) {
+		tiff_serial_header_t* serial_header = &d->serial_header;
+		*tiff = (tiff_t) {};
+		tiff->filesize = serial_header->filesize;
+		tiff->bytesize_of_offsets = serial_header->bytesize_of_offsets;
+		tiff->main_image_index = serial_header->main_image_index;
+		tiff->macro_image_index = serial_header->macro_image_index;
+		tiff->label_image_index = serial_header->label_image_index;
+		tiff->level_count = serial_header->level_count;
+		tiff->is_bigtiff = serial_header->is_bigtiff;
+		tiff->is_big_endian = serial_header->is_big_endian;
+		tiff->mpp_x = serial_header->mpp_x;
+		tiff->mpp_y = serial_header->mpp_y;
+		d->has_serial_header = true;
+	} else if (!tiff->ifds) {
+		tiff_serial_ifd_t* serial_ifds = (tiff_serial_ifd_t*) d->block_temp;
+		tiff->ifd_count = d->serial_header.ifd_count;
+		// TODO: maybe not use a stretchy_buffer here?
+		tiff->ifds = (tiff_ifd_t*) calloc(1, sizeof(tiff_ifd_t) * tiff->ifd_count); // allocate space for the IFD's
+		for (i32 i = 0; i < tiff->ifd_count; ++i) {
+			tiff_ifd_t* ifd = tiff->ifds + i;
+			tiff_serial_ifd_t* serial_ifd = serial_ifds + i;
+			*ifd = (tiff_ifd_t) {};
+			ifd->ifd_index = i;
+			ifd->image_width = serial_ifd->image_width;
+			ifd->image_height = serial_ifd->image_height;
+			ifd->tile_width = serial_ifd->tile_width;
+			ifd->tile_height = serial_ifd->tile_height;
+			ifd->tile_count = serial_ifd->tile_count;
+			ifd->are_tile_tables_loaded = true; // (they are part of the serialized data)
+			ifd->image_description_length = serial_ifd->image_description_length;
+			ifd->jpeg_tables_length = serial_ifd->jpeg_tables_length;
+			ifd->compression = serial_ifd->compression;
+			ifd->color_space = serial_ifd->color_space;
+			ifd->subimage_type = serial_ifd->subimage_type;
+			ifd->level_magnification = serial_ifd->level_magnification;
+			ifd->width_in_tiles = serial_ifd->width_in_tiles;
+			ifd->height_in_tiles = serial_ifd->height_in_tiles;
+			ifd->um_per_pixel_x = serial_ifd->um_per_pixel_x;
+			ifd->um_per_pixel_y = serial_ifd->um_per_pixel_y;
+			ifd->x_tile_side_in_um = serial_ifd->x_tile_side_in_um;
+			ifd->y_tile_side_in_um = serial_ifd->y_tile_side_in_um;
+			ifd->chroma_subsampling_horizontal = serial_ifd->chroma_subsampling_horizontal;
+			ifd->chroma_subsampling_vertical = serial_ifd->chroma_subsampling_vertical;
+			ifd->reference_black_white_rational_count = 0; // unused for now
+			ifd->reference_black_white = NULL; // unused for now
+			tiff_select_tile_path(ifd);
+		}
+	} else if (block->block_type == SERIAL_BLOCK_TIFF_TILE_TABLES_PACKED) {
+		success = tiff_unpack_tile_tables(tiff->ifds + block->index, d->block_temp, block->length);
+		if (!success) {
+			printf("tiff_deserialize(): IFD %u has malformed packed tile tables\n", block->index);
+		}
+	} else if (block->block_type == SERIAL_BLOCK_TERMINATOR) {
+		printf("tiff_deserialize(): found a terminator block\n");
+		d->is_complete = true;
+	}
+	if (d->block_temp) {
+		free(d->block_temp);
+		d->block_temp = NULL;
+	}
+	return success;
+}
 
-	// block: general TIFF header / meta
-	POP_BLOCK();
-
-	if (block->block_type == SERIAL_BLOCK_LZ4_COMPRESSED_DATA) {
-		// compressed LZ4 stream
-		i32 compressed_size = (i32)block->length;
-		i32 decompressed_size = (i32)block->index; // used as general purpose field here..
-		ASSERT(block->length < INT32_MAX);
-		ASSERT(block->index < INT32_MAX);
-		POP_DATA(compressed_size);
-		decompressed_buffer = (u8*) malloc(decompressed_size);
-		i32 bytes_decompressed = LZ4_decompress_safe((char*)data, (char*)decompressed_buffer, compressed_size, decompressed_size);
-		if (bytes_decompressed > 0) {
-			if (bytes_decompressed != decompressed_size) {
-				printf("LZ4_decompress_safe() decompressed %d bytes, however the expected size was %d\n", bytes_decompressed, decompressed_size);
-			} else {
-				// success, switch over to the uncompressed buffer!
-				pos = decompressed_buffer;
-				bytes_left = bytes_decompressed;
-				POP_BLOCK(); // now pointing to the uncompressed data stream
+// Parses the (uncompressed) block stream.
+static bool32 tiff_deserializer_parse(tiff_deserializer_t* d, u8* data, u64 size) {
+	d->bytes_parsed += size;
+	while (size > 0 && !d->is_complete) {
+		u64 count = 0;
+		if (d->block_header_received < sizeof(serial_block_t)) {
+			count = take_bytes((u8*)&d->block, sizeof(serial_block_t), &d->block_header_received, data, size);
+			if (d->block_header_received == sizeof(serial_block_t) && !tiff_deserializer_begin_block(d)) {
+				return false;
 			}
-
 		} else {
-			printf("LZ4_decompress_safe() failed (return value %d)\n", bytes_decompressed);
+			count = take_bytes(d->block_dest, d->block_content_size, &d->block_content_received, data, size);
+		}
+		data += count;
+		size -= count;
+		if (d->block_header_received == sizeof(serial_block_t) && d->block_content_received == d->block_content_size) {
+			if (!tiff_deserializer_end_block(d)) return false;
+			d->block_header_received = 0;
 		}
 	}
+	return true;
+}
 
-	if (block->block_type != SERIAL_BLOCK_TIFF_HEADER_AND_META) goto failed;
-
-	POP_DATA(sizeof(tiff_serial_header_t));
-	tiff_serial_header_t* serial_header = (tiff_serial_header_t*) data;
+void tiff_deserializer_begin(tiff_deserializer_t* deserializer, tiff_t* tiff) {
+	*deserializer = (tiff_deserializer_t){ .tiff = tiff };
 	*tiff = (tiff_t) {};
-	tiff->is_remote = 0; // set later
-	tiff->location = (network_location_t){}; // set later
-	tiff->fp = NULL;
-#if !IS_SERVER
-	tiff->win32_file_handle = NULL;
-#endif
-	tiff->filesize = serial_header->filesize;
-	tiff->bytesize_of_offsets = serial_header->bytesize_of_offsets;
-	tiff->ifd_count = serial_header->ifd_count;
-	tiff->ifds = NULL; // set later
-	tiff->main_image = NULL; // set later
-	tiff->main_image_index = serial_header->main_image_index;
-	tiff->macro_image = NULL; // set later
-	tiff->macro_image_index = serial_header->macro_image_index;
-	tiff->label_image = NULL; // set later
-	tiff->label_image_index = serial_header->label_image_index;
-	tiff->level_count = serial_header->level_count;
-	tiff->level_images = NULL; // set later
-	tiff->level_image_index = 0; // set later
-	tiff->is_bigtiff = serial_header->is_bigtiff;
-	tiff->is_big_endian = serial_header->is_big_endian;
-	tiff->mpp_x = serial_header->mpp_x;
-	tiff->mpp_y = serial_header->mpp_y;
-
-	// block: IFD's
-	POP_BLOCK();
-	if (block->block_type != SERIAL_BLOCK_TIFF_IFDS) goto failed;
-	u64 serial_ifds_block_size = tiff->ifd_count * sizeof(tiff_serial_ifd_t);
-	if (block->length != serial_ifds_block_size) goto failed;
-
-	POP_DATA(serial_ifds_block_size);
-	tiff_serial_ifd_t* serial_ifds = (tiff_serial_ifd_t*) data;
-
-	// TODO: maybe not use a stretchy_buffer here?
-	tiff->ifds = (tiff_ifd_t*) calloc(1, sizeof(tiff_ifd_t) * tiff->ifd_count); // allocate space for the IFD's
-	memset(tiff->ifds, 0, tiff->ifd_count * sizeof(tiff_ifd_t));
+}
 
-	for (i32 i = 0; i < tiff->ifd_count; ++i) {
-		tiff_ifd_t* ifd = tiff->ifds + i;
-		tiff_serial_ifd_t* serial_ifd = serial_ifds + i;
-		*ifd = (tiff_ifd_t) {};
-		ifd->ifd_index = i;
-		ifd->image_width = serial_ifd->image_width;
-		ifd->image_height = serial_ifd->image_height;
-		ifd->tile_width = serial_ifd->tile_width;
-		ifd->tile_height = serial_ifd->tile_height;
-		ifd->tile_count = serial_ifd->tile_count;
-		ifd->tile_offsets = NULL; // set later
-		ifd->tile_byte_counts = NULL; // set later
-		ifd->image_description = NULL; // set later
-		ifd->image_description_length = serial_ifd->image_description_length;
-		ifd->jpeg_tables = NULL; // set later
-		ifd->jpeg_tables_length = serial_ifd->jpeg_tables_length;
-		ifd->compression = serial_ifd->compression;
-		ifd->color_space = serial_ifd->color_space;
-		ifd->subimage_type = serial_ifd->subimage_type;
-		ifd->level_magnification = serial_ifd->level_magnification;
-		ifd->width_in_tiles = serial_ifd->width_in_tiles;
-		ifd->height_in_tiles = serial_ifd->height_in_tiles;
-		ifd->um_per_pixel_x = serial_ifd->um_per_pixel_x;
-		ifd->um_per_pixel_y = serial_ifd->um_per_pixel_y;
-		ifd->x_tile_side_in_um = serial_ifd->x_tile_side_in_um;
-		ifd->y_tile_side_in_um = serial_ifd->y_tile_side_in_um;
-		ifd->chroma_subsampling_horizontal = serial_ifd->chroma_subsampling_horizontal;
-		ifd->chroma_subsampling_vertical = serial_ifd->chroma_subsampling_vertical;
-		ifd->reference_black_white_rational_count = 0; // unused for now
-		ifd->reference_black_white = NULL; // unused for now
-	}
-
-	DUMMY_STATEMENT; // for placing a debug breakpoint
-
-	// The number of remaining blocks is unspecified.
-	// We are expecting at least byte offsets, tile offsets and JPEG tables for each IFD
-	bool32 reached_end = false;
-	while (!reached_end) {
-
-		POP_BLOCK();
-		if (block->length > 0) {
-			POP_DATA(block->length);
-		}
-		u8* block_content = data;
-		// TODO: Need to think about this: are block index's (if present) always referring an IFD index, though? Or are there other use cases?
-		if (block->index >= tiff->ifd_count) {
-			printf("tiff_deserialize(): found block referencing a non-existent IFD\n");
-			goto failed;
-		}
-		tiff_ifd_t* referenced_ifd = tiff->ifds + block->index;
-
-
-		switch (block->block_type) {
-			case SERIAL_BLOCK_TIFF_IMAGE_DESCRIPTION: {
-				if (referenced_ifd->image_description) {
-					printf("tiff_deserialize(): IFD %u already has an image description\n", block->index);
-					goto failed;
+// Feed the content of the response (without the HTTP headers) as it comes in. Returns false if it is not valid.
+bool32 tiff_deserializer_feed(tiff_deserializer_t* d, u8* data, u64 size) {
+	while (size > 0 && !d->is_complete && !d->failed) {
+		u64 count = size;
+		switch (d->mode) {
+			case TIFF_DESERIALIZER_START: {
+				count = take_bytes(d->first_block, sizeof(serial_block_t), &d->first_block_received, data, size);
+				if (d->first_block_received < sizeof(serial_block_t)) break;
+				serial_block_t* block = (serial_block_t*) d->first_block;
+				if (block->block_type == SERIAL_BLOCK_LZ4_COMPRESSED_CHUNKS) {
+					d->mode = TIFF_DESERIALIZER_LZ4_CHUNKS;
+					d->compressed_bytes_left = block->length;
+					d->compressed_data = (u8*) malloc(LZ4_COMPRESSBOUND(TIFF_SERIAL_LZ4_CHUNK_SIZE));
+					d->decompressed_data = (u8*) malloc(2 * TIFF_SERIAL_LZ4_CHUNK_SIZE);
+					d->lz4_stream_decode = LZ4_createStreamDecode();
+				} else if (block->block_type == SERIAL_BLOCK_LZ4_COMPRESSED_DATA) {
+					// The decompressed size is in the index field.
+					d->mode = TIFF_DESERIALIZER_LZ4_SINGLE_BLOCK;
+					if (block->length >= INT32_MAX) d->failed = true;
+					else d->compressed_data = (u8*) malloc(block->length);
+				} else {
+					d->mode = TIFF_DESERIALIZER_UNCOMPRESSED;
+					d->failed = !tiff_deserializer_parse(d, d->first_block, sizeof(serial_block_t));
 				}
-				referenced_ifd->image_description = (char*) malloc(block->length + 1);
-				memcpy(referenced_ifd->image_description, block_content, block->length);
-				referenced_ifd->image_description[block->length] = '\0';
-				referenced_ifd->image_description_length = block->length;
 			} break;
-			case SERIAL_BLOCK_TIFF_TILE_OFFSETS: {
-				if (referenced_ifd->tile_offsets) {
-					printf("tiff_deserialize(): IFD %u already has tile offsets\n", block->index);
-					goto failed;
-				}
-				referenced_ifd->tile_offsets = (u64*) malloc(block->length);
-				memcpy(referenced_ifd->tile_offsets, block_content, block->length);
+			case TIFF_DESERIALIZER_UNCOMPRESSED: {
+				d->failed = !tiff_deserializer_parse(d, data, size);
 			} break;
-			case SERIAL_BLOCK_TIFF_TILE_BYTE_COUNTS: {
-				if (referenced_ifd->tile_byte_counts) {
-					printf("tiff_deserialize(): IFD %u already has tile byte counts\n", block->index);
-					goto failed;
+			case TIFF_DESERIALIZER_LZ4_CHUNKS: {
+				if (d->compressed_bytes_left == 0) {
+					d->failed = true; // ran out of chunks before the terminator
+					break;
 				}
-				referenced_ifd->tile_byte_counts = (u64*) malloc(block->length);
-				memcpy(referenced_ifd->tile_byte_counts, block_content, block->length);
-			} break;
-			case SERIAL_BLOCK_TIFF_JPEG_TABLES: {
-				if (referenced_ifd->jpeg_tables) {
-					printf("tiff_deserialize(): IFD %u already has JPEG tables\n", block->index);
-					goto failed;
+				u64 available = MIN(size, d->compressed_bytes_left);
+				if (d->chunk_header_received < sizeof(tiff_serial_lz4_chunk_t)) {
+					count = take_bytes((u8*)&d->chunk, sizeof(tiff_serial_lz4_chunk_t), &d->chunk_header_received, data, available);
+					if (d->chunk_header_received == sizeof(tiff_serial_lz4_chunk_t) &&
+					    (d->chunk.compressed_size > LZ4_COMPRESSBOUND(TIFF_SERIAL_LZ4_CHUNK_SIZE) ||
+					     d->chunk.decompressed_size > TIFF_SERIAL_LZ4_CHUNK_SIZE)) {
+						d->failed = true;
+					}
+				} else {
+					count = take_bytes(d->compressed_data, d->chunk.compressed_size, &d->chunk_received, data, available);
+				}
+				d->compressed_bytes_left -= count;
+				if (!d->failed && d->chunk_header_received == sizeof(tiff_serial_lz4_chunk_t) &&
+				    d->chunk_received == d->chunk.compressed_size) {
+					// Each chunk is decoded into the other half of the buffer, the previous chunk needs to stay put.
+					u8* dest = d->decompressed_data + d->decompressed_index * TIFF_SERIAL_LZ4_CHUNK_SIZE;
+					i32 decompressed_size = LZ4_decompress_safe_continue((LZ4_streamDecode_t*)d->lz4_stream_decode,
+					                                                     (char*)d->compressed_data, (char*)dest,
+					                                                     (i32)d->chunk.compressed_size,
+					                                                     (i32)d->chunk.decompressed_size);
+					if (decompressed_size != (i32)d->chunk.decompressed_size) {
+						printf("LZ4_decompress_safe_continue() failed (return value %d)\n", decompressed_size);
+						d->failed = true;
+					} else {
+						d->decompressed_index ^= 1;
+						d->failed = !tiff_deserializer_parse(d, dest, decompressed_size);
+					}
+					d->chunk_header_received = 0;
+					d->chunk_received = 0;
 				}
-				referenced_ifd->jpeg_tables = (u8*) malloc(block->length);
-				memcpy(referenced_ifd->jpeg_tables, block_content, block->length);
-				referenced_ifd->jpeg_tables[block->length] = 0;
-				referenced_ifd->jpeg_tables_length = block->length;
 			} break;
-			case SERIAL_BLOCK_TERMINATOR: {
-				// Reached the end
-				printf("tiff_deserialize(): found a terminator block\n");
-				reached_end = true;
-				break;
+			case TIFF_DESERIALIZER_LZ4_SINGLE_BLOCK: {
+				serial_block_t* block = (serial_block_t*) d->first_block;
+				count = take_bytes(d->compressed_data, block->length, &d->chunk_received, data, size);
+				if (d->chunk_received == block->length) {
+					i32 decompressed_size = (i32)block->index;
+					u8* decompressed = (u8*) malloc(decompressed_size);
+					i32 bytes_decompressed = LZ4_decompress_safe((char*)d->compressed_data, (char*)decompressed,
+					                                             (i32)block->length, decompressed_size);
+					if (bytes_decompressed != decompressed_size) {
+						printf("LZ4_decompress_safe() failed (return value %d)\n", bytes_decompressed);
+						d->failed = true;
+					} else {
+						d->failed = !tiff_deserializer_parse(d, decompressed, decompressed_size);
+					}
+					free(decompressed);
+					if (!d->is_complete) d->failed = true;
+				}
 			} break;
 		}
+		data += count;
+		size -= count;
 	}
-	if (reached_end) {
-		success = true;
-		printf("tiff_deserialize(): bytes_left = %lld, content length = %lld, buffer size = %llu\n", bytes_left, content_length, buffer_size);
-	}
-
-	if (decompressed_buffer != NULL) free(decompressed_buffer);
-
-
-	// make some remaining assumptions
-	tiff->main_image = 	tiff->ifds + tiff->main_image_index;
-	tiff->macro_image = tiff->ifds + tiff->macro_image_index; // TODO: might not exist??
-	tiff->level_images = tiff->ifds + tiff->level_image_index; // TODO: might not exist??
-
-	// todo: flag empty tiles so they don't need to be loaded
+	return !d->failed;
+}
 
+// Returns true if the whole header came in. Otherwise, the tiff is left empty.
+bool32 tiff_deserializer_end(tiff_deserializer_t* d) {
+	tiff_t* tiff = d->tiff;
+	if (d->compressed_data) free(d->compressed_data);
+	if (d->decompressed_data) free(d->decompressed_data);
+	if (d->lz4_stream_decode) LZ4_freeStreamDecode((LZ4_streamDecode_t*)d->lz4_stream_decode);
+	if (d->block_temp) free(d->block_temp);
+	bool32 success = d->is_complete && !d->failed;
+	if (success) {
+		printf("tiff_deserialize(): parsed %llu bytes\n", d->bytes_parsed);
+		// make some remaining assumptions
+		tiff->main_image = tiff->ifds + tiff->main_image_index;
+		tiff->macro_image = tiff->ifds + tiff->macro_image_index; // TODO: might not exist??
+		tiff->level_images = tiff->ifds + d->serial_header.level_image_index; // TODO: might not exist??
+		tiff->level_image_index = d->serial_header.level_image_index;
+		// todo: flag empty tiles so they don't need to be loaded
+	} else if (tiff->ifds) {
+		tiff->is_remote = true; // so that tiff_destroy() knows how the IFDs were allocated
+		tiff_destroy(tiff);
+	}
+	*d = (tiff_deserializer_t){};
 	return success;
+}
 
-
-#undef POP_DATA
-#undef POP_BLOCK
-
+bool32 tiff_deserialize(tiff_t* tiff, u8* buffer, u64 buffer_size) {
+	i64 content_offset = find_end_of_http_headers(buffer, buffer_size);
+	tiff_deserializer_t deserializer;
+	tiff_deserializer_begin(&deserializer, tiff);
+	tiff_deserializer_feed(&deserializer, buffer + content_offset, buffer_size - content_offset);
+	return tiff_deserializer_end(&deserializer);
 }
 
 void tiff_destroy(tiff_t* tiff) {
@@ -954,6 +1739,10 @@ void tiff_destroy(tiff_t* tiff) {
 		fclose(tiff->fp);
 		tiff->fp = NULL;
 	}
+	tiff_unmap_file(tiff);
+	if (tiff->range_reader) {
+		tiff->range_reader->destroy(tiff->range_reader);
+	}
 #if !IS_SERVER
 	if (tiff->win32_file_handle) {
 		CloseHandle(tiff->win32_file_handle);
@@ -962,15 +1751,22 @@ void tiff_destroy(tiff_t* tiff) {
 
 	for (i32 i = 0; i < tiff->ifd_count; ++i) {
 		tiff_ifd_t* ifd = tiff->ifds + i;
-		if (ifd->tile_offsets) free(ifd->tile_offsets);
-		if (ifd->tile_byte_counts) free(ifd->tile_byte_counts);
+		if (ifd->tile_offsets) {
+			free(ifd->tile_offsets);
+			memory_stats_add(MEMORY_DOMAIN_TIFF_METADATA, -(i64)(ifd->tile_count * sizeof(u64)));
+		}
+		if (ifd->tile_byte_counts) {
+			free(ifd->tile_byte_counts);
+			memory_stats_add(MEMORY_DOMAIN_TIFF_METADATA, -(i64)(ifd->tile_count * sizeof(u64)));
+		}
 		if (ifd->image_description) free(ifd->image_description);
 		if (ifd->jpeg_tables) free(ifd->jpeg_tables);
 		if (ifd->reference_black_white) free(ifd->reference_black_white);
+		if (ifd->tile_data) free(ifd->tile_data);
 	}
 	// TODO: fix this, choose either stretchy_buffer or regular malloc, not both...
-	if (tiff->is_remote) {
-		free(tiff->ifds);
+	if (tiff->is_remote && !tiff->range_reader) {
+		free(tiff->ifds); // see tiff_deserialize()
 	} else {
 		sb_free(tiff->ifds);
 	}
@@ -36,6 +36,10 @@ extern "C" {
 #define TIFF_LITTLE_ENDIAN 0x4949
 #define TIFF_BIG_ENDIAN 0x4D4D
 
+#define TIFF_MMAP_MAX_FILESIZE (1ULL << 40) // larger files are read without memory-mapping
+#define TIFF_DIRECT_IO_ALIGNMENT 4096 // offset, size and buffer alignment for unbuffered reads (a multiple of any sector size)
+#define TIFF_SERIAL_TILE_DATA_MAX_SIZE KILOBYTES(512) // the coarsest level is sent along with the header, if this small
+
 // Documentation for TIFF tags: https://www.awaresystems.be/imaging/tiff/tifftags/search.html
 
 enum tiff_tag_code_enum {
@@ -51,7 +55,10 @@ enum tiff_tag_code_enum {
 	TIFF_TAG_SAMPLES_PER_PIXEL = 277,
 	TIFF_TAG_ROWS_PER_STRIP = 278,
 	TIFF_TAG_STRIP_BYTE_COUNTS = 279,
+	TIFF_TAG_X_RESOLUTION = 282,
+	TIFF_TAG_Y_RESOLUTION = 283,
 	TIFF_TAG_PLANAR_CONFIGURATION = 284,
+	TIFF_TAG_RESOLUTION_UNIT = 296,
 	TIFF_TAG_SOFTWARE = 305,
 	TIFF_TAG_TILE_WIDTH = 322,
 	TIFF_TAG_TILE_LENGTH = 323,
@@ -81,6 +88,12 @@ enum tiff_data_type_enum {
 	TIFF_IFD8 = 18,
 };
 
+enum tiff_resolution_unit_enum {
+	TIFF_RESOLUTION_UNIT_NONE = 1,
+	TIFF_RESOLUTION_UNIT_INCH = 2, // the default
+	TIFF_RESOLUTION_UNIT_CENTIMETER = 3,
+};
+
 enum tiff_subfiletype_enum {
 	TIFF_FILETYPE_REDUCEDIMAGE = 1,
 	TIFF_FILETYPE_PAGE = 2,
@@ -157,6 +170,8 @@ enum tiff_compression_enum {
 	TIFF_COMPRESSION_OJPEG = 6, // old-style JPEG -> ignore
 	TIFF_COMPRESSION_JPEG = 7,
 	TIFF_COMPRESSION_ADOBE_DEFLATE = 8,
+	TIFF_COMPRESSION_APERIO_JP2000_YCBCR = 33003, // raw JPEG 2000 codestream, YCbCr components
+	TIFF_COMPRESSION_APERIO_JP2000_RGB = 33005, // raw JPEG 2000 codestream, RGB components
 	TIFF_COMPRESSION_JP2000 = 34712,
 };
 
@@ -176,6 +191,17 @@ enum tiff_photometric_interpretation_enum {
 	TIFF_PHOTOMETRIC_LOGLUV = 32845,
 };
 
+// The tile kernels (color conversion while decoding, see jpeg_simd.c) come in variants for the common kinds of tiles,
+// with the tile size known at compile time, so that the loops have fixed trip counts. Which variant fits the tiles of
+// an IFD is decided once, by tiff_select_tile_path(); everything else takes the generic path.
+typedef enum tiff_tile_path_enum {
+	TIFF_TILE_PATH_GENERIC = 0,
+	TIFF_TILE_PATH_JPEG_YCBCR420_256, // JPEG, YCbCr with 2x2 chroma subsampling, 256 x 256 tiles
+	TIFF_TILE_PATH_JPEG_YCBCR420_512,
+	TIFF_TILE_PATH_JPEG_RGB_256, // JPEG, RGB (e.g. Aperio SVS; the streams may still be YCbCr, see decode_tile_pixels())
+	TIFF_TILE_PATH_JPEG_RGB_512,
+} tiff_tile_path_enum;
+
 enum subimage_type_enum {
 	TIFF_UNKNOWN_SUBIMAGE = 0,
 	TIFF_LEVEL_SUBIMAGE = 1,
@@ -193,14 +219,21 @@ typedef struct tiff_ifd_t {
 	u32 tile_width;
 	u32 tile_height;
 	u64 tile_count;
-	u64* tile_offsets;
-	u64* tile_byte_counts;
+	u64* tile_offsets; // only valid after tiff_load_tile_tables()
+	u64* tile_byte_counts; // only valid after tiff_load_tile_tables()
+	tiff_tag_t tile_offsets_tag; // where to find the tables in the file
+	tiff_tag_t tile_byte_counts_tag;
+	volatile i32 tile_tables_lock;
+	volatile bool32 are_tile_tables_loaded;
 	char* image_description;
 	u64 image_description_length;
 	u8* jpeg_tables;
 	u64 jpeg_tables_length;
 	u16 compression; // 7 = JPEG
 	u16 color_space;
+	u16 resolution_unit;
+	float x_resolution; // pixels per resolution unit (0 if not specified)
+	float y_resolution;
 	u32 tiff_subfiletype;
 	u32 subimage_type;
 	float level_magnification;
@@ -214,22 +247,50 @@ typedef struct tiff_ifd_t {
 	u16 chroma_subsampling_vertical;
 	u64 reference_black_white_rational_count;
 	tiff_rational_t* reference_black_white;
+	u8* tile_data; // remote slides: the compressed tiles of the coarsest level come with the header, stored back to back
+	u64 tile_data_size;
+	u32 tile_path; // tiff_tile_path_enum (not serialized: it follows from the other fields)
 } tiff_ifd_t;
 
 
+#define NETWORK_LOCATION_MAX_MIRRORS 3
+
+typedef struct network_mirror_t {
+	i32 portno;
+	char hostname[256];
+} network_mirror_t;
+
 typedef struct network_location_t {
 	i32 portno;
-	const char* hostname;
-	const char* filename;
+	char hostname[256]; // copied, because the slide may stay loaded after the caller's strings are gone
+	char filename[512];
+	u32 slide_handle; // 0 if the server doesn't support binary tile requests (see tile_request_t)
+	bool32 uses_range_requests; // a regular web server: the file is read with HTTP Range requests
+	// Other servers with the same slides. Tiles may be downloaded from any of them (see remote_network_thread_loop());
+	// they don't know the slide handle, so they get tile requests by filename.
+	network_mirror_t mirrors[NETWORK_LOCATION_MAX_MIRRORS];
+	i32 mirror_count;
 } network_location_t;
 
+// Reads parts of a file that is not on the local disk, e.g. with HTTP Range requests (see open_tiff_with_range_reader()).
+// The read function returns 1 on success (like fread), and may be called from several threads at once.
+typedef struct tiff_range_reader_t {
+	u64 (*read)(struct tiff_range_reader_t* reader, void* dest, u64 offset, u64 num_bytes);
+	void (*destroy)(struct tiff_range_reader_t* reader);
+} tiff_range_reader_t;
+
 struct tiff_t {
 	bool32 is_remote;
 	network_location_t location;
-	FILE* fp;
+	FILE* fp; // stays open, for loading the tile tables on demand
+	volatile i32 fp_lock;
+	tiff_range_reader_t* range_reader; // used instead of fp, if set
 #if !IS_SERVER
 	HANDLE win32_file_handle;
 #endif
+	u8* mapped_data; // set if the file is memory-mapped (see tiff_enable_mmap)
+	u64 mapped_size;
+	bool32 is_direct_io; // reads bypass the OS page cache and need TIFF_DIRECT_IO_ALIGNMENT (see tiff_enable_direct_io)
 	i64 filesize;
 	u32 bytesize_of_offsets;
 	u64 ifd_count;
@@ -293,13 +354,16 @@ typedef struct {
 } tiff_serial_ifd_t;
 
 enum serial_block_type_enum {
-	SERIAL_BLOCK_LZ4_COMPRESSED_DATA = 4444,
+	SERIAL_BLOCK_LZ4_COMPRESSED_DATA = 4444, // (older servers) the whole stream as a single LZ4 block
+	SERIAL_BLOCK_LZ4_COMPRESSED_CHUNKS = 4445, // the stream as LZ4 chunks (see tiff_serial_lz4_chunk_t)
 	SERIAL_BLOCK_TIFF_HEADER_AND_META = 9001, // using ridiculous numbers to make invalid file structure easier to detect
 	SERIAL_BLOCK_TIFF_IFDS = 9002,
 	SERIAL_BLOCK_TIFF_IMAGE_DESCRIPTION = 9003,
 	SERIAL_BLOCK_TIFF_TILE_OFFSETS = 9004,
 	SERIAL_BLOCK_TIFF_TILE_BYTE_COUNTS = 9005,
 	SERIAL_BLOCK_TIFF_JPEG_TABLES = 9006,
+	SERIAL_BLOCK_TIFF_TILE_DATA = 9007, // the compressed tiles of an IFD, in order (sizes as in the tile byte counts)
+	SERIAL_BLOCK_TIFF_TILE_TABLES_PACKED = 9008, // tile offsets and byte counts together, delta/varint encoded
 	SERIAL_BLOCK_TERMINATOR = 800,
 };
 
@@ -309,8 +373,67 @@ typedef struct {
 	u64 length;
 } serial_block_t;
 
+// The compressed stream is cut into chunks, so that the client can decompress it while it is still downloading.
+// The chunks are compressed as a single LZ4 stream (a chunk may refer back into the previous one), so the chunk size
+// needs to be the same as the LZ4 window for the decoder to be able to use a double buffer.
+#define TIFF_SERIAL_LZ4_CHUNK_SIZE KILOBYTES(64)
+
+typedef struct {
+	u32 compressed_size;
+	u32 decompressed_size;
+} tiff_serial_lz4_chunk_t;
+
+// Binary tile request (POST /tiles): the client names the tiles it wants, the server looks up where they are stored.
+// The response content is u32 tile_sizes[tile_count], followed by the tile data in the requested order.
+// A client that doesn't know the slide handle on the server sends slide_handle 0 to POST /tiles/<file> instead.
+#define TILE_REQUEST_MAGIC 0x454C4954 // "TILE"
+#define TILE_REQUEST_MAX_TILES 256
+
+typedef struct {
+	u32 magic;
+	u32 slide_handle; // handed out in the Slide-handle header field of the response to GET /slide/<file>/header
+	u32 level; // index into tiff->level_images
+	u32 tile_count;
+	// followed by: u32 tile_indices[tile_count]
+} tile_request_t;
+
+// Slide sets (GET /slide_set/<file>) are sent with an ETag, so that the client can ask again with If-None-Match and
+// get 304 Not Modified back if its copy is still current. Clients that send "Accept-encoding: x-lz4-block" get the
+// content compressed as a single LZ4 block; the Uncompressed-length field has the size of the JSON.
+#define SLIDE_SET_LZ4_ENCODING "x-lz4-block"
+
 #pragma pack(pop)
 
+// Turns the serialized header back into a tiff_t, while it is coming in (see tiff_deserializer_feed()). The LZ4 chunks
+// are decompressed one at a time, and the blocks are copied straight into the IFDs.
+typedef struct {
+	tiff_t* tiff;
+	u32 mode;
+	bool32 failed;
+	bool32 is_complete;
+	u8 first_block[sizeof(serial_block_t)];
+	u64 first_block_received;
+	// compressed layer
+	u64 compressed_bytes_left;
+	tiff_serial_lz4_chunk_t chunk;
+	u64 chunk_header_received;
+	u64 chunk_received;
+	u8* compressed_data; // one chunk (or the whole block, for the older single-block format)
+	u8* decompressed_data; // double buffer of decompressed chunks
+	i32 decompressed_index;
+	void* lz4_stream_decode;
+	// blocks
+	serial_block_t block;
+	u64 block_header_received;
+	u8* block_dest;
+	u64 block_content_size;
+	u64 block_content_received;
+	u8* block_temp; // blocks that are unpacked once complete
+	tiff_serial_header_t serial_header;
+	bool32 has_serial_header;
+	u64 bytes_parsed;
+} tiff_deserializer_t;
+
 typedef struct {
 	u8* raw_memory;
 	u8* data;
@@ -418,10 +541,36 @@ static inline u64 maybe_swap_64(u64 x, bool32 is_big_endian) {
 }
 
 
+// The tile size that the kernels of the tile path are specialized for (0 for the generic path).
+static inline u32 tiff_get_tile_path_dim(u32 tile_path) {
+	switch (tile_path) {
+		case TIFF_TILE_PATH_JPEG_YCBCR420_256: case TIFF_TILE_PATH_JPEG_RGB_256: return 256;
+		case TIFF_TILE_PATH_JPEG_YCBCR420_512: case TIFF_TILE_PATH_JPEG_RGB_512: return 512;
+		default: return 0;
+	}
+}
+
+extern bool32 tiff_enable_mmap;
+extern bool32 tiff_enable_direct_io;
+
 u64 file_read_at_offset(void* dest, FILE* fp, u64 offset, u64 num_bytes);
+u64 tiff_read_at_offset(tiff_t* tiff, void* dest, u64 offset, u64 num_bytes);
+void tiff_swap_integers_to_u64(u64* dest, void* source, u64 count, u32 bytesize);
 bool32 open_tiff_file(tiff_t* tiff, const char* filename);
+bool32 open_tiff_file_with_header(tiff_t* tiff, const char* filename, u8* serialized, u64 serialized_size);
+bool32 open_tiff_with_range_reader(tiff_t* tiff, i64 filesize, tiff_range_reader_t* range_reader);
+bool32 tiff_load_tile_tables(tiff_t* tiff, tiff_ifd_t* ifd);
+u8* tiff_get_mapped_range(tiff_t* tiff, u64 offset, u64 size);
+tiff_ifd_t* tiff_get_coarsest_level(tiff_t* tiff);
+u8* tiff_read_all_tiles(tiff_t* tiff, tiff_ifd_t* ifd, u64 max_size, u64* size);
+void tiff_clear_pixels_outside_image(u8* pixels, u32 pitch, u32 tile_width, u32 tile_height, u32 valid_width,
+                                     u32 valid_height);
+void tiff_select_tile_path(tiff_ifd_t* ifd);
 push_buffer_t* tiff_serialize(tiff_t* tiff, push_buffer_t* buffer);
 i64 find_end_of_http_headers(u8* str, u64 len);
+void tiff_deserializer_begin(tiff_deserializer_t* deserializer, tiff_t* tiff);
+bool32 tiff_deserializer_feed(tiff_deserializer_t* deserializer, u8* data, u64 size);
+bool32 tiff_deserializer_end(tiff_deserializer_t* deserializer);
 bool32 tiff_deserialize(tiff_t* tiff, u8* buffer, u64 buffer_size);
 void tiff_destroy(tiff_t* tiff);
 
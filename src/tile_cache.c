@@ -0,0 +1,229 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "common.h"
+#include "intrinsics.h"
+
+#define TILE_CACHE_IMPL
+#include "tile_cache.h"
+#include "memory_stats.h"
+
+// Key layout: 16 bits image id | 8 bits level | 40 bits tile index
+u64 tile_cache_key(u32 image_id, i32 level, i32 tile_index) {
+	u64 key = ((u64)(image_id & 0xFFFF) << 48) | ((u64)(level & 0xFF) << 40) | ((u64)tile_index & 0xFFFFFFFFFF);
+	return key;
+}
+
+static inline i32 tile_cache_bucket(tile_cache_t* cache, u64 key) {
+	// Fibonacci hashing
+	u64 hash = key * 11400714819323198485llu;
+	i32 result = (i32)(hash >> 32) & (cache->bucket_count - 1);
+	return result;
+}
+
+void tile_cache_init(tile_cache_t* cache, i64 budget, i32 entry_capacity) {
+	memset(cache, 0, sizeof(tile_cache_t));
+	cache->budget = budget;
+	cache->entry_capacity = entry_capacity;
+	cache->entries = (tile_cache_entry_t*) calloc(1, entry_capacity * sizeof(tile_cache_entry_t));
+	cache->bucket_count = (i32)next_pow2((u64)entry_capacity);
+	cache->buckets = (i32*) malloc(cache->bucket_count * sizeof(i32));
+	for (i32 i = 0; i < cache->bucket_count; ++i) {
+		cache->buckets[i] = -1;
+	}
+	// chain all entries together in the free list (reusing the hash_next field)
+	for (i32 i = 0; i < entry_capacity; ++i) {
+		cache->entries[i].hash_next = (i + 1 < entry_capacity) ? i + 1 : -1;
+	}
+	cache->free_list = 0;
+	cache->lru_head = -1;
+	cache->lru_tail = -1;
+	// The tables count towards the budget as well.
+	cache->memory_used = entry_capacity * sizeof(tile_cache_entry_t) + cache->bucket_count * sizeof(i32);
+	memory_stats_add(MEMORY_DOMAIN_TILE_CACHE, cache->memory_used);
+	cache->initialized = true;
+}
+
+void tile_cache_destroy(tile_cache_t* cache) {
+	if (cache->entries) {
+		for (i32 i = 0; i < cache->entry_capacity; ++i) {
+			if (cache->entries[i].data) {
+				free(cache->entries[i].data);
+			}
+		}
+		free(cache->entries);
+	}
+	if (cache->buckets) {
+		free(cache->buckets);
+	}
+	memory_stats_add(MEMORY_DOMAIN_TILE_CACHE, -cache->memory_used);
+	memset(cache, 0, sizeof(tile_cache_t));
+}
+
+static void tile_cache_lru_unlink(tile_cache_t* cache, i32 index) {
+	tile_cache_entry_t* entry = cache->entries + index;
+	if (entry->lru_prev >= 0) {
+		cache->entries[entry->lru_prev].lru_next = entry->lru_next;
+	} else {
+		cache->lru_head = entry->lru_next;
+	}
+	if (entry->lru_next >= 0) {
+		cache->entries[entry->lru_next].lru_prev = entry->lru_prev;
+	} else {
+		cache->lru_tail = entry->lru_prev;
+	}
+	entry->lru_prev = -1;
+	entry->lru_next = -1;
+}
+
+static void tile_cache_lru_push_front(tile_cache_t* cache, i32 index) {
+	tile_cache_entry_t* entry = cache->entries + index;
+	entry->lru_prev = -1;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head >= 0) {
+		cache->entries[cache->lru_head].lru_prev = index;
+	}
+	cache->lru_head = index;
+	if (cache->lru_tail < 0) {
+		cache->lru_tail = index;
+	}
+}
+
+static i32 tile_cache_find(tile_cache_t* cache, u64 key) {
+	i32 index = cache->buckets[tile_cache_bucket(cache, key)];
+	while (index >= 0) {
+		tile_cache_entry_t* entry = cache->entries + index;
+		if (entry->key == key) {
+			return index;
+		}
+		index = entry->hash_next;
+	}
+	return -1;
+}
+
+// Note: the caller must hold the lock.
+static void tile_cache_remove_entry(tile_cache_t* cache, i32 index) {
+	tile_cache_entry_t* entry = cache->entries + index;
+
+	// unlink from the hash bucket
+	i32* link = cache->buckets + tile_cache_bucket(cache, entry->key);
+	while (*link != index) {
+		ASSERT(*link >= 0);
+		link = &cache->entries[*link].hash_next;
+	}
+	*link = entry->hash_next;
+
+	tile_cache_lru_unlink(cache, index);
+	cache->memory_used -= entry->size;
+	memory_stats_add(MEMORY_DOMAIN_TILE_CACHE, -(i64)entry->size);
+	--cache->entry_count;
+	free(entry->data);
+	memset(entry, 0, sizeof(tile_cache_entry_t));
+
+	entry->hash_next = cache->free_list;
+	cache->free_list = index;
+}
+
+static void tile_cache_evict_to_budget(tile_cache_t* cache, i64 extra_size) {
+	while (cache->lru_tail >= 0 && (cache->memory_used + extra_size > cache->budget || cache->free_list < 0)) {
+		tile_cache_remove_entry(cache, cache->lru_tail);
+		++cache->eviction_count;
+	}
+}
+
+// Copies the cached data into dest (the cache entry might get evicted by another thread right after we unlock).
+bool32 tile_cache_lookup(tile_cache_t* cache, u64 key, u8* dest, u32 dest_capacity, u32* size) {
+	if (!cache->initialized) return false;
+	bool32 result = false;
+	spin_lock(&cache->lock);
+	i32 index = tile_cache_find(cache, key);
+	if (index >= 0) {
+		tile_cache_entry_t* entry = cache->entries + index;
+		if (entry->size <= dest_capacity) {
+			memcpy(dest, entry->data, entry->size);
+			*size = entry->size;
+			tile_cache_lru_unlink(cache, index);
+			tile_cache_lru_push_front(cache, index);
+			result = true;
+		}
+	}
+	if (result) {
+		++cache->hit_count;
+	} else {
+		++cache->miss_count;
+	}
+	spin_unlock(&cache->lock);
+	return result;
+}
+
+void tile_cache_insert(tile_cache_t* cache, u64 key, u8* data, u32 size) {
+	if (!cache->initialized || size == 0 || size > cache->budget) return;
+
+	// Copy the data while not holding the lock
+	u8* data_copy = (u8*) malloc(size);
+	memcpy(data_copy, data, size);
+
+	spin_lock(&cache->lock);
+	if (tile_cache_find(cache, key) >= 0) {
+		// another thread was faster
+		spin_unlock(&cache->lock);
+		free(data_copy);
+		return;
+	}
+	tile_cache_evict_to_budget(cache, size);
+	i32 index = cache->free_list;
+	ASSERT(index >= 0);
+	tile_cache_entry_t* entry = cache->entries + index;
+	cache->free_list = entry->hash_next;
+
+	entry->key = key;
+	entry->data = data_copy;
+	entry->size = size;
+	i32 bucket = tile_cache_bucket(cache, key);
+	entry->hash_next = cache->buckets[bucket];
+	cache->buckets[bucket] = index;
+	tile_cache_lru_push_front(cache, index);
+	cache->memory_used += size;
+	memory_stats_add(MEMORY_DOMAIN_TILE_CACHE, size);
+	++cache->entry_count;
+	spin_unlock(&cache->lock);
+}
+
+void tile_cache_remove_image(tile_cache_t* cache, u32 image_id) {
+	if (!cache->initialized) return;
+	spin_lock(&cache->lock);
+	i32 index = cache->lru_head;
+	while (index >= 0) {
+		tile_cache_entry_t* entry = cache->entries + index;
+		i32 next = entry->lru_next;
+		if ((entry->key >> 48) == (image_id & 0xFFFF)) {
+			tile_cache_remove_entry(cache, index);
+		}
+		index = next;
+	}
+	spin_unlock(&cache->lock);
+}
+
+void tile_cache_set_budget(tile_cache_t* cache, i64 budget) {
+	if (!cache->initialized) return;
+	spin_lock(&cache->lock);
+	cache->budget = budget;
+	tile_cache_evict_to_budget(cache, 0);
+	spin_unlock(&cache->lock);
+}
@@ -0,0 +1,83 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+// Cache in system memory for compressed tile data (e.g. JPEG streams), so that tiles that are displayed again
+// (after having been evicted from the GPU, or after panning back) only need to be decoded again, instead of
+// having to be read from disk or downloaded from the server.
+
+typedef struct tile_cache_entry_t {
+	u64 key;
+	u8* data;
+	u32 size;
+	i32 hash_next; // next entry in the same hash bucket (-1 = none)
+	i32 lru_prev; // more recently used entry (-1 = none)
+	i32 lru_next; // less recently used entry (-1 = none)
+} tile_cache_entry_t;
+
+typedef struct tile_cache_t {
+	volatile i32 lock;
+	i64 budget; // in bytes
+	i64 memory_used;
+	i32 entry_capacity;
+	i32 entry_count;
+	tile_cache_entry_t* entries;
+	i32 bucket_count; // power of 2
+	i32* buckets;
+	i32 free_list;
+	i32 lru_head; // most recently used
+	i32 lru_tail; // least recently used
+	i64 hit_count;
+	i64 miss_count;
+	i64 eviction_count;
+	bool32 initialized;
+} tile_cache_t;
+
+u64 tile_cache_key(u32 image_id, i32 level, i32 tile_index);
+void tile_cache_init(tile_cache_t* cache, i64 budget, i32 entry_capacity);
+void tile_cache_destroy(tile_cache_t* cache);
+bool32 tile_cache_lookup(tile_cache_t* cache, u64 key, u8* dest, u32 dest_capacity, u32* size);
+void tile_cache_insert(tile_cache_t* cache, u64 key, u8* data, u32 size);
+void tile_cache_remove_image(tile_cache_t* cache, u32 image_id);
+void tile_cache_set_budget(tile_cache_t* cache, i64 budget);
+
+// globals
+#if defined(TILE_CACHE_IMPL)
+#define INIT(...) __VA_ARGS__
+#define extern
+#else
+#define INIT(...)
+#undef extern
+#endif
+
+extern tile_cache_t global_tile_cache;
+
+#undef INIT
+#undef extern
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,158 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+// Experimental: tiles over UDP, for lossy links (such as a busy Wi-Fi network). Over TCP, a lost packet holds up
+// everything behind it on the connection, including tiles that have already arrived whole. Here, each tile is a
+// message of its own, sent as datagrams of at most TILE_DATAGRAM_PAYLOAD_SIZE bytes, and a lost datagram only holds up
+// the tile it belongs to.
+// The client first gets a session over its TLS connection (GET /datagram): a session id, a key, and the UDP port to
+// send to. After that, every datagram is sealed with AES-128-GCM under that key. The nonce is the direction followed
+// by the sequence number of the datagram, which the sender never reuses. A datagram starts with a
+// tile_datagram_header_t (in the clear, but authenticated), followed by the sealed message and the tag:
+//   client -> server: a tile_datagram_request_t, for one tile (and, if asked again, the fragments still missing)
+//   server -> client: a tile_datagram_fragment_t, followed by a part of the tile
+// The client asks again for the missing fragments of a tile once they are overdue (judged by the round-trip time); if
+// a tile still doesn't come in, the rest of the download goes over TCP after all (see tlsclient.c).
+
+#define TILE_DATAGRAM_MAGIC 0x47445453 // "STDG"
+#define TILE_DATAGRAM_SESSION_MAGIC 0x53445453 // "STDS"
+#define TILE_DATAGRAM_KEY_SIZE 16
+#define TILE_DATAGRAM_TAG_SIZE 16
+#define TILE_DATAGRAM_PAYLOAD_SIZE 1200 // with the headers, stays below the usual path MTU (also with IPv6)
+#define TILE_DATAGRAM_MAX_FRAGMENTS 4096 // larger tiles go over TCP
+#define TILE_DATAGRAM_MAX_RANGES 32 // of missing fragments, in a request
+#define TILE_DATAGRAM_FROM_CLIENT 0 // directions (for the nonce)
+#define TILE_DATAGRAM_FROM_SERVER 1
+
+#pragma pack(push, 1)
+// The content of the response to GET /datagram.
+typedef struct tile_datagram_session_t {
+	u32 magic;
+	u32 session_id;
+	u32 port;
+	u32 reserved;
+	u8 key[TILE_DATAGRAM_KEY_SIZE];
+} tile_datagram_session_t;
+
+typedef struct tile_datagram_header_t {
+	u32 magic;
+	u32 session_id;
+	u64 sequence;
+} tile_datagram_header_t;
+
+typedef struct tile_datagram_range_t {
+	u16 first_fragment;
+	u16 fragment_count;
+} tile_datagram_range_t;
+
+// Only the first range_count ranges are sent. Without any ranges, the server sends all fragments.
+typedef struct tile_datagram_request_t {
+	u32 request_id;
+	u32 slide_handle;
+	u32 level;
+	u32 tile_index;
+	u32 range_count;
+	tile_datagram_range_t ranges[TILE_DATAGRAM_MAX_RANGES];
+} tile_datagram_request_t;
+
+typedef enum tile_datagram_status_enum {
+	TILE_DATAGRAM_STATUS_OK = 0,
+	TILE_DATAGRAM_STATUS_NOT_FOUND = 1, // unknown slide handle, level or tile
+	TILE_DATAGRAM_STATUS_TOO_LARGE = 2, // more than TILE_DATAGRAM_MAX_FRAGMENTS
+	TILE_DATAGRAM_STATUS_READ_ERROR = 3,
+} tile_datagram_status_enum;
+
+// Followed by the part of the tile (empty tiles are sent as a single fragment without data). With an error status,
+// there is a single fragment without data.
+typedef struct tile_datagram_fragment_t {
+	u32 request_id;
+	u32 tile_size;
+	u16 fragment_index;
+	u16 fragment_count;
+	u32 status;
+} tile_datagram_fragment_t;
+#pragma pack(pop)
+
+#define TILE_DATAGRAM_MAX_SIZE (sizeof(tile_datagram_header_t) + sizeof(tile_datagram_fragment_t) + \
+                                TILE_DATAGRAM_PAYLOAD_SIZE + TILE_DATAGRAM_TAG_SIZE)
+
+static inline u32 get_tile_datagram_fragment_count(u32 tile_size) {
+	return MAX(1, (tile_size + TILE_DATAGRAM_PAYLOAD_SIZE - 1) / TILE_DATAGRAM_PAYLOAD_SIZE);
+}
+
+#ifdef TLS_AMALGAMATION
+// Sealing and opening (for server.c and tlsclient.c, which include tlse.c). The gcm_state is set up once per session
+// with gcm_init(), and must not be used by two threads at once.
+
+static inline void get_tile_datagram_nonce(u8* nonce, u32 direction, u64 sequence) {
+	memcpy(nonce, &direction, sizeof(u32));
+	memcpy(nonce + sizeof(u32), &sequence, sizeof(u64));
+}
+
+// The datagram holds the header, followed by the message; the message is encrypted in place, and the tag is added at
+// the end. Returns the size of the datagram, or 0 on failure.
+static i32 seal_tile_datagram(gcm_state* gcm, u32 direction, u8* datagram, i32 message_size) {
+	tile_datagram_header_t* header = (tile_datagram_header_t*) datagram;
+	u8* message = datagram + sizeof(tile_datagram_header_t);
+	u8 nonce[12];
+	get_tile_datagram_nonce(nonce, direction, header->sequence);
+	unsigned long tag_size = TILE_DATAGRAM_TAG_SIZE;
+	if (gcm_reset(gcm) != CRYPT_OK || gcm_add_iv(gcm, nonce, sizeof(nonce)) != CRYPT_OK ||
+	    gcm_add_aad(gcm, datagram, sizeof(tile_datagram_header_t)) != CRYPT_OK ||
+	    gcm_process(gcm, message, message_size, message, GCM_ENCRYPT) != CRYPT_OK ||
+	    gcm_done(gcm, message + message_size, &tag_size) != CRYPT_OK || tag_size != TILE_DATAGRAM_TAG_SIZE) {
+		return 0;
+	}
+	return (i32)sizeof(tile_datagram_header_t) + message_size + TILE_DATAGRAM_TAG_SIZE;
+}
+
+// Decrypts the message in place. Returns the size of the message, or -1 if the datagram is not authentic.
+static i32 open_tile_datagram(gcm_state* gcm, u32 direction, u8* datagram, i32 datagram_size) {
+	i32 message_size = datagram_size - (i32)sizeof(tile_datagram_header_t) - TILE_DATAGRAM_TAG_SIZE;
+	if (message_size < 0) return -1;
+	tile_datagram_header_t* header = (tile_datagram_header_t*) datagram;
+	u8* message = datagram + sizeof(tile_datagram_header_t);
+	u8 nonce[12];
+	get_tile_datagram_nonce(nonce, direction, header->sequence);
+	u8 tag[TILE_DATAGRAM_TAG_SIZE];
+	unsigned long tag_size = TILE_DATAGRAM_TAG_SIZE;
+	if (gcm_reset(gcm) != CRYPT_OK || gcm_add_iv(gcm, nonce, sizeof(nonce)) != CRYPT_OK ||
+	    gcm_add_aad(gcm, datagram, sizeof(tile_datagram_header_t)) != CRYPT_OK ||
+	    gcm_process(gcm, message, message_size, message, GCM_DECRYPT) != CRYPT_OK ||
+	    gcm_done(gcm, tag, &tag_size) != CRYPT_OK || tag_size != TILE_DATAGRAM_TAG_SIZE) {
+		return -1;
+	}
+	u8 difference = 0;
+	for (i32 i = 0; i < TILE_DATAGRAM_TAG_SIZE; ++i) {
+		difference |= tag[i] ^ message[message_size + i];
+	}
+	return (difference == 0) ? message_size : -1;
+}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,117 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include "platform.h"
+#include "intrinsics.h"
+
+#include <stdio.h>
+#include <math.h>
+
+#include "tile_metrics.h"
+
+tile_metrics_t global_tile_metrics;
+
+static const char* tile_stage_names[TILE_STAGE_COUNT] = {
+	"Queue wait", "I/O", "Decode", "Upload wait", "Upload", "Request to first draw",
+};
+
+static const char* tile_counter_names[TILE_COUNTER_COUNT] = {
+	"Requested", "Cancelled", "Dropped (work queue full)", "Empty", "Failed to decode", "Uniform (drawn flat)",
+};
+
+static i32 get_bucket_index(float microseconds) {
+	if (microseconds < 1.0f) return 0;
+	i32 exponent = 0;
+	float mantissa = frexpf(microseconds, &exponent); // in [0.5, 1)
+	i32 sub_bucket = (i32)((mantissa - 0.5f) * (2 * TILE_METRICS_BUCKETS_PER_OCTAVE));
+	i32 bucket_index = (exponent - 1) * TILE_METRICS_BUCKETS_PER_OCTAVE + sub_bucket;
+	return ATMOST(bucket_index, TILE_METRICS_BUCKET_COUNT - 1);
+}
+
+// The middle of the bucket, in seconds.
+static float get_bucket_value(i32 bucket_index) {
+	i32 exponent = bucket_index / TILE_METRICS_BUCKETS_PER_OCTAVE + 1;
+	float sub_bucket = (float)(bucket_index % TILE_METRICS_BUCKETS_PER_OCTAVE) + 0.5f;
+	float mantissa = 0.5f + sub_bucket / (2 * TILE_METRICS_BUCKETS_PER_OCTAVE);
+	return ldexpf(mantissa, exponent) * 1e-6f;
+}
+
+// Can be called from any thread.
+void tile_metrics_record(tile_stage_enum stage, i64 begin_clock, i64 end_clock) {
+	if (begin_clock == 0) return; // the stage was not timed
+	tile_latency_histogram_t* histogram = global_tile_metrics.stages + stage;
+	i32 bucket_index = get_bucket_index(get_seconds_elapsed(begin_clock, end_clock) * 1e6f);
+	interlocked_increment(&histogram->buckets[bucket_index]);
+	interlocked_increment(&histogram->count);
+}
+
+// Can be called from any thread.
+void tile_metrics_count(tile_counter_enum counter, i32 amount) {
+	for (i32 i = 0; i < amount; ++i) {
+		interlocked_increment(&global_tile_metrics.counters[counter]);
+	}
+}
+
+// Returns the latency in seconds below which the given fraction (e.g. 0.95f) of the recorded tiles fall, or 0 if
+// nothing was recorded yet. Accurate to within the bucket width (at most 25%).
+float tile_metrics_get_percentile(tile_stage_enum stage, float fraction) {
+	tile_latency_histogram_t* histogram = global_tile_metrics.stages + stage;
+	// The buckets may be incremented meanwhile, so don't rely on the total count to match the buckets exactly.
+	i32 counts[TILE_METRICS_BUCKET_COUNT];
+	i64 total = 0;
+	for (i32 i = 0; i < TILE_METRICS_BUCKET_COUNT; ++i) {
+		counts[i] = histogram->buckets[i];
+		total += counts[i];
+	}
+	if (total == 0) return 0.0f;
+	i64 rank = (i64)ceilf(fraction * (float)total);
+	i64 seen = 0;
+	for (i32 i = 0; i < TILE_METRICS_BUCKET_COUNT; ++i) {
+		seen += counts[i];
+		if (seen >= rank) return get_bucket_value(i);
+	}
+	return get_bucket_value(TILE_METRICS_BUCKET_COUNT - 1);
+}
+
+const char* tile_metrics_get_stage_name(tile_stage_enum stage) {
+	return tile_stage_names[stage];
+}
+
+const char* tile_metrics_get_counter_name(tile_counter_enum counter) {
+	return tile_counter_names[counter];
+}
+
+// Note: not synchronized with the threads that are recording; a few updates may get lost while resetting.
+void tile_metrics_reset() {
+	memset((void*)&global_tile_metrics, 0, sizeof(global_tile_metrics));
+}
+
+void tile_metrics_print() {
+	printf("Tile pipeline metrics:\n");
+	for (i32 stage = 0; stage < TILE_STAGE_COUNT; ++stage) {
+		printf("  %-22s %8d tiles, p50 %8.2f ms, p95 %8.2f ms, p99 %8.2f ms\n", tile_stage_names[stage],
+		       global_tile_metrics.stages[stage].count,
+		       tile_metrics_get_percentile((tile_stage_enum)stage, 0.50f) * 1000.0f,
+		       tile_metrics_get_percentile((tile_stage_enum)stage, 0.95f) * 1000.0f,
+		       tile_metrics_get_percentile((tile_stage_enum)stage, 0.99f) * 1000.0f);
+	}
+	for (i32 counter = 0; counter < TILE_COUNTER_COUNT; ++counter) {
+		printf("  %-26s %8d\n", tile_counter_names[counter], global_tile_metrics.counters[counter]);
+	}
+}
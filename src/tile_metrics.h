@@ -0,0 +1,77 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+// Where the time goes between requesting a tile and seeing it on screen, for tuning (see the tile metrics window in
+// gui.cpp; a summary is also printed on exit). The stages are recorded from whichever thread they happen on, into
+// histograms with logarithmic buckets that are updated with atomic increments only.
+// The metrics are cumulative since startup (or since the last reset).
+
+typedef enum tile_stage_enum {
+	TILE_STAGE_QUEUE_WAIT,  // from the request until a worker picks it up
+	TILE_STAGE_IO,          // from being picked up until the compressed data is in memory (local read or download)
+	TILE_STAGE_DECODE,      // decoding the compressed data
+	TILE_STAGE_UPLOAD_WAIT, // from being decoded until the main thread gets to uploading it
+	TILE_STAGE_UPLOAD,      // handing the pixels to OpenGL
+	TILE_STAGE_FIRST_DRAW,  // from the request until the tile is first drawn (the whole pipeline)
+	TILE_STAGE_COUNT
+} tile_stage_enum;
+
+typedef enum tile_counter_enum {
+	TILE_COUNTER_REQUESTED,
+	TILE_COUNTER_CANCELLED,      // went out of view before a worker picked it up
+	TILE_COUNTER_DROPPED,        // add_work_queue_entry() failed because the work queue was full
+	TILE_COUNTER_EMPTY,          // the tile has no data in the file, or an empty JPEG stream
+	TILE_COUNTER_DECODE_FAILED,
+	TILE_COUNTER_UNIFORM,        // a single color (e.g. empty glass): drawn flat, without a texture
+	TILE_COUNTER_COUNT
+} tile_counter_enum;
+
+#define TILE_METRICS_BUCKETS_PER_OCTAVE 4
+#define TILE_METRICS_BUCKET_COUNT 128 // up to 2^32 microseconds
+
+typedef struct tile_latency_histogram_t {
+	volatile i32 buckets[TILE_METRICS_BUCKET_COUNT]; // TILE_METRICS_BUCKETS_PER_OCTAVE for each power of 2 microseconds
+	volatile i32 count;
+} tile_latency_histogram_t;
+
+typedef struct tile_metrics_t {
+	tile_latency_histogram_t stages[TILE_STAGE_COUNT];
+	volatile i32 counters[TILE_COUNTER_COUNT];
+} tile_metrics_t;
+
+extern tile_metrics_t global_tile_metrics;
+
+void tile_metrics_record(tile_stage_enum stage, i64 begin_clock, i64 end_clock);
+void tile_metrics_count(tile_counter_enum counter, i32 amount);
+float tile_metrics_get_percentile(tile_stage_enum stage, float fraction);
+const char* tile_metrics_get_stage_name(tile_stage_enum stage);
+const char* tile_metrics_get_counter_name(tile_counter_enum counter);
+void tile_metrics_reset();
+void tile_metrics_print();
+
+#ifdef __cplusplus
+}
+#endif
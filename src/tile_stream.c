@@ -0,0 +1,263 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#include "win32_main.h"
+#include "platform.h"
+#include "intrinsics.h"
+
+#include <stdio.h>
+
+#include "stretchy_buffer.h"
+#include "viewer.h"
+#include "tile_stream.h"
+
+struct tile_stream_t {
+	image_t* image;
+	i32 level;
+	i32 tiff_level;
+	tile_range_t range;
+	tile_stream_tile_func_t* tile_func;
+	tile_stream_done_func_t* done_func;
+	void* userdata;
+	i32* tile_indices; // the nonempty tiles in the range, in the order in which they are stored in the file
+	i32 tile_count;
+	i32 batch_count;
+	volatile i32 next_batch;
+	volatile i32 batches_in_flight; // work queue entries (each takes on the next batch once done with one)
+	volatile i32 tiles_done;
+	volatile i32 is_cancelled;
+	volatile i32 is_done;
+	bool32 success;
+};
+
+static tile_stream_t** tile_streams; // sb, only accessed by the main thread
+
+typedef struct stored_tile_t {
+	u64 offset;
+	i32 tile_index;
+} stored_tile_t;
+
+static int stored_tile_cmp_func(const void* a, const void* b) {
+	u64 offset_a = ((stored_tile_t*)a)->offset;
+	u64 offset_b = ((stored_tile_t*)b)->offset;
+	return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+// Reads the tiles of the batch (local files: all at once, so that tiles stored back to back are read together),
+// decodes them one by one into the same buffer, and hands them to the callback.
+static void stream_tile_batch(i32 logical_thread_index, tile_stream_t* stream, i32 batch_index) {
+	image_t* image = stream->image;
+	tiff_t* tiff = &image->tiff.tiff;
+	tiff_ifd_t* ifd = tiff->level_images + stream->tiff_level;
+	i32* tile_indices = stream->tile_indices + batch_index * TILE_STREAM_BATCH_TILES;
+	i32 count = ATMOST(TILE_STREAM_BATCH_TILES, stream->tile_count - batch_index * TILE_STREAM_BATCH_TILES);
+
+	thread_memory_t* thread_memory = (thread_memory_t*) thread_local_storage[logical_thread_index];
+	temp_memory_t temp = begin_temp_memory(&thread_memory->task_arena);
+	u8* compressed_data[TILE_STREAM_BATCH_TILES] = {0};
+	u8* heap_buffer = NULL; // only if the batch was too large for the task arena
+	if (!tiff->is_remote) {
+		u64 capacity = 0;
+		for (i32 i = 0; i < count; ++i) {
+			capacity += ifd->tile_byte_counts[tile_indices[i]] + IO_COALESCE_MAX_GAP + 2 * TIFF_DIRECT_IO_ALIGNMENT;
+		}
+		u8* buffer = (u8*) try_push_size(&thread_memory->task_arena, capacity);
+		if (!buffer) {
+			buffer = (u8*) malloc(capacity);
+			heap_buffer = buffer;
+		}
+		read_local_tiles(image, stream->tiff_level, tile_indices, count, buffer, capacity, compressed_data);
+	}
+
+	u8* pixels = (u8*) try_push_size(&thread_memory->task_arena, TILE_DIM * TILE_PITCH);
+	u8* heap_pixels = NULL;
+	if (!pixels) {
+		pixels = (u8*) malloc(TILE_DIM * TILE_PITCH);
+		heap_pixels = pixels;
+	}
+	for (i32 i = 0; i < count && !stream->is_cancelled; ++i) {
+		i32 tile_index = tile_indices[i];
+		u8* data = compressed_data[i];
+		if (tiff->is_remote) {
+			// (into the part of the thread memory that is not used by the task arena)
+			data = get_compressed_tile_data(logical_thread_index, image, stream->tiff_level, tile_index,
+			                                (u8*) thread_memory->aligned_rest_of_thread_memory,
+			                                thread_memory->thread_memory_usable_size);
+		}
+		if (data) {
+			memset(pixels, 0xFF, TILE_DIM * TILE_PITCH); // (stays white if the JPEG stream is empty)
+			if (decode_compressed_tile_scaled(logical_thread_index, ifd, data, ifd->tile_byte_counts[tile_index],
+			                                  pixels, TILE_PITCH, 1)) {
+				tile_stream_tile_t tile = {0};
+				tile.tile_x = tile_index % ifd->width_in_tiles;
+				tile.tile_y = tile_index / ifd->width_in_tiles;
+				tile.pixels = pixels;
+				tile.width = (u32)ATMOST((u64)ifd->tile_width, ifd->image_width - (u64)tile.tile_x * ifd->tile_width);
+				tile.height = (u32)ATMOST((u64)ifd->tile_height, ifd->image_height - (u64)tile.tile_y * ifd->tile_height);
+				tile.pitch = TILE_PITCH;
+				stream->tile_func(logical_thread_index, stream->userdata, &tile);
+			}
+		}
+		interlocked_increment(&stream->tiles_done);
+	}
+	free(heap_pixels);
+	free(heap_buffer);
+	end_temp_memory(&temp);
+}
+
+static void tile_stream_batch_func(i32 logical_thread_index, void* userdata) {
+	tile_stream_t* stream = (tile_stream_t*) userdata;
+	for (;;) {
+		i32 batch_index = interlocked_increment(&stream->next_batch) - 1;
+		if (batch_index >= stream->batch_count || stream->is_cancelled) break;
+		stream_tile_batch(logical_thread_index, stream, batch_index);
+		// Back to the end of the queue for the next batch, so that the tiles for the view don't have to wait for the
+		// whole stream. (If the queue is full, just go on.)
+		if (add_work_queue_entry(&work_queue, tile_stream_batch_func, stream)) {
+			return;
+		}
+	}
+	if (interlocked_decrement(&stream->batches_in_flight) == 0) {
+		stream->success = !stream->is_cancelled;
+		interlocked_decrement(&stream->image->tile_streams_in_flight); // the image may be unloaded from here on
+		write_barrier;
+		stream->is_done = true;
+		platform_wake_main_thread(); // (for the done callback)
+	}
+}
+
+// Loads the tile tables of the level if needed, and puts the tiles in the order in which they are stored; then the
+// batches start.
+static void start_tile_stream_func(i32 logical_thread_index, void* userdata) {
+	tile_stream_t* stream = (tile_stream_t*) userdata;
+	tiff_t* tiff = &stream->image->tiff.tiff;
+	tiff_ifd_t* ifd = tiff->level_images + stream->tiff_level;
+	if (!stream->is_cancelled && tiff_load_tile_tables(tiff, ifd)) {
+		tile_range_t range = stream->range;
+		i32 max_tile_count = (range.x2 - range.x1) * (range.y2 - range.y1);
+		stored_tile_t* stored_tiles = (stored_tile_t*) malloc(ATLEAST(1, max_tile_count) * sizeof(stored_tile_t));
+		i32 tile_count = 0;
+		for (i32 tile_y = range.y1; tile_y < range.y2; ++tile_y) {
+			for (i32 tile_x = range.x1; tile_x < range.x2; ++tile_x) {
+				i32 tile_index = tile_y * ifd->width_in_tiles + tile_x;
+				if (ifd->tile_offsets[tile_index] == 0 || ifd->tile_byte_counts[tile_index] <= 2) {
+					continue; // empty tile
+				}
+				if (!is_tissue_in_tile(stream->image, stream->image->level_images + stream->level, tile_x, tile_y)) {
+					continue; // only glass (see tissue_mask.c)
+				}
+				stored_tiles[tile_count++] = (stored_tile_t){ .offset = ifd->tile_offsets[tile_index], .tile_index = tile_index };
+			}
+		}
+		qsort(stored_tiles, tile_count, sizeof(stored_tile_t), stored_tile_cmp_func);
+		stream->tile_indices = (i32*) malloc(ATLEAST(1, tile_count) * sizeof(i32));
+		for (i32 i = 0; i < tile_count; ++i) {
+			stream->tile_indices[i] = stored_tiles[i].tile_index;
+		}
+		free(stored_tiles);
+		stream->tile_count = tile_count;
+		stream->batch_count = (tile_count + TILE_STREAM_BATCH_TILES - 1) / TILE_STREAM_BATCH_TILES;
+	} else {
+		stream->is_cancelled = true; // (nothing to stream)
+	}
+	i32 entry_count = CLAMP(stream->batch_count, 1, TILE_STREAM_BATCHES_IN_FLIGHT);
+	stream->batches_in_flight = entry_count;
+	write_barrier;
+	for (i32 i = 0; i < entry_count; ++i) {
+		if (!add_work_queue_entry(&work_queue, tile_stream_batch_func, stream)) {
+			tile_stream_batch_func(logical_thread_index, stream); // queue is full, do it now
+		}
+	}
+}
+
+// Starts streaming the tiles in the range (of the tiles of the level) in the background. Returns NULL if the level
+// cannot be streamed. The stream stays valid until its done_func has been called.
+tile_stream_t* start_tile_stream(image_t* image, i32 level, tile_range_t range, tile_stream_tile_func_t* tile_func,
+                                 tile_stream_done_func_t* done_func, void* userdata) {
+	if (image->type != IMAGE_TYPE_TIFF || level < 0 || level >= image->level_count ||
+	    image->level_images[level].tiff_level < 0) {
+		printf("Tile stream: level %d is not stored in the file\n", level);
+		return NULL;
+	}
+	level_image_t* level_image = image->level_images + level;
+	range.x1 = CLAMP(range.x1, 0, (i32)level_image->width_in_tiles);
+	range.y1 = CLAMP(range.y1, 0, (i32)level_image->height_in_tiles);
+	range.x2 = CLAMP(range.x2, range.x1, (i32)level_image->width_in_tiles);
+	range.y2 = CLAMP(range.y2, range.y1, (i32)level_image->height_in_tiles);
+
+	tile_stream_t* stream = (tile_stream_t*) calloc(1, sizeof(tile_stream_t));
+	stream->image = image;
+	stream->level = level;
+	stream->tiff_level = level_image->tiff_level;
+	stream->range = range;
+	stream->tile_func = tile_func;
+	stream->done_func = done_func;
+	stream->userdata = userdata;
+
+	interlocked_increment(&image->tile_streams_in_flight);
+	if (!add_work_queue_entry(&work_queue, start_tile_stream_func, stream)) {
+		interlocked_decrement(&image->tile_streams_in_flight);
+		free(stream);
+		printf("Tile stream: the work queue is full, try again later\n");
+		return NULL;
+	}
+	sb_push(tile_streams, stream);
+	return stream;
+}
+
+float get_tile_stream_progress(tile_stream_t* stream) {
+	if (stream->batch_count == 0) {
+		return stream->is_done ? 1.0f : 0.0f; // (the tiles are not counted yet)
+	}
+	return (float)stream->tiles_done / (float)ATLEAST(1, stream->tile_count);
+}
+
+void cancel_tile_stream(tile_stream_t* stream) {
+	stream->is_cancelled = true;
+}
+
+// Needs to be followed by waiting for image->tile_streams_in_flight to drop to zero (see update_image_unloads()).
+void cancel_tile_streams_for_image(image_t* image) {
+	for (i32 i = 0; i < sb_count(tile_streams); ++i) {
+		if (tile_streams[i]->image == image) {
+			tile_streams[i]->is_cancelled = true;
+		}
+	}
+}
+
+// Needs to be called every frame, on the main thread: reports and cleans up finished streams.
+void update_tile_streams() {
+	i32 i = 0;
+	while (i < sb_count(tile_streams)) {
+		tile_stream_t* stream = tile_streams[i];
+		if (!stream->is_done) {
+			++i;
+			continue;
+		}
+		read_barrier;
+		if (stream->done_func) {
+			stream->done_func(stream->userdata, stream->success);
+		}
+		free(stream->tile_indices);
+		free(stream);
+		tile_streams[i] = sb_last(tile_streams);
+		--sb_raw_count(tile_streams);
+	}
+}
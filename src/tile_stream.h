@@ -0,0 +1,65 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+#include "viewer.h"
+
+// Streams all the tiles of a region of a slide level through a callback, for analysis (e.g. cell counting or tissue
+// quantification), apart from the tiles that are loaded for the view. The tiles are read in the order in which they
+// are stored in the file, a batch at a time, and decoded on the worker threads; the callback gets each tile as soon as
+// it is decoded, in the buffer it was decoded into. Only a few batches are underway at any time (also bounding the
+// memory in use), and the tiles for the view can get in between the batches.
+// Only levels that are stored in a TIFF file can be streamed (synthesized levels cannot). Tiles without tissue on them
+// are skipped, once the tissue mask of the slide is known (see tissue_mask.c).
+
+#define TILE_STREAM_BATCH_TILES 8 // tiles per batch, read together (see read_local_tiles())
+#define TILE_STREAM_BATCHES_IN_FLIGHT 4
+
+typedef struct tile_stream_t tile_stream_t;
+
+typedef struct tile_stream_tile_t {
+	i32 tile_x;
+	i32 tile_y;
+	u8* pixels; // BGRA; only valid during the callback
+	u32 width; // the part of the tile within the level (the tiles at the right and bottom edges are cut off)
+	u32 height;
+	u32 pitch;
+} tile_stream_tile_t;
+
+// Called on the worker threads, for several tiles at the same time and in no particular order.
+typedef void tile_stream_tile_func_t(i32 logical_thread_index, void* userdata, tile_stream_tile_t* tile);
+// Called on the main thread (see update_tile_streams()) once all the tiles are delivered, or after cancelling or
+// failing (is_complete is false then). The stream is gone after this.
+typedef void tile_stream_done_func_t(void* userdata, bool32 is_complete);
+
+tile_stream_t* start_tile_stream(image_t* image, i32 level, tile_range_t range, tile_stream_tile_func_t* tile_func,
+                                 tile_stream_done_func_t* done_func, void* userdata);
+float get_tile_stream_progress(tile_stream_t* stream);
+void cancel_tile_stream(tile_stream_t* stream);
+void cancel_tile_streams_for_image(image_t* image);
+void update_tile_streams();
+
+#ifdef __cplusplus
+}
+#endif
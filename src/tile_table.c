@@ -0,0 +1,193 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#include "intrinsics.h"
+#include "memory_stats.h"
+#include "viewer.h"
+
+// The tile states of a level are kept in pages of TILE_PAGE_DIM x TILE_PAGE_DIM tiles, which are allocated when one
+// of their tiles is first needed (see get_tile()). Of the levels of a large slide, usually only a small part is ever
+// looked at, so most pages never get allocated. Whether a tile is empty is known for the whole level up front (from
+// the tile tables), so that is kept apart from the pages, as a single bit per tile.
+
+static u64 get_tile_page_index(level_image_t* level_image, i32 tile_x, i32 tile_y) {
+	return (u64)(tile_y >> TILE_PAGE_DIM_LOG2) * level_image->width_in_pages + (tile_x >> TILE_PAGE_DIM_LOG2);
+}
+
+static i32 get_index_in_tile_page(i32 tile_x, i32 tile_y) {
+	return (tile_y & (TILE_PAGE_DIM - 1)) * TILE_PAGE_DIM + (tile_x & (TILE_PAGE_DIM - 1));
+}
+
+// Needs width_in_tiles and height_in_tiles to be set. All tiles start out as not empty and unloaded.
+void init_tile_table(level_image_t* level_image) {
+	level_image->width_in_pages = (level_image->width_in_tiles + TILE_PAGE_DIM - 1) >> TILE_PAGE_DIM_LOG2;
+	level_image->height_in_pages = (level_image->height_in_tiles + TILE_PAGE_DIM - 1) >> TILE_PAGE_DIM_LOG2;
+	u64 page_count = (u64)level_image->width_in_pages * level_image->height_in_pages;
+	u64 tile_count = (u64)level_image->width_in_tiles * level_image->height_in_tiles;
+	u64 empty_bit_words = ATLEAST(1, (tile_count + 31) / 32);
+	level_image->tile_pages = (tile_t* volatile*) calloc(ATLEAST(1, page_count), sizeof(tile_t*));
+	level_image->empty_tile_bits = (u32 volatile*) calloc(empty_bit_words, sizeof(u32));
+	level_image->nonempty_tile_counts = (i32 volatile*) calloc(ATLEAST(1, page_count), sizeof(i32));
+	for (u32 page_y = 0; page_y < level_image->height_in_pages; ++page_y) {
+		for (u32 page_x = 0; page_x < level_image->width_in_pages; ++page_x) {
+			// (the pages at the right and bottom edges may be partly outside of the level)
+			i32 width = ATMOST(TILE_PAGE_DIM, (i32)level_image->width_in_tiles - (i32)(page_x << TILE_PAGE_DIM_LOG2));
+			i32 height = ATMOST(TILE_PAGE_DIM, (i32)level_image->height_in_tiles - (i32)(page_y << TILE_PAGE_DIM_LOG2));
+			level_image->nonempty_tile_counts[page_y * level_image->width_in_pages + page_x] = width * height;
+		}
+	}
+	memory_stats_add(MEMORY_DOMAIN_TILE_STATES, page_count * (sizeof(tile_t*) + sizeof(i32)) + empty_bit_words * sizeof(u32));
+}
+
+// The caller is responsible for releasing the texture slots of the tiles first.
+void destroy_tile_table(level_image_t* level_image) {
+	if (!level_image->tile_pages) return;
+	u64 page_count = (u64)level_image->width_in_pages * level_image->height_in_pages;
+	u64 tile_count = (u64)level_image->width_in_tiles * level_image->height_in_tiles;
+	u64 empty_bit_words = ATLEAST(1, (tile_count + 31) / 32);
+	i64 freed_size = page_count * (sizeof(tile_t*) + sizeof(i32)) + empty_bit_words * sizeof(u32);
+	for (u64 i = 0; i < page_count; ++i) {
+		if (level_image->tile_pages[i]) {
+			free(level_image->tile_pages[i]);
+			freed_size += TILE_PAGE_SIZE * sizeof(tile_t);
+		}
+	}
+	memory_stats_add(MEMORY_DOMAIN_TILE_STATES, -freed_size);
+	free((void*)level_image->tile_pages);
+	free((void*)level_image->empty_tile_bits);
+	free((void*)level_image->nonempty_tile_counts);
+	level_image->tile_pages = NULL;
+	level_image->empty_tile_bits = NULL;
+	level_image->nonempty_tile_counts = NULL;
+}
+
+// Allocates the page of the tile if needed. Can be called from any thread: if two threads touch a new page at the
+// same time, one of them gets to keep its allocation.
+tile_t* get_tile(level_image_t* level_image, i32 tile_x, i32 tile_y) {
+	ASSERT(tile_x >= 0 && tile_x < (i32)level_image->width_in_tiles && tile_y >= 0 && tile_y < (i32)level_image->height_in_tiles);
+	tile_t* volatile* page_ptr = level_image->tile_pages + get_tile_page_index(level_image, tile_x, tile_y);
+	tile_t* page = *page_ptr;
+	if (!page) {
+		tile_t* new_page = (tile_t*) calloc(TILE_PAGE_SIZE, sizeof(tile_t));
+		page = (tile_t*) interlocked_compare_exchange_pointer(page_ptr, new_page, NULL);
+		if (page) {
+			free(new_page); // another thread was first
+		} else {
+			page = new_page;
+			memory_stats_add(MEMORY_DOMAIN_TILE_STATES, TILE_PAGE_SIZE * sizeof(tile_t));
+		}
+	}
+	return page + get_index_in_tile_page(tile_x, tile_y);
+}
+
+// Like get_tile(), but without allocating: returns NULL if the tile has never been touched (it is then unloaded).
+tile_t* peek_tile(level_image_t* level_image, i32 tile_x, i32 tile_y) {
+	ASSERT(tile_x >= 0 && tile_x < (i32)level_image->width_in_tiles && tile_y >= 0 && tile_y < (i32)level_image->height_in_tiles);
+	tile_t* page = level_image->tile_pages[get_tile_page_index(level_image, tile_x, tile_y)];
+	return page ? page + get_index_in_tile_page(tile_x, tile_y) : NULL;
+}
+
+bool32 is_tile_empty(level_image_t* level_image, i32 tile_x, i32 tile_y) {
+	u64 tile_index = (u64)tile_y * level_image->width_in_tiles + tile_x;
+	return (level_image->empty_tile_bits[tile_index / 32] >> (tile_index % 32)) & 1;
+}
+
+// For the tile state overlay: combines the state of the tile with how far its last load got. Does not allocate the
+// page of the tile. The latency (in seconds) is only set for resident tiles that have been drawn, otherwise it is 0.
+tile_overlay_state_enum get_tile_overlay_state(level_image_t* level_image, i32 tile_x, i32 tile_y, float* latency) {
+	*latency = 0.0f;
+	if (!level_image->tile_pages) return TILE_OVERLAY_NOT_REQUESTED;
+	if (is_tile_empty(level_image, tile_x, tile_y)) return TILE_OVERLAY_EMPTY;
+	tile_t* tile = peek_tile(level_image, tile_x, tile_y);
+	if (!tile) return TILE_OVERLAY_NOT_REQUESTED;
+	switch (tile->state) {
+		case TILE_STATE_QUEUED: return TILE_OVERLAY_QUEUED;
+		case TILE_STATE_LOADING: {
+			u8 stage = tile->debug_stage;
+			if (stage == TILE_DEBUG_STAGE_DECODING) return TILE_OVERLAY_DECODING;
+			if (stage == TILE_DEBUG_STAGE_UPLOADING) return TILE_OVERLAY_UPLOADING;
+			return TILE_OVERLAY_IO;
+		}
+		case TILE_STATE_LOADED: {
+			*latency = (float)tile->load_latency_in_ms * 0.001f;
+			return TILE_OVERLAY_RESIDENT;
+		}
+		default: {
+			u8 stage = tile->debug_stage;
+			if (stage == TILE_DEBUG_STAGE_FAILED) return TILE_OVERLAY_FAILED;
+			if (stage == TILE_DEBUG_STAGE_EVICTED) return TILE_OVERLAY_EVICTED;
+			return TILE_OVERLAY_NOT_REQUESTED;
+		}
+	}
+}
+
+// Empty tiles are neither requested nor drawn. Can be called from any thread.
+void mark_tile_empty(level_image_t* level_image, i32 tile_x, i32 tile_y) {
+	u64 tile_index = (u64)tile_y * level_image->width_in_tiles + tile_x;
+	u32 volatile* word_ptr = level_image->empty_tile_bits + tile_index / 32;
+	u32 bit = 1u << (tile_index % 32);
+	for (;;) {
+		u32 word = *word_ptr;
+		if (word & bit) return; // already marked
+		if ((u32)interlocked_compare_exchange(word_ptr, (i32)(word | bit), (i32)word) == word) break;
+	}
+	interlocked_decrement(level_image->nonempty_tile_counts + get_tile_page_index(level_image, tile_x, tile_y));
+}
+
+// Visits the tiles in the range that are not empty, row by row. Pages without any nonempty tiles are skipped as a
+// whole. With allocate_pages set, the tiles are looked up with get_tile(), otherwise with peek_tile() (so that
+// iterator->tile can be NULL).
+tile_iterator_t begin_tile_iteration(level_image_t* level_image, tile_range_t range, bool32 allocate_pages) {
+	tile_iterator_t iterator = {
+		.level_image = level_image, .range = range, .allocate_pages = allocate_pages,
+		.tile_x = range.x1 - 1, .tile_y = range.y1,
+	};
+	return iterator;
+}
+
+bool32 next_tile(tile_iterator_t* iterator) {
+	level_image_t* level_image = iterator->level_image;
+	tile_range_t range = iterator->range;
+	if (range.x1 >= range.x2) return false;
+	for (;;) {
+		++iterator->tile_x;
+		if (iterator->tile_x >= range.x2) {
+			iterator->tile_x = range.x1;
+			++iterator->tile_y;
+		}
+		if (iterator->tile_y >= range.y2) {
+			iterator->tile = NULL;
+			return false;
+		}
+		i32 tile_x = iterator->tile_x;
+		i32 tile_y = iterator->tile_y;
+		if (tile_x == range.x1 || (tile_x & (TILE_PAGE_DIM - 1)) == 0) {
+			// Entering a page: skip the rest of this row of the page if the page has nothing to draw.
+			if (level_image->nonempty_tile_counts[get_tile_page_index(level_image, tile_x, tile_y)] <= 0) {
+				i32 page_end_x = ((tile_x >> TILE_PAGE_DIM_LOG2) + 1) << TILE_PAGE_DIM_LOG2;
+				iterator->tile_x = ATMOST(page_end_x, range.x2) - 1;
+				continue;
+			}
+		}
+		if (is_tile_empty(level_image, tile_x, tile_y)) continue;
+		iterator->tile = iterator->allocate_pages ? get_tile(level_image, tile_x, tile_y) : peek_tile(level_image, tile_x, tile_y);
+		return true;
+	}
+}
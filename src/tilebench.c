@@ -0,0 +1,552 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Headless benchmark of the tile pipeline: opens a local TIFF and replays a recorded camera path through the same
+// stages as the viewer, without a window or an OpenGL context. Every frame, the tiles in view are put on a wishlist
+// with the same priorities as in add_visible_tiles_to_wishlist() (viewer.c); worker threads take the most urgent
+// request, read the compressed tile and decode it, and requests for tiles that went out of view before a worker got
+// to them are cancelled. The upload stage is either skipped, or simulated by copying the pixels on the main thread
+// within a time budget per frame (like upload_decoded_tiles()).
+//
+// Reports tiles/s and MB/s, and per viewport of the path the time until all its tiles at the zoom level in view were
+// loaded ("fully sharp").
+//
+// Camera paths are recorded in the viewer with View > Debug > Record camera path (see update_camera_path_recording()
+// in viewer.c), one line per change of the view:
+//   <seconds> <camera x in um> <camera y in um> <level> <viewport width> <viewport height>
+// Levels without their own image in the file are loaded from the next finer level instead.
+// The same paths can be replayed in the viewer itself, e.g.: slideviewer slide.tiff --replay camera_path.txt
+//
+// Usage: tilebench <slide.tiff> <camera_path.txt> [--threads N] [--upload none|copy] [--speed X] [--no-mmap]
+
+#ifndef IS_SERVER
+#define IS_SERVER 1 // should be defined by the command-line because we also need to compile e.g. tiff.c which is shared
+#endif
+
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "tiff.h"
+#include "jpeg_decoder.h"
+#include "cpu_dispatch.h"
+
+#define TILEBENCH_MAX_LEVELS 16
+#define TILEBENCH_DEFAULT_THREAD_COUNT 8
+#define TILEBENCH_FRAME_SECONDS (1.0 / 60.0)
+#define TILEBENCH_UPLOAD_BUDGET_SECONDS 0.004 // see tile_upload_budget_in_ms in the viewer
+#define TILEBENCH_SETTLE_SECONDS 10.0 // how long the last viewport may take to become sharp
+
+enum {
+	BENCH_TILE_UNLOADED = 0,
+	BENCH_TILE_QUEUED,
+	BENCH_TILE_LOADING,
+	BENCH_TILE_DECODED, // waiting for the upload stage
+	BENCH_TILE_LOADED,
+};
+
+typedef struct {
+	volatile i32 state;
+	bool32 is_empty;
+	i32 priority;
+	i64 frame_last_wanted;
+} bench_tile_t;
+
+typedef struct {
+	tiff_ifd_t* ifd; // NULL if the file has no image for this level
+	bench_tile_t* tiles;
+} bench_level_t;
+
+typedef struct {
+	i32 level; // index into bench_levels
+	u32 tile_index;
+} bench_request_t;
+
+typedef struct {
+	double time;
+	float camera_x;
+	float camera_y;
+	i32 level;
+	i32 viewport_width;
+	i32 viewport_height;
+	// Results
+	double seconds_until_sharp; // negative if the view moved on before it became sharp
+	double seconds_shown;
+} bench_viewport_t;
+
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t has_requests;
+	bench_request_t* requests; // sb
+	bench_request_t* decoded; // sb, waiting for the upload stage
+	u8** decoded_pixels; // sb, indexed like decoded (NULL if not kept)
+	bool32 is_running;
+	// Statistics, updated while holding the mutex
+	i64 tiles_loaded;
+	i64 bytes_read;
+	i64 cancelled_count;
+	i32 failed_count;
+	double read_seconds;
+	double decode_seconds;
+} bench_queue_t;
+
+static tiff_t bench_tiff;
+static bench_level_t bench_levels[TILEBENCH_MAX_LEVELS];
+static i32 bench_level_count;
+static bench_queue_t bench_queue;
+static bool32 bench_keep_pixels; // for the simulated upload
+
+double get_seconds() {
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+static void sleep_seconds(double seconds) {
+	if (seconds <= 0.0) return;
+#ifdef _WIN32
+	Sleep((DWORD)(seconds * 1000.0));
+#else
+	usleep((useconds_t)(seconds * 1e6));
+#endif
+}
+
+// Same as get_downsample_level() in pyramid.c.
+static i32 get_downsample_level(tiff_t* tiff, tiff_ifd_t* ifd) {
+	return (i32)roundf(log2f(ifd->um_per_pixel_x / tiff->mpp_x));
+}
+
+static bool32 init_bench_levels(tiff_t* tiff) {
+	for (u64 i = 0; i < tiff->level_count; ++i) {
+		tiff_ifd_t* ifd = tiff->level_images + i;
+		i32 level = get_downsample_level(tiff, ifd);
+		if (level < 0 || level >= TILEBENCH_MAX_LEVELS || bench_levels[level].ifd) continue;
+		if (ifd->compression != 7 || !tiff_load_tile_tables(tiff, ifd)) continue; // only JPEG tiles are supported
+		bench_levels[level].ifd = ifd;
+		bench_level_count = ATLEAST(bench_level_count, level + 1);
+	}
+	if (bench_level_count == 0 || !bench_levels[0].ifd) {
+		return false;
+	}
+	// Levels that are missing from the file fall back to the next finer level.
+	for (i32 level = 1; level < bench_level_count; ++level) {
+		if (!bench_levels[level].ifd) {
+			bench_levels[level].ifd = bench_levels[level - 1].ifd;
+		}
+	}
+	for (i32 level = 0; level < bench_level_count; ++level) {
+		tiff_ifd_t* ifd = bench_levels[level].ifd;
+		if (level > 0 && ifd == bench_levels[level - 1].ifd) {
+			bench_levels[level].tiles = bench_levels[level - 1].tiles; // shared with the finer level
+			continue;
+		}
+		bench_levels[level].tiles = (bench_tile_t*) calloc(ifd->tile_count, sizeof(bench_tile_t));
+		for (u64 i = 0; i < ifd->tile_count; ++i) {
+			bench_levels[level].tiles[i].is_empty = (ifd->tile_offsets[i] == 0 || ifd->tile_byte_counts[i] == 0);
+		}
+	}
+	return true;
+}
+
+// Takes the most urgent request off the queue (see take_tile_requests() in viewer.c). Needs to hold the mutex.
+static bool32 take_bench_request(bench_request_t* request) {
+	i32 best_index = -1;
+	i32 best_priority = 0;
+	for (i32 i = 0; i < sb_count(bench_queue.requests); ++i) {
+		bench_request_t* candidate = bench_queue.requests + i;
+		bench_tile_t* tile = bench_levels[candidate->level].tiles + candidate->tile_index;
+		if (best_index < 0 || tile->priority > best_priority) {
+			best_index = i;
+			best_priority = tile->priority;
+		}
+	}
+	if (best_index < 0) return false;
+	*request = bench_queue.requests[best_index];
+	bench_queue.requests[best_index] = sb_last(bench_queue.requests);
+	--sb_raw_count(bench_queue.requests);
+	return true;
+}
+
+void* bench_worker_proc(void* parameter) {
+	jpeg_decoder_state_t* decoder = jpeg_decoder_create_state();
+	u8* compressed = NULL;
+	u64 compressed_capacity = 0;
+	u8* pixels = NULL;
+	u64 pixels_capacity = 0;
+
+	pthread_mutex_lock(&bench_queue.mutex);
+	for (;;) {
+		bench_request_t request;
+		while (bench_queue.is_running && !take_bench_request(&request)) {
+			pthread_cond_wait(&bench_queue.has_requests, &bench_queue.mutex);
+		}
+		if (!bench_queue.is_running) break;
+		bench_tile_t* tile = bench_levels[request.level].tiles + request.tile_index;
+		tile->state = BENCH_TILE_LOADING;
+		pthread_mutex_unlock(&bench_queue.mutex);
+
+		tiff_ifd_t* ifd = bench_levels[request.level].ifd;
+		u64 size = ifd->tile_byte_counts[request.tile_index];
+		u64 pixels_size = (u64)ifd->tile_width * ifd->tile_height * 4;
+		if (size > compressed_capacity) {
+			compressed = (u8*) realloc(compressed, size);
+			compressed_capacity = size;
+		}
+		if (bench_keep_pixels || pixels_size > pixels_capacity) {
+			pixels = bench_keep_pixels ? (u8*) malloc(pixels_size) : (u8*) realloc(pixels, pixels_size);
+			pixels_capacity = pixels_size;
+		}
+		double read_start = get_seconds();
+		bool32 ok = (tiff_read_at_offset(&bench_tiff, compressed, ifd->tile_offsets[request.tile_index], size) == 1);
+		double decode_start = get_seconds();
+		memset(pixels, 0xFF, pixels_size);
+		if (ok) {
+			ok = decode_fixed_size_tile_with_state(decoder, ifd->jpeg_tables, (u32)ifd->jpeg_tables_length, compressed,
+			                                       (u32)size, pixels, ifd->tile_width * 4,
+			                                       (ifd->color_space == TIFF_PHOTOMETRIC_YCBCR),
+			                                       tiff_get_tile_path_dim(ifd->tile_path), 1);
+		}
+		double decode_end = get_seconds();
+
+		pthread_mutex_lock(&bench_queue.mutex);
+		bench_queue.read_seconds += decode_start - read_start;
+		bench_queue.decode_seconds += decode_end - decode_start;
+		bench_queue.bytes_read += size;
+		if (!ok) {
+			++bench_queue.failed_count; // like in the viewer, the tile is still shown (as white)
+		}
+		sb_push(bench_queue.decoded, request);
+		sb_push(bench_queue.decoded_pixels, bench_keep_pixels ? pixels : NULL);
+		tile->state = BENCH_TILE_DECODED;
+		if (bench_keep_pixels) {
+			pixels = NULL;
+			pixels_capacity = 0;
+		}
+	}
+	pthread_mutex_unlock(&bench_queue.mutex);
+
+	jpeg_decoder_destroy_state(decoder);
+	free(compressed);
+	free(pixels);
+	return 0;
+}
+
+// Puts the tiles in view on the request queue, or updates their priority if they are still waiting.
+// Returns true if all the tiles at the level of the viewport have been loaded. Needs to hold the mutex.
+static bool32 request_tiles_in_view(bench_viewport_t* viewport, i64 frame) {
+	i32 view_level = CLAMP(viewport->level, 0, bench_level_count - 1);
+	float screen_radius = ATLEAST(1.0f, sqrtf(SQUARE(viewport->viewport_width / 2) + SQUARE(viewport->viewport_height / 2)));
+	float view_um_per_pixel_x = bench_tiff.mpp_x * (float)(1 << view_level);
+	float view_um_per_pixel_y = bench_tiff.mpp_y * (float)(1 << view_level);
+	float camera_min_x = viewport->camera_x - 0.5f * viewport->viewport_width * view_um_per_pixel_x;
+	float camera_max_x = viewport->camera_x + 0.5f * viewport->viewport_width * view_um_per_pixel_x;
+	float camera_min_y = viewport->camera_y - 0.5f * viewport->viewport_height * view_um_per_pixel_y;
+	float camera_max_y = viewport->camera_y + 0.5f * viewport->viewport_height * view_um_per_pixel_y;
+
+	bool32 is_sharp = true;
+	for (i32 level = bench_level_count - 1; level >= view_level; --level) {
+		bench_level_t* bench_level = bench_levels + level;
+		tiff_ifd_t* ifd = bench_level->ifd;
+		if (level > view_level && bench_levels[level - 1].ifd == ifd) continue; // done at the finer level
+		i32 base_priority = (bench_level_count - level) * 100;
+		i32 tile_x1 = CLAMP((i32)floorf(camera_min_x / ifd->x_tile_side_in_um), 0, (i32)ifd->width_in_tiles);
+		i32 tile_x2 = CLAMP((i32)floorf(camera_max_x / ifd->x_tile_side_in_um) + 1, 0, (i32)ifd->width_in_tiles);
+		i32 tile_y1 = CLAMP((i32)floorf(camera_min_y / ifd->y_tile_side_in_um), 0, (i32)ifd->height_in_tiles);
+		i32 tile_y2 = CLAMP((i32)floorf(camera_max_y / ifd->y_tile_side_in_um) + 1, 0, (i32)ifd->height_in_tiles);
+		for (i32 tile_y = tile_y1; tile_y < tile_y2; ++tile_y) {
+			for (i32 tile_x = tile_x1; tile_x < tile_x2; ++tile_x) {
+				u32 tile_index = tile_y * ifd->width_in_tiles + tile_x;
+				bench_tile_t* tile = bench_level->tiles + tile_index;
+				if (tile->is_empty) continue;
+				float distance_x = (viewport->camera_x - ((tile_x + 0.5f) * ifd->x_tile_side_in_um)) / ifd->um_per_pixel_x;
+				float distance_y = (viewport->camera_y - ((tile_y + 0.5f) * ifd->y_tile_side_in_um)) / ifd->um_per_pixel_y;
+				float distance = sqrtf(SQUARE(distance_x) + SQUARE(distance_y)) / screen_radius;
+				tile->priority = base_priority + (i32)((1.0f - distance) * 300.0f);
+				tile->frame_last_wanted = frame;
+				if (tile->state == BENCH_TILE_UNLOADED) {
+					tile->state = BENCH_TILE_QUEUED;
+					sb_push(bench_queue.requests, ((bench_request_t){ .level = level, .tile_index = tile_index }));
+				}
+				if (level == view_level && tile->state != BENCH_TILE_LOADED) {
+					is_sharp = false;
+				}
+			}
+		}
+	}
+	return is_sharp;
+}
+
+// Requests for tiles that are no longer in view are dropped (see cancel_stale_tile_requests()). Needs to hold the mutex.
+static void cancel_stale_bench_requests(i64 frame) {
+	i32 kept_count = 0;
+	for (i32 i = 0; i < sb_count(bench_queue.requests); ++i) {
+		bench_request_t request = bench_queue.requests[i];
+		bench_tile_t* tile = bench_levels[request.level].tiles + request.tile_index;
+		if (tile->frame_last_wanted < frame) {
+			tile->state = BENCH_TILE_UNLOADED;
+			++bench_queue.cancelled_count;
+		} else {
+			bench_queue.requests[kept_count++] = request;
+		}
+	}
+	if (bench_queue.requests) {
+		sb_raw_count(bench_queue.requests) = kept_count;
+	}
+}
+
+// The upload stage, on the main thread: without simulated uploads, decoded tiles count as loaded right away.
+static void upload_bench_tiles(u8* texture, u64 texture_size) {
+	pthread_mutex_lock(&bench_queue.mutex);
+	bench_request_t* decoded = bench_queue.decoded;
+	u8** decoded_pixels = bench_queue.decoded_pixels;
+	bench_queue.decoded = NULL;
+	bench_queue.decoded_pixels = NULL;
+	pthread_mutex_unlock(&bench_queue.mutex);
+
+	double start = get_seconds();
+	i32 count = sb_count(decoded);
+	i32 uploaded_count = 0;
+	for (; uploaded_count < count; ++uploaded_count) {
+		if (texture && uploaded_count > 0 && get_seconds() - start > TILEBENCH_UPLOAD_BUDGET_SECONDS) {
+			break;
+		}
+		bench_request_t request = decoded[uploaded_count];
+		if (texture && decoded_pixels[uploaded_count]) {
+			tiff_ifd_t* ifd = bench_levels[request.level].ifd;
+			u64 size = ATMOST(texture_size, (u64)ifd->tile_width * ifd->tile_height * 4);
+			memcpy(texture, decoded_pixels[uploaded_count], size);
+			free(decoded_pixels[uploaded_count]);
+		}
+		bench_levels[request.level].tiles[request.tile_index].state = BENCH_TILE_LOADED;
+	}
+
+	pthread_mutex_lock(&bench_queue.mutex);
+	bench_queue.tiles_loaded += uploaded_count;
+	// Put back what we didn't get to, in front of the tiles that were decoded in the meantime.
+	for (i32 i = 0; i < sb_count(bench_queue.decoded); ++i) {
+		sb_push(decoded, bench_queue.decoded[i]);
+		sb_push(decoded_pixels, bench_queue.decoded_pixels[i]);
+	}
+	sb_free(bench_queue.decoded);
+	sb_free(bench_queue.decoded_pixels);
+	i32 remaining_count = sb_count(decoded) - uploaded_count;
+	if (remaining_count > 0) {
+		memmove(decoded, decoded + uploaded_count, remaining_count * sizeof(bench_request_t));
+		memmove(decoded_pixels, decoded_pixels + uploaded_count, remaining_count * sizeof(u8*));
+		sb_raw_count(decoded) = remaining_count;
+		sb_raw_count(decoded_pixels) = remaining_count;
+		bench_queue.decoded = decoded;
+		bench_queue.decoded_pixels = decoded_pixels;
+	} else {
+		sb_free(decoded);
+		sb_free(decoded_pixels);
+		bench_queue.decoded = NULL;
+		bench_queue.decoded_pixels = NULL;
+	}
+	pthread_mutex_unlock(&bench_queue.mutex);
+}
+
+static bench_viewport_t* load_camera_path(const char* filename) {
+	FILE* fp = fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "Could not open %s\n", filename);
+		return NULL;
+	}
+	bench_viewport_t* viewports = NULL; // sb
+	char line[256];
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#') continue;
+		bench_viewport_t viewport = {0};
+		if (sscanf(line, "%lf %f %f %d %d %d", &viewport.time, &viewport.camera_x, &viewport.camera_y, &viewport.level,
+		           &viewport.viewport_width, &viewport.viewport_height) == 6) {
+			sb_push(viewports, viewport);
+		}
+	}
+	fclose(fp);
+	return viewports;
+}
+
+int compare_doubles(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <slide.tiff> <camera_path.txt> [--threads N] [--upload none|copy] [--speed X] [--no-mmap]\n",
+		        argv[0]);
+		return 1;
+	}
+	cpu_dispatch_init(); // the CPU_KERNELS environment variable selects other kernels, e.g. CPU_KERNELS=scalar
+	i32 thread_count = TILEBENCH_DEFAULT_THREAD_COUNT;
+	bool32 simulate_upload = false;
+	double speed = 1.0;
+	for (i32 i = 3; i < argc; ++i) {
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			thread_count = atoi(argv[++i]);
+			if (thread_count <= 0) thread_count = TILEBENCH_DEFAULT_THREAD_COUNT;
+		} else if (strcmp(argv[i], "--upload") == 0 && i + 1 < argc) {
+			simulate_upload = (strcmp(argv[++i], "copy") == 0);
+		} else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+			speed = atof(argv[++i]);
+			if (speed <= 0.0) speed = 1.0;
+		} else if (strcmp(argv[i], "--no-mmap") == 0) {
+			tiff_enable_mmap = false;
+		} else {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	bench_viewport_t* viewports = load_camera_path(argv[2]);
+	i32 viewport_count = sb_count(viewports);
+	if (viewport_count == 0) {
+		fprintf(stderr, "The camera path %s is empty\n", argv[2]);
+		return 1;
+	}
+	if (!open_tiff_file(&bench_tiff, argv[1]) || !init_bench_levels(&bench_tiff)) {
+		fprintf(stderr, "Could not open %s (only tiled JPEG TIFF slides are supported)\n", argv[1]);
+		return 1;
+	}
+
+	tiff_ifd_t* base_ifd = bench_levels[0].ifd;
+	fprintf(stderr, "%s: %d levels, %u x %u pixels (%.1f x %.1f um)\n", argv[1], bench_level_count, base_ifd->image_width,
+	        base_ifd->image_height, base_ifd->image_width * bench_tiff.mpp_x, base_ifd->image_height * bench_tiff.mpp_y);
+
+	bench_keep_pixels = simulate_upload;
+	u64 texture_size = (u64)bench_levels[0].ifd->tile_width * bench_levels[0].ifd->tile_height * 4;
+	u8* texture = simulate_upload ? (u8*) malloc(texture_size) : NULL;
+
+	pthread_mutex_init(&bench_queue.mutex, NULL);
+	pthread_cond_init(&bench_queue.has_requests, NULL);
+	bench_queue.is_running = true;
+	pthread_t* threads = calloc(thread_count, sizeof(pthread_t));
+	for (i32 i = 0; i < thread_count; ++i) {
+		if (pthread_create(threads + i, NULL, &bench_worker_proc, NULL) != 0) {
+			fprintf(stderr, "Error creating thread\n");
+			return 1;
+		}
+	}
+
+	fprintf(stderr, "Replaying %d viewports of %s with %d threads (upload: %s)...\n", viewport_count, argv[2],
+	        thread_count, simulate_upload ? "copy" : "none");
+	double path_start_time = viewports[0].time;
+	double end_time = (viewports[viewport_count - 1].time - path_start_time) / speed + TILEBENCH_SETTLE_SECONDS;
+	double start = get_seconds();
+	i32 current = -1;
+	double current_shown_since = 0.0;
+	bool32 is_current_sharp = false;
+	for (i64 frame = 1; ; ++frame) {
+		double frame_start = get_seconds();
+		double elapsed = frame_start - start;
+		i32 next = current;
+		while (next + 1 < viewport_count && (viewports[next + 1].time - path_start_time) / speed <= elapsed) {
+			++next;
+		}
+		if (next != current) {
+			if (current >= 0) {
+				viewports[current].seconds_shown = elapsed - current_shown_since;
+				if (!is_current_sharp) viewports[current].seconds_until_sharp = -1.0;
+			}
+			current = next;
+			current_shown_since = elapsed;
+			is_current_sharp = false;
+		}
+
+		upload_bench_tiles(texture, texture_size);
+
+		pthread_mutex_lock(&bench_queue.mutex);
+		bool32 is_sharp = request_tiles_in_view(viewports + current, frame);
+		cancel_stale_bench_requests(frame);
+		pthread_cond_broadcast(&bench_queue.has_requests);
+		pthread_mutex_unlock(&bench_queue.mutex);
+
+		if (is_sharp && !is_current_sharp) {
+			is_current_sharp = true;
+			viewports[current].seconds_until_sharp = elapsed - current_shown_since;
+		}
+		bool32 is_last = (current == viewport_count - 1);
+		if (is_last && (is_current_sharp || elapsed > end_time)) {
+			viewports[current].seconds_shown = elapsed - current_shown_since;
+			if (!is_current_sharp) viewports[current].seconds_until_sharp = -1.0;
+			break;
+		}
+		sleep_seconds(TILEBENCH_FRAME_SECONDS - (get_seconds() - frame_start));
+	}
+	double elapsed = get_seconds() - start;
+
+	pthread_mutex_lock(&bench_queue.mutex);
+	bench_queue.is_running = false;
+	pthread_cond_broadcast(&bench_queue.has_requests);
+	pthread_mutex_unlock(&bench_queue.mutex);
+	for (i32 i = 0; i < thread_count; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	printf("viewport       time   level   camera (um)              sharp after\n");
+	double* sharp_times = NULL; // sb
+	for (i32 i = 0; i < viewport_count; ++i) {
+		bench_viewport_t* viewport = viewports + i;
+		if (viewport->seconds_until_sharp >= 0.0) {
+			sb_push(sharp_times, viewport->seconds_until_sharp);
+			printf("%8d %9.2f s %6d   %10.1f %10.1f   %8.1f ms\n", i, viewport->time - path_start_time, viewport->level,
+			       viewport->camera_x, viewport->camera_y, viewport->seconds_until_sharp * 1000.0);
+		} else {
+			printf("%8d %9.2f s %6d   %10.1f %10.1f   not sharp (shown for %.1f ms)\n", i, viewport->time - path_start_time,
+			       viewport->level, viewport->camera_x, viewport->camera_y, viewport->seconds_shown * 1000.0);
+		}
+	}
+	i64 tiles_loaded = bench_queue.tiles_loaded;
+	printf("tiles:      %lld loaded, %lld cancelled, %d failed\n", (long long)tiles_loaded,
+	       (long long)bench_queue.cancelled_count, bench_queue.failed_count);
+	printf("throughput: %.1f tiles/s, %.2f MB/s (compressed)\n", tiles_loaded / elapsed,
+	       bench_queue.bytes_read / (elapsed * 1024.0 * 1024.0));
+	if (tiles_loaded > 0) {
+		printf("per tile:   read %.2f ms, decode %.2f ms (summed over the workers)\n",
+		       bench_queue.read_seconds * 1000.0 / tiles_loaded, bench_queue.decode_seconds * 1000.0 / tiles_loaded);
+	}
+	i32 sharp_count = sb_count(sharp_times);
+	printf("sharp:      %d of %d viewports", sharp_count, viewport_count);
+	if (sharp_count > 0) {
+		qsort(sharp_times, sharp_count, sizeof(double), compare_doubles);
+		printf(", p50 %.1f ms, p90 %.1f ms, max %.1f ms", sharp_times[sharp_count / 2] * 1000.0,
+		       sharp_times[(i32)(sharp_count * 0.90)] * 1000.0, sharp_times[sharp_count - 1] * 1000.0);
+	}
+	printf("\n");
+
+	sb_free(sharp_times);
+	sb_free(viewports);
+	free(texture);
+	tiff_destroy(&bench_tiff);
+	return (tiles_loaded > 0) ? 0 : 1;
+}
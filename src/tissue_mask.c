@@ -0,0 +1,279 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#include "win32_main.h"
+#include "platform.h"
+#include "intrinsics.h"
+#include "viewer.h"
+#include "tiff.h"
+#include "cpu_dispatch.h"
+
+#include <stdio.h>
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Most of a slide is glass. The tissue mask tells which parts of the slide have tissue on them, so that prefetching,
+// tile streams and region exports can skip the rest. It is worked out once per slide, in the background, from the
+// coarsest level in the file: pixels that are colored (stained) or dark count as tissue; bright gray pixels are glass.
+// Until the mask is ready (or if there is none), everything counts as tissue.
+
+#define TISSUE_MASK_MAX_DIM 4096 // in pixels; if even 1/8 of the coarsest level in the file is larger, there is no mask
+#define TISSUE_SATURATION_THRESHOLD 20 // max - min of the color channels
+#define TISSUE_BRIGHTNESS_THRESHOLD 200 // max of the color channels
+#define TISSUE_MASK_MARGIN 2 // in pixels of the mask, so that the edges of the tissue are not cut off
+
+static void threshold_tissue_row_scalar(u8* bgra, u8* mask_row, i32 width) {
+	for (i32 x = 0; x < width; ++x) {
+		u8* pixel = bgra + x * 4;
+		u8 max = ATLEAST(ATLEAST(pixel[0], pixel[1]), pixel[2]);
+		u8 min = ATMOST(ATMOST(pixel[0], pixel[1]), pixel[2]);
+		mask_row[x] = (max - min > TISSUE_SATURATION_THRESHOLD || max < TISSUE_BRIGHTNESS_THRESHOLD);
+	}
+}
+
+#if defined(__SSE2__)
+
+// 4 pixels: the lowest byte of each becomes 1 for tissue, 0 for glass (the other bytes become 0).
+static inline __m128i threshold_tissue_sse2(__m128i v) {
+	__m128i g = _mm_srli_epi32(v, 8);
+	__m128i r = _mm_srli_epi32(v, 16);
+	__m128i max = _mm_max_epu8(_mm_max_epu8(v, g), r);
+	__m128i min = _mm_min_epu8(_mm_min_epu8(v, g), r);
+	// (saturating subtractions: nonzero if the saturation is above, or the brightness below the threshold)
+	__m128i is_saturated = _mm_subs_epu8(_mm_subs_epu8(max, min), _mm_set1_epi8(TISSUE_SATURATION_THRESHOLD));
+	__m128i is_dark = _mm_subs_epu8(_mm_set1_epi8((char)TISSUE_BRIGHTNESS_THRESHOLD), max);
+	__m128i is_tissue = _mm_and_si128(_mm_or_si128(is_saturated, is_dark), _mm_set1_epi32(0xFF));
+	return _mm_min_epu8(is_tissue, _mm_set1_epi32(1));
+}
+
+static void threshold_tissue_row_sse2(u8* bgra, u8* mask_row, i32 width) {
+	i32 x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m128i a = threshold_tissue_sse2(_mm_loadu_si128((__m128i*)(bgra + x * 4)));
+		__m128i b = threshold_tissue_sse2(_mm_loadu_si128((__m128i*)(bgra + x * 4 + 16)));
+		__m128i c = threshold_tissue_sse2(_mm_loadu_si128((__m128i*)(bgra + x * 4 + 32)));
+		__m128i d = threshold_tissue_sse2(_mm_loadu_si128((__m128i*)(bgra + x * 4 + 48)));
+		_mm_storeu_si128((__m128i*)(mask_row + x), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+	}
+	threshold_tissue_row_scalar(bgra + x * 4, mask_row + x, width - x);
+}
+
+#endif //__SSE2__
+
+typedef void threshold_tissue_row_func_t(u8* bgra, u8* mask_row, i32 width);
+
+// Indexed by level, see cpu_dispatch.h (the coarsest level is too small for AVX2 to make a difference)
+static threshold_tissue_row_func_t* threshold_tissue_row_impls[CPU_LEVEL_COUNT] = {
+	threshold_tissue_row_scalar,
+#if defined(__SSE2__)
+	threshold_tissue_row_sse2,
+	threshold_tissue_row_sse2,
+#endif
+};
+
+// 3x3 dilation or erosion of a mask of zeroes and ones, in two passes (temp is the size of the mask).
+// Beyond the edges, the edge pixels are repeated.
+static void morph_mask_3x3(u8* mask, u8* temp, i32 width, i32 height, bool32 is_dilation) {
+	for (i32 y = 0; y < height; ++y) {
+		u8* src = mask + (i64)y * width;
+		u8* dest = temp + (i64)y * width;
+		for (i32 x = 0; x < width; ++x) {
+			u8 left = src[ATLEAST(x - 1, 0)];
+			u8 right = src[ATMOST(x + 1, width - 1)];
+			dest[x] = is_dilation ? (left | src[x] | right) : (left & src[x] & right);
+		}
+	}
+	for (i32 y = 0; y < height; ++y) {
+		u8* above = temp + (i64)ATLEAST(y - 1, 0) * width;
+		u8* src = temp + (i64)y * width;
+		u8* below = temp + (i64)ATMOST(y + 1, height - 1) * width;
+		u8* dest = mask + (i64)y * width;
+		for (i32 x = 0; x < width; ++x) {
+			dest[x] = is_dilation ? (above[x] | src[x] | below[x]) : (above[x] & src[x] & below[x]);
+		}
+	}
+}
+
+// Removes specks (dust, noise) and fills small holes, then adds the margin.
+static void clean_up_tissue_mask(u8* mask, i32 width, i32 height) {
+	u8* temp = (u8*) malloc((u64)width * height);
+	morph_mask_3x3(mask, temp, width, height, false); // opening
+	morph_mask_3x3(mask, temp, width, height, true);
+	morph_mask_3x3(mask, temp, width, height, true); // closing
+	morph_mask_3x3(mask, temp, width, height, false);
+	for (i32 i = 0; i < TISSUE_MASK_MARGIN; ++i) {
+		morph_mask_3x3(mask, temp, width, height, true);
+	}
+	free(temp);
+}
+
+static tissue_mask_t* compute_tissue_mask(i32 logical_thread_index, image_t* image) {
+	i32 level = image->level_count - 1;
+	while (level > 0 && image->level_images[level].tiff_level < 0) {
+		--level;
+	}
+	i32 tiff_level = image->level_images[level].tiff_level;
+	tiff_t* tiff = &image->tiff.tiff;
+	if (tiff_level < 0 || !tiff_load_tile_tables(tiff, tiff->level_images + tiff_level)) {
+		return NULL;
+	}
+	tiff_ifd_t* ifd = tiff->level_images + tiff_level;
+	// Decoded at reduced size if needed (DCT scaling).
+	i32 scale = 1;
+	while (scale < 8 && ((ifd->image_width + scale - 1) / scale > TISSUE_MASK_MAX_DIM ||
+	                     (ifd->image_height + scale - 1) / scale > TISSUE_MASK_MAX_DIM)) {
+		scale *= 2;
+	}
+	i32 width = (i32)((ifd->image_width + scale - 1) / scale);
+	i32 height = (i32)((ifd->image_height + scale - 1) / scale);
+	if (width > TISSUE_MASK_MAX_DIM || height > TISSUE_MASK_MAX_DIM) {
+		return NULL; // (no coarse levels in the file)
+	}
+
+	thread_memory_t* thread_memory = (thread_memory_t*) thread_local_storage[logical_thread_index];
+	u8* compressed_buffer = (u8*) thread_memory->aligned_rest_of_thread_memory;
+	u64 compressed_buffer_capacity = thread_memory->thread_memory_usable_size;
+	i32 tile_width = (i32)ifd->tile_width / scale;
+	i32 tile_height = (i32)ifd->tile_height / scale;
+	u32 tile_pitch = tile_width * BYTES_PER_PIXEL;
+	u8* tile_pixels = (u8*) malloc((u64)tile_pitch * tile_height);
+	u8* mask = (u8*) calloc(1, (u64)width * height); // (empty tiles are glass)
+	threshold_tissue_row_func_t* threshold_row = threshold_tissue_row_impls[cpu_get_kernel_level(CPU_KERNEL_TISSUE_THRESHOLD)];
+	for (i32 tile_y = 0; tile_y < (i32)ifd->height_in_tiles && !image->is_tissue_mask_cancelled; ++tile_y) {
+		for (i32 tile_x = 0; tile_x < (i32)ifd->width_in_tiles; ++tile_x) {
+			i32 tile_index = tile_y * ifd->width_in_tiles + tile_x;
+			if (ifd->tile_offsets[tile_index] == 0 || ifd->tile_byte_counts[tile_index] <= 2) {
+				continue; // empty tile
+			}
+			i32 x1 = tile_x * tile_width;
+			i32 y1 = tile_y * tile_height;
+			i32 part_width = ATMOST(tile_width, width - x1);
+			i32 part_height = ATMOST(tile_height, height - y1);
+			if (part_width <= 0 || part_height <= 0) continue;
+			u8* compressed_data = get_compressed_tile_data(logical_thread_index, image, tiff_level, tile_index,
+			                                               compressed_buffer, compressed_buffer_capacity);
+			memset(tile_pixels, 0xFF, (u64)tile_pitch * tile_height);
+			if (!compressed_data || !decode_compressed_tile_scaled(logical_thread_index, ifd, compressed_data,
+			                                                       ifd->tile_byte_counts[tile_index], tile_pixels,
+			                                                       tile_pitch, scale)) {
+				// Can't tell: could be tissue.
+				for (i32 row = 0; row < part_height; ++row) {
+					memset(mask + (i64)(y1 + row) * width + x1, 1, part_width);
+				}
+				continue;
+			}
+			for (i32 row = 0; row < part_height; ++row) {
+				threshold_row(tile_pixels + (u64)row * tile_pitch, mask + (i64)(y1 + row) * width + x1, part_width);
+			}
+		}
+	}
+	free(tile_pixels);
+	if (image->is_tissue_mask_cancelled) {
+		free(mask);
+		return NULL;
+	}
+	clean_up_tissue_mask(mask, width, height);
+
+	// A summed-area table, so that any rectangle can be checked for tissue at once.
+	tissue_mask_t* tissue_mask = (tissue_mask_t*) calloc(1, sizeof(tissue_mask_t));
+	tissue_mask->width = width;
+	tissue_mask->height = height;
+	tissue_mask->um_per_pixel_x = ifd->um_per_pixel_x * (float)scale;
+	tissue_mask->um_per_pixel_y = ifd->um_per_pixel_y * (float)scale;
+	u32 pitch = width + 1;
+	u32* summed_area = (u32*) calloc((u64)pitch * (height + 1), sizeof(u32));
+	for (i32 y = 0; y < height; ++y) {
+		u32 row_sum = 0;
+		for (i32 x = 0; x < width; ++x) {
+			row_sum += mask[(i64)y * width + x];
+			summed_area[(u64)(y + 1) * pitch + (x + 1)] = summed_area[(u64)y * pitch + (x + 1)] + row_sum;
+		}
+	}
+	tissue_mask->summed_area = summed_area;
+	free(mask);
+	u32 tissue_pixel_count = summed_area[(u64)height * pitch + width];
+	printf("Tissue mask: %d x %d pixels (from level %d at 1/%d), %.0f%% tissue\n", width, height, level, scale,
+	       100.0f * (float)tissue_pixel_count / (float)ATLEAST(1, width * height));
+	return tissue_mask;
+}
+
+static void compute_tissue_mask_func(i32 logical_thread_index, void* userdata) {
+	image_t* image = (image_t*) userdata;
+	tissue_mask_t* tissue_mask = compute_tissue_mask(logical_thread_index, image);
+	if (tissue_mask) {
+		write_barrier;
+		image->tissue_mask = tissue_mask;
+	}
+	write_barrier;
+	interlocked_decrement(&image->tissue_mask_computations_in_flight); // the image may be unloaded from here on
+}
+
+// Only for TIFF images: with OpenSlide, or without coarse levels in the file, there is no mask.
+void start_tissue_mask_computation(image_t* image) {
+	if (image->type != IMAGE_TYPE_TIFF || image->channel_count > 0 || image->overlay_of_image_id != 0) {
+		return; // (fluorescence images are dark where there is no tissue, overlays are not slides)
+	}
+	interlocked_increment(&image->tissue_mask_computations_in_flight);
+	if (!add_work_queue_entry(&work_queue, compute_tissue_mask_func, image)) {
+		interlocked_decrement(&image->tissue_mask_computations_in_flight); // no mask then
+	}
+}
+
+void free_tissue_mask(image_t* image) {
+	image->is_tissue_mask_cancelled = true;
+	while (image->tissue_mask_computations_in_flight > 0) {
+		do_worker_work(&work_queue, 0);
+	}
+	read_barrier;
+	if (image->tissue_mask) {
+		free(image->tissue_mask->summed_area);
+		free(image->tissue_mask);
+		image->tissue_mask = NULL;
+	}
+}
+
+// Is there any tissue in the region (in micrometers)? Also true if this is not known.
+bool32 is_tissue_in_region(image_t* image, v2f region_min, v2f region_max) {
+	tissue_mask_t* tissue_mask = image->tissue_mask;
+	if (!tissue_mask) {
+		return true;
+	}
+	read_barrier;
+	i32 width = tissue_mask->width;
+	i32 height = tissue_mask->height;
+	i32 x1 = CLAMP((i32)floorf(region_min.x / tissue_mask->um_per_pixel_x), 0, width);
+	i32 y1 = CLAMP((i32)floorf(region_min.y / tissue_mask->um_per_pixel_y), 0, height);
+	i32 x2 = CLAMP((i32)ceilf(region_max.x / tissue_mask->um_per_pixel_x), x1, width);
+	i32 y2 = CLAMP((i32)ceilf(region_max.y / tissue_mask->um_per_pixel_y), y1, height);
+	u32* summed_area = tissue_mask->summed_area;
+	u32 pitch = width + 1;
+	u32 count = summed_area[(u64)y2 * pitch + x2] - summed_area[(u64)y1 * pitch + x2] -
+	            summed_area[(u64)y2 * pitch + x1] + summed_area[(u64)y1 * pitch + x1];
+	return count > 0;
+}
+
+bool32 is_tissue_in_tile(image_t* image, level_image_t* level_image, i32 tile_x, i32 tile_y) {
+	v2f region_min = { tile_x * level_image->x_tile_side_in_um, tile_y * level_image->y_tile_side_in_um };
+	v2f region_max = { region_min.x + level_image->x_tile_side_in_um, region_min.y + level_image->y_tile_side_in_um };
+	return is_tissue_in_region(image, region_min, region_max);
+}
@@ -21,26 +21,45 @@
 #undef MAX // these are redefined by TLSe
 
 #include <stdio.h>
+#include <ctype.h>
 #include <sys/types.h>
 #ifdef _WIN32
     #include <winsock2.h>
-    #define socklen_t int
+    #include <ws2tcpip.h>
     #define sleep(x)    Sleep(x*1000)
+    #define poll WSAPoll
 #else
     #include <sys/socket.h>
+    #include <sys/select.h>
     #include <netinet/in.h>
+    #include <netinet/tcp.h>
     #include <netdb.h> 
+    #include <fcntl.h>
+    #include <pthread.h>
+    #include <semaphore.h>
+    #include <poll.h>
 #endif
 #define LTM_DESC
 #define TLS_AMALGAMATION
 #define LTC_NO_ASM
+#define TLS_CPU_DISPATCH
 #include "tlse.c"
 
+#define TLSCLIENT_IMPL
 #include "tlsclient.h"
 #include "platform.h"
+#include "intrinsics.h"
 #include "tiff.h"
+#include "lz4.h"
+#include "disk_cache.h"
 #include "openslide_api.h" // TODO: remove/refactor, needed because of viewer.h
 #include "viewer.h"
+#include "profiler.h"
+#include "memory_stats.h"
+#include "log.h"
+#include "shard_ring.h"
+#include "slide_catalog.h"
+#include "tile_datagram.h"
 
 void error(char *msg) {
     perror(msg);
@@ -99,14 +118,29 @@ int validate_certificate(struct TLSContext *context, struct TLSCertificate **cer
 }
 
 
+// Initialized lazily, by the first thread that needs it (usually the network thread, see network_thread_proc(), so
+// that it is out of the way at startup). Other threads that need it meanwhile wait until it is done.
 void init_networking() {
-	static bool is_tls_initialized;
-	if (!is_tls_initialized) {
+	static volatile i32 init_state; // 0 = not started, 1 = in progress, 2 = done
+	if (init_state == 2) {
+		read_barrier;
+		return;
+	}
+	if (interlocked_compare_exchange(&init_state, 1, 0) != 0) {
+		while (init_state != 2) {
+			platform_sleep(1);
+		}
+		read_barrier;
+		return;
+	}
+	{
 #ifdef _WIN32
 		WSADATA wsa_data = {};
 		int err = WSAStartup(MAKEWORD(2, 2), &wsa_data);
 		if (err != 0) {
 			printf("WSAStartup failed with error: %d\n", err);
+			write_barrier;
+			init_state = 2;
 			return;
 		}
 		if (LOBYTE(wsa_data.wVersion) != 2 || HIBYTE(wsa_data.wVersion) != 2) {
@@ -119,335 +153,2760 @@ void init_networking() {
 
 		tls_init();
 
-
-		is_tls_initialized = true;
+		write_barrier;
+		init_state = 2;
 	}
 
 }
 
-// TODO: reduce stdout spam messages
-u8 *do_http_request(const char *hostname, i32 portno, const char *uri, i32 *bytes_read, i32 thread_id) {
+// Established connections are kept open after a request, so that subsequent requests to the same server
+// can skip the TCP and TLS handshakes.
+typedef struct {
+	i64 start_clock;
+	i64 last_used_clock;
+	i64 sockfd;
+	struct TLSContext* tls_context;
+	char hostname[256];
+	i32 portno;
+	u8* leftover; // bytes received beyond the end of the last response
+	i32 leftover_size;
+} tls_connection_t;
+
+#define REMOTE_CONNECTION_POOL_SIZE 16
+#define REMOTE_CONNECTION_MAX_IDLE_SECONDS 10.0f // must stay below the idle timeout of the server (see server.c)
+
+// Called with the part of the content of a response that has arrived so far (content_length is -1 if the size is not
+// known). Returning false abandons the response.
+typedef bool32 remote_response_progress_func_t(void* userdata, u8* content, i64 content_bytes_available,
+                                               i64 content_length);
+
+static tls_connection_t* idle_connections[REMOTE_CONNECTION_POOL_SIZE];
+static i32 idle_connection_count;
+static volatile i32 idle_connections_lock;
+
+static void print_socket_error(i32 thread_id, const char* prefix) {
+#ifdef _WIN32
+	int error_id = WSAGetLastError();
+	char* message_buffer;
+	/*size_t size = */FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+	                                 NULL, error_id, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&message_buffer, 0, NULL);
+	printf("[thread %d] %s: (error code 0x%x) %s\n", thread_id, prefix, (u32)error_id, message_buffer);
+	LocalFree(message_buffer);
+#else
+	printf("[thread %d] %s: %s\n", thread_id, prefix, strerror(errno));
+#endif
+}
+
+#define REMOTE_RESOLVED_HOST_COUNT 8
+#define REMOTE_ADDRESSES_PER_HOST 4
+#define REMOTE_CONNECT_TIMEOUT_SECONDS 3
+
+// Host names are looked up once, and the addresses are remembered for the rest of the session (or until none of them
+// can be connected to anymore). getaddrinfo() is thread-safe, unlike gethostbyname(), and also returns IPv6 addresses.
+typedef struct {
+	char hostname[256];
+	i32 portno;
+	i32 address_count;
+	struct sockaddr_storage addresses[REMOTE_ADDRESSES_PER_HOST];
+	i32 address_sizes[REMOTE_ADDRESSES_PER_HOST];
+} remote_host_t;
+
+static remote_host_t resolved_hosts[REMOTE_RESOLVED_HOST_COUNT];
+static i32 resolved_host_count;
+static volatile i32 resolved_hosts_lock;
+
+static bool32 resolve_remote_host(const char* hostname, i32 portno, remote_host_t* result) {
+	bool32 found = false;
+	spin_lock(&resolved_hosts_lock);
+	for (i32 i = 0; i < resolved_host_count; ++i) {
+		if (resolved_hosts[i].portno == portno && strcmp(resolved_hosts[i].hostname, hostname) == 0) {
+			*result = resolved_hosts[i];
+			found = true;
+			break;
+		}
+	}
+	spin_unlock(&resolved_hosts_lock);
+	if (found) return true;
+
+	char port_string[16];
+	snprintf(port_string, sizeof(port_string), "%d", portno);
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_protocol = IPPROTO_TCP };
+	struct addrinfo* address_list = NULL;
 	i64 start = get_clock();
-	i64 sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	int ret = getaddrinfo(hostname, port_string, &hints, &address_list);
+	if (ret != 0) {
+		printf("Error: could not resolve %s (%s)\n", hostname, gai_strerror(ret));
+		return false;
+	}
+	memset(result, 0, sizeof(*result));
+	strncpy(result->hostname, hostname, sizeof(result->hostname) - 1);
+	result->portno = portno;
+	for (struct addrinfo* info = address_list; info && result->address_count < REMOTE_ADDRESSES_PER_HOST; info = info->ai_next) {
+		if (info->ai_addrlen > sizeof(result->addresses[0])) continue;
+		memcpy(result->addresses + result->address_count, info->ai_addr, info->ai_addrlen);
+		result->address_sizes[result->address_count] = (i32)info->ai_addrlen;
+		++result->address_count;
+	}
+	freeaddrinfo(address_list);
+	printf("Resolved %s to %d address(es) in %g seconds\n", hostname, result->address_count, get_seconds_elapsed(start, get_clock()));
+	if (result->address_count == 0) return false;
 
-	if (sockfd < 0) {
-		printf("[thread %d] ERROR opening socket\n", thread_id);
-		return NULL;
+	spin_lock(&resolved_hosts_lock);
+	if (resolved_host_count < REMOTE_RESOLVED_HOST_COUNT) {
+		resolved_hosts[resolved_host_count++] = *result;
+	}
+	spin_unlock(&resolved_hosts_lock);
+	return true;
+}
+
+// Forgets the addresses, so that the next connection attempt looks up the host name again.
+static void forget_remote_host(const char* hostname, i32 portno) {
+	spin_lock(&resolved_hosts_lock);
+	for (i32 i = 0; i < resolved_host_count; ++i) {
+		if (resolved_hosts[i].portno == portno && strcmp(resolved_hosts[i].hostname, hostname) == 0) {
+			resolved_hosts[i] = resolved_hosts[--resolved_host_count];
+			break;
+		}
+	}
+	spin_unlock(&resolved_hosts_lock);
+}
+
+static void set_socket_blocking(i64 sockfd, bool32 blocking) {
+#ifdef _WIN32
+	u_long non_blocking = !blocking;
+	ioctlsocket((SOCKET)sockfd, FIONBIO, &non_blocking);
+#else
+	int flags = fcntl((int)sockfd, F_GETFL, 0);
+	fcntl((int)sockfd, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
+#endif
+}
+
+// Tries the addresses of the host in turn. The connect is non-blocking, so that an unreachable address only costs
+// REMOTE_CONNECT_TIMEOUT_SECONDS (instead of the much longer timeout of the OS) before the next one is tried.
+// Returns the connected socket (in blocking mode), or -1.
+static i64 connect_to_remote_host(const char* hostname, i32 portno) {
+	remote_host_t host;
+	if (!resolve_remote_host(hostname, portno, &host)) {
+		return -1;
 	}
-	u32 timeout_ms = 5000;
-	setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout_ms, sizeof(timeout_ms));
-	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout_ms, sizeof(timeout_ms));
-//	u32 optval = 1;
-//	setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, (char*)&optval, sizeof(optval));
-	struct hostent* server = gethostbyname(hostname);
-	if (server == NULL) {
-		printf("[thread %d] ERROR, no such host\n", thread_id);
+	for (i32 i = 0; i < host.address_count; ++i) {
+		struct sockaddr* address = (struct sockaddr*)(host.addresses + i);
+		i64 sockfd = (i64)socket(address->sa_family, SOCK_STREAM, IPPROTO_TCP);
+		if (sockfd < 0) continue;
+		set_socket_blocking(sockfd, false);
+		bool32 connected = (connect(sockfd, address, host.address_sizes[i]) == 0);
+		if (!connected) {
+			fd_set write_set, error_set;
+			FD_ZERO(&write_set);
+			FD_SET(sockfd, &write_set);
+			FD_ZERO(&error_set);
+			FD_SET(sockfd, &error_set);
+			struct timeval timeout = { .tv_sec = REMOTE_CONNECT_TIMEOUT_SECONDS };
+			if (select((int)sockfd + 1, NULL, &write_set, &error_set, &timeout) > 0 && FD_ISSET(sockfd, &write_set)) {
+				i32 socket_error = 0;
+				socklen_t length = sizeof(socket_error);
+				getsockopt(sockfd, SOL_SOCKET, SO_ERROR, (char*)&socket_error, &length);
+				connected = (socket_error == 0);
+			}
+		}
+		if (connected) {
+			set_socket_blocking(sockfd, true);
+			// Set timeout interval
+#ifdef _WIN32
+			u32 timeout_ms = 5000;
+			setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout_ms, sizeof(timeout_ms));
+			setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout_ms, sizeof(timeout_ms));
+#else
+			struct timeval io_timeout = { .tv_sec = 5 };
+			setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char*)&io_timeout, sizeof(io_timeout));
+			setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (char*)&io_timeout, sizeof(io_timeout));
+#endif
+			// Requests are small and may be sent back to back (pipelined); don't let them wait for the ACK of the previous one.
+			i32 no_delay = 1;
+			setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (char*)&no_delay, sizeof(no_delay));
+			return sockfd;
+		}
 		closesocket(sockfd);
-		sockfd = 0;
+	}
+	printf("Error: couldn't connect to %s:%d\n", hostname, portno);
+	forget_remote_host(hostname, portno); // perhaps the server has moved
+	return -1;
+}
+
+// The session ticket that the server last sent, per host, so that new connections can resume the TLS session instead
+// of doing the full handshake (saving the key exchange and the certificate; see tls_set_session_ticket()).
+typedef struct {
+	char hostname[256];
+	i32 portno;
+	i32 ticket_size;
+	u8 ticket[TLS_SESSION_TICKET_MAX_SIZE];
+} remote_session_ticket_t;
+
+static remote_session_ticket_t session_tickets[REMOTE_RESOLVED_HOST_COUNT];
+static i32 session_ticket_count;
+static volatile i32 session_tickets_lock;
+
+static void remember_session_ticket(tls_connection_t* connection) {
+	u8 ticket[TLS_SESSION_TICKET_MAX_SIZE];
+	i32 ticket_size = tls_get_session_ticket(connection->tls_context, ticket, sizeof(ticket));
+	if (ticket_size <= 0) return; // (no ticket received yet)
+	spin_lock(&session_tickets_lock);
+	i32 index = 0;
+	while (index < session_ticket_count && (session_tickets[index].portno != connection->portno ||
+	                                        strcmp(session_tickets[index].hostname, connection->hostname) != 0)) {
+		++index;
+	}
+	if (index == session_ticket_count && session_ticket_count < REMOTE_RESOLVED_HOST_COUNT) {
+		++session_ticket_count;
+	}
+	if (index < session_ticket_count) {
+		remote_session_ticket_t* entry = session_tickets + index;
+		strncpy(entry->hostname, connection->hostname, sizeof(entry->hostname) - 1);
+		entry->portno = connection->portno;
+		memcpy(entry->ticket, ticket, ticket_size);
+		entry->ticket_size = ticket_size;
+	}
+	spin_unlock(&session_tickets_lock);
+}
+
+static void forget_session_ticket(const char* hostname, i32 portno) {
+	spin_lock(&session_tickets_lock);
+	for (i32 i = 0; i < session_ticket_count; ++i) {
+		if (session_tickets[i].portno == portno && strcmp(session_tickets[i].hostname, hostname) == 0) {
+			session_tickets[i] = session_tickets[--session_ticket_count];
+			break;
+		}
+	}
+	spin_unlock(&session_tickets_lock);
+}
+
+static void offer_session_ticket(struct TLSContext* context, const char* hostname, i32 portno) {
+	spin_lock(&session_tickets_lock);
+	for (i32 i = 0; i < session_ticket_count; ++i) {
+		if (session_tickets[i].portno == portno && strcmp(session_tickets[i].hostname, hostname) == 0) {
+			tls_set_session_ticket(context, session_tickets[i].ticket, session_tickets[i].ticket_size);
+			break;
+		}
+	}
+	spin_unlock(&session_tickets_lock);
+}
+
+float close_remote_connection(tls_connection_t* connection) {
+	if (tls_established(connection->tls_context)) {
+		remember_session_ticket(connection);
+	}
+	tls_destroy_context(connection->tls_context);
+	closesocket(connection->sockfd);
+
+	float seconds_elapsed = get_seconds_elapsed(connection->start_clock, get_clock());
+	free(connection->leftover);
+	free(connection);
+	return seconds_elapsed;
+}
+
+// Connects to the server and completes the TLS handshake, so that the connection is ready for requests.
+tls_connection_t* open_remote_connection(const char* hostname, i32 portno) {
+	init_networking();
+	tls_connection_t* connection = (tls_connection_t*) calloc(1, sizeof(tls_connection_t));
+	connection->start_clock = get_clock();
+	connection->last_used_clock = connection->start_clock;
+	strncpy(connection->hostname, hostname, sizeof(connection->hostname) - 1);
+	connection->portno = portno;
+	connection->sockfd = connect_to_remote_host(hostname, portno);
+	if (connection->sockfd < 0) {
+		free(connection);
 		return NULL;
 	}
-	struct sockaddr_in serv_addr = { .sin_family = AF_INET };
-	memcpy((char *)&serv_addr.sin_addr.s_addr, (char *)server->h_addr, server->h_length);
-	serv_addr.sin_port = htons(portno);
-	if (connect(sockfd,(struct sockaddr *)&serv_addr,sizeof(serv_addr)) < 0) {
-		printf("[thread %d] ERROR connecting\n", thread_id);
-		closesocket(sockfd);
-		sockfd = 0;
+	connection->tls_context = tls_create_context(0, TLS_V13);
+	if (!connection->tls_context) {
+		printf("Error: couldn't create TLS context\n");
+		closesocket(connection->sockfd);
+		free(connection);
 		return NULL;
 	}
-	struct TLSContext* tls_context = tls_create_context(0, TLS_V13);
 	// the next line is needed only if you want to serialize the connection context or kTLS is used
 //	tls_make_exportable(tls_context, 1);
-	int ret = tls_client_connect(tls_context);
+	offer_session_ticket(connection->tls_context, hostname, portno);
+	int ret = tls_client_connect(connection->tls_context);
 	if (ret < 0) {
-		printf("[thread %d] tls_client_connect() failed with error %d\n", thread_id, ret);
+		printf("tls_client_connect() failed with error %d\n", ret);
 	}
-//	printf("TLS boilerplate is done in %g seconds\n", get_seconds_elapsed(start, get_clock()));
-	ret = send_pending(sockfd, tls_context);
-	if (ret < 0) {
-		printf("[thread %d] send_pending() returned error %d\n", thread_id, ret);
+	send_pending(connection->sockfd, connection->tls_context);
+
+	u8 receive_buffer[0xFFFF];
+	while (!tls_established(connection->tls_context)) {
+		i32 receive_size = recv(connection->sockfd, (char*)receive_buffer, sizeof(receive_buffer), 0);
+		if (receive_size <= 0 ||
+		    tls_consume_stream(connection->tls_context, receive_buffer, receive_size, validate_certificate) < 0) {
+			printf("Error: TLS handshake with %s:%d failed\n", hostname, portno);
+			forget_session_ticket(hostname, portno); // (in case the server no longer accepts it)
+			close_remote_connection(connection);
+			return NULL;
+		}
+		send_pending(connection->sockfd, connection->tls_context);
 	}
+//	printf("TLS boilerplate is done in %g seconds\n", get_seconds_elapsed(connection->start_clock, get_clock()));
+	return connection;
+}
 
-	u8 receive_buffer[0xFFFF]; // receive in 64K byte chunks
-	i32 receive_size;
-	i32 sent = 0;
-
-	i32 read_buffer_size = MEGABYTES(2); // TODO: reallocate if necessary
-	u8* read_buffer = calloc(read_buffer_size, 1);
-	u8* read_buffer_pos = read_buffer;
-	i32 total_bytes_read = 0;
+static void wake_remote_connector();
 
+// Takes an idle connection to the server out of the pool, if there is one that is still fresh enough.
+static tls_connection_t* get_idle_remote_connection(const char* hostname, i32 portno) {
+	wake_remote_connector(); // to replace the connection we are about to take (or to open one for next time)
 	for (;;) {
-		receive_size = recv(sockfd, (char*)receive_buffer, sizeof(receive_buffer), 0);
-		if (receive_size < 0) {
-			int error_id = WSAGetLastError();
-			char* prefix = "do_http_request";
-			char* message_buffer;
-			/*size_t size = */FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-			                                 NULL, error_id, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&message_buffer, 0, NULL);
-			printf("[thread %d] %s: (error code 0x%x) %s\n", thread_id, prefix, (u32)error_id, message_buffer);
-			LocalFree(message_buffer);
-			break;
-		} else if (receive_size == 0) {
-			printf("[thread %d] Gracefully closed\n", thread_id);
-			break;
-		}
-		ret = tls_consume_stream(tls_context, receive_buffer, receive_size, validate_certificate);
-		if (ret < 0) {
-			printf("[thread %d] tls_consume_stream() returned error %d\n", thread_id, ret);
-		}
-		send_pending(sockfd, tls_context);
-		if (tls_established(tls_context)) {
-			if (!sent) {
-				static const char requestfmt[] = "GET %s HTTP/1.1\r\nConnection: close\r\n\r\n";
-				char request[4096];
-				snprintf(request, sizeof(request), requestfmt, uri);
-				size_t request_len = strlen(request);
-
-				// try kTLS (kernel TLS implementation in linux >= 4.13)
-				// note that you can use send on a ktls socket
-				// recv must be handled by TLSe
-				if (!tls_make_ktls(tls_context, sockfd)) {
-					// call send as on regular TCP sockets
-					// TLS record layer is handled by the kernel
-					send(sockfd, request, request_len, 0);
-				} else {
-					tls_write(tls_context, (unsigned char *)request, request_len);
-					send_pending(sockfd, tls_context);
-				}
-				sent = 1;
-			}
-
-			// TODO: use realloc to resize read buffer if needed?
-			i32 read_size = tls_read(tls_context, read_buffer_pos, read_buffer_size - total_bytes_read - 1);
-			if (read_size > 0) {
-//				fwrite(read_buffer, read_size, 1, stdout);
-				read_buffer_pos += read_size;
-				total_bytes_read += read_size;
+		tls_connection_t* connection = NULL;
+		spin_lock(&idle_connections_lock);
+		for (i32 i = idle_connection_count - 1; i >= 0; --i) {
+			if (idle_connections[i]->portno == portno && strcmp(idle_connections[i]->hostname, hostname) == 0) {
+				connection = idle_connections[i];
+				idle_connections[i] = idle_connections[--idle_connection_count];
+				break;
 			}
+		}
+		spin_unlock(&idle_connections_lock);
 
+		if (!connection) {
+			return NULL;
+		} else if (get_seconds_elapsed(connection->last_used_clock, get_clock()) > REMOTE_CONNECTION_MAX_IDLE_SECONDS) {
+			close_remote_connection(connection); // the server may already have hung up; try the next one
+		} else {
+			return connection;
 		}
 	}
-	*bytes_read = total_bytes_read;
-
-	// now we should have the whole HTTP response
-	printf("[thread %d] HTTP read finished, length = %d\n", thread_id, total_bytes_read);
-//	fwrite(read_buffer, total_bytes_read, 1, stdout);
+}
 
+static void put_idle_remote_connection(tls_connection_t* connection) {
+	connection->last_used_clock = get_clock();
+	remember_session_ticket(connection);
+	bool32 added = false;
+	spin_lock(&idle_connections_lock);
+	if (idle_connection_count < REMOTE_CONNECTION_POOL_SIZE) {
+		idle_connections[idle_connection_count++] = connection;
+		added = true;
+	}
+	spin_unlock(&idle_connections_lock);
+	if (!added) {
+		close_remote_connection(connection);
+	}
+}
 
-	tls_destroy_context(tls_context);
-	closesocket(sockfd);
+#define REMOTE_SPARE_CONNECTIONS 2
+#define REMOTE_CONNECTOR_MAX_OTHER_HOSTS 8
+#define REMOTE_CONNECTOR_OTHER_HOST_MAX_IDLE_SECONDS 30.0f
 
-	float seconds_elapsed = get_seconds_elapsed(start, get_clock());
-	printf("[thread %d] Open remote took %g seconds\n", thread_id, seconds_elapsed);
+// The connector thread keeps a few connections to the slide server ready in the pool (with the TCP and TLS handshakes
+// already done), so that the workers loading tiles don't have to sit through the handshakes themselves. Other servers
+// (mirrors, or the nodes that the slides are on) get connections too, for as long as downloads keep asking for them.
+typedef struct {
+	char hostname[256];
+	i32 portno;
+	i64 wanted_clock; // the last time a download asked for a connection to this server
+} remote_connector_host_t;
+
+static char connector_hostname[256];
+static i32 connector_portno;
+static remote_connector_host_t connector_other_hosts[REMOTE_CONNECTOR_MAX_OTHER_HOSTS];
+static i32 connector_other_host_count;
+static volatile i32 connector_lock;
+static bool32 is_connector_started;
+#ifdef _WIN32
+static HANDLE connector_semaphore;
+#else
+static sem_t connector_semaphore;
+#endif
 
-	return read_buffer;
+static i32 count_idle_remote_connections(const char* hostname, i32 portno) {
+	i32 count = 0;
+	spin_lock(&idle_connections_lock);
+	for (i32 i = 0; i < idle_connection_count; ++i) {
+		if (idle_connections[i]->portno == portno && strcmp(idle_connections[i]->hostname, hostname) == 0) {
+			++count;
+		}
+	}
+	spin_unlock(&idle_connections_lock);
+	return count;
 }
 
+static void open_wanted_remote_datagram_sessions();
+
+static void remote_connector_loop() {
+	for (;;) {
+#ifdef _WIN32
+		WaitForSingleObject(connector_semaphore, INFINITE);
+#else
+		while (sem_wait(&connector_semaphore) != 0) {} // retry if interrupted
+#endif
+		remote_connector_host_t hosts[1 + REMOTE_CONNECTOR_MAX_OTHER_HOSTS];
+		i32 host_count = 0;
+		spin_lock(&connector_lock);
+		if (connector_hostname[0] != '\0') {
+			memcpy(hosts[0].hostname, connector_hostname, sizeof(hosts[0].hostname));
+			hosts[0].portno = connector_portno;
+			host_count = 1;
+		}
+		for (i32 i = 0; i < connector_other_host_count; ++i) {
+			if (get_seconds_elapsed(connector_other_hosts[i].wanted_clock, get_clock())
+			    < REMOTE_CONNECTOR_OTHER_HOST_MAX_IDLE_SECONDS) {
+				hosts[host_count++] = connector_other_hosts[i];
+			}
+		}
+		spin_unlock(&connector_lock);
 
-u8 *download_remote_chunk(const char *hostname, i32 portno, const char *filename, i64 chunk_offset, i64 chunk_size,
-                          i32 *bytes_read, i32 thread_id) {
+		for (i32 i = 0; i < host_count; ++i) {
+			while (count_idle_remote_connections(hosts[i].hostname, hosts[i].portno) < REMOTE_SPARE_CONNECTIONS) {
+				tls_connection_t* connection = open_remote_connection(hosts[i].hostname, hosts[i].portno);
+				if (!connection) break; // try again the next time we are woken up
+				put_idle_remote_connection(connection);
+			}
+		}
+		open_wanted_remote_datagram_sessions();
+	}
+}
 
-	char uri[2048] = {0};
-	snprintf(uri, sizeof(uri), "/slide/%s/%lld/%lld", filename, chunk_offset, chunk_size);
-	u8* read_buffer = do_http_request(hostname, portno, uri, bytes_read, thread_id);
-	return read_buffer;
+#ifdef _WIN32
+static DWORD WINAPI remote_connector_thread_proc(LPVOID parameter) {
+	remote_connector_loop();
+	return 0;
+}
+#else
+static void* remote_connector_thread_proc(void* parameter) {
+	remote_connector_loop();
+	return NULL;
+}
+#endif
 
+static void wake_remote_connector() {
+	if (!is_connector_started) return;
+#ifdef _WIN32
+	ReleaseSemaphore(connector_semaphore, 1, NULL);
+#else
+	sem_post(&connector_semaphore);
+#endif
 }
 
-u8 *download_remote_batch(const char *hostname, i32 portno, const char *filename, i64 *chunk_offsets, i64 *chunk_sizes,
-                          i32 batch_size, i32 *bytes_read, i32 thread_id) {
-	ASSERT(batch_size > 0);
-	char uri[4092] = {0};
-	char* pos = uri;
-	i32 bytes_printed = snprintf(uri, sizeof(uri), "/slide/%s", filename);
-	pos += bytes_printed;
-	i32 bytes_left = sizeof(uri) - bytes_printed;
-	for (i32 i = 0; i < batch_size; ++i) {
-		if (bytes_left <= 0) {
-			ASSERT(!"uri became too long");
-			return NULL;
-		}
-		bytes_printed += snprintf(pos, bytes_left, "/%lld/%lld", chunk_offsets[i], chunk_sizes[i]);
-		pos = uri + bytes_printed;
-		bytes_left = sizeof(uri) - bytes_printed;
+static void start_remote_connector() {
+	spin_lock(&connector_lock);
+	if (!is_connector_started) {
+#ifdef _WIN32
+		connector_semaphore = CreateSemaphoreA(NULL, 0, INT32_MAX, NULL);
+		HANDLE thread_handle = CreateThread(NULL, 0, remote_connector_thread_proc, NULL, 0, NULL);
+		CloseHandle(thread_handle);
+#else
+		sem_init(&connector_semaphore, 0, 0);
+		pthread_t thread;
+		pthread_create(&thread, NULL, remote_connector_thread_proc, NULL);
+		pthread_detach(thread);
+#endif
+		is_connector_started = true;
 	}
-	u8* read_buffer = do_http_request(hostname, portno, uri, bytes_read, thread_id);
-	return read_buffer;
+	spin_unlock(&connector_lock);
 }
 
-typedef struct {
-	i64 start_clock;
-	i64 sockfd;
-	struct TLSContext* tls_context;
-} tls_connection_t;
+// From now on, keep connections to this server ready (see remote_connector_loop()). Called from the main thread.
+void keep_remote_connections_ready(const char* hostname, i32 portno) {
+	spin_lock(&connector_lock);
+	strncpy(connector_hostname, hostname, sizeof(connector_hostname) - 1);
+	connector_portno = portno;
+	spin_unlock(&connector_lock);
+	start_remote_connector();
+	wake_remote_connector();
+}
 
-tls_connection_t* open_remote_connection(const char* hostname, i32 portno, void* alloced_mem_for_struct) {
-	tls_connection_t* connection = (tls_connection_t*) alloced_mem_for_struct;
-	if (connection) {
-		memset(connection, 0, sizeof(*connection));
-		connection->start_clock = get_clock();
-		connection->sockfd = socket(AF_INET, SOCK_STREAM, 0);
-		if (connection->sockfd < 0) {
-			printf("ERROR opening socket\n");
-			return NULL;
-		}
-		// Set timeout interval
-		u32 timeout_ms = 2000;
-		setsockopt(connection->sockfd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout_ms, sizeof(timeout_ms));
-		setsockopt(connection->sockfd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout_ms, sizeof(timeout_ms));
-		struct hostent* server = gethostbyname(hostname);
-		if (server == NULL) {
-			printf("ERROR, no such host\n");
-			closesocket(connection->sockfd);
-			connection->sockfd = 0;
-			return NULL;
+// For a while, also keep connections ready to another server (called by the network thread, if a download had to
+// wait for a connection).
+static void want_remote_connections(const char* hostname, i32 portno) {
+	spin_lock(&connector_lock);
+	remote_connector_host_t* host = NULL;
+	for (i32 i = 0; i < connector_other_host_count && !host; ++i) {
+		if (connector_other_hosts[i].portno == portno && strcmp(connector_other_hosts[i].hostname, hostname) == 0) {
+			host = connector_other_hosts + i;
 		}
-		struct sockaddr_in serv_addr = { .sin_family = AF_INET };
-		memcpy((char *)&serv_addr.sin_addr.s_addr, (char *)server->h_addr, server->h_length);
-		serv_addr.sin_port = htons((u16)portno);
-		if (connect(connection->sockfd,(struct sockaddr *)&serv_addr,sizeof(serv_addr)) < 0) {
-			printf("Error: couldn't connect to %s:%d\n", hostname, portno);
-			closesocket(connection->sockfd);
-			connection->sockfd = 0;
-			return NULL;
+	}
+	if (!host) {
+		if (connector_other_host_count < REMOTE_CONNECTOR_MAX_OTHER_HOSTS) {
+			host = connector_other_hosts + connector_other_host_count++;
+		} else {
+			host = connector_other_hosts;
+			for (i32 i = 1; i < connector_other_host_count; ++i) {
+				if (connector_other_hosts[i].wanted_clock < host->wanted_clock) host = connector_other_hosts + i;
+			}
 		}
-		connection->tls_context = tls_create_context(0, TLS_V13);
-		if (!connection->tls_context) {
-			printf("Error: couldn't create TLS context\n");
+		memset(host, 0, sizeof(*host));
+		strncpy(host->hostname, hostname, sizeof(host->hostname) - 1);
+		host->portno = portno;
+	}
+	host->wanted_clock = get_clock();
+	spin_unlock(&connector_lock);
+	start_remote_connector();
+	wake_remote_connector();
+}
+
+// Returns a pointer to the value of a header field (case-insensitive name), or NULL if the field is absent.
+static const char* find_http_header_field(const u8* headers, i64 headers_size, const char* name) {
+	i64 name_len = (i64)strlen(name);
+	for (i64 line_start = 0; line_start + name_len < headers_size; ++line_start) {
+		if (line_start > 0 && headers[line_start - 1] != '\n') continue;
+		i64 i = 0;
+		while (i < name_len && tolower(headers[line_start + i]) == tolower((u8)name[i])) ++i;
+		if (i == name_len && headers[line_start + name_len] == ':') {
+			const char* value = (const char*)headers + line_start + name_len + 1;
+			while (*value == ' ' || *value == '\t') ++value;
+			return value;
 		}
-		// the next line is needed only if you want to serialize the connection context or kTLS is used
-//	tls_make_exportable(tls_context, 1);
-		tls_client_connect(connection->tls_context);
-//	printf("TLS boilerplate is done in %g seconds\n", get_seconds_elapsed(start, get_clock()));
-		send_pending(connection->sockfd, connection->tls_context);
 	}
+	return NULL;
+}
 
-	return connection;
+static i32 get_http_status(const u8* headers, i64 headers_size) {
+	if (headers_size < 12 || strncmp((const char*)headers, "HTTP/1.", 7) != 0) return 0;
+	return atoi((const char*)headers + 9);
 }
 
-float close_remote_connection(tls_connection_t* connection) {
-	tls_destroy_context(connection->tls_context);
-	closesocket(connection->sockfd);
+static inline bool32 is_http_status_ok(i32 status) {
+	return status == 200 || status == 206;
+}
 
-	float seconds_elapsed = get_seconds_elapsed(connection->start_clock, get_clock());
-	return seconds_elapsed;
+static bool32 remote_send_request(tls_connection_t* connection, const char* request, i32 request_len) {
+	return tls_write(connection->tls_context, (unsigned char *)request, request_len) >= 0 &&
+	       send_pending(connection->sockfd, connection->tls_context) >= 0;
 }
 
-bool32 remote_request(tls_connection_t* connection, const char* request, i32 request_len, mem_t* mem_buffer) {
-	// TODO: refactor
+typedef struct {
+	u8* buffer;         // the headers, followed by the content (unless it was received into the caller's destination)
+	i64 header_size;
+	u8* content;        // points into buffer, or to the caller's destination
+	i64 content_length;
+	i32 status;
+	bool32 is_ok;       // status 200 (or 206 for a Range request)
+	bool32 is_reusable; // another request can be sent over the same connection
+	bool32 received_anything;
+} remote_response_t;
+
+// Reads the next response from the connection. The headers are parsed as they come in. Once the Content-length is
+// known, the content is received straight into content_dest (if given and large enough), or else into a buffer that
+// gets sized once. Without a Content-length, the content is read until the server hangs up.
+// If progress_func is given, it is called with the part of the content that has arrived so far, every time more
+// comes in. (Only for successful responses; the content pointer is valid for the duration of the call.)
+// Returns false if the response is incomplete (or was abandoned by progress_func). Otherwise, the caller needs to free response->buffer.
+static bool32 remote_receive_response(tls_connection_t* connection, u8* content_dest, i64 content_dest_capacity,
+                                      remote_response_progress_func_t* progress_func, void* progress_userdata,
+                                      remote_response_t* response, i32 thread_id) {
+	memset(response, 0, sizeof(*response));
 	u8 receive_buffer[0xFFFF]; // receive in 64K byte chunks
-	i32 receive_size;
-	i32 sent = 0;
+	i64 buffer_capacity = MAX(KILOBYTES(16), connection->leftover_size);
+	u8* buffer = malloc(buffer_capacity + 1);
+	i64 buffer_size = 0;
+	if (connection->leftover_size > 0) {
+		// The start of this response already came in together with the previous one.
+		memcpy(buffer, connection->leftover, connection->leftover_size);
+		buffer_size = connection->leftover_size;
+		free(connection->leftover);
+		connection->leftover = NULL;
+		connection->leftover_size = 0;
+	}
+	i64 header_size = 0;
+	i64 header_scan_start = 0;
+	i64 content_length = -1;
+	u8* content = NULL;
+	i64 content_received = 0;
+	i64 content_reported = 0;
+	i32 status = 0;
+	bool32 keep_alive = false;
+	bool32 complete = false;
+	bool32 received_anything = (buffer_size > 0);
 
-	u8* read_buffer_pos = mem_buffer->data;
-	i32 total_bytes_read = 0;
+	for (;;) {
+		// Take out whatever TLSe has already decrypted.
+		if (header_size == 0) {
+			// Until the headers are complete we don't know where the content should go, so take small steps.
+			for (;;) {
+				i64 end_of_headers = find_end_of_http_headers(buffer + header_scan_start, buffer_size - header_scan_start);
+				if (end_of_headers > 0) {
+					header_size = header_scan_start + end_of_headers;
+					break;
+				}
+				header_scan_start = MAX(0, buffer_size - 3);
+				if (buffer_size + KILOBYTES(4) > buffer_capacity) {
+					buffer_capacity *= 2;
+					buffer = realloc(buffer, buffer_capacity + 1);
+				}
+				i32 read_size = tls_read(connection->tls_context, buffer + buffer_size, KILOBYTES(4));
+				if (read_size <= 0) break;
+				buffer_size += read_size;
+				received_anything = true;
+			}
 
-	while ((receive_size = recv(connection->sockfd, (char*)receive_buffer, sizeof(receive_buffer), 0)) > 0) {
-		tls_consume_stream(connection->tls_context, receive_buffer, receive_size, validate_certificate);
-		send_pending(connection->sockfd, connection->tls_context);
-		if (tls_established(connection->tls_context)) {
-			if (!sent) {
-
-				// try kTLS (kernel TLS implementation in linux >= 4.13)
-				// note that you can use send on a ktls socket
-				// recv must be handled by TLSe
-				if (!tls_make_ktls(connection->tls_context, connection->sockfd)) {
-					// call send as on regular TCP sockets
-					// TLS record layer is handled by the kernel
-					send(connection->sockfd, request, request_len, 0);
+			if (header_size > 0) {
+				status = get_http_status(buffer, header_size);
+				const char* value = find_http_header_field(buffer, header_size, "Content-length");
+				content_length = value ? atoll(value) : -1;
+				value = find_http_header_field(buffer, header_size, "Connection");
+				keep_alive = (content_length >= 0) && !(value && strncmp(value, "close", 5) == 0);
+
+				i64 body_bytes = buffer_size - header_size;
+				if (content_length >= 0) {
+					content_received = MIN(body_bytes, content_length);
+					if (body_bytes > content_length) {
+						// Keep the bytes that belong to the next (pipelined) response.
+						connection->leftover_size = (i32)(body_bytes - content_length);
+						connection->leftover = malloc(connection->leftover_size);
+						memcpy(connection->leftover, buffer + header_size + content_length, connection->leftover_size);
+					}
+					if (content_dest && content_length <= content_dest_capacity) {
+						content = content_dest;
+						memcpy(content, buffer + header_size, content_received);
+						buffer_size = header_size;
+					} else {
+						buffer_capacity = header_size + content_length;
+						buffer = realloc(buffer, buffer_capacity + 1);
+						content = buffer + header_size;
+						buffer_size = header_size + content_received;
+					}
 				} else {
-					tls_write(connection->tls_context, (unsigned char *)request, request_len);
-					send_pending(connection->sockfd, connection->tls_context);
+					content_received = body_bytes;
 				}
-				sent = 1;
 			}
+		}
 
-			// TODO: use realloc to resize read buffer if needed?
-			i32 read_size = tls_read(connection->tls_context, read_buffer_pos, mem_buffer->capacity - total_bytes_read - 1);
-			if (read_size > 0) {
-//				fwrite(read_buffer, read_size, 1, stdout);
-				read_buffer_pos += read_size;
-				total_bytes_read += read_size;
+		if (header_size > 0) {
+			if (content_length >= 0) {
+				while (content_received < content_length) {
+					u32 bytes_wanted = (u32)MIN(content_length - content_received, INT32_MAX);
+					i32 read_size = tls_read(connection->tls_context, content + content_received, bytes_wanted);
+					if (read_size <= 0) break;
+					content_received += read_size;
+				}
+			} else {
+				for (;;) {
+					if (buffer_size == buffer_capacity) {
+						buffer_capacity *= 2;
+						buffer = realloc(buffer, buffer_capacity + 1);
+					}
+					i32 read_size = tls_read(connection->tls_context, buffer + buffer_size, (u32)MIN(buffer_capacity - buffer_size, INT32_MAX));
+					if (read_size <= 0) break;
+					buffer_size += read_size;
+					content_received += read_size;
+				}
+				content = buffer + header_size;
 			}
+			if (progress_func && is_http_status_ok(status) && content_received > content_reported) {
+				if (!progress_func(progress_userdata, content, content_received, content_length)) break;
+				content_reported = content_received;
+			}
+			if (content_length >= 0 && content_received == content_length) {
+				complete = true;
+				break;
+			}
+		}
 
+		i32 receive_size = recv(connection->sockfd, (char*)receive_buffer, sizeof(receive_buffer), 0);
+		if (receive_size < 0) {
+			print_socket_error(thread_id, "remote_receive_response");
+			break;
+		} else if (receive_size == 0) {
+			// Without a Content-length, the server hanging up marks the end of the response.
+			complete = (header_size > 0 && content_length < 0);
+			break;
+		}
+		if (tls_consume_stream(connection->tls_context, receive_buffer, receive_size, validate_certificate) < 0) {
+			printf("[thread %d] tls_consume_stream() failed\n", thread_id);
+			break;
 		}
+		send_pending(connection->sockfd, connection->tls_context);
 	}
 
-	mem_buffer->len = (size_t)total_bytes_read;
-	return (sent && total_bytes_read > 0);
+	// Note: a close_notify from a server that timed out the idle connection doesn't count as a response.
+	response->received_anything = received_anything || (content_received > 0);
+	if (!complete) {
+		free(buffer);
+		return false;
+	}
+	buffer[buffer_size] = '\0';
+	response->buffer = buffer;
+	response->header_size = header_size;
+	response->content = (content_length >= 0) ? content : buffer + header_size;
+	response->content_length = content_received;
+	response->status = status;
+	response->is_ok = is_http_status_ok(status);
+	response->is_reusable = keep_alive;
+	return true;
 }
 
-mem_t* download_remote_caselist(const char *hostname, i32 portno, const char *filename) {
-	mem_t* result = NULL;
+// Sends a GET request over a pooled connection (or a new one) and reads the response.
+// If content_dest is given, the content will be received into it, if it fits. The extra_header_fields (if any) need
+// to end with \r\n. For progress_func, see remote_receive_response().
+static bool32 remote_get_with_header_fields(const char* hostname, i32 portno, const char* uri, const char* extra_header_fields,
+                                            u8* content_dest, i64 content_dest_capacity,
+                                            remote_response_progress_func_t* progress_func, void* progress_userdata,
+                                            remote_response_t* response, i32 thread_id) {
+	i64 start = get_clock();
 
-	tls_connection_t* connection = open_remote_connection(hostname, portno, alloca(sizeof(tls_connection_t)));
-	if (connection) {
+	static const char requestfmt[] = "GET %s HTTP/1.1\r\nHost: %s\r\n%sConnection: keep-alive\r\n\r\n";
+	char request[4096];
+	snprintf(request, sizeof(request), requestfmt, uri, hostname, extra_header_fields ? extra_header_fields : "");
+	i32 request_len = (i32)strlen(request);
 
-		static const char requestfmt[] = "GET /slide_set/%s HTTP/1.1\r\nConnection: close\r\n\r\n";
-		char request[4096];
-		snprintf(request, sizeof(request), requestfmt, filename);
-		i32 request_len = (i32)strlen(request);
+	bool32 success = false;
+	memset(response, 0, sizeof(*response));
+	bool32 is_reused = false;
+	for (i32 attempt = 0; attempt < 2; ++attempt) {
+		// On the second attempt always start over with a new connection.
+		tls_connection_t* connection = (attempt == 0) ? get_idle_remote_connection(hostname, portno) : NULL;
+		is_reused = (connection != NULL);
+		if (!connection) {
+			connection = open_remote_connection(hostname, portno);
+			if (!connection) break;
+		}
 
-		mem_t* mem_buffer = platform_allocate_mem_buffer(MEGABYTES(2));
-		bool32 read_ok = remote_request(connection, request, request_len, mem_buffer);
-		float seconds_elapsed = close_remote_connection(connection);
-		if (read_ok) {
-			result = mem_buffer; // don't free (ownership passes to caller)
-			printf("Downloaded case list '%s' in %g seconds.\n", filename, seconds_elapsed);
+		success = remote_send_request(connection, request, request_len) &&
+		          remote_receive_response(connection, content_dest, content_dest_capacity, progress_func, progress_userdata,
+		                                  response, thread_id);
+		if (success && response->is_reusable) {
+			put_idle_remote_connection(connection);
 		} else {
-			free(mem_buffer);
+			close_remote_connection(connection);
 		}
+
+		// If a pooled connection fails before anything came back, the server most likely closed it
+		// while it was idle. GET requests are safe to repeat, so retry once.
+		if (success || !is_reused || response->received_anything) break;
 	}
 
-	return result;
+	// (Not Modified only comes back for a conditional request; then the caller already has the content.)
+	if (success && !response->is_ok && response->status != 304) {
+		log_warning("[thread %d] Request %s failed: %.*s\n", thread_id, uri, (i32)strcspn((char*)response->buffer, "\r\n"), response->buffer);
+		free(response->buffer);
+		response->buffer = NULL;
+		success = false;
+	}
+
+	if (success) {
+		// now we should have the whole HTTP response
+		log_debug("[thread %d] HTTP read finished, length = %lld%s\n", thread_id, response->content_length, is_reused ? " (reused connection)" : "");
+	}
+
+	float seconds_elapsed = get_seconds_elapsed(start, get_clock());
+	log_debug("[thread %d] Open remote took %g seconds\n", thread_id, seconds_elapsed);
+
+	return success;
 }
 
-bool32 open_remote_slide(app_state_t *app_state, const char *hostname, i32 portno, const char *filename) {
+static bool32 remote_get(const char* hostname, i32 portno, const char* uri, u8* content_dest, i64 content_dest_capacity,
+                         remote_response_t* response, i32 thread_id) {
+	return remote_get_with_header_fields(hostname, portno, uri, NULL, content_dest, content_dest_capacity, NULL, NULL,
+	                                     response, thread_id);
+}
 
-	bool32 success = false;
+// Slides on a regular web server (or in object storage behind one) are read with HTTP Range requests, for the path of
+// the file on the server. Note: one range per request; not every server supports multiple ranges in a request (S3
+// doesn't), and pipelined single-range requests do nearly as well.
+static void get_range_request_uri(char* uri, size_t uri_size, const char* filename) {
+	snprintf(uri, uri_size, "%s%s", filename[0] == '/' ? "" : "/", filename);
+}
 
-	static const char requestfmt[] = "GET /slide/%s/header HTTP/1.1\r\nConnection: close\r\n\r\n";
-	char request[4096];
-	snprintf(request, sizeof(request), requestfmt, filename);
-	i32 request_len = (i32)strlen(request);
+typedef struct {
+	i64 filesize;
+	char validator[256]; // ETag or Last-Modified, to tell whether the file has changed since an earlier session
+} remote_range_info_t;
+
+static void copy_http_header_value(char* dest, size_t dest_size, const char* value) {
+	size_t len = 0;
+	while (value[len] && value[len] != '\r' && value[len] != '\n' && len + 1 < dest_size) ++len;
+	memcpy(dest, value, len);
+	dest[len] = '\0';
+}
 
-	tls_connection_t* connection = open_remote_connection(hostname, portno, alloca(sizeof(tls_connection_t)));
-	if (!connection) {
-		return false;
+// Downloads a range of the file with a Range request. Returns the number of bytes received, or -1 if it failed. That
+// can be less than size at the end of the file. If info is given, it gets the size of the whole file.
+static i64 remote_get_range(const char* hostname, i32 portno, const char* uri, i64 offset, i64 size, u8* dest,
+                            remote_range_info_t* info, i32 thread_id) {
+	char range_field[96];
+	snprintf(range_field, sizeof(range_field), "Range: bytes=%lld-%lld\r\n", offset, offset + size - 1);
+	remote_response_t response;
+	i64 result = -1;
+	if (remote_get_with_header_fields(hostname, portno, uri, range_field, dest, size, NULL, NULL, &response, thread_id)) {
+		// A server that doesn't do ranges sends the whole file (status 200), that's no use to us.
+		const char* content_range = find_http_header_field(response.buffer, response.header_size, "Content-range");
+		const char* total_size = content_range ? strchr(content_range, '/') : NULL;
+		if (response.status == 206 && response.content == dest && response.content_length <= size && total_size) {
+			result = response.content_length;
+			if (info) {
+				info->filesize = atoll(total_size + 1);
+				const char* validator = find_http_header_field(response.buffer, response.header_size, "ETag");
+				if (!validator) validator = find_http_header_field(response.buffer, response.header_size, "Last-modified");
+				copy_http_header_value(info->validator, sizeof(info->validator), validator ? validator : "");
+			}
+		} else {
+			printf("[thread %d] %s:%d does not support Range requests for %s\n", thread_id, hostname, portno, uri);
+		}
+		free(response.buffer);
 	}
+	return result;
+}
 
-	mem_t* mem_buffer = platform_allocate_mem_buffer(MEGABYTES(2));
-	bool32 read_ok = remote_request(connection, request, request_len, mem_buffer);
-	float seconds_elapsed = close_remote_connection(connection);
-
-	if (read_ok) {
-		// now we should have the whole HTTP response
-		printf("HTTP read finished, length = %d\n", mem_buffer->len);
-//	fwrite(read_buffer, total_bytes_read, 1, stdout);
+// The TIFF header and IFDs are parsed on our side, through this reader (see open_tiff_with_range_reader()). Small
+// reads are done in blocks that are kept around, so that reading the many small tags doesn't take a round trip each.
+#define REMOTE_RANGE_BLOCK_SIZE KILOBYTES(64)
+#define REMOTE_RANGE_CACHED_BLOCK_COUNT 32
 
-		tiff_t tiff = {0};
-		if (tiff_deserialize(&tiff, mem_buffer->data, mem_buffer->len)) {
-			tiff.is_remote = true;
-			tiff.location = (network_location_t){ .hostname = hostname, .portno = portno, .filename = filename };
+typedef struct {
+	i64 offset; // -1 if unused
+	i64 size;
+	u8* data;
+	u32 last_used;
+} remote_range_block_t;
 
-			unload_all_images(app_state);
-			add_image_from_tiff(app_state, tiff);
-			success = true;
-		} else {
-			tiff_destroy(&tiff);
+typedef struct {
+	tiff_range_reader_t reader; // must be the first member
+	char hostname[256];
+	i32 portno;
+	char uri[2048];
+	i64 filesize;
+	volatile i32 lock;
+	u32 use_counter;
+	remote_range_block_t blocks[REMOTE_RANGE_CACHED_BLOCK_COUNT];
+} remote_range_reader_t;
+
+// Returns a copy of the part of the block that is needed (the block may be evicted by another thread meanwhile).
+static bool32 read_from_remote_range_block(remote_range_reader_t* reader, i64 block_offset, u8* dest,
+                                           i64 offset_in_block, i64 size) {
+	spin_lock(&reader->lock);
+	for (i32 i = 0; i < REMOTE_RANGE_CACHED_BLOCK_COUNT; ++i) {
+		remote_range_block_t* block = reader->blocks + i;
+		if (block->data && block->offset == block_offset) {
+			bool32 ok = (offset_in_block + size <= block->size);
+			if (ok) memcpy(dest, block->data + offset_in_block, size);
+			block->last_used = ++reader->use_counter;
+			spin_unlock(&reader->lock);
+			return ok;
 		}
+	}
+	spin_unlock(&reader->lock);
+
+	u8* data = (u8*) malloc(REMOTE_RANGE_BLOCK_SIZE);
+	i64 block_size = remote_get_range(reader->hostname, reader->portno, reader->uri, block_offset,
+	                                  MIN(REMOTE_RANGE_BLOCK_SIZE, reader->filesize - block_offset), data, NULL, 0);
+	if (block_size < offset_in_block + size) {
+		free(data);
+		return false;
+	}
+	memcpy(dest, data + offset_in_block, size);
 
+	spin_lock(&reader->lock);
+	remote_range_block_t* oldest = reader->blocks;
+	for (i32 i = 1; i < REMOTE_RANGE_CACHED_BLOCK_COUNT; ++i) {
+		if (reader->blocks[i].last_used < oldest->last_used) oldest = reader->blocks + i;
+	}
+	u8* evicted_data = oldest->data;
+	*oldest = (remote_range_block_t){ .offset = block_offset, .size = block_size, .data = data,
+	                                  .last_used = ++reader->use_counter };
+	spin_unlock(&reader->lock);
+	if (evicted_data) {
+		free(evicted_data);
+	} else {
+		memory_stats_add(MEMORY_DOMAIN_NETWORK_BUFFERS, REMOTE_RANGE_BLOCK_SIZE);
 	}
-	free(mem_buffer);
+	return true;
+}
 
+static u64 remote_range_read(tiff_range_reader_t* range_reader, void* dest, u64 offset, u64 num_bytes) {
+	remote_range_reader_t* reader = (remote_range_reader_t*) range_reader;
+	if (num_bytes == 0) return 1;
+	if ((i64)(offset + num_bytes) > reader->filesize) return 0;
+	if (num_bytes >= REMOTE_RANGE_BLOCK_SIZE) {
+		// Large reads, such as the tile tables, are downloaded as they are.
+		i64 bytes_received = remote_get_range(reader->hostname, reader->portno, reader->uri, (i64)offset,
+		                                      (i64)num_bytes, (u8*)dest, NULL, 0);
+		return (bytes_received == (i64)num_bytes) ? 1 : 0;
+	}
+	u8* pos = (u8*)dest;
+	i64 bytes_left = (i64)num_bytes;
+	i64 read_offset = (i64)offset;
+	while (bytes_left > 0) {
+		i64 block_offset = read_offset - (read_offset % REMOTE_RANGE_BLOCK_SIZE);
+		i64 offset_in_block = read_offset - block_offset;
+		i64 size = MIN(bytes_left, REMOTE_RANGE_BLOCK_SIZE - offset_in_block);
+		if (!read_from_remote_range_block(reader, block_offset, pos, offset_in_block, size)) return 0;
+		pos += size;
+		read_offset += size;
+		bytes_left -= size;
+	}
+	return 1;
+}
 
-//	float seconds_elapsed = close_remote_connection(connection);
-	printf("Open remote took %g seconds\n", seconds_elapsed);
-	return success;
+static void remote_range_reader_destroy(tiff_range_reader_t* range_reader) {
+	remote_range_reader_t* reader = (remote_range_reader_t*) range_reader;
+	for (i32 i = 0; i < REMOTE_RANGE_CACHED_BLOCK_COUNT; ++i) {
+		if (reader->blocks[i].data) {
+			free(reader->blocks[i].data);
+			memory_stats_add(MEMORY_DOMAIN_NETWORK_BUFFERS, -REMOTE_RANGE_BLOCK_SIZE);
+		}
+	}
+	free(reader);
 }
 
-bool32 get_remote_directory_listing() {
-	return false;
+// Opens a slide on a regular web server. The first block tells us the size of the file (from the Content-Range).
+static bool32 open_remote_tiff_with_range_requests(tiff_t* tiff, const char* hostname, i32 portno, const char* filename,
+                                                   remote_range_info_t* info) {
+	remote_range_reader_t* reader = (remote_range_reader_t*) calloc(1, sizeof(remote_range_reader_t));
+	reader->reader = (tiff_range_reader_t){ remote_range_read, remote_range_reader_destroy };
+	strncpy(reader->hostname, hostname, sizeof(reader->hostname) - 1);
+	reader->portno = portno;
+	get_range_request_uri(reader->uri, sizeof(reader->uri), filename);
+	u8* data = (u8*) malloc(REMOTE_RANGE_BLOCK_SIZE);
+	i64 block_size = remote_get_range(hostname, portno, reader->uri, 0, REMOTE_RANGE_BLOCK_SIZE, data, info, 0);
+	i64 filesize = info->filesize;
+	if (block_size <= 0 || filesize <= 0) {
+		free(data);
+		remote_range_reader_destroy(&reader->reader);
+		return false;
+	}
+	reader->filesize = filesize;
+	reader->blocks[0] = (remote_range_block_t){ .offset = 0, .size = block_size, .data = data, .last_used = 1 };
+	memory_stats_add(MEMORY_DOMAIN_NETWORK_BUFFERS, REMOTE_RANGE_BLOCK_SIZE);
+	reader->use_counter = 1;
+	if (!open_tiff_with_range_reader(tiff, filesize, &reader->reader)) {
+		tiff_destroy(tiff); // (also destroys the reader)
+		return false;
+	}
+	return true;
 }
 
+// TODO: reduce stdout spam messages
+u8 *do_http_request(const char *hostname, i32 portno, const char *uri, i32 *bytes_read, i32 thread_id) {
+	remote_response_t response;
+	if (remote_get(hostname, portno, uri, NULL, 0, &response, thread_id)) {
+		*bytes_read = (i32)(response.header_size + response.content_length);
+		return response.buffer;
+	} else {
+		*bytes_read = 0;
+		return NULL;
+	}
+}
+
+// Downloads a chunk of the file straight into dest. Returns false if it could not be downloaded completely.
+bool32 download_remote_chunk(network_location_t* location, i64 chunk_offset, i64 chunk_size, u8* dest, i64 dest_capacity,
+                             i32 thread_id) {
+	ASSERT(chunk_size <= dest_capacity);
+	char uri[2048] = {0};
+	if (location->uses_range_requests) {
+		get_range_request_uri(uri, sizeof(uri), location->filename);
+		return remote_get_range(location->hostname, location->portno, uri, chunk_offset, chunk_size, dest, NULL,
+		                        thread_id) == chunk_size;
+	}
+	snprintf(uri, sizeof(uri), "/slide/%s/%lld/%lld", location->filename, chunk_offset, chunk_size);
+	remote_response_t response;
+	bool32 success = false;
+	if (remote_get(location->hostname, location->portno, uri, dest, dest_capacity, &response, thread_id)) {
+		success = (response.content == dest && response.content_length == chunk_size);
+		free(response.buffer);
+	}
+	return success;
+}
+
+static bool32 build_batch_uri(char* uri, size_t uri_size, const char *filename, i64 *chunk_offsets, i64 *chunk_sizes, i32 batch_size) {
+	char* pos = uri;
+	i32 bytes_printed = snprintf(uri, uri_size, "/slide/%s", filename);
+	pos += bytes_printed;
+	i32 bytes_left = (i32)uri_size - bytes_printed;
+	for (i32 i = 0; i < batch_size; ++i) {
+		if (bytes_left <= 0) {
+			ASSERT(!"uri became too long");
+			return false;
+		}
+		bytes_printed += snprintf(pos, bytes_left, "/%lld/%lld", chunk_offsets[i], chunk_sizes[i]);
+		pos = uri + bytes_printed;
+		bytes_left = (i32)uri_size - bytes_printed;
+	}
+	return (bytes_left > 0);
+}
+
+u8 *download_remote_batch(const char *hostname, i32 portno, const char *filename, i64 *chunk_offsets, i64 *chunk_sizes,
+                          i32 batch_size, i32 *bytes_read, i32 thread_id) {
+	ASSERT(batch_size > 0);
+	char uri[4092] = {0};
+	if (!build_batch_uri(uri, sizeof(uri), filename, chunk_offsets, chunk_sizes, batch_size)) {
+		return NULL;
+	}
+	u8* read_buffer = do_http_request(hostname, portno, uri, bytes_read, thread_id);
+	return read_buffer;
+}
+
+typedef struct {
+	float rtt_seconds;     // from sending the requests until the first byte of the first response came back
+	float receive_seconds; // from the first byte until the last, minus the time spent in the progress callbacks
+	i64 bytes_received;
+} remote_transfer_t;
+
+// Adds the measurements of a batch download to remote_link_stats, for the main thread to pick up.
+static void report_remote_transfer(remote_transfer_t* transfer, i32 chunks_delivered) {
+	if (transfer->bytes_received == 0) return;
+	remote_link_stats_t* stats = &remote_link_stats;
+	spin_lock(&stats->lock);
+	stats->transfer_count += 1;
+	stats->rtt_seconds += transfer->rtt_seconds;
+	stats->receive_seconds += ATLEAST(0.0f, transfer->receive_seconds);
+	stats->bytes_received += transfer->bytes_received;
+	stats->chunks_received += chunks_delivered;
+	spin_unlock(&stats->lock);
+}
+
+typedef struct {
+	remote_response_progress_func_t* progress_func;
+	void* progress_userdata;
+	u32 stream_id; // if nonzero, the response may come back out of order (see serve_buffered_requests() in server.c)
+	bool32 is_range_request; // expects 206 Partial Content
+	bool32 is_answered;
+} remote_pipelined_request_t;
+
+// Tile downloads are done by the network thread (see remote_network_thread_loop()). While a download is underway, the
+// network thread owns its connection, and it waits on all of them at once; the workers only submit the downloads, and
+// decode the tiles that come in. All requests of a download are sent at once (pipelined) on a single connection, so
+// that the server can get on with the next one while we are still receiving the previous one.
+//
+// A slide may be on more than one server (see network_location_t::mirrors). Then each download goes to the server that
+// is expected to answer first, and a download that takes unusually long gets hedged: a duplicate is sent to another
+// server, and whichever of the two gets an answer first wins; the other one is abandoned. The chunks always go out
+// through the original download (which therefore stays around until its duplicate is done).
+#define REMOTE_DOWNLOAD_TIMEOUT_SECONDS 10.0f // without anything coming in
+#define REMOTE_DOWNLOAD_MAX_ATTEMPTS 2
+#define REMOTE_MAX_ACTIVE_DOWNLOADS 32
+#define REMOTE_MAX_SERVERS (1 + NETWORK_LOCATION_MAX_MIRRORS)
+
+typedef struct {
+	u8* data;
+	i32 size;
+} remote_request_text_t;
+
+typedef struct remote_download_t {
+	struct remote_download_t* next; // in submitted_downloads, or in the waiting list of the network thread
+	struct remote_download_t* next_live; // in live_downloads (only the originals, not the duplicates)
+	network_mirror_t servers[REMOTE_MAX_SERVERS]; // the slide's own server first
+	i32 server_count;
+	i32 server_index; // the server that the requests are going to
+	void* owner; // see cancel_remote_downloads()
+	u8* request_text;
+	remote_request_text_t* request_texts; // for request r to server s: request_texts[r * server_count + s]
+	remote_pipelined_request_t* requests;
+	i32 request_count;
+	void* progress; // progress trackers for the requests (see deliver_received_chunks(), deliver_received_tiles())
+	i64* chunk_sizes;
+	remote_chunk_received_func_t* callback;
+	remote_download_done_func_t* done_callback;
+	void* userdata;
+	volatile bool32 is_cancelled;
+	i32 chunks_delivered;
+	i32 attempt_count;
+	// Hedging (only touched by the network thread):
+	struct remote_download_t* original; // points to itself, if this is not a duplicate
+	struct remote_download_t* duplicate; // (of the original) while it is underway
+	struct remote_download_t* winner; // (of the original) the first of the two to get an answer
+	bool32 is_abandoned; // the other one won
+	bool32 is_hedged;
+	bool32 is_done; // (the original) waiting for its duplicate to be done
+	// While the responses are coming in:
+	tls_connection_t* connection;
+	i32 responses_received;
+	i32 current_request; // the request that the response that is coming in belongs to
+	u8* buffer; // the response that is coming in (possibly followed by the start of the next one)
+	i64 buffer_size;
+	i64 buffer_capacity;
+	i64 header_size; // 0 while the headers are incomplete
+	i64 content_length;
+	i64 content_reported;
+	bool32 is_ok;
+	bool32 keep_alive;
+	bool32 received_anything;
+	// For the timeout, and for report_remote_transfer():
+	i64 last_activity_clock;
+	i64 sent_clock;
+	i64 first_byte_clock;
+	float callback_seconds;
+	i64 bytes_received;
+	// Set if the download may go over UDP (see remote_datagram_download_t):
+	struct remote_datagram_download_t* datagram;
+	bool32* is_chunk_delivered; // (if it goes over TCP after all, the tiles that already came in are skipped)
+} remote_download_t;
+
+static remote_download_t* submitted_downloads; // not yet picked up by the network thread (newest first)
+static remote_download_t* live_downloads; // everything that has not finished yet
+static volatile i32 downloads_lock;
+static i64 wake_socket = -1; // datagrams sent to this socket wake up the network thread
+
+static void wake_network_thread() {
+	if (wake_socket >= 0) {
+		send(wake_socket, "", 1, 0);
+	}
+}
+
+static bool32 socket_would_block() {
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+// How long each server takes to answer (the time until the first byte of the response), for choosing between the
+// servers of a slide, and for deciding when to hedge a download. Only used by the network thread.
+#define REMOTE_LATENCY_SAMPLE_COUNT 64
+#define REMOTE_MAX_TRACKED_SERVERS 16
+#define REMOTE_HEDGE_MIN_SAMPLES 16 // until then, the p95 isn't known well enough to go by
+#define REMOTE_HEDGE_MIN_SECONDS 0.02f
+
+typedef struct {
+	network_mirror_t server;
+	float samples[REMOTE_LATENCY_SAMPLE_COUNT]; // the most recent ones
+	i32 sample_count;
+	float average_seconds;
+	float p95_seconds;
+	i32 active_count; // downloads that are underway
+	i64 last_used_clock;
+} remote_server_latency_t;
+
+static remote_server_latency_t server_latencies[REMOTE_MAX_TRACKED_SERVERS];
+static i32 server_latency_count;
+
+static remote_server_latency_t* get_remote_server_latency(network_mirror_t* server) {
+	remote_server_latency_t* latency = NULL;
+	for (i32 i = 0; i < server_latency_count && !latency; ++i) {
+		if (server_latencies[i].server.portno == server->portno &&
+		    strcmp(server_latencies[i].server.hostname, server->hostname) == 0) {
+			latency = server_latencies + i;
+		}
+	}
+	if (!latency) {
+		if (server_latency_count < REMOTE_MAX_TRACKED_SERVERS) {
+			latency = server_latencies + server_latency_count++;
+		} else {
+			// Forget the server that hasn't been used for the longest time (but not one with downloads underway).
+			for (i32 i = 0; i < server_latency_count; ++i) {
+				remote_server_latency_t* candidate = server_latencies + i;
+				if (candidate->active_count == 0 && (!latency || candidate->last_used_clock < latency->last_used_clock)) {
+					latency = candidate;
+				}
+			}
+			if (!latency) latency = server_latencies; // (can't happen, there are fewer active downloads than that)
+		}
+		memset(latency, 0, sizeof(*latency));
+		latency->server = *server;
+	}
+	latency->last_used_clock = get_clock();
+	return latency;
+}
+
+static int compare_floats(const void* a, const void* b) {
+	float x = *(const float*)a;
+	float y = *(const float*)b;
+	return (x > y) - (x < y);
+}
+
+static void add_remote_latency_sample(remote_server_latency_t* latency, float seconds) {
+	latency->samples[latency->sample_count % REMOTE_LATENCY_SAMPLE_COUNT] = seconds;
+	++latency->sample_count;
+	float smoothing = (latency->sample_count == 1) ? 1.0f : 0.1f;
+	latency->average_seconds = LERP(smoothing, latency->average_seconds, seconds);
+	i32 count = MIN(latency->sample_count, REMOTE_LATENCY_SAMPLE_COUNT);
+	float sorted[REMOTE_LATENCY_SAMPLE_COUNT];
+	memcpy(sorted, latency->samples, count * sizeof(float));
+	qsort(sorted, count, sizeof(float), compare_floats);
+	latency->p95_seconds = sorted[(count * 95) / 100];
+}
+
+// The time that a download would probably take to get an answer from the server: the downloads that are already
+// underway there go first. A server that hasn't been tried yet is expected to be quick, so that it gets measured.
+static float get_expected_remote_latency(remote_server_latency_t* latency) {
+	if (latency->sample_count == 0) return 0.0f;
+	return latency->average_seconds * (float)(1 + latency->active_count);
+}
+
+// Puts the servers of the download in the order in which they are expected to answer.
+static void order_remote_servers(remote_download_t* download, i32* order) {
+	float expected[REMOTE_MAX_SERVERS];
+	for (i32 i = 0; i < download->server_count; ++i) {
+		expected[i] = get_expected_remote_latency(get_remote_server_latency(download->servers + i));
+		i32 j = i;
+		for (; j > 0 && expected[order[j - 1]] > expected[i]; --j) {
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+	}
+}
+
+static bool32 is_remote_download_stopped(remote_download_t* download) {
+	return download->original->is_cancelled || download->is_abandoned;
+}
+
+// The duplicate shares the request texts and the progress trackers with the original (only one of the two will get
+// to deliver anything), but it needs its own connection state.
+static remote_download_t* create_duplicate_remote_download(remote_download_t* download, i32 server_index) {
+	remote_download_t* duplicate = (remote_download_t*) calloc(1, sizeof(remote_download_t));
+	memcpy(duplicate->servers, download->servers, sizeof(duplicate->servers));
+	duplicate->server_count = download->server_count;
+	duplicate->server_index = server_index;
+	duplicate->owner = download->owner;
+	duplicate->request_texts = download->request_texts;
+	duplicate->request_count = download->request_count;
+	duplicate->requests = (remote_pipelined_request_t*) malloc(download->request_count * sizeof(remote_pipelined_request_t));
+	memcpy(duplicate->requests, download->requests, download->request_count * sizeof(remote_pipelined_request_t));
+	duplicate->original = download;
+	duplicate->last_activity_clock = get_clock();
+	download->duplicate = duplicate;
+	download->is_hedged = true;
+	return duplicate;
+}
+
+// Downloads that haven't gotten an answer in the time that their server needs for 95% of the downloads are sent to
+// another server as well (at most once). Returns the number of milliseconds until the next one is due.
+static i32 hedge_slow_remote_downloads(remote_download_t** active_downloads, i32 active_count,
+                                       remote_download_t** waiting_downloads) {
+	i32 timeout_ms = 1000;
+	for (i32 i = 0; i < active_count; ++i) {
+		remote_download_t* download = active_downloads[i];
+		if (download->original != download || download->is_hedged || download->server_count < 2 ||
+		    download->first_byte_clock != 0 || is_remote_download_stopped(download)) {
+			continue;
+		}
+		remote_server_latency_t* latency = get_remote_server_latency(download->servers + download->server_index);
+		if (latency->sample_count < REMOTE_HEDGE_MIN_SAMPLES) continue;
+		float hedge_seconds = ATLEAST(latency->p95_seconds, REMOTE_HEDGE_MIN_SECONDS);
+		float seconds_left = hedge_seconds - get_seconds_elapsed(download->sent_clock, get_clock());
+		if (seconds_left > 0.0f) {
+			timeout_ms = MIN(timeout_ms, (i32)(seconds_left * 1000.0f) + 1);
+			continue;
+		}
+		i32 order[REMOTE_MAX_SERVERS];
+		order_remote_servers(download, order);
+		i32 server_index = (order[0] != download->server_index) ? order[0] : order[1];
+		log_debug("[network thread] Hedging a download from %s:%d (no answer after %g seconds) with %s:%d\n",
+		          download->servers[download->server_index].hostname, download->servers[download->server_index].portno,
+		          hedge_seconds, download->servers[server_index].hostname, download->servers[server_index].portno);
+		remote_download_t* duplicate = create_duplicate_remote_download(download, server_index);
+		duplicate->next = *waiting_downloads;
+		*waiting_downloads = duplicate;
+		timeout_ms = 0;
+	}
+	return timeout_ms;
+}
+
+static void forward_received_chunk(void* userdata, i32 chunk_index, u8* data, i64 size) {
+	remote_download_t* download = (remote_download_t*) userdata;
+	if (download->is_cancelled) return;
+	if (download->is_chunk_delivered) {
+		if (download->is_chunk_delivered[chunk_index]) return; // (it already came in over UDP)
+		download->is_chunk_delivered[chunk_index] = true;
+	}
+	++download->chunks_delivered;
+	download->callback(download->userdata, chunk_index, data, size);
+}
+
+static remote_download_t* create_remote_download(network_location_t* location, i32 request_count,
+                                                 remote_chunk_received_func_t* callback,
+                                                 remote_download_done_func_t* done_callback, void* userdata, void* owner) {
+	remote_download_t* download = (remote_download_t*) calloc(1, sizeof(remote_download_t));
+	download->original = download;
+	strncpy(download->servers[0].hostname, location->hostname, sizeof(download->servers[0].hostname) - 1);
+	download->servers[0].portno = location->portno;
+	download->server_count = 1;
+	// (A slide read with Range requests comes from a web server that knows nothing of mirrors.)
+	for (i32 i = 0; i < location->mirror_count && !location->uses_range_requests; ++i) {
+		download->servers[download->server_count++] = location->mirrors[i];
+	}
+	download->owner = owner;
+	download->request_texts = (remote_request_text_t*) calloc(request_count * download->server_count,
+	                                                          sizeof(remote_request_text_t));
+	download->requests = (remote_pipelined_request_t*) calloc(request_count, sizeof(remote_pipelined_request_t));
+	download->callback = callback;
+	download->done_callback = done_callback;
+	download->userdata = userdata;
+	return download;
+}
+
+static void submit_remote_download(remote_download_t* download) {
+	download->last_activity_clock = get_clock();
+	spin_lock(&downloads_lock);
+	download->next = submitted_downloads;
+	submitted_downloads = download;
+	download->next_live = live_downloads;
+	live_downloads = download;
+	spin_unlock(&downloads_lock);
+	wake_network_thread();
+}
+
+// Downloads that are still underway will stop delivering chunks, and finish (with done_callback) as soon as possible.
+void cancel_remote_downloads(void* owner) {
+	spin_lock(&downloads_lock);
+	for (remote_download_t* download = live_downloads; download; download = download->next_live) {
+		if (download->owner == owner) {
+			download->is_cancelled = true;
+		}
+	}
+	spin_unlock(&downloads_lock);
+	wake_network_thread();
+}
+
+// Hands the connection back to the pool, or closes it.
+static void release_remote_download_connection(remote_download_t* download, bool32 is_reusable) {
+	remote_server_latency_t* latency = get_remote_server_latency(download->servers + download->server_index);
+	--latency->active_count;
+	if (download->is_abandoned && download->first_byte_clock == 0) {
+		// It was at least this slow; leaving this out would make the server look faster than it is.
+		add_remote_latency_sample(latency, get_seconds_elapsed(download->sent_clock, get_clock()));
+	}
+	if (is_reusable) {
+		set_socket_blocking(download->connection->sockfd, true);
+		put_idle_remote_connection(download->connection);
+	} else {
+		close_remote_connection(download->connection);
+	}
+	download->connection = NULL;
+}
+
+// The original is done once its duplicate (if any) is done as well.
+static void complete_remote_download(remote_download_t* download) {
+	spin_lock(&downloads_lock);
+	remote_download_t** link = &live_downloads;
+	while (*link != download) {
+		link = &(*link)->next_live;
+	}
+	*link = download->next_live;
+	spin_unlock(&downloads_lock);
+
+	download->done_callback(download->userdata, download->chunks_delivered);
+
+	free(download->request_text);
+	free(download->request_texts);
+	free(download->requests);
+	free(download->progress);
+	free(download->chunk_sizes);
+	free(download->datagram);
+	free(download->is_chunk_delivered);
+	free(download);
+}
+
+static void finish_remote_download(remote_download_t* download) {
+	if (download->connection) {
+		release_remote_download_connection(download, false);
+	}
+	remote_download_t* original = download->original;
+	if (download->bytes_received > 0 && download->first_byte_clock != 0) {
+		remote_transfer_t transfer = {
+			.rtt_seconds = get_seconds_elapsed(download->sent_clock, download->first_byte_clock),
+			.receive_seconds = get_seconds_elapsed(download->first_byte_clock, get_clock()) - download->callback_seconds,
+			.bytes_received = download->bytes_received,
+		};
+		report_remote_transfer(&transfer, original->chunks_delivered);
+	}
+	free(download->buffer);
+	memory_stats_add(MEMORY_DOMAIN_NETWORK_BUFFERS, -download->buffer_capacity);
+	download->buffer = NULL;
+	download->buffer_capacity = 0;
+
+	if (download != original) {
+		original->duplicate = NULL;
+		free(download->requests);
+		free(download);
+		if (original->is_done) {
+			complete_remote_download(original);
+		}
+	} else if (download->duplicate) {
+		download->is_done = true; // the duplicate may still deliver chunks
+	} else {
+		complete_remote_download(download);
+	}
+}
+
+static void reserve_remote_download_buffer(remote_download_t* download, i64 capacity) {
+	if (download->buffer_capacity < capacity) {
+		i64 new_capacity = MAX(capacity, 2 * download->buffer_capacity);
+		memory_stats_add(MEMORY_DOMAIN_NETWORK_BUFFERS, new_capacity - download->buffer_capacity);
+		download->buffer_capacity = new_capacity;
+		download->buffer = (u8*) realloc(download->buffer, download->buffer_capacity);
+	}
+}
+
+// Takes a connection from the pool and sends the requests. Returns false if there is no connection available (yet).
+static bool32 start_remote_download(remote_download_t* download) {
+	tls_connection_t* connection = NULL;
+	if (download->original == download) {
+		// Go to the server that is expected to answer first; if it has no connection ready, then to the next best one.
+		i32 order[REMOTE_MAX_SERVERS];
+		order_remote_servers(download, order);
+		for (i32 i = 0; i < download->server_count && !connection; ++i) {
+			connection = get_idle_remote_connection(download->servers[order[i]].hostname, download->servers[order[i]].portno);
+			if (connection) download->server_index = order[i];
+		}
+		if (order[0] != download->server_index || !connection) {
+			want_remote_connections(download->servers[order[0]].hostname, download->servers[order[0]].portno);
+		}
+	} else {
+		// A duplicate goes to the server that it was made for.
+		network_mirror_t* server = download->servers + download->server_index;
+		connection = get_idle_remote_connection(server->hostname, server->portno);
+		if (!connection) want_remote_connections(server->hostname, server->portno);
+	}
+	if (!connection) {
+		return false; // the connector thread will wake us up once it has opened a new one
+	}
+	++get_remote_server_latency(download->servers + download->server_index)->active_count;
+	++download->attempt_count;
+	download->connection = connection;
+	download->responses_received = 0;
+	for (i32 r = 0; r < download->request_count; ++r) {
+		download->requests[r].is_answered = false;
+	}
+	download->buffer_size = 0;
+	download->header_size = 0;
+	download->received_anything = false;
+	if (connection->leftover_size > 0) {
+		reserve_remote_download_buffer(download, connection->leftover_size);
+		memcpy(download->buffer, connection->leftover, connection->leftover_size);
+		download->buffer_size = connection->leftover_size;
+		free(connection->leftover);
+		connection->leftover = NULL;
+		connection->leftover_size = 0;
+	}
+	// Send the requests in one go, so that they arrive together, and the server can choose the order of the responses.
+	for (i32 r = 0; r < download->request_count; ++r) {
+		remote_request_text_t* text = download->request_texts + r * download->server_count + download->server_index;
+		tls_write(connection->tls_context, text->data, text->size);
+	}
+	send_pending(connection->sockfd, connection->tls_context);
+	// Note: a failed send will show up as a failed receive.
+	set_socket_blocking(connection->sockfd, false);
+	download->sent_clock = get_clock();
+	download->last_activity_clock = download->sent_clock;
+	return true;
+}
+
+// Handles the responses that have come in so far. Returns false if the connection can't be used anymore.
+static bool32 process_remote_responses(remote_download_t* download) {
+	while (download->responses_received < download->request_count) {
+		if (download->header_size == 0) {
+			i64 end_of_headers = find_end_of_http_headers(download->buffer, download->buffer_size);
+			if (end_of_headers == 0) break;
+			u8* headers = download->buffer;
+			download->header_size = end_of_headers;
+			i32 status = get_http_status(headers, end_of_headers);
+			const char* value = find_http_header_field(headers, end_of_headers, "Content-length");
+			download->content_length = value ? atoll(value) : -1;
+			value = find_http_header_field(headers, end_of_headers, "Connection");
+			download->keep_alive = !(value && strncmp(value, "close", 5) == 0);
+			download->content_reported = 0;
+			// Responses to stream requests come back in any order; the others come back in the order of the requests.
+			i32 current_request = -1;
+			value = find_http_header_field(headers, end_of_headers, "Stream-id");
+			u32 stream_id = value ? (u32)atoll(value) : 0;
+			for (i32 r = 0; r < download->request_count && current_request < 0; ++r) {
+				remote_pipelined_request_t* request = download->requests + r;
+				if (!request->is_answered && (stream_id == 0 || request->stream_id == stream_id)) {
+					current_request = r;
+				}
+			}
+			if (current_request < 0) {
+				return false; // not a response to anything we asked for
+			}
+			download->current_request = current_request;
+			download->is_ok = (status == (download->requests[current_request].is_range_request ? 206 : 200));
+			remote_download_t* original = download->original;
+			if (original->duplicate) {
+				// Hedged: the first one to get an answer wins, and the other one is abandoned.
+				if (!download->is_ok || (original->winner && original->winner != download)) {
+					return false;
+				}
+				if (!original->winner) {
+					original->winner = download;
+					remote_download_t* other = (download == original) ? original->duplicate : original;
+					other->is_abandoned = true;
+					wake_network_thread(); // (to finish it right away)
+				}
+			}
+			if (download->content_length < 0) {
+				return false; // can't tell where the response stops
+			}
+			reserve_remote_download_buffer(download, download->header_size + download->content_length);
+		}
+
+		remote_pipelined_request_t* request = download->requests + download->current_request;
+		u8* content = download->buffer + download->header_size;
+		i64 content_available = MIN(download->buffer_size - download->header_size, download->content_length);
+		if (download->is_ok && request->progress_func && content_available > download->content_reported) {
+			i64 callback_start = get_clock();
+			// (Downloads are called off through cancel_remote_downloads() instead.)
+			request->progress_func(request->progress_userdata, content, content_available, download->content_length);
+			download->callback_seconds += get_seconds_elapsed(callback_start, get_clock());
+			download->content_reported = content_available;
+		}
+		if (content_available < download->content_length) break;
+
+		// The response is complete: make room for the next one.
+		i64 response_size = download->header_size + download->content_length;
+		if (download->is_ok) {
+			download->bytes_received += response_size;
+		}
+		memmove(download->buffer, download->buffer + response_size, download->buffer_size - response_size);
+		download->buffer_size -= response_size;
+		download->header_size = 0;
+		request->is_answered = true;
+		++download->responses_received;
+		if (!download->keep_alive) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Receives whatever has come in on the connection. Returns false if the connection can't be used anymore.
+static bool32 receive_remote_download(remote_download_t* download) {
+	tls_connection_t* connection = download->connection;
+	u8 receive_buffer[0xFFFF];
+	for (;;) {
+		i32 receive_size = recv(connection->sockfd, (char*)receive_buffer, sizeof(receive_buffer), 0);
+		if (receive_size == 0) {
+			return false; // the server hung up
+		} else if (receive_size < 0) {
+			if (socket_would_block()) break;
+			print_socket_error(-1, "receive_remote_download");
+			return false;
+		}
+		download->last_activity_clock = get_clock();
+		if (download->first_byte_clock == 0) {
+			download->first_byte_clock = download->last_activity_clock;
+			add_remote_latency_sample(get_remote_server_latency(download->servers + download->server_index),
+			                          get_seconds_elapsed(download->sent_clock, download->first_byte_clock));
+		}
+		if (tls_consume_stream(connection->tls_context, receive_buffer, receive_size, validate_certificate) < 0) {
+			printf("[network thread] tls_consume_stream() failed\n");
+			return false;
+		}
+		send_pending(connection->sockfd, connection->tls_context);
+		for (;;) {
+			reserve_remote_download_buffer(download, download->buffer_size + KILOBYTES(64));
+			i32 read_size = tls_read(connection->tls_context, download->buffer + download->buffer_size,
+			                         (u32)MIN(download->buffer_capacity - download->buffer_size, INT32_MAX));
+			if (read_size <= 0) break;
+			download->buffer_size += read_size;
+			// Note: a close_notify from a server that timed out the idle connection doesn't count as a response.
+			download->received_anything = true;
+		}
+	}
+	return process_remote_responses(download);
+}
+
+// Returns false if the download is no longer active. It either got finished, or it needs a new connection.
+static bool32 update_active_remote_download(remote_download_t* download, bool32 is_readable, bool32* needs_retry) {
+	*needs_retry = false;
+	bool32 is_usable = true;
+	if (is_readable) {
+		is_usable = receive_remote_download(download);
+	}
+	if (download->responses_received == download->request_count) {
+		if (is_usable && download->buffer_size == 0) {
+			release_remote_download_connection(download, true);
+		}
+		finish_remote_download(download);
+		return false;
+	}
+	bool32 is_timed_out = get_seconds_elapsed(download->last_activity_clock, get_clock()) > REMOTE_DOWNLOAD_TIMEOUT_SECONDS;
+	if (is_usable && !is_timed_out && !is_remote_download_stopped(download)) {
+		return true;
+	}
+	if (is_timed_out) {
+		network_mirror_t* server = download->servers + download->server_index;
+		printf("[network thread] Download from %s:%d timed out\n", server->hostname, server->portno);
+	}
+	release_remote_download_connection(download, false);
+	// If a pooled connection fails before anything came back, the server most likely closed it while it was idle.
+	// The requests are safe to repeat, so try again on another connection.
+	if (!is_usable && !download->received_anything && !download->is_abandoned &&
+	    download->attempt_count < REMOTE_DOWNLOAD_MAX_ATTEMPTS) {
+		*needs_retry = true;
+	} else {
+		finish_remote_download(download);
+	}
+	return false;
+}
+
+// Tiles over UDP (experimental, see tile_datagram.h). The connector thread gets a session from the server over TLS
+// (GET /datagram) the first time a download asks for one; until then, and if the server doesn't offer it, downloads go
+// over TCP as usual. A tile download that goes over UDP asks for each tile separately, and puts the tiles together
+// from the fragments as they come in; each tile is delivered as soon as it is complete, whatever happens to the others.
+// Fragments that are overdue are asked for again. If a tile still doesn't come in (or the server can't send it this
+// way), the download goes over TCP after all, and the session is not used for a while.
+#define REMOTE_DATAGRAM_SESSION_COUNT 4
+#define REMOTE_DATAGRAM_RETRY_SECONDS 60.0f
+#define REMOTE_DATAGRAM_MAX_DOWNLOADS 32
+#define REMOTE_DATAGRAM_MAX_REQUESTS 6 // for a tile
+#define REMOTE_DATAGRAM_INITIAL_TIMEOUT_SECONDS 0.3f // until the round-trip time is known
+#define REMOTE_DATAGRAM_MIN_TIMEOUT_SECONDS 0.03f
+#define REMOTE_DATAGRAM_RECEIVE_BUFFER_SIZE MEGABYTES(4)
+#define REMOTE_DATAGRAM_TILE_BITS 12 // of the request id (the rest identifies the download)
+
+typedef enum {
+	DATAGRAM_SESSION_NONE,
+	DATAGRAM_SESSION_WANTED, // for the connector thread to get
+	DATAGRAM_SESSION_READY, // from now on only used by the network thread
+	DATAGRAM_SESSION_FAILED,
+} datagram_session_state_enum;
+
+typedef struct remote_datagram_session_t {
+	char hostname[256];
+	i32 portno;
+	volatile i32 state;
+	i64 failed_clock;
+	u32 session_id;
+	gcm_state gcm;
+	i64 sockfd;
+	bool32 has_socket;
+	u64 next_sequence;
+	float smoothed_rtt; // 0 until measured
+} remote_datagram_session_t;
+
+typedef struct {
+	u8* data; // allocated once the size is known (with the first fragment)
+	u8* is_fragment_received;
+	u32 tile_size;
+	u32 fragment_count; // 0 until the first fragment has arrived
+	u32 fragments_received;
+	i32 request_count;
+	i64 requested_clock; // of the first request (for the round-trip time)
+	i64 last_activity_clock; // of the last request, or of the last fragment that came in
+	bool32 is_done;
+} remote_datagram_tile_t;
+
+typedef struct remote_datagram_download_t {
+	u32 id;
+	u32 slide_handle;
+	i32 tile_count;
+	u32* levels;
+	u32* tile_indices;
+	remote_datagram_tile_t* tiles; // while the download goes over UDP
+	remote_datagram_session_t* session;
+	i32 tiles_left;
+	bool32 needs_fallback;
+	bool32 has_fallen_back;
+} remote_datagram_download_t;
+
+static remote_datagram_session_t datagram_sessions[REMOTE_DATAGRAM_SESSION_COUNT];
+static volatile i32 datagram_sessions_lock;
+static u32 next_datagram_download_id; // (only used by the network thread)
+
+// Called by the connector thread.
+static bool32 open_remote_datagram_session(remote_datagram_session_t* session, const char* hostname, i32 portno) {
+	remote_response_t response;
+	if (!remote_get(hostname, portno, "/datagram", NULL, 0, &response, 0)) {
+		return false;
+	}
+	tile_datagram_session_t info = {0};
+	bool32 success = (response.is_ok && response.content_length == sizeof(info));
+	if (success) {
+		memcpy(&info, response.content, sizeof(info));
+		success = (info.magic == TILE_DATAGRAM_SESSION_MAGIC && info.port > 0 && info.port <= 65535);
+	}
+	free(response.buffer);
+	remote_host_t host;
+	if (!success || !resolve_remote_host(hostname, portno, &host)) {
+		return false;
+	}
+	struct sockaddr_storage address = host.addresses[0];
+	if (address.ss_family == AF_INET6) {
+		((struct sockaddr_in6*)&address)->sin6_port = htons((u16)info.port);
+	} else {
+		((struct sockaddr_in*)&address)->sin_port = htons((u16)info.port);
+	}
+	i64 sockfd = (i64)socket(address.ss_family, SOCK_DGRAM, 0);
+	if (sockfd < 0) return false;
+	int receive_buffer_size = REMOTE_DATAGRAM_RECEIVE_BUFFER_SIZE; // the fragments of a tile come in bursts
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, (char*)&receive_buffer_size, sizeof(receive_buffer_size));
+	if (connect(sockfd, (struct sockaddr*)&address, host.address_sizes[0]) != 0 ||
+	    gcm_init(&session->gcm, find_cipher("aes"), info.key, sizeof(info.key)) != CRYPT_OK) {
+		closesocket(sockfd);
+		return false;
+	}
+	set_socket_blocking(sockfd, false);
+	if (session->has_socket) {
+		closesocket(session->sockfd);
+	}
+	session->sockfd = sockfd;
+	session->has_socket = true;
+	session->session_id = info.session_id;
+	session->next_sequence = 1;
+	session->smoothed_rtt = 0.0f;
+	memset(&info, 0, sizeof(info));
+	return true;
+}
+
+// Called by the connector thread.
+static void open_wanted_remote_datagram_sessions() {
+	for (i32 i = 0; i < REMOTE_DATAGRAM_SESSION_COUNT; ++i) {
+		remote_datagram_session_t* session = datagram_sessions + i;
+		if (session->state != DATAGRAM_SESSION_WANTED) continue;
+		read_barrier;
+		if (open_remote_datagram_session(session, session->hostname, session->portno)) {
+			printf("Tiles from %s:%d will come over UDP (experimental)\n", session->hostname, session->portno);
+			write_barrier;
+			session->state = DATAGRAM_SESSION_READY;
+		} else {
+			session->failed_clock = get_clock();
+			write_barrier;
+			session->state = DATAGRAM_SESSION_FAILED;
+		}
+	}
+}
+
+// Returns the session to use for a download from this server, or NULL if there is none (yet). Then, the connector
+// thread is asked to get one. Called by the network thread.
+static remote_datagram_session_t* get_remote_datagram_session(const char* hostname, i32 portno) {
+	remote_datagram_session_t* session = NULL;
+	remote_datagram_session_t* free_slot = NULL;
+	spin_lock(&datagram_sessions_lock);
+	for (i32 i = 0; i < REMOTE_DATAGRAM_SESSION_COUNT && !session; ++i) {
+		remote_datagram_session_t* slot = datagram_sessions + i;
+		if (slot->portno == portno && strcmp(slot->hostname, hostname) == 0) {
+			session = slot;
+		} else if (!free_slot && (slot->state == DATAGRAM_SESSION_NONE || slot->state == DATAGRAM_SESSION_FAILED)) {
+			free_slot = slot;
+		}
+	}
+	bool32 is_wanted = false;
+	if (!session && free_slot) {
+		session = free_slot;
+		strncpy(session->hostname, hostname, sizeof(session->hostname) - 1);
+		session->portno = portno;
+		session->state = DATAGRAM_SESSION_WANTED;
+		is_wanted = true;
+	} else if (session && session->state == DATAGRAM_SESSION_FAILED &&
+	           get_seconds_elapsed(session->failed_clock, get_clock()) > REMOTE_DATAGRAM_RETRY_SECONDS) {
+		session->state = DATAGRAM_SESSION_WANTED;
+		is_wanted = true;
+	}
+	spin_unlock(&datagram_sessions_lock);
+	if (is_wanted) {
+		start_remote_connector();
+		wake_remote_connector();
+	}
+	if (!session || session->state != DATAGRAM_SESSION_READY) {
+		return NULL;
+	}
+	read_barrier;
+	return session;
+}
+
+// Asks for a tile, or for the fragments of it that are still missing.
+static void send_remote_datagram_request(remote_download_t* download, i32 tile) {
+	remote_datagram_download_t* datagram = download->datagram;
+	remote_datagram_session_t* session = datagram->session;
+	remote_datagram_tile_t* state = datagram->tiles + tile;
+	tile_datagram_request_t request = {
+		.request_id = (datagram->id << REMOTE_DATAGRAM_TILE_BITS) | (u32)tile,
+		.slide_handle = datagram->slide_handle,
+		.level = datagram->levels[tile],
+		.tile_index = datagram->tile_indices[tile],
+	};
+	// (Without any ranges, the server sends all fragments; also if there are more gaps than fit in the request.)
+	for (u32 i = 0; i < state->fragment_count; ) {
+		if (state->is_fragment_received[i]) {
+			++i;
+			continue;
+		}
+		u32 end = i + 1;
+		while (end < state->fragment_count && !state->is_fragment_received[end]) ++end;
+		if (request.range_count == TILE_DATAGRAM_MAX_RANGES) {
+			request.range_count = 0;
+			break;
+		}
+		request.ranges[request.range_count++] = (tile_datagram_range_t){ (u16)i, (u16)(end - i) };
+		i = end;
+	}
+	if (state->request_count > 0) {
+		remote_datagram_stats.fragments_requested_again += (state->fragment_count == 0 || request.range_count == 0)
+		                                                   ? ATLEAST(1, state->fragment_count)
+		                                                   : state->fragment_count - state->fragments_received;
+	}
+	i32 message_size = (i32)(offsetof(tile_datagram_request_t, ranges) + request.range_count * sizeof(tile_datagram_range_t));
+	u8 packet[sizeof(tile_datagram_header_t) + sizeof(request) + TILE_DATAGRAM_TAG_SIZE];
+	tile_datagram_header_t header = { TILE_DATAGRAM_MAGIC, session->session_id, session->next_sequence++ };
+	memcpy(packet, &header, sizeof(header));
+	memcpy(packet + sizeof(header), &request, message_size);
+	i32 packet_size = seal_tile_datagram(&session->gcm, TILE_DATAGRAM_FROM_CLIENT, packet, message_size);
+	if (packet_size > 0) {
+		send(session->sockfd, (char*)packet, packet_size, 0); // (if it gets lost, it will be sent again)
+	}
+	i64 now = get_clock();
+	if (state->request_count == 0) {
+		state->requested_clock = now;
+	}
+	++state->request_count;
+	state->last_activity_clock = now;
+}
+
+// Lets a tile download go over UDP, if the server offers it by the time it starts. (Only for tiles asked for by handle
+// at full quality; the server doesn't re-encode tiles for UDP.)
+static void allow_remote_datagram_download(remote_download_t* download, network_location_t* location, u32* levels,
+                                           u32* tile_indices, i32 tile_count) {
+	remote_datagram_download_t* datagram = (remote_datagram_download_t*) calloc(1, sizeof(remote_datagram_download_t) +
+	                                                                               2 * tile_count * sizeof(u32));
+	datagram->slide_handle = location->slide_handle;
+	datagram->tile_count = tile_count;
+	datagram->levels = (u32*)(datagram + 1);
+	datagram->tile_indices = datagram->levels + tile_count;
+	memcpy(datagram->levels, levels, tile_count * sizeof(u32));
+	memcpy(datagram->tile_indices, tile_indices, tile_count * sizeof(u32));
+	download->datagram = datagram;
+	download->is_chunk_delivered = (bool32*) calloc(tile_count, sizeof(bool32));
+}
+
+// Returns false if there is no session for the server (yet); the download then goes over TCP.
+static bool32 start_remote_datagram_download(remote_download_t* download) {
+	remote_datagram_download_t* datagram = download->datagram;
+	datagram->session = get_remote_datagram_session(download->servers[0].hostname, download->servers[0].portno);
+	if (!datagram->session) {
+		return false;
+	}
+	datagram->id = next_datagram_download_id++ & ((1u << (32 - REMOTE_DATAGRAM_TILE_BITS)) - 1);
+	datagram->tiles = (remote_datagram_tile_t*) calloc(datagram->tile_count, sizeof(remote_datagram_tile_t));
+	datagram->tiles_left = 0;
+	download->server_index = 0;
+	download->sent_clock = get_clock();
+	download->last_activity_clock = download->sent_clock;
+	for (i32 i = 0; i < datagram->tile_count; ++i) {
+		if (download->is_chunk_delivered[i]) {
+			datagram->tiles[i].is_done = true;
+		} else {
+			++datagram->tiles_left;
+			send_remote_datagram_request(download, i);
+		}
+	}
+	return true;
+}
+
+static void release_remote_datagram_tiles(remote_datagram_download_t* datagram) {
+	if (!datagram->tiles) return;
+	for (i32 i = 0; i < datagram->tile_count; ++i) {
+		free(datagram->tiles[i].data);
+		free(datagram->tiles[i].is_fragment_received);
+	}
+	free(datagram->tiles);
+	datagram->tiles = NULL;
+	datagram->session = NULL;
+}
+
+static void handle_remote_datagram_fragment(remote_download_t* download, i32 tile, tile_datagram_fragment_t* fragment,
+                                            u8* payload, i32 payload_size) {
+	remote_datagram_download_t* datagram = download->datagram;
+	remote_datagram_tile_t* state = datagram->tiles + tile;
+	if (state->is_done) return;
+	if (fragment->status != TILE_DATAGRAM_STATUS_OK) {
+		datagram->needs_fallback = true; // (let the server deal with it the way it does over TCP)
+		return;
+	}
+	u32 fragment_count = get_tile_datagram_fragment_count(fragment->tile_size);
+	if (fragment->fragment_count != fragment_count || fragment_count > TILE_DATAGRAM_MAX_FRAGMENTS ||
+	    fragment->fragment_index >= fragment_count || (state->fragment_count != 0 && state->tile_size != fragment->tile_size)) {
+		return;
+	}
+	u32 offset = fragment->fragment_index * TILE_DATAGRAM_PAYLOAD_SIZE;
+	if ((u32)payload_size != MIN(TILE_DATAGRAM_PAYLOAD_SIZE, fragment->tile_size - offset)) {
+		return;
+	}
+	i64 now = get_clock();
+	remote_datagram_session_t* session = datagram->session;
+	if (state->fragment_count == 0) {
+		state->tile_size = fragment->tile_size;
+		state->fragment_count = fragment_count;
+		state->data = (u8*) malloc(MAX(1, state->tile_size));
+		state->is_fragment_received = (u8*) calloc(fragment_count, 1);
+		if (state->request_count == 1) {
+			// (Only tiles that were asked for once tell the round-trip time.)
+			float rtt = get_seconds_elapsed(state->requested_clock, now);
+			session->smoothed_rtt = (session->smoothed_rtt == 0.0f) ? rtt : 0.875f * session->smoothed_rtt + 0.125f * rtt;
+		}
+	}
+	state->last_activity_clock = now;
+	if (state->is_fragment_received[fragment->fragment_index]) return;
+	state->is_fragment_received[fragment->fragment_index] = true;
+	memcpy(state->data + offset, payload, payload_size);
+	++state->fragments_received;
+	if (state->fragments_received == state->fragment_count) {
+		forward_received_chunk(download, tile, state->data, state->tile_size);
+		++remote_datagram_stats.tiles_received;
+		free(state->data);
+		free(state->is_fragment_received);
+		state->data = NULL;
+		state->is_fragment_received = NULL;
+		state->is_done = true;
+		--datagram->tiles_left;
+	}
+}
+
+// Takes in the fragments that have come in for the downloads that go over UDP.
+static void receive_remote_datagrams(remote_datagram_session_t* session, remote_download_t** downloads, i32 download_count) {
+	u8 packet[TILE_DATAGRAM_MAX_SIZE + 1];
+	for (;;) {
+		i32 packet_size = recv(session->sockfd, (char*)packet, sizeof(packet), 0);
+		if (packet_size < 0) break; // (also for errors, such as ICMP port unreachable: the requests will time out)
+		tile_datagram_header_t header;
+		if (packet_size > (i32)TILE_DATAGRAM_MAX_SIZE || packet_size < (i32)sizeof(header)) continue;
+		memcpy(&header, packet, sizeof(header));
+		if (header.magic != TILE_DATAGRAM_MAGIC || header.session_id != session->session_id) continue;
+		i32 message_size = open_tile_datagram(&session->gcm, TILE_DATAGRAM_FROM_SERVER, packet, packet_size);
+		tile_datagram_fragment_t fragment;
+		if (message_size < (i32)sizeof(fragment)) continue;
+		memcpy(&fragment, packet + sizeof(header), sizeof(fragment));
+		u32 id = fragment.request_id >> REMOTE_DATAGRAM_TILE_BITS;
+		i32 tile = (i32)(fragment.request_id & ((1u << REMOTE_DATAGRAM_TILE_BITS) - 1));
+		for (i32 i = 0; i < download_count; ++i) {
+			remote_download_t* download = downloads[i];
+			remote_datagram_download_t* datagram = download->datagram;
+			if (datagram->session != session || datagram->id != id || tile >= datagram->tile_count) continue;
+			download->last_activity_clock = get_clock();
+			if (download->first_byte_clock == 0) {
+				download->first_byte_clock = download->last_activity_clock;
+			}
+			download->bytes_received += packet_size;
+			handle_remote_datagram_fragment(download, tile, &fragment, packet + sizeof(header) + sizeof(fragment),
+			                                message_size - (i32)sizeof(fragment));
+			break;
+		}
+	}
+}
+
+// Asks again for the fragments that are overdue. Returns false if the download is no longer going over UDP: either it
+// got finished, or it needs to go over TCP (then needs_fallback is set).
+static bool32 update_remote_datagram_download(remote_download_t* download, i32* timeout_ms, bool32* needs_fallback) {
+	remote_datagram_download_t* datagram = download->datagram;
+	*needs_fallback = false;
+	if (datagram->tiles_left == 0 || is_remote_download_stopped(download)) {
+		release_remote_datagram_tiles(datagram);
+		finish_remote_download(download);
+		return false;
+	}
+	remote_datagram_session_t* session = datagram->session;
+	float timeout = (session->smoothed_rtt > 0.0f) ? ATLEAST(2.0f * session->smoothed_rtt, REMOTE_DATAGRAM_MIN_TIMEOUT_SECONDS)
+	                                               : REMOTE_DATAGRAM_INITIAL_TIMEOUT_SECONDS;
+	i64 now = get_clock();
+	bool32 is_failed = datagram->needs_fallback || session->state != DATAGRAM_SESSION_READY;
+	for (i32 i = 0; i < datagram->tile_count && !is_failed; ++i) {
+		remote_datagram_tile_t* state = datagram->tiles + i;
+		if (state->is_done) continue;
+		float seconds_left = timeout - get_seconds_elapsed(state->last_activity_clock, now);
+		if (seconds_left > 0.0f) {
+			*timeout_ms = MIN(*timeout_ms, (i32)(seconds_left * 1000.0f) + 1);
+		} else if (state->request_count >= REMOTE_DATAGRAM_MAX_REQUESTS) {
+			// Perhaps UDP doesn't get through at all, or the server was restarted and doesn't know the session.
+			printf("[network thread] Tiles over UDP from %s:%d are not coming in, going over TCP\n", session->hostname,
+			       session->portno);
+			session->failed_clock = now;
+			session->state = DATAGRAM_SESSION_FAILED;
+			is_failed = true;
+		} else {
+			send_remote_datagram_request(download, i);
+			*timeout_ms = MIN(*timeout_ms, (i32)(timeout * 1000.0f) + 1);
+		}
+	}
+	if (is_failed) {
+		release_remote_datagram_tiles(datagram);
+		datagram->has_fallen_back = true;
+		download->last_activity_clock = now;
+		++remote_datagram_stats.fallback_count;
+		*needs_fallback = true;
+		return false;
+	}
+	return true;
+}
+
+static bool32 create_wake_socket() {
+	i64 sockfd = (i64)socket(AF_INET, SOCK_DGRAM, 0);
+	if (sockfd < 0) return false;
+	struct sockaddr_in address = { .sin_family = AF_INET };
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t address_size = sizeof(address);
+	if (bind(sockfd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+	    getsockname(sockfd, (struct sockaddr*)&address, &address_size) != 0 ||
+	    connect(sockfd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+		closesocket(sockfd);
+		return false;
+	}
+	set_socket_blocking(sockfd, false);
+	wake_socket = sockfd;
+	return true;
+}
+
+// Runs on the network thread, and never returns. The callbacks of the downloads are called from here.
+void remote_network_thread_loop() {
+	if (!create_wake_socket()) {
+		printf("[network thread] Error: could not create the wake-up socket\n");
+	}
+	remote_download_t* waiting_downloads = NULL; // oldest first
+	remote_download_t* active_downloads[REMOTE_MAX_ACTIVE_DOWNLOADS];
+	i32 active_count = 0;
+	remote_download_t* datagram_downloads[REMOTE_DATAGRAM_MAX_DOWNLOADS]; // going over UDP
+	i32 datagram_count = 0;
+	for (;;) {
+		profiler_begin("start downloads");
+		// Pick up the new downloads, and keep them in the order they were submitted.
+		spin_lock(&downloads_lock);
+		remote_download_t* submitted = submitted_downloads;
+		submitted_downloads = NULL;
+		spin_unlock(&downloads_lock);
+		remote_download_t* new_downloads = NULL;
+		while (submitted) {
+			remote_download_t* next = submitted->next;
+			submitted->next = new_downloads;
+			new_downloads = submitted;
+			submitted = next;
+		}
+		remote_download_t** link = &waiting_downloads;
+		while (*link) {
+			link = &(*link)->next;
+		}
+		*link = new_downloads;
+
+		// Start whatever we can.
+		link = &waiting_downloads;
+		while (*link) {
+			remote_download_t* download = *link;
+			bool32 is_timed_out = get_seconds_elapsed(download->last_activity_clock, get_clock()) > REMOTE_DOWNLOAD_TIMEOUT_SECONDS;
+			if (is_remote_download_stopped(download) || is_timed_out) {
+				*link = download->next;
+				finish_remote_download(download);
+			} else if (download->datagram && !download->datagram->has_fallen_back &&
+			           datagram_count < REMOTE_DATAGRAM_MAX_DOWNLOADS && start_remote_datagram_download(download)) {
+				*link = download->next;
+				datagram_downloads[datagram_count++] = download;
+			} else if (active_count < REMOTE_MAX_ACTIVE_DOWNLOADS && start_remote_download(download)) {
+				*link = download->next;
+				active_downloads[active_count++] = download;
+			} else {
+				link = &download->next;
+			}
+		}
+
+		// Send a duplicate of the downloads that are taking unusually long to another server.
+		i32 hedge_timeout_ms = hedge_slow_remote_downloads(active_downloads, active_count, &waiting_downloads);
+
+		// Ask again for the fragments of the tiles coming over UDP that are overdue.
+		i32 datagram_timeout_ms = 1000;
+		i32 still_datagram_count = 0;
+		for (i32 i = 0; i < datagram_count; ++i) {
+			remote_download_t* download = datagram_downloads[i];
+			bool32 needs_fallback = false;
+			if (update_remote_datagram_download(download, &datagram_timeout_ms, &needs_fallback)) {
+				datagram_downloads[still_datagram_count++] = download;
+			} else if (needs_fallback) {
+				download->next = waiting_downloads;
+				waiting_downloads = download;
+				datagram_timeout_ms = 0;
+			}
+		}
+		datagram_count = still_datagram_count;
+
+		profiler_end();
+
+		// Wait until something comes in (or for the next timeout to expire).
+		struct pollfd poll_fds[1 + REMOTE_MAX_ACTIVE_DOWNLOADS + REMOTE_DATAGRAM_SESSION_COUNT];
+		poll_fds[0] = (struct pollfd){ .fd = wake_socket, .events = POLLIN };
+		for (i32 i = 0; i < active_count; ++i) {
+			poll_fds[1 + i] = (struct pollfd){ .fd = active_downloads[i]->connection->sockfd, .events = POLLIN };
+		}
+		remote_datagram_session_t* polled_sessions[REMOTE_DATAGRAM_SESSION_COUNT];
+		i32 polled_session_count = 0;
+		for (i32 i = 0; i < REMOTE_DATAGRAM_SESSION_COUNT; ++i) {
+			remote_datagram_session_t* session = datagram_sessions + i;
+			if (session->state == DATAGRAM_SESSION_READY) {
+				read_barrier;
+				poll_fds[1 + active_count + polled_session_count] = (struct pollfd){ .fd = session->sockfd, .events = POLLIN };
+				polled_sessions[polled_session_count++] = session;
+			}
+		}
+		i32 timeout_ms = MIN(MIN(waiting_downloads ? 100 : 1000, hedge_timeout_ms), datagram_timeout_ms);
+		i32 ready_count = poll(poll_fds, 1 + active_count + polled_session_count, timeout_ms);
+		if (ready_count < 0) {
+			print_socket_error(-1, "remote_network_thread_loop(): poll()");
+		}
+		if (poll_fds[0].revents) {
+			char discard[64];
+			while (recv(wake_socket, discard, sizeof(discard), 0) > 0) {}
+		}
+
+		profiler_begin("update downloads");
+		for (i32 i = 0; i < polled_session_count; ++i) {
+			if (ready_count > 0 && poll_fds[1 + active_count + i].revents != 0) {
+				receive_remote_datagrams(polled_sessions[i], datagram_downloads, datagram_count);
+			}
+		}
+		i32 still_active_count = 0;
+		for (i32 i = 0; i < active_count; ++i) {
+			remote_download_t* download = active_downloads[i];
+			bool32 is_readable = (ready_count > 0 && poll_fds[1 + i].revents != 0);
+			bool32 needs_retry = false;
+			if (update_active_remote_download(download, is_readable, &needs_retry)) {
+				active_downloads[still_active_count++] = download;
+			} else if (needs_retry) {
+				download->next = waiting_downloads;
+				waiting_downloads = download;
+			}
+		}
+		active_count = still_active_count;
+		profiler_end();
+	}
+}
+
+typedef struct {
+	i64* chunk_sizes;
+	i32 first_chunk;
+	i32 chunk_count;
+	i32 chunks_delivered;
+	i64 next_chunk_offset; // position of the next undelivered chunk within the response content
+	remote_chunk_received_func_t* callback;
+	void* userdata;
+} remote_batch_progress_t;
+
+// Hands over every chunk of a batch response that has arrived completely.
+static bool32 deliver_received_chunks(void* userdata, u8* content, i64 content_bytes_available, i64 content_length) {
+	remote_batch_progress_t* progress = (remote_batch_progress_t*) userdata;
+	while (progress->chunks_delivered < progress->chunk_count) {
+		i32 chunk_index = progress->first_chunk + progress->chunks_delivered;
+		i64 chunk_size = progress->chunk_sizes[chunk_index];
+		if (progress->next_chunk_offset + chunk_size > content_bytes_available) break;
+		progress->callback(progress->userdata, chunk_index, content + progress->next_chunk_offset, chunk_size);
+		progress->next_chunk_offset += chunk_size;
+		++progress->chunks_delivered;
+	}
+	return true;
+}
+
+// Downloads the chunks as batch requests of (at most) chunks_per_request chunks each, on the network thread.
+// Each chunk goes to the callback as soon as its last byte has arrived (in order). Once the download is over, the
+// done_callback gets the number of chunks that were delivered; the remaining ones could not be downloaded.
+// For a slide read with Range requests, every chunk gets a request of its own.
+void submit_remote_batch_download(network_location_t* location, i64 *chunk_offsets, i64 *chunk_sizes, i32 chunk_count,
+                                  i32 chunks_per_request, remote_chunk_received_func_t* callback,
+                                  remote_download_done_func_t* done_callback, void* userdata, void* owner) {
+	ASSERT(chunk_count > 0 && chunks_per_request > 0);
+	bool32 is_range_request = location->uses_range_requests;
+	if (is_range_request) chunks_per_request = 1;
+	i32 request_count = (chunk_count + chunks_per_request - 1) / chunks_per_request;
+	remote_download_t* download = create_remote_download(location, request_count, callback, done_callback, userdata,
+	                                                     owner);
+	download->chunk_sizes = (i64*) malloc(chunk_count * sizeof(i64));
+	memcpy(download->chunk_sizes, chunk_sizes, chunk_count * sizeof(i64));
+	remote_batch_progress_t* progress = (remote_batch_progress_t*) calloc(request_count, sizeof(remote_batch_progress_t));
+	download->progress = progress;
+	i32 server_count = download->server_count;
+	download->request_text = (u8*) malloc(request_count * server_count * 4096);
+	for (i32 r = 0; r < request_count; ++r) {
+		i32 first_chunk = r * chunks_per_request;
+		i32 batch_size = MIN(chunks_per_request, chunk_count - first_chunk);
+		char uri[4000] = {0};
+		if (is_range_request) {
+			get_range_request_uri(uri, sizeof(uri), location->filename);
+		} else if (!build_batch_uri(uri, sizeof(uri), location->filename, chunk_offsets + first_chunk,
+		                            chunk_sizes + first_chunk, batch_size)) {
+			request_count = r; // just send the ones that fit
+			break;
+		}
+		// The same request for each server (only the Host field is different).
+		for (i32 server_index = 0; server_index < server_count; ++server_index) {
+			const char* hostname = download->servers[server_index].hostname;
+			char* request = (char*)download->request_text + (r * server_count + server_index) * 4096;
+			if (is_range_request) {
+				i64 chunk_offset = chunk_offsets[first_chunk];
+				snprintf(request, 4096, "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%lld-%lld\r\nConnection: keep-alive\r\n\r\n",
+				         uri, hostname, chunk_offset, chunk_offset + chunk_sizes[first_chunk] - 1);
+			} else {
+				snprintf(request, 4096, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n", uri, hostname);
+			}
+			download->request_texts[r * server_count + server_index] = (remote_request_text_t){ (u8*)request,
+			                                                                                   (i32)strlen(request) };
+		}
+		progress[r] = (remote_batch_progress_t){
+			.chunk_sizes = download->chunk_sizes,
+			.first_chunk = first_chunk,
+			.chunk_count = batch_size,
+			.callback = forward_received_chunk,
+			.userdata = download,
+		};
+		download->requests[r] = (remote_pipelined_request_t){ deliver_received_chunks, progress + r,
+		                                                      .is_range_request = is_range_request };
+	}
+	download->request_count = request_count;
+	submit_remote_download(download);
+}
+
+typedef struct {
+	u32 tile_count;
+	i32 first_tile;
+	u32 tiles_delivered;
+	i64 next_tile_offset; // position of the next undelivered tile within the response content
+	remote_chunk_received_func_t* callback;
+	void* userdata;
+} remote_tile_progress_t;
+
+// A tile response starts with the sizes of all the tiles, which are followed by the tile data.
+static bool32 deliver_received_tiles(void* userdata, u8* content, i64 content_bytes_available, i64 content_length) {
+	remote_tile_progress_t* progress = (remote_tile_progress_t*) userdata;
+	i64 sizes_size = progress->tile_count * sizeof(u32);
+	if (content_bytes_available < sizes_size) return true;
+	if (progress->next_tile_offset == 0) {
+		progress->next_tile_offset = sizes_size;
+	}
+	while (progress->tiles_delivered < progress->tile_count) {
+		u32 tile_size;
+		memcpy(&tile_size, content + progress->tiles_delivered * sizeof(u32), sizeof(u32));
+		if (progress->next_tile_offset + tile_size > content_bytes_available) break;
+		progress->callback(progress->userdata, progress->first_tile + progress->tiles_delivered,
+		                   content + progress->next_tile_offset, tile_size);
+		progress->next_tile_offset += tile_size;
+		++progress->tiles_delivered;
+	}
+	return true;
+}
+
+// Downloads tiles by index on the network thread, using binary tile requests (see tile_request_t): one request for
+// each run of tiles that are in the same level. Each tile goes to the callback as soon as it has arrived. The requests
+// are sent as streams, with the highest priority of their tiles, so the server may answer them in a different order.
+// Once the download is over, the done_callback gets the number of tiles that were delivered.
+// With a quality (1-99), the server may send JPEG tiles re-encoded at that quality instead; those come in smaller than
+// the tile tables say (see send_reduced_quality_tiles() in server.c). Servers that don't know about this ignore it.
+void submit_remote_tile_download(network_location_t* location, u32 *levels, u32 *tile_indices, i32* priorities,
+                                 i32 tile_count, i32 quality, remote_chunk_received_func_t* callback,
+                                 remote_download_done_func_t* done_callback, void* userdata, void* owner) {
+	ASSERT(tile_count > 0);
+	remote_download_t* download = create_remote_download(location, tile_count, callback, done_callback, userdata, owner);
+	remote_tile_progress_t* progress = (remote_tile_progress_t*) calloc(tile_count, sizeof(remote_tile_progress_t));
+	download->progress = progress;
+	i32 server_count = download->server_count;
+	i32 max_request_size = 1024 + sizeof(tile_request_t) + TILE_REQUEST_MAX_TILES * sizeof(u32);
+	download->request_text = (u8*) malloc(tile_count * server_count * max_request_size);
+	u8* request = download->request_text;
+	i32 request_count = 0;
+	for (i32 first_tile = 0; first_tile < tile_count; ) {
+		u32 run_length = 1;
+		while (first_tile + run_length < (u32)tile_count && run_length < TILE_REQUEST_MAX_TILES &&
+		       levels[first_tile + run_length] == levels[first_tile]) {
+			++run_length;
+		}
+		i32 priority = priorities[first_tile];
+		for (u32 i = 1; i < run_length; ++i) {
+			priority = MAX(priority, priorities[first_tile + i]);
+		}
+		u32 stream_id = (u32)request_count + 1; // unique on the connection, which only this download uses
+		// The mirrors don't know the slide handle; they get asked by filename.
+		for (i32 server_index = 0; server_index < server_count; ++server_index) {
+			bool32 has_handle = (server_index == 0);
+			tile_request_t tile_request = { TILE_REQUEST_MAGIC, has_handle ? location->slide_handle : 0,
+			                                levels[first_tile], run_length };
+			i32 body_size = (i32)(sizeof(tile_request) + run_length * sizeof(u32));
+			char quality_header_field[32] = "";
+			if (quality > 0) {
+				snprintf(quality_header_field, sizeof(quality_header_field), "Tile-quality: %d\r\n", quality);
+			}
+			char http_headers[1024];
+			i32 headers_size = snprintf(http_headers, sizeof(http_headers),
+			                            "POST /tiles%s%s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n"
+			                            "Stream-id: %u\r\nStream-priority: %d\r\n%s"
+			                            "Content-type: application/octet-stream\r\nContent-length: %d\r\n\r\n",
+			                            has_handle ? "" : "/", has_handle ? "" : location->filename,
+			                            download->servers[server_index].hostname, stream_id, priority,
+			                            quality_header_field, body_size);
+			memcpy(request, http_headers, headers_size);
+			memcpy(request + headers_size, &tile_request, sizeof(tile_request));
+			memcpy(request + headers_size + sizeof(tile_request), tile_indices + first_tile, run_length * sizeof(u32));
+			download->request_texts[request_count * server_count + server_index] =
+				(remote_request_text_t){ request, headers_size + body_size };
+			request += headers_size + body_size;
+		}
+
+		progress[request_count] = (remote_tile_progress_t){
+			.tile_count = run_length,
+			.first_tile = first_tile,
+			.callback = forward_received_chunk,
+			.userdata = download,
+		};
+		download->requests[request_count] = (remote_pipelined_request_t){ deliver_received_tiles,
+		                                                                  progress + request_count, stream_id };
+		++request_count;
+		first_tile += run_length;
+	}
+	download->request_count = request_count;
+	if (use_datagram_tile_transport && quality == 0 && location->slide_handle != 0 &&
+	    tile_count <= (1 << REMOTE_DATAGRAM_TILE_BITS)) {
+		allow_remote_datagram_download(download, location, levels, tile_indices, tile_count);
+	}
+	submit_remote_download(download);
+}
+
+// The copy of the case list from an earlier download (kept in the disk cache) is revalidated with its ETag: if it is
+// still current, the server only sends back 304 Not Modified. Otherwise, the content comes LZ4-compressed (see
+// SLIDE_SET_LZ4_ENCODING), if the server thinks that is worth it.
+mem_t* download_remote_caselist(const char *hostname, i32 portno, const char *filename) {
+	mem_t* result = NULL;
+	i64 start = get_clock();
+
+	char cached_etag[256] = {0};
+	mem_t* cached = disk_cache_read_caselist(hostname, portno, filename, cached_etag, sizeof(cached_etag));
+	char header_fields[512];
+	i32 header_fields_len = snprintf(header_fields, sizeof(header_fields), "Accept-encoding: " SLIDE_SET_LZ4_ENCODING "\r\n");
+	if (cached && cached_etag[0]) {
+		snprintf(header_fields + header_fields_len, sizeof(header_fields) - header_fields_len, "If-None-Match: %s\r\n",
+		         cached_etag);
+	}
+
+	char uri[2048] = {0};
+	snprintf(uri, sizeof(uri), "/slide_set/%s", filename);
+	remote_response_t response;
+	if (remote_get_with_header_fields(hostname, portno, uri, header_fields, NULL, 0, NULL, NULL, &response, 0)) {
+		if (response.status == 304 && cached) {
+			result = cached;
+			cached = NULL;
+			printf("Case list '%s' is unchanged, using the cached copy (%g seconds).\n", filename,
+			       get_seconds_elapsed(start, get_clock()));
+		} else if (response.status != 304) {
+			// the caller expects only the file contents, without the HTTP headers
+			const char* encoding = find_http_header_field(response.buffer, response.header_size, "Content-encoding");
+			if (encoding && strncmp(encoding, SLIDE_SET_LZ4_ENCODING, strlen(SLIDE_SET_LZ4_ENCODING)) == 0) {
+				const char* value = find_http_header_field(response.buffer, response.header_size, "Uncompressed-length");
+				i64 uncompressed_length = value ? atoll(value) : -1;
+				if (uncompressed_length >= 0 && uncompressed_length < LZ4_MAX_INPUT_SIZE &&
+				    response.content_length < LZ4_MAX_INPUT_SIZE) {
+					result = platform_allocate_mem_buffer((size_t)uncompressed_length); // ownership passes to caller
+					i32 decompressed_size = LZ4_decompress_safe((const char*)response.content, (char*)result->data,
+					                                            (i32)response.content_length, (i32)uncompressed_length);
+					if (decompressed_size == uncompressed_length) {
+						result->len = (size_t)uncompressed_length;
+					} else {
+						free(result);
+						result = NULL;
+					}
+				}
+				if (!result) printf("Case list '%s': could not decompress\n", filename);
+			} else {
+				size_t content_length = (size_t)response.content_length;
+				result = platform_allocate_mem_buffer(content_length); // ownership passes to caller
+				memcpy(result->data, response.content, content_length);
+				result->len = content_length;
+			}
+			if (result) {
+				result->data[result->len] = '\0';
+				const char* etag = find_http_header_field(response.buffer, response.header_size, "ETag");
+				if (etag) {
+					char etag_value[256];
+					copy_http_header_value(etag_value, sizeof(etag_value), etag);
+					disk_cache_write_caselist(hostname, portno, filename, etag_value, result->data, result->len);
+				}
+				printf("Downloaded case list '%s' (%lld bytes transferred) in %g seconds.\n", filename,
+				       response.content_length, get_seconds_elapsed(start, get_clock()));
+			}
+		}
+		free(response.buffer);
+	}
+	if (cached) free(cached);
+
+	return result;
+}
+
+// For a slide read with Range requests, the disk cache keeps this (plus the ETag and size) in place of the header.
+#define RANGE_SLIDE_IDENTITY_PREFIX "range-slide:"
+
+// Tile downloads are idle when the network thread has nothing left to do. Prefetching waits for that (see caselist.c).
+bool32 are_remote_downloads_idle() {
+	spin_lock(&downloads_lock);
+	bool32 result = (live_downloads == NULL);
+	spin_unlock(&downloads_lock);
+	return result;
+}
+
+// Like are_remote_downloads_idle(), but not counting the downloads of owner (see cancel_remote_downloads()).
+bool32 are_remote_downloads_idle_except(void* owner) {
+	bool32 result = true;
+	spin_lock(&downloads_lock);
+	for (remote_download_t* download = live_downloads; download; download = download->next_live) {
+		if (download->owner != owner) {
+			result = false;
+			break;
+		}
+	}
+	spin_unlock(&downloads_lock);
+	return result;
+}
+
+// Other servers that have the same slides as the one the user connects to (see network_location_t::mirrors).
+static char mirrored_hostname[256];
+static i32 mirrored_portno;
+static shard_node_t remote_mirrors[NETWORK_LOCATION_MAX_MIRRORS];
+static i32 remote_mirror_count;
+static volatile i32 remote_mirrors_lock;
+
+// Slides that are opened from hostname:portno from now on may download their tiles from the servers in mirror_list
+// as well (a comma-separated list of host:port).
+void set_remote_mirrors(const char* hostname, i32 portno, const char* mirror_list) {
+	spin_lock(&remote_mirrors_lock);
+	strncpy(mirrored_hostname, hostname, sizeof(mirrored_hostname) - 1);
+	mirrored_portno = portno;
+	remote_mirror_count = shard_ring_parse_nodes(mirror_list, portno, remote_mirrors, NETWORK_LOCATION_MAX_MIRRORS);
+	spin_unlock(&remote_mirrors_lock);
+}
+
+static void get_remote_mirrors(const char* hostname, i32 portno, network_location_t* location) {
+	location->mirror_count = 0;
+	spin_lock(&remote_mirrors_lock);
+	if (mirrored_portno == portno && strcmp(mirrored_hostname, hostname) == 0) {
+		for (i32 i = 0; i < remote_mirror_count; ++i) {
+			network_mirror_t* mirror = location->mirrors + location->mirror_count;
+			if (remote_mirrors[i].portno == portno && strcmp(remote_mirrors[i].hostname, hostname) == 0) continue;
+			memcpy(mirror->hostname, remote_mirrors[i].hostname, sizeof(mirror->hostname));
+			mirror->portno = remote_mirrors[i].portno;
+			++location->mirror_count;
+		}
+	}
+	spin_unlock(&remote_mirrors_lock);
+}
+
+// Servers that spread the slides over several nodes (see shard_ring.h) hand out the node list at /nodes. The list is
+// kept for a while per server, so that slides can be requested from the node they belong to straight away.
+#define REMOTE_NODE_LIST_COUNT 8
+#define REMOTE_NODE_LIST_MAX_AGE_SECONDS 300.0f
+
+typedef struct {
+	char hostname[256];
+	i32 portno;
+	shard_ring_t ring; // empty if the server has no other nodes
+	i64 clock;
+} remote_node_list_t;
+
+static remote_node_list_t remote_node_lists[REMOTE_NODE_LIST_COUNT];
+static i32 remote_node_list_count;
+static volatile i32 remote_node_lists_lock;
+
+static i32 find_remote_node_list(const char* hostname, i32 portno) {
+	for (i32 i = 0; i < remote_node_list_count; ++i) {
+		remote_node_list_t* entry = remote_node_lists + i;
+		if (entry->portno == portno && strcmp(entry->hostname, hostname) == 0) return i;
+	}
+	return -1;
+}
+
+static void remove_remote_node_list(i32 index) {
+	shard_ring_destroy(&remote_node_lists[index].ring);
+	remote_node_lists[index] = remote_node_lists[--remote_node_list_count];
+}
+
+// (needs remote_node_lists_lock to be locked)
+static void lookup_remote_slide_node(remote_node_list_t* entry, const char* filename, char* node_hostname,
+                                     size_t node_hostname_size, i32* node_portno) {
+	i32 node_index = shard_ring_lookup(&entry->ring, filename);
+	if (node_index >= 0) {
+		shard_node_t* node = entry->ring.nodes + node_index;
+		strncpy(node_hostname, node->hostname, node_hostname_size - 1);
+		node_hostname[node_hostname_size - 1] = '\0';
+		*node_portno = node->portno;
+	}
+}
+
+// Finds the node that serves the slide: that is the server itself, unless it has other nodes. Downloads the node list
+// if it isn't known yet (or has become old, or if refresh is set), so this may block.
+static void resolve_remote_slide_node(const char* hostname, i32 portno, const char* filename, bool32 refresh,
+                                      char* node_hostname, size_t node_hostname_size, i32* node_portno) {
+	strncpy(node_hostname, hostname, node_hostname_size - 1);
+	node_hostname[node_hostname_size - 1] = '\0';
+	*node_portno = portno;
+
+	spin_lock(&remote_node_lists_lock);
+	i32 index = find_remote_node_list(hostname, portno);
+	if (!refresh && index >= 0 && get_seconds_elapsed(remote_node_lists[index].clock, get_clock())
+	                              < REMOTE_NODE_LIST_MAX_AGE_SECONDS) {
+		lookup_remote_slide_node(remote_node_lists + index, filename, node_hostname, node_hostname_size, node_portno);
+		spin_unlock(&remote_node_lists_lock);
+		return;
+	}
+	spin_unlock(&remote_node_lists_lock);
+
+	// A server that doesn't know /nodes has no other nodes either.
+	shard_ring_t ring = {0};
+	remote_response_t response;
+	if (remote_get(hostname, portno, "/nodes", NULL, 0, &response, 0)) {
+		char* node_list = (char*) calloc(1, (size_t)response.content_length + 1);
+		memcpy(node_list, response.content, (size_t)response.content_length);
+		if (shard_ring_parse(&ring, node_list, portno)) {
+			log_info("%s:%d has %d nodes\n", hostname, portno, ring.node_count);
+		}
+		free(node_list);
+		free(response.buffer);
+	}
+
+	spin_lock(&remote_node_lists_lock);
+	index = find_remote_node_list(hostname, portno);
+	if (index >= 0) {
+		remove_remote_node_list(index);
+	}
+	if (remote_node_list_count == REMOTE_NODE_LIST_COUNT) {
+		i32 oldest = 0;
+		for (i32 i = 1; i < remote_node_list_count; ++i) {
+			if (remote_node_lists[i].clock < remote_node_lists[oldest].clock) oldest = i;
+		}
+		remove_remote_node_list(oldest);
+	}
+	remote_node_list_t* entry = remote_node_lists + remote_node_list_count++;
+	memset(entry, 0, sizeof(*entry));
+	strncpy(entry->hostname, hostname, sizeof(entry->hostname) - 1);
+	entry->portno = portno;
+	entry->ring = ring;
+	entry->clock = get_clock();
+	lookup_remote_slide_node(entry, filename, node_hostname, node_hostname_size, node_portno);
+	spin_unlock(&remote_node_lists_lock);
+}
+
+// Headers of slides that are likely to be opened next, downloaded ahead of time (see prefetch_remote_slide_header()).
+// The slide handles in them stay valid for as long as the server runs, but the server may be restarted meanwhile.
+#define REMOTE_PREFETCHED_HEADER_COUNT 8
+#define REMOTE_PREFETCHED_HEADER_MAX_AGE_SECONDS 300.0f
+
+typedef struct {
+	char hostname[256];
+	i32 portno;
+	char filename[512];
+	remote_response_t response; // owns response.buffer
+	i64 clock;
+} remote_prefetched_header_t;
+
+static remote_prefetched_header_t prefetched_headers[REMOTE_PREFETCHED_HEADER_COUNT];
+static i32 prefetched_header_count;
+static volatile i32 prefetched_headers_lock;
+
+static i32 find_prefetched_remote_header(const char* hostname, i32 portno, const char* filename) {
+	for (i32 i = 0; i < prefetched_header_count; ++i) {
+		remote_prefetched_header_t* entry = prefetched_headers + i;
+		if (entry->portno == portno && strcmp(entry->hostname, hostname) == 0 && strcmp(entry->filename, filename) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void remove_prefetched_remote_header(i32 index, bool32 free_response) {
+	if (free_response) free(prefetched_headers[index].response.buffer);
+	prefetched_headers[index] = prefetched_headers[--prefetched_header_count];
+}
+
+// Downloads the header of a slide (which includes the tiles of its coarsest level), for open_remote_tiff() to use
+// later. Blocks until done; meant to be called from a background thread. The header is kept under the server that was
+// asked, even if the slide is on another node.
+bool32 prefetch_remote_slide_header(const char* hostname, i32 portno, const char* filename) {
+	spin_lock(&prefetched_headers_lock);
+	i32 index = find_prefetched_remote_header(hostname, portno, filename);
+	bool32 is_fresh = (index >= 0 && get_seconds_elapsed(prefetched_headers[index].clock, get_clock())
+	                                 < REMOTE_PREFETCHED_HEADER_MAX_AGE_SECONDS);
+	spin_unlock(&prefetched_headers_lock);
+	if (is_fresh) return true;
+
+	char node_hostname[256];
+	i32 node_portno;
+	resolve_remote_slide_node(hostname, portno, filename, false, node_hostname, sizeof(node_hostname), &node_portno);
+	char uri[2048] = {0};
+	snprintf(uri, sizeof(uri), "/slide/%s/header", filename);
+	remote_response_t response;
+	if (!remote_get(node_hostname, node_portno, uri, NULL, 0, &response, 0)) {
+		return false;
+	}
+
+	spin_lock(&prefetched_headers_lock);
+	index = find_prefetched_remote_header(hostname, portno, filename);
+	if (index >= 0) {
+		remove_prefetched_remote_header(index, true);
+	}
+	if (prefetched_header_count == REMOTE_PREFETCHED_HEADER_COUNT) {
+		i32 oldest = 0;
+		for (i32 i = 1; i < prefetched_header_count; ++i) {
+			if (prefetched_headers[i].clock < prefetched_headers[oldest].clock) oldest = i;
+		}
+		remove_prefetched_remote_header(oldest, true);
+	}
+	remote_prefetched_header_t* entry = prefetched_headers + prefetched_header_count++;
+	memset(entry, 0, sizeof(*entry));
+	strncpy(entry->hostname, hostname, sizeof(entry->hostname) - 1);
+	entry->portno = portno;
+	strncpy(entry->filename, filename, sizeof(entry->filename) - 1);
+	entry->response = response;
+	entry->clock = get_clock();
+	spin_unlock(&prefetched_headers_lock);
+	return true;
+}
+
+// If the header was prefetched (and is still fresh), the response is handed over; the caller needs to free its buffer.
+static bool32 take_prefetched_remote_header(const char* hostname, i32 portno, const char* filename,
+                                            remote_response_t* response) {
+	bool32 result = false;
+	spin_lock(&prefetched_headers_lock);
+	i32 index = find_prefetched_remote_header(hostname, portno, filename);
+	if (index >= 0) {
+		remote_prefetched_header_t* entry = prefetched_headers + index;
+		result = (get_seconds_elapsed(entry->clock, get_clock()) < REMOTE_PREFETCHED_HEADER_MAX_AGE_SECONDS);
+		if (result) *response = entry->response;
+		remove_prefetched_remote_header(index, !result);
+	}
+	spin_unlock(&prefetched_headers_lock);
+	return result;
+}
+
+typedef struct {
+	tiff_deserializer_t deserializer;
+	i64 content_fed;
+	volatile float* progress; // if given: the part of the header that has come in
+	volatile i32* is_cancelled; // if given (and set), the download is abandoned
+} remote_header_progress_t;
+
+// The header is deserialized while it is coming in.
+static bool32 deserialize_received_header(void* userdata, u8* content, i64 content_bytes_available, i64 content_length) {
+	remote_header_progress_t* progress = (remote_header_progress_t*) userdata;
+	tiff_deserializer_feed(&progress->deserializer, content + progress->content_fed,
+	                       content_bytes_available - progress->content_fed);
+	progress->content_fed = content_bytes_available;
+	if (progress->progress && content_length > 0) {
+		*progress->progress = (float)content_bytes_available / (float)content_length;
+	}
+	return !(progress->is_cancelled && *progress->is_cancelled);
+}
+
+// Gets the structure of a remote slide: the serialized header from a slide server, or else the IFDs of the file itself
+// using Range requests (from a plain web server), or else whatever is left in the disk cache. Also opens the disk
+// cache. Blocks until done; meant to be called from a background thread (see slide_open.c). If is_cancelled gets set,
+// the header download is cut off. On success, the caller owns the tiff and the disk cache (which may be NULL).
+bool32 open_remote_tiff(const char* hostname, i32 portno, const char* filename, tiff_t* tiff,
+                        struct disk_cache_t** disk_cache_out, volatile float* progress, volatile i32* is_cancelled) {
+	i64 start = get_clock();
+
+	// Tiles that were downloaded in an earlier session may still be on disk. (The disk cache belongs to the server that
+	// was asked, not to the node that has the slide, so it stays valid when nodes are added.)
+	disk_cache_t* disk_cache = disk_cache_open(hostname, portno, filename);
+	char node_hostname[256];
+	i32 node_portno;
+	resolve_remote_slide_node(hostname, portno, filename, false, node_hostname, sizeof(node_hostname), &node_portno);
+
+	char uri[2048] = {0};
+	snprintf(uri, sizeof(uri), "/slide/%s/header", filename);
+	memset(tiff, 0, sizeof(*tiff));
+	remote_header_progress_t header_progress = { .progress = progress, .is_cancelled = is_cancelled };
+	tiff_deserializer_begin(&header_progress.deserializer, tiff);
+	remote_response_t response;
+	bool32 read_ok = take_prefetched_remote_header(hostname, portno, filename, &response);
+	if (read_ok) {
+		printf("Using the prefetched header of %s\n", filename);
+		deserialize_received_header(&header_progress, response.content, response.content_length, response.content_length);
+	} else {
+		read_ok = remote_get_with_header_fields(node_hostname, node_portno, uri, NULL, NULL, 0, deserialize_received_header,
+		                                        &header_progress, &response, 0);
+		if (!read_ok && header_progress.content_fed == 0 && !(is_cancelled && *is_cancelled)) {
+			// If nodes were added or removed since the node list was downloaded, the slide may have moved.
+			char old_node_hostname[256];
+			memcpy(old_node_hostname, node_hostname, sizeof(old_node_hostname));
+			i32 old_node_portno = node_portno;
+			resolve_remote_slide_node(hostname, portno, filename, true, node_hostname, sizeof(node_hostname), &node_portno);
+			if (node_portno != old_node_portno || strcmp(node_hostname, old_node_hostname) != 0) {
+				read_ok = remote_get_with_header_fields(node_hostname, node_portno, uri, NULL, NULL, 0,
+				                                        deserialize_received_header, &header_progress, &response, 0);
+			}
+		}
+	}
+	bool32 header_deserialized = tiff_deserializer_end(&header_progress.deserializer);
+
+	bool32 deserialized = false;
+	bool32 uses_range_requests = false;
+	u32 slide_handle = 0;
+	remote_range_info_t range_info = {0};
+	if (is_cancelled && *is_cancelled) {
+		// A different slide is wanted now; don't bother with the fallbacks.
+	} else if (!read_ok && open_remote_tiff_with_range_requests(tiff, hostname, portno, filename, &range_info)) {
+		// Not a slide server, but a plain web server (or object storage) that serves the file itself.
+		deserialized = true;
+		uses_range_requests = true;
+		if (disk_cache) {
+			// There is no serialized header to compare; the ETag (or Last-Modified) tells whether the file changed.
+			char identity[512];
+			snprintf(identity, sizeof(identity), "%s%s/%lld", RANGE_SLIDE_IDENTITY_PREFIX, range_info.validator,
+			         range_info.filesize);
+			disk_cache_validate_header(disk_cache, (u8*)identity, strlen(identity), tiff->filesize);
+		}
+	} else if (read_ok) {
+		// Servers that support binary tile requests hand out a handle for the slide.
+		const char* value = find_http_header_field(response.buffer, response.header_size, "Slide-handle");
+		if (value) slide_handle = (u32)atoll(value);
+		deserialized = header_deserialized;
+		if (deserialized && disk_cache) {
+			// If the slide has changed on the server, the cached tiles are stale and need to be thrown away.
+			disk_cache_validate_header(disk_cache, response.content, response.content_length, tiff->filesize);
+		}
+	} else if (disk_cache && disk_cache->header &&
+	           !(disk_cache->header_size >= sizeof(RANGE_SLIDE_IDENTITY_PREFIX) - 1 &&
+	             memcmp(disk_cache->header, RANGE_SLIDE_IDENTITY_PREFIX, sizeof(RANGE_SLIDE_IDENTITY_PREFIX) - 1) == 0)) {
+		// The server could not be reached, but we can still show whatever we have cached.
+		printf("Could not download the slide header, falling back to the disk cache\n");
+		deserialized = tiff_deserialize(tiff, disk_cache->header, disk_cache->header_size);
+	}
+
+	if (deserialized) {
+		tiff->is_remote = true;
+		tiff->location = (network_location_t){ .portno = node_portno, .slide_handle = slide_handle,
+		                                       .uses_range_requests = uses_range_requests };
+		strncpy(tiff->location.hostname, node_hostname, sizeof(tiff->location.hostname) - 1);
+		strncpy(tiff->location.filename, filename, sizeof(tiff->location.filename) - 1);
+		// (If the slide is on another node, the mirrors of the server that was asked may not have it.)
+		if (node_portno == portno && strcmp(node_hostname, hostname) == 0) {
+			get_remote_mirrors(hostname, portno, &tiff->location);
+		}
+		*disk_cache_out = disk_cache;
+	} else {
+		tiff_destroy(tiff);
+		disk_cache_close(disk_cache);
+		*disk_cache_out = NULL;
+	}
+	if (read_ok) free(response.buffer);
+
+	printf("Open remote took %g seconds\n", get_seconds_elapsed(start, get_clock()));
+	return deserialized;
+}
+
+// Downloads the slide catalog of a server (see slide_catalog.h). The last one is kept in the disk cache: if it is still
+// current, the server only confirms that; if the server can't be reached, the cached one is used.
+mem_t* download_remote_slide_catalog(const char* hostname, i32 portno) {
+	mem_t* result = NULL;
+	i64 start = get_clock();
+
+	char cached_etag[256] = {0};
+	mem_t* cached = disk_cache_read_caselist(hostname, portno, SLIDE_CATALOG_CACHE_NAME, cached_etag, sizeof(cached_etag));
+	char header_fields[512] = {0};
+	if (cached && cached_etag[0]) {
+		snprintf(header_fields, sizeof(header_fields), "If-None-Match: %s\r\n", cached_etag);
+	}
+	remote_response_t response;
+	if (remote_get_with_header_fields(hostname, portno, "/catalog", header_fields, NULL, 0, NULL, NULL, &response, 0)) {
+		if (response.status == 304 && cached) {
+			result = cached;
+			cached = NULL;
+		} else if (response.status == 200) {
+			size_t content_length = (size_t)response.content_length;
+			result = platform_allocate_mem_buffer(content_length); // ownership passes to caller
+			memcpy(result->data, response.content, content_length);
+			result->len = content_length;
+			const char* etag = find_http_header_field(response.buffer, response.header_size, "ETag");
+			if (etag) {
+				char etag_value[256];
+				copy_http_header_value(etag_value, sizeof(etag_value), etag);
+				disk_cache_write_caselist(hostname, portno, SLIDE_CATALOG_CACHE_NAME, etag_value, result->data, result->len);
+			}
+		}
+		free(response.buffer);
+	}
+	if (!result && cached) {
+		printf("Could not download the slide catalog, falling back to the disk cache\n");
+		result = cached;
+		cached = NULL;
+	}
+	if (cached) free(cached);
+	if (result) {
+		printf("Slide catalog of %s:%d: %llu bytes, in %g seconds\n", hostname, portno, (u64)result->len,
+		       get_seconds_elapsed(start, get_clock()));
+	}
+	return result;
+}
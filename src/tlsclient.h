@@ -26,14 +26,51 @@ extern "C" {
 #endif
 
 
+// Measurements of the streamed batch downloads, summed until the main thread takes them out (once per frame).
+typedef struct remote_link_stats_t {
+	i32 volatile lock;
+	i32 transfer_count;
+	float rtt_seconds; // summed over the transfers: time until the first byte of the response came back
+	float receive_seconds; // summed over the transfers: time spent receiving the responses
+	i64 bytes_received;
+	i32 chunks_received;
+} remote_link_stats_t;
+
+// Tiles over UDP (experimental, see tile_datagram.h). Only counted by the network thread.
+typedef struct remote_datagram_stats_t {
+	i64 tiles_received;
+	i64 fragments_requested_again;
+	i64 fallback_count; // downloads that went over TCP after all
+} remote_datagram_stats_t;
+
+// Called on the network thread for each chunk of a download; data is only valid for the duration of the call.
+typedef void remote_chunk_received_func_t(void* userdata, i32 chunk_index, u8* data, i64 size);
+// Called on the network thread once a download is over (completed, failed, timed out, or cancelled).
+typedef void remote_download_done_func_t(void* userdata, i32 chunks_delivered);
+
 // prototypes
 void init_networking();
-u8 *download_remote_chunk(const char *hostname, i32 portno, const char *filename, i64 chunk_offset, i64 chunk_size,
-                          i32 *bytes_read, i32 thread_id);
+void keep_remote_connections_ready(const char* hostname, i32 portno);
+void set_remote_mirrors(const char* hostname, i32 portno, const char* mirror_list);
+bool32 download_remote_chunk(network_location_t* location, i64 chunk_offset, i64 chunk_size, u8* dest, i64 dest_capacity,
+                             i32 thread_id);
 u8 *download_remote_batch(const char *hostname, i32 portno, const char *filename, i64 *chunk_offsets, i64 *chunk_sizes,
                           i32 batch_size, i32 *bytes_read, i32 thread_id);
+void submit_remote_batch_download(network_location_t* location, i64 *chunk_offsets, i64 *chunk_sizes, i32 chunk_count,
+                                  i32 chunks_per_request, remote_chunk_received_func_t* callback,
+                                  remote_download_done_func_t* done_callback, void* userdata, void* owner);
+void submit_remote_tile_download(network_location_t* location, u32 *levels, u32 *tile_indices, i32* priorities,
+                                 i32 tile_count, i32 quality, remote_chunk_received_func_t* callback,
+                                 remote_download_done_func_t* done_callback, void* userdata, void* owner);
+void cancel_remote_downloads(void* owner);
+void remote_network_thread_loop();
 mem_t* download_remote_caselist(const char *hostname, i32 portno, const char *filename);
-bool32 open_remote_slide(app_state_t *app_state, const char *hostname, i32 portno, const char *filename);
+mem_t* download_remote_slide_catalog(const char* hostname, i32 portno);
+bool32 open_remote_tiff(const char* hostname, i32 portno, const char* filename, tiff_t* tiff,
+                        struct disk_cache_t** disk_cache_out, volatile float* progress, volatile i32* is_cancelled);
+bool32 prefetch_remote_slide_header(const char* hostname, i32 portno, const char* filename);
+bool32 are_remote_downloads_idle();
+bool32 are_remote_downloads_idle_except(void* owner);
 
 // globals
 #if defined(TLSCLIENT_IMPL)
@@ -44,7 +81,9 @@ bool32 open_remote_slide(app_state_t *app_state, const char *hostname, i32 portn
 #undef extern
 #endif
 
-
+extern remote_link_stats_t remote_link_stats;
+extern remote_datagram_stats_t remote_datagram_stats;
+extern bool use_datagram_tile_transport INIT(= false); // experimental: download tiles over UDP, if the server offers it
 
 #undef INIT
 #undef extern
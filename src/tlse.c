@@ -70,6 +70,15 @@
 #endif
 
 #include "tlse.h"
+#ifdef TLS_CPU_DISPATCH
+    // hardware AES-GCM and SIMD ChaCha20, chosen at runtime (the CPU_KERNEL_AES_GCM and CPU_KERNEL_CHACHA20 levels,
+    // see cpu_dispatch.h)
+    #include "cpu_dispatch.h"
+    #if CPU_AVX2_SUPPORTED
+        #include <immintrin.h>
+        #define TLS_AEAD_SIMD
+    #endif
+#endif
 #ifdef TLS_CURVE25519
     #include "curve25519.c"
 #endif
@@ -164,6 +173,11 @@
 
 #define DTLS_COOKIE_SIZE          32
 
+// session tickets are encrypted with AES-128-CTR and authenticated with HMAC-SHA256 (truncated)
+#define TLS_TICKET_KEY_SIZE       48 // 16 bytes AES key + 32 bytes HMAC key
+#define TLS_TICKET_IV_SIZE        16
+#define TLS_TICKET_MAC_SIZE       16
+
 #define TLS_MAX_SHA_SIZE 48
 // 16(md5) + 20(sha1)
 #define TLS_V11_HASH_SIZE 36
@@ -345,6 +359,150 @@ static inline void chacha_ivupdate(chacha_ctx *x, const u8 *iv, const u8 *aad, c
     x->input[15] = _private_tls_U8TO32_LITTLE(iv + 8) ^ _private_tls_U8TO32_LITTLE(aad + 4);
 }
 
+#ifdef TLS_AEAD_SIMD
+// ChaCha20 on 4 (SSE2) or 8 (AVX2) blocks at a time: each register holds the same word of the state of all the
+// blocks, so that the quarter rounds are the same as above; the words are transposed back into blocks at the end.
+
+#define TLS_CHACHA_ROTL_SSE2(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define TLS_CHACHA_QUARTERROUND_SSE2(a, b, c, d) \
+    a = _mm_add_epi32(a, b); d = TLS_CHACHA_ROTL_SSE2(_mm_xor_si128(d, a), 16); \
+    c = _mm_add_epi32(c, d); b = TLS_CHACHA_ROTL_SSE2(_mm_xor_si128(b, c), 12); \
+    a = _mm_add_epi32(a, b); d = TLS_CHACHA_ROTL_SSE2(_mm_xor_si128(d, a), 8); \
+    c = _mm_add_epi32(c, d); b = TLS_CHACHA_ROTL_SSE2(_mm_xor_si128(b, c), 7);
+
+static void _private_tls_chacha_blocks_sse2(chacha_ctx *x, const u8 *m, u8 *c, u32 blocks) {
+    u32 block;
+    int i;
+    for (block = 0; block + 4 <= blocks; block += 4) {
+        __m128i j[16];
+        __m128i v[16];
+        for (i = 0; i < 16; i++)
+            j[i] = _mm_set1_epi32((int)x->input[i]);
+        j[12] = _mm_add_epi32(j[12], _mm_set_epi32(3, 2, 1, 0));
+        for (i = 0; i < 16; i++)
+            v[i] = j[i];
+        for (i = 20; i > 0; i -= 2) {
+            TLS_CHACHA_QUARTERROUND_SSE2(v[0], v[4], v[8], v[12])
+            TLS_CHACHA_QUARTERROUND_SSE2(v[1], v[5], v[9], v[13])
+            TLS_CHACHA_QUARTERROUND_SSE2(v[2], v[6], v[10], v[14])
+            TLS_CHACHA_QUARTERROUND_SSE2(v[3], v[7], v[11], v[15])
+            TLS_CHACHA_QUARTERROUND_SSE2(v[0], v[5], v[10], v[15])
+            TLS_CHACHA_QUARTERROUND_SSE2(v[1], v[6], v[11], v[12])
+            TLS_CHACHA_QUARTERROUND_SSE2(v[2], v[7], v[8], v[13])
+            TLS_CHACHA_QUARTERROUND_SSE2(v[3], v[4], v[9], v[14])
+        }
+        for (i = 0; i < 16; i++)
+            v[i] = _mm_add_epi32(v[i], j[i]);
+        for (i = 0; i < 16; i += 4) {
+            __m128i t0 = _mm_unpacklo_epi32(v[i], v[i + 1]);
+            __m128i t1 = _mm_unpacklo_epi32(v[i + 2], v[i + 3]);
+            __m128i t2 = _mm_unpackhi_epi32(v[i], v[i + 1]);
+            __m128i t3 = _mm_unpackhi_epi32(v[i + 2], v[i + 3]);
+            __m128i ks[4];
+            ks[0] = _mm_unpacklo_epi64(t0, t1);
+            ks[1] = _mm_unpackhi_epi64(t0, t1);
+            ks[2] = _mm_unpacklo_epi64(t2, t3);
+            ks[3] = _mm_unpackhi_epi64(t2, t3);
+            int k;
+            for (k = 0; k < 4; k++) {
+                __m128i in = _mm_loadu_si128((const __m128i *)(m + 64 * k + 4 * i));
+                _mm_storeu_si128((__m128i *)(c + 64 * k + 4 * i), _mm_xor_si128(in, ks[k]));
+            }
+        }
+        x->input[12] += 4;
+        m += 256;
+        c += 256;
+    }
+}
+
+#define TLS_CHACHA_ROTL_AVX2(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+#define TLS_CHACHA_QUARTERROUND_AVX2(a, b, c, d) \
+    a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16); \
+    c = _mm256_add_epi32(c, d); b = TLS_CHACHA_ROTL_AVX2(_mm256_xor_si256(b, c), 12); \
+    a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8); \
+    c = _mm256_add_epi32(c, d); b = TLS_CHACHA_ROTL_AVX2(_mm256_xor_si256(b, c), 7);
+
+CPU_TARGET_AVX2 static void _private_tls_chacha_blocks_avx2(chacha_ctx *x, const u8 *m, u8 *c, u32 blocks) {
+    const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                           2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                          3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    u32 block;
+    int i;
+    for (block = 0; block + 8 <= blocks; block += 8) {
+        __m256i j[16];
+        __m256i v[16];
+        for (i = 0; i < 16; i++)
+            j[i] = _mm256_set1_epi32((int)x->input[i]);
+        j[12] = _mm256_add_epi32(j[12], _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        for (i = 0; i < 16; i++)
+            v[i] = j[i];
+        for (i = 20; i > 0; i -= 2) {
+            TLS_CHACHA_QUARTERROUND_AVX2(v[0], v[4], v[8], v[12])
+            TLS_CHACHA_QUARTERROUND_AVX2(v[1], v[5], v[9], v[13])
+            TLS_CHACHA_QUARTERROUND_AVX2(v[2], v[6], v[10], v[14])
+            TLS_CHACHA_QUARTERROUND_AVX2(v[3], v[7], v[11], v[15])
+            TLS_CHACHA_QUARTERROUND_AVX2(v[0], v[5], v[10], v[15])
+            TLS_CHACHA_QUARTERROUND_AVX2(v[1], v[6], v[11], v[12])
+            TLS_CHACHA_QUARTERROUND_AVX2(v[2], v[7], v[8], v[13])
+            TLS_CHACHA_QUARTERROUND_AVX2(v[3], v[4], v[9], v[14])
+        }
+        // (the 128-bit halves hold blocks 0-3 and 4-7, so the transpose gives a half block of two blocks at once)
+        __m256i ks[4][4];
+        for (i = 0; i < 16; i += 4) {
+            __m256i a = _mm256_add_epi32(v[i], j[i]);
+            __m256i b = _mm256_add_epi32(v[i + 1], j[i + 1]);
+            __m256i cc = _mm256_add_epi32(v[i + 2], j[i + 2]);
+            __m256i d = _mm256_add_epi32(v[i + 3], j[i + 3]);
+            __m256i t0 = _mm256_unpacklo_epi32(a, b);
+            __m256i t1 = _mm256_unpacklo_epi32(cc, d);
+            __m256i t2 = _mm256_unpackhi_epi32(a, b);
+            __m256i t3 = _mm256_unpackhi_epi32(cc, d);
+            ks[0][i / 4] = _mm256_unpacklo_epi64(t0, t1);
+            ks[1][i / 4] = _mm256_unpackhi_epi64(t0, t1);
+            ks[2][i / 4] = _mm256_unpacklo_epi64(t2, t3);
+            ks[3][i / 4] = _mm256_unpackhi_epi64(t2, t3);
+        }
+        int k;
+        for (k = 0; k < 4; k++) {
+            __m256i out[4];
+            out[0] = _mm256_permute2x128_si256(ks[k][0], ks[k][1], 0x20);
+            out[1] = _mm256_permute2x128_si256(ks[k][2], ks[k][3], 0x20);
+            out[2] = _mm256_permute2x128_si256(ks[k][0], ks[k][1], 0x31);
+            out[3] = _mm256_permute2x128_si256(ks[k][2], ks[k][3], 0x31);
+            unsigned int offsets[4] = { 64 * k, 64 * k + 32, 64 * (k + 4), 64 * (k + 4) + 32 };
+            int h;
+            for (h = 0; h < 4; h++) {
+                __m256i in = _mm256_loadu_si256((const __m256i *)(m + offsets[h]));
+                _mm256_storeu_si256((__m256i *)(c + offsets[h]), _mm256_xor_si256(in, out[h]));
+            }
+        }
+        x->input[12] += 8;
+        m += 512;
+        c += 512;
+    }
+}
+
+// Encrypts as many whole blocks as the SIMD versions can take; returns the number of bytes done.
+static u32 _private_tls_chacha_encrypt_simd(chacha_ctx *x, const u8 *m, u8 *c, u32 bytes) {
+    int level = cpu_get_kernel_level(CPU_KERNEL_CHACHA20);
+    u32 blocks = bytes / 64;
+    // (the scalar version carries the block counter into the next word, these don't)
+    if ((level == CPU_LEVEL_SCALAR) || ((unsigned long long)x->input[12] + blocks > 0xFFFFFFFFULL))
+        return 0;
+    u32 done = 0;
+    if ((level >= CPU_LEVEL_AVX2) && (blocks >= 8)) {
+        _private_tls_chacha_blocks_avx2(x, m, c, blocks);
+        done = blocks & ~7u;
+    }
+    if (blocks - done >= 4) {
+        _private_tls_chacha_blocks_sse2(x, m + done * 64, c + done * 64, blocks - done);
+        done += (blocks - done) & ~3u;
+    }
+    return done * 64;
+}
+#endif
+
 static inline void chacha_encrypt_bytes(chacha_ctx *x, const u8 *m, u8 *c, u32 bytes) {
     u32 x0, x1, x2, x3, x4, x5, x6, x7;
     u32 x8, x9, x10, x11, x12, x13, x14, x15;
@@ -356,6 +514,18 @@ static inline void chacha_encrypt_bytes(chacha_ctx *x, const u8 *m, u8 *c, u32 b
 
     if (!bytes)
         return;
+#ifdef TLS_AEAD_SIMD
+    if (bytes >= 256) {
+        u32 done = _private_tls_chacha_encrypt_simd(x, m, c, bytes);
+        if (done == bytes) {
+            x->unused = 0;
+            return;
+        }
+        m += done;
+        c += done;
+        bytes -= done;
+    }
+#endif
 
     j0 = x->input[0];
     j1 = x->input[1];
@@ -917,10 +1087,21 @@ struct TLSCertificate {
     unsigned int len;
 };
 
+#ifdef TLS_AEAD_SIMD
+typedef struct {
+    __m128i round_keys[15];
+    __m128i h_powers[8]; // H, H^2, ..., H^8 (byte-reflected, see _private_tls_ghash_blocks())
+    int rounds;
+} TLSAESNIGCM;
+#endif
+
 typedef struct {
     union {
         symmetric_CBC aes_local;
         gcm_state aes_gcm_local;
+#ifdef TLS_AEAD_SIMD
+        TLSAESNIGCM aes_ni_local;
+#endif
 #ifdef TLS_WITH_CHACHA20_POLY1305
         chacha_ctx chacha_local;
 #endif
@@ -928,6 +1109,9 @@ typedef struct {
     union {
         symmetric_CBC aes_remote;
         gcm_state aes_gcm_remote;
+#ifdef TLS_AEAD_SIMD
+        TLSAESNIGCM aes_ni_remote;
+#endif
 #ifdef TLS_WITH_CHACHA20_POLY1305
         chacha_ctx chacha_remote;
 #endif
@@ -953,6 +1137,7 @@ typedef struct {
 #endif
     } ctx_remote_mac;
     unsigned char created;
+    unsigned char aes_ni; // the GCM states are TLSAESNIGCM
 } TLSCipher;
 
 typedef struct {
@@ -1169,6 +1354,20 @@ void init_curves() {
 }
 #endif
 
+#ifdef WITH_TLS_13
+typedef struct {
+    unsigned char *ticket;
+    unsigned short ticket_len;
+    unsigned short cipher;
+    unsigned int lifetime;
+    unsigned int age_add;
+    unsigned int received_time;
+    unsigned char psk[TLS_MAX_HASH_SIZE];
+    unsigned char psk_len;
+    unsigned char offered; // (client: it is in the ClientHello)
+} TLSSessionTicket;
+#endif
+
 struct TLSContext {
     unsigned char remote_random[TLS_CLIENT_RANDOM_SIZE];
     unsigned char local_random[TLS_SERVER_RANDOM_SIZE];
@@ -1242,6 +1441,12 @@ struct TLSContext {
     unsigned char *finished_key;
     unsigned char *remote_finished_key;
     unsigned char *server_finished_hash;
+    // session resumption (see tls_enable_session_tickets())
+    unsigned char *ticket_key;
+    unsigned char *resumption_secret;
+    TLSSessionTicket offered_ticket;
+    TLSSessionTicket received_ticket;
+    unsigned char resumed;
 #endif
 #ifdef TLS_CURVE25519
     unsigned char *client_secret;
@@ -2764,7 +2969,10 @@ int _private_tls13_key(struct TLSContext *context, int handshake) {
         DEBUG_DUMP_HEX_LABEL("salt", salt, mac_length);
         _private_tls_hkdf_extract(mac_length, prk, mac_length, salt, mac_length, earlysecret, mac_length);
     } else {
-        _private_tls_hkdf_extract(mac_length, prk, mac_length, NULL, 0, earlysecret, mac_length);
+        if (context->resumed)
+            _private_tls_hkdf_extract(mac_length, prk, mac_length, NULL, 0, context->offered_ticket.psk, context->offered_ticket.psk_len);
+        else
+            _private_tls_hkdf_extract(mac_length, prk, mac_length, NULL, 0, earlysecret, mac_length);
         // derive secret for handshake "tls13 derived":
         DEBUG_DUMP_HEX_LABEL("null hash", hash, mac_length);
         _private_tls_hkdf_expand_label(mac_length, salt, mac_length, prk, mac_length, "derived", 7, hash, mac_length);
@@ -3625,6 +3833,247 @@ void tls_destroy_packet(struct TLSPacket *packet) {
     }
 }
 
+#ifdef TLS_AEAD_SIMD
+// AES-GCM with AES-NI and PCLMULQDQ (the CPU_KERNEL_AES_GCM level, see cpu_dispatch.h). The GHASH multiplication
+// works on byte-reflected blocks, as in Intel's "Carry-Less Multiplication and Its Usage for Computing the GCM Mode"
+// white paper; 8 blocks are encrypted at a time and share one reduction, with the powers of H.
+
+#define TLS_AES_NI_BLOCKS 8
+
+CPU_TARGET_AES_NI static inline __m128i _private_tls_aes_ni_bswap(__m128i v) {
+    return _mm_shuffle_epi8(v, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+CPU_TARGET_AES_NI static inline __m128i _private_tls_aes_ni_expand_step(__m128i key, __m128i assist) {
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+#define TLS_AES_NI_EXPAND_128(i, rcon) \
+    rk[i] = _private_tls_aes_ni_expand_step(rk[i - 1], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i - 1], rcon), 0xFF))
+#define TLS_AES_NI_EXPAND_256(i, rcon) \
+    rk[i] = _private_tls_aes_ni_expand_step(rk[i - 2], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i - 1], rcon), 0xFF)); \
+    if (i + 1 < 15) \
+        rk[i + 1] = _private_tls_aes_ni_expand_step(rk[i - 1], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i], 0), 0xAA))
+
+CPU_TARGET_AES_NI static int _private_tls_aes_ni_expand_key(TLSAESNIGCM *state, const unsigned char *key, int key_length) {
+    __m128i *rk = state->round_keys;
+    rk[0] = _mm_loadu_si128((const __m128i *)key);
+    if (key_length == 16) {
+        TLS_AES_NI_EXPAND_128(1, 0x01);
+        TLS_AES_NI_EXPAND_128(2, 0x02);
+        TLS_AES_NI_EXPAND_128(3, 0x04);
+        TLS_AES_NI_EXPAND_128(4, 0x08);
+        TLS_AES_NI_EXPAND_128(5, 0x10);
+        TLS_AES_NI_EXPAND_128(6, 0x20);
+        TLS_AES_NI_EXPAND_128(7, 0x40);
+        TLS_AES_NI_EXPAND_128(8, 0x80);
+        TLS_AES_NI_EXPAND_128(9, 0x1B);
+        TLS_AES_NI_EXPAND_128(10, 0x36);
+        state->rounds = 10;
+        return 0;
+    }
+    if (key_length == 32) {
+        rk[1] = _mm_loadu_si128((const __m128i *)(key + 16));
+        TLS_AES_NI_EXPAND_256(2, 0x01);
+        TLS_AES_NI_EXPAND_256(4, 0x02);
+        TLS_AES_NI_EXPAND_256(6, 0x04);
+        TLS_AES_NI_EXPAND_256(8, 0x08);
+        TLS_AES_NI_EXPAND_256(10, 0x10);
+        TLS_AES_NI_EXPAND_256(12, 0x20);
+        TLS_AES_NI_EXPAND_256(14, 0x40);
+        state->rounds = 14;
+        return 0;
+    }
+    return TLS_GENERIC_ERROR;
+}
+
+CPU_TARGET_AES_NI static inline __m128i _private_tls_aes_ni_encrypt_block(const TLSAESNIGCM *state, __m128i block) {
+    int i;
+    block = _mm_xor_si128(block, state->round_keys[0]);
+    for (i = 1; i < state->rounds; i++)
+        block = _mm_aesenc_si128(block, state->round_keys[i]);
+    return _mm_aesenclast_si128(block, state->round_keys[state->rounds]);
+}
+
+// The 256-bit carry-less product of a and b, as lo and hi (not reduced yet, so that products can be summed first).
+CPU_TARGET_AES_NI static inline void _private_tls_ghash_multiply(__m128i a, __m128i b, __m128i *lo, __m128i *hi) {
+    __m128i t0 = _mm_clmulepi64_si128(a, b, 0x00);
+    __m128i t1 = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+    __m128i t2 = _mm_clmulepi64_si128(a, b, 0x11);
+    *lo = _mm_xor_si128(*lo, _mm_xor_si128(t0, _mm_slli_si128(t1, 8)));
+    *hi = _mm_xor_si128(*hi, _mm_xor_si128(t2, _mm_srli_si128(t1, 8)));
+}
+
+// Shifts the (reflected) product left by one bit and reduces it modulo the GCM polynomial.
+CPU_TARGET_AES_NI static inline __m128i _private_tls_ghash_reduce(__m128i lo, __m128i hi) {
+    __m128i carry_lo = _mm_srli_epi32(lo, 31);
+    __m128i carry_hi = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    __m128i carry_over = _mm_srli_si128(carry_lo, 12);
+    carry_hi = _mm_slli_si128(carry_hi, 4);
+    carry_lo = _mm_slli_si128(carry_lo, 4);
+    lo = _mm_or_si128(lo, carry_lo);
+    hi = _mm_or_si128(_mm_or_si128(hi, carry_hi), carry_over);
+
+    __m128i a = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+    __m128i b = _mm_srli_si128(a, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(a, 12));
+    __m128i c = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+    c = _mm_xor_si128(c, b);
+    lo = _mm_xor_si128(lo, c);
+    return _mm_xor_si128(hi, lo);
+}
+
+CPU_TARGET_AES_NI static inline __m128i _private_tls_ghash_block(__m128i x, __m128i block, __m128i h) {
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+    _private_tls_ghash_multiply(_mm_xor_si128(x, _private_tls_aes_ni_bswap(block)), h, &lo, &hi);
+    return _private_tls_ghash_reduce(lo, hi);
+}
+
+// The GHASH of TLS_AES_NI_BLOCKS blocks at once: x = (x + b[0]) * H^8 + b[1] * H^7 + ... + b[7] * H.
+CPU_TARGET_AES_NI static inline __m128i _private_tls_ghash_blocks(const TLSAESNIGCM *state, __m128i x, const __m128i *blocks) {
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+    int i;
+    for (i = 0; i < TLS_AES_NI_BLOCKS; i++) {
+        __m128i block = _private_tls_aes_ni_bswap(blocks[i]);
+        if (i == 0)
+            block = _mm_xor_si128(block, x);
+        _private_tls_ghash_multiply(block, state->h_powers[TLS_AES_NI_BLOCKS - 1 - i], &lo, &hi);
+    }
+    return _private_tls_ghash_reduce(lo, hi);
+}
+
+CPU_TARGET_AES_NI static int _private_tls_aes_ni_gcm_init(TLSAESNIGCM *state, const unsigned char *key, int key_length) {
+    if (_private_tls_aes_ni_expand_key(state, key, key_length))
+        return TLS_GENERIC_ERROR;
+    __m128i h = _private_tls_aes_ni_bswap(_private_tls_aes_ni_encrypt_block(state, _mm_setzero_si128()));
+    int i;
+    state->h_powers[0] = h;
+    for (i = 1; i < TLS_AES_NI_BLOCKS; i++) {
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+        _private_tls_ghash_multiply(state->h_powers[i - 1], h, &lo, &hi);
+        state->h_powers[i] = _private_tls_ghash_reduce(lo, hi);
+    }
+    return 0;
+}
+
+// Encrypts or decrypts one record (with a 12-byte IV) and computes its tag.
+CPU_TARGET_AES_NI static void _private_tls_aes_ni_gcm(const TLSAESNIGCM *state, const unsigned char *iv, const unsigned char *aad, unsigned int aad_len, const unsigned char *in, unsigned char *out, unsigned int len, unsigned char *tag, int encrypt) {
+    unsigned char block_buffer[16];
+    __m128i h = state->h_powers[0];
+    __m128i x = _mm_setzero_si128();
+    unsigned int pos;
+    int i;
+
+    for (pos = 0; pos < aad_len; pos += 16) {
+        unsigned int size = aad_len - pos < 16 ? aad_len - pos : 16;
+        memset(block_buffer, 0, 16);
+        memcpy(block_buffer, aad + pos, size);
+        x = _private_tls_ghash_block(x, _mm_loadu_si128((const __m128i *)block_buffer), h);
+    }
+
+    // J0 = IV || 1; the blocks are encrypted with the counters from J0 + 1 on. (The counter is the last 32 bits, big
+    // endian, so in the byte-swapped block it is the first 32-bit lane.)
+    memcpy(block_buffer, iv, 12);
+    block_buffer[12] = 0;
+    block_buffer[13] = 0;
+    block_buffer[14] = 0;
+    block_buffer[15] = 1;
+    __m128i j0 = _mm_loadu_si128((const __m128i *)block_buffer);
+    __m128i counter = _private_tls_aes_ni_bswap(j0);
+    const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+
+    pos = 0;
+    for (; pos + 16 * TLS_AES_NI_BLOCKS <= len; pos += 16 * TLS_AES_NI_BLOCKS) {
+        __m128i blocks[TLS_AES_NI_BLOCKS];
+        __m128i data[TLS_AES_NI_BLOCKS];
+        for (i = 0; i < TLS_AES_NI_BLOCKS; i++) {
+            counter = _mm_add_epi32(counter, one);
+            blocks[i] = _mm_xor_si128(_private_tls_aes_ni_bswap(counter), state->round_keys[0]);
+        }
+        int round;
+        for (round = 1; round < state->rounds; round++) {
+            __m128i round_key = state->round_keys[round];
+            for (i = 0; i < TLS_AES_NI_BLOCKS; i++)
+                blocks[i] = _mm_aesenc_si128(blocks[i], round_key);
+        }
+        for (i = 0; i < TLS_AES_NI_BLOCKS; i++) {
+            __m128i input = _mm_loadu_si128((const __m128i *)(in + pos + 16 * i));
+            __m128i output = _mm_xor_si128(input, _mm_aesenclast_si128(blocks[i], state->round_keys[state->rounds]));
+            _mm_storeu_si128((__m128i *)(out + pos + 16 * i), output);
+            data[i] = encrypt ? output : input;
+        }
+        x = _private_tls_ghash_blocks(state, x, data);
+    }
+    for (; pos < len; pos += 16) {
+        unsigned int size = len - pos < 16 ? len - pos : 16;
+        counter = _mm_add_epi32(counter, one);
+        __m128i key_stream = _private_tls_aes_ni_encrypt_block(state, _private_tls_aes_ni_bswap(counter));
+        memset(block_buffer, 0, 16);
+        memcpy(block_buffer, in + pos, size);
+        __m128i input = _mm_loadu_si128((const __m128i *)block_buffer);
+        __m128i output = _mm_xor_si128(input, key_stream);
+        _mm_storeu_si128((__m128i *)block_buffer, output);
+        memcpy(out + pos, block_buffer, size);
+        if (encrypt) {
+            // (only the bytes of the ciphertext count, the rest of the block is zero)
+            memset(block_buffer + size, 0, 16 - size);
+            x = _private_tls_ghash_block(x, _mm_loadu_si128((const __m128i *)block_buffer), h);
+        } else {
+            x = _private_tls_ghash_block(x, input, h);
+        }
+    }
+
+    // the lengths in bits, big endian: byte-swapped, the length of the data is the low half
+    __m128i lengths = _mm_set_epi64x((long long)aad_len * 8, (long long)len * 8);
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+    _private_tls_ghash_multiply(_mm_xor_si128(x, lengths), h, &lo, &hi);
+    x = _private_tls_ghash_reduce(lo, hi);
+    __m128i result = _mm_xor_si128(_private_tls_aes_ni_bswap(x), _private_tls_aes_ni_encrypt_block(state, j0));
+    _mm_storeu_si128((__m128i *)tag, result);
+}
+#endif
+
+// One AES-GCM record through the local (sending) or remote (receiving) state, in the implementation the states were
+// created for (see _private_tls_crypto_create()). Returns 0 on success.
+int _private_tls_gcm_crypt(struct TLSContext *context, int local, const unsigned char *iv, const unsigned char *aad, int aad_len, const unsigned char *in, unsigned char *out, unsigned int len, unsigned char *tag) {
+#ifdef TLS_AEAD_SIMD
+    if (context->crypto.aes_ni) {
+        if (local)
+            _private_tls_aes_ni_gcm(&context->crypto.ctx_local.aes_ni_local, iv, aad, aad_len, in, out, len, tag, 1);
+        else
+            _private_tls_aes_ni_gcm(&context->crypto.ctx_remote.aes_ni_remote, iv, aad, aad_len, in, out, len, tag, 0);
+        return 0;
+    }
+#endif
+    gcm_state *gcm = local ? &context->crypto.ctx_local.aes_gcm_local : &context->crypto.ctx_remote.aes_gcm_remote;
+    unsigned long taglen = TLS_GCM_TAG_LEN;
+    int res = gcm_reset(gcm);
+    if (!res)
+        res = gcm_add_iv(gcm, (unsigned char *)iv, 12);
+    if (!res)
+        res = gcm_add_aad(gcm, (unsigned char *)aad, aad_len);
+    if (!res) {
+        if (local)
+            res = gcm_process(gcm, (unsigned char *)in, len, out, GCM_ENCRYPT);
+        else
+            res = gcm_process(gcm, out, len, (unsigned char *)in, GCM_DECRYPT);
+    }
+    if (!res)
+        res = gcm_done(gcm, tag, &taglen);
+    if ((!res) && (taglen != TLS_GCM_TAG_LEN))
+        res = TLS_GENERIC_ERROR;
+    return res;
+}
+
 int _private_tls_crypto_create(struct TLSContext *context, int key_length, unsigned char *localkey, unsigned char *localiv, unsigned char *remotekey, unsigned char *remoteiv) {
     if (context->crypto.created) {
         if (context->crypto.created == 1) {
@@ -3636,13 +4085,16 @@ int _private_tls_crypto_create(struct TLSContext *context, int key_length, unsig
 #endif
             unsigned char dummy_buffer[32];
             unsigned long tag_len = 0;
-            gcm_done(&context->crypto.ctx_remote.aes_gcm_remote, dummy_buffer, &tag_len);
-            gcm_done(&context->crypto.ctx_local.aes_gcm_local, dummy_buffer, &tag_len);
+            if (!context->crypto.aes_ni) {
+                gcm_done(&context->crypto.ctx_remote.aes_gcm_remote, dummy_buffer, &tag_len);
+                gcm_done(&context->crypto.ctx_local.aes_gcm_local, dummy_buffer, &tag_len);
+            }
 #ifdef TLS_WITH_CHACHA20_POLY1305
             }
 #endif
         }
         context->crypto.created = 0;
+        context->crypto.aes_ni = 0;
     }
     tls_init();
     int is_aead = _private_tls_is_aead(context);
@@ -3662,6 +4114,17 @@ int _private_tls_crypto_create(struct TLSContext *context, int key_length, unsig
     } else
 #endif
     if (is_aead) {
+#ifdef TLS_AEAD_SIMD
+        if (cpu_get_kernel_level(CPU_KERNEL_AES_GCM) >= CPU_LEVEL_SSE2) {
+            int res1 = _private_tls_aes_ni_gcm_init(&context->crypto.ctx_local.aes_ni_local, localkey, key_length);
+            int res2 = _private_tls_aes_ni_gcm_init(&context->crypto.ctx_remote.aes_ni_remote, remotekey, key_length);
+            if ((!res1) && (!res2)) {
+                context->crypto.aes_ni = 1;
+                context->crypto.created = 2;
+                return 0;
+            }
+        }
+#endif
         int res1 = gcm_init(&context->crypto.ctx_local.aes_gcm_local, cipherID, localkey, key_length);
         int res2 = gcm_init(&context->crypto.ctx_remote.aes_gcm_remote, cipherID, remotekey, key_length);
         
@@ -3704,11 +4167,14 @@ void _private_tls_crypto_done(struct TLSContext *context) {
             cbc_done(&context->crypto.ctx_local.aes_local);
             break;
         case 2:
-            gcm_done(&context->crypto.ctx_remote.aes_gcm_remote, dummy_buffer, &tag_len);
-            gcm_done(&context->crypto.ctx_local.aes_gcm_local, dummy_buffer, &tag_len);
+            if (!context->crypto.aes_ni) {
+                gcm_done(&context->crypto.ctx_remote.aes_gcm_remote, dummy_buffer, &tag_len);
+                gcm_done(&context->crypto.ctx_local.aes_gcm_local, dummy_buffer, &tag_len);
+            }
             break;
     }
     context->crypto.created = 0;
+    context->crypto.aes_ni = 0;
 }
 
 void tls_packet_update(struct TLSPacket *packet) {
@@ -3747,7 +4213,8 @@ void tls_packet_update(struct TLSPacket *packet) {
             if (packet->buf[0] != TLS_CHANGE_CIPHER)  {
                 if ((packet->buf[0] == TLS_HANDSHAKE) && (packet->len > header_size)) {
                     unsigned char handshake_type = packet->buf[header_size];
-                    if ((handshake_type != 0x00) && (handshake_type != 0x03))
+                    // (nor is a TLS 1.3 NewSessionTicket, which comes after the handshake)
+                    if ((handshake_type != 0x00) && (handshake_type != 0x03) && (handshake_type != 0x04))
                         _private_tls_update_hash(packet->context, packet->buf + header_size, packet->len - header_size - footer_size);
                 }
 #ifdef TLS_12_FALSE_START
@@ -3904,15 +4371,8 @@ void tls_packet_update(struct TLSPacket *packet) {
                                 }
 #endif
 
-                                gcm_reset(&packet->context->crypto.ctx_local.aes_gcm_local);
-                                gcm_add_iv(&packet->context->crypto.ctx_local.aes_gcm_local, iv, 12);
-                                gcm_add_aad(&packet->context->crypto.ctx_local.aes_gcm_local, aad, aad_size);                                
-                                gcm_process(&packet->context->crypto.ctx_local.aes_gcm_local, packet->buf + header_size, pt_length, ct + ct_pos, GCM_ENCRYPT);
-                                ct_pos += pt_length;
-                                
-                                unsigned long taglen = TLS_GCM_TAG_LEN;
-                                gcm_done(&packet->context->crypto.ctx_local.aes_gcm_local, ct + ct_pos, &taglen);
-                                ct_pos += taglen;
+                                _private_tls_gcm_crypt(packet->context, 1, iv, aad, aad_size, packet->buf + header_size, ct + ct_pos, pt_length, ct + ct_pos + pt_length);
+                                ct_pos += pt_length + TLS_GCM_TAG_LEN;
 #ifdef TLS_WITH_CHACHA20_POLY1305
                             }
 #endif
@@ -4269,6 +4729,312 @@ int _private_tls_write_packet(struct TLSPacket *packet) {
     return context->tls_buffer_len;
 }
 
+#ifdef WITH_TLS_13
+// The handshake hash including a message that has not been added to it (yet).
+int _private_tls_get_hash_with(struct TLSContext *context, const unsigned char *buf, unsigned int buf_len, unsigned char *hout) {
+    TLSHash *hash = _private_tls_ensure_hash(context);
+    if ((!hash->created) || ((context->version != TLS_V13) && (context->version != DTLS_V13)))
+        return 0;
+    hash_state prec;
+    memcpy(&prec, &hash->hash, sizeof(hash_state));
+    int hash_size = _private_tls_mac_length(context);
+    if (hash_size == TLS_SHA384_MAC_SIZE) {
+        sha384_process(&prec, buf, buf_len);
+        sha384_done(&prec, hout);
+    } else {
+        hash_size = TLS_SHA256_MAC_SIZE;
+        sha256_process(&prec, buf, buf_len);
+        sha256_done(&prec, hout);
+    }
+    return hash_size;
+}
+
+int _private_tls_equal(const unsigned char *a, const unsigned char *b, unsigned int len) {
+    unsigned char diff = 0;
+    unsigned int i;
+    for (i = 0; i < len; i++)
+        diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+static unsigned int _private_tls_read_uint32(const unsigned char *buf) {
+    return ((unsigned int)buf[0] << 24) | ((unsigned int)buf[1] << 16) | ((unsigned int)buf[2] << 8) | (unsigned int)buf[3];
+}
+
+static void _private_tls_write_uint32(unsigned char *buf, unsigned int i) {
+    buf[0] = (unsigned char)(i >> 24);
+    buf[1] = (unsigned char)(i >> 16);
+    buf[2] = (unsigned char)(i >> 8);
+    buf[3] = (unsigned char)i;
+}
+
+// Session tickets are only issued for SHA-256 cipher suites: the client hashes the ClientHello (with the binder)
+// before it knows which cipher the server picks.
+int _private_tls13_can_offer_ticket(struct TLSContext *context) {
+    TLSSessionTicket *ticket = &context->offered_ticket;
+    if ((context->is_server) || (context->dtls) || (context->version != TLS_V13) || (!ticket->ticket) || (!ticket->ticket_len) || (ticket->psk_len != TLS_SHA256_MAC_SIZE))
+        return 0;
+    // (a clock that was set back makes the age wrap around, and the ticket is not offered either)
+    unsigned int age = (unsigned int)time(NULL) - ticket->received_time;
+    return age < ticket->lifetime;
+}
+
+// binder = HMAC(finished key of the binder key, Transcript-Hash(ClientHello up to the binders))
+void _private_tls13_psk_binder(const unsigned char *psk, unsigned char psk_len, const unsigned char *hello, unsigned int hello_len, unsigned char *binder) {
+    unsigned int mac_length = TLS_SHA256_MAC_SIZE;
+    unsigned char early_secret[TLS_MAX_HASH_SIZE];
+    unsigned char binder_key[TLS_MAX_HASH_SIZE];
+    unsigned char finished_key[TLS_MAX_HASH_SIZE];
+    unsigned char hash[TLS_MAX_HASH_SIZE];
+    hash_state md;
+    sha256_init(&md);
+    sha256_done(&md, hash);
+    _private_tls_hkdf_extract(mac_length, early_secret, mac_length, NULL, 0, psk, psk_len);
+    _private_tls_hkdf_expand_label(mac_length, binder_key, mac_length, early_secret, mac_length, "res binder", 10, hash, mac_length);
+    _private_tls_hkdf_expand_label(mac_length, finished_key, mac_length, binder_key, mac_length, "finished", 8, NULL, 0);
+    sha256_init(&md);
+    sha256_process(&md, hello, hello_len);
+    sha256_done(&md, hash);
+    unsigned long out_size = mac_length;
+    hmac_state hmac;
+    hmac_init(&hmac, find_hash("sha256"), finished_key, mac_length);
+    hmac_process(&hmac, hash, mac_length);
+    hmac_done(&hmac, binder, &out_size);
+}
+
+// The extensions for offering the session ticket, at the end of the ClientHello (see tls_build_hello()). The binder
+// is left empty, because it covers the final length of the ClientHello; it is filled in by _private_tls13_sign_hello().
+int _private_tls13_ticket_extensions_size(struct TLSContext *context) {
+    return 6 + 47 + context->offered_ticket.ticket_len;
+}
+
+void _private_tls13_write_ticket_extensions(struct TLSContext *context, struct TLSPacket *packet) {
+    TLSSessionTicket *ticket = &context->offered_ticket;
+    // psk key exchange modes: psk_ke only (no (EC)DHE when resuming)
+    tls_packet_uint16(packet, 0x2D);
+    tls_packet_uint16(packet, 2);
+    tls_packet_uint8(packet, 1);
+    tls_packet_uint8(packet, 0);
+    // pre shared key (must be the last extension)
+    tls_packet_uint16(packet, 0x29);
+    tls_packet_uint16(packet, 43 + ticket->ticket_len);
+    tls_packet_uint16(packet, 6 + ticket->ticket_len);
+    tls_packet_uint16(packet, ticket->ticket_len);
+    tls_packet_append(packet, ticket->ticket, ticket->ticket_len);
+    // obfuscated ticket age (in milliseconds)
+    tls_packet_uint32(packet, ((unsigned int)time(NULL) - ticket->received_time) * 1000 + ticket->age_add);
+    tls_packet_uint16(packet, 1 + TLS_SHA256_MAC_SIZE);
+    tls_packet_uint8(packet, TLS_SHA256_MAC_SIZE);
+    unsigned char binder[TLS_SHA256_MAC_SIZE];
+    memset(binder, 0, sizeof(binder));
+    tls_packet_append(packet, binder, sizeof(binder));
+    ticket->offered = 1;
+}
+
+void _private_tls13_sign_hello(struct TLSContext *context, struct TLSPacket *packet) {
+    // (the handshake message starts after the 5-byte record header)
+    unsigned int hello_len = packet->len - 5 - 2 - 1 - TLS_SHA256_MAC_SIZE;
+    _private_tls13_psk_binder(context->offered_ticket.psk, context->offered_ticket.psk_len, packet->buf + 5, hello_len, packet->buf + packet->len - TLS_SHA256_MAC_SIZE);
+}
+
+// ticket = iv | AES-128-CTR(cipher, issue time, PSK) | HMAC-SHA256(iv | encrypted part), truncated
+int _private_tls13_seal_ticket(struct TLSContext *context, const unsigned char *psk, unsigned char psk_len, unsigned char *out) {
+    unsigned char plain[7 + TLS_MAX_HASH_SIZE];
+    unsigned int plain_len = 7 + psk_len;
+    plain[0] = (unsigned char)(context->cipher >> 8);
+    plain[1] = (unsigned char)context->cipher;
+    _private_tls_write_uint32(plain + 2, (unsigned int)time(NULL));
+    plain[6] = psk_len;
+    memcpy(plain + 7, psk, psk_len);
+
+    int res = 0;
+    symmetric_CTR aes;
+    if ((tls_random(out, TLS_TICKET_IV_SIZE)) && (!ctr_start(find_cipher("aes"), out, context->ticket_key, 16, 0, CTR_COUNTER_BIG_ENDIAN, &aes))) {
+        ctr_encrypt(plain, out + TLS_TICKET_IV_SIZE, plain_len, &aes);
+        ctr_done(&aes);
+
+        unsigned char mac[TLS_SHA256_MAC_SIZE];
+        unsigned long mac_len = sizeof(mac);
+        hmac_state hmac;
+        hmac_init(&hmac, find_hash("sha256"), context->ticket_key + 16, TLS_TICKET_KEY_SIZE - 16);
+        hmac_process(&hmac, out, TLS_TICKET_IV_SIZE + plain_len);
+        hmac_done(&hmac, mac, &mac_len);
+        memcpy(out + TLS_TICKET_IV_SIZE + plain_len, mac, TLS_TICKET_MAC_SIZE);
+        res = TLS_TICKET_IV_SIZE + plain_len + TLS_TICKET_MAC_SIZE;
+    }
+    memset(plain, 0, sizeof(plain));
+    return res;
+}
+
+// Returns the length of the PSK, or 0 if the ticket is not one of ours (e.g. from before a restart of the server),
+// has expired, or is for a different cipher suite.
+int _private_tls13_open_ticket(struct TLSContext *context, const unsigned char *ticket, unsigned int ticket_len, unsigned char *psk) {
+    if ((ticket_len < TLS_TICKET_IV_SIZE + 7 + TLS_TICKET_MAC_SIZE) || (ticket_len > TLS_TICKET_IV_SIZE + 7 + TLS_MAX_HASH_SIZE + TLS_TICKET_MAC_SIZE))
+        return 0;
+    unsigned int plain_len = ticket_len - TLS_TICKET_IV_SIZE - TLS_TICKET_MAC_SIZE;
+
+    unsigned char mac[TLS_SHA256_MAC_SIZE];
+    unsigned long mac_len = sizeof(mac);
+    hmac_state hmac;
+    hmac_init(&hmac, find_hash("sha256"), context->ticket_key + 16, TLS_TICKET_KEY_SIZE - 16);
+    hmac_process(&hmac, ticket, TLS_TICKET_IV_SIZE + plain_len);
+    hmac_done(&hmac, mac, &mac_len);
+    if (!_private_tls_equal(mac, ticket + TLS_TICKET_IV_SIZE + plain_len, TLS_TICKET_MAC_SIZE)) {
+        DEBUG_PRINT("SESSION TICKET NOT RECOGNIZED\n");
+        return 0;
+    }
+
+    unsigned char plain[7 + TLS_MAX_HASH_SIZE];
+    symmetric_CTR aes;
+    if (ctr_start(find_cipher("aes"), ticket, context->ticket_key, 16, 0, CTR_COUNTER_BIG_ENDIAN, &aes))
+        return 0;
+    ctr_decrypt(ticket + TLS_TICKET_IV_SIZE, plain, plain_len, &aes);
+    ctr_done(&aes);
+
+    int res = 0;
+    unsigned short cipher = (unsigned short)((plain[0] << 8) | plain[1]);
+    unsigned int age = (unsigned int)time(NULL) - _private_tls_read_uint32(plain + 2);
+    if ((cipher == context->cipher) && (age <= TLS_SESSION_TICKET_LIFETIME) && (plain[6] == plain_len - 7)) {
+        memcpy(psk, plain + 7, plain[6]);
+        res = plain[6];
+    } else {
+        DEBUG_PRINT("SESSION TICKET EXPIRED OR FOR ANOTHER CIPHER\n");
+    }
+    memset(plain, 0, sizeof(plain));
+    return res;
+}
+
+// Verifies the session ticket offered in the pre_shared_key extension of the ClientHello (only the first identity
+// is looked at). hello is the whole ClientHello message, psk_ext the data of the extension within it.
+int _private_tls13_accept_ticket(struct TLSContext *context, const unsigned char *hello, const unsigned char *psk_ext, unsigned int psk_ext_len) {
+    if ((!context->ticket_key) || (context->dtls) || (_private_tls_mac_length(context) != TLS_SHA256_MAC_SIZE) || (psk_ext_len < 2))
+        return 0;
+    unsigned int identities_len = ntohs(*(unsigned short *)psk_ext);
+    if ((identities_len < 6) || (identities_len + 4 > psk_ext_len))
+        return 0;
+    unsigned int ticket_len = ntohs(*(unsigned short *)&psk_ext[2]);
+    if (ticket_len + 6 > identities_len)
+        return 0;
+    const unsigned char *binders = psk_ext + 2 + identities_len;
+    unsigned int binders_len = ntohs(*(unsigned short *)binders);
+    if ((binders_len + identities_len + 4 > psk_ext_len) || (binders_len < 1 + TLS_SHA256_MAC_SIZE) || (binders[2] != TLS_SHA256_MAC_SIZE))
+        return 0;
+
+    unsigned char psk[TLS_MAX_HASH_SIZE];
+    int psk_len = _private_tls13_open_ticket(context, &psk_ext[4], ticket_len, psk);
+    if (psk_len != TLS_SHA256_MAC_SIZE)
+        return 0;
+    unsigned char binder[TLS_SHA256_MAC_SIZE];
+    _private_tls13_psk_binder(psk, psk_len, hello, (unsigned int)(binders - hello), binder);
+    if (!_private_tls_equal(binder, binders + 3, TLS_SHA256_MAC_SIZE)) {
+        DEBUG_PRINT("PSK BINDER MISMATCH\n");
+        memset(psk, 0, sizeof(psk));
+        return 0;
+    }
+    memcpy(context->offered_ticket.psk, psk, psk_len);
+    context->offered_ticket.psk_len = psk_len;
+    memset(psk, 0, sizeof(psk));
+    return 1;
+}
+
+// With psk_ke, there is no (EC)DHE: the handshake secret is extracted from zeros instead of the shared secret.
+int _private_tls13_set_zero_premaster(struct TLSContext *context) {
+    unsigned int mac_length = _private_tls_mac_length(context);
+    TLS_FREE(context->premaster_key);
+    context->premaster_key = (unsigned char *)TLS_MALLOC(mac_length);
+    if (!context->premaster_key)
+        return TLS_NO_MEMORY;
+    memset(context->premaster_key, 0, mac_length);
+    context->premaster_key_len = mac_length;
+    return 0;
+}
+
+// resumption_master_secret = Derive-Secret(master secret, "res master", ClientHello...client Finished); to be called
+// right after deriving the application traffic keys (when context->master_key holds the master secret).
+void _private_tls13_resumption_secret(struct TLSContext *context, const unsigned char *hash, unsigned int hash_len) {
+    unsigned int mac_length = _private_tls_mac_length(context);
+    if ((!hash_len) || (mac_length != TLS_SHA256_MAC_SIZE) || (!context->master_key) || (context->dtls))
+        return;
+    TLS_FREE(context->resumption_secret);
+    context->resumption_secret = (unsigned char *)TLS_MALLOC(mac_length);
+    if (context->resumption_secret)
+        _private_tls_hkdf_expand_label(mac_length, context->resumption_secret, mac_length, context->master_key, context->master_key_len, "res master", 10, hash, hash_len);
+}
+
+void _private_tls13_send_session_ticket(struct TLSContext *context) {
+    if ((!context->ticket_key) || (!context->resumption_secret))
+        return;
+    unsigned int mac_length = TLS_SHA256_MAC_SIZE;
+    static const unsigned char nonce[1] = { 0 }; // (one ticket per connection)
+    unsigned char psk[TLS_MAX_HASH_SIZE];
+    _private_tls_hkdf_expand_label(mac_length, psk, mac_length, context->resumption_secret, mac_length, "resumption", 10, nonce, sizeof(nonce));
+    unsigned char ticket[TLS_TICKET_IV_SIZE + 7 + TLS_MAX_HASH_SIZE + TLS_TICKET_MAC_SIZE];
+    int ticket_len = _private_tls13_seal_ticket(context, psk, mac_length, ticket);
+    memset(psk, 0, sizeof(psk));
+    unsigned char age_add[4];
+    if ((!ticket_len) || (!tls_random(age_add, sizeof(age_add))))
+        return;
+
+    struct TLSPacket *packet = tls_create_packet(context, TLS_HANDSHAKE, context->version, 0);
+    if (!packet)
+        return;
+    tls_packet_uint8(packet, 0x04);
+    tls_packet_uint24(packet, 14 + ticket_len);
+    tls_packet_uint32(packet, TLS_SESSION_TICKET_LIFETIME);
+    tls_packet_append(packet, age_add, sizeof(age_add));
+    tls_packet_uint8(packet, sizeof(nonce));
+    tls_packet_append(packet, nonce, sizeof(nonce));
+    tls_packet_uint16(packet, ticket_len);
+    tls_packet_append(packet, ticket, ticket_len);
+    // no extensions
+    tls_packet_uint16(packet, 0);
+    tls_packet_update(packet);
+    _private_tls_write_packet(packet);
+}
+
+// NewSessionTicket (buf from the 3-byte length on): the PSK for resuming is derived from the resumption secret of
+// this connection and the nonce of the ticket.
+int _private_tls13_parse_session_ticket(struct TLSContext *context, const unsigned char *buf, int buf_len) {
+    CHECK_SIZE(3, buf_len, TLS_NEED_MORE_DATA)
+    unsigned int size = buf[0] * 0x10000 + buf[1] * 0x100 + buf[2];
+    CHECK_SIZE(size, buf_len - 3, TLS_NEED_MORE_DATA)
+    const unsigned char *ptr = buf + 3;
+    if (size < 13)
+        return TLS_BROKEN_PACKET;
+    unsigned int lifetime = _private_tls_read_uint32(ptr);
+    unsigned int age_add = _private_tls_read_uint32(ptr + 4);
+    unsigned char nonce_len = ptr[8];
+    if (11 + nonce_len > size)
+        return TLS_BROKEN_PACKET;
+    const unsigned char *nonce = ptr + 9;
+    unsigned int ticket_len = ntohs(*(unsigned short *)&ptr[9 + nonce_len]);
+    if (13 + nonce_len + ticket_len > size)
+        return TLS_BROKEN_PACKET;
+    const unsigned char *ticket_data = ptr + 11 + nonce_len;
+
+    unsigned int mac_length = _private_tls_mac_length(context);
+    if ((!context->resumption_secret) || (!ticket_len) || (!lifetime) || (mac_length != TLS_SHA256_MAC_SIZE))
+        return 3 + size; // (not usable, ignore it)
+    TLSSessionTicket *ticket = &context->received_ticket;
+    TLS_FREE(ticket->ticket);
+    ticket->ticket = (unsigned char *)TLS_MALLOC(ticket_len);
+    if (!ticket->ticket) {
+        ticket->ticket_len = 0;
+        return TLS_NO_MEMORY;
+    }
+    memcpy(ticket->ticket, ticket_data, ticket_len);
+    ticket->ticket_len = (unsigned short)ticket_len;
+    ticket->cipher = context->cipher;
+    ticket->lifetime = lifetime < 604800 ? lifetime : 604800; // (at most 7 days)
+    ticket->age_add = age_add;
+    ticket->received_time = (unsigned int)time(NULL);
+    _private_tls_hkdf_expand_label(mac_length, ticket->psk, mac_length, context->resumption_secret, mac_length, "resumption", 10, nonce, nonce_len);
+    ticket->psk_len = (unsigned char)mac_length;
+    DEBUG_PRINT("RECEIVED SESSION TICKET (%i bytes)\n", (int)ticket_len);
+    return 3 + size;
+}
+#endif
+
 int _private_tls_write_app_data(struct TLSContext *context, const unsigned char *buf, unsigned int buf_len) {
     if (!context)
         return -1;
@@ -4454,6 +5220,9 @@ struct TLSContext *tls_accept(struct TLSContext *context) {
 #endif
         child->alpn = context->alpn;
         child->alpn_count = context->alpn_count;
+#ifdef WITH_TLS_13
+        child->ticket_key = context->ticket_key;
+#endif
     }
     return child;
 }
@@ -4597,6 +5366,11 @@ void tls_destroy_context(struct TLSContext *context) {
                 TLS_FREE(context->alpn[i]);
             TLS_FREE(context->alpn);
         }
+#ifdef WITH_TLS_13
+        if (context->ticket_key)
+            memset(context->ticket_key, 0, TLS_TICKET_KEY_SIZE);
+        TLS_FREE(context->ticket_key);
+#endif
     }
     if (context->client_certificates) {
         for (i = 0; i < context->client_certificates_count; i++)
@@ -4632,6 +5406,9 @@ void tls_destroy_context(struct TLSContext *context) {
     TLS_FREE(context->finished_key);
     TLS_FREE(context->remote_finished_key);
     TLS_FREE(context->server_finished_hash);
+    TLS_FREE(context->resumption_secret);
+    TLS_FREE(context->offered_ticket.ticket);
+    TLS_FREE(context->received_ticket.ticket);
 #endif
 #ifdef TLS_CURVE25519
     TLS_FREE(context->client_secret);
@@ -5508,6 +6285,7 @@ struct TLSPacket *tls_build_hello(struct TLSContext *context, int tls13_downgrad
         unsigned long shared_key_len = TLS_MAX_RSA_KEY;
         unsigned short shared_key_short = 0;
         int selected_group = 0;
+        int offer_ticket = 0;
         if ((context->version == TLS_V13) || (context->version == DTLS_V13)) {
             if (context->connection_status == 4) {
                 // connection_status == 4 => hello retry request
@@ -5547,6 +6325,9 @@ struct TLSPacket *tls_build_hello(struct TLSContext *context, int tls13_downgrad
                     extension_len += 8 + shared_key_len;
                     shared_key_short = (unsigned short)shared_key_len;
                 }
+                // pre shared key (the selected identity), instead of the key share
+                if (context->resumed)
+                    extension_len += 6;
             }
             // supported versions
             if (context->is_server)
@@ -5781,6 +6562,9 @@ struct TLSPacket *tls_build_hello(struct TLSContext *context, int tls13_downgrad
                     // secp256r1 produces 65 bytes export
                     extension_len += 103;
 #endif
+                    offer_ticket = _private_tls13_can_offer_ticket(context);
+                    if (offer_ticket)
+                        extension_len += _private_tls13_ticket_extensions_size(context);
                 }
 #endif
                 tls_packet_uint16(packet, extension_len);
@@ -5936,6 +6720,14 @@ struct TLSPacket *tls_build_hello(struct TLSContext *context, int tls13_downgrad
                 tls_packet_uint16(packet, 0x0601);
                 tls_packet_uint16(packet, 0x0203);
                 tls_packet_uint16(packet, 0x0201);
+                if (offer_ticket)
+                    _private_tls13_write_ticket_extensions(context, packet);
+            } else
+            if (context->resumed) {
+                // pre shared key: the first (and only) identity
+                tls_packet_uint16(packet, 0x29);
+                tls_packet_uint16(packet, 2);
+                tls_packet_uint16(packet, 0);
             }
         }
 #endif
@@ -5954,6 +6746,10 @@ struct TLSPacket *tls_build_hello(struct TLSContext *context, int tls13_downgrad
                 _private_dtls_handshake_copyframesize(packet);
                 context->dtls_seq++;
             }
+#ifdef WITH_TLS_13
+            if (offer_ticket)
+                _private_tls13_sign_hello(context, packet);
+#endif
         }
         tls_packet_update(packet);
     }
@@ -6520,6 +7316,9 @@ int tls_parse_hello(struct TLSContext *context, const unsigned char *buf, int bu
 #ifdef WITH_TLS_13
     const unsigned char *key_share = NULL;
     unsigned short key_size = 0;
+    const unsigned char *psk_extension = NULL;
+    unsigned short psk_extension_len = 0;
+    int psk_ke = 0;
 #endif
     while (buf_len - res >= 4) {
         // have extensions
@@ -6659,8 +7458,12 @@ int tls_parse_hello(struct TLSContext *context, const unsigned char *buf, int bu
                 DEBUG_DUMP_HEX_LABEL("EXTENSION, EARLY DATA", &buf[res], extension_len);
             } else
             if (extension_type == 0x29) {
-                // pre shared key
+                // pre shared key (has to be the last extension of the ClientHello)
                 DEBUG_DUMP_HEX_LABEL("EXTENSION, PRE SHARED KEY", &buf[res], extension_len);
+                if ((!context->is_server) || (res + extension_len == buf_len)) {
+                    psk_extension = &buf[res];
+                    psk_extension_len = extension_len;
+                }
             } else
             if (extension_type == 0x33) {
                 // key share
@@ -6686,6 +7489,11 @@ int tls_parse_hello(struct TLSContext *context, const unsigned char *buf, int bu
             if (extension_type == 0x2D) {
                 // psk key exchange modes
                 DEBUG_DUMP_HEX_LABEL("EXTENSION, PSK KEY EXCHANGE MODES", &buf[res], extension_len);
+                int i;
+                for (i = 1; (i <= buf[res]) && (i < extension_len); i++) {
+                    if (buf[res + i] == 0)
+                        psk_ke = 1;
+                }
             }
 #endif
             res += extension_len;
@@ -6717,6 +7525,29 @@ int tls_parse_hello(struct TLSContext *context, const unsigned char *buf, int bu
         DEBUG_PRINT("CIPHER: %s\n", tls_cipher_name(context));
     }
 
+    if ((psk_extension) && (context->version == TLS_V13) && (context->connection_status != 4)) {
+        if ((context->is_server) && (psk_ke) && (_private_tls13_accept_ticket(context, buf - 1, psk_extension, psk_extension_len))) {
+            // resuming: no key exchange (the key share of the client is not needed, and no certificate is sent)
+            if ((_private_tls13_set_zero_premaster(context)) || (!tls_random(context->local_random, TLS_SERVER_RANDOM_SIZE)))
+                return TLS_GENERIC_ERROR;
+            context->resumed = 1;
+            context->connection_status = 3;
+            return res;
+        }
+        if ((!context->is_server) && (psk_extension_len == 2) && (ntohs(*(unsigned short *)psk_extension) == 0) && (context->offered_ticket.offered)) {
+            if (context->cipher != context->offered_ticket.cipher) {
+                DEBUG_PRINT("SESSION TICKET ACCEPTED FOR ANOTHER CIPHER\n");
+                return TLS_BROKEN_PACKET;
+            }
+            context->resumed = 1;
+            if (!key_share) {
+                if (_private_tls13_set_zero_premaster(context))
+                    return TLS_NO_MEMORY;
+                context->connection_status = 2;
+                return res;
+            }
+        }
+    }
     if ((key_share) && (key_size) && ((context->version == TLS_V13) || (context->version == DTLS_V13))) {
         int key_share_err = _private_tls_parse_key_share(context, key_share, key_size);
         if (key_share_err) {
@@ -7311,9 +8142,16 @@ int tls_parse_finished(struct TLSContext *context, const unsigned char *buf, int
         if (context->is_server) {
             context->connection_status = 0xFF;
             res += size;
+            // (the resumption secret covers the client Finished as well, which is not in the hash yet)
+            unsigned char transcript_hash[TLS_MAX_HASH_SIZE];
+            unsigned int transcript_hash_len = 0;
+            if (!context->dtls)
+                transcript_hash_len = _private_tls_get_hash_with(context, buf - 1, res + 1, transcript_hash);
             _private_tls13_key(context, 0);
             context->local_sequence_number = 0;
             context->remote_sequence_number = 0;
+            _private_tls13_resumption_secret(context, transcript_hash, transcript_hash_len);
+            _private_tls13_send_session_ticket(context);
             return res;
         }
     } else
@@ -7473,6 +8311,20 @@ int tls_parse_verify(struct TLSContext *context, const unsigned char *buf, int b
 
 int tls_parse_payload(struct TLSContext *context, const unsigned char *buf, int buf_len, tls_validation_function certificate_verify) {
     int orig_len = buf_len;
+#ifdef WITH_TLS_13
+    if ((context->connection_status == 0xFF) && (!context->is_server) && (context->version == TLS_V13)) {
+        // session tickets (and nothing else) are expected after the handshake
+        while ((buf_len >= 4) && (buf[0] == 0x04)) {
+            int ticket_res = _private_tls13_parse_session_ticket(context, buf + 1, buf_len - 1);
+            if (ticket_res < 0)
+                return ticket_res;
+            buf += ticket_res + 1;
+            buf_len -= ticket_res + 1;
+        }
+        if (buf_len <= 0)
+            return orig_len;
+    }
+#endif
     if (context->connection_status == 0xFF) {
 #ifndef TLS_ACCEPT_SECURE_RENEGOTIATION
         // renegotiation disabled (emit warning alert)
@@ -7658,7 +8510,10 @@ int tls_parse_payload(struct TLSContext *context, const unsigned char *buf, int
                     DEBUG_PRINT("<= SENDING FINISHED\n");
                     _private_tls_update_hash(context, buf, payload_size + 1);
                     _private_tls_write_packet(tls_build_finished(context));
+                    unsigned char transcript_hash[TLS_MAX_HASH_SIZE];
+                    unsigned int transcript_hash_len = _private_tls_get_hash(context, transcript_hash);
                     _private_tls13_key(context, 0);
+                    _private_tls13_resumption_secret(context, transcript_hash, transcript_hash_len);
                     context->connection_status = 0xFF;
                     context->local_sequence_number = 0;
                     context->remote_sequence_number = 0;
@@ -7786,14 +8641,17 @@ int tls_parse_payload(struct TLSContext *context, const unsigned char *buf, int
                         context->cipher_spec_set = 1;
                         DEBUG_PRINT("<= SENDING ENCRYPTED EXTENSIONS\n");
                         _private_tls_write_packet(tls_build_encrypted_extensions(context));
-                        if (context->request_client_certificate) {
-                            DEBUG_PRINT("<= SENDING CERTIFICATE REQUEST\n");
-                            _private_tls_write_packet(tls_certificate_request(context));
+                        // (when resuming, the PSK authenticates the server)
+                        if (!context->resumed) {
+                            if (context->request_client_certificate) {
+                                DEBUG_PRINT("<= SENDING CERTIFICATE REQUEST\n");
+                                _private_tls_write_packet(tls_certificate_request(context));
+                            }
+                            DEBUG_PRINT("<= SENDING CERTIFICATE\n");
+                            _private_tls_write_packet(tls_build_certificate(context));
+                            DEBUG_PRINT("<= SENDING CERTIFICATE VERIFY\n");
+                            _private_tls_write_packet(tls_build_certificate_verify(context));
                         }
-                        DEBUG_PRINT("<= SENDING CERTIFICATE\n");
-                        _private_tls_write_packet(tls_build_certificate(context));
-                        DEBUG_PRINT("<= SENDING CERTIFICATE VERIFY\n");
-                        _private_tls_write_packet(tls_build_certificate_verify(context));
                         DEBUG_PRINT("<= SENDING FINISHED\n");
                         _private_tls_write_packet(tls_build_finished(context));
                         // new key
@@ -7941,7 +8799,6 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
             int delta = 8;
             int pt_length;
             unsigned char iv[TLS_13_AES_GCM_IV_LENGTH];
-            gcm_reset(&context->crypto.ctx_remote.aes_gcm_remote);
 
 #ifdef WITH_TLS_13
             if ((context->version == TLS_V13) || (context->version == DTLS_V13)) {
@@ -7990,16 +8847,13 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
             DEBUG_DUMP_HEX_LABEL("aad", aad, aad_size);
             DEBUG_DUMP_HEX_LABEL("aad iv", iv, 12);
             
-            int res0 = gcm_add_iv(&context->crypto.ctx_remote.aes_gcm_remote, iv, 12);
-            int res1 = gcm_add_aad(&context->crypto.ctx_remote.aes_gcm_remote, aad, aad_size);
             memset(pt, 0, length);
             DEBUG_PRINT("PT SIZE: %i\n", pt_length);
-            int res2 = gcm_process(&context->crypto.ctx_remote.aes_gcm_remote, pt, pt_length, buf + header_size + delta, GCM_DECRYPT);
-            unsigned char tag[32];
-            unsigned long taglen = 32;
-            int res3 = gcm_done(&context->crypto.ctx_remote.aes_gcm_remote, tag, &taglen);
-            if ((res0) || (res1) || (res2) || (res3) || (taglen != TLS_GCM_TAG_LEN)) {
-                DEBUG_PRINT("ERROR: gcm_add_iv: %i, gcm_add_aad: %i, gcm_process: %i, gcm_done: %i\n", res0, res1, res2, res3);
+            unsigned char tag[TLS_GCM_TAG_LEN];
+            unsigned long taglen = TLS_GCM_TAG_LEN;
+            int res = _private_tls_gcm_crypt(context, 0, iv, aad, aad_size, buf + header_size + delta, pt, pt_length, tag);
+            if (res) {
+                DEBUG_PRINT("ERROR: AES-GCM decryption: %i\n", res);
                 _private_random_sleep(context, TLS_MAX_ERROR_SLEEP_uS);
                 return TLS_BROKEN_PACKET;
             }
@@ -8910,6 +9764,110 @@ int tls_load_certificates(struct TLSContext *context, const unsigned char *pem_b
     return context->certificates_count;
 }
 
+#ifdef TLS_ECDSA_SUPPORTED
+static int _private_tls_der_read(const unsigned char *buf, unsigned int len, unsigned char tag, unsigned int *header_len, unsigned int *content_len) {
+    if ((len < 2) || (buf[0] != tag))
+        return 0;
+    unsigned int size = buf[1];
+    unsigned int header = 2;
+    if (size & 0x80) {
+        unsigned int size_bytes = size & 0x7F;
+        if ((size_bytes < 1) || (size_bytes > 2) || (len < 2 + size_bytes))
+            return 0;
+        size = 0;
+        for (unsigned int i = 0; i < size_bytes; i++)
+            size = (size << 8) | buf[2 + i];
+        header += size_bytes;
+    }
+    if (header + size > len)
+        return 0;
+    *header_len = header;
+    *content_len = size;
+    return 1;
+}
+
+static unsigned int _private_tls_der_write_header(unsigned char *buf, unsigned char tag, unsigned int size) {
+    buf[0] = tag;
+    if (size < 0x80) {
+        buf[1] = (unsigned char)size;
+        return 2;
+    }
+    if (size < 0x100) {
+        buf[1] = 0x81;
+        buf[2] = (unsigned char)size;
+        return 3;
+    }
+    buf[1] = 0x82;
+    buf[2] = (unsigned char)(size >> 8);
+    buf[3] = (unsigned char)size;
+    return 4;
+}
+
+// PKCS#8 PrivateKeyInfo ("BEGIN PRIVATE KEY", as written by openssl genpkey and req -newkey) wraps the SEC1 ECPrivateKey
+// that asn1_parse understands, with the curve in the outer algorithm identifier; unwraps it into a SEC1 key with the
+// curve added. Returns NULL if the key is not a PKCS#8 EC key.
+static unsigned char *_private_tls_unwrap_pkcs8_ec_key(const unsigned char *data, unsigned int len, unsigned int *out_len) {
+    unsigned int header, size;
+    if (!_private_tls_der_read(data, len, 0x30, &header, &size))
+        return NULL;
+    const unsigned char *ptr = data + header;
+    unsigned int remaining = size;
+    // version
+    if (!_private_tls_der_read(ptr, remaining, 0x02, &header, &size))
+        return NULL;
+    ptr += header + size;
+    remaining -= header + size;
+    // algorithm identifier: ecPublicKey, curve
+    unsigned int alg_header, alg_size;
+    if (!_private_tls_der_read(ptr, remaining, 0x30, &alg_header, &alg_size))
+        return NULL;
+    const unsigned char *alg = ptr + alg_header;
+    if ((!_private_tls_der_read(alg, alg_size, 0x06, &header, &size)) || (size != 7) || (!_is_oid(alg + header, TLS_EC_PUBLIC_KEY_OID, 7)))
+        return NULL;
+    const unsigned char *curve_oid = alg + header + size;
+    unsigned int curve_oid_len = alg_size - header - size;
+    if ((!_private_tls_der_read(curve_oid, curve_oid_len, 0x06, &header, &size)) || (header + size != curve_oid_len))
+        return NULL;
+    ptr += alg_header + alg_size;
+    remaining -= alg_header + alg_size;
+    // the SEC1 key: SEQUENCE { version, OCTET STRING private key, [0] curve (optional), [1] public key (optional) }
+    if (!_private_tls_der_read(ptr, remaining, 0x04, &header, &size))
+        return NULL;
+    const unsigned char *sec1 = ptr + header;
+    unsigned int sec1_len = size;
+    unsigned int key_header, key_size;
+    if (!_private_tls_der_read(sec1, sec1_len, 0x30, &key_header, &key_size))
+        return NULL;
+    const unsigned char *key = sec1 + key_header;
+    unsigned int prefix_len = 0;
+    if (!_private_tls_der_read(key, key_size, 0x02, &header, &size))
+        return NULL;
+    prefix_len += header + size;
+    if (!_private_tls_der_read(key + prefix_len, key_size - prefix_len, 0x04, &header, &size))
+        return NULL;
+    prefix_len += header + size;
+    int has_curve = (prefix_len < key_size) && (key[prefix_len] == 0xA0);
+
+    unsigned int curve_len = has_curve ? 0 : 2 + curve_oid_len;
+    unsigned int content_len = key_size + curve_len;
+    unsigned char *out = (unsigned char *)TLS_MALLOC(content_len + 8);
+    if (!out)
+        return NULL;
+    unsigned int pos = _private_tls_der_write_header(out, 0x30, content_len);
+    memcpy(out + pos, key, prefix_len);
+    pos += prefix_len;
+    if (!has_curve) {
+        pos += _private_tls_der_write_header(out + pos, 0xA0, curve_oid_len);
+        memcpy(out + pos, curve_oid, curve_oid_len);
+        pos += curve_oid_len;
+    }
+    memcpy(out + pos, key + prefix_len, key_size - prefix_len);
+    pos += key_size - prefix_len;
+    *out_len = pos;
+    return out;
+}
+#endif
+
 int tls_load_private_key(struct TLSContext *context, const unsigned char *pem_buffer, int pem_size) {
     if (!context)
         return TLS_GENERIC_ERROR;
@@ -8920,6 +9878,15 @@ int tls_load_private_key(struct TLSContext *context, const unsigned char *pem_bu
         unsigned char *data = tls_pem_decode(pem_buffer, pem_size, idx++, &len);
         if ((!data) || (!len))
             break;
+#ifdef TLS_ECDSA_SUPPORTED
+        unsigned int sec1_len = 0;
+        unsigned char *sec1 = _private_tls_unwrap_pkcs8_ec_key(data, len, &sec1_len);
+        if (sec1) {
+            TLS_FREE(data);
+            data = sec1;
+            len = sec1_len;
+        }
+#endif
         struct TLSCertificate *cert = asn1_parse(context, data, len, -1);
         if (cert) {
             if (!cert->der_len) {
@@ -9316,6 +10283,93 @@ struct TLSPacket *tls_build_message(struct TLSContext *context, const unsigned c
     return packet;
 }
 
+int tls_enable_session_tickets(struct TLSContext *context) {
+#ifdef WITH_TLS_13
+    if ((!context) || (!context->is_server) || (context->is_child))
+        return TLS_GENERIC_ERROR;
+    if (!context->ticket_key) {
+        // a new key for every run of the server (tickets from before a restart are not accepted anymore)
+        tls_init();
+        context->ticket_key = (unsigned char *)TLS_MALLOC(TLS_TICKET_KEY_SIZE);
+        if (!context->ticket_key)
+            return TLS_NO_MEMORY;
+        if (!tls_random(context->ticket_key, TLS_TICKET_KEY_SIZE)) {
+            TLS_FREE(context->ticket_key);
+            context->ticket_key = NULL;
+            return TLS_GENERIC_ERROR;
+        }
+    }
+    return 0;
+#else
+    return TLS_FEATURE_NOT_SUPPORTED;
+#endif
+}
+
+// serialized: version (1), cipher (2), lifetime (4), age add (4), received time (4), PSK length (1), PSK, ticket
+// length (2), ticket
+int tls_get_session_ticket(struct TLSContext *context, unsigned char *buf, unsigned int buf_len) {
+#ifdef WITH_TLS_13
+    if ((!context) || (context->is_server) || (!context->received_ticket.ticket))
+        return 0;
+    TLSSessionTicket *ticket = &context->received_ticket;
+    unsigned int size = 18 + ticket->psk_len + ticket->ticket_len;
+    if (size > buf_len)
+        return 0;
+    buf[0] = 1;
+    buf[1] = (unsigned char)(ticket->cipher >> 8);
+    buf[2] = (unsigned char)ticket->cipher;
+    _private_tls_write_uint32(buf + 3, ticket->lifetime);
+    _private_tls_write_uint32(buf + 7, ticket->age_add);
+    _private_tls_write_uint32(buf + 11, ticket->received_time);
+    buf[15] = ticket->psk_len;
+    memcpy(buf + 16, ticket->psk, ticket->psk_len);
+    buf[16 + ticket->psk_len] = (unsigned char)(ticket->ticket_len >> 8);
+    buf[17 + ticket->psk_len] = (unsigned char)ticket->ticket_len;
+    memcpy(buf + 18 + ticket->psk_len, ticket->ticket, ticket->ticket_len);
+    return size;
+#else
+    return 0;
+#endif
+}
+
+int tls_set_session_ticket(struct TLSContext *context, const unsigned char *buf, unsigned int buf_len) {
+#ifdef WITH_TLS_13
+    if ((!context) || (context->is_server) || (context->connection_status) || (!buf) || (buf_len < 18) || (buf[0] != 1))
+        return TLS_GENERIC_ERROR;
+    unsigned char psk_len = buf[15];
+    if ((psk_len > TLS_MAX_HASH_SIZE) || (buf_len < 18u + psk_len))
+        return TLS_BROKEN_PACKET;
+    unsigned int ticket_len = (buf[16 + psk_len] << 8) | buf[17 + psk_len];
+    if ((!ticket_len) || (buf_len != 18 + psk_len + ticket_len))
+        return TLS_BROKEN_PACKET;
+    TLSSessionTicket *ticket = &context->offered_ticket;
+    TLS_FREE(ticket->ticket);
+    memset(ticket, 0, sizeof(TLSSessionTicket));
+    ticket->ticket = (unsigned char *)TLS_MALLOC(ticket_len);
+    if (!ticket->ticket)
+        return TLS_NO_MEMORY;
+    memcpy(ticket->ticket, buf + 18 + psk_len, ticket_len);
+    ticket->ticket_len = (unsigned short)ticket_len;
+    ticket->cipher = (unsigned short)((buf[1] << 8) | buf[2]);
+    ticket->lifetime = _private_tls_read_uint32(buf + 3);
+    ticket->age_add = _private_tls_read_uint32(buf + 7);
+    ticket->received_time = _private_tls_read_uint32(buf + 11);
+    ticket->psk_len = psk_len;
+    memcpy(ticket->psk, buf + 16, psk_len);
+    return 0;
+#else
+    return TLS_FEATURE_NOT_SUPPORTED;
+#endif
+}
+
+int tls_is_resumed(struct TLSContext *context) {
+#ifdef WITH_TLS_13
+    if (context)
+        return context->resumed;
+#endif
+    return 0;
+}
+
 int tls_client_connect(struct TLSContext *context) {
     if ((context->is_server) || (context->critical_error))
         return TLS_UNEXPECTED_MESSAGE;
@@ -347,6 +347,23 @@ const char *tls_alpn(struct TLSContext *context);
 int tls_clear_certificates(struct TLSContext *context);
 int tls_make_ktls(struct TLSContext *context, int socket);
 int tls_unmake_ktls(struct TLSContext *context, int socket);
+/*
+  TLS 1.3 session resumption with stateless session tickets (psk_ke mode, so that a
+  resumed handshake needs no public key operations on either side).
+  Server: call tls_enable_session_tickets() on the server context, before tls_accept().
+  A ticket is sent after every completed handshake.
+  Client: after the handshake (once some application data has been read), tls_get_session_ticket()
+  serializes the ticket received from the server (returns the size, or 0 if there is none yet);
+  pass it to tls_set_session_ticket() on a new context before tls_client_connect(). If the
+  server does not accept it, a full handshake is done instead.
+*/
+#define TLS_SESSION_TICKET_LIFETIME     7200 // seconds
+#define TLS_SESSION_TICKET_MAX_SIZE     512  // serialized, for tls_get_session_ticket()
+int tls_enable_session_tickets(struct TLSContext *context);
+int tls_get_session_ticket(struct TLSContext *context, unsigned char *buf, unsigned int buf_len);
+int tls_set_session_ticket(struct TLSContext *context, const unsigned char *buf, unsigned int buf_len);
+// returns 1 if the handshake was done with a session ticket
+int tls_is_resumed(struct TLSContext *context);
 /*
   Creates a new DTLS random cookie secret to be used in HelloVerifyRequest (server-side).
   It is recommended to call this function from time to time, to protect against some 
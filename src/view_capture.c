@@ -0,0 +1,190 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#include "win32_main.h"
+#include "platform.h"
+#include "intrinsics.h"
+
+#include <stdio.h>
+#include <glad/glad.h>
+
+#include "stretchy_buffer.h"
+#include "jpeglib.h"
+#include "view_capture.h"
+
+typedef enum view_capture_stage_enum {
+	VIEW_CAPTURE_REQUESTED, // waiting for the end of the frame
+	VIEW_CAPTURE_READING,   // the GPU is copying the back buffer into the pixel buffer object
+	VIEW_CAPTURE_ENCODING,  // on a worker thread
+	VIEW_CAPTURE_DONE,
+} view_capture_stage_enum;
+
+typedef struct view_capture_t {
+	char filename[512];
+	volatile i32 stage; // view_capture_stage_enum
+	i32 width;
+	i32 height;
+	u32 pbo;
+	GLsync fence;
+	u8* pixels; // BGRA, bottom row first (as OpenGL has it)
+	i64 start_clock;
+	bool32 success;
+} view_capture_t;
+
+static view_capture_t** view_captures; // sb, only accessed by the main thread
+
+bool32 request_view_capture(const char* filename) {
+	if (sb_count(view_captures) >= VIEW_CAPTURES_MAX) {
+		printf("Capture: too many captures underway, try again later\n");
+		return false;
+	}
+	view_capture_t* capture = (view_capture_t*) calloc(1, sizeof(view_capture_t));
+	strncpy(capture->filename, filename, sizeof(capture->filename) - 1);
+	capture->stage = VIEW_CAPTURE_REQUESTED;
+	capture->start_clock = get_clock();
+	sb_push(view_captures, capture);
+	return true;
+}
+
+// Needs to be called at the end of drawing the views, before the GUI is drawn over them. Only starts the copy: the
+// pixels are read back later (see update_view_captures()).
+void capture_view_if_requested(i32 client_width, i32 client_height) {
+	for (i32 i = 0; i < sb_count(view_captures); ++i) {
+		view_capture_t* capture = view_captures[i];
+		if (capture->stage != VIEW_CAPTURE_REQUESTED) continue;
+		if (client_width <= 0 || client_height <= 0) {
+			capture->stage = VIEW_CAPTURE_DONE; // (minimized: nothing to capture)
+			continue;
+		}
+		capture->width = client_width;
+		capture->height = client_height;
+		u64 size = (u64)client_width * client_height * BYTES_PER_PIXEL;
+		glGenBuffers(1, &capture->pbo);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, capture->pbo);
+		glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)size, NULL, GL_STREAM_READ);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+		glReadBuffer(GL_BACK);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glReadPixels(0, 0, client_width, client_height, GL_BGRA, GL_UNSIGNED_BYTE, NULL); // (into the buffer, returns right away)
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		capture->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		capture->stage = VIEW_CAPTURE_READING;
+	}
+}
+
+static void bgra_row_to_rgb(u8* dest, const u8* src, u32 pixel_count) {
+	for (u32 i = 0; i < pixel_count; ++i) {
+		dest[i * 3 + 0] = src[i * 4 + 2];
+		dest[i * 3 + 1] = src[i * 4 + 1];
+		dest[i * 3 + 2] = src[i * 4 + 0];
+	}
+}
+
+static bool32 write_view_capture_jpeg(view_capture_t* capture) {
+	FILE* fp = fopen(capture->filename, "wb");
+	if (!fp) {
+		return false;
+	}
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	jpeg_stdio_dest(&cinfo, fp);
+	cinfo.image_width = (JDIMENSION)capture->width;
+	cinfo.image_height = (JDIMENSION)capture->height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, VIEW_CAPTURE_JPEG_QUALITY, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+	u8* rgb_row = (u8*) malloc((u64)capture->width * 3);
+	u64 pitch = (u64)capture->width * BYTES_PER_PIXEL;
+	for (i32 y = capture->height - 1; y >= 0; --y) {
+		bgra_row_to_rgb(rgb_row, capture->pixels + (u64)y * pitch, (u32)capture->width);
+		JSAMPROW rows[1] = { rgb_row };
+		jpeg_write_scanlines(&cinfo, rows, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	free(rgb_row);
+	return (fclose(fp) == 0);
+}
+
+static void encode_view_capture_func(i32 logical_thread_index, void* userdata) {
+	view_capture_t* capture = (view_capture_t*) userdata;
+	capture->success = write_view_capture_jpeg(capture);
+	if (!capture->success) {
+		remove(capture->filename); // no incomplete files
+	}
+	write_barrier;
+	capture->stage = VIEW_CAPTURE_DONE;
+}
+
+// Needs to be called every frame, on the main thread: picks up the pixels of the captures that the GPU is done with
+// (without waiting for the others), hands them to a worker for encoding, and cleans up the finished captures.
+void update_view_captures() {
+	i32 i = 0;
+	while (i < sb_count(view_captures)) {
+		view_capture_t* capture = view_captures[i];
+		if (capture->stage == VIEW_CAPTURE_READING) {
+			GLenum status = glClientWaitSync(capture->fence, 0, 0);
+			if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+				u64 size = (u64)capture->width * capture->height * BYTES_PER_PIXEL;
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, capture->pbo);
+				u8* mapped = (u8*) glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (GLsizeiptr)size, GL_MAP_READ_BIT);
+				if (mapped) {
+					capture->pixels = (u8*) malloc(size);
+					memcpy(capture->pixels, mapped, size);
+					glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+				}
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+				glDeleteBuffers(1, &capture->pbo);
+				glDeleteSync(capture->fence);
+				capture->pbo = 0;
+				capture->fence = 0;
+				capture->stage = VIEW_CAPTURE_ENCODING;
+				if (!capture->pixels) {
+					capture->stage = VIEW_CAPTURE_DONE;
+				} else if (!add_work_queue_entry(&work_queue, encode_view_capture_func, capture)) {
+					encode_view_capture_func(0, capture); // queue is full, do it now
+				}
+			}
+		}
+		if (capture->stage != VIEW_CAPTURE_DONE) {
+			++i;
+			continue;
+		}
+		read_barrier;
+		if (capture->success) {
+			printf("Capture: wrote %s (%d x %d pixels) in %.2f seconds\n", capture->filename, capture->width,
+			       capture->height, get_seconds_elapsed(capture->start_clock, get_clock()));
+		} else {
+			printf("Capture: failed to write %s\n", capture->filename);
+		}
+		free(capture->pixels);
+		free(capture);
+		view_captures[i] = sb_last(view_captures);
+		--sb_raw_count(view_captures);
+	}
+}
+
+bool32 is_view_capture_in_progress() {
+	return sb_count(view_captures) > 0;
+}
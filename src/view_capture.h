@@ -0,0 +1,44 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+// Captures what is on screen (the views of the slides with their annotations, without the GUI) to a JPEG file, without
+// stalling the frame: at the end of the frame the back buffer is copied into a pixel buffer object, which is only read
+// once a fence says that the GPU is done with it, a frame or two later. Flipping the rows and encoding happen on a
+// worker thread.
+// To capture the view at the native resolution of the slide instead, the region in view is exported from the file
+// (see start_region_export()).
+
+#define VIEW_CAPTURE_JPEG_QUALITY 92
+#define VIEW_CAPTURES_MAX 4 // in flight at once
+
+bool32 request_view_capture(const char* filename);
+void capture_view_if_requested(i32 client_width, i32 client_height);
+void update_view_captures();
+bool32 is_view_capture_in_progress();
+
+#ifdef __cplusplus
+}
+#endif
@@ -42,11 +42,24 @@
 #include "render_group.c"
 
 #include "tiff.h"
+#include "tile_cache.h"
+#include "disk_cache.h"
+#include "shared_tile_cache.h"
 #include "jpeg_decoder.h"
+#include "jpeg2000_decoder.h"
 #include "tlsclient.h"
 #include "gui.h"
 #include "caselist.h"
 #include "annotation.h"
+#include "profiler.h"
+#include "tile_metrics.h"
+#include "memory_stats.h"
+#include "region_export.h"
+#include "view_capture.h"
+#include "registration.h"
+#include "tile_stream.h"
+#include "slide_open.h"
+#include "log.h"
 
 
 void reset_scene(image_t *image, scene_t *scene) {
@@ -57,758 +70,3990 @@ void reset_scene(image_t *image, scene_t *scene) {
 
 }
 
-u32 load_texture(void* pixels, i32 width, i32 height) {
-	u32 texture = 0; //gl_gen_texture();
-	glEnable(GL_TEXTURE_2D);
-	glGenTextures(1, &texture);
-//	printf("Generated texture %d\n", texture);
-	glBindTexture(GL_TEXTURE_2D, texture);
-//	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
-//	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_BGRA, GL_UNSIGNED_BYTE, pixels);
-	glGenerateMipmap(GL_TEXTURE_2D);
-//	gl_diagnostic("glTexImage2D");
-	return texture;
-}
-
-tile_t* get_tile(level_image_t* image_level, i32 tile_x, i32 tile_y) {
-	i32 tile_index = tile_y * image_level->width_in_tiles + tile_x;
-	ASSERT(tile_index >= 0 && tile_index < image_level->tile_count);
-	tile_t* result = image_level->tiles + tile_index;
-	return result;
+// Finished tile loads, waiting to be handled by the main thread (the only thread with an OpenGL context): decoded
+// tiles to be uploaded, but also tiles that turned out to be empty or that failed to load. The workers don't touch
+// the state of a tile once they have picked it up; the main thread updates it when it takes the tile from the queue.
+typedef struct decoded_tile_t {
+	struct decoded_tile_t* next;
+	u32 image_id;
+	tile_t* tile;
+	i32 focal_plane;
+	i32 level;
+	i32 tile_x;
+	i32 tile_y;
+	bool32 is_empty; // nothing to draw, see discard_empty_tile()
+	bool32 is_failed; // may be requested again
+	u8* mip_chain; // see build_tile_mip_chain() / build_planar_tile_mip_chain(); NULL if the tile is uniform
+	bool32 is_gpu_decoded; // mip_chain holds DCT coefficients instead, see decode_tile_coefficients_into_texture()
+	bool32 is_uniform;
+	u32 uniform_color;
+	i32 texture_format; // tile_texture_format_enum
+	bool32 is_small_tile; // packed into a quadrant of a texture layer
+	i32 resolution_shift;
+	bool32 is_reduced_quality;
+	i64 decoded_clock;
+	i64 upload_clock; // when handed to the transfer queue (see submit_tile_transfer())
+} decoded_tile_t;
+
+// Lock-free multi-producer, single-consumer queue: the workers push onto a list (newest first) with a
+// compare-exchange, and the main thread takes the whole list at once with an exchange. Because the main thread never
+// takes out single entries, pushing is not affected by the ABA problem.
+typedef struct tile_completion_queue_t {
+	decoded_tile_t* volatile pushed; // newest first
+	decoded_tile_t* pending_first; // main thread only: taken from pushed (oldest first), not yet handled
+	decoded_tile_t* pending_last;
+	i32 pending_count;
+} tile_completion_queue_t;
+
+static tile_completion_queue_t tile_completion_queue;
+
+// Can be called from any thread; takes ownership of decoded_tile (allocated with malloc()).
+static void push_tile_completion(decoded_tile_t* decoded_tile) {
+	tile_completion_queue_t* queue = &tile_completion_queue;
+	decoded_tile_t* head;
+	do {
+		head = queue->pushed;
+		decoded_tile->next = head;
+	} while (interlocked_compare_exchange_pointer(&queue->pushed, decoded_tile, head) != head);
+	if (head == NULL) {
+		// The queue was empty, so the main thread may be idling. (If it wasn't, whoever pushed first has woken it.)
+		platform_wake_main_thread();
+	}
 }
 
-void tiff_load_tile_batch_func(i32 logical_thread_index, void* userdata) {
-	load_tile_task_batch_t* batch = (load_tile_task_batch_t*) userdata;
-	load_tile_task_t* first_task = batch->tile_tasks;
-	image_t* image = first_task->image;
+// Main thread only: appends what the workers pushed since the last call to the pending list, in the order pushed.
+static void take_tile_completions(tile_completion_queue_t* queue) {
+	decoded_tile_t* pushed = (decoded_tile_t*) interlocked_exchange_pointer(&queue->pushed, NULL);
+	decoded_tile_t* reversed = NULL;
+	decoded_tile_t* last = pushed;
+	while (pushed) {
+		decoded_tile_t* next = pushed->next;
+		pushed->next = reversed;
+		reversed = pushed;
+		pushed = next;
+		++queue->pending_count;
+	}
+	if (reversed) {
+		if (queue->pending_last) {
+			queue->pending_last->next = reversed;
+		} else {
+			queue->pending_first = reversed;
+		}
+		queue->pending_last = last;
+	}
+}
 
-	// Note: when the thread started up we allocated a large blob of memory for the thread to use privately
-	// TODO: better/more explicit allocator (instead of some setting some hard-coded pointers)
-	thread_memory_t* thread_memory = (thread_memory_t*) thread_local_storage[logical_thread_index];
-	u8* temp_memory = (u8*) thread_memory->aligned_rest_of_thread_memory; //malloc(WSI_BLOCK_SIZE);
-	memset(temp_memory, 0xFF, WSI_BLOCK_SIZE);
+static decoded_tile_t* new_tile_completion(image_t* image, level_image_t* level_image, tile_t* tile) {
+	decoded_tile_t* decoded_tile = (decoded_tile_t*) calloc(1, sizeof(decoded_tile_t));
+	decoded_tile->image_id = image->image_id;
+	decoded_tile->tile = tile;
+	i32 index = (i32)(level_image - image->focal_plane_level_images);
+	decoded_tile->focal_plane = index / image->level_count;
+	decoded_tile->level = index % image->level_count;
+	tile->debug_stage = TILE_DEBUG_STAGE_UPLOADING;
+	return decoded_tile;
+}
 
+// For a tile that turned out to have nothing to draw
+static void submit_empty_tile(image_t* image, level_image_t* level_image, tile_t* tile, i32 tile_x, i32 tile_y) {
+	decoded_tile_t* decoded_tile = new_tile_completion(image, level_image, tile);
+	decoded_tile->is_empty = true;
+	decoded_tile->tile_x = tile_x;
+	decoded_tile->tile_y = tile_y;
+	push_tile_completion(decoded_tile);
+}
 
-	if (image->type == IMAGE_TYPE_TIFF) {
-		tiff_t* tiff = &image->tiff.tiff;
+// For a tile that was picked up by a worker, but could not be loaded (it may be requested again)
+static void submit_failed_tile(image_t* image, level_image_t* level_image, tile_t* tile) {
+	decoded_tile_t* decoded_tile = new_tile_completion(image, level_image, tile);
+	decoded_tile->is_failed = true;
+	push_tile_completion(decoded_tile);
+}
 
-		if (tiff->is_remote) {
+// The channels of fluorescence images, and overlays, are grayscale: their tiles get single channel textures.
+static bool32 is_single_channel_image(image_t* image) {
+	return image->channel_count > 0 || image->overlay_of_image_id != 0;
+}
 
-			i32 bytes_read = 0;
-			i32 batch_size = batch->task_count;
-			i64 chunk_offsets[TILE_LOAD_BATCH_MAX];
-			i64 chunk_sizes[TILE_LOAD_BATCH_MAX];
-			i64 total_read_size = 0;
-			for (i32 i = 0; i < batch_size; ++i) {
-				load_tile_task_t* task = batch->tile_tasks + i;
-
-				i32 level = task->level;
-				i32 tile_x = task->tile_x;
-				i32 tile_y = task->tile_y;
-				level_image_t* level_image = image->level_images + level;
-				tile_t* tile = task->tile;
-				i32 tile_index = tile_y * level_image->width_in_tiles + tile_x;
-				tiff_ifd_t* level_ifd = tiff->level_images + level;
-				u64 tile_offset = level_ifd->tile_offsets[tile_index];
-				u64 chunk_size = level_ifd->tile_byte_counts[tile_index];
-
-				// It doesn't make sense to ask for empty tiles, this should never happen!
-				ASSERT(tile_offset != 0);
-				ASSERT(chunk_size != 0);
-
-				chunk_offsets[i] = tile_offset;
-				chunk_sizes[i] = chunk_size;
-				total_read_size += chunk_size;
-			}
-
-
-			u32 new_textures[TILE_LOAD_BATCH_MAX] = {0};
-
-			// Note: First download everything, then decode and upload everything to the GPU.
-			// It would be faster to pipeline this somehow.
-			u8* read_buffer = download_remote_batch(tiff->location.hostname, tiff->location.portno,
-			                                        tiff->location.filename,
-			                                        chunk_offsets, chunk_sizes, batch_size, &bytes_read, logical_thread_index);
-			if (read_buffer && bytes_read > 0) {
-				i64 content_offset = find_end_of_http_headers(read_buffer, bytes_read);
-				i64 content_length = bytes_read - content_offset;
-				u8* content = read_buffer + content_offset;
-
-				// TODO: better way to check the real content length?
-				if (content_length >= total_read_size) {
-
-					i64 chunk_offset_in_read_buffer = 0;
-					for (i32 i = 0; i < batch_size; ++i) {
-						u8* current_chunk = content + chunk_offset_in_read_buffer;
-						chunk_offset_in_read_buffer += chunk_sizes[i];
-
-						load_tile_task_t* task = batch->tile_tasks + i;
-						tiff_ifd_t* level_ifd = tiff->level_images + task->level;
-						u8* jpeg_tables = level_ifd->jpeg_tables;
-						u64 jpeg_tables_length = level_ifd->jpeg_tables_length;
-
-						if (content[0] == 0xFF && content[1] == 0xD9) {
-							// JPEG stream is empty
-						} else {
-							if (decode_tile(jpeg_tables, jpeg_tables_length, current_chunk, chunk_sizes[i],
-							                temp_memory, (level_ifd->color_space == TIFF_PHOTOMETRIC_YCBCR))) {
-//		                    printf("thread %d: successfully decoded level %d, tile %d (%d, %d)\n", logical_thread_index, level, tile_index, tile_x, tile_y);
-							} else {
-								printf("[thread %d] failed to decode level %d, tile (%d, %d)\n", logical_thread_index, task->level, task->tile_x, task->tile_y);
-							}
-						}
+// Called from a worker thread, once the tile has been decoded into the start of a tile buffer (see
+// acquire_tile_buffer()). The mipmaps are generated here as well, in place, so that the main thread only has to hand
+// the pixels to OpenGL. The buffer is passed on to the main thread, which gives it back after uploading.
+// Tiles of a single color (mostly empty glass) don't get a texture at all: only the color is passed on.
+// Tiles of levels with small tiles (at most TILE_DIM / 2), and tiles decoded at reduced size, only get a quarter of a
+// texture layer.
+// Tiles decoded as YCbCr planes or DCT coefficients (see decode_compressed_tile()) are uploaded as they are.
+// The channels of fluorescence images only keep one byte per pixel (see build_single_channel_tile_mip_chain()).
+static void submit_decoded_tile_at_quality(image_t* image, level_image_t* level_image, tile_t* tile, i32 resolution_shift,
+                                           u8* tile_buffer, i32 layout, bool32 is_reduced_quality) {
+	decoded_tile_t* decoded_tile = new_tile_completion(image, level_image, tile);
+	decoded_tile->resolution_shift = resolution_shift;
+	decoded_tile->is_reduced_quality = is_reduced_quality;
+	decoded_tile->decoded_clock = get_clock();
+	if (layout == DECODED_TILE_DCT_COEFFICIENTS) {
+		// (the pixels don't exist yet, so these are never treated as uniform)
+		decoded_tile->texture_format = TILE_TEXTURE_FORMAT_BGRA;
+		decoded_tile->is_gpu_decoded = true;
+		decoded_tile->mip_chain = tile_buffer;
+	} else if (layout == DECODED_TILE_YCBCR_PLANES) {
+		if (is_planar_tile_uniform(tile_buffer, TILE_DIM, &decoded_tile->uniform_color)) {
+			decoded_tile->is_uniform = true;
+			release_tile_buffer(tile_buffer);
+			tile_metrics_count(TILE_COUNTER_UNIFORM, 1);
+		} else {
+			build_planar_tile_mip_chain(tile_buffer, tile_buffer, TILE_DIM);
+			decoded_tile->texture_format = TILE_TEXTURE_FORMAT_YCBCR420;
+			decoded_tile->mip_chain = tile_buffer;
+		}
+	} else if (is_tile_uniform(tile_buffer, &decoded_tile->uniform_color)) {
+		decoded_tile->is_uniform = true;
+		release_tile_buffer(tile_buffer);
+		tile_metrics_count(TILE_COUNTER_UNIFORM, 1);
+	} else {
+		decoded_tile->is_small_tile = ((level_image->tile_width >> resolution_shift) <= TILE_DIM / 2 &&
+		                               (level_image->tile_height >> resolution_shift) <= TILE_DIM / 2);
+		i32 dim = TILE_DIM;
+		if (decoded_tile->is_small_tile) {
+			pack_small_tile(tile_buffer);
+			dim = TILE_DIM / 2;
+		}
+		if (is_single_channel_image(image)) {
+			build_single_channel_tile_mip_chain(tile_buffer, dim);
+			decoded_tile->texture_format = TILE_TEXTURE_FORMAT_R8;
+		} else {
+			build_tile_mip_chain(tile_buffer, tile_buffer, dim);
+			decoded_tile->texture_format = get_tile_texture_format_for_new_tiles();
+			if (decoded_tile->texture_format == TILE_TEXTURE_FORMAT_BC1) {
+				compress_tile_mip_chain_bc1(tile_buffer, dim);
+			}
+		}
+		decoded_tile->mip_chain = tile_buffer;
+	}
+	push_tile_completion(decoded_tile);
+}
 
-						new_textures[i] = load_texture(temp_memory, TILE_DIM, TILE_DIM);
-					}
+void submit_decoded_tile(image_t* image, level_image_t* level_image, tile_t* tile, i32 resolution_shift, u8* tile_buffer,
+                         i32 layout) {
+	submit_decoded_tile_at_quality(image, level_image, tile, resolution_shift, tile_buffer, layout, false);
+}
+
+// Images are referred to by handle (image_t::image_id): the index of a slot in image_slots, plus the generation of the
+// slot, which goes up as soon as the image in it is unloaded. Work that is still underway for an unloaded image
+// (tile loads, downloads, decodes) finds a different generation in the slot, and is dropped, or its result thrown away
+// (see upload_decoded_tiles()). Switching slides therefore doesn't wait for anything: the work for the old slide drains
+// in the background, while the image itself is kept around until it is done (see update_image_unloads()).
+#define IMAGE_HANDLE_INDEX_BITS 8
+#define IMAGE_SLOT_COUNT (1 << IMAGE_HANDLE_INDEX_BITS)
+#define IMAGE_HANDLE_GENERATION_MASK ((1u << (32 - IMAGE_HANDLE_INDEX_BITS)) - 1)
+
+typedef struct image_slot_t {
+	image_t* image; // NULL if the slot is free; only accessed by the main thread
+	u32 volatile generation; // never 0, so that an image_id of 0 can mean 'no image'
+} image_slot_t;
+
+static image_slot_t image_slots[IMAGE_SLOT_COUNT];
+
+static u32 acquire_image_handle(image_t* image) {
+	for (u32 i = 0; i < IMAGE_SLOT_COUNT; ++i) {
+		image_slot_t* slot = image_slots + i;
+		if (!slot->image) {
+			if (slot->generation == 0) slot->generation = 1;
+			slot->image = image;
+			return (slot->generation << IMAGE_HANDLE_INDEX_BITS) | i;
+		}
+	}
+	printf("Error: out of image slots\n");
+	panic();
+	return 0;
+}
+
+static void release_image_handle(u32 image_id) {
+	image_slot_t* slot = image_slots + (image_id & (IMAGE_SLOT_COUNT - 1));
+	if (slot->generation == (image_id >> IMAGE_HANDLE_INDEX_BITS)) {
+		u32 generation = (slot->generation + 1) & IMAGE_HANDLE_GENERATION_MASK;
+		slot->generation = generation ? generation : 1;
+		write_barrier;
+		slot->image = NULL;
+	}
+}
+
+// Safe to call from any thread: workers use it to skip the work for images that have been unloaded in the meantime.
+bool32 is_image_handle_alive(u32 image_id) {
+	image_slot_t* slot = image_slots + (image_id & (IMAGE_SLOT_COUNT - 1));
+	return image_id != 0 && slot->generation == (image_id >> IMAGE_HANDLE_INDEX_BITS);
+}
+
+image_t* find_loaded_image(app_state_t* app_state, u32 image_id) {
+	return is_image_handle_alive(image_id) ? image_slots[image_id & (IMAGE_SLOT_COUNT - 1)].image : NULL;
+}
+
+// The main thread keeps track of the tiles that own a texture, so that they can be evicted later.
+static void add_to_cached_tiles(image_t* image, tile_t* tile, i32 level) {
+	if (!tile->is_in_cached_tiles) {
+		tile->is_in_cached_tiles = true;
+		sb_push(image->cached_tiles, ((cached_tile_t){ .tile = tile, .level = level }));
+	}
+}
+
+// The tile is drawn from the texture slot from now on.
+static void set_tile_texture(image_t* image, decoded_tile_t* decoded_tile, u32 slot) {
+	tile_t* tile = decoded_tile->tile;
+	tile->texture_slot = slot;
+	tile->is_uniform = false;
+	tile->resolution_shift = decoded_tile->resolution_shift;
+	tile->is_reduced_quality = (bool8)decoded_tile->is_reduced_quality;
+	tile->state = TILE_STATE_LOADED;
+	tile->debug_stage = TILE_DEBUG_STAGE_DONE;
+	add_to_cached_tiles(image, tile, decoded_tile->level);
+}
+
+// The tiles that the transfer thread has finished uploading get their textures (see submit_tile_transfer()).
+static void finish_tile_transfers(app_state_t* app_state) {
+	u32 slot;
+	void* userdata;
+	while (take_finished_tile_transfer(&slot, &userdata)) {
+		decoded_tile_t* decoded_tile = (decoded_tile_t*) userdata;
+		tile_metrics_record(TILE_STAGE_UPLOAD_WAIT, decoded_tile->decoded_clock, decoded_tile->upload_clock);
+		tile_metrics_record(TILE_STAGE_UPLOAD, decoded_tile->upload_clock, get_clock());
+		image_t* image = find_loaded_image(app_state, decoded_tile->image_id);
+		if (image) {
+			// (a tile that was drawn from a reduced-size texture so far has kept drawing it until now)
+			u32 old_slot = decoded_tile->tile->texture_slot;
+			set_tile_texture(image, decoded_tile, slot);
+			if (old_slot != 0) {
+				release_tile_texture_slot(old_slot);
+			}
+		} else {
+			release_tile_texture_slot(slot); // the image was closed during the upload
+		}
+		release_tile_buffer(decoded_tile->mip_chain);
+		free(decoded_tile);
+	}
+}
+
+// Called from the main thread once per frame: handles the tile loads that the workers have finished, oldest first.
+// This is where the state of loaded tiles changes and decoded tiles are uploaded to the GPU, until the time budget is
+// used up. At least one tile is uploaded per frame, so that loading never stalls completely.
+// If the transfer thread is running, the tiles are handed to it instead (as many as the transfer queue takes), and
+// they are finished here once their uploads are done.
+// Returns the number of tiles still waiting.
+i32 upload_decoded_tiles(app_state_t* app_state, float time_budget_in_seconds) {
+	tile_completion_queue_t* queue = &tile_completion_queue;
+	take_tile_completions(queue);
+	bool32 use_transfer_queue = is_tile_transfer_queue_running();
+	if (use_transfer_queue) {
+		finish_tile_transfers(app_state);
+	}
 
+	i64 start = get_clock();
+	i32 uploaded_count = 0;
+	while (queue->pending_first) {
+		decoded_tile_t* decoded_tile = queue->pending_first;
+		bool32 needs_upload = !(decoded_tile->is_empty || decoded_tile->is_failed || decoded_tile->is_uniform);
+		bool32 is_transfer = use_transfer_queue && needs_upload && !decoded_tile->is_gpu_decoded;
+		if (is_transfer ? is_tile_transfer_queue_full() :
+		    (needs_upload && uploaded_count > 0 && get_seconds_elapsed(start, get_clock()) > time_budget_in_seconds)) {
+			break;
+		}
+		queue->pending_first = decoded_tile->next;
+		if (!queue->pending_first) {
+			queue->pending_last = NULL;
+		}
+		--queue->pending_count;
+
+		// The image may have been closed while the tile was being decoded; the tile no longer exists in that case.
+		image_t* image = find_loaded_image(app_state, decoded_tile->image_id);
+		if (image) {
+			tile_t* tile = decoded_tile->tile;
+			// A tile that was drawn from a reduced-size texture so far gives it up once the refined tile is in.
+			u32 old_slot = tile->texture_slot;
+			if (decoded_tile->is_empty) {
+				level_image_t* level_image = get_focal_plane_levels(image, decoded_tile->focal_plane) + decoded_tile->level;
+				mark_tile_empty(level_image, decoded_tile->tile_x, decoded_tile->tile_y);
+				tile->state = TILE_STATE_UNLOADED;
+				old_slot = 0;
+			} else if (decoded_tile->is_failed) {
+				tile->state = TILE_STATE_UNLOADED; // allow the tile to be requested again
+				tile->debug_stage = TILE_DEBUG_STAGE_FAILED;
+				old_slot = 0;
+			} else if (decoded_tile->is_uniform) {
+				tile->uniform_color = decoded_tile->uniform_color;
+				tile->is_uniform = true;
+				tile->texture_slot = 0;
+				tile->resolution_shift = decoded_tile->resolution_shift;
+				tile->is_reduced_quality = (bool8)decoded_tile->is_reduced_quality;
+				tile->state = TILE_STATE_LOADED;
+				tile->debug_stage = TILE_DEBUG_STAGE_DONE;
+			} else {
+				u32 slot = allocate_tile_texture_slot(decoded_tile->texture_format, decoded_tile->is_small_tile);
+				if (slot != 0 && is_transfer) {
+					decoded_tile->upload_clock = get_clock();
+					submit_tile_transfer(slot, decoded_tile->mip_chain, decoded_tile); // (there is room, see above)
+					++uploaded_count;
+					continue; // keeps the mip chain until the upload is done, see finish_tile_transfers()
+				} else if (slot != 0) {
+					i64 upload_start = get_clock();
+					if (decoded_tile->is_gpu_decoded) {
+						decode_tile_coefficients_into_texture(slot, decoded_tile->mip_chain);
+					} else {
+						upload_tile_mip_chain(slot, decoded_tile->mip_chain);
+					}
+					tile_metrics_record(TILE_STAGE_UPLOAD_WAIT, decoded_tile->decoded_clock, upload_start);
+					tile_metrics_record(TILE_STAGE_UPLOAD, upload_start, get_clock());
+					set_tile_texture(image, decoded_tile, slot);
+				} else {
+					printf("Error: no free tile texture slots\n");
+					old_slot = 0; // keep drawing the old texture, if any
+					// failed, allow the tile to be requested again
+					tile->state = (tile->texture_slot != 0) ? TILE_STATE_LOADED : TILE_STATE_UNLOADED;
+					tile->debug_stage = TILE_DEBUG_STAGE_FAILED;
 				}
+				++uploaded_count;
+			}
+			if (old_slot != 0) {
+				release_tile_texture_slot(old_slot);
+			}
+		}
+		if (decoded_tile->mip_chain) {
+			release_tile_buffer(decoded_tile->mip_chain);
+		}
+		free(decoded_tile);
+	}
+	// (what we didn't get to stays in the pending list, in front of what the workers push in the meantime)
+	return queue->pending_count;
+}
+
+static bool32 is_jpeg2000_compression(u16 compression) {
+	return compression == TIFF_COMPRESSION_JP2000 || compression == TIFF_COMPRESSION_APERIO_JP2000_YCBCR ||
+	       compression == TIFF_COMPRESSION_APERIO_JP2000_RGB;
+}
+
+// Decode a compressed TIFF tile into dest, optionally at reduced size (scale_denom = 2, 4 or 8).
+// Returns false if decoding failed; the pixels are left untouched if the JPEG stream is empty.
+bool32 decode_compressed_tile_scaled(i32 logical_thread_index, tiff_ifd_t* level_ifd, u8* data, u64 size, u8* dest,
+                                     u32 dest_pitch, i32 scale_denom) {
+	if (data[0] == 0xFF && data[1] == 0xD9) {
+		return true; // JPEG stream is empty
+	}
+	if (is_jpeg2000_compression(level_ifd->compression)) {
+		// Reduced sizes come from the lower resolution levels of the codestream. Full-size tiles of TILE_DIM x TILE_DIM
+		// are decoded by two threads; the other workers are usually busy with tiles of their own.
+		i32 resolution_reduction = (scale_denom >= 8) ? 3 : (scale_denom >= 4) ? 2 : (scale_denom >= 2) ? 1 : 0;
+		bool32 is_large_tile = (scale_denom == 1 && level_ifd->tile_width * level_ifd->tile_height >= TILE_DIM * TILE_DIM);
+		bool32 success = jpeg2000_decode_tile(data, size, dest, dest_pitch, level_ifd->tile_width / scale_denom,
+		                                      level_ifd->tile_height / scale_denom,
+		                                      (level_ifd->compression == TIFF_COMPRESSION_APERIO_JP2000_YCBCR),
+		                                      resolution_reduction, is_large_tile ? 2 : 1);
+		if (!success) {
+			tile_metrics_count(TILE_COUNTER_DECODE_FAILED, 1);
+		}
+		return success;
+	}
+	thread_memory_t* thread_memory = (thread_memory_t*) thread_local_storage[logical_thread_index];
+	if (!thread_memory->jpeg_decoder_state) {
+		thread_memory->jpeg_decoder_state = jpeg_decoder_create_state();
+	}
+	bool32 success = decode_fixed_size_tile_with_state(thread_memory->jpeg_decoder_state, level_ifd->jpeg_tables,
+	                                                   level_ifd->jpeg_tables_length, data, size, dest, dest_pitch,
+	                                                   (level_ifd->color_space == TIFF_PHOTOMETRIC_YCBCR),
+	                                                   tiff_get_tile_path_dim(level_ifd->tile_path), scale_denom);
+	if (!success) {
+		tile_metrics_count(TILE_COUNTER_DECODE_FAILED, 1);
+	}
+	return success;
+}
 
+// For tiles smaller than TILE_DIM: fills the rest of the tile buffer by repeating the last column and row, so that
+// neither the mipmaps nor the filtering at the edge of the drawn part pick up anything else.
+static void pad_tile_edges(u8* pixels, u32 valid_width, u32 valid_height) {
+	if (valid_width == 0 || valid_height == 0) return;
+	if (valid_width < TILE_DIM) {
+		for (u32 y = 0; y < valid_height; ++y) {
+			u32* row = (u32*)(pixels + y * TILE_PITCH);
+			u32 edge = row[valid_width - 1];
+			for (u32 x = valid_width; x < TILE_DIM; ++x) {
+				row[x] = edge;
 			}
+		}
+	}
+	u8* last_row = pixels + (valid_height - 1) * TILE_PITCH;
+	for (u32 y = valid_height; y < TILE_DIM; ++y) {
+		memcpy(pixels + y * TILE_PITCH, last_row, TILE_PITCH);
+	}
+}
+
+// Can the tile be kept as YCbCr planes or DCT coefficients (see decode_tile_planar_with_state() and
+// decode_tile_coefficients_with_state())? Only JPEG tiles at full size that fill a whole texture layer: the other tiles
+// need padding, which is done on BGRA pixels. (The tiles at the edges of the image qualify as well: the part outside of
+// the image is clipped when drawing, see get_tile_valid_fill().)
+// The channels of fluorescence images and overlays are grayscale, and need the pixels as well.
+static bool32 can_decode_tile_partially(tiff_ifd_t* level_ifd, load_tile_task_t* task) {
+	return tiff_get_tile_path_dim(level_ifd->tile_path) == TILE_DIM && task->resolution_shift == 0 &&
+	       !is_single_channel_image(task->image);
+}
 
-			// Note: setting task->tile->texture to the texture handle lets the main thread know that the texture
-			// is ready for use. However, the texture may still not *actually* be available until OpenGL has done its
-			// magic, so to be 100% sure we need to call glFinish() before setting task->tile->texture
-			// We only want to call glFinish() once, so we store the new texture handles temporarily while the
-			// rest of the batch is still loading.
-			// Better would be to flag the texture as 'ready for use' as soon as it's done, but I don't know
-			// how we could query this / be notified of this. (maybe an optimization for later?)
-			glFinish();
-			write_barrier;
-			for (i32 i = 0; i < batch_size; ++i) {
-				load_tile_task_t* task = batch->tile_tasks + i;
-				task->tile->texture = new_textures[i];
+// Decode a compressed TIFF tile into dest, at the size asked for by the task (the pixels are made white if decoding fails).
+// If possible the tile is only decoded into DCT coefficients (to be finished on the GPU), or into YCbCr planes, instead
+// of BGRA; *layout tells which it was (decoded_tile_layout_enum).
+// Returns false if the JPEG stream is empty: there is nothing to draw then, see discard_empty_tile().
+bool32 decode_compressed_tile(i32 logical_thread_index, tiff_ifd_t* level_ifd, load_tile_task_t* task, u8* data, u64 size,
+                              u8* dest, i32* layout) {
+	*layout = DECODED_TILE_BGRA;
+	if (data[0] == 0xFF && data[1] == 0xD9) {
+		tile_metrics_count(TILE_COUNTER_EMPTY, 1);
+		return false;
+	}
+	i64 decode_start = get_clock();
+	i32 shift = task->resolution_shift;
+	bool32 success;
+	bool32 use_gpu = use_gpu_tile_decoding();
+	if ((use_gpu || use_planar_tile_textures()) && can_decode_tile_partially(level_ifd, task)) {
+		thread_memory_t* thread_memory = (thread_memory_t*) thread_local_storage[logical_thread_index];
+		if (!thread_memory->jpeg_decoder_state) {
+			thread_memory->jpeg_decoder_state = jpeg_decoder_create_state();
+		}
+		bool32 is_YCbCr = (level_ifd->color_space == TIFF_PHOTOMETRIC_YCBCR);
+		bool32 is_partially_decoded = false;
+		if (use_gpu) {
+			success = decode_tile_coefficients_with_state(thread_memory->jpeg_decoder_state, level_ifd->jpeg_tables,
+			                                              level_ifd->jpeg_tables_length, data, size, dest, TILE_PITCH,
+			                                              is_YCbCr, TILE_DIM, &is_partially_decoded);
+			if (is_partially_decoded) {
+				*layout = DECODED_TILE_DCT_COEFFICIENTS;
+			}
+		} else {
+			success = decode_tile_planar_with_state(thread_memory->jpeg_decoder_state, level_ifd->jpeg_tables,
+			                                        level_ifd->jpeg_tables_length, data, size, dest, TILE_PITCH,
+			                                        is_YCbCr, TILE_DIM, &is_partially_decoded);
+			if (is_partially_decoded) {
+				*layout = DECODED_TILE_YCBCR_PLANES;
 			}
+		}
+		if (!success) {
+			*layout = DECODED_TILE_BGRA;
+			tile_metrics_count(TILE_COUNTER_DECODE_FAILED, 1);
+		}
+	} else {
+		success = decode_compressed_tile_scaled(logical_thread_index, level_ifd, data, size, dest, TILE_PITCH, 1 << shift);
+	}
+	tile_metrics_record(TILE_STAGE_DECODE, decode_start, get_clock());
+	if (success) {
+//		printf("thread %d: successfully decoded level %d, tile (%d, %d)\n", logical_thread_index, task->level, task->tile_x, task->tile_y);
+		u32 decoded_width = level_ifd->tile_width >> shift;
+		u32 decoded_height = level_ifd->tile_height >> shift;
+		if (*layout == DECODED_TILE_BGRA && (decoded_width < TILE_DIM || decoded_height < TILE_DIM)) {
+			pad_tile_edges(dest, decoded_width, decoded_height);
+		}
+	} else {
+		// A decoded tile covers the whole buffer, so it only needs to be cleared if decoding failed.
+		memset(dest, 0xFF, WSI_BLOCK_SIZE);
+		log_warning("[thread %d] failed to decode level %d, tile (%d, %d)\n", logical_thread_index, task->level, task->tile_x, task->tile_y);
+	}
+	return true;
+}
+
+// Tiles without any image data are not uploaded: they are marked empty, so that they are neither requested nor drawn
+// anymore (the background shows through). Usually they are already known to be empty from the tile tables, see
+// load_tile_tables_for_level(); this catches the tiles that were requested before that.
+static void discard_empty_tile(image_t* image, level_image_t* level_image, tile_t* tile, i32 tile_x, i32 tile_y,
+                               u8* tile_buffer) {
+	release_tile_buffer(tile_buffer);
+	submit_empty_tile(image, level_image, tile, tile_x, tile_y);
+}
+
+// According to the tile tables, is the tile empty? A tile of 2 bytes can only be an empty JPEG stream (0xFFD9).
+static bool32 is_empty_tile_in_file(tiff_ifd_t* ifd, i32 tile_index) {
+	return ifd->tile_offsets[tile_index] == 0 || ifd->tile_byte_counts[tile_index] <= 2;
+}
 
-			free(read_buffer);
+// Get the compressed data of several tiles of a local TIFF at once: all the file reads are in flight at the same time,
+// and tiles that are stored (nearly) back to back in the file are read together in one larger sequential read.
+// Tiles found in the tile cache are not read again; for memory-mapped files nothing needs to be read at all.
+// The data is packed into compressed_tile_data; compressed_data[i] is set to NULL for tiles that are empty, could not
+// be read, or did not fit in the buffer. At most IO_READ_BATCH_MAX tiles. Returns the number of bytes of the buffer used.
+u64 read_local_tiles(image_t* image, i32 tiff_level, i32* tile_indices, i32 count, u8* compressed_tile_data,
+                     u64 compressed_data_capacity, u8** compressed_data) {
+	tiff_t* tiff = &image->tiff.tiff;
+	tiff_ifd_t* level_ifd = tiff->level_images + tiff_level;
+	ASSERT(!tiff->is_remote);
+	ASSERT(count <= IO_READ_BATCH_MAX);
+	if (!tiff_load_tile_tables(tiff, level_ifd)) {
+		memset(compressed_data, 0, count * sizeof(u8*));
+		return 0;
+	}
+	u64 read_offsets[IO_READ_BATCH_MAX];
+	u64 read_sizes[IO_READ_BATCH_MAX];
+	i32 read_tiles[IO_READ_BATCH_MAX];
+	i32 read_count = 0;
+	u64 used = 0;
+	for (i32 i = 0; i < count; ++i) {
+		i32 tile_index = tile_indices[i];
+		u64 tile_offset = level_ifd->tile_offsets[tile_index];
+		u64 size = level_ifd->tile_byte_counts[tile_index];
+		compressed_data[i] = NULL;
+		if (tile_offset == 0 || size == 0) {
+			continue;
+		}
+		if (tiff->mapped_data) {
+			compressed_data[i] = tiff_get_mapped_range(tiff, tile_offset, size);
+			continue;
 		}
+		u32 cached_size = 0;
+		if (used + size <= compressed_data_capacity &&
+		    tile_cache_lookup(&global_tile_cache, tile_cache_key(image->image_id, tiff_level, tile_index),
+		                      compressed_tile_data + used, compressed_data_capacity - used, &cached_size) && cached_size == size) {
+			compressed_data[i] = compressed_tile_data + used;
+			used += size;
+		} else {
+			read_offsets[read_count] = tile_offset;
+			read_sizes[read_count] = size;
+			read_tiles[read_count] = i;
+			++read_count;
+		}
+	}
+	if (read_count == 0) {
+		return used;
+	}
 
+	io_range_t ranges[IO_READ_BATCH_MAX];
+	u64 positions[IO_READ_BATCH_MAX];
+	i32 range_indices[IO_READ_BATCH_MAX];
+	i32 range_count = io_coalesce_ranges(read_offsets, read_sizes, read_count, IO_COALESCE_MAX_GAP, IO_COALESCE_MAX_SIZE,
+	                                     ranges, positions, range_indices);
+	// For unbuffered (direct) I/O, the reads are widened to aligned offsets and sizes, into aligned buffer space.
+	u64 alignment = tiff->is_direct_io ? TIFF_DIRECT_IO_ALIGNMENT : 1;
+	io_read_request_t requests[IO_READ_BATCH_MAX];
+	u8* range_data[IO_READ_BATCH_MAX]; // where the requested range starts in the buffer
+	u64 range_base[IO_READ_BATCH_MAX]; // where the range starts in the positions returned by io_coalesce_ranges()
+	i32 request_count = 0;
+	u64 range_position = used;
+	u64 position = 0;
+	for (; request_count < range_count; ++request_count) {
+		io_range_t* range = ranges + request_count;
+		u64 read_offset = ROUND_DOWN_POW2(range->offset, alignment);
+		u64 read_size = ROUND_UP_POW2(range->offset + range->size, alignment) - read_offset;
+		u64 dest_position = ROUND_UP_POW2((u64)(uintptr_t)(compressed_tile_data + range_position), alignment)
+		                    - (u64)(uintptr_t)compressed_tile_data;
+		if (dest_position + read_size > compressed_data_capacity) {
+			break; // out of space, the tiles in the remaining ranges are not read
+		}
+		requests[request_count] = (io_read_request_t){ .file = tiff->win32_file_handle, .offset = read_offset,
+		                                               .size = (u32)read_size, .dest = compressed_tile_data + dest_position };
+		range_data[request_count] = compressed_tile_data + dest_position + (range->offset - read_offset);
+		range_base[request_count] = position;
+		position += range->size;
+		range_position = dest_position + read_size;
+	}
+	io_read_batch(requests, request_count);
+
+	for (i32 j = 0; j < read_count; ++j) {
+		i32 range_index = range_indices[j];
+		if (range_index >= request_count) continue;
+		u8* data = range_data[range_index] + (positions[j] - range_base[range_index]);
+		// Note: aligned reads of the end of the file come back short
+		u8* data_end = (u8*)requests[range_index].dest + requests[range_index].bytes_read;
+		if (data + read_sizes[j] <= data_end) {
+			i32 i = read_tiles[j];
+			compressed_data[i] = data;
+			tile_cache_insert(&global_tile_cache, tile_cache_key(image->image_id, tiff_level, tile_indices[i]), data, read_sizes[j]);
+		}
 	}
+	return range_position;
+}
 
+#ifdef BENCHMARK_TILE_READS
+#define BENCHMARK_TILE_READ_COUNT 4096
+
+// Compare unbuffered reads (tiff_enable_direct_io) against buffered reads, with a cold and a warm OS page cache.
+// Reads the first tiles of the base level in batches, like the tile loader does. Note: the 'cold' results only mean
+// something if the file was not read recently (e.g. right after a reboot, or for a file larger than the page cache).
+void benchmark_tile_reads(tiff_t* tiff, const char* filename) {
+	tiff_ifd_t* level_ifd = tiff->level_images;
+	if (!tiff_load_tile_tables(tiff, level_ifd)) return;
+	i32 tile_count = (i32)ATMOST(level_ifd->tile_count, BENCHMARK_TILE_READ_COUNT);
+	u64 buffer_size = TILE_LOAD_BATCH_MAX * (IO_COALESCE_MAX_SIZE + 2 * TIFF_DIRECT_IO_ALIGNMENT);
+	u8* buffer = platform_alloc(buffer_size); // page aligned
+	const char* run_names[] = {"unbuffered", "buffered, cold", "buffered, warm"};
+	for (i32 run = 0; run < COUNT(run_names); ++run) {
+		bool32 is_direct_io = (run == 0);
+		HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		                          FILE_ATTRIBUTE_NORMAL | (is_direct_io ? FILE_FLAG_NO_BUFFERING : 0) | FILE_FLAG_OVERLAPPED,
+		                          NULL);
+		if (file == INVALID_HANDLE_VALUE) {
+			win32_diagnostic("CreateFileA");
+			break;
+		}
+		u64 alignment = is_direct_io ? TIFF_DIRECT_IO_ALIGNMENT : 1;
+		u64 total_bytes = 0;
+		i32 tiles_read = 0;
+		i64 start = get_clock();
+		for (i32 first_tile = 0; first_tile < tile_count; first_tile += TILE_LOAD_BATCH_MAX) {
+			u64 offsets[TILE_LOAD_BATCH_MAX];
+			u64 sizes[TILE_LOAD_BATCH_MAX];
+			i32 count = 0;
+			for (i32 i = first_tile; i < ATMOST(first_tile + TILE_LOAD_BATCH_MAX, tile_count); ++i) {
+				if (level_ifd->tile_offsets[i] != 0 && level_ifd->tile_byte_counts[i] != 0) {
+					offsets[count] = level_ifd->tile_offsets[i];
+					sizes[count] = level_ifd->tile_byte_counts[i];
+					++count;
+				}
+			}
+			io_range_t ranges[TILE_LOAD_BATCH_MAX];
+			u64 positions[TILE_LOAD_BATCH_MAX];
+			i32 range_indices[TILE_LOAD_BATCH_MAX];
+			i32 range_count = io_coalesce_ranges(offsets, sizes, count, IO_COALESCE_MAX_GAP, IO_COALESCE_MAX_SIZE,
+			                                     ranges, positions, range_indices);
+			io_read_request_t requests[TILE_LOAD_BATCH_MAX];
+			u64 buffer_pos = 0;
+			for (i32 i = 0; i < range_count; ++i) {
+				u64 read_offset = ROUND_DOWN_POW2(ranges[i].offset, alignment);
+				u64 read_size = ROUND_UP_POW2(ranges[i].offset + ranges[i].size, alignment) - read_offset;
+				requests[i] = (io_read_request_t){ .file = file, .offset = read_offset, .size = (u32)read_size,
+				                                   .dest = buffer + buffer_pos };
+				buffer_pos += ROUND_UP_POW2(read_size, TIFF_DIRECT_IO_ALIGNMENT);
+			}
+			io_read_batch(requests, range_count);
+			for (i32 i = 0; i < range_count; ++i) {
+				total_bytes += requests[i].bytes_read;
+			}
+			tiles_read += count;
+		}
+		float seconds = get_seconds_elapsed(start, get_clock());
+		printf("benchmark_tile_reads(): %s: %d tiles, %.1f MB in %.3f s (%.1f MB/s, %.0f tiles/s)\n", run_names[run],
+		       tiles_read, (float)total_bytes / (float)MEGABYTES(1), seconds,
+		       (float)total_bytes / (float)MEGABYTES(1) / seconds, (float)tiles_read / seconds);
+		CloseHandle(file);
+	}
+	VirtualFree(buffer, 0, MEM_RELEASE);
 }
+#endif //BENCHMARK_TILE_READS
+
+// Get the compressed data of a TIFF tile: from the tile cache, the disk cache (remote slides), or else from the server
+// (local files are handled by read_local_tiles()). Returns NULL if this failed.
+u8* get_compressed_tile_data(i32 logical_thread_index, image_t* image, i32 tiff_level, i32 tile_index,
+                             u8* compressed_tile_data, u64 compressed_data_capacity) {
+	tiff_t* tiff = &image->tiff.tiff;
+	tiff_ifd_t* level_ifd = tiff->level_images + tiff_level;
+	i32 level = tiff_level;
+	if (!tiff_load_tile_tables(tiff, level_ifd)) {
+		return NULL;
+	}
+	u64 tile_offset = level_ifd->tile_offsets[tile_index];
+	u64 compressed_tile_size_in_bytes = level_ifd->tile_byte_counts[tile_index];
+	i32 tile_x = tile_index % level_ifd->width_in_tiles;
+	i32 tile_y = tile_index / level_ifd->width_in_tiles;
+	if (tile_offset == 0 || compressed_tile_size_in_bytes == 0) {
+		return NULL; // empty tile
+	}
+	if (!tiff->is_remote) {
+		u8* compressed_data = NULL;
+		read_local_tiles(image, tiff_level, &tile_index, 1, compressed_tile_data, compressed_data_capacity, &compressed_data);
+		return compressed_data;
+	}
 
-void load_tile_func(i32 logical_thread_index, void* userdata) {
-	load_tile_task_t* task_data = (load_tile_task_t*) userdata;
+	// The compressed tile data might still be around from an earlier visit (if the tile was evicted from the GPU)
+	u8* compressed_data = NULL;
+	u64 cache_key = tile_cache_key(image->image_id, level, tile_index);
+	u32 cached_size = 0;
+	bool32 is_cache_hit = false;
+	if (tile_cache_lookup(&global_tile_cache, cache_key, compressed_tile_data, compressed_data_capacity, &cached_size)) {
+		if (cached_size == compressed_tile_size_in_bytes) {
+			compressed_data = compressed_tile_data;
+			is_cache_hit = true;
+		}
+	}
+
+	u64 shared_cache_key = shared_tile_cache_key(image->shared_cache_slide_id, level, tile_index);
+	if (is_cache_hit) {
+		// no I/O needed
+	} else if (shared_tile_cache_lookup(&global_shared_tile_cache, shared_cache_key, compressed_tile_data,
+	                                    compressed_data_capacity, &cached_size)
+	           && cached_size == compressed_tile_size_in_bytes) {
+		// another instance downloaded it already
+		compressed_data = compressed_tile_data;
+	} else if (disk_cache_read_tile(image->disk_cache, disk_cache_key(level, tile_index), compressed_tile_data,
+	                                compressed_data_capacity, &cached_size)
+	           && cached_size == compressed_tile_size_in_bytes) {
+		compressed_data = compressed_tile_data;
+		shared_tile_cache_insert(&global_shared_tile_cache, shared_cache_key, compressed_data, cached_size);
+	} else {
+		log_debug("[thread %d] remote tile requested: level %d, tile %d (%d, %d)\n", logical_thread_index, level, tile_index, tile_x, tile_y);
+
+
+		// The tile is received directly into the thread's compressed tile buffer.
+		if (download_remote_chunk(&tiff->location, tile_offset, compressed_tile_size_in_bytes, compressed_tile_data,
+		                          compressed_data_capacity, logical_thread_index)) {
+			compressed_data = compressed_tile_data;
+			disk_cache_write_tile(image->disk_cache, disk_cache_key(level, tile_index), compressed_data, compressed_tile_size_in_bytes);
+			shared_tile_cache_insert(&global_shared_tile_cache, shared_cache_key, compressed_data, compressed_tile_size_in_bytes);
+		}
+	}
+
+	if (compressed_data && !is_cache_hit) {
+		tile_cache_insert(&global_tile_cache, cache_key, compressed_data, compressed_tile_size_in_bytes);
+	}
+	return compressed_data;
+}
+
+// Build a tile of a level that is missing from the file, out of the tiles of a finer level.
+// Each source tile is decoded at reduced resolution (using DCT scaling, or the resolution levels of a JPEG 2000
+// codestream), directly into its place in the tile.
+void synthesize_tile(i32 logical_thread_index, image_t* image, load_tile_task_t* task, u8* dest,
+                     u8* compressed_tile_data, u64 compressed_data_capacity) {
+	level_image_t* levels = get_focal_plane_levels(image, task->focal_plane);
+	level_image_t* level_image = levels + task->level;
+	level_image_t* source = levels + level_image->source_level;
+	tiff_t* tiff = &image->tiff.tiff;
+	tiff_ifd_t* source_ifd = tiff->level_images + source->tiff_level;
+	i32 shift = level_image->source_scale_shift;
+	ASSERT(shift >= 1 && shift <= 3);
+	i32 sub_tile_width = source_ifd->tile_width >> shift;
+	i32 sub_tile_height = source_ifd->tile_height >> shift;
+
+	// Gather the source tiles (at most 8x8)
+	i32 source_tile_indices[64];
+	i32 sub_tile_offsets[64];
+	i32 source_tile_count = 0;
+	for (i32 sub_y = 0; sub_y < (1 << shift); ++sub_y) {
+		i32 source_tile_y = (task->tile_y << shift) + sub_y;
+		if (source_tile_y >= source->height_in_tiles) break;
+		for (i32 sub_x = 0; sub_x < (1 << shift); ++sub_x) {
+			i32 source_tile_x = (task->tile_x << shift) + sub_x;
+			if (source_tile_x >= source->width_in_tiles) break;
+			if (is_tile_empty(source, source_tile_x, source_tile_y)) {
+				continue;
+			}
+			i32 source_tile_index = source_tile_y * source->width_in_tiles + source_tile_x;
+			source_tile_indices[source_tile_count] = source_tile_index;
+			sub_tile_offsets[source_tile_count] = (sub_y * sub_tile_height) * TILE_PITCH + (sub_x * sub_tile_width) * BYTES_PER_PIXEL;
+			++source_tile_count;
+		}
+	}
+
+	// For local files, read all the source tiles in one go
+	u8* local_data[64];
+	if (!tiff->is_remote) {
+		read_local_tiles(image, source->tiff_level, source_tile_indices, source_tile_count, compressed_tile_data,
+		                 compressed_data_capacity, local_data);
+	}
+
+	memset(dest, 0xFF, WSI_BLOCK_SIZE);
+	for (i32 i = 0; i < source_tile_count; ++i) {
+		i32 source_tile_index = source_tile_indices[i];
+		u8* compressed_data = NULL;
+		if (tiff->is_remote) {
+			compressed_data = get_compressed_tile_data(logical_thread_index, image, source->tiff_level, source_tile_index,
+			                                           compressed_tile_data, compressed_data_capacity);
+		} else {
+			compressed_data = local_data[i];
+		}
+		if (compressed_data) {
+			u64 size = source_ifd->tile_byte_counts[source_tile_index];
+			decode_compressed_tile_scaled(logical_thread_index, source_ifd, compressed_data, size, dest + sub_tile_offsets[i],
+			                              TILE_PITCH, 1 << shift);
+		}
+	}
+	if (level_image->tile_width < TILE_DIM || level_image->tile_height < TILE_DIM) {
+		pad_tile_edges(dest, level_image->tile_width, level_image->tile_height);
+	}
+}
+
+// A remote batch lives on until the download is over and all the tiles that came in are decoded. The download holds
+// one reference, and so does each tile that is waiting to be decoded.
+typedef struct {
+	image_t* image;
+	load_tile_task_batch_t batch;
+	volatile i32 refcount;
+	i32 download_count;
+	i32 download_task_indices[TILE_LOAD_BATCH_MAX];
+	u64 chunk_sizes[TILE_LOAD_BATCH_MAX];
+	u64 positions[TILE_LOAD_BATCH_MAX];
+	i32 range_indices[TILE_LOAD_BATCH_MAX];
+	u64 range_positions[TILE_LOAD_BATCH_MAX]; // where each range starts in the content of the batch download
+	bool32 is_delivered[TILE_LOAD_BATCH_MAX]; // indexed like batch.tile_tasks
+	i32 tile_quality; // the JPEG quality the server may reduce the tiles to, or 0
+	i64 start_clock;
+	float download_seconds;
+} remote_tile_batch_t;
+
+typedef struct {
+	remote_tile_batch_t* remote_batch;
+	i32 download_index;
+	u64 size;
+	bool32 is_reduced_quality; // re-encoded by the server: not cached, and loaded again later
+	u8 data[0]; // the compressed tile
+} downloaded_tile_t;
+
+static void release_remote_tile_batch(remote_tile_batch_t* remote_batch) {
+	if (interlocked_decrement(&remote_batch->refcount) > 0) return;
+	// Every tile in the batch had to wait for the whole download.
+	i32 batch_size = remote_batch->batch.task_count;
+	report_tile_load_stats(batch_size, remote_batch->download_seconds * batch_size,
+	                       get_seconds_elapsed(remote_batch->start_clock, get_clock()) * batch_size);
+	interlocked_decrement(&remote_batch->image->remote_downloads_in_flight);
+	free(remote_batch);
+}
+
+// Work queue entry: decodes a tile that was handed over by the network thread.
+static void decode_downloaded_tile_func(i32 logical_thread_index, void* userdata) {
+	downloaded_tile_t* downloaded_tile = (downloaded_tile_t*) userdata;
+	remote_tile_batch_t* remote_batch = downloaded_tile->remote_batch;
+	image_t* image = remote_batch->image;
+	tiff_t* tiff = &image->tiff.tiff;
+	i32 download_index = downloaded_tile->download_index;
+	u8* data = downloaded_tile->data;
+	u64 chunk_size = downloaded_tile->size;
+	i32 task_index = remote_batch->download_task_indices[download_index];
+	load_tile_task_t* task = remote_batch->batch.tile_tasks + task_index;
+	level_image_t* level_image = get_focal_plane_levels(image, task->focal_plane) + task->level;
+	i32 tile_index = task->tile_y * level_image->width_in_tiles + task->tile_x;
+	tiff_ifd_t* level_ifd = tiff->level_images + level_image->tiff_level;
+
+	if (!downloaded_tile->is_reduced_quality) {
+		tile_cache_insert(&global_tile_cache, tile_cache_key(image->image_id, level_image->tiff_level, tile_index),
+		                  data, chunk_size);
+		disk_cache_write_tile(image->disk_cache, disk_cache_key(level_image->tiff_level, tile_index), data, chunk_size);
+		shared_tile_cache_insert(&global_shared_tile_cache,
+		                         shared_tile_cache_key(image->shared_cache_slide_id, level_image->tiff_level, tile_index),
+		                         data, chunk_size);
+	}
+
+	u8* tile_buffer = acquire_tile_buffer();
+	i32 layout = DECODED_TILE_BGRA;
+	if (decode_compressed_tile(logical_thread_index, level_ifd, task, data, chunk_size, tile_buffer, &layout)) {
+		submit_decoded_tile_at_quality(image, level_image, task->tile, task->resolution_shift, tile_buffer, layout,
+		                               downloaded_tile->is_reduced_quality);
+	} else {
+		discard_empty_tile(image, level_image, task->tile, task->tile_x, task->tile_y, tile_buffer);
+	}
+
+	free(downloaded_tile);
+	release_remote_tile_batch(remote_batch);
+}
+
+// Called on the network thread: the decoding is left to the workers, so that the network thread can keep receiving.
+static void hand_over_downloaded_tile(remote_tile_batch_t* remote_batch, i32 download_index, u8* data, u64 chunk_size) {
+	downloaded_tile_t* downloaded_tile = (downloaded_tile_t*) malloc(sizeof(downloaded_tile_t) + chunk_size);
+	downloaded_tile->remote_batch = remote_batch;
+	downloaded_tile->download_index = download_index;
+	downloaded_tile->size = chunk_size;
+	downloaded_tile->is_reduced_quality = (chunk_size != remote_batch->chunk_sizes[download_index]);
+	memcpy(downloaded_tile->data, data, chunk_size);
+	load_tile_task_t* task = remote_batch->batch.tile_tasks + remote_batch->download_task_indices[download_index];
+	tile_metrics_record(TILE_STAGE_IO, task->start_clock, get_clock());
+	remote_batch->is_delivered[remote_batch->download_task_indices[download_index]] = true;
+	interlocked_increment(&remote_batch->refcount);
+	// Note: if the work queue is full, the network thread decodes the tile itself.
+	add_work_queue_entry(&work_queue, decode_downloaded_tile_func, downloaded_tile);
+}
+
+// Called by the network thread for each downloaded range, as soon as it has arrived (see submit_remote_batch_download()).
+static void decode_received_tile_range(void* userdata, i32 range_index, u8* data, i64 size) {
+	remote_tile_batch_t* remote_batch = (remote_tile_batch_t*) userdata;
+	for (i32 i = 0; i < remote_batch->download_count; ++i) {
+		if (remote_batch->range_indices[i] != range_index) continue;
+		u8* current_chunk = data + (remote_batch->positions[i] - remote_batch->range_positions[range_index]);
+		hand_over_downloaded_tile(remote_batch, i, current_chunk, remote_batch->chunk_sizes[i]);
+	}
+}
+
+// Called by the network thread for each downloaded tile, as soon as it has arrived (see submit_remote_tile_download()).
+static void decode_received_tile(void* userdata, i32 download_index, u8* data, i64 size) {
+	remote_tile_batch_t* remote_batch = (remote_tile_batch_t*) userdata;
+	// If the size doesn't match the tile tables we have, something is off; the tile will be requested again.
+	// Only tiles that the server re-encoded at the quality that was asked for come in smaller.
+	u64 chunk_size = remote_batch->chunk_sizes[download_index];
+	bool32 is_reduced_quality = (remote_batch->tile_quality > 0 && size > 2 && (u64)size < chunk_size);
+	if ((u64)size == chunk_size || is_reduced_quality) {
+		hand_over_downloaded_tile(remote_batch, download_index, data, (u64)size);
+	}
+}
+
+// Called by the network thread when the download of a batch is over.
+static void finish_remote_tile_batch(void* userdata, i32 chunks_delivered) {
+	remote_tile_batch_t* remote_batch = (remote_tile_batch_t*) userdata;
+	image_t* image = remote_batch->image;
+	tiff_t* tiff = &image->tiff.tiff;
+	if (tiff->location.slide_handle != 0 && chunks_delivered == 0) {
+		// Perhaps the server was restarted and doesn't know the handle anymore.
+		// From now on, ask for byte ranges instead.
+		tiff->location.slide_handle = 0;
+	}
+	// Tiles that could not be downloaded may be requested again.
+	for (i32 i = 0; i < remote_batch->download_count; ++i) {
+		i32 task_index = remote_batch->download_task_indices[i];
+		if (!remote_batch->is_delivered[task_index]) {
+			load_tile_task_t* task = remote_batch->batch.tile_tasks + task_index;
+			submit_failed_tile(image, get_focal_plane_levels(image, task->focal_plane) + task->level, task->tile);
+		}
+	}
+	remote_batch->download_seconds = get_seconds_elapsed(remote_batch->start_clock, get_clock());
+	interlocked_decrement(&tile_request_queue.loads_in_progress); // the next batch may start downloading
+	platform_wake_main_thread(); // (to hand out the next requests)
+	release_remote_tile_batch(remote_batch);
+}
+
+// Remote slides: decodes the tiles that are still present in the tile cache (or the disk cache) right away, and
+// submits a download for the rest. Returns true if a download was submitted: the batch is then finished on the network
+// thread (see finish_remote_tile_batch()), and counts as a load in progress until then.
+bool32 tiff_load_tile_batch_func(i32 logical_thread_index, load_tile_task_batch_t* batch) {
+	i64 start = get_clock();
+	image_t* image = batch->tile_tasks[0].image;
+	tiff_t* tiff = &image->tiff.tiff;
+	ASSERT(image->type == IMAGE_TYPE_TIFF && tiff->is_remote);
+
+	// The compressed data goes into the scratch memory of the thread; the pixels into tile buffers from the pool.
+	thread_memory_t* thread_memory = (thread_memory_t*) thread_local_storage[logical_thread_index];
+	u8* compressed_tile_data = (u8*) thread_memory->aligned_rest_of_thread_memory;
+	u64 compressed_data_capacity = thread_memory->thread_memory_usable_size;
+
+	remote_tile_batch_t* remote_batch = (remote_tile_batch_t*) calloc(1, sizeof(remote_tile_batch_t));
+	remote_batch->image = image;
+	remote_batch->batch = *batch;
+	remote_batch->start_clock = start;
+	remote_batch->refcount = 1;
+	batch = &remote_batch->batch;
+
+	u64 chunk_offsets[TILE_LOAD_BATCH_MAX];
+	i32 download_count = 0;
+	for (i32 i = 0; i < batch->task_count; ++i) {
+		load_tile_task_t* task = batch->tile_tasks + i;
+
+		level_image_t* level_image = get_focal_plane_levels(image, task->focal_plane) + task->level;
+		if (level_image->tiff_level < 0) {
+			// Level is not present in the file, build the tile from the tiles of a finer level
+			u8* tile_buffer = acquire_tile_buffer();
+			synthesize_tile(logical_thread_index, image, task, tile_buffer, compressed_tile_data, compressed_data_capacity);
+			submit_decoded_tile(image, level_image, task->tile, 0, tile_buffer, DECODED_TILE_BGRA);
+			continue;
+		}
+
+		i32 level = level_image->tiff_level;
+		i32 tile_index = task->tile_y * level_image->width_in_tiles + task->tile_x;
+		tiff_ifd_t* level_ifd = tiff->level_images + level;
+		if (!tiff_load_tile_tables(tiff, level_ifd)) {
+			// (for slides read with Range requests, the tables are downloaded when first needed)
+			submit_failed_tile(image, level_image, task->tile);
+			continue;
+		}
+		u64 tile_offset = level_ifd->tile_offsets[tile_index];
+		u64 chunk_size = level_ifd->tile_byte_counts[tile_index];
+
+		// Empty tiles are not requested once the tile tables are known, but they may have been requested before that.
+		if (is_empty_tile_in_file(level_ifd, tile_index)) {
+			submit_empty_tile(image, level_image, task->tile, task->tile_x, task->tile_y);
+			continue;
+		}
+
+		u32 cached_size = 0;
+		u64 cache_key = tile_cache_key(image->image_id, level, tile_index);
+		u64 shared_cache_key = shared_tile_cache_key(image->shared_cache_slide_id, level, tile_index);
+		bool32 is_cached = tile_cache_lookup(&global_tile_cache, cache_key, compressed_tile_data, compressed_data_capacity,
+		                                     &cached_size) && cached_size == chunk_size;
+		if (!is_cached && shared_tile_cache_lookup(&global_shared_tile_cache, shared_cache_key, compressed_tile_data,
+		                                           compressed_data_capacity, &cached_size) && cached_size == chunk_size) {
+			tile_cache_insert(&global_tile_cache, cache_key, compressed_tile_data, chunk_size);
+			is_cached = true;
+		}
+		if (!is_cached && disk_cache_read_tile(image->disk_cache, disk_cache_key(level, tile_index), compressed_tile_data,
+		                                       compressed_data_capacity, &cached_size) && cached_size == chunk_size) {
+			tile_cache_insert(&global_tile_cache, cache_key, compressed_tile_data, chunk_size);
+			shared_tile_cache_insert(&global_shared_tile_cache, shared_cache_key, compressed_tile_data, chunk_size);
+			is_cached = true;
+		}
+		if (is_cached) {
+			u8* tile_buffer = acquire_tile_buffer();
+			i32 layout = DECODED_TILE_BGRA;
+			if (decode_compressed_tile(logical_thread_index, level_ifd, task, compressed_tile_data, chunk_size, tile_buffer,
+			                           &layout)) {
+				submit_decoded_tile(image, level_image, task->tile, task->resolution_shift, tile_buffer, layout);
+			} else {
+				discard_empty_tile(image, level_image, task->tile, task->tile_x, task->tile_y, tile_buffer);
+			}
+		} else {
+			remote_batch->download_task_indices[download_count] = i;
+			chunk_offsets[download_count] = tile_offset;
+			remote_batch->chunk_sizes[download_count] = chunk_size;
+			++download_count;
+		}
+	}
+	remote_batch->download_count = download_count;
+
+	if (download_count == 0) {
+		report_tile_load_stats(batch->task_count, 0.0f, get_seconds_elapsed(start, get_clock()) * batch->task_count);
+		free(remote_batch);
+		return false;
+	}
+
+	// Tiles are decoded and uploaded as soon as they have arrived, while the rest is still on the way.
+	interlocked_increment(&image->remote_downloads_in_flight);
+	if (tiff->location.slide_handle != 0) {
+		// Ask for the tiles by index; the server knows where they are in the file.
+		u32 levels[TILE_LOAD_BATCH_MAX];
+		u32 tile_indices[TILE_LOAD_BATCH_MAX];
+		i32 priorities[TILE_LOAD_BATCH_MAX];
+		// Reduced quality is only asked for if it is fine for all the tiles (not for tiles being loaded again).
+		i32 tile_quality = batch->tile_tasks[remote_batch->download_task_indices[0]].remote_tile_quality;
+		for (i32 i = 0; i < download_count; ++i) {
+			load_tile_task_t* task = batch->tile_tasks + remote_batch->download_task_indices[i];
+			level_image_t* level_image = get_focal_plane_levels(image, task->focal_plane) + task->level;
+			levels[i] = (u32)level_image->tiff_level;
+			tile_indices[i] = (u32)(task->tile_y * level_image->width_in_tiles + task->tile_x);
+			priorities[i] = task->priority;
+			if (task->remote_tile_quality == 0) {
+				tile_quality = 0;
+			} else if (tile_quality > 0) {
+				tile_quality = MAX(tile_quality, task->remote_tile_quality);
+			}
+		}
+		remote_batch->tile_quality = tile_quality;
+		submit_remote_tile_download(&tiff->location, levels, tile_indices, priorities, download_count, tile_quality,
+		                            decode_received_tile, finish_remote_tile_batch, remote_batch, image);
+	} else {
+		// Ask for tiles that are stored (nearly) next to each other in the file as one chunk.
+		io_range_t ranges[TILE_LOAD_BATCH_MAX];
+		i32 range_count = io_coalesce_ranges(chunk_offsets, remote_batch->chunk_sizes, download_count, IO_COALESCE_MAX_GAP,
+		                                     IO_COALESCE_MAX_SIZE, ranges, remote_batch->positions, remote_batch->range_indices);
+		i64 range_offsets[TILE_LOAD_BATCH_MAX];
+		i64 range_sizes[TILE_LOAD_BATCH_MAX];
+		u64 total_read_size = 0;
+		for (i32 i = 0; i < range_count; ++i) {
+			range_offsets[i] = (i64)ranges[i].offset;
+			range_sizes[i] = (i64)ranges[i].size;
+			remote_batch->range_positions[i] = total_read_size;
+			total_read_size += ranges[i].size;
+		}
+		submit_remote_batch_download(&tiff->location, range_offsets, range_sizes, range_count, REMOTE_RANGES_PER_REQUEST,
+		                             decode_received_tile_range, finish_remote_tile_batch, remote_batch, image);
+	}
+	return true;
+}
+
+// Gets the OpenSlide handle reserved for the calling thread, opening it if this is the thread's first read.
+// Only the owning thread touches its slot; the handles are closed in unload_wsi(), once the loads are done.
+openslide_t* get_wsi_handle_for_thread(wsi_t* wsi, i32 logical_thread_index) {
+	ASSERT(logical_thread_index >= 0 && logical_thread_index < MAX_THREAD_COUNT);
+	openslide_t* osr = wsi->thread_osr[logical_thread_index];
+	if (!osr) {
+		osr = openslide.openslide_open(wsi->filename);
+		if (!osr) {
+			return wsi->osr; // fall back to the shared handle
+		}
+		wsi->thread_osr[logical_thread_index] = osr;
+	}
+	return osr;
+}
+
+// If the caller already read the compressed tile data (see load_local_tile_batch()), it is passed in preloaded_data.
+// For OpenSlide images, preloaded_data instead holds the pixels of the tile (see load_wsi_tile_batch()).
+void load_tile(i32 logical_thread_index, load_tile_task_t* task_data, u8* preloaded_data) {
+	image_t* image = task_data->image;
+	if (!is_image_handle_alive(image->image_id)) {
+		return; // unloaded while the tile was waiting (nothing to hand back: the tile is gone with the image)
+	}
+	i64 start = get_clock();
+	float io_seconds = 0.0f;
 	i32 level = task_data->level;
 	i32 tile_x = task_data->tile_x;
 	i32 tile_y = task_data->tile_y;
-	image_t* image = task_data->image;
-	level_image_t* level_image = image->level_images + level;
+	level_image_t* level_image = get_focal_plane_levels(image, task_data->focal_plane) + level;
 	tile_t* tile = get_tile(level_image, tile_x, tile_y);
 	i32 tile_index = tile_y * level_image->width_in_tiles + tile_x;
-	float tile_world_pos_x_end = (tile_x + 1) * level_image->x_tile_side_in_um;
-	float tile_world_pos_y_end = (tile_y + 1) * level_image->y_tile_side_in_um;
-	float tile_x_excess = tile_world_pos_x_end - image->width_in_um;
-	float tile_y_excess = tile_world_pos_y_end - image->height_in_um;
 
-	// Note: when the thread started up we allocated a large blob of memory for the thread to use privately
-	// TODO: better/more explicit allocator (instead of some setting some hard-coded pointers)
+	// The tile is decoded straight into a buffer from the tile buffer pool, which is then handed on for uploading.
+	// The compressed data goes into the scratch memory of the thread.
 	thread_memory_t* thread_memory = (thread_memory_t*) thread_local_storage[logical_thread_index];
-	u8* temp_memory = (u8*) thread_memory->aligned_rest_of_thread_memory; //malloc(WSI_BLOCK_SIZE);
-	memset(temp_memory, 0xFF, WSI_BLOCK_SIZE);
-	u8* compressed_tile_data = (u8*) thread_memory->aligned_rest_of_thread_memory + WSI_BLOCK_SIZE;
+	u8* tile_buffer = acquire_tile_buffer();
+	bool32 has_pixels = false; // if not, the tile is made white
+	bool32 is_empty = false; // nothing to draw, see discard_empty_tile()
+	i32 layout = DECODED_TILE_BGRA; // see decode_compressed_tile()
+	u8* compressed_tile_data = (u8*) thread_memory->aligned_rest_of_thread_memory;
+	i32 resolution_shift = 0; // only tiles decoded from the file itself can be decoded at reduced size
+
+
+	if (level_image->is_generated) {
+		// Cut out of the level in memory (see generated_levels.c)
+		if (!copy_generated_tile(level_image, tile_x, tile_y, tile_buffer)) {
+			// (not requested before the level is ready, so this should not happen)
+			release_tile_buffer(tile_buffer);
+			submit_failed_tile(image, level_image, tile);
+			return;
+		}
+		has_pixels = true;
+	} else if (image->type == IMAGE_TYPE_TIFF) {
+		tiff_t* tiff = &image->tiff.tiff;
+		u64 compressed_data_capacity = thread_memory->thread_memory_usable_size;
 
+		if (level_image->tiff_level < 0) {
+			// Level is not present in the file, build the tile from the tiles of a finer level
+			tile->debug_stage = TILE_DEBUG_STAGE_DECODING;
+			synthesize_tile(logical_thread_index, image, task_data, tile_buffer, compressed_tile_data, compressed_data_capacity);
+			has_pixels = true;
+		} else {
+			tiff_ifd_t* level_ifd = tiff->level_images + level_image->tiff_level;
+			if (!tiff_load_tile_tables(tiff, level_ifd)) {
+				goto finish_up;
+			}
 
-	if (image->type == IMAGE_TYPE_TIFF) {
-		tiff_t* tiff = &image->tiff.tiff;
-		tiff_ifd_t* level_ifd = tiff->level_images + level;
+			u64 tile_offset = level_ifd->tile_offsets[tile_index];
+			u64 compressed_tile_size_in_bytes = level_ifd->tile_byte_counts[tile_index];
+			// Some tiles apparently contain no data (not even an empty/dummy JPEG stream like some other tiles have).
+			if (is_empty_tile_in_file(level_ifd, tile_index)) {
+				tile_metrics_count(TILE_COUNTER_EMPTY, 1);
+				is_empty = true;
+				goto finish_up;
+			}
+			u8* compressed_data = preloaded_data;
+			if (!compressed_data) {
+				i64 io_start = get_clock();
+				compressed_data = get_compressed_tile_data(logical_thread_index, image, level_image->tiff_level, tile_index,
+				                                           compressed_tile_data, compressed_data_capacity);
+				i64 io_end = get_clock();
+				io_seconds = get_seconds_elapsed(io_start, io_end);
+				tile_metrics_record(TILE_STAGE_IO, task_data->start_clock, io_end);
+			}
+			if (compressed_data) {
+				tile->debug_stage = TILE_DEBUG_STAGE_DECODING;
+				has_pixels = decode_compressed_tile(logical_thread_index, level_ifd, task_data, compressed_data,
+				                                    compressed_tile_size_in_bytes, tile_buffer, &layout);
+				is_empty = !has_pixels;
+				resolution_shift = task_data->resolution_shift;
+			}
+		}
+		// Note: the part of a tile at the edge of the image that lies outside of it is left as it is: it is clipped
+		// when drawing (see get_tile_valid_fill()).
 
-		u64 tile_offset = level_ifd->tile_offsets[tile_index];
-		u64 compressed_tile_size_in_bytes = level_ifd->tile_byte_counts[tile_index];
-		// Some tiles apparently contain no data (not even an empty/dummy JPEG stream like some other tiles have).
-		// We need to check for this situation and chicken out if this is the case.
-		if (tile_offset == 0 || compressed_tile_size_in_bytes == 0) {
-			printf("thread %d: tile level %d, tile %d (%d, %d) appears to be empty\n", logical_thread_index, level, tile_index, tile_x, tile_y);
-			// TODO: Make one single 'empty' tile texture and simply reuse that
-//		    memset(temp_memory, 0xFF, WSI_BLOCK_SIZE);
-			goto finish_up;
+	} else if (image->type == IMAGE_TYPE_WSI) {
+		wsi_t* wsi = &image->wsi.wsi;
+		i64 x = (tile_x * TILE_DIM) << level;
+		i64 y = (tile_y * TILE_DIM) << level;
+		if (preloaded_data) {
+			// Already read as part of a larger region (see load_wsi_tile_batch())
+			memcpy(tile_buffer, preloaded_data, WSI_BLOCK_SIZE);
+		} else {
+			// (OpenSlide reads and decodes in one go, so this counts as decoding)
+			tile->debug_stage = TILE_DEBUG_STAGE_DECODING;
+			i64 decode_start = get_clock();
+			openslide_t* osr = get_wsi_handle_for_thread(wsi, logical_thread_index);
+			openslide.openslide_read_region(osr, (u32*)tile_buffer, x, y, level, TILE_DIM, TILE_DIM);
+			tile_metrics_record(TILE_STAGE_DECODE, decode_start, get_clock());
 		}
-		u8* jpeg_tables = level_ifd->jpeg_tables;
-		u64 jpeg_tables_length = level_ifd->jpeg_tables_length;
+		has_pixels = true;
+	} else {
+		log_error("thread %d: tile level %d, tile %d (%d, %d): unsupported image type\n", logical_thread_index, level, tile_index, tile_x, tile_y);
 
-		// TODO: make async I/O code platform agnostic
+	}
 
-		if (tiff->is_remote) {
-			printf("[thread %d] remote tile requested: level %d, tile %d (%d, %d)\n", logical_thread_index, level, tile_index, tile_x, tile_y);
 
+//	printf("[thread %d] Loaded tile: level=%d tile_x=%d tile_y=%d\n", logical_thread_index, level, tile_x, tile_y);
 
-			i32 bytes_read = 0;
-			u8* read_buffer = download_remote_chunk(tiff->location.hostname, tiff->location.portno, tiff->location.filename,
-			                                        tile_offset, compressed_tile_size_in_bytes, &bytes_read, logical_thread_index);
-			if (read_buffer && bytes_read > 0) {
-				i64 content_offset = find_end_of_http_headers(read_buffer, bytes_read);
-				i64 content_length = bytes_read - content_offset;
-				u8* content = read_buffer + content_offset;
+	finish_up:;
+	if (is_empty) {
+		discard_empty_tile(image, level_image, tile, tile_x, tile_y, tile_buffer);
+	} else {
+		if (!has_pixels) {
+			memset(tile_buffer, 0xFF, WSI_BLOCK_SIZE);
+			layout = DECODED_TILE_BGRA;
+		}
+		submit_decoded_tile(image, level_image, tile, resolution_shift, tile_buffer, layout);
+	}
+	report_tile_load_stats(1, io_seconds, get_seconds_elapsed(start, get_clock()));
 
-				// TODO: better way to check the real content length?
-				if (content_length >= compressed_tile_size_in_bytes) {
-					if (content[0] == 0xFF && content[1] == 0xD9) {
-						// JPEG stream is empty
-					} else {
-						if (decode_tile(jpeg_tables, jpeg_tables_length, content, compressed_tile_size_in_bytes,
-						                temp_memory, (level_ifd->color_space == TIFF_PHOTOMETRIC_YCBCR))) {
-//		                    printf("thread %d: successfully decoded level %d, tile %d (%d, %d)\n", logical_thread_index, level, tile_index, tile_x, tile_y);
-						} else {
-							printf("[thread %d] failed to decode level %d, tile %d (%d, %d)\n", logical_thread_index, level, tile_index, tile_x, tile_y);
-						}
-					}
+}
 
-				}
+void load_tile_func(i32 logical_thread_index, void* userdata) {
+	load_tile_task_t* task_data = (load_tile_task_t*) userdata;
+	load_tile(logical_thread_index, task_data, NULL);
+	free(task_data);
+}
+
+bool32 enqueue_load_tile(image_t* image, i32 level, i32 tile_x, i32 tile_y) {
+	load_tile_task_t* task_data = (load_tile_task_t*) malloc(sizeof(load_tile_task_t)); // should be freed after uploading the tile to the gpu
+	*task_data = (load_tile_task_t){ .image = image, .tile = NULL, .level = level, .tile_x = tile_x, .tile_y = tile_y };
+
+	return add_work_queue_entry(&work_queue, load_tile_func, task_data);
+
+}
+
+// Called from the main thread.
+void submit_tile_request(load_tile_task_t* task) {
+	tile_request_queue_t* queue = &tile_request_queue;
+	task->request_clock = get_clock();
+	task->tile->request_clock = task->request_clock;
+	spin_lock(&queue->lock);
+	sb_push(queue->requests, *task);
+	queue->request_count = sb_count(queue->requests);
+	task->tile->state = TILE_STATE_QUEUED;
+	spin_unlock(&queue->lock);
+	tile_metrics_count(TILE_COUNTER_REQUESTED, 1);
+}
 
+// Called from the main thread, after the tiles in view have been updated for this frame.
+// Requests for tiles that are no longer in view are dropped (if no worker has started on them yet).
+i32 cancel_stale_tile_requests(i64 frame_counter) {
+	tile_request_queue_t* queue = &tile_request_queue;
+	i32 cancelled_count = 0;
+	spin_lock(&queue->lock);
+	i32 new_request_count = 0;
+	for (i32 i = 0; i < queue->request_count; ++i) {
+		tile_t* tile = queue->requests[i].tile;
+		if (tile->time_last_wanted < frame_counter) {
+			tile->state = TILE_STATE_UNLOADED; // allow the tile to be requested again
+			tile->debug_stage = TILE_DEBUG_STAGE_NONE;
+			++cancelled_count;
+		} else {
+			queue->requests[new_request_count++] = queue->requests[i];
+		}
+	}
+	if (queue->requests) {
+		sb_raw_count(queue->requests) = new_request_count;
+	}
+	queue->request_count = new_request_count;
+	spin_unlock(&queue->lock);
+	tile_metrics_count(TILE_COUNTER_CANCELLED, cancelled_count);
+	return cancelled_count;
+}
+
+// Needs to be called before the tiles of an image are destroyed.
+void cancel_tile_requests_for_image(image_t* image) {
+	tile_request_queue_t* queue = &tile_request_queue;
+	spin_lock(&queue->lock);
+	i32 new_request_count = 0;
+	for (i32 i = 0; i < queue->request_count; ++i) {
+		if (queue->requests[i].image != image) {
+			queue->requests[new_request_count++] = queue->requests[i];
+		}
+	}
+	if (queue->requests) {
+		sb_raw_count(queue->requests) = new_request_count;
+	}
+	queue->request_count = new_request_count;
+	spin_unlock(&queue->lock);
+}
+
+// Takes the most urgent request off the queue, followed by the next most urgent requests for the same image
+// (up to max_count, so that remote tiles can be downloaded together).
+static i32 take_tile_requests(load_tile_task_t* tasks, i32 max_count) {
+	tile_request_queue_t* queue = &tile_request_queue;
+	i32 count = 0;
+	i64 start_clock = get_clock();
+	spin_lock(&queue->lock);
+	while (count < max_count) {
+		i32 best_index = -1;
+		i32 best_priority = 0;
+		for (i32 i = 0; i < queue->request_count; ++i) {
+			load_tile_task_t* request = queue->requests + i;
+			if (count > 0 && request->image != tasks[0].image) continue;
+			if (best_index < 0 || request->tile->priority > best_priority) {
+				best_index = i;
+				best_priority = request->tile->priority;
+			}
+		}
+		if (best_index < 0) break;
+		if (count == 0) {
+			// (under the lock, so that the image can't be seen as idle in between, see cancel_tile_requests_for_image())
+			interlocked_increment(&queue->requests[best_index].image->tile_loads_in_flight);
+		}
+		tasks[count] = queue->requests[best_index];
+		tasks[count].priority = best_priority;
+		tasks[count].tile->state = TILE_STATE_LOADING;
+		tasks[count].tile->debug_stage = TILE_DEBUG_STAGE_IO;
+		tasks[count].start_clock = start_clock;
+		++count;
+		queue->requests[best_index] = queue->requests[--queue->request_count];
+		sb_raw_count(queue->requests) = queue->request_count;
+	}
+	spin_unlock(&queue->lock);
+	for (i32 i = 0; i < count; ++i) {
+		tile_metrics_record(TILE_STAGE_QUEUE_WAIT, tasks[i].request_clock, start_clock);
+	}
+	return count;
+}
+
+// OpenSlide images: tiles that are above each other in the same column are read as one region, which OpenSlide can
+// serve with fewer lookups and decodes than separate reads. The region is as wide as a tile, so each tile comes out
+// as one contiguous block of pixels.
+static void load_wsi_tile_batch(i32 logical_thread_index, load_tile_task_batch_t* batch) {
+	image_t* image = batch->tile_tasks[0].image;
+	wsi_t* wsi = &image->wsi.wsi;
+	thread_memory_t* thread_memory = (thread_memory_t*) thread_local_storage[logical_thread_index];
+	u8* preloaded_data[TILE_LOAD_BATCH_MAX] = {0};
+	bool32 is_gathered[TILE_LOAD_BATCH_MAX] = {0};
+	for (i32 i = 0; i < batch->task_count; ++i) {
+		if (is_gathered[i]) continue;
+		load_tile_task_t* first_task = batch->tile_tasks + i;
+		is_gathered[i] = true;
+		i32 task_indices[TILE_LOAD_BATCH_MAX];
+		task_indices[0] = i;
+		i32 count = 1;
+		i32 top_tile_y = first_task->tile_y;
+		i32 bottom_tile_y = first_task->tile_y;
+		// Grow the run upwards and downwards for as long as the neighbouring tiles are also in the batch
+		bool32 has_grown = true;
+		while (has_grown) {
+			has_grown = false;
+			for (i32 j = i + 1; j < batch->task_count; ++j) {
+				load_tile_task_t* task = batch->tile_tasks + j;
+				if (is_gathered[j] || task->level != first_task->level || task->tile_x != first_task->tile_x) continue;
+				if (task->tile_y == top_tile_y - 1 || task->tile_y == bottom_tile_y + 1) {
+					top_tile_y = ATMOST(top_tile_y, task->tile_y);
+					bottom_tile_y = ATLEAST(bottom_tile_y, task->tile_y);
+					is_gathered[j] = true;
+					task_indices[count++] = j;
+					has_grown = true;
+				}
+			}
+		}
+		if (count == 1) continue; // load_tile() reads it by itself
+		u8* region = (u8*) try_push_size(&thread_memory->task_arena, count * WSI_BLOCK_SIZE);
+		if (!region) continue;
+		i32 level = first_task->level;
+		i64 x = ((i64)first_task->tile_x * TILE_DIM) << level;
+		i64 y = ((i64)top_tile_y * TILE_DIM) << level;
+		i64 decode_start = get_clock();
+		openslide_t* osr = get_wsi_handle_for_thread(wsi, logical_thread_index);
+		openslide.openslide_read_region(osr, (u32*)region, x, y, level, TILE_DIM, count * TILE_DIM);
+		i64 decode_end = get_clock();
+		for (i32 k = 0; k < count; ++k) {
+			load_tile_task_t* task = batch->tile_tasks + task_indices[k];
+			preloaded_data[task_indices[k]] = region + (task->tile_y - top_tile_y) * WSI_BLOCK_SIZE;
+			tile_metrics_record(TILE_STAGE_DECODE, decode_start, decode_end);
+		}
+	}
+	for (i32 i = 0; i < batch->task_count; ++i) {
+		load_tile(logical_thread_index, batch->tile_tasks + i, preloaded_data[i]);
+	}
+}
+
+// Local slides: read the compressed data of all the tiles in the batch up front, so that reads of tiles that are
+// stored next to each other in the file get merged into one (see read_local_tiles()).
+static void load_local_tile_batch(i32 logical_thread_index, load_tile_task_batch_t* batch) {
+	image_t* image = batch->tile_tasks[0].image;
+	if (image->type == IMAGE_TYPE_WSI) {
+		load_wsi_tile_batch(logical_thread_index, batch);
+		return;
+	}
+	u8* preloaded_data[TILE_LOAD_BATCH_MAX] = {0};
+	u8* buffer = NULL;
+	u8* heap_buffer = NULL; // only if the batch was too large for the task arena
+	if (image->type == IMAGE_TYPE_TIFF && !image->tiff.tiff.mapped_data && batch->task_count > 1) {
+		tiff_t* tiff = &image->tiff.tiff;
+		i64 io_start = get_clock();
+		u64 capacity = 0;
+		for (i32 i = 0; i < batch->task_count; ++i) {
+			load_tile_task_t* task = batch->tile_tasks + i;
+			level_image_t* level_image = get_focal_plane_levels(image, task->focal_plane) + task->level;
+			if (level_image->tiff_level >= 0 && tiff_load_tile_tables(tiff, tiff->level_images + level_image->tiff_level)) {
+				i32 tile_index = task->tile_y * level_image->width_in_tiles + task->tile_x;
+				capacity += tiff->level_images[level_image->tiff_level].tile_byte_counts[tile_index] + IO_COALESCE_MAX_GAP
+				            + 2 * TIFF_DIRECT_IO_ALIGNMENT;
+			}
+		}
+		// The buffer is only needed until the tiles in the batch are decoded, so it can go on the task arena.
+		thread_memory_t* thread_memory = (thread_memory_t*) thread_local_storage[logical_thread_index];
+		buffer = (u8*) try_push_size(&thread_memory->task_arena, capacity);
+		if (!buffer) {
+			buffer = (u8*) malloc(capacity);
+			heap_buffer = buffer;
+		}
+		u64 used = 0;
+		bool32 is_gathered[TILE_LOAD_BATCH_MAX] = {0};
+		for (i32 i = 0; i < batch->task_count; ++i) {
+			i32 focal_plane = batch->tile_tasks[i].focal_plane;
+			i32 level = batch->tile_tasks[i].level;
+			level_image_t* level_image = get_focal_plane_levels(image, focal_plane) + level;
+			if (is_gathered[i] || level_image->tiff_level < 0) continue;
+			// Gather the tiles at the same level (the tiles of one level are what may be stored together)
+			i32 tile_indices[TILE_LOAD_BATCH_MAX];
+			i32 task_indices[TILE_LOAD_BATCH_MAX];
+			i32 count = 0;
+			for (i32 j = i; j < batch->task_count; ++j) {
+				load_tile_task_t* task = batch->tile_tasks + j;
+				if (task->level == level && task->focal_plane == focal_plane) {
+					tile_indices[count] = task->tile_y * level_image->width_in_tiles + task->tile_x;
+					task_indices[count] = j;
+					is_gathered[j] = true;
+					++count;
+				}
+			}
+			u8* compressed_data[TILE_LOAD_BATCH_MAX];
+			used += read_local_tiles(image, level_image->tiff_level, tile_indices, count, buffer + used, capacity - used,
+			                         compressed_data);
+			for (i32 k = 0; k < count; ++k) {
+				preloaded_data[task_indices[k]] = compressed_data[k];
+			}
+		}
+		// Every tile in the batch had to wait for all of the reads.
+		i64 io_end = get_clock();
+		for (i32 i = 0; i < batch->task_count; ++i) {
+			if (preloaded_data[i]) {
+				tile_metrics_record(TILE_STAGE_IO, batch->tile_tasks[i].start_clock, io_end);
+			}
+		}
+		float io_seconds = get_seconds_elapsed(io_start, io_end) * batch->task_count;
+		report_tile_load_stats(0, io_seconds, io_seconds);
+	}
+	for (i32 i = 0; i < batch->task_count; ++i) {
+		load_tile(logical_thread_index, batch->tile_tasks + i, preloaded_data[i]);
+	}
+	free(heap_buffer);
+}
+
+// Work queue entry for loading tiles from the tile request queue; userdata is the maximum number of tiles to load.
+// The request is only chosen once the entry starts executing: it may find that there is nothing (left) to do.
+void load_next_tile_request_func(i32 logical_thread_index, void* userdata) {
+	tile_request_queue_t* queue = &tile_request_queue;
+	interlocked_increment(&queue->loads_in_progress);
+	interlocked_decrement(&queue->jobs_in_flight);
+	i32 max_count = ATMOST((i32)(intptr_t)userdata, TILE_LOAD_BATCH_MAX);
+	load_tile_task_batch_t batch = {};
+	batch.task_count = take_tile_requests(batch.tile_tasks, max_count);
+	if (batch.task_count > 0) {
+		image_t* image = batch.tile_tasks[0].image;
+		bool32 is_downloading = false;
+		if (!is_image_handle_alive(image->image_id)) {
+			// The image was unloaded after the requests were taken: no need to read or download anything.
+		} else if (image->type == IMAGE_TYPE_TIFF && image->tiff.tiff.is_remote) {
+			is_downloading = tiff_load_tile_batch_func(logical_thread_index, &batch);
+		} else {
+			// Prefetched tiles may not be needed at all, so they don't get to compete with the tiles in view.
+			bool32 is_prefetch = IS_PREFETCH_PRIORITY(batch.tile_tasks[0].priority);
+			if (is_prefetch) platform_set_thread_background_mode(true);
+			load_local_tile_batch(logical_thread_index, &batch);
+			if (is_prefetch) platform_set_thread_background_mode(false);
+		}
+		// (a download that is still underway is counted in image->remote_downloads_in_flight)
+		interlocked_decrement(&image->tile_loads_in_flight);
+		if (is_downloading) {
+			return; // still downloading: the load is over once the network thread is done with it
+		}
+	}
+	interlocked_decrement(&queue->loads_in_progress);
+	platform_wake_main_thread(); // (to hand out the next requests, also if nothing could be loaded)
+}
+
+void report_tile_load_stats(i32 tiles_loaded, float io_seconds, float total_seconds) {
+	tile_load_stats_t* stats = &tile_load_stats;
+	spin_lock(&stats->lock);
+	stats->tiles_loaded += tiles_loaded;
+	stats->io_seconds += io_seconds;
+	stats->total_seconds += total_seconds;
+	spin_unlock(&stats->lock);
+}
+
+#define REMOTE_TILE_BATCHES_IN_FLIGHT_MIN 2 // one downloading, one waiting
+#define REMOTE_TILE_BATCHES_IN_FLIGHT_MAX 6 // limits the load on the server
+#define LOCAL_TILE_BATCH_MAX 8 // tiles per work queue entry for local (not memory-mapped) files, to allow read coalescing
+#define REMOTE_REDUCED_TILE_QUALITY 50
+#define REMOTE_REDUCED_QUALITY_BANDWIDTH MEGABYTES(4) // bytes per second, over all the batches in flight
+
+// On a slow link (e.g. a VPN from home), scanner tiles of 50-150 KB each take a long time to come in. The tiles in view
+// are then asked for at a lower JPEG quality first, which the server re-encodes them to (see send_reduced_quality_tiles()
+// in server.c), and loaded again at full quality once the link has time for it (see add_visible_tiles_to_wishlist()).
+// To keep it from switching back and forth, the link has to get twice as fast before it switches back.
+static void update_remote_tile_quality(app_state_t* app_state) {
+	if (!app_state->adapt_remote_tile_quality || app_state->remote_bandwidth <= 0.0f) {
+		app_state->remote_tile_quality = 0;
+		return;
+	}
+	float link_bandwidth = app_state->remote_bandwidth * (float)app_state->remote_tile_batches_in_flight;
+	if (app_state->remote_tile_quality == 0 && link_bandwidth < (float)REMOTE_REDUCED_QUALITY_BANDWIDTH) {
+		app_state->remote_tile_quality = REMOTE_REDUCED_TILE_QUALITY;
+	} else if (app_state->remote_tile_quality > 0 && link_bandwidth > 2.0f * (float)REMOTE_REDUCED_QUALITY_BANDWIDTH) {
+		app_state->remote_tile_quality = 0;
+	}
+}
+
+// Called from the main thread once per frame: adapts how many tile loads are kept in flight to the measured
+// throughput and time per tile, instead of using a fixed number of tiles per frame.
+void update_tile_load_budget(app_state_t* app_state, float delta_t) {
+	tile_load_stats_t* stats = &tile_load_stats;
+	spin_lock(&stats->lock);
+	i32 tiles_loaded = stats->tiles_loaded;
+	float io_seconds = stats->io_seconds;
+	float total_seconds = stats->total_seconds;
+	stats->tiles_loaded = 0;
+	stats->io_seconds = 0.0f;
+	stats->total_seconds = 0.0f;
+	spin_unlock(&stats->lock);
+
+	float smoothing = 0.1f;
+	if (delta_t > 0.0f) {
+		app_state->tile_load_rate = LERP(smoothing, app_state->tile_load_rate, (float)tiles_loaded / delta_t);
+	}
+	if (tiles_loaded > 0) {
+		app_state->tile_io_latency = LERP(smoothing, app_state->tile_io_latency, io_seconds / (float)tiles_loaded);
+		app_state->tile_load_time = LERP(smoothing, app_state->tile_load_time, total_seconds / (float)tiles_loaded);
+	}
+
+	// Little's law: sustaining the measured rate takes (rate * time per tile) loads in flight. On top of that, keep
+	// one more per worker queued up, so that the workers don't run dry in between frames.
+	i32 worker_count = ATLEAST(1, total_thread_count - 1);
+	i32 target = (i32)ceilf(app_state->tile_load_rate * app_state->tile_load_time) + worker_count;
+	app_state->target_tile_loads_in_flight = CLAMP(target, worker_count, WORK_DEQUE_CAPACITY / 2);
+
+	// For remote slides, tune the batches to the measured link.
+	remote_link_stats_t* link = &remote_link_stats;
+	spin_lock(&link->lock);
+	i32 transfer_count = link->transfer_count;
+	float rtt_seconds = link->rtt_seconds;
+	float receive_seconds = link->receive_seconds;
+	i64 bytes_received = link->bytes_received;
+	i32 chunks_received = link->chunks_received;
+	link->transfer_count = 0;
+	link->rtt_seconds = 0.0f;
+	link->receive_seconds = 0.0f;
+	link->bytes_received = 0;
+	link->chunks_received = 0;
+	spin_unlock(&link->lock);
+
+	if (transfer_count > 0) {
+		// The first measurements replace the initial zeroes, instead of being averaged with them.
+		float link_smoothing = (app_state->remote_rtt > 0.0f) ? 0.2f : 1.0f;
+		app_state->remote_rtt = LERP(link_smoothing, app_state->remote_rtt, rtt_seconds / (float)transfer_count);
+		if (receive_seconds > 0.001f) {
+			float bandwidth = (float)bytes_received / receive_seconds;
+			link_smoothing = (app_state->remote_bandwidth > 0.0f) ? 0.2f : 1.0f;
+			app_state->remote_bandwidth = LERP(link_smoothing, app_state->remote_bandwidth, bandwidth);
+		}
+		if (chunks_received > 0) {
+			float bytes_per_tile = (float)bytes_received / (float)chunks_received;
+			link_smoothing = (app_state->remote_bytes_per_tile > 0.0f) ? 0.2f : 1.0f;
+			app_state->remote_bytes_per_tile = LERP(link_smoothing, app_state->remote_bytes_per_tile, bytes_per_tile);
+		}
+	}
+
+	i32 batch_size;
+	i32 batches_in_flight = REMOTE_TILE_BATCHES_IN_FLIGHT_MIN;
+	if (app_state->remote_bandwidth > 0.0f && app_state->remote_bytes_per_tile > 0.0f) {
+		// Each batch should take about a round trip to come in, so that at most half of the time goes to waiting
+		// for the first byte. That is the bandwidth-delay product, in tiles.
+		float seconds_per_tile = app_state->remote_bytes_per_tile / app_state->remote_bandwidth;
+		batch_size = CLAMP((i32)ceilf(app_state->remote_rtt / seconds_per_tile), 3, TILE_LOAD_BATCH_MAX);
+		// If the batches can't be made that large, keep more of them in flight, so that the link stays busy while
+		// one of them is waiting for its first byte. The bandwidth is measured per connection: once the link is
+		// saturated, the share of each connection drops, the batches take longer, and fewer get started.
+		float seconds_per_batch = (float)batch_size * seconds_per_tile;
+		batches_in_flight = 1 + (i32)ceilf(app_state->remote_rtt / seconds_per_batch);
+	} else {
+		// Nothing measured yet: grow the batches with the round trip time, as far as it is known from the tile loads.
+		batch_size = (i32)ceilf(app_state->tile_load_rate * app_state->tile_io_latency / REMOTE_TILE_BATCHES_IN_FLIGHT_MIN);
+	}
+	app_state->remote_tile_batch_size = CLAMP(batch_size, 3, TILE_LOAD_BATCH_MAX);
+	i32 max_batches_in_flight = MIN(REMOTE_TILE_BATCHES_IN_FLIGHT_MAX, ATLEAST(REMOTE_TILE_BATCHES_IN_FLIGHT_MIN, worker_count));
+	app_state->remote_tile_batches_in_flight = CLAMP(batches_in_flight, REMOTE_TILE_BATCHES_IN_FLIGHT_MIN, max_batches_in_flight);
+	update_remote_tile_quality(app_state);
+}
+
+u32 get_texture_slot_for_tile(image_t* image, i32 level, i32 tile_x, i32 tile_y) {
+	level_image_t* level_image = image->level_images + level;
+	tile_t* tile = peek_tile(level_image, tile_x, tile_y);
+	return tile ? tile->texture_slot : 0;
+}
+
+void load_wsi(wsi_t* wsi, const char* filename) {
+	if (!is_openslide_loading_done) {
+		// TODO: hack! queue abused, may cause conflicts
+		printf("Waiting for OpenSlide to finish loading...\n");
+		while (is_queue_work_in_progress(&work_queue)) {
+			do_worker_work(&work_queue, 0);
+		}
+	}
+
+	if (!is_openslide_available) {
+		char message[4096];
+		snprintf(message, sizeof(message), "Could not open \"%s\":\nlibopenslide-0.dll is missing or broken.\n", filename);
+		message_box(message);
+		return;
+	}
+
+	// TODO: check if necessary anymore?
+	unload_wsi(wsi);
+
+	wsi->osr = openslide.openslide_open(filename);
+	if (wsi->osr) {
+		printf("Openslide: opened %s\n", filename);
+		wsi->filename = strdup(filename);
+
+		openslide.openslide_get_level0_dimensions(wsi->osr, &wsi->width, &wsi->height);
+		ASSERT(wsi->width > 0);
+		ASSERT(wsi->height > 0);
+
+		wsi->level_count = openslide.openslide_get_level_count(wsi->osr);
+		printf("Openslide: WSI has %d levels\n", wsi->level_count);
+		if (wsi->level_count > WSI_MAX_LEVELS) {
+			panic();
+		}
+
+
+
+		const char* const* wsi_properties = openslide.openslide_get_property_names(wsi->osr);
+		if (wsi_properties) {
+			i32 property_index = 0;
+			const char* property = wsi_properties[0];
+			for (; property != NULL; property = wsi_properties[++property_index]) {
+				const char* property_value = openslide.openslide_get_property_value(wsi->osr, property);
+				printf("%s = %s\n", property, property_value);
+
+			}
+		}
+
+		wsi->mpp_x = 0.25f; // microns per pixel (default)
+		wsi->mpp_y = 0.25f; // microns per pixel (default)
+		const char* mpp_x_string = openslide.openslide_get_property_value(wsi->osr, "openslide.mpp-x");
+		const char* mpp_y_string = openslide.openslide_get_property_value(wsi->osr, "openslide.mpp-y");
+		if (mpp_x_string) {
+			float mpp = atof(mpp_x_string);
+			if (mpp > 0.0f) {
+				wsi->mpp_x = mpp;
+			}
+		}
+		if (mpp_y_string) {
+			float mpp = atof(mpp_y_string);
+			if (mpp > 0.0f) {
+				wsi->mpp_y = mpp;
+			}
+		}
+
+		for (i32 i = 0; i < wsi->level_count; ++i) {
+			wsi_level_t* level = wsi->levels + i;
+
+			openslide.openslide_get_level_dimensions(wsi->osr, i, &level->width, &level->height);
+			ASSERT(level->width > 0);
+			ASSERT(level->height > 0);
+			i64 partial_block_x = level->width % TILE_DIM;
+			i64 partial_block_y = level->height % TILE_DIM;
+			level->width_in_tiles = (i32)(level->width / TILE_DIM) + (partial_block_x != 0);
+			level->height_in_tiles = (i32)(level->height / TILE_DIM) + (partial_block_y != 0);
+			level->um_per_pixel_x = (float)(1 << i) * wsi->mpp_x;
+			level->um_per_pixel_y = (float)(1 << i) * wsi->mpp_y;
+			level->x_tile_side_in_um = level->um_per_pixel_x * (float)TILE_DIM;
+			level->y_tile_side_in_um = level->um_per_pixel_y * (float)TILE_DIM;
+			level->tile_count = level->width_in_tiles * level->height_in_tiles;
+			// Note: tiles are now managed by the format-agnostic image_t
+//			level->tiles = calloc(1, level->num_tiles * sizeof(wsi_tile_t));
+		}
+
+		const char* barcode = openslide.openslide_get_property_value(wsi->osr, "philips.PIM_DP_UFS_BARCODE");
+		if (barcode) {
+			wsi->barcode = barcode;
+		}
+
+		const char* const* wsi_associated_image_names = openslide.openslide_get_associated_image_names(wsi->osr);
+		if (wsi_associated_image_names) {
+			i32 name_index = 0;
+			const char* name = wsi_associated_image_names[0];
+			for (; name != NULL; name = wsi_associated_image_names[++name_index]) {
+				i64 w = 0;
+				i64 h = 0;
+				openslide.openslide_get_associated_image_dimensions(wsi->osr, name, &w, &h);
+				printf("%s : w=%lld h=%lld\n", name, w, h);
+
+			}
+		}
+
+
+	}
+
+}
+
+void unload_texture(u32 texture) {
+	glDeleteTextures(1, &texture);
+}
+
+#define ZOOM_LINGER_SECONDS 0.15f // see add_visible_tiles_to_wishlist()
+#define TILE_CACHE_PINNED_LEVEL_COUNT 3 // the coarsest levels are never evicted, they serve as a fallback
+
+int cached_tile_lru_cmp_func(const void* a, const void* b) {
+	i64 time_a = (*(cached_tile_t**)a)->tile->time_last_drawn;
+	i64 time_b = (*(cached_tile_t**)b)->tile->time_last_drawn;
+	return (time_a > time_b) - (time_a < time_b);
+}
+
+// The texture budget is shared by all loaded images: the least recently drawn tiles are evicted first, whichever
+// image they belong to. Images that are not being displayed are not drawn, so they give up their tiles first.
+// The budget is checked against the texture memory as tracked by the tile texture pool (see memory_stats.h).
+void evict_least_recently_drawn_tiles(app_state_t* app_state) {
+	i32 image_count = sb_count(app_state->loaded_images);
+	i64 resident_memory = memory_stats_get(MEMORY_DOMAIN_TILE_TEXTURES);
+	i32 resident_tile_count = tile_texture_pool.slots_in_use;
+	i64 budget = (i64)app_state->tile_cache_budget_in_mb * MEGABYTES(1);
+
+	if (resident_memory > budget) {
+		// Evict down to somewhat below the budget, so that we don't have to do this again on the very next frame.
+		i64 target_memory = budget - budget / 8;
+		i32 max_candidate_count = 0;
+		for (i32 image_index = 0; image_index < image_count; ++image_index) {
+			max_candidate_count += sb_count(app_state->loaded_images[image_index]->cached_tiles);
+		}
+		// The list of candidates is only needed for this frame.
+		cached_tile_t** candidates = push_array(&app_state->frame_arena, max_candidate_count, cached_tile_t*);
+		i32 candidate_count = 0;
+		for (i32 image_index = 0; image_index < image_count; ++image_index) {
+			image_t* image = app_state->loaded_images[image_index];
+			i32 first_pinned_level = image->level_count - TILE_CACHE_PINNED_LEVEL_COUNT;
+			i32 cached_tile_count = sb_count(image->cached_tiles);
+			for (i32 i = 0; i < cached_tile_count; ++i) {
+				cached_tile_t* cached_tile = image->cached_tiles + i;
+				if (cached_tile->tile->texture_slot == 0 || cached_tile->level >= first_pinned_level) {
+					continue; // still loading, or should be kept
+				}
+				i32 state = cached_tile->tile->state;
+				if (state == TILE_STATE_QUEUED || state == TILE_STATE_LOADING) {
+					continue; // being refined (see get_wanted_resolution_shift())
+				}
+				candidates[candidate_count++] = cached_tile;
+			}
+		}
+		qsort(candidates, candidate_count, sizeof(cached_tile_t*), cached_tile_lru_cmp_func);
+
+		for (i32 i = 0; i < candidate_count && resident_memory > target_memory; ++i) {
+			cached_tile_t* cached_tile = candidates[i];
+			tile_t* tile = cached_tile->tile;
+			if (tile->time_last_drawn >= app_state->frame_counter) {
+				break; // this tile (and every tile after it) is currently on screen
+			}
+			resident_memory -= get_tile_texture_slot_memory(tile->texture_slot);
+			release_tile_texture_slot(tile->texture_slot);
+			tile->texture_slot = 0;
+			tile->state = TILE_STATE_UNLOADED; // allow the tile to be requested again
+			tile->debug_stage = TILE_DEBUG_STAGE_EVICTED;
+			tile->is_in_cached_tiles = false;
+			cached_tile->tile = NULL;
+			--resident_tile_count;
+			++app_state->evicted_tile_count;
+		}
+
+		// rebuild the lists, leaving out the evicted tiles (and tiles that failed to load or were cancelled)
+		for (i32 image_index = 0; image_index < image_count; ++image_index) {
+			image_t* image = app_state->loaded_images[image_index];
+			i32 cached_tile_count = sb_count(image->cached_tiles);
+			i32 new_cached_tile_count = 0;
+			for (i32 i = 0; i < cached_tile_count; ++i) {
+				tile_t* tile = image->cached_tiles[i].tile;
+				if (tile == NULL) continue;
+				if (tile->texture_slot != 0 || tile->state != TILE_STATE_UNLOADED) {
+					image->cached_tiles[new_cached_tile_count++] = image->cached_tiles[i];
+				} else {
+					tile->is_in_cached_tiles = false;
+				}
+			}
+			if (image->cached_tiles) {
+				sb_raw_count(image->cached_tiles) = new_cached_tile_count;
+			}
+		}
+	}
+
+	app_state->cached_tile_count = resident_tile_count;
+	app_state->cached_tile_memory = resident_memory;
+	trim_tile_texture_pool(TILE_TEXTURE_SPARE_ARRAY_COUNT);
+}
+
+void unload_wsi(wsi_t* wsi) {
+	for (i32 i = 0; i < COUNT(wsi->thread_osr); ++i) {
+		if (wsi->thread_osr[i]) {
+			openslide.openslide_close(wsi->thread_osr[i]);
+			wsi->thread_osr[i] = NULL;
+		}
+	}
+	if (wsi->osr) {
+		openslide.openslide_close(wsi->osr);
+		wsi->osr = NULL;
+	}
+	if (wsi->filename) {
+		free(wsi->filename);
+		wsi->filename = NULL;
+	}
+
+}
+
+level_image_t* get_focal_plane_levels(image_t* image, i32 focal_plane) {
+	ASSERT(focal_plane >= 0 && focal_plane < image->focal_plane_count);
+	return image->focal_plane_level_images + focal_plane * image->level_count;
+}
+
+// Only the focal plane in view is requested and drawn (the adjacent planes are prefetched, see
+// prefetch_adjacent_focal_planes()); the tiles of the other planes stay cached until they are evicted.
+void set_focal_plane(image_t* image, i32 focal_plane) {
+	focal_plane = CLAMP(focal_plane, 0, image->focal_plane_count - 1);
+	if (focal_plane != image->focal_plane) {
+		image->last_focus_direction = (focal_plane > image->focal_plane) ? 1 : -1;
+	}
+	image->focal_plane = focal_plane;
+	image->level_images = get_focal_plane_levels(image, image->focal_plane);
+}
+
+// The usual colors of the dyes, in the order in which the channels are usually stored (DAPI first)
+static void init_image_channels(image_t* image) {
+	static const v3f colors[] = {
+		{{{0.0f, 0.0f, 1.0f}}}, {{{0.0f, 1.0f, 0.0f}}}, {{{1.0f, 0.0f, 0.0f}}}, {{{1.0f, 0.0f, 1.0f}}},
+		{{{0.0f, 1.0f, 1.0f}}}, {{{1.0f, 1.0f, 0.0f}}}, {{{1.0f, 0.5f, 0.0f}}}, {{{1.0f, 1.0f, 1.0f}}},
+	};
+	for (i32 i = 0; i < image->channel_count; ++i) {
+		image->channels[i] = (image_channel_t){ .is_enabled = true, .color = colors[i % COUNT(colors)], .gain = 1.0f };
+	}
+}
+
+// Fluorescence images are requested, prefetched and drawn one enabled channel at a time, with the channel standing in
+// for the focal plane in view; other images are gone through once, as they are. Start with *channel = -1.
+static bool32 next_shown_channel(image_t* image, i32* channel) {
+	if (image->channel_count == 0) {
+		bool32 is_first = (*channel < 0);
+		*channel = 0;
+		return is_first;
+	}
+	for (i32 i = *channel + 1; i < image->channel_count; ++i) {
+		if (image->channels[i].is_enabled) {
+			*channel = i;
+			set_focal_plane(image, i);
+			return true;
+		}
+	}
+	return false;
+}
+
+static image_t** images_being_unloaded; // sb, only accessed by the main thread (see unload_image())
+
+// Tells everything that may still be working on the image to stop; doesn't wait for it.
+static void cancel_work_for_image(image_t* image) {
+	// A region of the image might be being exported
+	cancel_region_exports_for_image(image);
+	// Or its tiles streamed for analysis
+	cancel_tile_streams_for_image(image);
+	// Or it might be being registered with another slide
+	cancel_registrations_for_image(image);
+	// Or its tissue mask still being computed
+	image->is_tissue_mask_cancelled = true;
+	// Levels might still be being generated, and tiles cut from them
+	image->is_level_generation_cancelled = true;
+	cancel_tile_requests_for_image(image);
+	if (image->type == IMAGE_TYPE_TIFF) {
+		// Tiles might still be on the way, or waiting to be decoded
+		cancel_remote_downloads(image);
+	}
+}
+
+static bool32 is_work_in_flight_for_image(image_t* image) {
+	return image->region_exports_in_flight > 0 || image->tile_streams_in_flight > 0 || image->registrations_in_flight > 0 ||
+	       image->tissue_mask_computations_in_flight > 0 || image->level_generations_in_flight > 0 ||
+	       image->tile_loads_in_flight > 0 || image->tile_table_loads_in_flight > 0 ||
+	       image->coarsest_level_loads_in_flight > 0 || image->remote_downloads_in_flight > 0;
+}
+
+// Frees everything the image holds (but not the image itself), once nothing is working on it anymore. Runs on a
+// worker thread: nothing here needs OpenGL (the texture slots only go back to the pool).
+static void free_image_resources(image_t* image) {
+	free_tissue_mask(image);
+	if (image->type == IMAGE_TYPE_WSI) {
+		unload_wsi(&image->wsi.wsi);
+	} else if (image->type == IMAGE_TYPE_SIMPLE) {
+		if (image->simple.pixels) {
+			stbi_image_free(image->simple.pixels);
+			image->simple.pixels = NULL;
+		}
+	} else if (image->type == IMAGE_TYPE_TIFF) {
+		tiff_destroy(&image->tiff.tiff);
+		tile_cache_remove_image(&global_tile_cache, image->image_id);
+		if (image->disk_cache) {
+			disk_cache_close(image->disk_cache);
+			image->disk_cache = NULL;
+		}
+	}
+
+	if (image->focal_plane_level_images) {
+		free_generated_levels(image);
+		u32 slots[256];
+		i32 slot_count = 0;
+		for (i32 i = 0; i < image->focal_plane_count * image->level_count; ++i) {
+			level_image_t* level_image = image->focal_plane_level_images + i;
+			if (level_image->tile_pages) {
+				// (normally none are left here, see unload_image())
+				u64 page_count = (u64)level_image->width_in_pages * level_image->height_in_pages;
+				for (u64 page_index = 0; page_index < page_count; ++page_index) {
+					tile_t* page = level_image->tile_pages[page_index];
+					if (!page) continue;
+					for (i32 j = 0; j < TILE_PAGE_SIZE; ++j) {
+						tile_t* tile = page + j;
+						if (tile->texture_slot != 0) {
+							slots[slot_count++] = tile->texture_slot;
+							tile->texture_slot = 0;
+							if (slot_count == COUNT(slots)) {
+								release_tile_texture_slots(slots, slot_count);
+								slot_count = 0;
+							}
+						}
+					}
+				}
+			}
+			destroy_tile_table(level_image);
+		}
+		release_tile_texture_slots(slots, slot_count);
+		free(image->focal_plane_level_images);
+		image->focal_plane_level_images = NULL;
+		image->level_images = NULL;
+	}
+	if (image->cached_tiles) {
+		sb_free(image->cached_tiles);
+		image->cached_tiles = NULL;
+	}
+}
+
+static void free_image_func(i32 logical_thread_index, void* userdata) {
+	image_t* image = (image_t*) userdata;
+	free_image_resources(image);
+	free(image);
+}
+
+// Takes over the image (allocated with malloc(), and already taken out of app_state->loaded_images), and tears it
+// down incrementally, so that closing a slide doesn't hold up the frame: the work on the image is called off, and
+// its texture slots go back to the pool right away; once the work has stopped (see update_image_unloads()), the rest
+// is freed on a worker thread.
+void unload_image(image_t* image) {
+	if (!image) return;
+	release_image_handle(image->image_id); // from here on, the results of the work still underway are thrown away
+	cancel_work_for_image(image);
+	// The tiles that own a texture are all in cached_tiles (see add_to_cached_tiles()); new ones can't be added,
+	// since the completions for images that are not loaded are thrown away (see upload_decoded_tiles()).
+	u32 slots[256];
+	i32 slot_count = 0;
+	for (i32 i = 0; i < sb_count(image->cached_tiles); ++i) {
+		tile_t* tile = image->cached_tiles[i].tile;
+		if (tile && tile->texture_slot != 0) {
+			slots[slot_count++] = tile->texture_slot;
+			tile->texture_slot = 0;
+			if (slot_count == COUNT(slots)) {
+				release_tile_texture_slots(slots, slot_count);
+				slot_count = 0;
+			}
+		}
+	}
+	release_tile_texture_slots(slots, slot_count);
+	trim_tile_texture_pool(0);
+	if (image->type == IMAGE_TYPE_SIMPLE && image->simple.texture != 0) {
+		unload_texture(image->simple.texture);
+		image->simple.texture = 0;
+	}
+	sb_push(images_being_unloaded, image);
+	update_image_unloads();
+}
+
+// Needs to be called every frame, on the main thread: hands the images that nothing is working on anymore over to a
+// worker, to be freed.
+void update_image_unloads() {
+	i32 i = 0;
+	while (i < sb_count(images_being_unloaded)) {
+		image_t* image = images_being_unloaded[i];
+		if (is_work_in_flight_for_image(image)) {
+			++i;
+			continue;
+		}
+		read_barrier;
+		if (!add_work_queue_entry(&work_queue, free_image_func, image)) {
+			free_image_func(0, image); // queue is full, do it now
+		}
+		images_being_unloaded[i] = sb_last(images_being_unloaded);
+		--sb_raw_count(images_being_unloaded);
+	}
+}
+
+void unload_all_images(app_state_t *app_state) {
+	i32 current_image_count = sb_count(app_state->loaded_images);
+	if (current_image_count > 0) {
+		ASSERT(app_state->loaded_images);
+		for (i32 i = 0; i < current_image_count; ++i) {
+			unload_image(app_state->loaded_images[i]);
+		}
+		sb_free(app_state->loaded_images);
+		app_state->loaded_images = NULL;
+	}
+	app_state->displayed_image = 0;
+	mouse_show();
+}
+
+static void unload_image_at_index(app_state_t* app_state, i32 index) {
+	i32 image_count = sb_count(app_state->loaded_images);
+	ASSERT(index >= 0 && index < image_count);
+	unload_image(app_state->loaded_images[index]);
+	memmove(app_state->loaded_images + index, app_state->loaded_images + index + 1,
+	        (image_count - index - 1) * sizeof(image_t*));
+	sb_raw_count(app_state->loaded_images) = image_count - 1;
+	if (app_state->displayed_image > index) {
+		--app_state->displayed_image;
+	} else if (app_state->displayed_image == index) {
+		app_state->displayed_image = 0;
+		for (i32 i = 0; i < image_count - 1; ++i) {
+			if (app_state->loaded_images[i]->overlay_of_image_id == 0) {
+				app_state->displayed_image = i; // (overlays are never displayed by themselves)
+				break;
+			}
+		}
+	}
+}
+
+// The overlay that is drawn over the image, if any (see load_overlay_from_file()).
+image_t* find_overlay_for_image(app_state_t* app_state, image_t* image) {
+	for (i32 i = 0; i < sb_count(app_state->loaded_images); ++i) {
+		if (app_state->loaded_images[i]->overlay_of_image_id == image->image_id) return app_state->loaded_images[i];
+	}
+	return NULL;
+}
+
+void close_overlay_for_image(app_state_t* app_state, image_t* image) {
+	for (i32 i = 0; i < sb_count(app_state->loaded_images); ++i) {
+		if (app_state->loaded_images[i]->overlay_of_image_id == image->image_id) {
+			unload_image_at_index(app_state, i);
+			return;
+		}
+	}
+}
+
+// Unloading an image also unloads its overlay.
+static void unload_image_and_overlay_at_index(app_state_t* app_state, i32 index) {
+	u32 image_id = app_state->loaded_images[index]->image_id;
+	unload_image_at_index(app_state, index);
+	for (i32 i = 0; i < sb_count(app_state->loaded_images); ++i) {
+		if (app_state->loaded_images[i]->overlay_of_image_id == image_id) {
+			unload_image_at_index(app_state, i);
+			return;
+		}
+	}
+}
+
+// Adds the image to the loaded images (unloading the one that was displayed least recently, if there are too many),
+// and displays it. Returns a pointer to the stored copy, which stays valid until the image is unloaded.
+static image_t* push_loaded_image(app_state_t* app_state, image_t* image, const char* identity) {
+	while (sb_count(app_state->loaded_images) >= MAX_LOADED_IMAGES) {
+		i32 least_recent_index = 0;
+		for (i32 i = 1; i < sb_count(app_state->loaded_images); ++i) {
+			if (app_state->loaded_images[i]->frame_last_displayed <
+			    app_state->loaded_images[least_recent_index]->frame_last_displayed) {
+				least_recent_index = i;
+			}
+		}
+		unload_image_and_overlay_at_index(app_state, least_recent_index);
+	}
+	image_t* stored_image = (image_t*) malloc(sizeof(image_t));
+	*stored_image = *image;
+	// (used as part of the key for the tile cache, and for pending tile uploads)
+	stored_image->image_id = acquire_image_handle(stored_image);
+	init_stain_matrix(&stored_image->stain_matrix, STAIN_PRESET_H_DAB);
+	stored_image->shown_stain = 0;
+	if (!stored_image->focal_plane_level_images) {
+		// (not a z-stack)
+		stored_image->focal_plane_level_images = stored_image->level_images;
+		stored_image->focal_plane_count = 1;
+	}
+	if (identity) {
+		strncpy(stored_image->identity, identity, sizeof(stored_image->identity) - 1);
+		if (stored_image->type == IMAGE_TYPE_TIFF && stored_image->tiff.tiff.is_remote) {
+			stored_image->shared_cache_slide_id = shared_tile_cache_slide_id(identity, stored_image->tiff.tiff.filesize);
+		}
+	}
+	stored_image->frame_last_displayed = app_state->frame_counter;
+	sb_push(app_state->loaded_images, stored_image);
+	app_state->displayed_image = sb_count(app_state->loaded_images) - 1;
+	return stored_image;
+}
+
+// If the image is still loaded, display it again (without reloading anything) and return true.
+// The camera stays where it is, so that consecutive sections of the same tissue can be compared by switching back
+// and forth.
+bool32 switch_to_loaded_image(app_state_t* app_state, const char* identity) {
+	for (i32 i = 0; i < sb_count(app_state->loaded_images); ++i) {
+		image_t* image = app_state->loaded_images[i];
+		if (image->overlay_of_image_id != 0) continue;
+		if (image->identity[0] != '\0' && strcmp(image->identity, identity) == 0) {
+			app_state->displayed_image = i;
+			image->frame_last_displayed = app_state->frame_counter;
+			scene_t* scene = &app_state->scenes[0];
+			scene->current_level = CLAMP(scene->current_level, 0, ATLEAST(0, image->level_count - 1));
+			mouse_show();
+			return true;
+		}
+	}
+	return false;
+}
+
+// Load the tile tables of a level in the file (see tiff_load_tile_tables()), then mark the empty tiles so that we
+// can skip loading them later on. This includes the tiles of the levels that are synthesized from this level.
+void load_tile_tables_for_level(image_t* image, i32 focal_plane, i32 level) {
+	tiff_t* tiff = &image->tiff.tiff;
+	level_image_t* levels = get_focal_plane_levels(image, focal_plane);
+	level_image_t* level_image = levels + level;
+	tiff_ifd_t* ifd = tiff->level_images + level_image->tiff_level;
+	if (!tiff_load_tile_tables(tiff, ifd)) {
+		return;
+	}
+	for (i32 j = 0; j < level_image->tile_count; ++j) {
+		if (is_empty_tile_in_file(ifd, j)) {
+			mark_tile_empty(level_image, j % level_image->width_in_tiles, j / level_image->width_in_tiles);
+		}
+	}
+
+	for (i32 synthesized_level = level + 1; synthesized_level < image->level_count; ++synthesized_level) {
+		level_image_t* synthesized = levels + synthesized_level;
+		if (synthesized->tiff_level >= 0) break;
+		i32 shift = synthesized->source_scale_shift;
+		if (shift > 3) continue; // already marked empty
+		// The synthesized tile is empty only if all of its source tiles are empty
+		for (i32 tile_y = 0; tile_y < synthesized->height_in_tiles; ++tile_y) {
+			for (i32 tile_x = 0; tile_x < synthesized->width_in_tiles; ++tile_x) {
+				bool32 is_empty = true;
+				for (i32 sy = tile_y << shift; sy < ATMOST((tile_y + 1) << shift, (i32)level_image->height_in_tiles); ++sy) {
+					for (i32 sx = tile_x << shift; sx < ATMOST((tile_x + 1) << shift, (i32)level_image->width_in_tiles); ++sx) {
+						if (!is_tile_empty(level_image, sx, sy)) {
+							is_empty = false;
+						}
+					}
+				}
+				if (is_empty) {
+					mark_tile_empty(synthesized, tile_x, tile_y);
+				}
+			}
+		}
+	}
+}
+
+void load_tile_tables_func(i32 logical_thread_index, void* userdata) {
+	load_tile_task_t* task = (load_tile_task_t*) userdata;
+	load_tile_tables_for_level(task->image, task->focal_plane, task->level);
+	interlocked_decrement(&task->image->tile_table_loads_in_flight);
+	free(task);
+}
+
+// Remote slides: the header may come with the compressed tiles of the coarsest level (see tiff_serialize()).
+// These go into the tile cache, so that the whole slide can be drawn without waiting for any tile downloads.
+static void preload_tiles_from_header(image_t* image) {
+	tiff_t* tiff = &image->tiff.tiff;
+	for (i32 level = 0; level < image->level_count; ++level) {
+		level_image_t* level_image = image->level_images + level;
+		if (level_image->tiff_level < 0) continue;
+		tiff_ifd_t* ifd = tiff->level_images + level_image->tiff_level;
+		if (!ifd->tile_data) continue;
+		u64 expected_size = 0;
+		for (u64 i = 0; i < ifd->tile_count; ++i) {
+			expected_size += ifd->tile_byte_counts[i];
+		}
+		if (expected_size == ifd->tile_data_size) {
+			u8* pos = ifd->tile_data;
+			for (u64 i = 0; i < ifd->tile_count; ++i) {
+				u64 tile_size = ifd->tile_byte_counts[i];
+				if (tile_size == 0) continue;
+				tile_cache_insert(&global_tile_cache, tile_cache_key(image->image_id, level_image->tiff_level, (i32)i),
+				                  pos, (u32)tile_size);
+				pos += tile_size;
+			}
+			level_image->are_tiles_preloaded = true;
+		} else {
+			printf("Tile data in the slide header has the wrong size (%llu instead of %llu bytes)\n", ifd->tile_data_size, expected_size);
+		}
+		free(ifd->tile_data);
+		ifd->tile_data = NULL;
+		ifd->tile_data_size = 0;
+	}
+}
+
+#define COARSEST_LEVEL_FIRST_MAX_TILES 64 // a coarsest level with more tiles than this is left to the tile requests
+#define COARSEST_LEVEL_FIRST_MAX_WAIT_SECONDS 0.25f
+
+// Work queue entry for a batch of tiles of the coarsest level (see load_coarsest_level_first()).
+void load_coarsest_level_batch_func(i32 logical_thread_index, void* userdata) {
+	load_tile_task_batch_t* batch = (load_tile_task_batch_t*) userdata;
+	image_t* image = batch->tile_tasks[0].image;
+	i64 start_clock = get_clock();
+	for (i32 i = 0; i < batch->task_count; ++i) {
+		batch->tile_tasks[i].start_clock = start_clock;
+	}
+	bool32 is_downloading = false;
+	if (image->tiff.tiff.is_remote) {
+		is_downloading = tiff_load_tile_batch_func(logical_thread_index, batch);
+	} else {
+		load_local_tile_batch(logical_thread_index, batch);
+	}
+	if (!is_downloading) {
+		interlocked_decrement(&tile_request_queue.loads_in_progress);
+	}
+	interlocked_decrement(&image->coarsest_level_loads_in_flight);
+	free(batch);
+	platform_wake_main_thread();
+}
+
+static void queue_coarsest_level_batch(image_t* image, load_tile_task_batch_t* batch) {
+	interlocked_increment(&tile_request_queue.loads_in_progress);
+	interlocked_increment(&image->coarsest_level_loads_in_flight);
+	if (!add_work_queue_entry(&work_queue, load_coarsest_level_batch_func, batch)) {
+		load_coarsest_level_batch_func(0, batch); // queue is full, do it now
+	}
+}
+
+// Right after a slide is opened, the whole coarsest level is loaded at once, bypassing the tile request queue, so
+// that the first frames already show the entire slide (at low resolution), with the finer tiles coming in over it.
+// The tiles are spread over the workers; for local slides, this waits (briefly) until they are decoded. Remote
+// slides don't wait: their tiles are downloaded in parallel, while the first frames are drawn.
+// Returns false if the coarsest level is left to the normal tile requests (and its tile table still needs loading).
+static bool32 load_coarsest_level_first(image_t* image, i32 level) {
+	level_image_t* level_image = image->level_images + level;
+	if (level_image->tiff_level < 0 || level_image->tile_count > COARSEST_LEVEL_FIRST_MAX_TILES) {
+		return false;
+	}
+	load_tile_tables_for_level(image, image->focal_plane, level);
+
+	i64 request_clock = get_clock();
+	load_tile_task_batch_t* batch = NULL;
+	tile_range_t all_tiles = { 0, 0, (i32)level_image->width_in_tiles, (i32)level_image->height_in_tiles };
+	tile_iterator_t it = begin_tile_iteration(level_image, all_tiles, true);
+	while (next_tile(&it)) {
+		tile_t* tile = it.tile;
+		if (tile->state != TILE_STATE_UNLOADED) continue;
+		if (!batch) {
+			batch = (load_tile_task_batch_t*) calloc(1, sizeof(load_tile_task_batch_t));
+		}
+		tile->state = TILE_STATE_LOADING;
+		tile->request_clock = request_clock;
+		batch->tile_tasks[batch->task_count++] = (load_tile_task_t){ .image = image, .tile = tile,
+		                                                             .focal_plane = image->focal_plane, .level = level,
+		                                                             .tile_x = it.tile_x, .tile_y = it.tile_y,
+		                                                             .request_clock = request_clock };
+		tile_metrics_count(TILE_COUNTER_REQUESTED, 1);
+		if (batch->task_count == TILE_LOAD_BATCH_MAX) {
+			queue_coarsest_level_batch(image, batch);
+			batch = NULL;
+		}
+	}
+	if (batch) {
+		queue_coarsest_level_batch(image, batch);
+	}
+
+	if (!image->tiff.tiff.is_remote) {
+		i64 wait_start = get_clock();
+		while (image->coarsest_level_loads_in_flight > 0 &&
+		       get_seconds_elapsed(wait_start, get_clock()) < COARSEST_LEVEL_FIRST_MAX_WAIT_SECONDS) {
+			platform_sleep(1);
+		}
+	}
+	return true;
+}
+
+// Overlays are stretched to cover the whole image they are drawn over: they are usually at a much lower resolution
+// (e.g. one pixel per patch that a model looked at), and the resolution in the file is not always reliable.
+static void fit_overlay_to_image(image_t* overlay, image_t* image) {
+	float scale_x = (float)image->width_in_um / ATLEAST(1.0f, (float)overlay->width_in_um);
+	float scale_y = (float)image->height_in_um / ATLEAST(1.0f, (float)overlay->height_in_um);
+	for (i32 i = 0; i < overlay->focal_plane_count * overlay->level_count; ++i) {
+		level_image_t* level_image = overlay->focal_plane_level_images + i;
+		level_image->um_per_pixel_x *= scale_x;
+		level_image->um_per_pixel_y *= scale_y;
+		level_image->x_tile_side_in_um *= scale_x;
+		level_image->y_tile_side_in_um *= scale_y;
+	}
+	overlay->mpp_x *= scale_x;
+	overlay->mpp_y *= scale_y;
+	overlay->width_in_um = image->width_in_um;
+	overlay->height_in_um = image->height_in_um;
+}
+
+// Adds the TIFF to the loaded images and starts loading it. With overlay_of set, the TIFF becomes the overlay of that
+// image instead of an image of its own (and is not displayed).
+static image_t* load_tiff_image(app_state_t* app_state, tiff_t tiff, const char* identity, image_t* overlay_of) {
+	image_t new_image = (image_t){};
+	new_image.type = IMAGE_TYPE_TIFF;
+	new_image.tiff.tiff = tiff;
+	new_image.is_freshly_loaded = true;
+	new_image.mpp_x = tiff.mpp_x;
+	new_image.mpp_y = tiff.mpp_y;
+	ASSERT(tiff.main_image);
+	new_image.width_in_pixels = tiff.main_image->image_width;
+	new_image.width_in_um = tiff.main_image->image_width * tiff.mpp_x;
+	new_image.height_in_pixels = tiff.main_image->image_height;
+	new_image.height_in_um = tiff.main_image->image_height * tiff.mpp_y;
+	// TODO: fix code duplication with tiff_deserialize()
+	if (tiff.level_count > 0 && tiff.main_image->tile_width) {
+
+		// Every level is supposed to be downsampled 2x compared to the previous one, but some pyramids skip levels.
+		// The missing levels are synthesized from the next finer level, using reduced-resolution decoding.
+		// Z-stacks have several focal planes: IFDs of the same size at a level, one per plane (in file order). A plane
+		// that is missing at a level (e.g. only the base level has them all) uses the IFD of the nearest plane instead.
+		i32 levels_in_file[IMAGE_MAX_LEVELS] = {0}; // (the first focal plane)
+		i32 focal_planes_in_file[IMAGE_MAX_LEVELS][FOCAL_PLANE_MAX];
+		i32 focal_plane_counts[IMAGE_MAX_LEVELS] = {0};
+		i32 level_count = 0;
+		memset(levels_in_file, -1, sizeof(levels_in_file));
+		for (i32 i = 0; i < tiff.level_count; ++i) {
+			tiff_ifd_t* ifd = tiff.level_images + i;
+			i32 level = (i32)roundf(log2f(ifd->um_per_pixel_x / tiff.mpp_x));
+			if (level >= 0 && level < COUNT(levels_in_file) && focal_plane_counts[level] < FOCAL_PLANE_MAX) {
+				if (levels_in_file[level] < 0) {
+					levels_in_file[level] = i;
+				}
+				focal_planes_in_file[level][focal_plane_counts[level]++] = i;
+				level_count = ATLEAST(level_count, level + 1);
+			}
+		}
+		ASSERT(levels_in_file[0] == 0);
+		i32 focal_plane_count = focal_plane_counts[0];
+		// Fluorescence images store their channels the same way, as grayscale IFDs (one per channel) at each level.
+		// Overlays only use the first one.
+		if (overlay_of) {
+			focal_plane_count = 1;
+		} else if (focal_plane_count > 1 && tiff.main_image->color_space == TIFF_PHOTOMETRIC_MINISBLACK) {
+			new_image.channel_count = focal_plane_count;
+			init_image_channels(&new_image);
+		}
+		// Without coarse levels in the file (e.g. a single-level TIFF), the pyramid is completed down to a single
+		// tile. For remote slides, only the levels that can be synthesized are added.
+		i32 max_level_count = tiff.is_remote ? ATMOST(IMAGE_MAX_LEVELS, level_count + 3) : IMAGE_MAX_LEVELS;
+		while (level_count < max_level_count && ((tiff.main_image->image_width - 1) >> (level_count - 1) >= TILE_DIM ||
+		                                         (tiff.main_image->image_height - 1) >> (level_count - 1) >= TILE_DIM)) {
+			++level_count;
+		}
+
+		new_image.level_count = level_count;
+		new_image.focal_plane_count = focal_plane_count;
+		new_image.focal_plane_level_images = (level_image_t*) calloc(1, focal_plane_count * level_count * sizeof(level_image_t));
+		new_image.level_images = new_image.focal_plane_level_images;
+
+		for (i32 i = 0; i < focal_plane_count * level_count; ++i) {
+			i32 focal_plane = i / level_count;
+			i32 level = i % level_count;
+			level_image_t* levels = get_focal_plane_levels(&new_image, focal_plane);
+			level_image_t* level_image = levels + level;
+			i32 tiff_level = levels_in_file[level];
+			if (tiff_level >= 0) {
+				tiff_level = focal_planes_in_file[level][ATMOST(focal_plane, focal_plane_counts[level] - 1)];
+			}
+			level_image->tiff_level = tiff_level;
+			level_image->source_level = level;
+			if (tiff_level >= 0) {
+				tiff_ifd_t* ifd = tiff.level_images + tiff_level;
+				level_image->tile_count = ifd->tile_count;
+				level_image->width_in_tiles = ifd->width_in_tiles;
+				level_image->height_in_tiles = ifd->height_in_tiles;
+				level_image->um_per_pixel_x = ifd->um_per_pixel_x;
+				level_image->um_per_pixel_y = ifd->um_per_pixel_y;
+				level_image->x_tile_side_in_um = ifd->x_tile_side_in_um;
+				level_image->y_tile_side_in_um = ifd->y_tile_side_in_um;
+				level_image->tile_width = ifd->tile_width;
+				level_image->tile_height = ifd->tile_height;
+				init_tile_table(level_image);
+				// Note: the empty tiles are marked once the tile tables are loaded, see load_tile_tables_for_level()
+			} else {
+				// Synthesized level: use the nearest finer level that is present in the file (libjpeg can scale down
+				// at most 8x while decoding, so that level should not be more than 3 levels away).
+				i32 source_level = level - 1;
+				while (levels_in_file[source_level] < 0) {
+					--source_level;
+				}
+				level_image_t* source = levels + source_level;
+				i32 shift = level - source_level;
+				level_image->source_level = source_level;
+				if (shift > 3 && !tiff.is_remote && init_generated_tiff_level(&new_image, focal_plane, level)) {
+					continue; // generated in memory instead (see generated_levels.c)
+				}
+				level_image->source_scale_shift = shift;
+				level_image->width_in_tiles = (source->width_in_tiles + (1 << shift) - 1) >> shift;
+				level_image->height_in_tiles = (source->height_in_tiles + (1 << shift) - 1) >> shift;
+				level_image->tile_count = level_image->width_in_tiles * level_image->height_in_tiles;
+				level_image->um_per_pixel_x = source->um_per_pixel_x * (float)(1 << shift);
+				level_image->um_per_pixel_y = source->um_per_pixel_y * (float)(1 << shift);
+				level_image->x_tile_side_in_um = source->x_tile_side_in_um * (float)(1 << shift);
+				level_image->y_tile_side_in_um = source->y_tile_side_in_um * (float)(1 << shift);
+				level_image->tile_width = source->tile_width;
+				level_image->tile_height = source->tile_height;
+				init_tile_table(level_image);
+				if (shift > 3) {
+					// Too far away, cannot synthesize this level (and too large to generate); it will simply not be drawn.
+					for (i32 tile_y = 0; tile_y < level_image->height_in_tiles; ++tile_y) {
+						for (i32 tile_x = 0; tile_x < level_image->width_in_tiles; ++tile_x) {
+							mark_tile_empty(level_image, tile_x, tile_y);
+						}
+					}
+				}
+			}
+		}
+	}
+	if (overlay_of) {
+		new_image.overlay_of_image_id = overlay_of->image_id;
+		new_image.overlay_opacity = 0.5f;
+		new_image.overlay_colormap = OVERLAY_COLORMAP_JET;
+		fit_overlay_to_image(&new_image, overlay_of);
+	}
+	image_t* image = push_loaded_image(app_state, &new_image, identity);
+	preload_tiles_from_header(image);
+	start_level_generation(image);
+	start_tissue_mask_computation(image);
+
+	i32 coarsest_stored_level = image->level_count - 1;
+	while (coarsest_stored_level > 0 && image->level_images[coarsest_stored_level].tiff_level < 0) {
+		--coarsest_stored_level;
+	}
+	bool32 is_coarsest_level_loading = load_coarsest_level_first(image, coarsest_stored_level);
+
+	// Load the (other) tile tables in the background, coarsest level first (that is what is shown first).
+	for (i32 i = image->focal_plane_count * image->level_count - 1; i >= 0; --i) {
+		i32 focal_plane = i % image->focal_plane_count;
+		i32 level = i / image->focal_plane_count;
+		if (get_focal_plane_levels(image, focal_plane)[level].tiff_level < 0) continue;
+		if (level == coarsest_stored_level && focal_plane == image->focal_plane && is_coarsest_level_loading) continue;
+		load_tile_task_t* task = (load_tile_task_t*) malloc(sizeof(load_tile_task_t));
+		*task = (load_tile_task_t){ .image = image, .focal_plane = focal_plane, .level = level };
+		interlocked_increment(&image->tile_table_loads_in_flight);
+		if (!add_work_queue_entry(&work_queue, load_tile_tables_func, task)) {
+			load_tile_tables_func(0, task); // queue is full, do it now
+		}
+	}
+	return image;
+}
+
+void add_image_from_tiff(app_state_t* app_state, tiff_t tiff, const char* identity) {
+	image_t* image = load_tiff_image(app_state, tiff, identity, NULL);
+	reset_scene(image, &app_state->scenes[0]);
+}
+
+bool file_exists(const char* filename) {
+	return (access(filename, F_OK) != -1);
+}
+
+// Files that the built-in TIFF backend cannot handle (or formats other than TIFF) are opened using OpenSlide.
+bool32 load_image_using_openslide(app_state_t* app_state, const char* filename) {
+	bool32 result = false;
+	if (!is_openslide_available) {
+		printf("Can't try to load %s using OpenSlide, because OpenSlide is not available\n", filename);
+		return false;
+	}
+	image_t image = (image_t){};
+
+	image.type = IMAGE_TYPE_WSI;
+	wsi_t* wsi = &image.wsi.wsi;
+	load_wsi(wsi, filename);
+	if (wsi->osr) {
+		image.is_freshly_loaded = true;
+		image.mpp_x = wsi->mpp_x;
+		image.mpp_y = wsi->mpp_y;
+		image.width_in_pixels = wsi->width;
+		image.width_in_um = wsi->width * wsi->mpp_x;
+		image.height_in_pixels = wsi->height;
+		image.height_in_um = wsi->height * wsi->mpp_y;
+		if (wsi->level_count > 0 && wsi->levels[0].x_tile_side_in_um > 0) {
+
+			image.level_count = wsi->level_count;
+			image.level_images = (level_image_t*) calloc(1, wsi->level_count * sizeof(level_image_t));
+
+			for (i32 i = 0; i < wsi->level_count; ++i) {
+				level_image_t* level_image = image.level_images + i;
+				level_image->tiff_level = i;
+				level_image->source_level = i;
+				wsi_level_t* wsi_level = wsi->levels + i;
+				level_image->tile_count = wsi_level->tile_count;
+				level_image->width_in_tiles = wsi_level->width_in_tiles;
+				level_image->height_in_tiles = wsi_level->height_in_tiles;
+				level_image->um_per_pixel_x = wsi_level->um_per_pixel_x;
+				level_image->um_per_pixel_y = wsi_level->um_per_pixel_y;
+				level_image->x_tile_side_in_um = wsi_level->x_tile_side_in_um;
+				level_image->y_tile_side_in_um = wsi_level->y_tile_side_in_um;
+				level_image->tile_width = TILE_DIM;
+				level_image->tile_height = TILE_DIM;
+				init_tile_table(level_image);
+				// Note: OpenSlide doesn't allow us to quickly check if tiles are empty or not.
+			}
+		}
+
+		reset_scene(&image, &app_state->scenes[0]);
+		push_loaded_image(app_state, &image, filename);
+		result = true;
+
+	}
+	return result;
+}
+
+// Can the tiles of all the levels be loaded by the built-in TIFF backend? Only (baseline) JPEG compressed tiles, and
+// JPEG 2000 compressed tiles if OpenJPEG is available, up to TILE_DIM x TILE_DIM are supported: smaller tiles fill part
+// of a tile buffer and texture (see pad_tile_edges()).
+bool32 can_load_tiff_tiles(tiff_t* tiff) {
+	if (tiff->level_count == 0) return false;
+	for (i32 i = 0; i < tiff->level_count; ++i) {
+		tiff_ifd_t* ifd = tiff->level_images + i;
+		bool32 is_supported_compression = (ifd->compression == TIFF_COMPRESSION_JPEG) ||
+		                                  (is_jpeg2000_compression(ifd->compression) && init_jpeg2000_decoder());
+		if (!is_supported_compression || ifd->tile_width > TILE_DIM || ifd->tile_height > TILE_DIM) {
+			printf("TIFF level %d: compression %d, %ux%u tiles: not supported by the built-in TIFF backend\n", i,
+			       ifd->compression, ifd->tile_width, ifd->tile_height);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool32 open_image_file(app_state_t* app_state, const char *filename, bool32 load_xml_annotations);
+
+bool32 load_generic_file(app_state_t *app_state, const char *filename) {
+	const char* ext = get_file_extension(filename);
+	if (strcasecmp(ext, "json") == 0) {
+		reload_global_caselist(app_state, filename);
+		show_slide_list_window = true;
+		return true;
+	} else if (strcasecmp(ext, "xml") == 0 || strcasecmp(ext, "geojson") == 0) {
+		load_annotations_in_background(app_state, filename);
+		return true;
+	} else {
+		// assume it is an image file?
+		reset_global_caselist(app_state);
+		cancel_background_annotation_loads(); // those would belong to the previous image
+		return open_image_file(app_state, filename, true);
+	}
+}
+
+// Checks if there is an associated ASAP XML annotations file (or else a GeoJSON file, e.g. exported from QuPath)
+void load_associated_xml_annotations(app_state_t* app_state, const char* filename) {
+	size_t len = strlen(filename);
+	size_t temp_size = len + 9; // add 9 so that we can always append ".geojson\0"
+	char* temp_filename = alloca(temp_size);
+	strncpy(temp_filename, filename, temp_size);
+	replace_file_extension(temp_filename, temp_size, "xml");
+	if (file_exists(temp_filename)) {
+		printf("Found XML annotations: %s\n", temp_filename);
+		load_annotations_in_background(app_state, temp_filename);
+		return;
+	}
+	replace_file_extension(temp_filename, temp_size, "geojson");
+	if (file_exists(temp_filename)) {
+		printf("Found GeoJSON annotations: %s\n", temp_filename);
+		load_annotations_in_background(app_state, temp_filename);
+	}
+}
+
+// A PNG/JPEG that is too large to show as a single texture is shown tiled, like a slide; all of its levels are
+// generated in the background (see generated_levels.c). Unknown resolution: 1 pixel = 1 um.
+static void add_raster_image(app_state_t* app_state, const char* filename, i32 width, i32 height) {
+	image_t new_image = (image_t){};
+	new_image.type = IMAGE_TYPE_RASTER;
+	new_image.is_freshly_loaded = true;
+	new_image.mpp_x = 1.0f;
+	new_image.mpp_y = 1.0f;
+	new_image.width_in_pixels = width;
+	new_image.width_in_um = width;
+	new_image.height_in_pixels = height;
+	new_image.height_in_um = height;
+
+	i32 level_count = 1;
+	while (level_count < IMAGE_MAX_LEVELS && ((width - 1) >> (level_count - 1) >= TILE_DIM ||
+	                                          (height - 1) >> (level_count - 1) >= TILE_DIM)) {
+		++level_count;
+	}
+	new_image.level_count = level_count;
+	new_image.level_images = (level_image_t*) calloc(1, level_count * sizeof(level_image_t));
+	u32 level_width = width;
+	u32 level_height = height;
+	for (i32 level = 0; level < level_count; ++level) {
+		level_image_t* level_image = new_image.level_images + level;
+		level_image->source_level = level;
+		level_image->generated_width = level_width;
+		level_image->generated_height = level_height;
+		init_generated_level(level_image, (float)(1 << level), (float)(1 << level));
+		level_width = (level_width + 1) / 2;
+		level_height = (level_height + 1) / 2;
+	}
+
+	reset_scene(&new_image, &app_state->scenes[0]);
+	image_t* image = push_loaded_image(app_state, &new_image, filename);
+	start_level_generation(image);
+}
+
+// TIFF files are opened in the background (see slide_open.c); the previous image stays up until the new one is ready.
+static bool32 open_image_file(app_state_t* app_state, const char *filename, bool32 load_xml_annotations) {
+	cancel_slide_open(); // (it would replace this one once done)
+	if (switch_to_loaded_image(app_state, filename)) {
+		return true;
+	}
+
+	bool32 result = false;
+	const char* ext = get_file_extension(filename);
+
+	i32 raster_width = 0, raster_height = 0, raster_channels = 0;
+	bool32 is_raster = (strcasecmp(ext, "png") == 0 || strcasecmp(ext, "jpg") == 0);
+	if (is_raster && stbi_info(filename, &raster_width, &raster_height, &raster_channels) &&
+	    (raster_width > LARGE_RASTER_IMAGE_DIM || raster_height > LARGE_RASTER_IMAGE_DIM)) {
+		add_raster_image(app_state, filename, raster_width, raster_height);
+		result = true;
+	} else if (is_raster) {
+		// Load using stb_image
+		image_t image = (image_t){};
+		image.type = IMAGE_TYPE_SIMPLE;
+		image.simple.channels = 4; // desired: RGBA
+		image.simple.pixels = stbi_load(filename, &image.simple.width, &image.simple.height, &image.simple.channels_in_file, 4);
+		if (image.simple.pixels) {
+			// Note: the shader samples from a texture array, so we upload the image as an array with a single layer
+			glGenTextures(1, &image.simple.texture);
+			//glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, image.simple.texture);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, image.simple.width, image.simple.height, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, image.simple.pixels);
+
+			image.is_freshly_loaded = true;
+			push_loaded_image(app_state, &image, filename);
+			result = true;
+
+			//stbi_image_free(image->stbi.pixels);
+		}
+
+	} else {
+		bool32 is_tiff = (strcasecmp(ext, "tiff") == 0 || strcasecmp(ext, "tif") == 0 || strcasecmp(ext, "svs") == 0);
+		if (app_state->use_builtin_tiff_backend && is_tiff) {
+			return start_local_slide_open(app_state, filename, load_xml_annotations);
+		}
+		result = load_image_using_openslide(app_state, filename);
+	}
+	if (result && load_xml_annotations) {
+		load_associated_xml_annotations(app_state, filename);
+	} else if (!result) {
+		printf("Could not load '%s'\n", filename);
+	}
+	return result;
+
+}
+
+bool32 load_image_from_file(app_state_t* app_state, const char *filename) {
+	return open_image_file(app_state, filename, false);
+}
+
+// Loads a TIFF (e.g. a heatmap of a model's predictions, as a grayscale pyramid) as the overlay of the displayed
+// image, replacing the overlay it had. The overlay is loaded in the same way, and shares the tile cache, with the
+// images themselves; it is drawn over the image in every scene that shows that image.
+bool32 load_overlay_from_file(app_state_t* app_state, const char* filename) {
+	if (sb_count(app_state->loaded_images) == 0) {
+		return false; // nothing to draw it over
+	}
+	image_t* image = app_state->loaded_images[app_state->displayed_image];
+	if (image->type == IMAGE_TYPE_SIMPLE) {
+		printf("Can't show an overlay over a non-tiled image\n");
+		return false;
+	}
+	tiff_t tiff = {0};
+	if (!(open_tiff_file(&tiff, filename) && can_load_tiff_tiles(&tiff))) {
+		tiff_destroy(&tiff);
+		printf("Could not load '%s' as an overlay\n", filename);
+		return false;
+	}
+	close_overlay_for_image(app_state, image);
+	u32 image_id = image->image_id;
+	load_tiff_image(app_state, tiff, filename, image);
+	// Keep displaying the image itself (which may have moved, if another image had to be unloaded to make room).
+	i32 displayed_image = -1;
+	for (i32 i = 0; i < sb_count(app_state->loaded_images); ++i) {
+		if (app_state->loaded_images[i]->image_id == image_id) {
+			displayed_image = i;
+		}
+	}
+	if (displayed_image < 0) {
+		// The image itself had to make room (all loaded images are in view); the overlay has nothing to go over.
+		unload_image_at_index(app_state, sb_count(app_state->loaded_images) - 1);
+		return false;
+	}
+	app_state->displayed_image = displayed_image;
+	return true;
+}
+
+i32 tile_pos_from_world_pos(float world_pos, float tile_side) {
+	ASSERT(tile_side > 0);
+	float tile_float = (world_pos / tile_side);
+	float tile = (i32)floorf(tile_float);
+	return tile;
+}
+
+// Keeps track of which of the visible tiles of a level are opaque: either loaded, or hidden under finer tiles.
+typedef struct tile_coverage_t {
+	level_image_t* level_image;
+	i32 tile_x1, tile_y1; // visible range of tiles
+	i32 width, height;
+	u8* is_opaque;
+} tile_coverage_t;
+
+// Checks whether the area of a tile is completely covered by opaque tiles from the next finer level.
+// Only the visible part of the tile is taken into account.
+static bool32 is_tile_covered_by_finer_level(tile_coverage_t* finer, level_image_t* level_image, i32 tile_x, i32 tile_y) {
+	if (!finer->is_opaque) {
+		return false;
+	}
+	float x0 = tile_x * level_image->x_tile_side_in_um;
+	float y0 = tile_y * level_image->y_tile_side_in_um;
+	float x1 = x0 + level_image->x_tile_side_in_um;
+	float y1 = y0 + level_image->y_tile_side_in_um;
+	float finer_side_x = finer->level_image->x_tile_side_in_um;
+	float finer_side_y = finer->level_image->y_tile_side_in_um;
+	// Note: small tolerance, so that tiles that only touch the border (because of float rounding) are not counted
+	i32 fx1 = (i32)floorf(x0 / finer_side_x + 0.001f);
+	i32 fy1 = (i32)floorf(y0 / finer_side_y + 0.001f);
+	i32 fx2 = (i32)ceilf(x1 / finer_side_x - 0.001f);
+	i32 fy2 = (i32)ceilf(y1 / finer_side_y - 0.001f);
+	fx1 = ATLEAST(fx1, finer->tile_x1);
+	fy1 = ATLEAST(fy1, finer->tile_y1);
+	fx2 = ATMOST(fx2, finer->tile_x1 + finer->width);
+	fy2 = ATMOST(fy2, finer->tile_y1 + finer->height);
+	if (fx1 >= fx2 || fy1 >= fy2) {
+		return false;
+	}
+	for (i32 fy = fy1; fy < fy2; ++fy) {
+		u8* row = finer->is_opaque + (fy - finer->tile_y1) * finer->width;
+		for (i32 fx = fx1; fx < fx2; ++fx) {
+			if (!row[fx - finer->tile_x1]) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool32 was_button_pressed(button_state_t* button) {
+	bool32 result = button->down && button->transition_count > 0;
+	return result;
+}
+
+bool32 was_button_released(button_state_t* button) {
+	bool32 result = (!button->down) && button->transition_count > 0;
+	return result;
+}
+
+bool32 was_key_pressed(input_t* input, i32 keycode) {
+	u8 key = keycode & 0xFF;
+	button_state_t* button = &input->keyboard.keys[key];
+	bool32 result = was_button_pressed(button);
+	return result;
+}
+
+bool32 is_key_down(input_t* input, i32 keycode) {
+	u8 key = keycode & 0xFF;
+	bool32 result = input->keyboard.keys[key].down;
+	return result;
+}
+
+
+i64 zoom_in_key_hold_down_start_time;
+i64 zoom_in_key_times_zoomed_while_holding;
+i64 zoom_out_key_hold_down_start_time;
+i64 zoom_out_key_times_zoomed_while_holding;
+
+// a 'frame of reference' and coordinate system for drawing 2d objects and making sense of the world
+typedef struct {
+	v2f view_pos; // camera position (at top left corner of the screen)
+} layer_t;
+
+layer_t basic_image_layer;
+
+
+int priority_cmp_func (const void* a, const void* b) {
+	return ( (*(load_tile_task_t*)b).priority - (*(load_tile_task_t*)a).priority );
+}
+
+void init_scene(app_state_t *app_state, scene_t *scene) {
+	memset(scene, 0, sizeof(scene_t));
+	scene->clear_color = app_state->clear_color;
+	scene->entity_count = 1; // NOTE: entity 0 = null entity, so start from 1
+	scene->camera = (v2f){0.0f, 0.0f}; // center camera at origin
+	scene->pixel_width = 1.0f;
+	scene->pixel_height = 1.0f;
+	scene->initialized = true;
+}
+
+void init_app_state(app_state_t* app_state) {
+	ASSERT(!app_state->initialized); // check sanity
+	ASSERT(app_state->temp_storage_memory == NULL);
+	memset(app_state, 0, sizeof(app_state_t));
+
+	size_t temp_storage_size = MEGABYTES(16); // Note: what is a good size to use here?
+	app_state->temp_storage_memory = platform_alloc(temp_storage_size);
+	memory_stats_add(MEMORY_DOMAIN_THREAD_MEMORY, temp_storage_size);
+	init_arena(&app_state->frame_arena, temp_storage_size, app_state->temp_storage_memory);
+
+	app_state->clear_color = (v4f){0.95f, 0.95f, 0.95f, 1.00f};
+	init_color_adjustments(&app_state->image_adjustments);
+	app_state->image_adjustments.master.black_level = 0.10f;
+	app_state->image_adjustments.master.white_level = 0.95f;
+	app_state->use_builtin_tiff_backend = true; // If disabled, revert to OpenSlide when loading TIFF files.
+	app_state->tile_cache_budget_in_mb = 1024;
+	app_state->enable_prefetch = true;
+	app_state->enable_readahead = true;
+	app_state->enable_low_latency_frame_pacing = true;
+	app_state->decode_minified_tiles_at_reduced_size = true;
+	app_state->blend_zoom_levels = true;
+	app_state->tile_upload_budget_in_ms = 4.0f;
+	app_state->compressed_tile_cache_budget_in_mb = 512;
+	app_state->adapt_remote_tile_quality = true;
+	app_state->scene_count = 1;
+	app_state->link_scene_cameras = true;
+	tile_cache_init(&global_tile_cache, (i64)app_state->compressed_tile_cache_budget_in_mb * MEGABYTES(1), 65536);
+	shared_tile_cache_open(&global_shared_tile_cache); // (without it, every instance downloads its own tiles)
+	app_state->initialized = true;
+}
+
+void autosave(app_state_t* app_state, bool force_ignore_delay) {
+	annotation_set_t* annotation_set = &app_state->scenes[0].annotation_set;
+	autosave_annotations(app_state, annotation_set, force_ignore_delay);
+}
+
+
+
+#define PREFETCH_MAX_TILES 32
+#define PREFETCH_LOOKAHEAD_SECONDS 0.5f
+#define FOCAL_PLANE_PREFETCH_MAX_TILES 64 // (a separate budget, enough for the view on both adjacent planes)
+
+// Wants tiles in the given region that are not in view; used for predicting where the camera is going next.
+// The tiles are added to the wishlist at low priority, and count against max_tiles (also if already requested
+// earlier), so that the total amount of prefetching stays bounded. Prefetched tiles that are not wanted anymore get
+// cancelled like any other stale request.
+static void prefetch_tiles_in_region(app_state_t* app_state, image_t* image, i32 focal_plane, i32 level,
+                                     v2f region_min, v2f region_max, v2f region_center, float region_radius,
+                                     i32 base_priority, i32* max_tiles) {
+	level_image_t* level_image = get_focal_plane_levels(image, focal_plane) + level;
+	tile_range_t range = get_tile_range_in_region(level_image, region_min, region_max);
+	tile_iterator_t it = begin_tile_iteration(level_image, range, true);
+	while (next_tile(&it)) {
+		if (*max_tiles <= 0) return;
+		tile_t* tile = it.tile;
+		i32 tile_x = it.tile_x;
+		i32 tile_y = it.tile_y;
+		if (tile->state == TILE_STATE_LOADED || tile->time_last_wanted == app_state->frame_counter) {
+			continue; // nothing to do, or already wanted this frame (e.g. because it is in view)
+		}
+		if (!is_tissue_in_tile(image, level_image, tile_x, tile_y)) {
+			continue; // only glass: not worth the bandwidth, unless it actually comes into view
+		}
+		float dx = (region_center.x - ((tile_x + 0.5f) * level_image->x_tile_side_in_um));
+		float dy = (region_center.y - ((tile_y + 0.5f) * level_image->y_tile_side_in_um));
+		float distance = sqrtf(SQUARE(dx) + SQUARE(dy)) / ATLEAST(1.0f, region_radius);
+		// Same as for visible tiles: coarser levels first, and closest to where the camera is expected to be.
+		tile->priority = base_priority + (image->level_count - level) * 100 + (i32)((1.0f - distance) * VISIBLE_TILE_PRIORITY_BONUS);
+		tile->time_last_wanted = app_state->frame_counter;
+		--*max_tiles;
+		++app_state->prefetched_tile_count;
+
+		if (tile->state == TILE_STATE_UNLOADED) {
+			sb_push(app_state->tile_wishlist, ((load_tile_task_t){
+					.image = image, .tile = tile, .focal_plane = focal_plane, .level = level,
+					.tile_x = tile_x, .tile_y = tile_y, .priority = tile->priority,
+			}));
+		}
+	}
+}
+
+#define SCENE_VIEWPORT_GAP 2 // in pixels; the background shows through between the scenes, as a divider
+
+// Splits the client area between the scenes: side by side, or in a 2x2 grid for four scenes.
+static void layout_scene_viewports(app_state_t* app_state, i32 scene_count, i32 client_width, i32 client_height) {
+	i32 columns = (scene_count == 4) ? 2 : scene_count;
+	i32 rows = (scene_count == 4) ? 2 : 1;
+	for (i32 i = 0; i < scene_count; ++i) {
+		i32 column = i % columns;
+		i32 row = i / columns;
+		i32 x1 = client_width * column / columns;
+		i32 x2 = client_width * (column + 1) / columns;
+		i32 y1 = client_height * row / rows;
+		i32 y2 = client_height * (row + 1) / rows;
+		if (column + 1 < columns) x2 -= SCENE_VIEWPORT_GAP;
+		if (row + 1 < rows) y2 -= SCENE_VIEWPORT_GAP;
+		app_state->scenes[i].viewport = (rect2i){ x1, y1, ATLEAST(1, x2 - x1), ATLEAST(1, y2 - y1) };
+	}
+}
+
+// Scene 0 shows the displayed image. The other scenes keep their image for as long as it stays loaded; otherwise
+// they get the most recently displayed image that is not shown yet, or else the same image as scene 0 (so that it
+// can be viewed at different zoom levels side by side). Simple (non-tiled) images are only shown in scene 0, and
+// overlays only over their image.
+static image_t* get_image_for_scene(app_state_t* app_state, i32 scene_index) {
+	scene_t* scene = app_state->scenes + scene_index;
+	image_t* displayed_image = app_state->loaded_images[app_state->displayed_image];
+	image_t* image = NULL;
+	if (scene_index == 0) {
+		image = displayed_image;
+	} else {
+		image = find_loaded_image(app_state, scene->image_id);
+		if (!image) {
+			for (i32 i = 0; i < sb_count(app_state->loaded_images); ++i) {
+				image_t* candidate = app_state->loaded_images[i];
+				if (candidate->type == IMAGE_TYPE_SIMPLE || candidate->overlay_of_image_id != 0) continue;
+				bool32 is_shown = false;
+				for (i32 j = 0; j < scene_index; ++j) {
+					if (app_state->scenes[j].image_id == candidate->image_id) is_shown = true;
+				}
+				if (!is_shown && (!image || candidate->frame_last_displayed > image->frame_last_displayed)) {
+					image = candidate;
+				}
+			}
+			if (!image && displayed_image->type != IMAGE_TYPE_SIMPLE) {
+				image = displayed_image;
+			}
+			if (!image) return NULL;
+		}
+	}
+	if (scene->image_id != image->image_id) {
+		scene->image_id = image->image_id;
+		if (scene_index > 0) {
+			reset_scene(image, scene);
+			if (app_state->link_scene_cameras) {
+				scene->camera = app_state->scenes[0].camera;
+			}
+		}
+	}
+	return image;
+}
+
+void get_scene_camera_bounds(scene_t* scene, v2f* camera_min, v2f* camera_max) {
+	float r_minus_l = scene->pixel_width * (float) scene->viewport.w;
+	float t_minus_b = scene->pixel_height * (float) scene->viewport.h;
+	*camera_min = (v2f){ scene->camera.x - r_minus_l * 0.5f, scene->camera.y - t_minus_b * 0.5f };
+	*camera_max = (v2f){ scene->camera.x + r_minus_l * 0.5f, scene->camera.y + t_minus_b * 0.5f };
+}
+
+#define JUMP_CATCH_UP_SPEED 10.0f // the share of the remaining distance covered per second (exponential)
+#define JUMP_DESTINATION_MAX_TILES 256
+
+// Moves the camera to the target (e.g. after clicking on the overview), with a short animation. The tiles at the
+// destination are requested right away, so that they are on their way by the time the camera arrives (see
+// add_jump_destination_to_wishlist()).
+void jump_scene_camera(scene_t* scene, v2f target) {
+	scene->jump_target = target;
+	scene->is_jumping = true;
+}
+
+// Zooming and panning (only if the scene receives the input), and the zoom and jump animations.
+static void update_scene_camera(app_state_t* app_state, scene_t* scene, image_t* image, input_t* input,
+                                v2i current_drag_vector, bool32 scene_clicked, float delta_t) {
+	i32 old_level = scene->current_level;
+	i32 center_offset_x = 0;
+	i32 center_offset_y = 0;
+	i32 viewport_width = scene->viewport.w;
+	i32 viewport_height = scene->viewport.h;
+
+	i32 max_level = image->level_count - 1;
+	scene->current_level = CLAMP(scene->current_level, 0, max_level);
+	level_image_t* level_image = image->level_images + scene->current_level;
+
+	// TODO: move all input handling code together
+	if (input) {
 
+		i32 dlevel = 0;
+		bool32 used_mouse_to_zoom = false;
 
-			}
-			free(read_buffer);
-		} else {
-			// To submit an async I/O request on Win32, we need to fill in an OVERLAPPED structure with the
-			// offset in the file where we want to do the read operation
-			LARGE_INTEGER offset = {.QuadPart = (i64)tile_offset};
-			thread_memory->overlapped = (OVERLAPPED) {};
-			thread_memory->overlapped.Offset = offset.LowPart;
-			thread_memory->overlapped.OffsetHigh = (DWORD)offset.HighPart;
-			thread_memory->overlapped.hEvent = thread_memory->async_io_event;
-			ResetEvent(thread_memory->async_io_event); // reset the event to unsignaled state
-
-			if (!ReadFile(tiff->win32_file_handle, compressed_tile_data,
-			              compressed_tile_size_in_bytes, NULL, &thread_memory->overlapped)) {
-				DWORD error = GetLastError();
-				if (error != ERROR_IO_PENDING) {
-					win32_diagnostic("ReadFile");
-				}
-			}
+		// Zoom in or out using the mouse wheel; with Ctrl held down, focus up or down through a z-stack instead.
+		bool32 is_z_stack = (image->focal_plane_count > 1 && image->channel_count == 0);
+		if (input->mouse_z != 0 && is_z_stack && is_key_down(input, KEYCODE_CONTROL)) {
+			set_focal_plane(image, image->focal_plane + (input->mouse_z > 0 ? -1 : 1));
+		} else if (input->mouse_z != 0) {
+			dlevel = (input->mouse_z > 0 ? -1 : 1);
+			used_mouse_to_zoom = true;
+		}
+		// Focus using Page Up / Page Down
+		if (is_z_stack && was_key_pressed(input, KEYCODE_PRIOR)) {
+			set_focal_plane(image, image->focal_plane - 1);
+		}
+		if (is_z_stack && was_key_pressed(input, KEYCODE_NEXT)) {
+			set_focal_plane(image, image->focal_plane + 1);
+		}
 
-			// Wait for the result of the I/O operation (blocking, because we specify bWait=TRUE)
-			DWORD bytes_read = 0;
-			if (!GetOverlappedResult(tiff->win32_file_handle, &thread_memory->overlapped, &bytes_read, TRUE)) {
-				win32_diagnostic("GetOverlappedResult");
-			}
-			// This should not be strictly necessary, but do it just in case GetOverlappedResult exits early (paranoia)
-			if(WaitForSingleObject(thread_memory->overlapped.hEvent, INFINITE) != WAIT_OBJECT_0) {
-				win32_diagnostic("WaitForSingleObject");
-			}
+		float key_repeat_interval = 0.2f; // in seconds
 
+		// Zoom out using Z or /
+		if (is_key_down(input, 'Z') || is_key_down(input, KEYCODE_OEM_2 /* '/' */)) {
 
-			if (compressed_tile_data[0] == 0xFF && compressed_tile_data[1] == 0xD9) {
-				// JPEG stream is empty
+			if (was_key_pressed(input, 'Z') || was_key_pressed(input, KEYCODE_OEM_2 /* '/' */)) {
+				dlevel += 1;
+				zoom_in_key_hold_down_start_time = get_clock();
+				zoom_in_key_times_zoomed_while_holding = 0;
 			} else {
-				if (decode_tile(jpeg_tables, jpeg_tables_length, compressed_tile_data, compressed_tile_size_in_bytes,
-				                temp_memory, (level_ifd->color_space == TIFF_PHOTOMETRIC_YCBCR))) {
-//		            printf("thread %d: successfully decoded level %d, tile %d (%d, %d)\n", logical_thread_index, level, tile_index, tile_x, tile_y);
-				} else {
-					printf("thread %d: failed to decode level %d, tile %d (%d, %d)\n", logical_thread_index, level, tile_index, tile_x, tile_y);
+				float time_elapsed = get_seconds_elapsed(zoom_in_key_hold_down_start_time, get_clock());
+				int zooms = (int) (time_elapsed / key_repeat_interval);
+				if ((zooms - zoom_in_key_times_zoomed_while_holding) == 1) {
+					zoom_in_key_times_zoomed_while_holding = zooms;
+					dlevel += 1;
 				}
 			}
-
 		}
 
-		// Trim the tile (replace with transparent color) if it extends beyond the image size
-		// TODO: anti-alias edge?
-		i32 new_tile_height = TILE_DIM;
-		i32 pitch = TILE_DIM * BYTES_PER_PIXEL;
-		if (tile_y_excess > 0) {
-			i32 excess_rows = (int)(tile_y_excess / level_image->y_tile_side_in_um * TILE_DIM);
-			ASSERT(excess_rows >= 0);
-			new_tile_height = TILE_DIM - excess_rows;
-			memset(temp_memory + (new_tile_height * pitch), 0, excess_rows * pitch);
-		}
-		if (tile_x_excess > 0) {
-			i32 excess_pixels = (int)(tile_x_excess / level_image->x_tile_side_in_um * TILE_DIM);
-			ASSERT(excess_pixels >= 0);
-			i32 new_tile_width = TILE_DIM - excess_pixels;
-			for (i32 row = 0; row < new_tile_height; ++row) {
-				u8* write_pos = temp_memory + (row * pitch) + (new_tile_width * BYTES_PER_PIXEL);
-				memset(write_pos, 0, excess_pixels * BYTES_PER_PIXEL);
+		// Zoom in using X or .
+		if (is_key_down(input, 'X') || is_key_down(input, KEYCODE_OEM_PERIOD)) {
+			if (was_key_pressed(input, 'X') || was_key_pressed(input, KEYCODE_OEM_PERIOD)) {
+				dlevel -= 1;
+				zoom_out_key_hold_down_start_time = get_clock();
+				zoom_out_key_times_zoomed_while_holding = 0;
+			} else {
+				float time_elapsed = get_seconds_elapsed(zoom_out_key_hold_down_start_time, get_clock());
+				int zooms = (int) (time_elapsed / key_repeat_interval);
+				if ((zooms - zoom_out_key_times_zoomed_while_holding) == 1) {
+					zoom_out_key_times_zoomed_while_holding = zooms;
+					dlevel -= 1;
+				}
 			}
 		}
 
-	} else if (image->type == IMAGE_TYPE_WSI) {
-		wsi_t* wsi = &image->wsi.wsi;
-		i64 x = (tile_x * TILE_DIM) << level;
-		i64 y = (tile_y * TILE_DIM) << level;
-		openslide.openslide_read_region(wsi->osr, (u32*)temp_memory, x, y, level, TILE_DIM, TILE_DIM);
-	} else {
-		printf("thread %d: tile level %d, tile %d (%d, %d): unsupported image type\n", logical_thread_index, level, tile_index, tile_x, tile_y);
-
-	}
-
 
-//	printf("[thread %d] Loaded tile: level=%d tile_x=%d tile_y=%d\n", logical_thread_index, level, tile_x, tile_y);
+		if (dlevel != 0) {
+//		        printf("mouse_z = %d\n", input->mouse_z);
+			scene->last_zoom_direction = (dlevel < 0) ? -1 : 1;
+			scene->current_level = CLAMP(scene->current_level + dlevel, 0, image->level_count - 1);
+			level_image = image->level_images + scene->current_level;
 
-	finish_up:;
-	glEnable(GL_TEXTURE_2D);
-	u32 new_texture = load_texture(temp_memory, TILE_DIM, TILE_DIM);
-	glFinish(); // Block thread execution until all OpenGL operations have finished.
-	write_barrier;
-	tile->texture = new_texture;
-	free(task_data);
+			if (scene->current_level != old_level && used_mouse_to_zoom) {
+#if 1
+				center_offset_x = (input->mouse_xy.x - scene->viewport.x) - viewport_width / 2;
+				center_offset_y = (input->mouse_xy.y - scene->viewport.y) - viewport_height / 2;
+
+				if (scene->current_level < old_level) {
+					// Zoom in, while keeping the area around the mouse cursor in the same place on the screen.
+					scene->camera.x += center_offset_x * level_image->um_per_pixel_x;
+					scene->camera.y += center_offset_y * level_image->um_per_pixel_y;
+				} else if (scene->current_level > old_level) {
+					// Zoom out, while keeping the area around the mouse cursor in the same place on the screen.
+					scene->camera.x -= center_offset_x * level_image->um_per_pixel_x * 0.5f;
+					scene->camera.y -= center_offset_y * level_image->um_per_pixel_y * 0.5f;
+				}
+#endif
+			}
+		}
 
-}
+	}
 
-bool32 enqueue_load_tile(image_t* image, i32 level, i32 tile_x, i32 tile_y) {
-	load_tile_task_t* task_data = (load_tile_task_t*) malloc(sizeof(load_tile_task_t)); // should be freed after uploading the tile to the gpu
-	*task_data = (load_tile_task_t){ .image = image, .tile = NULL, .level = level, .tile_x = tile_x, .tile_y = tile_y };
 
-	return add_work_queue_entry(&work_queue, load_tile_func, task_data);
 
-}
 
-u32 get_texture_for_tile(image_t* image, i32 level, i32 tile_x, i32 tile_y) {
-	level_image_t* level_image = image->level_images + level;
+	// TODO: fix/rewrite
+	// Spring/bounce effect
+	float d_zoom = (float) scene->current_level - scene->zoom_position;
+	float abs_d_zoom = fabsf(d_zoom);
+	if (abs_d_zoom > 1e-5f) {
+		app_state->allow_idling_next_frame = false;
+	}
+	float sign_d_zoom = signbit(d_zoom) ? -1.0f : 1.0f;
+	float linear_catch_up_speed = 10.0f * delta_t;
+	float exponential_catch_up_speed = 18.0f * delta_t;
+	if (abs_d_zoom > linear_catch_up_speed) {
+		d_zoom = (linear_catch_up_speed + (abs_d_zoom - linear_catch_up_speed) * exponential_catch_up_speed) *
+		         sign_d_zoom;
+	}
+	scene->zoom_position += d_zoom;
 
-	i32 tile_index = tile_y * level_image->width_in_tiles + tile_x;
-	ASSERT(tile_index >= 0 && tile_index < level_image->tile_count);
-	tile_t* tile = level_image->tiles + tile_index;
+	i32 passing_level = (i32)floorf(scene->zoom_position + 1e-3f);
+	if (passing_level != scene->zoom_passing_level) {
+		scene->zoom_passing_level = passing_level;
+		scene->zoom_passing_level_seconds = 0.0f;
+	} else {
+		scene->zoom_passing_level_seconds += delta_t;
+	}
 
-	return tile->texture;
-}
+	scene->pixel_width = powf(2.0f, scene->zoom_position) * image->mpp_x;
+	scene->pixel_height = powf(2.0f, scene->zoom_position) * image->mpp_y;
 
-void load_wsi(wsi_t* wsi, const char* filename) {
-	if (!is_openslide_loading_done) {
-		// TODO: hack! queue abused, may cause conflicts
-		printf("Waiting for OpenSlide to finish loading...\n");
-		while (is_queue_work_in_progress(&work_queue)) {
-			do_worker_work(&work_queue, 0);
+	if (scene->is_jumping) {
+		if (scene->is_dragging) {
+			scene->is_jumping = false; // taken over by the user
+		} else {
+			float catch_up = ATMOST(1.0f, JUMP_CATCH_UP_SPEED * delta_t);
+			scene->camera.x += (scene->jump_target.x - scene->camera.x) * catch_up;
+			scene->camera.y += (scene->jump_target.y - scene->camera.y) * catch_up;
+			if (fabsf(scene->jump_target.x - scene->camera.x) < scene->pixel_width &&
+			    fabsf(scene->jump_target.y - scene->camera.y) < scene->pixel_height) {
+				scene->camera = scene->jump_target;
+				scene->is_jumping = false;
+			}
+			app_state->allow_idling_next_frame = false;
 		}
 	}
 
-	if (!is_openslide_available) {
-		char message[4096];
-		snprintf(message, sizeof(message), "Could not open \"%s\":\nlibopenslide-0.dll is missing or broken.\n", filename);
-		message_box(message);
-		return;
-	}
+	v2f camera_min, camera_max;
+	get_scene_camera_bounds(scene, &camera_min, &camera_max);
 
-	// TODO: check if necessary anymore?
-	unload_wsi(wsi);
+	scene->mouse = scene->camera;
+	if (input) {
 
-	wsi->osr = openslide.openslide_open(filename);
-	if (wsi->osr) {
-		printf("Openslide: opened %s\n", filename);
+		scene->mouse.x = camera_min.x + (float)(input->mouse_xy.x - scene->viewport.x) * scene->pixel_width;
+		scene->mouse.y = camera_min.y + (float)(input->mouse_xy.y - scene->viewport.y) * scene->pixel_height;
 
-		openslide.openslide_get_level0_dimensions(wsi->osr, &wsi->width, &wsi->height);
-		ASSERT(wsi->width > 0);
-		ASSERT(wsi->height > 0);
 
-		wsi->level_count = openslide.openslide_get_level_count(wsi->osr);
-		printf("Openslide: WSI has %d levels\n", wsi->level_count);
-		if (wsi->level_count > WSI_MAX_LEVELS) {
-			panic();
+		// Panning should be faster when zoomed in very far.
+		float panning_multiplier = 1.0f + 3.0f * ((float) max_level - scene->zoom_position) / (float) max_level;
+		if (is_key_down(input, KEYCODE_SHIFT)) {
+			panning_multiplier *= 0.25f;
 		}
 
-
-
-		const char* const* wsi_properties = openslide.openslide_get_property_names(wsi->osr);
-		if (wsi_properties) {
-			i32 property_index = 0;
-			const char* property = wsi_properties[0];
-			for (; property != NULL; property = wsi_properties[++property_index]) {
-				const char* property_value = openslide.openslide_get_property_value(wsi->osr, property);
-				printf("%s = %s\n", property, property_value);
-
-			}
+		// Panning using the arrow or WASD keys.
+		float panning_speed = 900.0f * delta_t * panning_multiplier;
+		if (input->keyboard.action_down.down || is_key_down(input, 'S')) {
+			scene->camera.y += level_image->um_per_pixel_y * panning_speed;
+			mouse_hide();
 		}
-
-		wsi->mpp_x = 0.25f; // microns per pixel (default)
-		wsi->mpp_y = 0.25f; // microns per pixel (default)
-		const char* mpp_x_string = openslide.openslide_get_property_value(wsi->osr, "openslide.mpp-x");
-		const char* mpp_y_string = openslide.openslide_get_property_value(wsi->osr, "openslide.mpp-y");
-		if (mpp_x_string) {
-			float mpp = atof(mpp_x_string);
-			if (mpp > 0.0f) {
-				wsi->mpp_x = mpp;
-			}
+		if (input->keyboard.action_up.down || is_key_down(input, 'W')) {
+			scene->camera.y -= level_image->um_per_pixel_y * panning_speed;
+			mouse_hide();
 		}
-		if (mpp_y_string) {
-			float mpp = atof(mpp_y_string);
-			if (mpp > 0.0f) {
-				wsi->mpp_y = mpp;
-			}
+		if (input->keyboard.action_right.down || is_key_down(input, 'D')) {
+			scene->camera.x += level_image->um_per_pixel_x * panning_speed;
+			mouse_hide();
 		}
-
-		for (i32 i = 0; i < wsi->level_count; ++i) {
-			wsi_level_t* level = wsi->levels + i;
-
-			openslide.openslide_get_level_dimensions(wsi->osr, i, &level->width, &level->height);
-			ASSERT(level->width > 0);
-			ASSERT(level->height > 0);
-			i64 partial_block_x = level->width % TILE_DIM;
-			i64 partial_block_y = level->height % TILE_DIM;
-			level->width_in_tiles = (i32)(level->width / TILE_DIM) + (partial_block_x != 0);
-			level->height_in_tiles = (i32)(level->height / TILE_DIM) + (partial_block_y != 0);
-			level->um_per_pixel_x = (float)(1 << i) * wsi->mpp_x;
-			level->um_per_pixel_y = (float)(1 << i) * wsi->mpp_y;
-			level->x_tile_side_in_um = level->um_per_pixel_x * (float)TILE_DIM;
-			level->y_tile_side_in_um = level->um_per_pixel_y * (float)TILE_DIM;
-			level->tile_count = level->width_in_tiles * level->height_in_tiles;
-			// Note: tiles are now managed by the format-agnostic image_t
-//			level->tiles = calloc(1, level->num_tiles * sizeof(wsi_tile_t));
+		if (input->keyboard.action_left.down || is_key_down(input, 'A')) {
+			scene->camera.x -= level_image->um_per_pixel_x * panning_speed;
+			mouse_hide();
 		}
 
-		const char* barcode = openslide.openslide_get_property_value(wsi->osr, "philips.PIM_DP_UFS_BARCODE");
-		if (barcode) {
-			wsi->barcode = barcode;
+		if (scene->is_dragging) {
+			scene->camera.x -= current_drag_vector.x * level_image->um_per_pixel_x * panning_multiplier;
+			scene->camera.y -= current_drag_vector.y * level_image->um_per_pixel_y * panning_multiplier;
 		}
 
-		const char* const* wsi_associated_image_names = openslide.openslide_get_associated_image_names(wsi->osr);
-		if (wsi_associated_image_names) {
-			i32 name_index = 0;
-			const char* name = wsi_associated_image_names[0];
-			for (; name != NULL; name = wsi_associated_image_names[++name_index]) {
-				i64 w = 0;
-				i64 h = 0;
-				openslide.openslide_get_associated_image_dimensions(wsi->osr, name, &w, &h);
-				printf("%s : w=%lld h=%lld\n", name, w, h);
-
+		// try to select an annotation
+		if (scene->annotation_set.annotation_count > 0) {
+			if (was_key_pressed(input, 'Q') || (!gui_want_capture_mouse && scene_clicked)) {
+				i64 select_begin = get_clock();
+				select_annotation(scene, is_key_down(input, KEYCODE_CONTROL));
+				float selection_ms = get_seconds_elapsed(select_begin, get_clock()) * 1000.0f;
+//					printf("Selecting took %g ms.\n", selection_ms);
 			}
 		}
 
+		if (!gui_want_capture_keyboard && was_key_pressed(input, KEYCODE_DELETE)) {
+			delete_selected_annotations(&scene->annotation_set);
+		}
 
 	}
 
+	// Track how fast the camera is moving, to predict which tiles will be needed next.
+	// Note: compared with the previous frame (not old_level), because linked scenes are moved before this is called.
+	float r_minus_l = camera_max.x - camera_min.x;
+	float t_minus_b = camera_max.y - camera_min.y;
+	v2f camera_delta = { scene->camera.x - scene->previous_camera.x, scene->camera.y - scene->previous_camera.y };
+	if (scene->current_level != scene->previous_level || delta_t <= 0.0f || scene->is_jumping ||
+	    fabsf(camera_delta.x) > r_minus_l || fabsf(camera_delta.y) > t_minus_b) {
+		// Zooming around the mouse cursor (or jumping to a new location) does not count as panning.
+		scene->camera_velocity = (v2f){0.0f, 0.0f};
+	} else {
+		float smoothing = 0.3f;
+		scene->camera_velocity.x = LERP(smoothing, scene->camera_velocity.x, camera_delta.x / delta_t);
+		scene->camera_velocity.y = LERP(smoothing, scene->camera_velocity.y, camera_delta.y / delta_t);
+	}
+	scene->previous_camera = scene->camera;
+	scene->previous_level = scene->current_level;
 }
 
-void unload_texture(u32 texture) {
-	glDeleteTextures(1, &texture);
+// Appends the view to camera_path.txt whenever it changes, while recording is switched on (see the format described
+// in tilebench.c). The file is started over each time recording is switched on.
+static void update_camera_path_recording(app_state_t* app_state, scene_t* scene) {
+	static FILE* fp;
+	static i64 start_clock;
+	static v2f last_camera;
+	static i32 last_level;
+	static rect2i last_viewport;
+	if (!app_state->record_camera_path) {
+		if (fp) {
+			fclose(fp);
+			fp = NULL;
+		}
+		return;
+	}
+	if (!fp) {
+		fp = fopen("camera_path.txt", "w");
+		if (!fp) {
+			printf("Could not open camera_path.txt for writing\n");
+			app_state->record_camera_path = false;
+			return;
+		}
+		fprintf(fp, "# seconds camera_x camera_y level viewport_width viewport_height\n");
+		start_clock = get_clock();
+		last_viewport = (rect2i){}; // make sure the first view is written
+	}
+	if (scene->camera.x != last_camera.x || scene->camera.y != last_camera.y || scene->current_level != last_level ||
+	    scene->viewport.w != last_viewport.w || scene->viewport.h != last_viewport.h) {
+		fprintf(fp, "%.4f %.2f %.2f %d %d %d\n", get_seconds_elapsed(start_clock, get_clock()), scene->camera.x,
+		        scene->camera.y, scene->current_level, scene->viewport.w, scene->viewport.h);
+		last_camera = scene->camera;
+		last_level = scene->current_level;
+		last_viewport = scene->viewport;
+	}
 }
 
-void unload_wsi(wsi_t* wsi) {
-	if (wsi->osr) {
-		openslide.openslide_close(wsi->osr);
-		wsi->osr = NULL;
+bool32 start_camera_path_replay(app_state_t* app_state, const char* filename, bool32 quit_when_done) {
+	FILE* fp = fopen(filename, "r");
+	if (!fp) {
+		printf("Could not open %s\n", filename);
+		return false;
+	}
+	camera_path_replay_t* replay = &app_state->camera_path_replay;
+	sb_free(replay->points);
+	sb_free(replay->frame_times);
+	memset(replay, 0, sizeof(*replay));
+	char line[256];
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#') continue;
+		camera_path_point_t point = {0};
+		if (sscanf(line, "%f %f %f %d %d %d", &point.time, &point.camera.x, &point.camera.y, &point.level,
+		           &point.viewport_width, &point.viewport_height) == 6) {
+			sb_push(replay->points, point);
+		}
+	}
+	fclose(fp);
+	if (sb_count(replay->points) == 0) {
+		printf("%s: no camera path found\n", filename);
+		return false;
 	}
+	replay->is_active = true;
+	replay->quit_when_done = quit_when_done;
+	app_state->record_camera_path = false;
+	tile_metrics_reset();
+	printf("Replaying camera path %s (%d views, %.2f seconds)\n", filename, sb_count(replay->points),
+	       sb_last(replay->points).time);
+	return true;
+}
 
+static int compare_floats(const void* a, const void* b) {
+	float x = *(const float*)a;
+	float y = *(const float*)b;
+	return (x > y) - (x < y);
 }
 
-void unload_image(image_t* image) {
-	if (image) {
-		if (image->type == IMAGE_TYPE_WSI) {
-			unload_wsi(&image->wsi.wsi);
-		} else if (image->type == IMAGE_TYPE_SIMPLE) {
-			if (image->simple.pixels) {
-				stbi_image_free(image->simple.pixels);
-				image->simple.pixels = NULL;
-			}
-			if (image->simple.texture != 0) {
-				unload_texture(image->simple.texture);
-				image->simple.texture = 0;
-			}
-		} else if (image->type == IMAGE_TYPE_TIFF) {
-			tiff_destroy(&image->tiff.tiff);
-		}
-
-		if (image->level_images) {
-			for (i32 i = 0; i < image->level_count; ++i) {
-				level_image_t* level_image = image->level_images + i;
-				if (level_image->tiles) {
-					for (i32 j = 0; j < level_image->tile_count; ++j) {
-						tile_t* tile = level_image->tiles + j;
-						if (tile->texture != 0) {
-							unload_texture(tile->texture);
-						}
-					}
-				}
-				free(level_image->tiles);
-				level_image->tiles = NULL;
-			}
-			free(image->level_images);
-			image->level_images = NULL;
+static void finish_camera_path_replay(app_state_t* app_state, float replay_time) {
+	camera_path_replay_t* replay = &app_state->camera_path_replay;
+	i32 frame_count = sb_count(replay->frame_times);
+	if (frame_count > 0) {
+		float total_time = 0.0f;
+		i32 slow_frame_count = 0;
+		for (i32 i = 0; i < frame_count; ++i) {
+			total_time += replay->frame_times[i];
+			if (replay->frame_times[i] > 2.0f * CAMERA_PATH_REPLAY_FRAME_SECONDS) ++slow_frame_count;
 		}
+		qsort(replay->frame_times, frame_count, sizeof(float), compare_floats);
+		printf("Camera path replay: %d frames in %.2f s, for %.2f s of camera path (including waiting for the last tiles)\n",
+		       frame_count, total_time, replay_time);
+		printf("Frame time (ms): mean %.2f, p50 %.2f, p90 %.2f, p99 %.2f, max %.2f; %d frames slower than %.1f ms\n",
+		       total_time * 1000.0f / frame_count, replay->frame_times[frame_count / 2] * 1000.0f,
+		       replay->frame_times[(frame_count * 90) / 100] * 1000.0f,
+		       replay->frame_times[(frame_count * 99) / 100] * 1000.0f, replay->frame_times[frame_count - 1] * 1000.0f,
+		       slow_frame_count, 2.0f * CAMERA_PATH_REPLAY_FRAME_SECONDS * 1000.0f);
+	}
+	tile_metrics_print();
+	sb_free(replay->points);
+	sb_free(replay->frame_times);
+	bool32 quit_when_done = replay->quit_when_done;
+	memset(replay, 0, sizeof(*replay));
+	if (quit_when_done) {
+		is_program_running = false;
+	}
+}
 
+// While a camera path is being replayed, the active scene follows the recorded views instead of the input, and the
+// frame time is fixed (see camera_path_replay_t). Returns whether the replay is still going on.
+static bool32 update_camera_path_replay(app_state_t* app_state, scene_t* scene, float* delta_t) {
+	camera_path_replay_t* replay = &app_state->camera_path_replay;
+	if (!replay->is_active) return false;
+
+	i64 clock = get_clock();
+	if (replay->frame_index > 0) {
+		sb_push(replay->frame_times, get_seconds_elapsed(replay->last_frame_clock, clock));
+	} else if (scene->viewport.w != replay->points[0].viewport_width ||
+	           scene->viewport.h != replay->points[0].viewport_height) {
+		printf("Note: the camera path was recorded with a %dx%d viewport, but it is replayed with %dx%d\n",
+		       replay->points[0].viewport_width, replay->points[0].viewport_height, scene->viewport.w, scene->viewport.h);
+	}
+	replay->last_frame_clock = clock;
+	float replay_time = (float)replay->frame_index * CAMERA_PATH_REPLAY_FRAME_SECONDS;
+	++replay->frame_index;
+	*delta_t = CAMERA_PATH_REPLAY_FRAME_SECONDS;
+	app_state->allow_idling_next_frame = false;
+
+	i32 point_count = sb_count(replay->points);
+	while (replay->current_point + 1 < point_count && replay->points[replay->current_point + 1].time <= replay_time) {
+		++replay->current_point;
+	}
+	camera_path_point_t* point = replay->points + replay->current_point;
+	scene->camera = point->camera;
+	scene->current_level = point->level;
+
+	// After the last view, keep going until the tiles it needs have arrived (the wishlist for the last view has only
+	// been made in the frame after it was shown).
+	float end_time = point_count > 0 ? replay->points[point_count - 1].time : 0.0f;
+	if (replay_time > end_time + CAMERA_PATH_REPLAY_FRAME_SECONDS) {
+		bool32 is_settled = (tile_request_queue.request_count == 0 && tile_request_queue.loads_in_progress == 0 &&
+		                     app_state->tiles_waiting_for_upload == 0);
+		if (is_settled || replay_time > end_time + CAMERA_PATH_REPLAY_MAX_SETTLE_SECONDS) {
+			finish_camera_path_replay(app_state, replay_time);
+		}
+	}
+	return true;
+}
 
+// Adds the tiles in view that still need to be loaded to the wishlist. If several scenes show the same image, a tile
+// is only added once, and gets the highest priority of the scenes that want it.
+// While the zoom animation is underway, the zoom position lies between two levels. With blending, the finer of the two
+// (the blend level) is drawn translucent over the coarser one, more opaque the closer the zoom is to it; levels that
+// are finer still are not drawn yet. Without blending, everything up to the current level is drawn opaque.
+static i32 get_first_drawn_level(app_state_t* app_state, scene_t* scene, image_t* image, float* blend_alpha) {
+	*blend_alpha = 1.0f;
+	if (!app_state->blend_zoom_levels) {
+		return scene->current_level;
 	}
+	i32 zoom_level = CLAMP((i32)floorf(scene->zoom_position), 0, image->level_count - 1);
+	float fraction = scene->zoom_position - (float)zoom_level;
+	if (fraction > 0.001f && zoom_level + 1 < image->level_count) {
+		*blend_alpha = 1.0f - ATMOST(fraction, 1.0f);
+	}
+	return zoom_level;
 }
 
-void unload_all_images(app_state_t *app_state) {
-	i32 current_image_count = sb_count(app_state->loaded_images);
-	if (current_image_count > 0) {
-		ASSERT(app_state->loaded_images);
-		for (i32 i = 0; i < current_image_count; ++i) {
-			image_t* old_image = app_state->loaded_images + i;
-			unload_image(old_image);
-		}
-		sb_free(app_state->loaded_images);
-		app_state->loaded_images = NULL;
+// The coarsest level from which tiles are drawn (apart from placeholders, see push_placeholder_for_tile()). While
+// blending, the tiles of the blend level can be translucent, so the next coarser level is drawn opaque behind them.
+static i32 get_base_drawn_level(image_t* image, i32 first_drawn_level, float blend_alpha) {
+	i32 base_level = (blend_alpha < 1.0f) ? first_drawn_level + 1 : first_drawn_level;
+	return ATMOST(base_level, image->level_count - 1);
+}
+
+// While zooming in, the tiles of the new level are drawn minified until the zoom animation has caught up. Tiles that
+// are drawn at half size or smaller are decoded at 1/2 or 1/4 size (DCT scaling, or a lower JPEG 2000 resolution
+// level) and get a smaller texture; they are loaded again at full size as soon as they are no longer minified.
+// With blending between levels, tiles are never drawn at less than half size, so this does not apply.
+static i32 get_wanted_resolution_shift(app_state_t* app_state, scene_t* scene, image_t* image, i32 level) {
+	if (!app_state->decode_minified_tiles_at_reduced_size || app_state->blend_zoom_levels ||
+	    image->type != IMAGE_TYPE_TIFF || image->level_images[level].tiff_level < 0) {
+		return 0; // synthesized tiles are already decoded at reduced size
 	}
-	mouse_show();
+	i32 shift = (i32)floorf(scene->zoom_position - (float)level);
+	return CLAMP(shift, 0, 2);
 }
 
-void add_image_from_tiff(app_state_t* app_state, tiff_t tiff) {
-	image_t new_image = (image_t){};
-	new_image.type = IMAGE_TYPE_TIFF;
-	new_image.tiff.tiff = tiff;
-	new_image.is_freshly_loaded = true;
-	new_image.mpp_x = tiff.mpp_x;
-	new_image.mpp_y = tiff.mpp_y;
-	ASSERT(tiff.main_image);
-	new_image.width_in_pixels = tiff.main_image->image_width;
-	new_image.width_in_um = tiff.main_image->image_width * tiff.mpp_x;
-	new_image.height_in_pixels = tiff.main_image->image_height;
-	new_image.height_in_um = tiff.main_image->image_height * tiff.mpp_y;
-	// TODO: fix code duplication with tiff_deserialize()
-	if (tiff.level_count > 0 && tiff.main_image->tile_width) {
+static void add_visible_tiles_to_wishlist(app_state_t* app_state, scene_t* scene, image_t* image) {
+	scene_visibility_t* visibility = &scene->visibility;
+
+	// When zooming out, the levels that are being blended out are still drawn, and need to stay loaded.
+	float blend_alpha;
+	i32 first_drawn_level = get_first_drawn_level(app_state, scene, image, &blend_alpha);
+	i32 finest_level = ATMOST(scene->current_level, first_drawn_level);
+	// The levels in between the drawn levels and the coarsest (pinned) levels are not requested: missing tiles are
+	// filled in from whatever coarser tiles are loaded (see push_placeholder_for_tile()), so the bandwidth goes to the
+	// levels that are actually drawn.
+	i32 coarsest_drawn_level = ATLEAST(scene->current_level, get_base_drawn_level(image, first_drawn_level, blend_alpha));
+	i32 first_pinned_level = image->level_count - TILE_CACHE_PINNED_LEVEL_COUNT;
+	for (i32 level = image->level_count - 1; level >= finest_level; --level) {
+		if (level > coarsest_drawn_level && level < first_pinned_level) {
+			continue; // intermediate level
+		}
+		// While the zoom animation passes through several levels, only the level it is heading for is requested
+		// (besides the pinned levels); the levels in between are only requested if the zoom lingers at them.
+		bool32 is_zoom_target = (level == scene->current_level);
+		if (!is_zoom_target && level < first_pinned_level && scene->current_level != first_drawn_level &&
+		    scene->zoom_passing_level_seconds < ZOOM_LINGER_SECONDS) {
+			continue;
+		}
+		level_image_t *drawn_level = image->level_images + level;
+
+		// When zooming in, the levels that are not drawn yet are requested gradually as the zoom gets closer to them,
+		// from the center of the screen outwards: once the zoom is within one level, all the visible tiles are in.
+		// Levels that are zoomed through quickly are mostly skipped. The zoom target is requested right away, but only
+		// the part that will be in view once the zoom animation is over.
+		float requested_share = 1.0f;
+		if (level < first_drawn_level) {
+			requested_share = 2.0f - (scene->zoom_position - (float)level);
+			if (is_zoom_target) {
+				requested_share = ATLEAST(requested_share, drawn_level->um_per_pixel_x / scene->pixel_width);
+			}
+			if (requested_share <= 0.0f) continue;
+		}
 
-		new_image.level_count = tiff.level_count;
-		new_image.level_images = (level_image_t*) calloc(1, tiff.level_count * sizeof(level_image_t));
+		i32 base_priority = (image->level_count - level) * 100; // highest priority for the most zoomed in levels
+		if (drawn_level->are_tiles_preloaded) {
+			// These don't need to wait for the network: decode them first, as the background for everything else.
+			base_priority += (image->level_count + 1) * 100;
+		}
 
-		for (i32 i = 0; i < tiff.level_count; ++i) {
-			level_image_t* level_image = new_image.level_images + i;
-			tiff_ifd_t* ifd = tiff.level_images + i;
-			level_image->tile_count = ifd->tile_count;
-			level_image->width_in_tiles = ifd->width_in_tiles;
-			level_image->height_in_tiles = ifd->height_in_tiles;
-			level_image->um_per_pixel_x = ifd->um_per_pixel_x;
-			level_image->um_per_pixel_y = ifd->um_per_pixel_y;
-			level_image->x_tile_side_in_um = ifd->x_tile_side_in_um;
-			level_image->y_tile_side_in_um = ifd->y_tile_side_in_um;
-			level_image->tiles = (tile_t*) calloc(1, ifd->tile_count * sizeof(tile_t));
-			ASSERT(ifd->tile_byte_counts != NULL);
-			ASSERT(ifd->tile_offsets != NULL);
-			// mark the empty tiles, so that we can skip loading them later on
-			for (i32 j = 0; j < level_image->tile_count; ++j) {
-				tile_t* tile = level_image->tiles + j;
-				u64 tile_byte_count = ifd->tile_byte_counts[j];
-				if (tile_byte_count == 0) {
-					tile->is_empty = true;
+		i32 resolution_shift = get_wanted_resolution_shift(app_state, scene, image, level);
+
+		tile_range_t range = visibility->levels[level];
+		tile_iterator_t it = begin_tile_iteration(drawn_level, range, true);
+		while (next_tile(&it)) {
+
+			tile_t* tile = it.tile;
+			i32 tile_x = it.tile_x;
+			i32 tile_y = it.tile_y;
+			if (requested_share < 1.0f) {
+				float distance_on_screen = get_visible_tile_distance_from_center(visibility, drawn_level, tile_x, tile_y);
+				if (distance_on_screen > requested_share) {
+					continue; // not yet
 				}
 			}
-		}
-	}
-	reset_scene(&new_image, &app_state->scene);
-	sb_push(app_state->loaded_images, new_image);
-}
 
-bool file_exists(const char* filename) {
-	return (access(filename, F_OK) != -1);
-}
+			i32 tile_priority = base_priority + get_visible_tile_priority_bonus(visibility, drawn_level, tile_x, tile_y);
+			// Tiles that came in at reduced quality (see update_remote_tile_quality()) are loaded again at full
+			// quality, once the link has time for it (they are still drawn from the old texture meanwhile).
+			bool32 needs_full_quality = (tile->state == TILE_STATE_LOADED && tile->is_reduced_quality);
+			if (needs_full_quality) {
+				tile_priority = ATMOST(QUALITY_REFINEMENT_BASE_PRIORITY + tile_priority, -1);
+			}
 
-bool32 load_generic_file(app_state_t *app_state, const char *filename) {
-	const char* ext = get_file_extension(filename);
-	if (strcasecmp(ext, "json") == 0) {
-		reload_global_caselist(app_state, filename);
-		show_slide_list_window = true;
-		return true;
-	} else if (strcasecmp(ext, "xml") == 0) {
-		return load_asap_xml_annotations(app_state, filename);
-	} else {
-		// assume it is an image file?
-		reset_global_caselist(app_state);
-		if (load_image_from_file(app_state, filename)) {
-			// Check if there is an associated ASAP XML annotations file
-			size_t len = strlen(filename);
-			size_t temp_size = len + 5; // add 5 so that we can always append ".xml\0"
-			char* temp_filename = alloca(temp_size);
-			strncpy(temp_filename, filename, temp_size);
-			replace_file_extension(temp_filename, temp_size, "xml");
-			if (file_exists(temp_filename)) {
-				printf("Found XML annotations: %s\n", temp_filename);
-				load_asap_xml_annotations(app_state, temp_filename);
+			// Keep the priority up to date, also for tiles that are already waiting in the request queue.
+			bool32 is_wanted_by_other_scene = (tile->time_last_wanted == app_state->frame_counter);
+			if (!is_wanted_by_other_scene || tile_priority > tile->priority) {
+				tile->priority = tile_priority;
 			}
-			return true;
+			tile->time_last_wanted = app_state->frame_counter;
+
+			// Tiles decoded at reduced size are loaded again at full size once the zoom animation is over (they are
+			// still drawn from the old texture meanwhile).
+			bool32 needs_refinement = (tile->state == TILE_STATE_LOADED && tile->resolution_shift > 0 &&
+			                           resolution_shift == 0) || needs_full_quality;
+			if ((tile->state != TILE_STATE_UNLOADED && !needs_refinement) || is_wanted_by_other_scene) {
+				continue;
+			}
+			sb_push(app_state->tile_wishlist, ((load_tile_task_t){
+					.image = image, .tile = tile, .focal_plane = image->focal_plane, .level = level,
+					.tile_x = tile_x, .tile_y = tile_y, .priority = tile_priority, .resolution_shift = resolution_shift,
+					.remote_tile_quality = needs_full_quality ? 0 : app_state->remote_tile_quality,
+			}));
 
-		} else {
-			printf("Could not load '%s'\n", filename);
-			return false;
 		}
 
 	}
 }
 
-bool32 load_image_from_file(app_state_t* app_state, const char *filename) {
-	unload_all_images(app_state);
+// While the camera is jumping (see jump_scene_camera()), wants the tiles that will be in view at the destination, ahead
+// of the tiles that the camera passes over on the way (and before those that are actually in view).
+static void add_jump_destination_to_wishlist(app_state_t* app_state, scene_t* scene, image_t* image) {
+	if (!scene->is_jumping) return;
+	level_image_t* level_image = image->level_images + scene->current_level;
+	float half_width = scene->viewport.w * level_image->um_per_pixel_x * 0.5f;
+	float half_height = scene->viewport.h * level_image->um_per_pixel_y * 0.5f;
+	v2f target = scene->jump_target;
+	v2f destination_min = { target.x - half_width, target.y - half_height };
+	v2f destination_max = { target.x + half_width, target.y + half_height };
+	float radius = sqrtf(SQUARE(half_width) + SQUARE(half_height));
+	// (above the priority of the visible tiles, including the preloaded ones; see add_visible_tiles_to_wishlist())
+	i32 base_priority = 2 * (image->level_count + 1) * 100 + VISIBLE_TILE_PRIORITY_BONUS;
+	i32 max_tiles = JUMP_DESTINATION_MAX_TILES;
+	prefetch_tiles_in_region(app_state, image, image->focal_plane, scene->current_level, destination_min,
+	                         destination_max, target, radius, base_priority, &max_tiles);
+}
 
-	bool32 result = false;
-	const char* ext = get_file_extension(filename);
+// Wants the tiles that are likely to come into view next (see prefetch_tiles_in_region()).
+// The input is only passed for the scene under the mouse cursor.
+static void prefetch_tiles_for_scene(app_state_t* app_state, scene_t* scene, image_t* image, input_t* input,
+                                     i32* max_prefetch_tiles) {
+	v2f camera_min, camera_max;
+	get_scene_camera_bounds(scene, &camera_min, &camera_max);
+	float r_minus_l = camera_max.x - camera_min.x;
+	float t_minus_b = camera_max.y - camera_min.y;
+	float view_radius = sqrtf(SQUARE(r_minus_l * 0.5f) + SQUARE(t_minus_b * 0.5f));
+
+	float speed_in_pixels_per_second = sqrtf(SQUARE(scene->camera_velocity.x / scene->pixel_width) +
+	                                         SQUARE(scene->camera_velocity.y / scene->pixel_height));
+	if (speed_in_pixels_per_second > 50.0f) {
+		// Panning: want the tiles at the leading edge, where the viewport will be shortly if it keeps moving.
+		v2f lookahead = { scene->camera_velocity.x * PREFETCH_LOOKAHEAD_SECONDS,
+		                  scene->camera_velocity.y * PREFETCH_LOOKAHEAD_SECONDS };
+		v2f predicted_min = { camera_min.x + lookahead.x, camera_min.y + lookahead.y };
+		v2f predicted_max = { camera_max.x + lookahead.x, camera_max.y + lookahead.y };
+		v2f predicted_center = { scene->camera.x + lookahead.x, scene->camera.y + lookahead.y };
+		prefetch_tiles_in_region(app_state, image, image->focal_plane, scene->current_level, predicted_min, predicted_max,
+		                         predicted_center, view_radius, PREFETCH_BASE_PRIORITY, max_prefetch_tiles);
+	} else if (input) {
+		// Not panning: want the tiles that would come into view if the user zooms at the mouse cursor
+		// (in the direction of the last zoom).
+		i32 next_level = scene->current_level + ((scene->last_zoom_direction > 0) ? 1 : -1);
+		if (next_level >= 0 && next_level < image->level_count) {
+			level_image_t* next_level_image = image->level_images + next_level;
+			float offset_x = (float)(input->mouse_xy.x - scene->viewport.x - scene->viewport.w / 2);
+			float offset_y = (float)(input->mouse_xy.y - scene->viewport.y - scene->viewport.h / 2);
+			// Same camera movement as when actually zooming with the mouse wheel (see update_scene_camera()).
+			float offset_factor = (next_level < scene->current_level) ? 1.0f : -0.5f;
+			v2f next_center = { scene->camera.x + offset_x * next_level_image->um_per_pixel_x * offset_factor,
+			                    scene->camera.y + offset_y * next_level_image->um_per_pixel_y * offset_factor };
+			float next_half_width = scene->viewport.w * next_level_image->um_per_pixel_x * 0.5f;
+			float next_half_height = scene->viewport.h * next_level_image->um_per_pixel_y * 0.5f;
+			v2f next_min = { next_center.x - next_half_width, next_center.y - next_half_height };
+			v2f next_max = { next_center.x + next_half_width, next_center.y + next_half_height };
+			float next_radius = sqrtf(SQUARE(next_half_width) + SQUARE(next_half_height));
+			prefetch_tiles_in_region(app_state, image, image->focal_plane, next_level, next_min, next_max, next_center,
+			                         next_radius, PREFETCH_BASE_PRIORITY, max_prefetch_tiles);
+		}
+	}
+}
 
-	if (strcasecmp(ext, "png") == 0 || strcasecmp(ext, "jpg") == 0) {
-		// Load using stb_image
-		image_t image = (image_t){};
-		image.type = IMAGE_TYPE_SIMPLE;
-		image.simple.channels = 4; // desired: RGBA
-		image.simple.pixels = stbi_load(filename, &image.simple.width, &image.simple.height, &image.simple.channels_in_file, 4);
-		if (image.simple.pixels) {
-			glEnable(GL_TEXTURE_2D);
-			glGenTextures(1, &image.simple.texture);
-			//glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, image.simple.texture);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, image.simple.width, image.simple.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image.simple.pixels);
+// Z-stacks: wants the view on the focal planes above and below, at idle priority, so that focusing through the stack
+// doesn't have to wait for the whole view to load again. The plane in the direction that the focus last moved in
+// comes first.
+static void prefetch_adjacent_focal_planes(app_state_t* app_state, scene_t* scene, image_t* image, i32* max_tiles) {
+	if (image->focal_plane_count <= 1 || image->channel_count > 0) return;
+	v2f camera_min, camera_max;
+	get_scene_camera_bounds(scene, &camera_min, &camera_max);
+	float view_radius = sqrtf(SQUARE((camera_max.x - camera_min.x) * 0.5f) + SQUARE((camera_max.y - camera_min.y) * 0.5f));
+	i32 direction = (image->last_focus_direction < 0) ? -1 : 1;
+	for (i32 i = 0; i < 2; ++i) {
+		i32 focal_plane = image->focal_plane + ((i == 0) ? direction : -direction);
+		if (focal_plane < 0 || focal_plane >= image->focal_plane_count) continue;
+		i32 base_priority = FOCAL_PLANE_PREFETCH_BASE_PRIORITY - i * (image->level_count + 1) * 100;
+		prefetch_tiles_in_region(app_state, image, focal_plane, scene->current_level, camera_min, camera_max,
+		                         scene->camera, view_radius, base_priority, max_tiles);
+	}
+}
 
-			image.is_freshly_loaded = true;
-			sb_push(app_state->loaded_images, image);
-			result = true;
+#define READAHEAD_MAX_TILES 256
+#define READAHEAD_LOOKAHEAD_SECONDS 1.5f // (further than PREFETCH_LOOKAHEAD_SECONDS: a hint costs next to nothing)
 
-			//stbi_image_free(image->stbi.pixels);
+static void give_readahead_hints(tiff_t* tiff, u64* offsets, u64* sizes, i32 count) {
+	io_range_t ranges[IO_READ_BATCH_MAX];
+	u64 positions[IO_READ_BATCH_MAX];
+	i32 range_indices[IO_READ_BATCH_MAX];
+	i32 range_count = io_coalesce_ranges(offsets, sizes, count, IO_COALESCE_MAX_GAP, IO_COALESCE_MAX_SIZE,
+	                                     ranges, positions, range_indices);
+	io_readahead(tiff->win32_file_handle, tiff->mapped_data, ranges, range_count);
+}
+
+// Local slides: asks the OS to read the tiles around the view, and further along the direction of panning, into its
+// page cache (see io_readahead()). On a network share the first read of a tile is slow, but the neighbouring tiles
+// come in almost for free with a larger read. Unlike prefetching, this takes no worker threads, tile buffers or texture
+// memory, so it can reach much further. The hints are only given again when the tiles around the view change.
+static void readahead_tiles_for_scene(scene_t* scene, image_t* image) {
+	if (image->type != IMAGE_TYPE_TIFF) return;
+	tiff_t* tiff = &image->tiff.tiff;
+	if (tiff->is_remote || tiff->is_direct_io) return;
+	i32 level = scene->current_level;
+	level_image_t* level_image = get_focal_plane_levels(image, image->focal_plane) + level;
+	if (level_image->tiff_level < 0 || level_image->is_generated) return;
+	tiff_ifd_t* level_ifd = tiff->level_images + level_image->tiff_level;
+	if (!level_ifd->are_tile_tables_loaded) return; // (not worth reading them here, on the main thread)
+
+	v2f camera_min, camera_max;
+	get_scene_camera_bounds(scene, &camera_min, &camera_max);
+	float margin_x = (camera_max.x - camera_min.x) * 0.5f;
+	float margin_y = (camera_max.y - camera_min.y) * 0.5f;
+	v2f lookahead = { scene->camera_velocity.x * READAHEAD_LOOKAHEAD_SECONDS,
+	                  scene->camera_velocity.y * READAHEAD_LOOKAHEAD_SECONDS };
+	v2f region_min = { camera_min.x + MIN(0.0f, lookahead.x) - margin_x, camera_min.y + MIN(0.0f, lookahead.y) - margin_y };
+	v2f region_max = { camera_max.x + MAX(0.0f, lookahead.x) + margin_x, camera_max.y + MAX(0.0f, lookahead.y) + margin_y };
+	tile_range_t range = get_tile_range_in_region(level_image, region_min, region_max);
+	if (scene->readahead_image_id == image->image_id && scene->readahead_level == level &&
+	    memcmp(&scene->readahead_range, &range, sizeof(range)) == 0) {
+		return;
+	}
+	scene->readahead_image_id = image->image_id;
+	scene->readahead_level = level;
+	scene->readahead_range = range;
+
+	u64 offsets[IO_READ_BATCH_MAX];
+	u64 sizes[IO_READ_BATCH_MAX];
+	i32 count = 0;
+	i32 total_count = 0;
+	tile_iterator_t it = begin_tile_iteration(level_image, range, false);
+	while (next_tile(&it) && total_count < READAHEAD_MAX_TILES) {
+		if (it.tile && it.tile->state != TILE_STATE_UNLOADED) {
+			continue; // already loaded, or on its way
+		}
+		if (!is_tissue_in_tile(image, level_image, it.tile_x, it.tile_y)) {
+			continue;
+		}
+		i32 tile_index = it.tile_y * level_image->width_in_tiles + it.tile_x;
+		if (level_ifd->tile_offsets[tile_index] == 0 || level_ifd->tile_byte_counts[tile_index] == 0) {
+			continue;
 		}
+		offsets[count] = level_ifd->tile_offsets[tile_index];
+		sizes[count] = level_ifd->tile_byte_counts[tile_index];
+		++count;
+		++total_count;
+		if (count == IO_READ_BATCH_MAX) {
+			give_readahead_hints(tiff, offsets, sizes, count);
+			count = 0;
+		}
+	}
+	if (count > 0) {
+		give_readahead_hints(tiff, offsets, sizes, count);
+	}
+}
 
-	} else if (app_state->use_builtin_tiff_backend && (strcasecmp(ext, "tiff") == 0 || strcasecmp(ext, "tif") == 0)) {
-		tiff_t tiff = {0};
-		if (open_tiff_file(&tiff, filename)) {
-			add_image_from_tiff(app_state, tiff);
-			result = true;
+// Showing a single stain only changes how the resident tile textures are drawn; nothing needs to be reloaded.
+static void set_stain_view_for_image(image_t* image, bool32 is_tiled) {
+	float unmixing[3];
+	float stain_vector[3];
+	bool32 show_single_stain = (image->shown_stain > 0 &&
+	                            get_stain_unmixing(&image->stain_matrix, image->shown_stain - 1, unmixing, stain_vector));
+	if (is_tiled) {
+		if (show_single_stain) {
+			set_tile_stain_view(unmixing, stain_vector);
 		} else {
-			tiff_destroy(&tiff);
-			result = false;
-			printf("Opening %s failed\n", filename);
+			clear_tile_stain_view();
 		}
-
 	} else {
-		// Try to load the file using OpenSlide
-		if (!is_openslide_available) {
-			printf("Can't try to load %s using OpenSlide, because OpenSlide is not available\n", filename);
-			return false;
+		// A basic image is drawn with the basic shader, which is expected to be in use.
+		glUniform1i(basic_shader_u_show_single_stain, show_single_stain);
+		if (show_single_stain) {
+			glUniform3fv(basic_shader_u_stain_unmixing, 1, unmixing);
+			glUniform3fv(basic_shader_u_stain_vector, 1, stain_vector);
 		}
-		image_t image = (image_t){};
+	}
+}
 
-		image.type = IMAGE_TYPE_WSI;
-		wsi_t* wsi = &image.wsi.wsi;
-		load_wsi(wsi, filename);
-		if (wsi->osr) {
-			image.is_freshly_loaded = true;
-			image.mpp_x = wsi->mpp_x;
-			image.mpp_y = wsi->mpp_y;
-			image.width_in_pixels = wsi->width;
-			image.width_in_um = wsi->width * wsi->mpp_x;
-			image.height_in_pixels = wsi->height;
-			image.height_in_um = wsi->height * wsi->mpp_y;
-			if (wsi->level_count > 0 && wsi->levels[0].x_tile_side_in_um > 0) {
-
-				image.level_count = wsi->level_count;
-				image.level_images = (level_image_t*) calloc(1, wsi->level_count * sizeof(level_image_t));
-
-				for (i32 i = 0; i < wsi->level_count; ++i) {
-					level_image_t* level_image = image.level_images + i;
-					wsi_level_t* wsi_level = wsi->levels + i;
-					level_image->tile_count = wsi_level->tile_count;
-					level_image->width_in_tiles = wsi_level->width_in_tiles;
-					level_image->height_in_tiles = wsi_level->height_in_tiles;
-					level_image->um_per_pixel_x = wsi_level->um_per_pixel_x;
-					level_image->um_per_pixel_y = wsi_level->um_per_pixel_y;
-					level_image->x_tile_side_in_um = wsi_level->x_tile_side_in_um;
-					level_image->y_tile_side_in_um = wsi_level->y_tile_side_in_um;
-					level_image->tiles = (tile_t*) calloc(1, wsi_level->tile_count * sizeof(tile_t));
-					// Note: OpenSlide doesn't allow us to quickly check if tiles are empty or not.
-				}
-			}
+// The fraction of the tile that lies within the image: less than 1 only for the tiles at the right and bottom edges of
+// the level, which get clipped in tile.frag (see push_tile_instance()). Taken from the size in pixels, because
+// width_in_um is rounded to whole microns.
+static v2f get_tile_valid_fill(image_t* image, level_image_t* level_image, i32 tile_x, i32 tile_y) {
+	float width_in_um = (float)image->width_in_pixels * image->mpp_x;
+	float height_in_um = (float)image->height_in_pixels * image->mpp_y;
+	v2f fill = { CLAMP(width_in_um / level_image->x_tile_side_in_um - (float)tile_x, 0.0f, 1.0f),
+	             CLAMP(height_in_um / level_image->y_tile_side_in_um - (float)tile_y, 0.0f, 1.0f) };
+	return fill;
+}
 
-			reset_scene(&image, &app_state->scene);
-			sb_push(app_state->loaded_images, image);
-			result = true;
+static void push_drawable_tile(image_t* image, level_image_t* level_image, tile_t* tile, i32 tile_x, i32 tile_y,
+                               rect2f rect, float depth, float alpha, rect2i clip) {
+	v2f valid_fill = get_tile_valid_fill(image, level_image, tile_x, tile_y);
+	if (tile->is_uniform) {
+		push_flat_tile_instance(tile->uniform_color, rect.x, rect.y, rect.w, rect.h, depth, alpha, clip,
+		                        valid_fill.x, valid_fill.y);
+	} else {
+		push_tile_instance(tile->texture_slot, rect.x, rect.y, rect.w, rect.h, depth, alpha, clip,
+		                   (float)(level_image->tile_width >> tile->resolution_shift) / (float)TILE_DIM,
+		                   (float)(level_image->tile_height >> tile->resolution_shift) / (float)TILE_DIM,
+		                   valid_fill.x, valid_fill.y);
+	}
+}
 
+// Stands in for a visible tile that is not loaded yet: draws the part of the nearest coarser level that is loaded
+// there, clipped to the area of the missing tile (so that the texture coordinates cover just the matching part of
+// the ancestor tile). The coarsest levels are pinned in the texture cache, so there is almost always something.
+// Returns false if nothing could be found.
+static bool32 push_placeholder_for_tile(app_state_t* app_state, scene_t* scene, image_t* image, i32 level,
+                                        i32 tile_x, i32 tile_y) {
+	level_image_t* level_image = image->level_images + level;
+	rect2f rect = get_visible_tile_screen_rect(&scene->visibility, level_image, tile_x, tile_y);
+	// Rounded outwards to whole pixels, so that no gaps remain: where the clip rect overlaps a neighbouring tile, the
+	// neighbour is in front (or is filled in from the same ancestor anyway).
+	i32 clip_x1 = ATLEAST((i32)floorf(rect.x), scene->viewport.x);
+	i32 clip_y1 = ATLEAST((i32)floorf(rect.y), scene->viewport.y);
+	i32 clip_x2 = ATMOST((i32)ceilf(rect.x + rect.w), scene->viewport.x + scene->viewport.w);
+	i32 clip_y2 = ATMOST((i32)ceilf(rect.y + rect.h), scene->viewport.y + scene->viewport.h);
+	if (clip_x1 >= clip_x2 || clip_y1 >= clip_y2) {
+		return true; // not actually visible
+	}
+	rect2i clip = { clip_x1, clip_y1, clip_x2 - clip_x1, clip_y2 - clip_y1 };
+
+	float world_x1 = tile_x * level_image->x_tile_side_in_um;
+	float world_y1 = tile_y * level_image->y_tile_side_in_um;
+	float world_x2 = world_x1 + level_image->x_tile_side_in_um;
+	float world_y2 = world_y1 + level_image->y_tile_side_in_um;
+	for (i32 ancestor_level = level + 1; ancestor_level < image->level_count; ++ancestor_level) {
+		level_image_t* ancestor_level_image = image->level_images + ancestor_level;
+		// Usually a single tile, but the levels are not always exactly a factor 2 apart.
+		// Note: small tolerance, so that tiles that only touch the border (because of float rounding) are not counted
+		i32 ax1 = (i32)floorf(world_x1 / ancestor_level_image->x_tile_side_in_um + 0.001f);
+		i32 ay1 = (i32)floorf(world_y1 / ancestor_level_image->y_tile_side_in_um + 0.001f);
+		i32 ax2 = (i32)ceilf(world_x2 / ancestor_level_image->x_tile_side_in_um - 0.001f);
+		i32 ay2 = (i32)ceilf(world_y2 / ancestor_level_image->y_tile_side_in_um - 0.001f);
+		ax1 = ATLEAST(ax1, 0);
+		ay1 = ATLEAST(ay1, 0);
+		ax2 = ATMOST(ax2, (i32)ancestor_level_image->width_in_tiles);
+		ay2 = ATMOST(ay2, (i32)ancestor_level_image->height_in_tiles);
+
+		bool32 is_complete = true;
+		for (i32 ay = ay1; ay < ay2 && is_complete; ++ay) {
+			for (i32 ax = ax1; ax < ax2; ++ax) {
+				if (is_tile_empty(ancestor_level_image, ax, ay)) continue;
+				tile_t* ancestor = peek_tile(ancestor_level_image, ax, ay);
+				if (!ancestor || (ancestor->texture_slot == 0 && !ancestor->is_uniform)) {
+					is_complete = false;
+					break;
+				}
+			}
+		}
+		if (!is_complete) continue;
+
+		float depth = (float)ancestor_level * 0.1f;
+		for (i32 ay = ay1; ay < ay2; ++ay) {
+			for (i32 ax = ax1; ax < ax2; ++ax) {
+				if (is_tile_empty(ancestor_level_image, ax, ay)) continue;
+				tile_t* ancestor = get_tile(ancestor_level_image, ax, ay);
+				ancestor->time_last_drawn = app_state->frame_counter; // in use, should not be evicted
+				rect2f ancestor_rect = get_visible_tile_screen_rect(&scene->visibility, ancestor_level_image, ax, ay);
+				push_drawable_tile(image, ancestor_level_image, ancestor, ax, ay, ancestor_rect, depth, 1.0f, clip);
+			}
 		}
+		return true;
 	}
-	return result;
-
+	return false;
 }
 
-i32 tile_pos_from_world_pos(float world_pos, float tile_side) {
-	ASSERT(tile_side > 0);
-	float tile_float = (world_pos / tile_side);
-	float tile = (i32)floorf(tile_float);
-	return tile;
-}
+// Adds the tiles within the viewport to the tile instances (which are drawn for all scenes at once): those of the
+// current level, and while zooming with blending, also those of the level being blended over it. Where one of these
+// tiles is not loaded yet, the corresponding part of the nearest loaded coarser tile is drawn in its place (see
+// push_placeholder_for_tile()), so there are no holes; coarser tiles are not drawn otherwise.
+// Note: the levels from which tiles are drawn are the ones that get requested (see add_visible_tiles_to_wishlist()).
+static void push_visible_tiles(app_state_t* app_state, scene_t* scene, image_t* image) {
+	scene_visibility_t* visibility = &scene->visibility;
+	set_stain_view_for_image(image, true);
+
+	float blend_alpha;
+	i32 first_drawn_level = get_first_drawn_level(app_state, scene, image, &blend_alpha);
+
+	i32 base_level = get_base_drawn_level(image, first_drawn_level, blend_alpha);
+
+	tile_coverage_t finer_coverage = {0};
+	for (i32 level = first_drawn_level; level <= base_level; ++level) {
+		level_image_t *drawn_level = image->level_images + level;
+		float alpha = (level == first_drawn_level) ? blend_alpha : 1.0f;
+
+		tile_range_t range = visibility->levels[level];
+
+		// Finer levels are drawn on top of coarser levels (the depth test discards what is hidden).
+		float depth = (float)level * 0.1f;
+
+		tile_coverage_t coverage = {0};
+		coverage.level_image = drawn_level;
+		coverage.tile_x1 = range.x1;
+		coverage.tile_y1 = range.y1;
+		coverage.width = range.x2 - range.x1;
+		coverage.height = range.y2 - range.y1;
+		coverage.is_opaque = (u8*) calloc(1, ATLEAST(1, coverage.width * coverage.height));
+
+		tile_iterator_t it = begin_tile_iteration(drawn_level, range, false);
+		while (next_tile(&it)) {
+
+			tile_t* tile = it.tile;
+			i32 tile_x = it.tile_x;
+			i32 tile_y = it.tile_y;
+			bool32 is_covered = is_tile_covered_by_finer_level(&finer_coverage, drawn_level, tile_x, tile_y);
+			bool32 is_drawable = (tile && (tile->texture_slot != 0 || tile->is_uniform)); // (NULL if never touched)
+			if (is_drawable) {
+				// Note: also mark hidden tiles as drawn, they are still in view and should not be evicted.
+				tile->time_last_drawn = app_state->frame_counter;
+				if (tile->request_clock != 0) {
+					i64 draw_clock = get_clock();
+					tile_metrics_record(TILE_STAGE_FIRST_DRAW, tile->request_clock, draw_clock);
+					float latency_in_ms = get_seconds_elapsed(tile->request_clock, draw_clock) * 1000.0f;
+					tile->load_latency_in_ms = (u16)ATMOST(latency_in_ms, 65535.0f);
+					tile->request_clock = 0;
+				}
+				if (!is_covered) {
+					rect2f rect = get_visible_tile_screen_rect(visibility, drawn_level, tile_x, tile_y);
+					push_drawable_tile(image, drawn_level, tile, tile_x, tile_y, rect, depth, alpha, scene->viewport);
+				}
+			} else if (level == base_level && !is_covered) {
+				push_placeholder_for_tile(app_state, scene, image, level, tile_x, tile_y);
+			}
+			i32 coverage_index = (tile_y - coverage.tile_y1) * coverage.width + (tile_x - coverage.tile_x1);
+			coverage.is_opaque[coverage_index] = ((is_drawable && alpha >= 1.0f) || is_covered);
 
-bool32 was_button_pressed(button_state_t* button) {
-	bool32 result = button->down && button->transition_count > 0;
-	return result;
-}
+		}
 
-bool32 was_button_released(button_state_t* button) {
-	bool32 result = (!button->down) && button->transition_count > 0;
-	return result;
+		free(finer_coverage.is_opaque);
+		finer_coverage = coverage;
+	}
+	free(finer_coverage.is_opaque);
 }
 
-bool32 was_key_pressed(input_t* input, i32 keycode) {
-	u8 key = keycode & 0xFF;
-	button_state_t* button = &input->keyboard.keys[key];
-	bool32 result = was_button_pressed(button);
-	return result;
+// Fluorescence images are composited from their enabled channels on the GPU (see channel_view_t): the channels are
+// added together on a black background, drawn behind all the levels. Other images are drawn as they are.
+static void push_visible_channel_tiles(app_state_t* app_state, scene_t* scene, image_t* image) {
+	if (image->channel_count == 0) {
+		push_visible_tiles(app_state, scene, image);
+		return;
+	}
+	clear_tile_stain_view();
+	level_image_t* base_level = image->level_images + 0;
+	rect2f rect = get_visible_tile_screen_rect(&scene->visibility, base_level, 0, 0);
+	rect.w *= (float)base_level->width_in_tiles;
+	rect.h *= (float)base_level->height_in_tiles;
+	// (the whole tile grid, clipped to the image)
+	float valid_fill_x = ATMOST(1.0f, (float)image->width_in_pixels * image->mpp_x /
+	                                  (base_level->x_tile_side_in_um * (float)base_level->width_in_tiles));
+	float valid_fill_y = ATMOST(1.0f, (float)image->height_in_pixels * image->mpp_y /
+	                                  (base_level->y_tile_side_in_um * (float)base_level->height_in_tiles));
+	push_flat_tile_instance(0xFF000000, rect.x, rect.y, rect.w, rect.h, (float)image->level_count * 0.1f, 1.0f,
+	                        scene->viewport, valid_fill_x, valid_fill_y);
+	for (i32 channel = -1; next_shown_channel(image, &channel);) {
+		image_channel_t* settings = image->channels + channel;
+		set_tile_channel_view((float*) &settings->color, settings->gain, settings->offset);
+		push_visible_tiles(app_state, scene, image);
+	}
+	clear_tile_channel_view();
 }
 
-bool32 is_key_down(input_t* input, i32 keycode) {
-	u8 key = keycode & 0xFF;
-	bool32 result = input->keyboard.keys[key].down;
-	return result;
+// The levels of an overlay don't line up with those of the image it is drawn over: it is drawn from the coarsest
+// level that is still at least as fine as the screen.
+static i32 get_overlay_level(scene_t* scene, image_t* overlay) {
+	for (i32 level = overlay->level_count - 1; level > 0; --level) {
+		if (overlay->level_images[level].um_per_pixel_x <= scene->pixel_width) {
+			return level;
+		}
+	}
+	return 0;
 }
 
-
-i64 zoom_in_key_hold_down_start_time;
-i64 zoom_in_key_times_zoomed_while_holding;
-i64 zoom_out_key_hold_down_start_time;
-i64 zoom_out_key_times_zoomed_while_holding;
-
-// a 'frame of reference' and coordinate system for drawing 2d objects and making sense of the world
-typedef struct {
-	v2f view_pos; // camera position (at top left corner of the screen)
-} layer_t;
-
-layer_t basic_image_layer;
-
-
-int priority_cmp_func (const void* a, const void* b) {
-	return ( (*(load_tile_task_t*)b).priority - (*(load_tile_task_t*)a).priority );
+// Wants the tiles of the overlay that are in view: those of the level that is drawn, and of the pinned coarsest levels
+// (for the placeholders, see push_overlay_tiles()).
+static void add_overlay_tiles_to_wishlist(app_state_t* app_state, scene_t* scene, image_t* overlay) {
+	scene_visibility_t* visibility = &scene->visibility;
+	i32 drawn_level = get_overlay_level(scene, overlay);
+	i32 first_pinned_level = overlay->level_count - TILE_CACHE_PINNED_LEVEL_COUNT;
+	for (i32 level = overlay->level_count - 1; level >= drawn_level; --level) {
+		if (level > drawn_level && level < first_pinned_level) {
+			continue; // intermediate level
+		}
+		level_image_t* level_image = overlay->level_images + level;
+		i32 base_priority = (overlay->level_count - level) * 100;
+		tile_range_t range = get_tile_range_in_region(level_image, visibility->camera_min, visibility->camera_max);
+		tile_iterator_t it = begin_tile_iteration(level_image, range, true);
+		while (next_tile(&it)) {
+			tile_t* tile = it.tile;
+			i32 tile_priority = base_priority + get_visible_tile_priority_bonus(visibility, level_image, it.tile_x, it.tile_y);
+			bool32 is_wanted_by_other_scene = (tile->time_last_wanted == app_state->frame_counter);
+			if (!is_wanted_by_other_scene || tile_priority > tile->priority) {
+				tile->priority = tile_priority;
+			}
+			tile->time_last_wanted = app_state->frame_counter;
+			if (tile->state != TILE_STATE_UNLOADED || is_wanted_by_other_scene) {
+				continue;
+			}
+			sb_push(app_state->tile_wishlist, ((load_tile_task_t){
+					.image = overlay, .tile = tile, .focal_plane = 0, .level = level,
+					.tile_x = it.tile_x, .tile_y = it.tile_y, .priority = tile_priority,
+			}));
+		}
+	}
 }
 
-void init_scene(app_state_t *app_state, scene_t *scene) {
-	memset(scene, 0, sizeof(scene_t));
-	scene->clear_color = app_state->clear_color;
-	scene->entity_count = 1; // NOTE: entity 0 = null entity, so start from 1
-	scene->camera = (v2f){0.0f, 0.0f}; // center camera at origin
-	scene->pixel_width = 1.0f;
-	scene->pixel_height = 1.0f;
-	scene->initialized = true;
+// Overlays are drawn over everything else in the scene, through the colormap (see overlay_view_t). Missing tiles are
+// filled in from the coarser levels, like those of the image.
+static void push_overlay_tiles(app_state_t* app_state, scene_t* scene, image_t* overlay) {
+	scene_visibility_t* visibility = &scene->visibility;
+	clear_tile_stain_view();
+	set_tile_overlay_view(overlay->overlay_colormap, overlay->overlay_opacity);
+	i32 level = get_overlay_level(scene, overlay);
+	level_image_t* level_image = overlay->level_images + level;
+	float depth = (float)level * 0.1f;
+	tile_range_t range = get_tile_range_in_region(level_image, visibility->camera_min, visibility->camera_max);
+	tile_iterator_t it = begin_tile_iteration(level_image, range, false);
+	while (next_tile(&it)) {
+		tile_t* tile = it.tile;
+		if (tile && (tile->texture_slot != 0 || tile->is_uniform)) {
+			tile->time_last_drawn = app_state->frame_counter;
+			rect2f rect = get_visible_tile_screen_rect(visibility, level_image, it.tile_x, it.tile_y);
+			push_drawable_tile(overlay, level_image, tile, it.tile_x, it.tile_y, rect, depth, 1.0f, scene->viewport);
+		} else {
+			push_placeholder_for_tile(app_state, scene, overlay, level, it.tile_x, it.tile_y);
+		}
+	}
+	clear_tile_overlay_view();
 }
 
-void init_app_state(app_state_t* app_state) {
-	ASSERT(!app_state->initialized); // check sanity
-	ASSERT(app_state->temp_storage_memory == NULL);
-	memset(app_state, 0, sizeof(app_state_t));
+// The overview (see draw_minimap_window() in gui.cpp) is drawn from the pinned levels, which stay loaded anyway, so it
+// doesn't cause any I/O of its own: of those, the finest level that is completely loaded is used.
+i32 get_minimap_level(image_t* image) {
+	i32 first_pinned_level = ATLEAST(0, image->level_count - TILE_CACHE_PINNED_LEVEL_COUNT);
+	for (i32 level = first_pinned_level; level < image->level_count - 1; ++level) {
+		level_image_t* level_image = image->level_images + level;
+		tile_range_t range = { 0, 0, (i32)level_image->width_in_tiles, (i32)level_image->height_in_tiles };
+		bool32 is_complete = true;
+		tile_iterator_t it = begin_tile_iteration(level_image, range, false);
+		while (next_tile(&it)) {
+			if (!it.tile || (it.tile->texture_slot == 0 && !it.tile->is_uniform)) {
+				is_complete = false;
+				break;
+			}
+		}
+		if (is_complete) {
+			return level;
+		}
+	}
+	return image->level_count - 1;
+}
 
-	size_t temp_storage_size = MEGABYTES(16); // Note: what is a good size to use here?
-	app_state->temp_storage_memory = platform_alloc(temp_storage_size);
-	init_arena(&app_state->temp_arena, temp_storage_size, app_state->temp_storage_memory);
+// Draws the overview into app_state->minimap_rect, on top of everything else that has been drawn (as a pass of its own,
+// straight to the screen). The outlines of the view and the loaded tiles are drawn over it by the GUI.
+static void draw_minimap(app_state_t* app_state, image_t* image) {
+	rect2i rect = app_state->minimap_rect;
+	if (rect.w <= 0 || rect.h <= 0 || image->channel_count > 0 || image->width_in_um <= 0 || image->height_in_um <= 0) {
+		return;
+	}
+	begin_tile_instances();
+	set_stain_view_for_image(image, true);
+	v4f bg = app_state->clear_color;
+	u32 background_color = 0xFF000000 | ((u32)(bg.r * 255.0f) << 16) | ((u32)(bg.g * 255.0f) << 8) | (u32)(bg.b * 255.0f);
+	push_flat_tile_instance(background_color, (float)rect.x, (float)rect.y, (float)rect.w, (float)rect.h, 1.0f, 1.0f, rect,
+	                        1.0f, 1.0f);
+
+	i32 level = get_minimap_level(image);
+	level_image_t* level_image = image->level_images + level;
+	float scale_x = (float)rect.w / (float)image->width_in_um;
+	float scale_y = (float)rect.h / (float)image->height_in_um;
+	tile_range_t range = { 0, 0, (i32)level_image->width_in_tiles, (i32)level_image->height_in_tiles };
+	tile_iterator_t it = begin_tile_iteration(level_image, range, false);
+	while (next_tile(&it)) {
+		tile_t* tile = it.tile;
+		if (!tile || (tile->texture_slot == 0 && !tile->is_uniform)) continue;
+		tile->time_last_drawn = app_state->frame_counter;
+		rect2f tile_rect = { rect.x + it.tile_x * level_image->x_tile_side_in_um * scale_x,
+		                     rect.y + it.tile_y * level_image->y_tile_side_in_um * scale_y,
+		                     level_image->x_tile_side_in_um * scale_x, level_image->y_tile_side_in_um * scale_y };
+		push_drawable_tile(image, level_image, tile, it.tile_x, it.tile_y, tile_rect, 0.0f, 1.0f, rect);
+	}
+	clear_tile_stain_view();
 
-	app_state->clear_color = (v4f){0.95f, 0.95f, 0.95f, 1.00f};
-	app_state->black_level = 0.10f;
-	app_state->white_level = 0.95f;
-	app_state->use_builtin_tiff_backend = true; // If disabled, revert to OpenSlide when loading TIFF files.
-	app_state->initialized = true;
+	glClear(GL_DEPTH_BUFFER_BIT);
+	draw_tile_instances();
 }
 
-void autosave(app_state_t* app_state, bool force_ignore_delay) {
-	annotation_set_t* annotation_set = &app_state->scene.annotation_set;
-	autosave_annotations(app_state, annotation_set, force_ignore_delay);
+// The image adjustments and the display profile are applied on the GPU, through a lookup table that is only rebuilt
+// when the settings change (see update_color_lut()).
+void update_color_pipeline(app_state_t* app_state) {
+	color_adjustments_t adjustments;
+	if (app_state->use_image_adjustments) {
+		adjustments = app_state->image_adjustments;
+	} else {
+		init_color_adjustments(&adjustments);
+	}
+	display_profile_t* display_profile = app_state->use_display_profile ? &app_state->display_profile : NULL;
+	update_color_lut(&adjustments, display_profile);
 }
 
-
+// Auto-levels: the black and white level follow the luminance histogram of the visible tiles, which is counted on the
+// GPU as the tiles arrive (see update_visible_tile_histogram()). Needs to be called after the tiles are drawn.
+void update_auto_levels(app_state_t* app_state) {
+	if (!app_state->use_auto_levels || !is_visible_tile_histogram_available()) {
+		reset_visible_tile_histogram(); // (the tile textures may be reused in the meantime)
+		return;
+	}
+	u32 bins[TILE_HISTOGRAM_BINS];
+	if (read_visible_tile_histogram(bins)) {
+		color_curve_t* master = &app_state->image_adjustments.master;
+		if (set_levels_from_histogram(master, bins, TILE_HISTOGRAM_BINS, AUTO_LEVELS_LOW_PERCENTILE,
+		                              AUTO_LEVELS_HIGH_PERCENTILE)) {
+			app_state->use_image_adjustments = true;
+		}
+	}
+	update_visible_tile_histogram();
+}
 
 // TODO: refactor delta_t
 // TODO: think about having access to both current and old input. (for comparing); is transition count necessary?
 void viewer_update_and_render(app_state_t *app_state, input_t *input, i32 client_width, i32 client_height, float delta_t) {
 
-	i64 last_section = get_clock(); // start profiler section
+	profiler_begin("new frame");
 
 	if (!app_state->initialized) init_app_state(app_state);
+	++app_state->frame_counter;
+	reset_arena(&app_state->frame_arena);
+	update_region_exports();
+	update_view_captures();
+	update_registrations(app_state);
+	update_tile_streams();
+	update_slide_opens(app_state);
+	update_image_unloads();
 	// Note: the window might get resized, so need to update this every frame
 	app_state->client_viewport = (rect2i){0, 0, client_width, client_height};
 
-	scene_t* scene = &app_state->scene;
-	if (!scene->initialized) init_scene(app_state, scene);
-
-	// Note: could be changed to allow e.g. multiple scenes side by side
-	scene->viewport = app_state->client_viewport;
+	for (i32 i = 0; i < MAX_SCENES; ++i) {
+		if (!app_state->scenes[i].initialized) init_scene(app_state, app_state->scenes + i);
+	}
+	app_state->scene_count = CLAMP(app_state->scene_count, 1, MAX_SCENES);
+	app_state->scenes[0].viewport = app_state->client_viewport;
 
 	// TODO: this is part of rendering and doesn't belong here
 	gui_new_frame();
 
+	begin_gpu_timer_frame();
+
 	// Set up rendering state for the next frame
 	glDrawBuffer(GL_BACK);
 	glDisable(GL_BLEND);
@@ -817,18 +4062,68 @@ void viewer_update_and_render(app_state_t *app_state, input_t *input, i32 client
 	glClearColor(app_state->clear_color.r, app_state->clear_color.g, app_state->clear_color.b, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 
-	last_section = profiler_end_section(last_section, "viewer_update_and_render: new frame", 20.0f);
+	profiler_end();
+
+	profiler_begin("process input (1)");
 
 	app_state->allow_idling_next_frame = true; // but we might set it to false later
 
+	// Note: the tiles that the workers have decoded are handed to OpenGL at the end of the frame, in the time that is
+	// left (see run_frame_jobs()). Tiles that are still being loaded don't keep us from idling: the workers wake up the
+	// main thread once they are done (see platform_wake_main_thread()). Tiles that are already waiting for upload do.
+
+	memory_stats_set(MEMORY_DOMAIN_ANNOTATIONS, get_annotation_set_memory_usage(&app_state->scenes[0].annotation_set));
+
+	// (drawn over by the tiles of this frame)
+	if (app_state->annotation_stress.is_pending) {
+		run_annotation_stress_test(app_state, &app_state->annotation_stress);
+	}
+
 	i32 image_count = sb_count(app_state->loaded_images);
 	ASSERT(image_count >= 0);
 
 	if (image_count == 0) {
+		profiler_end();
 		return; // nothing to draw
 	}
 
-	image_t* image = app_state->loaded_images + app_state->displayed_image;
+	app_state->displayed_image = CLAMP(app_state->displayed_image, 0, image_count - 1);
+	image_t* image = app_state->loaded_images[app_state->displayed_image];
+
+	// Split the client area between the scenes, and find out which image each scene shows.
+	i32 scene_count = (image->type == IMAGE_TYPE_SIMPLE) ? 1 : app_state->scene_count;
+	layout_scene_viewports(app_state, scene_count, client_width, client_height);
+	image_t* scene_images[MAX_SCENES] = {0};
+	image_t* scene_overlays[MAX_SCENES] = {0};
+	for (i32 i = 0; i < scene_count; ++i) {
+		scene_images[i] = get_image_for_scene(app_state, i);
+		ASSERT(scene_images[i]);
+		scene_images[i]->frame_last_displayed = app_state->frame_counter;
+		scene_overlays[i] = find_overlay_for_image(app_state, scene_images[i]);
+		if (scene_overlays[i]) {
+			scene_overlays[i]->frame_last_displayed = app_state->frame_counter;
+		}
+	}
+
+	// The input goes to the scene under the mouse cursor (or the scene that is being dragged).
+	i32 active_scene_index = 0;
+	if (input) {
+		bool32 is_any_scene_dragging = false;
+		for (i32 i = 0; i < scene_count; ++i) {
+			if (app_state->scenes[i].is_dragging) {
+				active_scene_index = i;
+				is_any_scene_dragging = true;
+			}
+		}
+		if (!is_any_scene_dragging) {
+			for (i32 i = 0; i < scene_count; ++i) {
+				if (is_point_inside_rect2i(app_state->scenes[i].viewport, input->mouse_xy)) {
+					active_scene_index = i;
+				}
+			}
+		}
+	}
+	scene_t* scene = app_state->scenes + active_scene_index;
 
 
 
@@ -842,6 +4137,7 @@ void viewer_update_and_render(app_state_t *app_state, input_t *input, i32 client
 
 		if (was_key_pressed(input, 'W') && is_key_down(input, KEYCODE_CONTROL)) {
 			menu_close_file(app_state);
+			profiler_end();
 			return;
 		}
 
@@ -855,8 +4151,8 @@ void viewer_update_and_render(app_state_t *app_state, input_t *input, i32 client
 		if (input->mouse_buttons[0].down) {
 			// Mouse drag.
 			if (input->mouse_buttons[0].transition_count != 0) {
-				// Don't start dragging if clicked outside the window
-				rect2i valid_drag_start_rect = {0, 0, client_width, client_height};
+				// Don't start dragging if clicked outside the window (or in between the scenes)
+				rect2i valid_drag_start_rect = scene->viewport;
 				if (is_point_inside_rect2i(valid_drag_start_rect, input->mouse_xy)) {
 					scene->is_dragging = true; // drag start
 					scene->cumulative_drag_vector = (v2i){};
@@ -879,8 +4175,9 @@ void viewer_update_and_render(app_state_t *app_state, input_t *input, i32 client
 		}
 	}
 
-	last_section = profiler_end_section(last_section, "viewer_update_and_render: process input (1)", 5.0f);
+	profiler_end();
 
+	update_color_pipeline(app_state);
 
 	if (image->type == IMAGE_TYPE_SIMPLE) {
 		// Display a basic image
@@ -919,14 +4216,9 @@ void viewer_update_and_render(app_state_t *app_state, input_t *input, i32 client
 
 
 		glUseProgram(basic_shader);
-
-		if (app_state->use_image_adjustments) {
-			glUniform1f(basic_shader_u_black_level, app_state->black_level);
-			glUniform1f(basic_shader_u_white_level, app_state->white_level);
-		} else {
-			glUniform1f(basic_shader_u_black_level, 0.0f);
-			glUniform1f(basic_shader_u_white_level, 1.0f);
-		}
+		glUniform1i(basic_shader_u_apply_color_lut, 1);
+		bind_color_lut(basic_shader_u_color_lut);
+		set_stain_view_for_image(image, false);
 
 		glUniformMatrix4fv(basic_shader_u_model_matrix, 1, GL_FALSE, &model_matrix[0][0]);
 
@@ -946,425 +4238,211 @@ void viewer_update_and_render(app_state_t *app_state, input_t *input, i32 client
 
 		draw_rect(image->simple.texture);
 	}
-	else if (image->type == IMAGE_TYPE_TIFF || image->type == IMAGE_TYPE_WSI) {
-
-		i32 old_level = scene->current_level;
-		i32 center_offset_x = 0;
-		i32 center_offset_y = 0;
-
-		i32 max_level = image->level_count - 1;
-		level_image_t* level_image = image->level_images + scene->current_level;
-
-		// TODO: move all input handling code together
-		if (input) {
-
-			i32 dlevel = 0;
-			bool32 used_mouse_to_zoom = false;
-
-			// Zoom in or out using the mouse wheel.
-			if (input->mouse_z != 0) {
-				dlevel = (input->mouse_z > 0 ? -1 : 1);
-				used_mouse_to_zoom = true;
-			}
-
-			float key_repeat_interval = 0.2f; // in seconds
-
-			// Zoom out using Z or /
-			if (is_key_down(input, 'Z') || is_key_down(input, KEYCODE_OEM_2 /* '/' */)) {
-
-				if (was_key_pressed(input, 'Z') || was_key_pressed(input, KEYCODE_OEM_2 /* '/' */)) {
-					dlevel += 1;
-					zoom_in_key_hold_down_start_time = get_clock();
-					zoom_in_key_times_zoomed_while_holding = 0;
-				} else {
-					float time_elapsed = get_seconds_elapsed(zoom_in_key_hold_down_start_time, get_clock());
-					int zooms = (int) (time_elapsed / key_repeat_interval);
-					if ((zooms - zoom_in_key_times_zoomed_while_holding) == 1) {
-						zoom_in_key_times_zoomed_while_holding = zooms;
-						dlevel += 1;
-					}
-				}
-			}
-
-			// Zoom in using X or .
-			if (is_key_down(input, 'X') || is_key_down(input, KEYCODE_OEM_PERIOD)) {
-
-
-				if (was_key_pressed(input, 'X') || was_key_pressed(input, KEYCODE_OEM_PERIOD)) {
-					dlevel -= 1;
-					zoom_out_key_hold_down_start_time = get_clock();
-					zoom_out_key_times_zoomed_while_holding = 0;
+	else if (image->type == IMAGE_TYPE_TIFF || image->type == IMAGE_TYPE_WSI || image->type == IMAGE_TYPE_RASTER) {
+		profiler_begin("process input (2)");
+
+		// Zooming and panning. With linked cameras, the other scenes make the same movements as the active scene.
+		v2f active_camera_before = scene->camera;
+		i32 active_level_before = scene->current_level;
+		bool32 is_replaying = update_camera_path_replay(app_state, scene, &delta_t);
+		update_scene_camera(app_state, scene, scene_images[active_scene_index], is_replaying ? NULL : input,
+		                    current_drag_vector, scene_clicked, delta_t);
+		for (i32 i = 0; i < scene_count; ++i) {
+			if (i == active_scene_index) continue;
+			scene_t* other_scene = app_state->scenes + i;
+			image_t* other_image = scene_images[i];
+			if (app_state->link_scene_cameras) {
+				v2f active_offset, other_offset;
+				if (get_scene_registration_offset(app_state, active_scene_index, &active_offset) &&
+				    get_scene_registration_offset(app_state, i, &other_offset)) {
+					// Registered slides (see registration.h): keep showing the matching tissue
+					other_scene->camera.x = scene->camera.x - active_offset.x + other_offset.x;
+					other_scene->camera.y = scene->camera.y - active_offset.y + other_offset.y;
 				} else {
-					float time_elapsed = get_seconds_elapsed(zoom_out_key_hold_down_start_time, get_clock());
-					int zooms = (int) (time_elapsed / key_repeat_interval);
-					if ((zooms - zoom_out_key_times_zoomed_while_holding) == 1) {
-						zoom_out_key_times_zoomed_while_holding = zooms;
-						dlevel -= 1;
-					}
+					other_scene->camera.x += scene->camera.x - active_camera_before.x;
+					other_scene->camera.y += scene->camera.y - active_camera_before.y;
 				}
-			}
-
-
-			if (dlevel != 0) {
-//		        printf("mouse_z = %d\n", input->mouse_z);
-				scene->current_level = CLAMP(scene->current_level + dlevel, 0, image->level_count - 1);
-				level_image = image->level_images + scene->current_level;
-
-				if (scene->current_level != old_level && used_mouse_to_zoom) {
-#if 1
-					center_offset_x = input->mouse_xy.x - client_width / 2;
-					center_offset_y = (input->mouse_xy.y - client_height / 2);
-
-					if (scene->current_level < old_level) {
-						// Zoom in, while keeping the area around the mouse cursor in the same place on the screen.
-						scene->camera.x += center_offset_x * level_image->um_per_pixel_x;
-						scene->camera.y += center_offset_y * level_image->um_per_pixel_y;
-					} else if (scene->current_level > old_level) {
-						// Zoom out, while keeping the area around the mouse cursor in the same place on the screen.
-						scene->camera.x -= center_offset_x * level_image->um_per_pixel_x * 0.5f;
-						scene->camera.y -= center_offset_y * level_image->um_per_pixel_y * 0.5f;
-					}
-#endif
+				i32 dlevel = scene->current_level - active_level_before;
+				if (dlevel != 0) {
+					other_scene->current_level = CLAMP(other_scene->current_level + dlevel, 0, other_image->level_count - 1);
+					other_scene->last_zoom_direction = scene->last_zoom_direction;
 				}
 			}
-
+			update_scene_camera(app_state, other_scene, other_image, NULL, (v2i){}, false, delta_t);
 		}
 
-
-
-
-		// TODO: fix/rewrite
-		// Spring/bounce effect
-		float d_zoom = (float) scene->current_level - scene->zoom_position;
-		float abs_d_zoom = fabsf(d_zoom);
-		if (abs_d_zoom > 1e-5f) {
-			app_state->allow_idling_next_frame = false;
+		if (input && was_key_pressed(input, 'P')) {
+			app_state->use_image_adjustments = !app_state->use_image_adjustments;
 		}
-		float sign_d_zoom = signbit(d_zoom) ? -1.0f : 1.0f;
-		float linear_catch_up_speed = 10.0f * delta_t;
-		float exponential_catch_up_speed = 18.0f * delta_t;
-		if (abs_d_zoom > linear_catch_up_speed) {
-			d_zoom = (linear_catch_up_speed + (abs_d_zoom - linear_catch_up_speed) * exponential_catch_up_speed) *
-			         sign_d_zoom;
-		}
-		scene->zoom_position += d_zoom;
-
-		scene->pixel_width = powf(2.0f, scene->zoom_position) * image->mpp_x;
-		scene->pixel_height = powf(2.0f, scene->zoom_position) * image->mpp_y;
-
-		float r_minus_l = scene->pixel_width * (float) client_width;
-		float t_minus_b = scene->pixel_height * (float) client_height;
-
-
-
-		v2f camera_min = {
-				.x = scene->camera.x - r_minus_l * 0.5f,
-				.y = scene->camera.y - t_minus_b * 0.5f,
-		};
-		v2f camera_max = {
-				.x = scene->camera.x + r_minus_l * 0.5f,
-				.y = scene->camera.y + t_minus_b * 0.5f,
-		};
-
-
-		draw_annotations(&scene->annotation_set, camera_min, scene->pixel_width);
 
-		i32 camera_tile_x1 = tile_pos_from_world_pos(camera_min.x, level_image->x_tile_side_in_um);
-		i32 camera_tile_x2 = tile_pos_from_world_pos(camera_max.x, level_image->x_tile_side_in_um) + 1;
-		i32 camera_tile_y1 = tile_pos_from_world_pos(camera_min.y, level_image->y_tile_side_in_um);
-		i32 camera_tile_y2 = tile_pos_from_world_pos(camera_max.y, level_image->y_tile_side_in_um) + 1;
+		update_camera_path_recording(app_state, scene);
 
-		camera_tile_x1 = CLAMP(camera_tile_x1, 0, level_image->width_in_tiles);
-		camera_tile_x2 = CLAMP(camera_tile_x2, 0, level_image->width_in_tiles);
-		camera_tile_y1 = CLAMP(camera_tile_y1, 0, level_image->height_in_tiles);
-		camera_tile_y2 = CLAMP(camera_tile_y2, 0, level_image->height_in_tiles);
-
-		scene->mouse = scene->camera;
-		if (input) {
+		for (i32 i = 0; i < scene_count; ++i) {
+			update_scene_visibility(app_state->scenes + i, scene_images[i]);
+		}
 
-			scene->mouse.x = camera_min.x + (float)input->mouse_xy.x * scene->pixel_width;
-			scene->mouse.y = camera_min.y + (float)input->mouse_xy.y * scene->pixel_height;
+		profiler_end();
 
+		// IO
+		profiler_begin("create tiles wishlist");
 
-			if (was_key_pressed(input, 'P')) {
-				app_state->use_image_adjustments = !app_state->use_image_adjustments;
+		// Create a 'wishlist' of tiles to request, for all scenes together
+		if (app_state->tile_wishlist) {
+			sb_raw_count(app_state->tile_wishlist) = 0;
+		}
+		for (i32 i = 0; i < scene_count; ++i) {
+			for (i32 channel = -1; next_shown_channel(scene_images[i], &channel);) {
+				add_jump_destination_to_wishlist(app_state, app_state->scenes + i, scene_images[i]);
+				add_visible_tiles_to_wishlist(app_state, app_state->scenes + i, scene_images[i]);
 			}
-#if 0
-
-			// Experimental code for exporting regions of the wsi to a raw image file.
-			if (input->mouse_buttons[1].down && input->mouse_buttons[1].transition_count > 0) {
-				DUMMY_STATEMENT;
-				i32 click_x = (camera_rect_x1 + input->mouse_xy.x * level_image->um_per_pixel_x) / wsi->mpp_x;
-				i32 click_y = (camera_rect_y2 - input->mouse_xy.y * level_image->um_per_pixel_y) / wsi->mpp_y;
-				printf("Clicked screen x=%d y=%d; image x=%d y=%d\n",
-						input->mouse_xy.x, input->mouse_xy.y, click_x, click_y);
+			if (scene_overlays[i]) {
+				add_overlay_tiles_to_wishlist(app_state, app_state->scenes + i, scene_overlays[i]);
 			}
-
-			{
-				button_state_t* button = &input->keyboard.keys['E'];
-				if (button->down && button->transition_count > 0) {
-					v2i p1 = { 101456, 30736 };
-					v2i p2 = { 134784
-				, 61384 };
-					i64 w = p2.x - p1.x;
-					i64 h = p2.y - p1.y;
-					size_t export_size = w * h * BYTES_PER_PIXEL;
-					u32* temp_memory = malloc(export_size);
-					openslide.openslide_read_region(wsi->osr, temp_memory, p1.x, p1.y, 0, w, h);
-					FILE* fp = fopen("export.raw", "wb");
-					fwrite(temp_memory, export_size, 1, fp);
-					fclose(fp);
-					free(temp_memory);
-					printf("Exported region, width %d height %d\n", w, h);
-
+		}
+//		printf("Num tiles on wishlist = %d\n", sb_count(app_state->tile_wishlist));
+
+		app_state->prefetched_tile_count = 0;
+		if (app_state->enable_prefetch) {
+			// Only fill up the part of the tile cache budget that is still free, so that prefetching never causes
+			// tiles that were actually drawn to be evicted.
+			i64 budget = (i64)app_state->tile_cache_budget_in_mb * MEGABYTES(1);
+			i64 tile_memory = get_tile_texture_memory(get_tile_texture_format_for_new_tiles());
+			i64 free_tile_count = (budget - app_state->cached_tile_memory) / tile_memory - tile_request_queue.request_count;
+			i32 max_prefetch_tiles = (i32)CLAMP(free_tile_count, 0, PREFETCH_MAX_TILES);
+			for (i32 i = 0; i < scene_count; ++i) {
+				for (i32 channel = -1; next_shown_channel(scene_images[i], &channel);) {
+					prefetch_tiles_for_scene(app_state, app_state->scenes + i, scene_images[i],
+					                         (i == active_scene_index) ? input : NULL, &max_prefetch_tiles);
 				}
 			}
-#endif
-
-			// Panning should be faster when zoomed in very far.
-			float panning_multiplier = 1.0f + 3.0f * ((float) max_level - scene->zoom_position) / (float) max_level;
-			if (is_key_down(input, KEYCODE_SHIFT)) {
-				panning_multiplier *= 0.25f;
-			}
-
-			// Panning using the arrow or WASD keys.
-			float panning_speed = 900.0f * delta_t * panning_multiplier;
-			if (input->keyboard.action_down.down || is_key_down(input, 'S')) {
-				scene->camera.y += level_image->um_per_pixel_y * panning_speed;
-				mouse_hide();
-			}
-			if (input->keyboard.action_up.down || is_key_down(input, 'W')) {
-				scene->camera.y -= level_image->um_per_pixel_y * panning_speed;
-				mouse_hide();
-			}
-			if (input->keyboard.action_right.down || is_key_down(input, 'D')) {
-				scene->camera.x += level_image->um_per_pixel_x * panning_speed;
-				mouse_hide();
-			}
-			if (input->keyboard.action_left.down || is_key_down(input, 'A')) {
-				scene->camera.x -= level_image->um_per_pixel_x * panning_speed;
-				mouse_hide();
-			}
-
-			if (scene->is_dragging) {
-				scene->camera.x -= current_drag_vector.x * level_image->um_per_pixel_x * panning_multiplier;
-				scene->camera.y -= current_drag_vector.y * level_image->um_per_pixel_y * panning_multiplier;
-			}
-
-			// try to select an annotation
-			if (scene->annotation_set.annotation_count > 0) {
-				if (was_key_pressed(input, 'Q') || (!gui_want_capture_mouse && scene_clicked)) {
-					i64 select_begin = get_clock();
-					select_annotation(scene, is_key_down(input, KEYCODE_CONTROL));
-					float selection_ms = get_seconds_elapsed(select_begin, get_clock()) * 1000.0f;
-//					printf("Selecting took %g ms.\n", selection_ms);
-				}
+			i32 max_focal_plane_tiles = (i32)CLAMP(free_tile_count, 0, FOCAL_PLANE_PREFETCH_MAX_TILES);
+			for (i32 i = 0; i < scene_count; ++i) {
+				prefetch_adjacent_focal_planes(app_state, app_state->scenes + i, scene_images[i], &max_focal_plane_tiles);
 			}
-
-			if (!gui_want_capture_keyboard && was_key_pressed(input, KEYCODE_DELETE)) {
-				delete_selected_annotations(&scene->annotation_set);
+		}
+		if (app_state->enable_readahead) {
+			for (i32 i = 0; i < scene_count; ++i) {
+				readahead_tiles_for_scene(app_state->scenes + i, scene_images[i]);
 			}
-
 		}
 
-		last_section = profiler_end_section(last_section, "viewer_update_and_render: process input (2)", 5.0f);
-
-		// IO
-
-		// Create a 'wishlist' of tiles to request
-		load_tile_task_t tile_wishlist[32];
-		i32 num_tasks_on_wishlist = 0;
-		float screen_radius = ATLEAST(1.0f, sqrtf(SQUARE(client_width/2) + SQUARE(client_height/2)));
-
-		for (i32 level = image->level_count - 1; level >= scene->current_level; --level) {
-			level_image_t *drawn_level = image->level_images + level;
-
-			i32 base_priority = (image->level_count - level) * 100; // highest priority for the most zoomed in levels
-
-			i32 level_camera_tile_x1 = tile_pos_from_world_pos(camera_min.x, drawn_level->x_tile_side_in_um);
-			i32 level_camera_tile_x2 = tile_pos_from_world_pos(camera_max.x, drawn_level->x_tile_side_in_um) + 1;
-			i32 level_camera_tile_y1 = tile_pos_from_world_pos(camera_min.y, drawn_level->y_tile_side_in_um);
-			i32 level_camera_tile_y2 = tile_pos_from_world_pos(camera_max.y, drawn_level->y_tile_side_in_um) + 1;
-
-			level_camera_tile_x1 = CLAMP(level_camera_tile_x1, 0, drawn_level->width_in_tiles);
-			level_camera_tile_x2 = CLAMP(level_camera_tile_x2, 0, drawn_level->width_in_tiles);
-			level_camera_tile_y1 = CLAMP(level_camera_tile_y1, 0, drawn_level->height_in_tiles);
-			level_camera_tile_y2 = CLAMP(level_camera_tile_y2, 0, drawn_level->height_in_tiles);
-
+		i32 num_tasks_on_wishlist = sb_count(app_state->tile_wishlist);
+		qsort(app_state->tile_wishlist, num_tasks_on_wishlist, sizeof(load_tile_task_t), priority_cmp_func);
 
-			for (i32 tile_y = level_camera_tile_y1; tile_y < level_camera_tile_y2; ++tile_y) {
-				for (i32 tile_x = level_camera_tile_x1; tile_x < level_camera_tile_x2; ++tile_x) {
+		// Requests for tiles that are no longer in view don't need to be loaded anymore.
+		app_state->cancelled_tile_request_count += cancel_stale_tile_requests(app_state->frame_counter);
 
+		profiler_end();
 
+		profiler_begin("load tiles");
 
-					tile_t* tile = get_tile(drawn_level, tile_x, tile_y);
-					if (tile->texture != 0 || tile->is_empty || tile->is_submitted_for_loading) {
-						continue; // nothing needs to be done with this tile
-					}
-
-					float tile_distance_from_center_of_screen_x =
-							(scene->camera.x - ((tile_x + 0.5f) * drawn_level->x_tile_side_in_um)) / drawn_level->um_per_pixel_x;
-					float tile_distance_from_center_of_screen_y =
-							(scene->camera.y - ((tile_y + 0.5f) * drawn_level->y_tile_side_in_um)) / drawn_level->um_per_pixel_y;
-					float tile_distance_from_center_of_screen =
-							sqrtf(SQUARE(tile_distance_from_center_of_screen_x) + SQUARE(tile_distance_from_center_of_screen_y));
-					tile_distance_from_center_of_screen /= screen_radius;
-					// prioritize tiles close to the center of the screen
-					float priority_bonus = (1.0f - tile_distance_from_center_of_screen) * 300.0f; // can be tweaked.
-					i32 tile_priority = base_priority + (i32)priority_bonus;
-
-
-
-					if (num_tasks_on_wishlist >= COUNT(tile_wishlist)) {
-						break;
-					}
-					tile_wishlist[num_tasks_on_wishlist++] = (load_tile_task_t){
-							.image = image, .tile = tile, .level = level, .tile_x = tile_x, .tile_y = tile_y,
-							.priority = tile_priority,
-					};
-
-				}
-			}
-
+		for (i32 i = 0; i < num_tasks_on_wishlist; ++i) {
+			load_tile_task_t* task = app_state->tile_wishlist + i;
+			submit_tile_request(task);
+			task->tile->time_last_drawn = app_state->frame_counter;
 		}
-//		printf("Num tiles on wishlist = %d\n", num_tasks_on_wishlist);
-
-		qsort(tile_wishlist, num_tasks_on_wishlist, sizeof(load_tile_task_t), priority_cmp_func);
-
-		last_section = profiler_end_section(last_section, "viewer_update_and_render: create tiles wishlist", 5.0f);
 
-
-		if (num_tasks_on_wishlist > 0){
-			app_state->allow_idling_next_frame = false;
-
-			if (image->type == IMAGE_TYPE_TIFF && image->tiff.tiff.is_remote) {
-				// For remote slides, only send out a batch request every so often, instead of single tile requests every frame.
-				// (to reduce load on the server)
-				static u32 intermittent = 0;
-				++intermittent;
-				u32 intermittent_interval = 1;
-				intermittent_interval = 5; // reduce load on remote server; can be tweaked
-				if (intermittent % intermittent_interval == 0) {
-					i32 max_tiles_to_load = ATMOST(num_tasks_on_wishlist, 3); // can be tweaked
-
-					load_tile_task_batch_t* batch = (load_tile_task_batch_t*) calloc(1, sizeof(load_tile_task_batch_t));
-					batch->task_count = ATMOST(COUNT(batch->tile_tasks), max_tiles_to_load);
-					memcpy(batch->tile_tasks, tile_wishlist, batch->task_count * sizeof(load_tile_task_t));
-					if (add_work_queue_entry(&work_queue, tiff_load_tile_batch_func, batch)) {
-						// success
-						for (i32 i = 0; i < batch->task_count; ++i) {
-							load_tile_task_t* task = batch->tile_tasks + i;
-							task->tile->is_submitted_for_loading = true;
-						}
+		update_tile_load_budget(app_state, delta_t);
+
+		i32 pending_request_count = tile_request_queue.request_count;
+		if (pending_request_count > 0) {
+
+			// Each work queue entry picks up the most urgent request(s) at the moment it starts executing, so we only
+			// need to keep enough entries in flight to keep the workers busy.
+			bool32 is_remote = false;
+			bool32 is_local_unmapped = false;
+			for (i32 i = 0; i < scene_count; ++i) {
+				if (scene_images[i]->type == IMAGE_TYPE_TIFF) {
+					if (scene_images[i]->tiff.tiff.is_remote) {
+						is_remote = true;
+					} else if (!scene_images[i]->tiff.tiff.mapped_data) {
+						is_local_unmapped = true;
 					}
+				} else if (scene_images[i]->type == IMAGE_TYPE_WSI) {
+					is_local_unmapped = true; // batches allow reading adjacent tiles in one go (see load_wsi_tile_batch())
 				}
-			} else {
-				// regular file loading
-				i32 max_tiles_to_load = ATMOST(num_tasks_on_wishlist, 10);
-				for (i32 i = 0; i < max_tiles_to_load; ++i) {
-					load_tile_task_t* the_task = &tile_wishlist[i];
-					load_tile_task_t* task_data = (load_tile_task_t*) malloc(sizeof(load_tile_task_t)); // should be freed after uploading the tile to the gpu
-					*task_data = *the_task;
-					if (add_work_queue_entry(&work_queue, load_tile_func, task_data)) {
-						// success
-						task_data->tile->is_submitted_for_loading = true;
-					}
+			}
+			i32 max_in_flight = is_remote ? app_state->remote_tile_batches_in_flight : app_state->target_tile_loads_in_flight;
+			i32 tiles_per_entry = 1;
+			if (is_remote) {
+				tiles_per_entry = app_state->remote_tile_batch_size;
+			} else if (is_local_unmapped) {
+				// Hand out several tiles at once (so their reads can be merged), as long as all workers still get some
+				i32 worker_count = ATLEAST(1, total_thread_count - 1);
+				tiles_per_entry = CLAMP(pending_request_count / worker_count, 1, LOCAL_TILE_BATCH_MAX);
+			}
+			while (tile_request_queue.jobs_in_flight * tiles_per_entry < pending_request_count &&
+			       tile_request_queue.jobs_in_flight + tile_request_queue.loads_in_progress < max_in_flight) {
+				interlocked_increment(&tile_request_queue.jobs_in_flight);
+				if (!add_work_queue_entry(&work_queue, load_next_tile_request_func, (void*)(intptr_t)tiles_per_entry)) {
+					interlocked_decrement(&tile_request_queue.jobs_in_flight);
+					tile_metrics_count(TILE_COUNTER_DROPPED, 1);
+					break; // work queue is full, try again on a later frame
 				}
 			}
-
-
 		}
 
-		last_section = profiler_end_section(last_section, "viewer_update_and_render: load tiles", 5.0f);
+		profiler_end();
 
 
 		// RENDERING
 
-
+		// The tiles are positioned in screen coordinates (see push_visible_tiles()), so that the tiles of all scenes
+		// can be drawn in the same draw calls.
 		mat4x4 projection = {};
 		{
-			float l = -0.5f * r_minus_l;
-			float r = +0.5f * r_minus_l;
-			float b = +0.5f * t_minus_b;
-			float t = -0.5f * t_minus_b;
+			float l = 0.0f;
+			float r = (float) client_width;
+			float b = (float) client_height;
+			float t = 0.0f;
 			float n = 100.0f;
 			float f = -100.0f;
 			mat4x4_ortho(projection, l, r, b, t, n, f);
 		}
 
-		mat4x4 I;
-		mat4x4_identity(I);
-
-		// define view matrix
-		mat4x4 view_matrix;
-		mat4x4_translate(view_matrix, -scene->camera.x, -scene->camera.y, 0.0f);
-
-		mat4x4 projection_view_matrix;
-		mat4x4_mul(projection_view_matrix, projection, view_matrix);
-
-		glUseProgram(basic_shader);
+		glUseProgram(tile_shader);
 		glActiveTexture(GL_TEXTURE0);
-		glUniform1i(basic_shader_u_tex, 0);
-
-		glUniformMatrix4fv(basic_shader_u_projection_view_matrix, 1, GL_FALSE, &projection_view_matrix[0][0]);
-
-		glUniform3fv(basic_shader_u_background_color, 1, (GLfloat *) &app_state->clear_color);
-		if (app_state->use_image_adjustments) {
-			glUniform1f(basic_shader_u_black_level, app_state->black_level);
-			glUniform1f(basic_shader_u_white_level, app_state->white_level);
-		} else {
-			glUniform1f(basic_shader_u_black_level, 0.0f);
-			glUniform1f(basic_shader_u_white_level, 1.0f);
-		}
-
-		i32 num_levels_above_current = image->level_count - scene->current_level - 1;
-		ASSERT(num_levels_above_current >= 0);
-
-		last_section = profiler_end_section(last_section, "viewer_update_and_render: render (1)", 5.0f);
-
-		// Draw all levels within the viewport, up to the current zoom factor
-		for (i32 level = scene->current_level; level < image->level_count; ++level) {
-//		for (i32 level = image->level_count - 1; level >= scene->current_level; --level) {
-			level_image_t *drawn_level = image->level_images + level;
-
-			i32 level_camera_tile_x1 = tile_pos_from_world_pos(camera_min.x, drawn_level->x_tile_side_in_um);
-			i32 level_camera_tile_x2 = tile_pos_from_world_pos(camera_max.x, drawn_level->x_tile_side_in_um) + 1;
-			i32 level_camera_tile_y1 = tile_pos_from_world_pos(camera_min.y, drawn_level->y_tile_side_in_um);
-			i32 level_camera_tile_y2 = tile_pos_from_world_pos(camera_max.y, drawn_level->y_tile_side_in_um) + 1;
-
-			level_camera_tile_x1 = CLAMP(level_camera_tile_x1, 0, drawn_level->width_in_tiles);
-			level_camera_tile_x2 = CLAMP(level_camera_tile_x2, 0, drawn_level->width_in_tiles);
-			level_camera_tile_y1 = CLAMP(level_camera_tile_y1, 0, drawn_level->height_in_tiles);
-			level_camera_tile_y2 = CLAMP(level_camera_tile_y2, 0, drawn_level->height_in_tiles);
-
-			for (i32 tile_y = level_camera_tile_y1; tile_y < level_camera_tile_y2; ++tile_y) {
-				for (i32 tile_x = level_camera_tile_x1; tile_x < level_camera_tile_x2; ++tile_x) {
+		glUniform1i(tile_shader_u_tex, 0);
 
-					tile_t *tile = get_tile(drawn_level, tile_x, tile_y);
-					if (tile->texture) {
-						u32 texture = get_texture_for_tile(image, level, tile_x, tile_y);
+		glUniformMatrix4fv(tile_shader_u_projection_view_matrix, 1, GL_FALSE, &projection[0][0]);
 
-						float tile_pos_x = drawn_level->x_tile_side_in_um * tile_x;
-						float tile_pos_y = drawn_level->y_tile_side_in_um * tile_y;
+		v3f background_color = { .r = app_state->clear_color.r, .g = app_state->clear_color.g, .b = app_state->clear_color.b };
 
-						// define model matrix
-						mat4x4 model_matrix;
-						mat4x4_translate(model_matrix, tile_pos_x, tile_pos_y, 0.0f);
-						mat4x4_scale_aniso(model_matrix, model_matrix, drawn_level->x_tile_side_in_um,
-						                   drawn_level->y_tile_side_in_um, 1.0f);
-						glUniformMatrix4fv(basic_shader_u_model_matrix, 1, GL_FALSE, &model_matrix[0][0]);
-
-						draw_rect(texture);
-					}
-
-				}
+		profiler_begin("draw tiles");
+		begin_gpu_pass(GPU_PASS_TILES);
+		begin_tile_instances();
+		for (i32 i = 0; i < scene_count; ++i) {
+			push_visible_channel_tiles(app_state, app_state->scenes + i, scene_images[i]);
+			if (scene_overlays[i]) {
+				push_overlay_tiles(app_state, app_state->scenes + i, scene_overlays[i]);
 			}
-
 		}
+		// (if nothing changed since the last frame, the tiles are not drawn again, see draw_tile_layer())
+		draw_tile_layer(client_width, client_height, background_color);
+		update_auto_levels(app_state);
+		glUseProgram(tile_shader);
+		draw_minimap(app_state, image);
+		end_gpu_pass(GPU_PASS_TILES);
+		profiler_end();
+
+		// The annotations belong to the displayed image, in scene 0.
+		update_background_annotation_loads(app_state);
+		profiler_begin("draw annotations");
+		begin_gpu_pass(GPU_PASS_ANNOTATIONS);
+		{
+			scene_t* main_scene = app_state->scenes + 0;
+			v2f camera_min, camera_max;
+			get_scene_camera_bounds(main_scene, &camera_min, &camera_max);
+			draw_annotations(&main_scene->annotation_set, camera_min, main_scene->pixel_width, main_scene->viewport,
+			                 app_state->client_viewport);
+		}
+		end_gpu_pass(GPU_PASS_ANNOTATIONS);
 
-		last_section = profiler_end_section(last_section, "viewer_update_and_render: render (2)", 5.0f);
+		profiler_end();
 
+		// (tiles are evicted at the end of the frame, see run_frame_jobs())
 	}
 
+	// (before the GUI is drawn over the views)
+	capture_view_if_requested(client_width, client_height);
 }
-
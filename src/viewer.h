@@ -29,6 +29,7 @@ extern "C" {
 #include "openslide_api.h"
 #include "caselist.h"
 #include "annotation.h"
+#include "color_pipeline.h"
 
 typedef struct texture_t {
 	u32 texture;
@@ -55,12 +56,18 @@ typedef struct {
 } wsi_level_t;
 
 #define WSI_MAX_LEVELS 16
+#define IMAGE_MAX_LEVELS 32
+#define FOCAL_PLANE_MAX 32
 
 typedef struct wsi_t {
 	i64 width;
 	i64 height;
 	i32 level_count;
 	openslide_t* osr;
+	// OpenSlide serializes reads on the same openslide_t, so each worker thread opens its own handle on first use
+	// (see get_wsi_handle_for_thread()).
+	openslide_t* thread_osr[MAX_THREAD_COUNT];
+	char* filename;
 	const char* barcode;
 	float mpp_x;
 	float mpp_y;
@@ -72,17 +79,90 @@ typedef enum {
 	IMAGE_TYPE_SIMPLE,
 	IMAGE_TYPE_TIFF,
 	IMAGE_TYPE_WSI,
+	IMAGE_TYPE_RASTER, // a PNG/JPEG too large for a single texture: tiled, with the levels generated in memory
 } image_type_enum;
 
 
+// What a worker decoded a tile into (see decode_compressed_tile())
+typedef enum {
+	DECODED_TILE_BGRA = 0,
+	DECODED_TILE_YCBCR_PLANES, // see decode_tile_planar_with_state()
+	DECODED_TILE_DCT_COEFFICIENTS, // see decode_tile_coefficients_with_state(), finished on the GPU
+} decoded_tile_layout_enum;
+
+typedef enum {
+	TILE_STATE_UNLOADED = 0, // not requested (or failed, cancelled, evicted): may be requested
+	TILE_STATE_QUEUED,       // waiting in the tile request queue; can still be reprioritized or cancelled
+	TILE_STATE_LOADING,      // picked up by a worker thread, being read/decoded/uploaded
+	TILE_STATE_LOADED,       // texture_slot is valid
+} tile_state_enum;
+
+// How far the last load of a tile got, for the tile state overlay (see get_tile_overlay_state()). Written by the
+// pipeline as it goes; costs a byte that tile_t has to spare anyway.
+typedef enum tile_debug_stage_enum {
+	TILE_DEBUG_STAGE_NONE = 0,
+	TILE_DEBUG_STAGE_IO,        // picked up by a worker, reading the compressed data
+	TILE_DEBUG_STAGE_DECODING,
+	TILE_DEBUG_STAGE_UPLOADING, // decoded, waiting for the main thread to upload it (see upload_decoded_tiles())
+	TILE_DEBUG_STAGE_DONE,
+	TILE_DEBUG_STAGE_FAILED,
+	TILE_DEBUG_STAGE_EVICTED,
+} tile_debug_stage_enum;
+
+// The states shown by the tile state overlay (see draw_tile_state_overlay() in gui.cpp)
+typedef enum tile_overlay_state_enum {
+	TILE_OVERLAY_NOT_REQUESTED = 0,
+	TILE_OVERLAY_QUEUED,
+	TILE_OVERLAY_IO,
+	TILE_OVERLAY_DECODING,
+	TILE_OVERLAY_UPLOADING,
+	TILE_OVERLAY_RESIDENT,
+	TILE_OVERLAY_EMPTY,
+	TILE_OVERLAY_FAILED,
+	TILE_OVERLAY_EVICTED,
+	TILE_OVERLAY_STATE_COUNT
+} tile_overlay_state_enum;
+
+// Kept small, because a level can have millions of tiles (see tile_table.c). Whether a tile is empty is not kept
+// here, but in a bitmap of the level (see is_tile_empty()).
 typedef struct tile_t {
-	u32 texture;
-	bool32 is_submitted_for_loading;
-	bool32 is_empty;
+	u32 texture_slot; // layer in one of the tile texture arrays, 1-based (0 = not loaded)
+	u32 uniform_color; // BGRA
+	i32 volatile state; // tile_state_enum
+	i32 priority; // updated every frame while the tile is in view
+	bool8 is_uniform; // drawn in uniform_color, instead of from a texture (see is_tile_uniform())
+	bool8 is_in_cached_tiles;
+	u8 resolution_shift; // the texture holds the tile at 1 / 2^resolution_shift of its size (see load_tile_task_t)
+	u8 volatile debug_stage; // tile_debug_stage_enum
+	u16 load_latency_in_ms; // from the request until the tile was first drawn (for the tile state overlay)
+	bool8 is_reduced_quality; // downloaded at a lower JPEG quality, to be loaded again (see update_remote_tile_quality())
+	i64 time_last_wanted; // frame number at which the tile was last in view; older requests get cancelled
+	i64 time_last_drawn; // frame number, used for LRU eviction of the texture
+	i64 request_clock; // when the tile was last requested, until it is first drawn (for the tile metrics)
 } tile_t;
 
+// The largest generated level (see generated_levels.c); coarser levels are generated instead, if they fit
+#define GENERATED_LEVEL_MAX_SIZE MEGABYTES(256)
+// PNG/JPEG images larger than this (in either direction) are shown tiled, as IMAGE_TYPE_RASTER
+#define LARGE_RASTER_IMAGE_DIM 4096
+
+#define TILE_PAGE_DIM_LOG2 4
+#define TILE_PAGE_DIM (1 << TILE_PAGE_DIM_LOG2)
+#define TILE_PAGE_SIZE (TILE_PAGE_DIM * TILE_PAGE_DIM)
+
+// Tiles that have been requested for loading, and may currently own a texture
+typedef struct cached_tile_t {
+	tile_t* tile;
+	i32 level; // (of any focal plane)
+} cached_tile_t;
+
 typedef struct {
-	tile_t* tiles;
+	// Tile states, in pages of TILE_PAGE_DIM x TILE_PAGE_DIM tiles that are only allocated on first use (see get_tile())
+	tile_t* volatile* tile_pages; // width_in_pages * height_in_pages
+	u32 volatile* empty_tile_bits; // one bit per tile, in raster order (see is_tile_empty())
+	i32 volatile* nonempty_tile_counts; // per page; pages without nonempty tiles are skipped by next_tile()
+	u32 width_in_pages;
+	u32 height_in_pages;
 	u64 tile_count;
 	u32 width_in_tiles;
 	u32 height_in_tiles;
@@ -90,10 +170,55 @@ typedef struct {
 	float y_tile_side_in_um;
 	float um_per_pixel_x;
 	float um_per_pixel_y;
+	u32 tile_width; // in pixels, at most TILE_DIM; smaller tiles fill the top-left part of the tile buffer and texture
+	u32 tile_height;
+	i32 tiff_level; // index into tiff.level_images, or -1 if the level is missing from the file (synthesized)
+	i32 source_level; // for synthesized levels: the finer level that the tiles are built from
+	i32 source_scale_shift; // for synthesized levels: a tile consists of (1 << shift)^2 source tiles, decoded at reduced size
+	bool32 are_tiles_preloaded; // the compressed tiles came with the slide header, and are waiting in the tile cache
+	// Generated levels are built in memory in the background, and the tiles are cut from it (see generated_levels.c)
+	bool32 is_generated;
+	u8* volatile generated_pixels; // BGRA, NULL until the level is ready
+	u32 generated_width;
+	u32 generated_height;
 } level_image_t;
 
+// Which parts of a slide have tissue on them (see tissue_mask.c)
+typedef struct tissue_mask_t {
+	i32 width; // in pixels of the mask
+	i32 height;
+	float um_per_pixel_x;
+	float um_per_pixel_y;
+	u32* summed_area; // (width + 1) x (height + 1): the number of tissue pixels above and to the left
+} tissue_mask_t;
+
+// The render passes that are timed on the GPU (see begin_gpu_pass())
+typedef enum gpu_pass_enum {
+	GPU_PASS_TILES,
+	GPU_PASS_ANNOTATIONS,
+	GPU_PASS_GUI,
+	GPU_PASS_COUNT
+} gpu_pass_enum;
+
+// Colormaps for overlays (see apply_overlay_colormap() in tile.frag)
+typedef enum overlay_colormap_enum {
+	OVERLAY_COLORMAP_JET = 0,
+	OVERLAY_COLORMAP_VIRIDIS = 1,
+	OVERLAY_COLORMAP_RED = 2,
+	OVERLAY_COLORMAP_COUNT
+} overlay_colormap_enum;
+
+// The display settings of a channel of a fluorescence image (see push_visible_channel_tiles())
+typedef struct image_channel_t {
+	bool is_enabled; // only the enabled channels are loaded and drawn
+	v3f color;
+	float gain;
+	float offset;
+} image_channel_t;
+
 typedef struct {
 	image_type_enum type;
+	u32 image_id;
 	bool32 is_freshly_loaded; // TODO: remove or refactor, is this still needed?
 	union {
 		struct {
@@ -112,31 +237,89 @@ typedef struct {
 		} wsi;
 	};
 	i32 level_count;
-	level_image_t* level_images;
+	level_image_t* level_images; // of the focal plane in view (points into focal_plane_level_images)
+	// Z-stacks: each focal plane has its own levels, focal_plane_count * level_count in all (see set_focal_plane())
+	level_image_t* focal_plane_level_images;
+	i32 focal_plane_count;
+	i32 focal_plane; // in view
+	i32 last_focus_direction; // -1 or 1, for prefetching the next plane in that direction first
+	// Fluorescence images have a grayscale channel in the place of each focal plane; the channels are drawn together
+	i32 channel_count; // 0 if not a fluorescence image, otherwise the same as focal_plane_count
+	image_channel_t channels[FOCAL_PLANE_MAX];
+	// Overlays, e.g. a heatmap of a model's predictions, are drawn over another image instead of in a scene of their own
+	// (see load_overlay_from_file()). They are unloaded together with that image.
+	u32 overlay_of_image_id; // 0 if not an overlay
+	float overlay_opacity;
+	i32 overlay_colormap; // overlay_colormap_enum
+	cached_tile_t* cached_tiles; // sb
+	struct disk_cache_t* disk_cache; // for remote slides
+	u64 shared_cache_slide_id; // for remote slides, identifies the slide in the shared tile cache (see shared_tile_cache.h)
+	volatile i32 tile_loads_in_flight; // see take_tile_requests()
+	volatile i32 tile_table_loads_in_flight; // see load_tile_tables_func()
+	volatile i32 remote_downloads_in_flight; // see tiff_load_tile_batch_func()
+	volatile i32 coarsest_level_loads_in_flight; // see load_coarsest_level_first()
+	volatile i32 region_exports_in_flight; // see start_region_export()
+	volatile i32 tile_streams_in_flight; // see start_tile_stream()
+	volatile i32 registrations_in_flight; // see start_scene_registrations()
+	tissue_mask_t* volatile tissue_mask; // NULL until computed (see start_tissue_mask_computation())
+	volatile i32 tissue_mask_computations_in_flight;
+	volatile i32 is_tissue_mask_cancelled;
+	volatile i32 level_generations_in_flight; // see start_level_generation()
+	volatile i32 is_level_generation_cancelled;
+	char identity[512]; // the file (or remote location) the image was loaded from, to find it again when reopened
+	i64 frame_last_displayed;
 	float mpp_x;
 	float mpp_y;
 	i64 width_in_pixels;
 	i64 width_in_um;
 	i64 height_in_pixels;
 	i64 height_in_um;
+	stain_matrix_t stain_matrix; // for showing the stains separately, see get_stain_unmixing()
+	i32 shown_stain; // 0 = the original colors, 1-3 = only that stain
 } image_t;
 
 typedef struct load_tile_task_t {
 	image_t* image;
 	tile_t* tile;
+	i32 focal_plane;
 	i32 level;
 	i32 tile_x;
 	i32 tile_y;
 	i32 priority;
+	i32 resolution_shift; // decode at 1 / 2^resolution_shift of the size, for tiles that are drawn that much minified
+	i32 remote_tile_quality; // remote slides: the JPEG quality the server may reduce the tile to, or 0 for full quality
+	// Clock timestamps for the tile metrics (see tile_metrics.h)
+	i64 request_clock; // set by submit_tile_request()
+	i64 start_clock; // set when a worker takes the request off the queue
 } load_tile_task_t;
 
 #define TILE_LOAD_BATCH_MAX 8
+#define REMOTE_RANGES_PER_REQUEST 2 // a remote batch is split into pipelined requests, so the first tiles arrive sooner
 
 typedef struct load_tile_task_batch_t {
 	i32 task_count;
 	load_tile_task_t tile_tasks[TILE_LOAD_BATCH_MAX];
 } load_tile_task_batch_t;
 
+// Tile requests wait here until a worker is free, instead of being baked into the work queue in FIFO order.
+// The main thread keeps the priorities up to date, so a worker always starts on the most urgent tile at that moment,
+// and requests for tiles that went out of view can still be cancelled before any I/O has been done for them.
+typedef struct tile_request_queue_t {
+	i32 volatile lock;
+	i32 request_count; // same as sb_count(requests), but safe to read without holding the lock
+	i32 volatile jobs_in_flight; // work queue entries that have not yet picked up a request
+	i32 volatile loads_in_progress; // work queue entries that are currently loading tiles
+	load_tile_task_t* requests; // sb
+} tile_request_queue_t;
+
+// Filled in by the worker threads, collected (and reset) by the main thread once per frame.
+typedef struct tile_load_stats_t {
+	i32 volatile lock;
+	i32 tiles_loaded;
+	float io_seconds; // summed over the tiles: time spent waiting for the compressed data (local or remote)
+	float total_seconds; // summed over the tiles: time from starting the load to handing the tile to the GPU
+} tile_load_stats_t;
+
 
 enum entity_type_enum {
 	ENTITY_SIMPLE_IMAGE = 1,
@@ -158,6 +341,47 @@ typedef struct entity_t {
 
 #define MAX_ENTITIES 1000
 
+// The priority of a visible tile within its level (see get_visible_tile_priority_bonus()). This amounts to several
+// levels' worth of priority, so that the tiles close to where the user is looking can go before the tiles at the
+// edges of the view of a more zoomed in level.
+#define VISIBLE_TILE_PRIORITY_BONUS 300
+
+#define PREFETCH_BASE_PRIORITY (-10000) // always below the tiles that are actually in view
+#define FOCAL_PLANE_PREFETCH_BASE_PRIORITY (2 * PREFETCH_BASE_PRIORITY) // idle: below all other prefetching
+#define IS_PREFETCH_PRIORITY(priority) ((priority) < PREFETCH_BASE_PRIORITY / 2)
+// Tiles in view that were downloaded at reduced quality are loaded again after the tiles that are missing, but ahead of
+// prefetching (and the server treats them as bulk requests, see http_request_t in server.c).
+#define QUALITY_REFINEMENT_BASE_PRIORITY (PREFETCH_BASE_PRIORITY / 2)
+
+typedef struct tile_range_t {
+	i32 x1, y1, x2, y2; // x2 and y2 are exclusive
+} tile_range_t;
+
+// For looping over the nonempty tiles of a range (see begin_tile_iteration() and next_tile())
+typedef struct tile_iterator_t {
+	level_image_t* level_image;
+	tile_range_t range;
+	bool32 allocate_pages;
+	i32 tile_x;
+	i32 tile_y;
+	tile_t* tile; // NULL for tiles that were never touched, if allocate_pages is not set
+} tile_iterator_t;
+
+// Which tiles of each level are in view of a scene, worked out once per frame (see update_scene_visibility()), and
+// used for requesting, prefetching and drawing the tiles alike.
+typedef struct scene_visibility_t {
+	u32 image_id;
+	rect2i viewport;
+	v2f camera_min;
+	v2f camera_max;
+	float pixel_width;
+	float pixel_height;
+	v2f focus; // where the user is looking: the mouse cursor if over the scene, otherwise the center of the view
+	float focus_radius; // in screen pixels: the distance from the focus to the farthest corner of the viewport
+	i32 level_count;
+	tile_range_t levels[IMAGE_MAX_LEVELS]; // tile ranges in view; only recomputed when the camera moves
+} scene_visibility_t;
+
 typedef struct scene_t {
 	rect2i viewport;
 	v2f camera;
@@ -166,44 +390,184 @@ typedef struct scene_t {
 	float pixel_width;
 	float pixel_height;
 	float zoom_position;
-	i32 current_level;
+	i32 current_level; // the level the zoom animation is heading for
+	i32 zoom_passing_level; // the level the zoom animation is currently passing through
+	float zoom_passing_level_seconds; // how long it has been at that level
 	v4f clear_color;
 	u32 entity_count;
 	entity_t entities[MAX_ENTITIES];
 	annotation_set_t annotation_set;
 	bool8 is_dragging; // if mouse down: is this scene being dragged?
 	v2i cumulative_drag_vector;
+	v2f previous_camera;
+	i32 previous_level;
+	v2f camera_velocity; // in micrometers per second, smoothed over a few frames
+	i32 last_zoom_direction; // -1 = last zoomed in, 1 = last zoomed out
+	v2f jump_target; // where the camera is heading, while is_jumping (see jump_scene_camera())
+	bool8 is_jumping;
+	u32 image_id; // the loaded image shown in this scene, see get_image_for_scene()
+	scene_visibility_t visibility;
+	// The tiles that readahead hints were last given for (see readahead_tiles_for_scene())
+	u32 readahead_image_id;
+	i32 readahead_level;
+	tile_range_t readahead_range;
+	// Coarse registration with scene 0 (see registration.h): the tissue at a position in scene 0 is at that position
+	// plus registration_offset (in micrometers) in this scene. Only valid for the pair of images it was computed for.
+	v2f registration_offset;
+	u32 registered_image_id;
+	u32 registered_reference_id;
 	bool8 initialized;
 } scene_t;
 
+// The client area can be split between several scenes, e.g. to compare an H&E slide with its IHC restains.
+// Scene 0 shows the displayed image (and holds the annotations); the other scenes show the other loaded images.
+#define MAX_SCENES 4
+
+// Reopening one of these slides only switches the view back to it. Opening another one unloads the slide that was
+// displayed least recently. The tile caches and worker threads are shared: slides that are not displayed don't
+// request any tiles, and their textures are the first to be evicted.
+#define MAX_LOADED_IMAGES 4
+
+// Replaying a camera path recorded with View > Debug > Record camera path, as a reproducible workload (see
+// update_camera_path_replay() in viewer.c). Each frame advances the replay by a fixed time step, so that every run
+// shows the same sequence of views regardless of how fast the frames are; the frame times and the tile metrics are
+// reported when the replay is done.
+#define CAMERA_PATH_REPLAY_FRAME_SECONDS (1.0f / 60.0f)
+#define CAMERA_PATH_REPLAY_MAX_SETTLE_SECONDS 10.0f // after the last view, wait for the pending tiles at most this long
+
+typedef struct camera_path_point_t {
+	float time;
+	v2f camera;
+	i32 level;
+	i32 viewport_width;
+	i32 viewport_height;
+} camera_path_point_t;
+
+typedef struct camera_path_replay_t {
+	camera_path_point_t* points; // sb
+	i32 current_point;
+	i64 frame_index;
+	i64 last_frame_clock;
+	float* frame_times; // sb, in seconds
+	bool32 is_active;
+	bool32 quit_when_done; // e.g. when started from the command line
+} camera_path_replay_t;
+
+#define TILE_HISTOGRAM_BINS 256 // luminance, for auto-levels (needs to match tile_histogram.comp)
+#define AUTO_LEVELS_LOW_PERCENTILE 0.005f
+#define AUTO_LEVELS_HIGH_PERCENTILE 0.995f
+
 typedef struct app_state_t {
 	u8* temp_storage_memory;
-	arena_t temp_arena;
+	arena_t frame_arena; // on temp_storage_memory, reset at the start of every frame
 	rect2i client_viewport;
-	scene_t scene;
+	scene_t scenes[MAX_SCENES];
+	i32 scene_count; // the number of scenes shown side by side
+	bool link_scene_cameras; // panning and zooming in one scene also pans and zooms the other scenes
 	v4f clear_color;
-	float black_level;
-	float white_level;
-	image_t* loaded_images; // sb
-	i32 displayed_image;
+	color_adjustments_t image_adjustments; // only applied if use_image_adjustments is set
+	bool use_display_profile; // correct the colors for the display, see color_pipeline.h
+	display_profile_t display_profile;
+	image_t** loaded_images; // sb; allocated one by one, because worker threads keep pointers to them
+	i32 displayed_image; // index into loaded_images
 	caselist_t caselist;
 	case_t* selected_case;
 	bool use_builtin_tiff_backend;
 	bool use_image_adjustments;
+	rect2i minimap_rect; // where the overview is shown, in client coordinates (set by the GUI, empty if not shown)
+	bool use_auto_levels; // set the black and white level from the histogram of the visible tiles (see update_auto_levels())
 	bool initialized;
 	bool allow_idling_next_frame;
+	i64 frame_counter;
+	i32 tile_cache_budget_in_mb; // maximum amount of texture memory for tiles, before the least recently drawn are evicted
+	i32 cached_tile_count;
+	i64 cached_tile_memory;
+	i64 evicted_tile_count;
+	i64 cancelled_tile_request_count;
+	bool enable_prefetch; // request tiles ahead of panning and zooming
+	bool enable_readahead; // local slides: let the OS read the tiles around the view into its page cache ahead of time
+	bool decode_minified_tiles_at_reduced_size; // while zooming in, see get_wanted_resolution_shift()
+	bool blend_zoom_levels; // while zooming, see get_first_drawn_level()
+	bool enable_low_latency_frame_pacing; // while panning and zooming, start frames as late as possible (see win32_main.c)
+	bool record_camera_path; // write the camera of the active scene to camera_path.txt, for replaying in tilebench.c or the viewer
+	camera_path_replay_t camera_path_replay;
+	annotation_stress_params_t annotation_stress; // see annotation_stress.c
+	i32 prefetched_tile_count;
+	load_tile_task_t* tile_wishlist; // sb, rebuilt every frame
+	float tile_load_rate; // tiles per second, smoothed
+	float tile_io_latency; // seconds per tile, smoothed
+	float tile_load_time; // seconds per tile, smoothed
+	i32 target_tile_loads_in_flight;
+	i32 remote_tile_batch_size;
+	i32 remote_tile_batches_in_flight;
+	float remote_rtt; // seconds until the first byte of a batch response comes back, smoothed
+	float remote_bandwidth; // bytes per second while receiving, per connection, smoothed
+	float remote_bytes_per_tile; // smoothed
+	bool adapt_remote_tile_quality; // on slow links, ask for the tiles at a lower quality first (see update_remote_tile_quality())
+	i32 remote_tile_quality; // the JPEG quality asked for right now, or 0 for the tiles as they are
+	float tile_upload_budget_in_ms; // time per frame the main thread may spend uploading decoded tiles
+	i32 tiles_waiting_for_upload;
+	i32 compressed_tile_cache_budget_in_mb;
 } app_state_t;
 
 
 //  prototypes
+void unload_image(image_t* image);
+void update_image_unloads();
 void unload_all_images(app_state_t* app_state);
 void reset_scene(image_t* image, scene_t* scene);
-void add_image_from_tiff(app_state_t* app_state, tiff_t tiff);
+bool32 can_load_tiff_tiles(tiff_t* tiff);
+void add_image_from_tiff(app_state_t* app_state, tiff_t tiff, const char* identity);
+bool32 switch_to_loaded_image(app_state_t* app_state, const char* identity);
 bool32 load_generic_file(app_state_t* app_state, const char* filename);
+void load_associated_xml_annotations(app_state_t* app_state, const char* filename);
+bool32 load_image_using_openslide(app_state_t* app_state, const char* filename);
+//#define BENCHMARK_TILE_READS
+#ifdef BENCHMARK_TILE_READS
+void benchmark_tile_reads(tiff_t* tiff, const char* filename); // run when a TIFF file is opened (see slide_open.c)
+#endif
+bool32 start_camera_path_replay(app_state_t* app_state, const char* filename, bool32 quit_when_done);
 bool32 load_image_from_file(app_state_t* app_state, const char* filename);
+bool32 load_overlay_from_file(app_state_t* app_state, const char* filename);
+image_t* find_loaded_image(app_state_t* app_state, u32 image_id);
+bool32 is_image_handle_alive(u32 image_id);
+image_t* find_overlay_for_image(app_state_t* app_state, image_t* image);
+void close_overlay_for_image(app_state_t* app_state, image_t* image);
 void load_wsi(wsi_t* wsi, const char* filename);
 void unload_wsi(wsi_t* wsi);
 i32 tile_pos_from_world_pos(float world_pos, float tile_side);
+void get_scene_camera_bounds(scene_t* scene, v2f* camera_min, v2f* camera_max);
+void jump_scene_camera(scene_t* scene, v2f target);
+i32 get_minimap_level(image_t* image);
+void init_tile_table(level_image_t* level_image);
+void destroy_tile_table(level_image_t* level_image);
+tile_t* get_tile(level_image_t* level_image, i32 tile_x, i32 tile_y);
+tile_t* peek_tile(level_image_t* level_image, i32 tile_x, i32 tile_y);
+bool32 is_tile_empty(level_image_t* level_image, i32 tile_x, i32 tile_y);
+tile_overlay_state_enum get_tile_overlay_state(level_image_t* level_image, i32 tile_x, i32 tile_y, float* latency);
+void mark_tile_empty(level_image_t* level_image, i32 tile_x, i32 tile_y);
+tile_iterator_t begin_tile_iteration(level_image_t* level_image, tile_range_t range, bool32 allocate_pages);
+bool32 next_tile(tile_iterator_t* iterator);
+level_image_t* get_focal_plane_levels(image_t* image, i32 focal_plane);
+void set_focal_plane(image_t* image, i32 focal_plane);
+bool32 is_level_ready(level_image_t* level_image);
+void init_generated_level(level_image_t* level_image, float um_per_pixel_x, float um_per_pixel_y);
+bool32 init_generated_tiff_level(image_t* image, i32 focal_plane, i32 level);
+bool32 copy_generated_tile(level_image_t* level_image, i32 tile_x, i32 tile_y, u8* dest);
+void start_level_generation(image_t* image);
+void free_generated_levels(image_t* image);
+void start_tissue_mask_computation(image_t* image);
+void free_tissue_mask(image_t* image);
+bool32 is_tissue_in_region(image_t* image, v2f region_min, v2f region_max);
+bool32 is_tissue_in_tile(image_t* image, level_image_t* level_image, i32 tile_x, i32 tile_y);
+void synthesize_tile(i32 logical_thread_index, image_t* image, load_tile_task_t* task, u8* dest,
+                     u8* compressed_tile_data, u64 compressed_data_capacity);
+tile_range_t get_tile_range_in_region(level_image_t* level_image, v2f region_min, v2f region_max);
+void update_scene_visibility(scene_t* scene, image_t* image);
+rect2f get_visible_tile_screen_rect(scene_visibility_t* visibility, level_image_t* level_image, i32 tile_x, i32 tile_y);
+float get_visible_tile_distance_from_center(scene_visibility_t* visibility, level_image_t* level_image, i32 tile_x,
+                                            i32 tile_y);
+i32 get_visible_tile_priority_bonus(scene_visibility_t* visibility, level_image_t* level_image, i32 tile_x, i32 tile_y);
 bool32 was_button_pressed(button_state_t* button);
 bool32 was_button_released(button_state_t* button);
 bool32 was_key_pressed(input_t* input, i32 keycode);
@@ -211,9 +575,45 @@ bool32 is_key_down(input_t* input, i32 keycode);
 void init_scene(app_state_t *app_state, scene_t *scene);
 void init_app_state(app_state_t* app_state);
 void autosave(app_state_t* app_state, bool force_ignore_delay);
+void evict_least_recently_drawn_tiles(app_state_t* app_state);
+void submit_tile_request(load_tile_task_t* task);
+i32 cancel_stale_tile_requests(i64 frame_counter);
+void cancel_tile_requests_for_image(image_t* image);
+void load_next_tile_request_func(i32 logical_thread_index, void* userdata);
+void report_tile_load_stats(i32 tiles_loaded, float io_seconds, float total_seconds);
+void update_tile_load_budget(app_state_t* app_state, float delta_t);
+u64 read_local_tiles(image_t* image, i32 tiff_level, i32* tile_indices, i32 count, u8* compressed_tile_data,
+                     u64 compressed_data_capacity, u8** compressed_data);
+u8* get_compressed_tile_data(i32 logical_thread_index, image_t* image, i32 tiff_level, i32 tile_index,
+                             u8* compressed_tile_data, u64 compressed_data_capacity);
+bool32 decode_compressed_tile_scaled(i32 logical_thread_index, tiff_ifd_t* level_ifd, u8* data, u64 size, u8* dest,
+                                     u32 dest_pitch, i32 scale_denom);
+openslide_t* get_wsi_handle_for_thread(wsi_t* wsi, i32 logical_thread_index);
+void submit_decoded_tile(image_t* image, level_image_t* level_image, tile_t* tile, i32 resolution_shift, u8* pixels,
+                         i32 layout);
+i32 upload_decoded_tiles(app_state_t* app_state, float time_budget_in_seconds);
 void viewer_update_and_render(app_state_t* app_state, input_t* input, i32 client_width, i32 client_height, float delta_t);
 
 void init_opengl_stuff();
+void start_tile_transfers();
+bool32 is_tile_transfer_queue_running();
+void run_tile_transfers();
+bool32 is_tile_texture_compression_available();
+bool32 is_gpu_tile_decoding_available();
+bool32 is_visible_tile_histogram_available();
+void reset_visible_tile_histogram();
+void update_visible_tile_histogram();
+bool32 read_visible_tile_histogram(u32* bins);
+bool32 upload_annotation_segments(v4f* segments, i32* annotation_indices, i32 segment_count);
+void upload_annotation_attributes(rgba_t* attributes, i32 annotation_count);
+void draw_annotation_segments(i32* first_segments, i32* segment_counts, i32 range_count, v2f camera_min,
+                              float um_per_pixel, float thickness, rect2i viewport, rect2i client_viewport);
+bool32 are_gpu_timers_available();
+void begin_gpu_timer_frame();
+void begin_gpu_pass(gpu_pass_enum pass);
+void end_gpu_pass(gpu_pass_enum pass);
+float get_gpu_pass_seconds(gpu_pass_enum pass);
+const char* get_gpu_pass_name(gpu_pass_enum pass);
 
 
 // globals
@@ -226,6 +626,11 @@ void init_opengl_stuff();
 #endif
 
 extern app_state_t global_app_state;
+extern tile_request_queue_t tile_request_queue;
+extern tile_load_stats_t tile_load_stats;
+extern bool compress_tile_textures; // use BC1 for the tiles that are decoded from now on (see render_group.c)
+extern bool planar_tile_textures INIT(= true); // keep JPEG tiles as YCbCr planes, converted to RGB in tile.frag
+extern bool gpu_tile_decoding INIT(= false); // experimental: finish decoding JPEG tiles in a compute shader (OpenGL 4.3)
 
 #undef INIT
 #undef extern
@@ -0,0 +1,126 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+
+#include <math.h>
+
+#include "viewer.h"
+
+// The tiles in view are worked out once per frame, for each scene, and then shared by everything that needs them:
+// requesting the visible tiles (add_visible_tiles_to_wishlist()), prefetching (prefetch_tiles_in_region()) and drawing
+// (push_visible_tiles()). The tile ranges are kept for as long as the camera does not move.
+
+// The tiles that overlap the region. Tiles that only touch the border are left out.
+tile_range_t get_tile_range_in_region(level_image_t* level_image, v2f region_min, v2f region_max) {
+	tile_range_t range;
+	range.x1 = (i32)floorf(region_min.x / level_image->x_tile_side_in_um);
+	range.y1 = (i32)floorf(region_min.y / level_image->y_tile_side_in_um);
+	range.x2 = (i32)ceilf(region_max.x / level_image->x_tile_side_in_um);
+	range.y2 = (i32)ceilf(region_max.y / level_image->y_tile_side_in_um);
+	range.x1 = CLAMP(range.x1, 0, (i32)level_image->width_in_tiles);
+	range.y1 = CLAMP(range.y1, 0, (i32)level_image->height_in_tiles);
+	range.x2 = CLAMP(range.x2, range.x1, (i32)level_image->width_in_tiles);
+	range.y2 = CLAMP(range.y2, range.y1, (i32)level_image->height_in_tiles);
+	return range;
+}
+
+// Needs to be called after the camera of the scene has been updated for this frame.
+void update_scene_visibility(scene_t* scene, image_t* image) {
+	scene_visibility_t* visibility = &scene->visibility;
+	v2f camera_min, camera_max;
+	get_scene_camera_bounds(scene, &camera_min, &camera_max);
+
+	// The focus follows the mouse cursor, which does not change the tiles that are in view.
+	visibility->focus = scene->mouse;
+	float focus_x = (scene->mouse.x - camera_min.x) / scene->pixel_width;
+	float focus_y = (scene->mouse.y - camera_min.y) / scene->pixel_height;
+	float farthest_x = ATLEAST(focus_x, (float)scene->viewport.w - focus_x);
+	float farthest_y = ATLEAST(focus_y, (float)scene->viewport.h - focus_y);
+	visibility->focus_radius = ATLEAST(1.0f, sqrtf(SQUARE(farthest_x) + SQUARE(farthest_y)));
+
+	i32 level_count = ATMOST(image->level_count, IMAGE_MAX_LEVELS);
+	bool32 is_camera_static = (visibility->image_id == image->image_id && visibility->level_count == level_count &&
+	                           memcmp(&visibility->viewport, &scene->viewport, sizeof(rect2i)) == 0 &&
+	                           visibility->camera_min.x == camera_min.x && visibility->camera_min.y == camera_min.y &&
+	                           visibility->camera_max.x == camera_max.x && visibility->camera_max.y == camera_max.y);
+	if (is_camera_static) {
+		return;
+	}
+	visibility->image_id = image->image_id;
+	visibility->viewport = scene->viewport;
+	visibility->camera_min = camera_min;
+	visibility->camera_max = camera_max;
+	visibility->pixel_width = scene->pixel_width;
+	visibility->pixel_height = scene->pixel_height;
+	visibility->level_count = level_count;
+	for (i32 level = 0; level < level_count; ++level) {
+		visibility->levels[level] = get_tile_range_in_region(image->level_images + level, camera_min, camera_max);
+	}
+}
+
+// Screen coordinates; the right and bottom edges are computed the same way as the left and top edges of the next
+// tiles, so that no gaps appear between neighbouring tiles.
+rect2f get_visible_tile_screen_rect(scene_visibility_t* visibility, level_image_t* level_image, i32 tile_x, i32 tile_y) {
+	float x1 = visibility->viewport.x + (level_image->x_tile_side_in_um * tile_x - visibility->camera_min.x) / visibility->pixel_width;
+	float y1 = visibility->viewport.y + (level_image->y_tile_side_in_um * tile_y - visibility->camera_min.y) / visibility->pixel_height;
+	float x2 = visibility->viewport.x + (level_image->x_tile_side_in_um * (tile_x + 1) - visibility->camera_min.x) / visibility->pixel_width;
+	float y2 = visibility->viewport.y + (level_image->y_tile_side_in_um * (tile_y + 1) - visibility->camera_min.y) / visibility->pixel_height;
+	rect2f result = { x1, y1, x2 - x1, y2 - y1 };
+	return result;
+}
+
+// The distance on screen from the center of the view to the center of the tile, relative to the distance from the
+// center of the view to its corners.
+float get_visible_tile_distance_from_center(scene_visibility_t* visibility, level_image_t* level_image, i32 tile_x,
+                                            i32 tile_y) {
+	float center_x = (visibility->camera_min.x + visibility->camera_max.x) * 0.5f;
+	float center_y = (visibility->camera_min.y + visibility->camera_max.y) * 0.5f;
+	float dx = (center_x - (tile_x + 0.5f) * level_image->x_tile_side_in_um) / visibility->pixel_width;
+	float dy = (center_y - (tile_y + 0.5f) * level_image->y_tile_side_in_um) / visibility->pixel_height;
+	float screen_radius = sqrtf(SQUARE(visibility->viewport.w * 0.5f) + SQUARE(visibility->viewport.h * 0.5f));
+	return sqrtf(SQUARE(dx) + SQUARE(dy)) / ATLEAST(1.0f, screen_radius);
+}
+
+// Tiles closer to the focus go first. Tiles that are only partly in view count for less, in proportion to their area
+// on screen.
+i32 get_visible_tile_priority_bonus(scene_visibility_t* visibility, level_image_t* level_image, i32 tile_x, i32 tile_y) {
+	float tile_x1 = tile_x * level_image->x_tile_side_in_um;
+	float tile_y1 = tile_y * level_image->y_tile_side_in_um;
+	float tile_x2 = tile_x1 + level_image->x_tile_side_in_um;
+	float tile_y2 = tile_y1 + level_image->y_tile_side_in_um;
+	float visible_x1 = ATLEAST(tile_x1, visibility->camera_min.x);
+	float visible_y1 = ATLEAST(tile_y1, visibility->camera_min.y);
+	float visible_x2 = ATMOST(tile_x2, visibility->camera_max.x);
+	float visible_y2 = ATMOST(tile_y2, visibility->camera_max.y);
+	float visible_width = visible_x2 - visible_x1;
+	float visible_height = visible_y2 - visible_y1;
+	if (visible_width <= 0.0f || visible_height <= 0.0f) {
+		return 0; // not actually in view
+	}
+	float visible_share = (visible_width * visible_height) / (level_image->x_tile_side_in_um * level_image->y_tile_side_in_um);
+
+	// Measured to the center of the part that is in view.
+	float dx = (visibility->focus.x - (visible_x1 + visible_x2) * 0.5f) / visibility->pixel_width;
+	float dy = (visibility->focus.y - (visible_y1 + visible_y2) * 0.5f) / visibility->pixel_height;
+	float focus_distance = sqrtf(SQUARE(dx) + SQUARE(dy)) / visibility->focus_radius;
+	float closeness = 1.0f - ATMOST(focus_distance, 1.0f);
+
+	float bonus = (0.75f * closeness + 0.25f * ATMOST(visible_share, 1.0f)) * (float)VISIBLE_TILE_PRIORITY_BONUS;
+	return (i32)bonus;
+}
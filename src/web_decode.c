@@ -0,0 +1,81 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Entry points of the web build of the tile decoder (see the EMSCRIPTEN section of CMakeLists.txt). The module is
+// loaded by each of the Web Workers in the decode pool (see web/decode_pool.js), so every worker has an instance of
+// its own and the decoder state can simply be static.
+
+#include "common.h"
+
+#ifdef TARGET_EMSCRIPTEN
+#include <emscripten/emscripten.h>
+#else
+#define EMSCRIPTEN_KEEPALIVE
+#endif
+
+#include "jpeg_decoder.h"
+#include "cpu_dispatch.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static jpeg_decoder_state_t* decoder_state;
+
+EMSCRIPTEN_KEEPALIVE
+void web_decode_init() {
+	cpu_dispatch_init();
+	if (!decoder_state) {
+		decoder_state = jpeg_decoder_create_state();
+	}
+}
+
+// The decoder writes BGRA, but WebGL2 can only upload RGBA.
+static void swap_red_and_blue(u8* pixels, u32 pixel_count) {
+	u32 i = 0;
+#if defined(__SSE2__)
+	const __m128i green_and_alpha = _mm_set1_epi32((i32)0xFF00FF00);
+	const __m128i low_byte = _mm_set1_epi32(0xFF);
+	for (; i + 4 <= pixel_count; i += 4) {
+		__m128i v = _mm_loadu_si128((__m128i*)(pixels + i * 4));
+		__m128i red = _mm_and_si128(_mm_srli_epi32(v, 16), low_byte);
+		__m128i blue = _mm_slli_epi32(_mm_and_si128(v, low_byte), 16);
+		v = _mm_or_si128(_mm_and_si128(v, green_and_alpha), _mm_or_si128(red, blue));
+		_mm_storeu_si128((__m128i*)(pixels + i * 4), v);
+	}
+#endif
+	for (; i < pixel_count; ++i) {
+		u8 temp = pixels[i * 4 + 0];
+		pixels[i * 4 + 0] = pixels[i * 4 + 2];
+		pixels[i * 4 + 2] = temp;
+	}
+}
+
+// Decodes a JPEG-compressed TIFF tile (with the JPEG tables of its level, if any) into output, as RGBA pixels,
+// width * height * 4 bytes. All pointers are into the memory of the module (see create_buffer()).
+EMSCRIPTEN_KEEPALIVE
+bool32 web_decode_tile(u8* tables, u32 tables_length, u8* data, u32 length, u8* output, u32 width, u32 height,
+                       bool32 is_YCbCr) {
+	if (!decoder_state) web_decode_init();
+	memset(output, 0xFF, (u64)width * height * 4); // (stays white where the JPEG stream is short)
+	if (!decode_tile_with_state(decoder_state, tables, tables_length, data, length, output, width * 4, is_YCbCr, 1)) {
+		return false;
+	}
+	swap_red_and_blue(output, width * height);
+	return true;
+}
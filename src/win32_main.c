@@ -46,6 +46,12 @@
 #include "stringutils.h"
 
 #include "intrinsics.h"
+#include "profiler.h"
+#include "log.h"
+#include "frame_jobs.h"
+#include "cpu_dispatch.h"
+#include "tile_metrics.h"
+#include "memory_stats.h"
 
 #include "gui.h"
 #include "tlsclient.h"
@@ -79,7 +85,9 @@ surface_t backbuffer;
 WNDCLASSA main_window_class;
 
 win32_thread_info_t thread_infos[MAX_THREAD_COUNT];
-HGLRC glrcs[MAX_THREAD_COUNT];
+HGLRC main_glrc;
+HGLRC transfer_glrc; // shares its objects with main_glrc, see win32_start_transfer_thread()
+HANDLE transfer_semaphore;
 
 
 void win32_diagnostic(const char* prefix) {
@@ -164,6 +172,18 @@ void platform_sleep(u32 ms) {
 	Sleep(ms);
 }
 
+// The ICC profile that is set up in Windows for the display the main window is on.
+bool32 platform_get_display_profile_filename(char* filename, i32 size) {
+	HDC hdc = GetDC(main_window);
+	DWORD filename_size = (DWORD)size;
+	bool32 success = GetICMProfileA(hdc, &filename_size, filename);
+	ReleaseDC(main_window, hdc);
+	if (!success) {
+		printf("Warning: no color profile is set up for this display\n");
+	}
+	return success;
+}
+
 void message_box(const char* message) {
 	MessageBoxA(main_window, message, "Slideviewer", MB_ICONERROR);
 }
@@ -204,26 +224,6 @@ void win32_init_xinput() {
 	}
 }
 
-void win32_init_input() {
-	RAWINPUTDEVICE Rid[1];
-
-	Rid[0].usUsagePage = 0x01;
-	Rid[0].usUsage = 0x02;
-	Rid[0].dwFlags = 0;//RIDEV_NOLEGACY;   // adds HID mouse and also ignores legacy mouse messages
-	Rid[0].hwndTarget = 0;
-	if (RegisterRawInputDevices(Rid, 1, sizeof(Rid[0])) == FALSE) {
-		win32_diagnostic("Registering raw input devices failed");
-		panic();
-	}
-
-
-	win32_init_xinput();
-
-	// Flip-flop
-	old_input = &inputs[0];
-	curr_input = &inputs[1];
-}
-
 win32_window_dimension_t win32_get_window_dimension(HWND window) {
 	RECT rect;
 	GetClientRect(window, &rect);
@@ -259,10 +259,9 @@ void win32_toggle_fullscreen(HWND window) {
 	}
 }
 
-void win32_open_file_dialog(HWND window) {
+static bool32 win32_get_open_file_name(HWND window, const char* filter, char* filename, u32 filename_size) {
 	// Adapted from https://docs.microsoft.com/en-us/windows/desktop/dlgbox/using-common-dialog-boxes#open_file
 	OPENFILENAME ofn = {};       // common dialog box structure
-	char filename[4096];       // buffer for file name
 	filename[0] = '\0';
 
 	printf("Attempting to open a file\n");
@@ -271,8 +270,8 @@ void win32_open_file_dialog(HWND window) {
 	ofn.lStructSize = sizeof(ofn);
 	ofn.hwndOwner = window;
 	ofn.lpstrFile = filename;
-	ofn.nMaxFile = sizeof(filename);
-	ofn.lpstrFilter = "All\0*.*\0Text\0*.TXT\0";
+	ofn.nMaxFile = filename_size;
+	ofn.lpstrFilter = filter;
 	ofn.nFilterIndex = 1;
 	ofn.lpstrFileTitle = NULL;
 	ofn.nMaxFileTitle = 0;
@@ -281,11 +280,24 @@ void win32_open_file_dialog(HWND window) {
 
 	// Display the Open dialog box.
 	mouse_show();
-	if (GetOpenFileName(&ofn)==TRUE) {
+	return (GetOpenFileName(&ofn)==TRUE);
+}
+
+void win32_open_file_dialog(HWND window) {
+	char filename[4096];
+	if (win32_get_open_file_name(window, "All\0*.*\0Text\0*.TXT\0", filename, sizeof(filename))) {
 		load_generic_file(&global_app_state, filename);
 	}
 }
 
+// For showing e.g. a heatmap over the displayed image (see load_overlay_from_file())
+void win32_open_overlay_file_dialog(HWND window) {
+	char filename[4096];
+	if (win32_get_open_file_name(window, "TIFF\0*.tif;*.tiff\0All\0*.*\0", filename, sizeof(filename))) {
+		load_overlay_from_file(&global_app_state, filename);
+	}
+}
+
 
 LRESULT CALLBACK main_window_callback(HWND window, UINT message, WPARAM wparam, LPARAM lparam) {
 	LRESULT result = ImGui_ImplWin32_WndProcHandler(window, message, wparam, lparam);
@@ -417,7 +429,211 @@ void mouse_show() {
 	}
 }
 
+#define WM_APP_WAKE_UP (WM_APP + 1)
+static volatile i32 is_wake_up_message_pending;
+
+// Wakes up the main thread if it is idling in win32_process_pending_messages(), e.g. because a tile has finished
+// loading. At most one wake-up message is waiting at any time, however many tiles come in.
+void platform_wake_main_thread() {
+	if (interlocked_compare_exchange(&is_wake_up_message_pending, 1, 0) == 0) {
+		if (!PostMessageA(main_window, WM_APP_WAKE_UP, 0, 0)) {
+			is_wake_up_message_pending = 0;
+		}
+	}
+}
+
+// Raw mouse input is gathered on a thread of its own (see input_thread_proc()), so that a 1000 Hz mouse or a pen
+// tablet doesn't flood the main thread's message queue during a drag, and a slow frame doesn't hold up the input.
+// The events are added up as they come in; once per frame, win32_drain_raw_mouse_input() hands the sum to the main
+// thread, so that it only ever sees one drag vector and one wheel delta, however many events there were.
+typedef struct raw_mouse_accumulator_t {
+	volatile i32 lock;
+	v2i drag_vector; // only counts while the left button is down
+	i32 wheel_delta;
+	i32 event_count;
+	i64 first_event_clock;
+	i64 last_event_clock;
+	bool32 is_left_button_down;
+	bool32 was_left_button_pressed; // (re)starts the drag
+	bool32 did_move_without_dragging;
+} raw_mouse_accumulator_t;
+
+static raw_mouse_accumulator_t raw_mouse_accumulator;
+static HWND input_window; // message-only window of the input thread (NULL if raw input goes to the main window)
+
+// Called on the input thread (or on the main thread, if there is no input thread).
+static void win32_accumulate_raw_mouse_input(RAWMOUSE* mouse, bool32 is_foreground) {
+	i64 clock = get_clock();
+	raw_mouse_accumulator_t* accumulator = &raw_mouse_accumulator;
+	bool32 was_empty = false;
+	spin_lock(&accumulator->lock);
+	if (mouse->usButtonFlags & RI_MOUSE_LEFT_BUTTON_DOWN) {
+		accumulator->is_left_button_down = true;
+		if (is_foreground) {
+			accumulator->was_left_button_pressed = true;
+			accumulator->drag_vector = (v2i){};
+		}
+	}
+	if (mouse->usButtonFlags & RI_MOUSE_LEFT_BUTTON_UP) {
+		accumulator->is_left_button_down = false;
+	}
+	if (is_foreground) {
+		if (mouse->usButtonFlags & RI_MOUSE_WHEEL) {
+			accumulator->wheel_delta += (i16)mouse->usButtonData;
+		}
+		// We want relative mouse movement
+		if (!(mouse->usFlags & MOUSE_MOVE_ABSOLUTE)) {
+			if (accumulator->is_left_button_down) {
+				accumulator->drag_vector.x += mouse->lLastX;
+				accumulator->drag_vector.y += mouse->lLastY;
+			} else if (mouse->lLastX != 0 || mouse->lLastY != 0) {
+				accumulator->did_move_without_dragging = true;
+			}
+		}
+		was_empty = (accumulator->event_count == 0);
+		if (was_empty) {
+			accumulator->first_event_clock = clock;
+		}
+		accumulator->last_event_clock = clock;
+		++accumulator->event_count;
+	}
+	spin_unlock(&accumulator->lock);
+	if (was_empty && input_window) {
+		platform_wake_main_thread(); // the main thread may be idling, and no longer gets WM_INPUT itself
+	}
+}
+
+static void win32_handle_raw_input(HRAWINPUT handle, bool32 is_foreground) {
+	RAWINPUT raw;
+	u32 size = sizeof(raw);
+	if (GetRawInputData(handle, RID_INPUT, &raw, &size, sizeof(RAWINPUTHEADER)) == (u32)-1) {
+		return;
+	}
+	if (raw.header.dwType == RIM_TYPEMOUSE) {
+		win32_accumulate_raw_mouse_input(&raw.data.mouse, is_foreground);
+	}
+}
+
+// Hands the mouse events since the previous call over to the input of this frame.
+static void win32_drain_raw_mouse_input(input_t* input) {
+	raw_mouse_accumulator_t* accumulator = &raw_mouse_accumulator;
+	spin_lock(&accumulator->lock);
+	v2i drag_vector = accumulator->drag_vector;
+	i32 wheel_delta = accumulator->wheel_delta;
+	i32 event_count = accumulator->event_count;
+	i64 first_event_clock = accumulator->first_event_clock;
+	i64 last_event_clock = accumulator->last_event_clock;
+	bool32 was_left_button_pressed = accumulator->was_left_button_pressed;
+	bool32 did_move_without_dragging = accumulator->did_move_without_dragging;
+	accumulator->drag_vector = (v2i){};
+	accumulator->wheel_delta = 0;
+	accumulator->event_count = 0;
+	accumulator->was_left_button_pressed = false;
+	accumulator->did_move_without_dragging = false;
+	spin_unlock(&accumulator->lock);
+
+	input->mouse_event_count = event_count;
+	input->first_mouse_event_clock = event_count ? first_event_clock : 0;
+	input->last_mouse_event_clock = event_count ? last_event_clock : 0;
+	if (event_count == 0 || gui_want_capture_mouse) {
+		return;
+	}
+	if (was_left_button_pressed) {
+		input->drag_vector = (v2i){};
+		input->drag_start_xy = input->mouse_xy;
+	}
+	input->drag_vector.x += drag_vector.x;
+	input->drag_vector.y += drag_vector.y;
+	input->dmouse_xy.x += drag_vector.x;
+	input->dmouse_xy.y += drag_vector.y;
+	input->mouse_z += wheel_delta;
+	if (did_move_without_dragging) {
+		mouse_show(); // (ShowCursor() only works on the thread that owns the window)
+	}
+}
+
+static bool32 win32_register_raw_mouse_input(HWND target, DWORD flags) {
+	RAWINPUTDEVICE Rid[1];
+	Rid[0].usUsagePage = 0x01;
+	Rid[0].usUsage = 0x02;
+	Rid[0].dwFlags = flags;//RIDEV_NOLEGACY;   // adds HID mouse and also ignores legacy mouse messages
+	Rid[0].hwndTarget = target;
+	return RegisterRawInputDevices(Rid, 1, sizeof(Rid[0]));
+}
+
+static HANDLE input_thread_ready_event;
+
+static DWORD WINAPI input_thread_proc(void* parameter) {
+	WNDCLASSA window_class = {};
+	window_class.lpfnWndProc = DefWindowProcA;
+	window_class.hInstance = GetModuleHandleA(NULL);
+	window_class.lpszClassName = "SlideviewerInputWindowClass";
+	HWND window = NULL;
+	if (RegisterClassA(&window_class)) {
+		window = CreateWindowExA(0, window_class.lpszClassName, "", 0, 0, 0, 0, 0, HWND_MESSAGE, NULL,
+		                         window_class.hInstance, NULL);
+	}
+	// The message-only window is never in the foreground, so it needs RIDEV_INPUTSINK to get any input at all;
+	// events are only counted while the main window is in the foreground.
+	if (window && win32_register_raw_mouse_input(window, RIDEV_INPUTSINK)) {
+		input_window = window;
+	} else if (window) {
+		DestroyWindow(window);
+	}
+	SetEvent(input_thread_ready_event);
+	if (!input_window) {
+		return 0;
+	}
+
+	MSG message;
+	while (GetMessageA(&message, NULL, 0, 0) > 0) {
+		if (message.message == WM_INPUT) {
+			win32_handle_raw_input((HRAWINPUT) message.lParam, GetForegroundWindow() == main_window);
+		}
+		DispatchMessageA(&message); // DefWindowProcA() cleans up after WM_INPUT
+	}
+	return 0;
+}
+
+// Can be turned off with INPUT_THREAD=0; the main thread then gets the raw input itself, like before.
+static bool32 win32_start_input_thread() {
+	const char* input_thread_env = getenv("INPUT_THREAD");
+	if (input_thread_env && atoi(input_thread_env) == 0) {
+		return false;
+	}
+	input_thread_ready_event = CreateEventA(NULL, FALSE, FALSE, NULL);
+	HANDLE thread_handle = CreateThread(NULL, 0, input_thread_proc, NULL, 0, NULL);
+	if (!thread_handle) {
+		CloseHandle(input_thread_ready_event);
+		return false;
+	}
+	SetThreadPriority(thread_handle, THREAD_PRIORITY_HIGHEST); // it hardly does any work, but it should do it promptly
+	CloseHandle(thread_handle);
+	WaitForSingleObject(input_thread_ready_event, INFINITE);
+	CloseHandle(input_thread_ready_event);
+	return (input_window != NULL);
+}
+
+// Needs to be called after win32_init_main_window().
+void win32_init_input() {
+	raw_mouse_accumulator.is_left_button_down = (GetAsyncKeyState(VK_LBUTTON) & (1<<15)) != 0;
+	if (!win32_start_input_thread()) {
+		if (!win32_register_raw_mouse_input(0, 0)) {
+			win32_diagnostic("Registering raw input devices failed");
+			panic();
+		}
+	}
+
+	win32_init_xinput();
+
+	// Flip-flop
+	old_input = &inputs[0];
+	curr_input = &inputs[1];
+}
+
 // returns true if there was an idle period, false otherwise.
+// While idling, the main thread blocks until there is input, or until a worker has something new to draw (see
+// platform_wake_main_thread()): frames are only drawn when the content actually changes.
 bool win32_process_pending_messages(input_t* input, HWND window, bool allow_idling) {
 	i64 begin = get_clock(); // profiling
 
@@ -425,13 +641,6 @@ bool win32_process_pending_messages(input_t* input, HWND window, bool allow_idli
 	MSG message;
 	i32 messages_processed = 0;
 
-	// Just to be sure we don't get stalls, don't allow idling while we are actively using the window
-	// TODO: revise, might be unnecessary power usage
-	HWND foreground_window = GetForegroundWindow();
-	if (foreground_window == window) {
-		allow_idling = false; //
-	}
-
 	bool did_idle = false;
 	WINBOOL has_message = PeekMessageA(&message, NULL, 0, 0, PM_REMOVE);
 	if (!has_message) {
@@ -461,50 +670,21 @@ bool win32_process_pending_messages(input_t* input, HWND window, bool allow_idli
 				DispatchMessageA(&message);
 			} break;
 
+			case WM_APP_WAKE_UP: {
+				is_wake_up_message_pending = 0; // tiles that arrive from now on need to wake us up again
+			} break;
+
 			case WM_MOUSEWHEEL: {
+				// Outside the GUI, the wheel is taken from the raw input (see win32_accumulate_raw_mouse_input()).
 				if (gui_want_capture_mouse) {
 					TranslateMessage(&message);
 					DispatchMessageA(&message);
-				} else {
-					u32 par = (u32)message.wParam;
-					i32 z_delta = GET_WHEEL_DELTA_WPARAM(message.wParam);
-					input->mouse_z = z_delta;
 				}
 			} break;
 
 			case WM_INPUT: {
-				if (gui_want_capture_mouse) {
-					break;
-				}
-				u32 size;
-				GetRawInputData((HRAWINPUT) message.lParam, RID_INPUT, NULL, &size, sizeof(RAWINPUTHEADER));
-				RAWINPUT* raw = (RAWINPUT*) alloca(size);
-				GetRawInputData((HRAWINPUT) message.lParam, RID_INPUT, raw, &size, sizeof(RAWINPUTHEADER));
-
-				if (raw->header.dwType == RIM_TYPEMOUSE)
-				{
-					if (raw->data.mouse.usButtonFlags & RI_MOUSE_LEFT_BUTTON_DOWN) {
-						curr_input->drag_vector = (v2i){};
-						curr_input->drag_start_xy = curr_input->mouse_xy;
-					}
-
-					// We want relative mouse movement
-					if (!(raw->data.mouse.usFlags & MOUSE_MOVE_ABSOLUTE)) {
-						if (curr_input->mouse_buttons[0].down) {
-							curr_input->drag_vector.x += raw->data.mouse.lLastX;
-							curr_input->dmouse_xy.x += raw->data.mouse.lLastX;
-							curr_input->drag_vector.y += raw->data.mouse.lLastY;
-							curr_input->dmouse_xy.y += raw->data.mouse.lLastY;
-//						printf("Dragging: dx=%d dy=%d\n", curr_input->delta_mouse_x, curr_input->delta_mouse_y);
-						} else {
-							// not dragging
-							mouse_show();
-						}
-					}
-
-
-				}
-
+				// Only if there is no input thread.
+				win32_handle_raw_input((HRAWINPUT) message.lParam, true);
 			} break;
 
 			case WM_KEYDOWN:
@@ -777,6 +957,70 @@ void win32_gl_swap_interval(int interval) {
 	}
 }
 
+// Frame pacing: while something is moving on the screen, the input is sampled as late as the measured frame cost
+// allows, so that the frame is finished just before the next display refresh. With WGL_EXT_swap_control_tear
+// (adaptive vsync), a frame that still turns out to be late is shown right away instead of a whole refresh later.
+// In static views nothing changes: the main thread idles (see win32_process_pending_messages()) with normal vsync.
+typedef struct frame_pacing_t {
+	float refresh_period; // seconds
+	float frame_cost; // seconds from sampling the input until SwapBuffers() is called; follows the peaks
+	i64 last_swap_clock; // when the last SwapBuffers() returned, i.e. roughly at the last refresh
+	i32 swap_interval;
+	bool32 is_adaptive_vsync_supported;
+} frame_pacing_t;
+
+static frame_pacing_t frame_pacing;
+
+void win32_init_frame_pacing(HDC hdc) {
+	frame_pacing.is_adaptive_vsync_supported = win32_wgl_extension_supported("WGL_EXT_swap_control_tear");
+	i32 refresh_rate = GetDeviceCaps(hdc, VREFRESH);
+	if (refresh_rate <= 1) {
+		refresh_rate = 60; // 0 or 1 means the hardware default
+	}
+	frame_pacing.refresh_period = 1.0f / (float)refresh_rate;
+	frame_pacing.swap_interval = 1;
+	win32_gl_swap_interval(1);
+}
+
+// Called before sampling the input. In latency mode, waits until the frame can just be finished in time.
+void win32_wait_for_frame_start(bool32 is_latency_mode) {
+	i32 wanted_swap_interval = (is_latency_mode && frame_pacing.is_adaptive_vsync_supported) ? -1 : 1;
+	if (wanted_swap_interval != frame_pacing.swap_interval) {
+		win32_gl_swap_interval(wanted_swap_interval);
+		frame_pacing.swap_interval = wanted_swap_interval;
+	}
+	if (!is_latency_mode || frame_pacing.last_swap_clock == 0) return;
+
+	// The frame cost does not include the GPU work that is still outstanding when SwapBuffers() is called,
+	// hence the safety margin.
+	float needed_time = frame_pacing.frame_cost * 1.25f + 0.002f;
+	if (needed_time > frame_pacing.refresh_period * 0.75f) {
+		return; // no time to spare
+	}
+	i64 start_clock = frame_pacing.last_swap_clock +
+	                  (i64)((frame_pacing.refresh_period - needed_time) * (float)performance_counter_frequency);
+	for (;;) {
+		float remaining = get_seconds_elapsed(get_clock(), start_clock);
+		if (remaining <= 0.0f) break;
+		if (is_sleep_granular && remaining > 0.002f) {
+			Sleep((DWORD)((remaining - 0.001f) * 1000.0f));
+		} else {
+			YieldProcessor();
+		}
+	}
+}
+
+void win32_end_frame_pacing(i64 input_clock, i64 swap_begin_clock, i64 swap_end_clock) {
+	float frame_cost = get_seconds_elapsed(input_clock, swap_begin_clock);
+	if (frame_cost > frame_pacing.frame_cost) {
+		frame_pacing.frame_cost = frame_cost; // react to slow frames immediately, and recover slowly
+	} else {
+		frame_pacing.frame_cost += (frame_cost - frame_pacing.frame_cost) * 0.05f;
+	}
+	frame_pacing.last_swap_clock = swap_end_clock;
+	profiler_set_frame_latency(get_seconds_elapsed(input_clock, swap_end_clock), frame_cost);
+}
+
 
 
 HMODULE opengl32_dll_handle;
@@ -837,9 +1081,7 @@ void win32_init_opengl(HWND window) {
 	// We want to create an OpenGL context using wglCreateContextAttribsARB, instead of the regular wglCreateContext.
 	// Unfortunately, that's considered an OpenGL extension. Therefore, we first need to create a "dummy" context
 	// (and destroy it again) solely for the purpose of creating the actual OpenGL context that we want.
-	// (Why bother? Mostly because we want to have worker threads for loading textures in the background. For this
-	// to work properly, we want multiple OpenGL contexts (one per thread), and we want all the contexts
-	// to be able share their resources, which requires creating them with wglCreateContextAttribsARB.)
+	// (Why bother? Mostly because we want to be able to ask for a specific OpenGL version and a debug context.)
 
 	// Set up a 'dummy' window, because Win32 requires a device context (DC) coupled to a window for creating
 	// OpenGL contexts.
@@ -989,11 +1231,13 @@ void win32_init_opengl(HWND window) {
 	};
 #endif
 
-	glrcs[0] = wglCreateContextAttribsARB(dc, NULL, context_attribs);
-	if (glrcs[0] == NULL) {
+	main_glrc = wglCreateContextAttribsARB(dc, NULL, context_attribs);
+	if (main_glrc == NULL) {
 		printf("wglCreateContextAttribsARB() failed.");
 		panic();
 	}
+	// (if this fails, the main thread does the uploads itself)
+	transfer_glrc = wglCreateContextAttribsARB(dc, main_glrc, context_attribs);
 
 
 	// Delete the dummy context and start using the real one.
@@ -1001,7 +1245,7 @@ void win32_init_opengl(HWND window) {
 	wglDeleteContext_alt(dummy_glrc);
 	ReleaseDC(dummy_window, dummy_dc);
 	DestroyWindow(dummy_window);
-	if (!wglMakeCurrent_alt(dc, glrcs[0])) {
+	if (!wglMakeCurrent_alt(dc, main_glrc)) {
 		win32_diagnostic("wglMakeCurrent");
 		panic();
 	}
@@ -1014,21 +1258,9 @@ void win32_init_opengl(HWND window) {
 	}
 
 
-	// Create separate OpenGL contexts for each worker thread, so that they can load textures (etc.) on the fly
-	ASSERT(logical_cpu_count > 0);
-	for (i32 thread_index = 1; thread_index < total_thread_count; ++thread_index) {
-		HGLRC glrc = wglCreateContextAttribsARB(dc, glrcs[0], context_attribs);
-		if (!glrc) {
-			printf("Thread %d: wglCreateContextAttribsARB() failed.", thread_index);
-			panic();
-		}
-/*		if (!wglShareLists(glrcs[0], glrc)) {
-			printf("Thread %d: ", thread_index);
-			win32_diagnostic("wglShareLists");
-			panic();
-		}*/
-		glrcs[thread_index] = glrc;
-	}
+	// Note: the worker threads do not get OpenGL contexts of their own; they only decode tiles, and the main thread
+	// uploads them (see upload_decoded_tiles()), or has the transfer thread upload them (see
+	// win32_start_transfer_thread()).
 
 	// Try to enable debug output on the main thread.
 #if USE_OPENGL_DEBUG_CONTEXT
@@ -1058,8 +1290,6 @@ void win32_init_opengl(HWND window) {
 
 bool win32_process_input(HWND window, app_state_t* app_state) {
 
-	i64 last_section = get_clock(); // profiling
-
 	// Swap
 	input_t* temp = old_input;
 	old_input = curr_input;
@@ -1094,14 +1324,12 @@ bool win32_process_input(HWND window, app_state_t* app_state) {
 	win32_process_keyboard_event(&curr_input->mouse_buttons[3], GetAsyncKeyState(VK_XBUTTON1) & (1<<15));
 	win32_process_keyboard_event(&curr_input->mouse_buttons[4], GetAsyncKeyState(VK_XBUTTON2) & (1<<15));
 
-	last_section = profiler_end_section(last_section, "input: (1)", 5.0f);
-
-
+	profiler_begin("process pending messages");
 	bool did_idle = win32_process_pending_messages(curr_input, window, app_state->allow_idling_next_frame);
-//	last_section = profiler_end_section(last_section, "input: (2) process pending messages", 20.0f);
+	profiler_end();
+	win32_drain_raw_mouse_input(curr_input);
 
 //	win32_process_xinput_controllers();
-//	last_section = profiler_end_section(last_section, "input: (3) xinput", 5.0f);
 
 	// Check if at least one button/key is pressed at all (if no buttons are pressed,
 	// we might be allowed to idle waiting for input (skipping frames!) as long as nothing is animating on the screen).
@@ -1121,36 +1349,50 @@ bool win32_process_input(HWND window, app_state_t* app_state) {
 
 
 
-bool32 add_work_queue_entry(work_queue_t* queue, work_queue_callback_t callback, void* userdata) {
-	// Circular FIFO buffer
-	i32 new_next_entry_to_submit = (queue->next_entry_to_submit + 1) % COUNT(queue->entries);
-	if (new_next_entry_to_submit == queue->next_entry_to_execute) {
-		printf("Warning: work queue is overflowing - job is cancelled\n");
-		return false;
+// Logical index of the calling thread (the main thread is 0); decides which deque new work is pushed onto.
+static THREAD_LOCAL i32 current_logical_thread_index;
+
+static bool32 work_deque_push(work_deque_t* deque, work_queue_entry_t entry) {
+	bool32 result = false;
+	spin_lock(&deque->lock);
+	if (deque->tail - deque->head < WORK_DEQUE_CAPACITY) {
+		deque->entries[deque->tail % WORK_DEQUE_CAPACITY] = entry;
+		++deque->tail;
+		result = true;
 	}
-	queue->entries[queue->next_entry_to_submit] = (work_queue_entry_t){ .data = userdata, .callback = callback };
-	++queue->completion_goal;
-	write_barrier;
-	queue->next_entry_to_submit = new_next_entry_to_submit;
-	ReleaseSemaphore(queue->semaphore_handle, 1, NULL);
-	return true;
+	spin_unlock(&deque->lock);
+	return result;
 }
 
-work_queue_entry_t get_next_work_queue_entry(work_queue_t* queue) {
+// Owner side: take the most recently pushed entry.
+static work_queue_entry_t work_deque_pop(work_deque_t* deque) {
 	work_queue_entry_t result = {};
+	if (deque->head == deque->tail) return result; // cheap early out, rechecked under the lock
+	spin_lock(&deque->lock);
+	if (deque->head != deque->tail) {
+		--deque->tail;
+		result = deque->entries[deque->tail % WORK_DEQUE_CAPACITY];
+		if (deque->head == deque->tail) {
+			deque->head = deque->tail = 0;
+		}
+	}
+	spin_unlock(&deque->lock);
+	return result;
+}
 
-	i32 original_entry_to_execute = queue->next_entry_to_execute;
-	i32 new_next_entry_to_execute = (original_entry_to_execute + 1) % COUNT(queue->entries);
-	if (original_entry_to_execute != queue->next_entry_to_submit) {
-		i32 entry_index = interlocked_compare_exchange(&queue->next_entry_to_execute,
-		                                               new_next_entry_to_execute, original_entry_to_execute);
-		if (entry_index == original_entry_to_execute) {
-			result.data = queue->entries[entry_index].data;
-			result.callback = queue->entries[entry_index].callback;
-			result.is_valid = true;
-			read_barrier;
+// Thief side: take the oldest entry, so that work is still started roughly in submission order.
+static work_queue_entry_t work_deque_steal(work_deque_t* deque) {
+	work_queue_entry_t result = {};
+	if (deque->head == deque->tail) return result;
+	spin_lock(&deque->lock);
+	if (deque->head != deque->tail) {
+		result = deque->entries[deque->head % WORK_DEQUE_CAPACITY];
+		++deque->head;
+		if (deque->head == deque->tail) {
+			deque->head = deque->tail = 0;
 		}
 	}
+	spin_unlock(&deque->lock);
 	return result;
 }
 
@@ -1158,11 +1400,50 @@ void win32_mark_queue_entry_completed(work_queue_t* queue) {
 	interlocked_increment(&queue->completion_count);
 }
 
+// Returns false if the entry could not be queued (only when called from the main thread while its deque is full).
+// The caller should then retry later, e.g. on the next frame. Worker threads never get refused: if their own
+// deque is full, they execute the entry immediately instead.
+bool32 add_work_queue_entry(work_queue_t* queue, work_queue_callback_t callback, void* userdata) {
+	i32 thread_index = current_logical_thread_index;
+	ASSERT(thread_index >= 0 && thread_index < queue->deque_count);
+	work_queue_entry_t entry = { .data = userdata, .callback = callback, .is_valid = true };
+
+	interlocked_increment(&queue->completion_goal);
+	if (work_deque_push(queue->deques + thread_index, entry)) {
+		ReleaseSemaphore(queue->semaphore_handle, 1, NULL);
+		return true;
+	} else if (thread_index > 0) {
+		callback(thread_index, userdata);
+		win32_mark_queue_entry_completed(queue);
+		return true;
+	} else {
+		interlocked_decrement(&queue->completion_goal);
+		return false;
+	}
+}
+
+work_queue_entry_t get_next_work_queue_entry(work_queue_t* queue, int logical_thread_index) {
+	work_queue_entry_t result = work_deque_pop(queue->deques + logical_thread_index);
+	// Nothing left in our own deque: try to steal from the other threads, starting with our neighbour.
+	for (i32 i = 1; !result.is_valid && i < queue->deque_count; ++i) {
+		i32 victim = (logical_thread_index + i) % queue->deque_count;
+		result = work_deque_steal(queue->deques + victim);
+	}
+	if (result.is_valid) {
+		read_barrier;
+	}
+	return result;
+}
+
 bool32 do_worker_work(work_queue_t* queue, int logical_thread_index) {
-	work_queue_entry_t entry = get_next_work_queue_entry(queue);
+	work_queue_entry_t entry = get_next_work_queue_entry(queue, logical_thread_index);
 	if (entry.is_valid) {
 		if (!entry.callback) panic();
+		profiler_begin("work queue task");
 		entry.callback(logical_thread_index, entry.data);
+		profiler_end();
+		thread_memory_t* thread_memory = (thread_memory_t*) thread_local_storage[logical_thread_index];
+		reset_arena(&thread_memory->task_arena);
 		win32_mark_queue_entry_completed(queue);
 	}
 	return entry.is_valid;
@@ -1170,79 +1451,151 @@ bool32 do_worker_work(work_queue_t* queue, int logical_thread_index) {
 
 
 bool32 is_queue_work_in_progress(work_queue_t* queue) {
-	bool32 result = (queue->completion_goal < queue->completion_count);
+	bool32 result = (queue->completion_count < queue->completion_goal);
 	return result;
 }
 
-DWORD WINAPI thread_proc(void* parameter) {
-	win32_thread_info_t* thread_info = (win32_thread_info_t*) parameter;
-	i64 init_start_time = get_clock();
-
-	// Allocate a private memory buffer
-	u64 thread_memory_size = MEGABYTES(16);
-	thread_local_storage[thread_info->logical_thread_index] = platform_alloc(thread_memory_size); // how much actually needed?
-	thread_memory_t* thread_memory = (thread_memory_t*) thread_local_storage[thread_info->logical_thread_index];
+// Allocates the private memory buffer of a thread (used e.g. as scratch space for decoding tiles).
+static void win32_init_thread_memory(i32 logical_thread_index) {
+	u64 thread_memory_size = MEGABYTES(16) + THREAD_TASK_ARENA_SIZE;
+	thread_local_storage[logical_thread_index] = platform_alloc(thread_memory_size); // how much actually needed?
+	memory_stats_add(MEMORY_DOMAIN_THREAD_MEMORY, thread_memory_size);
+	thread_memory_t* thread_memory = (thread_memory_t*) thread_local_storage[logical_thread_index];
 	memset(thread_memory, 0, sizeof(thread_memory_t));
 
-	thread_memory->async_io_event = CreateEventA(NULL, TRUE, FALSE, NULL);
-	if (!thread_memory->async_io_event) {
-		win32_diagnostic("CreateEvent");
-	}
 	thread_memory->thread_memory_raw_size = thread_memory_size;
 
 	thread_memory->aligned_rest_of_thread_memory = (void*)
 			((((u64)thread_memory + sizeof(thread_memory_t) + os_page_size - 1) / os_page_size) * os_page_size); // round up to next page boundary
 	thread_memory->thread_memory_usable_size = thread_memory_size - ((u64)thread_memory->aligned_rest_of_thread_memory - (u64)thread_memory);
 
-	// Create a dedicated OpenGL context for this thread, to be used for on-the-fly texture loading
-	ASSERT(main_window);
-	HDC dc = 0;
-	for (;;) {
-		dc = GetDC(main_window);
-		if (dc) break; else {
-			Sleep(1);
+	// The task arena takes up the end of the thread memory; the scratch space before it stays as large as it was.
+	thread_memory->thread_memory_usable_size -= THREAD_TASK_ARENA_SIZE;
+	init_arena(&thread_memory->task_arena, THREAD_TASK_ARENA_SIZE,
+	           (u8*)thread_memory->aligned_rest_of_thread_memory + thread_memory->thread_memory_usable_size);
+}
+
+// The logical processors of each physical core (from win32_count_physical_cores()), for pinning the workers.
+static DWORD_PTR core_processor_masks[MAX_THREAD_COUNT];
+static i32 core_processor_mask_count;
+static bool32 is_worker_pinning_enabled;
+
+// Hyperthreads of the same core share its execution units, so a core with two decoders on it isn't much faster
+// than with one. If the topology can't be queried, every logical processor is taken to be a core.
+static i32 win32_count_physical_cores() {
+	DWORD length = 0;
+	GetLogicalProcessorInformation(NULL, &length);
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION* infos = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION*) malloc(length);
+	i32 core_count = 0;
+	if (infos && length > 0 && GetLogicalProcessorInformation(infos, &length)) {
+		i32 info_count = (i32)(length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+		for (i32 i = 0; i < info_count; ++i) {
+			if (infos[i].Relationship == RelationProcessorCore) {
+				if (core_count < COUNT(core_processor_masks)) {
+					core_processor_masks[core_count] = infos[i].ProcessorMask;
+				}
+				++core_count;
+			}
 		}
 	}
-	HGLRC glrc = glrcs[thread_info->logical_thread_index];
-	ASSERT(glrc);
-	while (!wglMakeCurrent_alt(dc, glrc)) {
-		DWORD error_id = GetLastError();
-		if (error_id == 0) {
-			Sleep(1000);
-			continue; // for some reason, this can fail, but with error code 0, retrying seems harmless??
-		} else {
-			win32_diagnostic("wglMakeCurrent");
-			panic();
-		}
+	free(infos);
+	core_processor_mask_count = MIN(core_count, COUNT(core_processor_masks));
+	return (core_count > 0) ? core_count : logical_cpu_count;
+}
+
+// Background mode lowers the scheduling, I/O and memory priority of the calling thread, so that speculative work
+// (prefetching) yields to the tiles that are actually in view. Not applied to the main thread, which only runs
+// work entries while waiting for them.
+void platform_set_thread_background_mode(bool32 background) {
+	static THREAD_LOCAL bool32 is_in_background_mode;
+	if (current_logical_thread_index == 0 || background == is_in_background_mode) return;
+	if (SetThreadPriority(GetCurrentThread(), background ? THREAD_MODE_BACKGROUND_BEGIN : THREAD_MODE_BACKGROUND_END)) {
+		is_in_background_mode = background;
 	}
-	ReleaseDC(main_window, dc);
+}
 
-#if USE_OPENGL_DEBUG_CONTEXT
-	i32 gl_context_flags;
-	glGetIntegerv(GL_CONTEXT_FLAGS, &gl_context_flags);
-	if (gl_context_flags & GL_CONTEXT_FLAG_DEBUG_BIT) {
-//		printf("enabling debug output for thread %d...\n", thread_info->logical_thread_index);
-		glEnable(GL_DEBUG_OUTPUT);
-		glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
-		glDebugMessageCallback(opengl_debug_message_callback, 0);
-		glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, NULL, false);
-		glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_LOW, 0, NULL, true);
-		glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_MEDIUM, 0, NULL, true);
-		glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_HIGH, 0, NULL, true);
+DWORD WINAPI thread_proc(void* parameter) {
+	win32_thread_info_t* thread_info = (win32_thread_info_t*) parameter;
+	i64 init_start_time = get_clock();
+
+	win32_init_thread_memory(thread_info->logical_thread_index);
+	current_logical_thread_index = thread_info->logical_thread_index;
+	if (is_worker_pinning_enabled && core_processor_mask_count > 1) {
+		// Worker i goes on core i; core 0 is left to the main thread. (More workers than cores wrap around.)
+		i32 core = 1 + (thread_info->logical_thread_index - 1) % (core_processor_mask_count - 1);
+		SetThreadAffinityMask(GetCurrentThread(), core_processor_masks[core]);
 	}
-#endif
+	char thread_name[32];
+	snprintf(thread_name, sizeof(thread_name), "worker %d", thread_info->logical_thread_index);
+	profiler_register_thread(thread_name);
 
 //	printf("Thread %d reporting for duty (init took %.3f seconds)\n", thread_info->logical_thread_index, get_seconds_elapsed(init_start_time, get_clock()));
 
 	for (;;) {
-		if (!is_queue_work_in_progress(thread_info->queue)) {
-			Sleep(1);
-			WaitForSingleObjectEx(thread_info->queue->semaphore_handle, 1, FALSE);
-		}
-		do_worker_work(thread_info->queue, thread_info->logical_thread_index);
+		// Run everything we can find (our own deque first, then steal), then sleep until new work is submitted.
+		while (do_worker_work(thread_info->queue, thread_info->logical_thread_index)) {}
+		WaitForSingleObjectEx(thread_info->queue->semaphore_handle, INFINITE, FALSE);
 	}
 }
 
+// The network thread does the remote tile downloads (see remote_network_thread_loop()). It doesn't take on any work
+// itself, but it has a deque of its own, for handing the downloaded tiles to the workers.
+DWORD WINAPI network_thread_proc(void* parameter) {
+	win32_thread_info_t* thread_info = (win32_thread_info_t*) parameter;
+	win32_init_thread_memory(thread_info->logical_thread_index); // for decoding tiles itself, if the deque is full
+	current_logical_thread_index = thread_info->logical_thread_index;
+	profiler_register_thread("network");
+	profiler_begin("init networking");
+	init_networking(); // here instead of at startup, because Winsock and TLS take a while to initialize
+	profiler_end();
+	remote_network_thread_loop();
+	return 0;
+}
+
+// Needs to be called after win32_init_multithreading().
+void win32_start_network_thread() {
+	i32 network_thread_index = total_thread_count;
+	thread_infos[network_thread_index] = (win32_thread_info_t){ .logical_thread_index = network_thread_index, .queue = &work_queue};
+	HANDLE thread_handle = CreateThread(NULL, 0, network_thread_proc, thread_infos + network_thread_index, 0, NULL);
+	CloseHandle(thread_handle);
+}
+
+// The transfer thread does the tile uploads, with an OpenGL context of its own (see the transfer queue in
+// render_group.c). It sleeps until the main thread submits something.
+DWORD WINAPI transfer_thread_proc(void* parameter) {
+	HDC dc = GetDC(main_window);
+	if (!wglMakeCurrent_alt(dc, transfer_glrc)) {
+		win32_diagnostic("wglMakeCurrent");
+		return 0; // (the queue is not started, so the main thread keeps doing the uploads)
+	}
+	profiler_register_thread("transfer");
+	start_tile_transfers();
+	if (!is_tile_transfer_queue_running()) {
+		wglMakeCurrent_alt(NULL, NULL);
+		return 0;
+	}
+	for (;;) {
+		WaitForSingleObjectEx(transfer_semaphore, INFINITE, FALSE);
+		run_tile_transfers();
+	}
+}
+
+// Needs to be called after init_opengl_stuff(). Can be turned off with TRANSFER_THREAD=0.
+void win32_start_transfer_thread() {
+	const char* transfer_thread_env = getenv("TRANSFER_THREAD");
+	if (!transfer_glrc || (transfer_thread_env && atoi(transfer_thread_env) == 0)) {
+		return;
+	}
+	transfer_semaphore = CreateSemaphoreA(NULL, 0, 1 << 30, NULL);
+	HANDLE thread_handle = CreateThread(NULL, 0, transfer_thread_proc, NULL, 0, NULL);
+	SetThreadPriority(thread_handle, THREAD_PRIORITY_ABOVE_NORMAL);
+	CloseHandle(thread_handle);
+}
+
+void win32_wake_transfer_thread() {
+	ReleaseSemaphore(transfer_semaphore, 1, NULL);
+}
+
 //#define TEST_THREAD_QUEUE
 #ifdef TEST_THREAD_QUEUE
 void echo_task(int logical_thread_index, void* userdata) {
@@ -1250,12 +1603,80 @@ void echo_task(int logical_thread_index, void* userdata) {
 }
 #endif
 
+// Stress test for the work queue: floods it with many small tasks (some submitted from the main thread,
+// the rest spawned by the tasks themselves on the worker threads) and reports throughput and queueing latency.
+//#define BENCHMARK_WORK_QUEUE
+#ifdef BENCHMARK_WORK_QUEUE
+#define BENCHMARK_TASK_COUNT 200000
+#define BENCHMARK_SUBTASKS_PER_TASK 3
+
+typedef struct benchmark_task_t {
+	i64 submit_clock;
+	i64 start_clock;
+} benchmark_task_t;
+
+benchmark_task_t benchmark_tasks[BENCHMARK_TASK_COUNT];
+i32 volatile benchmark_tasks_reserved;
+
+void benchmark_task(int logical_thread_index, void* userdata) {
+	benchmark_task_t* task = (benchmark_task_t*) userdata;
+	task->start_clock = get_clock();
+	volatile u32 dummy = 0;
+	for (i32 i = 0; i < 2000; ++i) {
+		dummy += i; // stand-in for a small amount of real work
+	}
+	for (i32 i = 0; i < BENCHMARK_SUBTASKS_PER_TASK; ++i) {
+		i32 task_index = interlocked_increment(&benchmark_tasks_reserved) - 1;
+		if (task_index >= BENCHMARK_TASK_COUNT) break;
+		benchmark_task_t* subtask = benchmark_tasks + task_index;
+		subtask->submit_clock = get_clock();
+		add_work_queue_entry(&work_queue, benchmark_task, subtask);
+	}
+}
+
+void benchmark_work_queue() {
+	i64 start = get_clock();
+	i32 rejected_count = 0;
+	for (;;) {
+		i32 task_index = interlocked_increment(&benchmark_tasks_reserved) - 1;
+		if (task_index >= BENCHMARK_TASK_COUNT) break;
+		benchmark_task_t* task = benchmark_tasks + task_index;
+		task->submit_clock = get_clock();
+		while (!add_work_queue_entry(&work_queue, benchmark_task, task)) {
+			++rejected_count; // backpressure: our deque is full, wait for the workers to catch up
+			_mm_pause();
+			task->submit_clock = get_clock();
+		}
+	}
+	while (is_queue_work_in_progress(&work_queue)) {
+		_mm_pause();
+	}
+	float seconds_elapsed = get_seconds_elapsed(start, get_clock());
+
+	float total_latency = 0.0f;
+	float max_latency = 0.0f;
+	for (i32 i = 0; i < BENCHMARK_TASK_COUNT; ++i) {
+		float latency = get_seconds_elapsed(benchmark_tasks[i].submit_clock, benchmark_tasks[i].start_clock);
+		total_latency += latency;
+		max_latency = MAX(max_latency, latency);
+	}
+	printf("Work queue benchmark: %d tasks on %d threads in %.3f s (%.0f tasks/s)\n",
+	       BENCHMARK_TASK_COUNT, total_thread_count, seconds_elapsed, BENCHMARK_TASK_COUNT / seconds_elapsed);
+	printf("    latency: average %.3f ms, max %.3f ms; submissions refused (backpressure): %d\n",
+	       (total_latency / BENCHMARK_TASK_COUNT) * 1000.0f, max_latency * 1000.0f, rejected_count);
+}
+#endif
+
 void win32_init_multithreading() {
 	i32 semaphore_initial_count = 0;
-	i32 worker_thread_count = total_thread_count - 1;
-	work_queue.semaphore_handle = CreateSemaphoreExA(0, semaphore_initial_count, worker_thread_count, 0, 0, SEMAPHORE_ALL_ACCESS);
-
-	// NOTE: the main thread is considered thread 0.
+	// Every submitted entry releases the semaphore once; entries run inline or by the main thread do not consume
+	// a count, so the count can get ahead of the actual amount of work (this only causes harmless spurious wakeups).
+	i32 semaphore_maximum_count = WORK_DEQUE_CAPACITY * MAX_THREAD_COUNT;
+	work_queue.semaphore_handle = CreateSemaphoreExA(0, semaphore_initial_count, semaphore_maximum_count, 0, 0, SEMAPHORE_ALL_ACCESS);
+	work_queue.deque_count = total_thread_count + 1; // the last deque belongs to the network thread
+
+	// NOTE: the main thread is considered thread 0. It also runs work entries (e.g. while waiting for them to finish).
+	win32_init_thread_memory(0);
 	for (i32 i = 1; i < total_thread_count; ++i) {
 		thread_infos[i] = (win32_thread_info_t){ .logical_thread_index = i, .queue = &work_queue};
 
@@ -1282,10 +1703,14 @@ void win32_init_multithreading() {
 	add_work_queue_entry(&work_queue, echo_task, "string 11");
 
 	while (is_queue_work_in_progress(&work_queue)) {
-		do_worker_work(&work_queue, total_thread_count);
+		do_worker_work(&work_queue, 0);
 	}
 #endif
 
+#ifdef BENCHMARK_WORK_QUEUE
+	benchmark_work_queue();
+#endif
+
 
 }
 
@@ -1334,37 +1759,56 @@ void win32_init_main_window() {
 
 }
 
-bool profiling = false;
-
-i64 profiler_end_section(i64 start, const char* name, float report_threshold_ms) {
-	if (!profiling) return -1;
-	else {
-		i64 end = get_clock();
-		float ms_elapsed = get_seconds_elapsed(start, end) * 1000.0f;
-		if (ms_elapsed > report_threshold_ms) {
-			printf("[profiler] %s: %g ms\n", name, ms_elapsed);
-		}
-		return end;
-	}
-}
-
-
 int main(int argc, char** argv) {
 	g_instance = GetModuleHandle(NULL);
 	g_cmdline = GetCommandLine();
 	g_argc = argc;
 	g_argv = argv;
 
+	// Startup is kept short: the window is shown (and cleared) first, and whatever isn't needed for the first frame
+	// is picked up by other threads (OpenSlide is loaded by a worker, and networking is initialized by the network
+	// thread). The steps show up in the profiler; with --startup-trace, they are exported after the first frame.
+	i64 startup_clock = get_clock();
 	printf("Starting up...\n");
+	profiler_register_thread("main");
+	profiler_begin("startup");
+	cpu_dispatch_init(); // picks the SIMD kernels (may be overridden with the CPU_KERNELS environment variable)
+	log_init(stdout, LOG_LEVEL_INFO); // the worker threads log through this (see log.h)
+	bool32 export_startup_trace = false;
+	for (i32 i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--startup-trace") == 0) {
+			export_startup_trace = true;
+		}
+	}
 
 	GetSystemInfo(&system_info);
 	logical_cpu_count = (i32)system_info.dwNumberOfProcessors;
 	os_page_size = system_info.dwPageSize;
-	total_thread_count = MIN(logical_cpu_count, MAX_THREAD_COUNT);
+	physical_core_count = win32_count_physical_cores();
+	// The work queue threads mostly decode tiles, which is CPU-bound: one per physical core, counting the main thread
+	// (so the main thread keeps a core to itself for rendering). The I/O-bound remote downloads don't take up any of
+	// these, they are done by the network thread. Can be overridden with the WORKER_THREADS environment variable
+	// (the number of threads besides the main thread); with PIN_WORKER_THREADS=1, each worker is pinned to its core.
+	total_thread_count = ATLEAST(2, physical_core_count);
+	const char* worker_threads_env = getenv("WORKER_THREADS");
+	if (worker_threads_env && atoi(worker_threads_env) > 0) {
+		total_thread_count = 1 + atoi(worker_threads_env);
+	}
+	total_thread_count = MIN(total_thread_count, MAX_THREAD_COUNT - 1); // one more thread for networking
+	const char* pin_env = getenv("PIN_WORKER_THREADS");
+	is_worker_pinning_enabled = (pin_env && atoi(pin_env) != 0);
 
 	win32_init_timer();
 	win32_init_cursor();
+	profiler_begin("init main window");
 	win32_init_main_window();
+	glClearColor(0.95f, 0.95f, 0.95f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	wglSwapBuffers(wglGetCurrentDC_alt());
+	profiler_end();
+	float window_shown_seconds = get_seconds_elapsed(startup_clock, get_clock());
+
+	profiler_begin("init multithreading");
 	win32_init_multithreading();
 	// Load OpenSlide in the background, we might not need it immediately.
 #if 1
@@ -1373,54 +1817,110 @@ int main(int argc, char** argv) {
     load_openslide_task(0, NULL);
 #endif
 	win32_init_input();
-	init_networking();
+	win32_start_network_thread();
+	profiler_end();
 
 	is_program_running = true;
 
+	profiler_begin("init opengl");
 	init_opengl_stuff();
+	win32_start_transfer_thread();
+	profiler_end();
+	profiler_begin("init gui");
 	win32_init_gui(main_window);
+	profiler_end();
 
+	profiler_begin("init app state");
 	app_state_t* app_state = &global_app_state;
 	init_app_state(app_state);
+	profiler_end();
 
 	// Load a slide from the command line or through the OS (double-click / drag on executable, etc.)
 	// TODO: give the viewer the option to do this without referring to the g_argc which it does not need to know!
-	if (g_argc > 1) {
+	if (g_argc > 1 && g_argv[1][0] != '-') {
 		char* filename = g_argv[1];
 		load_generic_file(app_state, filename);
+		// Replay a recorded camera path, report the frame times and tile metrics, and quit (for performance testing).
+		if (g_argc > 3 && strcmp(g_argv[2], "--replay") == 0) {
+			start_camera_path_replay(app_state, g_argv[3], true);
+		}
+	}
+	// Generate N annotations with M vertices in K groups, time loading, drawing and editing them, and quit
+	// (see annotation_stress.c). Can be combined with a slide, to spread the annotations over it.
+	for (i32 i = 1; i + 3 < g_argc; ++i) {
+		if (strcmp(g_argv[i], "--annotation-stress") == 0) {
+			annotation_stress_params_t* stress = &app_state->annotation_stress;
+			stress->annotation_count = atoi(g_argv[i + 1]);
+			stress->vertex_count = atoi(g_argv[i + 2]);
+			stress->group_count = atoi(g_argv[i + 3]);
+			stress->is_pending = true;
+			stress->quit_when_done = true;
+		}
 	}
 
 	HDC glrc_hdc = wglGetCurrentDC_alt();
 
+	win32_init_frame_pacing(glrc_hdc);
+	profiler_end(); // startup
+
 	i64 last_clock = get_clock();
+	bool32 is_first_frame = true;
 	while (is_program_running) {
 
+		profiler_new_frame();
+		profiler_begin("frame pacing");
+		bool32 is_latency_mode = app_state->enable_low_latency_frame_pacing && !app_state->allow_idling_next_frame;
+		win32_wait_for_frame_start(is_latency_mode);
+		profiler_end();
+
 		i64 current_clock = get_clock();
 		float delta_t = (float)(current_clock - last_clock) / (float)performance_counter_frequency;
 		last_clock = current_clock;
 
+		profiler_begin("input");
 		bool did_idle = win32_process_input(main_window, app_state);
 		if (did_idle) {
 			last_clock = get_clock();
 		}
-		i64 section_end = profiler_end_section(last_clock, "input", 20.0f);
+		profiler_end();
+		i64 input_clock = get_clock();
+		// (some room is left for the GPU to finish, like in win32_wait_for_frame_start())
+		begin_frame_jobs(input_clock, frame_pacing.refresh_period * 0.75f);
 
 		win32_window_dimension_t dimension = win32_get_window_dimension(main_window);
+		profiler_begin("viewer update and render");
 		viewer_update_and_render(app_state, curr_input, dimension.width, dimension.height, delta_t);
-		section_end = profiler_end_section(section_end, "viewer update and render", 20.0f);
+		profiler_end();
 
+		profiler_begin("gui draw");
 		gui_draw(app_state, curr_input, dimension.width, dimension.height);
-		section_end = profiler_end_section(section_end, "gui draw", 10.0f);
+		profiler_end();
 
+		// Uploads, tile cache eviction and autosave, in the time that is left (see frame_jobs.h)
+		profiler_begin("frame jobs");
+		run_frame_jobs(app_state);
+		profiler_end();
 
-		autosave(app_state, false);
-
+		profiler_begin("swap buffers");
+		i64 swap_begin_clock = get_clock();
 		wglSwapBuffers(glrc_hdc);
-		section_end = profiler_end_section(section_end, "end frame", 100.0f);
+		profiler_end();
+		win32_end_frame_pacing(input_clock, swap_begin_clock, get_clock());
+
+		if (is_first_frame) {
+			is_first_frame = false;
+			printf("Startup: window shown after %.0f ms, first frame after %.0f ms\n", window_shown_seconds * 1000.0f,
+			       get_seconds_elapsed(startup_clock, get_clock()) * 1000.0f);
+			if (export_startup_trace) {
+				profiler_export_chrome_trace("startup_trace.json");
+			}
+		}
 
 	}
 
 	autosave(app_state, true); // save any unsaved changes
+	tile_metrics_print();
+	log_flush();
 
 	return 0;
 }
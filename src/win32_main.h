@@ -22,6 +22,7 @@
 // todo: fix this (make opaque structure?)
 #include <windows.h>
 #include "platform.h"
+#include "arena.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -48,13 +49,23 @@ typedef struct {
 } win32_window_dimension_t;
 
 
+#define WORK_DEQUE_CAPACITY 256
+
+// Each thread owns one deque: the owner pushes and pops at the tail (newest entry first),
+// other threads steal from the head (oldest entry first).
+typedef struct work_deque_t {
+	i32 volatile lock;
+	i32 volatile head;
+	i32 volatile tail;
+	work_queue_entry_t entries[WORK_DEQUE_CAPACITY];
+} work_deque_t;
+
 typedef struct work_queue_t {
-	HANDLE semaphore_handle;
-	i32 volatile next_entry_to_submit;
-	i32 volatile next_entry_to_execute;
+	HANDLE semaphore_handle; // signaled once for every submitted entry; idle workers block on it
 	i32 volatile completion_count;
 	i32 volatile completion_goal;
-	work_queue_entry_t entries[256];
+	i32 deque_count;
+	work_deque_t deques[MAX_THREAD_COUNT];
 } work_queue_t;
 
 
@@ -64,18 +75,22 @@ typedef struct win32_thread_info_t {
 } win32_thread_info_t;
 
 typedef struct {
-	HANDLE async_io_event;
-	OVERLAPPED overlapped;
 	u64 thread_memory_raw_size;
 	u64 thread_memory_usable_size; // free space from aligned_rest_of_thread_memory onward
 	void* aligned_rest_of_thread_memory;
+	struct jpeg_decoder_state_t* jpeg_decoder_state; // created on first use
+	arena_t task_arena; // for allocations that only live as long as one work queue task; reset after every task
 } thread_memory_t;
 
+#define THREAD_TASK_ARENA_SIZE MEGABYTES(4)
+
 
 void win32_open_file_dialog(HWND window);
+void win32_open_overlay_file_dialog(HWND window);
 void win32_toggle_fullscreen(HWND window);
 bool32 win32_is_fullscreen(HWND window);
 void win32_diagnostic(const char* prefix);
+void win32_wake_transfer_thread();
 
 // globals
 #if defined(WIN32_MAIN_IMPL)
@@ -91,6 +106,7 @@ extern SYSTEM_INFO system_info;
 extern u32 os_page_size;
 extern i32 total_thread_count;
 extern i32 logical_cpu_count;
+extern i32 physical_core_count;
 extern work_queue_t work_queue;
 
 
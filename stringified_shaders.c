@@ -30,7 +30,7 @@ const char stringified_shader_source__basic_vert[276] = {
 	0
 };
 
-const char stringified_shader_source__basic_frag[483] = {
+const char stringified_shader_source__basic_frag[1325] = {
 	0x23, 0x76, 0x65, 0x72, 0x73, 0x69, 0x6f, 0x6e, 0x20, 0x31, 0x34, 
 	0x30, 0x0d, 0x0a, 0x0d, 0x0a, 0x0d, 0x0a, 0x69, 0x6e, 0x20, 0x76, 
 	0x65, 0x63, 0x32, 0x20, 0x76, 0x73, 0x5f, 0x74, 0x65, 0x78, 0x5f, 
@@ -38,21 +38,43 @@ const char stringified_shader_source__basic_frag[483] = {
 	0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x76, 0x65, 
 	0x63, 0x33, 0x20, 0x62, 0x67, 0x5f, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 
 	0x3b, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 
-	0x73, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x72, 0x32, 0x44, 0x20, 0x74, 
-	0x68, 0x65, 0x5f, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 0x3b, 
-	0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x66, 
-	0x6c, 0x6f, 0x61, 0x74, 0x20, 0x62, 0x6c, 0x61, 0x63, 0x6b, 0x5f, 
-	0x6c, 0x65, 0x76, 0x65, 0x6c, 0x3b, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 
-	0x66, 0x6f, 0x72, 0x6d, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 
-	0x77, 0x68, 0x69, 0x74, 0x65, 0x5f, 0x6c, 0x65, 0x76, 0x65, 0x6c, 
-	0x3b, 0x0d, 0x0a, 0x0d, 0x0a, 0x76, 0x6f, 0x69, 0x64, 0x20, 0x6d, 
-	0x61, 0x69, 0x6e, 0x28, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 
-	0x20, 0x20, 0x76, 0x65, 0x63, 0x34, 0x20, 0x74, 0x68, 0x65, 0x5f, 
-	0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 0x5f, 0x72, 0x67, 0x62, 
-	0x61, 0x20, 0x3d, 0x20, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 
-	0x28, 0x74, 0x68, 0x65, 0x5f, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 
-	0x65, 0x2c, 0x20, 0x76, 0x73, 0x5f, 0x74, 0x65, 0x78, 0x5f, 0x63, 
-	0x6f, 0x6f, 0x72, 0x64, 0x29, 0x3b, 0x0d, 0x0a, 0x0d, 0x0a, 0x20, 
+	0x73, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x72, 0x32, 0x44, 0x41, 0x72, 
+	0x72, 0x61, 0x79, 0x20, 0x74, 0x68, 0x65, 0x5f, 0x74, 0x65, 0x78, 
+	0x74, 0x75, 0x72, 0x65, 0x3b, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 
+	0x6f, 0x72, 0x6d, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x6c, 
+	0x61, 0x79, 0x65, 0x72, 0x3b, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 
+	0x6f, 0x72, 0x6d, 0x20, 0x73, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x72, 
+	0x33, 0x44, 0x20, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x5f, 0x6c, 0x75, 
+	0x74, 0x3b, 0x20, 0x2f, 0x2f, 0x20, 0x74, 0x68, 0x65, 0x20, 0x69, 
+	0x6d, 0x61, 0x67, 0x65, 0x20, 0x61, 0x64, 0x6a, 0x75, 0x73, 0x74, 
+	0x6d, 0x65, 0x6e, 0x74, 0x73, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x64, 
+	0x69, 0x73, 0x70, 0x6c, 0x61, 0x79, 0x20, 0x63, 0x6f, 0x6c, 0x6f, 
+	0x72, 0x20, 0x63, 0x6f, 0x72, 0x72, 0x65, 0x63, 0x74, 0x69, 0x6f, 
+	0x6e, 0x2c, 0x20, 0x73, 0x65, 0x65, 0x20, 0x75, 0x70, 0x64, 0x61, 
+	0x74, 0x65, 0x5f, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x5f, 0x6c, 0x75, 
+	0x74, 0x28, 0x29, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 
+	0x6d, 0x20, 0x62, 0x6f, 0x6f, 0x6c, 0x20, 0x61, 0x70, 0x70, 0x6c, 
+	0x79, 0x5f, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x5f, 0x6c, 0x75, 0x74, 
+	0x3b, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 
+	0x62, 0x6f, 0x6f, 0x6c, 0x20, 0x73, 0x68, 0x6f, 0x77, 0x5f, 0x73, 
+	0x69, 0x6e, 0x67, 0x6c, 0x65, 0x5f, 0x73, 0x74, 0x61, 0x69, 0x6e, 
+	0x3b, 0x20, 0x2f, 0x2f, 0x20, 0x73, 0x65, 0x65, 0x20, 0x67, 0x65, 
+	0x74, 0x5f, 0x73, 0x74, 0x61, 0x69, 0x6e, 0x5f, 0x75, 0x6e, 0x6d, 
+	0x69, 0x78, 0x69, 0x6e, 0x67, 0x28, 0x29, 0x0d, 0x0a, 0x75, 0x6e, 
+	0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x76, 0x65, 0x63, 0x33, 0x20, 
+	0x73, 0x74, 0x61, 0x69, 0x6e, 0x5f, 0x75, 0x6e, 0x6d, 0x69, 0x78, 
+	0x69, 0x6e, 0x67, 0x3b, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 
+	0x72, 0x6d, 0x20, 0x76, 0x65, 0x63, 0x33, 0x20, 0x73, 0x74, 0x61, 
+	0x69, 0x6e, 0x5f, 0x76, 0x65, 0x63, 0x74, 0x6f, 0x72, 0x3b, 0x0d, 
+	0x0a, 0x0d, 0x0a, 0x76, 0x6f, 0x69, 0x64, 0x20, 0x6d, 0x61, 0x69, 
+	0x6e, 0x28, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+	0x76, 0x65, 0x63, 0x34, 0x20, 0x74, 0x68, 0x65, 0x5f, 0x74, 0x65, 
+	0x78, 0x74, 0x75, 0x72, 0x65, 0x5f, 0x72, 0x67, 0x62, 0x61, 0x20, 
+	0x3d, 0x20, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 0x28, 0x74, 
+	0x68, 0x65, 0x5f, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 0x2c, 
+	0x20, 0x76, 0x65, 0x63, 0x33, 0x28, 0x76, 0x73, 0x5f, 0x74, 0x65, 
+	0x78, 0x5f, 0x63, 0x6f, 0x6f, 0x72, 0x64, 0x2c, 0x20, 0x6c, 0x61, 
+	0x79, 0x65, 0x72, 0x29, 0x29, 0x3b, 0x0d, 0x0a, 0x0d, 0x0a, 0x20, 
 	0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x6f, 0x70, 
 	0x61, 0x63, 0x69, 0x74, 0x79, 0x20, 0x3d, 0x20, 0x74, 0x68, 0x65, 
 	0x5f, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 0x5f, 0x72, 0x67, 
@@ -60,30 +82,1720 @@ const char stringified_shader_source__basic_frag[483] = {
 	0x76, 0x65, 0x63, 0x33, 0x20, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x20, 
 	0x3d, 0x20, 0x74, 0x68, 0x65, 0x5f, 0x74, 0x65, 0x78, 0x74, 0x75, 
 	0x72, 0x65, 0x5f, 0x72, 0x67, 0x62, 0x61, 0x2e, 0x72, 0x67, 0x62, 
-	0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x63, 0x6f, 0x6c, 0x6f, 
-	0x72, 0x20, 0x3d, 0x20, 0x28, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x20, 
-	0x2d, 0x20, 0x62, 0x6c, 0x61, 0x63, 0x6b, 0x5f, 0x6c, 0x65, 0x76, 
-	0x65, 0x6c, 0x29, 0x20, 0x2a, 0x20, 0x28, 0x31, 0x2e, 0x30, 0x66, 
-	0x20, 0x2f, 0x20, 0x28, 0x77, 0x68, 0x69, 0x74, 0x65, 0x5f, 0x6c, 
-	0x65, 0x76, 0x65, 0x6c, 0x20, 0x2d, 0x20, 0x62, 0x6c, 0x61, 0x63, 
-	0x6b, 0x5f, 0x6c, 0x65, 0x76, 0x65, 0x6c, 0x29, 0x29, 0x3b, 0x0d, 
-	0x0a, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x67, 0x6c, 0x5f, 0x46, 
-	0x72, 0x61, 0x67, 0x43, 0x6f, 0x6c, 0x6f, 0x72, 0x20, 0x3d, 0x20, 
-	0x76, 0x65, 0x63, 0x34, 0x28, 0x6f, 0x70, 0x61, 0x63, 0x69, 0x74, 
-	0x79, 0x20, 0x2a, 0x20, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x20, 0x2b, 
-	0x20, 0x28, 0x31, 0x2e, 0x30, 0x66, 0x2d, 0x6f, 0x70, 0x61, 0x63, 
-	0x69, 0x74, 0x79, 0x29, 0x20, 0x2a, 0x20, 0x62, 0x67, 0x5f, 0x63, 
-	0x6f, 0x6c, 0x6f, 0x72, 0x2c, 0x20, 0x6f, 0x70, 0x61, 0x63, 0x69, 
-	0x74, 0x79, 0x29, 0x3b, 0x0d, 0x0a, 0x7d, 0x0d, 0x0a, 0
+	0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x28, 
+	0x73, 0x68, 0x6f, 0x77, 0x5f, 0x73, 0x69, 0x6e, 0x67, 0x6c, 0x65, 
+	0x5f, 0x73, 0x74, 0x61, 0x69, 0x6e, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x2f, 0x2f, 0x20, 
+	0x43, 0x6f, 0x6c, 0x6f, 0x72, 0x20, 0x64, 0x65, 0x63, 0x6f, 0x6e, 
+	0x76, 0x6f, 0x6c, 0x75, 0x74, 0x69, 0x6f, 0x6e, 0x3a, 0x20, 0x74, 
+	0x68, 0x65, 0x20, 0x6f, 0x70, 0x74, 0x69, 0x63, 0x61, 0x6c, 0x20, 
+	0x64, 0x65, 0x6e, 0x73, 0x69, 0x74, 0x79, 0x20, 0x69, 0x73, 0x20, 
+	0x75, 0x6e, 0x6d, 0x69, 0x78, 0x65, 0x64, 0x20, 0x69, 0x6e, 0x74, 
+	0x6f, 0x20, 0x74, 0x68, 0x65, 0x20, 0x61, 0x6d, 0x6f, 0x75, 0x6e, 
+	0x74, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x73, 0x68, 
+	0x6f, 0x77, 0x6e, 0x20, 0x73, 0x74, 0x61, 0x69, 0x6e, 0x2c, 0x20, 
+	0x77, 0x68, 0x69, 0x63, 0x68, 0x20, 0x69, 0x73, 0x20, 0x74, 0x68, 
+	0x65, 0x6e, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x2f, 0x2f, 0x20, 0x72, 0x65, 0x62, 0x75, 0x69, 0x6c, 0x74, 
+	0x20, 0x77, 0x69, 0x74, 0x68, 0x6f, 0x75, 0x74, 0x20, 0x74, 0x68, 
+	0x65, 0x20, 0x6f, 0x74, 0x68, 0x65, 0x72, 0x20, 0x73, 0x74, 0x61, 
+	0x69, 0x6e, 0x73, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x76, 0x65, 0x63, 0x33, 0x20, 0x6f, 0x70, 0x74, 0x69, 
+	0x63, 0x61, 0x6c, 0x5f, 0x64, 0x65, 0x6e, 0x73, 0x69, 0x74, 0x79, 
+	0x20, 0x3d, 0x20, 0x2d, 0x6c, 0x6f, 0x67, 0x28, 0x6d, 0x61, 0x78, 
+	0x28, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x2c, 0x20, 0x76, 0x65, 0x63, 
+	0x33, 0x28, 0x31, 0x2e, 0x30, 0x66, 0x20, 0x2f, 0x20, 0x32, 0x35, 
+	0x35, 0x2e, 0x30, 0x66, 0x29, 0x29, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61, 
+	0x74, 0x20, 0x73, 0x74, 0x61, 0x69, 0x6e, 0x5f, 0x61, 0x6d, 0x6f, 
+	0x75, 0x6e, 0x74, 0x20, 0x3d, 0x20, 0x6d, 0x61, 0x78, 0x28, 0x30, 
+	0x2e, 0x30, 0x66, 0x2c, 0x20, 0x64, 0x6f, 0x74, 0x28, 0x73, 0x74, 
+	0x61, 0x69, 0x6e, 0x5f, 0x75, 0x6e, 0x6d, 0x69, 0x78, 0x69, 0x6e, 
+	0x67, 0x2c, 0x20, 0x6f, 0x70, 0x74, 0x69, 0x63, 0x61, 0x6c, 0x5f, 
+	0x64, 0x65, 0x6e, 0x73, 0x69, 0x74, 0x79, 0x29, 0x29, 0x3b, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x63, 0x6f, 
+	0x6c, 0x6f, 0x72, 0x20, 0x3d, 0x20, 0x65, 0x78, 0x70, 0x28, 0x2d, 
+	0x73, 0x74, 0x61, 0x69, 0x6e, 0x5f, 0x61, 0x6d, 0x6f, 0x75, 0x6e, 
+	0x74, 0x20, 0x2a, 0x20, 0x73, 0x74, 0x61, 0x69, 0x6e, 0x5f, 0x76, 
+	0x65, 0x63, 0x74, 0x6f, 0x72, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x7d, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 
+	0x20, 0x28, 0x61, 0x70, 0x70, 0x6c, 0x79, 0x5f, 0x63, 0x6f, 0x6c, 
+	0x6f, 0x72, 0x5f, 0x6c, 0x75, 0x74, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x2f, 0x2f, 0x20, 
+	0x28, 0x74, 0x68, 0x65, 0x20, 0x6f, 0x75, 0x74, 0x65, 0x72, 0x6d, 
+	0x6f, 0x73, 0x74, 0x20, 0x67, 0x72, 0x69, 0x64, 0x20, 0x70, 0x6f, 
+	0x69, 0x6e, 0x74, 0x73, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 
+	0x20, 0x6c, 0x6f, 0x6f, 0x6b, 0x75, 0x70, 0x20, 0x74, 0x61, 0x62, 
+	0x6c, 0x65, 0x20, 0x61, 0x72, 0x65, 0x20, 0x61, 0x74, 0x20, 0x74, 
+	0x68, 0x65, 0x20, 0x74, 0x65, 0x78, 0x65, 0x6c, 0x20, 0x63, 0x65, 
+	0x6e, 0x74, 0x65, 0x72, 0x73, 0x29, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x33, 0x20, 0x6c, 
+	0x75, 0x74, 0x5f, 0x73, 0x69, 0x7a, 0x65, 0x20, 0x3d, 0x20, 0x76, 
+	0x65, 0x63, 0x33, 0x28, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 
+	0x53, 0x69, 0x7a, 0x65, 0x28, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x5f, 
+	0x6c, 0x75, 0x74, 0x2c, 0x20, 0x30, 0x29, 0x29, 0x3b, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x63, 0x6f, 0x6c, 
+	0x6f, 0x72, 0x20, 0x3d, 0x20, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 
+	0x65, 0x28, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x5f, 0x6c, 0x75, 0x74, 
+	0x2c, 0x20, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x20, 0x2a, 0x20, 0x28, 
+	0x28, 0x6c, 0x75, 0x74, 0x5f, 0x73, 0x69, 0x7a, 0x65, 0x20, 0x2d, 
+	0x20, 0x31, 0x2e, 0x30, 0x66, 0x29, 0x20, 0x2f, 0x20, 0x6c, 0x75, 
+	0x74, 0x5f, 0x73, 0x69, 0x7a, 0x65, 0x29, 0x20, 0x2b, 0x20, 0x30, 
+	0x2e, 0x35, 0x66, 0x20, 0x2f, 0x20, 0x6c, 0x75, 0x74, 0x5f, 0x73, 
+	0x69, 0x7a, 0x65, 0x29, 0x2e, 0x72, 0x67, 0x62, 0x3b, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x7d, 0x0d, 0x0a, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x67, 0x6c, 0x5f, 0x46, 0x72, 0x61, 0x67, 0x43, 0x6f, 
+	0x6c, 0x6f, 0x72, 0x20, 0x3d, 0x20, 0x76, 0x65, 0x63, 0x34, 0x28, 
+	0x6f, 0x70, 0x61, 0x63, 0x69, 0x74, 0x79, 0x20, 0x2a, 0x20, 0x63, 
+	0x6f, 0x6c, 0x6f, 0x72, 0x20, 0x2b, 0x20, 0x28, 0x31, 0x2e, 0x30, 
+	0x66, 0x2d, 0x6f, 0x70, 0x61, 0x63, 0x69, 0x74, 0x79, 0x29, 0x20, 
+	0x2a, 0x20, 0x62, 0x67, 0x5f, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x2c, 
+	0x20, 0x6f, 0x70, 0x61, 0x63, 0x69, 0x74, 0x79, 0x29, 0x3b, 0x0d, 
+	0x0a, 0x7d, 0x0d, 0x0a, 0
+};
+
+const char stringified_shader_source__tile_vert[1617] = {
+	0x23, 0x76, 0x65, 0x72, 0x73, 0x69, 0x6f, 0x6e, 0x20, 0x31, 0x34, 
+	0x30, 0x0d, 0x0a, 0x0d, 0x0a, 0x69, 0x6e, 0x20, 0x76, 0x65, 0x63, 
+	0x33, 0x20, 0x70, 0x6f, 0x73, 0x3b, 0x0d, 0x0a, 0x69, 0x6e, 0x20, 
+	0x76, 0x65, 0x63, 0x32, 0x20, 0x74, 0x65, 0x78, 0x5f, 0x63, 0x6f, 
+	0x6f, 0x72, 0x64, 0x3b, 0x0d, 0x0a, 0x0d, 0x0a, 0x6f, 0x75, 0x74, 
+	0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 0x76, 0x73, 0x5f, 0x74, 0x65, 
+	0x78, 0x5f, 0x63, 0x6f, 0x6f, 0x72, 0x64, 0x3b, 0x0d, 0x0a, 0x66, 
+	0x6c, 0x61, 0x74, 0x20, 0x6f, 0x75, 0x74, 0x20, 0x66, 0x6c, 0x6f, 
+	0x61, 0x74, 0x20, 0x76, 0x73, 0x5f, 0x6c, 0x61, 0x79, 0x65, 0x72, 
+	0x3b, 0x0d, 0x0a, 0x66, 0x6c, 0x61, 0x74, 0x20, 0x6f, 0x75, 0x74, 
+	0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x76, 0x73, 0x5f, 0x69, 
+	0x73, 0x5f, 0x66, 0x6c, 0x61, 0x74, 0x3b, 0x0d, 0x0a, 0x66, 0x6c, 
+	0x61, 0x74, 0x20, 0x6f, 0x75, 0x74, 0x20, 0x76, 0x65, 0x63, 0x34, 
+	0x20, 0x76, 0x73, 0x5f, 0x66, 0x6c, 0x61, 0x74, 0x5f, 0x63, 0x6f, 
+	0x6c, 0x6f, 0x72, 0x3b, 0x0d, 0x0a, 0x66, 0x6c, 0x61, 0x74, 0x20, 
+	0x6f, 0x75, 0x74, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x76, 
+	0x73, 0x5f, 0x61, 0x6c, 0x70, 0x68, 0x61, 0x3b, 0x0d, 0x0a, 0x66, 
+	0x6c, 0x61, 0x74, 0x20, 0x6f, 0x75, 0x74, 0x20, 0x76, 0x65, 0x63, 
+	0x32, 0x20, 0x76, 0x73, 0x5f, 0x76, 0x61, 0x6c, 0x69, 0x64, 0x5f, 
+	0x6d, 0x61, 0x78, 0x3b, 0x0d, 0x0a, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 
+	0x66, 0x6f, 0x72, 0x6d, 0x20, 0x6d, 0x61, 0x74, 0x34, 0x20, 0x70, 
+	0x72, 0x6f, 0x6a, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x5f, 0x76, 
+	0x69, 0x65, 0x77, 0x5f, 0x6d, 0x61, 0x74, 0x72, 0x69, 0x78, 0x3b, 
+	0x0d, 0x0a, 0x0d, 0x0a, 0x2f, 0x2f, 0x20, 0x50, 0x65, 0x72, 0x2d, 
+	0x69, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x63, 0x65, 0x20, 0x64, 0x61, 
+	0x74, 0x61, 0x20, 0x66, 0x6f, 0x72, 0x20, 0x61, 0x20, 0x62, 0x61, 
+	0x74, 0x63, 0x68, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x69, 0x6c, 0x65, 
+	0x73, 0x2c, 0x20, 0x69, 0x6e, 0x64, 0x65, 0x78, 0x65, 0x64, 0x20, 
+	0x62, 0x79, 0x20, 0x67, 0x6c, 0x5f, 0x49, 0x6e, 0x73, 0x74, 0x61, 
+	0x6e, 0x63, 0x65, 0x49, 0x44, 0x2e, 0x0d, 0x0a, 0x2f, 0x2f, 0x20, 
+	0x72, 0x65, 0x63, 0x74, 0x20, 0x3d, 0x20, 0x28, 0x78, 0x2c, 0x20, 
+	0x79, 0x2c, 0x20, 0x77, 0x69, 0x64, 0x74, 0x68, 0x2c, 0x20, 0x68, 
+	0x65, 0x69, 0x67, 0x68, 0x74, 0x29, 0x20, 0x69, 0x6e, 0x20, 0x73, 
+	0x63, 0x72, 0x65, 0x65, 0x6e, 0x20, 0x63, 0x6f, 0x6f, 0x72, 0x64, 
+	0x69, 0x6e, 0x61, 0x74, 0x65, 0x73, 0x3b, 0x20, 0x70, 0x61, 0x72, 
+	0x61, 0x6d, 0x73, 0x20, 0x3d, 0x20, 0x28, 0x74, 0x65, 0x78, 0x74, 
+	0x75, 0x72, 0x65, 0x20, 0x6c, 0x61, 0x79, 0x65, 0x72, 0x2c, 0x20, 
+	0x64, 0x65, 0x70, 0x74, 0x68, 0x2c, 0x20, 0x69, 0x73, 0x20, 0x66, 
+	0x6c, 0x61, 0x74, 0x2c, 0x20, 0x61, 0x6c, 0x70, 0x68, 0x61, 0x29, 
+	0x0d, 0x0a, 0x2f, 0x2f, 0x20, 0x74, 0x65, 0x78, 0x5f, 0x72, 0x65, 
+	0x63, 0x74, 0x20, 0x3d, 0x20, 0x74, 0x68, 0x65, 0x20, 0x70, 0x61, 
+	0x72, 0x74, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x74, 
+	0x69, 0x6c, 0x65, 0x20, 0x74, 0x68, 0x61, 0x74, 0x20, 0x69, 0x73, 
+	0x20, 0x64, 0x72, 0x61, 0x77, 0x6e, 0x20, 0x28, 0x78, 0x2c, 0x20, 
+	0x79, 0x2c, 0x20, 0x77, 0x69, 0x64, 0x74, 0x68, 0x2c, 0x20, 0x68, 
+	0x65, 0x69, 0x67, 0x68, 0x74, 0x29, 0x2c, 0x20, 0x6c, 0x65, 0x73, 
+	0x73, 0x20, 0x74, 0x68, 0x61, 0x6e, 0x20, 0x74, 0x68, 0x65, 0x20, 
+	0x77, 0x68, 0x6f, 0x6c, 0x65, 0x20, 0x74, 0x69, 0x6c, 0x65, 0x20, 
+	0x61, 0x74, 0x20, 0x74, 0x68, 0x65, 0x20, 0x76, 0x69, 0x65, 0x77, 
+	0x70, 0x6f, 0x72, 0x74, 0x20, 0x65, 0x64, 0x67, 0x65, 0x73, 0x3b, 
+	0x0d, 0x0a, 0x2f, 0x2f, 0x20, 0x66, 0x6f, 0x72, 0x20, 0x66, 0x6c, 
+	0x61, 0x74, 0x20, 0x74, 0x69, 0x6c, 0x65, 0x73, 0x20, 0x28, 0x77, 
+	0x68, 0x69, 0x63, 0x68, 0x20, 0x61, 0x72, 0x65, 0x20, 0x64, 0x72, 
+	0x61, 0x77, 0x6e, 0x20, 0x69, 0x6e, 0x20, 0x61, 0x20, 0x73, 0x69, 
+	0x6e, 0x67, 0x6c, 0x65, 0x20, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x20, 
+	0x69, 0x6e, 0x73, 0x74, 0x65, 0x61, 0x64, 0x20, 0x6f, 0x66, 0x20, 
+	0x66, 0x72, 0x6f, 0x6d, 0x20, 0x61, 0x20, 0x74, 0x65, 0x78, 0x74, 
+	0x75, 0x72, 0x65, 0x29, 0x20, 0x74, 0x68, 0x65, 0x20, 0x63, 0x6f, 
+	0x6c, 0x6f, 0x72, 0x20, 0x28, 0x72, 0x2c, 0x20, 0x67, 0x2c, 0x20, 
+	0x62, 0x2c, 0x20, 0x61, 0x29, 0x0d, 0x0a, 0x2f, 0x2f, 0x20, 0x76, 
+	0x61, 0x6c, 0x69, 0x64, 0x5f, 0x6d, 0x61, 0x78, 0x20, 0x3d, 0x20, 
+	0x28, 0x78, 0x2c, 0x20, 0x79, 0x29, 0x20, 0x77, 0x68, 0x65, 0x72, 
+	0x65, 0x20, 0x74, 0x68, 0x65, 0x20, 0x70, 0x61, 0x72, 0x74, 0x20, 
+	0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x74, 0x69, 0x6c, 0x65, 
+	0x20, 0x77, 0x69, 0x74, 0x68, 0x69, 0x6e, 0x20, 0x74, 0x68, 0x65, 
+	0x20, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x20, 0x65, 0x6e, 0x64, 0x73, 
+	0x2c, 0x20, 0x69, 0x6e, 0x20, 0x74, 0x68, 0x65, 0x20, 0x74, 0x65, 
+	0x78, 0x74, 0x75, 0x72, 0x65, 0x20, 0x63, 0x6f, 0x6f, 0x72, 0x64, 
+	0x69, 0x6e, 0x61, 0x74, 0x65, 0x73, 0x20, 0x6f, 0x66, 0x20, 0x74, 
+	0x69, 0x6c, 0x65, 0x2e, 0x66, 0x72, 0x61, 0x67, 0x0d, 0x0a, 0x6c, 
+	0x61, 0x79, 0x6f, 0x75, 0x74, 0x28, 0x73, 0x74, 0x64, 0x31, 0x34, 
+	0x30, 0x29, 0x20, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 
+	0x74, 0x69, 0x6c, 0x65, 0x5f, 0x69, 0x6e, 0x73, 0x74, 0x61, 0x6e, 
+	0x63, 0x65, 0x73, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+	0x76, 0x65, 0x63, 0x34, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x61, 0x6e, 
+	0x63, 0x65, 0x5f, 0x72, 0x65, 0x63, 0x74, 0x73, 0x5b, 0x32, 0x35, 
+	0x36, 0x5d, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 
+	0x63, 0x34, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x63, 0x65, 
+	0x5f, 0x70, 0x61, 0x72, 0x61, 0x6d, 0x73, 0x5b, 0x32, 0x35, 0x36, 
+	0x5d, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 
+	0x34, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x63, 0x65, 0x5f, 
+	0x74, 0x65, 0x78, 0x5f, 0x72, 0x65, 0x63, 0x74, 0x73, 0x5b, 0x32, 
+	0x35, 0x36, 0x5d, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x76, 
+	0x65, 0x63, 0x34, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x63, 
+	0x65, 0x5f, 0x76, 0x61, 0x6c, 0x69, 0x64, 0x5f, 0x6d, 0x61, 0x78, 
+	0x65, 0x73, 0x5b, 0x32, 0x35, 0x36, 0x5d, 0x3b, 0x0d, 0x0a, 0x7d, 
+	0x3b, 0x0d, 0x0a, 0x0d, 0x0a, 0x76, 0x6f, 0x69, 0x64, 0x20, 0x6d, 
+	0x61, 0x69, 0x6e, 0x28, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x76, 0x65, 0x63, 0x34, 0x20, 0x72, 0x65, 0x63, 0x74, 
+	0x20, 0x3d, 0x20, 0x69, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x63, 0x65, 
+	0x5f, 0x72, 0x65, 0x63, 0x74, 0x73, 0x5b, 0x67, 0x6c, 0x5f, 0x49, 
+	0x6e, 0x73, 0x74, 0x61, 0x6e, 0x63, 0x65, 0x49, 0x44, 0x5d, 0x3b, 
+	0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x34, 0x20, 
+	0x70, 0x61, 0x72, 0x61, 0x6d, 0x73, 0x20, 0x3d, 0x20, 0x69, 0x6e, 
+	0x73, 0x74, 0x61, 0x6e, 0x63, 0x65, 0x5f, 0x70, 0x61, 0x72, 0x61, 
+	0x6d, 0x73, 0x5b, 0x67, 0x6c, 0x5f, 0x49, 0x6e, 0x73, 0x74, 0x61, 
+	0x6e, 0x63, 0x65, 0x49, 0x44, 0x5d, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x76, 0x65, 0x63, 0x33, 0x20, 0x77, 0x6f, 0x72, 0x6c, 
+	0x64, 0x5f, 0x70, 0x6f, 0x73, 0x20, 0x3d, 0x20, 0x76, 0x65, 0x63, 
+	0x33, 0x28, 0x72, 0x65, 0x63, 0x74, 0x2e, 0x78, 0x79, 0x20, 0x2b, 
+	0x20, 0x70, 0x6f, 0x73, 0x2e, 0x78, 0x79, 0x20, 0x2a, 0x20, 0x72, 
+	0x65, 0x63, 0x74, 0x2e, 0x7a, 0x77, 0x2c, 0x20, 0x70, 0x61, 0x72, 
+	0x61, 0x6d, 0x73, 0x2e, 0x79, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x67, 0x6c, 0x5f, 0x50, 0x6f, 0x73, 0x69, 0x74, 0x69, 
+	0x6f, 0x6e, 0x20, 0x3d, 0x20, 0x70, 0x72, 0x6f, 0x6a, 0x65, 0x63, 
+	0x74, 0x69, 0x6f, 0x6e, 0x5f, 0x76, 0x69, 0x65, 0x77, 0x5f, 0x6d, 
+	0x61, 0x74, 0x72, 0x69, 0x78, 0x20, 0x2a, 0x20, 0x76, 0x65, 0x63, 
+	0x34, 0x28, 0x77, 0x6f, 0x72, 0x6c, 0x64, 0x5f, 0x70, 0x6f, 0x73, 
+	0x2c, 0x20, 0x31, 0x2e, 0x30, 0x66, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x34, 0x20, 0x74, 0x65, 0x78, 
+	0x5f, 0x72, 0x65, 0x63, 0x74, 0x20, 0x3d, 0x20, 0x69, 0x6e, 0x73, 
+	0x74, 0x61, 0x6e, 0x63, 0x65, 0x5f, 0x74, 0x65, 0x78, 0x5f, 0x72, 
+	0x65, 0x63, 0x74, 0x73, 0x5b, 0x67, 0x6c, 0x5f, 0x49, 0x6e, 0x73, 
+	0x74, 0x61, 0x6e, 0x63, 0x65, 0x49, 0x44, 0x5d, 0x3b, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x76, 0x73, 0x5f, 0x69, 0x73, 0x5f, 0x66, 
+	0x6c, 0x61, 0x74, 0x20, 0x3d, 0x20, 0x70, 0x61, 0x72, 0x61, 0x6d, 
+	0x73, 0x2e, 0x7a, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 
+	0x66, 0x20, 0x28, 0x70, 0x61, 0x72, 0x61, 0x6d, 0x73, 0x2e, 0x7a, 
+	0x20, 0x3e, 0x20, 0x30, 0x2e, 0x35, 0x66, 0x29, 0x20, 0x7b, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x76, 0x73, 
+	0x5f, 0x74, 0x65, 0x78, 0x5f, 0x63, 0x6f, 0x6f, 0x72, 0x64, 0x20, 
+	0x3d, 0x20, 0x74, 0x65, 0x78, 0x5f, 0x63, 0x6f, 0x6f, 0x72, 0x64, 
+	0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x76, 0x73, 0x5f, 0x66, 0x6c, 0x61, 0x74, 0x5f, 0x63, 0x6f, 0x6c, 
+	0x6f, 0x72, 0x20, 0x3d, 0x20, 0x74, 0x65, 0x78, 0x5f, 0x72, 0x65, 
+	0x63, 0x74, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x7d, 0x20, 
+	0x65, 0x6c, 0x73, 0x65, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x76, 0x73, 0x5f, 0x74, 0x65, 0x78, 
+	0x5f, 0x63, 0x6f, 0x6f, 0x72, 0x64, 0x20, 0x3d, 0x20, 0x74, 0x65, 
+	0x78, 0x5f, 0x72, 0x65, 0x63, 0x74, 0x2e, 0x78, 0x79, 0x20, 0x2b, 
+	0x20, 0x74, 0x65, 0x78, 0x5f, 0x63, 0x6f, 0x6f, 0x72, 0x64, 0x20, 
+	0x2a, 0x20, 0x74, 0x65, 0x78, 0x5f, 0x72, 0x65, 0x63, 0x74, 0x2e, 
+	0x7a, 0x77, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x76, 0x73, 0x5f, 0x66, 0x6c, 0x61, 0x74, 0x5f, 0x63, 
+	0x6f, 0x6c, 0x6f, 0x72, 0x20, 0x3d, 0x20, 0x76, 0x65, 0x63, 0x34, 
+	0x28, 0x30, 0x2e, 0x30, 0x66, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x7d, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x76, 0x73, 
+	0x5f, 0x6c, 0x61, 0x79, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x70, 0x61, 
+	0x72, 0x61, 0x6d, 0x73, 0x2e, 0x78, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x76, 0x73, 0x5f, 0x61, 0x6c, 0x70, 0x68, 0x61, 0x20, 
+	0x3d, 0x20, 0x70, 0x61, 0x72, 0x61, 0x6d, 0x73, 0x2e, 0x77, 0x3b, 
+	0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x76, 0x73, 0x5f, 0x76, 0x61, 
+	0x6c, 0x69, 0x64, 0x5f, 0x6d, 0x61, 0x78, 0x20, 0x3d, 0x20, 0x69, 
+	0x6e, 0x73, 0x74, 0x61, 0x6e, 0x63, 0x65, 0x5f, 0x76, 0x61, 0x6c, 
+	0x69, 0x64, 0x5f, 0x6d, 0x61, 0x78, 0x65, 0x73, 0x5b, 0x67, 0x6c, 
+	0x5f, 0x49, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x63, 0x65, 0x49, 0x44, 
+	0x5d, 0x2e, 0x78, 0x79, 0x3b, 0x0d, 0x0a, 0x7d, 0x0d, 0x0a, 0
+};
+
+const char stringified_shader_source__tile_frag[5709] = {
+	0x23, 0x76, 0x65, 0x72, 0x73, 0x69, 0x6f, 0x6e, 0x20, 0x31, 0x34, 
+	0x30, 0x0d, 0x0a, 0x0d, 0x0a, 0x0d, 0x0a, 0x69, 0x6e, 0x20, 0x76, 
+	0x65, 0x63, 0x32, 0x20, 0x76, 0x73, 0x5f, 0x74, 0x65, 0x78, 0x5f, 
+	0x63, 0x6f, 0x6f, 0x72, 0x64, 0x3b, 0x0d, 0x0a, 0x66, 0x6c, 0x61, 
+	0x74, 0x20, 0x69, 0x6e, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 
+	0x76, 0x73, 0x5f, 0x6c, 0x61, 0x79, 0x65, 0x72, 0x3b, 0x0d, 0x0a, 
+	0x66, 0x6c, 0x61, 0x74, 0x20, 0x69, 0x6e, 0x20, 0x66, 0x6c, 0x6f, 
+	0x61, 0x74, 0x20, 0x76, 0x73, 0x5f, 0x69, 0x73, 0x5f, 0x66, 0x6c, 
+	0x61, 0x74, 0x3b, 0x0d, 0x0a, 0x66, 0x6c, 0x61, 0x74, 0x20, 0x69, 
+	0x6e, 0x20, 0x76, 0x65, 0x63, 0x34, 0x20, 0x76, 0x73, 0x5f, 0x66, 
+	0x6c, 0x61, 0x74, 0x5f, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x3b, 0x0d, 
+	0x0a, 0x66, 0x6c, 0x61, 0x74, 0x20, 0x69, 0x6e, 0x20, 0x66, 0x6c, 
+	0x6f, 0x61, 0x74, 0x20, 0x76, 0x73, 0x5f, 0x61, 0x6c, 0x70, 0x68, 
+	0x61, 0x3b, 0x20, 0x2f, 0x2f, 0x20, 0x6c, 0x65, 0x73, 0x73, 0x20, 
+	0x74, 0x68, 0x61, 0x6e, 0x20, 0x31, 0x20, 0x77, 0x68, 0x69, 0x6c, 
+	0x65, 0x20, 0x61, 0x20, 0x6c, 0x65, 0x76, 0x65, 0x6c, 0x20, 0x69, 
+	0x73, 0x20, 0x62, 0x6c, 0x65, 0x6e, 0x64, 0x65, 0x64, 0x20, 0x69, 
+	0x6e, 0x20, 0x6f, 0x72, 0x20, 0x6f, 0x75, 0x74, 0x20, 0x28, 0x62, 
+	0x6c, 0x65, 0x6e, 0x64, 0x69, 0x6e, 0x67, 0x20, 0x69, 0x73, 0x20, 
+	0x65, 0x6e, 0x61, 0x62, 0x6c, 0x65, 0x64, 0x20, 0x66, 0x6f, 0x72, 
+	0x20, 0x74, 0x68, 0x6f, 0x73, 0x65, 0x20, 0x74, 0x69, 0x6c, 0x65, 
+	0x73, 0x20, 0x6f, 0x6e, 0x6c, 0x79, 0x29, 0x0d, 0x0a, 0x66, 0x6c, 
+	0x61, 0x74, 0x20, 0x69, 0x6e, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 
+	0x76, 0x73, 0x5f, 0x76, 0x61, 0x6c, 0x69, 0x64, 0x5f, 0x6d, 0x61, 
+	0x78, 0x3b, 0x20, 0x2f, 0x2f, 0x20, 0x62, 0x65, 0x79, 0x6f, 0x6e, 
+	0x64, 0x20, 0x74, 0x68, 0x69, 0x73, 0x2c, 0x20, 0x74, 0x68, 0x65, 
+	0x20, 0x74, 0x69, 0x6c, 0x65, 0x20, 0x69, 0x73, 0x20, 0x6f, 0x75, 
+	0x74, 0x73, 0x69, 0x64, 0x65, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 
+	0x65, 0x20, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x20, 0x28, 0x73, 0x65, 
+	0x65, 0x20, 0x70, 0x75, 0x73, 0x68, 0x5f, 0x74, 0x69, 0x6c, 0x65, 
+	0x5f, 0x69, 0x6e, 0x73, 0x74, 0x61, 0x6e, 0x63, 0x65, 0x28, 0x29, 
+	0x29, 0x0d, 0x0a, 0x0d, 0x0a, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 
+	0x6f, 0x72, 0x6d, 0x20, 0x76, 0x65, 0x63, 0x33, 0x20, 0x62, 0x67, 
+	0x5f, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x3b, 0x0d, 0x0a, 0x75, 0x6e, 
+	0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x73, 0x61, 0x6d, 0x70, 0x6c, 
+	0x65, 0x72, 0x32, 0x44, 0x41, 0x72, 0x72, 0x61, 0x79, 0x20, 0x74, 
+	0x68, 0x65, 0x5f, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 0x3b, 
+	0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x73, 
+	0x61, 0x6d, 0x70, 0x6c, 0x65, 0x72, 0x33, 0x44, 0x20, 0x63, 0x6f, 
+	0x6c, 0x6f, 0x72, 0x5f, 0x6c, 0x75, 0x74, 0x3b, 0x20, 0x2f, 0x2f, 
+	0x20, 0x74, 0x68, 0x65, 0x20, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x20, 
+	0x61, 0x64, 0x6a, 0x75, 0x73, 0x74, 0x6d, 0x65, 0x6e, 0x74, 0x73, 
+	0x20, 0x61, 0x6e, 0x64, 0x20, 0x64, 0x69, 0x73, 0x70, 0x6c, 0x61, 
+	0x79, 0x20, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x20, 0x63, 0x6f, 0x72, 
+	0x72, 0x65, 0x63, 0x74, 0x69, 0x6f, 0x6e, 0x2c, 0x20, 0x73, 0x65, 
+	0x65, 0x20, 0x75, 0x70, 0x64, 0x61, 0x74, 0x65, 0x5f, 0x63, 0x6f, 
+	0x6c, 0x6f, 0x72, 0x5f, 0x6c, 0x75, 0x74, 0x28, 0x29, 0x0d, 0x0a, 
+	0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x62, 0x6f, 0x6f, 
+	0x6c, 0x20, 0x73, 0x68, 0x6f, 0x77, 0x5f, 0x73, 0x69, 0x6e, 0x67, 
+	0x6c, 0x65, 0x5f, 0x73, 0x74, 0x61, 0x69, 0x6e, 0x3b, 0x20, 0x2f, 
+	0x2f, 0x20, 0x73, 0x65, 0x65, 0x20, 0x67, 0x65, 0x74, 0x5f, 0x73, 
+	0x74, 0x61, 0x69, 0x6e, 0x5f, 0x75, 0x6e, 0x6d, 0x69, 0x78, 0x69, 
+	0x6e, 0x67, 0x28, 0x29, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 
+	0x72, 0x6d, 0x20, 0x76, 0x65, 0x63, 0x33, 0x20, 0x73, 0x74, 0x61, 
+	0x69, 0x6e, 0x5f, 0x75, 0x6e, 0x6d, 0x69, 0x78, 0x69, 0x6e, 0x67, 
+	0x3b, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 
+	0x76, 0x65, 0x63, 0x33, 0x20, 0x73, 0x74, 0x61, 0x69, 0x6e, 0x5f, 
+	0x76, 0x65, 0x63, 0x74, 0x6f, 0x72, 0x3b, 0x0d, 0x0a, 0x75, 0x6e, 
+	0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x62, 0x6f, 0x6f, 0x6c, 0x20, 
+	0x69, 0x73, 0x5f, 0x70, 0x6c, 0x61, 0x6e, 0x61, 0x72, 0x3b, 0x20, 
+	0x2f, 0x2f, 0x20, 0x74, 0x68, 0x65, 0x20, 0x74, 0x65, 0x78, 0x74, 
+	0x75, 0x72, 0x65, 0x20, 0x68, 0x6f, 0x6c, 0x64, 0x73, 0x20, 0x59, 
+	0x43, 0x62, 0x43, 0x72, 0x20, 0x34, 0x3a, 0x32, 0x3a, 0x30, 0x20, 
+	0x70, 0x6c, 0x61, 0x6e, 0x65, 0x73, 0x20, 0x28, 0x73, 0x65, 0x65, 
+	0x20, 0x54, 0x49, 0x4c, 0x45, 0x5f, 0x54, 0x45, 0x58, 0x54, 0x55, 
+	0x52, 0x45, 0x5f, 0x46, 0x4f, 0x52, 0x4d, 0x41, 0x54, 0x5f, 0x59, 
+	0x43, 0x42, 0x43, 0x52, 0x34, 0x32, 0x30, 0x29, 0x0d, 0x0a, 0x75, 
+	0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x62, 0x6f, 0x6f, 0x6c, 
+	0x20, 0x69, 0x73, 0x5f, 0x63, 0x68, 0x61, 0x6e, 0x6e, 0x65, 0x6c, 
+	0x3b, 0x20, 0x2f, 0x2f, 0x20, 0x61, 0x20, 0x63, 0x68, 0x61, 0x6e, 
+	0x6e, 0x65, 0x6c, 0x20, 0x6f, 0x66, 0x20, 0x61, 0x20, 0x66, 0x6c, 
+	0x75, 0x6f, 0x72, 0x65, 0x73, 0x63, 0x65, 0x6e, 0x63, 0x65, 0x20, 
+	0x69, 0x6d, 0x61, 0x67, 0x65, 0x2c, 0x20, 0x61, 0x64, 0x64, 0x65, 
+	0x64, 0x20, 0x74, 0x6f, 0x20, 0x74, 0x68, 0x65, 0x20, 0x6f, 0x74, 
+	0x68, 0x65, 0x72, 0x20, 0x63, 0x68, 0x61, 0x6e, 0x6e, 0x65, 0x6c, 
+	0x73, 0x20, 0x28, 0x73, 0x65, 0x65, 0x20, 0x63, 0x68, 0x61, 0x6e, 
+	0x6e, 0x65, 0x6c, 0x5f, 0x76, 0x69, 0x65, 0x77, 0x5f, 0x74, 0x29, 
+	0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x76, 
+	0x65, 0x63, 0x33, 0x20, 0x63, 0x68, 0x61, 0x6e, 0x6e, 0x65, 0x6c, 
+	0x5f, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x3b, 0x0d, 0x0a, 0x75, 0x6e, 
+	0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 
+	0x20, 0x63, 0x68, 0x61, 0x6e, 0x6e, 0x65, 0x6c, 0x5f, 0x67, 0x61, 
+	0x69, 0x6e, 0x3b, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 
+	0x6d, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x63, 0x68, 0x61, 
+	0x6e, 0x6e, 0x65, 0x6c, 0x5f, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 
+	0x3b, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 
+	0x62, 0x6f, 0x6f, 0x6c, 0x20, 0x69, 0x73, 0x5f, 0x6f, 0x76, 0x65, 
+	0x72, 0x6c, 0x61, 0x79, 0x3b, 0x20, 0x2f, 0x2f, 0x20, 0x61, 0x6e, 
+	0x20, 0x6f, 0x76, 0x65, 0x72, 0x6c, 0x61, 0x79, 0x2c, 0x20, 0x65, 
+	0x2e, 0x67, 0x2e, 0x20, 0x61, 0x20, 0x68, 0x65, 0x61, 0x74, 0x6d, 
+	0x61, 0x70, 0x3a, 0x20, 0x74, 0x68, 0x65, 0x20, 0x76, 0x61, 0x6c, 
+	0x75, 0x65, 0x73, 0x20, 0x61, 0x72, 0x65, 0x20, 0x63, 0x6f, 0x6c, 
+	0x6f, 0x72, 0x65, 0x64, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x62, 0x6c, 
+	0x65, 0x6e, 0x64, 0x65, 0x64, 0x20, 0x6f, 0x76, 0x65, 0x72, 0x20, 
+	0x74, 0x68, 0x65, 0x20, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x0d, 0x0a, 
+	0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x69, 0x6e, 0x74, 
+	0x20, 0x6f, 0x76, 0x65, 0x72, 0x6c, 0x61, 0x79, 0x5f, 0x63, 0x6f, 
+	0x6c, 0x6f, 0x72, 0x6d, 0x61, 0x70, 0x3b, 0x20, 0x2f, 0x2f, 0x20, 
+	0x73, 0x65, 0x65, 0x20, 0x6f, 0x76, 0x65, 0x72, 0x6c, 0x61, 0x79, 
+	0x5f, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x6d, 0x61, 0x70, 0x5f, 0x65, 
+	0x6e, 0x75, 0x6d, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 
+	0x6d, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x6f, 0x76, 0x65, 
+	0x72, 0x6c, 0x61, 0x79, 0x5f, 0x6f, 0x70, 0x61, 0x63, 0x69, 0x74, 
+	0x79, 0x3b, 0x0d, 0x0a, 0x0d, 0x0a, 0x2f, 0x2f, 0x20, 0x54, 0x68, 
+	0x65, 0x20, 0x6c, 0x61, 0x79, 0x6f, 0x75, 0x74, 0x20, 0x6f, 0x66, 
+	0x20, 0x61, 0x20, 0x70, 0x6c, 0x61, 0x6e, 0x61, 0x72, 0x20, 0x74, 
+	0x69, 0x6c, 0x65, 0x20, 0x69, 0x73, 0x20, 0x61, 0x20, 0x73, 0x69, 
+	0x6e, 0x67, 0x6c, 0x65, 0x20, 0x63, 0x68, 0x61, 0x6e, 0x6e, 0x65, 
+	0x6c, 0x20, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x20, 0x6f, 0x66, 0x20, 
+	0x64, 0x69, 0x6d, 0x20, 0x78, 0x20, 0x28, 0x31, 0x2e, 0x35, 0x20, 
+	0x2a, 0x20, 0x64, 0x69, 0x6d, 0x29, 0x3a, 0x20, 0x74, 0x68, 0x65, 
+	0x20, 0x59, 0x20, 0x70, 0x6c, 0x61, 0x6e, 0x65, 0x20, 0x6f, 0x6e, 
+	0x20, 0x74, 0x6f, 0x70, 0x2c, 0x20, 0x77, 0x69, 0x74, 0x68, 0x20, 
+	0x74, 0x68, 0x65, 0x20, 0x43, 0x62, 0x20, 0x61, 0x6e, 0x64, 0x0d, 
+	0x0a, 0x2f, 0x2f, 0x20, 0x43, 0x72, 0x20, 0x70, 0x6c, 0x61, 0x6e, 
+	0x65, 0x73, 0x20, 0x73, 0x69, 0x64, 0x65, 0x20, 0x62, 0x79, 0x20, 
+	0x73, 0x69, 0x64, 0x65, 0x20, 0x62, 0x65, 0x6c, 0x6f, 0x77, 0x20, 
+	0x69, 0x74, 0x2e, 0x20, 0x54, 0x68, 0x65, 0x20, 0x63, 0x68, 0x72, 
+	0x6f, 0x6d, 0x61, 0x20, 0x69, 0x73, 0x20, 0x75, 0x70, 0x73, 0x61, 
+	0x6d, 0x70, 0x6c, 0x65, 0x64, 0x20, 0x62, 0x79, 0x20, 0x72, 0x65, 
+	0x70, 0x65, 0x61, 0x74, 0x69, 0x6e, 0x67, 0x20, 0x65, 0x61, 0x63, 
+	0x68, 0x20, 0x73, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x20, 0x28, 0x74, 
+	0x68, 0x65, 0x20, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 0x20, 
+	0x69, 0x73, 0x20, 0x73, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x64, 0x20, 
+	0x4e, 0x45, 0x41, 0x52, 0x45, 0x53, 0x54, 0x29, 0x2e, 0x0d, 0x0a, 
+	0x76, 0x65, 0x63, 0x34, 0x20, 0x73, 0x61, 0x6d, 0x70, 0x6c, 0x65, 
+	0x5f, 0x70, 0x6c, 0x61, 0x6e, 0x61, 0x72, 0x5f, 0x74, 0x69, 0x6c, 
+	0x65, 0x28, 0x76, 0x65, 0x63, 0x32, 0x20, 0x75, 0x76, 0x2c, 0x20, 
+	0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x6c, 0x61, 0x79, 0x65, 0x72, 
+	0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 
+	0x6f, 0x61, 0x74, 0x20, 0x64, 0x69, 0x6d, 0x20, 0x3d, 0x20, 0x66, 
+	0x6c, 0x6f, 0x61, 0x74, 0x28, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 
+	0x65, 0x53, 0x69, 0x7a, 0x65, 0x28, 0x74, 0x68, 0x65, 0x5f, 0x74, 
+	0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 0x2c, 0x20, 0x30, 0x29, 0x2e, 
+	0x78, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x75, 0x76, 
+	0x20, 0x3d, 0x20, 0x63, 0x6c, 0x61, 0x6d, 0x70, 0x28, 0x75, 0x76, 
+	0x2c, 0x20, 0x76, 0x65, 0x63, 0x32, 0x28, 0x30, 0x2e, 0x35, 0x66, 
+	0x20, 0x2f, 0x20, 0x64, 0x69, 0x6d, 0x29, 0x2c, 0x20, 0x76, 0x65, 
+	0x63, 0x32, 0x28, 0x31, 0x2e, 0x30, 0x66, 0x20, 0x2d, 0x20, 0x30, 
+	0x2e, 0x35, 0x66, 0x20, 0x2f, 0x20, 0x64, 0x69, 0x6d, 0x29, 0x29, 
+	0x3b, 0x20, 0x2f, 0x2f, 0x20, 0x64, 0x6f, 0x6e, 0x27, 0x74, 0x20, 
+	0x6c, 0x65, 0x74, 0x20, 0x59, 0x20, 0x72, 0x75, 0x6e, 0x20, 0x69, 
+	0x6e, 0x74, 0x6f, 0x20, 0x74, 0x68, 0x65, 0x20, 0x63, 0x68, 0x72, 
+	0x6f, 0x6d, 0x61, 0x20, 0x70, 0x6c, 0x61, 0x6e, 0x65, 0x73, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 
+	0x79, 0x20, 0x3d, 0x20, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 
+	0x28, 0x74, 0x68, 0x65, 0x5f, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 
+	0x65, 0x2c, 0x20, 0x76, 0x65, 0x63, 0x33, 0x28, 0x75, 0x76, 0x2e, 
+	0x78, 0x2c, 0x20, 0x75, 0x76, 0x2e, 0x79, 0x20, 0x2a, 0x20, 0x28, 
+	0x32, 0x2e, 0x30, 0x66, 0x20, 0x2f, 0x20, 0x33, 0x2e, 0x30, 0x66, 
+	0x29, 0x2c, 0x20, 0x6c, 0x61, 0x79, 0x65, 0x72, 0x29, 0x29, 0x2e, 
+	0x72, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 
+	0x61, 0x74, 0x20, 0x63, 0x68, 0x72, 0x6f, 0x6d, 0x61, 0x5f, 0x76, 
+	0x20, 0x3d, 0x20, 0x28, 0x32, 0x2e, 0x30, 0x66, 0x20, 0x2b, 0x20, 
+	0x75, 0x76, 0x2e, 0x79, 0x29, 0x20, 0x2f, 0x20, 0x33, 0x2e, 0x30, 
+	0x66, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 
+	0x61, 0x74, 0x20, 0x63, 0x62, 0x20, 0x3d, 0x20, 0x74, 0x65, 0x78, 
+	0x74, 0x75, 0x72, 0x65, 0x28, 0x74, 0x68, 0x65, 0x5f, 0x74, 0x65, 
+	0x78, 0x74, 0x75, 0x72, 0x65, 0x2c, 0x20, 0x76, 0x65, 0x63, 0x33, 
+	0x28, 0x75, 0x76, 0x2e, 0x78, 0x20, 0x2a, 0x20, 0x30, 0x2e, 0x35, 
+	0x66, 0x2c, 0x20, 0x63, 0x68, 0x72, 0x6f, 0x6d, 0x61, 0x5f, 0x76, 
+	0x2c, 0x20, 0x6c, 0x61, 0x79, 0x65, 0x72, 0x29, 0x29, 0x2e, 0x72, 
+	0x20, 0x2d, 0x20, 0x31, 0x32, 0x38, 0x2e, 0x30, 0x66, 0x20, 0x2f, 
+	0x20, 0x32, 0x35, 0x35, 0x2e, 0x30, 0x66, 0x3b, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x63, 0x72, 
+	0x20, 0x3d, 0x20, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 0x28, 
+	0x74, 0x68, 0x65, 0x5f, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 
+	0x2c, 0x20, 0x76, 0x65, 0x63, 0x33, 0x28, 0x30, 0x2e, 0x35, 0x66, 
+	0x20, 0x2b, 0x20, 0x75, 0x76, 0x2e, 0x78, 0x20, 0x2a, 0x20, 0x30, 
+	0x2e, 0x35, 0x66, 0x2c, 0x20, 0x63, 0x68, 0x72, 0x6f, 0x6d, 0x61, 
+	0x5f, 0x76, 0x2c, 0x20, 0x6c, 0x61, 0x79, 0x65, 0x72, 0x29, 0x29, 
+	0x2e, 0x72, 0x20, 0x2d, 0x20, 0x31, 0x32, 0x38, 0x2e, 0x30, 0x66, 
+	0x20, 0x2f, 0x20, 0x32, 0x35, 0x35, 0x2e, 0x30, 0x66, 0x3b, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x2f, 0x2f, 0x20, 0x46, 0x75, 0x6c, 
+	0x6c, 0x20, 0x72, 0x61, 0x6e, 0x67, 0x65, 0x20, 0x59, 0x43, 0x62, 
+	0x43, 0x72, 0x20, 0x28, 0x4a, 0x46, 0x49, 0x46, 0x29, 0x2c, 0x20, 
+	0x6c, 0x69, 0x6b, 0x65, 0x20, 0x6c, 0x69, 0x62, 0x6a, 0x70, 0x65, 
+	0x67, 0x20, 0x63, 0x6f, 0x6e, 0x76, 0x65, 0x72, 0x74, 0x73, 0x20, 
+	0x69, 0x74, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 
+	0x33, 0x20, 0x72, 0x67, 0x62, 0x20, 0x3d, 0x20, 0x76, 0x65, 0x63, 
+	0x33, 0x28, 0x79, 0x20, 0x2b, 0x20, 0x31, 0x2e, 0x34, 0x30, 0x32, 
+	0x66, 0x20, 0x2a, 0x20, 0x63, 0x72, 0x2c, 0x20, 0x79, 0x20, 0x2d, 
+	0x20, 0x30, 0x2e, 0x33, 0x34, 0x34, 0x31, 0x33, 0x36, 0x66, 0x20, 
+	0x2a, 0x20, 0x63, 0x62, 0x20, 0x2d, 0x20, 0x30, 0x2e, 0x37, 0x31, 
+	0x34, 0x31, 0x33, 0x36, 0x66, 0x20, 0x2a, 0x20, 0x63, 0x72, 0x2c, 
+	0x20, 0x79, 0x20, 0x2b, 0x20, 0x31, 0x2e, 0x37, 0x37, 0x32, 0x66, 
+	0x20, 0x2a, 0x20, 0x63, 0x62, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x76, 0x65, 
+	0x63, 0x34, 0x28, 0x63, 0x6c, 0x61, 0x6d, 0x70, 0x28, 0x72, 0x67, 
+	0x62, 0x2c, 0x20, 0x30, 0x2e, 0x30, 0x66, 0x2c, 0x20, 0x31, 0x2e, 
+	0x30, 0x66, 0x29, 0x2c, 0x20, 0x31, 0x2e, 0x30, 0x66, 0x29, 0x3b, 
+	0x0d, 0x0a, 0x7d, 0x0d, 0x0a, 0x0d, 0x0a, 0x2f, 0x2f, 0x20, 0x52, 
+	0x65, 0x74, 0x75, 0x72, 0x6e, 0x73, 0x20, 0x74, 0x68, 0x65, 0x20, 
+	0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 
+	0x65, 0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x2c, 0x20, 0x77, 0x69, 
+	0x74, 0x68, 0x20, 0x74, 0x68, 0x65, 0x20, 0x6f, 0x70, 0x61, 0x63, 
+	0x69, 0x74, 0x79, 0x3a, 0x20, 0x7a, 0x65, 0x72, 0x6f, 0x20, 0x28, 
+	0x6e, 0x6f, 0x20, 0x64, 0x61, 0x74, 0x61, 0x29, 0x20, 0x69, 0x73, 
+	0x20, 0x74, 0x72, 0x61, 0x6e, 0x73, 0x70, 0x61, 0x72, 0x65, 0x6e, 
+	0x74, 0x2e, 0x0d, 0x0a, 0x76, 0x65, 0x63, 0x34, 0x20, 0x61, 0x70, 
+	0x70, 0x6c, 0x79, 0x5f, 0x6f, 0x76, 0x65, 0x72, 0x6c, 0x61, 0x79, 
+	0x5f, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x6d, 0x61, 0x70, 0x28, 0x66, 
+	0x6c, 0x6f, 0x61, 0x74, 0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x29, 
+	0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 
+	0x33, 0x20, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x3b, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x6f, 0x70, 
+	0x61, 0x63, 0x69, 0x74, 0x79, 0x20, 0x3d, 0x20, 0x28, 0x76, 0x61, 
+	0x6c, 0x75, 0x65, 0x20, 0x3e, 0x20, 0x30, 0x2e, 0x35, 0x66, 0x20, 
+	0x2f, 0x20, 0x32, 0x35, 0x35, 0x2e, 0x30, 0x66, 0x29, 0x20, 0x3f, 
+	0x20, 0x6f, 0x76, 0x65, 0x72, 0x6c, 0x61, 0x79, 0x5f, 0x6f, 0x70, 
+	0x61, 0x63, 0x69, 0x74, 0x79, 0x20, 0x3a, 0x20, 0x30, 0x2e, 0x30, 
+	0x66, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 
+	0x28, 0x6f, 0x76, 0x65, 0x72, 0x6c, 0x61, 0x79, 0x5f, 0x63, 0x6f, 
+	0x6c, 0x6f, 0x72, 0x6d, 0x61, 0x70, 0x20, 0x3d, 0x3d, 0x20, 0x30, 
+	0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x2f, 0x2f, 0x20, 0x4a, 0x65, 0x74, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x63, 0x6f, 0x6c, 0x6f, 
+	0x72, 0x20, 0x3d, 0x20, 0x63, 0x6c, 0x61, 0x6d, 0x70, 0x28, 0x76, 
+	0x65, 0x63, 0x33, 0x28, 0x31, 0x2e, 0x35, 0x66, 0x29, 0x20, 0x2d, 
+	0x20, 0x61, 0x62, 0x73, 0x28, 0x76, 0x65, 0x63, 0x33, 0x28, 0x34, 
+	0x2e, 0x30, 0x66, 0x20, 0x2a, 0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 
+	0x29, 0x20, 0x2d, 0x20, 0x76, 0x65, 0x63, 0x33, 0x28, 0x33, 0x2e, 
+	0x30, 0x66, 0x2c, 0x20, 0x32, 0x2e, 0x30, 0x66, 0x2c, 0x20, 0x31, 
+	0x2e, 0x30, 0x66, 0x29, 0x29, 0x2c, 0x20, 0x30, 0x2e, 0x30, 0x66, 
+	0x2c, 0x20, 0x31, 0x2e, 0x30, 0x66, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x7d, 0x20, 0x65, 0x6c, 0x73, 0x65, 0x20, 0x69, 
+	0x66, 0x20, 0x28, 0x6f, 0x76, 0x65, 0x72, 0x6c, 0x61, 0x79, 0x5f, 
+	0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x6d, 0x61, 0x70, 0x20, 0x3d, 0x3d, 
+	0x20, 0x31, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x2f, 0x2f, 0x20, 0x56, 0x69, 0x72, 0x69, 
+	0x64, 0x69, 0x73, 0x2c, 0x20, 0x61, 0x73, 0x20, 0x61, 0x20, 0x70, 
+	0x6f, 0x6c, 0x79, 0x6e, 0x6f, 0x6d, 0x69, 0x61, 0x6c, 0x20, 0x66, 
+	0x69, 0x74, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x20, 0x76, 0x65, 0x63, 0x33, 
+	0x20, 0x63, 0x30, 0x20, 0x3d, 0x20, 0x76, 0x65, 0x63, 0x33, 0x28, 
+	0x30, 0x2e, 0x32, 0x37, 0x37, 0x37, 0x32, 0x37, 0x33, 0x32, 0x37, 
+	0x32, 0x32, 0x33, 0x34, 0x31, 0x37, 0x37, 0x66, 0x2c, 0x20, 0x30, 
+	0x2e, 0x30, 0x30, 0x35, 0x34, 0x30, 0x37, 0x33, 0x34, 0x34, 0x35, 
+	0x34, 0x34, 0x39, 0x36, 0x36, 0x35, 0x37, 0x38, 0x66, 0x2c, 0x20, 
+	0x30, 0x2e, 0x33, 0x33, 0x34, 0x30, 0x39, 0x39, 0x38, 0x30, 0x35, 
+	0x33, 0x33, 0x35, 0x33, 0x30, 0x36, 0x31, 0x66, 0x29, 0x3b, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x63, 0x6f, 
+	0x6e, 0x73, 0x74, 0x20, 0x76, 0x65, 0x63, 0x33, 0x20, 0x63, 0x31, 
+	0x20, 0x3d, 0x20, 0x76, 0x65, 0x63, 0x33, 0x28, 0x30, 0x2e, 0x31, 
+	0x30, 0x35, 0x30, 0x39, 0x33, 0x30, 0x34, 0x33, 0x31, 0x30, 0x38, 
+	0x35, 0x37, 0x37, 0x34, 0x66, 0x2c, 0x20, 0x31, 0x2e, 0x34, 0x30, 
+	0x34, 0x36, 0x31, 0x33, 0x35, 0x32, 0x39, 0x38, 0x39, 0x38, 0x35, 
+	0x37, 0x35, 0x66, 0x2c, 0x20, 0x31, 0x2e, 0x33, 0x38, 0x34, 0x35, 
+	0x39, 0x30, 0x31, 0x36, 0x32, 0x35, 0x39, 0x34, 0x36, 0x38, 0x35, 
+	0x66, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x20, 0x76, 0x65, 0x63, 
+	0x33, 0x20, 0x63, 0x32, 0x20, 0x3d, 0x20, 0x76, 0x65, 0x63, 0x33, 
+	0x28, 0x2d, 0x30, 0x2e, 0x33, 0x33, 0x30, 0x38, 0x36, 0x31, 0x38, 
+	0x32, 0x38, 0x37, 0x32, 0x35, 0x35, 0x35, 0x36, 0x33, 0x66, 0x2c, 
+	0x20, 0x30, 0x2e, 0x32, 0x31, 0x34, 0x38, 0x34, 0x37, 0x35, 0x35, 
+	0x39, 0x34, 0x36, 0x38, 0x32, 0x31, 0x33, 0x66, 0x2c, 0x20, 0x30, 
+	0x2e, 0x30, 0x39, 0x35, 0x30, 0x39, 0x35, 0x31, 0x36, 0x33, 0x30, 
+	0x32, 0x38, 0x32, 0x33, 0x36, 0x35, 0x39, 0x66, 0x29, 0x3b, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x63, 0x6f, 
+	0x6e, 0x73, 0x74, 0x20, 0x76, 0x65, 0x63, 0x33, 0x20, 0x63, 0x33, 
+	0x20, 0x3d, 0x20, 0x76, 0x65, 0x63, 0x33, 0x28, 0x2d, 0x34, 0x2e, 
+	0x36, 0x33, 0x34, 0x32, 0x33, 0x30, 0x34, 0x39, 0x38, 0x39, 0x38, 
+	0x33, 0x34, 0x38, 0x36, 0x66, 0x2c, 0x20, 0x2d, 0x35, 0x2e, 0x37, 
+	0x39, 0x39, 0x31, 0x30, 0x30, 0x39, 0x37, 0x33, 0x33, 0x35, 0x31, 
+	0x35, 0x38, 0x35, 0x66, 0x2c, 0x20, 0x2d, 0x31, 0x39, 0x2e, 0x33, 
+	0x33, 0x32, 0x34, 0x34, 0x30, 0x39, 0x35, 0x36, 0x32, 0x37, 0x39, 
+	0x38, 0x37, 0x66, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x20, 0x76, 
+	0x65, 0x63, 0x33, 0x20, 0x63, 0x34, 0x20, 0x3d, 0x20, 0x76, 0x65, 
+	0x63, 0x33, 0x28, 0x36, 0x2e, 0x32, 0x32, 0x38, 0x32, 0x36, 0x39, 
+	0x39, 0x33, 0x36, 0x33, 0x34, 0x37, 0x30, 0x38, 0x31, 0x66, 0x2c, 
+	0x20, 0x31, 0x34, 0x2e, 0x31, 0x37, 0x39, 0x39, 0x33, 0x33, 0x33, 
+	0x36, 0x36, 0x38, 0x30, 0x35, 0x30, 0x39, 0x66, 0x2c, 0x20, 0x35, 
+	0x36, 0x2e, 0x36, 0x39, 0x30, 0x35, 0x35, 0x32, 0x36, 0x30, 0x30, 
+	0x36, 0x38, 0x31, 0x30, 0x35, 0x66, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x63, 0x6f, 0x6e, 0x73, 
+	0x74, 0x20, 0x76, 0x65, 0x63, 0x33, 0x20, 0x63, 0x35, 0x20, 0x3d, 
+	0x20, 0x76, 0x65, 0x63, 0x33, 0x28, 0x34, 0x2e, 0x37, 0x37, 0x36, 
+	0x33, 0x38, 0x34, 0x39, 0x39, 0x37, 0x36, 0x37, 0x30, 0x32, 0x38, 
+	0x38, 0x66, 0x2c, 0x20, 0x2d, 0x31, 0x33, 0x2e, 0x37, 0x34, 0x35, 
+	0x31, 0x34, 0x35, 0x33, 0x37, 0x37, 0x37, 0x34, 0x36, 0x30, 0x31, 
+	0x66, 0x2c, 0x20, 0x2d, 0x36, 0x35, 0x2e, 0x33, 0x35, 0x33, 0x30, 
+	0x33, 0x32, 0x36, 0x33, 0x33, 0x33, 0x37, 0x32, 0x33, 0x34, 0x66, 
+	0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x20, 0x76, 0x65, 0x63, 0x33, 
+	0x20, 0x63, 0x36, 0x20, 0x3d, 0x20, 0x76, 0x65, 0x63, 0x33, 0x28, 
+	0x2d, 0x35, 0x2e, 0x34, 0x33, 0x35, 0x34, 0x35, 0x35, 0x38, 0x35, 
+	0x35, 0x39, 0x33, 0x34, 0x36, 0x33, 0x31, 0x66, 0x2c, 0x20, 0x34, 
+	0x2e, 0x36, 0x34, 0x35, 0x38, 0x35, 0x32, 0x36, 0x31, 0x32, 0x31, 
+	0x37, 0x38, 0x35, 0x33, 0x35, 0x66, 0x2c, 0x20, 0x32, 0x36, 0x2e, 
+	0x33, 0x31, 0x32, 0x34, 0x33, 0x35, 0x32, 0x34, 0x39, 0x35, 0x38, 
+	0x33, 0x32, 0x66, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x20, 0x3d, 
+	0x20, 0x63, 0x6c, 0x61, 0x6d, 0x70, 0x28, 0x63, 0x30, 0x20, 0x2b, 
+	0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 0x2a, 0x20, 0x28, 0x63, 
+	0x31, 0x20, 0x2b, 0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 0x2a, 
+	0x20, 0x28, 0x63, 0x32, 0x20, 0x2b, 0x20, 0x76, 0x61, 0x6c, 0x75, 
+	0x65, 0x20, 0x2a, 0x20, 0x28, 0x63, 0x33, 0x20, 0x2b, 0x20, 0x76, 
+	0x61, 0x6c, 0x75, 0x65, 0x20, 0x2a, 0x20, 0x28, 0x63, 0x34, 0x20, 
+	0x2b, 0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 0x2a, 0x20, 0x28, 
+	0x63, 0x35, 0x20, 0x2b, 0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x20, 
+	0x2a, 0x20, 0x63, 0x36, 0x29, 0x29, 0x29, 0x29, 0x29, 0x2c, 0x20, 
+	0x30, 0x2e, 0x30, 0x66, 0x2c, 0x20, 0x31, 0x2e, 0x30, 0x66, 0x29, 
+	0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x7d, 0x20, 0x65, 0x6c, 
+	0x73, 0x65, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x2f, 0x2f, 0x20, 0x52, 0x65, 0x64, 0x2c, 0x20, 
+	0x6d, 0x6f, 0x72, 0x65, 0x20, 0x6f, 0x70, 0x61, 0x71, 0x75, 0x65, 
+	0x20, 0x66, 0x6f, 0x72, 0x20, 0x68, 0x69, 0x67, 0x68, 0x65, 0x72, 
+	0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 0x73, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 
+	0x20, 0x3d, 0x20, 0x76, 0x65, 0x63, 0x33, 0x28, 0x31, 0x2e, 0x30, 
+	0x66, 0x2c, 0x20, 0x30, 0x2e, 0x30, 0x66, 0x2c, 0x20, 0x30, 0x2e, 
+	0x30, 0x66, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x6f, 0x70, 0x61, 0x63, 0x69, 0x74, 0x79, 0x20, 
+	0x3d, 0x20, 0x6f, 0x76, 0x65, 0x72, 0x6c, 0x61, 0x79, 0x5f, 0x6f, 
+	0x70, 0x61, 0x63, 0x69, 0x74, 0x79, 0x20, 0x2a, 0x20, 0x76, 0x61, 
+	0x6c, 0x75, 0x65, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x7d, 
+	0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 
+	0x6e, 0x20, 0x76, 0x65, 0x63, 0x34, 0x28, 0x63, 0x6f, 0x6c, 0x6f, 
+	0x72, 0x2c, 0x20, 0x6f, 0x70, 0x61, 0x63, 0x69, 0x74, 0x79, 0x29, 
+	0x3b, 0x0d, 0x0a, 0x7d, 0x0d, 0x0a, 0x0d, 0x0a, 0x2f, 0x2f, 0x20, 
+	0x54, 0x68, 0x65, 0x20, 0x70, 0x61, 0x72, 0x74, 0x20, 0x6f, 0x66, 
+	0x20, 0x74, 0x68, 0x65, 0x20, 0x70, 0x69, 0x78, 0x65, 0x6c, 0x20, 
+	0x74, 0x68, 0x61, 0x74, 0x20, 0x6c, 0x69, 0x65, 0x73, 0x20, 0x77, 
+	0x69, 0x74, 0x68, 0x69, 0x6e, 0x20, 0x74, 0x68, 0x65, 0x20, 0x69, 
+	0x6d, 0x61, 0x67, 0x65, 0x3a, 0x20, 0x74, 0x68, 0x65, 0x20, 0x74, 
+	0x69, 0x6c, 0x65, 0x73, 0x20, 0x61, 0x74, 0x20, 0x74, 0x68, 0x65, 
+	0x20, 0x65, 0x64, 0x67, 0x65, 0x73, 0x20, 0x6f, 0x66, 0x20, 0x74, 
+	0x68, 0x65, 0x20, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x20, 0x61, 0x72, 
+	0x65, 0x20, 0x63, 0x6c, 0x69, 0x70, 0x70, 0x65, 0x64, 0x20, 0x68, 
+	0x65, 0x72, 0x65, 0x2c, 0x20, 0x77, 0x69, 0x74, 0x68, 0x20, 0x74, 
+	0x68, 0x65, 0x20, 0x65, 0x64, 0x67, 0x65, 0x0d, 0x0a, 0x2f, 0x2f, 
+	0x20, 0x61, 0x6e, 0x74, 0x69, 0x2d, 0x61, 0x6c, 0x69, 0x61, 0x73, 
+	0x65, 0x64, 0x20, 0x6f, 0x76, 0x65, 0x72, 0x20, 0x6f, 0x6e, 0x65, 
+	0x20, 0x70, 0x69, 0x78, 0x65, 0x6c, 0x2e, 0x0d, 0x0a, 0x66, 0x6c, 
+	0x6f, 0x61, 0x74, 0x20, 0x67, 0x65, 0x74, 0x5f, 0x63, 0x6f, 0x76, 
+	0x65, 0x72, 0x61, 0x67, 0x65, 0x28, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 0x70, 0x69, 
+	0x78, 0x65, 0x6c, 0x73, 0x5f, 0x69, 0x6e, 0x73, 0x69, 0x64, 0x65, 
+	0x20, 0x3d, 0x20, 0x28, 0x76, 0x73, 0x5f, 0x76, 0x61, 0x6c, 0x69, 
+	0x64, 0x5f, 0x6d, 0x61, 0x78, 0x20, 0x2d, 0x20, 0x76, 0x73, 0x5f, 
+	0x74, 0x65, 0x78, 0x5f, 0x63, 0x6f, 0x6f, 0x72, 0x64, 0x29, 0x20, 
+	0x2f, 0x20, 0x6d, 0x61, 0x78, 0x28, 0x66, 0x77, 0x69, 0x64, 0x74, 
+	0x68, 0x28, 0x76, 0x73, 0x5f, 0x74, 0x65, 0x78, 0x5f, 0x63, 0x6f, 
+	0x6f, 0x72, 0x64, 0x29, 0x2c, 0x20, 0x76, 0x65, 0x63, 0x32, 0x28, 
+	0x31, 0x65, 0x2d, 0x36, 0x66, 0x29, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x63, 
+	0x6c, 0x61, 0x6d, 0x70, 0x28, 0x6d, 0x69, 0x6e, 0x28, 0x70, 0x69, 
+	0x78, 0x65, 0x6c, 0x73, 0x5f, 0x69, 0x6e, 0x73, 0x69, 0x64, 0x65, 
+	0x2e, 0x78, 0x2c, 0x20, 0x70, 0x69, 0x78, 0x65, 0x6c, 0x73, 0x5f, 
+	0x69, 0x6e, 0x73, 0x69, 0x64, 0x65, 0x2e, 0x79, 0x29, 0x20, 0x2b, 
+	0x20, 0x30, 0x2e, 0x35, 0x66, 0x2c, 0x20, 0x30, 0x2e, 0x30, 0x66, 
+	0x2c, 0x20, 0x31, 0x2e, 0x30, 0x66, 0x29, 0x3b, 0x0d, 0x0a, 0x7d, 
+	0x0d, 0x0a, 0x0d, 0x0a, 0x76, 0x6f, 0x69, 0x64, 0x20, 0x6d, 0x61, 
+	0x69, 0x6e, 0x28, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x63, 0x6f, 0x76, 0x65, 
+	0x72, 0x61, 0x67, 0x65, 0x20, 0x3d, 0x20, 0x67, 0x65, 0x74, 0x5f, 
+	0x63, 0x6f, 0x76, 0x65, 0x72, 0x61, 0x67, 0x65, 0x28, 0x29, 0x3b, 
+	0x20, 0x2f, 0x2f, 0x20, 0x28, 0x74, 0x68, 0x65, 0x20, 0x64, 0x65, 
+	0x72, 0x69, 0x76, 0x61, 0x74, 0x69, 0x76, 0x65, 0x73, 0x20, 0x6e, 
+	0x65, 0x65, 0x64, 0x20, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 
+	0x20, 0x63, 0x6f, 0x6e, 0x74, 0x72, 0x6f, 0x6c, 0x20, 0x66, 0x6c, 
+	0x6f, 0x77, 0x2c, 0x20, 0x61, 0x73, 0x20, 0x64, 0x6f, 0x65, 0x73, 
+	0x20, 0x74, 0x68, 0x65, 0x20, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 
+	0x65, 0x20, 0x6c, 0x6f, 0x6f, 0x6b, 0x75, 0x70, 0x29, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x2f, 0x2f, 0x20, 0x28, 0x74, 0x68, 0x65, 
+	0x20, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 0x20, 0x69, 0x73, 
+	0x20, 0x61, 0x6c, 0x73, 0x6f, 0x20, 0x73, 0x61, 0x6d, 0x70, 0x6c, 
+	0x65, 0x64, 0x20, 0x66, 0x6f, 0x72, 0x20, 0x66, 0x6c, 0x61, 0x74, 
+	0x20, 0x74, 0x69, 0x6c, 0x65, 0x73, 0x2c, 0x20, 0x73, 0x6f, 0x20, 
+	0x74, 0x68, 0x61, 0x74, 0x20, 0x74, 0x68, 0x65, 0x20, 0x74, 0x65, 
+	0x78, 0x74, 0x75, 0x72, 0x65, 0x20, 0x6c, 0x6f, 0x6f, 0x6b, 0x75, 
+	0x70, 0x20, 0x73, 0x74, 0x61, 0x79, 0x73, 0x20, 0x69, 0x6e, 0x20, 
+	0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x63, 0x6f, 0x6e, 
+	0x74, 0x72, 0x6f, 0x6c, 0x20, 0x66, 0x6c, 0x6f, 0x77, 0x29, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x34, 0x20, 0x74, 
+	0x65, 0x78, 0x65, 0x6c, 0x20, 0x3d, 0x20, 0x69, 0x73, 0x5f, 0x70, 
+	0x6c, 0x61, 0x6e, 0x61, 0x72, 0x20, 0x3f, 0x20, 0x73, 0x61, 0x6d, 
+	0x70, 0x6c, 0x65, 0x5f, 0x70, 0x6c, 0x61, 0x6e, 0x61, 0x72, 0x5f, 
+	0x74, 0x69, 0x6c, 0x65, 0x28, 0x76, 0x73, 0x5f, 0x74, 0x65, 0x78, 
+	0x5f, 0x63, 0x6f, 0x6f, 0x72, 0x64, 0x2c, 0x20, 0x76, 0x73, 0x5f, 
+	0x6c, 0x61, 0x79, 0x65, 0x72, 0x29, 0x20, 0x3a, 0x20, 0x74, 0x65, 
+	0x78, 0x74, 0x75, 0x72, 0x65, 0x28, 0x74, 0x68, 0x65, 0x5f, 0x74, 
+	0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 0x2c, 0x20, 0x76, 0x65, 0x63, 
+	0x33, 0x28, 0x76, 0x73, 0x5f, 0x74, 0x65, 0x78, 0x5f, 0x63, 0x6f, 
+	0x6f, 0x72, 0x64, 0x2c, 0x20, 0x76, 0x73, 0x5f, 0x6c, 0x61, 0x79, 
+	0x65, 0x72, 0x29, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+	0x76, 0x65, 0x63, 0x34, 0x20, 0x74, 0x68, 0x65, 0x5f, 0x74, 0x65, 
+	0x78, 0x74, 0x75, 0x72, 0x65, 0x5f, 0x72, 0x67, 0x62, 0x61, 0x20, 
+	0x3d, 0x20, 0x6d, 0x69, 0x78, 0x28, 0x74, 0x65, 0x78, 0x65, 0x6c, 
+	0x2c, 0x20, 0x76, 0x73, 0x5f, 0x66, 0x6c, 0x61, 0x74, 0x5f, 0x63, 
+	0x6f, 0x6c, 0x6f, 0x72, 0x2c, 0x20, 0x76, 0x73, 0x5f, 0x69, 0x73, 
+	0x5f, 0x66, 0x6c, 0x61, 0x74, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x69, 0x66, 0x20, 0x28, 0x69, 0x73, 0x5f, 0x63, 0x68, 
+	0x61, 0x6e, 0x6e, 0x65, 0x6c, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x2f, 0x2f, 0x20, 0x28, 
+	0x74, 0x68, 0x65, 0x20, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 
+	0x20, 0x69, 0x73, 0x20, 0x73, 0x69, 0x6e, 0x67, 0x6c, 0x65, 0x20, 
+	0x63, 0x68, 0x61, 0x6e, 0x6e, 0x65, 0x6c, 0x2c, 0x20, 0x61, 0x6e, 
+	0x64, 0x20, 0x66, 0x6c, 0x61, 0x74, 0x20, 0x74, 0x69, 0x6c, 0x65, 
+	0x73, 0x20, 0x6f, 0x66, 0x20, 0x61, 0x20, 0x63, 0x68, 0x61, 0x6e, 
+	0x6e, 0x65, 0x6c, 0x20, 0x61, 0x72, 0x65, 0x20, 0x67, 0x72, 0x61, 
+	0x79, 0x29, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x69, 0x6e, 0x74, 0x65, 
+	0x6e, 0x73, 0x69, 0x74, 0x79, 0x20, 0x3d, 0x20, 0x63, 0x6c, 0x61, 
+	0x6d, 0x70, 0x28, 0x74, 0x68, 0x65, 0x5f, 0x74, 0x65, 0x78, 0x74, 
+	0x75, 0x72, 0x65, 0x5f, 0x72, 0x67, 0x62, 0x61, 0x2e, 0x72, 0x20, 
+	0x2a, 0x20, 0x63, 0x68, 0x61, 0x6e, 0x6e, 0x65, 0x6c, 0x5f, 0x67, 
+	0x61, 0x69, 0x6e, 0x20, 0x2b, 0x20, 0x63, 0x68, 0x61, 0x6e, 0x6e, 
+	0x65, 0x6c, 0x5f, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x2c, 0x20, 
+	0x30, 0x2e, 0x30, 0x66, 0x2c, 0x20, 0x31, 0x2e, 0x30, 0x66, 0x29, 
+	0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x67, 0x6c, 0x5f, 0x46, 0x72, 0x61, 0x67, 0x43, 0x6f, 0x6c, 0x6f, 
+	0x72, 0x20, 0x3d, 0x20, 0x76, 0x65, 0x63, 0x34, 0x28, 0x63, 0x6f, 
+	0x76, 0x65, 0x72, 0x61, 0x67, 0x65, 0x20, 0x2a, 0x20, 0x69, 0x6e, 
+	0x74, 0x65, 0x6e, 0x73, 0x69, 0x74, 0x79, 0x20, 0x2a, 0x20, 0x63, 
+	0x68, 0x61, 0x6e, 0x6e, 0x65, 0x6c, 0x5f, 0x63, 0x6f, 0x6c, 0x6f, 
+	0x72, 0x2c, 0x20, 0x31, 0x2e, 0x30, 0x66, 0x29, 0x3b, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 
+	0x75, 0x72, 0x6e, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x7d, 
+	0x20, 0x65, 0x6c, 0x73, 0x65, 0x20, 0x69, 0x66, 0x20, 0x28, 0x69, 
+	0x73, 0x5f, 0x6f, 0x76, 0x65, 0x72, 0x6c, 0x61, 0x79, 0x29, 0x20, 
+	0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x76, 0x65, 0x63, 0x34, 0x20, 0x6f, 0x76, 0x65, 0x72, 0x6c, 0x61, 
+	0x79, 0x20, 0x3d, 0x20, 0x61, 0x70, 0x70, 0x6c, 0x79, 0x5f, 0x6f, 
+	0x76, 0x65, 0x72, 0x6c, 0x61, 0x79, 0x5f, 0x63, 0x6f, 0x6c, 0x6f, 
+	0x72, 0x6d, 0x61, 0x70, 0x28, 0x74, 0x68, 0x65, 0x5f, 0x74, 0x65, 
+	0x78, 0x74, 0x75, 0x72, 0x65, 0x5f, 0x72, 0x67, 0x62, 0x61, 0x2e, 
+	0x72, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x67, 0x6c, 0x5f, 0x46, 0x72, 0x61, 0x67, 0x43, 0x6f, 
+	0x6c, 0x6f, 0x72, 0x20, 0x3d, 0x20, 0x76, 0x65, 0x63, 0x34, 0x28, 
+	0x6f, 0x76, 0x65, 0x72, 0x6c, 0x61, 0x79, 0x2e, 0x72, 0x67, 0x62, 
+	0x2c, 0x20, 0x6f, 0x76, 0x65, 0x72, 0x6c, 0x61, 0x79, 0x2e, 0x61, 
+	0x20, 0x2a, 0x20, 0x63, 0x6f, 0x76, 0x65, 0x72, 0x61, 0x67, 0x65, 
+	0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x3b, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x7d, 0x0d, 0x0a, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x2f, 0x2f, 0x20, 0x28, 0x6f, 0x75, 0x74, 0x73, 0x69, 0x64, 
+	0x65, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x69, 0x6d, 
+	0x61, 0x67, 0x65, 0x2c, 0x20, 0x74, 0x68, 0x65, 0x20, 0x62, 0x61, 
+	0x63, 0x6b, 0x67, 0x72, 0x6f, 0x75, 0x6e, 0x64, 0x20, 0x73, 0x68, 
+	0x6f, 0x77, 0x73, 0x20, 0x74, 0x68, 0x72, 0x6f, 0x75, 0x67, 0x68, 
+	0x2c, 0x20, 0x61, 0x73, 0x20, 0x66, 0x6f, 0x72, 0x20, 0x74, 0x72, 
+	0x61, 0x6e, 0x73, 0x70, 0x61, 0x72, 0x65, 0x6e, 0x74, 0x20, 0x70, 
+	0x69, 0x78, 0x65, 0x6c, 0x73, 0x29, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x6f, 0x70, 0x61, 0x63, 
+	0x69, 0x74, 0x79, 0x20, 0x3d, 0x20, 0x74, 0x68, 0x65, 0x5f, 0x74, 
+	0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 0x5f, 0x72, 0x67, 0x62, 0x61, 
+	0x2e, 0x61, 0x20, 0x2a, 0x20, 0x63, 0x6f, 0x76, 0x65, 0x72, 0x61, 
+	0x67, 0x65, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 
+	0x63, 0x33, 0x20, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x20, 0x3d, 0x20, 
+	0x74, 0x68, 0x65, 0x5f, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 
+	0x5f, 0x72, 0x67, 0x62, 0x61, 0x2e, 0x72, 0x67, 0x62, 0x3b, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x28, 0x73, 0x68, 
+	0x6f, 0x77, 0x5f, 0x73, 0x69, 0x6e, 0x67, 0x6c, 0x65, 0x5f, 0x73, 
+	0x74, 0x61, 0x69, 0x6e, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x2f, 0x2f, 0x20, 0x43, 0x6f, 
+	0x6c, 0x6f, 0x72, 0x20, 0x64, 0x65, 0x63, 0x6f, 0x6e, 0x76, 0x6f, 
+	0x6c, 0x75, 0x74, 0x69, 0x6f, 0x6e, 0x3a, 0x20, 0x74, 0x68, 0x65, 
+	0x20, 0x6f, 0x70, 0x74, 0x69, 0x63, 0x61, 0x6c, 0x20, 0x64, 0x65, 
+	0x6e, 0x73, 0x69, 0x74, 0x79, 0x20, 0x69, 0x73, 0x20, 0x75, 0x6e, 
+	0x6d, 0x69, 0x78, 0x65, 0x64, 0x20, 0x69, 0x6e, 0x74, 0x6f, 0x20, 
+	0x74, 0x68, 0x65, 0x20, 0x61, 0x6d, 0x6f, 0x75, 0x6e, 0x74, 0x20, 
+	0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x73, 0x68, 0x6f, 0x77, 
+	0x6e, 0x20, 0x73, 0x74, 0x61, 0x69, 0x6e, 0x2c, 0x20, 0x77, 0x68, 
+	0x69, 0x63, 0x68, 0x20, 0x69, 0x73, 0x20, 0x74, 0x68, 0x65, 0x6e, 
+	0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x2f, 
+	0x2f, 0x20, 0x72, 0x65, 0x62, 0x75, 0x69, 0x6c, 0x74, 0x20, 0x77, 
+	0x69, 0x74, 0x68, 0x6f, 0x75, 0x74, 0x20, 0x74, 0x68, 0x65, 0x20, 
+	0x6f, 0x74, 0x68, 0x65, 0x72, 0x20, 0x73, 0x74, 0x61, 0x69, 0x6e, 
+	0x73, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x76, 0x65, 0x63, 0x33, 0x20, 0x6f, 0x70, 0x74, 0x69, 0x63, 0x61, 
+	0x6c, 0x5f, 0x64, 0x65, 0x6e, 0x73, 0x69, 0x74, 0x79, 0x20, 0x3d, 
+	0x20, 0x2d, 0x6c, 0x6f, 0x67, 0x28, 0x6d, 0x61, 0x78, 0x28, 0x63, 
+	0x6f, 0x6c, 0x6f, 0x72, 0x2c, 0x20, 0x76, 0x65, 0x63, 0x33, 0x28, 
+	0x31, 0x2e, 0x30, 0x66, 0x20, 0x2f, 0x20, 0x32, 0x35, 0x35, 0x2e, 
+	0x30, 0x66, 0x29, 0x29, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 
+	0x73, 0x74, 0x61, 0x69, 0x6e, 0x5f, 0x61, 0x6d, 0x6f, 0x75, 0x6e, 
+	0x74, 0x20, 0x3d, 0x20, 0x6d, 0x61, 0x78, 0x28, 0x30, 0x2e, 0x30, 
+	0x66, 0x2c, 0x20, 0x64, 0x6f, 0x74, 0x28, 0x73, 0x74, 0x61, 0x69, 
+	0x6e, 0x5f, 0x75, 0x6e, 0x6d, 0x69, 0x78, 0x69, 0x6e, 0x67, 0x2c, 
+	0x20, 0x6f, 0x70, 0x74, 0x69, 0x63, 0x61, 0x6c, 0x5f, 0x64, 0x65, 
+	0x6e, 0x73, 0x69, 0x74, 0x79, 0x29, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x63, 0x6f, 0x6c, 0x6f, 
+	0x72, 0x20, 0x3d, 0x20, 0x65, 0x78, 0x70, 0x28, 0x2d, 0x73, 0x74, 
+	0x61, 0x69, 0x6e, 0x5f, 0x61, 0x6d, 0x6f, 0x75, 0x6e, 0x74, 0x20, 
+	0x2a, 0x20, 0x73, 0x74, 0x61, 0x69, 0x6e, 0x5f, 0x76, 0x65, 0x63, 
+	0x74, 0x6f, 0x72, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+	0x7d, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x2f, 0x2f, 0x20, 0x28, 
+	0x74, 0x68, 0x65, 0x20, 0x6f, 0x75, 0x74, 0x65, 0x72, 0x6d, 0x6f, 
+	0x73, 0x74, 0x20, 0x67, 0x72, 0x69, 0x64, 0x20, 0x70, 0x6f, 0x69, 
+	0x6e, 0x74, 0x73, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 
+	0x6c, 0x6f, 0x6f, 0x6b, 0x75, 0x70, 0x20, 0x74, 0x61, 0x62, 0x6c, 
+	0x65, 0x20, 0x61, 0x72, 0x65, 0x20, 0x61, 0x74, 0x20, 0x74, 0x68, 
+	0x65, 0x20, 0x74, 0x65, 0x78, 0x65, 0x6c, 0x20, 0x63, 0x65, 0x6e, 
+	0x74, 0x65, 0x72, 0x73, 0x29, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+	0x76, 0x65, 0x63, 0x33, 0x20, 0x6c, 0x75, 0x74, 0x5f, 0x73, 0x69, 
+	0x7a, 0x65, 0x20, 0x3d, 0x20, 0x76, 0x65, 0x63, 0x33, 0x28, 0x74, 
+	0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 0x53, 0x69, 0x7a, 0x65, 0x28, 
+	0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x5f, 0x6c, 0x75, 0x74, 0x2c, 0x20, 
+	0x30, 0x29, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x63, 
+	0x6f, 0x6c, 0x6f, 0x72, 0x20, 0x3d, 0x20, 0x74, 0x65, 0x78, 0x74, 
+	0x75, 0x72, 0x65, 0x28, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x5f, 0x6c, 
+	0x75, 0x74, 0x2c, 0x20, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x20, 0x2a, 
+	0x20, 0x28, 0x28, 0x6c, 0x75, 0x74, 0x5f, 0x73, 0x69, 0x7a, 0x65, 
+	0x20, 0x2d, 0x20, 0x31, 0x2e, 0x30, 0x66, 0x29, 0x20, 0x2f, 0x20, 
+	0x6c, 0x75, 0x74, 0x5f, 0x73, 0x69, 0x7a, 0x65, 0x29, 0x20, 0x2b, 
+	0x20, 0x30, 0x2e, 0x35, 0x66, 0x20, 0x2f, 0x20, 0x6c, 0x75, 0x74, 
+	0x5f, 0x73, 0x69, 0x7a, 0x65, 0x29, 0x2e, 0x72, 0x67, 0x62, 0x3b, 
+	0x0d, 0x0a, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x67, 0x6c, 0x5f, 
+	0x46, 0x72, 0x61, 0x67, 0x43, 0x6f, 0x6c, 0x6f, 0x72, 0x20, 0x3d, 
+	0x20, 0x76, 0x65, 0x63, 0x34, 0x28, 0x6f, 0x70, 0x61, 0x63, 0x69, 
+	0x74, 0x79, 0x20, 0x2a, 0x20, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x20, 
+	0x2b, 0x20, 0x28, 0x31, 0x2e, 0x30, 0x66, 0x2d, 0x6f, 0x70, 0x61, 
+	0x63, 0x69, 0x74, 0x79, 0x29, 0x20, 0x2a, 0x20, 0x62, 0x67, 0x5f, 
+	0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x2c, 0x20, 0x6f, 0x70, 0x61, 0x63, 
+	0x69, 0x74, 0x79, 0x20, 0x2a, 0x20, 0x76, 0x73, 0x5f, 0x61, 0x6c, 
+	0x70, 0x68, 0x61, 0x29, 0x3b, 0x0d, 0x0a, 0x7d, 0x0d, 0x0a, 0
+};
+
+const char stringified_shader_source__annotation_vert[2461] = {
+	0x23, 0x76, 0x65, 0x72, 0x73, 0x69, 0x6f, 0x6e, 0x20, 0x31, 0x34, 
+	0x30, 0x0d, 0x0a, 0x0d, 0x0a, 0x2f, 0x2f, 0x20, 0x41, 0x6e, 0x6e, 
+	0x6f, 0x74, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x6f, 0x75, 0x74, 
+	0x6c, 0x69, 0x6e, 0x65, 0x73, 0x2c, 0x20, 0x64, 0x72, 0x61, 0x77, 
+	0x6e, 0x20, 0x61, 0x73, 0x20, 0x73, 0x63, 0x72, 0x65, 0x65, 0x6e, 
+	0x2d, 0x73, 0x70, 0x61, 0x63, 0x65, 0x20, 0x71, 0x75, 0x61, 0x64, 
+	0x73, 0x20, 0x28, 0x36, 0x20, 0x76, 0x65, 0x72, 0x74, 0x69, 0x63, 
+	0x65, 0x73, 0x20, 0x70, 0x65, 0x72, 0x20, 0x73, 0x65, 0x67, 0x6d, 
+	0x65, 0x6e, 0x74, 0x2c, 0x20, 0x6e, 0x6f, 0x20, 0x76, 0x65, 0x72, 
+	0x74, 0x65, 0x78, 0x20, 0x61, 0x74, 0x74, 0x72, 0x69, 0x62, 0x75, 
+	0x74, 0x65, 0x73, 0x29, 0x2e, 0x0d, 0x0a, 0x2f, 0x2f, 0x20, 0x54, 
+	0x68, 0x65, 0x20, 0x67, 0x65, 0x6f, 0x6d, 0x65, 0x74, 0x72, 0x79, 
+	0x20, 0x69, 0x73, 0x20, 0x73, 0x74, 0x6f, 0x72, 0x65, 0x64, 0x20, 
+	0x6f, 0x6e, 0x63, 0x65, 0x20, 0x69, 0x6e, 0x20, 0x77, 0x6f, 0x72, 
+	0x6c, 0x64, 0x20, 0x63, 0x6f, 0x6f, 0x72, 0x64, 0x69, 0x6e, 0x61, 
+	0x74, 0x65, 0x73, 0x20, 0x28, 0x6d, 0x69, 0x63, 0x72, 0x6f, 0x6d, 
+	0x65, 0x74, 0x65, 0x72, 0x73, 0x29, 0x2c, 0x20, 0x69, 0x6e, 0x20, 
+	0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 0x20, 0x62, 0x75, 0x66, 
+	0x66, 0x65, 0x72, 0x73, 0x3a, 0x0d, 0x0a, 0x2f, 0x2f, 0x20, 0x73, 
+	0x65, 0x67, 0x6d, 0x65, 0x6e, 0x74, 0x73, 0x20, 0x3d, 0x20, 0x28, 
+	0x78, 0x30, 0x2c, 0x20, 0x79, 0x30, 0x2c, 0x20, 0x78, 0x31, 0x2c, 
+	0x20, 0x79, 0x31, 0x29, 0x3b, 0x20, 0x73, 0x65, 0x67, 0x6d, 0x65, 
+	0x6e, 0x74, 0x5f, 0x61, 0x6e, 0x6e, 0x6f, 0x74, 0x61, 0x74, 0x69, 
+	0x6f, 0x6e, 0x73, 0x20, 0x3d, 0x20, 0x74, 0x68, 0x65, 0x20, 0x61, 
+	0x6e, 0x6e, 0x6f, 0x74, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x65, 
+	0x61, 0x63, 0x68, 0x20, 0x73, 0x65, 0x67, 0x6d, 0x65, 0x6e, 0x74, 
+	0x20, 0x62, 0x65, 0x6c, 0x6f, 0x6e, 0x67, 0x73, 0x20, 0x74, 0x6f, 
+	0x3b, 0x0d, 0x0a, 0x2f, 0x2f, 0x20, 0x61, 0x6e, 0x6e, 0x6f, 0x74, 
+	0x61, 0x74, 0x69, 0x6f, 0x6e, 0x5f, 0x61, 0x74, 0x74, 0x72, 0x69, 
+	0x62, 0x75, 0x74, 0x65, 0x73, 0x20, 0x3d, 0x20, 0x28, 0x72, 0x2c, 
+	0x20, 0x67, 0x2c, 0x20, 0x62, 0x2c, 0x20, 0x73, 0x65, 0x6c, 0x65, 
+	0x63, 0x74, 0x65, 0x64, 0x29, 0x20, 0x70, 0x65, 0x72, 0x20, 0x61, 
+	0x6e, 0x6e, 0x6f, 0x74, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x2e, 0x0d, 
+	0x0a, 0x0d, 0x0a, 0x66, 0x6c, 0x61, 0x74, 0x20, 0x6f, 0x75, 0x74, 
+	0x20, 0x76, 0x65, 0x63, 0x34, 0x20, 0x76, 0x73, 0x5f, 0x63, 0x6f, 
+	0x6c, 0x6f, 0x72, 0x3b, 0x0d, 0x0a, 0x6f, 0x75, 0x74, 0x20, 0x66, 
+	0x6c, 0x6f, 0x61, 0x74, 0x20, 0x76, 0x73, 0x5f, 0x64, 0x69, 0x73, 
+	0x74, 0x61, 0x6e, 0x63, 0x65, 0x3b, 0x20, 0x2f, 0x2f, 0x20, 0x61, 
+	0x63, 0x72, 0x6f, 0x73, 0x73, 0x20, 0x74, 0x68, 0x65, 0x20, 0x6c, 
+	0x69, 0x6e, 0x65, 0x2c, 0x20, 0x69, 0x6e, 0x20, 0x70, 0x69, 0x78, 
+	0x65, 0x6c, 0x73, 0x20, 0x66, 0x72, 0x6f, 0x6d, 0x20, 0x74, 0x68, 
+	0x65, 0x20, 0x63, 0x65, 0x6e, 0x74, 0x65, 0x72, 0x0d, 0x0a, 0x66, 
+	0x6c, 0x61, 0x74, 0x20, 0x6f, 0x75, 0x74, 0x20, 0x66, 0x6c, 0x6f, 
+	0x61, 0x74, 0x20, 0x76, 0x73, 0x5f, 0x68, 0x61, 0x6c, 0x66, 0x5f, 
+	0x77, 0x69, 0x64, 0x74, 0x68, 0x3b, 0x0d, 0x0a, 0x0d, 0x0a, 0x75, 
+	0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x73, 0x61, 0x6d, 0x70, 
+	0x6c, 0x65, 0x72, 0x42, 0x75, 0x66, 0x66, 0x65, 0x72, 0x20, 0x73, 
+	0x65, 0x67, 0x6d, 0x65, 0x6e, 0x74, 0x73, 0x3b, 0x0d, 0x0a, 0x75, 
+	0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x69, 0x73, 0x61, 0x6d, 
+	0x70, 0x6c, 0x65, 0x72, 0x42, 0x75, 0x66, 0x66, 0x65, 0x72, 0x20, 
+	0x73, 0x65, 0x67, 0x6d, 0x65, 0x6e, 0x74, 0x5f, 0x61, 0x6e, 0x6e, 
+	0x6f, 0x74, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x3b, 0x0d, 0x0a, 
+	0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x73, 0x61, 0x6d, 
+	0x70, 0x6c, 0x65, 0x72, 0x42, 0x75, 0x66, 0x66, 0x65, 0x72, 0x20, 
+	0x61, 0x6e, 0x6e, 0x6f, 0x74, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x5f, 
+	0x61, 0x74, 0x74, 0x72, 0x69, 0x62, 0x75, 0x74, 0x65, 0x73, 0x3b, 
+	0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x76, 
+	0x65, 0x63, 0x32, 0x20, 0x63, 0x61, 0x6d, 0x65, 0x72, 0x61, 0x5f, 
+	0x6d, 0x69, 0x6e, 0x3b, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 
+	0x72, 0x6d, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x75, 0x6d, 
+	0x5f, 0x70, 0x65, 0x72, 0x5f, 0x70, 0x69, 0x78, 0x65, 0x6c, 0x3b, 
+	0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x76, 
+	0x65, 0x63, 0x32, 0x20, 0x76, 0x69, 0x65, 0x77, 0x70, 0x6f, 0x72, 
+	0x74, 0x5f, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x3b, 0x0d, 0x0a, 
+	0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x76, 0x65, 0x63, 
+	0x32, 0x20, 0x73, 0x63, 0x72, 0x65, 0x65, 0x6e, 0x5f, 0x73, 0x69, 
+	0x7a, 0x65, 0x3b, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 
+	0x6d, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x74, 0x68, 0x69, 
+	0x63, 0x6b, 0x6e, 0x65, 0x73, 0x73, 0x3b, 0x0d, 0x0a, 0x0d, 0x0a, 
+	0x76, 0x6f, 0x69, 0x64, 0x20, 0x6d, 0x61, 0x69, 0x6e, 0x28, 0x29, 
+	0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 0x6e, 0x74, 
+	0x20, 0x73, 0x65, 0x67, 0x6d, 0x65, 0x6e, 0x74, 0x5f, 0x69, 0x6e, 
+	0x64, 0x65, 0x78, 0x20, 0x3d, 0x20, 0x67, 0x6c, 0x5f, 0x56, 0x65, 
+	0x72, 0x74, 0x65, 0x78, 0x49, 0x44, 0x20, 0x2f, 0x20, 0x36, 0x3b, 
+	0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x63, 
+	0x6f, 0x72, 0x6e, 0x65, 0x72, 0x20, 0x3d, 0x20, 0x67, 0x6c, 0x5f, 
+	0x56, 0x65, 0x72, 0x74, 0x65, 0x78, 0x49, 0x44, 0x20, 0x25, 0x20, 
+	0x36, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 
+	0x34, 0x20, 0x73, 0x65, 0x67, 0x6d, 0x65, 0x6e, 0x74, 0x20, 0x3d, 
+	0x20, 0x74, 0x65, 0x78, 0x65, 0x6c, 0x46, 0x65, 0x74, 0x63, 0x68, 
+	0x28, 0x73, 0x65, 0x67, 0x6d, 0x65, 0x6e, 0x74, 0x73, 0x2c, 0x20, 
+	0x73, 0x65, 0x67, 0x6d, 0x65, 0x6e, 0x74, 0x5f, 0x69, 0x6e, 0x64, 
+	0x65, 0x78, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 
+	0x6e, 0x74, 0x20, 0x61, 0x6e, 0x6e, 0x6f, 0x74, 0x61, 0x74, 0x69, 
+	0x6f, 0x6e, 0x5f, 0x69, 0x6e, 0x64, 0x65, 0x78, 0x20, 0x3d, 0x20, 
+	0x74, 0x65, 0x78, 0x65, 0x6c, 0x46, 0x65, 0x74, 0x63, 0x68, 0x28, 
+	0x73, 0x65, 0x67, 0x6d, 0x65, 0x6e, 0x74, 0x5f, 0x61, 0x6e, 0x6e, 
+	0x6f, 0x74, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x73, 0x2c, 0x20, 0x73, 
+	0x65, 0x67, 0x6d, 0x65, 0x6e, 0x74, 0x5f, 0x69, 0x6e, 0x64, 0x65, 
+	0x78, 0x29, 0x2e, 0x72, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+	0x76, 0x65, 0x63, 0x34, 0x20, 0x61, 0x74, 0x74, 0x72, 0x69, 0x62, 
+	0x75, 0x74, 0x65, 0x73, 0x20, 0x3d, 0x20, 0x74, 0x65, 0x78, 0x65, 
+	0x6c, 0x46, 0x65, 0x74, 0x63, 0x68, 0x28, 0x61, 0x6e, 0x6e, 0x6f, 
+	0x74, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x5f, 0x61, 0x74, 0x74, 0x72, 
+	0x69, 0x62, 0x75, 0x74, 0x65, 0x73, 0x2c, 0x20, 0x61, 0x6e, 0x6e, 
+	0x6f, 0x74, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x5f, 0x69, 0x6e, 0x64, 
+	0x65, 0x78, 0x29, 0x3b, 0x0d, 0x0a, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x76, 0x65, 0x63, 0x33, 0x20, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 
+	0x20, 0x3d, 0x20, 0x61, 0x74, 0x74, 0x72, 0x69, 0x62, 0x75, 0x74, 
+	0x65, 0x73, 0x2e, 0x72, 0x67, 0x62, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x77, 0x69, 0x64, 
+	0x74, 0x68, 0x20, 0x3d, 0x20, 0x74, 0x68, 0x69, 0x63, 0x6b, 0x6e, 
+	0x65, 0x73, 0x73, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 
+	0x66, 0x20, 0x28, 0x61, 0x74, 0x74, 0x72, 0x69, 0x62, 0x75, 0x74, 
+	0x65, 0x73, 0x2e, 0x61, 0x20, 0x3e, 0x20, 0x30, 0x2e, 0x35, 0x66, 
+	0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x2f, 0x2f, 0x20, 0x73, 0x65, 0x6c, 0x65, 0x63, 0x74, 
+	0x65, 0x64, 0x3a, 0x20, 0x6c, 0x69, 0x67, 0x68, 0x74, 0x65, 0x72, 
+	0x20, 0x61, 0x6e, 0x64, 0x20, 0x74, 0x68, 0x69, 0x63, 0x6b, 0x65, 
+	0x72, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x20, 0x3d, 0x20, 0x6d, 0x69, 0x78, 
+	0x28, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x2c, 0x20, 0x76, 0x65, 0x63, 
+	0x33, 0x28, 0x31, 0x2e, 0x30, 0x66, 0x29, 0x2c, 0x20, 0x30, 0x2e, 
+	0x32, 0x66, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x77, 0x69, 0x64, 0x74, 0x68, 0x20, 0x2a, 0x3d, 
+	0x20, 0x32, 0x2e, 0x30, 0x66, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x7d, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 
+	0x61, 0x74, 0x20, 0x68, 0x61, 0x6c, 0x66, 0x5f, 0x77, 0x69, 0x64, 
+	0x74, 0x68, 0x20, 0x3d, 0x20, 0x30, 0x2e, 0x35, 0x66, 0x20, 0x2a, 
+	0x20, 0x77, 0x69, 0x64, 0x74, 0x68, 0x20, 0x2b, 0x20, 0x30, 0x2e, 
+	0x35, 0x66, 0x3b, 0x20, 0x2f, 0x2f, 0x20, 0x68, 0x61, 0x6c, 0x66, 
+	0x20, 0x61, 0x20, 0x70, 0x69, 0x78, 0x65, 0x6c, 0x20, 0x65, 0x78, 
+	0x74, 0x72, 0x61, 0x20, 0x66, 0x6f, 0x72, 0x20, 0x74, 0x68, 0x65, 
+	0x20, 0x61, 0x6e, 0x74, 0x69, 0x61, 0x6c, 0x69, 0x61, 0x73, 0x65, 
+	0x64, 0x20, 0x65, 0x64, 0x67, 0x65, 0x73, 0x0d, 0x0a, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 0x70, 0x30, 
+	0x20, 0x3d, 0x20, 0x28, 0x73, 0x65, 0x67, 0x6d, 0x65, 0x6e, 0x74, 
+	0x2e, 0x78, 0x79, 0x20, 0x2d, 0x20, 0x63, 0x61, 0x6d, 0x65, 0x72, 
+	0x61, 0x5f, 0x6d, 0x69, 0x6e, 0x29, 0x20, 0x2f, 0x20, 0x75, 0x6d, 
+	0x5f, 0x70, 0x65, 0x72, 0x5f, 0x70, 0x69, 0x78, 0x65, 0x6c, 0x20, 
+	0x2b, 0x20, 0x76, 0x69, 0x65, 0x77, 0x70, 0x6f, 0x72, 0x74, 0x5f, 
+	0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 0x70, 0x31, 0x20, 0x3d, 
+	0x20, 0x28, 0x73, 0x65, 0x67, 0x6d, 0x65, 0x6e, 0x74, 0x2e, 0x7a, 
+	0x77, 0x20, 0x2d, 0x20, 0x63, 0x61, 0x6d, 0x65, 0x72, 0x61, 0x5f, 
+	0x6d, 0x69, 0x6e, 0x29, 0x20, 0x2f, 0x20, 0x75, 0x6d, 0x5f, 0x70, 
+	0x65, 0x72, 0x5f, 0x70, 0x69, 0x78, 0x65, 0x6c, 0x20, 0x2b, 0x20, 
+	0x76, 0x69, 0x65, 0x77, 0x70, 0x6f, 0x72, 0x74, 0x5f, 0x6f, 0x66, 
+	0x66, 0x73, 0x65, 0x74, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+	0x76, 0x65, 0x63, 0x32, 0x20, 0x64, 0x65, 0x6c, 0x74, 0x61, 0x20, 
+	0x3d, 0x20, 0x70, 0x31, 0x20, 0x2d, 0x20, 0x70, 0x30, 0x3b, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 
+	0x6c, 0x65, 0x6e, 0x20, 0x3d, 0x20, 0x6c, 0x65, 0x6e, 0x67, 0x74, 
+	0x68, 0x28, 0x64, 0x65, 0x6c, 0x74, 0x61, 0x29, 0x3b, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 0x64, 0x69, 
+	0x72, 0x20, 0x3d, 0x20, 0x28, 0x6c, 0x65, 0x6e, 0x20, 0x3e, 0x20, 
+	0x30, 0x2e, 0x30, 0x30, 0x30, 0x31, 0x66, 0x29, 0x20, 0x3f, 0x20, 
+	0x64, 0x65, 0x6c, 0x74, 0x61, 0x20, 0x2f, 0x20, 0x6c, 0x65, 0x6e, 
+	0x20, 0x3a, 0x20, 0x76, 0x65, 0x63, 0x32, 0x28, 0x31, 0x2e, 0x30, 
+	0x66, 0x2c, 0x20, 0x30, 0x2e, 0x30, 0x66, 0x29, 0x3b, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 0x6e, 0x6f, 
+	0x72, 0x6d, 0x61, 0x6c, 0x20, 0x3d, 0x20, 0x76, 0x65, 0x63, 0x32, 
+	0x28, 0x2d, 0x64, 0x69, 0x72, 0x2e, 0x79, 0x2c, 0x20, 0x64, 0x69, 
+	0x72, 0x2e, 0x78, 0x29, 0x3b, 0x0d, 0x0a, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x2f, 0x2f, 0x20, 0x54, 0x77, 0x6f, 0x20, 0x74, 0x72, 
+	0x69, 0x61, 0x6e, 0x67, 0x6c, 0x65, 0x73, 0x3a, 0x20, 0x28, 0x73, 
+	0x74, 0x61, 0x72, 0x74, 0x2c, 0x20, 0x2d, 0x29, 0x2c, 0x20, 0x28, 
+	0x65, 0x6e, 0x64, 0x2c, 0x20, 0x2d, 0x29, 0x2c, 0x20, 0x28, 0x73, 
+	0x74, 0x61, 0x72, 0x74, 0x2c, 0x20, 0x2b, 0x29, 0x20, 0x61, 0x6e, 
+	0x64, 0x20, 0x28, 0x73, 0x74, 0x61, 0x72, 0x74, 0x2c, 0x20, 0x2b, 
+	0x29, 0x2c, 0x20, 0x28, 0x65, 0x6e, 0x64, 0x2c, 0x20, 0x2d, 0x29, 
+	0x2c, 0x20, 0x28, 0x65, 0x6e, 0x64, 0x2c, 0x20, 0x2b, 0x29, 0x2e, 
+	0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x2f, 0x2f, 0x20, 0x54, 0x68, 
+	0x65, 0x20, 0x65, 0x6e, 0x64, 0x73, 0x20, 0x61, 0x72, 0x65, 0x20, 
+	0x65, 0x78, 0x74, 0x65, 0x6e, 0x64, 0x65, 0x64, 0x20, 0x62, 0x79, 
+	0x20, 0x68, 0x61, 0x6c, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x77, 
+	0x69, 0x64, 0x74, 0x68, 0x2c, 0x20, 0x73, 0x6f, 0x20, 0x74, 0x68, 
+	0x61, 0x74, 0x20, 0x74, 0x68, 0x65, 0x20, 0x73, 0x65, 0x67, 0x6d, 
+	0x65, 0x6e, 0x74, 0x73, 0x20, 0x6f, 0x66, 0x20, 0x61, 0x6e, 0x20, 
+	0x6f, 0x75, 0x74, 0x6c, 0x69, 0x6e, 0x65, 0x20, 0x6a, 0x6f, 0x69, 
+	0x6e, 0x20, 0x77, 0x69, 0x74, 0x68, 0x6f, 0x75, 0x74, 0x20, 0x67, 
+	0x61, 0x70, 0x73, 0x2c, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x2f, 
+	0x2f, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x73, 0x6f, 0x20, 0x74, 0x68, 
+	0x61, 0x74, 0x20, 0x61, 0x20, 0x73, 0x65, 0x67, 0x6d, 0x65, 0x6e, 
+	0x74, 0x20, 0x6f, 0x66, 0x20, 0x7a, 0x65, 0x72, 0x6f, 0x20, 0x6c, 
+	0x65, 0x6e, 0x67, 0x74, 0x68, 0x20, 0x73, 0x74, 0x69, 0x6c, 0x6c, 
+	0x20, 0x73, 0x68, 0x6f, 0x77, 0x73, 0x20, 0x75, 0x70, 0x20, 0x61, 
+	0x73, 0x20, 0x61, 0x20, 0x64, 0x6f, 0x74, 0x2e, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x62, 0x6f, 0x6f, 0x6c, 0x20, 0x69, 0x73, 0x5f, 
+	0x65, 0x6e, 0x64, 0x20, 0x3d, 0x20, 0x28, 0x63, 0x6f, 0x72, 0x6e, 
+	0x65, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x31, 0x20, 0x7c, 0x7c, 0x20, 
+	0x63, 0x6f, 0x72, 0x6e, 0x65, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x34, 
+	0x20, 0x7c, 0x7c, 0x20, 0x63, 0x6f, 0x72, 0x6e, 0x65, 0x72, 0x20, 
+	0x3d, 0x3d, 0x20, 0x35, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x73, 0x69, 0x64, 0x65, 
+	0x20, 0x3d, 0x20, 0x28, 0x63, 0x6f, 0x72, 0x6e, 0x65, 0x72, 0x20, 
+	0x3d, 0x3d, 0x20, 0x32, 0x20, 0x7c, 0x7c, 0x20, 0x63, 0x6f, 0x72, 
+	0x6e, 0x65, 0x72, 0x20, 0x3d, 0x3d, 0x20, 0x33, 0x20, 0x7c, 0x7c, 
+	0x20, 0x63, 0x6f, 0x72, 0x6e, 0x65, 0x72, 0x20, 0x3d, 0x3d, 0x20, 
+	0x35, 0x29, 0x20, 0x3f, 0x20, 0x31, 0x2e, 0x30, 0x66, 0x20, 0x3a, 
+	0x20, 0x2d, 0x31, 0x2e, 0x30, 0x66, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 0x70, 0x6f, 0x73, 0x20, 
+	0x3d, 0x20, 0x69, 0x73, 0x5f, 0x65, 0x6e, 0x64, 0x20, 0x3f, 0x20, 
+	0x70, 0x31, 0x20, 0x2b, 0x20, 0x64, 0x69, 0x72, 0x20, 0x2a, 0x20, 
+	0x68, 0x61, 0x6c, 0x66, 0x5f, 0x77, 0x69, 0x64, 0x74, 0x68, 0x20, 
+	0x3a, 0x20, 0x70, 0x30, 0x20, 0x2d, 0x20, 0x64, 0x69, 0x72, 0x20, 
+	0x2a, 0x20, 0x68, 0x61, 0x6c, 0x66, 0x5f, 0x77, 0x69, 0x64, 0x74, 
+	0x68, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x70, 0x6f, 0x73, 
+	0x20, 0x2b, 0x3d, 0x20, 0x6e, 0x6f, 0x72, 0x6d, 0x61, 0x6c, 0x20, 
+	0x2a, 0x20, 0x73, 0x69, 0x64, 0x65, 0x20, 0x2a, 0x20, 0x68, 0x61, 
+	0x6c, 0x66, 0x5f, 0x77, 0x69, 0x64, 0x74, 0x68, 0x3b, 0x0d, 0x0a, 
+	0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 
+	0x6e, 0x64, 0x63, 0x20, 0x3d, 0x20, 0x76, 0x65, 0x63, 0x32, 0x28, 
+	0x70, 0x6f, 0x73, 0x2e, 0x78, 0x20, 0x2f, 0x20, 0x73, 0x63, 0x72, 
+	0x65, 0x65, 0x6e, 0x5f, 0x73, 0x69, 0x7a, 0x65, 0x2e, 0x78, 0x20, 
+	0x2a, 0x20, 0x32, 0x2e, 0x30, 0x66, 0x20, 0x2d, 0x20, 0x31, 0x2e, 
+	0x30, 0x66, 0x2c, 0x20, 0x31, 0x2e, 0x30, 0x66, 0x20, 0x2d, 0x20, 
+	0x70, 0x6f, 0x73, 0x2e, 0x79, 0x20, 0x2f, 0x20, 0x73, 0x63, 0x72, 
+	0x65, 0x65, 0x6e, 0x5f, 0x73, 0x69, 0x7a, 0x65, 0x2e, 0x79, 0x20, 
+	0x2a, 0x20, 0x32, 0x2e, 0x30, 0x66, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x67, 0x6c, 0x5f, 0x50, 0x6f, 0x73, 0x69, 0x74, 
+	0x69, 0x6f, 0x6e, 0x20, 0x3d, 0x20, 0x76, 0x65, 0x63, 0x34, 0x28, 
+	0x6e, 0x64, 0x63, 0x2c, 0x20, 0x30, 0x2e, 0x30, 0x66, 0x2c, 0x20, 
+	0x31, 0x2e, 0x30, 0x66, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x76, 0x73, 0x5f, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x20, 0x3d, 
+	0x20, 0x76, 0x65, 0x63, 0x34, 0x28, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 
+	0x2c, 0x20, 0x31, 0x2e, 0x30, 0x66, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x76, 0x73, 0x5f, 0x64, 0x69, 0x73, 0x74, 0x61, 
+	0x6e, 0x63, 0x65, 0x20, 0x3d, 0x20, 0x73, 0x69, 0x64, 0x65, 0x20, 
+	0x2a, 0x20, 0x68, 0x61, 0x6c, 0x66, 0x5f, 0x77, 0x69, 0x64, 0x74, 
+	0x68, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x76, 0x73, 0x5f, 
+	0x68, 0x61, 0x6c, 0x66, 0x5f, 0x77, 0x69, 0x64, 0x74, 0x68, 0x20, 
+	0x3d, 0x20, 0x68, 0x61, 0x6c, 0x66, 0x5f, 0x77, 0x69, 0x64, 0x74, 
+	0x68, 0x3b, 0x0d, 0x0a, 0x7d, 0x0d, 0x0a, 0
+};
+
+const char stringified_shader_source__annotation_frag[294] = {
+	0x23, 0x76, 0x65, 0x72, 0x73, 0x69, 0x6f, 0x6e, 0x20, 0x31, 0x34, 
+	0x30, 0x0d, 0x0a, 0x0d, 0x0a, 0x66, 0x6c, 0x61, 0x74, 0x20, 0x69, 
+	0x6e, 0x20, 0x76, 0x65, 0x63, 0x34, 0x20, 0x76, 0x73, 0x5f, 0x63, 
+	0x6f, 0x6c, 0x6f, 0x72, 0x3b, 0x0d, 0x0a, 0x69, 0x6e, 0x20, 0x66, 
+	0x6c, 0x6f, 0x61, 0x74, 0x20, 0x76, 0x73, 0x5f, 0x64, 0x69, 0x73, 
+	0x74, 0x61, 0x6e, 0x63, 0x65, 0x3b, 0x0d, 0x0a, 0x66, 0x6c, 0x61, 
+	0x74, 0x20, 0x69, 0x6e, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 
+	0x76, 0x73, 0x5f, 0x68, 0x61, 0x6c, 0x66, 0x5f, 0x77, 0x69, 0x64, 
+	0x74, 0x68, 0x3b, 0x0d, 0x0a, 0x0d, 0x0a, 0x76, 0x6f, 0x69, 0x64, 
+	0x20, 0x6d, 0x61, 0x69, 0x6e, 0x28, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x2f, 0x2f, 0x20, 0x46, 0x61, 0x64, 0x65, 
+	0x20, 0x6f, 0x75, 0x74, 0x20, 0x6f, 0x76, 0x65, 0x72, 0x20, 0x74, 
+	0x68, 0x65, 0x20, 0x6f, 0x75, 0x74, 0x65, 0x72, 0x6d, 0x6f, 0x73, 
+	0x74, 0x20, 0x70, 0x69, 0x78, 0x65, 0x6c, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x63, 0x6f, 0x76, 
+	0x65, 0x72, 0x61, 0x67, 0x65, 0x20, 0x3d, 0x20, 0x63, 0x6c, 0x61, 
+	0x6d, 0x70, 0x28, 0x76, 0x73, 0x5f, 0x68, 0x61, 0x6c, 0x66, 0x5f, 
+	0x77, 0x69, 0x64, 0x74, 0x68, 0x20, 0x2d, 0x20, 0x61, 0x62, 0x73, 
+	0x28, 0x76, 0x73, 0x5f, 0x64, 0x69, 0x73, 0x74, 0x61, 0x6e, 0x63, 
+	0x65, 0x29, 0x2c, 0x20, 0x30, 0x2e, 0x30, 0x66, 0x2c, 0x20, 0x31, 
+	0x2e, 0x30, 0x66, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+	0x67, 0x6c, 0x5f, 0x46, 0x72, 0x61, 0x67, 0x43, 0x6f, 0x6c, 0x6f, 
+	0x72, 0x20, 0x3d, 0x20, 0x76, 0x65, 0x63, 0x34, 0x28, 0x76, 0x73, 
+	0x5f, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x2e, 0x72, 0x67, 0x62, 0x2c, 
+	0x20, 0x76, 0x73, 0x5f, 0x63, 0x6f, 0x6c, 0x6f, 0x72, 0x2e, 0x61, 
+	0x20, 0x2a, 0x20, 0x63, 0x6f, 0x76, 0x65, 0x72, 0x61, 0x67, 0x65, 
+	0x29, 0x3b, 0x0d, 0x0a, 0x7d, 0x0d, 0x0a, 0
+};
+
+const char stringified_shader_source__jpeg_decode_comp[5514] = {
+	0x23, 0x76, 0x65, 0x72, 0x73, 0x69, 0x6f, 0x6e, 0x20, 0x34, 0x33, 
+	0x30, 0x0d, 0x0a, 0x0d, 0x0a, 0x2f, 0x2f, 0x20, 0x54, 0x68, 0x65, 
+	0x20, 0x70, 0x61, 0x72, 0x74, 0x20, 0x6f, 0x66, 0x20, 0x64, 0x65, 
+	0x63, 0x6f, 0x64, 0x69, 0x6e, 0x67, 0x20, 0x61, 0x20, 0x4a, 0x50, 
+	0x45, 0x47, 0x20, 0x74, 0x69, 0x6c, 0x65, 0x20, 0x74, 0x68, 0x61, 
+	0x74, 0x20, 0x63, 0x6f, 0x6d, 0x65, 0x73, 0x20, 0x61, 0x66, 0x74, 
+	0x65, 0x72, 0x20, 0x74, 0x68, 0x65, 0x20, 0x65, 0x6e, 0x74, 0x72, 
+	0x6f, 0x70, 0x79, 0x20, 0x64, 0x65, 0x63, 0x6f, 0x64, 0x69, 0x6e, 
+	0x67, 0x2c, 0x20, 0x66, 0x6f, 0x72, 0x20, 0x74, 0x69, 0x6c, 0x65, 
+	0x73, 0x20, 0x74, 0x68, 0x61, 0x74, 0x20, 0x74, 0x68, 0x65, 0x20, 
+	0x77, 0x6f, 0x72, 0x6b, 0x65, 0x72, 0x73, 0x20, 0x6f, 0x6e, 0x6c, 
+	0x79, 0x20, 0x64, 0x65, 0x63, 0x6f, 0x64, 0x65, 0x64, 0x0d, 0x0a, 
+	0x2f, 0x2f, 0x20, 0x69, 0x6e, 0x74, 0x6f, 0x20, 0x44, 0x43, 0x54, 
+	0x20, 0x63, 0x6f, 0x65, 0x66, 0x66, 0x69, 0x63, 0x69, 0x65, 0x6e, 
+	0x74, 0x73, 0x20, 0x28, 0x73, 0x65, 0x65, 0x20, 0x64, 0x65, 0x63, 
+	0x6f, 0x64, 0x65, 0x5f, 0x74, 0x69, 0x6c, 0x65, 0x5f, 0x63, 0x6f, 
+	0x65, 0x66, 0x66, 0x69, 0x63, 0x69, 0x65, 0x6e, 0x74, 0x73, 0x5f, 
+	0x77, 0x69, 0x74, 0x68, 0x5f, 0x73, 0x74, 0x61, 0x74, 0x65, 0x28, 
+	0x29, 0x29, 0x2e, 0x20, 0x52, 0x75, 0x6e, 0x73, 0x20, 0x69, 0x6e, 
+	0x20, 0x74, 0x77, 0x6f, 0x20, 0x73, 0x74, 0x61, 0x67, 0x65, 0x73, 
+	0x2c, 0x20, 0x6f, 0x6e, 0x65, 0x20, 0x64, 0x69, 0x73, 0x70, 0x61, 
+	0x74, 0x63, 0x68, 0x20, 0x65, 0x61, 0x63, 0x68, 0x3a, 0x0d, 0x0a, 
+	0x2f, 0x2f, 0x20, 0x30, 0x3a, 0x20, 0x64, 0x65, 0x71, 0x75, 0x61, 
+	0x6e, 0x74, 0x69, 0x7a, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x2c, 0x20, 
+	0x49, 0x44, 0x43, 0x54, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x63, 0x6f, 
+	0x6c, 0x6f, 0x72, 0x20, 0x63, 0x6f, 0x6e, 0x76, 0x65, 0x72, 0x73, 
+	0x69, 0x6f, 0x6e, 0x20, 0x6f, 0x66, 0x20, 0x6f, 0x6e, 0x65, 0x20, 
+	0x31, 0x36, 0x78, 0x31, 0x36, 0x20, 0x70, 0x69, 0x78, 0x65, 0x6c, 
+	0x20, 0x4d, 0x43, 0x55, 0x20, 0x28, 0x34, 0x20, 0x59, 0x20, 0x62, 
+	0x6c, 0x6f, 0x63, 0x6b, 0x73, 0x2c, 0x20, 0x31, 0x20, 0x43, 0x62, 
+	0x20, 0x61, 0x6e, 0x64, 0x20, 0x31, 0x20, 0x43, 0x72, 0x20, 0x62, 
+	0x6c, 0x6f, 0x63, 0x6b, 0x29, 0x20, 0x70, 0x65, 0x72, 0x20, 0x77, 
+	0x6f, 0x72, 0x6b, 0x0d, 0x0a, 0x2f, 0x2f, 0x20, 0x20, 0x20, 0x20, 
+	0x67, 0x72, 0x6f, 0x75, 0x70, 0x2c, 0x20, 0x69, 0x6e, 0x74, 0x6f, 
+	0x20, 0x6d, 0x69, 0x70, 0x20, 0x6c, 0x65, 0x76, 0x65, 0x6c, 0x20, 
+	0x30, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x74, 0x69, 
+	0x6c, 0x65, 0x20, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 0x0d, 
+	0x0a, 0x2f, 0x2f, 0x20, 0x31, 0x3a, 0x20, 0x74, 0x68, 0x65, 0x20, 
+	0x32, 0x78, 0x32, 0x20, 0x62, 0x6f, 0x78, 0x20, 0x66, 0x69, 0x6c, 
+	0x74, 0x65, 0x72, 0x20, 0x6f, 0x66, 0x20, 0x31, 0x36, 0x78, 0x31, 
+	0x36, 0x20, 0x70, 0x69, 0x78, 0x65, 0x6c, 0x73, 0x20, 0x70, 0x65, 
+	0x72, 0x20, 0x77, 0x6f, 0x72, 0x6b, 0x20, 0x67, 0x72, 0x6f, 0x75, 
+	0x70, 0x2c, 0x20, 0x66, 0x72, 0x6f, 0x6d, 0x20, 0x6d, 0x69, 0x70, 
+	0x20, 0x6c, 0x65, 0x76, 0x65, 0x6c, 0x20, 0x30, 0x20, 0x69, 0x6e, 
+	0x74, 0x6f, 0x20, 0x6d, 0x69, 0x70, 0x20, 0x6c, 0x65, 0x76, 0x65, 
+	0x6c, 0x20, 0x31, 0x0d, 0x0a, 0x0d, 0x0a, 0x6c, 0x61, 0x79, 0x6f, 
+	0x75, 0x74, 0x28, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x5f, 0x73, 0x69, 
+	0x7a, 0x65, 0x5f, 0x78, 0x20, 0x3d, 0x20, 0x31, 0x36, 0x2c, 0x20, 
+	0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x5f, 0x73, 0x69, 0x7a, 0x65, 0x5f, 
+	0x79, 0x20, 0x3d, 0x20, 0x31, 0x36, 0x29, 0x20, 0x69, 0x6e, 0x3b, 
+	0x0d, 0x0a, 0x0d, 0x0a, 0x2f, 0x2f, 0x20, 0x51, 0x75, 0x61, 0x6e, 
+	0x74, 0x69, 0x7a, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x74, 0x61, 
+	0x62, 0x6c, 0x65, 0x73, 0x20, 0x6f, 0x66, 0x20, 0x59, 0x2c, 0x20, 
+	0x43, 0x62, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x43, 0x72, 0x2c, 0x20, 
+	0x74, 0x68, 0x65, 0x6e, 0x20, 0x74, 0x68, 0x65, 0x20, 0x63, 0x6f, 
+	0x65, 0x66, 0x66, 0x69, 0x63, 0x69, 0x65, 0x6e, 0x74, 0x73, 0x20, 
+	0x6f, 0x66, 0x20, 0x61, 0x6c, 0x6c, 0x20, 0x62, 0x6c, 0x6f, 0x63, 
+	0x6b, 0x73, 0x20, 0x28, 0x61, 0x6c, 0x6c, 0x20, 0x31, 0x36, 0x20, 
+	0x62, 0x69, 0x74, 0x73, 0x2c, 0x20, 0x74, 0x77, 0x6f, 0x20, 0x74, 
+	0x6f, 0x20, 0x61, 0x20, 0x75, 0x69, 0x6e, 0x74, 0x29, 0x0d, 0x0a, 
+	0x6c, 0x61, 0x79, 0x6f, 0x75, 0x74, 0x28, 0x73, 0x74, 0x64, 0x34, 
+	0x33, 0x30, 0x2c, 0x20, 0x62, 0x69, 0x6e, 0x64, 0x69, 0x6e, 0x67, 
+	0x20, 0x3d, 0x20, 0x30, 0x29, 0x20, 0x72, 0x65, 0x61, 0x64, 0x6f, 
+	0x6e, 0x6c, 0x79, 0x20, 0x62, 0x75, 0x66, 0x66, 0x65, 0x72, 0x20, 
+	0x63, 0x6f, 0x65, 0x66, 0x66, 0x69, 0x63, 0x69, 0x65, 0x6e, 0x74, 
+	0x5f, 0x62, 0x75, 0x66, 0x66, 0x65, 0x72, 0x20, 0x7b, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x75, 0x69, 0x6e, 0x74, 0x20, 0x63, 0x6f, 
+	0x65, 0x66, 0x66, 0x69, 0x63, 0x69, 0x65, 0x6e, 0x74, 0x5f, 0x64, 
+	0x61, 0x74, 0x61, 0x5b, 0x5d, 0x3b, 0x0d, 0x0a, 0x7d, 0x3b, 0x0d, 
+	0x0a, 0x0d, 0x0a, 0x6c, 0x61, 0x79, 0x6f, 0x75, 0x74, 0x28, 0x72, 
+	0x67, 0x62, 0x61, 0x38, 0x2c, 0x20, 0x62, 0x69, 0x6e, 0x64, 0x69, 
+	0x6e, 0x67, 0x20, 0x3d, 0x20, 0x30, 0x29, 0x20, 0x75, 0x6e, 0x69, 
+	0x66, 0x6f, 0x72, 0x6d, 0x20, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x32, 
+	0x44, 0x41, 0x72, 0x72, 0x61, 0x79, 0x20, 0x74, 0x69, 0x6c, 0x65, 
+	0x5f, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x3b, 0x20, 0x2f, 0x2f, 0x20, 
+	0x6d, 0x69, 0x70, 0x20, 0x6c, 0x65, 0x76, 0x65, 0x6c, 0x20, 0x30, 
+	0x0d, 0x0a, 0x6c, 0x61, 0x79, 0x6f, 0x75, 0x74, 0x28, 0x72, 0x67, 
+	0x62, 0x61, 0x38, 0x2c, 0x20, 0x62, 0x69, 0x6e, 0x64, 0x69, 0x6e, 
+	0x67, 0x20, 0x3d, 0x20, 0x31, 0x29, 0x20, 0x75, 0x6e, 0x69, 0x66, 
+	0x6f, 0x72, 0x6d, 0x20, 0x77, 0x72, 0x69, 0x74, 0x65, 0x6f, 0x6e, 
+	0x6c, 0x79, 0x20, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x32, 0x44, 0x41, 
+	0x72, 0x72, 0x61, 0x79, 0x20, 0x74, 0x69, 0x6c, 0x65, 0x5f, 0x6d, 
+	0x69, 0x70, 0x5f, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x3b, 0x20, 0x2f, 
+	0x2f, 0x20, 0x6d, 0x69, 0x70, 0x20, 0x6c, 0x65, 0x76, 0x65, 0x6c, 
+	0x20, 0x31, 0x0d, 0x0a, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 
+	0x72, 0x6d, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x73, 0x74, 0x61, 0x67, 
+	0x65, 0x3b, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 
+	0x20, 0x69, 0x6e, 0x74, 0x20, 0x64, 0x69, 0x6d, 0x3b, 0x20, 0x2f, 
+	0x2f, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x74, 0x69, 
+	0x6c, 0x65, 0x20, 0x28, 0x61, 0x20, 0x6d, 0x75, 0x6c, 0x74, 0x69, 
+	0x70, 0x6c, 0x65, 0x20, 0x6f, 0x66, 0x20, 0x31, 0x36, 0x29, 0x0d, 
+	0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x69, 0x6e, 
+	0x74, 0x20, 0x6c, 0x61, 0x79, 0x65, 0x72, 0x3b, 0x0d, 0x0a, 0x0d, 
+	0x0a, 0x63, 0x6f, 0x6e, 0x73, 0x74, 0x20, 0x69, 0x6e, 0x74, 0x20, 
+	0x51, 0x55, 0x41, 0x4e, 0x54, 0x5f, 0x54, 0x41, 0x42, 0x4c, 0x45, 
+	0x53, 0x5f, 0x53, 0x49, 0x5a, 0x45, 0x20, 0x3d, 0x20, 0x33, 0x20, 
+	0x2a, 0x20, 0x36, 0x34, 0x3b, 0x20, 0x2f, 0x2f, 0x20, 0x69, 0x6e, 
+	0x20, 0x31, 0x36, 0x2d, 0x62, 0x69, 0x74, 0x20, 0x76, 0x61, 0x6c, 
+	0x75, 0x65, 0x73, 0x0d, 0x0a, 0x0d, 0x0a, 0x73, 0x68, 0x61, 0x72, 
+	0x65, 0x64, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x63, 0x6f, 
+	0x65, 0x66, 0x66, 0x69, 0x63, 0x69, 0x65, 0x6e, 0x74, 0x73, 0x5b, 
+	0x36, 0x20, 0x2a, 0x20, 0x36, 0x34, 0x5d, 0x3b, 0x20, 0x2f, 0x2f, 
+	0x20, 0x64, 0x65, 0x71, 0x75, 0x61, 0x6e, 0x74, 0x69, 0x7a, 0x65, 
+	0x64, 0x3a, 0x20, 0x34, 0x20, 0x59, 0x20, 0x62, 0x6c, 0x6f, 0x63, 
+	0x6b, 0x73, 0x20, 0x28, 0x69, 0x6e, 0x20, 0x72, 0x61, 0x73, 0x74, 
+	0x65, 0x72, 0x20, 0x6f, 0x72, 0x64, 0x65, 0x72, 0x29, 0x2c, 0x20, 
+	0x43, 0x62, 0x2c, 0x20, 0x43, 0x72, 0x0d, 0x0a, 0x73, 0x68, 0x61, 
+	0x72, 0x65, 0x64, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x6c, 
+	0x75, 0x6d, 0x61, 0x5f, 0x72, 0x6f, 0x77, 0x73, 0x5b, 0x34, 0x20, 
+	0x2a, 0x20, 0x36, 0x34, 0x5d, 0x3b, 0x20, 0x2f, 0x2f, 0x20, 0x61, 
+	0x66, 0x74, 0x65, 0x72, 0x20, 0x74, 0x68, 0x65, 0x20, 0x66, 0x69, 
+	0x72, 0x73, 0x74, 0x20, 0x28, 0x68, 0x6f, 0x72, 0x69, 0x7a, 0x6f, 
+	0x6e, 0x74, 0x61, 0x6c, 0x29, 0x20, 0x70, 0x61, 0x73, 0x73, 0x20, 
+	0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x49, 0x44, 0x43, 0x54, 
+	0x3a, 0x20, 0x38, 0x20, 0x72, 0x6f, 0x77, 0x73, 0x20, 0x6f, 0x66, 
+	0x20, 0x38, 0x20, 0x70, 0x65, 0x72, 0x20, 0x62, 0x6c, 0x6f, 0x63, 
+	0x6b, 0x0d, 0x0a, 0x73, 0x68, 0x61, 0x72, 0x65, 0x64, 0x20, 0x66, 
+	0x6c, 0x6f, 0x61, 0x74, 0x20, 0x63, 0x68, 0x72, 0x6f, 0x6d, 0x61, 
+	0x5f, 0x72, 0x6f, 0x77, 0x73, 0x5b, 0x32, 0x20, 0x2a, 0x20, 0x31, 
+	0x32, 0x38, 0x5d, 0x3b, 0x20, 0x2f, 0x2f, 0x20, 0x38, 0x20, 0x72, 
+	0x6f, 0x77, 0x73, 0x20, 0x6f, 0x66, 0x20, 0x31, 0x36, 0x20, 0x70, 
+	0x65, 0x72, 0x20, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x0d, 0x0a, 0x0d, 
+	0x0a, 0x69, 0x6e, 0x74, 0x20, 0x67, 0x65, 0x74, 0x5f, 0x31, 0x36, 
+	0x5f, 0x62, 0x69, 0x74, 0x73, 0x28, 0x69, 0x6e, 0x74, 0x20, 0x69, 
+	0x6e, 0x64, 0x65, 0x78, 0x2c, 0x20, 0x62, 0x6f, 0x6f, 0x6c, 0x20, 
+	0x69, 0x73, 0x5f, 0x73, 0x69, 0x67, 0x6e, 0x65, 0x64, 0x29, 0x20, 
+	0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x75, 0x69, 0x6e, 0x74, 
+	0x20, 0x77, 0x6f, 0x72, 0x64, 0x20, 0x3d, 0x20, 0x63, 0x6f, 0x65, 
+	0x66, 0x66, 0x69, 0x63, 0x69, 0x65, 0x6e, 0x74, 0x5f, 0x64, 0x61, 
+	0x74, 0x61, 0x5b, 0x69, 0x6e, 0x64, 0x65, 0x78, 0x20, 0x3e, 0x3e, 
+	0x20, 0x31, 0x5d, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 
+	0x6e, 0x74, 0x20, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x20, 0x3d, 
+	0x20, 0x28, 0x69, 0x6e, 0x64, 0x65, 0x78, 0x20, 0x26, 0x20, 0x31, 
+	0x29, 0x20, 0x2a, 0x20, 0x31, 0x36, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 0x20, 0x69, 0x73, 
+	0x5f, 0x73, 0x69, 0x67, 0x6e, 0x65, 0x64, 0x20, 0x3f, 0x20, 0x62, 
+	0x69, 0x74, 0x66, 0x69, 0x65, 0x6c, 0x64, 0x45, 0x78, 0x74, 0x72, 
+	0x61, 0x63, 0x74, 0x28, 0x69, 0x6e, 0x74, 0x28, 0x77, 0x6f, 0x72, 
+	0x64, 0x29, 0x2c, 0x20, 0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x2c, 
+	0x20, 0x31, 0x36, 0x29, 0x20, 0x3a, 0x20, 0x69, 0x6e, 0x74, 0x28, 
+	0x62, 0x69, 0x74, 0x66, 0x69, 0x65, 0x6c, 0x64, 0x45, 0x78, 0x74, 
+	0x72, 0x61, 0x63, 0x74, 0x28, 0x77, 0x6f, 0x72, 0x64, 0x2c, 0x20, 
+	0x6f, 0x66, 0x66, 0x73, 0x65, 0x74, 0x2c, 0x20, 0x31, 0x36, 0x29, 
+	0x29, 0x3b, 0x0d, 0x0a, 0x7d, 0x0d, 0x0a, 0x0d, 0x0a, 0x2f, 0x2f, 
+	0x20, 0x53, 0x63, 0x61, 0x6c, 0x65, 0x64, 0x20, 0x73, 0x6f, 0x20, 
+	0x74, 0x68, 0x61, 0x74, 0x20, 0x74, 0x68, 0x65, 0x20, 0x32, 0x44, 
+	0x20, 0x49, 0x44, 0x43, 0x54, 0x20, 0x69, 0x73, 0x20, 0x74, 0x68, 
+	0x65, 0x20, 0x70, 0x72, 0x6f, 0x64, 0x75, 0x63, 0x74, 0x20, 0x6f, 
+	0x66, 0x20, 0x74, 0x77, 0x6f, 0x20, 0x31, 0x44, 0x20, 0x70, 0x61, 
+	0x73, 0x73, 0x65, 0x73, 0x2e, 0x20, 0x54, 0x68, 0x65, 0x20, 0x63, 
+	0x68, 0x72, 0x6f, 0x6d, 0x61, 0x20, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 
+	0x73, 0x20, 0x61, 0x72, 0x65, 0x20, 0x74, 0x72, 0x61, 0x6e, 0x73, 
+	0x66, 0x6f, 0x72, 0x6d, 0x65, 0x64, 0x20, 0x73, 0x74, 0x72, 0x61, 
+	0x69, 0x67, 0x68, 0x74, 0x20, 0x69, 0x6e, 0x74, 0x6f, 0x20, 0x31, 
+	0x36, 0x78, 0x31, 0x36, 0x0d, 0x0a, 0x2f, 0x2f, 0x20, 0x70, 0x69, 
+	0x78, 0x65, 0x6c, 0x73, 0x20, 0x28, 0x6e, 0x20, 0x3d, 0x20, 0x31, 
+	0x36, 0x29, 0x2c, 0x20, 0x77, 0x68, 0x69, 0x63, 0x68, 0x20, 0x69, 
+	0x73, 0x20, 0x68, 0x6f, 0x77, 0x20, 0x6c, 0x69, 0x62, 0x6a, 0x70, 
+	0x65, 0x67, 0x20, 0x75, 0x70, 0x73, 0x61, 0x6d, 0x70, 0x6c, 0x65, 
+	0x73, 0x20, 0x74, 0x68, 0x65, 0x6d, 0x20, 0x74, 0x6f, 0x6f, 0x20, 
+	0x28, 0x44, 0x43, 0x54, 0x20, 0x73, 0x63, 0x61, 0x6c, 0x69, 0x6e, 
+	0x67, 0x29, 0x2e, 0x0d, 0x0a, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 
+	0x69, 0x64, 0x63, 0x74, 0x5f, 0x62, 0x61, 0x73, 0x69, 0x73, 0x28, 
+	0x69, 0x6e, 0x74, 0x20, 0x78, 0x2c, 0x20, 0x69, 0x6e, 0x74, 0x20, 
+	0x75, 0x2c, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x6e, 0x29, 0x20, 0x7b, 
+	0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 
+	0x6e, 0x20, 0x28, 0x28, 0x75, 0x20, 0x3d, 0x3d, 0x20, 0x30, 0x29, 
+	0x20, 0x3f, 0x20, 0x73, 0x71, 0x72, 0x74, 0x28, 0x30, 0x2e, 0x31, 
+	0x32, 0x35, 0x66, 0x29, 0x20, 0x3a, 0x20, 0x30, 0x2e, 0x35, 0x66, 
+	0x29, 0x20, 0x2a, 0x20, 0x63, 0x6f, 0x73, 0x28, 0x66, 0x6c, 0x6f, 
+	0x61, 0x74, 0x28, 0x28, 0x32, 0x20, 0x2a, 0x20, 0x78, 0x20, 0x2b, 
+	0x20, 0x31, 0x29, 0x20, 0x2a, 0x20, 0x75, 0x29, 0x20, 0x2a, 0x20, 
+	0x28, 0x33, 0x2e, 0x31, 0x34, 0x31, 0x35, 0x39, 0x32, 0x36, 0x35, 
+	0x66, 0x20, 0x2f, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x28, 0x32, 
+	0x20, 0x2a, 0x20, 0x6e, 0x29, 0x29, 0x29, 0x3b, 0x0d, 0x0a, 0x7d, 
+	0x0d, 0x0a, 0x0d, 0x0a, 0x2f, 0x2f, 0x20, 0x4c, 0x65, 0x76, 0x65, 
+	0x6c, 0x20, 0x73, 0x68, 0x69, 0x66, 0x74, 0x20, 0x61, 0x6e, 0x64, 
+	0x20, 0x72, 0x61, 0x6e, 0x67, 0x65, 0x20, 0x6c, 0x69, 0x6d, 0x69, 
+	0x74, 0x2c, 0x20, 0x6c, 0x69, 0x6b, 0x65, 0x20, 0x6c, 0x69, 0x62, 
+	0x6a, 0x70, 0x65, 0x67, 0x20, 0x64, 0x6f, 0x65, 0x73, 0x20, 0x62, 
+	0x65, 0x66, 0x6f, 0x72, 0x65, 0x20, 0x74, 0x68, 0x65, 0x20, 0x63, 
+	0x6f, 0x6c, 0x6f, 0x72, 0x20, 0x63, 0x6f, 0x6e, 0x76, 0x65, 0x72, 
+	0x73, 0x69, 0x6f, 0x6e, 0x0d, 0x0a, 0x66, 0x6c, 0x6f, 0x61, 0x74, 
+	0x20, 0x74, 0x6f, 0x5f, 0x73, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x28, 
+	0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 
+	0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 
+	0x74, 0x75, 0x72, 0x6e, 0x20, 0x63, 0x6c, 0x61, 0x6d, 0x70, 0x28, 
+	0x66, 0x6c, 0x6f, 0x6f, 0x72, 0x28, 0x76, 0x61, 0x6c, 0x75, 0x65, 
+	0x20, 0x2b, 0x20, 0x31, 0x32, 0x38, 0x2e, 0x35, 0x66, 0x29, 0x2c, 
+	0x20, 0x30, 0x2e, 0x30, 0x66, 0x2c, 0x20, 0x32, 0x35, 0x35, 0x2e, 
+	0x30, 0x66, 0x29, 0x20, 0x2a, 0x20, 0x28, 0x31, 0x2e, 0x30, 0x66, 
+	0x20, 0x2f, 0x20, 0x32, 0x35, 0x35, 0x2e, 0x30, 0x66, 0x29, 0x3b, 
+	0x0d, 0x0a, 0x7d, 0x0d, 0x0a, 0x0d, 0x0a, 0x76, 0x6f, 0x69, 0x64, 
+	0x20, 0x64, 0x65, 0x63, 0x6f, 0x64, 0x65, 0x5f, 0x6d, 0x63, 0x75, 
+	0x28, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 
+	0x6e, 0x74, 0x20, 0x78, 0x20, 0x3d, 0x20, 0x69, 0x6e, 0x74, 0x28, 
+	0x67, 0x6c, 0x5f, 0x4c, 0x6f, 0x63, 0x61, 0x6c, 0x49, 0x6e, 0x76, 
+	0x6f, 0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x49, 0x44, 0x2e, 0x78, 
+	0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 0x6e, 0x74, 
+	0x20, 0x79, 0x20, 0x3d, 0x20, 0x69, 0x6e, 0x74, 0x28, 0x67, 0x6c, 
+	0x5f, 0x4c, 0x6f, 0x63, 0x61, 0x6c, 0x49, 0x6e, 0x76, 0x6f, 0x63, 
+	0x61, 0x74, 0x69, 0x6f, 0x6e, 0x49, 0x44, 0x2e, 0x79, 0x29, 0x3b, 
+	0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x74, 
+	0x20, 0x3d, 0x20, 0x79, 0x20, 0x2a, 0x20, 0x31, 0x36, 0x20, 0x2b, 
+	0x20, 0x78, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 0x76, 
+	0x65, 0x63, 0x32, 0x20, 0x6d, 0x63, 0x75, 0x20, 0x3d, 0x20, 0x69, 
+	0x76, 0x65, 0x63, 0x32, 0x28, 0x67, 0x6c, 0x5f, 0x57, 0x6f, 0x72, 
+	0x6b, 0x47, 0x72, 0x6f, 0x75, 0x70, 0x49, 0x44, 0x2e, 0x78, 0x79, 
+	0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 0x6e, 0x74, 
+	0x20, 0x6c, 0x75, 0x6d, 0x61, 0x5f, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 
+	0x73, 0x5f, 0x70, 0x65, 0x72, 0x5f, 0x72, 0x6f, 0x77, 0x20, 0x3d, 
+	0x20, 0x64, 0x69, 0x6d, 0x20, 0x2f, 0x20, 0x38, 0x3b, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x6c, 0x75, 0x6d, 
+	0x61, 0x5f, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x5f, 0x63, 0x6f, 0x75, 
+	0x6e, 0x74, 0x20, 0x3d, 0x20, 0x6c, 0x75, 0x6d, 0x61, 0x5f, 0x62, 
+	0x6c, 0x6f, 0x63, 0x6b, 0x73, 0x5f, 0x70, 0x65, 0x72, 0x5f, 0x72, 
+	0x6f, 0x77, 0x20, 0x2a, 0x20, 0x6c, 0x75, 0x6d, 0x61, 0x5f, 0x62, 
+	0x6c, 0x6f, 0x63, 0x6b, 0x73, 0x5f, 0x70, 0x65, 0x72, 0x5f, 0x72, 
+	0x6f, 0x77, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 0x6e, 
+	0x74, 0x20, 0x63, 0x68, 0x72, 0x6f, 0x6d, 0x61, 0x5f, 0x62, 0x6c, 
+	0x6f, 0x63, 0x6b, 0x73, 0x5f, 0x70, 0x65, 0x72, 0x5f, 0x72, 0x6f, 
+	0x77, 0x20, 0x3d, 0x20, 0x64, 0x69, 0x6d, 0x20, 0x2f, 0x20, 0x31, 
+	0x36, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 0x6e, 0x74, 
+	0x20, 0x63, 0x68, 0x72, 0x6f, 0x6d, 0x61, 0x5f, 0x62, 0x6c, 0x6f, 
+	0x63, 0x6b, 0x5f, 0x63, 0x6f, 0x75, 0x6e, 0x74, 0x20, 0x3d, 0x20, 
+	0x63, 0x68, 0x72, 0x6f, 0x6d, 0x61, 0x5f, 0x62, 0x6c, 0x6f, 0x63, 
+	0x6b, 0x73, 0x5f, 0x70, 0x65, 0x72, 0x5f, 0x72, 0x6f, 0x77, 0x20, 
+	0x2a, 0x20, 0x63, 0x68, 0x72, 0x6f, 0x6d, 0x61, 0x5f, 0x62, 0x6c, 
+	0x6f, 0x63, 0x6b, 0x73, 0x5f, 0x70, 0x65, 0x72, 0x5f, 0x72, 0x6f, 
+	0x77, 0x3b, 0x0d, 0x0a, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x2f, 
+	0x2f, 0x20, 0x44, 0x65, 0x71, 0x75, 0x61, 0x6e, 0x74, 0x69, 0x7a, 
+	0x65, 0x20, 0x74, 0x68, 0x65, 0x20, 0x33, 0x38, 0x34, 0x20, 0x63, 
+	0x6f, 0x65, 0x66, 0x66, 0x69, 0x63, 0x69, 0x65, 0x6e, 0x74, 0x73, 
+	0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x4d, 0x43, 0x55, 
+	0x3a, 0x20, 0x6f, 0x6e, 0x65, 0x20, 0x6f, 0x72, 0x20, 0x74, 0x77, 
+	0x6f, 0x20, 0x70, 0x65, 0x72, 0x20, 0x69, 0x6e, 0x76, 0x6f, 0x63, 
+	0x61, 0x74, 0x69, 0x6f, 0x6e, 0x2e, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x66, 0x6f, 0x72, 0x20, 0x28, 0x69, 0x6e, 0x74, 0x20, 0x69, 
+	0x20, 0x3d, 0x20, 0x74, 0x3b, 0x20, 0x69, 0x20, 0x3c, 0x20, 0x36, 
+	0x20, 0x2a, 0x20, 0x36, 0x34, 0x3b, 0x20, 0x69, 0x20, 0x2b, 0x3d, 
+	0x20, 0x32, 0x35, 0x36, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x62, 
+	0x6c, 0x6f, 0x63, 0x6b, 0x20, 0x3d, 0x20, 0x69, 0x20, 0x2f, 0x20, 
+	0x36, 0x34, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x6b, 0x20, 0x3d, 0x20, 0x69, 
+	0x20, 0x25, 0x20, 0x36, 0x34, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x63, 0x6f, 
+	0x6d, 0x70, 0x6f, 0x6e, 0x65, 0x6e, 0x74, 0x20, 0x3d, 0x20, 0x6d, 
+	0x61, 0x78, 0x28, 0x30, 0x2c, 0x20, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 
+	0x20, 0x2d, 0x20, 0x33, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x62, 0x6c, 
+	0x6f, 0x63, 0x6b, 0x5f, 0x69, 0x6e, 0x64, 0x65, 0x78, 0x3b, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 
+	0x20, 0x28, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x20, 0x3c, 0x20, 0x34, 
+	0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x76, 0x65, 0x63, 0x32, 
+	0x20, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 0x73, 0x20, 
+	0x3d, 0x20, 0x6d, 0x63, 0x75, 0x20, 0x2a, 0x20, 0x32, 0x20, 0x2b, 
+	0x20, 0x69, 0x76, 0x65, 0x63, 0x32, 0x28, 0x62, 0x6c, 0x6f, 0x63, 
+	0x6b, 0x20, 0x26, 0x20, 0x31, 0x2c, 0x20, 0x62, 0x6c, 0x6f, 0x63, 
+	0x6b, 0x20, 0x3e, 0x3e, 0x20, 0x31, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x5f, 0x69, 0x6e, 0x64, 0x65, 0x78, 
+	0x20, 0x3d, 0x20, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x5f, 0x70, 0x6f, 
+	0x73, 0x2e, 0x79, 0x20, 0x2a, 0x20, 0x6c, 0x75, 0x6d, 0x61, 0x5f, 
+	0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x73, 0x5f, 0x70, 0x65, 0x72, 0x5f, 
+	0x72, 0x6f, 0x77, 0x20, 0x2b, 0x20, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 
+	0x5f, 0x70, 0x6f, 0x73, 0x2e, 0x78, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x7d, 0x20, 0x65, 0x6c, 0x73, 
+	0x65, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 
+	0x5f, 0x69, 0x6e, 0x64, 0x65, 0x78, 0x20, 0x3d, 0x20, 0x6c, 0x75, 
+	0x6d, 0x61, 0x5f, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x5f, 0x63, 0x6f, 
+	0x75, 0x6e, 0x74, 0x20, 0x2b, 0x20, 0x28, 0x63, 0x6f, 0x6d, 0x70, 
+	0x6f, 0x6e, 0x65, 0x6e, 0x74, 0x20, 0x2d, 0x20, 0x31, 0x29, 0x20, 
+	0x2a, 0x20, 0x63, 0x68, 0x72, 0x6f, 0x6d, 0x61, 0x5f, 0x62, 0x6c, 
+	0x6f, 0x63, 0x6b, 0x5f, 0x63, 0x6f, 0x75, 0x6e, 0x74, 0x20, 0x2b, 
+	0x20, 0x6d, 0x63, 0x75, 0x2e, 0x79, 0x20, 0x2a, 0x20, 0x63, 0x68, 
+	0x72, 0x6f, 0x6d, 0x61, 0x5f, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x73, 
+	0x5f, 0x70, 0x65, 0x72, 0x5f, 0x72, 0x6f, 0x77, 0x20, 0x2b, 0x20, 
+	0x6d, 0x63, 0x75, 0x2e, 0x78, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x7d, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 
+	0x71, 0x75, 0x61, 0x6e, 0x74, 0x20, 0x3d, 0x20, 0x66, 0x6c, 0x6f, 
+	0x61, 0x74, 0x28, 0x67, 0x65, 0x74, 0x5f, 0x31, 0x36, 0x5f, 0x62, 
+	0x69, 0x74, 0x73, 0x28, 0x63, 0x6f, 0x6d, 0x70, 0x6f, 0x6e, 0x65, 
+	0x6e, 0x74, 0x20, 0x2a, 0x20, 0x36, 0x34, 0x20, 0x2b, 0x20, 0x6b, 
+	0x2c, 0x20, 0x66, 0x61, 0x6c, 0x73, 0x65, 0x29, 0x29, 0x3b, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x63, 0x6f, 
+	0x65, 0x66, 0x66, 0x69, 0x63, 0x69, 0x65, 0x6e, 0x74, 0x73, 0x5b, 
+	0x69, 0x5d, 0x20, 0x3d, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x28, 
+	0x67, 0x65, 0x74, 0x5f, 0x31, 0x36, 0x5f, 0x62, 0x69, 0x74, 0x73, 
+	0x28, 0x51, 0x55, 0x41, 0x4e, 0x54, 0x5f, 0x54, 0x41, 0x42, 0x4c, 
+	0x45, 0x53, 0x5f, 0x53, 0x49, 0x5a, 0x45, 0x20, 0x2b, 0x20, 0x62, 
+	0x6c, 0x6f, 0x63, 0x6b, 0x5f, 0x69, 0x6e, 0x64, 0x65, 0x78, 0x20, 
+	0x2a, 0x20, 0x36, 0x34, 0x20, 0x2b, 0x20, 0x6b, 0x2c, 0x20, 0x74, 
+	0x72, 0x75, 0x65, 0x29, 0x29, 0x20, 0x2a, 0x20, 0x71, 0x75, 0x61, 
+	0x6e, 0x74, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x7d, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x62, 0x61, 0x72, 0x72, 0x69, 0x65, 
+	0x72, 0x28, 0x29, 0x3b, 0x0d, 0x0a, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x2f, 0x2f, 0x20, 0x48, 0x6f, 0x72, 0x69, 0x7a, 0x6f, 0x6e, 
+	0x74, 0x61, 0x6c, 0x20, 0x70, 0x61, 0x73, 0x73, 0x3a, 0x20, 0x65, 
+	0x61, 0x63, 0x68, 0x20, 0x69, 0x6e, 0x76, 0x6f, 0x63, 0x61, 0x74, 
+	0x69, 0x6f, 0x6e, 0x20, 0x63, 0x6f, 0x6d, 0x70, 0x75, 0x74, 0x65, 
+	0x73, 0x20, 0x6f, 0x6e, 0x65, 0x20, 0x76, 0x61, 0x6c, 0x75, 0x65, 
+	0x20, 0x6f, 0x66, 0x20, 0x61, 0x20, 0x59, 0x20, 0x72, 0x6f, 0x77, 
+	0x2c, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x6f, 0x6e, 0x65, 0x20, 0x76, 
+	0x61, 0x6c, 0x75, 0x65, 0x20, 0x6f, 0x66, 0x20, 0x61, 0x20, 0x28, 
+	0x31, 0x36, 0x20, 0x77, 0x69, 0x64, 0x65, 0x29, 0x20, 0x63, 0x68, 
+	0x72, 0x6f, 0x6d, 0x61, 0x20, 0x72, 0x6f, 0x77, 0x2e, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x62, 0x6c, 0x6f, 
+	0x63, 0x6b, 0x20, 0x3d, 0x20, 0x74, 0x20, 0x2f, 0x20, 0x36, 0x34, 
+	0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x69, 0x6e, 0x74, 0x20, 0x76, 0x20, 0x3d, 0x20, 0x28, 0x74, 0x20, 
+	0x25, 0x20, 0x36, 0x34, 0x29, 0x20, 0x2f, 0x20, 0x38, 0x3b, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x69, 0x6e, 
+	0x74, 0x20, 0x70, 0x78, 0x20, 0x3d, 0x20, 0x74, 0x20, 0x25, 0x20, 
+	0x38, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x73, 0x75, 0x6d, 0x20, 
+	0x3d, 0x20, 0x30, 0x2e, 0x30, 0x66, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6f, 0x72, 0x20, 0x28, 
+	0x69, 0x6e, 0x74, 0x20, 0x75, 0x20, 0x3d, 0x20, 0x30, 0x3b, 0x20, 
+	0x75, 0x20, 0x3c, 0x20, 0x38, 0x3b, 0x20, 0x2b, 0x2b, 0x75, 0x29, 
+	0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x73, 0x75, 0x6d, 0x20, 0x2b, 0x3d, 
+	0x20, 0x69, 0x64, 0x63, 0x74, 0x5f, 0x62, 0x61, 0x73, 0x69, 0x73, 
+	0x28, 0x70, 0x78, 0x2c, 0x20, 0x75, 0x2c, 0x20, 0x38, 0x29, 0x20, 
+	0x2a, 0x20, 0x63, 0x6f, 0x65, 0x66, 0x66, 0x69, 0x63, 0x69, 0x65, 
+	0x6e, 0x74, 0x73, 0x5b, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x20, 0x2a, 
+	0x20, 0x36, 0x34, 0x20, 0x2b, 0x20, 0x76, 0x20, 0x2a, 0x20, 0x38, 
+	0x20, 0x2b, 0x20, 0x75, 0x5d, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x7d, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x75, 0x6d, 0x61, 0x5f, 0x72, 
+	0x6f, 0x77, 0x73, 0x5b, 0x74, 0x5d, 0x20, 0x3d, 0x20, 0x73, 0x75, 
+	0x6d, 0x3b, 0x0d, 0x0a, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x63, 0x68, 0x72, 0x6f, 
+	0x6d, 0x61, 0x20, 0x3d, 0x20, 0x74, 0x20, 0x2f, 0x20, 0x31, 0x32, 
+	0x38, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x76, 0x20, 0x3d, 0x20, 0x28, 0x74, 0x20, 0x25, 0x20, 0x31, 
+	0x32, 0x38, 0x29, 0x20, 0x2f, 0x20, 0x31, 0x36, 0x3b, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x78, 0x20, 
+	0x3d, 0x20, 0x74, 0x20, 0x25, 0x20, 0x31, 0x36, 0x3b, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x73, 0x75, 0x6d, 
+	0x20, 0x3d, 0x20, 0x30, 0x2e, 0x30, 0x66, 0x3b, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6f, 0x72, 0x20, 
+	0x28, 0x69, 0x6e, 0x74, 0x20, 0x75, 0x20, 0x3d, 0x20, 0x30, 0x3b, 
+	0x20, 0x75, 0x20, 0x3c, 0x20, 0x38, 0x3b, 0x20, 0x2b, 0x2b, 0x75, 
+	0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x73, 0x75, 0x6d, 0x20, 0x2b, 
+	0x3d, 0x20, 0x69, 0x64, 0x63, 0x74, 0x5f, 0x62, 0x61, 0x73, 0x69, 
+	0x73, 0x28, 0x70, 0x78, 0x2c, 0x20, 0x75, 0x2c, 0x20, 0x31, 0x36, 
+	0x29, 0x20, 0x2a, 0x20, 0x63, 0x6f, 0x65, 0x66, 0x66, 0x69, 0x63, 
+	0x69, 0x65, 0x6e, 0x74, 0x73, 0x5b, 0x28, 0x34, 0x20, 0x2b, 0x20, 
+	0x63, 0x68, 0x72, 0x6f, 0x6d, 0x61, 0x29, 0x20, 0x2a, 0x20, 0x36, 
+	0x34, 0x20, 0x2b, 0x20, 0x76, 0x20, 0x2a, 0x20, 0x38, 0x20, 0x2b, 
+	0x20, 0x75, 0x5d, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x7d, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x63, 0x68, 0x72, 0x6f, 0x6d, 0x61, 0x5f, 0x72, 
+	0x6f, 0x77, 0x73, 0x5b, 0x74, 0x5d, 0x20, 0x3d, 0x20, 0x73, 0x75, 
+	0x6d, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x7d, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x62, 0x61, 0x72, 0x72, 0x69, 0x65, 0x72, 
+	0x28, 0x29, 0x3b, 0x0d, 0x0a, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+	0x2f, 0x2f, 0x20, 0x56, 0x65, 0x72, 0x74, 0x69, 0x63, 0x61, 0x6c, 
+	0x20, 0x70, 0x61, 0x73, 0x73, 0x3a, 0x20, 0x65, 0x61, 0x63, 0x68, 
+	0x20, 0x69, 0x6e, 0x76, 0x6f, 0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e, 
+	0x20, 0x63, 0x6f, 0x6d, 0x70, 0x75, 0x74, 0x65, 0x73, 0x20, 0x74, 
+	0x68, 0x65, 0x20, 0x59, 0x2c, 0x20, 0x43, 0x62, 0x20, 0x61, 0x6e, 
+	0x64, 0x20, 0x43, 0x72, 0x20, 0x6f, 0x66, 0x20, 0x69, 0x74, 0x73, 
+	0x20, 0x70, 0x69, 0x78, 0x65, 0x6c, 0x2e, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 
+	0x20, 0x3d, 0x20, 0x28, 0x79, 0x20, 0x2f, 0x20, 0x38, 0x29, 0x20, 
+	0x2a, 0x20, 0x32, 0x20, 0x2b, 0x20, 0x78, 0x20, 0x2f, 0x20, 0x38, 
+	0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61, 
+	0x74, 0x20, 0x6c, 0x75, 0x6d, 0x61, 0x20, 0x3d, 0x20, 0x30, 0x2e, 
+	0x30, 0x66, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 
+	0x6f, 0x61, 0x74, 0x20, 0x63, 0x62, 0x20, 0x3d, 0x20, 0x30, 0x2e, 
+	0x30, 0x66, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 
+	0x6f, 0x61, 0x74, 0x20, 0x63, 0x72, 0x20, 0x3d, 0x20, 0x30, 0x2e, 
+	0x30, 0x66, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6f, 
+	0x72, 0x20, 0x28, 0x69, 0x6e, 0x74, 0x20, 0x76, 0x20, 0x3d, 0x20, 
+	0x30, 0x3b, 0x20, 0x76, 0x20, 0x3c, 0x20, 0x38, 0x3b, 0x20, 0x2b, 
+	0x2b, 0x76, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x6c, 0x75, 0x6d, 0x61, 0x20, 0x2b, 0x3d, 
+	0x20, 0x69, 0x64, 0x63, 0x74, 0x5f, 0x62, 0x61, 0x73, 0x69, 0x73, 
+	0x28, 0x79, 0x20, 0x25, 0x20, 0x38, 0x2c, 0x20, 0x76, 0x2c, 0x20, 
+	0x38, 0x29, 0x20, 0x2a, 0x20, 0x6c, 0x75, 0x6d, 0x61, 0x5f, 0x72, 
+	0x6f, 0x77, 0x73, 0x5b, 0x62, 0x6c, 0x6f, 0x63, 0x6b, 0x20, 0x2a, 
+	0x20, 0x36, 0x34, 0x20, 0x2b, 0x20, 0x76, 0x20, 0x2a, 0x20, 0x38, 
+	0x20, 0x2b, 0x20, 0x78, 0x20, 0x25, 0x20, 0x38, 0x5d, 0x3b, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 
+	0x6f, 0x61, 0x74, 0x20, 0x62, 0x61, 0x73, 0x69, 0x73, 0x20, 0x3d, 
+	0x20, 0x69, 0x64, 0x63, 0x74, 0x5f, 0x62, 0x61, 0x73, 0x69, 0x73, 
+	0x28, 0x79, 0x2c, 0x20, 0x76, 0x2c, 0x20, 0x31, 0x36, 0x29, 0x3b, 
+	0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x63, 
+	0x62, 0x20, 0x2b, 0x3d, 0x20, 0x62, 0x61, 0x73, 0x69, 0x73, 0x20, 
+	0x2a, 0x20, 0x63, 0x68, 0x72, 0x6f, 0x6d, 0x61, 0x5f, 0x72, 0x6f, 
+	0x77, 0x73, 0x5b, 0x76, 0x20, 0x2a, 0x20, 0x31, 0x36, 0x20, 0x2b, 
+	0x20, 0x78, 0x5d, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x63, 0x72, 0x20, 0x2b, 0x3d, 0x20, 0x62, 0x61, 
+	0x73, 0x69, 0x73, 0x20, 0x2a, 0x20, 0x63, 0x68, 0x72, 0x6f, 0x6d, 
+	0x61, 0x5f, 0x72, 0x6f, 0x77, 0x73, 0x5b, 0x31, 0x32, 0x38, 0x20, 
+	0x2b, 0x20, 0x76, 0x20, 0x2a, 0x20, 0x31, 0x36, 0x20, 0x2b, 0x20, 
+	0x78, 0x5d, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x7d, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x75, 0x6d, 0x61, 0x20, 0x3d, 
+	0x20, 0x74, 0x6f, 0x5f, 0x73, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x28, 
+	0x6c, 0x75, 0x6d, 0x61, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x63, 0x62, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x5f, 0x73, 0x61, 
+	0x6d, 0x70, 0x6c, 0x65, 0x28, 0x63, 0x62, 0x29, 0x20, 0x2d, 0x20, 
+	0x31, 0x32, 0x38, 0x2e, 0x30, 0x66, 0x20, 0x2f, 0x20, 0x32, 0x35, 
+	0x35, 0x2e, 0x30, 0x66, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+	0x63, 0x72, 0x20, 0x3d, 0x20, 0x74, 0x6f, 0x5f, 0x73, 0x61, 0x6d, 
+	0x70, 0x6c, 0x65, 0x28, 0x63, 0x72, 0x29, 0x20, 0x2d, 0x20, 0x31, 
+	0x32, 0x38, 0x2e, 0x30, 0x66, 0x20, 0x2f, 0x20, 0x32, 0x35, 0x35, 
+	0x2e, 0x30, 0x66, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x2f, 
+	0x2f, 0x20, 0x46, 0x75, 0x6c, 0x6c, 0x20, 0x72, 0x61, 0x6e, 0x67, 
+	0x65, 0x20, 0x59, 0x43, 0x62, 0x43, 0x72, 0x20, 0x28, 0x4a, 0x46, 
+	0x49, 0x46, 0x29, 0x2c, 0x20, 0x74, 0x68, 0x65, 0x20, 0x73, 0x61, 
+	0x6d, 0x65, 0x20, 0x61, 0x73, 0x20, 0x69, 0x6e, 0x20, 0x74, 0x69, 
+	0x6c, 0x65, 0x2e, 0x66, 0x72, 0x61, 0x67, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x76, 0x65, 0x63, 0x33, 0x20, 0x72, 0x67, 0x62, 0x20, 
+	0x3d, 0x20, 0x76, 0x65, 0x63, 0x33, 0x28, 0x6c, 0x75, 0x6d, 0x61, 
+	0x20, 0x2b, 0x20, 0x31, 0x2e, 0x34, 0x30, 0x32, 0x66, 0x20, 0x2a, 
+	0x20, 0x63, 0x72, 0x2c, 0x20, 0x6c, 0x75, 0x6d, 0x61, 0x20, 0x2d, 
+	0x20, 0x30, 0x2e, 0x33, 0x34, 0x34, 0x31, 0x33, 0x36, 0x66, 0x20, 
+	0x2a, 0x20, 0x63, 0x62, 0x20, 0x2d, 0x20, 0x30, 0x2e, 0x37, 0x31, 
+	0x34, 0x31, 0x33, 0x36, 0x66, 0x20, 0x2a, 0x20, 0x63, 0x72, 0x2c, 
+	0x20, 0x6c, 0x75, 0x6d, 0x61, 0x20, 0x2b, 0x20, 0x31, 0x2e, 0x37, 
+	0x37, 0x32, 0x66, 0x20, 0x2a, 0x20, 0x63, 0x62, 0x29, 0x3b, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x53, 
+	0x74, 0x6f, 0x72, 0x65, 0x28, 0x74, 0x69, 0x6c, 0x65, 0x5f, 0x69, 
+	0x6d, 0x61, 0x67, 0x65, 0x2c, 0x20, 0x69, 0x76, 0x65, 0x63, 0x33, 
+	0x28, 0x67, 0x6c, 0x5f, 0x47, 0x6c, 0x6f, 0x62, 0x61, 0x6c, 0x49, 
+	0x6e, 0x76, 0x6f, 0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x49, 0x44, 
+	0x2e, 0x78, 0x79, 0x2c, 0x20, 0x6c, 0x61, 0x79, 0x65, 0x72, 0x29, 
+	0x2c, 0x20, 0x76, 0x65, 0x63, 0x34, 0x28, 0x63, 0x6c, 0x61, 0x6d, 
+	0x70, 0x28, 0x72, 0x67, 0x62, 0x2c, 0x20, 0x30, 0x2e, 0x30, 0x66, 
+	0x2c, 0x20, 0x31, 0x2e, 0x30, 0x66, 0x29, 0x2c, 0x20, 0x31, 0x2e, 
+	0x30, 0x66, 0x29, 0x29, 0x3b, 0x0d, 0x0a, 0x7d, 0x0d, 0x0a, 0x0d, 
+	0x0a, 0x76, 0x6f, 0x69, 0x64, 0x20, 0x62, 0x75, 0x69, 0x6c, 0x64, 
+	0x5f, 0x6d, 0x69, 0x70, 0x5f, 0x6c, 0x65, 0x76, 0x65, 0x6c, 0x28, 
+	0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 0x76, 
+	0x65, 0x63, 0x32, 0x20, 0x70, 0x6f, 0x73, 0x20, 0x3d, 0x20, 0x69, 
+	0x76, 0x65, 0x63, 0x32, 0x28, 0x67, 0x6c, 0x5f, 0x47, 0x6c, 0x6f, 
+	0x62, 0x61, 0x6c, 0x49, 0x6e, 0x76, 0x6f, 0x63, 0x61, 0x74, 0x69, 
+	0x6f, 0x6e, 0x49, 0x44, 0x2e, 0x78, 0x79, 0x29, 0x3b, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x69, 0x76, 0x65, 0x63, 0x32, 0x20, 0x73, 
+	0x6f, 0x75, 0x72, 0x63, 0x65, 0x5f, 0x70, 0x6f, 0x73, 0x20, 0x3d, 
+	0x20, 0x70, 0x6f, 0x73, 0x20, 0x2a, 0x20, 0x32, 0x3b, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x34, 0x20, 0x73, 0x75, 
+	0x6d, 0x20, 0x3d, 0x20, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x4c, 0x6f, 
+	0x61, 0x64, 0x28, 0x74, 0x69, 0x6c, 0x65, 0x5f, 0x69, 0x6d, 0x61, 
+	0x67, 0x65, 0x2c, 0x20, 0x69, 0x76, 0x65, 0x63, 0x33, 0x28, 0x73, 
+	0x6f, 0x75, 0x72, 0x63, 0x65, 0x5f, 0x70, 0x6f, 0x73, 0x2c, 0x20, 
+	0x6c, 0x61, 0x79, 0x65, 0x72, 0x29, 0x29, 0x20, 0x2b, 0x20, 0x69, 
+	0x6d, 0x61, 0x67, 0x65, 0x4c, 0x6f, 0x61, 0x64, 0x28, 0x74, 0x69, 
+	0x6c, 0x65, 0x5f, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x2c, 0x20, 0x69, 
+	0x76, 0x65, 0x63, 0x33, 0x28, 0x73, 0x6f, 0x75, 0x72, 0x63, 0x65, 
+	0x5f, 0x70, 0x6f, 0x73, 0x20, 0x2b, 0x20, 0x69, 0x76, 0x65, 0x63, 
+	0x32, 0x28, 0x31, 0x2c, 0x20, 0x30, 0x29, 0x2c, 0x20, 0x6c, 0x61, 
+	0x79, 0x65, 0x72, 0x29, 0x29, 0x20, 0x2b, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x4c, 0x6f, 0x61, 0x64, 
+	0x28, 0x74, 0x69, 0x6c, 0x65, 0x5f, 0x69, 0x6d, 0x61, 0x67, 0x65, 
+	0x2c, 0x20, 0x69, 0x76, 0x65, 0x63, 0x33, 0x28, 0x73, 0x6f, 0x75, 
+	0x72, 0x63, 0x65, 0x5f, 0x70, 0x6f, 0x73, 0x20, 0x2b, 0x20, 0x69, 
+	0x76, 0x65, 0x63, 0x32, 0x28, 0x30, 0x2c, 0x20, 0x31, 0x29, 0x2c, 
+	0x20, 0x6c, 0x61, 0x79, 0x65, 0x72, 0x29, 0x29, 0x20, 0x2b, 0x20, 
+	0x69, 0x6d, 0x61, 0x67, 0x65, 0x4c, 0x6f, 0x61, 0x64, 0x28, 0x74, 
+	0x69, 0x6c, 0x65, 0x5f, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x2c, 0x20, 
+	0x69, 0x76, 0x65, 0x63, 0x33, 0x28, 0x73, 0x6f, 0x75, 0x72, 0x63, 
+	0x65, 0x5f, 0x70, 0x6f, 0x73, 0x20, 0x2b, 0x20, 0x69, 0x76, 0x65, 
+	0x63, 0x32, 0x28, 0x31, 0x2c, 0x20, 0x31, 0x29, 0x2c, 0x20, 0x6c, 
+	0x61, 0x79, 0x65, 0x72, 0x29, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 
+	0x20, 0x20, 0x69, 0x6d, 0x61, 0x67, 0x65, 0x53, 0x74, 0x6f, 0x72, 
+	0x65, 0x28, 0x74, 0x69, 0x6c, 0x65, 0x5f, 0x6d, 0x69, 0x70, 0x5f, 
+	0x69, 0x6d, 0x61, 0x67, 0x65, 0x2c, 0x20, 0x69, 0x76, 0x65, 0x63, 
+	0x33, 0x28, 0x70, 0x6f, 0x73, 0x2c, 0x20, 0x6c, 0x61, 0x79, 0x65, 
+	0x72, 0x29, 0x2c, 0x20, 0x73, 0x75, 0x6d, 0x20, 0x2a, 0x20, 0x30, 
+	0x2e, 0x32, 0x35, 0x66, 0x29, 0x3b, 0x0d, 0x0a, 0x7d, 0x0d, 0x0a, 
+	0x0d, 0x0a, 0x76, 0x6f, 0x69, 0x64, 0x20, 0x6d, 0x61, 0x69, 0x6e, 
+	0x28, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x2f, 
+	0x2f, 0x20, 0x28, 0x74, 0x68, 0x65, 0x20, 0x73, 0x74, 0x61, 0x67, 
+	0x65, 0x20, 0x69, 0x73, 0x20, 0x74, 0x68, 0x65, 0x20, 0x73, 0x61, 
+	0x6d, 0x65, 0x20, 0x66, 0x6f, 0x72, 0x20, 0x61, 0x6c, 0x6c, 0x20, 
+	0x69, 0x6e, 0x76, 0x6f, 0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x73, 
+	0x2c, 0x20, 0x77, 0x68, 0x69, 0x63, 0x68, 0x20, 0x6b, 0x65, 0x65, 
+	0x70, 0x73, 0x20, 0x74, 0x68, 0x65, 0x20, 0x62, 0x61, 0x72, 0x72, 
+	0x69, 0x65, 0x72, 0x73, 0x20, 0x69, 0x6e, 0x20, 0x64, 0x65, 0x63, 
+	0x6f, 0x64, 0x65, 0x5f, 0x6d, 0x63, 0x75, 0x28, 0x29, 0x20, 0x69, 
+	0x6e, 0x20, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 0x20, 0x63, 
+	0x6f, 0x6e, 0x74, 0x72, 0x6f, 0x6c, 0x20, 0x66, 0x6c, 0x6f, 0x77, 
+	0x29, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x28, 
+	0x73, 0x74, 0x61, 0x67, 0x65, 0x20, 0x3d, 0x3d, 0x20, 0x30, 0x29, 
+	0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x64, 0x65, 0x63, 0x6f, 0x64, 0x65, 0x5f, 0x6d, 0x63, 0x75, 
+	0x28, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x7d, 0x20, 
+	0x65, 0x6c, 0x73, 0x65, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x62, 0x75, 0x69, 0x6c, 0x64, 0x5f, 
+	0x6d, 0x69, 0x70, 0x5f, 0x6c, 0x65, 0x76, 0x65, 0x6c, 0x28, 0x29, 
+	0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x7d, 0x0d, 0x0a, 0x7d, 
+	0x0d, 0x0a, 0
+};
+
+const char stringified_shader_source__tile_histogram_comp[2045] = {
+	0x23, 0x76, 0x65, 0x72, 0x73, 0x69, 0x6f, 0x6e, 0x20, 0x34, 0x33, 
+	0x30, 0x0d, 0x0a, 0x0d, 0x0a, 0x2f, 0x2f, 0x20, 0x41, 0x64, 0x64, 
+	0x73, 0x20, 0x74, 0x68, 0x65, 0x20, 0x6c, 0x75, 0x6d, 0x69, 0x6e, 
+	0x61, 0x6e, 0x63, 0x65, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x69, 0x6c, 
+	0x65, 0x73, 0x20, 0x74, 0x6f, 0x20, 0x61, 0x20, 0x68, 0x69, 0x73, 
+	0x74, 0x6f, 0x67, 0x72, 0x61, 0x6d, 0x2c, 0x20, 0x66, 0x6f, 0x72, 
+	0x20, 0x61, 0x75, 0x74, 0x6f, 0x2d, 0x6c, 0x65, 0x76, 0x65, 0x6c, 
+	0x73, 0x20, 0x28, 0x73, 0x65, 0x65, 0x20, 0x75, 0x70, 0x64, 0x61, 
+	0x74, 0x65, 0x5f, 0x76, 0x69, 0x73, 0x69, 0x62, 0x6c, 0x65, 0x5f, 
+	0x74, 0x69, 0x6c, 0x65, 0x5f, 0x68, 0x69, 0x73, 0x74, 0x6f, 0x67, 
+	0x72, 0x61, 0x6d, 0x28, 0x29, 0x29, 0x2e, 0x20, 0x4f, 0x6e, 0x65, 
+	0x20, 0x77, 0x6f, 0x72, 0x6b, 0x20, 0x67, 0x72, 0x6f, 0x75, 0x70, 
+	0x0d, 0x0a, 0x2f, 0x2f, 0x20, 0x70, 0x65, 0x72, 0x20, 0x74, 0x69, 
+	0x6c, 0x65, 0x3a, 0x20, 0x65, 0x61, 0x63, 0x68, 0x20, 0x69, 0x6e, 
+	0x76, 0x6f, 0x63, 0x61, 0x74, 0x69, 0x6f, 0x6e, 0x20, 0x74, 0x61, 
+	0x6b, 0x65, 0x73, 0x20, 0x32, 0x78, 0x32, 0x20, 0x6f, 0x66, 0x20, 
+	0x61, 0x20, 0x67, 0x72, 0x69, 0x64, 0x20, 0x6f, 0x66, 0x20, 0x33, 
+	0x32, 0x78, 0x33, 0x32, 0x20, 0x73, 0x61, 0x6d, 0x70, 0x6c, 0x65, 
+	0x73, 0x2c, 0x20, 0x73, 0x70, 0x72, 0x65, 0x61, 0x64, 0x20, 0x6f, 
+	0x76, 0x65, 0x72, 0x20, 0x74, 0x68, 0x65, 0x20, 0x76, 0x69, 0x73, 
+	0x69, 0x62, 0x6c, 0x65, 0x20, 0x70, 0x61, 0x72, 0x74, 0x20, 0x6f, 
+	0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x74, 0x69, 0x6c, 0x65, 0x2c, 
+	0x20, 0x66, 0x72, 0x6f, 0x6d, 0x20, 0x74, 0x68, 0x65, 0x0d, 0x0a, 
+	0x2f, 0x2f, 0x20, 0x73, 0x6d, 0x61, 0x6c, 0x6c, 0x65, 0x72, 0x20, 
+	0x6d, 0x69, 0x70, 0x20, 0x6c, 0x65, 0x76, 0x65, 0x6c, 0x2e, 0x20, 
+	0x54, 0x68, 0x65, 0x20, 0x73, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x73, 
+	0x20, 0x61, 0x72, 0x65, 0x20, 0x63, 0x6f, 0x75, 0x6e, 0x74, 0x65, 
+	0x64, 0x20, 0x69, 0x6e, 0x20, 0x73, 0x68, 0x61, 0x72, 0x65, 0x64, 
+	0x20, 0x6d, 0x65, 0x6d, 0x6f, 0x72, 0x79, 0x20, 0x66, 0x69, 0x72, 
+	0x73, 0x74, 0x2c, 0x20, 0x73, 0x6f, 0x20, 0x74, 0x68, 0x61, 0x74, 
+	0x20, 0x6f, 0x6e, 0x6c, 0x79, 0x20, 0x6f, 0x6e, 0x65, 0x20, 0x61, 
+	0x74, 0x6f, 0x6d, 0x69, 0x63, 0x20, 0x61, 0x64, 0x64, 0x20, 0x70, 
+	0x65, 0x72, 0x20, 0x62, 0x69, 0x6e, 0x20, 0x67, 0x6f, 0x65, 0x73, 
+	0x20, 0x6f, 0x75, 0x74, 0x20, 0x74, 0x6f, 0x0d, 0x0a, 0x2f, 0x2f, 
+	0x20, 0x74, 0x68, 0x65, 0x20, 0x68, 0x69, 0x73, 0x74, 0x6f, 0x67, 
+	0x72, 0x61, 0x6d, 0x20, 0x62, 0x75, 0x66, 0x66, 0x65, 0x72, 0x2e, 
+	0x0d, 0x0a, 0x0d, 0x0a, 0x6c, 0x61, 0x79, 0x6f, 0x75, 0x74, 0x28, 
+	0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x5f, 0x73, 0x69, 0x7a, 0x65, 0x5f, 
+	0x78, 0x20, 0x3d, 0x20, 0x31, 0x36, 0x2c, 0x20, 0x6c, 0x6f, 0x63, 
+	0x61, 0x6c, 0x5f, 0x73, 0x69, 0x7a, 0x65, 0x5f, 0x79, 0x20, 0x3d, 
+	0x20, 0x31, 0x36, 0x29, 0x20, 0x69, 0x6e, 0x3b, 0x0d, 0x0a, 0x0d, 
+	0x0a, 0x73, 0x74, 0x72, 0x75, 0x63, 0x74, 0x20, 0x68, 0x69, 0x73, 
+	0x74, 0x6f, 0x67, 0x72, 0x61, 0x6d, 0x5f, 0x74, 0x69, 0x6c, 0x65, 
+	0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 
+	0x34, 0x20, 0x74, 0x65, 0x78, 0x5f, 0x72, 0x65, 0x63, 0x74, 0x3b, 
+	0x20, 0x2f, 0x2f, 0x20, 0x74, 0x68, 0x65, 0x20, 0x70, 0x61, 0x72, 
+	0x74, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20, 0x6c, 0x61, 
+	0x79, 0x65, 0x72, 0x20, 0x74, 0x6f, 0x20, 0x63, 0x6f, 0x75, 0x6e, 
+	0x74, 0x20, 0x28, 0x61, 0x73, 0x20, 0x69, 0x6e, 0x20, 0x74, 0x69, 
+	0x6c, 0x65, 0x2e, 0x76, 0x65, 0x72, 0x74, 0x29, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x34, 0x20, 0x6c, 0x61, 0x79, 
+	0x65, 0x72, 0x3b, 0x20, 0x2f, 0x2f, 0x20, 0x78, 0x3a, 0x20, 0x74, 
+	0x68, 0x65, 0x20, 0x6c, 0x61, 0x79, 0x65, 0x72, 0x20, 0x69, 0x6e, 
+	0x20, 0x74, 0x68, 0x65, 0x20, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 
+	0x65, 0x20, 0x61, 0x72, 0x72, 0x61, 0x79, 0x0d, 0x0a, 0x7d, 0x3b, 
+	0x0d, 0x0a, 0x0d, 0x0a, 0x6c, 0x61, 0x79, 0x6f, 0x75, 0x74, 0x28, 
+	0x73, 0x74, 0x64, 0x34, 0x33, 0x30, 0x2c, 0x20, 0x62, 0x69, 0x6e, 
+	0x64, 0x69, 0x6e, 0x67, 0x20, 0x3d, 0x20, 0x30, 0x29, 0x20, 0x72, 
+	0x65, 0x61, 0x64, 0x6f, 0x6e, 0x6c, 0x79, 0x20, 0x62, 0x75, 0x66, 
+	0x66, 0x65, 0x72, 0x20, 0x74, 0x69, 0x6c, 0x65, 0x5f, 0x62, 0x75, 
+	0x66, 0x66, 0x65, 0x72, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x68, 0x69, 0x73, 0x74, 0x6f, 0x67, 0x72, 0x61, 0x6d, 0x5f, 
+	0x74, 0x69, 0x6c, 0x65, 0x20, 0x74, 0x69, 0x6c, 0x65, 0x73, 0x5b, 
+	0x5d, 0x3b, 0x0d, 0x0a, 0x7d, 0x3b, 0x0d, 0x0a, 0x0d, 0x0a, 0x6c, 
+	0x61, 0x79, 0x6f, 0x75, 0x74, 0x28, 0x73, 0x74, 0x64, 0x34, 0x33, 
+	0x30, 0x2c, 0x20, 0x62, 0x69, 0x6e, 0x64, 0x69, 0x6e, 0x67, 0x20, 
+	0x3d, 0x20, 0x31, 0x29, 0x20, 0x62, 0x75, 0x66, 0x66, 0x65, 0x72, 
+	0x20, 0x68, 0x69, 0x73, 0x74, 0x6f, 0x67, 0x72, 0x61, 0x6d, 0x5f, 
+	0x62, 0x75, 0x66, 0x66, 0x65, 0x72, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x75, 0x69, 0x6e, 0x74, 0x20, 0x62, 0x69, 0x6e, 
+	0x73, 0x5b, 0x32, 0x35, 0x36, 0x5d, 0x3b, 0x0d, 0x0a, 0x7d, 0x3b, 
+	0x0d, 0x0a, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 0x66, 0x6f, 0x72, 0x6d, 
+	0x20, 0x73, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x72, 0x32, 0x44, 0x41, 
+	0x72, 0x72, 0x61, 0x79, 0x20, 0x74, 0x68, 0x65, 0x5f, 0x74, 0x65, 
+	0x78, 0x74, 0x75, 0x72, 0x65, 0x3b, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 
+	0x66, 0x6f, 0x72, 0x6d, 0x20, 0x62, 0x6f, 0x6f, 0x6c, 0x20, 0x69, 
+	0x73, 0x5f, 0x70, 0x6c, 0x61, 0x6e, 0x61, 0x72, 0x3b, 0x20, 0x2f, 
+	0x2f, 0x20, 0x73, 0x65, 0x65, 0x20, 0x54, 0x49, 0x4c, 0x45, 0x5f, 
+	0x54, 0x45, 0x58, 0x54, 0x55, 0x52, 0x45, 0x5f, 0x46, 0x4f, 0x52, 
+	0x4d, 0x41, 0x54, 0x5f, 0x59, 0x43, 0x42, 0x43, 0x52, 0x34, 0x32, 
+	0x30, 0x20, 0x61, 0x6e, 0x64, 0x20, 0x73, 0x61, 0x6d, 0x70, 0x6c, 
+	0x65, 0x5f, 0x70, 0x6c, 0x61, 0x6e, 0x61, 0x72, 0x5f, 0x74, 0x69, 
+	0x6c, 0x65, 0x28, 0x29, 0x20, 0x69, 0x6e, 0x20, 0x74, 0x69, 0x6c, 
+	0x65, 0x2e, 0x66, 0x72, 0x61, 0x67, 0x0d, 0x0a, 0x75, 0x6e, 0x69, 
+	0x66, 0x6f, 0x72, 0x6d, 0x20, 0x69, 0x6e, 0x74, 0x20, 0x66, 0x69, 
+	0x72, 0x73, 0x74, 0x5f, 0x74, 0x69, 0x6c, 0x65, 0x3b, 0x0d, 0x0a, 
+	0x0d, 0x0a, 0x73, 0x68, 0x61, 0x72, 0x65, 0x64, 0x20, 0x75, 0x69, 
+	0x6e, 0x74, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x5f, 0x62, 0x69, 
+	0x6e, 0x73, 0x5b, 0x32, 0x35, 0x36, 0x5d, 0x3b, 0x0d, 0x0a, 0x0d, 
+	0x0a, 0x2f, 0x2f, 0x20, 0x52, 0x65, 0x63, 0x2e, 0x20, 0x36, 0x30, 
+	0x31, 0x20, 0x6c, 0x75, 0x6d, 0x61, 0x2c, 0x20, 0x77, 0x68, 0x69, 
+	0x63, 0x68, 0x20, 0x69, 0x73, 0x20, 0x61, 0x6c, 0x73, 0x6f, 0x20, 
+	0x77, 0x68, 0x61, 0x74, 0x20, 0x74, 0x68, 0x65, 0x20, 0x59, 0x20, 
+	0x70, 0x6c, 0x61, 0x6e, 0x65, 0x20, 0x6f, 0x66, 0x20, 0x61, 0x20, 
+	0x70, 0x6c, 0x61, 0x6e, 0x61, 0x72, 0x20, 0x74, 0x69, 0x6c, 0x65, 
+	0x20, 0x68, 0x6f, 0x6c, 0x64, 0x73, 0x0d, 0x0a, 0x66, 0x6c, 0x6f, 
+	0x61, 0x74, 0x20, 0x73, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x5f, 0x6c, 
+	0x75, 0x6d, 0x69, 0x6e, 0x61, 0x6e, 0x63, 0x65, 0x28, 0x76, 0x65, 
+	0x63, 0x32, 0x20, 0x75, 0x76, 0x2c, 0x20, 0x66, 0x6c, 0x6f, 0x61, 
+	0x74, 0x20, 0x6c, 0x61, 0x79, 0x65, 0x72, 0x29, 0x20, 0x7b, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x28, 0x69, 0x73, 
+	0x5f, 0x70, 0x6c, 0x61, 0x6e, 0x61, 0x72, 0x29, 0x20, 0x7b, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 
+	0x74, 0x75, 0x72, 0x6e, 0x20, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 
+	0x65, 0x4c, 0x6f, 0x64, 0x28, 0x74, 0x68, 0x65, 0x5f, 0x74, 0x65, 
+	0x78, 0x74, 0x75, 0x72, 0x65, 0x2c, 0x20, 0x76, 0x65, 0x63, 0x33, 
+	0x28, 0x75, 0x76, 0x2e, 0x78, 0x2c, 0x20, 0x75, 0x76, 0x2e, 0x79, 
+	0x20, 0x2a, 0x20, 0x28, 0x32, 0x2e, 0x30, 0x66, 0x20, 0x2f, 0x20, 
+	0x33, 0x2e, 0x30, 0x66, 0x29, 0x2c, 0x20, 0x6c, 0x61, 0x79, 0x65, 
+	0x72, 0x29, 0x2c, 0x20, 0x31, 0x2e, 0x30, 0x66, 0x29, 0x2e, 0x72, 
+	0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x7d, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x33, 0x20, 0x72, 0x67, 0x62, 
+	0x20, 0x3d, 0x20, 0x74, 0x65, 0x78, 0x74, 0x75, 0x72, 0x65, 0x4c, 
+	0x6f, 0x64, 0x28, 0x74, 0x68, 0x65, 0x5f, 0x74, 0x65, 0x78, 0x74, 
+	0x75, 0x72, 0x65, 0x2c, 0x20, 0x76, 0x65, 0x63, 0x33, 0x28, 0x75, 
+	0x76, 0x2c, 0x20, 0x6c, 0x61, 0x79, 0x65, 0x72, 0x29, 0x2c, 0x20, 
+	0x31, 0x2e, 0x30, 0x66, 0x29, 0x2e, 0x72, 0x67, 0x62, 0x3b, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x72, 0x65, 0x74, 0x75, 0x72, 0x6e, 
+	0x20, 0x64, 0x6f, 0x74, 0x28, 0x72, 0x67, 0x62, 0x2c, 0x20, 0x76, 
+	0x65, 0x63, 0x33, 0x28, 0x30, 0x2e, 0x32, 0x39, 0x39, 0x66, 0x2c, 
+	0x20, 0x30, 0x2e, 0x35, 0x38, 0x37, 0x66, 0x2c, 0x20, 0x30, 0x2e, 
+	0x31, 0x31, 0x34, 0x66, 0x29, 0x29, 0x3b, 0x0d, 0x0a, 0x7d, 0x0d, 
+	0x0a, 0x0d, 0x0a, 0x76, 0x6f, 0x69, 0x64, 0x20, 0x6d, 0x61, 0x69, 
+	0x6e, 0x28, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 
+	0x75, 0x69, 0x6e, 0x74, 0x20, 0x74, 0x20, 0x3d, 0x20, 0x67, 0x6c, 
+	0x5f, 0x4c, 0x6f, 0x63, 0x61, 0x6c, 0x49, 0x6e, 0x76, 0x6f, 0x63, 
+	0x61, 0x74, 0x69, 0x6f, 0x6e, 0x49, 0x6e, 0x64, 0x65, 0x78, 0x3b, 
+	0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 
+	0x5f, 0x62, 0x69, 0x6e, 0x73, 0x5b, 0x74, 0x5d, 0x20, 0x3d, 0x20, 
+	0x30, 0x75, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x62, 0x61, 
+	0x72, 0x72, 0x69, 0x65, 0x72, 0x28, 0x29, 0x3b, 0x0d, 0x0a, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x68, 0x69, 0x73, 0x74, 0x6f, 0x67, 
+	0x72, 0x61, 0x6d, 0x5f, 0x74, 0x69, 0x6c, 0x65, 0x20, 0x74, 0x69, 
+	0x6c, 0x65, 0x20, 0x3d, 0x20, 0x74, 0x69, 0x6c, 0x65, 0x73, 0x5b, 
+	0x66, 0x69, 0x72, 0x73, 0x74, 0x5f, 0x74, 0x69, 0x6c, 0x65, 0x20, 
+	0x2b, 0x20, 0x69, 0x6e, 0x74, 0x28, 0x67, 0x6c, 0x5f, 0x57, 0x6f, 
+	0x72, 0x6b, 0x47, 0x72, 0x6f, 0x75, 0x70, 0x49, 0x44, 0x2e, 0x78, 
+	0x29, 0x5d, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6f, 
+	0x72, 0x20, 0x28, 0x69, 0x6e, 0x74, 0x20, 0x73, 0x79, 0x20, 0x3d, 
+	0x20, 0x30, 0x3b, 0x20, 0x73, 0x79, 0x20, 0x3c, 0x20, 0x32, 0x3b, 
+	0x20, 0x2b, 0x2b, 0x73, 0x79, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x66, 0x6f, 0x72, 0x20, 
+	0x28, 0x69, 0x6e, 0x74, 0x20, 0x73, 0x78, 0x20, 0x3d, 0x20, 0x30, 
+	0x3b, 0x20, 0x73, 0x78, 0x20, 0x3c, 0x20, 0x32, 0x3b, 0x20, 0x2b, 
+	0x2b, 0x73, 0x78, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x76, 0x65, 
+	0x63, 0x32, 0x20, 0x63, 0x65, 0x6c, 0x6c, 0x20, 0x3d, 0x20, 0x28, 
+	0x76, 0x65, 0x63, 0x32, 0x28, 0x67, 0x6c, 0x5f, 0x4c, 0x6f, 0x63, 
+	0x61, 0x6c, 0x49, 0x6e, 0x76, 0x6f, 0x63, 0x61, 0x74, 0x69, 0x6f, 
+	0x6e, 0x49, 0x44, 0x2e, 0x78, 0x79, 0x29, 0x20, 0x2a, 0x20, 0x32, 
+	0x2e, 0x30, 0x66, 0x20, 0x2b, 0x20, 0x76, 0x65, 0x63, 0x32, 0x28, 
+	0x73, 0x78, 0x2c, 0x20, 0x73, 0x79, 0x29, 0x20, 0x2b, 0x20, 0x30, 
+	0x2e, 0x35, 0x66, 0x29, 0x20, 0x2a, 0x20, 0x28, 0x31, 0x2e, 0x30, 
+	0x66, 0x20, 0x2f, 0x20, 0x33, 0x32, 0x2e, 0x30, 0x66, 0x29, 0x3b, 
+	0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x76, 0x65, 0x63, 0x32, 0x20, 0x75, 0x76, 0x20, 
+	0x3d, 0x20, 0x74, 0x69, 0x6c, 0x65, 0x2e, 0x74, 0x65, 0x78, 0x5f, 
+	0x72, 0x65, 0x63, 0x74, 0x2e, 0x78, 0x79, 0x20, 0x2b, 0x20, 0x63, 
+	0x65, 0x6c, 0x6c, 0x20, 0x2a, 0x20, 0x74, 0x69, 0x6c, 0x65, 0x2e, 
+	0x74, 0x65, 0x78, 0x5f, 0x72, 0x65, 0x63, 0x74, 0x2e, 0x7a, 0x77, 
+	0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x66, 0x6c, 0x6f, 0x61, 0x74, 0x20, 0x6c, 
+	0x75, 0x6d, 0x69, 0x6e, 0x61, 0x6e, 0x63, 0x65, 0x20, 0x3d, 0x20, 
+	0x63, 0x6c, 0x61, 0x6d, 0x70, 0x28, 0x73, 0x61, 0x6d, 0x70, 0x6c, 
+	0x65, 0x5f, 0x6c, 0x75, 0x6d, 0x69, 0x6e, 0x61, 0x6e, 0x63, 0x65, 
+	0x28, 0x75, 0x76, 0x2c, 0x20, 0x74, 0x69, 0x6c, 0x65, 0x2e, 0x6c, 
+	0x61, 0x79, 0x65, 0x72, 0x2e, 0x78, 0x29, 0x2c, 0x20, 0x30, 0x2e, 
+	0x30, 0x66, 0x2c, 0x20, 0x31, 0x2e, 0x30, 0x66, 0x29, 0x3b, 0x0d, 
+	0x0a, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x61, 0x74, 0x6f, 0x6d, 0x69, 0x63, 0x41, 0x64, 0x64, 
+	0x28, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x5f, 0x62, 0x69, 0x6e, 0x73, 
+	0x5b, 0x75, 0x69, 0x6e, 0x74, 0x28, 0x6c, 0x75, 0x6d, 0x69, 0x6e, 
+	0x61, 0x6e, 0x63, 0x65, 0x20, 0x2a, 0x20, 0x32, 0x35, 0x35, 0x2e, 
+	0x30, 0x66, 0x20, 0x2b, 0x20, 0x30, 0x2e, 0x35, 0x66, 0x29, 0x5d, 
+	0x2c, 0x20, 0x31, 0x75, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x7d, 0x0d, 0x0a, 0x20, 0x20, 0x20, 
+	0x20, 0x7d, 0x0d, 0x0a, 0x20, 0x20, 0x20, 0x20, 0x62, 0x61, 0x72, 
+	0x72, 0x69, 0x65, 0x72, 0x28, 0x29, 0x3b, 0x0d, 0x0a, 0x0d, 0x0a, 
+	0x20, 0x20, 0x20, 0x20, 0x69, 0x66, 0x20, 0x28, 0x6c, 0x6f, 0x63, 
+	0x61, 0x6c, 0x5f, 0x62, 0x69, 0x6e, 0x73, 0x5b, 0x74, 0x5d, 0x20, 
+	0x21, 0x3d, 0x20, 0x30, 0x75, 0x29, 0x20, 0x7b, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x61, 0x74, 0x6f, 0x6d, 
+	0x69, 0x63, 0x41, 0x64, 0x64, 0x28, 0x62, 0x69, 0x6e, 0x73, 0x5b, 
+	0x74, 0x5d, 0x2c, 0x20, 0x6c, 0x6f, 0x63, 0x61, 0x6c, 0x5f, 0x62, 
+	0x69, 0x6e, 0x73, 0x5b, 0x74, 0x5d, 0x29, 0x3b, 0x0d, 0x0a, 0x20, 
+	0x20, 0x20, 0x20, 0x7d, 0x0d, 0x0a, 0x7d, 0x0d, 0x0a, 0
 };
 
-const char* stringified_shader_sources[2] = {
+const char* stringified_shader_sources[8] = {
 	stringified_shader_source__basic_vert,
 	stringified_shader_source__basic_frag,
+	stringified_shader_source__tile_vert,
+	stringified_shader_source__tile_frag,
+	stringified_shader_source__annotation_vert,
+	stringified_shader_source__annotation_frag,
+	stringified_shader_source__jpeg_decode_comp,
+	stringified_shader_source__tile_histogram_comp,
 };
 
-const char* stringified_shader_source_names[2] = {
+const char* stringified_shader_source_names[8] = {
 	"basic_vert",
 	"basic_frag",
+	"tile_vert",
+	"tile_frag",
+	"annotation_vert",
+	"annotation_frag",
+	"jpeg_decode_comp",
+	"tile_histogram_comp",
 };
 
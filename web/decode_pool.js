@@ -0,0 +1,117 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Loads tiles of a TIFF slide on a web server: the tiles are fetched with HTTP range requests, and decoded to RGBA
+// pixels (ready for texImage2D / texSubImage3D in WebGL2) by a pool of Web Workers (see decode_worker.js).
+// Like the desktop viewer, tiles that are (nearly) next to each other in the file are fetched with one request.
+// The tile offsets and sizes, and the JPEG tables of the level, come from the header of the TIFF file.
+
+const RANGE_MERGE_GAP = 64 * 1024; // tiles this close together are fetched in one range, the gap is thrown away
+const RANGE_MAX_SIZE = 4 * 1024 * 1024;
+
+export class TileDecodePool {
+	constructor(workerCount = navigator.hardwareConcurrency || 4, workerUrl = "decode_worker.js") {
+		this.workers = [];
+		this.pending = new Map(); // id -> { resolve, reject, worker }
+		this.nextId = 1;
+		for (let i = 0; i < workerCount; ++i) {
+			const worker = new Worker(workerUrl);
+			worker.inFlight = 0;
+			worker.onmessage = (event) => this.onDecoded(worker, event.data);
+			this.workers.push(worker);
+		}
+	}
+
+	onDecoded(worker, result) {
+		--worker.inFlight;
+		const request = this.pending.get(result.id);
+		this.pending.delete(result.id);
+		if (result.ok) {
+			request.resolve(result.pixels);
+		} else {
+			request.reject(new Error("could not decode tile"));
+		}
+	}
+
+	// Resolves to the RGBA pixels (width * height * 4 bytes). The data is handed over to the worker, not copied.
+	decode(data, tables, width, height, isYCbCr) {
+		let worker = this.workers[0];
+		for (const candidate of this.workers) {
+			if (candidate.inFlight < worker.inFlight) worker = candidate;
+		}
+		++worker.inFlight;
+		const id = this.nextId++;
+		return new Promise((resolve, reject) => {
+			this.pending.set(id, { resolve, reject });
+			worker.postMessage({ id, data, tables, width, height, isYCbCr }, [data.buffer]);
+		});
+	}
+
+	async fetchRange(url, offset, size) {
+		const response = await fetch(url, { headers: { Range: `bytes=${offset}-${offset + size - 1}` } });
+		if (response.status !== 206) {
+			throw new Error(`${url}: the server does not support range requests (status ${response.status})`);
+		}
+		return new Uint8Array(await response.arrayBuffer());
+	}
+
+	// tiles: [{ offset, size }], level: { tables, tileWidth, tileHeight, isYCbCr }. Resolves to the pixels of each
+	// tile, in the same order (null for tiles that could not be loaded).
+	async loadTiles(url, tiles, level) {
+		const order = tiles.map((tile, index) => index).sort((a, b) => tiles[a].offset - tiles[b].offset);
+		const ranges = [];
+		for (const index of order) {
+			const tile = tiles[index];
+			const last = ranges[ranges.length - 1];
+			if (last && tile.offset >= last.end && tile.offset - last.end <= RANGE_MERGE_GAP &&
+			    tile.offset + tile.size - last.offset <= RANGE_MAX_SIZE) {
+				last.end = tile.offset + tile.size;
+				last.tiles.push(index);
+			} else {
+				ranges.push({ offset: tile.offset, end: tile.offset + tile.size, tiles: [index] });
+			}
+		}
+		const results = new Array(tiles.length).fill(null);
+		await Promise.all(ranges.map(async (range) => {
+			let bytes;
+			try {
+				bytes = await this.fetchRange(url, range.offset, range.end - range.offset);
+			} catch (error) {
+				console.warn(error);
+				return;
+			}
+			await Promise.all(range.tiles.map(async (index) => {
+				const tile = tiles[index];
+				const start = tile.offset - range.offset;
+				const data = bytes.slice(start, start + tile.size); // (a buffer of its own, to hand over to the worker)
+				try {
+					results[index] = await this.decode(data, level.tables, level.tileWidth, level.tileHeight,
+					                                   level.isYCbCr);
+				} catch (error) {
+					console.warn(error);
+				}
+			}));
+		}));
+		return results;
+	}
+
+	terminate() {
+		for (const worker of this.workers) worker.terminate();
+		this.workers = [];
+	}
+}
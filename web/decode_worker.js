@@ -0,0 +1,63 @@
+/*
+  Slideviewer, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2020  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Decodes tiles with the WebAssembly build of the tile decoder (see src/web_decode.c), one worker of the pool in
+// decode_pool.js. The buffers in the memory of the module are kept, and only grown when a larger tile comes along.
+
+importScripts("slideviewer_decode.js");
+
+let decoder = null;
+const ready = createDecoderModule().then((module) => {
+	decoder = module;
+	decoder._web_decode_init();
+});
+
+const buffers = {};
+
+function reserveBuffer(name, size) {
+	let buffer = buffers[name];
+	if (!buffer || buffer.capacity < size) {
+		if (buffer) decoder._destroy_buffer(buffer.pointer);
+		buffer = { pointer: decoder._create_buffer(size), capacity: size };
+		buffers[name] = buffer;
+	}
+	return buffer.pointer;
+}
+
+self.onmessage = async (event) => {
+	await ready;
+	const { id, data, tables, width, height, isYCbCr } = event.data;
+	const dataPointer = reserveBuffer("data", data.byteLength);
+	decoder.HEAPU8.set(data, dataPointer);
+	let tablesPointer = 0;
+	if (tables && tables.byteLength > 0) {
+		tablesPointer = reserveBuffer("tables", tables.byteLength);
+		decoder.HEAPU8.set(tables, tablesPointer);
+	}
+	const outputSize = width * height * 4;
+	const outputPointer = reserveBuffer("output", outputSize);
+	const ok = decoder._web_decode_tile(tablesPointer, tables ? tables.byteLength : 0, dataPointer, data.byteLength,
+	                                    outputPointer, width, height, isYCbCr ? 1 : 0) !== 0;
+	if (ok) {
+		// (copied out of the memory of the module, so that it can be handed over without another copy)
+		const pixels = decoder.HEAPU8.slice(outputPointer, outputPointer + outputSize);
+		self.postMessage({ id, ok, pixels }, [pixels.buffer]);
+	} else {
+		self.postMessage({ id, ok });
+	}
+};